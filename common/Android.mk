@@ -32,8 +32,11 @@ LOCAL_MODULE := trustme.cml.libcommon
 LOCAL_MODULE_TAGS := optional
 LOCAL_SRC_FILES := \
 	event.c \
+	event_aio.c \
 	list.c \
+	hashmap.c \
 	logf.c \
+	logf_async.c \
 	mem.c \
 	str.c \
 	nl.c
@@ -91,6 +94,7 @@ LOCAL_SRC_FILES := \
 	logf.c \
 	mem.c \
 	list.c \
+	hashmap.c \
 	event.c \
 	event.test.c
 
@@ -0,0 +1,399 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file common.bench.c
+ *
+ * Micro-benchmarks of the primitives in common/. Each benchmark is run a few
+ * times and the fastest run is reported, results are written to stdout as JSON:
+ *
+ *   common.bench [-r <runs>] [<name filter>]
+ */
+
+#include "event.h"
+#include "file.h"
+#include "list.h"
+#include "logf.h"
+#include "logf.pb-c.h"
+#include "macro.h"
+#include "mem.h"
+#include "nl.h"
+#include "protobuf.h"
+#include "ssl_util.h"
+#include "str.h"
+#include "uuid.h"
+
+#include <linux/if_link.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_RUNS_DEFAULT 3
+#define BENCH_FILE_SIZE (4 * 1024 * 1024)
+#define BENCH_LIST_LEN 1024
+
+static char bench_file_in[] = "/tmp/common.bench.in.XXXXXX";
+static char bench_file_out[] = "/tmp/common.bench.out.XXXXXX";
+
+static struct timespec bench_started;
+static uint64_t bench_elapsed_ns;
+
+static void
+bench_start(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &bench_started);
+}
+
+static void
+bench_stop(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	bench_elapsed_ns = (now.tv_sec - bench_started.tv_sec) * 1000000000ULL + now.tv_nsec -
+			   bench_started.tv_nsec;
+}
+
+/******************************************************************************/
+
+static void
+bench_timer_cb(event_timer_t *timer, void *data)
+{
+	size_t *fired = data;
+
+	(*fired)++;
+	event_remove_timer(timer);
+	event_timer_free(timer);
+}
+
+static void
+bench_event_timer(size_t n)
+{
+	size_t fired = 0;
+
+	bench_start();
+	for (size_t i = 0; i < n; i++)
+		event_add_timer(event_timer_new(0, 1, &bench_timer_cb, &fired));
+	event_loop();
+	bench_stop();
+
+	ASSERT(fired == n);
+}
+
+typedef struct bench_io {
+	int fds[2];
+	size_t remaining;
+} bench_io_t;
+
+static void
+bench_io_cb(int fd, UNUSED unsigned events, event_io_t *io, void *data)
+{
+	bench_io_t *bench = data;
+	char c;
+
+	if (read(fd, &c, 1) != 1 || --bench->remaining == 0 || write(bench->fds[1], &c, 1) != 1) {
+		event_remove_io(io);
+		event_io_free(io);
+	}
+}
+
+static void
+bench_event_io(size_t n)
+{
+	bench_io_t bench = { .remaining = n };
+
+	IF_TRUE_RETURN(pipe(bench.fds) < 0);
+
+	event_add_io(event_io_new(bench.fds[0], EVENT_IO_READ, &bench_io_cb, &bench));
+	bench_start();
+	if (write(bench.fds[1], "x", 1) == 1)
+		event_loop();
+	bench_stop();
+
+	close(bench.fds[0]);
+	close(bench.fds[1]);
+}
+
+static void
+bench_signal_cb(UNUSED int signum, event_signal_t *sig, void *data)
+{
+	size_t *remaining = data;
+
+	if (--(*remaining) == 0) {
+		event_remove_signal(sig);
+		event_signal_free(sig);
+		return;
+	}
+	raise(SIGUSR1);
+}
+
+static void
+bench_event_signal(size_t n)
+{
+	size_t remaining = n;
+
+	event_add_signal(event_signal_new(SIGUSR1, &bench_signal_cb, &remaining));
+	bench_start();
+	raise(SIGUSR1);
+	event_loop();
+	bench_stop();
+}
+
+static void
+bench_list_append(size_t n)
+{
+	bench_start();
+	for (size_t i = 0; i < n; i += BENCH_LIST_LEN) {
+		list_queue_t queue = { NULL, NULL };
+		for (size_t j = 0; j < BENCH_LIST_LEN; j++)
+			list_queue_append(&queue, (void *)(intptr_t)j);
+		list_queue_delete(&queue);
+	}
+	bench_stop();
+}
+
+static void
+bench_list_prepend_remove(size_t n)
+{
+	bench_start();
+	for (size_t i = 0; i < n; i += BENCH_LIST_LEN) {
+		list_t *list = NULL;
+		for (size_t j = 0; j < BENCH_LIST_LEN; j++)
+			list = list_prepend(list, (void *)(intptr_t)j);
+		// removes from the head, i.e., in insertion order of prepend
+		for (size_t j = BENCH_LIST_LEN; j > 0; j--)
+			list = list_remove(list, (void *)(intptr_t)(j - 1));
+	}
+	bench_stop();
+}
+
+static void
+bench_protobuf_roundtrip(size_t n)
+{
+	int sv[2];
+	IF_TRUE_RETURN(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0);
+
+	LogMessage msg = LOG_MESSAGE__INIT;
+	msg.prio = LOG_PRIORITY__INFO;
+	msg.msg = "benchmark message of a typical log line length, with some payload";
+	msg.has_timestamp = true;
+	msg.timestamp = 1234567890;
+	msg.file = "common.bench.c";
+	msg.has_line = true;
+	msg.line = __LINE__;
+
+	bench_start();
+	for (size_t i = 0; i < n; i++) {
+		if (protobuf_send_message(sv[0], (ProtobufCMessage *)&msg) < 0)
+			break;
+		ProtobufCMessage *in = protobuf_recv_message(sv[1], &log_message__descriptor);
+		if (!in)
+			break;
+		protobuf_free_message(in);
+	}
+	bench_stop();
+
+	close(sv[0]);
+	close(sv[1]);
+}
+
+static void
+bench_file_copy(size_t n)
+{
+	bench_start();
+	for (size_t i = 0; i < n; i++) {
+		unlink(bench_file_out);
+		if (file_copy(bench_file_in, bench_file_out, -1, 4096, 0) < 0)
+			break;
+	}
+	bench_stop();
+}
+
+static void
+bench_ssl_hash_file(size_t n)
+{
+	unsigned int len;
+
+	bench_start();
+	for (size_t i = 0; i < n; i++) {
+		unsigned char *hash = ssl_hash_file(bench_file_in, &len, "SHA256");
+		if (!hash)
+			break;
+		mem_free0(hash);
+	}
+	bench_stop();
+}
+
+static void
+bench_nl_msg(size_t n)
+{
+	struct ifinfomsg ifi = { .ifi_family = AF_UNSPEC };
+
+	bench_start();
+	for (size_t i = 0; i < n; i++) {
+		nl_msg_t *msg = nl_msg_new();
+		nl_msg_set_type(msg, RTM_NEWLINK);
+		nl_msg_set_flags(msg, NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL | NLM_F_ACK);
+		nl_msg_set_link_req(msg, &ifi);
+		nl_msg_add_string(msg, IFLA_IFNAME, "veth0");
+		struct nlattr *linkinfo = nl_msg_start_nested_attr(msg, IFLA_LINKINFO);
+		nl_msg_add_string(msg, IFLA_INFO_KIND, "veth");
+		struct nlattr *data = nl_msg_start_nested_attr(msg, IFLA_INFO_DATA);
+		nl_msg_end_nested_attr(msg, data);
+		nl_msg_end_nested_attr(msg, linkinfo);
+		nl_msg_free(msg);
+	}
+	bench_stop();
+}
+
+static void
+bench_str_append(size_t n)
+{
+	bench_start();
+	for (size_t i = 0; i < n; i += 64) {
+		str_t *str = str_new(NULL);
+		for (size_t j = 0; j < 64; j++)
+			str_append_printf(str, "key%zu=%zu;", j, i);
+		str_free(str, true);
+	}
+	bench_stop();
+}
+
+static void
+bench_uuid(size_t n)
+{
+	bench_start();
+	for (size_t i = 0; i < n; i++) {
+		uuid_t *uuid = uuid_new("00000000-0000-0000-0000-000000000001");
+		if (!uuid || !uuid_string(uuid))
+			break;
+		uuid_free(uuid);
+	}
+	bench_stop();
+}
+
+/******************************************************************************/
+
+typedef struct bench {
+	const char *name;
+	void (*func)(size_t n);
+	size_t n; // operations per run
+} bench_t;
+
+static const bench_t benches[] = {
+	{ "event/timer_dispatch", bench_event_timer, 100000 },
+	{ "event/io_dispatch", bench_event_io, 100000 },
+	{ "event/signal_dispatch", bench_event_signal, 100000 },
+	{ "list/queue_append", bench_list_append, 1024 * 1024 },
+	{ "list/prepend_remove", bench_list_prepend_remove, 1024 * 1024 },
+	{ "protobuf/frame_roundtrip", bench_protobuf_roundtrip, 100000 },
+	{ "file/copy_4m", bench_file_copy, 50 },
+	{ "ssl/hash_file_sha256_4m", bench_ssl_hash_file, 50 },
+	{ "nl/msg_build", bench_nl_msg, 1000000 },
+	{ "str/append_printf", bench_str_append, 64 * 16384 },
+	{ "uuid/parse_format", bench_uuid, 1000000 },
+};
+
+static int
+bench_setup_files(void)
+{
+	int fd = mkstemp(bench_file_in);
+	IF_TRUE_RETVAL(fd < 0, -1);
+
+	char *buf = mem_alloc(BENCH_FILE_SIZE);
+	for (size_t i = 0; i < BENCH_FILE_SIZE; i++)
+		buf[i] = (char)(i * 31);
+	ssize_t written = write(fd, buf, BENCH_FILE_SIZE);
+	mem_free0(buf);
+	close(fd);
+	IF_TRUE_RETVAL(written != BENCH_FILE_SIZE, -1);
+
+	fd = mkstemp(bench_file_out);
+	IF_TRUE_RETVAL(fd < 0, -1);
+	close(fd);
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int runs = BENCH_RUNS_DEFAULT;
+	const char *filter = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "r:")) != -1) {
+		if (opt == 'r' && atoi(optarg) > 0) {
+			runs = atoi(optarg);
+		} else {
+			fprintf(stderr, "Usage: %s [-r <runs>] [<name filter>]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind < argc)
+		filter = argv[optind];
+
+	event_init();
+	ssl_init(false, NULL);
+
+	if (bench_setup_files() < 0) {
+		fprintf(stderr, "Failed to create benchmark files\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("{\n  \"runs\": %d,\n  \"benchmarks\": [", runs);
+	bool first = true;
+	for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		const bench_t *bench = &benches[i];
+		if (filter && !strstr(bench->name, filter))
+			continue;
+
+		uint64_t best_ns = UINT64_MAX;
+		for (int r = 0; r < runs; r++) {
+			bench->func(bench->n);
+			best_ns = MIN(best_ns, bench_elapsed_ns);
+		}
+
+		double ns_per_op = (double)best_ns / bench->n;
+		printf("%s\n    { \"name\": \"%s\", \"ops\": %zu, \"ns\": %" PRIu64
+		       ", \"ns_per_op\": %.2f, \"ops_per_sec\": %.0f }",
+		       first ? "" : ",", bench->name, bench->n, best_ns, ns_per_op,
+		       ns_per_op > 0 ? 1e9 / ns_per_op : 0);
+		fflush(stdout);
+		first = false;
+	}
+	printf("\n  ]\n}\n");
+
+	unlink(bench_file_in);
+	unlink(bench_file_out);
+	ssl_free();
+
+	return EXIT_SUCCESS;
+}
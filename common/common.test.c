@@ -3,6 +3,23 @@
 extern MunitSuite mem_suite;
 extern MunitSuite macro_suite;
 extern MunitSuite ssl_util_suite;
+extern MunitSuite event_suite;
+extern MunitSuite event_aio_suite;
+extern MunitSuite list_suite;
+extern MunitSuite hashmap_suite;
+extern MunitSuite logf_suite;
+extern MunitSuite shm_ring_suite;
+extern MunitSuite metrics_suite;
+extern MunitSuite str_suite;
+extern MunitSuite dir_suite;
+extern MunitSuite proc_suite;
+extern MunitSuite uuid_suite;
+extern MunitSuite file_suite;
+extern MunitSuite file_writer_suite;
+extern MunitSuite hex_suite;
+extern MunitSuite merkle_suite;
+extern MunitSuite worker_suite;
+extern MunitSuite fanout_suite;
 
 int
 main(int argc, char *argv[MUNIT_ARRAY_PARAM(argc + 1)])
@@ -12,6 +29,23 @@ main(int argc, char *argv[MUNIT_ARRAY_PARAM(argc + 1)])
 	failed += munit_suite_main(&mem_suite, NULL, argc, argv);
 	failed += munit_suite_main(&macro_suite, NULL, argc, argv);
 	failed += munit_suite_main(&ssl_util_suite, NULL, argc, argv);
+	failed += munit_suite_main(&event_suite, NULL, argc, argv);
+	failed += munit_suite_main(&event_aio_suite, NULL, argc, argv);
+	failed += munit_suite_main(&list_suite, NULL, argc, argv);
+	failed += munit_suite_main(&hashmap_suite, NULL, argc, argv);
+	failed += munit_suite_main(&logf_suite, NULL, argc, argv);
+	failed += munit_suite_main(&shm_ring_suite, NULL, argc, argv);
+	failed += munit_suite_main(&metrics_suite, NULL, argc, argv);
+	failed += munit_suite_main(&str_suite, NULL, argc, argv);
+	failed += munit_suite_main(&dir_suite, NULL, argc, argv);
+	failed += munit_suite_main(&proc_suite, NULL, argc, argv);
+	failed += munit_suite_main(&uuid_suite, NULL, argc, argv);
+	failed += munit_suite_main(&file_suite, NULL, argc, argv);
+	failed += munit_suite_main(&file_writer_suite, NULL, argc, argv);
+	failed += munit_suite_main(&hex_suite, NULL, argc, argv);
+	failed += munit_suite_main(&merkle_suite, NULL, argc, argv);
+	failed += munit_suite_main(&worker_suite, NULL, argc, argv);
+	failed += munit_suite_main(&fanout_suite, NULL, argc, argv);
 
 	return failed;
 }
@@ -38,13 +38,25 @@
 #include <string.h>
 #include <sys/mount.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
 #include <linux/kdev_t.h>
+#include <sys/auxv.h>
+#if defined(__aarch64__)
+#include <asm/hwcap.h>
+#endif
 
 #include "cryptfs.h"
 #include "macro.h"
 #include "mem.h"
 #include "proc.h"
 #include "file.h"
+#include "list.h"
+#include "probe.h"
+#include "str.h"
 
 #ifdef ANDROID
 #define DEV_MAPPER "/dev/device-mapper"
@@ -58,11 +70,21 @@
 #define INTEGRITY_TAG_SIZE 32
 #define CRYPTO_TYPE_AUTHENC "capi:authenc(hmac(sha256),xts(aes))-random"
 #define CRYPTO_TYPE "aes-xts-plain64"
+#define CRYPTO_TYPE_ADIANTUM "xchacha12,aes-adiantum-plain64"
+#define INTEGRITY_HASH_BITMAP "hmac(sha256)" // keyed internal hash in bitmap mode
 
 /* taken from vold */
 #define DEVMAPPER_BUFFER_SIZE 4096
 #define DM_CRYPT_BUF_SIZE 4096
 #define DM_INTEGRITY_BUF_SIZE 4096
+#define DM_VERITY_BUF_SIZE 4096
+
+/* time to wait for the kernel's uevents of a batch of freshly resumed devices */
+#define CRYPTFS_BATCH_UEVENT_TIMEOUT_MS 5000
+#define UEVENT_BUF_SIZE 4096
+
+#define VERITY_BLOCK_SIZE 4096
+#define VERITY_HASH_ALGO "sha256"
 
 /* FIXME Rejig library to record & use errno instead */
 #ifndef DM_EXISTS_FLAG
@@ -71,6 +93,8 @@
 
 /******************************************************************************/
 
+static const cryptfs_opts_t cryptfs_opts_default = { .integrity = CRYPTFS_INTEGRITY_JOURNAL };
+
 static unsigned long
 get_provided_data_sectors(const char *real_blk_name);
 
@@ -155,9 +179,58 @@ convert_key_to_hex_ascii(unsigned char *master_key, unsigned int keysize,
 }
 #endif
 
+/*
+ * Returns true if the crypt target on top of the integrity device provides the tags
+ * itself (AEAD), false if dm-integrity computes them by its internal hash.
+ */
+static bool
+cryptfs_opts_aead(const cryptfs_opts_t *opts)
+{
+	return opts->integrity != CRYPTFS_INTEGRITY_BITMAP;
+}
+
+/*
+ * Returns true if the CPU has instructions for AES, which makes aes-xts faster than
+ * adiantum.
+ */
+static bool
+cryptfs_cpu_has_aes(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("aes");
+#elif defined(__aarch64__)
+	return getauxval(AT_HWCAP) & HWCAP_AES;
+#else
+	return false;
+#endif
+}
+
+static const char *
+cryptfs_plain_cipher(const cryptfs_opts_t *opts)
+{
+	switch (opts->cipher) {
+	case CRYPTFS_CIPHER_ADIANTUM:
+		return CRYPTO_TYPE_ADIANTUM;
+	case CRYPTFS_CIPHER_AUTO: {
+		static int has_aes = -1;
+		if (has_aes < 0) {
+			has_aes = cryptfs_cpu_has_aes();
+			INFO("CPU %s AES instructions, using %s for plain dm-crypt volumes",
+			     has_aes ? "has" : "lacks",
+			     has_aes ? CRYPTO_TYPE : CRYPTO_TYPE_ADIANTUM);
+		}
+		return has_aes ? CRYPTO_TYPE : CRYPTO_TYPE_ADIANTUM;
+	}
+	default:
+		return CRYPTO_TYPE;
+	}
+}
+
 static int
 load_integrity_mapping_table(int fd, const char *real_blk_name, const char *meta_blk_name,
-			     const char *name, int fs_size)
+			     const char *name, int fs_size, const char *key,
+			     const cryptfs_opts_t *opts)
 {
 	// General variables
 	int ioctl_ret;
@@ -167,9 +240,30 @@ load_integrity_mapping_table(int fd, const char *real_blk_name, const char *meta
 	struct dm_target_spec *tgt;
 	struct dm_ioctl *mapping_io;
 	char *integrity_params;
-	char *extra_params = mem_printf("1 meta_device:%s", meta_blk_name);
 	int mapping_counter;
 
+	int n_extra = 1;
+	str_t *extra_params = str_new(NULL);
+	str_append_printf(extra_params, "meta_device:%s", meta_blk_name);
+	if (opts->sector_size) {
+		str_append_printf(extra_params, " block_size:%u", opts->sector_size);
+		n_extra++;
+	}
+	if (!cryptfs_opts_aead(opts)) {
+		str_append_printf(extra_params, " internal_hash:%s:%s", INTEGRITY_HASH_BITMAP,
+				  key + strlen(key) - CRYPTFS_FDE_KEY_LEN);
+		n_extra++;
+	}
+	if (opts->allow_discards) {
+		str_append(extra_params, " allow_discards");
+		n_extra++;
+	}
+	char mode = 'J';
+	if (opts->integrity == CRYPTFS_INTEGRITY_BITMAP)
+		mode = 'B';
+	else if (opts->integrity == CRYPTFS_INTEGRITY_DIRECT)
+		mode = 'D';
+
 	mapping_io = (struct dm_ioctl *)mapping_buffer;
 
 	/* Load the mapping table for this device */
@@ -190,9 +284,13 @@ load_integrity_mapping_table(int fd, const char *real_blk_name, const char *meta
 	// these parameters are used in [1] as well as by dmsetup when traced with strace
 	snprintf(integrity_params,
 		 DM_INTEGRITY_BUF_SIZE - sizeof(struct dm_ioctl) - sizeof(struct dm_target_spec),
-		 "%s 0 %d J %s", real_blk_name, INTEGRITY_TAG_SIZE, extra_params);
+		 "%s 0 %d %c %d %s", real_blk_name, INTEGRITY_TAG_SIZE, mode, n_extra,
+		 str_buffer(extra_params));
 
-	mem_free0(extra_params);
+	// the parameters may contain the hmac key
+	char *extra_buf = str_free(extra_params, false);
+	memset(extra_buf, 0, strlen(extra_buf));
+	mem_free0(extra_buf);
 
 	// Set pointer behind parameter
 	integrity_params += strlen(integrity_params) + 1;
@@ -223,16 +321,42 @@ load_integrity_mapping_table(int fd, const char *real_blk_name, const char *meta
 
 static int
 load_crypto_mapping_table(int fd, const char *real_blk_name, const char *master_key_ascii,
-			  const char *name, int fs_size, bool integrity)
+			  const char *name, int fs_size, bool aead, const cryptfs_opts_t *opts)
 {
 	char buffer[DM_CRYPT_BUF_SIZE];
 	struct dm_ioctl *io;
 	struct dm_target_spec *tgt;
 	char *crypt_params;
-	char *extra_params = integrity ? mem_printf("1 integrity:%d:aead", INTEGRITY_TAG_SIZE) :
-					 mem_printf("1 allow_discards");
 
-	const char *crypto_type = integrity ? CRYPTO_TYPE_AUTHENC : CRYPTO_TYPE;
+	int n_extra = 1;
+	str_t *extra_params = str_new(NULL);
+	if (aead) {
+		str_append_printf(extra_params, "integrity:%d:aead", INTEGRITY_TAG_SIZE);
+		if (opts->allow_discards) {
+			str_append(extra_params, " allow_discards");
+			n_extra++;
+		}
+	} else {
+		str_append(extra_params, "allow_discards");
+	}
+	if (opts->sector_size) {
+		str_append_printf(extra_params, " sector_size:%u", opts->sector_size);
+		n_extra++;
+	}
+	if (opts->no_workqueue) {
+		str_append(extra_params, " no_read_workqueue no_write_workqueue");
+		n_extra += 2;
+	}
+	if (opts->same_cpu_crypt) {
+		str_append(extra_params, " same_cpu_crypt");
+		n_extra++;
+	}
+	if (opts->submit_from_crypt_cpus) {
+		str_append(extra_params, " submit_from_crypt_cpus");
+		n_extra++;
+	}
+
+	const char *crypto_type = aead ? CRYPTO_TYPE_AUTHENC : cryptfs_plain_cipher(opts);
 
 	int i;
 	int ioctl_ret;
@@ -255,8 +379,9 @@ load_crypto_mapping_table(int fd, const char *real_blk_name, const char *master_
 	crypt_params = buffer + sizeof(struct dm_ioctl) + sizeof(struct dm_target_spec);
 	snprintf(crypt_params,
 		 DM_CRYPT_BUF_SIZE - sizeof(struct dm_ioctl) - sizeof(struct dm_target_spec),
-		 "%s %s 0 %s 0 %s", crypto_type, master_key_ascii, real_blk_name, extra_params);
-	mem_free0(extra_params);
+		 "%s %s 0 %s 0 %d %s", crypto_type, master_key_ascii, real_blk_name, n_extra,
+		 str_buffer(extra_params));
+	str_free(extra_params, true);
 
 	crypt_params += strlen(crypt_params) + 1;
 	crypt_params =
@@ -306,7 +431,7 @@ load_crypto_mapping_table(int fd, const char *real_blk_name, const char *master_
 // [2] https://wiki.gentoo.org/wiki/Device-mapper#Integrity
 static int
 create_integrity_blk_dev(const char *real_blk_name, const char *meta_blk_name, const char *name,
-			 const unsigned long fs_size)
+			 const unsigned long fs_size, const char *key, const cryptfs_opts_t *opts)
 {
 	int fd;
 	int ioctl_ret;
@@ -343,7 +468,8 @@ create_integrity_blk_dev(const char *real_blk_name, const char *meta_blk_name, c
 	// Load Integrity map table
 	DEBUG("Loading Integrity mapping table");
 
-	load_count = load_integrity_mapping_table(fd, real_blk_name, meta_blk_name, name, fs_size);
+	load_count = load_integrity_mapping_table(fd, real_blk_name, meta_blk_name, name, fs_size,
+						  key, opts);
 	if (load_count < 0) {
 		ERROR("Error while loading mapping table");
 		goto errout;
@@ -373,7 +499,7 @@ errout:
 
 static int
 create_crypto_blk_dev(const char *real_blk_name, const char *master_key, const char *name,
-		      unsigned long fs_size, bool integrity)
+		      unsigned long fs_size, bool aead, const cryptfs_opts_t *opts)
 {
 	char buffer[DM_CRYPT_BUF_SIZE];
 	struct dm_ioctl *io;
@@ -408,8 +534,8 @@ create_crypto_blk_dev(const char *real_blk_name, const char *master_key, const c
 		goto errout;
 	}
 
-	load_count =
-		load_crypto_mapping_table(fd, real_blk_name, master_key, name, fs_size, integrity);
+	load_count = load_crypto_mapping_table(fd, real_blk_name, master_key, name, fs_size, aead,
+					       opts);
 	if (load_count < 0) {
 		ERROR("Cannot load dm-crypt mapping table");
 		goto errout;
@@ -556,9 +682,61 @@ errout:
 	return provided_data_sectors;
 }
 
+/*
+ * Writes zeros to the whole crypto device, which generates the initial MACs
+ * on the underlying integrity device.
+ */
+static int
+format_crypto_blk_dev(const char *crypto_blkdev, unsigned long fs_size)
+{
+	int fd;
+	if ((fd = open(crypto_blkdev, O_WRONLY | O_DIRECT)) < 0) {
+		ERROR("Cannot open volume %s", crypto_blkdev);
+		return -1;
+	}
+	char zeros[DM_INTEGRITY_BUF_SIZE] __attribute__((__aligned__(512)));
+	memset(zeros, 0, sizeof(zeros));
+	for (unsigned long i = 0; i < fs_size / 8; ++i) {
+		if (write(fd, zeros, DM_INTEGRITY_BUF_SIZE) < DM_INTEGRITY_BUF_SIZE) {
+			ERROR_ERRNO("Could not write empty block %lu to %s", i, crypto_blkdev);
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+/*
+ * Checks that the key is long enough for the mode of the volume.
+ */
+static bool
+cryptfs_key_is_valid(const char *key, bool integrity, const cryptfs_opts_t *opts)
+{
+	size_t min_len = CRYPTFS_FDE_KEY_LEN;
+	if (integrity && !cryptfs_opts_aead(opts))
+		min_len = 2 * CRYPTFS_FDE_KEY_LEN;
+	if (strlen(key) < min_len) {
+		ERROR("Key too short for the integrity mode of the volume");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Returns the key of the crypt target: the whole key for AEAD and the first
+ * CRYPTFS_FDE_KEY_LEN hex digits for plain xts mode.
+ */
+static char *
+cryptfs_crypt_key_new(const char *key, bool aead)
+{
+	return aead ? mem_strdup(key) : mem_strndup(key, CRYPTFS_FDE_KEY_LEN);
+}
+
 static char *
 cryptfs_setup_volume_integrity_new(const char *label, const char *real_blkdev,
-				   const char *meta_blkdev, const char *key, unsigned long fs_size)
+				   const char *meta_blkdev, const char *key, unsigned long fs_size,
+				   const cryptfs_opts_t *opts)
 {
 	bool initial_format = false;
 	char *crypto_blkdev = NULL;
@@ -568,7 +746,8 @@ cryptfs_setup_volume_integrity_new(const char *label, const char *real_blkdev,
 	/* check if meta device is initialized */
 	initial_format = get_provided_data_sectors(meta_blkdev) != fs_size;
 
-	if (create_integrity_blk_dev(real_blkdev, meta_blkdev, integrity_dev_label, fs_size) < 0) {
+	if (create_integrity_blk_dev(real_blkdev, meta_blkdev, integrity_dev_label, fs_size, key,
+				     opts) < 0) {
 		DEBUG("create_integrity_blk_dev failed!");
 		goto error;
 	}
@@ -582,7 +761,12 @@ cryptfs_setup_volume_integrity_new(const char *label, const char *real_blkdev,
 		DEBUG("Successfully created device node");
 	}
 
-	if (create_crypto_blk_dev(integrity_dev, key, label, fs_size, true) < 0) {
+	char *crypt_key = cryptfs_crypt_key_new(key, cryptfs_opts_aead(opts));
+	int ret = create_crypto_blk_dev(integrity_dev, crypt_key, label, fs_size,
+					cryptfs_opts_aead(opts), opts);
+	memset(crypt_key, 0, strlen(crypt_key));
+	mem_free0(crypt_key);
+	if (ret < 0) {
 		ERROR("Could not create crypto block device");
 		return NULL;
 	}
@@ -599,21 +783,8 @@ cryptfs_setup_volume_integrity_new(const char *label, const char *real_blkdev,
 		DEBUG("Formatting crypto blkdev %s. Generating initial MAC on "
 		      "integrity_dev %s",
 		      crypto_blkdev, integrity_dev);
-		int fd;
-		if ((fd = open(crypto_blkdev, O_WRONLY | O_DIRECT)) < 0) {
-			ERROR("Cannot open volume %s", crypto_blkdev);
+		if (format_crypto_blk_dev(crypto_blkdev, fs_size) < 0)
 			goto error;
-		}
-		char zeros[DM_INTEGRITY_BUF_SIZE] __attribute__((__aligned__(512)));
-		for (unsigned long i = 0; i < fs_size / 8; ++i) {
-			if (write(fd, zeros, DM_INTEGRITY_BUF_SIZE) < DM_INTEGRITY_BUF_SIZE) {
-				ERROR_ERRNO("Could not write empty block %lu to %s", i,
-					    crypto_blkdev);
-				close(fd);
-				goto error;
-			}
-		}
-		close(fd);
 	}
 	return crypto_blkdev;
 error:
@@ -622,9 +793,9 @@ error:
 	return NULL;
 }
 
-char *
-cryptfs_setup_volume_new(const char *label, const char *real_blkdev, const char *key,
-			 const char *meta_blkdev)
+static char *
+cryptfs_setup_dm_new(const char *label, const char *real_blkdev, const char *key,
+		     const char *meta_blkdev, const cryptfs_opts_t *opts)
 {
 	int fd;
 	unsigned long fs_size;
@@ -644,19 +815,156 @@ cryptfs_setup_volume_new(const char *label, const char *real_blkdev, const char
 		DEBUG("Crypto blk device size: %lu", fs_size);
 	}
 
+	if (opts->integrity == CRYPTFS_INTEGRITY_NONE)
+		meta_blkdev = NULL;
+	IF_FALSE_RETVAL(cryptfs_key_is_valid(key, meta_blkdev != NULL, opts), NULL);
+
 	if (meta_blkdev)
 		return cryptfs_setup_volume_integrity_new(label, real_blkdev, meta_blkdev, key,
-							  fs_size);
+							  fs_size, opts);
 
 	// do dmcrypt device setup only
 
 	/* Use only the first 64 hex digits of master key for 512 bit xts mode */
-	IF_TRUE_RETVAL(strlen(key) < CRYPTFS_FDE_KEY_LEN, NULL);
 	char enc_key[CRYPTFS_FDE_KEY_LEN + 1];
 	memcpy(enc_key, key, CRYPTFS_FDE_KEY_LEN);
 	enc_key[CRYPTFS_FDE_KEY_LEN] = '\0';
 
-	if (create_crypto_blk_dev(real_blkdev, enc_key, label, fs_size, false) < 0)
+	if (create_crypto_blk_dev(real_blkdev, enc_key, label, fs_size, false, opts) < 0)
+		return NULL;
+
+	return create_device_node(label);
+}
+
+char *
+cryptfs_setup_volume_new(const char *label, const char *real_blkdev, const char *key,
+			 const char *meta_blkdev, const cryptfs_opts_t *opts)
+{
+	PROBE2(cryptfs_setup_volume, label, meta_blkdev != NULL);
+	char *dev = cryptfs_setup_dm_new(label, real_blkdev, key, meta_blkdev,
+					 opts ? opts : &cryptfs_opts_default);
+	PROBE2(cryptfs_setup_volume_done, label, dev != NULL);
+
+	return dev;
+}
+
+static int
+load_verity_mapping_table(int fd, const char *real_blk_name, const char *name, uint64_t data_size,
+			  const char *root_hash, const char *salt)
+{
+	char buffer[DM_VERITY_BUF_SIZE];
+	struct dm_ioctl *io;
+	struct dm_target_spec *tgt;
+	char *verity_params;
+	uint64_t data_blocks = data_size / VERITY_BLOCK_SIZE;
+
+	io = (struct dm_ioctl *)buffer;
+	tgt = (struct dm_target_spec *)&buffer[sizeof(struct dm_ioctl)];
+
+	ioctl_init(io, DM_VERITY_BUF_SIZE, name, DM_EXISTS_FLAG | DM_READONLY_FLAG);
+	io->target_count = 1;
+	tgt->status = 0;
+	tgt->sector_start = 0;
+	tgt->length = data_size / 512;
+	strcpy(tgt->target_type, "verity");
+
+	/*
+	 * Data and hash tree share the same device, the hash tree starts right
+	 * behind the data blocks. The kernel verifies each block on first access.
+	 */
+	verity_params = buffer + sizeof(struct dm_ioctl) + sizeof(struct dm_target_spec);
+	snprintf(verity_params,
+		 DM_VERITY_BUF_SIZE - sizeof(struct dm_ioctl) - sizeof(struct dm_target_spec),
+		 "1 %s %s %d %d %" PRIu64 " %" PRIu64 " %s %s %s", real_blk_name, real_blk_name,
+		 VERITY_BLOCK_SIZE, VERITY_BLOCK_SIZE, data_blocks, data_blocks, VERITY_HASH_ALGO,
+		 root_hash, (salt && *salt) ? salt : "-");
+
+	verity_params += strlen(verity_params) + 1;
+	verity_params =
+		(char *)(((unsigned long)verity_params + 7) & ~8); /* Align to an 8 byte boundary */
+	tgt->next = verity_params - buffer;
+
+	if (dm_ioctl(fd, DM_TABLE_LOAD, io)) {
+		ERROR_ERRNO("Loading verity mapping table failed");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+create_verity_blk_dev(const char *real_blk_name, const char *name, uint64_t data_size,
+		      const char *root_hash, const char *salt)
+{
+	char buffer[DM_VERITY_BUF_SIZE];
+	struct dm_ioctl *io;
+	int fd;
+	int retval = -1;
+
+	if ((fd = open(DEV_MAPPER, O_RDWR)) < 0) {
+		ERROR_ERRNO("Cannot open device-mapper");
+		return -1;
+	}
+
+	io = (struct dm_ioctl *)buffer;
+	ioctl_init(io, DM_VERITY_BUF_SIZE, name, DM_READONLY_FLAG);
+	if (dm_ioctl(fd, DM_DEV_CREATE, io)) {
+		ERROR_ERRNO("Cannot create dm-verity device");
+		goto errout;
+	}
+
+	if (load_verity_mapping_table(fd, real_blk_name, name, data_size, root_hash, salt) < 0) {
+		ioctl_init(io, DM_VERITY_BUF_SIZE, name, 0);
+		if (dm_ioctl(fd, DM_DEV_REMOVE, io))
+			WARN_ERRNO("Cannot remove incomplete dm-verity device");
+		goto errout;
+	}
+
+	/* Resume this device to activate it */
+	ioctl_init(io, DM_VERITY_BUF_SIZE, name, 0);
+	if (dm_ioctl(fd, DM_DEV_SUSPEND, io)) {
+		ERROR_ERRNO("Cannot resume the dm-verity device");
+		goto errout;
+	}
+
+	retval = 0;
+
+errout:
+	close(fd);
+	return retval;
+}
+
+char *
+cryptfs_setup_verity_new(const char *label, const char *real_blkdev, uint64_t data_size,
+			 const char *root_hash, const char *salt)
+{
+	IF_NULL_RETVAL(label, NULL);
+	IF_NULL_RETVAL(real_blkdev, NULL);
+	IF_NULL_RETVAL(root_hash, NULL);
+
+	if (data_size == 0 || data_size % VERITY_BLOCK_SIZE) {
+		ERROR("Verity data size %" PRIu64 " is not a multiple of %d", data_size,
+		      VERITY_BLOCK_SIZE);
+		return NULL;
+	}
+
+	int fd = open(real_blkdev, O_RDONLY);
+	if (fd < 0) {
+		ERROR_ERRNO("Cannot open volume %s", real_blkdev);
+		return NULL;
+	}
+	uint64_t dev_size = (uint64_t)get_blkdev_size(fd) * 512;
+	close(fd);
+
+	if (dev_size <= data_size) {
+		ERROR("Volume %s (%" PRIu64 " bytes) does not contain a verity hash tree",
+		      real_blkdev, dev_size);
+		return NULL;
+	}
+
+	DEBUG("Setting up dm-verity device %s on %s (data size %" PRIu64 ")", label, real_blkdev,
+	      data_size);
+
+	if (create_verity_blk_dev(real_blkdev, label, data_size, root_hash, salt) < 0)
 		return NULL;
 
 	return create_device_node(label);
@@ -708,3 +1016,312 @@ error:
 	close(fd); /* If fd is <0 from a failed open call, it's safe to just ignore the close error */
 	return ret;
 }
+
+/******************************************************************************/
+
+typedef struct cryptfs_batch_entry {
+	char *label;
+	char *real_blkdev;
+	char *meta_blkdev;
+	char *key;
+	cryptfs_opts_t opts;
+	unsigned long fs_size;
+	bool initial_format;
+	bool failed;
+	bool resumed; /**< the kernel has announced the crypto device by a uevent */
+	char *device;
+	pid_t format_pid;
+} cryptfs_batch_entry_t;
+
+struct cryptfs_batch {
+	list_t *entries;
+};
+
+cryptfs_batch_t *
+cryptfs_batch_new(void)
+{
+	return mem_new0(cryptfs_batch_t, 1);
+}
+
+void
+cryptfs_batch_free(cryptfs_batch_t *batch)
+{
+	IF_NULL_RETURN(batch);
+
+	for (list_t *l = batch->entries; l; l = l->next) {
+		cryptfs_batch_entry_t *e = l->data;
+		mem_free0(e->label);
+		mem_free0(e->real_blkdev);
+		if (e->meta_blkdev)
+			mem_free0(e->meta_blkdev);
+		memset(e->key, 0, strlen(e->key));
+		mem_free0(e->key);
+		if (e->device)
+			mem_free0(e->device);
+		mem_free0(e);
+	}
+	list_delete(batch->entries);
+	mem_free0(batch);
+}
+
+int
+cryptfs_batch_add(cryptfs_batch_t *batch, const char *label, const char *real_blk_dev,
+		  const char *ascii_key, const char *meta_blk_dev, const cryptfs_opts_t *opts)
+{
+	ASSERT(batch);
+	IF_NULL_RETVAL(label, -1);
+	IF_NULL_RETVAL(real_blk_dev, -1);
+	IF_NULL_RETVAL(ascii_key, -1);
+
+	if (!opts)
+		opts = &cryptfs_opts_default;
+	if (opts->integrity == CRYPTFS_INTEGRITY_NONE)
+		meta_blk_dev = NULL;
+	IF_FALSE_RETVAL(cryptfs_key_is_valid(ascii_key, meta_blk_dev != NULL, opts), -1);
+
+	cryptfs_batch_entry_t *e = mem_new0(cryptfs_batch_entry_t, 1);
+	e->label = mem_strdup(label);
+	e->real_blkdev = mem_strdup(real_blk_dev);
+	e->meta_blkdev = meta_blk_dev ? mem_strdup(meta_blk_dev) : NULL;
+	e->key = mem_strdup(ascii_key);
+	e->opts = *opts;
+	e->format_pid = -1;
+
+	batch->entries = list_append(batch->entries, e);
+	return 0;
+}
+
+const char *
+cryptfs_batch_get_device(const cryptfs_batch_t *batch, const char *label)
+{
+	ASSERT(batch);
+	IF_NULL_RETVAL(label, NULL);
+
+	for (list_t *l = batch->entries; l; l = l->next) {
+		cryptfs_batch_entry_t *e = l->data;
+		if (!strcmp(e->label, label))
+			return e->failed ? NULL : e->device;
+	}
+	return NULL;
+}
+
+static void
+cryptfs_batch_entry_fail(cryptfs_batch_entry_t *e)
+{
+	char *integrity_dev_label = mem_printf("%s-%s", e->label, "integrity");
+
+	e->failed = true;
+	/* remove whatever was set up already, the caller may fall back to a single setup */
+	cryptfs_delete_blk_dev(e->label);
+	delete_integrity_blk_dev(integrity_dev_label);
+
+	mem_free0(integrity_dev_label);
+	if (e->device)
+		mem_free0(e->device);
+}
+
+/*
+ * Opens a socket for the kernel's uevents. It has to be opened before the
+ * devices are resumed in order to not miss their events.
+ */
+static int
+cryptfs_batch_uevent_sock(void)
+{
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 /* kernel only */ };
+	int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		WARN_ERRNO("Cannot open uevent socket");
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		WARN_ERRNO("Cannot bind uevent socket");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static cryptfs_batch_entry_t *
+cryptfs_batch_uevent_match(cryptfs_batch_t *batch, const char *buf, size_t len)
+{
+	for (size_t off = 0; off < len; off += strlen(buf + off) + 1) {
+		if (strncmp(buf + off, "DM_NAME=", 8))
+			continue;
+		for (list_t *l = batch->entries; l; l = l->next) {
+			cryptfs_batch_entry_t *e = l->data;
+			if (!e->failed && !strcmp(buf + off + 8, e->label))
+				return e;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Waits for the change uevents the kernel emits when a device of the batch is
+ * resumed. All devices are awaited at once instead of polling one after another.
+ */
+static void
+cryptfs_batch_wait_uevents(cryptfs_batch_t *batch, int fd, int pending)
+{
+	char buf[UEVENT_BUF_SIZE];
+	struct timespec start, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (pending > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+			       (now.tv_nsec - start.tv_nsec) / 1000000;
+		if (elapsed >= CRYPTFS_BATCH_UEVENT_TIMEOUT_MS) {
+			WARN("Timeout waiting for uevents of %d dm devices", pending);
+			return;
+		}
+
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		int ret = poll(&pfd, 1, CRYPTFS_BATCH_UEVENT_TIMEOUT_MS - elapsed);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			continue;
+
+		struct sockaddr_nl addr;
+		socklen_t addrlen = sizeof(addr);
+		ssize_t len =
+			recvfrom(fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&addr, &addrlen);
+		if (len <= 0 || addr.nl_pid != 0) // only trust events sent by the kernel
+			continue;
+		buf[len] = '\0';
+
+		cryptfs_batch_entry_t *e = cryptfs_batch_uevent_match(batch, buf, len);
+		if (e && !e->resumed) {
+			TRACE("Got uevent for dm device %s", e->label);
+			e->resumed = true;
+			pending--;
+		}
+	}
+}
+
+int
+cryptfs_batch_setup(cryptfs_batch_t *batch)
+{
+	ASSERT(batch);
+
+	int pending = 0, ready = 0;
+	int uevent_fd = cryptfs_batch_uevent_sock();
+
+	/* first stage: sizes and integrity devices of all volumes */
+	for (list_t *l = batch->entries; l; l = l->next) {
+		cryptfs_batch_entry_t *e = l->data;
+
+		int fd = open(e->real_blkdev, O_RDONLY);
+		if (fd < 0) {
+			ERROR_ERRNO("Cannot open volume %s", e->real_blkdev);
+			e->failed = true;
+			continue;
+		}
+		e->fs_size = get_blkdev_size(fd);
+		close(fd);
+		if (e->fs_size == 0) {
+			ERROR("Cannot get size of volume %s", e->real_blkdev);
+			e->failed = true;
+			continue;
+		}
+
+		if (!e->meta_blkdev)
+			continue;
+
+		e->initial_format = get_provided_data_sectors(e->meta_blkdev) != e->fs_size;
+
+		char *integrity_dev_label = mem_printf("%s-%s", e->label, "integrity");
+		char *integrity_dev = NULL;
+		if (create_integrity_blk_dev(e->real_blkdev, e->meta_blkdev, integrity_dev_label,
+					     e->fs_size, e->key, &e->opts) == 0)
+			integrity_dev = create_device_node(integrity_dev_label);
+		mem_free0(integrity_dev_label);
+
+		if (!integrity_dev) {
+			ERROR("Could not set up integrity device for %s", e->label);
+			cryptfs_batch_entry_fail(e);
+			continue;
+		}
+		/* the crypto target is stacked on top of the integrity device */
+		mem_free0(e->real_blkdev);
+		e->real_blkdev = integrity_dev;
+	}
+
+	/* second stage: crypto devices of all volumes */
+	for (list_t *l = batch->entries; l; l = l->next) {
+		cryptfs_batch_entry_t *e = l->data;
+		if (e->failed)
+			continue;
+
+		bool aead = e->meta_blkdev && cryptfs_opts_aead(&e->opts);
+		char *crypt_key = cryptfs_crypt_key_new(e->key, aead);
+		int ret = create_crypto_blk_dev(e->real_blkdev, crypt_key, e->label, e->fs_size,
+						aead, &e->opts);
+		memset(crypt_key, 0, strlen(crypt_key));
+		mem_free0(crypt_key);
+		if (ret < 0) {
+			ERROR("Could not create crypto block device %s", e->label);
+			cryptfs_batch_entry_fail(e);
+			continue;
+		}
+		pending++;
+	}
+
+	if (uevent_fd >= 0) {
+		cryptfs_batch_wait_uevents(batch, uevent_fd, pending);
+		close(uevent_fd);
+	}
+
+	/* third stage: device nodes and initial formatting, the latter in parallel */
+	for (list_t *l = batch->entries; l; l = l->next) {
+		cryptfs_batch_entry_t *e = l->data;
+		if (e->failed)
+			continue;
+
+		e->device = create_device_node(e->label);
+		if (!e->device) {
+			ERROR("Could not create device node for %s", e->label);
+			cryptfs_batch_entry_fail(e);
+			continue;
+		}
+
+		if (!e->initial_format)
+			continue;
+
+		DEBUG("Formatting crypto blkdev %s. Generating initial MAC on "
+		      "integrity_dev %s",
+		      e->device, e->real_blkdev);
+		e->format_pid = fork();
+		if (e->format_pid == 0) {
+			_exit(format_crypto_blk_dev(e->device, e->fs_size) < 0 ? EXIT_FAILURE :
+										 EXIT_SUCCESS);
+		} else if (e->format_pid < 0) {
+			ERROR_ERRNO("Could not fork formatting of %s", e->device);
+			cryptfs_batch_entry_fail(e);
+		}
+	}
+
+	for (list_t *l = batch->entries; l; l = l->next) {
+		cryptfs_batch_entry_t *e = l->data;
+
+		if (e->format_pid > 0) {
+			int status;
+			pid_t pid;
+			while ((pid = waitpid(e->format_pid, &status, 0)) < 0 && errno == EINTR)
+				;
+			e->format_pid = -1;
+			if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+				ERROR("Formatting crypto blkdev %s failed", e->device);
+				cryptfs_batch_entry_fail(e);
+			}
+		}
+		if (!e->failed)
+			ready++;
+	}
+
+	DEBUG("Set up %d of %d dm volumes in batch", ready, (int)list_length(batch->entries));
+	return ready;
+}
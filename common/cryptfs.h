@@ -33,15 +33,115 @@
 #define CRYPTFS_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #define CRYPTFS_FDE_KEY_LEN 64
 
+/**
+ * How dm-integrity protects a volume with a meta device.
+ */
+typedef enum cryptfs_integrity {
+	/** tags of an AEAD dm-crypt target, written through a journal on the meta device */
+	CRYPTFS_INTEGRITY_JOURNAL = 0,
+	/** keyed internal hash, dirty regions are tracked in a bitmap instead of a journal */
+	CRYPTFS_INTEGRITY_BITMAP,
+	/** tags of an AEAD dm-crypt target, written directly without a journal */
+	CRYPTFS_INTEGRITY_DIRECT,
+	/** plain dm-crypt, no meta device is used */
+	CRYPTFS_INTEGRITY_NONE,
+} cryptfs_integrity_t;
+
+/**
+ * Cipher of plain dm-crypt volumes, the keys of both have CRYPTFS_FDE_KEY_LEN hex digits.
+ */
+typedef enum cryptfs_cipher {
+	CRYPTFS_CIPHER_AES_XTS = 0, /**< aes-xts-plain64 */
+	CRYPTFS_CIPHER_ADIANTUM,    /**< xchacha12,aes-adiantum-plain64 */
+	CRYPTFS_CIPHER_AUTO,	    /**< AES_XTS with AES instructions, ADIANTUM otherwise */
+} cryptfs_cipher_t;
+
+/**
+ * Options of an encrypted volume, NULL selects the defaults (all members zero).
+ */
+typedef struct cryptfs_opts {
+	cryptfs_integrity_t integrity; /**< only used if there is a meta device */
+	cryptfs_cipher_t cipher;       /**< of plain dm-crypt, AEAD uses a fixed one */
+	unsigned int sector_size;      /**< of dm-crypt and dm-integrity, 0 for 512 */
+	bool no_workqueue;	       /**< process I/O inline, not in dm-crypt's workqueues */
+	bool same_cpu_crypt;	       /**< encrypt on the CPU which submitted the I/O */
+	bool submit_from_crypt_cpus;   /**< submit writes from the encrypting CPUs */
+	bool allow_discards;	       /**< also pass discards through dm-integrity */
+} cryptfs_opts_t;
+
 char *
 cryptfs_get_device_path_new(const char *label);
 
+/**
+ * Sets up a dm-crypt device on top of real_blk_dev. If meta_blk_dev is given, the
+ * volume is protected by dm-integrity, which keeps its tags on meta_blk_dev.
+ * Plain dm-crypt uses the first CRYPTFS_FDE_KEY_LEN hex digits of ascii_key, the
+ * BITMAP mode additionally the last CRYPTFS_FDE_KEY_LEN ones as key of its hmac.
+ *
+ * @return the path of the device node or NULL on error
+ */
 char *
 cryptfs_setup_volume_new(const char *label, const char *real_blk_dev, const char *ascii_key,
-			 const char *meta_blk_dev);
+			 const char *meta_blk_dev, const cryptfs_opts_t *opts);
+
+/**
+ * Sets up a read-only dm-verity device on top of real_blk_dev. The hash tree is
+ * expected in the same block device right behind the first data_size bytes.
+ * Blocks are verified against root_hash on access by the kernel.
+ *
+ * @return the path of the device node or NULL on error
+ */
+char *
+cryptfs_setup_verity_new(const char *label, const char *real_blk_dev, uint64_t data_size,
+			 const char *root_hash, const char *salt);
+
+typedef struct cryptfs_batch cryptfs_batch_t;
+
+/**
+ * Creates a new, empty batch of encrypted volumes which are set up at once by
+ * cryptfs_batch_setup().
+ */
+cryptfs_batch_t *
+cryptfs_batch_new(void);
+
+/**
+ * Frees the batch. Devices set up by the batch are not removed.
+ */
+void
+cryptfs_batch_free(cryptfs_batch_t *batch);
+
+/**
+ * Adds a volume to the batch. The parameters are the same as for
+ * cryptfs_setup_volume_new().
+ *
+ * @return 0 on success, -1 if the parameters are invalid
+ */
+int
+cryptfs_batch_add(cryptfs_batch_t *batch, const char *label, const char *real_blk_dev,
+		  const char *ascii_key, const char *meta_blk_dev, const cryptfs_opts_t *opts);
+
+/**
+ * Sets up all volumes of the batch. The dm targets of all volumes are created
+ * stage by stage, the device nodes are created after the kernel announced all
+ * devices by uevents, and initial formatting of integrity volumes runs in parallel.
+ * Volumes which could not be set up are removed again, so that the caller may
+ * fall back to cryptfs_setup_volume_new() for them.
+ *
+ * @return the number of volumes set up successfully
+ */
+int
+cryptfs_batch_setup(cryptfs_batch_t *batch);
+
+/**
+ * Returns the device path of a volume set up by the batch or NULL if the
+ * setup of this volume failed.
+ */
+const char *
+cryptfs_batch_get_device(const cryptfs_batch_t *batch, const char *label);
 
 int
 cryptfs_delete_blk_dev(const char *name);
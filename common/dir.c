@@ -30,47 +30,136 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
-int
-dir_foreach(const char *path, int (*func)(const char *path, const char *file, void *data),
-	    void *data)
+// large enough for several hundred entries per getdents64 call
+#define DIR_GETDENTS_BUF_SIZE (32 * 1024)
+
+// layout of the records returned by getdents64(2), see linux/dirent.h
+struct dir_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static unsigned char
+dir_get_type(int dirfd, const char *name)
+{
+	struct stat s;
+
+	if (fstatat(dirfd, name, &s, AT_SYMLINK_NOFOLLOW) < 0)
+		return DT_UNKNOWN;
+
+	return IFTODT(s.st_mode);
+}
+
+static int
+dir_foreach_fd_internal(int fd, const char *path, dir_foreach_at_func_t func, void *data,
+			bool resolve_type)
 {
-	struct dirent *dp;
-	DIR *dirp;
+	char *buf = mem_alloc(DIR_GETDENTS_BUF_SIZE);
 	int n = 0;
 
+	for (;;) {
+		long len = syscall(SYS_getdents64, fd, buf, DIR_GETDENTS_BUF_SIZE);
+		if (len < 0) {
+			WARN_ERRNO("Could not read dir %s", path);
+			n = -1;
+			goto out;
+		}
+		if (len == 0)
+			break;
+
+		for (long off = 0; off < len;) {
+			struct dir_dirent64 *d = (struct dir_dirent64 *)(void *)(buf + off);
+			off += d->d_reclen;
+
+			if (d->d_name[0] == '.' &&
+			    (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+				continue;
+
+			unsigned char type = d->d_type;
+			if (type == DT_UNKNOWN && resolve_type)
+				type = dir_get_type(fd, d->d_name);
+
+			int ret = func(fd, path, d->d_name, type, data);
+			if (ret < 0) {
+				DEBUG("Callback of dir_foreach returned %d", ret);
+				n = -1;
+				goto out;
+			} else if (ret > 0) {
+				n++;
+			}
+		}
+	}
+out:
+	mem_free0(buf);
+	return n;
+}
+
+static int
+dir_foreach_at_internal(int dirfd, const char *path, dir_foreach_at_func_t func, void *data,
+			bool resolve_type)
+{
 	IF_NULL_RETVAL(path, -1);
 	IF_NULL_RETVAL(func, -1);
 
-	dirp = opendir(path);
-	if (!dirp) {
+	int fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
 		WARN_ERRNO("Could not open dir %s", path);
 		return -1;
 	}
 
-	while ((dp = readdir(dirp)) != NULL) {
-		if (strcmp(dp->d_name, ".") == 0)
-			continue;
-		if (strcmp(dp->d_name, "..") == 0)
-			continue;
+	int n = dir_foreach_fd_internal(fd, path, func, data, resolve_type);
+	close(fd);
 
-		TRACE("Found directory %s/%s", path, dp->d_name);
+	return n;
+}
 
-		int ret = func(path, dp->d_name, data);
-		if (ret < 0) {
-			DEBUG("Callback of dir_foreach returned %d", ret);
-			n = -1;
-			break;
-		} else if (ret > 0) {
-			n++;
-		}
-	}
+int
+dir_foreach_fd(int fd, const char *path, dir_foreach_at_func_t func, void *data)
+{
+	IF_TRUE_RETVAL(fd < 0, -1);
+	IF_NULL_RETVAL(func, -1);
 
-	closedir(dirp);
+	return dir_foreach_fd_internal(fd, path ? path : "", func, data, true);
+}
 
-	return n;
+int
+dir_foreach_at(int dirfd, const char *path, dir_foreach_at_func_t func, void *data)
+{
+	return dir_foreach_at_internal(dirfd, path, func, data, true);
+}
+
+typedef struct dir_foreach_path_params {
+	int (*func)(const char *path, const char *file, void *data);
+	void *data;
+} dir_foreach_path_params_t;
+
+static int
+dir_foreach_path_cb(UNUSED int dirfd, const char *path, const char *name,
+		    UNUSED unsigned char type, void *data)
+{
+	dir_foreach_path_params_t *params = data;
+	return params->func(path, name, params->data);
+}
+
+int
+dir_foreach(const char *path, int (*func)(const char *path, const char *file, void *data),
+	    void *data)
+{
+	IF_NULL_RETVAL(func, -1);
+
+	dir_foreach_path_params_t params = { .func = func, .data = data };
+
+	// path based callbacks do not use the type, so do not stat on file systems without d_type
+	return dir_foreach_at_internal(AT_FDCWD, path, &dir_foreach_path_cb, &params, false);
 }
 
 int
@@ -111,30 +200,34 @@ out:
 }
 
 static int
-dir_unlink_folder_contents_cb(const char *path, const char *name, UNUSED void *data)
+dir_unlink_folder_contents_cb(int dirfd, const char *path, const char *name, unsigned char type,
+			      UNUSED void *data)
 {
-	struct stat stat_buffer;
 	int ret = 0;
-	char *file_to_remove = mem_printf("%s/%s", path, name);
-	if (stat(file_to_remove, &stat_buffer) == 0 && !S_ISDIR(stat_buffer.st_mode)) {
-		TRACE("Unlinking file %s", file_to_remove);
-		if (unlink(file_to_remove) == -1) {
-			ERROR_ERRNO("Could not delete file %s", file_to_remove);
-			ret--;
-		}
-	} else {
-		TRACE("Path %s is dir", file_to_remove);
-		if (dir_foreach(file_to_remove, &dir_unlink_folder_contents_cb, NULL) < 0) {
-			ERROR_ERRNO("Could not delete all dir contents in %s", file_to_remove);
-			ret--;
-		}
-		TRACE("Removing now empty dir %s", file_to_remove);
-		if (rmdir(file_to_remove) < 0) {
-			ERROR_ERRNO("Could not delete dir %s", file_to_remove);
+
+	if (type != DT_DIR) {
+		if (unlinkat(dirfd, name, 0) < 0) {
+			ERROR_ERRNO("Could not delete file %s/%s", path, name);
 			ret--;
 		}
+		return ret;
+	}
+
+	int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		ERROR_ERRNO("Could not open dir %s/%s", path, name);
+		return -1;
+	}
+	if (dir_foreach_fd(fd, name, &dir_unlink_folder_contents_cb, NULL) < 0) {
+		ERROR("Could not delete all dir contents in %s/%s", path, name);
+		ret--;
+	}
+	close(fd);
+
+	if (unlinkat(dirfd, name, AT_REMOVEDIR) < 0) {
+		ERROR_ERRNO("Could not delete dir %s/%s", path, name);
+		ret--;
 	}
-	mem_free0(file_to_remove);
 	return ret;
 }
 
@@ -145,11 +238,10 @@ dir_delete_folder(const char *path, const char *dir_name)
 	char *dir_to_remove = mem_printf("%s/%s", path, dir_name);
 
 	DEBUG("Deleting %s", dir_to_remove);
-	if (dir_foreach(dir_to_remove, &dir_unlink_folder_contents_cb, NULL) < 0) {
+	if (dir_foreach_at(AT_FDCWD, dir_to_remove, &dir_unlink_folder_contents_cb, NULL) < 0) {
 		ERROR_ERRNO("Could not delete all dir contents in %s", dir_to_remove);
 		ret--;
 	}
-	TRACE("Removing now empty dir %s", dir_to_remove);
 	if (rmdir(dir_to_remove) < 0) {
 		ERROR_ERRNO("Could not delete dir %s", dir_to_remove);
 		ret--;
@@ -183,7 +275,8 @@ dir_copy_params_free(dir_copy_params_t *params)
 }
 
 static int
-dir_copy_folder_contents_cb(const char *path, const char *name, void *data)
+dir_copy_folder_contents_cb(int dirfd, const char *path, const char *name, unsigned char type,
+			    void *data)
 {
 	dir_copy_params_t *p = data;
 	ASSERT(p);
@@ -201,7 +294,12 @@ dir_copy_folder_contents_cb(const char *path, const char *name, void *data)
 	if (params->filter && (!params->filter(file_src, params->data)))
 		goto out;
 
-	IF_TRUE_GOTO((ret = lstat(file_src, &s)), out);
+	if (type == DT_FIFO || type == DT_SOCK) {
+		TRACE("Skip FIFO, SOCK %s -> %s", file_src, file_dst);
+		goto out;
+	}
+
+	IF_TRUE_GOTO((ret = fstatat(dirfd, name, &s, AT_SYMLINK_NOFOLLOW)), out);
 
 	switch (s.st_mode & S_IFMT) {
 	case S_IFBLK:
@@ -220,7 +318,7 @@ dir_copy_folder_contents_cb(const char *path, const char *name, void *data)
 			goto out;
 		}
 		TRACE("Copying link %s -> %s", file_src, file_dst);
-		ret = readlink(file_src, target, s.st_size + 1);
+		ret = readlinkat(dirfd, name, target, s.st_size + 1);
 		if (ret < 0 || ret > s.st_size) {
 			ERROR_ERRNO("Failed to read lnk");
 			mem_free0(target);
@@ -250,7 +348,7 @@ dir_copy_folder_contents_cb(const char *path, const char *name, void *data)
 				ret--;
 			}
 		}
-		if (dir_foreach(file_src, &dir_copy_folder_contents_cb, params) < 0) {
+		if (dir_foreach_at(AT_FDCWD, file_src, &dir_copy_folder_contents_cb, params) < 0) {
 			ERROR("Could not copy all dir contents of %s -> %s ", file_src, file_dst);
 			ret--;
 		}
@@ -291,7 +389,7 @@ dir_copy_folder(const char *source, const char *target,
 		}
 	}
 	dir_copy_params_t *params = dir_copy_params_new(target, NULL, filter, filter_data);
-	if (dir_foreach(source, &dir_copy_folder_contents_cb, params) < 0) {
+	if (dir_foreach_at(AT_FDCWD, source, &dir_copy_folder_contents_cb, params) < 0) {
 		ERROR("Could not copy all dir contents in %s", source);
 		ret--;
 	}
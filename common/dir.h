@@ -33,6 +33,8 @@
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <stdbool.h>
 
 /**
@@ -48,9 +50,51 @@ int
 dir_foreach(const char *path, int (*func)(const char *path, const char *file, void *data),
 	    void *data);
 
+/**
+ * Callback of dir_foreach_at and dir_foreach_fd.
+ *
+ * @param dirfd The open directory, e.g., for openat(2), fstatat(2) or unlinkat(2)
+ *		relative to it. It is only valid during the callback.
+ * @param path The path of the directory as given to dir_foreach_at or dir_foreach_fd.
+ * @param name The name of the entry.
+ * @param type The type of the entry as in d_type of readdir(3), e.g., DT_DIR or DT_LNK.
+ *	       Symbolic links are never followed.
+ * @param data The data object given to dir_foreach_at or dir_foreach_fd.
+ * @return <0 to stop calling callbacks, >0 to count the entry.
+ */
+typedef int (*dir_foreach_at_func_t)(int dirfd, const char *path, const char *name,
+				     unsigned char type, void *data);
+
+/**
+ * Reads a directory in large batches with getdents64(2) and calls a callback for each
+ * entry except "." and "..", which gets the type of the entry and the directory fd.
+ * Callers thus neither need to stat(2) each entry nor build the paths of entries.
+ *
+ * @param dirfd The directory fd a relative path is resolved against, or AT_FDCWD.
+ * @param path The path of the directory, relative to dirfd or absolute.
+ * @param func The callback to be called for each directory entry.
+ * @param data A data object given to each callback function.
+ * @returns -1 on error and the number of callbacks which returned a value > 0 on success.
+ */
+int
+dir_foreach_at(int dirfd, const char *path, dir_foreach_at_func_t func, void *data);
+
+/**
+ * Like dir_foreach_at, but for an already open directory fd, which is not closed.
+ *
+ * @param fd The open directory, read from its current position.
+ * @param path The path of the directory passed to the callbacks, e.g., for messages.
+ */
+int
+dir_foreach_fd(int fd, const char *path, dir_foreach_at_func_t func, void *data);
+
 int
 dir_mkdir_p(const char *path, mode_t mode);
 
+/**
+ * Deletes the directory path/dir_name recursively. Symbolic links are removed, not
+ * followed.
+ */
 int
 dir_delete_folder(const char *path, const char *dir_name);
 
@@ -0,0 +1,208 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "dir.h"
+#include "dir_walk.h"
+#include "file.h"
+#include "logf.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DIR_TEST_WIDTH 6
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+/*
+ * Creates DIR_TEST_WIDTH subdirectories with DIR_TEST_WIDTH files and one nested
+ * directory each below root, plus a symlink to outside, whose target must survive
+ * any deletion of root.
+ */
+static void
+create_tree(const char *root, const char *outside)
+{
+	munit_assert_int(dir_mkdir_p(root, 0700), ==, 0);
+	for (int i = 0; i < DIR_TEST_WIDTH; i++) {
+		char *sub = mem_printf("%s/d%d/nested", root, i);
+		munit_assert_int(dir_mkdir_p(sub, 0700), ==, 0);
+		for (int j = 0; j < DIR_TEST_WIDTH; j++) {
+			char *file = mem_printf("%s/d%d/f%d", root, i, j);
+			munit_assert_int(file_write(file, "x", 1), ==, 1);
+			mem_free0(file);
+		}
+		mem_free0(sub);
+	}
+	char *link = mem_printf("%s/link", root);
+	munit_assert_int(symlink(outside, link), ==, 0);
+	mem_free0(link);
+}
+
+static int
+count_cb(UNUSED int dirfd, UNUSED const char *path, const char *name, unsigned char type,
+	 void *data)
+{
+	int *types = data;
+	if (type == DT_DIR)
+		types[0]++;
+	else if (type == DT_LNK)
+		types[1]++;
+	return strcmp(name, "link") ? 0 : 1;
+}
+
+static MunitResult
+test_dir_foreach_at(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	char tmp[] = "/tmp/dir_test_XXXXXX";
+	munit_assert_not_null(mkdtemp(tmp));
+	char *root = mem_printf("%s/root", tmp);
+	create_tree(root, tmp);
+
+	int types[2] = { 0, 0 };
+	munit_assert_int(dir_foreach_at(AT_FDCWD, root, &count_cb, types), ==, 1);
+	munit_assert_int(types[0], ==, DIR_TEST_WIDTH);
+	munit_assert_int(types[1], ==, 1);
+
+	munit_assert_int(dir_delete_folder(tmp, "root"), ==, 0);
+	munit_assert_false(file_exists(root));
+	munit_assert_true(file_is_dir(tmp));
+	munit_assert_int(rmdir(tmp), ==, 0);
+
+	mem_free0(root);
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_dir_walk_delete(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	char tmp[] = "/tmp/dir_test_XXXXXX";
+	munit_assert_not_null(mkdtemp(tmp));
+	char *root = mem_printf("%s/root", tmp);
+
+	create_tree(root, tmp);
+	munit_assert_int(dir_walk_delete(root, 4), ==, 0);
+	munit_assert_false(file_exists(root));
+	munit_assert_true(file_is_dir(tmp));
+
+	create_tree(root, tmp);
+	munit_assert_int(dir_walk_delete(root, 1), ==, 0);
+	munit_assert_false(file_exists(root));
+
+	munit_assert_int(dir_walk_delete(root, 2), ==, -1);
+	munit_assert_int(rmdir(tmp), ==, 0);
+
+	mem_free0(root);
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_dir_walk_copy(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	char tmp[] = "/tmp/dir_test_XXXXXX";
+	munit_assert_not_null(mkdtemp(tmp));
+	char *root = mem_printf("%s/root", tmp);
+	char *copy = mem_printf("%s/copy", tmp);
+	char *file = mem_printf("%s/d1/f2", copy);
+	char *link = mem_printf("%s/link", copy);
+	char buf[2] = { 0 };
+
+	create_tree(root, tmp);
+	munit_assert_int(chmod(root, 0500), ==, 0);
+
+	dir_walk_progress_t progress = { 0, 0 };
+	munit_assert_int(dir_walk_copy(root, copy, 4, &progress), ==, 0);
+	// the subdirectories with their nested directory and files, plus the link
+	munit_assert_size(progress.entries, ==, DIR_TEST_WIDTH * (DIR_TEST_WIDTH + 2) + 1);
+	munit_assert_size(progress.bytes, ==, DIR_TEST_WIDTH * DIR_TEST_WIDTH);
+
+	munit_assert_int(file_read(file, buf, 1), ==, 1);
+	munit_assert_string_equal(buf, "x");
+	munit_assert_true(file_is_link(link));
+	munit_assert_true(file_is_dir(copy));
+
+	struct stat s;
+	munit_assert_int(stat(copy, &s), ==, 0);
+	munit_assert_int(s.st_mode & 07777, ==, 0500);
+
+	munit_assert_int(chmod(root, 0700), ==, 0);
+	munit_assert_int(chmod(copy, 0700), ==, 0);
+	munit_assert_int(dir_walk_delete(root, 0), ==, 0);
+	munit_assert_int(dir_walk_delete(copy, 0), ==, 0);
+	munit_assert_int(rmdir(tmp), ==, 0);
+
+	mem_free0(link);
+	mem_free0(file);
+	mem_free0(copy);
+	mem_free0(root);
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/foreach_at",		/* name */
+		test_dir_foreach_at,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/walk_delete",		/* name */
+		test_dir_walk_delete,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	{
+		"/walk_copy",		/* name */
+		test_dir_walk_copy,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite dir_suite = {
+	"/dir",			/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
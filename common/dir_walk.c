@@ -0,0 +1,584 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "dir_walk.h"
+#include "dir.h"
+#include "file.h"
+
+#include "macro.h"
+#include "mem.h"
+#include "logf.h"
+#include "event.h"
+#include "worker.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+
+// fds are stored as dir_data pointers with an offset, so that NULL means no fd
+#define DIR_WALK_FD_TO_PTR(fd) ((void *)(intptr_t)((fd) + 1))
+#define DIR_WALK_PTR_TO_FD(ptr) ((int)(intptr_t)(ptr)-1)
+
+typedef struct dir_walk_node dir_walk_node_t;
+
+struct dir_walk_node {
+	dir_walk_node_t *parent;
+	dir_walk_node_t *next; // next node on the stack of unread directories
+	char *name;	       // relative to the fd of parent
+	int fd;
+	void *dir_data;
+	// entries still to be finished, plus one until the directory has been read
+	unsigned int pending;
+};
+
+typedef struct dir_walk_state {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	// unread directories; a stack keeps the walk depth first and the open fds bounded
+	dir_walk_node_t *stack;
+	unsigned int busy; // threads reading a directory
+	int errors;
+	dir_walk_func_t func;
+	void *data;
+	dir_walk_progress_t *progress;
+} dir_walk_state_t;
+
+typedef struct dir_walk_read {
+	dir_walk_state_t *walk;
+	dir_walk_node_t *node;
+} dir_walk_read_t;
+
+static void
+dir_walk_error(dir_walk_state_t *walk)
+{
+	pthread_mutex_lock(&walk->lock);
+	walk->errors++;
+	pthread_mutex_unlock(&walk->lock);
+}
+
+static void
+dir_walk_count(dir_walk_state_t *walk)
+{
+	if (walk->progress)
+		__atomic_add_fetch(&walk->progress->entries, 1, __ATOMIC_RELAXED);
+}
+
+static void
+dir_walk_node_free(dir_walk_node_t *node)
+{
+	mem_free0(node->name);
+	mem_free0(node);
+}
+
+/*
+ * Drops one pending reference of node and, for each directory which is finished by
+ * that, calls the post callback and continues with its parent.
+ */
+static void
+dir_walk_node_release(dir_walk_state_t *walk, dir_walk_node_t *node)
+{
+	while (node) {
+		pthread_mutex_lock(&walk->lock);
+		bool finished = --node->pending == 0;
+		pthread_mutex_unlock(&walk->lock);
+		if (!finished)
+			return;
+
+		if (node->fd >= 0)
+			close(node->fd);
+
+		dir_walk_node_t *parent = node->parent;
+		if (walk->func(parent ? parent->fd : AT_FDCWD, node->name, DT_DIR, true,
+			       &node->dir_data, walk->data) < 0)
+			dir_walk_error(walk);
+
+		dir_walk_node_free(node);
+		node = parent;
+	}
+}
+
+static int
+dir_walk_read_cb(int dirfd, UNUSED const char *path, const char *name, unsigned char type,
+		 void *data)
+{
+	dir_walk_read_t *read = data;
+	dir_walk_state_t *walk = read->walk;
+
+	if (type != DT_DIR) {
+		if (walk->func(dirfd, name, type, false, &read->node->dir_data, walk->data) < 0)
+			dir_walk_error(walk);
+		dir_walk_count(walk);
+		return 0;
+	}
+
+	dir_walk_node_t *child = mem_new0(dir_walk_node_t, 1);
+	child->parent = read->node;
+	child->name = mem_strdup(name);
+	child->fd = -1;
+	child->dir_data = read->node->dir_data;
+	child->pending = 1;
+
+	int ret = walk->func(dirfd, name, type, false, &child->dir_data, walk->data);
+	dir_walk_count(walk);
+	if (ret) {
+		if (ret < 0)
+			dir_walk_error(walk);
+		dir_walk_node_free(child);
+		return 0;
+	}
+
+	pthread_mutex_lock(&walk->lock);
+	read->node->pending++;
+	child->next = walk->stack;
+	walk->stack = child;
+	pthread_cond_signal(&walk->cond);
+	pthread_mutex_unlock(&walk->lock);
+
+	return 0;
+}
+
+static void
+dir_walk_node_read(dir_walk_state_t *walk, dir_walk_node_t *node)
+{
+	int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+	// the root may be a symlink given by the caller, but do not follow any below it
+	if (node->parent)
+		flags |= O_NOFOLLOW;
+
+	node->fd = openat(node->parent ? node->parent->fd : AT_FDCWD, node->name, flags);
+	if (node->fd < 0) {
+		ERROR_ERRNO("Could not open dir %s", node->name);
+		dir_walk_error(walk);
+	} else {
+		dir_walk_read_t read = { .walk = walk, .node = node };
+		if (dir_foreach_fd(node->fd, node->name, &dir_walk_read_cb, &read) < 0)
+			dir_walk_error(walk);
+	}
+
+	dir_walk_node_release(walk, node);
+}
+
+static void *
+dir_walk_thread(void *arg)
+{
+	dir_walk_state_t *walk = arg;
+
+	pthread_mutex_lock(&walk->lock);
+	for (;;) {
+		while (!walk->stack && walk->busy)
+			pthread_cond_wait(&walk->cond, &walk->lock);
+		// nothing left to read and nobody who could push more
+		if (!walk->stack)
+			break;
+
+		dir_walk_node_t *node = walk->stack;
+		walk->stack = node->next;
+		walk->busy++;
+		pthread_mutex_unlock(&walk->lock);
+
+		dir_walk_node_read(walk, node);
+
+		pthread_mutex_lock(&walk->lock);
+		walk->busy--;
+		if (!walk->stack && !walk->busy)
+			pthread_cond_broadcast(&walk->cond);
+	}
+	pthread_mutex_unlock(&walk->lock);
+
+	return NULL;
+}
+
+static int
+dir_walk_internal(const char *path, dir_walk_func_t func, void *data, unsigned int threads,
+		  dir_walk_progress_t *progress)
+{
+	IF_NULL_RETVAL(path, -1);
+	IF_NULL_RETVAL(func, -1);
+
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? (unsigned int)cpus : 1;
+	}
+	threads = MIN(threads, DIR_WALK_MAX_THREADS);
+
+	dir_walk_node_t *root = mem_new0(dir_walk_node_t, 1);
+	root->name = mem_strdup(path);
+	root->fd = -1;
+	root->pending = 1;
+
+	int ret = func(AT_FDCWD, path, DT_DIR, false, &root->dir_data, data);
+	if (ret) {
+		dir_walk_node_free(root);
+		return ret < 0 ? -1 : 0;
+	}
+
+	dir_walk_state_t walk = { .stack = root,
+				  .busy = 0,
+				  .errors = 0,
+				  .func = func,
+				  .data = data,
+				  .progress = progress };
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_cond_init(&walk.cond, NULL);
+
+	// signals are handled by the event loop thread only
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	pthread_t tids[DIR_WALK_MAX_THREADS];
+	unsigned int started = 0;
+	for (unsigned int i = 1; i < threads; i++) {
+		if (pthread_create(&tids[started], NULL, &dir_walk_thread, &walk)) {
+			WARN("Could not start dir walk thread, continuing with %u", started + 1);
+			break;
+		}
+		started++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	// the calling thread takes part in the walk
+	dir_walk_thread(&walk);
+
+	for (unsigned int i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	pthread_cond_destroy(&walk.cond);
+	pthread_mutex_destroy(&walk.lock);
+
+	return walk.errors ? -1 : 0;
+}
+
+int
+dir_walk(const char *path, dir_walk_func_t func, void *data, unsigned int threads)
+{
+	return dir_walk_internal(path, func, data, threads, NULL);
+}
+
+static int
+dir_walk_delete_cb(int dirfd, const char *name, unsigned char type, bool post,
+		   UNUSED void **dir_data, UNUSED void *data)
+{
+	if (type != DT_DIR) {
+		if (unlinkat(dirfd, name, 0) < 0) {
+			ERROR_ERRNO("Could not delete file %s", name);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (post && unlinkat(dirfd, name, AT_REMOVEDIR) < 0) {
+		ERROR_ERRNO("Could not delete dir %s", name);
+		return -1;
+	}
+	return 0;
+}
+
+int
+dir_walk_delete(const char *path, unsigned int threads)
+{
+	DEBUG("Deleting %s", path);
+	return dir_walk(path, &dir_walk_delete_cb, NULL, threads);
+}
+
+typedef struct dir_walk_copy {
+	const char *target;
+	dir_walk_progress_t *progress;
+} dir_walk_copy_t;
+
+static int
+dir_walk_copy_file(int dirfd, const char *name, int target_fd, const struct stat *s,
+		   dir_walk_copy_t *copy)
+{
+	int ret = -1;
+	int out_fd = -1;
+
+	int in_fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	IF_TRUE_GOTO_ERROR(in_fd < 0, out);
+	out_fd = openat(target_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+			0600);
+	IF_TRUE_GOTO_ERROR(out_fd < 0, out);
+
+	IF_TRUE_GOTO_ERROR(file_copy_fd(in_fd, out_fd), out);
+	IF_TRUE_GOTO_ERROR(fchown(out_fd, s->st_uid, s->st_gid), out);
+	IF_TRUE_GOTO_ERROR(fchmod(out_fd, s->st_mode & 07777), out);
+
+	if (copy->progress)
+		__atomic_add_fetch(&copy->progress->bytes, s->st_size, __ATOMIC_RELAXED);
+	ret = 0;
+out:
+	if (ret)
+		ERROR_ERRNO("Could not copy file %s", name);
+	if (out_fd >= 0)
+		close(out_fd);
+	if (in_fd >= 0)
+		close(in_fd);
+	return ret;
+}
+
+static int
+dir_walk_copy_link(int dirfd, const char *name, int target_fd, const struct stat *s)
+{
+	char *link = mem_alloc0(s->st_size + 1);
+	int ret = -1;
+
+	ssize_t len = readlinkat(dirfd, name, link, s->st_size + 1);
+	if (len < 0 || len > s->st_size) {
+		ERROR_ERRNO("Could not read link %s", name);
+		goto out;
+	}
+	link[len] = '\0';
+
+	if (symlinkat(link, target_fd, name) < 0) {
+		ERROR_ERRNO("Could not create symlink %s -> %s", name, link);
+		goto out;
+	}
+	if (fchownat(target_fd, name, s->st_uid, s->st_gid, AT_SYMLINK_NOFOLLOW) < 0) {
+		ERROR_ERRNO("Could not chown link %s", name);
+		goto out;
+	}
+	ret = 0;
+out:
+	mem_free0(link);
+	return ret;
+}
+
+/*
+ * The dir_data of each source directory is the fd of the matching target directory,
+ * which is created with a private mode first and gets the mode of the source once all
+ * entries have been copied into it, so that read-only directories can be copied too.
+ */
+static int
+dir_walk_copy_cb(int dirfd, const char *name, unsigned char type, bool post, void **dir_data,
+		 void *data)
+{
+	dir_walk_copy_t *copy = data;
+	bool root = dirfd == AT_FDCWD;
+	struct stat s;
+
+	if (type == DT_FIFO || type == DT_SOCK) {
+		TRACE("Skip FIFO, SOCK %s", name);
+		return 0;
+	}
+	if (fstatat(dirfd, name, &s, AT_SYMLINK_NOFOLLOW) < 0) {
+		ERROR_ERRNO("Could not stat %s", name);
+		return -1;
+	}
+
+	if (post) {
+		int fd = DIR_WALK_PTR_TO_FD(*dir_data);
+		int ret = 0;
+		if (fchmod(fd, s.st_mode & 07777) < 0) {
+			ERROR_ERRNO("Could not preserve mode for dir %s", name);
+			ret = -1;
+		}
+		close(fd);
+		return ret;
+	}
+
+	int target_fd = root ? AT_FDCWD : DIR_WALK_PTR_TO_FD(*dir_data);
+	const char *target_name = root ? copy->target : name;
+
+	switch (s.st_mode & S_IFMT) {
+	case S_IFDIR: {
+		if (mkdirat(target_fd, target_name, 0700) < 0 && errno != EEXIST) {
+			ERROR_ERRNO("Could not mkdir target dir %s", target_name);
+			return -1;
+		}
+		int fd = openat(target_fd, target_name,
+				O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0) {
+			ERROR_ERRNO("Could not open target dir %s", target_name);
+			return -1;
+		}
+		if (fchown(fd, s.st_uid, s.st_gid) < 0) {
+			ERROR_ERRNO("Could not chown dir %s to (%d:%d)", target_name, s.st_uid,
+				    s.st_gid);
+			close(fd);
+			return -1;
+		}
+		*dir_data = DIR_WALK_FD_TO_PTR(fd);
+		return 0;
+	}
+	case S_IFREG:
+		return dir_walk_copy_file(dirfd, name, target_fd, &s, copy);
+	case S_IFLNK:
+		return dir_walk_copy_link(dirfd, name, target_fd, &s);
+	case S_IFBLK:
+	case S_IFCHR:
+		if (mknodat(target_fd, name, s.st_mode, s.st_rdev) < 0 ||
+		    fchownat(target_fd, name, s.st_uid, s.st_gid, AT_SYMLINK_NOFOLLOW) < 0) {
+			ERROR_ERRNO("Could not copy device node %s", name);
+			return -1;
+		}
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+int
+dir_walk_copy(const char *source, const char *target, unsigned int threads,
+	      dir_walk_progress_t *progress)
+{
+	IF_NULL_RETVAL(target, -1);
+
+	dir_walk_copy_t copy = { .target = target, .progress = progress };
+
+	DEBUG("Copying %s -> %s", source, target);
+	return dir_walk_internal(source, &dir_walk_copy_cb, &copy, threads, progress);
+}
+
+typedef struct dir_walk_job {
+	char *path;
+	char *target; // of copy jobs
+	dir_walk_func_t func;
+	void *data;
+	dir_walk_copy_t copy; // data of copy jobs
+	dir_walk_progress_t progress;
+	int ret;
+	event_timer_t *timer;
+	dir_walk_progress_cb_t progress_cb;
+	dir_walk_done_cb_t done_cb;
+	void *cb_data;
+} dir_walk_job_t;
+
+static void
+dir_walk_job_free(dir_walk_job_t *job)
+{
+	if (job->timer) {
+		event_remove_timer(job->timer);
+		event_timer_free(job->timer);
+	}
+	mem_free0(job->target);
+	mem_free0(job->path);
+	mem_free0(job);
+}
+
+static void
+dir_walk_job_work(void *data)
+{
+	dir_walk_job_t *job = data;
+
+	job->ret = dir_walk_internal(job->path, job->func, job->data, 0, &job->progress);
+}
+
+static void
+dir_walk_job_done(void *data)
+{
+	dir_walk_job_t *job = data;
+
+	DEBUG("Walk of %s finished with %d after %zu entries", job->path, job->ret,
+	      job->progress.entries);
+	if (job->done_cb)
+		job->done_cb(job->ret, &job->progress, job->cb_data);
+
+	dir_walk_job_free(job);
+}
+
+static void
+dir_walk_job_progress_cb(UNUSED event_timer_t *timer, void *data)
+{
+	dir_walk_job_t *job = data;
+
+	dir_walk_progress_t progress = {
+		.entries = __atomic_load_n(&job->progress.entries, __ATOMIC_RELAXED),
+		.bytes = __atomic_load_n(&job->progress.bytes, __ATOMIC_RELAXED),
+	};
+	job->progress_cb(&progress, job->cb_data);
+}
+
+static int
+dir_walk_job_run(dir_walk_job_t *job)
+{
+	if (job->progress_cb) {
+		job->timer = event_timer_new(DIR_WALK_PROGRESS_INTERVAL, EVENT_TIMER_REPEAT_FOREVER,
+					     &dir_walk_job_progress_cb, job);
+		event_add_timer(job->timer);
+	}
+
+	if (worker_run(&dir_walk_job_work, &dir_walk_job_done, job) < 0) {
+		ERROR("Could not start background walk of %s", job->path);
+		dir_walk_job_free(job);
+		return -1;
+	}
+	return 0;
+}
+
+static dir_walk_job_t *
+dir_walk_job_new(const char *path, dir_walk_progress_cb_t progress_cb, dir_walk_done_cb_t done_cb,
+		 void *cb_data)
+{
+	dir_walk_job_t *job = mem_new0(dir_walk_job_t, 1);
+	job->path = mem_strdup(path);
+	job->progress_cb = progress_cb;
+	job->done_cb = done_cb;
+	job->cb_data = cb_data;
+	return job;
+}
+
+int
+dir_walk_async(const char *path, dir_walk_func_t func, void *data,
+	       dir_walk_progress_cb_t progress_cb, dir_walk_done_cb_t done_cb, void *cb_data)
+{
+	IF_NULL_RETVAL(path, -1);
+	IF_NULL_RETVAL(func, -1);
+
+	dir_walk_job_t *job = dir_walk_job_new(path, progress_cb, done_cb, cb_data);
+	job->func = func;
+	job->data = data;
+
+	return dir_walk_job_run(job);
+}
+
+int
+dir_walk_delete_async(const char *path, dir_walk_progress_cb_t progress_cb,
+		      dir_walk_done_cb_t done_cb, void *cb_data)
+{
+	IF_NULL_RETVAL(path, -1);
+
+	DEBUG("Deleting %s in background", path);
+	return dir_walk_async(path, &dir_walk_delete_cb, NULL, progress_cb, done_cb, cb_data);
+}
+
+int
+dir_walk_copy_async(const char *source, const char *target, dir_walk_progress_cb_t progress_cb,
+		    dir_walk_done_cb_t done_cb, void *cb_data)
+{
+	IF_NULL_RETVAL(source, -1);
+	IF_NULL_RETVAL(target, -1);
+
+	dir_walk_job_t *job = dir_walk_job_new(source, progress_cb, done_cb, cb_data);
+	job->func = &dir_walk_copy_cb;
+	job->data = &job->copy;
+	job->target = mem_strdup(target);
+	job->copy.target = job->target;
+	job->copy.progress = &job->progress;
+
+	DEBUG("Copying %s -> %s in background", source, target);
+	return dir_walk_job_run(job);
+}
@@ -0,0 +1,167 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file dir_walk.h
+ *
+ * Walks large directory trees, e.g. container volumes, with several threads. Each thread
+ * takes a directory from a shared stack, reads it with dir_foreach_fd and pushes its
+ * subdirectories; entries are addressed relative to the fd of their directory, so paths
+ * are never built or resolved again.
+ *
+ * On top of that, trees can be copied or deleted in the background on the worker pool
+ * (see worker.h), with progress and completion reported in the event loop thread.
+ * Like worker.c, this needs -lpthread and is thus not part of libcommon.
+ */
+
+#ifndef DIR_WALK_H
+#define DIR_WALK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Maximum number of threads used by dir_walk.
+ */
+#define DIR_WALK_MAX_THREADS 8
+
+/**
+ * Interval in ms in which background jobs report their progress.
+ */
+#define DIR_WALK_PROGRESS_INTERVAL 1000
+
+/**
+ * Callback of dir_walk. It is called concurrently from several threads.
+ *
+ * For directories it is called twice: before their entries (post == false) and after
+ * the callbacks of all entries below them returned (post == true). The root directory
+ * is passed with dirfd AT_FDCWD and name the path given to dir_walk.
+ *
+ * Each directory has a data pointer, which is initialized with the one of its parent
+ * (NULL for the root). In the first call of a directory, dir_data points to its own
+ * pointer, which may be replaced, e.g., by a matching target directory. For entries
+ * which are no directories, dir_data points to the pointer of their parent, which must
+ * not be changed. In the post call, dir_data points to the directory's own pointer again,
+ * e.g., to release it.
+ *
+ * @param dirfd The open parent directory of the entry.
+ * @param name The name of the entry relative to dirfd.
+ * @param type The type of the entry as in d_type of readdir(3). Symbolic links are never
+ *	       followed.
+ * @param post true for the call after all entries of a directory have been handled.
+ * @param dir_data The per directory data pointer, see above.
+ * @param data The data object given to dir_walk.
+ * @return <0 on error, which makes dir_walk fail, otherwise 0. In the first call of a
+ *	   directory, its entries are skipped if a value != 0 is returned.
+ */
+typedef int (*dir_walk_func_t)(int dirfd, const char *name, unsigned char type, bool post,
+			       void **dir_data, void *data);
+
+/**
+ * Progress of a walk. The fields are updated atomically while the walk runs.
+ */
+typedef struct dir_walk_progress {
+	size_t entries; // entries handled so far
+	size_t bytes;	// bytes of regular files copied so far
+} dir_walk_progress_t;
+
+/**
+ * Walks the directory tree below path and calls func for each entry.
+ *
+ * @param path The root of the tree.
+ * @param func The callback called for each entry.
+ * @param data A data object given to each callback.
+ * @param threads Number of threads to use including the calling one; 0 uses one per
+ *		  online CPU, at most DIR_WALK_MAX_THREADS.
+ * @return 0 if all callbacks succeeded and all directories could be read, -1 otherwise.
+ */
+int
+dir_walk(const char *path, dir_walk_func_t func, void *data, unsigned int threads);
+
+/**
+ * Deletes the directory path recursively with dir_walk. Symbolic links are removed,
+ * not followed.
+ *
+ * @param path The directory to be deleted.
+ * @param threads Number of threads to use, as for dir_walk.
+ * @return 0 on success, -1 if anything could not be deleted.
+ */
+int
+dir_walk_delete(const char *path, unsigned int threads);
+
+/**
+ * Copies the directory tree source to target with dir_walk, preserving modes and
+ * owners. Regular files are reflinked or copied in kernel where possible, symbolic
+ * links are copied, not followed, and FIFOs and sockets are skipped.
+ *
+ * @param source The directory to be copied.
+ * @param target The directory to be created or filled.
+ * @param threads Number of threads to use, as for dir_walk.
+ * @param progress Progress to be updated, may be NULL.
+ * @return 0 on success, -1 if anything could not be copied.
+ */
+int
+dir_walk_copy(const char *source, const char *target, unsigned int threads,
+	      dir_walk_progress_t *progress);
+
+/**
+ * Called in the event loop thread every DIR_WALK_PROGRESS_INTERVAL ms while a background
+ * job runs.
+ */
+typedef void (*dir_walk_progress_cb_t)(const dir_walk_progress_t *progress, void *data);
+
+/**
+ * Called in the event loop thread when a background job has finished.
+ *
+ * @param ret The return value of the walk.
+ */
+typedef void (*dir_walk_done_cb_t)(int ret, const dir_walk_progress_t *progress, void *data);
+
+/**
+ * Runs dir_walk on the worker pool. func is called on worker threads, progress_cb and
+ * done_cb in the event loop thread.
+ *
+ * @param progress_cb Called periodically with the progress, may be NULL.
+ * @param done_cb Called once the walk has finished, may be NULL.
+ * @param cb_data Data object given to progress_cb and done_cb.
+ * @return 0 if the job was started, -1 otherwise (no callback is called then).
+ */
+int
+dir_walk_async(const char *path, dir_walk_func_t func, void *data,
+	       dir_walk_progress_cb_t progress_cb, dir_walk_done_cb_t done_cb, void *cb_data);
+
+/**
+ * Like dir_walk_delete, but on the worker pool, see dir_walk_async.
+ */
+int
+dir_walk_delete_async(const char *path, dir_walk_progress_cb_t progress_cb,
+		      dir_walk_done_cb_t done_cb, void *cb_data);
+
+/**
+ * Like dir_walk_copy, but on the worker pool, see dir_walk_async.
+ */
+int
+dir_walk_copy_async(const char *source, const char *target, dir_walk_progress_cb_t progress_cb,
+		    dir_walk_done_cb_t done_cb, void *cb_data);
+
+#endif /* DIR_WALK_H */
@@ -27,18 +27,28 @@
 
 #include "mem.h"
 #include "list.h"
+#include "hashmap.h"
+#include "probe.h"
 #include "macro.h"
+#include "fd.h"
 
 #include <errno.h>
+#include <stdlib.h>
 #include <limits.h>
 #include <time.h>
 #include <string.h>
 #include <signal.h>
 #include <sys/epoll.h>
 #include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
 #define timespec_cmp(a, b, CMP)                                                                    \
 	(((a)->tv_sec == (b)->tv_sec) ? ((a)->tv_nsec CMP(b)->tv_nsec) :                           \
 					((a)->tv_sec CMP(b)->tv_sec))
@@ -83,6 +93,8 @@ struct event_timer {
 	struct timespec next;	  /**< next timeout, absolute value */
 	int repeat;		  /**< how often to repeat, -1 means repeat indefinitely */
 	int repeated;		  /**< how often the timer already expired */
+	ssize_t heap_idx;	  /**< position in the timer heap, -1 if not queued */
+	event_base_t *base;	  /**< the event base the timer was added to */
 };
 
 struct event_io {
@@ -91,6 +103,8 @@ struct event_io {
 	void *data;		  /**< a data pointer to pass to the callback function */
 	int fd;			  /**< the file descriptor which should be watched */
 	unsigned events;	  /**< mask of events to listen for */
+	event_base_t *base;	  /**< the event base the io event was added to */
+	bool internal;		  /**< internal io event which does not keep the loop running */
 };
 
 struct event_inotify {
@@ -101,6 +115,7 @@ struct event_inotify {
 	uint32_t mask;		  /**< a bit-mask of events to be watched for */
 	int wd;			  /**< the watch descriptor */
 	bool todo;		  /**< helper variable for event_inotify_handler() */
+	event_base_t *base;	  /**< the event base the inotify event was added to */
 };
 
 struct event_signal {
@@ -108,54 +123,316 @@ struct event_signal {
 		     void *data); /**< the function to call when the event is triggered */
 	void *data;		  /**< a data pointer to pass to the callback function */
 	int signum;		  /**< the signal number of interes */
-	bool todo;		  /**< helper variable for event_signal_handler() */
+	bool todo;		  /**< helper variable for event_signal_dispatch() */
+};
+
+struct event_child {
+	void (*func)(pid_t pid, int status, event_child_t *child,
+		     void *data); /**< the function to call when the child terminated */
+	void *data;		  /**< a data pointer to pass to the callback function */
+	pid_t pid;		  /**< the pid of the child to be watched */
+	event_io_t *io;		  /**< io event on the pidfd of the child (if supported) */
+	bool added;		  /**< whether the event was added to the event loop */
+};
+
+/* key of the profiling statistics of a callback, without padding */
+typedef struct event_profile_key {
+	const void *func;
+	uint64_t type;
+} event_profile_key_t;
+
+struct event_base {
+	/* Timers are kept in a binary min-heap ordered by their next expiration time,
+	 * thus the next deadline is always found at index 0 */
+	event_timer_t **timer_heap; /**< the timer heap */
+	size_t timer_heap_len;	    /**< number of queued timers */
+	size_t timer_heap_size;	    /**< allocated size of the timer heap */
+	int epoll_fd;		    /**< the epoll fd of this base, -1 if not yet created */
+	unsigned io_active;	    /**< number of active io events */
+	unsigned io_internal;	    /**< number of active internal io events */
+	list_t *inotify_list;	    /**< list of inotify events */
+	hashmap_t *inotify_map;	    /**< lists of inotify events indexed by watch descriptor */
+	event_io_t *inotify_io;	    /**< io event for the inotify fd of this base */
+	bool profile;		    /**< whether callbacks are profiled */
+	list_t *profile_list;	    /**< list of event_profile_stat_t */
+	hashmap_t *profile_map;	    /**< event_profile_stat_t indexed by event_profile_key_t */
+	/* number of dispatched callbacks per event_profile_type_t */
+	uint64_t dispatched[EVENT_PROFILE_INOTIFY + 1];
 };
 
-static list_t *event_timer_list = NULL;
-static list_t *event_signal_list = NULL;
-static list_t *event_inotify_list = NULL;
-static bool event_signal_received0[NSIG] = { false };
-static bool event_signal_received1[NSIG] = { false };
-static bool *event_signal_received = event_signal_received0;
-static unsigned event_io_active = 0;
+/* the default base which is used by all threads without an own base, it
+ * is the only base which dispatches signal events */
+static event_base_t event_base_default = { .epoll_fd = -1 };
+static __thread event_base_t *event_base_thread = NULL;
+
+/* Signal events are kept in one list per signal number, so that dispatching
+ * a signal only visits the handlers registered for it. The signal handler
+ * marks the signal as pending and wakes up the default loop by writing to
+ * a self-pipe which is polled as an ordinary io event. */
+static list_t *event_signal_lists[NSIG] = { NULL };
+static unsigned event_signal_count = 0;
+static volatile sig_atomic_t event_signal_pending[NSIG] = { 0 };
+static int event_signal_pipe[2] = { -1, -1 };
+static volatile pid_t event_signal_pid = 0;
+static event_io_t *event_signal_io = NULL;
 static bool event_initialized = false;
-static event_io_t *event_inotify_io = NULL;
+
+/* Child events are watched by SIGCHLD if the kernel does not support pidfds */
+static list_t *event_child_fallback_list = NULL;
+static event_signal_t *event_child_sigchld = NULL;
+
+static void
+event_signal_pipe_init(void);
+
+static event_base_t *
+event_base_current(void)
+{
+	return event_base_thread ? event_base_thread : &event_base_default;
+}
 
 /******************************************************************************/
 
+static event_profile_stat_t *
+event_profile_stat_get(event_base_t *base, event_profile_type_t type, const void *func)
+{
+	event_profile_key_t key = { .func = func, .type = type };
+
+	if (!base->profile_map)
+		base->profile_map = hashmap_new();
+
+	event_profile_stat_t *stat = hashmap_get(base->profile_map, &key, sizeof(key));
+	if (stat)
+		return stat;
+
+	stat = mem_new0(event_profile_stat_t, 1);
+	stat->type = type;
+	stat->func = func;
+	base->profile_list = list_prepend(base->profile_list, stat);
+	hashmap_put(base->profile_map, &key, sizeof(key), stat);
+
+	return stat;
+}
+
+unsigned
+event_profile_bucket(uint64_t ns)
+{
+	unsigned bucket = 0;
+
+	for (uint64_t us = ns / 1000; us && bucket < EVENT_PROFILE_BUCKETS - 1; us >>= 1)
+		bucket++;
+
+	return bucket;
+}
+
+static void
+event_profile_record(event_base_t *base, event_profile_type_t type, const void *func,
+		     const struct timespec *start)
+{
+	struct timespec now, diff;
+	uint64_t ns;
+
+	timespec_now(&now);
+	timespec_sub(&now, start, &diff);
+	ns = (uint64_t)diff.tv_sec * 1000000000ULL + (uint64_t)diff.tv_nsec;
+
+	event_profile_stat_t *stat = event_profile_stat_get(base, type, func);
+	stat->count++;
+	stat->total_ns += ns;
+	if (ns > stat->max_ns)
+		stat->max_ns = ns;
+	stat->histogram[event_profile_bucket(ns)]++;
+}
+
+static void
+event_profile_clear(event_base_t *base)
+{
+	for (list_t *l = base->profile_list; l; l = l->next)
+		mem_free0(l->data);
+	list_delete(base->profile_list);
+	base->profile_list = NULL;
+	if (base->profile_map) {
+		hashmap_free(base->profile_map);
+		base->profile_map = NULL;
+	}
+}
+
+void
+event_profile_enable(bool enable)
+{
+	event_base_current()->profile = enable;
+}
+
+bool
+event_profile_is_enabled(void)
+{
+	return event_base_current()->profile;
+}
+
+void
+event_profile_reset(void)
+{
+	event_profile_clear(event_base_current());
+}
+
 static int
-event_timeout(void)
+event_profile_stat_cmp(const void *a, const void *b)
 {
-	struct timespec next, now, diff;
-	event_timer_t *timer;
-	list_t *l;
+	const event_profile_stat_t *sa = a;
+	const event_profile_stat_t *sb = b;
 
-	if (!event_timer_list)
-		return -1;
+	if (sa->total_ns == sb->total_ns)
+		return 0;
+	return (sa->total_ns < sb->total_ns) ? 1 : -1;
+}
+
+uint64_t
+event_get_dispatched(event_profile_type_t type)
+{
+	IF_FALSE_RETVAL(type <= EVENT_PROFILE_INOTIFY, 0);
 
-	l = event_timer_list;
-	timer = l->data;
+	// signal callbacks are dispatched by the default base only
+	if (type == EVENT_PROFILE_SIGNAL)
+		return event_base_default.dispatched[type];
+	return event_base_current()->dispatched[type];
+}
 
-	ASSERT(timer);
+size_t
+event_profile_get_stats(event_profile_stat_t **stats)
+{
+	IF_NULL_RETVAL(stats, 0);
+
+	event_base_t *base = event_base_current();
+	size_t n = list_length(base->profile_list);
 
-	timespec_set(&timer->next, &next);
+	*stats = NULL;
+	if (!n)
+		return 0;
 
-	// find the smallest next time in list
-	for (l = l->next; l; l = l->next) {
-		timer = l->data;
+	*stats = mem_new(event_profile_stat_t, n);
+	size_t i = 0;
+	for (list_t *l = base->profile_list; l; l = l->next)
+		(*stats)[i++] = *(event_profile_stat_t *)l->data;
 
-		ASSERT(timer);
+	qsort(*stats, n, sizeof(event_profile_stat_t), event_profile_stat_cmp);
+
+	return n;
+}
+
+const char *
+event_profile_type_to_string(event_profile_type_t type)
+{
+	switch (type) {
+	case EVENT_PROFILE_IO:
+		return "io";
+	case EVENT_PROFILE_TIMER:
+		return "timer";
+	case EVENT_PROFILE_SIGNAL:
+		return "signal";
+	case EVENT_PROFILE_INOTIFY:
+		return "inotify";
+	}
+	return "unknown";
+}
+
+/******************************************************************************/
+
+static void
+event_timer_heap_set(event_base_t *base, size_t idx, event_timer_t *timer)
+{
+	base->timer_heap[idx] = timer;
+	timer->heap_idx = idx;
+}
+
+static void
+event_timer_heap_sift_up(event_base_t *base, size_t idx)
+{
+	event_timer_t *timer = base->timer_heap[idx];
+
+	while (idx > 0) {
+		size_t parent = (idx - 1) / 2;
+		if (!timespec_cmp(&timer->next, &base->timer_heap[parent]->next, <))
+			break;
+		event_timer_heap_set(base, idx, base->timer_heap[parent]);
+		idx = parent;
+	}
+	event_timer_heap_set(base, idx, timer);
+}
+
+static void
+event_timer_heap_sift_down(event_base_t *base, size_t idx)
+{
+	event_timer_t *timer = base->timer_heap[idx];
+
+	for (;;) {
+		size_t child = 2 * idx + 1;
+		if (child >= base->timer_heap_len)
+			break;
+		if (child + 1 < base->timer_heap_len &&
+		    timespec_cmp(&base->timer_heap[child + 1]->next, &base->timer_heap[child]->next,
+				 <))
+			child++;
+		if (!timespec_cmp(&base->timer_heap[child]->next, &timer->next, <))
+			break;
+		event_timer_heap_set(base, idx, base->timer_heap[child]);
+		idx = child;
+	}
+	event_timer_heap_set(base, idx, timer);
+}
 
-		if (timespec_cmp(&next, &timer->next, >))
-			timespec_set(&timer->next, &next);
+static void
+event_timer_heap_push(event_base_t *base, event_timer_t *timer)
+{
+	if (base->timer_heap_len == base->timer_heap_size) {
+		base->timer_heap_size = base->timer_heap_size ? 2 * base->timer_heap_size : 16;
+		base->timer_heap =
+			mem_renew(event_timer_t *, base->timer_heap, base->timer_heap_size);
 	}
+	timer->base = base;
+	event_timer_heap_set(base, base->timer_heap_len++, timer);
+	event_timer_heap_sift_up(base, timer->heap_idx);
+}
+
+static void
+event_timer_heap_remove(event_timer_t *timer)
+{
+	event_base_t *base = timer->base;
+	size_t idx = timer->heap_idx;
+
+	ASSERT(idx < base->timer_heap_len && base->timer_heap[idx] == timer);
+
+	timer->heap_idx = -1;
+	timer->base = NULL;
+	if (idx == --base->timer_heap_len)
+		return;
+
+	// move the last element into the gap and restore the heap property
+	event_timer_heap_set(base, idx, base->timer_heap[base->timer_heap_len]);
+	if (idx > 0 &&
+	    timespec_cmp(&base->timer_heap[idx]->next, &base->timer_heap[(idx - 1) / 2]->next, <))
+		event_timer_heap_sift_up(base, idx);
+	else
+		event_timer_heap_sift_down(base, idx);
+}
+
+static int
+event_timeout(event_base_t *base)
+{
+	struct timespec now, diff;
+	event_timer_t *timer;
+
+	if (!base->timer_heap_len)
+		return -1;
+
+	timer = base->timer_heap[0];
+
+	ASSERT(timer);
 
 	timespec_now(&now);
 
-	if (timespec_cmp(&next, &now, <))
+	if (timespec_cmp(&timer->next, &now, <))
 		return 0;
 
-	timespec_sub(&next, &now, &diff);
+	timespec_sub(&timer->next, &now, &diff);
 
 	// should not happen, because timeout was an int too
 	ASSERT(diff.tv_sec <= (INT_MAX / 1000));
@@ -165,48 +442,56 @@ event_timeout(void)
 }
 
 static void
-event_timeout_handler(void)
+event_timeout_handler(event_base_t *base)
 {
 	struct timespec now;
 
-	IF_NULL_RETURN(event_timer_list);
-
 	timespec_now(&now);
 
-	for (list_t *l = event_timer_list; l;) {
-		event_timer_t *timer = l->data;
+	// timer->func might add or remove timers, thus always look at the current heap top
+	while (base->timer_heap_len) {
+		event_timer_t *timer = base->timer_heap[0];
 
 		ASSERT(timer);
 
-		if (timespec_cmp(&now, &timer->next, >)) {
-			if (!timer->repeated) {
-				event_remove_timer(timer);
-			} else {
-				if (timer->repeated > 0)
-					timer->repeated--;
-				if (!timer->repeated)
-					event_remove_timer(timer);
-				else
-					timespec_add(&timer->diff, &timer->next, &timer->next);
-
-				TRACE("Handling timer event %p (func=%p, data=%p, diff=%u.%09us, repeat=%d)",
-				      (void *)timer, CAST_FUNCPTR_VOIDPTR timer->func, timer->data,
-				      (unsigned)timer->diff.tv_sec, (unsigned)timer->diff.tv_nsec,
-				      timer->repeat);
-
-				(timer->func)(timer, timer->data);
-			}
+		if (!timespec_cmp(&now, &timer->next, >))
+			break;
 
-			// event_timer_remove modifies the timer list
-			// and timer->func might modify the timer list
-			// so we will start again at its head...
-			if (event_timer_list)
-				l = event_timer_list;
-			else
-				break;
+		if (!timer->repeated) {
+			event_remove_timer(timer);
+			continue;
+		}
+
+		if (timer->repeated > 0)
+			timer->repeated--;
+		if (!timer->repeated) {
+			event_remove_timer(timer);
 		} else {
-			l = l->next;
+			timespec_add(&timer->diff, &timer->next, &timer->next);
+			event_timer_heap_sift_down(base, timer->heap_idx);
+		}
+
+		TRACE("Handling timer event %p (func=%p, data=%p, diff=%u.%09us, repeat=%d)",
+		      (void *)timer, CAST_FUNCPTR_VOIDPTR timer->func, timer->data,
+		      (unsigned)timer->diff.tv_sec, (unsigned)timer->diff.tv_nsec, timer->repeat);
+
+		base->dispatched[EVENT_PROFILE_TIMER]++;
+		PROBE2(event_dispatch, EVENT_PROFILE_TIMER, CAST_FUNCPTR_VOIDPTR timer->func);
+		if (base->profile) {
+			// timer->func might free the timer
+			void *func = CAST_FUNCPTR_VOIDPTR timer->func;
+			struct timespec start;
+
+			timespec_now(&start);
+			(timer->func)(timer, timer->data);
+			event_profile_record(base, EVENT_PROFILE_TIMER, func, &start);
+
+			// the callback might have taken a while
+			timespec_now(&now);
+		} else {
+			(timer->func)(timer, timer->data);
 		}
+		PROBE1(event_dispatch_done, EVENT_PROFILE_TIMER);
 	}
 }
 
@@ -226,6 +511,8 @@ event_timer_new(int timeout, int repeat, void (*func)(event_timer_t *timer, void
 	timer->next.tv_sec = 0;
 	timer->next.tv_nsec = 0;
 	timer->repeat = repeat;
+	timer->heap_idx = -1;
+	timer->base = NULL;
 
 	return timer;
 }
@@ -235,6 +522,9 @@ event_timer_free(event_timer_t *timer)
 {
 	IF_NULL_RETURN(timer);
 
+	if (timer->heap_idx >= 0)
+		event_timer_heap_remove(timer);
+
 	mem_free0(timer);
 }
 
@@ -249,7 +539,11 @@ event_add_timer(event_timer_t *timer)
 	timespec_add(&now, &timer->diff, &timer->next);
 	timer->repeated = timer->repeat;
 
-	event_timer_list = list_append(event_timer_list, timer);
+	if (timer->heap_idx >= 0) {
+		// already queued, just reschedule
+		event_timer_heap_remove(timer);
+	}
+	event_timer_heap_push(event_base_current(), timer);
 
 	TRACE("Added timer event %p (func=%p, data=%p, diff=%u.%09us, repeat=%d)", (void *)timer,
 	      CAST_FUNCPTR_VOIDPTR timer->func, timer->data, (unsigned)timer->diff.tv_sec,
@@ -261,8 +555,9 @@ event_remove_timer(event_timer_t *timer)
 {
 	IF_NULL_RETURN(timer);
 
-	TRACE("Removing timer event %p from list %p", (void *)timer, (void *)event_timer_list);
-	event_timer_list = list_remove(event_timer_list, timer);
+	TRACE("Removing timer event %p from base %p", (void *)timer, (void *)timer->base);
+	if (timer->heap_idx >= 0)
+		event_timer_heap_remove(timer);
 
 	TRACE("Removed timer event %p (func=%p, data=%p, diff=%u.%09us, repeat=%d)", (void *)timer,
 	      CAST_FUNCPTR_VOIDPTR timer->func, timer->data, (unsigned)timer->diff.tv_sec,
@@ -272,9 +567,9 @@ event_remove_timer(event_timer_t *timer)
 /******************************************************************************/
 
 static int
-event_epoll_fd(int reset)
+event_epoll_fd(event_base_t *base, int reset)
 {
-	static int fd = -1;
+	int fd = base->epoll_fd;
 
 	if (fd < 0 || (fd >= 0 && reset == 1)) {
 		if (fd >= 0 && close(fd) < 0) {
@@ -295,26 +590,17 @@ event_epoll_fd(int reset)
 		oldflags |= FD_CLOEXEC;
 		if (fcntl(fd, F_SETFD, oldflags) < 0)
 			WARN_ERRNO("fcntl failed");
+
+		base->epoll_fd = fd;
+		base->io_active = 0;
+		base->io_internal = 0;
 	}
 
 	return fd;
 }
 
-static void
-event_reset_fd(void)
-{
-	event_epoll_fd(1);
-}
-
 // compiling with -Wall, -Werror
 // must cast types appropriately in wrapper functions
-static void
-wrapped_remove_timer(void *elem)
-{
-	event_remove_timer((event_timer_t *)elem);
-	event_timer_free(elem);
-}
-
 static void
 wrapped_remove_signal(void *elem)
 {
@@ -323,43 +609,114 @@ wrapped_remove_signal(void *elem)
 }
 
 static void
-wrapped_remove_inotify(void *elem)
+event_base_reset(event_base_t *base)
 {
-	event_inotify_list = list_unlink(event_inotify_list, elem);
-	event_inotify_free(elem);
+	if (base->inotify_io) {
+		TRACE("Resetting inotify event");
+		event_remove_io(base->inotify_io);
+		close(base->inotify_io->fd);
+		event_io_free(base->inotify_io);
+		base->inotify_io = NULL;
+	}
+
+	if (base->timer_heap) {
+		TRACE("Resetting event timers");
+		while (base->timer_heap_len) {
+			event_timer_t *timer = base->timer_heap[base->timer_heap_len - 1];
+			event_remove_timer(timer);
+			event_timer_free(timer);
+		}
+		mem_free0(base->timer_heap);
+		base->timer_heap_size = 0;
+	}
+	if (base->inotify_list) {
+		TRACE("Resetting event inotify list");
+		for (list_t *l = base->inotify_list; l; l = l->next) {
+			event_inotify_t *inotify = l->data;
+			list_delete(hashmap_remove(base->inotify_map, &inotify->wd,
+						   sizeof(inotify->wd)));
+			event_inotify_free(inotify);
+		}
+		list_delete(base->inotify_list);
+		base->inotify_list = NULL;
+	}
+	if (base->inotify_map) {
+		hashmap_free(base->inotify_map);
+		base->inotify_map = NULL;
+	}
+
+	base->profile = false;
+	event_profile_clear(base);
 }
 
 void
 event_reset()
 {
-	if (event_inotify_io) {
-		TRACE("Resetting inotify event");
-		event_remove_io(event_inotify_io);
-		close(event_inotify_io->fd);
-		event_io_free(event_inotify_io);
-		event_inotify_io = NULL;
-	}
+	event_base_t *base = event_base_current();
 
-	TRACE("Resetting event epoll fd");
-	event_reset_fd();
+	event_base_reset(base);
 
-	if (event_timer_list) {
-		TRACE("Resetting event timers");
-		list_foreach(event_timer_list, wrapped_remove_timer);
-		event_timer_list = NULL;
-	}
-	if (event_signal_list) {
-		TRACE("Resetting event signal handler list");
-		list_foreach(event_signal_list, wrapped_remove_signal);
-		event_signal_list = NULL;
-	}
-	if (event_inotify_list) {
-		TRACE("Resetting event inotify list");
-		list_foreach(event_inotify_list, wrapped_remove_inotify);
-		event_inotify_list = NULL;
+	TRACE("Resetting event epoll fd");
+	event_epoll_fd(base, 1);
+
+	if (base == &event_base_default) {
+		TRACE("Resetting event signal handler lists");
+		for (int i = 0; i < NSIG; i++) {
+			if (event_signal_lists[i])
+				list_foreach(event_signal_lists[i], wrapped_remove_signal);
+			event_signal_lists[i] = NULL;
+			event_signal_pending[i] = 0;
+		}
+		event_signal_count = 0;
+
+		// the SIGCHLD fallback for child events has been freed above
+		event_child_sigchld = NULL;
+		list_delete(event_child_fallback_list);
+		event_child_fallback_list = NULL;
+
+		/* The signal pipe might be shared with our parent (after fork), thus
+		 * always create a new one which is registered in the new epoll fd.
+		 * The registration of the old one vanished with the old epoll fd. */
+		if (event_initialized) {
+			if (event_signal_io)
+				event_signal_io->base = NULL;
+			event_signal_pipe_init();
+		}
 	}
 }
 
+event_base_t *
+event_base_new(void)
+{
+	event_base_t *base = mem_new0(event_base_t, 1);
+	base->epoll_fd = -1;
+
+	return base;
+}
+
+void
+event_base_free(event_base_t *base)
+{
+	IF_NULL_RETURN(base);
+	IF_TRUE_RETURN(base == &event_base_default);
+
+	event_base_reset(base);
+
+	if (base->epoll_fd >= 0 && close(base->epoll_fd) < 0)
+		WARN_ERRNO("Failed to close epoll fd of event base %p", (void *)base);
+
+	if (event_base_thread == base)
+		event_base_thread = NULL;
+
+	mem_free0(base);
+}
+
+void
+event_base_set_current(event_base_t *base)
+{
+	event_base_thread = base;
+}
+
 event_io_t *
 event_io_new(int fd, unsigned events,
 	     void (*func)(int fd, unsigned events, event_io_t *io, void *data), void *data)
@@ -374,6 +731,8 @@ event_io_new(int fd, unsigned events,
 	io->data = data;
 	io->fd = fd;
 	io->events = events;
+	io->base = NULL;
+	io->internal = false;
 
 	return io;
 }
@@ -386,52 +745,97 @@ event_io_free(event_io_t *io)
 	mem_free0(io);
 }
 
-void
-event_add_io(event_io_t *io)
+static void
+event_io_epoll_event(const event_io_t *io, struct epoll_event *epoll_event)
 {
-	struct epoll_event epoll_event;
+	epoll_event->events = 0;
+	epoll_event->events |= (io->events & EVENT_IO_READ) ? EPOLLIN : 0;
+	epoll_event->events |= (io->events & EVENT_IO_WRITE) ? EPOLLOUT : 0;
+	epoll_event->events |= (io->events & EVENT_IO_PRI) ? EPOLLPRI : 0;
+	epoll_event->events |= (io->events & EVENT_IO_EDGE) ? EPOLLET : 0;
+	epoll_event->events |= (io->events & EVENT_IO_ONESHOT) ? EPOLLONESHOT : 0;
+	epoll_event->data.ptr = (void *)io;
+}
 
-	IF_NULL_RETURN(io);
+static void
+event_base_add_io(event_base_t *base, event_io_t *io)
+{
+	struct epoll_event epoll_event;
 
-	epoll_event.events = 0;
-	epoll_event.events |= (io->events & EVENT_IO_READ) ? EPOLLIN : 0;
-	epoll_event.events |= (io->events & EVENT_IO_WRITE) ? EPOLLOUT : 0;
-	epoll_event.events |= (io->events & EVENT_IO_PRI) ? EPOLLPRI : 0;
-	epoll_event.data.ptr = io;
+	event_io_epoll_event(io, &epoll_event);
 
-	if (epoll_ctl(event_epoll_fd(0), EPOLL_CTL_ADD, io->fd, &epoll_event) < 0)
+	if (epoll_ctl(event_epoll_fd(base, 0), EPOLL_CTL_ADD, io->fd, &epoll_event) < 0) {
 		WARN_ERRNO("epoll_ctl failed"); // TODO: handle error?
-	else
-		event_io_active++;
+	} else {
+		base->io_active++;
+		if (io->internal)
+			base->io_internal++;
+		io->base = base;
+	}
 
 	TRACE("Added io event %p (func=%p, data=%p, fd=%d, events=0x%x)", (void *)io,
 	      CAST_FUNCPTR_VOIDPTR io->func, io->data, io->fd, io->events);
 }
 
+void
+event_add_io(event_io_t *io)
+{
+	IF_NULL_RETURN(io);
+
+	event_base_add_io(event_base_current(), io);
+}
+
 void
 event_remove_io(event_io_t *io)
 {
 	IF_NULL_RETURN(io);
 	TRACE("Removing io event %p", (void *)io);
 
-	if (epoll_ctl(event_epoll_fd(0), EPOLL_CTL_DEL, io->fd, NULL) < 0)
+	event_base_t *base = io->base ? io->base : event_base_current();
+
+	if (epoll_ctl(event_epoll_fd(base, 0), EPOLL_CTL_DEL, io->fd, NULL) < 0) {
 		WARN_ERRNO("epoll_ctl failed"); // TODO: handle error?
-	else
-		event_io_active--;
+	} else {
+		base->io_active--;
+		if (io->internal)
+			base->io_internal--;
+		io->base = NULL;
+	}
 
 	TRACE("Removed io event %p (func=%p, data=%p, fd=%d, events=0x%x)", (void *)io,
 	      CAST_FUNCPTR_VOIDPTR io->func, io->data, io->fd, io->events);
 	//TODO unlink?
 }
 
+int
+event_rearm_io(event_io_t *io)
+{
+	struct epoll_event epoll_event;
+
+	IF_NULL_RETVAL(io, -1);
+
+	event_base_t *base = io->base ? io->base : event_base_current();
+
+	event_io_epoll_event(io, &epoll_event);
+
+	if (epoll_ctl(event_epoll_fd(base, 0), EPOLL_CTL_MOD, io->fd, &epoll_event) < 0) {
+		WARN_ERRNO("epoll_ctl failed");
+		return -1;
+	}
+
+	TRACE("Rearmed io event %p (func=%p, data=%p, fd=%d, events=0x%x)", (void *)io,
+	      CAST_FUNCPTR_VOIDPTR io->func, io->data, io->fd, io->events);
+	return 0;
+}
+
 static int
-event_epoll(int timeout)
+event_epoll(event_base_t *base, int timeout)
 {
 	struct epoll_event epoll_events[128];
 	int n, i;
 
 	TRACE("Calling epoll_wait with timeout=%ums", timeout);
-	n = epoll_wait(event_epoll_fd(0), epoll_events, ELEMENTSOF(epoll_events), timeout);
+	n = epoll_wait(event_epoll_fd(base, 0), epoll_events, ELEMENTSOF(epoll_events), timeout);
 	if (n < 0) {
 		if (errno == EINTR) // caused by suspend (no real error)
 			TRACE_ERRNO("epoll_wait interrupted by system");
@@ -457,7 +861,22 @@ event_epoll(int timeout)
 			      (void *)io, CAST_FUNCPTR_VOIDPTR io->func, io->data, io->fd,
 			      io->events);
 
-			(io->func)(io->fd, e, io, io->data);
+			// internal io events account their callbacks by themselves
+			if (!io->internal)
+				base->dispatched[EVENT_PROFILE_IO]++;
+			PROBE2(event_dispatch, EVENT_PROFILE_IO, CAST_FUNCPTR_VOIDPTR io->func);
+			if (base->profile && !io->internal) {
+				// io->func might free the io event
+				void *func = CAST_FUNCPTR_VOIDPTR io->func;
+				struct timespec start;
+
+				timespec_now(&start);
+				(io->func)(io->fd, e, io, io->data);
+				event_profile_record(base, EVENT_PROFILE_IO, func, &start);
+			} else {
+				(io->func)(io->fd, e, io, io->data);
+			}
+			PROBE1(event_dispatch_done, EVENT_PROFILE_IO);
 
 			TRACE("Finished io handling");
 		}
@@ -468,10 +887,41 @@ event_epoll(int timeout)
 
 /******************************************************************************/
 
+/* Inotify events are indexed by their watch descriptor, so that an event read
+ * from the inotify fd only visits the handlers registered for its wd. Several
+ * handlers on the same path share a wd and are kept in one list per wd. */
+static list_t *
+event_inotify_lookup(event_base_t *base, int wd)
+{
+	return hashmap_get(base->inotify_map, &wd, sizeof(wd));
+}
+
+static void
+event_inotify_index(event_base_t *base, event_inotify_t *inotify)
+{
+	if (!base->inotify_map)
+		base->inotify_map = hashmap_new();
+
+	list_t *list = event_inotify_lookup(base, inotify->wd);
+	list = list_append(list, inotify);
+	hashmap_put(base->inotify_map, &inotify->wd, sizeof(inotify->wd), list);
+}
+
+static void
+event_inotify_unindex(event_base_t *base, event_inotify_t *inotify)
+{
+	list_t *list = event_inotify_lookup(base, inotify->wd);
+	list = list_remove(list, inotify);
+	if (list)
+		hashmap_put(base->inotify_map, &inotify->wd, sizeof(inotify->wd), list);
+	else
+		hashmap_remove(base->inotify_map, &inotify->wd, sizeof(inotify->wd));
+}
+
 static void
-event_inotify_handler(int wd, const char *path, uint32_t mask)
+event_inotify_handler(event_base_t *base, int wd, const char *path, uint32_t mask)
 {
-	for (list_t *l = event_inotify_list; l; l = l->next) {
+	for (list_t *l = event_inotify_lookup(base, wd); l; l = l->next) {
 		event_inotify_t *inotify = l->data;
 
 		ASSERT(inotify);
@@ -480,7 +930,7 @@ event_inotify_handler(int wd, const char *path, uint32_t mask)
 		inotify->todo = true;
 	}
 
-	for (list_t *l = event_inotify_list; l;) {
+	for (list_t *l = event_inotify_lookup(base, wd); l;) {
 		event_inotify_t *inotify = l->data;
 
 		ASSERT(inotify);
@@ -494,6 +944,15 @@ event_inotify_handler(int wd, const char *path, uint32_t mask)
 			      (void *)inotify, CAST_FUNCPTR_VOIDPTR inotify->func, inotify->data,
 			      wd, inotify->path, inotify->mask);
 
+			// inotify->func might free the inotify event
+			void *func = CAST_FUNCPTR_VOIDPTR inotify->func;
+			bool profile = base->profile;
+			struct timespec start;
+			base->dispatched[EVENT_PROFILE_INOTIFY]++;
+			PROBE2(event_dispatch, EVENT_PROFILE_INOTIFY, func);
+			if (profile)
+				timespec_now(&start);
+
 			if (path) {
 				char *full_path = mem_printf("%s/%s", inotify->path, path);
 				(inotify->func)(full_path, mask, inotify, inotify->data);
@@ -502,12 +961,13 @@ event_inotify_handler(int wd, const char *path, uint32_t mask)
 				(inotify->func)(inotify->path, mask, inotify, inotify->data);
 			}
 
-			// inotify->func might modify the inotify list
+			if (profile)
+				event_profile_record(base, EVENT_PROFILE_INOTIFY, func, &start);
+			PROBE1(event_dispatch_done, EVENT_PROFILE_INOTIFY);
+
+			// inotify->func might modify the list of this wd
 			// so we will start again at its head
-			if (event_inotify_list)
-				l = event_inotify_list;
-			else
-				break;
+			l = event_inotify_lookup(base, wd);
 		} else {
 			l = l->next;
 		}
@@ -515,9 +975,11 @@ event_inotify_handler(int wd, const char *path, uint32_t mask)
 }
 
 static void
-event_inotify_cb(int fd, unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+event_inotify_cb(int fd, unsigned events, UNUSED event_io_t *io, void *data)
 {
-	char buf[(8 * (sizeof(struct inotify_event) + NAME_MAX + 1))] __attribute__((aligned(8)));
+	/* drain a burst of events with a single read, inotify events
+	 * are much smaller than this buffer as long as they carry no name */
+	char buf[64 * 1024] __attribute__((aligned(8)));
 	char *p;
 	ssize_t n;
 
@@ -552,24 +1014,24 @@ event_inotify_cb(int fd, unsigned events, UNUSED event_io_t *io, UNUSED void *da
 		      e->mask & IN_Q_OVERFLOW ? "IN_Q_OVERFLOW " : "",
 		      e->mask & IN_IGNORED ? "IN_IGNORED " : "", e->wd, e->mask, e->cookie, name);
 
-		event_inotify_handler(e->wd, name, e->mask);
+		event_inotify_handler(data, e->wd, name, e->mask);
 
 		p += sizeof(struct inotify_event) + e->len;
 	}
 }
 
 static int
-event_inotify_fd(void)
+event_inotify_fd(event_base_t *base)
 {
-	if (event_inotify_io && event_inotify_io->fd >= 0)
-		return event_inotify_io->fd;
+	if (base->inotify_io && base->inotify_io->fd >= 0)
+		return base->inotify_io->fd;
 
-	int fd = inotify_init();
+	int fd = inotify_init1(IN_CLOEXEC);
 	if (fd < 0)
 		FATAL_ERRNO("Could not init inotify");
 
-	event_io_t *io = event_io_new(fd, EVENT_IO_READ, &event_inotify_cb, NULL);
-	event_add_io(io);
+	base->inotify_io = event_io_new(fd, EVENT_IO_READ, &event_inotify_cb, base);
+	event_add_io(base->inotify_io);
 
 	return fd;
 }
@@ -592,6 +1054,7 @@ event_inotify_new(const char *path, uint32_t mask,
 	inotify->mask = mask;
 	inotify->wd = -1;
 	inotify->todo = false;
+	inotify->base = NULL;
 
 	return inotify;
 }
@@ -612,14 +1075,18 @@ event_add_inotify(event_inotify_t *inotify)
 {
 	IF_NULL_RETVAL(inotify, -1);
 
-	inotify->wd =
-		inotify_add_watch(event_inotify_fd(), inotify->path, inotify->mask | IN_MASK_ADD);
+	event_base_t *base = event_base_current();
+
+	inotify->wd = inotify_add_watch(event_inotify_fd(base), inotify->path,
+					inotify->mask | IN_MASK_ADD);
 	if (inotify->wd < 0) {
 		WARN_ERRNO("Could not add inotify watch for %s", inotify->path);
 		return -1;
 	}
 
-	event_inotify_list = list_append(event_inotify_list, inotify);
+	base->inotify_list = list_append(base->inotify_list, inotify);
+	event_inotify_index(base, inotify);
+	inotify->base = base;
 
 	TRACE("Added inotify event %p (func=%p, data=%p, wd=%d, path=%s, mask=0x%08x)",
 	      (void *)inotify, CAST_FUNCPTR_VOIDPTR inotify->func, inotify->data, inotify->wd,
@@ -634,30 +1101,36 @@ event_remove_inotify(event_inotify_t *inotify)
 	IF_NULL_RETURN(inotify);
 
 	TRACE("Removing inotify event %p", (void *)inotify);
-	event_inotify_list = list_remove(event_inotify_list, inotify);
 
-	/* walk through list and check if there are other handlers on the same
-	 * watch descriptor */
-	bool others = false;
-	for (list_t *l = event_inotify_list; l; l = l->next) {
+	event_base_t *base = inotify->base ? inotify->base : event_base_current();
+	base->inotify_list = list_remove(base->inotify_list, inotify);
+	event_inotify_unindex(base, inotify);
+	inotify->base = NULL;
+
+	/* check if there are other handlers on the same watch descriptor,
+	 * re-adding their watches resets the mask of the wd to their union */
+	list_t *others = hashmap_remove(base->inotify_map, &inotify->wd, sizeof(inotify->wd));
+	bool shared = others != NULL;
+	for (list_t *l = others; l; l = l->next) {
 		event_inotify_t *inotify_cur = l->data;
-		if (inotify_cur->wd == inotify->wd) {
-			if (!others)
-				/* If the handler is the first of the others it should overwrite the mask */
-				inotify_cur->wd = inotify_add_watch(
-					event_inotify_fd(), inotify_cur->path, inotify_cur->mask);
-			else
-				/* There was already another handler which reset the mask, so we add now */
-				inotify_cur->wd =
-					inotify_add_watch(event_inotify_fd(), inotify_cur->path,
-							  inotify_cur->mask | IN_MASK_ADD);
-			others = true;
-		}
+		if (l == others)
+			/* If the handler is the first of the others it should overwrite the mask */
+			inotify_cur->wd =
+				inotify_add_watch(event_inotify_fd(base), inotify_cur->path,
+						  inotify_cur->mask);
+		else
+			/* There was already another handler which reset the mask, so we add now */
+			inotify_cur->wd =
+				inotify_add_watch(event_inotify_fd(base), inotify_cur->path,
+						  inotify_cur->mask | IN_MASK_ADD);
+		if (inotify_cur->wd >= 0)
+			event_inotify_index(base, inotify_cur);
 	}
+	list_delete(others);
 
-	if (!others) {
+	if (!shared) {
 		/* If there were no other handlers with the same watch descriptor we remove it completely */
-		if (inotify_rm_watch(event_inotify_fd(), inotify->wd) < 0) {
+		if (inotify_rm_watch(event_inotify_fd(base), inotify->wd) < 0) {
 			WARN_ERRNO("Could not remove inotify watch for %s", inotify->path);
 			return;
 		}
@@ -701,7 +1174,8 @@ event_add_signal(event_signal_t *sig)
 {
 	IF_NULL_RETURN(sig);
 
-	event_signal_list = list_append(event_signal_list, sig);
+	event_signal_lists[sig->signum] = list_append(event_signal_lists[sig->signum], sig);
+	event_signal_count++;
 
 	TRACE("Added signal event %p (func=%p, data=%p, signal=%d (%s))", (void *)sig,
 	      CAST_FUNCPTR_VOIDPTR sig->func, sig->data, sig->signum, strsignal(sig->signum));
@@ -713,31 +1187,20 @@ event_remove_signal(event_signal_t *sig)
 	IF_NULL_RETURN(sig);
 
 	TRACE("Removing signal event %p from list", (void *)sig);
-	event_signal_list = list_remove(event_signal_list, sig);
+	list_t *elem = list_find(event_signal_lists[sig->signum], sig);
+	IF_NULL_RETURN(elem);
+
+	event_signal_lists[sig->signum] = list_unlink(event_signal_lists[sig->signum], elem);
+	event_signal_count--;
 
 	TRACE("Removed signal event %p (func=%p, data=%p, signal=%d (%s))", (void *)sig,
 	      CAST_FUNCPTR_VOIDPTR sig->func, sig->data, sig->signum, strsignal(sig->signum));
 }
 
 static void
-event_signal_handler(void)
+event_signal_dispatch(int signum)
 {
-	bool *received;
-
-	TRACE("event_signal_handler() called");
-
-	/* We have two arrays to allow atomic switching from one array to the
-	 * other to guarantee that we do not miss signals entirely. It is still
-	 * possible that the handler is only called once for multiple signals
-	 * of the same type.
-	 */
-	received = event_signal_received;
-	if (event_signal_received == event_signal_received0)
-		event_signal_received = event_signal_received1;
-	else
-		event_signal_received = event_signal_received0;
-
-	for (list_t *l = event_signal_list; l; l = l->next) {
+	for (list_t *l = event_signal_lists[signum]; l; l = l->next) {
 		event_signal_t *sig = l->data;
 
 		ASSERT(sig);
@@ -746,35 +1209,247 @@ event_signal_handler(void)
 		sig->todo = true;
 	}
 
-	for (list_t *l = event_signal_list; l;) {
+	for (list_t *l = event_signal_lists[signum]; l;) {
 		event_signal_t *sig = l->data;
 
 		ASSERT(sig);
-		ASSERT(sig->signum > 0);
-		ASSERT(sig->signum < NSIG);
+		ASSERT(sig->signum == signum);
 
-		if (sig->todo && received[sig->signum]) {
+		if (sig->todo) {
 			sig->todo = false;
 
 			TRACE("Handling signal event %p (func=%p, data=%p, signal=%d (%s))",
 			      (void *)sig, CAST_FUNCPTR_VOIDPTR sig->func, sig->data, sig->signum,
 			      strsignal(sig->signum));
 
-			(sig->func)(sig->signum, sig, sig->data);
+			event_base_default.dispatched[EVENT_PROFILE_SIGNAL]++;
+			PROBE2(event_dispatch, EVENT_PROFILE_SIGNAL, CAST_FUNCPTR_VOIDPTR sig->func);
+			if (event_base_default.profile) {
+				// sig->func might free the signal event
+				void *func = CAST_FUNCPTR_VOIDPTR sig->func;
+				struct timespec start;
+
+				timespec_now(&start);
+				(sig->func)(sig->signum, sig, sig->data);
+				event_profile_record(&event_base_default, EVENT_PROFILE_SIGNAL,
+						     func, &start);
+			} else {
+				(sig->func)(sig->signum, sig, sig->data);
+			}
+			PROBE1(event_dispatch_done, EVENT_PROFILE_SIGNAL);
 
 			// sig->func might modify the signal list
 			// so we will start again at its head
-			if (event_signal_list)
-				l = event_signal_list;
+			if (event_signal_lists[signum])
+				l = event_signal_lists[signum];
 			else
 				break;
 		} else {
 			l = l->next;
 		}
 	}
+}
+
+static void
+event_signal_cb(int fd, unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+{
+	char buf[64];
+
+	TRACE("event_signal_cb() called");
+
+	if (!(events & EVENT_IO_READ))
+		return;
 
-	for (int i = 0; i < NSIG; i++)
-		received[i] = false;
+	// drain the pipe, the pending flags tell which signals were received
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+
+	/* It is still possible that a handler is only called once for
+	 * multiple signals of the same type. */
+	for (int i = 1; i < NSIG; i++) {
+		if (!event_signal_pending[i])
+			continue;
+		event_signal_pending[i] = 0;
+		event_signal_dispatch(i);
+	}
+}
+
+static void
+event_signal_pipe_init(void)
+{
+	if (event_signal_io) {
+		if (event_signal_io->base)
+			event_remove_io(event_signal_io);
+		event_io_free(event_signal_io);
+		event_signal_io = NULL;
+	}
+	for (int i = 0; i < 2; i++) {
+		if (event_signal_pipe[i] >= 0)
+			close(event_signal_pipe[i]);
+		event_signal_pipe[i] = -1;
+	}
+
+	int fds[2];
+	if (pipe(fds) < 0)
+		FATAL_ERRNO("Could not create signal pipe");
+
+	for (int i = 0; i < 2; i++) {
+		if (fd_make_non_blocking(fds[i]) < 0)
+			WARN("Could not set signal pipe to non blocking");
+		if (fcntl(fds[i], F_SETFD, FD_CLOEXEC) < 0)
+			WARN_ERRNO("fcntl failed");
+	}
+
+	event_signal_pipe[0] = fds[0];
+	event_signal_pipe[1] = fds[1];
+	event_signal_pid = getpid();
+
+	event_signal_io = event_io_new(fds[0], EVENT_IO_READ, &event_signal_cb, NULL);
+	event_signal_io->internal = true;
+	event_base_add_io(&event_base_default, event_signal_io);
+}
+
+/******************************************************************************/
+
+/**
+ * Reaps the child if it terminated and invokes its callback.
+ * @return true if the child terminated and the callback has been invoked.
+ */
+static bool
+event_child_reap(event_child_t *child)
+{
+	int status = 0;
+	pid_t pid = waitpid(child->pid, &status, WNOHANG);
+
+	if (pid == 0) {
+		TRACE("Child %d did not change its state yet", child->pid);
+		return false;
+	}
+	if (pid < 0) {
+		DEBUG_ERRNO("Could not reap child %d", child->pid);
+		status = -1;
+	} else if (!WIFEXITED(status) && !WIFSIGNALED(status)) {
+		TRACE("Child %d stopped or continued", child->pid);
+		return false;
+	}
+
+	event_remove_child(child);
+
+	TRACE("Handling child event %p (func=%p, data=%p, pid=%d, status=%d)", (void *)child,
+	      CAST_FUNCPTR_VOIDPTR child->func, child->data, child->pid, status);
+
+	(child->func)(child->pid, status, child, child->data);
+	return true;
+}
+
+static void
+event_child_pidfd_cb(UNUSED int fd, UNUSED unsigned events, UNUSED event_io_t *io, void *data)
+{
+	event_child_reap(data);
+}
+
+static void
+event_child_sigchld_cb(UNUSED int signum, UNUSED event_signal_t *sig, UNUSED void *data)
+{
+	// the callback might remove children from the list, thus always restart at its head
+	for (list_t *l = event_child_fallback_list; l;) {
+		event_child_t *child = l->data;
+
+		if (event_child_reap(child))
+			l = event_child_fallback_list;
+		else
+			l = l->next;
+	}
+}
+
+event_child_t *
+event_child_new(pid_t pid, void (*func)(pid_t pid, int status, event_child_t *child, void *data),
+		void *data)
+{
+	event_child_t *child;
+
+	IF_FALSE_RETVAL(pid > 0, NULL);
+	IF_NULL_RETVAL(func, NULL);
+
+	child = mem_new0(event_child_t, 1);
+	child->func = func;
+	child->data = data;
+	child->pid = pid;
+
+	return child;
+}
+
+void
+event_child_free(event_child_t *child)
+{
+	IF_NULL_RETURN(child);
+
+	if (child->added)
+		event_remove_child(child);
+
+	mem_free0(child);
+}
+
+int
+event_add_child(event_child_t *child)
+{
+	IF_NULL_RETVAL(child, -1);
+	IF_TRUE_RETVAL(child->added, -1);
+
+	int fd = syscall(SYS_pidfd_open, child->pid, 0);
+	if (fd >= 0) {
+		if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)
+			WARN_ERRNO("fcntl failed");
+		child->io = event_io_new(fd, EVENT_IO_READ, &event_child_pidfd_cb, child);
+		event_add_io(child->io);
+	} else if (errno == ENOSYS) {
+		TRACE("pidfd not supported, falling back to SIGCHLD");
+		event_child_fallback_list = list_append(event_child_fallback_list, child);
+		if (!event_child_sigchld) {
+			event_child_sigchld =
+				event_signal_new(SIGCHLD, &event_child_sigchld_cb, NULL);
+			event_add_signal(event_child_sigchld);
+		}
+	} else {
+		WARN_ERRNO("Could not open pidfd for child %d", child->pid);
+		return -1;
+	}
+	child->added = true;
+
+	TRACE("Added child event %p (func=%p, data=%p, pid=%d)", (void *)child,
+	      CAST_FUNCPTR_VOIDPTR child->func, child->data, child->pid);
+
+	/* the child might already have terminated before the pidfd was
+	 * opened or before our SIGCHLD handler was registered */
+	if (!child->io)
+		event_child_reap(child);
+
+	return 0;
+}
+
+void
+event_remove_child(event_child_t *child)
+{
+	IF_NULL_RETURN(child);
+	IF_FALSE_RETURN(child->added);
+
+	if (child->io) {
+		event_remove_io(child->io);
+		close(child->io->fd);
+		event_io_free(child->io);
+		child->io = NULL;
+	} else {
+		event_child_fallback_list = list_remove(event_child_fallback_list, child);
+		if (!event_child_fallback_list && event_child_sigchld) {
+			event_remove_signal(event_child_sigchld);
+			event_signal_free(event_child_sigchld);
+			event_child_sigchld = NULL;
+		}
+	}
+	child->added = false;
+
+	TRACE("Removed child event %p (func=%p, data=%p, pid=%d)", (void *)child,
+	      CAST_FUNCPTR_VOIDPTR child->func, child->data, child->pid);
 }
 
 /******************************************************************************/
@@ -789,9 +1464,22 @@ event_sigaction(int signum, const struct sigaction *act, struct sigaction *oldac
 static void
 event_sa_handler(int signum)
 {
-	TRACE("Received signal %d (%s)", signum, strsignal(signum));
+	int saved_errno = errno;
+
 	if (signum < NSIG)
-		event_signal_received[signum] = true;
+		event_signal_pending[signum] = 1;
+
+	/* A forked child which did not reset its event loop yet might still share
+	 * the pipe with us, thus only wake up the loop of the process which
+	 * created the pipe. */
+	if (event_signal_pipe[1] >= 0 && getpid() == event_signal_pid) {
+		char c = (char)signum;
+		if (write(event_signal_pipe[1], &c, 1) < 0) {
+			// pipe is full, the loop will be woken up anyway
+		}
+	}
+
+	errno = saved_errno;
 }
 
 void
@@ -816,29 +1504,40 @@ event_init(void)
 	event_sigaction(SIGUSR2, &action, NULL);
 	event_sigaction(SIGHUP, &action, NULL);
 
+	event_signal_pipe_init();
+
 	event_initialized = true;
 }
 
 void
-event_loop(void)
+event_base_loop(event_base_t *base)
 {
-	if (!event_initialized) {
+	IF_NULL_RETURN(base);
+
+	bool is_default = (base == &event_base_default);
+
+	if (is_default && !event_initialized) {
 		WARN("Called event_loop() without prior initialization through event_init(). Signals might have been lost!.");
 		event_init();
 	}
-	DEBUG("Starting event loop");
+	DEBUG("Starting event loop (base %p)", (void *)base);
 
-	while (event_signal_list || event_timer_list || event_io_active) {
+	while ((is_default && event_signal_count) || base->timer_heap_len ||
+	       base->io_active > base->io_internal) {
 		int timeout;
 
-		event_signal_handler();
-
-		timeout = event_timeout();
-		if (!event_epoll(timeout))
-			event_timeout_handler();
+		timeout = event_timeout(base);
+		if (!event_epoll(base, timeout))
+			event_timeout_handler(base);
 
 		TRACE("Handled event");
 	}
 
-	DEBUG("Leaving event loop");
+	DEBUG("Leaving event loop (base %p)", (void *)base);
+}
+
+void
+event_loop(void)
+{
+	event_base_loop(event_base_current());
 }
@@ -31,12 +31,23 @@
  * registered callback functions for I/O and signal events will be invoked whenever
  * one of the monitored events or signals occur, respectively. Both I/O and signal
  * events will be active until they get explicitly removed.
+ *
+ * Timer, I/O, and inotify events are registered at an event base. By default,
+ * all events are handled by a process-wide default base. A thread may run its
+ * own independent event loop by creating an event base with event_base_new()
+ * and selecting it with event_base_set_current(). All event_add_*() calls of
+ * that thread and event_loop() then use this base. Signal events are always
+ * dispatched by the loop of the default base.
  */
 
 #ifndef EVENT_H
 #define EVENT_H
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
+
+typedef struct event_base event_base_t;
 
 typedef struct event_timer event_timer_t;
 
@@ -84,6 +95,19 @@ event_remove_timer(event_timer_t *timer);
 #define EVENT_IO_EXCEPT (1 << 2)
 #define EVENT_IO_PRI (1 << 3)
 
+/**
+ * Flags which may be or'd to the events given to event_io_new() in order
+ * to change the notification mode of the I/O event.
+ *
+ * EVENT_IO_EDGE requests edge-triggered notification, i.e. the callback is only
+ * invoked if new data arrives. Thus, the callback must drain the fd until it would
+ * block (EAGAIN), which requires a non-blocking fd.
+ * EVENT_IO_ONESHOT disables the I/O event after it has been triggered once. It
+ * has to be re-enabled by calling event_rearm_io().
+ */
+#define EVENT_IO_EDGE (1 << 4)
+#define EVENT_IO_ONESHOT (1 << 5)
+
 typedef struct event_io event_io_t;
 
 /**
@@ -91,7 +115,8 @@ typedef struct event_io event_io_t;
  *
  * @param fd The file descriptor to be monitored.
  * @param events Bitwise-or'd events to be monitored on the fd.
- *               May be a combination of EVENT_IO_READ, EVENT_IO_WRITE, and EVENT_IO_EXCEPT.
+ *               May be a combination of EVENT_IO_READ, EVENT_IO_WRITE, and EVENT_IO_EXCEPT,
+ *               optionally combined with the mode flags EVENT_IO_EDGE and EVENT_IO_ONESHOT.
  * @param func A pointer to the callback function.
  * @param data Payload data to be passed to the callback function.
  * @return The newly created I/O event.
@@ -124,14 +149,63 @@ event_add_io(event_io_t *io);
 void
 event_remove_io(event_io_t *io);
 
+/**
+ * Re-enables an I/O event which was added with the EVENT_IO_ONESHOT flag
+ * after it has been triggered.
+ *
+ * @param io The I/O event to be re-enabled.
+ * @return 0 on success, -1 on error.
+ */
+int
+event_rearm_io(event_io_t *io);
+
 /**
  * Resets the event subsystem to its initial state
  * As this sets all event lists to zero,
- * the event_loop() call currently executing will exit
+ * the event_loop() call currently executing will exit.
+ * Only the event base of the calling thread is reset, signal events
+ * are reset if this is the default base.
  */
 void
 event_reset();
 
+/**
+ * Creates a new event base, i.e., an independent set of timer, I/O and
+ * inotify events with its own event loop.
+ * An event base must only be used by a single thread at a time.
+ *
+ * @return The newly created event base.
+ */
+event_base_t *
+event_base_new(void);
+
+/**
+ * Frees an event base including all timer, I/O and inotify events which are
+ * still registered at it. The default base cannot be freed.
+ *
+ * @param base The event base to be freed.
+ */
+void
+event_base_free(event_base_t *base);
+
+/**
+ * Sets the event base used by the calling thread. Subsequent event_add_*()
+ * and event_loop() calls of this thread operate on this base.
+ *
+ * @param base The event base for this thread or NULL to use the default base.
+ */
+void
+event_base_set_current(event_base_t *base);
+
+/**
+ * Invokes the event loop of the given base. The function returns if there are
+ * no more registered events in the base.
+ *
+ * @param base The event base to run the loop for.
+ */
+void
+event_base_loop(event_base_t *base);
+
 // TODO: doxygen for event_inotify*
 
 typedef struct event_inotify event_inotify_t;
@@ -188,6 +262,54 @@ event_add_signal(event_signal_t *sig);
 void
 event_remove_signal(event_signal_t *sig);
 
+typedef struct event_child event_child_t;
+
+/**
+ * Creates a new child event which is triggered as soon as the child process
+ * with the given pid terminates. The child is reaped before the callback is
+ * invoked. In contrast to a SIGCHLD signal event, only the callback of the
+ * terminated child is invoked.
+ *
+ * @param pid The pid of a child process of the calling process.
+ * @param func A pointer to the callback function, which gets the exit status
+ *             as returned by waitpid(2) or -1 if the child was already reaped
+ *             by someone else.
+ * @param data Payload data to be passed to the callback function.
+ * @return The newly created child event.
+ */
+event_child_t *
+event_child_new(pid_t pid, void (*func)(pid_t pid, int status, event_child_t *child, void *data),
+		void *data);
+
+/**
+ * Frees the allocated memory of the child event.
+ *
+ * @param child The child event to be freed.
+ */
+void
+event_child_free(event_child_t *child);
+
+/**
+ * Adds the child event to the event loop. The event is automatically removed
+ * from the event loop before its callback is invoked, thus the callback may
+ * free the child event.
+ * Uses a pidfd if supported by the kernel, otherwise falls back to a
+ * SIGCHLD signal event.
+ *
+ * @param child The child event to be added;
+ * @return 0 on success, -1 on error.
+ */
+int
+event_add_child(event_child_t *child);
+
+/**
+ * Removes the child event from the event loop.
+ *
+ * @param child The child event to be removed.
+ */
+void
+event_remove_child(event_child_t *child);
+
 /**
  * Initializes the event loop. Should be called before event_add_signal() is used;
  * otherwise, signals that occur before event_loop() is started might be lost and
@@ -204,4 +326,91 @@ event_init(void);
 void
 event_loop(void);
 
+/**
+ * Types of event callbacks distinguished by the profiling of the event loop.
+ */
+typedef enum event_profile_type {
+	EVENT_PROFILE_IO = 0,
+	EVENT_PROFILE_TIMER,
+	EVENT_PROFILE_SIGNAL,
+	EVENT_PROFILE_INOTIFY,
+} event_profile_type_t;
+
+/**
+ * Number of buckets of the callback duration histogram. Bucket 0 counts
+ * callbacks which took less than 1us, bucket i > 0 counts callbacks which
+ * took [2^(i-1), 2^i) us and the last bucket counts all longer callbacks.
+ */
+#define EVENT_PROFILE_BUCKETS 20
+
+/**
+ * Returns the bucket of the duration histogram which counts the given duration,
+ * e.g., to record other durations in histograms of the same layout.
+ *
+ * @param ns The duration in nanoseconds.
+ * @return The index of the bucket, less than EVENT_PROFILE_BUCKETS.
+ */
+unsigned
+event_profile_bucket(uint64_t ns);
+
+/**
+ * Profiling statistics of all invocations of one callback function.
+ */
+typedef struct event_profile_stat {
+	event_profile_type_t type;		   /**< type of the event */
+	const void *func;			   /**< the callback function */
+	uint64_t count;				   /**< number of invocations */
+	uint64_t total_ns;			   /**< accumulated wall time */
+	uint64_t max_ns;			   /**< longest single invocation */
+	uint64_t histogram[EVENT_PROFILE_BUCKETS]; /**< log2 histogram of durations */
+} event_profile_stat_t;
+
+/**
+ * Enables or disables the profiling of the callbacks dispatched by the event
+ * loop of the current thread's event base. Signal callbacks are accounted to
+ * the default base. Recorded statistics are kept when profiling is disabled.
+ *
+ * @param enable true to enable profiling, false to disable it.
+ */
+void
+event_profile_enable(bool enable);
+
+/**
+ * Checks whether profiling is enabled for the current event base.
+ *
+ * @return true if profiling is enabled, false otherwise.
+ */
+bool
+event_profile_is_enabled(void);
+
+/**
+ * Discards all profiling statistics recorded for the current event base.
+ */
+void
+event_profile_reset(void);
+
+/**
+ * Returns a copy of the profiling statistics of the current event base sorted
+ * by the accumulated wall time of the callbacks in descending order.
+ *
+ * @param stats Pointer which is set to the newly allocated array of statistics
+ *		(NULL if there are none). The caller has to free the array.
+ * @return The number of elements in the array.
+ */
+size_t
+event_profile_get_stats(event_profile_stat_t **stats);
+
+/**
+ * Returns the number of callbacks of the given type dispatched by the event loop
+ * of the current thread's event base, regardless of whether profiling is enabled.
+ */
+uint64_t
+event_get_dispatched(event_profile_type_t type);
+
+/**
+ * Returns a human readable name of the given profiling type.
+ */
+const char *
+event_profile_type_to_string(event_profile_type_t type);
+
 #endif /* EVENT_H */
@@ -0,0 +1,392 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "event.h"
+#include "logf.h"
+#include "mem.h"
+#include "macro.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define TEST_TIMER_COUNT 32
+
+static int test_timer_order[TEST_TIMER_COUNT];
+static int test_timer_fired;
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	logf_register(&logf_test_write, stderr);
+	test_timer_fired = 0;
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	event_reset();
+}
+
+static void
+test_timer_cb(event_timer_t *timer, void *data)
+{
+	test_timer_order[test_timer_fired++] = (int)(intptr_t)data;
+	event_remove_timer(timer);
+	event_timer_free(timer);
+}
+
+static MunitResult
+test_timers_fire_in_deadline_order(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// add timers in an order which differs from their expiration order
+	for (int i = 0; i < TEST_TIMER_COUNT; i++) {
+		int timeout = (i * 7) % TEST_TIMER_COUNT;
+		event_timer_t *timer =
+			event_timer_new(timeout, 1, &test_timer_cb, (void *)(intptr_t)timeout);
+		munit_assert_not_null(timer);
+		event_add_timer(timer);
+	}
+
+	event_loop();
+
+	munit_assert_int(test_timer_fired, ==, TEST_TIMER_COUNT);
+	for (int i = 1; i < TEST_TIMER_COUNT; i++)
+		munit_assert_int(test_timer_order[i - 1], <=, test_timer_order[i]);
+
+	return MUNIT_OK;
+}
+
+static void
+test_timer_repeat_cb(event_timer_t *timer, void *data)
+{
+	int *count = data;
+
+	test_timer_fired++;
+	if (++(*count) == 3) {
+		event_remove_timer(timer);
+		event_timer_free(timer);
+	}
+}
+
+static void
+test_timer_never_cb(UNUSED event_timer_t *timer, UNUSED void *data)
+{
+	munit_error("removed timer was fired");
+}
+
+static void
+test_timer_remove_cb(event_timer_t *timer, void *data)
+{
+	event_timer_t *never = data;
+
+	event_remove_timer(never);
+	event_timer_free(never);
+	event_remove_timer(timer);
+	event_timer_free(timer);
+}
+
+static MunitResult
+test_timers_repeat_and_remove(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	int count = 0;
+
+	event_timer_t *repeat =
+		event_timer_new(1, EVENT_TIMER_REPEAT_FOREVER, &test_timer_repeat_cb, &count);
+	event_timer_t *never = event_timer_new(50, 1, &test_timer_never_cb, NULL);
+	event_timer_t *remove = event_timer_new(5, 1, &test_timer_remove_cb, never);
+
+	event_add_timer(never);
+	event_add_timer(repeat);
+	event_add_timer(remove);
+
+	event_loop();
+
+	munit_assert_int(count, ==, 3);
+	munit_assert_int(test_timer_fired, ==, 3);
+
+	return MUNIT_OK;
+}
+
+static void
+test_base_timer_cb(event_timer_t *timer, void *data)
+{
+	int *count = data;
+
+	if (++(*count) == 2) {
+		event_remove_timer(timer);
+		event_timer_free(timer);
+	}
+}
+
+static void *
+test_base_thread(void *data)
+{
+	event_base_t *base = event_base_new();
+	event_base_set_current(base);
+
+	event_add_timer(event_timer_new(1, EVENT_TIMER_REPEAT_FOREVER, &test_base_timer_cb, data));
+	event_loop();
+
+	event_base_free(base);
+	return NULL;
+}
+
+static MunitResult
+test_base_per_thread_loop(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	pthread_t thread;
+	int count = 0;
+
+	// a timer of the default base must not be handled by the thread's loop
+	event_timer_t *never = event_timer_new(0, 1, &test_timer_never_cb, NULL);
+	event_add_timer(never);
+
+	munit_assert_int(pthread_create(&thread, NULL, &test_base_thread, &count), ==, 0);
+	munit_assert_int(pthread_join(thread, NULL), ==, 0);
+	munit_assert_int(count, ==, 2);
+
+	event_remove_timer(never);
+	event_timer_free(never);
+
+	return MUNIT_OK;
+}
+
+static void
+test_signal_cb(int signum, event_signal_t *sig, void *data)
+{
+	int *count = data;
+
+	munit_assert_int(signum, ==, SIGUSR1);
+	(*count)++;
+	event_remove_signal(sig);
+	event_signal_free(sig);
+}
+
+static void
+test_signal_raise_cb(event_timer_t *timer, UNUSED void *data)
+{
+	event_remove_timer(timer);
+	event_timer_free(timer);
+	raise(SIGUSR1);
+}
+
+static MunitResult
+test_signal_dispatch(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	int count = 0, other = 0;
+
+	event_init();
+
+	event_add_signal(event_signal_new(SIGUSR1, &test_signal_cb, &count));
+	event_signal_t *sig2 = event_signal_new(SIGUSR2, &test_signal_cb, &other);
+	event_add_signal(sig2);
+	event_add_timer(event_timer_new(1, 1, &test_signal_raise_cb, NULL));
+
+	// remove the SIGUSR2 handler again, to check that the per signal lists stay intact
+	event_remove_signal(sig2);
+	event_signal_free(sig2);
+
+	event_loop();
+
+	munit_assert_int(count, ==, 1);
+	munit_assert_int(other, ==, 0);
+
+	return MUNIT_OK;
+}
+
+static void
+test_child_cb(pid_t pid, int status, event_child_t *child, void *data)
+{
+	pid_t *expected = data;
+
+	munit_assert_int(pid, ==, *expected);
+	munit_assert_true(WIFEXITED(status));
+	munit_assert_int(WEXITSTATUS(status), ==, 3);
+	test_timer_fired++;
+	event_child_free(child);
+}
+
+static MunitResult
+test_child_watch(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	event_init();
+
+	pid_t pid = fork();
+	munit_assert_int(pid, >=, 0);
+	if (pid == 0) {
+		usleep(1000);
+		_exit(3);
+	}
+
+	event_child_t *child = event_child_new(pid, &test_child_cb, &pid);
+	munit_assert_int(event_add_child(child), ==, 0);
+
+	event_loop();
+
+	munit_assert_int(test_timer_fired, ==, 1);
+
+	return MUNIT_OK;
+}
+
+static void
+test_count_warn_write(logf_prio_t prio, UNUSED const char *msg, void *data)
+{
+	if (prio >= LOGF_PRIO_WARN)
+		(*(int *)data)++;
+}
+
+static MunitResult
+test_reset_in_child(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	event_init();
+
+	pid_t pid = fork();
+	munit_assert_int(pid, >=, 0);
+	if (pid == 0) {
+		int warnings = 0;
+		logf_register(&test_count_warn_write, &warnings);
+		event_reset();
+		_exit(warnings);
+	}
+
+	int status;
+	munit_assert_int(waitpid(pid, &status, 0), ==, pid);
+	munit_assert_true(WIFEXITED(status));
+	munit_assert_int(WEXITSTATUS(status), ==, 0);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_profile_records_callbacks(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	int count = 0;
+	event_profile_stat_t *stats = NULL;
+
+	munit_assert_false(event_profile_is_enabled());
+	event_profile_enable(true);
+
+	event_timer_t *repeat =
+		event_timer_new(1, EVENT_TIMER_REPEAT_FOREVER, &test_timer_repeat_cb, &count);
+	event_add_timer(repeat);
+
+	event_loop();
+
+	munit_assert_size(event_profile_get_stats(&stats), ==, 1);
+	munit_assert_int(stats[0].type, ==, EVENT_PROFILE_TIMER);
+	munit_assert_ptr_equal(stats[0].func, CAST_FUNCPTR_VOIDPTR test_timer_repeat_cb);
+	munit_assert_uint64(stats[0].count, ==, 3);
+	munit_assert_uint64(stats[0].max_ns, <=, stats[0].total_ns);
+
+	uint64_t sum = 0;
+	for (int i = 0; i < EVENT_PROFILE_BUCKETS; i++)
+		sum += stats[0].histogram[i];
+	munit_assert_uint64(sum, ==, 3);
+	mem_free0(stats);
+
+	event_profile_reset();
+	munit_assert_size(event_profile_get_stats(&stats), ==, 0);
+	munit_assert_null(stats);
+
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/timers fire in deadline order",   /* name */
+		test_timers_fire_in_deadline_order, /* test */
+		setup,				    /* setup */
+		tear_down,			    /* tear_down */
+		MUNIT_TEST_OPTION_NONE,		    /* options */
+		NULL				    /* parameters */
+	},
+	{
+		"/timers repeat and can be removed from callbacks", /* name */
+		test_timers_repeat_and_remove,			    /* test */
+		setup,						    /* setup */
+		tear_down,					    /* tear_down */
+		MUNIT_TEST_OPTION_NONE,				    /* options */
+		NULL						    /* parameters */
+	},
+
+	{
+		"/event bases run independent loops per thread", /* name */
+		test_base_per_thread_loop,			 /* test */
+		setup,						 /* setup */
+		tear_down,					 /* tear_down */
+		MUNIT_TEST_OPTION_NONE,				 /* options */
+		NULL						 /* parameters */
+	},
+
+	{
+		"/signals are dispatched through the event loop", /* name */
+		test_signal_dispatch,				  /* test */
+		setup,						  /* setup */
+		tear_down,					  /* tear_down */
+		MUNIT_TEST_OPTION_NONE,				  /* options */
+		NULL						  /* parameters */
+	},
+
+	{
+		"/profiling records callback statistics", /* name */
+		test_profile_records_callbacks,		  /* test */
+		setup,					  /* setup */
+		tear_down,				  /* tear_down */
+		MUNIT_TEST_OPTION_NONE,			  /* options */
+		NULL					  /* parameters */
+	},
+
+	{
+		"/child events are triggered on termination", /* name */
+		test_child_watch,			      /* test */
+		setup,					      /* setup */
+		tear_down,				      /* tear_down */
+		MUNIT_TEST_OPTION_NONE,			      /* options */
+		NULL					      /* parameters */
+	},
+
+	{
+		"/reset in a forked child does not warn", /* name */
+		test_reset_in_child,			  /* test */
+		setup,					  /* setup */
+		tear_down,				  /* tear_down */
+		MUNIT_TEST_OPTION_NONE,			  /* options */
+		NULL					  /* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite event_suite = {
+	"/event",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
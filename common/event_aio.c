@@ -0,0 +1,545 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "event_aio.h"
+
+#include "event.h"
+#include "list.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define EVENT_AIO_URING_ENTRIES 64
+#endif
+
+typedef struct {
+	event_aio_func_t func;
+	void *data;
+	char *path; // copy of the path of openat and statx
+	int res;
+} event_aio_req_t;
+
+/*
+ * Operations are accounted per thread, as every thread runs the loop of its own
+ * event base. The eventfd is polled by the loop while operations are pending and
+ * signals both io_uring completions and operations completed synchronously.
+ */
+typedef struct {
+	pid_t pid; // the context is not shared with forked children
+	int efd;
+	event_io_t *io;
+	unsigned pending; // operations whose callback was not yet invoked
+	list_t *done;	  // synchronously completed requests in order
+#ifdef IO_URING
+	int ring_fd;	   // -1 if io_uring is not used
+	unsigned queued;   // sqes not yet submitted
+	unsigned inflight; // requests owned by the ring, at most the number of cqes
+	uint8_t ops[IORING_OP_LAST];
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	unsigned sq_entries, cq_entries;
+	struct io_uring_cqe *cqes;
+#endif
+} event_aio_ctx_t;
+
+static __thread event_aio_ctx_t *event_aio_ctx = NULL;
+
+static void
+event_aio_dispatch(event_aio_ctx_t *ctx, event_aio_req_t *req)
+{
+	ctx->pending--;
+	if (!ctx->pending)
+		event_remove_io(ctx->io);
+
+	(req->func)(req->res, req->data);
+	mem_free0(req->path);
+	mem_free0(req);
+}
+
+static void
+event_aio_signal(event_aio_ctx_t *ctx)
+{
+	uint64_t one = 1;
+	if (write(ctx->efd, &one, sizeof(one)) < 0)
+		WARN_ERRNO("Failed to signal event_aio eventfd");
+}
+
+/******************************************************************************/
+
+#ifdef IO_URING
+static int
+event_aio_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+event_aio_uring_enter(int fd, unsigned to_submit)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+static int
+event_aio_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void
+event_aio_uring_free(event_aio_ctx_t *ctx)
+{
+	if (ctx->sqes)
+		munmap(ctx->sqes, ctx->sqes_size);
+	if (ctx->cq_ring)
+		munmap(ctx->cq_ring, ctx->cq_ring_size);
+	if (ctx->sq_ring)
+		munmap(ctx->sq_ring, ctx->sq_ring_size);
+	if (ctx->ring_fd >= 0)
+		close(ctx->ring_fd);
+	ctx->sqes = NULL;
+	ctx->cq_ring = NULL;
+	ctx->sq_ring = NULL;
+	ctx->ring_fd = -1;
+}
+
+static void
+event_aio_uring_init(event_aio_ctx_t *ctx)
+{
+	struct io_uring_params p = { 0 };
+
+	ctx->ring_fd = event_aio_uring_setup(EVENT_AIO_URING_ENTRIES, &p);
+	if (ctx->ring_fd < 0) {
+		DEBUG_ERRNO("io_uring not available, executing file operations synchronously");
+		return;
+	}
+
+	ctx->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ctx->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ctx->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ctx->sq_ring = mmap(NULL, ctx->sq_ring_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ctx->ring_fd, IORING_OFF_SQ_RING);
+	ctx->cq_ring = mmap(NULL, ctx->cq_ring_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ctx->ring_fd, IORING_OFF_CQ_RING);
+	ctx->sqes = mmap(NULL, ctx->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			 ctx->ring_fd, IORING_OFF_SQES);
+	if (ctx->sq_ring == MAP_FAILED || ctx->cq_ring == MAP_FAILED || ctx->sqes == MAP_FAILED) {
+		WARN_ERRNO("Failed to map io_uring, executing file operations synchronously");
+		if (ctx->sq_ring == MAP_FAILED)
+			ctx->sq_ring = NULL;
+		if (ctx->cq_ring == MAP_FAILED)
+			ctx->cq_ring = NULL;
+		if (ctx->sqes == MAP_FAILED)
+			ctx->sqes = NULL;
+		event_aio_uring_free(ctx);
+		return;
+	}
+
+	uint8_t *sq = ctx->sq_ring;
+	uint8_t *cq = ctx->cq_ring;
+	ctx->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ctx->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ctx->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ctx->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ctx->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ctx->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ctx->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ctx->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	ctx->sq_entries = p.sq_entries;
+	ctx->cq_entries = p.cq_entries;
+
+	// opcodes not supported by the kernel are executed synchronously
+	size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = mem_alloc0(probe_size);
+	if (!event_aio_uring_register(ctx->ring_fd, IORING_REGISTER_PROBE, probe, 256)) {
+		for (unsigned i = 0; i < probe->ops_len && i < IORING_OP_LAST; i++)
+			ctx->ops[i] = probe->ops[i].flags & IO_URING_OP_SUPPORTED;
+	}
+	mem_free0(probe);
+
+	if (event_aio_uring_register(ctx->ring_fd, IORING_REGISTER_EVENTFD, &ctx->efd, 1) < 0) {
+		WARN_ERRNO("Failed to register io_uring eventfd, not using io_uring");
+		event_aio_uring_free(ctx);
+		return;
+	}
+
+	DEBUG("Using io_uring with %u entries for file operations", ctx->sq_entries);
+}
+
+static void
+event_aio_uring_submit(event_aio_ctx_t *ctx)
+{
+	while (ctx->queued) {
+		int n = event_aio_uring_enter(ctx->ring_fd, ctx->queued);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			// the sqes stay in the ring and are retried on the next wakeup
+			WARN_ERRNO("Failed to submit %u io_uring operations", ctx->queued);
+			if (errno == EAGAIN || errno == EBUSY)
+				event_aio_signal(ctx);
+			return;
+		}
+		ctx->queued -= MIN((unsigned)n, ctx->queued);
+		if (n == 0)
+			break;
+	}
+}
+
+/*
+ * Returns a free sqe for op, or NULL if the operation has to be executed
+ * synchronously because io_uring or op is not supported or the ring is full.
+ */
+static struct io_uring_sqe *
+event_aio_uring_get_sqe(event_aio_ctx_t *ctx, uint8_t op)
+{
+	IF_TRUE_RETVAL(ctx->ring_fd < 0 || !ctx->ops[op], NULL);
+	// every request owned by the ring needs a cqe, which must not overflow
+	IF_TRUE_RETVAL(ctx->inflight >= ctx->cq_entries, NULL);
+
+	unsigned tail = *ctx->sq_tail;
+	if (tail - __atomic_load_n(ctx->sq_head, __ATOMIC_ACQUIRE) >= ctx->sq_entries) {
+		event_aio_uring_submit(ctx);
+		IF_TRUE_RETVAL(tail - __atomic_load_n(ctx->sq_head, __ATOMIC_ACQUIRE) >=
+				       ctx->sq_entries,
+			       NULL);
+	}
+
+	unsigned idx = tail & *ctx->sq_mask;
+	struct io_uring_sqe *sqe = &ctx->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	return sqe;
+}
+
+static void
+event_aio_uring_queue(event_aio_ctx_t *ctx, struct io_uring_sqe *sqe, event_aio_req_t *req)
+{
+	unsigned tail = *ctx->sq_tail;
+
+	sqe->user_data = (uintptr_t)req;
+	ctx->sq_array[tail & *ctx->sq_mask] = sqe - ctx->sqes;
+	__atomic_store_n(ctx->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	// wake up the loop once to submit all operations queued until then at once
+	if (!ctx->queued++)
+		event_aio_signal(ctx);
+	ctx->inflight++;
+}
+
+static void
+event_aio_uring_reap(event_aio_ctx_t *ctx)
+{
+	IF_TRUE_RETURN(ctx->ring_fd < 0);
+
+	for (;;) {
+		unsigned head = *ctx->cq_head;
+		if (head == __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE))
+			break;
+
+		struct io_uring_cqe *cqe = &ctx->cqes[head & *ctx->cq_mask];
+		event_aio_req_t *req = (event_aio_req_t *)(uintptr_t)cqe->user_data;
+		req->res = cqe->res;
+		__atomic_store_n(ctx->cq_head, head + 1, __ATOMIC_RELEASE);
+
+		ctx->inflight--;
+		event_aio_dispatch(ctx, req);
+	}
+}
+#endif /* IO_URING */
+
+/******************************************************************************/
+
+static void
+event_aio_cb(int fd, unsigned events, UNUSED event_io_t *io, void *data)
+{
+	event_aio_ctx_t *ctx = data;
+	uint64_t count;
+
+	IF_FALSE_RETURN(events & EVENT_IO_READ);
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		WARN_ERRNO("Failed to read event_aio eventfd");
+
+#ifdef IO_URING
+	event_aio_uring_submit(ctx);
+	event_aio_uring_reap(ctx);
+#endif
+
+	// requests completed by callbacks invoked below are dispatched on the next wakeup
+	list_t *done = ctx->done;
+	ctx->done = NULL;
+	for (list_t *l = done; l; l = l->next)
+		event_aio_dispatch(ctx, l->data);
+	list_delete(done);
+}
+
+static void
+event_aio_ctx_free(event_aio_ctx_t *ctx)
+{
+#ifdef IO_URING
+	event_aio_uring_free(ctx);
+#endif
+	// the io event belongs to the event loop of the parent
+	event_io_free(ctx->io);
+	close(ctx->efd);
+	mem_free0(ctx);
+}
+
+static event_aio_ctx_t *
+event_aio_ctx_get(void)
+{
+	if (event_aio_ctx && event_aio_ctx->pid != getpid()) {
+		event_aio_ctx_free(event_aio_ctx);
+		event_aio_ctx = NULL;
+	}
+	if (event_aio_ctx)
+		return event_aio_ctx;
+
+	int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	IF_TRUE_RETVAL_ERROR_ERRNO(efd < 0, NULL);
+
+	event_aio_ctx_t *ctx = mem_new0(event_aio_ctx_t, 1);
+	ctx->pid = getpid();
+	ctx->efd = efd;
+	ctx->io = event_io_new(efd, EVENT_IO_READ, event_aio_cb, ctx);
+#ifdef IO_URING
+	ctx->ring_fd = -1;
+	event_aio_uring_init(ctx);
+#endif
+	event_aio_ctx = ctx;
+	return ctx;
+}
+
+static event_aio_req_t *
+event_aio_req_new(event_aio_ctx_t *ctx, event_aio_func_t func, void *data)
+{
+	event_aio_req_t *req = mem_new0(event_aio_req_t, 1);
+	req->func = func;
+	req->data = data;
+
+	// the loop polls the eventfd as long as any operation is pending
+	if (!ctx->pending++)
+		event_add_io(ctx->io);
+	return req;
+}
+
+/*
+ * Completes a request which was executed synchronously, res being the return value
+ * of the system call. The callback is invoked from the event loop.
+ */
+static void
+event_aio_complete(event_aio_ctx_t *ctx, event_aio_req_t *req, long res)
+{
+	req->res = res < 0 ? -errno : (int)res;
+
+	if (!ctx->done)
+		event_aio_signal(ctx);
+	ctx->done = list_append(ctx->done, req);
+}
+
+int
+event_aio_read(int fd, void *buf, size_t len, off_t offset, event_aio_func_t func, void *data)
+{
+	IF_NULL_RETVAL(func, -1);
+	event_aio_ctx_t *ctx = event_aio_ctx_get();
+	IF_NULL_RETVAL(ctx, -1);
+
+	event_aio_req_t *req = event_aio_req_new(ctx, func, data);
+	len = MIN(len, (size_t)INT_MAX);
+#ifdef IO_URING
+	struct io_uring_sqe *sqe = event_aio_uring_get_sqe(ctx, IORING_OP_READ);
+	if (sqe) {
+		sqe->fd = fd;
+		sqe->addr = (uintptr_t)buf;
+		sqe->len = len;
+		sqe->off = offset < 0 ? (uint64_t)-1 : (uint64_t)offset;
+		event_aio_uring_queue(ctx, sqe, req);
+		return 0;
+	}
+#endif
+	event_aio_complete(ctx, req, offset < 0 ? read(fd, buf, len) : pread(fd, buf, len, offset));
+	return 0;
+}
+
+int
+event_aio_write(int fd, const void *buf, size_t len, off_t offset, event_aio_func_t func,
+		void *data)
+{
+	IF_NULL_RETVAL(func, -1);
+	event_aio_ctx_t *ctx = event_aio_ctx_get();
+	IF_NULL_RETVAL(ctx, -1);
+
+	event_aio_req_t *req = event_aio_req_new(ctx, func, data);
+	len = MIN(len, (size_t)INT_MAX);
+#ifdef IO_URING
+	struct io_uring_sqe *sqe = event_aio_uring_get_sqe(ctx, IORING_OP_WRITE);
+	if (sqe) {
+		sqe->fd = fd;
+		sqe->addr = (uintptr_t)buf;
+		sqe->len = len;
+		sqe->off = offset < 0 ? (uint64_t)-1 : (uint64_t)offset;
+		event_aio_uring_queue(ctx, sqe, req);
+		return 0;
+	}
+#endif
+	event_aio_complete(ctx, req,
+			   offset < 0 ? write(fd, buf, len) : pwrite(fd, buf, len, offset));
+	return 0;
+}
+
+int
+event_aio_openat(int dirfd, const char *path, int flags, mode_t mode, event_aio_func_t func,
+		 void *data)
+{
+	IF_NULL_RETVAL(path, -1);
+	IF_NULL_RETVAL(func, -1);
+	event_aio_ctx_t *ctx = event_aio_ctx_get();
+	IF_NULL_RETVAL(ctx, -1);
+
+	event_aio_req_t *req = event_aio_req_new(ctx, func, data);
+	req->path = mem_strdup(path);
+#ifdef IO_URING
+	struct io_uring_sqe *sqe = event_aio_uring_get_sqe(ctx, IORING_OP_OPENAT);
+	if (sqe) {
+		sqe->fd = dirfd;
+		sqe->addr = (uintptr_t)req->path;
+		sqe->len = mode;
+		sqe->open_flags = flags;
+		event_aio_uring_queue(ctx, sqe, req);
+		return 0;
+	}
+#endif
+	event_aio_complete(ctx, req, openat(dirfd, req->path, flags, mode));
+	return 0;
+}
+
+int
+event_aio_statx(int dirfd, const char *path, int flags, unsigned int mask,
+		struct statx *statxbuf, event_aio_func_t func, void *data)
+{
+	IF_NULL_RETVAL(path, -1);
+	IF_NULL_RETVAL(statxbuf, -1);
+	IF_NULL_RETVAL(func, -1);
+	event_aio_ctx_t *ctx = event_aio_ctx_get();
+	IF_NULL_RETVAL(ctx, -1);
+
+	event_aio_req_t *req = event_aio_req_new(ctx, func, data);
+	req->path = mem_strdup(path);
+#ifdef IO_URING
+	struct io_uring_sqe *sqe = event_aio_uring_get_sqe(ctx, IORING_OP_STATX);
+	if (sqe) {
+		sqe->fd = dirfd;
+		sqe->addr = (uintptr_t)req->path;
+		sqe->len = mask;
+		sqe->off = (uintptr_t)statxbuf;
+		sqe->statx_flags = flags;
+		event_aio_uring_queue(ctx, sqe, req);
+		return 0;
+	}
+#endif
+	event_aio_complete(ctx, req, statx(dirfd, req->path, flags, mask, statxbuf));
+	return 0;
+}
+
+int
+event_aio_fsync(int fd, bool datasync, event_aio_func_t func, void *data)
+{
+	IF_NULL_RETVAL(func, -1);
+	event_aio_ctx_t *ctx = event_aio_ctx_get();
+	IF_NULL_RETVAL(ctx, -1);
+
+	event_aio_req_t *req = event_aio_req_new(ctx, func, data);
+#ifdef IO_URING
+	struct io_uring_sqe *sqe = event_aio_uring_get_sqe(ctx, IORING_OP_FSYNC);
+	if (sqe) {
+		sqe->fd = fd;
+		sqe->fsync_flags = datasync ? IORING_FSYNC_DATASYNC : 0;
+		event_aio_uring_queue(ctx, sqe, req);
+		return 0;
+	}
+#endif
+	event_aio_complete(ctx, req, datasync ? fdatasync(fd) : fsync(fd));
+	return 0;
+}
+
+int
+event_aio_splice(int fd_in, off_t off_in, int fd_out, off_t off_out, size_t len,
+		 unsigned int flags, event_aio_func_t func, void *data)
+{
+	IF_NULL_RETVAL(func, -1);
+	event_aio_ctx_t *ctx = event_aio_ctx_get();
+	IF_NULL_RETVAL(ctx, -1);
+
+	event_aio_req_t *req = event_aio_req_new(ctx, func, data);
+	len = MIN(len, (size_t)INT_MAX);
+#ifdef IO_URING
+	struct io_uring_sqe *sqe = event_aio_uring_get_sqe(ctx, IORING_OP_SPLICE);
+	if (sqe) {
+		sqe->fd = fd_out;
+		sqe->off = off_out < 0 ? (uint64_t)-1 : (uint64_t)off_out;
+		sqe->splice_fd_in = fd_in;
+		sqe->splice_off_in = off_in < 0 ? (uint64_t)-1 : (uint64_t)off_in;
+		sqe->len = len;
+		sqe->splice_flags = flags;
+		event_aio_uring_queue(ctx, sqe, req);
+		return 0;
+	}
+#endif
+	loff_t in = off_in, out = off_out;
+	event_aio_complete(ctx, req,
+			   splice(fd_in, off_in < 0 ? NULL : &in, fd_out, off_out < 0 ? NULL : &out,
+				  len, flags));
+	return 0;
+}
+
+bool
+event_aio_uses_io_uring(void)
+{
+#ifdef IO_URING
+	event_aio_ctx_t *ctx = event_aio_ctx_get();
+	return ctx && ctx->ring_fd >= 0;
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,122 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file event_aio.h
+ *
+ * Asynchronous file operations which complete via callbacks on the event loop of
+ * the calling thread, e.g., to overlap file I/O of the event loop without threads.
+ *
+ * If compiled with IO_URING and supported by the kernel, the operations are queued
+ * to an io_uring of the calling thread. All operations queued by the callbacks of one
+ * loop iteration are submitted by a single io_uring_enter() and their completions are
+ * signaled to the loop by an eventfd. Otherwise, or if the ring is full, an operation
+ * is executed synchronously, but its callback is still invoked from the loop.
+ *
+ * Buffers passed to an operation have to stay valid until its callback was invoked.
+ * The event loop keeps running as long as operations are pending.
+ */
+
+#ifndef EVENT_AIO_H
+#define EVENT_AIO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// defined by sys/stat.h with _GNU_SOURCE
+struct statx;
+
+/**
+ * Completion callback of an operation.
+ *
+ * @param res The result of the corresponding system call on success
+ *            or the negative errno value on failure.
+ * @param data Payload data given to the operation.
+ */
+typedef void (*event_aio_func_t)(int res, void *data);
+
+/**
+ * Reads up to len bytes from fd at offset, or at the current file position if
+ * offset is -1, like pread(2) or read(2).
+ *
+ * @return 0 if the operation was queued, -1 otherwise (func is not invoked).
+ */
+int
+event_aio_read(int fd, void *buf, size_t len, off_t offset, event_aio_func_t func, void *data);
+
+/**
+ * Writes up to len bytes to fd at offset, or at the current file position if
+ * offset is -1, like pwrite(2) or write(2).
+ *
+ * @return 0 if the operation was queued, -1 otherwise (func is not invoked).
+ */
+int
+event_aio_write(int fd, const void *buf, size_t len, off_t offset, event_aio_func_t func,
+		void *data);
+
+/**
+ * Opens path relative to dirfd like openat(2), res is the new file descriptor.
+ * The path is copied and need not stay valid.
+ *
+ * @return 0 if the operation was queued, -1 otherwise (func is not invoked).
+ */
+int
+event_aio_openat(int dirfd, const char *path, int flags, mode_t mode, event_aio_func_t func,
+		 void *data);
+
+/**
+ * Retrieves the status of path relative to dirfd like statx(2) into statxbuf.
+ * The path is copied and need not stay valid.
+ *
+ * @return 0 if the operation was queued, -1 otherwise (func is not invoked).
+ */
+int
+event_aio_statx(int dirfd, const char *path, int flags, unsigned int mask,
+		struct statx *statxbuf, event_aio_func_t func, void *data);
+
+/**
+ * Flushes fd to disk like fsync(2) or, if datasync is set, like fdatasync(2).
+ *
+ * @return 0 if the operation was queued, -1 otherwise (func is not invoked).
+ */
+int
+event_aio_fsync(int fd, bool datasync, event_aio_func_t func, void *data);
+
+/**
+ * Moves up to len bytes from fd_in to fd_out like splice(2). An offset of -1
+ * denotes the current file position or a pipe.
+ *
+ * @return 0 if the operation was queued, -1 otherwise (func is not invoked).
+ */
+int
+event_aio_splice(int fd_in, off_t off_in, int fd_out, off_t off_out, size_t len,
+		 unsigned int flags, event_aio_func_t func, void *data);
+
+/**
+ * Returns whether the operations of the calling thread are executed by io_uring.
+ */
+bool
+event_aio_uses_io_uring(void);
+
+#endif /* EVENT_AIO_H */
@@ -0,0 +1,251 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "munit.h"
+
+#include "event_aio.h"
+#include "event.h"
+#include "logf.h"
+#include "mem.h"
+#include "macro.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TEST_WRITES 100
+#define TEST_DATA "event_aio test data"
+
+typedef struct {
+	char path[64];
+	int fd;
+	int step;
+	char buf[64];
+	struct statx stx;
+} test_file_t;
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	event_reset();
+}
+
+/*
+ * Chains openat, write, fsync, statx and read, each started by the callback of
+ * the former operation.
+ */
+static void
+test_file_cb(int res, void *data)
+{
+	test_file_t *t = data;
+
+	switch (t->step++) {
+	case 0:
+		munit_assert_int(res, >=, 0);
+		t->fd = res;
+		munit_assert_int(event_aio_write(t->fd, TEST_DATA, strlen(TEST_DATA), 0,
+						 test_file_cb, t),
+				 ==, 0);
+		break;
+	case 1:
+		munit_assert_int(res, ==, strlen(TEST_DATA));
+		munit_assert_int(event_aio_fsync(t->fd, true, test_file_cb, t), ==, 0);
+		break;
+	case 2:
+		munit_assert_int(res, ==, 0);
+		munit_assert_int(event_aio_statx(AT_FDCWD, t->path, 0, STATX_SIZE, &t->stx,
+						 test_file_cb, t),
+				 ==, 0);
+		break;
+	case 3:
+		munit_assert_int(res, ==, 0);
+		munit_assert_uint64(t->stx.stx_size, ==, strlen(TEST_DATA));
+		munit_assert_int(event_aio_read(t->fd, t->buf, sizeof(t->buf), 0, test_file_cb, t),
+				 ==, 0);
+		break;
+	case 4:
+		munit_assert_int(res, ==, strlen(TEST_DATA));
+		munit_assert_memory_equal(res, t->buf, TEST_DATA);
+		break;
+	default:
+		munit_error("unexpected callback");
+	}
+}
+
+static MunitResult
+test_event_aio_file(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	test_file_t t = { .fd = -1 };
+
+	snprintf(t.path, sizeof(t.path), "/tmp/event_aio.test.%d", getpid());
+	munit_assert_int(event_aio_openat(AT_FDCWD, t.path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+					  0600, test_file_cb, &t),
+			 ==, 0);
+
+	// the callback is never invoked before the loop runs
+	munit_assert_int(t.step, ==, 0);
+	event_loop();
+
+	munit_assert_int(t.step, ==, 5);
+	close(t.fd);
+	unlink(t.path);
+
+	return MUNIT_OK;
+}
+
+static void
+test_count_cb(int res, void *data)
+{
+	int *count = data;
+
+	munit_assert_int(res, ==, 1);
+	(*count)++;
+}
+
+static void
+test_error_cb(int res, void *data)
+{
+	munit_assert_int(res, ==, -EBADF);
+	*(bool *)data = true;
+}
+
+static MunitResult
+test_event_aio_many(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	char path[64];
+	char buf[TEST_WRITES];
+	int count = 0;
+	bool failed = false;
+
+	snprintf(path, sizeof(path), "/tmp/event_aio.test.%d", getpid());
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	munit_assert_int(fd, >=, 0);
+
+	// more operations than the ring holds are queued by a single callback
+	for (int i = 0; i < TEST_WRITES; i++) {
+		buf[i] = 'a' + i % 26;
+		munit_assert_int(event_aio_write(fd, &buf[i], 1, i, test_count_cb, &count), ==, 0);
+	}
+	munit_assert_int(event_aio_read(-1, buf, 1, 0, test_error_cb, &failed), ==, 0);
+	event_loop();
+
+	munit_assert_int(count, ==, TEST_WRITES);
+	munit_assert_true(failed);
+
+	char check[TEST_WRITES];
+	munit_assert_int(pread(fd, check, sizeof(check), 0), ==, sizeof(check));
+	munit_assert_memory_equal(sizeof(check), check, buf);
+
+	close(fd);
+	unlink(path);
+
+	return MUNIT_OK;
+}
+
+static void
+test_splice_cb(int res, void *data)
+{
+	munit_assert_int(res, ==, strlen(TEST_DATA));
+	*(bool *)data = true;
+}
+
+static MunitResult
+test_event_aio_splice(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	char path[64];
+	char buf[64] = { 0 };
+	int pipefd[2];
+	bool done = false;
+
+	snprintf(path, sizeof(path), "/tmp/event_aio.test.%d", getpid());
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	munit_assert_int(fd, >=, 0);
+	munit_assert_int(pipe(pipefd), ==, 0);
+	munit_assert_int(write(pipefd[1], TEST_DATA, strlen(TEST_DATA)), ==, strlen(TEST_DATA));
+
+	munit_assert_int(event_aio_splice(pipefd[0], -1, fd, 0, strlen(TEST_DATA), 0,
+					  test_splice_cb, &done),
+			 ==, 0);
+	event_loop();
+
+	munit_assert_true(done);
+	munit_assert_int(pread(fd, buf, sizeof(buf), 0), ==, strlen(TEST_DATA));
+	munit_assert_string_equal(buf, TEST_DATA);
+
+	close(pipefd[0]);
+	close(pipefd[1]);
+	close(fd);
+	unlink(path);
+
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/file",		/* name */
+		test_event_aio_file,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/many",		/* name */
+		test_event_aio_many,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/splice",		/* name */
+		test_event_aio_splice,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite event_aio_suite = {
+	"/event_aio",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
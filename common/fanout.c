@@ -0,0 +1,108 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "fanout.h"
+
+#include "macro.h"
+#include "mem.h"
+
+struct fanout {
+	size_t n, next;	 // number of items, index of the next one to start
+	size_t parallel; // maximum number of items in flight
+	size_t pending;	 // items in flight
+	bool ok;
+	bool running; // guards against completion while fanout_trigger() iterates
+	fanout_start_cb_t start;
+	fanout_done_cb_t done;
+	void *data;
+};
+
+fanout_t *
+fanout_new(size_t n, size_t parallel, fanout_start_cb_t start, fanout_done_cb_t done,
+	   void *data)
+{
+	ASSERT(start);
+	ASSERT(done);
+
+	fanout_t *fanout = mem_new0(fanout_t, 1);
+	fanout->n = n;
+	fanout->parallel = MAX(parallel, (size_t)1);
+	fanout->ok = true;
+	fanout->start = start;
+	fanout->done = done;
+	fanout->data = data;
+	return fanout;
+}
+
+/*
+ * Starts the next items until the maximum number is in flight and reports the result
+ * once no item is in flight anymore.
+ */
+static void
+fanout_trigger(fanout_t *fanout)
+{
+	// items may complete synchronously, the outermost invocation takes care of them
+	if (fanout->running)
+		return;
+
+	fanout->running = true;
+	while (fanout->ok && fanout->pending < fanout->parallel && fanout->next < fanout->n) {
+		size_t index = fanout->next++;
+		fanout->pending++;
+		if (!(fanout->start)(fanout, index, fanout->data))
+			fanout->pending--;
+	}
+	fanout->running = false;
+
+	if (fanout->pending > 0)
+		return;
+
+	(fanout->done)(fanout, fanout->ok, fanout->data);
+	mem_free0(fanout);
+}
+
+void
+fanout_run(fanout_t *fanout)
+{
+	ASSERT(fanout);
+	fanout_trigger(fanout);
+}
+
+void
+fanout_item_done(fanout_t *fanout, bool ok)
+{
+	ASSERT(fanout);
+	ASSERT(fanout->pending > 0);
+
+	fanout->pending--;
+	if (!ok)
+		fanout->ok = false;
+	fanout_trigger(fanout);
+}
+
+bool
+fanout_is_ok(const fanout_t *fanout)
+{
+	ASSERT(fanout);
+	return fanout->ok;
+}
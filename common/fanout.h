@@ -0,0 +1,88 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file fanout.h
+ *
+ * Fan-out/fan-in of asynchronous operations on the event loop: the items 0..n-1 are
+ * started with at most a given number of them in flight, and a single completion
+ * callback reports the aggregated result once all started items have completed.
+ * After the first failed item, no further items are started.
+ */
+
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct fanout fanout_t;
+
+/**
+ * Starts an item. An item which has been started must report its result exactly once
+ * by fanout_item_done(), which may also happen before this function returns.
+ *
+ * @return true if the item was started, false if it was skipped
+ */
+typedef bool (*fanout_start_cb_t)(fanout_t *fanout, size_t index, void *data);
+
+/**
+ * Reports the aggregated result, i.e., true if no item failed. The fanout is
+ * freed after this callback returned.
+ */
+typedef void (*fanout_done_cb_t)(fanout_t *fanout, bool ok, void *data);
+
+/**
+ * Creates a fanout over n items with at most parallel items in flight.
+ *
+ * @param n the number of items
+ * @param parallel the maximum number of items in flight, at least one
+ * @param start callback starting a single item
+ * @param done callback reporting the aggregated result
+ * @param data payload passed to both callbacks
+ * @return the new fanout, which is started by fanout_run()
+ */
+fanout_t *
+fanout_new(size_t n, size_t parallel, fanout_start_cb_t start, fanout_done_cb_t done,
+	   void *data);
+
+/**
+ * Starts the first items. The done callback may have been called and the fanout
+ * freed when this returns, e.g., if all items were skipped.
+ */
+void
+fanout_run(fanout_t *fanout);
+
+/**
+ * Reports the result of a started item and starts the next ones.
+ */
+void
+fanout_item_done(fanout_t *fanout, bool ok);
+
+/**
+ * Returns false if an item already failed, e.g., to abort retries of other items.
+ */
+bool
+fanout_is_ok(const fanout_t *fanout);
+
+#endif /* FANOUT_H */
@@ -0,0 +1,256 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "fanout.h"
+#include "logf.h"
+#include "macro.h"
+
+#include <stdio.h>
+
+#define TEST_ITEMS 10
+#define TEST_PARALLEL 3
+
+typedef struct {
+	fanout_t *fanout;
+	size_t started[TEST_ITEMS];
+	size_t n_started;
+	size_t in_flight, max_in_flight;
+	size_t skip;	 // items with an index divisible by skip are skipped, 0 for none
+	size_t fail;	 // index of the item which fails, TEST_ITEMS for none
+	bool sync;	 // items complete before the start callback returns
+	int done_count;
+	bool done_ok;
+} test_fanout_t;
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static void
+test_complete(test_fanout_t *t, size_t index)
+{
+	t->in_flight--;
+	fanout_item_done(t->fanout, index != t->fail);
+}
+
+static bool
+test_start(fanout_t *fanout, size_t index, void *data)
+{
+	test_fanout_t *t = data;
+
+	munit_assert_ptr_equal(fanout, t->fanout);
+	if (t->skip && index % t->skip == 0)
+		return false;
+
+	t->started[t->n_started++] = index;
+	t->in_flight++;
+	t->max_in_flight = MAX(t->max_in_flight, t->in_flight);
+	if (t->sync)
+		test_complete(t, index);
+	return true;
+}
+
+static void
+test_done(fanout_t *fanout, bool ok, void *data)
+{
+	test_fanout_t *t = data;
+
+	munit_assert_ptr_equal(fanout, t->fanout);
+	munit_assert_size(t->in_flight, ==, 0);
+	t->done_count++;
+	t->done_ok = ok;
+}
+
+static void
+test_fanout_init(test_fanout_t *t, size_t n)
+{
+	t->fail = TEST_ITEMS;
+	t->fanout = fanout_new(n, TEST_PARALLEL, test_start, test_done, t);
+	munit_assert_not_null(t->fanout);
+}
+
+/*
+ * Completes the started items one by one in the order they were started.
+ */
+static void
+test_fanout_complete_all(test_fanout_t *t)
+{
+	for (size_t i = 0; i < t->n_started; i++) {
+		munit_assert_int(t->done_count, ==, 0);
+		test_complete(t, t->started[i]);
+	}
+}
+
+static MunitResult
+test_fanout_parallel(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	test_fanout_t t = { 0 };
+
+	test_fanout_init(&t, TEST_ITEMS);
+	fanout_run(t.fanout);
+	munit_assert_size(t.n_started, ==, TEST_PARALLEL);
+	munit_assert_true(fanout_is_ok(t.fanout));
+
+	test_fanout_complete_all(&t);
+	munit_assert_size(t.n_started, ==, TEST_ITEMS);
+	munit_assert_size(t.max_in_flight, ==, TEST_PARALLEL);
+	munit_assert_int(t.done_count, ==, 1);
+	munit_assert_true(t.done_ok);
+
+	for (size_t i = 0; i < TEST_ITEMS; i++)
+		munit_assert_size(t.started[i], ==, i);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_fanout_skip(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	test_fanout_t t = { 0 };
+
+	t.skip = 2;
+	test_fanout_init(&t, TEST_ITEMS);
+	fanout_run(t.fanout);
+	test_fanout_complete_all(&t);
+	munit_assert_size(t.n_started, ==, TEST_ITEMS / 2);
+	munit_assert_int(t.done_count, ==, 1);
+	munit_assert_true(t.done_ok);
+
+	// all items skipped, done before fanout_run() returns
+	t = (test_fanout_t){ 0 };
+	t.skip = 1;
+	test_fanout_init(&t, TEST_ITEMS);
+	fanout_run(t.fanout);
+	munit_assert_size(t.n_started, ==, 0);
+	munit_assert_int(t.done_count, ==, 1);
+	munit_assert_true(t.done_ok);
+
+	// no items at all
+	t = (test_fanout_t){ 0 };
+	test_fanout_init(&t, 0);
+	fanout_run(t.fanout);
+	munit_assert_int(t.done_count, ==, 1);
+	munit_assert_true(t.done_ok);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_fanout_fail(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	test_fanout_t t = { 0 };
+
+	test_fanout_init(&t, TEST_ITEMS);
+	t.fail = 1;
+	fanout_run(t.fanout);
+
+	// the items in flight complete, but no further ones are started
+	test_complete(&t, t.started[0]);
+	munit_assert_size(t.n_started, ==, TEST_PARALLEL + 1);
+	test_complete(&t, t.started[1]);
+	munit_assert_false(fanout_is_ok(t.fanout));
+	test_complete(&t, t.started[2]);
+	munit_assert_int(t.done_count, ==, 0);
+	test_complete(&t, t.started[3]);
+	munit_assert_size(t.n_started, ==, TEST_PARALLEL + 1);
+	munit_assert_int(t.done_count, ==, 1);
+	munit_assert_false(t.done_ok);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_fanout_sync(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	test_fanout_t t = { 0 };
+
+	t.sync = true;
+	test_fanout_init(&t, TEST_ITEMS);
+	fanout_run(t.fanout);
+	munit_assert_size(t.n_started, ==, TEST_ITEMS);
+	munit_assert_size(t.max_in_flight, ==, 1);
+	munit_assert_int(t.done_count, ==, 1);
+	munit_assert_true(t.done_ok);
+
+	t = (test_fanout_t){ 0 };
+	t.sync = true;
+	test_fanout_init(&t, TEST_ITEMS);
+	t.fail = 4;
+	fanout_run(t.fanout);
+	munit_assert_size(t.n_started, ==, 5);
+	munit_assert_int(t.done_count, ==, 1);
+	munit_assert_false(t.done_ok);
+
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/parallel",		/* name */
+		test_fanout_parallel,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/skip",		/* name */
+		test_fanout_skip,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/fail",		/* name */
+		test_fanout_fail,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/sync",		/* name */
+		test_fanout_sync,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite fanout_suite = {
+	"/fanout",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
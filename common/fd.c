@@ -28,6 +28,15 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
 
 int
 fd_write(int fd, const char *buf, size_t len)
@@ -106,9 +115,71 @@ fd_make_non_blocking(int fd)
 	return res;
 }
 
+int
+fd_keep_on_exec(int fd)
+{
+	int flags = fcntl(fd, F_GETFD);
+	if (flags == -1 || fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC) == -1) {
+		WARN_ERRNO("Failed to clear FD_CLOEXEC of fd %d.", fd);
+		return -1;
+	}
+	return 0;
+}
+
 int
 fd_is_closed(int fd)
 {
 	errno = 0;
 	return fcntl(fd, F_GETFD) == -1 && errno == EBADF;
 }
+
+/*
+ * Applies close() or FD_CLOEXEC to all fds from first on by scanning /proc/self/fd,
+ * for kernels without close_range(2).
+ */
+static int
+fd_close_range_fallback(int first, bool cloexec)
+{
+	DIR *dir = opendir("/proc/self/fd");
+	IF_NULL_RETVAL(dir, -1);
+
+	int dir_fd = dirfd(dir);
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		char *end;
+		long fd = strtol(entry->d_name, &end, 10);
+		if (*end != '\0' || end == entry->d_name || fd < first || fd == dir_fd)
+			continue;
+		if (cloexec) {
+			int flags = fcntl(fd, F_GETFD);
+			if (flags >= 0)
+				fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+		} else {
+			close(fd);
+		}
+	}
+	closedir(dir);
+	return 0;
+}
+
+static int
+fd_close_range(int first, bool cloexec)
+{
+#ifdef SYS_close_range
+	if (syscall(SYS_close_range, first, UINT_MAX, cloexec ? CLOSE_RANGE_CLOEXEC : 0) == 0)
+		return 0;
+#endif
+	return fd_close_range_fallback(first, cloexec);
+}
+
+int
+fd_close_all(int first)
+{
+	return fd_close_range(first, false);
+}
+
+int
+fd_cloexec_all(int first)
+{
+	return fd_close_range(first, true);
+}
@@ -64,6 +64,16 @@ fd_read(int fd, char *buf, size_t len);
 int
 fd_make_non_blocking(int fd);
 
+/**
+ * Clears FD_CLOEXEC of the given fd, so that it is inherited by a program the process
+ * executes, e.g. after marking all fds with fd_cloexec_all().
+ *
+ * @param fd the file descriptor
+ * @return 0 on success, -1 on error
+ */
+int
+fd_keep_on_exec(int fd);
+
 /**
  * Checks if the given fd is closed
  *
@@ -73,4 +83,25 @@ fd_make_non_blocking(int fd);
 int
 fd_is_closed(int fd);
 
+/**
+ * Closes all file descriptors from the given one on, e.g. in a child process after
+ * fork(). Uses close_range(2) and falls back to a scan of /proc/self/fd.
+ *
+ * @param first the lowest file descriptor to close
+ * @return 0 on success, -1 if the file descriptors could not be determined
+ */
+int
+fd_close_all(int first);
+
+/**
+ * Marks all file descriptors from the given one on close-on-exec, so that they stay
+ * usable, e.g. for logging, until the process calls exec. Uses close_range(2) with
+ * CLOSE_RANGE_CLOEXEC and falls back to a scan of /proc/self/fd.
+ *
+ * @param first the lowest file descriptor to mark
+ * @return 0 on success, -1 if the file descriptors could not be determined
+ */
+int
+fd_cloexec_all(int first);
+
 #endif // FD_H
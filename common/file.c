@@ -21,6 +21,8 @@
  * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
  */
 
+#define _GNU_SOURCE
+
 #include <string.h>
 #include <unistd.h>
 
@@ -35,6 +37,21 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <alloca.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+
+/* Buffer size for copying data which the kernel cannot copy on its own */
+#define FILE_COPY_BUF_SIZE (1024 * 1024)
+
+/* Multicast group of the uevents sent by the kernel, udevd rebroadcasts on group 2 */
+#define FILE_UEVENT_GROUP_KERNEL 1
+/* Interval to check for a device node if uevents are not available */
+#define FILE_WAIT_DEV_POLL_MS 10
 
 /******************************************************************************/
 
@@ -101,6 +118,175 @@ file_is_socket(const char *file)
 	return !lstat(file, &s) && S_ISSOCK(s.st_mode);
 }
 
+static bool
+file_is_dev(const char *file)
+{
+	struct stat s;
+
+	return !stat(file, &s) && (S_ISBLK(s.st_mode) || S_ISCHR(s.st_mode));
+}
+
+int
+file_wait_dev(const char *file, unsigned timeout_ms)
+{
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = FILE_UEVENT_GROUP_KERNEL };
+	struct timespec start, now;
+	int ret = -1;
+
+	// subscribe before the first check, so that no uevent in between is missed
+	int sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			  NETLINK_KOBJECT_UEVENT);
+	if (sock >= 0 && bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(sock);
+		sock = -1;
+	}
+	if (sock < 0)
+		WARN_ERRNO("Could not subscribe to uevents, polling for %s", file);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
+		if (file_is_dev(file)) {
+			ret = 0;
+			break;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 +
+				  (now.tv_nsec - start.tv_nsec) / 1000000;
+		if (elapsed_ms >= (long)timeout_ms)
+			break;
+
+		int wait_ms = timeout_ms - elapsed_ms;
+		if (sock < 0) {
+			usleep(MIN(wait_ms, FILE_WAIT_DEV_POLL_MS) * 1000);
+			continue;
+		}
+
+		// devtmpfs creates the node before the add uevent is sent
+		struct pollfd pfd = { .fd = sock, .events = POLLIN };
+		if (poll(&pfd, 1, wait_ms) < 0 && errno != EINTR) {
+			WARN_ERRNO("Could not wait for uevents");
+			break;
+		}
+		// the node is checked again anyway, thus the content is irrelevant
+		char buf[256];
+		while (recv(sock, buf, sizeof(buf), MSG_TRUNC) >= 0)
+			;
+	}
+
+	if (sock >= 0)
+		close(sock);
+	return ret;
+}
+
+/*
+ * Copies len bytes at off of in_fd to off + delta of out_fd. copy_file_range() lets the
+ * filesystem copy or share the data without passing it through user space. If it is not
+ * supported for these files, kernel_copy is cleared and a large buffer is used instead.
+ */
+static int
+file_copy_extent(int in_fd, int out_fd, off_t off, off_t delta, off_t len, bool *kernel_copy,
+		 unsigned char **buf)
+{
+	while (len > 0) {
+		ssize_t n;
+
+		if (*kernel_copy) {
+			loff_t in_off = off, out_off = off + delta;
+			n = copy_file_range(in_fd, &in_off, out_fd, &out_off, len, 0);
+			if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+				      errno == EOPNOTSUPP)) {
+				TRACE("copy_file_range not supported, falling back to read/write");
+				*kernel_copy = false;
+				continue;
+			}
+		} else {
+			if (!*buf)
+				*buf = mem_alloc(FILE_COPY_BUF_SIZE);
+			n = pread(in_fd, *buf, MIN(len, FILE_COPY_BUF_SIZE), off);
+			for (ssize_t w = 0; n > 0 && w < n;) {
+				ssize_t written = pwrite(out_fd, *buf + w, n - w, off + delta + w);
+				if (written < 0 && errno != EINTR)
+					return -1;
+				w += MAX(written, 0);
+			}
+		}
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		IF_TRUE_RETVAL(n < 0, -1);
+		// input was truncated meanwhile
+		IF_TRUE_RETVAL(n == 0, 0);
+
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Copies the first len bytes of the regular file in_fd to out_start of the freshly
+ * truncated regular file out_fd. Whole files are reflinked if the filesystem supports
+ * it, e.g., btrfs or xfs. Otherwise only the data extents are copied, holes stay sparse.
+ */
+static int
+file_copy_regular(int in_fd, int out_fd, off_t len, off_t in_size, off_t out_start)
+{
+	if (out_start == 0 && len == in_size && !ioctl(out_fd, FICLONE, in_fd)) {
+		TRACE("Copied file by reflink");
+		return 0;
+	}
+
+	int ret = 0;
+	bool kernel_copy = true;
+	unsigned char *buf = NULL;
+
+	for (off_t off = 0; off < len;) {
+		off_t data = lseek(in_fd, off, SEEK_DATA);
+		// no data behind off
+		if (data < 0 && errno == ENXIO)
+			break;
+		IF_TRUE_GOTO_ERROR(data < 0, err);
+		if (data >= len)
+			break;
+
+		off_t hole = lseek(in_fd, data, SEEK_HOLE);
+		IF_TRUE_GOTO_ERROR(hole < 0, err);
+		hole = MIN(hole, len);
+
+		IF_TRUE_GOTO_ERROR(file_copy_extent(in_fd, out_fd, data, out_start, hole - data,
+						    &kernel_copy, &buf),
+				   err);
+		off = hole;
+	}
+
+	// holes at the end have not been written, thus set the size explicitly
+	IF_TRUE_GOTO_ERROR(ftruncate(out_fd, out_start + len), err);
+out:
+	mem_free0(buf);
+	return ret;
+err:
+	ret = -1;
+	goto out;
+}
+
+int
+file_copy_fd(int in_fd, int out_fd)
+{
+	struct stat in_st;
+
+	IF_TRUE_RETVAL(fstat(in_fd, &in_st), -1);
+	IF_FALSE_RETVAL(S_ISREG(in_st.st_mode), -1);
+
+	return file_copy_regular(in_fd, out_fd, in_st.st_size, in_st.st_size, 0);
+}
+
+int
+file_reflink_fd(int in_fd, int out_fd)
+{
+	return ioctl(out_fd, FICLONE, in_fd) ? -1 : 0;
+}
+
 int
 file_copy(const char *in_file, const char *out_file, ssize_t count, size_t bs, off_t seek)
 {
@@ -125,6 +311,19 @@ file_copy(const char *in_file, const char *out_file, ssize_t count, size_t bs, o
 		return -1;
 	}
 
+	struct stat in_st, out_st;
+	if (!fstat(in_fd, &in_st) && !fstat(out_fd, &out_st) && S_ISREG(in_st.st_mode) &&
+	    S_ISREG(out_st.st_mode)) {
+		off_t len = in_st.st_size;
+		if (count >= 0 && (size_t)count <= (size_t)in_st.st_size / bs)
+			len = count * bs;
+
+		ret = file_copy_regular(in_fd, out_fd, len, in_st.st_size, seek * bs);
+		if (ret)
+			DEBUG_ERRNO("Could not copy %s to %s", in_file, out_file);
+		goto out;
+	}
+
 	buf = alloca(bs); // TODO: use mem_new for big bs...
 
 	ret = lseek(out_fd, seek * bs, SEEK_SET);
@@ -209,6 +408,62 @@ file_write(const char *file, const char *buf, ssize_t len)
 	return file_write_internal(file, buf, len, O_WRONLY | O_CREAT | O_TRUNC);
 }
 
+int
+file_write_atomic(const char *file, const char *buf, ssize_t len)
+{
+	IF_NULL_RETVAL(file, -1);
+	IF_NULL_RETVAL(buf, -1);
+
+	if (len < 0)
+		len = strlen(buf);
+
+	int ret = -1;
+	int fd = -1;
+	char *tmp = mem_printf("%s.XXXXXX", file);
+	char *dir = mem_strdup(file);
+	char *slash = strrchr(dir, '/');
+	if (slash)
+		*(slash == dir ? slash + 1 : slash) = '\0';
+
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0) {
+		DEBUG_ERRNO("Could not create temporary file for %s", file);
+		goto out;
+	}
+	// the file keeps the permissions file_write() would have created it with
+	mode_t mask = umask(0);
+	umask(mask);
+	if (fchmod(fd, 00666 & ~mask) < 0 || fd_write(fd, buf, len) < 0 || fsync(fd) < 0) {
+		DEBUG_ERRNO("Could not write temporary file for %s", file);
+		goto err;
+	}
+	close(fd);
+	fd = -1;
+
+	if (rename(tmp, file) < 0) {
+		DEBUG_ERRNO("Could not replace %s", file);
+		goto err;
+	}
+
+	// make the rename itself durable
+	int dfd = open(slash ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0 || fsync(dfd) < 0)
+		DEBUG_ERRNO("Could not sync directory of %s", file);
+	if (dfd >= 0)
+		close(dfd);
+
+	ret = len;
+	goto out;
+err:
+	if (fd >= 0)
+		close(fd);
+	unlink(tmp);
+out:
+	mem_free0(dir);
+	mem_free0(tmp);
+	return ret;
+}
+
 int
 file_write_append(const char *file, const char *buf, ssize_t len)
 {
@@ -254,6 +509,150 @@ file_printf_append(const char *file, const char *fmt, ...)
 	return ret;
 }
 
+struct file_handle_fd {
+	int fd;
+	int flags;
+	char *name;
+};
+
+file_handle_t *
+file_handle_open(const char *file, int flags)
+{
+	IF_NULL_RETVAL(file, NULL);
+
+	int fd = open(file, flags | O_CLOEXEC, 00666);
+	if (fd < 0) {
+		DEBUG_ERRNO("Could not open file %s", file);
+		return NULL;
+	}
+
+	file_handle_t *handle = mem_new0(file_handle_t, 1);
+	handle->fd = fd;
+	handle->flags = flags;
+	handle->name = mem_strdup(file);
+	return handle;
+}
+
+void
+file_handle_close(file_handle_t *handle)
+{
+	IF_NULL_RETURN(handle);
+
+	close(handle->fd);
+	mem_free0(handle->name);
+	mem_free0(handle);
+}
+
+const char *
+file_handle_get_name(const file_handle_t *handle)
+{
+	IF_NULL_RETVAL(handle, NULL);
+	return handle->name;
+}
+
+ssize_t
+file_handle_pwrite(file_handle_t *handle, const void *buf, size_t len, off_t off)
+{
+	IF_NULL_RETVAL(handle, -1);
+	IF_NULL_RETVAL(buf, -1);
+
+	const char *p = buf;
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = (handle->flags & O_APPEND) ?
+				    write(handle->fd, p + done, len - done) :
+				    pwrite(handle->fd, p + done, len - done, off + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			DEBUG_ERRNO("Could not write to file %s", handle->name);
+			return -1;
+		}
+		done += n;
+	}
+	return done;
+}
+
+ssize_t
+file_handle_writev(file_handle_t *handle, const struct iovec *iov, int iovcnt)
+{
+	IF_NULL_RETVAL(handle, -1);
+	IF_NULL_RETVAL(iov, -1);
+
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	ssize_t n;
+	do {
+		n = writev(handle->fd, iov, iovcnt);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		DEBUG_ERRNO("Could not write to file %s", handle->name);
+		return -1;
+	}
+
+	// complete a short write buffer by buffer
+	size_t skip = n;
+	for (int i = 0; i < iovcnt && (size_t)n < total; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		if (fd_write(handle->fd, (const char *)iov[i].iov_base + skip,
+			     iov[i].iov_len - skip) < 0)
+			return -1;
+		n += iov[i].iov_len - skip;
+		skip = 0;
+	}
+	return n;
+}
+
+ssize_t
+file_handle_printf(file_handle_t *handle, const char *fmt, ...)
+{
+	va_list ap;
+	char buf[128];
+
+	IF_NULL_RETVAL(handle, -1);
+
+	va_start(ap, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	IF_TRUE_RETVAL(len < 0, -1);
+
+	// control files are written with short values, others need an allocation
+	if ((size_t)len < sizeof(buf))
+		return file_handle_pwrite(handle, buf, len, 0);
+
+	va_start(ap, fmt);
+	char *str = mem_vprintf(fmt, ap);
+	va_end(ap);
+
+	ssize_t ret = file_handle_pwrite(handle, str, len, 0);
+	mem_free0(str);
+	return ret;
+}
+
+ssize_t
+file_handle_pread(file_handle_t *handle, char *buf, size_t len, off_t off)
+{
+	IF_NULL_RETVAL(handle, -1);
+	IF_NULL_RETVAL(buf, -1);
+	IF_TRUE_RETVAL(len == 0, -1);
+
+	ssize_t n;
+	do {
+		n = pread(handle->fd, buf, len - 1, off);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		DEBUG_ERRNO("Could not read from file %s", handle->name);
+		return -1;
+	}
+	buf[n] = '\0';
+	return n;
+}
+
 int
 file_read(const char *file, char *buf, size_t len)
 {
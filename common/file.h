@@ -32,6 +32,7 @@
 
 #include <stdbool.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 bool
 file_exists(const char *file);
@@ -54,6 +55,17 @@ file_is_mountpoint(const char *file);
 bool
 file_is_socket(const char *file);
 
+/**
+ * Waits until file exists as a block or character device node, e.g. after the
+ * kernel created a device. Instead of sleeping, it is rechecked whenever a uevent
+ * arrives, which requires to be in the initial network namespace.
+ * @param file The path of the device node.
+ * @param timeout_ms The maximum time to wait in milliseconds.
+ * @return 0 if the node exists, -1 on timeout.
+ */
+int
+file_wait_dev(const char *file, unsigned timeout_ms);
+
 /**
  * Copy a file.
  * @param in_file The file to be read.
@@ -62,10 +74,38 @@ file_is_socket(const char *file);
  * @param bs Read and write up to bs bytes at a time.
  * @param seek Skip seek blocks at start of output.
  * @return -1 on error else 0.
+ *
+ * If both files are regular files, the block size only scales count and seek.
+ * The data is then reflinked or copied in kernel where possible, and holes of
+ * in_file are kept in out_file.
  */
 int
 file_copy(const char *in_file, const char *out_file, ssize_t count, size_t bs, off_t seek);
 
+/**
+ * Copy the whole content of the regular file in_fd to the regular file out_fd,
+ * which should be empty. Like file_copy, the data is reflinked or copied in kernel
+ * where possible and holes are kept.
+ *
+ * @param in_fd The file to be read.
+ * @param out_fd The file to be written.
+ * @return -1 on error else 0.
+ */
+int
+file_copy_fd(int in_fd, int out_fd);
+
+/**
+ * Let the regular file out_fd share all data extents of in_fd (reflink), without
+ * copying any data. Fails with errno EOPNOTSUPP or EXDEV if the filesystem does not
+ * support this, e.g., on ext4 or across filesystems.
+ *
+ * @param in_fd The file to be cloned.
+ * @param out_fd The file to be written.
+ * @return -1 on error else 0.
+ */
+int
+file_reflink_fd(int in_fd, int out_fd);
+
 /**
  * Move a file.
  * @param src The source file name.
@@ -86,6 +126,18 @@ file_move(const char *src, const char *dst, size_t bs);
 int
 file_write(const char *file, const char *buf, ssize_t len);
 
+/**
+ * Write a string to a file, which is replaced atomically. The content is written to a
+ * temporary file in the same directory and synced before it is renamed over the file,
+ * so that the file has either its old or its new content even after a crash.
+ * @param file The file name.
+ * @param buf The buffer to be written.
+ * @param len The length of buffer, maybe -1 to determine buffer length with strlen().
+ * @return -1 on error else the number of bytes written.
+ */
+int
+file_write_atomic(const char *file, const char *buf, ssize_t len);
+
 /**
  * Append  a string to the end of a file.
  * @param file The file name.
@@ -114,6 +166,70 @@ file_printf(const char *file, const char *fmt, ...);
 int
 file_printf_append(const char *file, const char *fmt, ...);
 
+/**
+ * A file which is kept open across several reads and writes, e.g., a control file in
+ * sysfs, procfs or cgroupfs written repeatedly, or a log which is appended to.
+ * Compared to file_write and friends, this saves an open(2) and a close(2) per access.
+ */
+// struct file_handle is taken by name_to_handle_at(2)
+typedef struct file_handle_fd file_handle_t;
+
+/**
+ * Opens a file handle.
+ * @param file The file name.
+ * @param flags Flags for open(2), e.g. O_WRONLY | O_APPEND; O_CLOEXEC is always added.
+ *		New files are created with mode 0666 minus umask.
+ * @return The new handle or NULL on error.
+ */
+file_handle_t *
+file_handle_open(const char *file, int flags);
+
+/**
+ * Closes a file handle and frees it.
+ * @param handle The handle, may be NULL.
+ */
+void
+file_handle_close(file_handle_t *handle);
+
+/**
+ * Returns the file name a handle has been opened with.
+ */
+const char *
+file_handle_get_name(const file_handle_t *handle);
+
+/**
+ * Writes len bytes of buf at offset off, retrying on short writes. For handles
+ * opened with O_APPEND, the data is appended instead.
+ * @return -1 on error else the number of bytes written.
+ */
+ssize_t
+file_handle_pwrite(file_handle_t *handle, const void *buf, size_t len, off_t off);
+
+/**
+ * Writes the buffers of iov at the current position with a single writev(2),
+ * which, e.g., appends a record built from several parts atomically. Short writes
+ * are completed with further calls.
+ * @return -1 on error else the number of bytes written.
+ */
+ssize_t
+file_handle_writev(file_handle_t *handle, const struct iovec *iov, int iovcnt);
+
+/**
+ * Writes a formatted string with a single write at offset 0, as expected by control
+ * files, or at the end for handles opened with O_APPEND.
+ * @return -1 on error else the number of bytes written.
+ */
+ssize_t
+file_handle_printf(file_handle_t *handle, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/**
+ * Reads up to len - 1 bytes at offset off and terminates them with a null byte.
+ * @return -1 on error else the number of bytes read.
+ */
+ssize_t
+file_handle_pread(file_handle_t *handle, char *buf, size_t len, off_t off);
+
 /**
  * Read a string from a file.
  * @param file The file name.
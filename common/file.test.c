@@ -0,0 +1,158 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "file.h"
+#include "logf.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static MunitResult
+test_file_handle_write(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	char path[] = "/tmp/file_test_XXXXXX";
+	int fd = mkstemp(path);
+	munit_assert_int(fd, >=, 0);
+	close(fd);
+
+	char buf[64];
+	file_handle_t *handle = file_handle_open(path, O_RDWR);
+	munit_assert_not_null(handle);
+	munit_assert_string_equal(file_handle_get_name(handle), path);
+
+	// control file style writes replace the content at offset 0
+	munit_assert_int(file_handle_printf(handle, "%d", 12345), ==, 5);
+	munit_assert_int(file_handle_printf(handle, "%s", "ab"), ==, 2);
+	munit_assert_int(file_handle_pread(handle, buf, sizeof(buf), 0), ==, 5);
+	munit_assert_string_equal(buf, "ab345");
+
+	munit_assert_int(file_handle_pwrite(handle, "xyz", 3, 5), ==, 3);
+	munit_assert_int(file_handle_pread(handle, buf, 4, 3), ==, 3);
+	munit_assert_string_equal(buf, "45x");
+	file_handle_close(handle);
+
+	handle = file_handle_open(path, O_WRONLY | O_TRUNC | O_APPEND);
+	munit_assert_not_null(handle);
+	struct iovec iov[] = { { "head ", 5 }, { "", 0 }, { "tail", 4 } };
+	munit_assert_int(file_handle_writev(handle, iov, 3), ==, 9);
+	munit_assert_int(file_handle_pwrite(handle, "!", 1, 0), ==, 1);
+	file_handle_close(handle);
+
+	munit_assert_int(file_read(path, buf, sizeof(buf)), ==, 10);
+	buf[10] = '\0';
+	munit_assert_string_equal(buf, "head tail!");
+
+	munit_assert_null(file_handle_open("/nonexistent/file", O_RDONLY));
+	unlink(path);
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_file_wait_dev(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	munit_assert_int(file_wait_dev("/dev/null", 0), ==, 0);
+
+	// a regular file is no device node
+	char path[] = "/tmp/file_test_XXXXXX";
+	int fd = mkstemp(path);
+	munit_assert_int(fd, >=, 0);
+	close(fd);
+	munit_assert_int(file_wait_dev(path, 20), ==, -1);
+	unlink(path);
+
+	munit_assert_int(file_wait_dev("/dev/nonexistent", 20), ==, -1);
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_file_write_atomic(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	char path[] = "/tmp/file_test_XXXXXX";
+	int fd = mkstemp(path);
+	munit_assert_int(fd, >=, 0);
+	close(fd);
+
+	char buf[64];
+	munit_assert_int(file_write(path, "old content", -1), ==, 11);
+	munit_assert_int(file_write_atomic(path, "new", -1), ==, 3);
+	munit_assert_int(file_read(path, buf, sizeof(buf)), ==, 3);
+	buf[3] = '\0';
+	munit_assert_string_equal(buf, "new");
+	unlink(path);
+
+	// nothing is left behind if the temporary file cannot be created
+	munit_assert_int(file_write_atomic("/nonexistent/file", "x", 1), ==, -1);
+	munit_assert_false(file_exists("/nonexistent/file"));
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/handle_write",	/* name */
+		test_file_handle_write, /* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/write_atomic",	/* name */
+		test_file_write_atomic, /* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/wait_dev",		/* name */
+		test_file_wait_dev,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite file_suite = {
+	"/file",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
@@ -0,0 +1,161 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#include "file_writer.h"
+
+//#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
+#include "macro.h"
+#include "mem.h"
+#include "list.h"
+#include "event.h"
+#include "file.h"
+
+#include <string.h>
+
+// time in ms writes to the same file are coalesced
+#define FILE_WRITER_DELAY 500
+
+typedef struct file_writer_entry {
+	char *file;
+	char *buf;
+	size_t len;
+} file_writer_entry_t;
+
+// pending entries in the order they were first written
+static list_t *file_writer_list = NULL;
+static event_timer_t *file_writer_timer = NULL;
+
+static file_writer_entry_t *
+file_writer_entry_get(const char *file)
+{
+	for (list_t *l = file_writer_list; l; l = l->next) {
+		file_writer_entry_t *entry = l->data;
+		if (!strcmp(entry->file, file))
+			return entry;
+	}
+	return NULL;
+}
+
+static void
+file_writer_entry_free(file_writer_entry_t *entry)
+{
+	file_writer_list = list_remove(file_writer_list, entry);
+	mem_free0(entry->file);
+	mem_free0(entry->buf);
+	mem_free0(entry);
+
+	if (!file_writer_list && file_writer_timer) {
+		event_remove_timer(file_writer_timer);
+		event_timer_free(file_writer_timer);
+		file_writer_timer = NULL;
+	}
+}
+
+static void
+file_writer_cb_flush(event_timer_t *timer, UNUSED void *data)
+{
+	event_timer_free(timer);
+	file_writer_timer = NULL;
+
+	file_writer_flush(NULL);
+}
+
+int
+file_writer_write(const char *file, const char *buf, ssize_t len)
+{
+	IF_NULL_RETVAL(file, -1);
+	IF_NULL_RETVAL(buf, -1);
+
+	if (len < 0)
+		len = strlen(buf);
+
+	file_writer_entry_t *entry = file_writer_entry_get(file);
+	if (entry) {
+		TRACE("Replacing pending write of %s", file);
+		mem_free0(entry->buf);
+	} else {
+		entry = mem_new0(file_writer_entry_t, 1);
+		entry->file = mem_strdup(file);
+		file_writer_list = list_append(file_writer_list, entry);
+	}
+	entry->buf = mem_alloc(len > 0 ? len : 1);
+	memcpy(entry->buf, buf, len);
+	entry->len = len;
+
+	if (!file_writer_timer) {
+		file_writer_timer =
+			event_timer_new(FILE_WRITER_DELAY, 1, &file_writer_cb_flush, NULL);
+		event_add_timer(file_writer_timer);
+	}
+	return 0;
+}
+
+char *
+file_writer_get_pending_new(const char *file, size_t *len)
+{
+	IF_NULL_RETVAL(file, NULL);
+	ASSERT(len);
+
+	file_writer_entry_t *entry = file_writer_entry_get(file);
+	IF_NULL_RETVAL(entry, NULL);
+
+	char *buf = mem_alloc(entry->len > 0 ? entry->len : 1);
+	memcpy(buf, entry->buf, entry->len);
+	*len = entry->len;
+	return buf;
+}
+
+int
+file_writer_flush(const char *file)
+{
+	int ret = 0;
+
+	for (list_t *l = file_writer_list; l;) {
+		file_writer_entry_t *entry = l->data;
+		l = l->next;
+		if (file && strcmp(entry->file, file))
+			continue;
+
+		if (file_write_atomic(entry->file, entry->buf, entry->len) < 0) {
+			ERROR("Could not write %s", entry->file);
+			ret = -1;
+		} else {
+			DEBUG("Wrote %zu bytes to %s", entry->len, entry->file);
+		}
+		file_writer_entry_free(entry);
+	}
+	return ret;
+}
+
+void
+file_writer_discard(const char *file)
+{
+	IF_NULL_RETURN(file);
+
+	file_writer_entry_t *entry = file_writer_entry_get(file);
+	IF_NULL_RETURN(entry);
+
+	DEBUG("Discarding pending write of %s", file);
+	file_writer_entry_free(entry);
+}
@@ -0,0 +1,83 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+/**
+ * @file file_writer.h
+ *
+ * Write-behind for small files which are rewritten frequently, e.g., configs.
+ * Writes are not performed right away but kept in memory for a short delay, so that
+ * several writes to the same file within this window result in a single write of the
+ * latest content. The pending content is then written with file_write_atomic() from
+ * the event loop, i.e., the file is never left partially written.
+ *
+ * Readers of such a file must use file_writer_get_pending_new() or flush the file
+ * before reading it, and file_writer_discard() must be called before it is removed.
+ */
+
+#ifndef FILE_WRITER_H
+#define FILE_WRITER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Schedules writing buf to the given file. Content which is still pending for the
+ * same file is replaced.
+ *
+ * @param file The file name.
+ * @param buf The buffer to be written, which is copied.
+ * @param len The length of buffer, maybe -1 to determine buffer length with strlen().
+ * @return 0 on success, -1 on error.
+ */
+int
+file_writer_write(const char *file, const char *buf, ssize_t len);
+
+/**
+ * Returns a copy of the content which is pending for the given file.
+ *
+ * @param file The file name.
+ * @param len Is set to the length of the pending content.
+ * @return The newly allocated content or NULL if no write is pending for the file.
+ */
+char *
+file_writer_get_pending_new(const char *file, size_t *len);
+
+/**
+ * Writes the pending content of the given file right away.
+ *
+ * @param file The file name or NULL to write all pending files, e.g., before a reboot.
+ * @return 0 on success, -1 if a write failed.
+ */
+int
+file_writer_flush(const char *file);
+
+/**
+ * Drops the pending content of the given file without writing it.
+ *
+ * @param file The file name.
+ */
+void
+file_writer_discard(const char *file);
+
+#endif /* FILE_WRITER_H */
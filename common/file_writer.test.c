@@ -0,0 +1,136 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#include "munit.h"
+
+#include "file_writer.h"
+#include "event.h"
+#include "file.h"
+#include "logf.h"
+#include "mem.h"
+#include "macro.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char test_path[] = "/tmp/file_writer_test_XXXXXX";
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	logf_register(&logf_test_write, stderr);
+	strcpy(test_path + strlen(test_path) - 6, "XXXXXX");
+	int fd = mkstemp(test_path);
+	munit_assert_int(fd, >=, 0);
+	close(fd);
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	unlink(test_path);
+	event_reset();
+}
+
+static MunitResult
+test_file_writer_coalesce(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	char buf[64];
+	size_t len;
+
+	munit_assert_int(file_writer_write(test_path, "first", -1), ==, 0);
+	munit_assert_int(file_writer_write(test_path, "second", -1), ==, 0);
+	munit_assert_int(file_size(test_path), ==, 0);
+
+	// readers see the latest content before it is written
+	char *pending = file_writer_get_pending_new(test_path, &len);
+	munit_assert_not_null(pending);
+	munit_assert_size(len, ==, 6);
+	munit_assert_memory_equal(len, pending, "second");
+	mem_free0(pending);
+
+	// the loop returns as soon as the delayed write is done
+	event_loop();
+
+	munit_assert_null(file_writer_get_pending_new(test_path, &len));
+	munit_assert_int(file_read(test_path, buf, sizeof(buf)), ==, 6);
+	munit_assert_memory_equal(6, buf, "second");
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_file_writer_flush(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	char buf[64];
+	size_t len;
+
+	munit_assert_int(file_writer_write(test_path, "flushed", -1), ==, 0);
+	munit_assert_int(file_writer_flush(test_path), ==, 0);
+	munit_assert_int(file_read(test_path, buf, sizeof(buf)), ==, 7);
+	munit_assert_memory_equal(7, buf, "flushed");
+
+	// a discarded write must not recreate a removed file
+	munit_assert_int(file_writer_write(test_path, "discarded", -1), ==, 0);
+	file_writer_discard(test_path);
+	unlink(test_path);
+	munit_assert_null(file_writer_get_pending_new(test_path, &len));
+	munit_assert_int(file_writer_flush(NULL), ==, 0);
+	munit_assert_false(file_exists(test_path));
+
+	munit_assert_int(file_writer_write("/nonexistent/file", "x", 1), ==, 0);
+	munit_assert_int(file_writer_flush(NULL), ==, -1);
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/coalesce",		   /* name */
+		test_file_writer_coalesce, /* test */
+		setup,			   /* setup */
+		tear_down,		   /* tear_down */
+		MUNIT_TEST_OPTION_NONE,	   /* options */
+		NULL			   /* parameters */
+	},
+	{
+		"/flush",		/* name */
+		test_file_writer_flush, /* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite file_writer_suite = {
+	"/file_writer",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
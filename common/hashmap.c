@@ -0,0 +1,206 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+//#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
+
+#include "hashmap.h"
+
+#include "macro.h"
+#include "mem.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* initial number of buckets, always a power of two */
+#define HASHMAP_BUCKETS_MIN 16
+
+typedef struct hashmap_entry hashmap_entry_t;
+struct hashmap_entry {
+	hashmap_entry_t *next; /**< next entry in the same bucket */
+	uint32_t hash;	       /**< cached hash of the key */
+	void *value;	       /**< the stored value */
+	size_t key_len;	       /**< length of the key */
+	unsigned char key[];   /**< copy of the key */
+};
+
+struct hashmap {
+	hashmap_entry_t **buckets; /**< array of bucket chains */
+	size_t n_buckets;	   /**< number of buckets, a power of two */
+	size_t n_entries;	   /**< number of stored entries */
+};
+
+/* 32-bit FNV-1a */
+static uint32_t
+hashmap_hash(const void *key, size_t key_len)
+{
+	const unsigned char *p = key;
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < key_len; i++) {
+		hash ^= p[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static hashmap_entry_t **
+hashmap_find(const hashmap_t *map, const void *key, size_t key_len, uint32_t hash)
+{
+	hashmap_entry_t **e = &map->buckets[hash & (map->n_buckets - 1)];
+
+	for (; *e; e = &(*e)->next) {
+		if ((*e)->hash == hash && (*e)->key_len == key_len &&
+		    !memcmp((*e)->key, key, key_len))
+			break;
+	}
+	return e;
+}
+
+static void
+hashmap_grow(hashmap_t *map)
+{
+	size_t n_buckets = map->n_buckets * 2;
+	hashmap_entry_t **buckets = mem_new0(hashmap_entry_t *, n_buckets);
+
+	for (size_t i = 0; i < map->n_buckets; i++) {
+		hashmap_entry_t *e = map->buckets[i];
+		while (e) {
+			hashmap_entry_t *next = e->next;
+			size_t idx = e->hash & (n_buckets - 1);
+			e->next = buckets[idx];
+			buckets[idx] = e;
+			e = next;
+		}
+	}
+
+	mem_free0(map->buckets);
+	map->buckets = buckets;
+	map->n_buckets = n_buckets;
+	TRACE("Grew hash map %p to %zu buckets", (void *)map, n_buckets);
+}
+
+hashmap_t *
+hashmap_new(void)
+{
+	hashmap_t *map = mem_new0(hashmap_t, 1);
+	map->n_buckets = HASHMAP_BUCKETS_MIN;
+	map->buckets = mem_new0(hashmap_entry_t *, map->n_buckets);
+
+	return map;
+}
+
+void
+hashmap_clear(hashmap_t *map)
+{
+	IF_NULL_RETURN(map);
+
+	for (size_t i = 0; i < map->n_buckets; i++) {
+		hashmap_entry_t *e = map->buckets[i];
+		while (e) {
+			hashmap_entry_t *next = e->next;
+			mem_free0(e);
+			e = next;
+		}
+		map->buckets[i] = NULL;
+	}
+	map->n_entries = 0;
+}
+
+void
+hashmap_free(hashmap_t *map)
+{
+	IF_NULL_RETURN(map);
+
+	hashmap_clear(map);
+	mem_free0(map->buckets);
+	mem_free0(map);
+}
+
+int
+hashmap_put(hashmap_t *map, const void *key, size_t key_len, void *value)
+{
+	IF_NULL_RETVAL(map, -1);
+	IF_NULL_RETVAL(key, -1);
+	IF_NULL_RETVAL(value, -1);
+
+	uint32_t hash = hashmap_hash(key, key_len);
+	hashmap_entry_t **e = hashmap_find(map, key, key_len, hash);
+
+	if (*e) {
+		(*e)->value = value;
+		return 0;
+	}
+
+	hashmap_entry_t *entry = mem_alloc(sizeof(hashmap_entry_t) + key_len);
+	entry->next = NULL;
+	entry->hash = hash;
+	entry->value = value;
+	entry->key_len = key_len;
+	memcpy(entry->key, key, key_len);
+	*e = entry;
+
+	// keep the load factor below 1
+	if (++map->n_entries > map->n_buckets)
+		hashmap_grow(map);
+
+	return 0;
+}
+
+void *
+hashmap_get(const hashmap_t *map, const void *key, size_t key_len)
+{
+	IF_NULL_RETVAL(map, NULL);
+	IF_NULL_RETVAL(key, NULL);
+
+	hashmap_entry_t *e = *hashmap_find(map, key, key_len, hashmap_hash(key, key_len));
+
+	return e ? e->value : NULL;
+}
+
+void *
+hashmap_remove(hashmap_t *map, const void *key, size_t key_len)
+{
+	IF_NULL_RETVAL(map, NULL);
+	IF_NULL_RETVAL(key, NULL);
+
+	hashmap_entry_t **e = hashmap_find(map, key, key_len, hashmap_hash(key, key_len));
+	hashmap_entry_t *entry = *e;
+
+	if (!entry)
+		return NULL;
+
+	void *value = entry->value;
+	*e = entry->next;
+	mem_free0(entry);
+	map->n_entries--;
+
+	return value;
+}
+
+size_t
+hashmap_size(const hashmap_t *map)
+{
+	IF_NULL_RETVAL(map, 0);
+
+	return map->n_entries;
+}
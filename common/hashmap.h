@@ -0,0 +1,116 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file hashmap.h
+ *
+ * Implements a hash map which maps keys of arbitrary length to data pointers.
+ * Keys are copied on insertion, values are owned by the caller. Collisions are
+ * resolved by chaining and the bucket array grows with the number of entries,
+ * so that lookups, insertions and removals take constant time on average.
+ */
+
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include <stddef.h>
+#include <string.h>
+
+typedef struct hashmap hashmap_t;
+
+/**
+ * Creates a new empty hash map.
+ *
+ * @return The newly created hash map.
+ */
+hashmap_t *
+hashmap_new(void);
+
+/**
+ * Frees the hash map and all its entries. The values are not freed.
+ *
+ * @param map The hash map to be freed.
+ */
+void
+hashmap_free(hashmap_t *map);
+
+/**
+ * Inserts a value for the given key. An already existing value for the same key
+ * is replaced.
+ *
+ * @param map The hash map.
+ * @param key The key, which is copied.
+ * @param key_len The length of the key in bytes.
+ * @param value The value to be stored; must not be NULL.
+ * @return 0 on success, -1 on error.
+ */
+int
+hashmap_put(hashmap_t *map, const void *key, size_t key_len, void *value);
+
+/**
+ * Looks up the value stored for the given key.
+ *
+ * @param map The hash map.
+ * @param key The key to search for.
+ * @param key_len The length of the key in bytes.
+ * @return The value or NULL if there is no value for the key.
+ */
+void *
+hashmap_get(const hashmap_t *map, const void *key, size_t key_len);
+
+/**
+ * Removes the entry for the given key.
+ *
+ * @param map The hash map.
+ * @param key The key of the entry to be removed.
+ * @param key_len The length of the key in bytes.
+ * @return The value of the removed entry or NULL if there was no entry for the key.
+ */
+void *
+hashmap_remove(hashmap_t *map, const void *key, size_t key_len);
+
+/**
+ * Removes all entries from the hash map.
+ *
+ * @param map The hash map.
+ */
+void
+hashmap_clear(hashmap_t *map);
+
+/**
+ * Returns the number of entries stored in the hash map.
+ *
+ * @param map The hash map.
+ * @return The number of entries.
+ */
+size_t
+hashmap_size(const hashmap_t *map);
+
+/**
+ * Convenience wrappers for hash maps with null-terminated string keys.
+ */
+#define hashmap_put_str(map, key, value) hashmap_put(map, key, strlen(key), value)
+#define hashmap_get_str(map, key) hashmap_get(map, key, strlen(key))
+#define hashmap_remove_str(map, key) hashmap_remove(map, key, strlen(key))
+
+#endif /* HASHMAP_H */
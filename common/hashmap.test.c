@@ -0,0 +1,109 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "hashmap.h"
+#include "logf.h"
+#include "mem.h"
+#include "macro.h"
+
+#include <stdint.h>
+
+#define TEST_HASHMAP_ENTRIES 1000
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+}
+
+static MunitResult
+test_hashmap_put_get_remove(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	hashmap_t *map = hashmap_new();
+	munit_assert_not_null(map);
+
+	// enough entries to let the map grow several times
+	for (int i = 0; i < TEST_HASHMAP_ENTRIES; i++) {
+		char *key = mem_printf("key-%d", i);
+		munit_assert_int(hashmap_put_str(map, key, (void *)(intptr_t)(i + 1)), ==, 0);
+		mem_free0(key);
+	}
+	munit_assert_size(hashmap_size(map), ==, TEST_HASHMAP_ENTRIES);
+
+	for (int i = 0; i < TEST_HASHMAP_ENTRIES; i++) {
+		char *key = mem_printf("key-%d", i);
+		munit_assert_int((intptr_t)hashmap_get_str(map, key), ==, i + 1);
+		mem_free0(key);
+	}
+	munit_assert_null(hashmap_get_str(map, "key-"));
+
+	// replacing keeps a single entry
+	munit_assert_int(hashmap_put_str(map, "key-0", (void *)(intptr_t)42), ==, 0);
+	munit_assert_size(hashmap_size(map), ==, TEST_HASHMAP_ENTRIES);
+	munit_assert_int((intptr_t)hashmap_remove_str(map, "key-0"), ==, 42);
+	munit_assert_null(hashmap_remove_str(map, "key-0"));
+	munit_assert_size(hashmap_size(map), ==, TEST_HASHMAP_ENTRIES - 1);
+
+	// binary keys
+	int uid = 100000;
+	munit_assert_int(hashmap_put(map, &uid, sizeof(uid), map), ==, 0);
+	munit_assert_ptr_equal(hashmap_get(map, &uid, sizeof(uid)), map);
+
+	hashmap_clear(map);
+	munit_assert_size(hashmap_size(map), ==, 0);
+	munit_assert_null(hashmap_get_str(map, "key-1"));
+
+	hashmap_free(map);
+
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/entries can be inserted, found and removed", /* name */
+		test_hashmap_put_get_remove,		       /* test */
+		setup,					       /* setup */
+		tear_down,				       /* tear_down */
+		MUNIT_TEST_OPTION_NONE,			       /* options */
+		NULL					       /* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite hashmap_suite = {
+	"/hashmap",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
@@ -0,0 +1,253 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include <limits.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "macro.h"
+#include "mem.h"
+
+#include "hex.h"
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/*
+ * Returns the value of the hex digit c and sets bad if c is none, without branching
+ * on the input.
+ */
+static inline unsigned int
+hex_val(unsigned char c, unsigned int *bad)
+{
+	unsigned int digit = c - (unsigned int)'0';
+	unsigned int letter = (c | 0x20u) - (unsigned int)'a';
+	unsigned int is_digit = digit < 10;
+	unsigned int is_letter = letter < 6;
+
+	*bad |= !(is_digit | is_letter);
+	return (is_digit * digit) | (is_letter * (letter + 10));
+}
+
+#if defined(__SSE2__)
+/*
+ * Maps each nibble 0..15 in n to its ascii hex digit.
+ */
+static inline __m128i
+hex_sse2_digits(__m128i n)
+{
+	__m128i letter = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)),
+				       _mm_set1_epi8('a' - '0' - 10));
+	return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), letter);
+}
+
+/*
+ * Maps each hex digit in c to its value and collects non hex digits in bad.
+ */
+static inline __m128i
+hex_sse2_values(__m128i c, __m128i *bad)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	__m128i letter = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	// unsigned x <= limit iff the saturated x - limit is zero
+	__m128i is_digit = _mm_cmpeq_epi8(_mm_subs_epu8(digit, _mm_set1_epi8(9)), zero);
+	__m128i is_letter = _mm_cmpeq_epi8(_mm_subs_epu8(letter, _mm_set1_epi8(5)), zero);
+
+	*bad = _mm_or_si128(*bad, _mm_cmpeq_epi8(_mm_or_si128(is_digit, is_letter), zero));
+	return _mm_or_si128(_mm_and_si128(is_digit, digit),
+			    _mm_and_si128(is_letter, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+}
+
+/*
+ * Combines the 16 bit lanes of two digit values (high nibble first in memory) to bytes.
+ */
+static inline __m128i
+hex_sse2_pairs(__m128i v)
+{
+	__m128i hi = _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x00ff)), 4);
+	return _mm_or_si128(hi, _mm_srli_epi16(v, 8));
+}
+
+static size_t
+hex_encode_simd(char *hex, const uint8_t *bin, size_t len)
+{
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(bin + i));
+		__m128i mask = _mm_set1_epi8(0x0f);
+		__m128i hi = hex_sse2_digits(_mm_and_si128(_mm_srli_epi16(v, 4), mask));
+		__m128i lo = hex_sse2_digits(_mm_and_si128(v, mask));
+		_mm_storeu_si128((__m128i *)(hex + 2 * i), _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *)(hex + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+	return i;
+}
+
+static size_t
+hex_decode_simd(uint8_t *bin, const char *hex, size_t len, unsigned int *bad)
+{
+	size_t i = 0;
+	__m128i bad_v = _mm_setzero_si128();
+	for (; i + 32 <= len; i += 32) {
+		const __m128i *in = (const __m128i *)(hex + i);
+		__m128i a = hex_sse2_values(_mm_loadu_si128(in), &bad_v);
+		__m128i b = hex_sse2_values(_mm_loadu_si128(in + 1), &bad_v);
+		_mm_storeu_si128((__m128i *)(bin + i / 2),
+				 _mm_packus_epi16(hex_sse2_pairs(a), hex_sse2_pairs(b)));
+	}
+	*bad |= _mm_movemask_epi8(bad_v) != 0;
+	return i;
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+static inline uint8x16_t
+hex_neon_digits(uint8x16_t n)
+{
+	uint8x16_t letter = vandq_u8(vcgtq_u8(n, vdupq_n_u8(9)), vdupq_n_u8('a' - '0' - 10));
+	return vaddq_u8(vaddq_u8(n, vdupq_n_u8('0')), letter);
+}
+
+static inline uint8x16_t
+hex_neon_values(uint8x16_t c, uint8x16_t *bad)
+{
+	uint8x16_t digit = vsubq_u8(c, vdupq_n_u8('0'));
+	uint8x16_t letter = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+	uint8x16_t is_digit = vcltq_u8(digit, vdupq_n_u8(10));
+	uint8x16_t is_letter = vcltq_u8(letter, vdupq_n_u8(6));
+
+	*bad = vorrq_u8(*bad, vmvnq_u8(vorrq_u8(is_digit, is_letter)));
+	return vorrq_u8(vandq_u8(is_digit, digit),
+			vandq_u8(is_letter, vaddq_u8(letter, vdupq_n_u8(10))));
+}
+
+static size_t
+hex_encode_simd(char *hex, const uint8_t *bin, size_t len)
+{
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8(bin + i);
+		uint8x16x2_t out;
+		out.val[0] = hex_neon_digits(vshrq_n_u8(v, 4));
+		out.val[1] = hex_neon_digits(vandq_u8(v, vdupq_n_u8(0x0f)));
+		vst2q_u8((uint8_t *)hex + 2 * i, out);
+	}
+	return i;
+}
+
+static size_t
+hex_decode_simd(uint8_t *bin, const char *hex, size_t len, unsigned int *bad)
+{
+	size_t i = 0;
+	uint8x16_t bad_v = vdupq_n_u8(0);
+	for (; i + 32 <= len; i += 32) {
+		uint8x16x2_t in = vld2q_u8((const uint8_t *)hex + i);
+		uint8x16_t hi = hex_neon_values(in.val[0], &bad_v);
+		uint8x16_t lo = hex_neon_values(in.val[1], &bad_v);
+		vst1q_u8(bin + i / 2, vorrq_u8(vshlq_n_u8(hi, 4), lo));
+	}
+	*bad |= vmaxvq_u8(bad_v) != 0;
+	return i;
+}
+#else
+static size_t
+hex_encode_simd(UNUSED char *hex, UNUSED const uint8_t *bin, UNUSED size_t len)
+{
+	return 0;
+}
+
+static size_t
+hex_decode_simd(UNUSED uint8_t *bin, UNUSED const char *hex, UNUSED size_t len,
+		UNUSED unsigned int *bad)
+{
+	return 0;
+}
+#endif
+
+void
+hex_encode(char *hex, const uint8_t *bin, size_t len)
+{
+	ASSERT(hex);
+
+	size_t i = hex_encode_simd(hex, bin, len);
+	for (; i < len; i++) {
+		hex[2 * i] = hex_digits[bin[i] >> 4];
+		hex[2 * i + 1] = hex_digits[bin[i] & 0xf];
+	}
+	hex[2 * len] = '\0';
+}
+
+char *
+hex_encode_new(const uint8_t *bin, size_t len)
+{
+	size_t hex_len = MUL_WITH_OVERFLOW_CHECK(len, (size_t)2);
+	char *hex = mem_alloc(ADD_WITH_OVERFLOW_CHECK(hex_len, (size_t)1));
+
+	hex_encode(hex, bin, len);
+	return hex;
+}
+
+int
+hex_decode(uint8_t *bin, const char *hex, size_t len)
+{
+	ASSERT(bin);
+	IF_NULL_RETVAL(hex, -1);
+	IF_TRUE_RETVAL(len % 2 || len / 2 > INT_MAX, -1);
+
+	unsigned int bad = 0;
+	size_t i = hex_decode_simd(bin, hex, len, &bad);
+	for (; i < len; i += 2) {
+		unsigned int hi = hex_val(hex[i], &bad);
+		unsigned int lo = hex_val(hex[i + 1], &bad);
+		bin[i / 2] = (hi << 4) | lo;
+	}
+
+	return bad ? -1 : (int)(len / 2);
+}
+
+uint8_t *
+hex_decode_new(const char *hex, size_t *out_len)
+{
+	IF_NULL_RETVAL(hex, NULL);
+	ASSERT(out_len);
+
+	size_t len = strlen(hex);
+	size_t odd = len % 2;
+	uint8_t *bin = mem_alloc0(MAX(len / 2 + odd, (size_t)1));
+
+	if (odd) {
+		unsigned int bad = 0;
+		bin[0] = hex_val(hex[0], &bad);
+		IF_TRUE_GOTO(bad, err);
+	}
+	IF_TRUE_GOTO(hex_decode(bin + odd, hex + odd, len - odd) < 0, err);
+
+	*out_len = len / 2 + odd;
+	return bin;
+err:
+	mem_free0(bin);
+	return NULL;
+}
@@ -0,0 +1,80 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file hex.h
+ *
+ * Converts binary data like digests, keys and quotes to lower case hex strings and back.
+ * On x86 (SSE2) and ARM (NEON) 16 bytes are converted per step; other targets use a table
+ * based scalar implementation with the same results.
+ */
+
+#ifndef HEX_H
+#define HEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Writes the lower case hex representation of len bytes of bin to hex.
+ *
+ * @param hex Buffer of at least 2 * len + 1 bytes, null terminated afterwards.
+ * @param bin The data to be converted.
+ * @param len The number of bytes in bin.
+ */
+void
+hex_encode(char *hex, const uint8_t *bin, size_t len);
+
+/**
+ * Returns a newly allocated lower case hex string of len bytes of bin.
+ *
+ * @param bin The data to be converted.
+ * @param len The number of bytes in bin.
+ * @return The hex string which has to be freed by the caller.
+ */
+char *
+hex_encode_new(const uint8_t *bin, size_t len);
+
+/**
+ * Converts the len hex digits at hex, in upper or lower case, to len / 2 bytes.
+ *
+ * @param bin Buffer of at least len / 2 bytes.
+ * @param hex The hex digits, not necessarily null terminated.
+ * @param len The number of hex digits, has to be even.
+ * @return The number of bytes written, -1 if len is odd or hex contains a non hex digit.
+ */
+int
+hex_decode(uint8_t *bin, const char *hex, size_t len);
+
+/**
+ * Converts the null terminated hex string hex to a newly allocated buffer. An odd number
+ * of digits is treated as if a leading '0' was present.
+ *
+ * @param hex The hex string.
+ * @param out_len Set to the number of bytes in the returned buffer.
+ * @return The data which has to be freed by the caller, NULL if hex is no valid hex string.
+ */
+uint8_t *
+hex_decode_new(const char *hex, size_t *out_len);
+
+#endif /* HEX_H */
@@ -0,0 +1,161 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "hex.h"
+#include "logf.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static MunitResult
+test_hex_encode(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	uint8_t bin[71];
+	char expected[2 * sizeof(bin) + 1];
+
+	for (size_t i = 0; i < sizeof(bin); i++)
+		bin[i] = (uint8_t)(i * 37 + 11);
+
+	// cover the vectorized part and the scalar tail for every length
+	for (size_t len = 0; len <= sizeof(bin); len++) {
+		for (size_t i = 0; i < len; i++)
+			snprintf(expected + 2 * i, 3, "%02x", bin[i]);
+		expected[2 * len] = '\0';
+
+		char *hex = hex_encode_new(bin, len);
+		munit_assert_string_equal(hex, expected);
+		mem_free0(hex);
+	}
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_hex_decode(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	uint8_t bin[256];
+	uint8_t out[256];
+	char hex[2 * sizeof(bin) + 1];
+
+	for (size_t i = 0; i < sizeof(bin); i++)
+		bin[i] = (uint8_t)i;
+	hex_encode(hex, bin, sizeof(bin));
+
+	munit_assert_int(hex_decode(out, hex, strlen(hex)), ==, sizeof(bin));
+	munit_assert_memory_equal(sizeof(bin), out, bin);
+
+	// upper case digits
+	for (size_t i = 0; hex[i]; i++)
+		if (hex[i] >= 'a')
+			hex[i] -= 'a' - 'A';
+	munit_assert_int(hex_decode(out, hex, strlen(hex)), ==, sizeof(bin));
+	munit_assert_memory_equal(sizeof(bin), out, bin);
+
+	// an invalid digit is detected in the vectorized part as well as in the tail
+	const char invalid[] = { '/', ':', '@', 'G', '`', 'g', ' ', '\xff' };
+	for (size_t pos = 0; pos < 70; pos += 7) {
+		for (size_t i = 0; i < sizeof(invalid); i++) {
+			char saved = hex[pos];
+			hex[pos] = invalid[i];
+			munit_assert_int(hex_decode(out, hex, 70), ==, -1);
+			hex[pos] = saved;
+		}
+	}
+	munit_assert_int(hex_decode(out, hex, 69), ==, -1);
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_hex_decode_new(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	size_t len = 0;
+	uint8_t *bin = hex_decode_new("1a2B3c", &len);
+	munit_assert_not_null(bin);
+	munit_assert_size(len, ==, 3);
+	munit_assert_memory_equal(3, bin, "\x1a\x2b\x3c");
+	mem_free0(bin);
+
+	// odd length is padded with a leading zero
+	bin = hex_decode_new("abc", &len);
+	munit_assert_not_null(bin);
+	munit_assert_size(len, ==, 2);
+	munit_assert_memory_equal(2, bin, "\x0a\xbc");
+	mem_free0(bin);
+
+	bin = hex_decode_new("", &len);
+	munit_assert_not_null(bin);
+	munit_assert_size(len, ==, 0);
+	mem_free0(bin);
+
+	munit_assert_null(hex_decode_new("x12", &len));
+	munit_assert_null(hex_decode_new("12x", &len));
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/encode",		/* name */
+		test_hex_encode,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/decode",		/* name */
+		test_hex_decode,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/decode_new",		/* name */
+		test_hex_decode_new,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite hex_suite = {
+	"/hex",			/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
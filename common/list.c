@@ -27,11 +27,113 @@
 #include "macro.h"
 #include "mem.h"
 
+#include <pthread.h>
+
+/* Upper bound of unused list elements cached per thread */
+#define LIST_POOL_MAX 256
+
+/* Per-thread free list of unused list elements (chained by their next pointer)
+ * which are recycled by list_elem_new() to avoid a malloc/free pair for
+ * each element inserted into and removed from a list. */
+static __thread list_t *list_pool = NULL;
+static __thread unsigned int list_pool_len = 0;
+
+/* Trims the pool of a terminating thread. The key's value is set as soon as the
+ * thread caches its first element, as destructors only run for non-NULL values. */
+static pthread_key_t list_pool_key;
+static pthread_once_t list_pool_key_once = PTHREAD_ONCE_INIT;
+static __thread bool list_pool_key_set = false;
+
+static void
+list_pool_destructor(UNUSED void *value)
+{
+	list_pool_trim();
+	// other destructors may still free elements, which registers the thread again
+	list_pool_key_set = false;
+}
+
+static void
+list_pool_key_create(void)
+{
+	if (pthread_key_create(&list_pool_key, &list_pool_destructor))
+		WARN("Could not create key to trim list element pools on thread exit");
+}
+
+static void
+list_pool_register_thread(void)
+{
+	list_pool_key_set = true;
+	pthread_once(&list_pool_key_once, &list_pool_key_create);
+	if (pthread_setspecific(list_pool_key, &list_pool_key_set))
+		WARN("Could not register list element pool of this thread");
+}
+
+static list_t *
+list_elem_new(void *data)
+{
+	list_t *e = list_pool;
+
+	if (e) {
+		list_pool = e->next;
+		list_pool_len--;
+	} else {
+		e = mem_new(list_t, 1);
+	}
+	e->data = data;
+
+	return e;
+}
+
+static void
+list_elem_free(list_t *e)
+{
+	if (list_pool_len >= LIST_POOL_MAX) {
+		mem_free0(e);
+		return;
+	}
+
+	if (!list_pool_key_set)
+		list_pool_register_thread();
+
+	e->data = NULL;
+	e->prev = NULL;
+	e->next = list_pool;
+	list_pool = e;
+	list_pool_len++;
+}
+
+void
+list_pool_trim(void)
+{
+	while (list_pool) {
+		list_t *e = list_pool;
+		list_pool = e->next;
+		mem_free0(e);
+	}
+	list_pool_len = 0;
+}
+
+/* unlinks elem which must be part of the list and returns the new head */
+static list_t *
+list_unlink_elem(list_t *list, list_t *elem)
+{
+	list_t *head = list;
+
+	if (elem->prev)
+		elem->prev->next = elem->next;
+	else
+		head = elem->next; // elem was the head
+	if (elem->next)
+		elem->next->prev = elem->prev;
+	list_elem_free(elem);
+
+	return head;
+}
+
 list_t *
 list_append(list_t *list, void *data)
 {
-	list_t *e = mem_new(list_t, 1);
-	e->data = data;
+	list_t *e = list_elem_new(data);
 
 	list_t *tail = list_tail(list);
 	e->prev = tail;
@@ -72,7 +174,7 @@ void
 list_delete(list_t *list)
 {
 	while (list)
-		list = list_unlink(list, list);
+		list = list_unlink_elem(list, list);
 }
 
 list_t *
@@ -82,17 +184,7 @@ list_unlink(list_t *list, list_t *elem)
 	IF_FALSE_RETVAL(list_contains(list, elem),
 			list); // this also handles the case that list is NULL
 
-	list_t *head = list;
-
-	if (elem->prev)
-		elem->prev->next = elem->next;
-	else
-		head = elem->next; // elem was the head
-	if (elem->next)
-		elem->next->prev = elem->prev;
-	mem_free0(elem);
-
-	return head;
+	return list_unlink_elem(list, elem);
 }
 
 list_t *
@@ -155,8 +247,7 @@ list_nth_data(list_t *list, unsigned int n)
 list_t *
 list_prepend(list_t *list, void *data)
 {
-	list_t *e = mem_new(list_t, 1);
-	e->data = data;
+	list_t *e = list_elem_new(data);
 
 	e->prev = NULL;
 	e->next = list;
@@ -185,9 +276,8 @@ list_replace(list_t *list, list_t *elem, void *data)
 			list); // this also handles the case that list is NULL
 
 	list_t *head = list;
-	list_t *e = mem_new(list_t, 1);
+	list_t *e = list_elem_new(data);
 
-	e->data = data;
 	e->prev = elem->prev;
 	e->next = elem->next;
 
@@ -199,7 +289,7 @@ list_replace(list_t *list, list_t *elem, void *data)
 	if (elem->next)
 		elem->next->prev = e;
 
-	mem_free0(elem);
+	list_elem_free(elem);
 
 	return head;
 }
@@ -227,3 +317,59 @@ list_foreach(list_t *list, void(func)(void *))
 		}
 	} while (current && current != list);
 }
+
+void
+list_queue_append(list_queue_t *queue, void *data)
+{
+	IF_NULL_RETURN(queue);
+
+	list_t *e = list_elem_new(data);
+	e->prev = queue->tail;
+	e->next = NULL;
+
+	if (queue->tail)
+		queue->tail->next = e;
+	else
+		queue->head = e;
+	queue->tail = e;
+}
+
+void
+list_queue_prepend(list_queue_t *queue, void *data)
+{
+	IF_NULL_RETURN(queue);
+
+	queue->head = list_prepend(queue->head, data);
+	if (!queue->tail)
+		queue->tail = queue->head;
+}
+
+void
+list_queue_unlink(list_queue_t *queue, list_t *elem)
+{
+	IF_NULL_RETURN(queue);
+	IF_NULL_RETURN(elem);
+	IF_FALSE_RETURN(list_contains(queue->head, elem));
+
+	if (elem == queue->tail)
+		queue->tail = elem->prev;
+	queue->head = list_unlink_elem(queue->head, elem);
+}
+
+void
+list_queue_remove(list_queue_t *queue, void *data)
+{
+	IF_NULL_RETURN(queue);
+
+	list_queue_unlink(queue, list_find(queue->head, data));
+}
+
+void
+list_queue_delete(list_queue_t *queue)
+{
+	IF_NULL_RETURN(queue);
+
+	list_delete(queue->head);
+	queue->head = NULL;
+	queue->tail = NULL;
+}
@@ -29,6 +29,10 @@
  * be passed to the API functions in order to access or manipulate the list
  * elements. The head pointer may be NULL when calling list_append or
  * list_prepend in order to create a new list.
+ * Note that list_append has to walk to the tail of the list, use list_queue_t
+ * for lists which are built by appending many elements.
+ * Unused list elements are cached per thread and recycled, thus inserting and
+ * removing elements usually does not hit the heap allocator.
  */
 
 #ifndef LIST_H
@@ -206,4 +210,66 @@ list_replace(list_t *list, list_t *elem, void *data)
  */
 void
 list_foreach(list_t *list, void(func)(void *));
+/**
+ * Releases the unused list elements which are cached by the calling thread
+ * for recycling. List elements are recycled transparently and the cache of a
+ * thread is released when it terminates, calling this function is only needed
+ * to return the memory earlier.
+ */
+void
+list_pool_trim(void);
+
+/**
+ * A list which additionally keeps a pointer to its tail, so that elements can be
+ * appended in constant time. The head member is an ordinary list head, thus all
+ * functions which do not modify the list, e.g. list_find() or list_length(), and
+ * plain iteration can be used on it directly. The list must only be modified
+ * through the list_queue_*() functions. A zero initialized list_queue_t is an
+ * empty list.
+ */
+typedef struct list_queue {
+	list_t *head; /**< the head of the list */
+	list_t *tail; /**< the tail of the list */
+} list_queue_t;
+
+/**
+ * Appends a new element with the given payload at the end of the list in O(1).
+ * @param queue The list.
+ * @param data Payload of the new list element; may be NULL.
+ */
+void
+list_queue_append(list_queue_t *queue, void *data);
+
+/**
+ * Puts a new element with the given payload at the start of the list.
+ * @param queue The list.
+ * @param data Payload of the new list element; may be NULL.
+ */
+void
+list_queue_prepend(list_queue_t *queue, void *data);
+
+/**
+ * Deletes an element from the list.
+ * @param queue The list.
+ * @param elem The element to delete.
+ */
+void
+list_queue_unlink(list_queue_t *queue, list_t *elem);
+
+/**
+ * Deletes the first element from the list that contains the supplied data
+ * as payload.
+ * @param queue The list.
+ * @param data The payload data to search for as deletion criteria.
+ */
+void
+list_queue_remove(list_queue_t *queue, void *data);
+
+/**
+ * Deletes all elements of the list, which is empty afterwards.
+ * @param queue The list.
+ */
+void
+list_queue_delete(list_queue_t *queue);
+
 #endif /* LIST_H */
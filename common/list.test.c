@@ -0,0 +1,181 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "list.h"
+#include "logf.h"
+#include "mem.h"
+#include "macro.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define TEST_LIST_LEN 64
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	list_pool_trim();
+}
+
+static MunitResult
+test_list_recycles_elements(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	list_t *list = NULL;
+
+	for (int i = 0; i < TEST_LIST_LEN; i++)
+		list = list_append(list, (void *)(intptr_t)i);
+	list_delete(list);
+
+	// elements are taken from the pool now and have to be fully initialized
+	list = NULL;
+	for (int i = 0; i < TEST_LIST_LEN; i++)
+		list = list_prepend(list, (void *)(intptr_t)i);
+
+	munit_assert_uint(list_length(list), ==, TEST_LIST_LEN);
+	munit_assert_null(list->prev);
+	munit_assert_null(list_tail(list)->next);
+	for (int i = 0; i < TEST_LIST_LEN; i++)
+		munit_assert_int((intptr_t)list_nth_data(list, i), ==, TEST_LIST_LEN - 1 - i);
+
+	list = list_remove(list, (void *)(intptr_t)0);
+	munit_assert_uint(list_length(list), ==, TEST_LIST_LEN - 1);
+	list_delete(list);
+
+	return MUNIT_OK;
+}
+
+static void *
+test_list_thread(UNUSED void *data)
+{
+	list_t *list = NULL;
+
+	for (int i = 0; i < TEST_LIST_LEN; i++)
+		list = list_append(list, (void *)(intptr_t)i);
+	list_delete(list);
+
+	// the pooled elements are released on exit, which leak checkers verify
+	return NULL;
+}
+
+static MunitResult
+test_list_pool_released_on_thread_exit(UNUSED const MunitParameter params[],
+				       UNUSED void *data)
+{
+	for (int i = 0; i < 4; i++) {
+		pthread_t thread;
+		munit_assert_int(pthread_create(&thread, NULL, &test_list_thread, NULL), ==, 0);
+		munit_assert_int(pthread_join(thread, NULL), ==, 0);
+	}
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_list_queue_keeps_tail(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	list_queue_t queue = { NULL, NULL };
+
+	for (int i = 1; i <= 3; i++)
+		list_queue_append(&queue, (void *)(intptr_t)i);
+	list_queue_prepend(&queue, (void *)(intptr_t)0);
+
+	munit_assert_uint(list_length(queue.head), ==, 4);
+	munit_assert_ptr_equal(queue.tail, list_tail(queue.head));
+	for (int i = 0; i < 4; i++)
+		munit_assert_int((intptr_t)list_nth_data(queue.head, i), ==, i);
+
+	// removing the tail moves the tail pointer to its predecessor
+	list_queue_remove(&queue, (void *)(intptr_t)3);
+	munit_assert_ptr_equal(queue.tail, list_tail(queue.head));
+	munit_assert_int((intptr_t)queue.tail->data, ==, 2);
+
+	list_queue_append(&queue, (void *)(intptr_t)4);
+	munit_assert_int((intptr_t)queue.tail->data, ==, 4);
+	munit_assert_int((intptr_t)queue.tail->prev->data, ==, 2);
+
+	// elements which are not part of the list are ignored
+	list_queue_remove(&queue, (void *)(intptr_t)42);
+	munit_assert_uint(list_length(queue.head), ==, 4);
+
+	while (queue.head)
+		list_queue_unlink(&queue, queue.head);
+	munit_assert_null(queue.tail);
+
+	list_queue_append(&queue, (void *)(intptr_t)5);
+	munit_assert_ptr_equal(queue.head, queue.tail);
+
+	list_queue_delete(&queue);
+	munit_assert_null(queue.head);
+	munit_assert_null(queue.tail);
+
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/elements are recycled",    /* name */
+		test_list_recycles_elements, /* test */
+		setup,			     /* setup */
+		tear_down,		     /* tear_down */
+		MUNIT_TEST_OPTION_NONE,	     /* options */
+		NULL			     /* parameters */
+	},
+
+	{
+		"/list queue keeps track of its tail", /* name */
+		test_list_queue_keeps_tail,	       /* test */
+		setup,				       /* setup */
+		tear_down,			       /* tear_down */
+		MUNIT_TEST_OPTION_NONE,		       /* options */
+		NULL				       /* parameters */
+	},
+
+	{
+		"/element pools are released on thread exit", /* name */
+		test_list_pool_released_on_thread_exit,	      /* test */
+		setup,					      /* setup */
+		tear_down,				      /* tear_down */
+		MUNIT_TEST_OPTION_NONE,			      /* options */
+		NULL					      /* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite list_suite = {
+	"/list",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
@@ -46,6 +46,25 @@
 #define LOGF_FILE_STRIP "device/fraunhofer/common/cml/"
 #endif
 
+// source location of the message currently passed to the handlers, see logf_message_location()
+static __thread const char *logf_location_msg = NULL;
+static __thread const char *logf_location_file = NULL;
+static __thread int logf_location_line = 0;
+static __thread int logf_location_len = 0;
+
+static void
+logf_write_location(logf_prio_t prio, const char *msg, const char *file, int line, int len)
+{
+	logf_location_msg = msg;
+	logf_location_file = file;
+	logf_location_line = line;
+	logf_location_len = len;
+
+	logf_write(prio, msg);
+
+	logf_location_msg = NULL;
+}
+
 void
 logf_message(logf_prio_t prio, const char *fmt, ...)
 {
@@ -53,6 +72,9 @@ logf_message(logf_prio_t prio, const char *fmt, ...)
 	va_list ap;
 	int n;
 
+	if (prio < logf_min_prio)
+		return;
+
 	va_start(ap, fmt);
 	n = vsnprintf(buf, sizeof(buf), fmt, ap);
 	va_end(ap);
@@ -71,6 +93,9 @@ logf_message_errno(logf_prio_t prio, const char *fmt, ...)
 	va_list ap;
 	int n;
 
+	if (prio < logf_min_prio)
+		return;
+
 	va_start(ap, fmt);
 	n = vsnprintf(buf, sizeof(buf), fmt, ap);
 	va_end(ap);
@@ -93,6 +118,9 @@ logf_message_file(logf_prio_t prio, const char *file, int line, const char *fmt,
 	va_list ap;
 	int n;
 
+	if (prio < logf_min_prio)
+		return;
+
 	if (file && strstr(file, LOGF_FILE_STRIP) == file)
 		file += strlen(LOGF_FILE_STRIP);
 
@@ -101,6 +129,8 @@ logf_message_file(logf_prio_t prio, const char *file, int line, const char *fmt,
 	if (n < 0)
 		return;
 
+	int len = n;
+
 	va_start(ap, fmt);
 	n += vsnprintf(buf + n, sizeof(buf) - n, fmt, ap);
 	va_end(ap);
@@ -108,7 +138,7 @@ logf_message_file(logf_prio_t prio, const char *file, int line, const char *fmt,
 	if (n < 0)
 		return;
 
-	logf_write(prio, buf);
+	logf_write_location(prio, buf, file, line, len);
 }
 
 void
@@ -119,6 +149,9 @@ logf_message_file_errno(logf_prio_t prio, const char *file, int line, const char
 	va_list ap;
 	int n;
 
+	if (prio < logf_min_prio)
+		return;
+
 	if (file && strstr(file, LOGF_FILE_STRIP) == file)
 		file += strlen(LOGF_FILE_STRIP);
 
@@ -127,6 +160,8 @@ logf_message_file_errno(logf_prio_t prio, const char *file, int line, const char
 	if (n < 0)
 		return;
 
+	int len = n;
+
 	va_start(ap, fmt);
 	n += vsnprintf(buf + n, sizeof(buf) - n, fmt, ap);
 	va_end(ap);
@@ -139,19 +174,52 @@ logf_message_file_errno(logf_prio_t prio, const char *file, int line, const char
 	if (n < 0)
 		return;
 
-	logf_write(prio, buf);
+	logf_write_location(prio, buf, file, line, len);
 }
 
 /******************************************************************************/
 
 static list_t *logf_handler_list = NULL;
 
+logf_prio_t logf_min_prio = LOGF_PRIO_SILENT;
+
 struct logf_handler {
 	void (*func)(logf_prio_t prio, const char *msg, void *data);
 	void *data;
 	logf_prio_t prio;
 };
 
+static void
+logf_update_min_prio(void)
+{
+	logf_prio_t min_prio = LOGF_PRIO_SILENT;
+
+	for (list_t *l = logf_handler_list; l; l = l->next) {
+		logf_handler_t *h = l->data;
+		if (h && h->func && h->prio < min_prio)
+			min_prio = h->prio;
+	}
+	logf_min_prio = min_prio;
+}
+
+const char *
+logf_message_location(const char *msg, const char **file, int *line)
+{
+	if (!msg || msg != logf_location_msg) {
+		if (file)
+			*file = NULL;
+		if (line)
+			*line = 0;
+		return msg;
+	}
+
+	if (file)
+		*file = logf_location_file;
+	if (line)
+		*line = logf_location_line;
+	return msg + logf_location_len;
+}
+
 void
 logf_write(logf_prio_t prio, const char *msg)
 {
@@ -173,6 +241,7 @@ logf_register(void (*func)(logf_prio_t prio, const char *msg, void *data), void
 	handler->prio = LOGF_PRIO_TRACE;
 
 	logf_handler_list = list_append(logf_handler_list, handler);
+	logf_update_min_prio();
 
 	return handler;
 }
@@ -181,6 +250,7 @@ void
 logf_unregister(logf_handler_t *handler)
 {
 	logf_handler_list = list_remove(logf_handler_list, handler);
+	logf_update_min_prio();
 }
 
 void
@@ -188,6 +258,7 @@ logf_handler_set_prio(logf_handler_t *handler, logf_prio_t prio)
 {
 	ASSERT(handler);
 	handler->prio = prio;
+	logf_update_min_prio();
 }
 
 /******************************************************************************/
@@ -256,8 +327,8 @@ logf_file_write_timestamp(FILE *stream)
 	fprintf(stream, "%s.%06u%s ", buf1, (unsigned)tv.tv_usec, buf2);
 }
 
-static const char *
-prio_str(logf_prio_t prio)
+const char *
+logf_prio_to_string(logf_prio_t prio)
 {
 	switch (prio) {
 	case LOGF_PRIO_FATAL:
@@ -284,7 +355,7 @@ logf_file_write(logf_prio_t prio, const char *msg, void *data)
 		return;
 
 	logf_file_write_timestamp(data);
-	fprintf(data, "[%u] %s %s\n", getpid(), prio_str(prio), msg);
+	fprintf(data, "[%u] %s %s\n", getpid(), logf_prio_to_string(prio), msg);
 	fflush(data);
 }
 
@@ -294,7 +365,7 @@ logf_test_write(logf_prio_t prio, const char *msg, void *data)
 	if (!data)
 		return;
 
-	fprintf(data, "[%u] %s %s\n", getpid(), prio_str(prio), msg);
+	fprintf(data, "[%u] %s %s\n", getpid(), logf_prio_to_string(prio), msg);
 	fflush(data);
 }
 
@@ -331,7 +402,7 @@ logf_syslog_write(logf_prio_t prio, const char *msg, void *data)
 		break;
 	}
 
-	syslog(prio_syslog, "%s %s %s\n", prio_str(prio), (char *)data, msg);
+	syslog(prio_syslog, "%s %s %s\n", logf_prio_to_string(prio), (char *)data, msg);
 }
 
 void *
@@ -417,7 +488,7 @@ logf_klog_write(logf_prio_t prio, const char *msg, void *data)
 	}
 
 	klog_write(prio_klog, "<%u>%s[%u] %s %s\n", prio_klog, (char *)data, getpid(),
-		   prio_str(prio), msg);
+		   logf_prio_to_string(prio), msg);
 }
 #else
 void
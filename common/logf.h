@@ -51,6 +51,12 @@
  *
  * // Log to the kernel ring buffer using tag `sometag' (may be viewed with the `dmesg' command):
  * logf_register(&logf_klog_write, logf_klog_new("sometag"));
+ *
+ * // Log messages to file `somefile.log' from a background thread:
+ * logf_register(&logf_async_write, logf_async_new(logf_file_new("somefile.log"), 0));
+ *
+ * // Log structured binary records (see logf.proto) to file `somefile.pblog':
+ * logf_register(&logf_protobuf_write, logf_protobuf_new("somefile.pblog", NULL));
  * @endcode
  */
 
@@ -69,6 +75,14 @@ typedef enum {
 
 typedef struct logf_handler logf_handler_t;
 
+/**
+ * Lowest priority accepted by any of the registered handlers, LOGF_PRIO_SILENT if there
+ * are none. It is kept up to date by logf_register(), logf_unregister() and
+ * logf_handler_set_prio() and allows the logging macros to skip formatting messages
+ * which no handler would write.
+ */
+extern logf_prio_t logf_min_prio;
+
 /**
  * This function is only implicitly used by the logging macros defined in macro.h
  */
@@ -109,6 +123,13 @@ logf_message_file_errno(logf_prio_t prio, const char *file, int line, const char
 #endif
 	;
 
+/**
+ * Checks if a message of the given priority would be written. The first comparison
+ * is a compile time constant, thus disabled levels compile out completely, the second
+ * one reads a single global instead of formatting the message for no handler.
+ */
+#define logf_prio_enabled(level) ((level) >= LOGF_LOG_MIN_PRIO && (level) >= logf_min_prio)
+
 #ifndef DEBUG_BUILD
 // RELEASE BUILD: log INFO level and higher, include NEITHER file name NOR line number
 #ifndef LOGF_LOG_MIN_PRIO
@@ -117,12 +138,12 @@ logf_message_file_errno(logf_prio_t prio, const char *file, int line, const char
 
 #define logf_message_guard(level, ...)                                                             \
 	do {                                                                                       \
-		if (level >= LOGF_LOG_MIN_PRIO)                                                    \
+		if (logf_prio_enabled(level))                                                      \
 			logf_message(level, __VA_ARGS__);                                          \
 	} while (0)
 #define logf_message_errno_guard(level, ...)                                                       \
 	do {                                                                                       \
-		if (level >= LOGF_LOG_MIN_PRIO)                                                    \
+		if (logf_prio_enabled(level))                                                      \
 			logf_message_errno(level, __VA_ARGS__);                                    \
 	} while (0)
 
@@ -139,12 +160,12 @@ logf_message_file_errno(logf_prio_t prio, const char *file, int line, const char
 
 #define logf_message_guard(level, ...)                                                             \
 	do {                                                                                       \
-		if (level >= LOGF_LOG_MIN_PRIO)                                                    \
+		if (logf_prio_enabled(level))                                                      \
 			logf_message_file(level, __FILE__, __LINE__, __VA_ARGS__);                 \
 	} while (0)
 #define logf_message_errno_guard(level, ...)                                                       \
 	do {                                                                                       \
-		if (level >= LOGF_LOG_MIN_PRIO)                                                    \
+		if (logf_prio_enabled(level))                                                      \
 			logf_message_file_errno(level, __FILE__, __LINE__, __VA_ARGS__);           \
 	} while (0)
 
@@ -177,6 +198,19 @@ logf_message_file_errno(logf_prio_t prio, const char *file, int line, const char
 void
 logf_write(logf_prio_t prio, const char *msg);
 
+/**
+ * Returns the source location of a message while it is passed to the log writers.
+ * Allows writers which store the location separately to strip the "file+line: "
+ * prefix which is prepended to msg in debug builds.
+ *
+ * @param msg The log message passed to the writer.
+ * @param file Set to the source file name or NULL if msg carries no location.
+ * @param line Set to the source line or 0 if msg carries no location.
+ * @return msg without its location prefix.
+ */
+const char *
+logf_message_location(const char *msg, const char **file, int *line);
+
 /**
  * Registers a log writer.
  *
@@ -218,6 +252,30 @@ logf_file_new_name(const char *name);
 void *
 logf_file_new(const char *name);
 
+/**
+ * Default limits of rotating log files, see logf_file_rotating_new.
+ */
+#define LOGF_FILE_ROTATE_SIZE (16 * 1024 * 1024)
+#define LOGF_FILE_ROTATE_AGE (24 * 60 * 60)
+#define LOGF_FILE_ROTATE_TOTAL (128 * 1024 * 1024)
+
+/**
+ * Opens a log file like logf_file_new, which is rotated once it would exceed
+ * max_size bytes or is older than max_age seconds, i.e., a new file with the
+ * current timestamp is opened. Rotated files are gzip compressed to `<file>.gz'
+ * on a background thread, which afterwards deletes the oldest log files of name
+ * while all of them take more than max_total bytes. Forked children keep
+ * appending to the current file. Requires linking logf_rotate.c and zlib.
+ *
+ * @param name Name of the log file.
+ * @param max_size Maximum size of a log file in bytes, 0 for no limit.
+ * @param max_age Maximum age of a log file in seconds, 0 for no limit.
+ * @param max_total Maximum size of all log files of name in bytes, 0 for no limit.
+ * @return A stream for logf_file_write or logf_async_new, NULL on error.
+ */
+void *
+logf_file_rotating_new(const char *name, size_t max_size, unsigned max_age, size_t max_total);
+
 /**
  * Logs to stdout/stderr or to a file.
  * Cannot be used in conjunction with unit tests; use logf_test_write instead.
@@ -229,6 +287,95 @@ logf_file_new(const char *name);
 void
 logf_file_write(logf_prio_t prio, const char *msg, void *data);
 
+/**
+ * Returns the fixed width string representation of the given priority, e.g. "<WARN> ".
+ */
+const char *
+logf_prio_to_string(logf_prio_t prio);
+
+/**
+ * Default interval in milliseconds in which logf_async_write flushes queued messages.
+ */
+#define LOGF_ASYNC_FLUSH_INTERVAL 200
+
+/**
+ * Creates an asynchronous sink for logf_async_write, which writes to the given stream
+ * from a dedicated writer thread. Messages are queued in a lock-free ring buffer and
+ * written in batches at least every flush_interval ms, or earlier if the ring buffer
+ * fills up. If the ring buffer is full, messages are dropped and counted instead of
+ * blocking the caller. FATAL messages are flushed immediately by the caller.
+ *
+ * @param stream A stream as returned by logf_file_new; the sink takes ownership.
+ * @param flush_interval Flush interval in milliseconds, 0 for LOGF_ASYNC_FLUSH_INTERVAL.
+ * @return A pointer to the sink or NULL on error.
+ */
+void *
+logf_async_new(void *stream, unsigned int flush_interval);
+
+/**
+ * Queues a log message for asynchronous writing. In forked child processes,
+ * which do not have the writer thread, messages are written synchronously.
+ *
+ * @param prio Priority of the log message.
+ * @param msg The log message.
+ * @param data The sink returned by logf_async_new.
+ */
+void
+logf_async_write(logf_prio_t prio, const char *msg, void *data);
+
+/**
+ * Synchronously writes all queued messages of the sink.
+ */
+void
+logf_async_flush(void *data);
+
+/**
+ * Returns the number of messages which have been dropped since the sink was created.
+ */
+unsigned long
+logf_async_get_dropped(void *data);
+
+/**
+ * Writes the remaining queued messages, stops the writer thread and closes the
+ * stream of the sink unless it is stdout or stderr. The handler must have been
+ * unregistered before.
+ */
+void
+logf_async_free(void *data);
+
+/**
+ * Opens a binary log file for logf_protobuf_write. As logf_file_new, this will
+ * append a unique timestamp to the filename.
+ * The file contains LogMessage records (see logf.proto), each preceded by its
+ * length as 32 bit unsigned integer in network byte order, i.e., the framing of
+ * protobuf_send_message. Use the `log_render' command of the control tool to
+ * print it as text.
+ *
+ * @param name Name of the log file.
+ * @param uuid Container or device uuid stored in each record, may be NULL.
+ * @return A pointer to the sink or NULL on error.
+ */
+void *
+logf_protobuf_new(const char *name, const char *uuid);
+
+/**
+ * Logs a LogMessage record with timestamp, pid, priority, source location and
+ * message text to a binary log file. Requires linking logf_protobuf.c and
+ * logf.pb-c.c.
+ *
+ * @param prio Priority of the log message.
+ * @param msg The log message.
+ * @param data The sink returned by logf_protobuf_new.
+ */
+void
+logf_protobuf_write(logf_prio_t prio, const char *msg, void *data);
+
+/**
+ * Closes the binary log file. The handler must have been unregistered before.
+ */
+void
+logf_protobuf_free(void *data);
+
 /**
  *  Similar to logf_file_write but omits the (varying) timestamp and may thus
  *  be used for unit tests.
@@ -0,0 +1,248 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "logf.h"
+#include "mem.h"
+#include "macro.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TEST_LOGF_ASYNC_MESSAGES 5000
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	return logf_register(&logf_test_write, stderr);
+}
+
+static void
+tear_down(void *fixture)
+{
+	logf_unregister(fixture);
+	mem_free0(fixture);
+}
+
+static MunitResult
+test_logf_min_prio(UNUSED const MunitParameter params[], void *data)
+{
+	logf_handler_t *handler = data;
+
+	logf_handler_set_prio(handler, LOGF_PRIO_WARN);
+	munit_assert_int(logf_min_prio, ==, LOGF_PRIO_WARN);
+	munit_assert_false(logf_prio_enabled(LOGF_PRIO_INFO));
+	munit_assert_true(logf_prio_enabled(LOGF_PRIO_WARN));
+
+	// the most verbose handler determines the gate
+	logf_handler_t *verbose = logf_register(&logf_test_write, stderr);
+	munit_assert_true(logf_prio_enabled(LOGF_PRIO_INFO));
+	logf_unregister(verbose);
+	mem_free0(verbose);
+	munit_assert_false(logf_prio_enabled(LOGF_PRIO_INFO));
+
+	logf_unregister(handler);
+	munit_assert_int(logf_min_prio, ==, LOGF_PRIO_SILENT);
+	munit_assert_false(logf_prio_enabled(LOGF_PRIO_FATAL));
+
+	return MUNIT_OK;
+}
+
+static void
+logf_test_location_write(UNUSED logf_prio_t prio, const char *msg, void *data)
+{
+	const char **file = data;
+	int line;
+
+	const char *text = logf_message_location(msg, file, &line);
+	munit_assert_string_equal(text, "some message");
+	if (*file)
+		munit_assert_int(line, ==, 42);
+}
+
+static MunitResult
+test_logf_message_location(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	const char *file = NULL;
+	logf_handler_t *handler = logf_register(&logf_test_location_write, &file);
+
+	logf_message_file(LOGF_PRIO_INFO, "some/file.c", 42, "some %s", "message");
+	munit_assert_string_equal(file, "some/file.c");
+
+	logf_message(LOGF_PRIO_INFO, "some %s", "message");
+	munit_assert_null(file);
+
+	logf_unregister(handler);
+	mem_free0(handler);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_logf_async_write(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	FILE *f = tmpfile();
+	munit_assert_not_null(f);
+
+	void *sink = logf_async_new(f, 1);
+	munit_assert_not_null(sink);
+
+	for (int i = 0; i < TEST_LOGF_ASYNC_MESSAGES; i++) {
+		char msg[32];
+		snprintf(msg, sizeof(msg), "message %d", i);
+		logf_async_write(LOGF_PRIO_INFO, msg, sink);
+	}
+	// longer than the inline buffer of a ring buffer slot
+	char long_msg[1024];
+	memset(long_msg, 'x', sizeof(long_msg) - 1);
+	long_msg[sizeof(long_msg) - 1] = '\0';
+	logf_async_write(LOGF_PRIO_WARN, long_msg, sink);
+	logf_async_flush(sink);
+
+	// every message is either written or counted as dropped
+	size_t written = 0;
+	bool found_long_msg = false;
+	char line[2048];
+	rewind(f);
+	while (fgets(line, sizeof(line), f)) {
+		if (strstr(line, "<INFO>  message "))
+			written++;
+		if (strstr(line, long_msg))
+			found_long_msg = true;
+	}
+	munit_assert_size(written + found_long_msg + logf_async_get_dropped(sink), ==,
+			  TEST_LOGF_ASYNC_MESSAGES + 1);
+
+	logf_async_free(sink);
+
+	return MUNIT_OK;
+}
+
+static size_t
+test_logf_count_files(const char *dir, const char *suffix)
+{
+	size_t n = 0;
+	DIR *d = opendir(dir);
+	munit_assert_not_null(d);
+	for (struct dirent *e; (e = readdir(d));) {
+		size_t len = strlen(e->d_name);
+		if (e->d_name[0] != '.' && len >= strlen(suffix) &&
+		    !strcmp(e->d_name + len - strlen(suffix), suffix))
+			n++;
+	}
+	closedir(d);
+	return n;
+}
+
+static void
+test_logf_remove_files(const char *dir)
+{
+	DIR *d = opendir(dir);
+	munit_assert_not_null(d);
+	for (struct dirent *e; (e = readdir(d));) {
+		if (e->d_name[0] == '.')
+			continue;
+		char *path = mem_printf("%s/%s", dir, e->d_name);
+		unlink(path);
+		mem_free0(path);
+	}
+	closedir(d);
+}
+
+static MunitResult
+test_logf_file_rotating(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	char dir[] = "/tmp/logf_test_XXXXXX";
+	munit_assert_not_null(mkdtemp(dir));
+	char *name = mem_printf("%s/test", dir);
+	char msg[64];
+
+	// every message exceeds the size limit of a file, thus each ends up in its own file
+	FILE *f = logf_file_rotating_new(name, 16, 0, 0);
+	munit_assert_not_null(f);
+	for (int i = 0; i < 4; i++) {
+		snprintf(msg, sizeof(msg), "message %d", i);
+		logf_file_write(LOGF_PRIO_INFO, msg, f);
+		usleep(1000);
+	}
+	// waits for the compression of the last rotated file
+	fclose(f);
+	munit_assert_size(test_logf_count_files(dir, ".gz"), ==, 3);
+	munit_assert_size(test_logf_count_files(dir, ""), ==, 4);
+	test_logf_remove_files(dir);
+
+	// the oldest files are deleted, the current one is kept
+	f = logf_file_rotating_new(name, 16, 0, 1);
+	munit_assert_not_null(f);
+	for (int i = 0; i < 4; i++) {
+		snprintf(msg, sizeof(msg), "message %d", i);
+		logf_file_write(LOGF_PRIO_INFO, msg, f);
+		usleep(1000);
+	}
+	fclose(f);
+	munit_assert_size(test_logf_count_files(dir, ""), ==, 1);
+	munit_assert_size(test_logf_count_files(dir, ".gz"), ==, 0);
+	test_logf_remove_files(dir);
+
+	rmdir(dir);
+	mem_free0(name);
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/messages are only formatted if a handler accepts them", /* name */
+		test_logf_min_prio,					  /* test */
+		setup,							  /* setup */
+		tear_down,						  /* tear_down */
+		MUNIT_TEST_OPTION_NONE,					  /* options */
+		NULL							  /* parameters */
+	},
+	{ "/writers get the source location of a message", test_logf_message_location, setup,
+	  tear_down, MUNIT_TEST_OPTION_NONE, NULL },
+	{
+		"/async sink writes or counts every message", /* name */
+		test_logf_async_write,			      /* test */
+		setup,					      /* setup */
+		tear_down,				      /* tear_down */
+		MUNIT_TEST_OPTION_NONE,			      /* options */
+		NULL					      /* parameters */
+	},
+	{ "/rotating files are compressed and capped", test_logf_file_rotating, setup, tear_down,
+	  MUNIT_TEST_OPTION_NONE, NULL },
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite logf_suite = {
+	"/logf",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
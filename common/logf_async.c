@@ -0,0 +1,327 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "macro.h"
+#include "logf.h"
+#include "mem.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+// number of ring buffer slots, must be a power of two
+#define LOGF_ASYNC_SLOTS 1024
+// messages up to this length are stored in the slot, longer ones are copied to the heap
+#define LOGF_ASYNC_MSG_INLINE 256
+#define LOGF_ASYNC_BATCH_SIZE (16 * 1024)
+#define LOGF_ASYNC_LINE_MAX (4096 + 128)
+
+typedef struct logf_async_slot {
+	size_t seq; // sequence number, see logf_async_write()
+	logf_prio_t prio;
+	struct timeval tv;
+	char *msg_long;
+	char msg[LOGF_ASYNC_MSG_INLINE];
+} logf_async_slot_t;
+
+typedef struct logf_async {
+	FILE *stream;
+	int fd;
+	pid_t pid; // process which runs the writer thread
+	unsigned int flush_interval;
+
+	logf_async_slot_t slots[LOGF_ASYNC_SLOTS];
+	size_t head; // next slot to be claimed by a producer
+	size_t tail; // next slot to be written by the consumer
+	unsigned long dropped;
+	unsigned long dropped_reported;
+
+	pthread_t thread;
+	pthread_mutex_t drain_lock; // serializes consumers, i.e., writer thread and flushes
+	pthread_mutex_t wait_lock;
+	pthread_cond_t wakeup;
+	bool stop;
+
+	// consumer only: output batch and cached timestamp of the last second
+	char batch[LOGF_ASYNC_BATCH_SIZE];
+	size_t batch_len;
+	time_t ts_sec;
+	char ts_date[64];
+	char ts_zone[16];
+} logf_async_t;
+
+static void
+logf_async_batch_write(logf_async_t *sink)
+{
+	size_t off = 0;
+
+	// streams without a file descriptor, e.g., rotating log files, do their own writing
+	if (sink->fd < 0) {
+		fwrite(sink->batch, 1, sink->batch_len, sink->stream);
+		fflush(sink->stream);
+		sink->batch_len = 0;
+		return;
+	}
+
+	while (off < sink->batch_len) {
+		ssize_t ret = write(sink->fd, sink->batch + off, sink->batch_len - off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break; // nothing sensible left to do, the log itself is broken
+		off += ret;
+	}
+	sink->batch_len = 0;
+}
+
+static void
+logf_async_batch_append(logf_async_t *sink, logf_prio_t prio, const struct timeval *tv,
+			const char *msg)
+{
+	if (sink->batch_len + LOGF_ASYNC_LINE_MAX > sizeof(sink->batch))
+		logf_async_batch_write(sink);
+
+	// formatting the date is expensive, do it only once per second
+	if (tv->tv_sec != sink->ts_sec) {
+		struct tm tm;
+		sink->ts_sec = tv->tv_sec;
+		if (!localtime_r(&tv->tv_sec, &tm) ||
+		    !strftime(sink->ts_date, sizeof(sink->ts_date), "%Y-%m-%dT%H:%M:%S", &tm) ||
+		    !strftime(sink->ts_zone, sizeof(sink->ts_zone), "%z", &tm))
+			sink->ts_date[0] = sink->ts_zone[0] = '\0';
+	}
+
+	// same format as logf_file_write()
+	int n = snprintf(sink->batch + sink->batch_len, sizeof(sink->batch) - sink->batch_len,
+			 "%s.%06u%s [%u] %s %.4096s\n", sink->ts_date, (unsigned)tv->tv_usec,
+			 sink->ts_zone, sink->pid, logf_prio_to_string(prio), msg);
+	if (n > 0)
+		sink->batch_len += MIN((size_t)n, sizeof(sink->batch) - sink->batch_len - 1);
+}
+
+/**
+ * Writes all queued messages to the log file.
+ */
+static void
+logf_async_drain(logf_async_t *sink)
+{
+	pthread_mutex_lock(&sink->drain_lock);
+
+	for (;;) {
+		logf_async_slot_t *slot = &sink->slots[sink->tail & (LOGF_ASYNC_SLOTS - 1)];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq != sink->tail + 1)
+			break; // empty, or the producer has not yet finished the slot
+
+		logf_async_batch_append(sink, slot->prio, &slot->tv,
+					slot->msg_long ? slot->msg_long : slot->msg);
+		mem_free0(slot->msg_long);
+
+		// release the slot for the producers of the next round
+		__atomic_store_n(&slot->seq, sink->tail + LOGF_ASYNC_SLOTS, __ATOMIC_RELEASE);
+		__atomic_store_n(&sink->tail, sink->tail + 1, __ATOMIC_RELAXED);
+	}
+
+	unsigned long dropped = __atomic_load_n(&sink->dropped, __ATOMIC_RELAXED);
+	if (dropped != sink->dropped_reported) {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		char msg[64];
+		snprintf(msg, sizeof(msg), "%lu log messages dropped",
+			 dropped - sink->dropped_reported);
+		logf_async_batch_append(sink, LOGF_PRIO_WARN, &tv, msg);
+		sink->dropped_reported = dropped;
+	}
+
+	logf_async_batch_write(sink);
+
+	pthread_mutex_unlock(&sink->drain_lock);
+}
+
+static void *
+logf_async_thread(void *data)
+{
+	logf_async_t *sink = data;
+
+	pthread_mutex_lock(&sink->wait_lock);
+	while (!sink->stop) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += sink->flush_interval / 1000;
+		ts.tv_nsec += (sink->flush_interval % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&sink->wakeup, &sink->wait_lock, &ts);
+
+		pthread_mutex_unlock(&sink->wait_lock);
+		logf_async_drain(sink);
+		pthread_mutex_lock(&sink->wait_lock);
+	}
+	pthread_mutex_unlock(&sink->wait_lock);
+
+	logf_async_drain(sink);
+	return NULL;
+}
+
+void *
+logf_async_new(void *stream, unsigned int flush_interval)
+{
+	IF_NULL_RETVAL(stream, NULL);
+
+	logf_async_t *sink = mem_new0(logf_async_t, 1);
+	sink->stream = stream;
+	sink->fd = fileno(stream);
+	sink->pid = getpid();
+	sink->flush_interval = flush_interval ? flush_interval : LOGF_ASYNC_FLUSH_INTERVAL;
+	sink->ts_sec = -1;
+
+	for (size_t i = 0; i < LOGF_ASYNC_SLOTS; i++)
+		sink->slots[i].seq = i;
+
+	// data which has been written through stdio before must precede our output
+	fflush(stream);
+
+	pthread_mutex_init(&sink->drain_lock, NULL);
+	pthread_mutex_init(&sink->wait_lock, NULL);
+	pthread_cond_init(&sink->wakeup, NULL);
+
+	if (pthread_create(&sink->thread, NULL, logf_async_thread, sink) != 0) {
+		pthread_cond_destroy(&sink->wakeup);
+		pthread_mutex_destroy(&sink->wait_lock);
+		pthread_mutex_destroy(&sink->drain_lock);
+		mem_free0(sink);
+		return NULL;
+	}
+
+	return sink;
+}
+
+void
+logf_async_write(logf_prio_t prio, const char *msg, void *data)
+{
+	logf_async_t *sink = data;
+
+	if (!sink)
+		return;
+
+	// a forked child does not have the writer thread, write synchronously
+	if (getpid() != sink->pid) {
+		logf_file_write(prio, msg, sink->stream);
+		return;
+	}
+
+	// claim a slot, this is the bounded multi-producer queue by D. Vyukov:
+	// a slot is free for position pos if its sequence number equals pos,
+	// and filled, i.e., ready for the consumer, if it equals pos + 1
+	logf_async_slot_t *slot;
+	size_t pos = __atomic_load_n(&sink->head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &sink->slots[pos & (LOGF_ASYNC_SLOTS - 1)];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&sink->head, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			// full, never block the caller
+			__atomic_add_fetch(&sink->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&sink->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->prio = prio;
+	gettimeofday(&slot->tv, NULL);
+	size_t len = strlen(msg);
+	if (len < sizeof(slot->msg)) {
+		memcpy(slot->msg, msg, len + 1);
+		slot->msg_long = NULL;
+	} else {
+		slot->msg_long = mem_strdup(msg);
+	}
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	if (prio >= LOGF_PRIO_FATAL) {
+		// the process is about to abort, do not lose the reason
+		logf_async_drain(sink);
+	} else if (pos - __atomic_load_n(&sink->tail, __ATOMIC_RELAXED) > LOGF_ASYNC_SLOTS / 2) {
+		pthread_cond_signal(&sink->wakeup);
+	}
+}
+
+void
+logf_async_flush(void *data)
+{
+	logf_async_t *sink = data;
+
+	IF_NULL_RETURN(sink);
+
+	if (getpid() == sink->pid)
+		logf_async_drain(sink);
+}
+
+unsigned long
+logf_async_get_dropped(void *data)
+{
+	logf_async_t *sink = data;
+
+	IF_NULL_RETVAL(sink, 0);
+
+	return __atomic_load_n(&sink->dropped, __ATOMIC_RELAXED);
+}
+
+void
+logf_async_free(void *data)
+{
+	logf_async_t *sink = data;
+
+	IF_NULL_RETURN(sink);
+
+	pthread_mutex_lock(&sink->wait_lock);
+	sink->stop = true;
+	pthread_cond_signal(&sink->wakeup);
+	pthread_mutex_unlock(&sink->wait_lock);
+	pthread_join(sink->thread, NULL);
+
+	pthread_cond_destroy(&sink->wakeup);
+	pthread_mutex_destroy(&sink->wait_lock);
+	pthread_mutex_destroy(&sink->drain_lock);
+
+	if (sink->stream != stdout && sink->stream != stderr)
+		fclose(sink->stream);
+	mem_free0(sink);
+}
@@ -0,0 +1,138 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "logf.h"
+#include "logf.pb-c.h"
+
+#include "macro.h"
+#include "mem.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+ * Writers must not log themselves, as this would recurse into the handler.
+ * Thus, errors are silently ignored here, like fprintf() errors in logf_file_write.
+ */
+
+typedef struct logf_protobuf {
+	int fd;
+	char *uuid;
+} logf_protobuf_t;
+
+static LogPriority
+logf_protobuf_prio(logf_prio_t prio)
+{
+	switch (prio) {
+	case LOGF_PRIO_TRACE:
+		return LOG_PRIORITY__TRACE;
+	case LOGF_PRIO_DEBUG:
+		return LOG_PRIORITY__DEBUG;
+	case LOGF_PRIO_INFO:
+		return LOG_PRIORITY__INFO;
+	case LOGF_PRIO_WARN:
+		return LOG_PRIORITY__WARN;
+	case LOGF_PRIO_ERROR:
+		return LOG_PRIORITY__ERROR;
+	case LOGF_PRIO_FATAL:
+		return LOG_PRIORITY__FATAL;
+	default:
+		return LOG_PRIORITY__SILENT;
+	}
+}
+
+void *
+logf_protobuf_new(const char *name, const char *uuid)
+{
+	char *name_with_time_of_day = logf_file_new_name(name);
+	int fd = open(name_with_time_of_day, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	mem_free0(name_with_time_of_day);
+
+	if (fd < 0)
+		return NULL;
+
+	logf_protobuf_t *sink = mem_new0(logf_protobuf_t, 1);
+	sink->fd = fd;
+	sink->uuid = uuid ? mem_strdup(uuid) : NULL;
+
+	return sink;
+}
+
+void
+logf_protobuf_write(logf_prio_t prio, const char *msg, void *data)
+{
+	logf_protobuf_t *sink = data;
+	struct timeval tv;
+	const char *file;
+	int line;
+	uint8_t buf[4096 + 512];
+
+	if (!sink || !msg)
+		return;
+
+	LogMessage record = LOG_MESSAGE__INIT;
+	record.prio = logf_protobuf_prio(prio);
+	record.msg = (char *)logf_message_location(msg, &file, &line);
+	if (file) {
+		record.file = (char *)file;
+		record.has_line = true;
+		record.line = line;
+	}
+	if (!gettimeofday(&tv, NULL)) {
+		record.has_timestamp = true;
+		record.timestamp = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+	record.has_pid = true;
+	record.pid = getpid();
+	record.uuid = sink->uuid;
+
+	// messages are truncated to 4096 bytes by logf_message*, so they usually fit on the stack
+	size_t len = log_message__get_packed_size(&record);
+	uint8_t *packed = len <= sizeof(buf) ? buf : mem_alloc(len);
+	log_message__pack(&record, packed);
+
+	uint32_t header = htonl(len);
+	struct iovec iov[2] = { { .iov_base = &header, .iov_len = sizeof(header) },
+				{ .iov_base = packed, .iov_len = len } };
+	// a single write keeps records of concurrent (forked) writers from interleaving
+	writev(sink->fd, iov, 2);
+
+	if (packed != buf)
+		mem_free0(packed);
+}
+
+void
+logf_protobuf_free(void *data)
+{
+	logf_protobuf_t *sink = data;
+	IF_NULL_RETURN(sink);
+
+	close(sink->fd);
+	mem_free0(sink->uuid);
+	mem_free0(sink);
+}
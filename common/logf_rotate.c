@@ -0,0 +1,353 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "macro.h"
+#include "logf.h"
+#include "mem.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define LOGF_ROTATE_BUF_SIZE (64 * 1024)
+
+/*
+ * Nothing in here may log, as the functions run while the stream is locked by a
+ * writer, or concurrently to writers on the compressor thread.
+ */
+typedef struct logf_rotate {
+	char *name;
+	size_t max_size;
+	unsigned max_age;
+	size_t max_total;
+	pid_t pid; // process which rotates, forked children only append
+
+	int fd;
+	char *path;
+	size_t size;
+	time_t opened; // monotonic time in seconds
+
+	pthread_t compressor;
+	bool compressing;
+} logf_rotate_t;
+
+typedef struct logf_rotate_job {
+	int fd; // of the rotated file
+	char *path;
+	char *name;
+	ino_t current; // inode of the file currently written, never deleted
+	size_t max_total;
+} logf_rotate_job_t;
+
+typedef struct logf_rotate_file {
+	char *path;
+	off_t size;
+} logf_rotate_file_t;
+
+static time_t
+logf_rotate_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*
+ * Compresses the rotated file to <path>.gz and removes it, unless it was renamed
+ * or removed in the meantime.
+ */
+static void
+logf_rotate_compress(const logf_rotate_job_t *job)
+{
+	struct stat st_fd, st_path;
+	IF_TRUE_RETURN(fstat(job->fd, &st_fd) || stat(job->path, &st_path) ||
+		       st_fd.st_ino != st_path.st_ino);
+
+	char *gz_path = mem_printf("%s.gz", job->path);
+	char *tmp_path = mem_printf("%s.tmp", gz_path);
+	char *buf = mem_alloc(LOGF_ROTATE_BUF_SIZE);
+	bool ok = false;
+
+	gzFile gz = gzopen(tmp_path, "wbe");
+	IF_NULL_GOTO(gz, out);
+
+	off_t off = 0;
+	for (;;) {
+		ssize_t len = pread(job->fd, buf, LOGF_ROTATE_BUF_SIZE, off);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 || (len > 0 && gzwrite(gz, buf, len) != len))
+			break;
+		if (len == 0) {
+			ok = true;
+			break;
+		}
+		off += len;
+	}
+	if (gzclose(gz) != Z_OK)
+		ok = false;
+
+	if (ok && !rename(tmp_path, gz_path))
+		unlink(job->path);
+	else
+		unlink(tmp_path);
+out:
+	mem_free0(buf);
+	mem_free0(tmp_path);
+	mem_free0(gz_path);
+}
+
+static int
+logf_rotate_file_cmp(const void *a, const void *b)
+{
+	// the names only differ in their RFC3339 timestamps, i.e., sort by age
+	return strcmp(((const logf_rotate_file_t *)a)->path, ((const logf_rotate_file_t *)b)->path);
+}
+
+/*
+ * Deletes the oldest log files of name until all of them take at most max_total
+ * bytes. The file currently written is counted, but kept.
+ */
+static void
+logf_rotate_enforce_cap(const logf_rotate_job_t *job)
+{
+	char *name_dup = mem_strdup(job->name);
+	char *dir_dup = mem_strdup(job->name);
+	const char *base = basename(name_dup);
+	const char *dir = dirname(dir_dup);
+	size_t base_len = strlen(base);
+
+	logf_rotate_file_t *files = NULL;
+	size_t n = 0, cap = 0;
+	uint64_t total = 0;
+
+	DIR *d = opendir(dir);
+	IF_NULL_GOTO(d, out);
+	for (struct dirent *e; (e = readdir(d));) {
+		if (strncmp(e->d_name, base, base_len) || e->d_name[base_len] != '.')
+			continue;
+
+		char *path = mem_printf("%s/%s", dir, e->d_name);
+		struct stat st;
+		if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+			mem_free0(path);
+			continue;
+		}
+		total += st.st_size;
+		if (st.st_ino == job->current) {
+			mem_free0(path);
+			continue;
+		}
+		if (n == cap) {
+			cap = cap ? 2 * cap : 16;
+			files = mem_renew(logf_rotate_file_t, files, cap);
+		}
+		files[n].path = path;
+		files[n].size = st.st_size;
+		n++;
+	}
+	closedir(d);
+
+	qsort(files, n, sizeof(logf_rotate_file_t), logf_rotate_file_cmp);
+	for (size_t i = 0; i < n && total > job->max_total; i++) {
+		if (!unlink(files[i].path))
+			total -= files[i].size;
+	}
+
+	for (size_t i = 0; i < n; i++)
+		mem_free0(files[i].path);
+	mem_free0(files);
+out:
+	mem_free0(dir_dup);
+	mem_free0(name_dup);
+}
+
+static void *
+logf_rotate_compressor(void *data)
+{
+	logf_rotate_job_t *job = data;
+
+	logf_rotate_compress(job);
+	if (job->max_total)
+		logf_rotate_enforce_cap(job);
+
+	close(job->fd);
+	mem_free0(job->path);
+	mem_free0(job->name);
+	mem_free0(job);
+	return NULL;
+}
+
+/*
+ * Opens the file path, which is owned by r afterwards.
+ */
+static int
+logf_rotate_open(logf_rotate_t *r, char *path)
+{
+	// readable for the compressor, which must not reopen a possibly renamed file
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		mem_free0(path);
+		return -1;
+	}
+
+	r->fd = fd;
+	r->path = path;
+	r->size = 0;
+	r->opened = logf_rotate_now();
+	return 0;
+}
+
+static void
+logf_rotate_join(logf_rotate_t *r)
+{
+	if (r->compressing) {
+		pthread_join(r->compressor, NULL);
+		r->compressing = false;
+	}
+}
+
+/*
+ * Switches to a new file and hands the old one to the compressor thread. If the
+ * new file cannot be opened, logging continues to the old one.
+ */
+static void
+logf_rotate_rotate(logf_rotate_t *r)
+{
+	int old_fd = r->fd;
+	char *old_path = r->path;
+
+	// rotating twice within a microsecond would reopen the same file
+	char *path = logf_file_new_name(r->name);
+	if (!strcmp(path, old_path)) {
+		mem_free0(path);
+		return;
+	}
+
+	if (logf_rotate_open(r, path)) {
+		// retry with the next message of the next period
+		r->opened = logf_rotate_now();
+		r->size = 0;
+		return;
+	}
+
+	// rotations are far apart, thus waiting for the previous job hardly ever blocks
+	logf_rotate_join(r);
+
+	struct stat st;
+	logf_rotate_job_t *job = mem_new0(logf_rotate_job_t, 1);
+	job->fd = old_fd;
+	job->path = old_path;
+	job->name = mem_strdup(r->name);
+	job->current = fstat(r->fd, &st) ? 0 : st.st_ino;
+	job->max_total = r->max_total;
+
+	if (pthread_create(&r->compressor, NULL, logf_rotate_compressor, job)) {
+		// keep the file uncompressed
+		close(job->fd);
+		mem_free0(job->path);
+		mem_free0(job->name);
+		mem_free0(job);
+		return;
+	}
+	r->compressing = true;
+}
+
+static ssize_t
+logf_rotate_write(void *cookie, const char *buf, size_t len)
+{
+	logf_rotate_t *r = cookie;
+
+	if (getpid() == r->pid && r->size > 0 &&
+	    ((r->max_size && r->size + len > r->max_size) ||
+	     (r->max_age && logf_rotate_now() - r->opened >= (time_t)r->max_age)))
+		logf_rotate_rotate(r);
+
+	size_t off = 0;
+	while (off < len) {
+		ssize_t ret = write(r->fd, buf + off, len - off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return off ? (ssize_t)off : -1;
+		off += ret;
+	}
+	r->size += len;
+	return len;
+}
+
+static int
+logf_rotate_close(void *cookie)
+{
+	logf_rotate_t *r = cookie;
+
+	if (getpid() == r->pid)
+		logf_rotate_join(r);
+	close(r->fd);
+	mem_free0(r->path);
+	mem_free0(r->name);
+	mem_free0(r);
+	return 0;
+}
+
+void *
+logf_file_rotating_new(const char *name, size_t max_size, unsigned max_age, size_t max_total)
+{
+	IF_NULL_RETVAL(name, NULL);
+
+	logf_rotate_t *r = mem_new0(logf_rotate_t, 1);
+	r->name = mem_strdup(name);
+	r->max_size = max_size;
+	r->max_age = max_age;
+	r->max_total = max_total;
+	r->pid = getpid();
+
+	if (logf_rotate_open(r, logf_file_new_name(name))) {
+		mem_free0(r->name);
+		mem_free0(r);
+		return NULL;
+	}
+
+	cookie_io_functions_t io = { .write = logf_rotate_write, .close = logf_rotate_close };
+	FILE *stream = fopencookie(r, "w", io);
+	if (!stream) {
+		logf_rotate_close(r);
+		return NULL;
+	}
+	return stream;
+}
@@ -23,19 +23,40 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
 #include <linux/loop.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 
 #include "loopdev.h"
+#include "file.h"
 
 #include "macro.h"
 #include "mem.h"
 
+#ifndef LOOP_CTL_ADD
+#define LOOP_CTL_ADD 0x4C80
+#endif
 #ifndef LOOP_CTL_GET_FREE
 #define LOOP_CTL_GET_FREE 0x4C82
 #endif
+#ifndef LO_FLAGS_DIRECT_IO
+#define LO_FLAGS_DIRECT_IO 16
+#endif
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE 0x4C0A
+struct loop_config {
+	__u32 fd;
+	__u32 block_size;
+	struct loop_info64 info;
+	__u64 __reserved[8];
+};
+#endif
 
 #ifdef ANDROID
 #define LOOP_DEV_PREFIX "/dev/block/loop"
@@ -45,6 +66,12 @@
 
 #define LOOP_CONTROL "/dev/loop-control"
 
+// the loop attribute directory only exists while a backing file is attached
+#define LOOP_SYSFS_BOUND "/sys/block/loop%d/loop"
+
+// upper bound of loop device indices probed while filling the pool
+#define LOOP_POOL_MAX_INDEX 1024
+
 char *
 loopdev_new(void)
 {
@@ -70,6 +97,35 @@ loopdev_new(void)
 	return mem_printf("%s%d", LOOP_DEV_PREFIX, i);
 }
 
+int
+loopdev_pool_fill(unsigned count)
+{
+	int fd;
+	unsigned free_count = 0;
+
+	fd = open(LOOP_CONTROL, O_RDONLY);
+	if (fd < 0) {
+		ERROR_ERRNO("Cannot open %s", LOOP_CONTROL);
+		return -1;
+	}
+
+	for (int i = 0; i < LOOP_POOL_MAX_INDEX && free_count < count; i++) {
+		if (ioctl(fd, LOOP_CTL_ADD, i) < 0 && errno != EEXIST) {
+			WARN_ERRNO("Cannot add loop device %d", i);
+			break;
+		}
+
+		char bound[sizeof(LOOP_SYSFS_BOUND) + 12];
+		snprintf(bound, sizeof(bound), LOOP_SYSFS_BOUND, i);
+		if (access(bound, F_OK) < 0)
+			free_count++;
+	}
+	close(fd);
+
+	DEBUG("Loop device pool holds %u free devices", free_count);
+	return free_count;
+}
+
 void
 loopdev_free(char *dev)
 {
@@ -79,44 +135,19 @@ loopdev_free(char *dev)
 int
 loopdev_wait(const char *dev, unsigned timeout)
 {
-	unsigned i;
-
-	for (i = 0; i < timeout; i++) {
-		struct stat st;
-
-		DEBUG("Checking loop device %s (%i/%i)", dev, i, timeout);
-		if (stat(dev, &st) || !S_ISBLK(st.st_mode))
-			usleep(1000);
-		else
-			return 0;
-	}
-
-	return -1;
+	DEBUG("Waiting for loop device %s", dev);
+	return file_wait_dev(dev, timeout);
 }
 
 /*
- * Taken from:
+ * Fallback for kernels without LOOP_CONFIGURE (< 5.8), taken from:
  * http://stackoverflow.com/questions/11295154/how-do-i-loop-mount-programmatically
  */
-
-int
-loopdev_setup_device(const char *img, const char *dev)
+static int
+loopdev_setup_device_legacy(int img_fd, int dev_fd, const char *dev, bool direct_io)
 {
 	struct loop_info64 info;
 	memset(&info, 0, sizeof(info));
-	int img_fd, dev_fd = -1;
-
-	img_fd = open(img, O_RDWR | O_EXCL);
-	if (img_fd < 0) {
-		ERROR_ERRNO("Could not open image file %s", img);
-		goto error;
-	}
-
-	dev_fd = open(dev, O_RDWR);
-	if (dev_fd < 0) {
-		ERROR_ERRNO("Could not open device %s", dev);
-		goto error;
-	}
 
 	if (ioctl(dev_fd, LOOP_SET_FD, img_fd) < 0) {
 		ERROR_ERRNO("Failed to set fd of loop device %s", dev);
@@ -136,16 +167,71 @@ loopdev_setup_device(const char *img, const char *dev)
 		goto error;
 	}
 
+	// direct I/O is an optimization only, keep buffered I/O if unsupported
+	if (direct_io && ioctl(dev_fd, LOOP_SET_DIRECT_IO, 1) < 0)
+		DEBUG_ERRNO("Could not enable direct I/O for loop device %s", dev);
+
+	return 0;
+
+error:
+	ioctl(dev_fd, LOOP_CLR_FD, 0);
+	return -1;
+}
+
+int
+loopdev_setup_device(const char *img, const char *dev, bool direct_io, bool read_only)
+{
+	struct loop_config config;
+	memset(&config, 0, sizeof(config));
+	int img_fd, dev_fd = -1;
+	int err = 0;
+
+	img_fd = open(img, read_only ? O_RDONLY : O_RDWR);
+	if (img_fd < 0) {
+		err = errno;
+		ERROR_ERRNO("Could not open image file %s", img);
+		goto error;
+	}
+
+	dev_fd = open(dev, O_RDWR);
+	if (dev_fd < 0) {
+		err = errno;
+		ERROR_ERRNO("Could not open device %s", dev);
+		goto error;
+	}
+
+	/*
+	 * Attach the image and set all flags in one go. Autoclear means we do not
+	 * need a detach of the loop device after umount. If the kernel cannot do
+	 * direct I/O on the backing file it silently keeps buffered I/O.
+	 */
+	config.fd = img_fd;
+	config.info.lo_flags = LO_FLAGS_AUTOCLEAR;
+	if (direct_io)
+		config.info.lo_flags |= LO_FLAGS_DIRECT_IO;
+	if (read_only)
+		config.info.lo_flags |= LO_FLAGS_READ_ONLY;
+
+	if (ioctl(dev_fd, LOOP_CONFIGURE, &config) < 0) {
+		err = errno;
+		if (err != EINVAL && err != ENOTTY) {
+			ERROR_ERRNO("Failed to configure loop device %s", dev);
+			goto error;
+		}
+		if (loopdev_setup_device_legacy(img_fd, dev_fd, dev, direct_io) < 0) {
+			err = errno;
+			goto error;
+		}
+	}
+
 	close(img_fd);
 	return dev_fd;
 
 error:
 	if (img_fd >= 0)
 		close(img_fd);
-
-	if (dev_fd >= 0) {
-		ioctl(dev_fd, LOOP_CLR_FD, 0);
+	if (dev_fd >= 0)
 		close(dev_fd);
-	}
+	errno = err;
 	return -1;
 }
@@ -32,6 +32,8 @@
 #ifndef LOOPDEV_H
 #define LOOPDEV_H
 
+#include <stdbool.h>
+
 /**
  * Get a free loop device.
  * @return The path of the loop device or NULL in case of an error.
@@ -48,6 +50,16 @@ loopdev_new(void);
 void
 loopdev_free(char *dev);
 
+/**
+ * Pre-create loop devices until at least count of them are unbound, so that the
+ * devices handed out by loopdev_new() already have their nodes in the dev file
+ * system. Further devices are still created on demand by loopdev_new().
+ * @param count The number of free loop devices to keep ready.
+ * @return The number of free loop devices found or created, -1 on error.
+ */
+int
+loopdev_pool_fill(unsigned count);
+
 /**
  * Wait until the loop device appears in the dev file system.
  * @param dev The path for the loop device, e.g. /dev/loop0.
@@ -64,11 +76,15 @@ loopdev_wait(const char *dev, unsigned timeout);
  * @param img The path to an image file.
  * @param dev The path for the loop device, e.g. /dev/loop0.
  * Call loopdev_new() to get one.
+ * @param direct_io Bypass the page cache for the image file, which avoids caching
+ * its contents twice, i.e., once for the image and once for the loop device.
+ * @param read_only Attach the image read-only.
  * @return A file descriptor for the loop device or -1 in case of an
  * error. The caller must close the file descriptor after calling mount.
+ * errno is set to EBUSY if dev was taken by someone else in the meantime.
  */
 
 int
-loopdev_setup_device(const char *img, const char *dev);
+loopdev_setup_device(const char *img, const char *dev, bool direct_io, bool read_only);
 
 #endif /* LOOPDEV_H */
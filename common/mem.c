@@ -22,6 +22,7 @@
  */
 
 #define _GNU_SOURCE
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,6 +32,21 @@
 #include "mem.h"
 #include "macro.h"
 
+static bool mem_acct_enabled = false;
+
+static void
+mem_acct_alloc(void *p, size_t size, uintptr_t site);
+
+static void
+mem_acct_free(void *p);
+
+/* accounts an allocation to the caller of the enclosing mem_* function */
+#define MEM_ACCT_ALLOC(p, size)                                                                    \
+	do {                                                                                       \
+		if (__atomic_load_n(&mem_acct_enabled, __ATOMIC_RELAXED))                          \
+			mem_acct_alloc(p, size, (uintptr_t)__builtin_return_address(0));           \
+	} while (0)
+
 #define DEBUG_THRESHOLD(size)                                                                      \
 	do {                                                                                       \
 		if (size > (1024 * 1024))                                                          \
@@ -43,6 +59,7 @@ mem_alloc(size_t size)
 	DEBUG_THRESHOLD(size);
 	void *p = malloc(size);
 	ASSERT(p);
+	MEM_ACCT_ALLOC(p, size);
 	return p;
 }
 
@@ -52,6 +69,7 @@ mem_alloc0(size_t size)
 	DEBUG_THRESHOLD(size);
 	void *p = calloc(1, size);
 	ASSERT(p);
+	MEM_ACCT_ALLOC(p, size);
 	return p;
 }
 
@@ -59,8 +77,11 @@ void *
 mem_realloc(void *mem, size_t size)
 {
 	DEBUG_THRESHOLD(size);
+	if (mem && __atomic_load_n(&mem_acct_enabled, __ATOMIC_RELAXED))
+		mem_acct_free(mem);
 	void *p = realloc(mem, size);
 	ASSERT(p);
+	MEM_ACCT_ALLOC(p, size);
 	return p;
 }
 
@@ -70,6 +91,7 @@ mem_strdup(const char *str)
 	ASSERT(str);
 	char *p = strdup(str);
 	ASSERT(p);
+	MEM_ACCT_ALLOC(p, strlen(p) + 1);
 	return p;
 }
 
@@ -80,6 +102,7 @@ mem_strndup(const char *str, size_t len)
 	DEBUG_THRESHOLD(len);
 	char *p = strndup(str, len);
 	ASSERT(p);
+	MEM_ACCT_ALLOC(p, strlen(p) + 1);
 	return p;
 }
 
@@ -87,9 +110,11 @@ unsigned char *
 mem_memcpy(const unsigned char *mem, size_t size)
 {
 	ASSERT(mem);
-	unsigned char *p = mem_alloc0(size);
+	DEBUG_THRESHOLD(size);
+	unsigned char *p = calloc(1, size);
 	ASSERT(p);
 	memcpy(p, mem, size);
+	MEM_ACCT_ALLOC(p, size);
 	return p;
 }
 
@@ -98,7 +123,9 @@ mem_vprintf(const char *fmt, va_list ap)
 {
 	char *p = NULL;
 	ASSERT(fmt);
-	ASSERT(vasprintf(&p, fmt, ap) >= 0);
+	int len = vasprintf(&p, fmt, ap);
+	ASSERT(len >= 0);
+	MEM_ACCT_ALLOC(p, (size_t)len + 1);
 	return p;
 }
 
@@ -109,14 +136,19 @@ mem_printf(const char *fmt, ...)
 	va_list ap;
 	ASSERT(fmt);
 	va_start(ap, fmt);
-	ASSERT(vasprintf(&p, fmt, ap) >= 0);
+	int len = vasprintf(&p, fmt, ap);
 	va_end(ap);
+	ASSERT(len >= 0);
+	MEM_ACCT_ALLOC(p, (size_t)len + 1);
 	return p;
 }
 
 void
 mem_free(void *ptr)
 {
+	// forget the allocation before its address can be reused by another thread
+	if (ptr && __atomic_load_n(&mem_acct_enabled, __ATOMIC_RELAXED))
+		mem_acct_free(ptr);
 	free(ptr);
 }
 
@@ -138,3 +170,386 @@ mem_free_array(void **array, size_t size)
 		mem_free0(array);
 	}
 }
+
+/******************************************************************************/
+
+/* slots of the site table, sites beyond 3/4 of it are accounted to the last slot */
+#define MEM_ACCT_SITES 2048
+/* initial number of slots of the table of live allocations */
+#define MEM_ACCT_PTRS_MIN 4096
+/* yields while waiting for the lock before giving up, since after clone(2) the
+ * lock may be held by a thread which does not exist in the child */
+#define MEM_ACCT_LOCK_YIELDS 100000
+
+typedef struct {
+	uintptr_t ptr; /**< address of the allocation, 0 for an empty slot */
+	size_t size;   /**< requested size */
+	uint32_t site; /**< index into mem_acct_sites */
+} mem_acct_ptr_t;
+
+static bool mem_acct_locked = false;
+static mem_site_stats_t mem_acct_sites[MEM_ACCT_SITES + 1];
+static size_t mem_acct_n_sites = 0;
+static mem_site_stats_t mem_acct_total;
+/* open addressing with linear probing, the size is a power of 2 */
+static mem_acct_ptr_t *mem_acct_ptrs = NULL;
+static size_t mem_acct_ptrs_size = 0;
+static size_t mem_acct_ptrs_used = 0;
+
+static size_t
+mem_acct_hash(uintptr_t key, size_t size)
+{
+	return (size_t)(((uint64_t)key * 0x9e3779b97f4a7c15ULL) >> 32) & (size - 1);
+}
+
+static bool
+mem_acct_lock(void)
+{
+	for (int i = 0; __atomic_test_and_set(&mem_acct_locked, __ATOMIC_ACQUIRE); i++) {
+		if (i == MEM_ACCT_LOCK_YIELDS) {
+			__atomic_store_n(&mem_acct_enabled, false, __ATOMIC_RELAXED);
+			return false;
+		}
+		sched_yield();
+	}
+	return true;
+}
+
+static void
+mem_acct_unlock(void)
+{
+	__atomic_clear(&mem_acct_locked, __ATOMIC_RELEASE);
+}
+
+static mem_site_stats_t *
+mem_acct_site(uintptr_t site)
+{
+	size_t i = mem_acct_hash(site, MEM_ACCT_SITES);
+
+	for (; mem_acct_sites[i].site; i = (i + 1) & (MEM_ACCT_SITES - 1)) {
+		if (mem_acct_sites[i].site == site)
+			return &mem_acct_sites[i];
+	}
+	if (mem_acct_n_sites >= MEM_ACCT_SITES / 4 * 3)
+		return &mem_acct_sites[MEM_ACCT_SITES];
+
+	mem_acct_n_sites++;
+	mem_acct_sites[i].site = site;
+	return &mem_acct_sites[i];
+}
+
+/* returns the slot of ptr or the empty slot where it would be inserted */
+static mem_acct_ptr_t *
+mem_acct_ptr_find(uintptr_t ptr)
+{
+	size_t mask = mem_acct_ptrs_size - 1;
+	size_t i = mem_acct_hash(ptr, mem_acct_ptrs_size);
+
+	while (mem_acct_ptrs[i].ptr && mem_acct_ptrs[i].ptr != ptr)
+		i = (i + 1) & mask;
+	return &mem_acct_ptrs[i];
+}
+
+static bool
+mem_acct_ptrs_grow(void)
+{
+	size_t size = mem_acct_ptrs_size ? mem_acct_ptrs_size * 2 : MEM_ACCT_PTRS_MIN;
+	mem_acct_ptr_t *ptrs = calloc(size, sizeof(mem_acct_ptr_t));
+	IF_NULL_RETVAL(ptrs, false);
+
+	mem_acct_ptr_t *old = mem_acct_ptrs;
+	size_t old_size = mem_acct_ptrs_size;
+	mem_acct_ptrs = ptrs;
+	mem_acct_ptrs_size = size;
+	for (size_t i = 0; i < old_size; i++) {
+		if (old[i].ptr)
+			*mem_acct_ptr_find(old[i].ptr) = old[i];
+	}
+	free(old);
+	return true;
+}
+
+/* accounts the allocation in slot as freed and empties the slot */
+static void
+mem_acct_ptr_release(mem_acct_ptr_t *slot)
+{
+	mem_site_stats_t *site = &mem_acct_sites[slot->site];
+	site->frees++;
+	site->live_bytes -= slot->size;
+	mem_acct_total.frees++;
+	mem_acct_total.live_bytes -= slot->size;
+
+	// backward shift deletion keeps the probe sequences intact without tombstones
+	size_t mask = mem_acct_ptrs_size - 1;
+	size_t hole = slot - mem_acct_ptrs;
+	for (size_t i = (hole + 1) & mask; mem_acct_ptrs[i].ptr; i = (i + 1) & mask) {
+		size_t home = mem_acct_hash(mem_acct_ptrs[i].ptr, mem_acct_ptrs_size);
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			mem_acct_ptrs[hole] = mem_acct_ptrs[i];
+			hole = i;
+		}
+	}
+	mem_acct_ptrs[hole].ptr = 0;
+	mem_acct_ptrs_used--;
+}
+
+static void
+mem_acct_alloc(void *p, size_t size, uintptr_t site)
+{
+	IF_FALSE_RETURN(mem_acct_lock());
+
+	// the accounting may have been disabled meanwhile
+	if (!mem_acct_enabled ||
+	    ((mem_acct_ptrs_used + 1) * 2 > mem_acct_ptrs_size && !mem_acct_ptrs_grow())) {
+		mem_acct_unlock();
+		return;
+	}
+
+	mem_acct_ptr_t *slot = mem_acct_ptr_find((uintptr_t)p);
+	// the previous allocation at this address was freed with free(3)
+	if (slot->ptr) {
+		mem_acct_ptr_release(slot);
+		slot = mem_acct_ptr_find((uintptr_t)p);
+	}
+	mem_acct_ptrs_used++;
+
+	mem_site_stats_t *stats = mem_acct_site(site);
+	slot->ptr = (uintptr_t)p;
+	slot->size = size;
+	slot->site = stats - mem_acct_sites;
+
+	stats->allocs++;
+	stats->live_bytes += size;
+	stats->peak_bytes = MAX(stats->peak_bytes, stats->live_bytes);
+	mem_acct_total.allocs++;
+	mem_acct_total.live_bytes += size;
+	mem_acct_total.peak_bytes = MAX(mem_acct_total.peak_bytes, mem_acct_total.live_bytes);
+
+	mem_acct_unlock();
+}
+
+static void
+mem_acct_free(void *p)
+{
+	IF_FALSE_RETURN(mem_acct_lock());
+
+	if (mem_acct_enabled && mem_acct_ptrs) {
+		mem_acct_ptr_t *slot = mem_acct_ptr_find((uintptr_t)p);
+		if (slot->ptr)
+			mem_acct_ptr_release(slot);
+	}
+
+	mem_acct_unlock();
+}
+
+void
+mem_accounting_enable(bool enable)
+{
+	// called by a thread of this process, so the holder will release the lock
+	while (__atomic_test_and_set(&mem_acct_locked, __ATOMIC_ACQUIRE))
+		sched_yield();
+
+	if (enable && !mem_acct_enabled) {
+		memset(mem_acct_sites, 0, sizeof(mem_acct_sites));
+		memset(&mem_acct_total, 0, sizeof(mem_acct_total));
+		mem_acct_n_sites = 0;
+		free(mem_acct_ptrs);
+		mem_acct_ptrs = NULL;
+		mem_acct_ptrs_size = 0;
+		mem_acct_ptrs_used = 0;
+	}
+	__atomic_store_n(&mem_acct_enabled, enable, __ATOMIC_RELAXED);
+
+	mem_acct_unlock();
+}
+
+bool
+mem_accounting_is_enabled(void)
+{
+	return __atomic_load_n(&mem_acct_enabled, __ATOMIC_RELAXED);
+}
+
+static int
+mem_acct_cmp_live_bytes(const void *a, const void *b)
+{
+	const mem_site_stats_t *sa = a;
+	const mem_site_stats_t *sb = b;
+
+	if (sa->live_bytes != sb->live_bytes)
+		return sa->live_bytes < sb->live_bytes ? 1 : -1;
+	return sa->allocs < sb->allocs ? 1 : sa->allocs > sb->allocs ? -1 : 0;
+}
+
+mem_site_stats_t *
+mem_accounting_get_new(mem_site_stats_t *total)
+{
+	ASSERT(total);
+
+	// not accounted itself, allocated before taking the lock
+	mem_site_stats_t *sites = calloc(MEM_ACCT_SITES + 2, sizeof(mem_site_stats_t));
+	ASSERT(sites);
+	size_t n = 0;
+
+	while (__atomic_test_and_set(&mem_acct_locked, __ATOMIC_ACQUIRE))
+		sched_yield();
+
+	for (size_t i = 0; i <= MEM_ACCT_SITES; i++) {
+		if (mem_acct_sites[i].allocs)
+			sites[n++] = mem_acct_sites[i];
+	}
+	*total = mem_acct_total;
+
+	mem_acct_unlock();
+
+	qsort(sites, n, sizeof(mem_site_stats_t), mem_acct_cmp_live_bytes);
+	return sites;
+}
+
+/******************************************************************************/
+
+/* default size of the chunks of an arena */
+#define MEM_ARENA_CHUNK_SIZE 4096
+/* alignment of all allocations served by an arena (same as malloc) */
+#define MEM_ARENA_ALIGN (2 * sizeof(void *))
+
+typedef struct mem_arena_chunk mem_arena_chunk_t;
+struct mem_arena_chunk {
+	mem_arena_chunk_t *next; /**< the previously allocated chunk */
+	size_t size;		 /**< usable size of the chunk */
+	size_t used;		 /**< number of used bytes */
+	unsigned char data[] __attribute__((aligned(MEM_ARENA_ALIGN)));
+};
+
+struct mem_arena {
+	mem_arena_chunk_t *chunks; /**< list of chunks, the current chunk first */
+	size_t chunk_size;	   /**< size of regular chunks */
+};
+
+static mem_arena_chunk_t *
+mem_arena_chunk_new(size_t size)
+{
+	mem_arena_chunk_t *chunk = mem_alloc(sizeof(mem_arena_chunk_t) + size);
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+
+	return chunk;
+}
+
+mem_arena_t *
+mem_arena_new(size_t chunk_size)
+{
+	mem_arena_t *arena = mem_new(mem_arena_t, 1);
+	chunk_size = chunk_size ? chunk_size : MEM_ARENA_CHUNK_SIZE;
+	// keep the free space of all chunks a multiple of the alignment
+	arena->chunk_size = (chunk_size + MEM_ARENA_ALIGN - 1) & ~(size_t)(MEM_ARENA_ALIGN - 1);
+	arena->chunks = mem_arena_chunk_new(arena->chunk_size);
+
+	return arena;
+}
+
+void
+mem_arena_reset(mem_arena_t *arena)
+{
+	IF_NULL_RETURN(arena);
+
+	// the initial chunk is always the last element
+	while (arena->chunks->next) {
+		mem_arena_chunk_t *chunk = arena->chunks;
+		arena->chunks = chunk->next;
+		mem_free0(chunk);
+	}
+	arena->chunks->used = 0;
+}
+
+void
+mem_arena_free(mem_arena_t *arena)
+{
+	IF_NULL_RETURN(arena);
+
+	mem_arena_reset(arena);
+	mem_free0(arena->chunks);
+	mem_free0(arena);
+}
+
+void *
+mem_arena_alloc(mem_arena_t *arena, size_t size)
+{
+	ASSERT(arena);
+
+	size_t aligned = 0;
+	ASSERT(!__builtin_add_overflow(size, MEM_ARENA_ALIGN - 1, &aligned));
+	aligned &= ~(size_t)(MEM_ARENA_ALIGN - 1);
+
+	mem_arena_chunk_t *chunk = arena->chunks;
+	if (chunk->size - chunk->used < aligned) {
+		/* Large allocations get a dedicated chunk which is queued behind the
+		 * current one, so that the remainder of the current chunk is still used. */
+		if (aligned > arena->chunk_size / 4) {
+			mem_arena_chunk_t *large = mem_arena_chunk_new(aligned);
+			large->used = aligned;
+			large->next = chunk->next;
+			chunk->next = large;
+			return large->data;
+		}
+		chunk = mem_arena_chunk_new(arena->chunk_size);
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+
+	void *p = chunk->data + chunk->used;
+	chunk->used += aligned;
+
+	return p;
+}
+
+void *
+mem_arena_alloc0(mem_arena_t *arena, size_t size)
+{
+	void *p = mem_arena_alloc(arena, size);
+	memset(p, 0, size);
+
+	return p;
+}
+
+char *
+mem_arena_strdup(mem_arena_t *arena, const char *str)
+{
+	ASSERT(str);
+
+	size_t len = strlen(str) + 1;
+	char *p = mem_arena_alloc(arena, len);
+	memcpy(p, str, len);
+
+	return p;
+}
+
+char *
+mem_arena_printf(mem_arena_t *arena, const char *fmt, ...)
+{
+	va_list ap;
+	ASSERT(arena);
+	ASSERT(fmt);
+
+	// first try to print into the remainder of the current chunk
+	mem_arena_chunk_t *chunk = arena->chunks;
+	char *buf = (char *)chunk->data + chunk->used;
+	size_t avail = chunk->size - chunk->used;
+
+	va_start(ap, fmt);
+	int len = vsnprintf(buf, avail, fmt, ap);
+	va_end(ap);
+	ASSERT(len >= 0);
+
+	if ((size_t)len < avail) {
+		// allocating from the current chunk returns exactly buf
+		return mem_arena_alloc(arena, len + 1);
+	}
+
+	char *p = mem_arena_alloc(arena, (size_t)len + 1);
+	va_start(ap, fmt);
+	ASSERT(vsnprintf(p, (size_t)len + 1, fmt, ap) == len);
+	va_end(ap);
+
+	return p;
+}
@@ -32,8 +32,10 @@
 #ifndef MEM_H
 #define MEM_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 
 /**
@@ -141,7 +143,7 @@ mem_free(void *ptr);
  * double-free and similar exploitable issues.
  * @param mem Memory pointer to be freed.
  */
-#define mem_free0(ptr) ((void)(free(ptr), (ptr) = NULL))
+#define mem_free0(ptr) ((void)(mem_free(ptr), (ptr) = NULL))
 
 /**
  * Frees the allocated memory of each array element and the array itself.
@@ -198,4 +200,128 @@ mem_free_array(void **array, size_t size);
 		(struct_type *)mem_realloc((mem), _total_len);                                     \
 	})
 
+/**
+ * Allocation statistics of one call site (or of all sites, see mem_accounting_get).
+ */
+typedef struct mem_site_stats {
+	uintptr_t site;	   /**< return address of the allocating call, 0 for all others */
+	uint64_t allocs;   /**< allocations made by the site */
+	uint64_t frees;	   /**< frees of allocations made by the site */
+	size_t live_bytes; /**< bytes allocated by the site and not yet freed */
+	size_t peak_bytes; /**< high-water mark of live_bytes */
+} mem_site_stats_t;
+
+/**
+ * Enables or disables the accounting of the allocations made by the mem_*
+ * functions per call site, i.e., per return address of the mem_* call, which
+ * can be resolved with addr2line or dladdr(3). Enabling the disabled accounting
+ * discards all previous statistics; disabling keeps them until then.
+ *
+ * While enabled, each allocation and free takes a global spin lock and updates
+ * a hash table of the live allocations, which is cheap compared to malloc(3)
+ * itself. Memory freed with free(3) instead of mem_free is only accounted as
+ * freed once its address is returned by another mem_* allocation.
+ *
+ * @param enable true to enable, false to disable the accounting
+ */
+void
+mem_accounting_enable(bool enable);
+
+/**
+ * Returns whether the accounting of allocations is enabled.
+ */
+bool
+mem_accounting_is_enabled(void);
+
+/**
+ * Returns the statistics recorded since mem_accounting_enable.
+ *
+ * @param total Filled with the statistics of all sites, of which peak_bytes is
+ *		the high-water mark of the total live bytes.
+ * @return Newly allocated array of all sites which allocated memory, the site
+ *	   with the most live bytes first, terminated by an entry with 0 allocs.
+ */
+mem_site_stats_t *
+mem_accounting_get_new(mem_site_stats_t *total);
+
+/**
+ * Opaque type of a memory arena. An arena serves many small allocations from
+ * larger chunks and releases all of them at once, which is useful for memory
+ * with a well defined lifetime, e.g., allocations which are only needed while
+ * handling a single request or event callback.
+ */
+typedef struct mem_arena mem_arena_t;
+
+/**
+ * Creates a new memory arena.
+ *
+ * @param chunk_size The size of the chunks from which the allocations are
+ *		     served, or 0 to use a default size.
+ * @return The newly created arena.
+ */
+mem_arena_t *
+mem_arena_new(size_t chunk_size);
+
+/**
+ * Releases all allocations made from the arena. The arena keeps its initial
+ * chunk and can be used for further allocations.
+ *
+ * @param arena The arena to be reset.
+ */
+void
+mem_arena_reset(mem_arena_t *arena);
+
+/**
+ * Releases all allocations made from the arena and frees the arena itself.
+ *
+ * @param arena The arena to be freed.
+ */
+void
+mem_arena_free(mem_arena_t *arena);
+
+/**
+ * Allocates memory from the arena. The memory is not initialized and
+ * must not be freed individually. Aborts if the allocation fails.
+ *
+ * @param arena The arena to allocate from.
+ * @param size The number of bytes to allocate.
+ * @return Pointer to the allocated memory, suitably aligned for any type.
+ */
+void *
+mem_arena_alloc(mem_arena_t *arena, size_t size);
+
+/**
+ * Allocates memory from the arena. The memory is set to zero.
+ *
+ * @param arena The arena to allocate from.
+ * @param size The number of bytes to allocate.
+ * @return Pointer to the allocated memory.
+ */
+void *
+mem_arena_alloc0(mem_arena_t *arena, size_t size);
+
+/**
+ * Duplicates a string into memory allocated from the arena.
+ *
+ * @param arena The arena to allocate from.
+ * @param str The string to duplicate.
+ * @return Pointer to the new string.
+ */
+char *
+mem_arena_strdup(mem_arena_t *arena, const char *str);
+
+/**
+ * Prints to a string allocated from the arena.
+ *
+ * @param arena The arena to allocate from.
+ * @param fmt The format string.
+ * @return Pointer to the formatted string.
+ */
+char *
+mem_arena_printf(mem_arena_t *arena, const char *fmt, ...)
+#if defined(__GNUC__)
+	__attribute__((format(printf, 2, 3)))
+#endif
+	;
+
 #endif /* MEM_H */
@@ -27,6 +27,8 @@
 #include "mem.h"
 #include "macro.h"
 
+#include <stdint.h>
+
 // Dummy struct to test the different allocation primitives
 struct complex_t {
 	char buf[16];
@@ -281,6 +283,93 @@ test_integer_overflow_in_mem_renew_is_detected(UNUSED const MunitParameter param
 	return MUNIT_FAIL;
 }
 
+static MunitResult
+test_arena_allocations(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	mem_arena_t *arena = mem_arena_new(128);
+	munit_assert_not_null(arena);
+
+	// allocations are aligned and do not overlap
+	char *a = mem_arena_alloc(arena, 3);
+	char *b = mem_arena_alloc0(arena, 5);
+	munit_assert_size((uintptr_t)a % sizeof(void *), ==, 0);
+	munit_assert_size((uintptr_t)b % sizeof(void *), ==, 0);
+	munit_assert_ptr_not_equal(a, b);
+	munit_assert_memory_equal(5, b, "\0\0\0\0\0");
+
+	char *s = mem_arena_strdup(arena, "trust|me");
+	munit_assert_string_equal(s, "trust|me");
+
+	// printf fits in the current chunk, needs a new chunk or a dedicated one
+	for (int i = 0; i < 32; i++) {
+		char *p = mem_arena_printf(arena, "entry %d", i);
+		char *expected = mem_printf("entry %d", i);
+		munit_assert_string_equal(p, expected);
+		mem_free0(expected);
+	}
+	char *large = mem_arena_printf(arena, "%0200d", 7);
+	munit_assert_size(strlen(large), ==, 200);
+	munit_assert_char(large[199], ==, '7');
+	munit_assert_string_equal(s, "trust|me");
+
+	mem_arena_reset(arena);
+	munit_assert_string_equal(mem_arena_printf(arena, "%s", "reused"), "reused");
+
+	mem_arena_free(arena);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_accounting(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	mem_site_stats_t total;
+	// enough allocations to grow the table of live allocations
+	const size_t n = 5000;
+	char **ptrs = mem_new0(char *, n);
+
+	mem_accounting_enable(true);
+	munit_assert_true(mem_accounting_is_enabled());
+
+	// one call site for all allocations
+	for (size_t i = 0; i < n; i++)
+		ptrs[i] = mem_alloc(32);
+	for (size_t i = 0; i < n; i += 2)
+		mem_free0(ptrs[i]);
+	ptrs[1] = mem_realloc(ptrs[1], 64);
+
+	mem_site_stats_t *sites = mem_accounting_get_new(&total);
+	munit_assert_uint64(total.allocs, ==, n + 1);
+	munit_assert_uint64(total.frees, ==, n / 2 + 1);
+	munit_assert_size(total.live_bytes, ==, (n / 2 - 1) * 32 + 64);
+	munit_assert_size(total.peak_bytes, ==, n * 32);
+	munit_assert_size(sites[0].site, !=, 0);
+	munit_assert_uint64(sites[0].allocs, ==, n);
+	munit_assert_size(sites[0].live_bytes, ==, (n / 2 - 1) * 32);
+	munit_assert_uint64(sites[1].allocs, ==, 1);
+	munit_assert_uint64(sites[2].allocs, ==, 0);
+	mem_free0(sites);
+
+	for (size_t i = 1; i < n; i += 2)
+		mem_free0(ptrs[i]);
+	sites = mem_accounting_get_new(&total);
+	munit_assert_size(total.live_bytes, ==, 0);
+	munit_assert_uint64(total.frees, ==, total.allocs);
+	mem_free0(sites);
+
+	// nothing is accounted while disabled, the statistics are kept
+	mem_accounting_enable(false);
+	munit_assert_false(mem_accounting_is_enabled());
+	char *untracked = mem_strdup("untracked");
+	mem_free0(untracked);
+	sites = mem_accounting_get_new(&total);
+	munit_assert_uint64(total.allocs, ==, n + 1);
+	mem_free0(sites);
+
+	mem_free0(ptrs);
+	return MUNIT_OK;
+}
+
 static MunitTest tests[] = {
 	{
 		"/allocate primitives and structs",	  /* name */
@@ -354,6 +443,22 @@ static MunitTest tests[] = {
 		MUNIT_TEST_OPTION_NONE,			     /* options */
 		NULL					     /* parameters */
 	},
+	{
+		"/accounting of allocations per call site", /* name */
+		test_accounting,			    /* test */
+		setup,					    /* setup */
+		tear_down,				    /* tear_down */
+		MUNIT_TEST_OPTION_NONE,			    /* options */
+		NULL					    /* parameters */
+	},
+	{
+		"/arena allocations",	/* name */
+		test_arena_allocations, /* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
 
 	// Mark the end of the array with an entry where the test function is NULL
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
@@ -0,0 +1,183 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "merkle.h"
+
+#include "macro.h"
+#include "mem.h"
+
+#include <openssl/evp.h>
+#include <string.h>
+
+#define MERKLE_PREFIX_LEAF 0x00
+#define MERKLE_PREFIX_NODE 0x01
+#define MERKLE_LEVELS_MAX 64
+
+struct merkle_tree {
+	uint8_t *hashes;		       // all levels, leaf level first
+	size_t level_off[MERKLE_LEVELS_MAX];   // index of the first hash of each level
+	size_t level_count[MERKLE_LEVELS_MAX]; // number of hashes of each level
+	size_t levels;			       // the last level holds the root only
+};
+
+static int
+merkle_hash(uint8_t *out, uint8_t prefix, const uint8_t *a, size_t a_len, const uint8_t *b,
+	    size_t b_len)
+{
+	int ret = -1;
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	IF_NULL_RETVAL_ERROR(ctx, -1);
+
+	if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) || !EVP_DigestUpdate(ctx, &prefix, 1) ||
+	    !EVP_DigestUpdate(ctx, a, a_len) || (b && !EVP_DigestUpdate(ctx, b, b_len)) ||
+	    !EVP_DigestFinal_ex(ctx, out, NULL)) {
+		ERROR("Failed to compute merkle tree hash");
+		goto out;
+	}
+	ret = 0;
+out:
+	EVP_MD_CTX_free(ctx);
+	return ret;
+}
+
+static uint8_t *
+merkle_tree_hash(const merkle_tree_t *tree, size_t level, size_t i)
+{
+	return tree->hashes + (tree->level_off[level] + i) * MERKLE_HASH_LEN;
+}
+
+merkle_tree_t *
+merkle_tree_new(const uint8_t *const *leaves, const size_t *leaf_lens, size_t n)
+{
+	IF_TRUE_RETVAL_ERROR(n == 0, NULL);
+
+	merkle_tree_t *tree = mem_new0(merkle_tree_t, 1);
+
+	// every level halves the number of hashes rounding up, in total less than 2n
+	size_t total = 0;
+	for (size_t count = n;; count = (count + 1) / 2) {
+		tree->level_off[tree->levels] = total;
+		tree->level_count[tree->levels] = count;
+		tree->levels++;
+		total += count;
+		if (count == 1)
+			break;
+	}
+	tree->hashes = mem_alloc(MUL_WITH_OVERFLOW_CHECK(total, (size_t)MERKLE_HASH_LEN));
+
+	for (size_t i = 0; i < n; i++) {
+		if (merkle_hash(merkle_tree_hash(tree, 0, i), MERKLE_PREFIX_LEAF, leaves[i],
+				leaf_lens[i], NULL, 0))
+			goto err;
+	}
+
+	for (size_t l = 1; l < tree->levels; l++) {
+		for (size_t i = 0; i < tree->level_count[l]; i++) {
+			uint8_t *left = merkle_tree_hash(tree, l - 1, 2 * i);
+			if (2 * i + 1 == tree->level_count[l - 1]) {
+				memcpy(merkle_tree_hash(tree, l, i), left, MERKLE_HASH_LEN);
+				continue;
+			}
+			if (merkle_hash(merkle_tree_hash(tree, l, i), MERKLE_PREFIX_NODE, left,
+					MERKLE_HASH_LEN, left + MERKLE_HASH_LEN, MERKLE_HASH_LEN))
+				goto err;
+		}
+	}
+	return tree;
+err:
+	merkle_tree_free(tree);
+	return NULL;
+}
+
+void
+merkle_tree_free(merkle_tree_t *tree)
+{
+	IF_NULL_RETURN(tree);
+	mem_free0(tree->hashes);
+	mem_free0(tree);
+}
+
+const uint8_t *
+merkle_tree_get_root(const merkle_tree_t *tree)
+{
+	ASSERT(tree);
+	return merkle_tree_hash(tree, tree->levels - 1, 0);
+}
+
+size_t
+merkle_tree_get_proof_len(const merkle_tree_t *tree, size_t index)
+{
+	ASSERT(tree);
+	ASSERT(index < tree->level_count[0]);
+
+	size_t len = 0;
+	for (size_t l = 0; l < tree->levels - 1; l++, index /= 2) {
+		if ((index ^ 1) < tree->level_count[l])
+			len++;
+	}
+	return len;
+}
+
+const uint8_t *
+merkle_tree_get_proof_hash(const merkle_tree_t *tree, size_t index, size_t i)
+{
+	ASSERT(tree);
+	ASSERT(index < tree->level_count[0]);
+
+	for (size_t l = 0; l < tree->levels - 1; l++, index /= 2) {
+		size_t sibling = index ^ 1;
+		if (sibling >= tree->level_count[l])
+			continue;
+		if (i-- == 0)
+			return merkle_tree_hash(tree, l, sibling);
+	}
+	return NULL;
+}
+
+bool
+merkle_proof_verify(const uint8_t *leaf, size_t leaf_len, size_t index, size_t n,
+		    const uint8_t *const *proof, size_t proof_len, const uint8_t *root)
+{
+	uint8_t hash[MERKLE_HASH_LEN];
+	size_t used = 0;
+
+	IF_TRUE_RETVAL(index >= n, false);
+	IF_TRUE_RETVAL(merkle_hash(hash, MERKLE_PREFIX_LEAF, leaf, leaf_len, NULL, 0), false);
+
+	for (size_t count = n; count > 1; count = (count + 1) / 2, index /= 2) {
+		int ret;
+		if (index % 2 == 0 && index + 1 == count)
+			continue; // promoted without a sibling
+		if (used == proof_len)
+			return false;
+		if (index % 2)
+			ret = merkle_hash(hash, MERKLE_PREFIX_NODE, proof[used], MERKLE_HASH_LEN,
+					  hash, MERKLE_HASH_LEN);
+		else
+			ret = merkle_hash(hash, MERKLE_PREFIX_NODE, hash, MERKLE_HASH_LEN,
+					  proof[used], MERKLE_HASH_LEN);
+		IF_TRUE_RETVAL(ret, false);
+		used++;
+	}
+	return used == proof_len && !memcmp(hash, root, MERKLE_HASH_LEN);
+}
@@ -0,0 +1,94 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file merkle.h
+ *
+ * SHA-256 Merkle tree over a list of byte strings, e.g. the nonces of several verifiers
+ * which are attested by a single TPM quote over the root. Leaves are hashed as
+ * H(0x00 || data) and inner nodes as H(0x01 || left || right); a node without a right
+ * sibling is promoted to the next level unchanged. An inclusion proof consists of the
+ * sibling hashes from the leaf up to the root.
+ */
+
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MERKLE_HASH_LEN 32
+
+typedef struct merkle_tree merkle_tree_t;
+
+/**
+ * Builds the tree over n leaves.
+ *
+ * @param leaves The data of the leaves.
+ * @param leaf_lens The lengths of the data in leaves.
+ * @param n The number of leaves, at least one.
+ * @return The tree, NULL on error.
+ */
+merkle_tree_t *
+merkle_tree_new(const uint8_t *const *leaves, const size_t *leaf_lens, size_t n);
+
+void
+merkle_tree_free(merkle_tree_t *tree);
+
+/**
+ * Returns the MERKLE_HASH_LEN bytes of the root hash, owned by the tree.
+ */
+const uint8_t *
+merkle_tree_get_root(const merkle_tree_t *tree);
+
+/**
+ * Returns the number of sibling hashes of the inclusion proof of leaf index.
+ */
+size_t
+merkle_tree_get_proof_len(const merkle_tree_t *tree, size_t index);
+
+/**
+ * Returns a pointer to the i-th sibling hash of the inclusion proof of leaf index,
+ * counted from the leaf level, which is owned by the tree.
+ */
+const uint8_t *
+merkle_tree_get_proof_hash(const merkle_tree_t *tree, size_t index, size_t i);
+
+/**
+ * Recomputes the root from a leaf and its inclusion proof and compares it to root.
+ *
+ * @param leaf The data of the leaf.
+ * @param leaf_len The length of leaf.
+ * @param index The position of the leaf in the tree.
+ * @param n The number of leaves in the tree.
+ * @param proof The sibling hashes, each MERKLE_HASH_LEN bytes, from the leaf level up.
+ * @param proof_len The number of hashes in proof.
+ * @param root The expected root hash.
+ * @return true if the proof is valid for the given root.
+ */
+bool
+merkle_proof_verify(const uint8_t *leaf, size_t leaf_len, size_t index, size_t n,
+		    const uint8_t *const *proof, size_t proof_len, const uint8_t *root);
+
+#endif /* MERKLE_H */
@@ -0,0 +1,179 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "merkle.h"
+#include "logf.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_LEAVES_MAX 17
+#define TEST_LEAF_LEN 8
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static void
+test_fill_leaves(uint8_t data[][TEST_LEAF_LEN], const uint8_t **leaves, size_t *lens, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		for (size_t j = 0; j < TEST_LEAF_LEN; j++)
+			data[i][j] = (uint8_t)(i * 31 + j);
+		leaves[i] = data[i];
+		lens[i] = TEST_LEAF_LEN;
+	}
+}
+
+static MunitResult
+test_merkle_root(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	uint8_t leaf_data[3][TEST_LEAF_LEN];
+	const uint8_t *leaves[3];
+	size_t lens[3];
+	uint8_t buf[1 + 2 * MERKLE_HASH_LEN];
+	uint8_t h[3][MERKLE_HASH_LEN];
+	uint8_t expected[MERKLE_HASH_LEN];
+
+	test_fill_leaves(leaf_data, leaves, lens, 3);
+
+	for (size_t i = 0; i < 3; i++) {
+		buf[0] = 0x00;
+		memcpy(buf + 1, leaf_data[i], TEST_LEAF_LEN);
+		SHA256(buf, 1 + TEST_LEAF_LEN, h[i]);
+	}
+
+	// a single leaf is its own root
+	merkle_tree_t *tree = merkle_tree_new(leaves, lens, 1);
+	munit_assert_not_null(tree);
+	munit_assert_memory_equal(MERKLE_HASH_LEN, merkle_tree_get_root(tree), h[0]);
+	munit_assert_size(merkle_tree_get_proof_len(tree, 0), ==, 0);
+	merkle_tree_free(tree);
+
+	// root = H(1 || H(1 || h0 || h1) || h2), the third leaf is promoted
+	buf[0] = 0x01;
+	memcpy(buf + 1, h[0], MERKLE_HASH_LEN);
+	memcpy(buf + 1 + MERKLE_HASH_LEN, h[1], MERKLE_HASH_LEN);
+	SHA256(buf, sizeof(buf), expected);
+	memcpy(buf + 1, expected, MERKLE_HASH_LEN);
+	memcpy(buf + 1 + MERKLE_HASH_LEN, h[2], MERKLE_HASH_LEN);
+	SHA256(buf, sizeof(buf), expected);
+
+	tree = merkle_tree_new(leaves, lens, 3);
+	munit_assert_not_null(tree);
+	munit_assert_memory_equal(MERKLE_HASH_LEN, merkle_tree_get_root(tree), expected);
+	munit_assert_size(merkle_tree_get_proof_len(tree, 0), ==, 2);
+	munit_assert_size(merkle_tree_get_proof_len(tree, 2), ==, 1);
+	// buf still holds the inner node H(1 || h0 || h1), the only sibling of the third leaf
+	munit_assert_memory_equal(MERKLE_HASH_LEN, merkle_tree_get_proof_hash(tree, 2, 0), buf + 1);
+	merkle_tree_free(tree);
+
+	munit_assert_null(merkle_tree_new(leaves, lens, 0));
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_merkle_proof(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	uint8_t leaf_data[TEST_LEAVES_MAX][TEST_LEAF_LEN];
+	const uint8_t *leaves[TEST_LEAVES_MAX];
+	size_t lens[TEST_LEAVES_MAX];
+	const uint8_t *proof[8];
+
+	test_fill_leaves(leaf_data, leaves, lens, TEST_LEAVES_MAX);
+
+	// every leaf of every tree size, including the unbalanced ones
+	for (size_t n = 1; n <= TEST_LEAVES_MAX; n++) {
+		merkle_tree_t *tree = merkle_tree_new(leaves, lens, n);
+		munit_assert_not_null(tree);
+		const uint8_t *root = merkle_tree_get_root(tree);
+
+		for (size_t i = 0; i < n; i++) {
+			size_t proof_len = merkle_tree_get_proof_len(tree, i);
+			for (size_t k = 0; k < proof_len; k++) {
+				proof[k] = merkle_tree_get_proof_hash(tree, i, k);
+				munit_assert_not_null(proof[k]);
+			}
+			munit_assert_null(merkle_tree_get_proof_hash(tree, i, proof_len));
+
+			munit_assert_true(merkle_proof_verify(leaves[i], lens[i], i, n, proof,
+							      proof_len, root));
+
+			// wrong position, wrong leaf, truncated proof
+			if (n > 1) {
+				munit_assert_false(merkle_proof_verify(leaves[i], lens[i],
+								       (i + 1) % n, n, proof,
+								       proof_len, root));
+				munit_assert_false(merkle_proof_verify(leaves[(i + 1) % n],
+								       lens[i], i, n, proof,
+								       proof_len, root));
+				munit_assert_false(merkle_proof_verify(leaves[i], lens[i], i, n,
+								       proof, proof_len - 1,
+								       root));
+			}
+			munit_assert_false(merkle_proof_verify(leaves[i], lens[i], n, n, proof,
+							       proof_len, root));
+		}
+		merkle_tree_free(tree);
+	}
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/root",		/* name */
+		test_merkle_root,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/proof",		/* name */
+		test_merkle_proof,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite merkle_suite = {
+	"/merkle",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
@@ -0,0 +1,314 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "metrics.h"
+
+#include "list.h"
+#include "macro.h"
+#include "mem.h"
+#include "str.h"
+
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+// number of shards of counters and histograms, threads are assigned round-robin
+#define METRICS_SHARDS 8
+#define METRICS_CACHELINE 64
+
+typedef union {
+	uint64_t value;
+	char pad[METRICS_CACHELINE];
+} metrics_counter_shard_t;
+
+typedef struct {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t buckets[METRICS_HISTOGRAM_BUCKETS + 1]; // the last one counts longer durations
+	uint64_t pad[7];				  // up to a multiple of the cache line
+} metrics_histogram_shard_t;
+
+struct metrics {
+	metrics_type_t type;
+	char *name;
+	char *labels;
+	char *help;
+	metrics_func_t func;
+	void *data;
+	int64_t gauge;
+	metrics_counter_shard_t *counter;
+	metrics_histogram_shard_t *histogram;
+};
+
+static list_t *metrics_list = NULL;
+
+static unsigned metrics_shard_next = 0;
+static __thread unsigned metrics_shard_thread = 0; // shard + 1, 0 if not assigned yet
+
+static unsigned
+metrics_shard(void)
+{
+	if (!metrics_shard_thread) {
+		unsigned next = __atomic_fetch_add(&metrics_shard_next, 1, __ATOMIC_RELAXED);
+		metrics_shard_thread = next % METRICS_SHARDS + 1;
+	}
+	return metrics_shard_thread - 1;
+}
+
+static const char *
+metrics_type_to_string(metrics_type_t type)
+{
+	switch (type) {
+	case METRICS_COUNTER:
+		return "counter";
+	case METRICS_GAUGE:
+		return "gauge";
+	case METRICS_HISTOGRAM:
+		return "histogram";
+	}
+	return "untyped";
+}
+
+static metrics_t *
+metrics_register(metrics_type_t type, const char *name, const char *labels, const char *help)
+{
+	ASSERT(name);
+
+	metrics_t *metrics = mem_new0(metrics_t, 1);
+	metrics->type = type;
+	metrics->name = mem_strdup(name);
+	metrics->labels = labels && *labels ? mem_strdup(labels) : NULL;
+	metrics->help = mem_strdup(help ? help : "");
+
+	metrics_list = list_append(metrics_list, metrics);
+	return metrics;
+}
+
+metrics_t *
+metrics_new(metrics_type_t type, const char *name, const char *labels, const char *help)
+{
+	metrics_t *metrics = metrics_register(type, name, labels, help);
+
+	if (type == METRICS_COUNTER)
+		metrics->counter = mem_new0(metrics_counter_shard_t, METRICS_SHARDS);
+	else if (type == METRICS_HISTOGRAM)
+		metrics->histogram = mem_new0(metrics_histogram_shard_t, METRICS_SHARDS);
+
+	return metrics;
+}
+
+metrics_t *
+metrics_func_new(metrics_type_t type, const char *name, const char *labels, const char *help,
+		 metrics_func_t func, void *data)
+{
+	ASSERT(func);
+	ASSERT(type != METRICS_HISTOGRAM);
+
+	metrics_t *metrics = metrics_register(type, name, labels, help);
+	metrics->func = func;
+	metrics->data = data;
+	return metrics;
+}
+
+void
+metrics_free(metrics_t *metrics)
+{
+	IF_NULL_RETURN(metrics);
+
+	metrics_list = list_remove(metrics_list, metrics);
+	mem_free0(metrics->name);
+	mem_free0(metrics->labels);
+	mem_free0(metrics->help);
+	mem_free0(metrics->counter);
+	mem_free0(metrics->histogram);
+	mem_free0(metrics);
+}
+
+void
+metrics_add(metrics_t *metrics, int64_t n)
+{
+	IF_NULL_RETURN(metrics);
+
+	if (metrics->counter)
+		__atomic_add_fetch(&metrics->counter[metrics_shard()].value, (uint64_t)n,
+				   __ATOMIC_RELAXED);
+	else if (metrics->type == METRICS_GAUGE && !metrics->func)
+		__atomic_add_fetch(&metrics->gauge, n, __ATOMIC_RELAXED);
+}
+
+void
+metrics_inc(metrics_t *metrics)
+{
+	metrics_add(metrics, 1);
+}
+
+void
+metrics_set(metrics_t *metrics, int64_t value)
+{
+	IF_NULL_RETURN(metrics);
+	IF_FALSE_RETURN(metrics->type == METRICS_GAUGE && !metrics->func);
+
+	__atomic_store_n(&metrics->gauge, value, __ATOMIC_RELAXED);
+}
+
+uint64_t
+metrics_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * The bounds are 1000ns * 2^k for even and 1500ns * 2^k for odd buckets 2k and 2k + 1.
+ */
+uint64_t
+metrics_histogram_bound(unsigned bucket)
+{
+	ASSERT(bucket < METRICS_HISTOGRAM_BUCKETS);
+	return ((uint64_t)1000 << (bucket / 2)) * (2 + bucket % 2) / 2;
+}
+
+static unsigned
+metrics_histogram_bucket(uint64_t ns)
+{
+	IF_TRUE_RETVAL(ns <= 1000, 0);
+
+	// the smallest bound not below ns, bounds are multiples of 500: 2^(k+1) or 3 * 2^k
+	uint64_t y = (ns - 1) / 500;
+	unsigned msb = 63 - __builtin_clzll(y);
+	unsigned bucket = (y & (1ULL << (msb - 1))) ? 2 * msb : 2 * msb - 1;
+
+	return MIN(bucket, METRICS_HISTOGRAM_BUCKETS);
+}
+
+void
+metrics_observe(metrics_t *metrics, uint64_t ns)
+{
+	IF_NULL_RETURN(metrics);
+	IF_NULL_RETURN(metrics->histogram);
+
+	metrics_histogram_shard_t *shard = &metrics->histogram[metrics_shard()];
+	__atomic_add_fetch(&shard->buckets[metrics_histogram_bucket(ns)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&shard->sum_ns, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&shard->count, 1, __ATOMIC_RELAXED);
+}
+
+int64_t
+metrics_get(const metrics_t *metrics)
+{
+	IF_NULL_RETVAL(metrics, 0);
+
+	if (metrics->func)
+		return metrics->func(metrics->data);
+	if (metrics->type == METRICS_GAUGE)
+		return __atomic_load_n(&metrics->gauge, __ATOMIC_RELAXED);
+
+	uint64_t value = 0;
+	for (int i = 0; i < METRICS_SHARDS; i++) {
+		if (metrics->counter)
+			value += __atomic_load_n(&metrics->counter[i].value, __ATOMIC_RELAXED);
+		else
+			value += __atomic_load_n(&metrics->histogram[i].count, __ATOMIC_RELAXED);
+	}
+	return value;
+}
+
+/*
+ * Appends name{labels} with an optional additional label.
+ */
+static void
+metrics_format_name(str_t *out, const metrics_t *metrics, const char *suffix, const char *label)
+{
+	str_append_printf(out, "%s%s", metrics->name, suffix);
+	if (metrics->labels || label)
+		str_append_printf(out, "{%s%s%s}", metrics->labels ? metrics->labels : "",
+				  metrics->labels && label ? "," : "", label ? label : "");
+}
+
+static void
+metrics_format_histogram(str_t *out, const metrics_t *metrics)
+{
+	uint64_t buckets[METRICS_HISTOGRAM_BUCKETS + 1] = { 0 };
+	uint64_t sum_ns = 0;
+
+	for (int i = 0; i < METRICS_SHARDS; i++) {
+		const metrics_histogram_shard_t *shard = &metrics->histogram[i];
+		for (int b = 0; b <= METRICS_HISTOGRAM_BUCKETS; b++)
+			buckets[b] += __atomic_load_n(&shard->buckets[b], __ATOMIC_RELAXED);
+		sum_ns += __atomic_load_n(&shard->sum_ns, __ATOMIC_RELAXED);
+	}
+
+	// the buckets are cumulative, the count is the one of the +Inf bucket
+	uint64_t count = 0;
+	for (int b = 0; b <= METRICS_HISTOGRAM_BUCKETS; b++) {
+		char le[32];
+		count += buckets[b];
+		if (b < METRICS_HISTOGRAM_BUCKETS)
+			snprintf(le, sizeof(le), "le=\"%.9g\"", metrics_histogram_bound(b) / 1e9);
+		else
+			snprintf(le, sizeof(le), "le=\"+Inf\"");
+		metrics_format_name(out, metrics, "_bucket", le);
+		str_append_printf(out, " %" PRIu64 "\n", count);
+	}
+	metrics_format_name(out, metrics, "_sum", NULL);
+	str_append_printf(out, " %.9f\n", sum_ns / 1e9);
+	metrics_format_name(out, metrics, "_count", NULL);
+	str_append_printf(out, " %" PRIu64 "\n", count);
+}
+
+char *
+metrics_format_new(void)
+{
+	str_t *out = str_new(NULL);
+
+	for (list_t *l = metrics_list; l; l = l->next) {
+		const metrics_t *family = l->data;
+
+		// skip families which were formatted with an earlier metric of the same name
+		bool formatted = false;
+		for (list_t *p = metrics_list; p != l && !formatted; p = p->next)
+			formatted = !strcmp(((metrics_t *)p->data)->name, family->name);
+		if (formatted)
+			continue;
+
+		str_append_printf(out, "# HELP %s %s\n", family->name, family->help);
+		str_append_printf(out, "# TYPE %s %s\n", family->name,
+				  metrics_type_to_string(family->type));
+
+		for (list_t *m = l; m; m = m->next) {
+			const metrics_t *metrics = m->data;
+			if (strcmp(metrics->name, family->name))
+				continue;
+
+			if (metrics->type == METRICS_HISTOGRAM) {
+				metrics_format_histogram(out, metrics);
+			} else {
+				metrics_format_name(out, metrics, "", NULL);
+				str_append_printf(out, " %" PRId64 "\n", metrics_get(metrics));
+			}
+		}
+	}
+
+	return str_free(out, false);
+}
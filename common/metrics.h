@@ -0,0 +1,145 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file metrics.h
+ *
+ * A lightweight registry of runtime metrics, i.e., counters, gauges and histograms of
+ * durations, which formats all registered metrics in the Prometheus text format.
+ *
+ * Counters and histograms are updated lock-free on per-thread shards, so that threads
+ * updating the same metric do not contend on a cache line; reading sums up the shards.
+ * Metrics may be updated from any thread, but are created, freed and formatted by the
+ * main thread only. Metrics may also be backed by a function which is called when they
+ * are formatted, e.g., to export counters a module maintains anyway.
+ *
+ * Metrics of the same name but different labels form one metric family; they have to
+ * be of the same type and should have the same help text.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+/**
+ * Histograms count durations in log-linear buckets: two buckets per power of two
+ * (1us, 1.5us, 2us, 3us, 4us, 6us, ...) up to about 100s, and all longer ones.
+ */
+#define METRICS_HISTOGRAM_BUCKETS 54
+
+typedef struct metrics metrics_t;
+
+typedef enum {
+	METRICS_COUNTER = 0,
+	METRICS_GAUGE,
+	METRICS_HISTOGRAM,
+} metrics_type_t;
+
+/**
+ * Callback which returns the current value of a function backed metric.
+ */
+typedef int64_t (*metrics_func_t)(void *data);
+
+/**
+ * Creates and registers a metric.
+ *
+ * @param type The type of the metric.
+ * @param name The name of the metric, e.g., "cml_uevents_forwarded_total". Histograms
+ *		are exported in seconds and should be named accordingly.
+ * @param labels The labels of the metric in the Prometheus format without braces,
+ *		e.g., "type=\"io\"", or NULL.
+ * @param help A description of the metric family.
+ * @return The registered metric.
+ */
+metrics_t *
+metrics_new(metrics_type_t type, const char *name, const char *labels, const char *help);
+
+/**
+ * Creates and registers a counter or gauge whose value is returned by func.
+ */
+metrics_t *
+metrics_func_new(metrics_type_t type, const char *name, const char *labels, const char *help,
+		 metrics_func_t func, void *data);
+
+/**
+ * Unregisters and frees a metric.
+ */
+void
+metrics_free(metrics_t *metrics);
+
+/**
+ * Adds n to a counter or a gauge.
+ */
+void
+metrics_add(metrics_t *metrics, int64_t n);
+
+/**
+ * Increments a counter or a gauge by one.
+ */
+void
+metrics_inc(metrics_t *metrics);
+
+/**
+ * Sets a gauge to value.
+ */
+void
+metrics_set(metrics_t *metrics, int64_t value);
+
+/**
+ * Counts a duration in a histogram.
+ *
+ * @param ns The duration in nanoseconds.
+ */
+void
+metrics_observe(metrics_t *metrics, uint64_t ns);
+
+/**
+ * Returns the value of a counter or a gauge, or the number of durations counted by a
+ * histogram.
+ */
+int64_t
+metrics_get(const metrics_t *metrics);
+
+/**
+ * Returns the current time of the monotonic clock in nanoseconds, e.g., to measure
+ * durations for metrics_observe().
+ */
+uint64_t
+metrics_now_ns(void);
+
+/**
+ * Returns the upper bound of a bucket of the histograms in nanoseconds.
+ */
+uint64_t
+metrics_histogram_bound(unsigned bucket);
+
+/**
+ * Formats all registered metrics in the Prometheus text format (version 0.0.4).
+ *
+ * @return A newly allocated string, which the caller has to free.
+ */
+char *
+metrics_format_new(void);
+
+#endif /* METRICS_H */
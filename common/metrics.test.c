@@ -0,0 +1,214 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "metrics.h"
+#include "logf.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#define TEST_THREADS 4
+#define TEST_INCREMENTS 100000
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static int64_t
+test_func(void *data)
+{
+	return *(int64_t *)data;
+}
+
+static MunitResult
+test_metrics_counter_gauge(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	metrics_t *counter = metrics_new(METRICS_COUNTER, "test_total", NULL, "test");
+	metrics_t *gauge = metrics_new(METRICS_GAUGE, "test_gauge", NULL, "test");
+	int64_t value = 42;
+	metrics_t *func = metrics_func_new(METRICS_GAUGE, "test_func", NULL, "test", test_func,
+					   &value);
+
+	metrics_inc(counter);
+	metrics_add(counter, 2);
+	munit_assert_int64(metrics_get(counter), ==, 3);
+
+	metrics_set(gauge, 10);
+	metrics_add(gauge, -3);
+	munit_assert_int64(metrics_get(gauge), ==, 7);
+
+	munit_assert_int64(metrics_get(func), ==, 42);
+	value = 43;
+	munit_assert_int64(metrics_get(func), ==, 43);
+
+	metrics_free(func);
+	metrics_free(gauge);
+	metrics_free(counter);
+
+	return MUNIT_OK;
+}
+
+static void *
+test_increment(void *data)
+{
+	for (int i = 0; i < TEST_INCREMENTS; i++)
+		metrics_inc(data);
+	return NULL;
+}
+
+static MunitResult
+test_metrics_counter_threads(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	metrics_t *counter = metrics_new(METRICS_COUNTER, "test_total", NULL, "test");
+	pthread_t threads[TEST_THREADS];
+
+	for (int i = 0; i < TEST_THREADS; i++)
+		munit_assert_int(pthread_create(&threads[i], NULL, test_increment, counter), ==, 0);
+	for (int i = 0; i < TEST_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	munit_assert_int64(metrics_get(counter), ==, TEST_THREADS * TEST_INCREMENTS);
+
+	metrics_free(counter);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_metrics_histogram(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	metrics_t *histogram = metrics_new(METRICS_HISTOGRAM, "test_seconds", NULL, "test");
+
+	munit_assert_uint64(metrics_histogram_bound(0), ==, 1000);
+	munit_assert_uint64(metrics_histogram_bound(1), ==, 1500);
+	munit_assert_uint64(metrics_histogram_bound(2), ==, 2000);
+	munit_assert_uint64(metrics_histogram_bound(5), ==, 6000);
+
+	// durations on a bound are counted in its bucket, the others in the next one
+	metrics_observe(histogram, 1000);
+	metrics_observe(histogram, 1001);
+	metrics_observe(histogram, 1500);
+	metrics_observe(histogram, 5999);
+	metrics_observe(histogram, 1000000000000);
+	munit_assert_int64(metrics_get(histogram), ==, 5);
+
+	char *text = metrics_format_new();
+	munit_assert_not_null(strstr(text, "# TYPE test_seconds histogram\n"));
+	munit_assert_not_null(strstr(text, "test_seconds_bucket{le=\"1e-06\"} 1\n"));
+	munit_assert_not_null(strstr(text, "test_seconds_bucket{le=\"1.5e-06\"} 3\n"));
+	munit_assert_not_null(strstr(text, "test_seconds_bucket{le=\"4e-06\"} 3\n"));
+	munit_assert_not_null(strstr(text, "test_seconds_bucket{le=\"6e-06\"} 4\n"));
+	munit_assert_not_null(strstr(text, "test_seconds_bucket{le=\"+Inf\"} 5\n"));
+	munit_assert_not_null(strstr(text, "test_seconds_count 5\n"));
+	mem_free0(text);
+
+	metrics_free(histogram);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_metrics_format(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	metrics_t *a = metrics_new(METRICS_COUNTER, "test_total", "type=\"a\"", "test");
+	metrics_t *other = metrics_new(METRICS_GAUGE, "test_gauge", NULL, "gauge");
+	metrics_t *b = metrics_new(METRICS_COUNTER, "test_total", "type=\"b\"", "test");
+
+	metrics_add(a, 1);
+	metrics_add(b, 2);
+	metrics_set(other, -1);
+
+	// metrics of the same family are formatted together, after a single header
+	char *text = metrics_format_new();
+	munit_assert_string_equal(text, "# HELP test_total test\n"
+					"# TYPE test_total counter\n"
+					"test_total{type=\"a\"} 1\n"
+					"test_total{type=\"b\"} 2\n"
+					"# HELP test_gauge gauge\n"
+					"# TYPE test_gauge gauge\n"
+					"test_gauge -1\n");
+	mem_free0(text);
+
+	metrics_free(a);
+	metrics_free(b);
+	metrics_free(other);
+
+	text = metrics_format_new();
+	munit_assert_string_equal(text, "");
+	mem_free0(text);
+
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/counters and gauges",	    /* name */
+		test_metrics_counter_gauge, /* test */
+		setup,			    /* setup */
+		NULL,			    /* tear_down */
+		MUNIT_TEST_OPTION_NONE,	    /* options */
+		NULL			    /* parameters */
+	},
+	{
+		"/counters are updated by threads", /* name */
+		test_metrics_counter_threads,	    /* test */
+		setup,				    /* setup */
+		NULL,				    /* tear_down */
+		MUNIT_TEST_OPTION_NONE,		    /* options */
+		NULL				    /* parameters */
+	},
+	{
+		"/histograms",		/* name */
+		test_metrics_histogram, /* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/format",		/* name */
+		test_metrics_format,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite metrics_suite = {
+	"/metrics",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
@@ -30,19 +30,33 @@
 #include "mem.h"
 #include "file.h"
 #include "proc.h"
+#include "str.h"
+#include "fd.h"
+#include "event.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <sched.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <linux/bpf.h>
 #include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/pkt_sched.h>
+#include <linux/fib_rules.h>
 #include <linux/genetlink.h>
 #include <linux/nl80211.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/ipset/ip_set.h>
 
 #define IPTABLES_PATH "iptables"
-#define IP_PATH "ip"
-#define NSENTER_PATH "nsenter"
+#define IPTABLES_RESTORE_PATH "iptables-restore"
 
 /* routing */
 #define IP_ROUTE_LOCALNET_PATH "/proc/sys/net/ipv4/conf/%s/route_localnet"
@@ -63,69 +77,685 @@
 #define LOOPBACK_PREFIX 16
 #define LOCALHOST_IP "127.0.0.1"
 
+/* Defined in linux/if.h, which clashes with net/if.h */
+#ifndef IFF_LOWER_UP
+#define IFF_LOWER_UP 0x10000
+#endif
+
+/* Receive buffer for rtnetlink dumps, the kernel never sends larger chunks */
+#define NETWORK_NL_DUMP_BUF_SIZE 32768
+
+/* ipset holding the mac whitelist of a bridged physical interface */
+#define NETWORK_MAC_SET_NAME "cml_mac_%s"
+#define NETWORK_MAC_SET_TYPE "hash:mac"
+
+/* Entries of the XDP map holding the mac whitelist, larger whitelists use the ipset */
+#define NETWORK_XDP_MAC_MAX 1024
+
+/* Number and size of link notifications received with one recvmmsg() */
+#define NETWORK_LINK_CACHE_BATCH 8
+#define NETWORK_LINK_CACHE_BUF_SIZE 8192
+
+/**
+ * Cached state of a link in the network namespace of cmld.
+ */
+typedef struct {
+	int index;
+	char name[IFNAMSIZ];
+	uint8_t mac[6];
+	bool has_mac;
+	bool physical; //!< backed by a device driver
+} network_link_t;
+
+/**
+ * XDP program filtering the frames received on a bridged physical interface.
+ */
+typedef struct {
+	char netif[IFNAMSIZ];
+	int map_fd; //!< hash map of the whitelisted source macs
+} network_xdp_filter_t;
+
+static list_t *network_xdp_filters = NULL;
+
+static list_t *network_link_cache = NULL;
+static nl_sock_t *network_link_cache_sock = NULL;
+static event_io_t *network_link_cache_io = NULL;
+static char **network_link_cache_bufs = NULL;
+static pid_t network_link_cache_pid = 0;
+
+/* Token bucket of the bandwidth limits, i.e. the bytes sent at once after idling */
+#define NETWORK_SHAPING_BURST_MS 10
+#define NETWORK_SHAPING_BURST_MIN (16 * 1514)
+/* Bytes queued by the shaper in addition to the burst before it drops */
+#define NETWORK_SHAPING_LATENCY_MS 50
+
+/**
+ * A single iptables rule in iptables-restore syntax, e.g.
+ * "-I FORWARD -s 10.0.0.0/24 -j ACCEPT", together with its table.
+ */
+typedef struct {
+	const char *table;
+	char *rule;
+} network_iptables_rule_t;
+
+/**
+ * Opens a routing netlink socket inside the network namespace of the process pid.
+ * The socket stays bound to that namespace after switching back to our own one.
+ */
+static nl_sock_t *
+network_nl_sock_routing_ns_new(pid_t pid)
+{
+	nl_sock_t *nl_sock = NULL;
+	int self_fd = -1;
+
+	char *ns_path = mem_printf("/proc/%d/ns/net", pid);
+	int ns_fd = open(ns_path, O_RDONLY | O_CLOEXEC);
+	if (ns_fd < 0) {
+		ERROR_ERRNO("Could not open %s", ns_path);
+		mem_free0(ns_path);
+		return NULL;
+	}
+	mem_free0(ns_path);
+
+	self_fd = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+	if (self_fd < 0) {
+		ERROR_ERRNO("Could not open own netns");
+		goto out;
+	}
+
+	if (setns(ns_fd, CLONE_NEWNET)) {
+		ERROR_ERRNO("Could not join netns of pid %d", pid);
+		goto out;
+	}
+
+	nl_sock = nl_sock_routing_new();
+
+	if (setns(self_fd, CLONE_NEWNET))
+		FATAL_ERRNO("Could not switch back to own netns");
+out:
+	if (self_fd >= 0)
+		close(self_fd);
+	close(ns_fd);
+	return nl_sock;
+}
+
+/**
+ * Allocates an rtnetlink request of the given type whose payload starts with the
+ * family specific header hdr. NLM_F_REQUEST is always set.
+ */
+static nl_msg_t *
+network_rtnl_msg_new(uint16_t type, uint16_t flags, const void *hdr, size_t hdr_len)
+{
+	nl_msg_t *req = nl_msg_new();
+	IF_NULL_RETVAL_ERROR(req, NULL);
+
+	IF_TRUE_GOTO_ERROR(nl_msg_set_type(req, type), err);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_flags(req, NLM_F_REQUEST | flags), err);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_buf_unaligned(req, (char *)hdr, hdr_len), err);
+
+	return req;
+err:
+	nl_msg_free(req);
+	return NULL;
+}
+
+/**
+ * Sends req on nl_sock and waits for the ACK. Consumes req.
+ */
 static int
-network_call_ip(const char *addr, uint32_t subnet, const char *interface, char *action)
+network_rtnl_request(const nl_sock_t *nl_sock, nl_msg_t *req)
 {
-	char *net = mem_printf("%s/%i", addr, subnet);
-	const char *const argv[] = { IP_PATH, "addr", action, net, "dev", interface, NULL };
-	int ret = proc_fork_and_execvp(argv);
-	mem_free0(net);
+	int ret = nl_msg_send_kernel_verify(nl_sock, req);
+	if (ret)
+		ERROR("failed to send netlink message or received a negative ACK");
+	nl_msg_free(req);
 	return ret;
 }
 
-int
-network_move_link_ns(pid_t src_pid, pid_t dest_pid, const char *interface)
+/**
+ * Sends req in the network namespace of pid, or in our own one if pid is 0,
+ * and waits for the ACK. Consumes req.
+ */
+static int
+network_rtnl_transact(nl_msg_t *req, pid_t pid)
 {
-	char *src_pid_str = mem_printf("%d", src_pid);
-	char *dest_pid_str = mem_printf("%d", dest_pid);
-	const char *const argv[] = { NSENTER_PATH, "-t",	 src_pid_str, "-n",
-				     IP_PATH,	   "link",	 "set",	      interface,
-				     "netns",	   dest_pid_str, NULL };
-	DEBUG("NSENTER:");
-	for (int i = 0; argv[i]; i++)
-		DEBUG("-- %s", argv[i]);
-	int ret = proc_fork_and_execvp(argv);
-	mem_free0(src_pid_str);
-	mem_free0(dest_pid_str);
+	IF_NULL_RETVAL(req, -1);
+
+	// sockets in foreign namespaces are not pooled, they would keep the namespace alive
+	nl_sock_t *nl_sock = pid ? network_nl_sock_routing_ns_new(pid) :
+				   nl_sock_pool_get(NETLINK_ROUTE);
+	if (!nl_sock) {
+		ERROR("failed to allocate netlink socket");
+		nl_msg_free(req);
+		return -1;
+	}
+
+	int ret = network_rtnl_request(nl_sock, req);
+	nl_sock_free(nl_sock);
 	return ret;
 }
 
-int
-network_list_link_ns(pid_t pid, list_t **link_list)
+/**
+ * Sends the dump request req on nl_sock and calls cb for every object returned
+ * by the kernel until the dump is done. Consumes req.
+ */
+static int
+network_rtnl_dump(const nl_sock_t *nl_sock, nl_msg_t *req,
+		  int (*cb)(struct nlmsghdr *nlh, void *data), void *data)
+{
+	int ret = -1;
+	char *buf = NULL;
+
+	if (nl_msg_send_kernel(nl_sock, req) < 0) {
+		ERROR_ERRNO("Could not send netlink dump request");
+		goto out;
+	}
+
+	buf = mem_new0(char, NETWORK_NL_DUMP_BUF_SIZE);
+	while (1) {
+		int len = nl_msg_receive_kernel(nl_sock, buf, NETWORK_NL_DUMP_BUF_SIZE, false);
+		if (len < 0) {
+			ERROR_ERRNO("Could not receive netlink dump");
+			goto out;
+		}
+
+		for (struct nlmsghdr *nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type == NLMSG_DONE) {
+				ret = 0;
+				goto out;
+			}
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(nlh);
+				errno = -err->error;
+				ERROR_ERRNO("Netlink dump failed");
+				goto out;
+			}
+			if (cb(nlh, data))
+				goto out;
+		}
+	}
+out:
+	mem_free0(buf);
+	nl_msg_free(req);
+	return ret;
+}
+
+/**
+ * Parses an IPv4 or IPv6 address into addr, which must provide room for a
+ * struct in6_addr. Returns the address family or -1 on error.
+ */
+static int
+network_inet_pton(const char *str, struct in6_addr *addr)
+{
+	if (inet_pton(AF_INET, str, addr) == 1)
+		return AF_INET;
+	if (inet_pton(AF_INET6, str, addr) == 1)
+		return AF_INET6;
+
+	ERROR("Invalid ip address '%s'", str);
+	return -1;
+}
+
+static size_t
+network_inet_addr_len(int family)
 {
-	char *command = mem_printf("%s -t %d -n %s link", NSENTER_PATH, pid, IP_PATH);
-	FILE *fp;
-	int line_size = 1024;
-	char *line = mem_new0(char, line_size);
+	return family == AF_INET6 ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+}
 
-	fp = popen(command, "r");
-	mem_free0(command);
-	if (fp == NULL) {
-		mem_free0(line);
+static int
+network_rtnl_addr(const char *addr, uint32_t subnet, const char *interface, bool add)
+{
+	struct in6_addr ip;
+	int family = network_inet_pton(addr, &ip);
+	IF_TRUE_RETVAL(family < 0, -1);
+
+	unsigned int ifi_index = if_nametoindex(interface);
+	if (!ifi_index) {
+		ERROR("net interface name '%s' could not be resolved", interface);
 		return -1;
 	}
 
-	int n = 0;
-	while (fgets(line + n, line_size - n, fp) != NULL) {
-		if (n != 0) {
-			line[strnlen(line, line_size) - 1] = 0;
-			*link_list = list_append(*link_list, mem_strdup(line));
-			n = 0;
-		} else {
-			n = strnlen(line, line_size);
+	/* Same default scope as ip addr add: host for 127.0.0.0/8, global otherwise */
+	struct ifaddrmsg addr_req = {
+		.ifa_family = family,
+		.ifa_prefixlen = subnet,
+		.ifa_scope = (add && family == AF_INET && ((uint8_t *)&ip)[0] == 127) ?
+				     RT_SCOPE_HOST :
+				     RT_SCOPE_UNIVERSE,
+		.ifa_index = ifi_index,
+	};
+
+	nl_msg_t *req =
+		network_rtnl_msg_new(add ? RTM_NEWADDR : RTM_DELADDR,
+				     add ? NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL : NLM_F_ACK,
+				     &addr_req, sizeof(addr_req));
+	IF_NULL_RETVAL(req, -1);
+
+	size_t len = network_inet_addr_len(family);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_buffer(req, IFA_LOCAL, (char *)&ip, len), err);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_buffer(req, IFA_ADDRESS, (char *)&ip, len), err);
+
+	return network_rtnl_transact(req, 0);
+err:
+	nl_msg_free(req);
+	return -1;
+}
+
+/**
+ * Resolves a routing table given by name or number as accepted by ip route.
+ */
+static int
+network_route_table_id(const char *table_id, uint32_t *table)
+{
+	if (!table_id || !strcmp(table_id, "main")) {
+		*table = RT_TABLE_MAIN;
+		return 0;
+	}
+
+	char *end = NULL;
+	errno = 0;
+	unsigned long id = strtoul(table_id, &end, 10);
+	if (errno || end == table_id || *end != '\0' || id > UINT32_MAX) {
+		ERROR("Unknown routing table '%s'", table_id);
+		return -1;
+	}
+
+	*table = id;
+	return 0;
+}
+
+/**
+ * Adds (or replaces) or deletes a route in the given table. dst is either
+ * "default" or an address with optional prefix length. gateway and dev may be NULL.
+ */
+static int
+network_rtnl_route(const char *table_id, const char *dst, const char *gateway, const char *dev,
+		   bool add)
+{
+	struct in6_addr dst_addr, gw_addr;
+	int family = AF_UNSPEC;
+	int dst_len = 0;
+	unsigned int oif = 0;
+	uint32_t table;
+
+	IF_TRUE_RETVAL(network_route_table_id(table_id, &table), -1);
+
+	if (strcmp(dst, "default")) {
+		char *addr = mem_strdup(dst);
+		char *prefix = strchr(addr, '/');
+		if (prefix)
+			*prefix++ = '\0';
+
+		family = network_inet_pton(addr, &dst_addr);
+		int max_len = 8 * network_inet_addr_len(family);
+		dst_len = prefix ? atoi(prefix) : max_len;
+		mem_free0(addr);
+
+		if (family < 0 || dst_len < 0 || dst_len > max_len) {
+			ERROR("Invalid route destination '%s'", dst);
+			return -1;
+		}
+	}
+
+	if (gateway) {
+		int gw_family = network_inet_pton(gateway, &gw_addr);
+		IF_TRUE_RETVAL(gw_family < 0, -1);
+		if (family != AF_UNSPEC && gw_family != family) {
+			ERROR("Address family of gateway %s does not match %s", gateway, dst);
+			return -1;
+		}
+		family = gw_family;
+	}
+
+	if (family == AF_UNSPEC)
+		family = AF_INET;
+
+	if (dev && !(oif = if_nametoindex(dev))) {
+		ERROR("net interface name '%s' could not be resolved", dev);
+		return -1;
+	}
+
+	/* Mirror the defaults of ip route replace/del */
+	struct rtmsg route_req = {
+		.rtm_family = family,
+		.rtm_dst_len = dst_len,
+		.rtm_table = table < 256 ? table : RT_TABLE_UNSPEC,
+		.rtm_protocol = add ? RTPROT_BOOT : RTPROT_UNSPEC,
+		.rtm_scope = !add ? RT_SCOPE_NOWHERE : gateway ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK,
+		.rtm_type = add ? RTN_UNICAST : RTN_UNSPEC,
+	};
+
+	nl_msg_t *req =
+		network_rtnl_msg_new(add ? RTM_NEWROUTE : RTM_DELROUTE,
+				     add ? NLM_F_ACK | NLM_F_CREATE | NLM_F_REPLACE : NLM_F_ACK,
+				     &route_req, sizeof(route_req));
+	IF_NULL_RETVAL(req, -1);
+
+	size_t len = network_inet_addr_len(family);
+	if (dst_len)
+		IF_TRUE_GOTO_ERROR(nl_msg_add_buffer(req, RTA_DST, (char *)&dst_addr, len), err);
+	if (gateway)
+		IF_TRUE_GOTO_ERROR(nl_msg_add_buffer(req, RTA_GATEWAY, (char *)&gw_addr, len), err);
+	if (oif)
+		IF_TRUE_GOTO_ERROR(nl_msg_add_u32(req, RTA_OIF, oif), err);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_u32(req, RTA_TABLE, table), err);
+
+	return network_rtnl_transact(req, 0);
+err:
+	nl_msg_free(req);
+	return -1;
+}
+
+static int
+network_rtnl_del_link(const char *dev)
+{
+	struct ifinfomsg link_req = { .ifi_family = AF_UNSPEC };
+
+	nl_msg_t *req = network_rtnl_msg_new(RTM_DELLINK, NLM_F_ACK, &link_req, sizeof(link_req));
+	IF_NULL_RETVAL(req, -1);
+
+	IF_TRUE_GOTO_ERROR(nl_msg_add_string(req, IFLA_IFNAME, dev), err);
+
+	return network_rtnl_transact(req, 0);
+err:
+	nl_msg_free(req);
+	return -1;
+}
+
+/**
+ * Enslaves dev to the interface with index master_index, or releases it if
+ * master_index is 0.
+ */
+static int
+network_rtnl_set_master(const char *dev, unsigned int master_index)
+{
+	unsigned int ifi_index = if_nametoindex(dev);
+	if (!ifi_index) {
+		ERROR("net interface name '%s' could not be resolved", dev);
+		return -1;
+	}
+
+	struct ifinfomsg link_req = { .ifi_family = AF_UNSPEC, .ifi_index = ifi_index };
+
+	nl_msg_t *req = network_rtnl_msg_new(RTM_NEWLINK, NLM_F_ACK, &link_req, sizeof(link_req));
+	IF_NULL_RETVAL(req, -1);
+
+	IF_TRUE_GOTO_ERROR(nl_msg_add_u32(req, IFLA_MASTER, master_index), err);
+
+	return network_rtnl_transact(req, 0);
+err:
+	nl_msg_free(req);
+	return -1;
+}
+
+static int
+network_list_link_cb(struct nlmsghdr *nlh, void *data)
+{
+	list_t **link_list = data;
+	const char *name = NULL;
+	char *mac = NULL;
+	uint32_t mtu = 0;
+
+	IF_FALSE_RETVAL(nlh->nlmsg_type == RTM_NEWLINK, 0);
+
+	struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+	int len = IFLA_PAYLOAD(nlh);
+	for (struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case IFLA_IFNAME:
+			name = RTA_DATA(rta);
+			break;
+		case IFLA_MTU:
+			mtu = *(uint32_t *)RTA_DATA(rta);
+			break;
+		case IFLA_ADDRESS:
+			if (RTA_PAYLOAD(rta) == 6 && !mac)
+				mac = network_mac_addr_to_str_new(RTA_DATA(rta));
+			break;
+		default:
+			break;
 		}
 	}
-	pclose(fp);
-	mem_free0(line);
+	IF_NULL_GOTO(name, out);
+
+	/* Keep the two line layout of ip link, as the control interface reports it verbatim */
+	const struct {
+		unsigned int flag;
+		const char *name;
+	} flags[] = { { IFF_LOOPBACK, "LOOPBACK" },
+		      { IFF_BROADCAST, "BROADCAST" },
+		      { IFF_POINTOPOINT, "POINTOPOINT" },
+		      { IFF_MULTICAST, "MULTICAST" },
+		      { IFF_UP, "UP" },
+		      { IFF_LOWER_UP, "LOWER_UP" } };
+
+	str_t *entry = str_new_printf("%d: %s: <", ifi->ifi_index, name);
+	bool first = true;
+	for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		if (!(ifi->ifi_flags & flags[i].flag))
+			continue;
+		str_append_printf(entry, "%s%s", first ? "" : ",", flags[i].name);
+		first = false;
+	}
+	str_append_printf(entry, "> mtu %u\n    link/%s %s", mtu,
+			  (ifi->ifi_flags & IFF_LOOPBACK) ? "loopback" : "ether",
+			  mac ? mac : "00:00:00:00:00:00");
+
+	*link_list = list_append(*link_list, str_free(entry, false));
+out:
+	mem_free0(mac);
 	return 0;
 }
 
+static int
+network_rule_prio_cb(struct nlmsghdr *nlh, void *data)
+{
+	list_t **prio_list = data;
+	uint32_t prio = 0;
+
+	IF_FALSE_RETVAL(nlh->nlmsg_type == RTM_NEWRULE, 0);
+
+	struct fib_rule_hdr *frh = NLMSG_DATA(nlh);
+	int len = NLMSG_PAYLOAD(nlh, sizeof(struct fib_rule_hdr));
+	for (struct rtattr *rta = (struct rtattr *)((char *)frh + NLMSG_ALIGN(sizeof(*frh)));
+	     RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == FRA_PRIORITY)
+			prio = *(uint32_t *)RTA_DATA(rta);
+	}
+
+	/* Like ip rule flush, keep the rule for the local table at priority 0 */
+	if (prio) {
+		uint32_t *p = mem_new0(uint32_t, 1);
+		*p = prio;
+		*prio_list = list_append(*prio_list, p);
+	}
+	return 0;
+}
+
+static int
+network_rtnl_rules_flush(const nl_sock_t *nl_sock)
+{
+	list_t *prio_list = NULL;
+	struct fib_rule_hdr rule_req = { .family = AF_INET };
+
+	nl_msg_t *req = network_rtnl_msg_new(RTM_GETRULE, NLM_F_DUMP, &rule_req, sizeof(rule_req));
+	IF_NULL_RETVAL(req, -1);
+
+	int ret = network_rtnl_dump(nl_sock, req, network_rule_prio_cb, &prio_list);
+
+	/* Delete all rules with one round trip */
+	nl_batch_t *batch = nl_batch_new();
+	for (list_t *l = prio_list; l; l = l->next) {
+		uint32_t *prio = l->data;
+
+		if (!ret) {
+			req = network_rtnl_msg_new(RTM_DELRULE, NLM_F_ACK, &rule_req,
+						   sizeof(rule_req));
+			if (!req || nl_msg_add_u32(req, FRA_PRIORITY, *prio) ||
+			    nl_batch_add(batch, req) < 0) {
+				nl_msg_free(req);
+				ret = -1;
+			}
+		}
+		mem_free0(prio);
+	}
+	list_delete(prio_list);
+
+	if (!ret && nl_batch_send_kernel_verify(nl_sock, batch))
+		ret = -1;
+	nl_batch_free(batch);
+
+	return ret;
+}
+
+/**
+ * Feeds buf to a single iptables-restore run which applies all contained rules
+ * on top of the current ruleset.
+ */
+static int
+network_iptables_restore_buf(const char *buf, size_t len)
+{
+	int status;
+	int pipefd[2];
+	const char *const argv[] = { IPTABLES_RESTORE_PATH, "--noflush", NULL };
+
+	if (pipe2(pipefd, O_CLOEXEC)) {
+		ERROR_ERRNO("Could not create pipe for %s", argv[0]);
+		return -1;
+	}
+
+	pid_t pid = fork();
+	switch (pid) {
+	case -1:
+		ERROR_ERRNO("Could not fork for %s", argv[0]);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return -1;
+	case 0:
+		if (dup2(pipefd[0], STDIN_FILENO) < 0)
+			FATAL_ERRNO("Could not redirect stdin of %s", argv[0]);
+		execvp(argv[0], (char *const *)argv);
+		FATAL_ERRNO("Could not execvp %s", argv[0]);
+		return -1;
+	default:
+		break;
+	}
+
+	close(pipefd[0]);
+	int ret = fd_write(pipefd[1], buf, len) == (int)len ? 0 : -1;
+	close(pipefd[1]);
+
+	if (waitpid(pid, &status, 0) != pid) {
+		ERROR_ERRNO("Could not waitpid for '%s'", argv[0]);
+		return -1;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		ERROR("%s failed to apply the rules", argv[0]);
+		return -1;
+	}
+	return ret;
+}
+
+/**
+ * Applies n rules with one iptables-restore run. Each table is committed
+ * atomically, so a failing rule leaves the other rules of its table unapplied.
+ */
+static int
+network_iptables_restore(const network_iptables_rule_t *rules, size_t n)
+{
+	str_t *input = str_new(NULL);
+
+	for (size_t i = 0; i < n; i++) {
+		if (i == 0 || strcmp(rules[i].table, rules[i - 1].table)) {
+			if (i > 0)
+				str_append(input, "COMMIT\n");
+			str_append_printf(input, "*%s\n", rules[i].table);
+		}
+		TRACE("iptables -t %s %s", rules[i].table, rules[i].rule);
+		str_append_printf(input, "%s\n", rules[i].rule);
+	}
+	str_append(input, "COMMIT\n");
+
+	int ret = network_iptables_restore_buf(str_buffer(input), str_length(input));
+	str_free(input, true);
+	return ret;
+}
+
+/**
+ * Applies a set of rules in one batch. If removing rules fails as a whole,
+ * e.g. because one of them is already gone, the remaining ones are removed
+ * one by one so that teardown does not leave stale rules behind.
+ */
+static int
+network_iptables_apply(const network_iptables_rule_t *rules, size_t n, bool add)
+{
+	IF_FALSE_RETVAL(network_iptables_restore(rules, n), 0);
+	IF_TRUE_RETVAL(add, -1);
+
+	WARN("Batched removal of iptables rules failed, removing them one by one");
+	int ret = 0;
+	for (size_t i = 0; i < n; i++)
+		ret |= network_iptables_restore(&rules[i], 1);
+	return ret;
+}
+
+/**
+ * Arguments are spliced into iptables-restore input, so they must not contain
+ * separators which would start a further option or rule.
+ */
+static bool
+network_iptables_arg_is_valid(const char *arg)
+{
+	if (arg[strcspn(arg, " \t\n\"'")] != '\0') {
+		ERROR("Invalid iptables argument '%s'", arg);
+		return false;
+	}
+	return true;
+}
+
+int
+network_move_link_ns(pid_t src_pid, pid_t dest_pid, const char *interface)
+{
+	ASSERT(interface);
+	DEBUG("Moving %s from netns of pid %d to netns of pid %d", interface, src_pid, dest_pid);
+
+	/* The interface is looked up by name inside the netns of src_pid */
+	struct ifinfomsg link_req = { .ifi_family = AF_UNSPEC };
+
+	nl_msg_t *req = network_rtnl_msg_new(RTM_NEWLINK, NLM_F_ACK, &link_req, sizeof(link_req));
+	IF_NULL_RETVAL(req, -1);
+
+	IF_TRUE_GOTO_ERROR(nl_msg_add_string(req, IFLA_IFNAME, interface), err);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_u32(req, IFLA_NET_NS_PID, dest_pid), err);
+
+	return network_rtnl_transact(req, src_pid);
+err:
+	nl_msg_free(req);
+	return -1;
+}
+
+int
+network_list_link_ns(pid_t pid, list_t **link_list)
+{
+	struct ifinfomsg link_req = { .ifi_family = AF_UNSPEC };
+
+	nl_sock_t *nl_sock = network_nl_sock_routing_ns_new(pid);
+	IF_NULL_RETVAL_ERROR(nl_sock, -1);
+
+	nl_msg_t *req = network_rtnl_msg_new(RTM_GETLINK, NLM_F_DUMP, &link_req, sizeof(link_req));
+	int ret = req ? network_rtnl_dump(nl_sock, req, network_list_link_cb, link_list) : -1;
+
+	nl_sock_free(nl_sock);
+	return ret;
+}
+
 int
 network_set_ip_addr_of_interface(const char *addr, uint32_t subnet, const char *interface)
 {
 	DEBUG("About to configure network interface %s with ip %s and subnet %i", interface, addr,
 	      subnet);
-	return network_call_ip(addr, subnet, interface, "add");
+	return network_rtnl_addr(addr, subnet, interface, true);
 }
 
 int
@@ -133,7 +763,7 @@ network_remove_ip_addr_from_interface(const char *addr, uint32_t subnet, const c
 {
 	DEBUG("About to remove ip %s and subnet %i from network interface %s", addr, subnet,
 	      interface);
-	return network_call_ip(addr, subnet, interface, "del");
+	return network_rtnl_addr(addr, subnet, interface, false);
 }
 
 int
@@ -142,9 +772,7 @@ network_setup_default_route(const char *gateway, bool add)
 	ASSERT(gateway);
 	DEBUG("%s default route via %s", add ? "Adding" : "Deleting", gateway);
 
-	const char *const argv[] = { IP_PATH, "route", add ? "replace" : "del", "default", "via",
-				     gateway, NULL };
-	return proc_fork_and_execvp(argv);
+	return network_rtnl_route(NULL, "default", gateway, NULL, add);
 }
 
 int
@@ -153,10 +781,7 @@ network_setup_default_route_table(const char *table_id, const char *gateway, boo
 	ASSERT(gateway);
 	DEBUG("%s default route via %s", add ? "Adding" : "Deleting", gateway);
 
-	const char *const argv[] = { IP_PATH,	"route",  add ? "replace" : "del",
-				     "default", "via",	  gateway,
-				     "table",	table_id, NULL };
-	return proc_fork_and_execvp(argv);
+	return network_rtnl_route(table_id, "default", gateway, NULL, add);
 }
 
 int
@@ -166,10 +791,7 @@ network_setup_route_table(const char *table_id, const char *net_dst, const char
 	ASSERT(dev);
 	DEBUG("%s route to %s via %s", add ? "Adding" : "Deleting", net_dst, dev);
 
-	const char *const argv[] = { IP_PATH, "route",	add ? "replace" : "del",
-				     net_dst, "dev",	dev,
-				     "table", table_id, NULL };
-	return proc_fork_and_execvp(argv);
+	return network_rtnl_route(table_id, net_dst, NULL, dev, add);
 }
 
 int
@@ -179,9 +801,7 @@ network_setup_route(const char *net_dst, const char *dev, bool add)
 	ASSERT(dev);
 	DEBUG("%s route to %s via %s", add ? "Adding" : "Deleting", net_dst, dev);
 
-	const char *const argv[] = { IP_PATH, "route", add ? "replace" : "del", net_dst, "dev",
-				     dev,     "table", IP_ROUTING_TABLE,	NULL };
-	return proc_fork_and_execvp(argv);
+	return network_rtnl_route(IP_ROUTING_TABLE, net_dst, NULL, dev, add);
 }
 
 int
@@ -205,63 +825,166 @@ network_setup_port_forwarding(const char *srcip, uint16_t srcport, const char *d
 	ASSERT(srcip);
 	ASSERT(dstip);
 
-	char *src_port = mem_printf("%" PRIu16, srcport);
-	char *dst_port = mem_printf("%" PRIu16, dstport);
-	char *dst = mem_printf("%s:%" PRIu16, dstip, dstport);
-
-	DEBUG("%s port forwarding from %s to %s", enable ? "Enabling" : "Disabling", src_port, dst);
-
-	// forward local port to destination:port
-	const char *const argv[] = { IPTABLES_PATH, "-t", "nat",       enable ? "-I" : "-D",
-				     "OUTPUT",	    "-s", "127.0.0.1", "-d",
-				     "127.0.0.1",   "-p", "tcp",       "--dport",
-				     src_port,	    "-j", "DNAT",      "--to-destination",
-				     dst,	    NULL };
-	int error = proc_fork_and_execvp(argv);
-	// change source address for forwarded packets
-	const char *const argv2[] = { IPTABLES_PATH, "-t", "nat",	enable ? "-I" : "-D",
-				      "POSTROUTING", "-s", "127.0.0.1", "-d",
-				      dstip,	     "-p", "tcp",	"--dport",
-				      dst_port,	     "-j", "SNAT",	"--to-source",
-				      srcip,	     NULL };
-	error |= proc_fork_and_execvp(argv2);
-
-	mem_free0(src_port);
-	mem_free0(dst_port);
-	mem_free0(dst);
+	IF_FALSE_RETVAL(network_iptables_arg_is_valid(srcip), -1);
+	IF_FALSE_RETVAL(network_iptables_arg_is_valid(dstip), -1);
+
+	const char *op = enable ? "-I" : "-D";
+
+	DEBUG("%s port forwarding from %" PRIu16 " to %s:%" PRIu16,
+	      enable ? "Enabling" : "Disabling", srcport, dstip, dstport);
+
+	network_iptables_rule_t rules[] = {
+		// forward local port to destination:port
+		{ "nat", mem_printf("%s OUTPUT -s 127.0.0.1 -d 127.0.0.1 -p tcp --dport %" PRIu16
+				    " -j DNAT --to-destination %s:%" PRIu16,
+				    op, srcport, dstip, dstport) },
+		// change source address for forwarded packets
+		{ "nat", mem_printf("%s POSTROUTING -s 127.0.0.1 -d %s -p tcp --dport %" PRIu16
+				    " -j SNAT --to-source %s",
+				    op, dstip, dstport, srcip) },
+	};
+	size_t n = sizeof(rules) / sizeof(rules[0]);
+
+	int error = network_iptables_apply(rules, n, enable);
+
+	for (size_t i = 0; i < n; i++)
+		mem_free0(rules[i].rule);
+
+	return error;
+}
+
+int
+network_setup_masquerading(const char *subnet, bool enable)
+{
+	ASSERT(subnet);
+
+	IF_FALSE_RETVAL(network_iptables_arg_is_valid(subnet), -1);
+
+	const char *op = enable ? "-I" : "-D";
+
+	DEBUG("%s IP forwarding from %s", enable ? "Enabling" : "Disabling", subnet);
+
+	network_iptables_rule_t rules[] = {
+		// outgoing
+		{ "nat", mem_printf("%s POSTROUTING -s %s -j MASQUERADE", op, subnet) },
+		{ "filter", mem_printf("%s FORWARD -s %s -j ACCEPT", op, subnet) },
+		// incoming
+		{ "filter",
+		  mem_printf("%s FORWARD -d %s -m state --state RELATED,ESTABLISHED -j ACCEPT", op,
+			     subnet) },
+	};
+	size_t n = sizeof(rules) / sizeof(rules[0]);
+
+	int error = network_iptables_apply(rules, n, enable);
+
+	for (size_t i = 0; i < n; i++)
+		mem_free0(rules[i].rule);
+
+	if (error) {
+		ERROR("Failed to setup IP forwarding from %s", subnet);
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+network_set_egress_rate(const char *dev, uint64_t rate)
+{
+	ASSERT(dev);
+	IF_TRUE_RETVAL(rate == 0, 0);
+
+	unsigned int ifi_index = if_nametoindex(dev);
+	if (!ifi_index) {
+		ERROR("net interface name '%s' could not be resolved", dev);
+		return -1;
+	}
+
+	DEBUG("Shaping egress of %s to %" PRIu64 " bytes/s", dev, rate);
 
-	return error;
+	uint64_t burst = MAX(rate / 1000 * NETWORK_SHAPING_BURST_MS, NETWORK_SHAPING_BURST_MIN);
+	uint64_t limit = burst + rate / 1000 * NETWORK_SHAPING_LATENCY_MS;
+	struct tc_tbf_qopt qopt = {
+		.rate = { .rate = MIN(rate, UINT32_MAX), .linklayer = TC_LINKLAYER_ETHERNET },
+		.limit = MIN(limit, UINT32_MAX),
+	};
+	struct tcmsg tc_req = { .tcm_family = AF_UNSPEC,
+				.tcm_ifindex = ifi_index,
+				.tcm_handle = TC_H_MAKE(1 << 16, 0),
+				.tcm_parent = TC_H_ROOT };
+	uint16_t flags = NLM_F_CREATE | NLM_F_REPLACE | NLM_F_ACK;
+
+	nl_msg_t *req = network_rtnl_msg_new(RTM_NEWQDISC, flags, &tc_req, sizeof(tc_req));
+	IF_NULL_RETVAL(req, -1);
+
+	IF_TRUE_GOTO_ERROR(nl_msg_add_string(req, TCA_KIND, "tbf"), err);
+	struct nlattr *opts = nl_msg_start_nested_attr(req, TCA_OPTIONS);
+	IF_NULL_GOTO_ERROR(opts, err);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_buffer(req, TCA_TBF_PARMS, (char *)&qopt, sizeof(qopt)), err);
+	if (rate > UINT32_MAX)
+		IF_TRUE_GOTO_ERROR(nl_msg_add_u64(req, TCA_TBF_RATE64, rate), err);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_u32(req, TCA_TBF_BURST, MIN(burst, UINT32_MAX)), err);
+	IF_TRUE_GOTO_ERROR(nl_msg_end_nested_attr(req, opts), err);
+	IF_TRUE_RETVAL(network_rtnl_transact(req, 0), -1);
+
+	// replaces the default fifo of the shaper, so that a bulk flow does not delay others
+	tc_req.tcm_handle = TC_H_MAKE(2 << 16, 0);
+	tc_req.tcm_parent = TC_H_MAKE(1 << 16, 1);
+	req = network_rtnl_msg_new(RTM_NEWQDISC, flags, &tc_req, sizeof(tc_req));
+	IF_NULL_RETVAL(req, -1);
+
+	IF_TRUE_GOTO_ERROR(nl_msg_add_string(req, TCA_KIND, "fq_codel"), err);
+
+	return network_rtnl_transact(req, 0);
+err:
+	nl_msg_free(req);
+	return -1;
 }
 
 int
-network_setup_masquerading(const char *subnet, bool enable)
+network_setup_qos(const char *name, const char *subnet, uint64_t rate, int dscp,
+		  unsigned int priority, bool enable)
 {
+	ASSERT(name);
 	ASSERT(subnet);
 
-	DEBUG("%s IP forwarding from %s", enable ? "Enabling" : "Disabling", subnet);
+	IF_FALSE_RETVAL(network_iptables_arg_is_valid(name), -1);
+	IF_FALSE_RETVAL(network_iptables_arg_is_valid(subnet), -1);
+
+	const char *op = enable ? "-I" : "-D";
+	network_iptables_rule_t rules[3];
+	size_t n = 0;
+
+	DEBUG("%s QoS of traffic from %s", enable ? "Enabling" : "Disabling", subnet);
+
+	if (rate) {
+		uint64_t burst = MAX(rate / 1000 * NETWORK_SHAPING_BURST_MS,
+				     NETWORK_SHAPING_BURST_MIN);
+		rules[n].table = "filter";
+		rules[n++].rule = mem_printf("%s FORWARD -s %s -m hashlimit --hashlimit-name %s"
+					     " --hashlimit-above %" PRIu64 "b/s"
+					     " --hashlimit-burst %" PRIu64 " -j DROP",
+					     op, subnet, name, rate, MIN(burst, UINT32_MAX));
+	}
+	if (dscp >= 0) {
+		rules[n].table = "mangle";
+		rules[n++].rule = mem_printf("%s POSTROUTING -s %s -j DSCP --set-dscp %d", op,
+					     subnet, dscp);
+	}
+	if (priority) {
+		rules[n].table = "mangle";
+		rules[n++].rule = mem_printf("%s POSTROUTING -s %s -j CLASSIFY --set-class 0:%x",
+					     op, subnet, priority);
+	}
+	IF_TRUE_RETVAL(n == 0, 0);
+
+	int error = network_iptables_apply(rules, n, enable);
 
-	// outgoing
-	int error = network_iptables("nat", "POSTROUTING", subnet, "MASQUERADE", enable);
-	error |= network_iptables("filter", "FORWARD", subnet, "ACCEPT", enable);
-	// incoming
-	const char *const argv[] = { IPTABLES_PATH,
-				     "-t",
-				     "filter",
-				     enable ? "-I" : "-D",
-				     "FORWARD",
-				     "-d",
-				     subnet,
-				     "-m",
-				     "state",
-				     "--state",
-				     "RELATED,ESTABLISHED",
-				     "-j",
-				     "ACCEPT",
-				     NULL };
-	error |= proc_fork_and_execvp(argv);
+	for (size_t i = 0; i < n; i++)
+		mem_free0(rules[i].rule);
 
 	if (error) {
-		ERROR("Failed to setup IP forwarding from %s", subnet);
+		ERROR("Failed to setup QoS of traffic from %s", subnet);
 		return -1;
 	}
 
@@ -274,8 +997,7 @@ network_delete_link(const char *dev)
 	ASSERT(dev);
 	DEBUG("Destroying network interface %s", dev);
 
-	const char *const argv[] = { IP_PATH, "link", "delete", dev, NULL };
-	return proc_fork_and_execvp(argv);
+	return network_rtnl_del_link(dev);
 }
 
 void
@@ -312,7 +1034,7 @@ network_set_flag(const char *ifi_name, const uint32_t flag)
 	}
 
 	/* Open netlink socket */
-	if (!(nl_sock = nl_sock_routing_new())) {
+	if (!(nl_sock = nl_sock_pool_get(NETLINK_ROUTE))) {
 		ERROR("failed to allocate netlink socket");
 		return -1;
 	}
@@ -403,18 +1125,34 @@ network_setup_loopback()
 int
 network_routing_rules_set_all_main(bool flush)
 {
+	uint32_t table;
+	IF_TRUE_RETVAL(network_route_table_id(IP_ROUTING_TABLE, &table), -1);
+
+	nl_sock_t *nl_sock = nl_sock_pool_get(NETLINK_ROUTE);
+	IF_NULL_RETVAL_ERROR(nl_sock, -1);
+
 	if (flush) {
 		DEBUG("Flushing all ip routing rules!");
-		const char *const argv[] = { IP_PATH, "rule", "flush", NULL };
-		if (proc_fork_and_execvp(argv))
+		if (network_rtnl_rules_flush(nl_sock))
 			WARN("Failed to flush routing rules");
 	}
 
 	DEBUG("Set rule to route all traffic through table %s", IP_ROUTING_TABLE);
 
-	const char *const argv2[] = { IP_PATH,	"rule",		  "add", "from", "all",
-				      "lookup", IP_ROUTING_TABLE, NULL };
-	return proc_fork_and_execvp(argv2);
+	struct fib_rule_hdr rule_req = { .family = AF_INET,
+					 .table = table < 256 ? table : RT_TABLE_UNSPEC,
+					 .action = FR_ACT_TO_TBL };
+
+	nl_msg_t *req = network_rtnl_msg_new(RTM_NEWRULE, NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL,
+					     &rule_req, sizeof(rule_req));
+	int ret = -1;
+	if (req && !nl_msg_add_u32(req, FRA_TABLE, table))
+		ret = network_rtnl_request(nl_sock, req);
+	else
+		nl_msg_free(req);
+
+	nl_sock_free(nl_sock);
+	return ret;
 }
 
 bool
@@ -430,9 +1168,244 @@ network_interface_is_wifi(const char *if_name)
 	return ret;
 }
 
+static network_link_t *
+network_link_cache_find_index(int index)
+{
+	for (list_t *l = network_link_cache; l; l = l->next) {
+		network_link_t *link = l->data;
+		if (link->index == index)
+			return link;
+	}
+	return NULL;
+}
+
+static network_link_t *
+network_link_cache_find_name(const char *name)
+{
+	for (list_t *l = network_link_cache; l; l = l->next) {
+		network_link_t *link = l->data;
+		if (!strncmp(link->name, name, IFNAMSIZ))
+			return link;
+	}
+	return NULL;
+}
+
+/**
+ * Applies a RTM_NEWLINK or RTM_DELLINK message, either from the initial dump
+ * or from the subscription, to the cache.
+ */
+static int
+network_link_cache_update_cb(struct nlmsghdr *nlh, UNUSED void *data)
+{
+	IF_FALSE_RETVAL(nlh->nlmsg_type == RTM_NEWLINK || nlh->nlmsg_type == RTM_DELLINK, 0);
+	IF_TRUE_RETVAL(nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifinfomsg)), 0);
+
+	struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+	network_link_t *link = network_link_cache_find_index(ifi->ifi_index);
+
+	if (nlh->nlmsg_type == RTM_DELLINK) {
+		if (link) {
+			TRACE("Link %s removed from cache", link->name);
+			network_link_cache = list_remove(network_link_cache, link);
+			mem_free0(link);
+		}
+		return 0;
+	}
+
+	const char *name = NULL;
+	const uint8_t *mac = NULL;
+	int len = IFLA_PAYLOAD(nlh);
+	for (struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFLA_IFNAME)
+			name = RTA_DATA(rta);
+		else if (rta->rta_type == IFLA_ADDRESS && RTA_PAYLOAD(rta) == 6)
+			mac = RTA_DATA(rta);
+	}
+	IF_NULL_RETVAL(name, 0);
+
+	if (!link) {
+		link = mem_new0(network_link_t, 1);
+		link->index = ifi->ifi_index;
+		/* sysfs entries are registered before the link is announced */
+		char *dev_drv_path = mem_printf("/sys/class/net/%s/device/driver", name);
+		link->physical = file_exists(dev_drv_path);
+		mem_free0(dev_drv_path);
+		network_link_cache = list_append(network_link_cache, link);
+	}
+
+	// renames are announced as RTM_NEWLINK with the same index
+	strncpy(link->name, name, IFNAMSIZ - 1);
+	link->has_mac = mac != NULL;
+	if (mac)
+		memcpy(link->mac, mac, 6);
+
+	return 0;
+}
+
+static void
+network_link_cache_clear(void)
+{
+	for (list_t *l = network_link_cache; l; l = l->next)
+		mem_free0(l->data);
+	list_delete(network_link_cache);
+	network_link_cache = NULL;
+}
+
+/**
+ * (Re)populates the cache from a full link dump.
+ */
+static int
+network_link_cache_resync(void)
+{
+	struct ifinfomsg link_req = { .ifi_family = AF_UNSPEC };
+
+	network_link_cache_clear();
+
+	nl_sock_t *nl_sock = nl_sock_pool_get(NETLINK_ROUTE);
+	IF_NULL_RETVAL_ERROR(nl_sock, -1);
+
+	nl_msg_t *req = network_rtnl_msg_new(RTM_GETLINK, NLM_F_DUMP, &link_req, sizeof(link_req));
+	int ret = req ? network_rtnl_dump(nl_sock, req, network_link_cache_update_cb, NULL) : -1;
+
+	nl_sock_free(nl_sock);
+	return ret;
+}
+
+/**
+ * Applies all pending notifications. As the kernel queues them before it
+ * acknowledges the request which caused them, links created or removed by
+ * ourselves are always visible afterwards.
+ */
+static void
+network_link_cache_drain(void)
+{
+	ssize_t lens[NETWORK_LINK_CACHE_BATCH];
+
+	for (;;) {
+		int n = nl_msg_receive_kernel_batch(network_link_cache_sock,
+						    network_link_cache_bufs,
+						    NETWORK_LINK_CACHE_BUF_SIZE, lens,
+						    NETWORK_LINK_CACHE_BATCH, false);
+		if (n < 0 && errno == ENOBUFS) {
+			WARN("Link notifications were dropped, resyncing link cache");
+			if (network_link_cache_resync())
+				ERROR("Could not resync link cache");
+			continue;
+		}
+		if (n <= 0) {
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+				WARN_ERRNO("Could not receive link notifications");
+			return;
+		}
+
+		for (int i = 0; i < n; i++) {
+			int len = lens[i];
+			for (struct nlmsghdr *nlh = (struct nlmsghdr *)network_link_cache_bufs[i];
+			     len > 0 && NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len))
+				network_link_cache_update_cb(nlh, NULL);
+		}
+	}
+}
+
+static void
+network_link_cache_cb(UNUSED int fd, UNUSED unsigned events, UNUSED event_io_t *io,
+		      UNUSED void *data)
+{
+	network_link_cache_drain();
+}
+
+/**
+ * Returns true if lookups can be answered from the cache. Forked children,
+ * e.g., helpers which joined another netns, query the kernel directly.
+ */
+static bool
+network_link_cache_usable(void)
+{
+	IF_FALSE_RETVAL(network_link_cache_sock && getpid() == network_link_cache_pid, false);
+
+	network_link_cache_drain();
+	return true;
+}
+
+int
+network_link_cache_init(void)
+{
+	IF_TRUE_RETVAL(network_link_cache_sock, 0);
+
+	network_link_cache_sock = nl_sock_routing_new();
+	IF_NULL_RETVAL_ERROR(network_link_cache_sock, -1);
+
+	int fd = nl_sock_get_fd(network_link_cache_sock);
+	int group = RTNLGRP_LINK;
+	if (setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group))) {
+		ERROR_ERRNO("Could not subscribe to link notifications");
+		goto err;
+	}
+
+	network_link_cache_bufs = mem_new0(char *, NETWORK_LINK_CACHE_BATCH);
+	for (int i = 0; i < NETWORK_LINK_CACHE_BATCH; i++)
+		network_link_cache_bufs[i] = mem_alloc0(NETWORK_LINK_CACHE_BUF_SIZE);
+
+	// subscribe before the dump, so that no change in between is lost
+	if (network_link_cache_resync())
+		goto err;
+
+	network_link_cache_io = event_io_new(fd, EVENT_IO_READ, network_link_cache_cb, NULL);
+	event_add_io(network_link_cache_io);
+	network_link_cache_pid = getpid();
+
+	INFO("Link cache holds %d links", list_length(network_link_cache));
+	return 0;
+err:
+	network_link_cache_free();
+	return -1;
+}
+
+void
+network_link_cache_free(void)
+{
+	if (network_link_cache_io) {
+		event_remove_io(network_link_cache_io);
+		event_io_free(network_link_cache_io);
+		network_link_cache_io = NULL;
+	}
+	if (network_link_cache_bufs) {
+		for (int i = 0; i < NETWORK_LINK_CACHE_BATCH; i++)
+			mem_free0(network_link_cache_bufs[i]);
+		mem_free0(network_link_cache_bufs);
+	}
+	nl_sock_free(network_link_cache_sock);
+	network_link_cache_sock = NULL;
+	network_link_cache_pid = 0;
+	network_link_cache_clear();
+}
+
+bool
+network_interface_exists(const char *ifname)
+{
+	IF_NULL_RETVAL(ifname, false);
+
+	if (network_link_cache_usable())
+		return network_link_cache_find_name(ifname) != NULL;
+
+	return if_nametoindex(ifname) != 0;
+}
+
 list_t *
 network_get_physical_interfaces_new()
 {
+	if (network_link_cache_usable()) {
+		list_t *if_name_list = NULL;
+		for (list_t *l = network_link_cache; l; l = l->next) {
+			network_link_t *link = l->data;
+			if (link->physical) {
+				DEBUG("Adding %s to the physical device list", link->name);
+				if_name_list = list_append(if_name_list, mem_strdup(link->name));
+			}
+		}
+		return if_name_list;
+	}
+
 	struct if_nameindex *if_ni, *i;
 	if_ni = if_nameindex();
 
@@ -495,7 +1468,7 @@ network_nl80211_move_ns(const char *if_name, const pid_t pid)
 	IF_TRUE_RETVAL_ERROR(nl80211_id < GENL_MIN_ID, -1);
 
 	/* Open netlink socket */
-	nl_sock = nl_sock_default_new(NETLINK_GENERIC);
+	nl_sock = nl_sock_pool_get(NETLINK_GENERIC);
 	IF_NULL_RETVAL_ERROR(nl_sock, -1);
 
 	/* Create netlink message */
@@ -550,7 +1523,7 @@ network_rtnet_move_ns(const char *ifi_name, const pid_t pid)
 	IF_FALSE_RETVAL_ERROR(ifi_index, -1);
 
 	/* Open netlink socket */
-	nl_sock = nl_sock_routing_new();
+	nl_sock = nl_sock_pool_get(NETLINK_ROUTE);
 	IF_NULL_RETVAL_ERROR(nl_sock, -1);
 
 	/* Create netlink message */
@@ -606,7 +1579,7 @@ network_rename_ifi(const char *old_ifi_name, const char *new_ifi_name)
 	}
 
 	/* Open netlink socket */
-	if (!(nl_sock = nl_sock_routing_new())) {
+	if (!(nl_sock = nl_sock_pool_get(NETLINK_ROUTE))) {
 		ERROR("failed to allocate netlink socket");
 		return -1;
 	}
@@ -680,6 +1653,13 @@ network_get_mac_by_ifname(const char *ifname, uint8_t mac[6])
 	IF_NULL_RETVAL(ifname, -1);
 	IF_NULL_RETVAL(mac, -1);
 
+	if (network_link_cache_usable()) {
+		network_link_t *link = network_link_cache_find_name(ifname);
+		IF_FALSE_RETVAL(link && link->has_mac, -1);
+		memcpy(mac, link->mac, 6);
+		return 0;
+	}
+
 	char *dev_addr_path = mem_printf("/sys/class/net/%s/address", ifname);
 	char *mac_str = file_read_new(dev_addr_path, 128);
 	mem_free0(dev_addr_path);
@@ -698,6 +1678,15 @@ network_get_ifname_by_addr_new(uint8_t mac[6])
 {
 	IF_NULL_RETVAL(mac, NULL);
 
+	if (network_link_cache_usable()) {
+		for (list_t *l = network_link_cache; l; l = l->next) {
+			network_link_t *link = l->data;
+			if (link->has_mac && !memcmp(link->mac, mac, 6))
+				return mem_strdup(link->name);
+		}
+		return NULL;
+	}
+
 	struct if_nameindex *if_ni, *i;
 	if_ni = if_nameindex();
 
@@ -731,9 +1720,24 @@ network_create_bridge(const char *name)
 {
 	IF_NULL_RETVAL_ERROR(name, -1);
 
-	const char *const argv[] = { IP_PATH, "link", "add", "name", name, "type", "bridge", NULL };
-	int ret = proc_fork_and_execvp(argv);
-	return ret;
+	struct nlattr *linkinfo = NULL;
+	struct ifinfomsg link_req = { .ifi_family = AF_UNSPEC };
+
+	nl_msg_t *req = network_rtnl_msg_new(RTM_NEWLINK, NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL,
+					     &link_req, sizeof(link_req));
+	IF_NULL_RETVAL(req, -1);
+
+	IF_TRUE_GOTO_ERROR(nl_msg_add_string(req, IFLA_IFNAME, name), err);
+
+	linkinfo = nl_msg_start_nested_attr(req, IFLA_LINKINFO);
+	IF_NULL_GOTO_ERROR(linkinfo, err);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_string(req, IFLA_INFO_KIND, "bridge"), err);
+	IF_TRUE_GOTO_ERROR(nl_msg_end_nested_attr(req, linkinfo), err);
+
+	return network_rtnl_transact(req, 0);
+err:
+	nl_msg_free(req);
+	return -1;
 }
 
 /**
@@ -745,10 +1749,13 @@ network_bridge_add_port(const char *br_name, const char *prt_name)
 	IF_NULL_RETVAL_ERROR(br_name, -1);
 	IF_NULL_RETVAL_ERROR(prt_name, -1);
 
-	const char *const argv[] = { IP_PATH,  "link",	 "set",	  "dev",
-				     prt_name, "master", br_name, NULL };
-	int ret = proc_fork_and_execvp(argv);
-	return ret;
+	unsigned int br_index = if_nametoindex(br_name);
+	if (!br_index) {
+		ERROR("bridge name '%s' could not be resolved", br_name);
+		return -1;
+	}
+
+	return network_rtnl_set_master(prt_name, br_index);
 }
 
 int
@@ -756,9 +1763,7 @@ network_bridge_remove_port(const char *br_name)
 {
 	IF_NULL_RETVAL_ERROR(br_name, -1);
 
-	const char *const argv[] = { IP_PATH, "link", "set", br_name, "nomaster", NULL };
-	int ret = proc_fork_and_execvp(argv);
-	return ret;
+	return network_rtnl_set_master(br_name, 0);
 }
 
 int
@@ -766,9 +1771,7 @@ network_bridge_set_up(const char *br_name)
 {
 	IF_NULL_RETVAL_ERROR(br_name, -1);
 
-	const char *const argv[] = { IP_PATH, "link", "set", "dev", br_name, "up", NULL };
-	int ret = proc_fork_and_execvp(argv);
-	return ret;
+	return network_set_flag(br_name, IFF_UP);
 }
 
 int
@@ -776,41 +1779,378 @@ network_delete_bridge(const char *name)
 {
 	IF_NULL_RETVAL_ERROR(name, -1);
 
-	const char *const argv[] = { IP_PATH, "link", "delete", name, "type", "bridge", NULL };
-	int ret = proc_fork_and_execvp(argv);
+	return network_rtnl_del_link(name);
+}
+
+/**
+ * Allocates an ipset request for cmd on the set name.
+ */
+static nl_msg_t *
+network_ipset_msg_new(uint8_t cmd, const char *name)
+{
+	uint8_t protocol = IPSET_PROTOCOL;
+	struct nfgenmsg nfg = { .nfgen_family = AF_INET, .version = NFNETLINK_V0 };
+
+	nl_msg_t *req =
+		network_rtnl_msg_new((NFNL_SUBSYS_IPSET << 8) | cmd, NLM_F_ACK, &nfg, sizeof(nfg));
+	IF_NULL_RETVAL(req, NULL);
+
+	IF_TRUE_GOTO_ERROR(nl_msg_add_buffer(req, IPSET_ATTR_PROTOCOL, (char *)&protocol, 1), err);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_string(req, IPSET_ATTR_SETNAME, name), err);
+
+	return req;
+err:
+	nl_msg_free(req);
+	return NULL;
+}
+
+/**
+ * Queues the creation of the mac set name, which is kept if it already exists,
+ * followed by replacing its content with the macs of mac_whitelist.
+ */
+static int
+network_ipset_mac_batch_fill(nl_batch_t *batch, const char *name, list_t *mac_whitelist)
+{
+	uint8_t revision = 0;
+	uint8_t family = NFPROTO_UNSPEC;
+
+	nl_msg_t *req = network_ipset_msg_new(IPSET_CMD_CREATE, name);
+	IF_NULL_RETVAL(req, -1);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_string(req, IPSET_ATTR_TYPENAME, NETWORK_MAC_SET_TYPE), err);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_buffer(req, IPSET_ATTR_REVISION, (char *)&revision, 1), err);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_buffer(req, IPSET_ATTR_FAMILY, (char *)&family, 1), err);
+	IF_TRUE_GOTO_ERROR(nl_batch_add(batch, req) < 0, err);
+
+	req = network_ipset_msg_new(IPSET_CMD_FLUSH, name);
+	IF_NULL_RETVAL(req, -1);
+	IF_TRUE_GOTO_ERROR(nl_batch_add(batch, req) < 0, err);
+
+	for (list_t *l = mac_whitelist; l; l = l->next) {
+		req = network_ipset_msg_new(IPSET_CMD_ADD, name);
+		IF_NULL_RETVAL(req, -1);
+
+		struct nlattr *data = nl_msg_start_nested_attr(req, IPSET_ATTR_DATA | NLA_F_NESTED);
+		IF_NULL_GOTO_ERROR(data, err);
+		IF_TRUE_GOTO_ERROR(nl_msg_add_buffer(req, IPSET_ATTR_ETHER, l->data, 6), err);
+		IF_TRUE_GOTO_ERROR(nl_msg_end_nested_attr(req, data), err);
+		IF_TRUE_GOTO_ERROR(nl_batch_add(batch, req) < 0, err);
+	}
+	return 0;
+err:
+	nl_msg_free(req);
+	return -1;
+}
+
+static struct bpf_insn
+network_bpf_insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+	struct bpf_insn insn = {
+		.code = code, .dst_reg = dst, .src_reg = src, .off = off, .imm = imm
+	};
+	return insn;
+}
+
+static network_xdp_filter_t *
+network_xdp_filter_get(const char *netif)
+{
+	for (list_t *l = network_xdp_filters; l; l = l->next) {
+		network_xdp_filter_t *filter = l->data;
+		if (!strcmp(filter->netif, netif))
+			return filter;
+	}
+	return NULL;
+}
+
+static bool
+network_mac_list_contains(list_t *mac_list, const uint8_t mac[6])
+{
+	for (list_t *l = mac_list; l; l = l->next) {
+		if (!memcmp(l->data, mac, 6))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Adds the macs of mac_whitelist to the map before removing the ones which are no
+ * longer whitelisted, so that clients which stay whitelisted are never dropped.
+ */
+static int
+network_xdp_mac_map_update(int map_fd, list_t *mac_whitelist)
+{
+	union bpf_attr attr;
+	uint8_t allowed = 1;
+	uint8_t key[6], next_key[6];
+	uint8_t *stale = mem_alloc0(NETWORK_XDP_MAC_MAX * 6);
+	int n_stale = 0;
+	int ret = -1;
+
+	if (list_length(mac_whitelist) > NETWORK_XDP_MAC_MAX) {
+		DEBUG("Whitelist exceeds the %d entries of the XDP filter", NETWORK_XDP_MAC_MAX);
+		goto out;
+	}
+
+	for (list_t *l = mac_whitelist; l; l = l->next) {
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = map_fd;
+		attr.key = (uint64_t)(uintptr_t)l->data;
+		attr.value = (uint64_t)(uintptr_t)&allowed;
+		attr.flags = BPF_ANY;
+		if (syscall(__NR_bpf, BPF_MAP_UPDATE_ELEM, &attr, sizeof(attr)) < 0) {
+			ERROR_ERRNO("Could not add mac to XDP filter");
+			goto out;
+		}
+	}
+
+	// a hash map restarts iterating after a deleted key, thus collect the keys first
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.next_key = (uint64_t)(uintptr_t)next_key;
+	while (n_stale < NETWORK_XDP_MAC_MAX &&
+	       !syscall(__NR_bpf, BPF_MAP_GET_NEXT_KEY, &attr, sizeof(attr))) {
+		if (!network_mac_list_contains(mac_whitelist, next_key))
+			memcpy(stale + 6 * n_stale++, next_key, 6);
+		memcpy(key, next_key, 6);
+		attr.key = (uint64_t)(uintptr_t)key;
+	}
+
+	for (int i = 0; i < n_stale; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = map_fd;
+		attr.key = (uint64_t)(uintptr_t)(stale + 6 * i);
+		if (syscall(__NR_bpf, BPF_MAP_DELETE_ELEM, &attr, sizeof(attr)) < 0) {
+			ERROR_ERRNO("Could not remove mac from XDP filter");
+			goto out;
+		}
+	}
+	ret = 0;
+out:
+	mem_free0(stale);
+	return ret;
+}
+
+/**
+ * Loads the XDP program which passes the frames whose source mac is in the map
+ * map_fd and drops all others, including truncated ones.
+ */
+static int
+network_xdp_mac_prog_load(int map_fd)
+{
+	struct bpf_insn insns[] = {
+		// r2 = data, r3 = data_end, drop frames without a complete ethernet header
+		network_bpf_insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1,
+				 offsetof(struct xdp_md, data), 0),
+		network_bpf_insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1,
+				 offsetof(struct xdp_md, data_end), 0),
+		network_bpf_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+		network_bpf_insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 14),
+		network_bpf_insn(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 14, 0),
+		// copy the source mac to the stack as key
+		network_bpf_insn(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2, 6, 0),
+		network_bpf_insn(BPF_STX | BPF_MEM | BPF_H, BPF_REG_10, BPF_REG_4, -8, 0),
+		network_bpf_insn(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2, 8, 0),
+		network_bpf_insn(BPF_STX | BPF_MEM | BPF_H, BPF_REG_10, BPF_REG_4, -6, 0),
+		network_bpf_insn(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2, 10, 0),
+		network_bpf_insn(BPF_STX | BPF_MEM | BPF_H, BPF_REG_10, BPF_REG_4, -4, 0),
+		// r0 = bpf_map_lookup_elem(map, key)
+		network_bpf_insn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd),
+		network_bpf_insn(0, 0, 0, 0, 0),
+		network_bpf_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+		network_bpf_insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8),
+		network_bpf_insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+		network_bpf_insn(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 2, 0),
+		network_bpf_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+		network_bpf_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		network_bpf_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_DROP),
+		network_bpf_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uint64_t)(uintptr_t)insns;
+	attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+	attr.license = (uint64_t)(uintptr_t) "GPL";
+
+	return syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+}
+
+/**
+ * Attaches the XDP program prog_fd to netif, or detaches its program if prog_fd is -1.
+ */
+static int
+network_rtnl_set_xdp(const char *netif, int prog_fd)
+{
+	unsigned int ifi_index = if_nametoindex(netif);
+	if (!ifi_index) {
+		ERROR("net interface name '%s' could not be resolved", netif);
+		return -1;
+	}
+
+	struct ifinfomsg link_req = { .ifi_family = AF_UNSPEC, .ifi_index = ifi_index };
+
+	nl_msg_t *req = network_rtnl_msg_new(RTM_SETLINK, NLM_F_ACK, &link_req, sizeof(link_req));
+	IF_NULL_RETVAL(req, -1);
+
+	struct nlattr *xdp = nl_msg_start_nested_attr(req, IFLA_XDP | NLA_F_NESTED);
+	IF_NULL_GOTO_ERROR(xdp, err);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_u32(req, IFLA_XDP_FD, (uint32_t)prog_fd), err);
+	IF_TRUE_GOTO_ERROR(nl_msg_end_nested_attr(req, xdp), err);
+
+	return network_rtnl_transact(req, 0);
+err:
+	nl_msg_free(req);
+	return -1;
+}
+
+/**
+ * Filters the frames received on netif by their source mac in XDP, i.e. in the
+ * driver before an skb is allocated and before they reach the bridge.
+ */
+static int
+network_xdp_mac_filter_attach(const char *netif, list_t *mac_whitelist)
+{
+	IF_TRUE_RETVAL(strlen(netif) >= IFNAMSIZ, -1);
+	IF_TRUE_RETVAL(list_length(mac_whitelist) > NETWORK_XDP_MAC_MAX, -1);
+
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_HASH;
+	attr.key_size = 6;
+	attr.value_size = 1;
+	attr.max_entries = NETWORK_XDP_MAC_MAX;
+
+	int map_fd = syscall(__NR_bpf, BPF_MAP_CREATE, &attr, sizeof(attr));
+	if (map_fd < 0) {
+		DEBUG_ERRNO("Could not create XDP map for %s", netif);
+		return -1;
+	}
+	int prog_fd = -1;
+
+	IF_TRUE_GOTO(network_xdp_mac_map_update(map_fd, mac_whitelist), err);
+
+	prog_fd = network_xdp_mac_prog_load(map_fd);
+	if (prog_fd < 0) {
+		DEBUG_ERRNO("Could not load XDP mac filter for %s", netif);
+		goto err;
+	}
+	// the attached program keeps a reference to itself and the map
+	IF_TRUE_GOTO(network_rtnl_set_xdp(netif, prog_fd), err);
+	close(prog_fd);
+
+	network_xdp_filter_t *filter = mem_new0(network_xdp_filter_t, 1);
+	strcpy(filter->netif, netif);
+	filter->map_fd = map_fd;
+	network_xdp_filters = list_append(network_xdp_filters, filter);
+
+	DEBUG("Attached XDP mac filter with %d macs to %s", list_length(mac_whitelist), netif);
+	return 0;
+err:
+	if (prog_fd >= 0)
+		close(prog_fd);
+	close(map_fd);
+	return -1;
+}
+
+static int
+network_xdp_mac_filter_detach(network_xdp_filter_t *filter)
+{
+	int ret = network_rtnl_set_xdp(filter->netif, -1);
+	if (ret)
+		WARN("Could not detach XDP mac filter from %s", filter->netif);
+
+	close(filter->map_fd);
+	network_xdp_filters = list_remove(network_xdp_filters, filter);
+	mem_free0(filter);
 	return ret;
 }
 
 int
-network_iptables_phys_deny(const char *chain, const char *netif, bool add)
+network_phys_mac_filter_update(const char *netif, list_t *mac_whitelist)
 {
 	ASSERT(netif);
 
-	const char *const argv[] = { IPTABLES_PATH, add ? "-I" : "-D",
-				     chain,	    "-m",
-				     "physdev",	    "--physdev-in",
-				     netif,	    "-j",
-				     "DROP",	    NULL };
+	network_xdp_filter_t *filter = network_xdp_filter_get(netif);
+	if (filter)
+		return network_xdp_mac_map_update(filter->map_fd, mac_whitelist);
 
-	return proc_fork_and_execvp(argv);
+	nl_sock_t *nl_sock = nl_sock_pool_get(NETLINK_NETFILTER);
+	IF_NULL_RETVAL_ERROR(nl_sock, -1);
+
+	char *name = mem_printf(NETWORK_MAC_SET_NAME, netif);
+	nl_batch_t *batch = nl_batch_new();
+
+	int ret = network_ipset_mac_batch_fill(batch, name, mac_whitelist);
+	if (!ret && nl_batch_send_kernel_verify(nl_sock, batch)) {
+		ERROR_ERRNO("Could not update mac set %s", name);
+		ret = -1;
+	}
+
+	nl_batch_free(batch);
+	mem_free0(name);
+	nl_sock_free(nl_sock);
+	return ret;
+}
+
+static int
+network_ipset_destroy(const char *name)
+{
+	nl_sock_t *nl_sock = nl_sock_pool_get(NETLINK_NETFILTER);
+	IF_NULL_RETVAL_ERROR(nl_sock, -1);
+
+	nl_msg_t *req = network_ipset_msg_new(IPSET_CMD_DESTROY, name);
+	int ret = req ? network_rtnl_request(nl_sock, req) : -1;
+
+	nl_sock_free(nl_sock);
+	return ret;
 }
 
 int
-network_phys_allow_mac(const char *chain, const char *netif, uint8_t mac[6], bool add)
+network_phys_mac_filter(const char *netif, list_t *mac_whitelist, bool add)
 {
 	ASSERT(netif);
 
-	char *mac_str = network_mac_addr_to_str_new(mac);
-	const char *const argv[] = { IPTABLES_PATH, add ? "-I" : "-D",
-				     chain,	    "-m",
-				     "physdev",	    "--physdev-in",
-				     netif,	    "-m",
-				     "mac",	    "--mac-source",
-				     mac_str,	    "-j",
-				     "ACCEPT",	    NULL };
+	IF_FALSE_RETVAL(network_iptables_arg_is_valid(netif), -1);
 
-	int ret = proc_fork_and_execvp(argv);
+	network_xdp_filter_t *filter = network_xdp_filter_get(netif);
+	if (filter)
+		return add ? network_xdp_mac_map_update(filter->map_fd, mac_whitelist) :
+			     network_xdp_mac_filter_detach(filter);
+	if (add && !network_xdp_mac_filter_attach(netif, mac_whitelist))
+		return 0;
 
-	mem_free0(mac_str);
+	/* The set has to exist before and must not be referenced after the rules */
+	if (add && network_phys_mac_filter_update(netif, mac_whitelist))
+		return -1;
+
+	char *name = mem_printf(NETWORK_MAC_SET_NAME, netif);
+	const char *op = add ? "-I" : "-D";
+
+	/* ACCEPT is inserted last, so that it is evaluated before DROP */
+	network_iptables_rule_t rules[] = {
+		{ "filter", mem_printf("%s INPUT -m physdev --physdev-in %s -j DROP", op, netif) },
+		{ "filter",
+		  mem_printf("%s FORWARD -m physdev --physdev-in %s -j DROP", op, netif) },
+		{ "filter", mem_printf("%s INPUT -m physdev --physdev-in %s -m set --match-set %s "
+				       "src -j ACCEPT",
+				       op, netif, name) },
+		{ "filter",
+		  mem_printf("%s FORWARD -m physdev --physdev-in %s -m set --match-set %s "
+			     "src -j ACCEPT",
+			     op, netif, name) },
+	};
+	size_t n = sizeof(rules) / sizeof(rules[0]);
+
+	int ret = network_iptables_apply(rules, n, add);
+
+	for (size_t i = 0; i < n; i++)
+		mem_free0(rules[i].rule);
+
+	if (!add || ret) {
+		if (network_ipset_destroy(name))
+			WARN("Could not destroy mac set %s", name);
+	}
+
+	mem_free0(name);
 	return ret;
 }
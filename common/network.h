@@ -101,6 +101,28 @@ network_setup_port_forwarding(const char *srcip, uint16_t srcport, const char *d
 int
 network_setup_masquerading(const char *subnet, bool enable);
 
+/**
+ * Shapes the egress traffic of dev to rate bytes/s with a token bucket, behind which
+ * flows are queued fairly by fq_codel. The qdiscs are removed together with dev.
+ *
+ * @param rate the rate in bytes/s, 0 leaves dev unshaped
+ */
+int
+network_set_egress_rate(const char *dev, uint64_t rate);
+
+/**
+ * Enable or disable policing, DSCP marking and prioritization of the traffic which is
+ * forwarded from subnet.
+ *
+ * @param name unique name of the rate limit, at most IFNAMSIZ - 1 characters
+ * @param rate limit in bytes/s beyond which packets are dropped, 0 for unlimited
+ * @param dscp DSCP set on the packets, -1 to leave them unmarked
+ * @param priority skb priority (TC_PRIO_*) for the qdisc of the uplink, 0 to keep it
+ */
+int
+network_setup_qos(const char *name, const char *subnet, uint64_t rate, int dscp,
+		  unsigned int priority, bool enable);
+
 /**
  * Free network interface for instance to be reusable after a container restart
  */
@@ -146,6 +168,29 @@ network_move_link_ns(pid_t src_pid, pid_t dest_pid, const char *interface);
 int
 network_list_link_ns(pid_t pid, list_t **link_list);
 
+/**
+ * Sets up an in-memory table of the links in the network namespace of the calling
+ * process, which is kept current through a RTNLGRP_LINK subscription handled in the
+ * event loop. Afterwards, the link lookups of this module are answered from the table
+ * instead of by syscalls and sysfs scans. Lookups of forked children still query the
+ * kernel, as they may have joined another network namespace.
+ * @return 0 on success, -1 on error
+ */
+int
+network_link_cache_init(void);
+
+/**
+ * Stops the subscription and frees the link table.
+ */
+void
+network_link_cache_free(void);
+
+/**
+ * Checks if a network interface with the given name exists.
+ */
+bool
+network_interface_exists(const char *ifname);
+
 /*
  * Generates a list containing names of all available physical network interfaces
  */
@@ -255,17 +300,30 @@ int
 network_delete_bridge(const char *name);
 
 /**
- * Adds/Removes a rule to firewall to drop all input traffic on the
- * physical (bridge-port) interface netif.
+ * Adds/Removes firewall rules which drop all input traffic on the physical
+ * (bridge-port) interface netif except of clients whose mac address is in
+ * mac_whitelist. If the kernel supports it, the frames are dropped by an XDP program
+ * on netif, which looks up their source mac in a BPF hash map, before they reach the
+ * bridge. Otherwise, the whitelist is kept in an ipset and matched in constant time.
+ *
+ * @param netif the physical interface
+ * @param mac_whitelist list of uint8_t[6] mac addresses
+ * @param add true to apply the filter, false to remove it
+ * @return 0 on success, -1 on error
  */
 int
-network_iptables_phys_deny(const char *chain, const char *netif, bool add);
+network_phys_mac_filter(const char *netif, list_t *mac_whitelist, bool add);
 
 /**
- * Adds/Removes a rule to firewall to allow input traffic of a client
- * by its mac address on the physical (bridge-port) interface netif.
+ * Replaces the whitelist of the mac filter on netif, i.e. the entries of its BPF map
+ * or its ipset with a single batch of netlink requests, without touching the firewall
+ * rules.
+ *
+ * @param netif the physical interface
+ * @param mac_whitelist list of uint8_t[6] mac addresses
+ * @return 0 on success, -1 on error
  */
 int
-network_phys_allow_mac(const char *chain, const char *netif, uint8_t mac[6], bool add);
+network_phys_mac_filter_update(const char *netif, list_t *mac_whitelist);
 
 #endif /* NETWORK_H */
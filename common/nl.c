@@ -24,11 +24,13 @@
 #include "nl.h"
 #include <sys/uio.h>
 #include <unistd.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <asm/types.h>
 #include <linux/netlink.h>
 #include <linux/genetlink.h>
@@ -51,8 +53,33 @@
 
 #define NL_HDR_OFFSET(len) len + NLMSG_ALIGN(len);
 
+/**
+ * Limits for one sendmsg() call of a request batch. The size stays well below the
+ * socket send buffer. Each ACK arrives in its own skb, which is accounted with its
+ * full truesize (about 1K) against the receive buffer, so the number of requests
+ * is bounded such that all ACKs of one call fit without an overrun.
+ */
+#define NL_BATCH_MAX_SEND_SIZE (NL_DEFAULT_SOCK_SNDBUF_SIZE / 2)
+#define NL_BATCH_MAX_MSGS 32
+
+/**
+ * Single requests use the socket fd as sequence number, batched requests are
+ * numbered from a range above the usual fd numbers.
+ */
+#define NL_BATCH_SEQ_START 0x10000
+
+/**
+ * Number of idle sockets kept by nl_sock_pool_get() and of released messages kept for
+ * reuse by nl_msg_new(), and of cached generic netlink family ids
+ */
+#define NL_SOCK_POOL_SIZE 8
+#define NL_MSG_CACHE_SIZE 4
+#define NL_GENL_FAMILY_CACHE_SIZE 8
+
 // only trust udev messages from this pid
 static pid_t trusted_udevd_pid = -1;
+// additionally trust kernel messages from this port, see nl_sock_uevent_set_replay_port()
+static uint32_t trusted_replay_port = 0;
 
 enum udev_monitor_netlink_group {
 	UDEV_MONITOR_NONE,
@@ -66,6 +93,12 @@ enum udev_monitor_netlink_group {
 struct nl_sock {
 	int fd;			  //!< Netlink filedescriptor
 	struct sockaddr_nl local; //!< corresponding local sockaddress
+	bool pooled;		  //!< Owned by the socket pool, see nl_sock_pool_get()
+	bool in_use;		  //!< Pooled socket currently handed out
+	int protocol;		  //!< Netlink protocol of a pooled socket
+	pid_t pid;		  //!< Process which created a pooled socket
+	dev_t ns_dev;		  //!< Network namespace of a pooled socket
+	ino_t ns_ino;
 };
 
 /**
@@ -76,6 +109,28 @@ struct nl_msg {
 	struct nlmsghdr nlmsghdr; //!< Netlink message header
 };
 
+/**
+ * Batch of netlink requests
+ */
+struct nl_batch {
+	nl_msg_t **msgs;   //!< Queued requests, owned by the batch
+	int *errors;	   //!< Result of each request, 0 or negative errno
+	unsigned int n;	   //!< Number of queued requests
+	unsigned int size; //!< Number of allocated slots
+};
+
+static uint32_t nl_batch_seq = NL_BATCH_SEQ_START;
+
+static nl_sock_t *nl_sock_pool[NL_SOCK_POOL_SIZE];
+
+static nl_msg_t *nl_msg_cache[NL_MSG_CACHE_SIZE];
+static unsigned int nl_msg_cache_len = 0;
+
+static struct {
+	char *name;
+	uint16_t id;
+} nl_genl_family_cache[NL_GENL_FAMILY_CACHE_SIZE];
+
 /**
  * Sets the pointer of a netlink message header to the top end of the given netlink message.
  * NLMSG_ALIGN rounds the length of a netlink message up to align it properly.
@@ -251,7 +306,7 @@ nl_sock_new(int protocol)
 		return NULL;
 
 	/* Get a netlink socket */
-	ret->fd = socket(AF_NETLINK, SOCK_RAW, protocol);
+	ret->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, protocol);
 
 	TRACE("Socket created, fd: %d", ret->fd);
 
@@ -304,6 +359,12 @@ nl_sock_uevent_new(pid_t udevd_pid)
 	return nl_sock_new(NETLINK_KOBJECT_UEVENT);
 }
 
+void
+nl_sock_uevent_set_replay_port(uint32_t port)
+{
+	trusted_replay_port = port;
+}
+
 nl_sock_t *
 nl_sock_routing_new()
 {
@@ -337,10 +398,78 @@ nl_sock_get_fd(const nl_sock_t *sock)
 	return sock->fd;
 }
 
+/**
+ * Gets the identity of the network namespace of the calling thread.
+ * @return failure: -1, success: 0
+ */
+static int
+nl_sock_get_netns(dev_t *dev, ino_t *ino)
+{
+	struct stat st;
+	if (stat("/proc/thread-self/ns/net", &st) && stat("/proc/self/ns/net", &st))
+		return -1;
+
+	*dev = st.st_dev;
+	*ino = st.st_ino;
+	return 0;
+}
+
+nl_sock_t *
+nl_sock_pool_get(int protocol)
+{
+	ASSERT(protocol != NETLINK_KOBJECT_UEVENT);
+
+	dev_t ns_dev;
+	ino_t ns_ino;
+	if (nl_sock_get_netns(&ns_dev, &ns_ino)) {
+		DEBUG_ERRNO("Could not identify netns, using unpooled nl socket");
+		return nl_sock_new(protocol);
+	}
+
+	pid_t pid = getpid();
+	nl_sock_t **slot = NULL;
+	for (int i = 0; i < NL_SOCK_POOL_SIZE; i++) {
+		nl_sock_t *sock = nl_sock_pool[i];
+		if (!sock) {
+			slot = slot ? slot : &nl_sock_pool[i];
+			continue;
+		}
+		// sockets inherited by a forked child stay with the parent
+		if (!sock->in_use && sock->protocol == protocol && sock->pid == pid &&
+		    sock->ns_dev == ns_dev && sock->ns_ino == ns_ino) {
+			TRACE("Reusing pooled nl socket, fd: %d", sock->fd);
+			sock->in_use = true;
+			return sock;
+		}
+	}
+
+	nl_sock_t *sock = nl_sock_new(protocol);
+	if (sock && slot) {
+		sock->pooled = true;
+		sock->in_use = true;
+		sock->protocol = protocol;
+		sock->pid = pid;
+		sock->ns_dev = ns_dev;
+		sock->ns_ino = ns_ino;
+		*slot = sock;
+	}
+	return sock;
+}
+
 void
 nl_sock_free(nl_sock_t *nl)
 {
 	IF_NULL_RETURN(nl);
+
+	if (nl->pooled) {
+		// drop unread responses, so the next user does not receive them
+		char buf[256];
+		while (recv(nl->fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_TRUNC) >= 0)
+			;
+		nl->in_use = false;
+		return;
+	}
+
 	close(nl->fd);
 	mem_free0(nl);
 }
@@ -398,6 +527,14 @@ nl_msg_add_u32(nl_msg_t *msg, int type, uint32_t val)
 	return nl_msg_add_attr(msg, type, (const void *)&val, sizeof(uint32_t));
 }
 
+int
+nl_msg_add_u64(nl_msg_t *msg, int type, uint64_t val)
+{
+	ASSERT(msg);
+
+	return nl_msg_add_attr(msg, type, (const void *)&val, sizeof(uint64_t));
+}
+
 int
 nl_msg_send_kernel(const nl_sock_t *nl, const nl_msg_t *msg)
 {
@@ -474,7 +611,8 @@ nl_verify_uevent_source(struct msghdr *uevent_msg, struct sockaddr_nl nladdr)
 		/* ignoring unicast netlink message */
 		return -1;
 	}
-	if ((nladdr.nl_groups == UDEV_MONITOR_KERNEL) && (nladdr.nl_pid != 0)) {
+	if ((nladdr.nl_groups == UDEV_MONITOR_KERNEL) && (nladdr.nl_pid != 0) &&
+	    (!trusted_replay_port || nladdr.nl_pid != trusted_replay_port)) {
 		/* ignoring unicast netlink message */
 		return -1;
 	}
@@ -488,6 +626,35 @@ nl_verify_uevent_source(struct msghdr *uevent_msg, struct sockaddr_nl nladdr)
 	return 0;
 }
 
+/*
+ * Sanity checks of a received message, returns -1 if the message has to be dropped.
+ */
+static int
+nl_msg_check(const nl_sock_t *nl, struct msghdr *m, struct sockaddr_nl nladdr, bool receive_uevent)
+{
+	if (receive_uevent && nl_verify_uevent_source(m, nladdr)) {
+		TRACE("Detected possibly malicious uevent");
+		return -1;
+	}
+
+	TRACE("Received a message from kernel");
+
+	TRACE("Sent from this address:");
+	TRACE("sockaddr_nl{nl_family: %u, nl_pad:%u, nl_pid: %u, nl_groups: %u}", nladdr.nl_family,
+	      nladdr.nl_pad, nladdr.nl_pid, nladdr.nl_groups);
+
+	TRACE("Arrived on this socket");
+	TRACE("nl_sock{fd:%d, local: nl_family: %u, nl_pad:%u, nl_pid: %u, nl_groups: %u}", nl->fd,
+	      nl->local.nl_family, nl->local.nl_pad, nl->local.nl_pid, nl->local.nl_groups);
+
+	/* Check for truncated messages */
+	IF_TRUE_RETVAL_TRACE(m->msg_flags & MSG_TRUNC, -1);
+	/* Check if protocol family fits */
+	IF_FALSE_RETVAL_TRACE(nladdr.nl_family == AF_NETLINK, -1);
+
+	return 0;
+}
+
 static int
 nl_msg_receive(const nl_sock_t *nl, char *buf, const size_t len, bool receive_uevent, bool ucred)
 {
@@ -515,30 +682,14 @@ nl_msg_receive(const nl_sock_t *nl, char *buf, const size_t len, bool receive_ue
 			TRACE("recvmsg failed");
 			if (errno == EINTR)
 				continue;
-			goto error;
+			/* keep errno, e.g., to let callers distinguish EAGAIN */
+			memset(buf, 0, len);
+			return -1;
 		}
 		break;
 	}
 
-	if (receive_uevent && nl_verify_uevent_source(&m, nladdr)) {
-		TRACE("Detected possibly malicious uevent");
-		goto error;
-	}
-
-	TRACE("Received a message from kernel");
-
-	TRACE("Sent from this address:");
-	TRACE("sockaddr_nl{nl_family: %u, nl_pad:%u, nl_pid: %u, nl_groups: %u}", nladdr.nl_family,
-	      nladdr.nl_pad, nladdr.nl_pid, nladdr.nl_groups);
-
-	TRACE("Arrived on this socket");
-	TRACE("nl_sock{fd:%d, local: nl_family: %u, nl_pad:%u, nl_pid: %u, nl_groups: %u}", nl->fd,
-	      nl->local.nl_family, nl->local.nl_pad, nl->local.nl_pid, nl->local.nl_groups);
-
-	/* Check for truncated messages */
-	IF_TRUE_GOTO_TRACE(m.msg_flags & MSG_TRUNC, error);
-	/* Check if protocol family fits */
-	IF_FALSE_GOTO_TRACE(nladdr.nl_family == AF_NETLINK, error);
+	IF_TRUE_GOTO(nl_msg_check(nl, &m, nladdr, receive_uevent), error);
 
 	return received;
 
@@ -555,6 +706,49 @@ nl_msg_receive_kernel(const nl_sock_t *nl, char *buf, const size_t len, bool rec
 	return nl_msg_receive(nl, buf, len, receive_uevent, true);
 }
 
+int
+nl_msg_receive_kernel_batch(const nl_sock_t *nl, char **bufs, size_t len, ssize_t *lens,
+			    unsigned int n, bool receive_uevent)
+{
+	ASSERT(nl && bufs && lens);
+
+	struct mmsghdr msgs[n];
+	struct iovec iovs[n];
+	struct sockaddr_nl nladdrs[n];
+	char controls[n][CMSG_SPACE(sizeof(struct ucred))];
+	int received;
+
+	for (unsigned int i = 0; i < n; i++) {
+		iovs[i].iov_base = bufs[i];
+		iovs[i].iov_len = len;
+		msgs[i].msg_hdr = (struct msghdr){ .msg_name = &nladdrs[i],
+						   .msg_namelen = sizeof(nladdrs[i]),
+						   .msg_iov = &iovs[i],
+						   .msg_iovlen = 1,
+						   .msg_control = controls[i],
+						   .msg_controllen = sizeof(controls[i]) };
+		msgs[i].msg_len = 0;
+	}
+
+	do {
+		received = recvmmsg(nl->fd, msgs, n, MSG_DONTWAIT, NULL);
+	} while (received < 0 && errno == EINTR);
+
+	/* keep errno, e.g., to let callers distinguish EAGAIN */
+	IF_TRUE_RETVAL_TRACE(received < 0, -1);
+
+	for (int i = 0; i < received; i++) {
+		if (nl_msg_check(nl, &msgs[i].msg_hdr, nladdrs[i], receive_uevent)) {
+			TRACE("Purged netlink message, as it did not pass sanity checks");
+			lens[i] = -1;
+			continue;
+		}
+		lens[i] = msgs[i].msg_len;
+	}
+
+	return received;
+}
+
 int
 nl_msg_receive_nocred(const nl_sock_t *nl, char *buf, const size_t len)
 {
@@ -678,12 +872,39 @@ nl_msg_send_kernel_verify(const nl_sock_t *nl_sock, const nl_msg_t *req)
 	return nl_eval_ack(nl_sock, req->nlmsghdr.nlmsg_seq);
 }
 
+/**
+ * Returns the number of bytes of a message starting at its header which may have been
+ * written since it was allocated or reset.
+ */
+static size_t
+nl_msg_used_len(const nl_msg_t *msg)
+{
+	size_t max = NLMSG_ALIGN(msg->size) + NLMSG_ALIGN(sizeof(struct nl_msg)) -
+		     offsetof(struct nl_msg, nlmsghdr);
+	return MIN((size_t)NLMSG_ALIGN(msg->nlmsghdr.nlmsg_len), max);
+}
+
+void
+nl_msg_reset(nl_msg_t *msg)
+{
+	ASSERT(msg);
+
+	memset(&msg->nlmsghdr, 0, nl_msg_used_len(msg));
+	nl_msg_set_len(msg, msg->size);
+}
+
 nl_msg_t *
 nl_msg_new()
 {
 	nl_msg_t *ret = NULL;
 	size_t size = NL_MSG_DEFAULT_SIZE;
 
+	if (nl_msg_cache_len > 0) {
+		ret = nl_msg_cache[--nl_msg_cache_len];
+		nl_msg_reset(ret);
+		return ret;
+	}
+
 	/* Take padding bytes after the nlmsghdr and the payload into
 	 * account */
 	const size_t len = NLMSG_ALIGN(size) + NLMSG_ALIGN(sizeof(struct nl_msg));
@@ -712,6 +933,11 @@ void
 nl_msg_free(nl_msg_t *msg)
 {
 	IF_NULL_RETURN(msg);
+
+	if (nl_msg_cache_len < NL_MSG_CACHE_SIZE) {
+		nl_msg_cache[nl_msg_cache_len++] = msg;
+		return;
+	}
 	mem_free0(msg);
 }
 
@@ -794,6 +1020,31 @@ nl_msg_set_buf_unaligned(nl_msg_t *msg, char *buf, size_t size)
 	return nl_msg_set_len(msg, size);
 }
 
+int
+nl_msg_set_buf_iov(nl_msg_t *msg, const struct iovec *iov, int iovcnt)
+{
+	ASSERT(msg);
+
+	size_t size = 0;
+	for (int i = 0; i < iovcnt; i++)
+		size += iov[i].iov_len;
+
+	/* Check for overflow in message buffer */
+	if (NLMSG_LENGTH(size) > msg->size) {
+		TRACE("size: %zu, msg->size %zu", size, msg->size);
+		errno = EOVERFLOW;
+		return -1;
+	}
+
+	char *data = NLMSG_DATA(&msg->nlmsghdr);
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(data, iov[i].iov_base, iov[i].iov_len);
+		data += iov[i].iov_len;
+	}
+
+	return nl_msg_set_len(msg, size);
+}
+
 int
 nl_msg_set_genl_hdr(nl_msg_t *msg, const struct genlmsghdr *hdr)
 {
@@ -850,8 +1101,8 @@ nl_nla_ok(const struct nlattr *nla, int rem)
 	       sizeof(struct nlattr) <= (unsigned int)rem;
 }
 
-uint16_t
-nl_genl_family_getid(const char *family_name)
+static uint16_t
+nl_genl_family_resolve(const char *family_name)
 {
 	nl_sock_t *nl_sock = NULL;
 	nl_msg_t *req = NULL;
@@ -867,7 +1118,7 @@ nl_genl_family_getid(const char *family_name)
 	};
 
 	/* Open netlink socket */
-	if (!(nl_sock = nl_sock_new(NETLINK_GENERIC))) {
+	if (!(nl_sock = nl_sock_pool_get(NETLINK_GENERIC))) {
 		ERROR("failed to allocate gen_netlink socket");
 		return 0;
 	}
@@ -974,3 +1225,207 @@ msg_err:
 		mem_free0(buf);
 	return 0;
 }
+
+uint16_t
+nl_genl_family_getid(const char *family_name)
+{
+	ASSERT(family_name);
+
+	int i = 0;
+	for (; i < NL_GENL_FAMILY_CACHE_SIZE && nl_genl_family_cache[i].name; i++) {
+		if (!strcmp(nl_genl_family_cache[i].name, family_name))
+			return nl_genl_family_cache[i].id;
+	}
+
+	// ids are assigned when a family registers, e.g. on loading its module,
+	// so only successful lookups are cached
+	uint16_t id = nl_genl_family_resolve(family_name);
+	if (id && i < NL_GENL_FAMILY_CACHE_SIZE) {
+		nl_genl_family_cache[i].name = mem_strdup(family_name);
+		nl_genl_family_cache[i].id = id;
+	}
+	return id;
+}
+
+nl_batch_t *
+nl_batch_new(void)
+{
+	return mem_new0(nl_batch_t, 1);
+}
+
+void
+nl_batch_free(nl_batch_t *batch)
+{
+	IF_NULL_RETURN(batch);
+
+	for (unsigned int i = 0; i < batch->n; i++)
+		nl_msg_free(batch->msgs[i]);
+	mem_free0(batch->msgs);
+	mem_free0(batch->errors);
+	mem_free0(batch);
+}
+
+int
+nl_batch_add(nl_batch_t *batch, nl_msg_t *msg)
+{
+	ASSERT(batch && msg);
+
+	if (!(msg->nlmsghdr.nlmsg_flags & NLM_F_ACK)) {
+		ERROR("nl request message must have the NLM_F_ACK flag set");
+		return -1;
+	}
+
+	if (NLMSG_ALIGN(msg->nlmsghdr.nlmsg_len) > NL_BATCH_MAX_SEND_SIZE) {
+		ERROR("nl request message of %u bytes is too large for a batch",
+		      msg->nlmsghdr.nlmsg_len);
+		return -1;
+	}
+
+	if (batch->n == batch->size) {
+		batch->size = batch->size ? 2 * batch->size : 8;
+		batch->msgs = mem_renew(nl_msg_t *, batch->msgs, batch->size);
+		batch->errors = mem_renew(int, batch->errors, batch->size);
+	}
+
+	batch->msgs[batch->n] = msg;
+	batch->errors[batch->n] = -ENOMSG;
+
+	return batch->n++;
+}
+
+unsigned int
+nl_batch_length(const nl_batch_t *batch)
+{
+	ASSERT(batch);
+	return batch->n;
+}
+
+int
+nl_batch_get_error(const nl_batch_t *batch, unsigned int i)
+{
+	ASSERT(batch && i < batch->n);
+	return batch->errors[i];
+}
+
+/**
+ * Sends the requests [first, first + count) of the batch with one sendmsg() call
+ * and collects their ACKs. This function may possibly block!
+ */
+static int
+nl_batch_send_chunk(const nl_sock_t *nl, nl_batch_t *batch, unsigned int first, unsigned int count)
+{
+	struct iovec iov[count];
+	struct sockaddr_nl nladdr = { .nl_family = AF_NETLINK }; /* Kernel, unicast */
+	int ret = 0;
+
+	/* Assign consecutive sequence numbers which do not collide with the fd */
+	if (nl_batch_seq < NL_BATCH_SEQ_START || nl_batch_seq > UINT32_MAX - count)
+		nl_batch_seq = NL_BATCH_SEQ_START;
+	uint32_t base = nl_batch_seq;
+	if ((uint32_t)nl->fd >= base && (uint32_t)nl->fd - base < count)
+		base = nl->fd + 1;
+	nl_batch_seq = base + count;
+
+	/* The kernel walks the messages of one datagram in NLMSG_ALIGN steps */
+	for (unsigned int i = 0; i < count; i++) {
+		struct nlmsghdr *nlmsg = &batch->msgs[first + i]->nlmsghdr;
+		nlmsg->nlmsg_seq = base + i;
+		iov[i] = (struct iovec){ .iov_base = nlmsg,
+					 .iov_len = NLMSG_ALIGN(nlmsg->nlmsg_len) };
+	}
+
+	struct msghdr m = { .msg_name = &nladdr,
+			    .msg_namelen = sizeof(nladdr),
+			    .msg_iov = iov,
+			    .msg_iovlen = count };
+
+	TRACE("Sending %u batched messages (seq %u-%u) on socket with fd %d", count, base,
+	      base + count - 1, nl->fd);
+
+	if (sendmsg(nl->fd, &m, 0) < 0) {
+		ERROR_ERRNO("Could not send netlink batch");
+		return -1;
+	}
+
+	char *buf = mem_new0(char, NL_DEFAULT_SOCK_RCVBUF_SIZE);
+	unsigned int pending = count;
+
+	while (pending > 0) {
+		int len = nl_msg_receive_kernel(nl, buf, NL_DEFAULT_SOCK_RCVBUF_SIZE, false);
+		if (len < 0) {
+			ERROR_ERRNO("Could not receive ACKs of netlink batch");
+			ret = -1;
+			break;
+		}
+
+		for (struct nlmsghdr *msg = (struct nlmsghdr *)buf; NLMSG_OK(msg, len);
+		     msg = NLMSG_NEXT(msg, len)) {
+			uint32_t i = msg->nlmsg_seq - base;
+
+			if (msg->nlmsg_type != NLMSG_ERROR || msg->nlmsg_seq < base || i >= count ||
+			    batch->errors[first + i] != -ENOMSG) {
+				TRACE("Skipping message (type %u, seq %u) which is no pending ACK",
+				      msg->nlmsg_type, msg->nlmsg_seq);
+				continue;
+			}
+
+			struct nlmsgerr *errack = NLMSG_DATA(msg);
+			batch->errors[first + i] = errack->error;
+			if (errack->error) {
+				errno = -(errack->error);
+				DEBUG_ERRNO("ACK of batched request %u reports an error",
+					    first + i);
+				ret = -1;
+			}
+			pending--;
+		}
+	}
+
+	mem_free0(buf);
+	return ret;
+}
+
+int
+nl_batch_send_kernel_verify(const nl_sock_t *nl, nl_batch_t *batch)
+{
+	ASSERT(nl && batch);
+
+	int ret = 0;
+	unsigned int first = 0;
+
+	for (unsigned int i = 0; i < batch->n; i++)
+		batch->errors[i] = -ENOMSG;
+
+	while (first < batch->n) {
+		unsigned int count = 0;
+		size_t size = 0;
+
+		while (first + count < batch->n && count < NL_BATCH_MAX_MSGS) {
+			size_t len = NLMSG_ALIGN(batch->msgs[first + count]->nlmsghdr.nlmsg_len);
+			if (size + len > NL_BATCH_MAX_SEND_SIZE)
+				break;
+			size += len;
+			count++;
+		}
+
+		if (nl_batch_send_chunk(nl, batch, first, count))
+			ret = -1;
+		first += count;
+
+		/* Unacknowledged requests leave the socket in an unknown state */
+		if (batch->errors[first - 1] == -ENOMSG) {
+			ERROR("Aborting netlink batch after %u of %u requests", first, batch->n);
+			break;
+		}
+	}
+
+	IF_FALSE_RETVAL(ret, 0);
+
+	for (unsigned int i = 0; i < batch->n; i++) {
+		if (batch->errors[i]) {
+			errno = -batch->errors[i];
+			break;
+		}
+	}
+	return -1;
+}
@@ -37,6 +37,7 @@
 
 #include <stdint.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 #include <linux/genetlink.h>
@@ -58,6 +59,14 @@ typedef struct nl_msg nl_msg_t;
 nl_sock_t *
 nl_sock_uevent_new(pid_t udevd_pid);
 
+/**
+ * Additionally accepts kernel uevents sent by the given netlink port, which are dropped
+ * as spoofed otherwise. This allows to replay recorded uevents for testing.
+ * @param port netlink port id of the replaying socket, 0 to accept the kernel only again
+ */
+void
+nl_sock_uevent_set_replay_port(uint32_t port);
+
 /**
  * Allocates, opens and returns a nl_sock object of family NETLINK_ROUTE with various netlink options.
  * Depending on the protocol, the socket options are implicitly set.
@@ -86,6 +95,15 @@ nl_sock_xfrm_new();
 nl_sock_t *
 nl_sock_default_new(int protocol);
 
+/**
+ * Returns an idle pooled socket of the given protocol in the network namespace of the
+ * caller, or creates one. nl_sock_free() returns the socket to the pool instead of
+ * closing it. Pooled sockets are meant for single request/response transactions and
+ * must not be reconfigured, e.g. by joining multicast groups.
+ */
+nl_sock_t *
+nl_sock_pool_get(int protocol);
+
 /**
  * Getter for fd of a nl_sock struct.
  * @return Filedescriptor associated to the netlink socket
@@ -117,6 +135,18 @@ nl_msg_send_kernel(const nl_sock_t *sock, const nl_msg_t *msg);
 int
 nl_msg_receive_kernel(const nl_sock_t *sock, char *buf, size_t len, bool receive_uevent);
 
+/**
+ * Receive up to n netlink messages from the kernel with a single recvmmsg() call
+ * without blocking. Message i is stored in bufs[i], each of which must hold len bytes.
+ * @param lens Filled with the length of each received message, or -1 if the message
+ * did not pass the same sanity checks as in nl_msg_receive_kernel() and was dropped.
+ * @return In case of failure, return -1 with errno set (EAGAIN if no message is
+ * pending), in case of success, return the number of messages received
+ */
+int
+nl_msg_receive_kernel_batch(const nl_sock_t *sock, char **bufs, size_t len, ssize_t *lens,
+			    unsigned int n, bool receive_uevent);
+
 /**
  * Transmit a message with ACKNOWLEDGEMENT flag
  * and check the ACK response for success.
@@ -142,6 +172,13 @@ nl_msg_new();
 void
 nl_msg_free(nl_msg_t *msg);
 
+/**
+ * Clears the given message to the state after nl_msg_new(), so it can be reused
+ * for another request.
+ */
+void
+nl_msg_reset(nl_msg_t *msg);
+
 /**
  * Sets the request to according to the given payload struct.
  * The message length is adapted accordingly.
@@ -229,6 +266,14 @@ nl_msg_add_string(nl_msg_t *msg, int type, const char *str);
 int
 nl_msg_add_u32(nl_msg_t *msg, int type, uint32_t val);
 
+/**
+ * This function adds a uint64_t attribute of a certain type
+ * to the netlink message
+ * @return failure: -1, success: 0
+ */
+int
+nl_msg_add_u64(nl_msg_t *msg, int type, uint64_t val);
+
 /**
  * Sets the message payload unaligned according to the given buffer.
  * The message length is adapted accordingly to the size argument.
@@ -237,6 +282,14 @@ nl_msg_add_u32(nl_msg_t *msg, int type, uint32_t val);
 int
 nl_msg_set_buf_unaligned(nl_msg_t *msg, char *buf, size_t size);
 
+/**
+ * Sets the message payload unaligned to the concatenation of the given buffers.
+ * The message length is adapted accordingly to their total size.
+ * @return failure: -1, success: 0
+ */
+int
+nl_msg_set_buf_iov(nl_msg_t *msg, const struct iovec *iov, int iovcnt);
+
 /**
  * Sets the request according to the given struct genlmsghdr
  * The message length is adapted accordingly.
@@ -258,7 +311,65 @@ nl_msg_receive_and_check_kernel(const nl_sock_t *nl);
  * the corresponding id.
  * @return family id, -1 on error
  * */
+/**
+ * Resolves the id of the given generic netlink family, e.g. "nl80211".
+ * Resolved ids are cached for subsequent calls.
+ * @return the family id, 0 on failure
+ */
 uint16_t
 nl_genl_family_getid(const char *family_name);
 
+/**
+ * Batch of netlink requests which are sent to the kernel with a single sendmsg()
+ * and whose ACKs are collected in one receive loop.
+ */
+typedef struct nl_batch nl_batch_t;
+
+/**
+ * Allocates an empty request batch.
+ * @return Pointer to the batch; NULL in case of failure
+ */
+nl_batch_t *
+nl_batch_new(void);
+
+/**
+ * Frees the batch together with all queued messages.
+ */
+void
+nl_batch_free(nl_batch_t *batch);
+
+/**
+ * Queues a request with the NLM_F_ACK flag set. On success the batch takes
+ * ownership of msg, its sequence number is assigned when the batch is sent.
+ * @return In case of failure, return -1, in case of success, the index of the
+ * request inside the batch
+ */
+int
+nl_batch_add(nl_batch_t *batch, nl_msg_t *msg);
+
+/**
+ * Returns the number of requests queued in the batch.
+ */
+unsigned int
+nl_batch_length(const nl_batch_t *batch);
+
+/**
+ * Transmits all queued requests and waits for their ACKs. Requests are sent with
+ * as few sendmsg() calls as the socket buffers allow, usually a single one.
+ * The kernel processes every request, regardless of failures of earlier ones.
+ * This is a blocking function.
+ * @return 0 if all requests were acknowledged successfully, -1 otherwise with errno
+ * set to the error of the first failed request
+ */
+int
+nl_batch_send_kernel_verify(const nl_sock_t *sock, nl_batch_t *batch);
+
+/**
+ * Returns the result of request i of the last nl_batch_send_kernel_verify() call.
+ * @return 0 on success, the negative errno reported in the ACK on failure, or
+ * -ENOMSG if no ACK was received for the request
+ */
+int
+nl_batch_get_error(const nl_batch_t *batch, unsigned int i);
+
 #endif /* NL_H_ */
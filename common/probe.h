@@ -0,0 +1,65 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file probe.h
+ *
+ * Static tracepoints (USDT probes) of the provider "cml" at points of interest of
+ * cmld, scd and tpm2d, which can be traced in production builds with bpftrace or perf,
+ * e.g.:
+ *
+ *   bpftrace -e 'usdt:/usr/sbin/cmld:cml:container_state { printf("%s %d\n", str(arg0), arg2); }'
+ *
+ * Probes are only compiled in if built with USDT=y, which requires sys/sdt.h
+ * (systemtap-sdt-dev). Then, a probe is a single nop instruction which a tracer
+ * replaces while it is attached, plus an ELF note which describes the location of
+ * its arguments. Otherwise, probes and the evaluation of their arguments are compiled
+ * out. Arguments should be cheap, e.g., values at hand anyway, as they are evaluated
+ * even if no tracer is attached.
+ *
+ * Probes come in pairs of name and name_done around operations whose latency is of
+ * interest, with the same first argument to match them.
+ */
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#ifdef USDT
+#include <sys/sdt.h>
+
+#define PROBE0(name) DTRACE_PROBE(cml, name)
+#define PROBE1(name, a1) DTRACE_PROBE1(cml, name, a1)
+#define PROBE2(name, a1, a2) DTRACE_PROBE2(cml, name, a1, a2)
+#define PROBE3(name, a1, a2, a3) DTRACE_PROBE3(cml, name, a1, a2, a3)
+#define PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(cml, name, a1, a2, a3, a4)
+#else
+#define PROBE0(name)                                                                               \
+	do {                                                                                       \
+	} while (0)
+#define PROBE1(name, a1) PROBE0(name)
+#define PROBE2(name, a1, a2) PROBE0(name)
+#define PROBE3(name, a1, a2, a3) PROBE0(name)
+#define PROBE4(name, a1, a2, a3, a4) PROBE0(name)
+#endif
+
+#endif /* PROBE_H */
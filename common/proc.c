@@ -30,21 +30,35 @@
 #include "dir.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
-struct proc_killall {
-	pid_t ppid;
-	const char *name;
-	int sig;
-};
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+
+// enough for a /proc/PID/stat line up to the starttime field
+#define PROC_STAT_BUF_SIZE 1024
 
-struct proc_find {
+typedef struct proc_entry {
+	pid_t pid;
 	pid_t ppid;
-	const char *name;
-	pid_t match;
+	unsigned long long starttime; // in clock ticks after boot, tells reused pids apart
+	char state;
+	char name[16];
+} proc_entry_t;
+
+struct proc_table {
+	proc_entry_t *entries; // sorted by ppid, then pid
+	size_t n;
+	size_t size;
 };
 
 struct proc_status {
@@ -146,88 +160,258 @@ proc_status_get_ppid(const proc_status_t *status)
 	return status->ppid;
 }
 
+static unsigned long long
+proc_stat_parse_num(const char *p)
+{
+	unsigned long long val = 0;
+
+	while (*p >= '0' && *p <= '9')
+		val = val * 10 + (*p++ - '0');
+	return val;
+}
+
+static const char *
+proc_stat_skip_fields(const char *p, int n)
+{
+	while (p && n-- > 0) {
+		p = strchr(p, ' ');
+		if (p)
+			p++;
+	}
+	return p;
+}
+
+/*
+ * Parses "pid (name) state ppid ... starttime ..." as in proc(5). The name may contain
+ * spaces and parentheses itself, thus it ends at the last ')'.
+ */
 static int
-proc_killall_cb(UNUSED const char *path, const char *file, void *data)
+proc_stat_parse(const char *buf, proc_entry_t *entry)
 {
-	struct proc_killall *pk = data;
+	const char *open = strchr(buf, '(');
+	const char *close = strrchr(buf, ')');
+	IF_TRUE_RETVAL(!open || !close || close < open || close[1] != ' ', -1);
+
+	entry->pid = proc_stat_parse_num(buf);
+
+	size_t len = MIN((size_t)(close - open - 1), sizeof(entry->name) - 1);
+	memcpy(entry->name, open + 1, len);
+	entry->name[len] = '\0';
+
+	// field 3 is the state, 4 the ppid and 22 the starttime
+	const char *p = close + 2;
+	entry->state = *p;
+	p = proc_stat_skip_fields(p, 1);
+	IF_NULL_RETVAL(p, -1);
+	entry->ppid = proc_stat_parse_num(p);
+	p = proc_stat_skip_fields(p, 18);
+	IF_NULL_RETVAL(p, -1);
+	entry->starttime = proc_stat_parse_num(p);
 
-	char *tmp = NULL;
-	pid_t pid = strtol(file, &tmp, 10);
-	if (!tmp || tmp[0] != '\0') // filename is not a number
-		return 0;
+	return 0;
+}
+
+static int
+proc_stat_read(int dirfd, const char *dir, proc_entry_t *entry)
+{
+	char path[64];
+	char buf[PROC_STAT_BUF_SIZE];
+
+	snprintf(path, sizeof(path), "%s/stat", dir);
+	int fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+	// the process may have exited meanwhile
+	IF_TRUE_RETVAL_TRACE(fd < 0, -1);
 
-	proc_status_t *status = proc_status_new(pid);
-	IF_NULL_RETVAL(status, 0);
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	IF_TRUE_RETVAL_TRACE(len <= 0, -1);
+	buf[len] = '\0';
 
-	pid_t ppid = proc_status_get_ppid(status);
-	const char *name = proc_status_get_name(status);
+	return proc_stat_parse(buf, entry);
+}
+
+static int
+proc_table_add_cb(int dirfd, UNUSED const char *path, const char *name, unsigned char type,
+		  void *data)
+{
+	proc_table_t *table = data;
+
+	if (type != DT_DIR || name[0] < '0' || name[0] > '9') // not a process
+		return 0;
 
-	if ((pk->ppid < 0 || pk->ppid == ppid) && !strcmp(name, pk->name)) {
-		DEBUG("Killing process %s with pid %d", pk->name, pid);
-		kill(pid, pk->sig);
+	if (table->n == table->size) {
+		table->size = MAX(2 * table->size, 256);
+		table->entries = mem_renew(proc_entry_t, table->entries, table->size);
 	}
+	if (proc_stat_read(dirfd, name, &table->entries[table->n]) == 0)
+		table->n++;
 
-	proc_status_free(status);
 	return 0;
 }
 
-int
-proc_killall(pid_t ppid, const char *name, int sig)
+static int
+proc_entry_cmp(const void *a, const void *b)
 {
-	struct proc_killall data = { ppid, name, sig };
+	const proc_entry_t *ea = a, *eb = b;
 
-	DEBUG("Trying to kill %s with ppid %d", name, ppid);
-	if (dir_foreach("/proc", &proc_killall_cb, &data) < 0) {
+	if (ea->ppid != eb->ppid)
+		return ea->ppid < eb->ppid ? -1 : 1;
+	return ea->pid < eb->pid ? -1 : ea->pid > eb->pid;
+}
+
+proc_table_t *
+proc_table_new(void)
+{
+	proc_table_t *table = mem_new0(proc_table_t, 1);
+
+	if (dir_foreach_at(AT_FDCWD, "/proc", &proc_table_add_cb, table) < 0) {
 		WARN("Could not traverse /proc");
-		return -1;
+		proc_table_free(table);
+		return NULL;
 	}
+	qsort(table->entries, table->n, sizeof(proc_entry_t), proc_entry_cmp);
+
+	TRACE("Read %zu processes from /proc", table->n);
+	return table;
+}
+
+void
+proc_table_free(proc_table_t *table)
+{
+	IF_NULL_RETURN(table);
+
+	mem_free0(table->entries);
+	mem_free0(table);
+}
 
+size_t
+proc_table_size(const proc_table_t *table)
+{
+	ASSERT(table);
+	return table->n;
+}
+
+/*
+ * Returns the index of the first entry with ppid, or table->n if there is none.
+ */
+static size_t
+proc_table_first_child(const proc_table_t *table, pid_t ppid)
+{
+	size_t lo = 0, hi = table->n;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (table->entries[mid].ppid < ppid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+pid_t
+proc_table_find(const proc_table_t *table, pid_t ppid, const char *name)
+{
+	ASSERT(table);
+	IF_NULL_RETVAL(name, 0);
+
+	for (size_t i = proc_table_first_child(table, ppid);
+	     i < table->n && table->entries[i].ppid == ppid; i++) {
+		if (!strcmp(table->entries[i].name, name)) {
+			TRACE("Found pid %d with ppid %d and name %s", table->entries[i].pid, ppid,
+			      name);
+			return table->entries[i].pid;
+		}
+	}
 	return 0;
 }
 
+/*
+ * Signals the process of entry unless it has exited since the snapshot.
+ * Returns 1 if it has been signaled, 0 if it is gone and -1 on error.
+ */
 static int
-proc_find_cb(UNUSED const char *path, const char *file, void *data)
+proc_entry_signal(const proc_entry_t *entry, int sig)
 {
-	struct proc_find *pf = data;
+	int pidfd = syscall(SYS_pidfd_open, entry->pid, 0);
+	if (pidfd < 0) {
+		IF_TRUE_RETVAL_TRACE(errno == ESRCH, 0);
+		IF_FALSE_RETVAL(errno == ENOSYS, -1);
+		// without pidfds, a pid reused since the snapshot cannot be ruled out
+		return kill(entry->pid, sig) < 0 ? -1 : 1;
+	}
 
-	char *tmp = NULL;
-	pid_t pid = strtol(file, &tmp, 10);
-	if (!tmp || tmp[0] != '\0') // filename is not a number
-		return 0;
+	// the pidfd pins the pid, so it is safe to use if it still has the same start time
+	int ret = 0;
+	char dir[32];
+	proc_entry_t now;
+	snprintf(dir, sizeof(dir), "/proc/%d", entry->pid);
+	if (proc_stat_read(AT_FDCWD, dir, &now) < 0 || now.starttime != entry->starttime) {
+		TRACE("Process %d has exited meanwhile", entry->pid);
+	} else if (syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0) < 0) {
+		ret = errno == ESRCH ? 0 : -1;
+	} else {
+		ret = 1;
+	}
 
-	proc_status_t *status = proc_status_new(pid);
-	IF_NULL_RETVAL_TRACE(status, 0);
+	close(pidfd);
+	return ret;
+}
 
-	pid_t ppid = proc_status_get_ppid(status);
-	const char *name = proc_status_get_name(status);
+int
+proc_table_killall(const proc_table_t *table, pid_t ppid, const char *name, int sig)
+{
+	ASSERT(table);
+	IF_NULL_RETVAL(name, -1);
+
+	int killed = 0, ret = 0;
+	size_t i = ppid < 0 ? 0 : proc_table_first_child(table, ppid);
+	for (; i < table->n && (ppid < 0 || table->entries[i].ppid == ppid); i++) {
+		const proc_entry_t *entry = &table->entries[i];
+		if (strcmp(entry->name, name))
+			continue;
 
-	if ((pf->ppid == ppid) && !strcmp(name, pf->name)) {
-		TRACE("Found pid %d with ppid %d and name %s", pid, ppid, pf->name);
-		pf->match = pid;
-		//return -1; // TODO maybe adapt dir_foreach to allow aborting the directory traversing without indicating an error
+		DEBUG("Killing process %s with pid %d", name, entry->pid);
+		int n = proc_entry_signal(entry, sig);
+		if (n < 0) {
+			WARN_ERRNO("Could not kill process %s with pid %d", name, entry->pid);
+			ret = -1;
+		} else {
+			killed += n;
+		}
 	}
+	return ret < 0 ? -1 : killed;
+}
 
-	proc_status_free(status);
-	return 0;
+int
+proc_killall(pid_t ppid, const char *name, int sig)
+{
+	DEBUG("Trying to kill %s with ppid %d", name, ppid);
+
+	proc_table_t *table = proc_table_new();
+	IF_NULL_RETVAL(table, -1);
+
+	int ret = proc_table_killall(table, ppid, name, sig);
+	proc_table_free(table);
+
+	return ret < 0 ? -1 : 0;
 }
 
 pid_t
 proc_find(pid_t ppid, const char *name)
 {
-	struct proc_find data = { ppid, name, 0 };
+	proc_table_t *table = proc_table_new();
+	IF_NULL_RETVAL(table, -1);
 
-	if (dir_foreach("/proc", &proc_find_cb, &data) < 0) {
-		WARN("Could not traverse /proc");
-		return -1;
-	}
+	pid_t pid = proc_table_find(table, ppid, name);
+	proc_table_free(table);
 
-	return data.match;
+	return pid;
 }
 
-int
-proc_fork_and_execvp(const char *const *argv)
+pid_t
+proc_fork_and_execvp_nowait(const char *const *argv)
 {
-	int status;
 	pid_t pid = fork();
 
 	switch (pid) {
@@ -239,14 +423,24 @@ proc_fork_and_execvp(const char *const *argv)
 		FATAL_ERRNO("Could not execvp %s", argv[0]);
 		return -1;
 	default:
-		if (waitpid(pid, &status, 0) != pid) {
-			ERROR_ERRNO("Could not waitpid for '%s'", argv[0]);
-		} else if (!WIFEXITED(status)) {
-			ERROR("Child '%s' terminated abnormally", argv[0]);
-		} else {
-			TRACE("%s terminated normally", argv[0]);
-			return WEXITSTATUS(status) ? -1 : 0;
-		}
+		return pid;
+	}
+}
+
+int
+proc_fork_and_execvp(const char *const *argv)
+{
+	int status;
+	pid_t pid = proc_fork_and_execvp_nowait(argv);
+	IF_TRUE_RETVAL(pid == -1, -1);
+
+	if (waitpid(pid, &status, 0) != pid) {
+		ERROR_ERRNO("Could not waitpid for '%s'", argv[0]);
+	} else if (!WIFEXITED(status)) {
+		ERROR("Child '%s' terminated abnormally", argv[0]);
+	} else {
+		TRACE("%s terminated normally", argv[0]);
+		return WEXITSTATUS(status) ? -1 : 0;
 	}
 	return -1;
 }
@@ -24,6 +24,7 @@
 #ifndef PROC_H
 #define PROC_H
 
+#include <stddef.h>
 #include <unistd.h>
 
 typedef struct proc_status proc_status_t;
@@ -46,6 +47,7 @@ proc_status_get_ppid(const proc_status_t *status);
  * @param ppid The pid of the parent process, might be negativ.
  * @param name The process name which should be killed.
  * @param sig The signal number, e.g. SIGKILL.
+ * Takes a new proc_table snapshot, see proc_table_killall.
  */
 int
 proc_killall(pid_t ppid, const char *name, int sig);
@@ -55,13 +57,65 @@ proc_killall(pid_t ppid, const char *name, int sig);
  * @param ppid The pid of the parent process.
  * @param name The process name to find.
  * @return pid of matched process, 0 if no match, -1 on error.
+ * Takes a new proc_table snapshot for each call, see proc_table_find.
  */
 pid_t
 proc_find(pid_t ppid, const char *name);
 
+/**
+ * A snapshot of all processes, read from /proc/PID/stat, with the processes indexed by
+ * their parent pid. Several lookups, e.g., down a process tree, should share a snapshot
+ * instead of scanning /proc for each of them.
+ */
+typedef struct proc_table proc_table_t;
+
+/**
+ * Takes a snapshot of all processes.
+ * @return the new table, NULL if /proc could not be read.
+ */
+proc_table_t *
+proc_table_new(void);
+
+void
+proc_table_free(proc_table_t *table);
+
+/**
+ * Returns the number of processes in the snapshot.
+ */
+size_t
+proc_table_size(const proc_table_t *table);
+
+/**
+ * Returns the pid of a process matching name and ppid in the snapshot.
+ * @param ppid The pid of the parent process.
+ * @param name The process name (comm) to find.
+ * @return lowest pid of the matching processes, 0 if no match.
+ */
+pid_t
+proc_table_find(const proc_table_t *table, pid_t ppid, const char *name);
+
+/**
+ * Sends a signal to all processes of the snapshot matching name and, if ppid is
+ * not negative, ppid. Processes are signaled through a pidfd, which is only used
+ * after checking that the pid still belongs to the process in the snapshot, so an
+ * exited process whose pid has been reused meanwhile is never hit.
+ * @return the number of signaled processes, -1 on error.
+ */
+int
+proc_table_killall(const proc_table_t *table, pid_t ppid, const char *name, int sig);
+
 int
 proc_fork_and_execvp(const char *const *argv);
 
+/**
+ * Forks and executes argv in the child without waiting for it.
+ * The caller is responsible for reaping the child, e.g., with waitpid().
+ * @param argv NULL terminated argument vector, argv[0] is looked up in PATH
+ * @return pid of the child, -1 if fork failed
+ */
+pid_t
+proc_fork_and_execvp_nowait(const char *const *argv);
+
 /**
  * Returns the last cap from the running kernel
  * @return last cap of running kernel, -1 on error;
@@ -0,0 +1,133 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "proc.h"
+#include "logf.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// parentheses and spaces are allowed in process names and must not confuse the parser
+#define PROC_TEST_NAME "a) (b c"
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static pid_t
+fork_named_child(void)
+{
+	int sync[2];
+	char c = 0;
+
+	munit_assert_int(pipe(sync), ==, 0);
+	pid_t pid = fork();
+	munit_assert_int(pid, >=, 0);
+	if (pid == 0) {
+		prctl(PR_SET_NAME, PROC_TEST_NAME);
+		if (write(sync[1], &c, 1) != 1)
+			_exit(1);
+		for (;;)
+			pause();
+	}
+	munit_assert_int(read(sync[0], &c, 1), ==, 1);
+	close(sync[0]);
+	close(sync[1]);
+	return pid;
+}
+
+static MunitResult
+test_proc_table_find(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	pid_t pid = fork_named_child();
+
+	proc_table_t *table = proc_table_new();
+	munit_assert_not_null(table);
+	munit_assert_size(proc_table_size(table), >, 1);
+	munit_assert_int(proc_table_find(table, getpid(), PROC_TEST_NAME), ==, pid);
+	munit_assert_int(proc_table_find(table, pid, PROC_TEST_NAME), ==, 0);
+	munit_assert_int(proc_find(getpid(), PROC_TEST_NAME), ==, pid);
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	proc_table_free(table);
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_proc_table_killall(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	int status;
+	pid_t pid = fork_named_child();
+
+	proc_table_t *table = proc_table_new();
+	munit_assert_not_null(table);
+	munit_assert_int(proc_table_killall(table, getpid(), PROC_TEST_NAME, SIGKILL), ==, 1);
+	munit_assert_int(waitpid(pid, &status, 0), ==, pid);
+	munit_assert_true(WIFSIGNALED(status));
+
+	// the process of the snapshot is gone, so nothing must be signaled anymore
+	munit_assert_int(proc_table_killall(table, getpid(), PROC_TEST_NAME, SIGKILL), ==, 0);
+
+	proc_table_free(table);
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/table_find",		/* name */
+		test_proc_table_find,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/table_killall",	 /* name */
+		test_proc_table_killall, /* test */
+		setup,			 /* setup */
+		NULL,			 /* tear_down */
+		MUNIT_TEST_OPTION_NONE,	 /* options */
+		NULL			 /* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite proc_suite = {
+	"/proc",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
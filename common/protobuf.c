@@ -31,11 +31,21 @@
 #include "mem.h"
 #include "fd.h"
 #include "file.h"
+#include "probe.h"
 
+#include <string.h>
 #include <unistd.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
-#define PROTOBUF_MAX_MESSAGE_SIZE 1024 * 1024
+#define PROTOBUF_SEND_STACK_BUF_SIZE 1024
+#define PROTOBUF_SEND_STREAM_BUF_SIZE (16 * 1024)
+#define PROTOBUF_READER_BUF_SIZE 4096
 
 // TODO update naming scheme
 
@@ -58,65 +68,217 @@ protobuf_pack_message_new(const ProtobufCMessage *message, uint8_t **ptr)
 	return actual_len;
 }
 
+uint32_t
+protobuf_pack_message(const ProtobufCMessage *message, uint8_t *buf, size_t buf_len,
+		      uint8_t **ptr)
+{
+	ASSERT(message);
+	ASSERT(ptr);
+
+	uint32_t packed_len = protobuf_c_message_get_packed_size(message);
+	uint8_t *packed = packed_len <= buf_len ? buf : mem_alloc(packed_len);
+
+	uint32_t actual_len = protobuf_c_message_pack(message, packed);
+	ASSERT(actual_len == packed_len);
+
+	*ptr = packed;
+	return actual_len;
+}
+
+/**
+ * Writes all data described by the given iovec array to fd. Partial writes are
+ * resumed and, for non-blocking descriptors, poll() is used to wait for the
+ * descriptor to become writable instead of spinning on EAGAIN.
+ */
+static ssize_t
+protobuf_writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t total = 0;
+
+	while (iovcnt > 0) {
+		ssize_t ret = writev(fd, iov, iovcnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+				if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+					return -1;
+				continue;
+			}
+			return -1;
+		}
+		if (ret == 0)
+			break;
+
+		total += ret;
+		// skip completely written vectors and advance into the partial one
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return total;
+}
+
+/**
+ * Returns true if fd is a packet based socket. Header and body are kept in
+ * separate packets for those, since blocking readers consume them with two
+ * distinct read calls and a combined packet would be truncated.
+ */
+static bool
+protobuf_fd_is_packet_based(int fd)
+{
+	int type;
+	socklen_t len = sizeof(type);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0)
+		return false; // not a socket, e.g. a regular file or pipe
+
+	return type == SOCK_SEQPACKET || type == SOCK_DGRAM;
+}
+
 ssize_t
 protobuf_send_message_packed(int fd, const uint8_t *buf, uint32_t buflen)
 {
-	ASSERT(buf);
+	ASSERT(buf || buflen == 0);
 
 	IF_FALSE_RETVAL(buflen < PROTOBUF_MAX_MESSAGE_SIZE, -1);
 
-	ssize_t bytes_sent = fd_write(fd, (char *)&(uint32_t){ htonl(buflen) }, sizeof(uint32_t));
-	if (-1 == bytes_sent)
-		goto error_write;
-	TRACE("sent protobuf message length (%zd bytes sent, %zu bytes expected, len=%d)",
-	      bytes_sent, sizeof(uint32_t), buflen);
-	ASSERT((size_t)bytes_sent == sizeof(uint32_t));
-
+	uint32_t header = htonl(buflen);
+	struct iovec iov[2] = {
+		{ .iov_base = &header, .iov_len = sizeof(header) },
+		{ .iov_base = (uint8_t *)buf, .iov_len = buflen },
+	};
 	// serialized form of message with all default values has zero length
 	// => transmit its (zero) length prefix only
-	if (buflen == 0)
-		return 0;
-
-	// TODO sending large messages: might have to send multiple chunks
-	// need good (generic?!) solution that interacts nicely with event handling!
-	bytes_sent = fd_write(fd, (char *)buf, buflen);
-	if (-1 == bytes_sent)
+	int iovcnt = buflen ? 2 : 1;
+	ssize_t bytes_sent;
+
+	if (iovcnt > 1 && protobuf_fd_is_packet_based(fd)) {
+		bytes_sent = protobuf_writev_all(fd, &iov[0], 1);
+		if (bytes_sent == (ssize_t)sizeof(header))
+			bytes_sent += protobuf_writev_all(fd, &iov[1], 1);
+	} else {
+		// header and body in one syscall, i.e., without a separate small
+		// segment for the length prefix on TCP connections
+		bytes_sent = protobuf_writev_all(fd, iov, iovcnt);
+	}
+	if (bytes_sent != (ssize_t)(sizeof(header) + buflen))
 		goto error_write;
-	TRACE("sent protobuf message data (%zd bytes sent, %u bytes expected)", bytes_sent, buflen);
 
-	ASSERT((size_t)bytes_sent == buflen);
-	return bytes_sent;
+	TRACE("sent protobuf message (%zd bytes sent, len=%u)", bytes_sent, buflen);
+	PROBE2(protobuf_send, fd, buflen);
+	return buflen;
 
 error_write:
 	DEBUG_ERRNO("Failed to write binary protobuf message to fd %d.", fd);
 	return -1;
 }
 
+/*
+ * ProtobufCBuffer which packs a message into a fixed size chunk and writes the chunk
+ * to fd whenever it is full, like protobuf_c_buffer_simple but without growing.
+ */
+typedef struct protobuf_fd_buffer {
+	ProtobufCBuffer base;
+	int fd;
+	bool failed;
+	size_t len;
+	uint8_t data[PROTOBUF_SEND_STREAM_BUF_SIZE];
+} protobuf_fd_buffer_t;
+
+static void
+protobuf_fd_buffer_flush(protobuf_fd_buffer_t *buffer)
+{
+	struct iovec iov = { .iov_base = buffer->data, .iov_len = buffer->len };
+	if (buffer->len && protobuf_writev_all(buffer->fd, &iov, 1) != (ssize_t)buffer->len)
+		buffer->failed = true;
+	buffer->len = 0;
+}
+
+static void
+protobuf_fd_buffer_append(ProtobufCBuffer *base, size_t len, const uint8_t *data)
+{
+	protobuf_fd_buffer_t *buffer = (protobuf_fd_buffer_t *)base;
+
+	while (len > 0 && !buffer->failed) {
+		size_t n = MIN(len, sizeof(buffer->data) - buffer->len);
+		memcpy(buffer->data + buffer->len, data, n);
+		buffer->len += n;
+		data += n;
+		len -= n;
+		if (buffer->len == sizeof(buffer->data))
+			protobuf_fd_buffer_flush(buffer);
+	}
+}
+
+/*
+ * Packs a large message with its length prefix straight to the stream fd in chunks,
+ * instead of serializing it into a buffer of its full size first.
+ */
+static ssize_t
+protobuf_send_message_streamed(int fd, const ProtobufCMessage *message, uint32_t buflen)
+{
+	protobuf_fd_buffer_t buffer = { .base = { .append = protobuf_fd_buffer_append },
+					.fd = fd,
+					.failed = false,
+					.len = 0 };
+
+	uint32_t header = htonl(buflen);
+	protobuf_fd_buffer_append(&buffer.base, sizeof(header), (uint8_t *)&header);
+	size_t packed_len = protobuf_c_message_pack_to_buffer(message, &buffer.base);
+	ASSERT(packed_len == buflen);
+	protobuf_fd_buffer_flush(&buffer);
+
+	if (buffer.failed) {
+		DEBUG_ERRNO("Failed to write binary protobuf message to fd %d.", fd);
+		return -1;
+	}
+
+	TRACE("sent streamed protobuf message (len=%u)", buflen);
+	PROBE2(protobuf_send, fd, buflen);
+	return buflen;
+}
+
 ssize_t
 protobuf_send_message(int fd, const ProtobufCMessage *message)
 {
 	ASSERT(message);
 
-	uint8_t *buf = NULL;
-	uint32_t buflen = protobuf_pack_message_new(message, &buf);
-
+	size_t buflen = protobuf_c_message_get_packed_size(message);
 	if (!(buflen < PROTOBUF_MAX_MESSAGE_SIZE)) {
 		ERROR("Packed message exceeds PROTOBUF_MAX_MESSAGE_SIZE");
-		if (buf)
-			mem_free0(buf);
-
 		return -1;
 	}
 
-	if (-1 == protobuf_send_message_packed(fd, buf, buflen)) {
-		ERROR_ERRNO("Failed to write packed protobuf message to fd %d.", fd);
-		mem_free0(buf);
-		return -1;
+	// packet based sockets need the whole message in one packet
+	if (buflen > PROTOBUF_SEND_STREAM_BUF_SIZE && !protobuf_fd_is_packet_based(fd)) {
+		ssize_t ret = protobuf_send_message_streamed(fd, message, buflen);
+		if (-1 == ret)
+			ERROR_ERRNO("Failed to write packed protobuf message to fd %d.", fd);
+		return ret;
 	}
 
-	mem_free0(buf);
+	// small messages are packed on the stack to save an allocation per message
+	uint8_t stack_buf[PROTOBUF_SEND_STACK_BUF_SIZE];
+	uint8_t *buf;
+	protobuf_pack_message(message, stack_buf, sizeof(stack_buf), &buf);
 
-	return buflen;
+	ssize_t ret = protobuf_send_message_packed(fd, buf, buflen);
+	if (-1 == ret)
+		ERROR_ERRNO("Failed to write packed protobuf message to fd %d.", fd);
+
+	if (buf != stack_buf)
+		mem_free0(buf);
+
+	return ret == -1 ? -1 : (ssize_t)buflen;
 }
 
 uint8_t *
@@ -170,6 +332,7 @@ protobuf_recv_message_packed_new(int fd, ssize_t *ret_len)
 	// need good (generic?!) solution that interacts nicely with event handling!
 
 	*ret_len = bytes_read;
+	PROBE2(protobuf_recv, fd, buflen);
 
 	return buf;
 
@@ -202,6 +365,139 @@ protobuf_recv_message(int fd, const ProtobufCMessageDescriptor *descriptor)
 	return msg;
 }
 
+struct protobuf_reader {
+	int fd;
+	uint8_t *buf; // reused for all frames of this connection
+	size_t size;
+	size_t start; // begin of unconsumed data
+	size_t end;   // end of received data
+};
+
+protobuf_reader_t *
+protobuf_reader_new(int fd)
+{
+	protobuf_reader_t *reader = mem_new0(protobuf_reader_t, 1);
+	reader->fd = fd;
+	reader->size = PROTOBUF_READER_BUF_SIZE;
+	reader->buf = mem_alloc(reader->size);
+
+	return reader;
+}
+
+void
+protobuf_reader_free(protobuf_reader_t *reader)
+{
+	IF_NULL_RETURN(reader);
+
+	mem_free0(reader->buf);
+	mem_free0(reader);
+}
+
+int
+protobuf_reader_get_fd(const protobuf_reader_t *reader)
+{
+	ASSERT(reader);
+	return reader->fd;
+}
+
+/**
+ * Ensures that at least needed bytes fit into the buffer starting at the
+ * first unconsumed byte, moving pending data to the front or growing the
+ * buffer if necessary.
+ */
+static void
+protobuf_reader_reserve(protobuf_reader_t *reader, size_t needed)
+{
+	if (reader->size - reader->start >= needed)
+		return;
+
+	if (reader->start > 0) {
+		memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+		reader->end -= reader->start;
+		reader->start = 0;
+	}
+	if (reader->size < needed) {
+		reader->buf = mem_realloc(reader->buf, needed);
+		reader->size = needed;
+	}
+}
+
+int
+protobuf_reader_recv_message(protobuf_reader_t *reader,
+			     const ProtobufCMessageDescriptor *descriptor,
+			     ProtobufCMessage **message)
+{
+	ASSERT(reader);
+	ASSERT(descriptor);
+	ASSERT(message);
+
+	*message = NULL;
+
+	for (;;) {
+		size_t avail = reader->end - reader->start;
+		size_t frame_len = sizeof(uint32_t);
+
+		if (avail >= sizeof(uint32_t)) {
+			uint32_t len;
+			memcpy(&len, reader->buf + reader->start, sizeof(len));
+			len = ntohl(len);
+			if (!(len < PROTOBUF_MAX_MESSAGE_SIZE)) {
+				ERROR("Protocol violation on fd %d: message length %u too large",
+				      reader->fd, len);
+				return -1;
+			}
+			frame_len += len;
+
+			if (avail >= frame_len) {
+				// unpack directly from the receive buffer, no copy of the frame
+				*message = protobuf_c_message_unpack(descriptor, NULL, len,
+								     reader->buf + reader->start +
+									     sizeof(uint32_t));
+				reader->start += frame_len;
+				if (reader->start == reader->end) {
+					reader->start = reader->end = 0;
+					// release buffers grown by a single large frame
+					if (reader->size > PROTOBUF_READER_BUF_SIZE * 16) {
+						reader->size = PROTOBUF_READER_BUF_SIZE;
+						reader->buf =
+							mem_realloc(reader->buf, reader->size);
+					}
+				}
+				if (!*message) {
+					ERROR("Failed to unpack protobuf message from fd %d",
+					      reader->fd);
+					return -1;
+				}
+				PROBE2(protobuf_recv, reader->fd, len);
+				return 1;
+			}
+		}
+
+		protobuf_reader_reserve(reader, frame_len);
+
+		ssize_t bytes_read =
+			read(reader->fd, reader->buf + reader->end, reader->size - reader->end);
+		if (bytes_read < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			DEBUG_ERRNO("Failed to read binary protobuf message from fd %d.",
+				    reader->fd);
+			return -1;
+		}
+		if (bytes_read == 0) {
+			DEBUG("client on fd %d closed connection.", reader->fd);
+			if (avail > 0)
+				WARN("Dropped incomplete protobuf message (%zu bytes) on fd %d",
+				     avail, reader->fd);
+			return -1;
+		}
+		TRACE("read %zd bytes of protobuf data from fd %d", bytes_read, reader->fd);
+		reader->end += bytes_read;
+	}
+}
+
 ProtobufCMessage *
 protobuf_unpack_message(const ProtobufCMessageDescriptor *descriptor, uint8_t *buf,
 			uint32_t buf_len)
@@ -326,6 +622,137 @@ protobuf_message_new_from_buf(const uint8_t *buf, size_t buflen,
 	return msg;
 }
 
+struct protobuf_text_reader {
+	char *file;
+	char *map;
+	size_t size;
+	size_t off; // start of the next record
+	char *delim;
+	size_t delim_len;
+	const char *record; // last record returned by protobuf_text_reader_next()
+	size_t record_len;
+};
+
+protobuf_text_reader_t *
+protobuf_text_reader_new(const char *filename, const char *delimiter)
+{
+	ASSERT(filename);
+	ASSERT(delimiter);
+
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		WARN_ERRNO("Could not open file \"%s\" for reading.", filename);
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		WARN_ERRNO("Could not stat file \"%s\".", filename);
+		close(fd);
+		return NULL;
+	}
+
+	protobuf_text_reader_t *reader = mem_new0(protobuf_text_reader_t, 1);
+	reader->file = mem_strdup(filename);
+	reader->size = st.st_size;
+	reader->delim = mem_strdup(delimiter);
+	reader->delim_len = strlen(delimiter);
+
+	// an empty file cannot be mapped and simply has no records
+	if (reader->size > 0) {
+		reader->map = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (reader->map == MAP_FAILED) {
+			WARN_ERRNO("Could not map file \"%s\".", filename);
+			reader->map = NULL;
+			close(fd);
+			protobuf_text_reader_free(reader);
+			return NULL;
+		}
+		if (madvise(reader->map, reader->size, MADV_SEQUENTIAL))
+			DEBUG_ERRNO("madvise failed for \"%s\"", filename);
+	}
+	close(fd);
+	return reader;
+}
+
+void
+protobuf_text_reader_free(protobuf_text_reader_t *reader)
+{
+	IF_NULL_RETURN(reader);
+
+	if (reader->map)
+		munmap(reader->map, reader->size);
+	mem_free0(reader->delim);
+	mem_free0(reader->file);
+	mem_free0(reader);
+}
+
+/*
+ * Returns the offset of the next delimiter line at or after off, or the file size.
+ */
+static size_t
+protobuf_text_reader_find_delim(const protobuf_text_reader_t *reader, size_t off)
+{
+	while (off < reader->size) {
+		const char *line = reader->map + off;
+		size_t remain = reader->size - off;
+		if (remain >= reader->delim_len && !memcmp(line, reader->delim, reader->delim_len))
+			return off;
+		const char *nl = memchr(line, '\n', remain);
+		if (!nl)
+			break;
+		off += nl - line + 1;
+	}
+	return reader->size;
+}
+
+int
+protobuf_text_reader_next(protobuf_text_reader_t *reader,
+			  const ProtobufCMessageDescriptor *descriptor, ProtobufCMessage **message)
+{
+	ASSERT(reader);
+	ASSERT(descriptor);
+	ASSERT(message);
+
+	*message = NULL;
+	if (reader->off >= reader->size)
+		return 0;
+
+	size_t end = protobuf_text_reader_find_delim(reader, reader->off);
+	reader->record = reader->map + reader->off;
+	reader->record_len = end - reader->off;
+	reader->off = MIN(end + reader->delim_len, reader->size);
+
+	*message = protobuf_message_new_from_buf((const uint8_t *)reader->record,
+						 reader->record_len, descriptor);
+	if (!*message) {
+		WARN("Skipping unparsable record at offset %zu of file \"%s\".",
+		     (size_t)(reader->record - reader->map), reader->file);
+		return -1;
+	}
+	return 1;
+}
+
+const char *
+protobuf_text_reader_get_record(const protobuf_text_reader_t *reader, size_t *len)
+{
+	ASSERT(reader);
+	ASSERT(len);
+
+	*len = reader->record_len;
+	return reader->record;
+}
+
+char *
+protobuf_message_to_string_new(const ProtobufCMessage *message)
+{
+	ASSERT(message);
+
+	char *string = protobuf_c_text_to_string((ProtobufCMessage *)message, NULL);
+	if (!string)
+		ERROR("Failed to serialize text protobuf message to string.");
+	return string;
+}
+
 ssize_t
 protobuf_message_write_to_file(const char *filename, ProtobufCMessage *message)
 {
@@ -338,7 +765,7 @@ protobuf_message_write_to_file(const char *filename, ProtobufCMessage *message)
 		return -1;
 	}
 	size_t len = strlen(string);
-	int res = file_write(filename, string, len);
+	int res = file_write_atomic(filename, string, len);
 	free(string);
 	if (res < 0) {
 		ERROR("Failed to write serialized text protobuf message to file \"%s\".", filename);
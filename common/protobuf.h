@@ -37,6 +37,11 @@
 #include <sys/types.h>
 #include <stdbool.h>
 
+/**
+ * Upper bound (exclusive) for the length of a serialized message
+ */
+#define PROTOBUF_MAX_MESSAGE_SIZE (1024 * 1024)
+
 /**
  * Packs the given protobuf message struct
  * and returns it's binary serialized form.
@@ -50,11 +55,27 @@
 uint32_t
 protobuf_pack_message_new(const ProtobufCMessage *message, uint8_t **ptr);
 
+/**
+ * Packs the given protobuf message struct into the caller provided buffer buf, e.g. on
+ * the stack, if it fits, otherwise into a newly allocated buffer.
+ *
+ * @param message   the protobuf message struct to serialize
+ * @param buf       the buffer to be used for small messages
+ * @param buf_len   the size of buf
+ * @param ptr       the location to store a pointer to the serialized representation,
+ *                  which has to be freed by the caller if it is not buf
+ * @return          the length of the serialized message
+ */
+uint32_t
+protobuf_pack_message(const ProtobufCMessage *message, uint8_t *buf, size_t buf_len,
+		      uint8_t **ptr);
+
 /**
  * Writes the given, serialized protobuf message struct to the given file descriptor
  * (e.g. a file or socket).
  *
- * The serialized message is prefixed with the length of the actual data.
+ * The serialized message is prefixed with the length of the actual data. On stream
+ * sockets, length prefix and data are written with a single writev(2) call.
  *
  * @param fd        the file descriptor that the serialized message is written to
  * @param buf       the serialized protobuf message to write
@@ -104,6 +125,56 @@ protobuf_recv_message(int fd, const ProtobufCMessageDescriptor *descriptor);
 uint8_t *
 protobuf_recv_message_packed_new(int fd, ssize_t *msg_len);
 
+/**
+ * Non-blocking, length-prefixed message reader for a single stream connection.
+ *
+ * Received data is accumulated in a per-connection buffer which is reused for
+ * all frames, so partially received messages are completed across several
+ * event loop wakeups instead of blocking the caller.
+ */
+typedef struct protobuf_reader protobuf_reader_t;
+
+/**
+ * Creates a new reader for the given connected stream socket.
+ * The file descriptor should be in non-blocking mode and is not owned by the reader.
+ *
+ * @param fd        the file descriptor messages are read from
+ * @return          the new reader, release with protobuf_reader_free()
+ */
+protobuf_reader_t *
+protobuf_reader_new(int fd);
+
+/**
+ * Frees the given reader and any buffered data. Does not close its file descriptor.
+ */
+void
+protobuf_reader_free(protobuf_reader_t *reader);
+
+/**
+ * Returns the file descriptor the given reader reads from.
+ */
+int
+protobuf_reader_get_fd(const protobuf_reader_t *reader);
+
+/**
+ * Reads all currently available data from the reader's file descriptor without blocking
+ * and deserializes the next complete message as defined by the given message descriptor.
+ *
+ * Since several messages may be buffered after a single wakeup, callers should invoke
+ * this function repeatedly until it no longer returns 1.
+ *
+ * @param reader        the reader of the connection
+ * @param descriptor    the protobuf message descriptor that defines the message structure
+ * @param message       location to store the received message; must be released with
+ *                      protobuf_free_message()
+ * @return  1 if a message was stored in message, 0 if more data has to be received,
+ *          -1 on EOF, read or protocol error (the connection should be closed)
+ */
+int
+protobuf_reader_recv_message(protobuf_reader_t *reader,
+			     const ProtobufCMessageDescriptor *descriptor,
+			     ProtobufCMessage **message);
+
 /**
  * Unpacks the given, packed protobuf message
  *
@@ -164,8 +235,67 @@ ProtobufCMessage *
 protobuf_message_new_from_buf(const uint8_t *buf, size_t buflen,
 			      const ProtobufCMessageDescriptor *descriptor);
 
+/**
+ * Reader for text files holding several text protobuf messages separated by delimiter
+ * lines. The file is mapped into memory and the records are parsed one at a time,
+ * so only the record which is currently parsed is copied, regardless of the file size.
+ */
+typedef struct protobuf_text_reader protobuf_text_reader_t;
+
+/**
+ * Opens the given file for reading its records.
+ *
+ * @param filename      name of the text file containing the protobuf messages
+ * @param delimiter     the line separating two records including its newline, e.g. "---\n"
+ * @return  the new reader, release with protobuf_text_reader_free(); NULL on error
+ */
+protobuf_text_reader_t *
+protobuf_text_reader_new(const char *filename, const char *delimiter);
+
+/**
+ * Unmaps the file of the given reader and frees it.
+ */
+void
+protobuf_text_reader_free(protobuf_text_reader_t *reader);
+
+/**
+ * Parses the next record of the file as defined by the given descriptor.
+ *
+ * @param reader        the reader of the file
+ * @param descriptor    the protobuf message descriptor that defines the message structure
+ * @param message       location to store the parsed message; must be released with
+ *                      protobuf_free_message()
+ * @return  1 if a message was stored in message, 0 at the end of the file,
+ *          -1 if the record could not be parsed (the reader continues with the next one)
+ */
+int
+protobuf_text_reader_next(protobuf_text_reader_t *reader,
+			  const ProtobufCMessageDescriptor *descriptor, ProtobufCMessage **message);
+
+/**
+ * Returns the raw text of the record last returned by protobuf_text_reader_next(),
+ * e.g. to preserve a record which could not be parsed. The text is not null terminated
+ * and only valid until the reader is advanced or freed.
+ *
+ * @param reader        the reader of the file
+ * @param len           location to store the length of the record
+ * @return  the text of the record, NULL if no record was read yet
+ */
+const char *
+protobuf_text_reader_get_record(const protobuf_text_reader_t *reader, size_t *len);
+
+/**
+ * Serializes the given protobuf message to its textual representation.
+ *
+ * @param message   the protobuf message to be serialized
+ * @return          the newly allocated string or NULL on error
+ */
+char *
+protobuf_message_to_string_new(const ProtobufCMessage *message);
+
 /**
  * Writes a textual representation of the given protobuf message to the given file.
+ * The file is replaced atomically, see file_write_atomic().
  *
  * @param filename  name of the text file where to store the serialized protobuf message
  * @param message   the protobuf message to be serialized
@@ -0,0 +1,424 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "protobuf_writer.h"
+#include "protobuf.h"
+
+//#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
+#include "macro.h"
+#include "mem.h"
+#include "list.h"
+#include "event.h"
+#include "probe.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define PROTOBUF_WRITER_HIGH_WATERMARK_DEFAULT (256 * 1024)
+#define PROTOBUF_WRITER_MAX_PENDING (32 * 1024 * 1024)
+#define PROTOBUF_WRITER_IOV_MAX 16
+// messages up to this size are packed into the per-writer scratch buffer
+#define PROTOBUF_WRITER_SCRATCH_MIN 1024
+#define PROTOBUF_WRITER_SCRATCH_MAX (64 * 1024)
+
+typedef struct protobuf_writer_frame {
+	size_t len; // length prefix and serialized message
+	size_t off; // bytes already written
+	uint8_t data[];
+} protobuf_writer_frame_t;
+
+struct protobuf_writer {
+	int fd;
+	int event_fd; // dup of fd, since epoll allows only one registration per fd
+	bool packet_based;
+	bool coalescing; // writes are deferred to the write event
+	bool failed;
+	list_queue_t frames;
+	size_t pending;
+	size_t high_watermark;
+	bool congested;
+	protobuf_writer_watermark_cb_t cb;
+	void *data;
+	event_io_t *io; // registered while data is pending
+	uint8_t *scratch; // reused for messages which are written right away
+	size_t scratch_size;
+};
+
+static list_t *protobuf_writer_list = NULL;
+
+static void
+protobuf_writer_cb_write(int fd, unsigned events, event_io_t *io, void *data);
+
+protobuf_writer_t *
+protobuf_writer_new(int fd, size_t high_watermark, protobuf_writer_watermark_cb_t cb, void *data)
+{
+	int event_fd = dup(fd);
+	if (event_fd < 0) {
+		WARN_ERRNO("Failed to duplicate fd %d for outbound queue", fd);
+		return NULL;
+	}
+
+	protobuf_writer_t *writer = mem_new0(protobuf_writer_t, 1);
+	writer->fd = fd;
+	writer->event_fd = event_fd;
+	writer->high_watermark =
+		high_watermark ? high_watermark : PROTOBUF_WRITER_HIGH_WATERMARK_DEFAULT;
+	writer->cb = cb;
+	writer->data = data;
+
+	int type;
+	socklen_t len = sizeof(type);
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0)
+		writer->packet_based = (type == SOCK_SEQPACKET || type == SOCK_DGRAM);
+
+	protobuf_writer_list = list_append(protobuf_writer_list, writer);
+
+	return writer;
+}
+
+static void
+protobuf_writer_clear(protobuf_writer_t *writer)
+{
+	for (list_t *l = writer->frames.head; l; l = l->next)
+		mem_free0(l->data);
+	list_queue_delete(&writer->frames);
+	writer->pending = 0;
+}
+
+void
+protobuf_writer_free(protobuf_writer_t *writer)
+{
+	IF_NULL_RETURN(writer);
+
+	if (writer->pending)
+		DEBUG("Discarding %zu queued bytes for fd %d", writer->pending, writer->fd);
+
+	if (writer->io) {
+		event_remove_io(writer->io);
+		event_io_free(writer->io);
+	}
+	if (close(writer->event_fd) < 0)
+		WARN_ERRNO("Failed to close duplicated fd %d", writer->event_fd);
+
+	protobuf_writer_clear(writer);
+	protobuf_writer_list = list_remove(protobuf_writer_list, writer);
+	mem_free0(writer->scratch);
+	mem_free0(writer);
+}
+
+protobuf_writer_t *
+protobuf_writer_get_by_fd(int fd)
+{
+	for (list_t *l = protobuf_writer_list; l; l = l->next) {
+		protobuf_writer_t *writer = l->data;
+		if (writer->fd == fd)
+			return writer;
+	}
+	return NULL;
+}
+
+size_t
+protobuf_writer_get_pending(const protobuf_writer_t *writer)
+{
+	ASSERT(writer);
+	return writer->pending;
+}
+
+bool
+protobuf_writer_is_congested(const protobuf_writer_t *writer)
+{
+	ASSERT(writer);
+	return writer->congested;
+}
+
+void
+protobuf_writer_set_coalescing(protobuf_writer_t *writer, bool coalescing)
+{
+	ASSERT(writer);
+	writer->coalescing = coalescing;
+}
+
+/**
+ * Writes as much of the queued data as possible without blocking.
+ *
+ * @return 0 if the queue was drained or the socket would block, -1 on error
+ */
+static int
+protobuf_writer_flush(protobuf_writer_t *writer)
+{
+	while (writer->frames.head) {
+		struct iovec iov[PROTOBUF_WRITER_IOV_MAX];
+		int iovcnt = 0;
+
+		if (writer->packet_based) {
+			// length prefix and data are sent as separate packets,
+			// as done by protobuf_send_message_packed()
+			protobuf_writer_frame_t *frame = writer->frames.head->data;
+			size_t end = frame->off < sizeof(uint32_t) ? sizeof(uint32_t) : frame->len;
+			iov[0].iov_base = frame->data + frame->off;
+			iov[0].iov_len = end - frame->off;
+			iovcnt = 1;
+		} else {
+			for (list_t *l = writer->frames.head; l && iovcnt < PROTOBUF_WRITER_IOV_MAX;
+			     l = l->next, iovcnt++) {
+				protobuf_writer_frame_t *frame = l->data;
+				iov[iovcnt].iov_base = frame->data + frame->off;
+				iov[iovcnt].iov_len = frame->len - frame->off;
+			}
+		}
+
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+		ssize_t ret = sendmsg(writer->fd, &msg, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			DEBUG_ERRNO("Failed to write queued protobuf messages to fd %d",
+				    writer->fd);
+			return -1;
+		}
+		TRACE("Wrote %zd of %zu queued bytes to fd %d", ret, writer->pending, writer->fd);
+
+		writer->pending -= ret;
+		while (ret > 0) {
+			protobuf_writer_frame_t *frame = writer->frames.head->data;
+			size_t n = MIN((size_t)ret, frame->len - frame->off);
+			frame->off += n;
+			ret -= n;
+			if (frame->off == frame->len) {
+				list_queue_unlink(&writer->frames, writer->frames.head);
+				mem_free0(frame);
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * Registers or removes the write event depending on whether data is pending
+ * and notifies the watermark callback about state changes.
+ */
+static void
+protobuf_writer_update(protobuf_writer_t *writer)
+{
+	if (writer->pending && !writer->io) {
+		writer->io = event_io_new(writer->event_fd, EVENT_IO_WRITE,
+					  protobuf_writer_cb_write, writer);
+		event_add_io(writer->io);
+	} else if (!writer->pending && writer->io) {
+		event_remove_io(writer->io);
+		event_io_free(writer->io);
+		writer->io = NULL;
+	}
+
+	if (!writer->congested && writer->pending > writer->high_watermark) {
+		DEBUG("Outbound queue of fd %d exceeds high watermark (%zu bytes)", writer->fd,
+		      writer->pending);
+		writer->congested = true;
+		if (writer->cb)
+			writer->cb(writer, true, writer->data);
+	} else if (writer->congested && writer->pending <= writer->high_watermark / 2) {
+		DEBUG("Outbound queue of fd %d drained (%zu bytes)", writer->fd, writer->pending);
+		writer->congested = false;
+		if (writer->cb)
+			writer->cb(writer, false, writer->data);
+	}
+}
+
+/**
+ * Marks the connection as failed; queued and further messages are dropped.
+ */
+static void
+protobuf_writer_fail(protobuf_writer_t *writer)
+{
+	writer->failed = true;
+	protobuf_writer_clear(writer);
+}
+
+static void
+protobuf_writer_cb_write(UNUSED int fd, unsigned events, UNUSED event_io_t *io, void *data)
+{
+	protobuf_writer_t *writer = data;
+	ASSERT(writer);
+
+	if (events & EVENT_IO_EXCEPT) {
+		DEBUG("Connection on fd %d closed, dropping queued messages", writer->fd);
+		protobuf_writer_fail(writer);
+	} else if (protobuf_writer_flush(writer) < 0) {
+		protobuf_writer_fail(writer);
+	}
+
+	protobuf_writer_update(writer);
+}
+
+/**
+ * Allocates a frame for a serialized message of len bytes and fills in its length
+ * prefix. Returns NULL if the message must not be queued.
+ */
+static protobuf_writer_frame_t *
+protobuf_writer_frame_new(protobuf_writer_t *writer, size_t len)
+{
+	IF_TRUE_RETVAL_TRACE(writer->failed, NULL);
+
+	if (!(len < PROTOBUF_MAX_MESSAGE_SIZE)) {
+		ERROR("Packed message exceeds PROTOBUF_MAX_MESSAGE_SIZE");
+		return NULL;
+	}
+	if (writer->pending + len > PROTOBUF_WRITER_MAX_PENDING) {
+		WARN("Outbound queue of fd %d is full, dropping message", writer->fd);
+		return NULL;
+	}
+
+	protobuf_writer_frame_t *frame =
+		mem_alloc(sizeof(protobuf_writer_frame_t) + sizeof(uint32_t) + len);
+	frame->len = sizeof(uint32_t) + len;
+	frame->off = 0;
+	uint32_t header = htonl(len);
+	memcpy(frame->data, &header, sizeof(header));
+	return frame;
+}
+
+static ssize_t
+protobuf_writer_queue_frame(protobuf_writer_t *writer, protobuf_writer_frame_t *frame)
+{
+	size_t len = frame->len - sizeof(uint32_t);
+
+	// if older data is still pending, the write event takes care of it
+	bool flush = writer->frames.head == NULL && !writer->coalescing;
+	list_queue_append(&writer->frames, frame);
+	writer->pending += frame->len - frame->off;
+	PROBE3(protobuf_queue, writer->fd, len, writer->pending);
+
+	if (flush && protobuf_writer_flush(writer) < 0) {
+		protobuf_writer_fail(writer);
+		protobuf_writer_update(writer);
+		return -1;
+	}
+	protobuf_writer_update(writer);
+
+	return len;
+}
+
+/**
+ * Packs a message into the scratch buffer of an idle writer and writes it right away.
+ * Only the part which could not be written is copied into a queued frame, so the
+ * common case of a small message on a drained connection needs no allocation.
+ */
+static ssize_t
+protobuf_writer_send_scratch(protobuf_writer_t *writer, const ProtobufCMessage *message,
+			     size_t len)
+{
+	size_t total = sizeof(uint32_t) + len;
+	if (writer->scratch_size < total) {
+		writer->scratch_size = MAX(total, (size_t)PROTOBUF_WRITER_SCRATCH_MIN);
+		writer->scratch = mem_renew(uint8_t, writer->scratch, writer->scratch_size);
+	}
+
+	uint32_t header = htonl(len);
+	memcpy(writer->scratch, &header, sizeof(header));
+	protobuf_c_message_pack(message, writer->scratch + sizeof(header));
+
+	ssize_t ret;
+	do {
+		ret = send(writer->fd, writer->scratch, total, MSG_NOSIGNAL);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		DEBUG_ERRNO("Failed to write protobuf message to fd %d", writer->fd);
+		protobuf_writer_fail(writer);
+		protobuf_writer_update(writer);
+		return -1;
+	}
+	size_t written = ret < 0 ? 0 : ret;
+	TRACE("Wrote %zu of %zu bytes to fd %d", written, total, writer->fd);
+	if (written == total) {
+		PROBE3(protobuf_queue, writer->fd, len, writer->pending);
+		return len;
+	}
+
+	protobuf_writer_frame_t *frame = protobuf_writer_frame_new(writer, len);
+	IF_NULL_RETVAL(frame, -1);
+	memcpy(frame->data, writer->scratch, total);
+	frame->off = written;
+	return protobuf_writer_queue_frame(writer, frame);
+}
+
+ssize_t
+protobuf_writer_queue_message(protobuf_writer_t *writer, const ProtobufCMessage *message)
+{
+	ASSERT(writer);
+	ASSERT(message);
+
+	size_t len = protobuf_c_message_get_packed_size(message);
+
+	if (writer->frames.head == NULL && !writer->coalescing && !writer->packet_based &&
+	    !writer->failed && len <= PROTOBUF_WRITER_SCRATCH_MAX)
+		return protobuf_writer_send_scratch(writer, message, len);
+
+	protobuf_writer_frame_t *frame = protobuf_writer_frame_new(writer, len);
+	IF_NULL_RETVAL(frame, -1);
+
+	protobuf_c_message_pack(message, frame->data + sizeof(uint32_t));
+	return protobuf_writer_queue_frame(writer, frame);
+}
+
+ssize_t
+protobuf_writer_queue_packed(protobuf_writer_t *writer, const uint8_t *buf, size_t len)
+{
+	ASSERT(writer);
+	ASSERT(buf || len == 0);
+
+	protobuf_writer_frame_t *frame = protobuf_writer_frame_new(writer, len);
+	IF_NULL_RETVAL(frame, -1);
+
+	if (len)
+		memcpy(frame->data + sizeof(uint32_t), buf, len);
+	return protobuf_writer_queue_frame(writer, frame);
+}
+
+ssize_t
+protobuf_writer_send_message(int fd, const ProtobufCMessage *message)
+{
+	protobuf_writer_t *writer = protobuf_writer_get_by_fd(fd);
+
+	if (writer)
+		return protobuf_writer_queue_message(writer, message);
+
+	return protobuf_send_message(fd, message);
+}
+
+ssize_t
+protobuf_writer_send_packed(int fd, const uint8_t *buf, size_t len)
+{
+	protobuf_writer_t *writer = protobuf_writer_get_by_fd(fd);
+
+	if (writer)
+		return protobuf_writer_queue_packed(writer, buf, len);
+
+	IF_FALSE_RETVAL(len < PROTOBUF_MAX_MESSAGE_SIZE, -1);
+	return protobuf_send_message_packed(fd, buf, len);
+}
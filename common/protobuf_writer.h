@@ -0,0 +1,147 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file protobuf_writer.h
+ *
+ * Provides per-connection outbound queues for length-prefixed protobuf messages.
+ * Messages are queued instead of being written synchronously and are drained from
+ * the event loop whenever the socket becomes writable, so a slow peer no longer
+ * blocks the sender. An optional callback is notified when the queued data exceeds
+ * a high watermark and again once it has drained, which allows producers to apply
+ * backpressure.
+ */
+
+#ifndef PROTOBUF_WRITER_H
+#define PROTOBUF_WRITER_H
+
+#include <protobuf-c/protobuf-c.h>
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef struct protobuf_writer protobuf_writer_t;
+
+/**
+ * Called when the amount of queued data of a writer exceeds its high watermark
+ * (congested == true) and when it dropped to half of the high watermark again
+ * (congested == false).
+ */
+typedef void (*protobuf_writer_watermark_cb_t)(protobuf_writer_t *writer, bool congested,
+					       void *data);
+
+/**
+ * Creates a new outbound queue for the given connected socket and registers it,
+ * so that protobuf_writer_send_message() on fd uses the queue.
+ * The socket should be in non-blocking mode. The writer must be freed before
+ * the socket is closed.
+ *
+ * @param fd                the connected socket messages are written to
+ * @param high_watermark    number of queued bytes which triggers the callback,
+ *                          0 for the default
+ * @param cb                watermark callback, may be NULL
+ * @param data              data passed to the callback
+ * @return                  the new writer or NULL on error
+ */
+protobuf_writer_t *
+protobuf_writer_new(int fd, size_t high_watermark, protobuf_writer_watermark_cb_t cb, void *data);
+
+/**
+ * Unregisters and frees the given writer. Data which is still queued is discarded.
+ */
+void
+protobuf_writer_free(protobuf_writer_t *writer);
+
+/**
+ * Returns the writer registered for the given socket, or NULL if there is none.
+ */
+protobuf_writer_t *
+protobuf_writer_get_by_fd(int fd);
+
+/**
+ * Returns the number of bytes which are queued but not yet written.
+ */
+size_t
+protobuf_writer_get_pending(const protobuf_writer_t *writer);
+
+/**
+ * Returns true if more data than the high watermark is queued, i.e., producers
+ * should stop queueing further messages until the watermark callback signals
+ * that the queue has drained.
+ */
+bool
+protobuf_writer_is_congested(const protobuf_writer_t *writer);
+
+/**
+ * If coalescing is enabled, queued messages are not written right away but on the
+ * next writable event of the socket, together with all messages queued meanwhile.
+ * This trades a loop iteration of latency for fewer, larger writes, e.g., fewer
+ * segments on a remote connection. Disabled by default.
+ */
+void
+protobuf_writer_set_coalescing(protobuf_writer_t *writer, bool coalescing);
+
+/**
+ * Serializes the given message and queues it for transmission. As much data as
+ * possible is written immediately, the rest is written from the event loop.
+ *
+ * @param writer    the writer of the connection
+ * @param message   the protobuf message struct to serialize and write
+ * @return          the length of the serialized message (without length prefix) or -1
+ *                  if the connection failed or the hard queue limit is exceeded
+ */
+ssize_t
+protobuf_writer_queue_message(protobuf_writer_t *writer, const ProtobufCMessage *message);
+
+/**
+ * Same as protobuf_writer_queue_message(), but queues an already serialized message,
+ * e.g., one packed by a thread which must not touch the writer itself.
+ * @param writer    the writer of the connection
+ * @param buf       the serialized message
+ * @param len       the length of the serialized message
+ * @return          len or -1 if the connection failed or the hard queue limit is exceeded
+ */
+ssize_t
+protobuf_writer_queue_packed(protobuf_writer_t *writer, const uint8_t *buf, size_t len);
+
+/**
+ * Sends the given message over fd. If a writer is registered for fd, the message is
+ * queued with protobuf_writer_queue_message(), otherwise it is written synchronously
+ * with protobuf_send_message().
+ *
+ * @param fd        the file descriptor that the serialized message is written to
+ * @param message   the protobuf message struct to serialize and write
+ * @return          the length of the serialized message (without length prefix) or -1
+ */
+ssize_t
+protobuf_writer_send_message(int fd, const ProtobufCMessage *message);
+
+/**
+ * Sends the already serialized message in buf over fd, queued if a writer is
+ * registered for fd, otherwise synchronously with protobuf_send_message_packed().
+ * @return          len or -1 on error
+ */
+ssize_t
+protobuf_writer_send_packed(int fd, const uint8_t *buf, size_t len);
+
+#endif // PROTOBUF_WRITER_H
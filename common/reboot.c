@@ -28,6 +28,14 @@
 #else
 #include <unistd.h>
 #include <sys/reboot.h>
+#include <sys/syscall.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+#ifndef KEXEC_FILE_NO_INITRAMFS
+#define KEXEC_FILE_NO_INITRAMFS 0x00000004
 #endif
 
 int
@@ -48,8 +56,34 @@ reboot_reboot(int cmd)
 		res = android_reboot(ANDROID_RB_POWEROFF, 0, 0);
 #else
 		res = reboot(RB_POWER_OFF);
+#endif
+		break;
+	case KEXEC:
+#if defined(ANDROID) || !defined(RB_KEXEC)
+		errno = ENOSYS;
+#else
+		res = reboot(RB_KEXEC);
 #endif
 		break;
 	}
 	return res;
 }
+
+int
+reboot_kexec_load(int kernel_fd, int initrd_fd, const char *cmdline)
+{
+#if defined(ANDROID) || !defined(SYS_kexec_file_load)
+	(void)kernel_fd;
+	(void)initrd_fd;
+	(void)cmdline;
+	errno = ENOSYS;
+	return -1;
+#else
+	unsigned long flags = initrd_fd < 0 ? KEXEC_FILE_NO_INITRAMFS : 0;
+	// the length includes the terminating null byte
+	if (syscall(SYS_kexec_file_load, kernel_fd, initrd_fd, strlen(cmdline) + 1, cmdline,
+		    flags) < 0)
+		return -1;
+	return 0;
+#endif
+}
@@ -25,12 +25,13 @@
  * @file reboot.h
  *
  * Provides utility function to reboot and poweroff the machine.
+ * Rebooting by kexec skips the firmware, the kernel to boot has to be loaded before.
  */
 
 #ifndef REBOOT_H
 #define REBOOT_H
 
-enum command { REBOOT, POWER_OFF };
+enum command { REBOOT, POWER_OFF, KEXEC };
 
 /**
  * Reboots the system or performs a related action.
@@ -42,4 +43,16 @@ enum command { REBOOT, POWER_OFF };
 int
 reboot_reboot(int cmd);
 
+/**
+ * Loads the kernel (and initrd) to be booted by reboot_reboot(KEXEC) with kexec_file_load,
+ * which lets the running kernel verify and measure (IMA) both images.
+ *
+ * @param kernel_fd  the opened kernel image
+ * @param initrd_fd  the opened initrd, -1 for none
+ * @param cmdline  the kernel command line
+ * @return  0 on success, -1 on failure
+ */
+int
+reboot_kexec_load(int kernel_fd, int initrd_fd, const char *cmdline);
+
 #endif // REBOOT_H
@@ -0,0 +1,352 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "sampler.h"
+
+#include "macro.h"
+#include "mem.h"
+#include "list.h"
+#include "hashmap.h"
+#include "event.h"
+#include "file.h"
+#include "str.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+// frames recorded per sample, deeper stacks are cut off at their outermost frames
+#define SAMPLER_MAX_DEPTH 48
+// samples buffered between two drains of the event loop
+#define SAMPLER_SLOTS 512
+// ms between two drains of the slots
+#define SAMPLER_DRAIN_INTERVAL 200
+// distinct stacks per file, samples of further stacks are only counted
+#define SAMPLER_MAX_STACKS 4096
+// frames further away from the stack pointer are not followed
+#define SAMPLER_MAX_STACK_SPAN (8 * 1024 * 1024)
+// number of files kept including the current one
+#define SAMPLER_FILES 8
+
+enum {
+	SAMPLER_SLOT_FREE = 0,
+	SAMPLER_SLOT_WRITING,
+	SAMPLER_SLOT_READY,
+};
+
+typedef struct {
+	int state;
+	unsigned depth;
+	uintptr_t pcs[SAMPLER_MAX_DEPTH]; // innermost frame first
+} sampler_slot_t;
+
+typedef struct {
+	uint64_t count;
+	unsigned depth;
+	uintptr_t pcs[SAMPLER_MAX_DEPTH];
+} sampler_stack_t;
+
+/*
+ * The slots are allocated on the first start and never freed, since a signal
+ * handler on another thread might still write to them after stopping.
+ */
+static sampler_slot_t *sampler_slots = NULL;
+static unsigned sampler_next_slot = 0;
+static uint64_t sampler_dropped = 0;
+static pid_t sampler_pid = -1;
+
+static bool sampler_running = false;
+static char *sampler_path = NULL;
+static unsigned sampler_drains_per_write = 0;
+static unsigned sampler_drains = 0;
+static event_timer_t *sampler_timer = NULL;
+
+// samples aggregated since the last write
+static hashmap_t *sampler_stack_map = NULL;
+static list_t *sampler_stack_list = NULL;
+static uint64_t sampler_overflow = 0;
+
+/*
+ * Reads from the stack of the interrupted thread. Frame pointers may be garbage
+ * in code compiled without them, thus memory is read by a system call which fails
+ * on unmapped memory instead of faulting.
+ */
+static bool
+sampler_read(uintptr_t addr, void *buf, size_t len)
+{
+	struct iovec local = { .iov_base = buf, .iov_len = len };
+	struct iovec remote = { .iov_base = (void *)addr, .iov_len = len };
+	return process_vm_readv(sampler_pid, &local, 1, &remote, 1, 0) == (ssize_t)len;
+}
+
+static unsigned
+sampler_unwind(UNUSED const ucontext_t *uc, UNUSED uintptr_t *pcs, UNUSED unsigned max)
+{
+	uintptr_t pc, fp, sp;
+
+#if defined(__x86_64__)
+	pc = uc->uc_mcontext.gregs[REG_RIP];
+	fp = uc->uc_mcontext.gregs[REG_RBP];
+	sp = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+	pc = uc->uc_mcontext.pc;
+	fp = uc->uc_mcontext.regs[29];
+	sp = uc->uc_mcontext.sp;
+#else
+	return 0;
+#endif
+
+	unsigned n = 0;
+	pcs[n++] = pc;
+
+	// each frame starts with the frame pointer and return address of its caller
+	while (n < max && fp >= sp && fp - sp < SAMPLER_MAX_STACK_SPAN &&
+	       !(fp & (sizeof(uintptr_t) - 1))) {
+		uintptr_t frame[2];
+		if (!sampler_read(fp, frame, sizeof(frame)) || !frame[1])
+			break;
+		pcs[n++] = frame[1];
+		// the stack grows down, thus callers have higher frame addresses
+		if (frame[0] <= fp)
+			break;
+		fp = frame[0];
+	}
+	return n;
+}
+
+static void
+sampler_handler(UNUSED int signum, UNUSED siginfo_t *info, void *context)
+{
+	int saved_errno = errno;
+
+	unsigned i = __atomic_fetch_add(&sampler_next_slot, 1, __ATOMIC_RELAXED) % SAMPLER_SLOTS;
+	sampler_slot_t *slot = &sampler_slots[i];
+	int expected = SAMPLER_SLOT_FREE;
+
+	// the slot has not been drained yet, e.g., if the event loop is busy
+	if (!__atomic_compare_exchange_n(&slot->state, &expected, SAMPLER_SLOT_WRITING, false,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		__atomic_add_fetch(&sampler_dropped, 1, __ATOMIC_RELAXED);
+		errno = saved_errno;
+		return;
+	}
+
+	slot->depth = sampler_unwind(context, slot->pcs, SAMPLER_MAX_DEPTH);
+	__atomic_store_n(&slot->state, slot->depth ? SAMPLER_SLOT_READY : SAMPLER_SLOT_FREE,
+			 __ATOMIC_RELEASE);
+
+	errno = saved_errno;
+}
+
+static void
+sampler_drain(void)
+{
+	for (int i = 0; i < SAMPLER_SLOTS; i++) {
+		sampler_slot_t *slot = &sampler_slots[i];
+		if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != SAMPLER_SLOT_READY)
+			continue;
+
+		size_t key_len = slot->depth * sizeof(uintptr_t);
+		sampler_stack_t *stack = hashmap_get(sampler_stack_map, slot->pcs, key_len);
+		if (!stack && hashmap_size(sampler_stack_map) < SAMPLER_MAX_STACKS) {
+			stack = mem_new0(sampler_stack_t, 1);
+			stack->depth = slot->depth;
+			memcpy(stack->pcs, slot->pcs, key_len);
+			hashmap_put(sampler_stack_map, stack->pcs, key_len, stack);
+			sampler_stack_list = list_append(sampler_stack_list, stack);
+		}
+		if (stack)
+			stack->count++;
+		else
+			sampler_overflow++;
+
+		__atomic_store_n(&slot->state, SAMPLER_SLOT_FREE, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Appends the name of the function containing pc. Return addresses point behind
+ * the call, which may already be the next function, thus callers pass pc - 1.
+ */
+static void
+sampler_append_frame(str_t *out, uintptr_t pc)
+{
+	Dl_info info;
+
+	if (dladdr((void *)pc, &info) && info.dli_sname) {
+		str_append(out, info.dli_sname);
+	} else if (info.dli_fname && info.dli_fbase) {
+		const char *name = strrchr(info.dli_fname, '/');
+		str_append_printf(out, "%s+0x%" PRIxPTR, name ? name + 1 : info.dli_fname,
+				  pc - (uintptr_t)info.dli_fbase);
+	} else {
+		str_append_printf(out, "0x%" PRIxPTR, pc);
+	}
+}
+
+static void
+sampler_write(void)
+{
+	IF_TRUE_RETURN(!sampler_stack_list && !sampler_overflow);
+
+	str_t *out = str_new(NULL);
+	for (list_t *l = sampler_stack_list; l; l = l->next) {
+		sampler_stack_t *stack = l->data;
+		// outermost frame first
+		for (int i = stack->depth - 1; i >= 0; i--) {
+			sampler_append_frame(out, i ? stack->pcs[i] - 1 : stack->pcs[i]);
+			str_append(out, i ? ";" : "");
+		}
+		str_append_printf(out, " %" PRIu64 "\n", stack->count);
+		mem_free0(stack);
+	}
+	if (sampler_overflow)
+		str_append_printf(out, "[other stacks] %" PRIu64 "\n", sampler_overflow);
+
+	list_delete(sampler_stack_list);
+	sampler_stack_list = NULL;
+	hashmap_clear(sampler_stack_map);
+	sampler_overflow = 0;
+
+	for (int i = SAMPLER_FILES - 1; i > 0; i--) {
+		char *from = i > 1 ? mem_printf("%s.%d", sampler_path, i - 1) :
+				     mem_strdup(sampler_path);
+		char *to = mem_printf("%s.%d", sampler_path, i);
+		if (rename(from, to) < 0 && errno != ENOENT)
+			WARN_ERRNO("Could not rotate %s to %s", from, to);
+		mem_free0(from);
+		mem_free0(to);
+	}
+
+	if (file_write(sampler_path, str_buffer(out), str_length(out)) < 0)
+		WARN("Could not write samples to %s", sampler_path);
+	str_free(out, true);
+
+	uint64_t dropped = __atomic_exchange_n(&sampler_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped)
+		WARN("Dropped %" PRIu64 " samples, the event loop drained them too late", dropped);
+}
+
+static void
+sampler_cb_drain(UNUSED event_timer_t *timer, UNUSED void *data)
+{
+	sampler_drain();
+
+	if (++sampler_drains >= sampler_drains_per_write) {
+		sampler_drains = 0;
+		sampler_write();
+	}
+}
+
+static int
+sampler_set_timer(unsigned hz)
+{
+	struct itimerval it = { { 0, 0 }, { 0, 0 } };
+
+	if (hz) {
+		it.it_interval.tv_sec = 0;
+		it.it_interval.tv_usec = MAX(1000000 / hz, 1);
+		it.it_value = it.it_interval;
+	}
+	return setitimer(ITIMER_PROF, &it, NULL);
+}
+
+int
+sampler_start(const char *path, unsigned hz, unsigned interval)
+{
+	ASSERT(path);
+
+	IF_TRUE_RETVAL(sampler_running, -1);
+	IF_TRUE_RETVAL(hz == 0 || hz > 1000, -1);
+
+	if (!sampler_slots)
+		sampler_slots = mem_new0(sampler_slot_t, SAMPLER_SLOTS);
+	sampler_pid = getpid();
+
+	/*
+	 * The handler stays installed after stopping, since the default action of a
+	 * still pending SIGPROF would terminate the process.
+	 */
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = sampler_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, NULL) < 0) {
+		WARN_ERRNO("Could not install SIGPROF handler");
+		return -1;
+	}
+	if (sampler_set_timer(hz) < 0) {
+		WARN_ERRNO("Could not arm profiling timer");
+		return -1;
+	}
+
+	sampler_path = mem_strdup(path);
+	sampler_drains_per_write = MAX(interval * 1000 / SAMPLER_DRAIN_INTERVAL, 1);
+	sampler_drains = 0;
+	sampler_stack_map = hashmap_new();
+	sampler_timer = event_timer_new(SAMPLER_DRAIN_INTERVAL, EVENT_TIMER_REPEAT_FOREVER,
+					sampler_cb_drain, NULL);
+	event_add_timer(sampler_timer);
+	sampler_running = true;
+
+	INFO("Sampling profiler started with %u Hz, writing to %s every %u s", hz, path,
+	     interval);
+	return 0;
+}
+
+void
+sampler_stop(void)
+{
+	IF_FALSE_RETURN(sampler_running);
+
+	if (sampler_set_timer(0) < 0)
+		WARN_ERRNO("Could not disarm profiling timer");
+	sampler_drain();
+	sampler_write();
+
+	event_remove_timer(sampler_timer);
+	event_timer_free(sampler_timer);
+	sampler_timer = NULL;
+	hashmap_free(sampler_stack_map);
+	sampler_stack_map = NULL;
+	mem_free0(sampler_path);
+	sampler_running = false;
+
+	INFO("Sampling profiler stopped");
+}
+
+bool
+sampler_is_running(void)
+{
+	return sampler_running;
+}
@@ -0,0 +1,75 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file sampler.h
+ *
+ * A sampling profiler for the daemons, which can be enabled at runtime to catch
+ * intermittent CPU spikes on devices where no external profiler can be attached.
+ *
+ * While running, SIGPROF interrupts the process with the given frequency of its
+ * consumed CPU time. The signal handler unwinds the call stack of the interrupted
+ * thread along the frame pointers (only supported on x86_64 and aarch64) into
+ * preallocated slots. The event loop periodically aggregates the samples, and writes
+ * them in the folded format of flamegraph.pl, i.e., one line "outer;...;inner count"
+ * per distinct call stack, to a file which is rotated through a number of older files.
+ * Files are only written if samples were taken, so an idle process keeps the samples
+ * of its last spikes.
+ *
+ * Functions are named if they are exported (link with -rdynamic), otherwise they are
+ * given as binary+offset, which can be resolved with addr2line. Stacks are only
+ * complete if everything was compiled with -fno-omit-frame-pointer.
+ *
+ * The sampler must be started and stopped by the thread running the event loop.
+ */
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdbool.h>
+
+/**
+ * Starts the sampling profiler of the process.
+ *
+ * @param path The file the folded stacks are written to, which is rotated to
+ *		path.1, path.2, ...
+ * @param hz Samples per second of CPU time consumed by the process.
+ * @param interval Seconds between writing the samples taken meanwhile.
+ * @return 0 on success, -1 on error, e.g., if the sampler is already running.
+ */
+int
+sampler_start(const char *path, unsigned hz, unsigned interval);
+
+/**
+ * Stops the sampling profiler and writes the samples taken since the last write.
+ */
+void
+sampler_stop(void);
+
+/**
+ * Checks whether the sampling profiler is running.
+ */
+bool
+sampler_is_running(void);
+
+#endif /* SAMPLER_H */
@@ -0,0 +1,295 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "shm_ring.h"
+
+#include "macro.h"
+#include "mem.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// frames start at multiples of this, which keeps the length headers aligned
+#define SHM_RING_ALIGN 8
+// length header of the filler which marks the unused end of the ring before a wrap
+#define SHM_RING_WRAP UINT32_MAX
+
+#define SHM_RING_FRAME_SIZE(len)                                                                   \
+	(((size_t)(len) + sizeof(uint32_t) + SHM_RING_ALIGN - 1) & ~((size_t)SHM_RING_ALIGN - 1))
+
+/**
+ * Shared control block at the start of the mapping. Positions increase monotonically,
+ * the offset into the data area is the position modulo the ring size. Both live in
+ * separate cache lines to avoid false sharing between producer and consumer.
+ */
+typedef struct shm_ring_ctrl {
+	uint64_t head; // written by the consumer
+	uint8_t pad0[56];
+	uint64_t tail; // written by the producer
+	uint8_t pad1[56];
+} shm_ring_ctrl_t;
+
+struct shm_ring {
+	int mem_fd;
+	int doorbell_fd;
+	shm_ring_ctrl_t *ctrl;
+	uint8_t *data;
+	size_t size;
+	uint64_t pos;	   // private copy of tail (producer) or head (consumer)
+	uint32_t frame_len; // length of the frame returned by the last peek
+	bool broken;
+};
+
+static bool
+shm_ring_size_valid(size_t size)
+{
+	return size >= 2 * SHM_RING_ALIGN && size <= UINT32_MAX && !(size & (size - 1));
+}
+
+static int
+shm_ring_map(shm_ring_t *ring)
+{
+	ring->ctrl = mmap(NULL, sizeof(shm_ring_ctrl_t) + ring->size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, ring->mem_fd, 0);
+	if (ring->ctrl == MAP_FAILED) {
+		ring->ctrl = NULL;
+		ERROR_ERRNO("Failed to map shared memory ring");
+		return -1;
+	}
+	ring->data = (uint8_t *)(ring->ctrl + 1);
+	return 0;
+}
+
+shm_ring_t *
+shm_ring_new(size_t size)
+{
+	IF_FALSE_RETVAL(shm_ring_size_valid(size), NULL);
+
+	shm_ring_t *ring = mem_new0(shm_ring_t, 1);
+	ring->size = size;
+	ring->doorbell_fd = -1;
+
+	ring->mem_fd = memfd_create("shm_ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (ring->mem_fd < 0) {
+		ERROR_ERRNO("Failed to create memfd for shared memory ring");
+		goto error;
+	}
+	if (ftruncate(ring->mem_fd, sizeof(shm_ring_ctrl_t) + size) < 0) {
+		ERROR_ERRNO("Failed to resize shared memory ring");
+		goto error;
+	}
+	// the peer must not be able to shrink the file under our mapping (SIGBUS)
+	if (fcntl(ring->mem_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+		ERROR_ERRNO("Failed to seal shared memory ring");
+		goto error;
+	}
+	if (shm_ring_map(ring) < 0)
+		goto error;
+
+	ring->doorbell_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (ring->doorbell_fd < 0) {
+		ERROR_ERRNO("Failed to create doorbell for shared memory ring");
+		goto error;
+	}
+
+	return ring;
+
+error:
+	shm_ring_free(ring);
+	return NULL;
+}
+
+shm_ring_t *
+shm_ring_attach(int mem_fd, int doorbell_fd)
+{
+	shm_ring_t *ring = mem_new0(shm_ring_t, 1);
+	ring->mem_fd = mem_fd;
+	ring->doorbell_fd = doorbell_fd;
+
+	struct stat st;
+	if (fstat(mem_fd, &st) < 0) {
+		ERROR_ERRNO("Failed to stat shared memory ring");
+		goto error;
+	}
+	if (st.st_size <= (off_t)sizeof(shm_ring_ctrl_t) ||
+	    !shm_ring_size_valid(st.st_size - sizeof(shm_ring_ctrl_t))) {
+		ERROR("Shared memory ring has invalid size %zd", (ssize_t)st.st_size);
+		goto error;
+	}
+	ring->size = st.st_size - sizeof(shm_ring_ctrl_t);
+
+	if (shm_ring_map(ring) < 0)
+		goto error;
+	ring->pos = __atomic_load_n(&ring->ctrl->head, __ATOMIC_SEQ_CST);
+
+	return ring;
+
+error:
+	shm_ring_free(ring);
+	return NULL;
+}
+
+void
+shm_ring_free(shm_ring_t *ring)
+{
+	IF_NULL_RETURN(ring);
+
+	if (ring->ctrl)
+		munmap(ring->ctrl, sizeof(shm_ring_ctrl_t) + ring->size);
+	if (ring->mem_fd >= 0)
+		close(ring->mem_fd);
+	if (ring->doorbell_fd >= 0)
+		close(ring->doorbell_fd);
+	mem_free0(ring);
+}
+
+int
+shm_ring_get_mem_fd(const shm_ring_t *ring)
+{
+	ASSERT(ring);
+	return ring->mem_fd;
+}
+
+int
+shm_ring_get_doorbell_fd(const shm_ring_t *ring)
+{
+	ASSERT(ring);
+	return ring->doorbell_fd;
+}
+
+int
+shm_ring_write(shm_ring_t *ring, const uint8_t *buf, uint32_t len)
+{
+	ASSERT(ring);
+	ASSERT(buf || len == 0);
+
+	if (ring->broken) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	uint64_t tail = ring->pos;
+	uint64_t head = __atomic_load_n(&ring->ctrl->head, __ATOMIC_SEQ_CST);
+	// head is written by the peer, it must lie within the filled part of the ring
+	if (head > tail || tail - head > ring->size || head % SHM_RING_ALIGN) {
+		ERROR("Shared memory ring corrupted by consumer (head %" PRIu64 ", tail %" PRIu64
+		      ")",
+		      head, tail);
+		ring->broken = true;
+		errno = EBADMSG;
+		return -1;
+	}
+
+	size_t frame_size = SHM_RING_FRAME_SIZE(len);
+	size_t off = tail & (ring->size - 1);
+	size_t contig = ring->size - off;
+	size_t needed = frame_size > contig ? contig + frame_size : frame_size;
+	if (frame_size > ring->size / 2 || tail - head + needed > ring->size) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	if (frame_size > contig) {
+		*(uint32_t *)(ring->data + off) = SHM_RING_WRAP;
+		tail += contig;
+		off = 0;
+	}
+	*(uint32_t *)(ring->data + off) = len;
+	if (len)
+		memcpy(ring->data + off + sizeof(uint32_t), buf, len);
+	tail += frame_size;
+
+	// publish the frame, then check if the consumer had already drained the ring
+	__atomic_store_n(&ring->ctrl->tail, tail, __ATOMIC_SEQ_CST);
+	head = __atomic_load_n(&ring->ctrl->head, __ATOMIC_SEQ_CST);
+	if (head == ring->pos) {
+		uint64_t one = 1;
+		if (write(ring->doorbell_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			WARN_ERRNO("Failed to ring doorbell of shared memory ring");
+	}
+	ring->pos = tail;
+
+	return 0;
+}
+
+const uint8_t *
+shm_ring_peek(shm_ring_t *ring, uint32_t *len)
+{
+	ASSERT(ring);
+	ASSERT(len);
+
+	for (;;) {
+		uint64_t tail = __atomic_load_n(&ring->ctrl->tail, __ATOMIC_SEQ_CST);
+		while (ring->pos != tail) {
+			size_t off = ring->pos & (ring->size - 1);
+			uint32_t frame_len = *(uint32_t *)(ring->data + off);
+			if (frame_len == SHM_RING_WRAP) {
+				ring->pos += ring->size - off;
+				continue;
+			}
+			if (frame_len > ring->size - off - sizeof(uint32_t)) {
+				ERROR("Invalid frame length %u in shared memory ring", frame_len);
+				return NULL;
+			}
+			ring->frame_len = frame_len;
+			*len = frame_len;
+			return ring->data + off + sizeof(uint32_t);
+		}
+		// publish that the ring is drained, the producer rings the doorbell for
+		// frames written after this, earlier ones are caught by the check below
+		__atomic_store_n(&ring->ctrl->head, ring->pos, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ring->ctrl->tail, __ATOMIC_SEQ_CST) == ring->pos)
+			return NULL;
+	}
+}
+
+void
+shm_ring_consume(shm_ring_t *ring)
+{
+	ASSERT(ring);
+
+	ring->pos += SHM_RING_FRAME_SIZE(ring->frame_len);
+	ring->frame_len = 0;
+	__atomic_store_n(&ring->ctrl->head, ring->pos, __ATOMIC_SEQ_CST);
+}
+
+void
+shm_ring_clear_doorbell(shm_ring_t *ring)
+{
+	ASSERT(ring);
+
+	uint64_t count;
+	if (read(ring->doorbell_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		WARN_ERRNO("Failed to reset doorbell of shared memory ring");
+}
@@ -0,0 +1,114 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file shm_ring.h
+ *
+ * Single-producer single-consumer ring of variable sized frames in shared memory.
+ * The ring lives in a sealed memfd, which is handed to another process together
+ * with an eventfd used as doorbell, e.g., via sock_unix_send_fds(). The producer
+ * only rings the doorbell if the consumer has drained the ring, i.e., might be
+ * waiting for it, and the consumer processes frames in place. A frame therefore
+ * costs no syscall while the consumer is busy and no copy on the consumer side.
+ *
+ * The producer does not trust the consumer: the consumer position read from shared
+ * memory is validated before it is used and a corrupted ring refuses any further
+ * frames, so callers can fall back to another transport.
+ */
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct shm_ring shm_ring_t;
+
+/**
+ * Creates the producer side of a new ring.
+ *
+ * @param size capacity of the ring in bytes, must be a power of two
+ * @return the new ring or NULL on error
+ */
+shm_ring_t *
+shm_ring_new(size_t size);
+
+/**
+ * Creates the consumer side of a ring from the file descriptors of the producer.
+ * The ring takes ownership of both descriptors, also on error.
+ *
+ * @param mem_fd the memfd as returned by shm_ring_get_mem_fd() of the producer
+ * @param doorbell_fd the eventfd as returned by shm_ring_get_doorbell_fd()
+ * @return the new ring or NULL on error
+ */
+shm_ring_t *
+shm_ring_attach(int mem_fd, int doorbell_fd);
+
+/**
+ * Unmaps the ring and closes its file descriptors.
+ */
+void
+shm_ring_free(shm_ring_t *ring);
+
+int
+shm_ring_get_mem_fd(const shm_ring_t *ring);
+
+/**
+ * Returns the eventfd which becomes readable when the ring needs to be drained.
+ */
+int
+shm_ring_get_doorbell_fd(const shm_ring_t *ring);
+
+/**
+ * Appends a frame to the ring (producer only) and rings the doorbell if needed.
+ *
+ * @return 0 on success, -1 if the frame does not fit into the ring right now
+ *         (errno ENOSPC) or if the ring is corrupted (errno EBADMSG)
+ */
+int
+shm_ring_write(shm_ring_t *ring, const uint8_t *buf, uint32_t len);
+
+/**
+ * Returns the oldest frame of the ring (consumer only) without removing it.
+ * The frame stays valid until shm_ring_consume() is called.
+ *
+ * @param len pointer to store the length of the frame
+ * @return pointer to the frame inside the ring or NULL if the ring is empty
+ */
+const uint8_t *
+shm_ring_peek(shm_ring_t *ring, uint32_t *len);
+
+/**
+ * Removes the frame returned by the last shm_ring_peek() from the ring.
+ */
+void
+shm_ring_consume(shm_ring_t *ring);
+
+/**
+ * Resets the doorbell (consumer only). Must be called before the ring is drained
+ * with shm_ring_peek(), so that no wakeup for frames written meanwhile is lost.
+ */
+void
+shm_ring_clear_doorbell(shm_ring_t *ring);
+
+#endif /* SHM_RING_H */
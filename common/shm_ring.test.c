@@ -0,0 +1,129 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "shm_ring.h"
+#include "logf.h"
+#include "macro.h"
+
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TEST_RING_SIZE 256
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static bool
+doorbell_rung(shm_ring_t *ring)
+{
+	struct pollfd pfd = { .fd = shm_ring_get_doorbell_fd(ring), .events = POLLIN };
+	return poll(&pfd, 1, 0) == 1;
+}
+
+static MunitResult
+test_shm_ring_transfers_frames(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	shm_ring_t *producer = shm_ring_new(TEST_RING_SIZE);
+	munit_assert_not_null(producer);
+	shm_ring_t *consumer = shm_ring_attach(dup(shm_ring_get_mem_fd(producer)),
+					       dup(shm_ring_get_doorbell_fd(producer)));
+	munit_assert_not_null(consumer);
+
+	uint8_t buf[100];
+	uint32_t len;
+
+	munit_assert_null(shm_ring_peek(consumer, &len));
+
+	// frames wrap around the end of the ring several times
+	for (int i = 0; i < 16; i++) {
+		memset(buf, i, sizeof(buf));
+		munit_assert_int(shm_ring_write(producer, buf, sizeof(buf) - i), ==, 0);
+		munit_assert_int(shm_ring_write(producer, buf, i), ==, 0);
+
+		// writing to a drained ring rings the doorbell
+		munit_assert_true(doorbell_rung(consumer));
+		shm_ring_clear_doorbell(consumer);
+		munit_assert_false(doorbell_rung(consumer));
+
+		const uint8_t *frame = shm_ring_peek(consumer, &len);
+		munit_assert_not_null(frame);
+		munit_assert_uint32(len, ==, sizeof(buf) - i);
+		munit_assert_memory_equal(len, frame, buf);
+		shm_ring_consume(consumer);
+
+		frame = shm_ring_peek(consumer, &len);
+		munit_assert_not_null(frame);
+		munit_assert_uint32(len, ==, i);
+		munit_assert_memory_equal(len, frame, buf);
+		shm_ring_consume(consumer);
+
+		munit_assert_null(shm_ring_peek(consumer, &len));
+	}
+
+	// frames larger than half of the ring and a full ring are refused
+	munit_assert_int(shm_ring_write(producer, buf, TEST_RING_SIZE / 2), ==, -1);
+	int written = 0;
+	while (shm_ring_write(producer, buf, 20) == 0)
+		written++;
+	munit_assert_int(written, >, 0);
+	while (shm_ring_peek(consumer, &len)) {
+		shm_ring_consume(consumer);
+		written--;
+	}
+	munit_assert_int(written, ==, 0);
+
+	shm_ring_free(consumer);
+	shm_ring_free(producer);
+
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/frames are transferred",	/* name */
+		test_shm_ring_transfers_frames, /* test */
+		setup,				/* setup */
+		NULL,				/* tear_down */
+		MUNIT_TEST_OPTION_NONE,		/* options */
+		NULL				/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite shm_ring_suite = {
+	"/shm_ring",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
@@ -31,8 +31,10 @@
 #include <string.h>
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h> // inet_addr
 #include <netdb.h>
+#include <poll.h>
 
 #define MAKE_SOCKADDR_UN(addr, path)                                                               \
 	struct sockaddr_un addr = { .sun_family = AF_UNIX };                                       \
@@ -189,6 +191,20 @@ sock_inet_connect(int sock, const char *ip, int port)
 	return 0;
 }
 
+int
+sock_inet_set_keepalive(int sock, int idle, int intvl, int cnt)
+{
+	int on = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0 ||
+	    setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0 ||
+	    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl)) < 0 ||
+	    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt)) < 0) {
+		WARN_ERRNO("Failed to enable keepalive on socket %d", sock);
+		return -1;
+	}
+	return 0;
+}
+
 static int
 sock_inet_connect_addrinfo(struct addrinfo *addrinfo)
 {
@@ -279,3 +295,89 @@ sock_unix_get_peer_uid(int sock, uint32_t *peer_uid)
 	*peer_uid = ucred.uid;
 	return 0;
 }
+
+int
+sock_unix_send_fds(int sock, const int *fds, size_t n)
+{
+	IF_TRUE_RETVAL(n == 0 || n > SOCK_UNIX_MAX_FDS, -1);
+
+	char byte = 0;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	union {
+		char buf[CMSG_SPACE(SOCK_UNIX_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+
+	struct msghdr msg = { .msg_iov = &iov,
+			      .msg_iovlen = 1,
+			      .msg_control = control.buf,
+			      .msg_controllen = CMSG_SPACE(n * sizeof(int)) };
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+
+	ssize_t ret;
+	do {
+		ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	} while (ret < 0 && errno == EINTR);
+	if (ret != 1) {
+		WARN_ERRNO("Failed to pass file descriptors on socket %d", sock);
+		return -1;
+	}
+	return 0;
+}
+
+int
+sock_unix_recv_fds(int sock, int *fds, size_t n)
+{
+	IF_TRUE_RETVAL(n == 0 || n > SOCK_UNIX_MAX_FDS, -1);
+
+	char byte;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	union {
+		char buf[CMSG_SPACE(SOCK_UNIX_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+
+	struct msghdr msg = { .msg_iov = &iov,
+			      .msg_iovlen = 1,
+			      .msg_control = control.buf,
+			      .msg_controllen = sizeof(control.buf) };
+
+	ssize_t ret;
+	for (int waited = 0;; waited = 1) {
+		do {
+			ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+		} while (ret < 0 && errno == EINTR);
+		if (ret >= 0 || errno != EAGAIN || waited)
+			break;
+		struct pollfd pfd = { .fd = sock, .events = POLLIN };
+		poll(&pfd, 1, 1000);
+	}
+	if (ret != 1) {
+		WARN_ERRNO("Failed to receive file descriptors on socket %d", sock);
+		return -1;
+	}
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		WARN("Expected file descriptors on socket %d, got none", sock);
+		return -1;
+	}
+	int received_fds[SOCK_UNIX_MAX_FDS];
+	size_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	received = MIN(received, (size_t)SOCK_UNIX_MAX_FDS);
+	memcpy(received_fds, CMSG_DATA(cmsg), received * sizeof(int));
+	if (received != n || (msg.msg_flags & MSG_CTRUNC)) {
+		WARN("Expected %zu file descriptors on socket %d, got %zu", n, sock, received);
+		for (size_t i = 0; i < received; i++)
+			close(received_fds[i]);
+		return -1;
+	}
+	memcpy(fds, received_fds, n * sizeof(int));
+
+	return 0;
+}
@@ -172,6 +172,19 @@ sock_inet_create(int type);
 int
 sock_inet_connect(int sock, const char *ip, int port);
 
+/**
+ * Enables TCP keepalive probes on the given AF_INET stream socket, so that a dead
+ * peer or a silently dropped connection is detected after idle + intvl * cnt seconds.
+ *
+ * @param sock the AF_INET socket file descriptor
+ * @param idle seconds without traffic until the first probe is sent
+ * @param intvl seconds between unanswered probes
+ * @param cnt number of unanswered probes after which the connection is dropped
+ * @return 0 on success, -1 on error
+ */
+int
+sock_inet_set_keepalive(int sock, int idle, int intvl, int cnt);
+
 /**
  * Binds the given INET socket to the specified ip/port.
  * Note that this is currently IPv4 only.
@@ -223,4 +236,32 @@ sock_inet_create_and_connect(int type, const char *node, const char *service);
 int
 sock_unix_get_peer_uid(int sock, uint32_t *peer_uid);
 
+// max. number of file descriptors passed with one call of sock_unix_send_fds()
+#define SOCK_UNIX_MAX_FDS 8
+
+/**
+ * Passes file descriptors to the peer of a connected UNIX socket.
+ * They are transferred together with a single data byte, which the peer has to
+ * receive with sock_unix_recv_fds().
+ *
+ * @param sock		the connected UNIX socket file descriptor
+ * @param fds		the file descriptors to pass
+ * @param n		number of file descriptors, at most SOCK_UNIX_MAX_FDS
+ * @return		0 on success, -1 on error
+ */
+int
+sock_unix_send_fds(int sock, const int *fds, size_t n);
+
+/**
+ * Receives exactly n file descriptors sent with sock_unix_send_fds().
+ * On a non-blocking socket, this waits up to a second for them to arrive.
+ *
+ * @param sock		the connected UNIX socket file descriptor
+ * @param fds		array to store the received file descriptors
+ * @param n		number of expected file descriptors, at most SOCK_UNIX_MAX_FDS
+ * @return		0 on success, -1 on error
+ */
+int
+sock_unix_recv_fds(int sock, int *fds, size_t n);
+
 #endif // SOCK_H
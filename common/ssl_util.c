@@ -39,7 +39,13 @@
 #include <openssl/bio.h>
 #include <openssl/x509_vfy.h>
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 //#undef LOGF_LOG_MIN_PRIO
@@ -69,8 +75,8 @@
 #define RSA_KEY_SIZE_MKKEYP 4096
 
 #define RSA_KEY_EXPONENT RSA_F4
-/* Chunk size for reading sig-/hashfiles */
-#define SIGN_HASH_BUFFER_SIZE 4096
+/* Chunk size for hashing (image) files, a multiple of the page size */
+#define HASH_FILE_CHUNK_SIZE (1024 * 1024)
 
 /*** self provisioning flags and functions */
 #define TEST_C "DE"
@@ -98,10 +104,6 @@ static int
 ssl_add_ext_cert(X509 *cert, int nid, char *value);
 /*** self provisioning flags and functions */
 
-/* creates a public key pair */
-static EVP_PKEY *
-ssl_mkkeypair(rsa_padding_t key_type);
-
 /* creates a CSR of a public key. If tpmkey is set true, openssl-tpm-engine
  * is used to create the request with a TPM-bound key */
 static X509_REQ *
@@ -454,7 +456,7 @@ error:
 	return NULL;
 }
 
-static EVP_PKEY *
+EVP_PKEY *
 ssl_mkkeypair(rsa_padding_t key_type)
 {
 	//https://www.openssl.org/docs/man1.1.1/man3/EVP_PKEY_keygen_init.html
@@ -825,6 +827,90 @@ cb_verify_ignore_time(int ok, X509_STORE_CTX *ctx)
 	return ok;
 }
 
+/*
+ * Reads the certificate under test followed by its chain from bio.
+ */
+static int
+ssl_read_cert_chain_bio(BIO *bio, X509 **cert, STACK_OF(X509) * *chain)
+{
+	*cert = NULL;
+	*chain = NULL;
+
+	if (!PEM_read_bio_X509(bio, cert, 0, NULL)) {
+		ERROR("Failed to load cert from certificate under test");
+		return -1;
+	}
+
+	if (!(*chain = sk_X509_new_null())) {
+		ERROR("Error setting up certificate chain");
+		goto err;
+	}
+
+	X509 *chain_cert = NULL;
+	while (PEM_read_bio_X509(bio, &chain_cert, 0, NULL)) {
+		if (!sk_X509_push(*chain, chain_cert)) {
+			ERROR("Error reading next cert of the chain");
+			X509_free(chain_cert);
+			goto err;
+		}
+		chain_cert = NULL;
+	}
+	// reading stops with an error once the bio is exhausted
+	ERR_clear_error();
+
+	if (!sk_X509_num(*chain))
+		WARN("Certificate under test has no chain");
+	return 0;
+err:
+	sk_X509_pop_free(*chain, X509_free);
+	X509_free(*cert);
+	*cert = NULL;
+	*chain = NULL;
+	return -1;
+}
+
+/*
+ * Verifies cert with its chain against the trust anchors in store.
+ */
+static int
+ssl_verify_cert_chain(X509_STORE_CTX *context, X509_STORE *store, X509 *cert,
+		      STACK_OF(X509) * chain)
+{
+	int ret;
+
+	if (!X509_STORE_CTX_init(context, store, cert, chain)) {
+		ERROR("Error in certificate verification (init store_ctx)");
+		return -2;
+	}
+
+	int verify_ret = X509_verify_cert(context);
+	const char *verify_string =
+		X509_verify_cert_error_string(X509_STORE_CTX_get_error(context));
+
+	INFO("Verification return status: %s", verify_string);
+
+	if (verify_ret == 1) {
+		DEBUG("Certificate verification successful");
+		ret = 0;
+	} else {
+		if (verify_ret == 0) {
+			ret = -1;
+			ERROR("Certificate invalid");
+		} else {
+			ret = -2;
+			ERROR("Unexpected failure during certificate validation");
+		}
+
+		int store_ctx_error = X509_STORE_CTX_get_error(context);
+		int store_ctx_error_depth = X509_STORE_CTX_get_error_depth(context);
+		ERROR("Certificate is not valid, error #%d (%s) at cert chain depth: %d",
+		      store_ctx_error, verify_string, store_ctx_error_depth);
+	}
+
+	X509_STORE_CTX_cleanup(context);
+	return ret;
+}
+
 int
 ssl_verify_certificate(const char *test_cert_file, const char *root_cert_file, bool ignore_time)
 {
@@ -865,77 +951,279 @@ ssl_verify_certificate(const char *test_cert_file, const char *root_cert_file, b
 		goto end;
 	}
 
-	if (!PEM_read_bio_X509(stackbio, &test_cert, 0, NULL)) {
-		ERROR("Failed to load cert from certificate under test");
+	if (ssl_read_cert_chain_bio(stackbio, &test_cert, &chainstack) < 0) {
 		ret = -2;
 		goto end;
 	}
 
-	if (!(chainstack = sk_X509_new_null())) {
-		ERROR("Error setting up certificate chain");
-		ret = -2;
-		goto end;
-	}
+	ret = ssl_verify_cert_chain(context, store, test_cert, chainstack);
 
-	X509 *chain_cert = NULL;
-	while (PEM_read_bio_X509(stackbio, &chain_cert, 0, NULL)) {
-		if (!sk_X509_push(chainstack, chain_cert)) {
-			ERROR("Error reading next cert of the chain");
-			ret = -2;
-			goto end;
+end:
+	if (context != NULL)
+		X509_STORE_CTX_free(context);
+	if (store != NULL)
+		X509_STORE_free(store);
+	if (stackbio != NULL)
+		BIO_free(stackbio);
+	if (chainstack != NULL)
+		sk_X509_pop_free(chainstack, X509_free);
+	if (test_cert != NULL)
+		X509_free(test_cert);
+	return ret;
+}
+
+/******************************************************************************/
+
+/* Parsed certificates under test and their chains, indexed by the sha256 of their
+ * PEM data. Configs and images are usually signed with a few certificates only,
+ * thus a small cache replaced in LRU order suffices. Entries are handed out with
+ * own references, so that they can be replaced while still in use by another thread. */
+#define SSL_CERT_CACHE_SIZE 16
+
+typedef struct ssl_cert_cache_entry {
+	unsigned char sha256[SHA256_DIGEST_LENGTH];
+	X509 *cert;
+	STACK_OF(X509) * chain;
+	unsigned long last_use;
+} ssl_cert_cache_entry_t;
+
+static ssl_cert_cache_entry_t ssl_cert_cache[SSL_CERT_CACHE_SIZE];
+static unsigned long ssl_cert_cache_clock = 0;
+static pthread_mutex_t ssl_cert_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+ssl_cert_cache_get(const uint8_t *cert_buf, size_t cert_len, X509 **cert,
+		   STACK_OF(X509) * *chain)
+{
+	unsigned char sha256[SHA256_DIGEST_LENGTH];
+	IF_NULL_RETVAL(SHA256(cert_buf, cert_len, sha256), -1);
+
+	pthread_mutex_lock(&ssl_cert_cache_lock);
+	ssl_cert_cache_entry_t *entry = &ssl_cert_cache[0];
+	for (size_t i = 0; i < SSL_CERT_CACHE_SIZE; i++) {
+		ssl_cert_cache_entry_t *e = &ssl_cert_cache[i];
+		if (e->cert && !memcmp(e->sha256, sha256, sizeof(sha256))) {
+			e->last_use = ++ssl_cert_cache_clock;
+			X509_up_ref(e->cert);
+			*cert = e->cert;
+			*chain = X509_chain_up_ref(e->chain);
+			pthread_mutex_unlock(&ssl_cert_cache_lock);
+			return 0;
 		}
-		chain_cert = NULL;
+		if (e->last_use < entry->last_use)
+			entry = e;
 	}
+	pthread_mutex_unlock(&ssl_cert_cache_lock);
 
-	if (!sk_X509_num(chainstack))
-		WARN("Certificate under test has no chain");
+	BIO *mem = BIO_new_mem_buf(cert_buf, cert_len);
+	IF_NULL_RETVAL(mem, -1);
+	int ret = ssl_read_cert_chain_bio(mem, cert, chain);
+	BIO_free(mem);
+	IF_TRUE_RETVAL(ret < 0, -1);
 
-	if (!X509_STORE_CTX_init(context, store, test_cert, chainstack)) {
-		ERROR("Error in certificate verification (init store_ctx)");
-		ret = -2;
-		goto end;
+	// replace the least recently used entry
+	pthread_mutex_lock(&ssl_cert_cache_lock);
+	if (entry->cert) {
+		X509_free(entry->cert);
+		sk_X509_pop_free(entry->chain, X509_free);
 	}
+	memcpy(entry->sha256, sha256, sizeof(sha256));
+	X509_up_ref(*cert);
+	entry->cert = *cert;
+	entry->chain = X509_chain_up_ref(*chain);
+	entry->last_use = ++ssl_cert_cache_clock;
+	pthread_mutex_unlock(&ssl_cert_cache_lock);
 
-	int verify_ret = X509_verify_cert(context);
-	const char *verify_string =
-		X509_verify_cert_error_string(X509_STORE_CTX_get_error(context));
+	return 0;
+}
 
-	INFO("Verification return status: %s", verify_string);
+/* Results of certificate verifications with the current store of a context */
+#define SSL_VERIFY_CTX_RESULTS 16
+
+struct ssl_verify_ctx {
+	char *root_path;
+	bool ignore_time;
+	pthread_mutex_t lock;
+	X509_STORE *store; // NULL if the trust anchors could not be loaded
+	struct stat root_st;
+	bool loaded;
+	struct {
+		unsigned char sha256[SHA256_DIGEST_LENGTH];
+		int ret;
+	} results[SSL_VERIFY_CTX_RESULTS];
+	size_t results_len;
+	size_t results_next;
+};
+
+static X509_STORE *
+ssl_verify_ctx_load_store(const ssl_verify_ctx_t *ctx)
+{
+	X509_STORE *store = X509_STORE_new();
+	if (!store) {
+		ERROR("Error in certificate verification (setup store)");
+		return NULL;
+	}
+	if (ctx->ignore_time)
+		X509_STORE_set_verify_cb(store, cb_verify_ignore_time);
 
-	if (verify_ret == 1) {
-		DEBUG("Certificate verification successful");
-		ret = 0;
-	} else {
-		if (verify_ret == 0) {
-			ret = -1;
-			ERROR("Certificate invalid");
-		} else {
-			ret = -2;
-			ERROR("Unexpected failure during certificate validation");
+	if (!S_ISDIR(ctx->root_st.st_mode)) {
+		if (!X509_STORE_load_locations(store, ctx->root_path, NULL)) {
+			ERROR("Failed to load root CA %s", ctx->root_path);
+			goto err;
 		}
+		return store;
+	}
+
+	DIR *dir = opendir(ctx->root_path);
+	if (!dir) {
+		ERROR_ERRNO("Failed to open CA directory %s", ctx->root_path);
+		goto err;
+	}
+	int n = 0;
+	struct dirent *de;
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		char *file = mem_printf("%s/%s", ctx->root_path, de->d_name);
+		if (X509_STORE_load_locations(store, file, NULL))
+			n++;
+		else
+			ERROR("Failed to load CA %s", file);
+		mem_free0(file);
+	}
+	closedir(dir);
+	if (!n) {
+		DEBUG("No CA found in %s", ctx->root_path);
+		goto err;
+	}
+	return store;
+err:
+	ERR_clear_error();
+	X509_STORE_free(store);
+	return NULL;
+}
 
-		int store_ctx_error = X509_STORE_CTX_get_error(context);
-		int store_ctx_error_depth = X509_STORE_CTX_get_error_depth(context);
-		ERROR("Certificate is not valid, error #%d (%s) at cert chain depth: %d",
-		      store_ctx_error, verify_string, store_ctx_error_depth);
+/*
+ * Returns a reference to the store of ctx, which is reloaded first if the
+ * trust anchors changed. Must be called with ctx->lock held.
+ */
+static X509_STORE *
+ssl_verify_ctx_get_store(ssl_verify_ctx_t *ctx)
+{
+	struct stat st;
+	if (stat(ctx->root_path, &st) < 0)
+		memset(&st, 0, sizeof(st));
+
+	if (!ctx->loaded || st.st_ino != ctx->root_st.st_ino ||
+	    st.st_mtim.tv_sec != ctx->root_st.st_mtim.tv_sec ||
+	    st.st_mtim.tv_nsec != ctx->root_st.st_mtim.tv_nsec ||
+	    st.st_size != ctx->root_st.st_size) {
+		if (ctx->store)
+			X509_STORE_free(ctx->store);
+		ctx->root_st = st;
+		ctx->store = st.st_ino ? ssl_verify_ctx_load_store(ctx) : NULL;
+		ctx->loaded = true;
+		ctx->results_len = 0;
+		ctx->results_next = 0;
+		DEBUG("Loaded trust anchors from %s", ctx->root_path);
+	}
+
+	if (ctx->store)
+		X509_STORE_up_ref(ctx->store);
+	return ctx->store;
+}
+
+ssl_verify_ctx_t *
+ssl_verify_ctx_new(const char *root_path, bool ignore_time)
+{
+	ASSERT(root_path);
+
+	ssl_verify_ctx_t *ctx = mem_new0(ssl_verify_ctx_t, 1);
+	ctx->root_path = mem_strdup(root_path);
+	ctx->ignore_time = ignore_time;
+	pthread_mutex_init(&ctx->lock, NULL);
+	return ctx;
+}
+
+void
+ssl_verify_ctx_free(ssl_verify_ctx_t *ctx)
+{
+	IF_NULL_RETURN(ctx);
+
+	if (ctx->store)
+		X509_STORE_free(ctx->store);
+	pthread_mutex_destroy(&ctx->lock);
+	mem_free0(ctx->root_path);
+	mem_free0(ctx);
+}
+
+int
+ssl_verify_ctx_verify_certificate(ssl_verify_ctx_t *ctx, const uint8_t *cert_buf,
+				  size_t cert_len)
+{
+	ASSERT(ctx);
+	ASSERT(cert_buf);
+
+	unsigned char sha256[SHA256_DIGEST_LENGTH];
+	IF_NULL_RETVAL(SHA256(cert_buf, cert_len, sha256), -2);
+
+	pthread_mutex_lock(&ctx->lock);
+	X509_STORE *store = ssl_verify_ctx_get_store(ctx);
+	// without time checks, the result only depends on the certificate and the store
+	for (size_t i = 0; ctx->ignore_time && i < ctx->results_len; i++) {
+		if (!memcmp(ctx->results[i].sha256, sha256, sizeof(sha256))) {
+			int ret = ctx->results[i].ret;
+			pthread_mutex_unlock(&ctx->lock);
+			if (store)
+				X509_STORE_free(store);
+			TRACE("Using cached certificate verification result %d", ret);
+			return ret;
+		}
 	}
+	pthread_mutex_unlock(&ctx->lock);
 
-end:
-	if (context != NULL) {
-		X509_STORE_CTX_cleanup(context);
-		X509_STORE_CTX_free(context);
+	if (!store) {
+		ERROR("Failed to load root CA from %s", ctx->root_path);
+		return -2;
 	}
-	if (store != NULL)
-		X509_STORE_free(store);
-	if (stackbio != NULL)
-		BIO_free(stackbio);
-	if (chainstack != NULL)
-		sk_X509_pop_free(chainstack, X509_free);
-	if (test_cert != NULL)
-		X509_free(test_cert);
+
+	int ret = -2;
+	X509 *cert = NULL;
+	STACK_OF(X509) *chain = NULL;
+	X509_STORE_CTX *context = X509_STORE_CTX_new();
+	if (!context) {
+		ERROR("Error in certificate verification (setup store_ctx)");
+		goto out;
+	}
+	IF_TRUE_GOTO(ssl_cert_cache_get(cert_buf, cert_len, &cert, &chain) < 0, out);
+
+	ret = ssl_verify_cert_chain(context, store, cert, chain);
+
+	// errors are not cached, they do not tell anything about the certificate
+	if (ret != -2 && ctx->ignore_time) {
+		pthread_mutex_lock(&ctx->lock);
+		// the store might have been reloaded meanwhile
+		if (ctx->store == store) {
+			memcpy(ctx->results[ctx->results_next].sha256, sha256, sizeof(sha256));
+			ctx->results[ctx->results_next].ret = ret;
+			ctx->results_next = (ctx->results_next + 1) % SSL_VERIFY_CTX_RESULTS;
+			ctx->results_len = MIN(ctx->results_len + 1, SSL_VERIFY_CTX_RESULTS);
+		}
+		pthread_mutex_unlock(&ctx->lock);
+	}
+out:
+	if (context)
+		X509_STORE_CTX_free(context);
+	if (chain)
+		sk_X509_pop_free(chain, X509_free);
+	if (cert)
+		X509_free(cert);
+	X509_STORE_free(store);
 	return ret;
 }
 
+/******************************************************************************/
+
 static int
 ssl_set_pkey_ctx_rsa_pss(EVP_PKEY_CTX *ctx, const EVP_MD *hash_fct)
 {
@@ -980,23 +1268,51 @@ ssl_verify_signature_from_digest(const char *cert_buf, size_t cert_len, const ui
 	IF_FALSE_RETVAL_ERROR(0 < hash_len, -1);
 
 	int ret = 0;
-	X509 *cert;
-	EVP_PKEY *key = NULL;
-	BIO *mem;
-	EVP_PKEY_CTX *pkey_ctx = NULL;
+	EVP_PKEY *key = ssl_pubkey_from_cert_buf_new(cert_buf, cert_len);
 
-	// load certificate
-	mem = BIO_new(BIO_s_mem());
-	BIO_write(mem, cert_buf, cert_len);
-	cert = PEM_read_bio_X509(mem, NULL, 0, NULL);
-	BIO_free(mem);
-
-	if ((key = X509_get_pubkey(cert)) == NULL) {
+	if (key == NULL) {
 		ERROR("Error in signature verification (loading pubkey failed)");
-		ret = -2;
-		goto error;
+		return -2;
 	}
 
+	ret = ssl_verify_signature_from_digest_pkey(key, sig_buf, sig_len, hash, hash_len,
+						    digest_algo);
+
+	EVP_PKEY_free(key);
+	return ret;
+}
+
+EVP_PKEY *
+ssl_pubkey_from_cert_buf_new(const char *cert_buf, size_t cert_len)
+{
+	ASSERT(cert_buf);
+
+	X509 *cert;
+	STACK_OF(X509) *chain;
+
+	IF_TRUE_RETVAL(ssl_cert_cache_get((const uint8_t *)cert_buf, cert_len, &cert, &chain) < 0,
+		       NULL);
+
+	EVP_PKEY *key = X509_get_pubkey(cert);
+	X509_free(cert);
+	sk_X509_pop_free(chain, X509_free);
+	return key;
+}
+
+int
+ssl_verify_signature_from_digest_pkey(EVP_PKEY *key, const uint8_t *sig_buf, size_t sig_len,
+				      const uint8_t *hash, size_t hash_len, const char *digest_algo)
+{
+	ASSERT(key);
+	ASSERT(sig_buf);
+	ASSERT(hash);
+
+	IF_FALSE_RETVAL_ERROR(0 < sig_len, -1);
+	IF_FALSE_RETVAL_ERROR(0 < hash_len, -1);
+
+	int ret = 0;
+	EVP_PKEY_CTX *pkey_ctx = NULL;
+
 	TRACE("Verifying signature...");
 
 	if ((pkey_ctx = EVP_PKEY_CTX_new(key, NULL)) == NULL) {
@@ -1059,10 +1375,6 @@ ssl_verify_signature_from_digest(const char *cert_buf, size_t cert_len, const ui
 	}
 
 error:
-	if (cert)
-		X509_free(cert);
-	if (key)
-		EVP_PKEY_free(key);
 	if (pkey_ctx)
 		EVP_PKEY_CTX_free(pkey_ctx);
 	return ret;
@@ -1112,63 +1424,187 @@ error:
 	return ret;
 }
 
-unsigned char *
-ssl_hash_file(const char *file_to_hash, unsigned int *calc_len, const char *hash_algo)
+/*
+ * Returns a bitmap of the pages of [off, off + len) of fd which are already in the
+ * page cache, or NULL if residency can not be determined. The range is only mapped,
+ * never accessed, so this neither reads the file nor risks SIGBUS on truncation.
+ */
+static unsigned char *
+ssl_hash_file_resident_new(int fd, off_t off, size_t len, size_t page_size)
 {
-	ASSERT(file_to_hash);
-	ASSERT(hash_algo);
+	void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, off);
+	if (map == MAP_FAILED)
+		return NULL;
 
-	unsigned char *ret = NULL;
-	FILE *fp = NULL;
-	const EVP_MD *hash_fct;
-	EVP_MD_CTX *md_ctx = NULL;
+	unsigned char *vec = mem_alloc((len + page_size - 1) / page_size);
+	if (mincore(map, len, vec) < 0)
+		mem_free0(vec);
 
-	if (!(fp = fopen(file_to_hash, "rb"))) {
-		ERROR("Error in file hasing (opening hash file)");
-		return NULL;
-	}
+	munmap(map, len);
+	return vec;
+}
 
-	if ((hash_fct = EVP_get_digestbyname(hash_algo)) == NULL) {
-		ERROR("Error in file hasing (unable to initialize hash function");
-		fclose(fp);
-		return NULL;
+/*
+ * Drops the pages of [off, off + len) from the page cache which were not resident
+ * before we read them, so that hashing large images does not evict the working set
+ * of running containers, while pages they are using are kept.
+ */
+static void
+ssl_hash_file_drop_cache(int fd, off_t off, size_t len, const unsigned char *resident,
+			 size_t page_size)
+{
+	size_t pages = (len + page_size - 1) / page_size;
+
+	for (size_t i = 0; i < pages;) {
+		if (resident && (resident[i] & 1)) {
+			i++;
+			continue;
+		}
+		size_t run = i;
+		while (run < pages && !(resident && (resident[run] & 1)))
+			run++;
+		posix_fadvise(fd, off + i * page_size, (run - i) * page_size, POSIX_FADV_DONTNEED);
+		i = run;
 	}
+}
 
-	if ((md_ctx = EVP_MD_CTX_new()) == NULL) {
-		ERROR("Allocating EVP_MD failed!");
-		fclose(fp);
-		return NULL;
+/*
+ * Feeds the whole content of fd into the n digest contexts. The file is read in large
+ * chunks; while one chunk is hashed, the kernel already reads ahead the next one.
+ */
+static int
+ssl_hash_file_update(int fd, size_t n, EVP_MD_CTX **md_ctx)
+{
+	int ret = -1;
+	struct stat st;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+
+	if (regular)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	unsigned char *buffer = mem_alloc(HASH_FILE_CHUNK_SIZE);
+	for (off_t off = 0;; off += HASH_FILE_CHUNK_SIZE) {
+		unsigned char *resident = NULL;
+		if (regular) {
+			if (off >= st.st_size)
+				break;
+			size_t chunk = MIN(HASH_FILE_CHUNK_SIZE, st.st_size - off);
+			resident = ssl_hash_file_resident_new(fd, off, chunk, page_size);
+			// start reading the following chunk asynchronously
+			posix_fadvise(fd, off + HASH_FILE_CHUNK_SIZE, HASH_FILE_CHUNK_SIZE,
+				      POSIX_FADV_WILLNEED);
+		}
+
+		ssize_t len = 0;
+		while (len < HASH_FILE_CHUNK_SIZE) {
+			ssize_t r = read(fd, buffer + len, HASH_FILE_CHUNK_SIZE - len);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0) {
+				ERROR_ERRNO("Error in file hashing (reading file failed)");
+				mem_free0(resident);
+				goto out;
+			}
+			if (r == 0)
+				break;
+			len += r;
+		}
+		if (len == 0) {
+			mem_free0(resident);
+			break;
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			if (!EVP_DigestUpdate(md_ctx[i], buffer, len)) {
+				ERROR("Error in file hashing (reading/hashing file failed");
+				mem_free0(resident);
+				goto out;
+			}
+		}
+
+		if (regular)
+			ssl_hash_file_drop_cache(fd, off, len, resident, page_size);
+		mem_free0(resident);
 	}
+	ret = 0;
+out:
+	mem_free0(buffer);
+	return ret;
+}
 
-	EVP_DigestInit(md_ctx, hash_fct);
+int
+ssl_hash_file_multi(const char *file_to_hash, size_t n, const char *const *hash_algos,
+		    unsigned char **hashes, unsigned int *calc_lens)
+{
+	ASSERT(file_to_hash);
+	ASSERT(n > 0 && n <= SSL_HASH_FILE_MULTI_MAX);
+	ASSERT(hash_algos);
+	ASSERT(hashes);
+	ASSERT(calc_lens);
+
+	int ret = -1;
+	int fd = -1;
+	EVP_MD_CTX *md_ctx[SSL_HASH_FILE_MULTI_MAX] = { NULL };
 
-	int len = 0;
-	unsigned char buffer[SIGN_HASH_BUFFER_SIZE];
+	for (size_t i = 0; i < n; i++)
+		hashes[i] = NULL;
 
-	while ((len = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-		if (!EVP_DigestUpdate(md_ctx, buffer, len)) {
-			ERROR("Error in file hashing (reading/hashing file failed");
-			fclose(fp);
+	if ((fd = open(file_to_hash, O_RDONLY | O_CLOEXEC)) < 0) {
+		ERROR("Error in file hasing (opening hash file)");
+		return -1;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		const EVP_MD *hash_fct;
+		if ((hash_fct = EVP_get_digestbyname(hash_algos[i])) == NULL) {
+			ERROR("Error in file hasing (unable to initialize hash function");
+			goto error;
+		}
+		if ((md_ctx[i] = EVP_MD_CTX_new()) == NULL) {
+			ERROR("Allocating EVP_MD failed!");
 			goto error;
 		}
+		EVP_DigestInit(md_ctx[i], hash_fct);
 	}
-	fclose(fp);
 
-	ret = (unsigned char *)mem_alloc0(EVP_MAX_MD_SIZE);
-	if (EVP_DigestFinal(md_ctx, ret, calc_len) != 1) {
-		ERROR("Error in file hashing (computing hash)");
-		mem_free0(ret);
-		ret = NULL;
+	// read the file only once and feed every digest from the same buffer
+	if (ssl_hash_file_update(fd, n, md_ctx) < 0)
 		goto error;
+
+	for (size_t i = 0; i < n; i++) {
+		hashes[i] = (unsigned char *)mem_alloc0(EVP_MAX_MD_SIZE);
+		if (EVP_DigestFinal(md_ctx[i], hashes[i], &calc_lens[i]) != 1) {
+			ERROR("Error in file hashing (computing hash)");
+			goto error;
+		}
 	}
-	/* DEBUG OUTPUT
-	char *string = mem_alloc0(*calc_len*2+1);
-	for (unsigned int i = 0;  i < *calc_len;  i++) snprintf(string+2*i, 3, "%02x", ret[i]);
-	DEBUG("Calc hash: %s", string);
-	*/
+	ret = 0;
 
 error:
-	EVP_MD_CTX_free(md_ctx);
+	if (ret < 0) {
+		for (size_t i = 0; i < n; i++)
+			if (hashes[i])
+				mem_free0(hashes[i]);
+	}
+	for (size_t i = 0; i < n; i++)
+		if (md_ctx[i])
+			EVP_MD_CTX_free(md_ctx[i]);
+	close(fd);
+	return ret;
+}
+
+unsigned char *
+ssl_hash_file(const char *file_to_hash, unsigned int *calc_len, const char *hash_algo)
+{
+	ASSERT(file_to_hash);
+	ASSERT(hash_algo);
+
+	unsigned char *ret = NULL;
+
+	if (ssl_hash_file_multi(file_to_hash, 1, &hash_algo, &ret, calc_len) < 0)
+		return NULL;
+
 	return ret;
 }
 
@@ -1178,19 +1614,29 @@ ssl_create_pkcs12_token(const char *token_file, const char *cert_file, const cha
 {
 	ASSERT(token_file && passphrase);
 
+	EVP_PKEY *pkey = ssl_mkkeypair(rsa_padding);
+	if (NULL == pkey) {
+		ERROR("Error creating public-key pair");
+		return -1;
+	}
+
+	int ret = ssl_create_pkcs12_token_from_key(token_file, cert_file, passphrase, user_name,
+						   pkey);
+	EVP_PKEY_free(pkey);
+	return ret;
+}
+
+int
+ssl_create_pkcs12_token_from_key(const char *token_file, const char *cert_file,
+				 const char *passphrase, const char *user_name, EVP_PKEY *pkey)
+{
+	ASSERT(token_file && passphrase && pkey);
+
 	FILE *fp;
-	EVP_PKEY *pkey = NULL;
 	X509 *cert = NULL;
 	PKCS12 *p12 = NULL;
 	char *passphr = mem_strdup(passphrase);
 
-	pkey = ssl_mkkeypair(rsa_padding);
-
-	if (NULL == pkey) {
-		ERROR("Error creating public-key pair");
-		goto error;
-	}
-
 	if ((cert = ssl_mkcert(pkey, user_name)) == NULL) {
 		ERROR("Error creating certificate");
 		goto error;
@@ -1242,8 +1688,6 @@ ssl_create_pkcs12_token(const char *token_file, const char *cert_file, const cha
 	} else {
 		DEBUG("Stored softtoken");
 	}
-	DEBUG("EVP_PKEY_free %p", (void *)pkey);
-	EVP_PKEY_free(pkey);
 	DEBUG("X509_free %p", (void *)cert);
 	X509_free(cert);
 	DEBUG("PKCS12_free %p", (void *)p12);
@@ -1253,8 +1697,6 @@ ssl_create_pkcs12_token(const char *token_file, const char *cert_file, const cha
 	DEBUG("all free done");
 	return 0;
 error:
-	if (pkey)
-		EVP_PKEY_free(pkey);
 	if (cert)
 		X509_free(cert);
 	if (p12)
@@ -1678,19 +2120,10 @@ ssl_verify_signature_from_buf(uint8_t *cert_buf, size_t cert_len, const uint8_t
 
 	int ret = 0;
 
-	// certificate variables
-	X509 *cert;
-	BIO *mem;
-
-	// load certificate
-	mem = BIO_new(BIO_s_mem());
-	BIO_write(mem, cert_buf, cert_len);
-	cert = PEM_read_bio_X509(mem, NULL, 0, NULL);
-	BIO_free(mem);
-
 	DEBUG("Hash algo: %s", digest_algo);
 	unsigned int hash_len = 0;
 	unsigned char *hash = ssl_hash_buf(buf, buf_len, &hash_len, digest_algo);
+	IF_NULL_RETVAL(hash, -2);
 
 	if (0 > (ret = ssl_verify_signature_from_digest((char *)cert_buf, cert_len, sig_buf,
 							sig_len, hash, hash_len, digest_algo))) {
@@ -1701,9 +2134,7 @@ ssl_verify_signature_from_buf(uint8_t *cert_buf, size_t cert_len, const uint8_t
 	}
 
 error:
-	if (cert)
-		X509_free(cert);
-
+	mem_free0(hash);
 	return ret;
 }
 
@@ -96,6 +96,34 @@ ssl_unwrap_key_sym(const unsigned char *kek, const unsigned char *wrapped_key,
 int
 ssl_verify_certificate(const char *test_cert_file, const char *root_cert_file, bool ignore_time);
 
+typedef struct ssl_verify_ctx ssl_verify_ctx_t;
+
+/**
+ * Creates a reusable context for certificate verifications against the trust
+ * anchors in root_path, which is either a single (PEM) CA file or a directory
+ * of CA files. The trust anchors are loaded on first use and reloaded whenever
+ * root_path changes. The context may be used from multiple threads.
+ * The parameter ignore_time has the same meaning as for ssl_verify_certificate.
+ */
+ssl_verify_ctx_t *
+ssl_verify_ctx_new(const char *root_path, bool ignore_time);
+
+/**
+ * Frees a context created by ssl_verify_ctx_new.
+ */
+void
+ssl_verify_ctx_free(ssl_verify_ctx_t *ctx);
+
+/**
+ * Verifies the certificate (followed by its chain) in the PEM buffer cert_buf
+ * against the trust anchors of ctx.
+ * @return Returns 0 on success, -1 if the verification failed and -2 in case of
+ * an unexpected verification error, e.g. if no trust anchor could be loaded.
+ */
+int
+ssl_verify_ctx_verify_certificate(ssl_verify_ctx_t *ctx, const uint8_t *cert_buf,
+				  size_t cert_len);
+
 /**
  * verifies a signature stored in signed_file with a certificate stored in cert_file. Thereby, the original
  * file located in signature_file is hashed with the hash algorithm hash_algo.
@@ -129,6 +157,24 @@ ssl_verify_signature_from_digest(const char *cert_buf, size_t cert_len, const ui
 				 size_t sig_len, const uint8_t *hash, size_t hash_len,
 				 const char *digest_algo);
 
+/**
+ * Same as ssl_verify_signature_from_digest, but takes the already loaded public key
+ * of the certificate, e.g., to verify many signatures without reparsing the certificate.
+ * @return Returns 0 on success, -1 if the verification failed and -2 in case of
+ * an unexpected verification error.
+ */
+int
+ssl_verify_signature_from_digest_pkey(EVP_PKEY *key, const uint8_t *sig_buf, size_t sig_len,
+				      const uint8_t *hash, size_t hash_len,
+				      const char *digest_algo);
+
+/**
+ * Loads the public key of the PEM certificate stored in cert_buf.
+ * @return The public key which has to be freed with EVP_PKEY_free, NULL on error
+ */
+EVP_PKEY *
+ssl_pubkey_from_cert_buf_new(const char *cert_buf, size_t cert_len);
+
 /**
  * The file located in file_to_hash is hashed with the hash algorithm hash_algo.
  * @return The function reveals the hash  as return value and its length via the parameter calc_len.
@@ -137,6 +183,22 @@ ssl_verify_signature_from_digest(const char *cert_buf, size_t cert_len, const ui
 unsigned char *
 ssl_hash_file(const char *file_to_hash, unsigned int *calc_len, const char *hash_algo);
 
+/**
+ * Maximum number of hash algorithms accepted by ssl_hash_file_multi.
+ */
+#define SSL_HASH_FILE_MULTI_MAX 4
+
+/**
+ * The file located in file_to_hash is hashed with all n hash algorithms given in
+ * hash_algos in a single pass over the file.
+ * On success, hashes[i] points to a newly allocated buffer with the hash for
+ * hash_algos[i] and calc_lens[i] holds its length. On failure, all hashes[i] are NULL.
+ * @return 0 on success, -1 otherwise.
+ */
+int
+ssl_hash_file_multi(const char *file_to_hash, size_t n, const char *const *hash_algos,
+		    unsigned char **hashes, unsigned int *calc_lens);
+
 /**
  * creates a pkcs 12 softtoken located in the file token_file, locked with the password passphrase.
  * The corresponding (currently) self-signed certificate is stored in the file cert_file, if specified
@@ -145,6 +207,22 @@ int
 ssl_create_pkcs12_token(const char *token_file, const char *cert_file, const char *passphrase,
 			const char *user_name, rsa_padding_t rsa_padding);
 
+/**
+ * Like ssl_create_pkcs12_token(), but for a key pair generated beforehand, e.g., by
+ * ssl_mkkeypair(). The key pair is not freed.
+ */
+int
+ssl_create_pkcs12_token_from_key(const char *token_file, const char *cert_file,
+				 const char *passphrase, const char *user_name, EVP_PKEY *pkey);
+
+/**
+ * Generates a new RSA key pair for the given padding scheme, which may take seconds
+ * on slow devices. It may be called from a worker thread.
+ * @return the key pair, NULL on failure
+ */
+EVP_PKEY *
+ssl_mkkeypair(rsa_padding_t key_type);
+
 /**
  * changes the passwphrase/pin of a pkcs 12 softtoken located in the file token_file,
  * locked with the old password oldpass. If oldpass is correct token will be unlocked,
@@ -132,6 +132,37 @@ test_ssl_create_pkcs12_token_ssa(UNUSED const MunitParameter params[], UNUSED vo
 	return MUNIT_OK;
 }
 
+static UNUSED MunitResult
+test_ssl_create_pkcs12_token_from_key(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	EVP_PKEY *pkey = NULL;
+	X509 *cert = NULL;
+	STACK_OF(X509) *ca = NULL;
+
+	unlink("tmptoken_key.p12");
+
+	EVP_PKEY *gen_key = ssl_mkkeypair(RSA_SSA_PADDING);
+	munit_assert(NULL != gen_key);
+
+	int ret = ssl_create_pkcs12_token_from_key("tmptoken_key.p12", NULL, "trustme",
+						   "testuser", gen_key);
+	munit_assert(0 == ret);
+
+	// the token has to contain the given key, which is still owned by the caller
+	ret = ssl_read_pkcs12_token("tmptoken_key.p12", "trustme", &pkey, &cert, &ca);
+	munit_assert(0 == ret);
+	munit_assert(1 == EVP_PKEY_eq(gen_key, pkey));
+
+	unlink("tmptoken_key.p12");
+
+	EVP_PKEY_free(gen_key);
+	EVP_PKEY_free(pkey);
+	X509_free(cert);
+	sk_X509_pop_free(ca, X509_free);
+
+	return MUNIT_OK;
+}
+
 static UNUSED MunitResult
 test_ssl_create_pkcs12_token_pss(UNUSED const MunitParameter params[], UNUSED void *data)
 {
@@ -758,6 +789,86 @@ test_ssl_verify_signature_from_digest_ssa_ssacert_sha512(UNUSED const MunitParam
 	return MUNIT_OK;
 }
 
+static MunitResult
+test_ssl_hash_file_multi(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	char file[] = "/tmp/ssl_hash_file_multi.XXXXXX";
+	int fd = mkstemp(file);
+	munit_assert(fd >= 0);
+	close(fd);
+
+	// spans several read buffers and ends with a partial one
+	size_t len = 2 * 1024 * 1024 + 123;
+	char *buf = mem_alloc(len);
+	for (size_t i = 0; i < len; i++)
+		buf[i] = i * 7;
+	munit_assert(file_write(file, buf, len) == (ssize_t)len);
+
+	const char *algos[] = { "SHA1", "SHA256", "SHA512" };
+	unsigned char *hashes[3];
+	unsigned int lens[3];
+	munit_assert(0 == ssl_hash_file_multi(file, 3, algos, hashes, lens));
+
+	for (int i = 0; i < 3; i++) {
+		unsigned int single_len;
+		unsigned char *single = ssl_hash_file(file, &single_len, algos[i]);
+		munit_assert_not_null(single);
+		munit_assert_uint(single_len, ==, lens[i]);
+		munit_assert_memory_equal(single_len, single, hashes[i]);
+		mem_free0(single);
+		mem_free0(hashes[i]);
+	}
+
+	// all or nothing
+	const char *bad_algos[] = { "SHA256", "NOSUCHHASH" };
+	munit_assert(-1 == ssl_hash_file_multi(file, 2, bad_algos, hashes, lens));
+	munit_assert_null(hashes[0]);
+	munit_assert_null(hashes[1]);
+
+	unlink(file);
+	mem_free0(buf);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_ssl_verify_ctx(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	char *cert_buf = NULL;
+	off_t cert_len = file_size("testdata/testpki/ssig.cert");
+	munit_assert(cert_len > 0);
+	cert_buf = mem_alloc0(cert_len);
+	munit_assert(file_read("testdata/testpki/ssig.cert", cert_buf, cert_len) == cert_len);
+
+	ssl_verify_ctx_t *ctx = ssl_verify_ctx_new("testdata/testpki/ssig_rootca.cert", true);
+	munit_assert_not_null(ctx);
+	// the second verification is answered from the caches
+	for (int i = 0; i < 2; i++)
+		munit_assert_int(0, ==,
+				 ssl_verify_ctx_verify_certificate(ctx, (uint8_t *)cert_buf,
+								   cert_len));
+	munit_assert_int(0, ==,
+			 ssl_verify_certificate("testdata/testpki/ssig.cert",
+						"testdata/testpki/ssig_rootca.cert", true));
+	ssl_verify_ctx_free(ctx);
+
+	// signed by another CA
+	ctx = ssl_verify_ctx_new("testdata/testpki/user_subca.cert", true);
+	munit_assert_int(-1, ==,
+			 ssl_verify_ctx_verify_certificate(ctx, (uint8_t *)cert_buf, cert_len));
+	ssl_verify_ctx_free(ctx);
+
+	// no trust anchors at all
+	ctx = ssl_verify_ctx_new("testdata/testpki/nonexistent", true);
+	munit_assert_int(-2, ==,
+			 ssl_verify_ctx_verify_certificate(ctx, (uint8_t *)cert_buf, cert_len));
+	ssl_verify_ctx_free(ctx);
+
+	mem_free0(cert_buf);
+
+	return MUNIT_OK;
+}
+
 static MunitTest tests[] = {
 	{ "test_ssl_verify_signature_from_buf_ssa_ssacert",
 	  test_ssl_verify_signature_from_buf_ssa_ssacert, setup, tear_down, MUNIT_TEST_OPTION_NONE,
@@ -815,6 +926,9 @@ static MunitTest tests[] = {
 	{ "ssl_verify_signature_from_digest sigssa_ssacert_sha512",
 	  test_ssl_verify_signature_from_digest_ssa_ssacert_sha512, setup, tear_down,
 	  MUNIT_TEST_OPTION_NONE, NULL },
+	{ "ssl_hash_file_multi", test_ssl_hash_file_multi, setup, tear_down, MUNIT_TEST_OPTION_NONE,
+	  NULL },
+	{ "ssl_verify_ctx", test_ssl_verify_ctx, setup, tear_down, MUNIT_TEST_OPTION_NONE, NULL },
 	{ "ssl_create_csr_default", test_ssl_create_csr_openssl_default, setup, tear_down,
 	  MUNIT_TEST_OPTION_NONE, NULL },
 	{ "ssl_create_csr_pss", test_ssl_create_csr_pss, setup, tear_down, MUNIT_TEST_OPTION_NONE,
@@ -827,6 +941,8 @@ static MunitTest tests[] = {
 	  MUNIT_TEST_OPTION_NONE, NULL },
 	{ "test_ssl_create_pkcs12_token_pss", test_ssl_create_pkcs12_token_pss, setup, tear_down,
 	  MUNIT_TEST_OPTION_NONE, NULL },
+	{ "test_ssl_create_pkcs12_token_from_key", test_ssl_create_pkcs12_token_from_key, setup,
+	  tear_down, MUNIT_TEST_OPTION_NONE, NULL },
 	// Mark the end of the array with an entry where the test function is NULL
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
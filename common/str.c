@@ -30,12 +30,13 @@
 #include "mem.h"
 #include "macro.h"
 
-struct str {
-	char *buf;
-	ssize_t len;
-	size_t allocated_len;
-};
+// smallest buffer allocated when a string grows
+#define STR_MIN_GROW 16
 
+/*
+ * Makes room for len more characters and the terminating null byte. The buffer
+ * grows geometrically, so that appending n characters piecewise takes O(n).
+ */
 static void
 str_expand(str_t *str, size_t len)
 {
@@ -44,18 +45,43 @@ str_expand(str_t *str, size_t len)
 	if (str->len + len < str->allocated_len)
 		return;
 
-	str->allocated_len = str->len + len + 1;
-	str->buf = mem_realloc(str->buf, str->allocated_len);
+	size_t needed = str->len + len + 1;
+	size_t allocated_len = MAX(MAX(str->allocated_len * 2, needed), STR_MIN_GROW);
+
+	if (str->buf_on_stack) {
+		char *buf = mem_alloc(allocated_len);
+		memcpy(buf, str->buf, str->len + 1);
+		str->buf = buf;
+		str->buf_on_stack = false;
+	} else {
+		str->buf = mem_realloc(str->buf, allocated_len);
+	}
+	str->allocated_len = allocated_len;
 }
 
+/*
+ * Formats directly into the spare capacity, and only formats a second time if
+ * the result did not fit.
+ */
 static void
 str_append_printf_internal(str_t *str, const char *fmt, va_list ap)
 {
-	char *buf;
+	va_list ap_retry;
 
-	buf = mem_vprintf(fmt, ap);
-	str_insert_len(str, -1, buf, -1);
-	mem_free0(buf);
+	IF_NULL_RETURN(str);
+
+	va_copy(ap_retry, ap);
+	size_t avail = str->allocated_len - str->len;
+	int len = vsnprintf(str->buf + str->len, avail, fmt, ap);
+	ASSERT(len >= 0);
+
+	if ((size_t)len >= avail) {
+		str_expand(str, len);
+		ASSERT(vsnprintf(str->buf + str->len, (size_t)len + 1, fmt, ap_retry) == len);
+	}
+	va_end(ap_retry);
+
+	str->len += len;
 }
 
 str_t *
@@ -85,6 +111,8 @@ str_new_len(size_t len)
 	str->allocated_len = 0;
 	str->len = 0;
 	str->buf = NULL;
+	str->on_stack = false;
+	str->buf_on_stack = false;
 
 	str_expand(str, MAX(len, 2));
 	str->buf[0] = 0;
@@ -92,6 +120,25 @@ str_new_len(size_t len)
 	return str;
 }
 
+str_t *
+str_init_stack(str_stack_t *stack, const char *init)
+{
+	ASSERT(stack);
+
+	str_t *str = &stack->str;
+	str->buf = stack->buf;
+	str->len = 0;
+	str->allocated_len = sizeof(stack->buf);
+	str->on_stack = true;
+	str->buf_on_stack = true;
+	str->buf[0] = 0;
+
+	if (init)
+		str_append(str, init);
+
+	return str;
+}
+
 str_t *
 str_new_printf(const char *fmt, ...)
 {
@@ -252,13 +299,18 @@ str_free(str_t *str, bool free_buf)
 	IF_NULL_RETVAL(str, NULL);
 
 	if (free_buf) {
-		mem_free0(str->buf);
+		if (!str->buf_on_stack)
+			mem_free0(str->buf);
 		buf = NULL;
+	} else if (str->buf_on_stack) {
+		// the buffer does not outlive the caller's stack frame
+		buf = mem_strndup(str->buf, str->len);
 	} else {
 		buf = str->buf;
 	}
 
-	mem_free0(str);
+	if (!str->on_stack)
+		mem_free0(str);
 
 	return buf;
 }
@@ -266,12 +318,16 @@ str_free(str_t *str, bool free_buf)
 str_t *
 str_hexdump_new(unsigned char *mem, size_t len)
 {
-	str_t *ret = str_new_len(len * 2 + 1);
-
-	while (len--) {
-		str_append_printf(ret, "%02x ", *mem);
-		mem++;
+	static const char hex[] = "0123456789abcdef";
+	str_t *ret = str_new_len(len * 3);
+
+	for (char *p = ret->buf; len--; mem++) {
+		*p++ = hex[*mem >> 4];
+		*p++ = hex[*mem & 0xf];
+		*p++ = ' ';
+		ret->len += 3;
 	}
+	ret->buf[ret->len] = 0;
 
 	return ret;
 }
@@ -35,8 +35,31 @@
 #include <unistd.h>
 #include <stdbool.h>
 
+// size of the buffer of a string on the stack, see str_init_stack
+#define STR_STACK_LEN 256
+
 typedef struct str str_t;
 
+/*
+ * The members are only exposed so that strings can be placed on the stack, they
+ * must not be accessed directly.
+ */
+struct str {
+	char *buf;
+	ssize_t len;
+	size_t allocated_len;
+	bool on_stack;	   /**< the str_t is part of a str_stack_t */
+	bool buf_on_stack; /**< buf is the buffer of the str_stack_t */
+};
+
+/**
+ * Storage of a string on the stack, see str_init_stack.
+ */
+typedef struct str_stack {
+	str_t str;
+	char buf[STR_STACK_LEN];
+} str_stack_t;
+
 /**
  * Creates a new string.
  *
@@ -56,6 +79,20 @@ str_new(const char *init);
 str_t *
 str_new_len(size_t len);
 
+/**
+ * Initializes a string in storage on the stack of the caller, which saves the
+ * allocations of short-lived strings. The string is used like one created by
+ * str_new and only moves its buffer to the heap when growing beyond
+ * STR_STACK_LEN bytes. It must still be released with str_free, which returns a
+ * copy on the heap if the buffer is kept.
+ *
+ * @param stack The storage of the string, which must outlive its use.
+ * @param init The initial content of the string, may be NULL.
+ * @return Pointer to the string in stack.
+ */
+str_t *
+str_init_stack(str_stack_t *stack, const char *init);
+
 /**
  * Creates a new string with formatted content.
  *
@@ -0,0 +1,174 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "str.h"
+#include "logf.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <string.h>
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static MunitResult
+test_str_append(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	str_t *str = str_new("abc");
+	char expected[4096];
+
+	strcpy(expected, "abc");
+	for (int i = 0; i < 1000; i++) {
+		str_append(str, "x");
+		strcat(expected, "x");
+	}
+	munit_assert_size(str_length(str), ==, 1003);
+	munit_assert_string_equal(str_buffer(str), expected);
+
+	str_insert(str, 0, ">");
+	str_truncate(str, 4);
+	munit_assert_string_equal(str_buffer(str), ">abc");
+
+	str_free(str, true);
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_str_printf(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	str_t *str = str_new_printf("%d-%s", 42, "a");
+	munit_assert_string_equal(str_buffer(str), "42-a");
+
+	// does not fit into the spare capacity and is formatted again
+	str_append_printf(str, "%0300d", 7);
+	munit_assert_size(str_length(str), ==, 304);
+	munit_assert_char(str_buffer(str)[303], ==, '7');
+	munit_assert_char(str_buffer(str)[4], ==, '0');
+
+	str_assign_printf(str, "%s %u", "reset", 1u);
+	munit_assert_string_equal(str_buffer(str), "reset 1");
+
+	char *buf = str_free(str, false);
+	munit_assert_string_equal(buf, "reset 1");
+	mem_free0(buf);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_str_stack(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	str_stack_t stack;
+	str_t *str = str_init_stack(&stack, "on");
+
+	str_append_printf(str, " the %s", "stack");
+	munit_assert_string_equal(str_buffer(str), "on the stack");
+	munit_assert_ptr_equal(str_buffer(str), stack.buf);
+
+	// the kept buffer is copied to the heap
+	char *buf = str_free(str, false);
+	munit_assert_ptr_not_equal(buf, stack.buf);
+	munit_assert_string_equal(buf, "on the stack");
+	mem_free0(buf);
+
+	// growing beyond the stack buffer moves it to the heap
+	str = str_init_stack(&stack, NULL);
+	for (int i = 0; i < STR_STACK_LEN; i++)
+		str_append(str, "y");
+	str_append_printf(str, "%s", "z");
+	munit_assert_ptr_not_equal(str_buffer(str), stack.buf);
+	munit_assert_size(str_length(str), ==, STR_STACK_LEN + 1);
+	munit_assert_char(str_buffer(str)[0], ==, 'y');
+	munit_assert_char(str_buffer(str)[STR_STACK_LEN], ==, 'z');
+	str_free(str, true);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_str_hexdump(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	unsigned char mem[] = { 0x00, 0x7f, 0xab };
+
+	str_t *str = str_hexdump_new(mem, sizeof(mem));
+	munit_assert_string_equal(str_buffer(str), "00 7f ab ");
+	str_free(str, true);
+
+	str = str_hexdump_new(mem, 0);
+	munit_assert_string_equal(str_buffer(str), "");
+	str_free(str, true);
+
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/append and insert",	/* name */
+		test_str_append,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/printf",		/* name */
+		test_str_printf,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/strings on the stack", /* name */
+		test_str_stack,		 /* test */
+		setup,			 /* setup */
+		NULL,			 /* tear_down */
+		MUNIT_TEST_OPTION_NONE,	 /* options */
+		NULL			 /* parameters */
+	},
+	{
+		"/hexdump",		/* name */
+		test_str_hexdump,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite str_suite = {
+	"/str",			/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
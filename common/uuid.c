@@ -21,13 +21,12 @@
  * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
  */
 
-#include <inttypes.h>
-#include <stdio.h>
+#include <errno.h>
 #include <string.h>
-#include <strings.h>
-#include <stdlib.h>
-#include <limits.h>
 #include <unistd.h>
+#ifndef __APPLE__
+#include <sys/random.h>
+#endif
 
 #include "macro.h"
 #include "mem.h"
@@ -35,109 +34,122 @@
 #include "uuid.h"
 
 struct uuid {
-	uint32_t time_low;
-	uint16_t time_mid;
-	uint16_t time_hi_and_version;
+	uuid_bin_t bin;
 
-	/* This field is normally divided in:
-	 * uint8_t clock_seq_high_and_reserved;
-	 * uint8_t clock_seq_low; */
-	uint16_t clock_seq;
+	/* The string representation of the UUID, formatted on first use */
+	char string[UUID_STRING_LEN];
+};
 
-	/* This field is only 48 bits in RFC. Here we use
-	 * a uint64_t for easier usability. */
-	uint64_t node;
+// offsets of the hex digit pairs of each byte in the string representation
+static const uint8_t uuid_hex_offsets[16] = { 0,  2,  4,  6,  9,  11, 14, 16,
+					      19, 21, 24, 26, 28, 30, 32, 34 };
 
-	/* The string representation of the UUID */
-	char *string;
-};
+static const char uuid_hex_digits[] = "0123456789abcdef";
 
-static int
-uuid_fill_from_string(uuid_t *uuid, const char *string)
+/*
+ * Returns the value of the hex digit c and sets bad if c is none, without branching
+ * on the input.
+ */
+static inline unsigned int
+uuid_hex_val(unsigned char c, unsigned int *bad)
 {
-	TRACE("Trying to fill UUID from string: %s", string);
+	unsigned int digit = c - (unsigned int)'0';
+	unsigned int letter = (c | 0x20u) - (unsigned int)'a';
+	unsigned int is_digit = digit < 10;
+	unsigned int is_letter = letter < 6;
 
-	if (strlen(string) != 36) {
-		goto error;
+	*bad |= !(is_digit | is_letter);
+	return (is_digit * digit) | (is_letter * (letter + 10));
+}
+
+int
+uuid_bin_parse(uuid_bin_t *bin, const char *string)
+{
+	ASSERT(bin);
+	IF_NULL_RETVAL(string, -1);
+
+	if (strnlen(string, UUID_STRING_LEN) != UUID_STRING_LEN - 1) {
+		TRACE("Could not parse UUID from string (not a valid UUID string?)");
+		return -1;
 	}
 
-	int ret = sscanf(string, "%" SCNx32 "-%" SCNx16 "-%" SCNx16 "-%" SCNx16 "-%" SCNx64,
-			 &uuid->time_low, &uuid->time_mid, &uuid->time_hi_and_version,
-			 &uuid->clock_seq, &uuid->node);
+	unsigned int bad = (string[8] ^ '-') | (string[13] ^ '-') | (string[18] ^ '-') |
+			   (string[23] ^ '-');
+	for (int i = 0; i < 16; i++) {
+		const char *hex = string + uuid_hex_offsets[i];
+		unsigned int hi = uuid_hex_val(hex[0], &bad);
+		unsigned int lo = uuid_hex_val(hex[1], &bad);
+		bin->bytes[i] = (hi << 4) | lo;
+	}
 
-	TRACE("Parsed %d values from string", ret);
+	if (bad) {
+		TRACE("Could not parse UUID from string (not a valid UUID string?)");
+		return -1;
+	}
+	return 0;
+}
+
+void
+uuid_bin_format(const uuid_bin_t *bin, char *string)
+{
+	ASSERT(bin);
+	ASSERT(string);
 
-	if (ret != 5) {
-		goto error;
+	for (int i = 0; i < 16; i++) {
+		char *hex = string + uuid_hex_offsets[i];
+		hex[0] = uuid_hex_digits[bin->bytes[i] >> 4];
+		hex[1] = uuid_hex_digits[bin->bytes[i] & 0xf];
 	}
+	string[8] = string[13] = string[18] = string[23] = '-';
+	string[UUID_STRING_LEN - 1] = '\0';
+}
+
+int
+uuid_bin_generate(uuid_bin_t *bin)
+{
+	ASSERT(bin);
 
+#ifdef __APPLE__
+	arc4random_buf(bin->bytes, sizeof(bin->bytes));
+#else /* LINUX */
+	ssize_t n;
+	do {
+		n = getrandom(bin->bytes, sizeof(bin->bytes), 0);
+	} while (n < 0 && errno == EINTR);
+	if (n != sizeof(bin->bytes)) {
+		WARN_ERRNO("Could not get random bytes for UUID");
+		return -1;
+	}
+#endif
+	/* Make sure the random UUID has the correct format */
+	bin->bytes[6] = (bin->bytes[6] & 0x0f) | 0x40; // version 4 ((pseudo)random UUID)
+	bin->bytes[8] = (bin->bytes[8] & 0x3f) | 0x80; // variant conforming to RFC 4122
 	return 0;
+}
 
-error:
-	TRACE("Could not parse UUID from string (not a valid UUID string?)");
-	return -1;
+bool
+uuid_bin_equals(const uuid_bin_t *bin1, const uuid_bin_t *bin2)
+{
+	IF_NULL_RETVAL(bin1, false);
+	IF_NULL_RETVAL(bin2, false);
+
+	return !memcmp(bin1->bytes, bin2->bytes, sizeof(bin1->bytes));
 }
 
 uuid_t *
 uuid_new(char const *uuid)
 {
 	uuid_t *u = mem_new0(uuid_t, 1);
-	u->string = mem_new0(char, 37);
 
 	if (!uuid) {
 		/* No UUID string provided, generate it randomly */
-#ifdef __APPLE__
-		DEBUG("Using arc4random to generate random UUID");
-		arc4random_buf((void *)&u->time_low, sizeof(u->time_low));
-		arc4random_buf((void *)&u->time_mid, sizeof(u->time_mid));
-		arc4random_buf((void *)&u->time_hi_and_version, sizeof(u->time_hi_and_version));
-		arc4random_buf((void *)&u->clock_seq, sizeof(u->clock_seq));
-		arc4random_buf((void *)&u->node, sizeof(u->node));
-		/* Make sure the random UUID has the correct format */
-		u->time_hi_and_version &= 0x0fff; // Clear version bits
-		u->time_hi_and_version |= 0x4000; // Set to version 4 ((pseudo)random UUID)
-		u->clock_seq &= 0x3fff;		  // Clear reserved bits
-		u->clock_seq |=
-			0x8000; // Set reserved bits to 10 indicating UUID conforming to RFC 4122
-#else				/* LINUX */
-		// get a uuid string from /proc/kernel/random/uuid
-		FILE *f = fopen("/proc/sys/kernel/random/uuid", "r");
-		if (!f) {
-			WARN_ERRNO("Could not open UUID providing file in sys filesystem");
-			goto error;
-		}
-		char buf[37];
-		if (!fgets(buf, 37, f)) {
-			WARN_ERRNO("Could not read from UUID file in sys filesystem");
-			fclose(f);
-			goto error;
-		}
-		fclose(f);
-		int ret = uuid_fill_from_string(u, buf);
-		if (ret < 0) {
+		if (uuid_bin_generate(&u->bin) < 0)
 			goto error;
-		}
-#endif
 	} else {
 		/* UUID string provided, fill the structure from it */
-		int ret = uuid_fill_from_string(u, uuid);
-		if (ret < 0) {
+		TRACE("Trying to fill UUID from string: %s", uuid);
+		if (uuid_bin_parse(&u->bin, uuid) < 0)
 			goto error;
-		}
-	}
-
-	/* generate the UUID string from the filled structure */
-	snprintf(u->string, 37,
-		 "%08" PRIx32 "-%04" PRIx16 "-%04" PRIx16 "-%04" PRIx16 "-%012" PRIx64, u->time_low,
-		 u->time_mid, u->time_hi_and_version, u->clock_seq, u->node);
-
-	/* final check if the input string and the generated string match */
-	if (uuid) {
-		if (strncasecmp(uuid, u->string, 37)) {
-			WARN("%s and %s are not equal! Final check for string equality failed, not generating an UUID",
-			     uuid, u->string);
-			goto error;
-		}
 	}
 
 	return u;
@@ -153,11 +165,7 @@ uuid_equals(const uuid_t *uuid1, const uuid_t *uuid2)
 	IF_NULL_RETVAL(uuid1, false);
 	IF_NULL_RETVAL(uuid2, false);
 
-	if (uuid1->time_low == uuid2->time_low && uuid1->time_mid == uuid2->time_mid &&
-	    uuid1->time_hi_and_version == uuid2->time_hi_and_version &&
-	    uuid1->clock_seq == uuid2->clock_seq && uuid1->node == uuid2->node)
-		return true;
-	return false;
+	return uuid_bin_equals(&uuid1->bin, &uuid2->bin);
 }
 
 void
@@ -165,14 +173,24 @@ uuid_free(uuid_t *uuid)
 {
 	IF_NULL_RETURN(uuid);
 
-	mem_free0(uuid->string);
 	mem_free0(uuid);
 }
 
+const uuid_bin_t *
+uuid_get_bin(const uuid_t *uuid)
+{
+	IF_NULL_RETVAL(uuid, NULL);
+	return &uuid->bin;
+}
+
 const char *
 uuid_string(const uuid_t *uuid)
 {
 	IF_NULL_RETVAL(uuid, NULL);
+
+	// the string is only a cache of the immutable binary UUID
+	if (!uuid->string[0])
+		uuid_bin_format(&uuid->bin, ((uuid_t *)uuid)->string);
 	return uuid->string;
 }
 
@@ -181,14 +199,10 @@ uuid_get_node(const uuid_t *uuid)
 {
 	ASSERT(uuid);
 
+	// the 48 bit node ID are the last 6 bytes
 	uint64_t node = 0;
-
-	// 48-bit correspond to 12 hex characters
-	if (1 != sscanf(uuid->string + strlen(uuid->string) - 12, "%12" SCNx64, &node)) {
-		ERROR_ERRNO("Failed to read node ID");
-		DEBUG("Failed to return id");
-		return ULLONG_MAX;
-	}
+	for (int i = 10; i < 16; i++)
+		node = (node << 8) | uuid->bin.bytes[i];
 
 	return node;
 }
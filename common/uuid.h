@@ -36,6 +36,54 @@
 
 typedef struct uuid uuid_t;
 
+/**
+ * Length of the string representation of a UUID including the terminating null byte.
+ */
+#define UUID_STRING_LEN 37
+
+/**
+ * The 16 bytes of a UUID in network byte order, as a value type which needs no
+ * allocation. Equal UUIDs have equal bytes, so uuid_bin_t can be compared with memcmp
+ * and used as a key of a hashmap directly.
+ */
+typedef struct uuid_bin {
+	uint8_t bytes[16];
+} uuid_bin_t;
+
+/**
+ * Generates a random (version 4) UUID from getrandom(2).
+ *
+ * @param bin The UUID to be filled.
+ * @return 0 on success, -1 on error.
+ */
+int
+uuid_bin_generate(uuid_bin_t *bin);
+
+/**
+ * Parses the string representation of a UUID, in upper or lower case.
+ *
+ * @param bin The UUID to be filled.
+ * @param string The string to be parsed.
+ * @return 0 on success, -1 if string is no valid UUID.
+ */
+int
+uuid_bin_parse(uuid_bin_t *bin, const char *string);
+
+/**
+ * Formats a UUID as lower case string.
+ *
+ * @param bin The UUID to be formatted.
+ * @param string Buffer of at least UUID_STRING_LEN bytes.
+ */
+void
+uuid_bin_format(const uuid_bin_t *bin, char *string);
+
+/**
+ * Tests two binary UUIDs for equality.
+ */
+bool
+uuid_bin_equals(const uuid_bin_t *bin1, const uuid_bin_t *bin2);
+
 /**
  * Generate new UUID.
  *
@@ -66,7 +114,16 @@ void
 uuid_free(uuid_t *uuid);
 
 /**
- * Get a string representation of the UUID.
+ * Get the binary representation of the UUID, e.g., as hashmap key.
+ *
+ * @param uuid The UUID.
+ * @return The binary UUID, which is valid as long as uuid.
+ */
+const uuid_bin_t *
+uuid_get_bin(const uuid_t *uuid);
+
+/**
+ * Get a string representation of the UUID. It is formatted on first use.
  *
  * @param uuid UUID for which the string representation is returned.
  * @return The string representation of uuid.
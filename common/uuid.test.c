@@ -0,0 +1,125 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "uuid.h"
+#include "logf.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <string.h>
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static MunitResult
+test_uuid_parse(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	uuid_t *upper = uuid_new("0A1B2C3D-4E5F-4a6b-8C7D-9E0F1A2B3C4D");
+	uuid_t *lower = uuid_new("0a1b2c3d-4e5f-4a6b-8c7d-9e0f1a2b3c4d");
+	munit_assert_not_null(upper);
+	munit_assert_not_null(lower);
+
+	munit_assert_true(uuid_equals(upper, lower));
+	munit_assert_string_equal(uuid_string(upper), "0a1b2c3d-4e5f-4a6b-8c7d-9e0f1a2b3c4d");
+	munit_assert_uint64(uuid_get_node(upper), ==, 0x9e0f1a2b3c4dULL);
+	munit_assert_uint8(uuid_get_bin(upper)->bytes[0], ==, 0x0a);
+	munit_assert_uint8(uuid_get_bin(upper)->bytes[15], ==, 0x4d);
+
+	const char *invalid[] = {
+		"",
+		"0a1b2c3d-4e5f-4a6b-8c7d-9e0f1a2b3c4",
+		"0a1b2c3d-4e5f-4a6b-8c7d-9e0f1a2b3c4d0",
+		"0a1b2c3d+4e5f-4a6b-8c7d-9e0f1a2b3c4d",
+		"0a1b2c3d-4e5f-4a6b-8c7d-9e0f1a2b3c4g",
+		"0a1b2c3d-4e5f-4a6b-8c7d-9e0f1a2b3c:d",
+		"0a1b2c3d-4e5f-4a6b-8c7d-9e0f1a2b3c`d",
+	};
+	for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+		munit_assert_null(uuid_new(invalid[i]));
+
+	uuid_free(upper);
+	uuid_free(lower);
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_uuid_generate(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	uuid_t *a = uuid_new(NULL);
+	uuid_t *b = uuid_new(NULL);
+	munit_assert_not_null(a);
+	munit_assert_not_null(b);
+	munit_assert_false(uuid_equals(a, b));
+
+	// version 4 and RFC 4122 variant
+	const char *string = uuid_string(a);
+	munit_assert_size(strlen(string), ==, UUID_STRING_LEN - 1);
+	munit_assert_char(string[14], ==, '4');
+	munit_assert_not_null(strchr("89ab", string[19]));
+
+	uuid_t *copy = uuid_new(string);
+	munit_assert_not_null(copy);
+	munit_assert_true(uuid_equals(a, copy));
+	munit_assert_true(uuid_bin_equals(uuid_get_bin(a), uuid_get_bin(copy)));
+
+	uuid_free(copy);
+	uuid_free(a);
+	uuid_free(b);
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/parse",		/* name */
+		test_uuid_parse,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/generate",		/* name */
+		test_uuid_generate,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite uuid_suite = {
+	"/uuid",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
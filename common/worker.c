@@ -0,0 +1,400 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "worker.h"
+
+#include "macro.h"
+#include "mem.h"
+#include "event.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+typedef enum { WORKER_JOB_QUEUED, WORKER_JOB_RUNNING, WORKER_JOB_DONE } worker_job_state_t;
+
+struct worker_job {
+	void (*work)(void *data);
+	void (*done)(void *data);
+	void *data;
+	worker_prio_t prio;
+	worker_queue_t *queue;	  // NULL for jobs of the pool
+	worker_job_state_t state; // protected by worker_lock
+	bool cancelled;		  // set by worker_cancel() while running
+	struct worker_job *prev;
+	struct worker_job *next;
+};
+
+/*
+ * A queue has its own thread, which runs the jobs of the queue one after the other.
+ * Apart from the thread, its jobs are handled like those of the pool.
+ */
+struct worker_queue {
+	pthread_cond_t cond;
+	worker_job_t *head; // pending jobs, protected by worker_lock
+	worker_job_t *tail;
+	bool closing; // the thread frees the queue once it is empty
+};
+
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+// pending jobs per priority and finished jobs, protected by worker_lock
+static worker_job_t *worker_head[WORKER_PRIO_COUNT] = { NULL };
+static worker_job_t *worker_tail[WORKER_PRIO_COUNT] = { NULL };
+static worker_job_t *worker_done_head = NULL;
+static worker_job_t *worker_done_tail = NULL;
+
+// signals finished jobs to the event loop
+static int worker_done_fd = -1;
+static event_io_t *worker_done_io = NULL;
+static bool worker_started = false;
+// jobs whose done function was not yet called, only used by the event loop thread
+static unsigned worker_outstanding = 0;
+
+static __thread worker_job_t *worker_current = NULL;
+
+static void
+worker_list_append(worker_job_t **head, worker_job_t **tail, worker_job_t *job)
+{
+	job->next = NULL;
+	job->prev = *tail;
+	if (*tail)
+		(*tail)->next = job;
+	else
+		*head = job;
+	*tail = job;
+}
+
+static void
+worker_list_remove(worker_job_t **head, worker_job_t **tail, worker_job_t *job)
+{
+	if (job->prev)
+		job->prev->next = job->next;
+	else
+		*head = job->next;
+	if (job->next)
+		job->next->prev = job->prev;
+	else
+		*tail = job->prev;
+	job->prev = job->next = NULL;
+}
+
+/**
+ * Dequeues the first job of the highest non-empty priority. Must be called with
+ * worker_lock held.
+ */
+static worker_job_t *
+worker_dequeue(void)
+{
+	for (int prio = 0; prio < WORKER_PRIO_COUNT; prio++) {
+		worker_job_t *job = worker_head[prio];
+		if (!job)
+			continue;
+		worker_list_remove(&worker_head[prio], &worker_tail[prio], job);
+		job->state = WORKER_JOB_RUNNING;
+		return job;
+	}
+	return NULL;
+}
+
+/**
+ * Runs a dequeued job and hands it back to the event loop.
+ */
+static void
+worker_job_run(worker_job_t *job)
+{
+	worker_current = job;
+	job->work(job->data);
+	worker_current = NULL;
+
+	// the event loop is only woken up for the first of several finished jobs
+	pthread_mutex_lock(&worker_lock);
+	bool wakeup = !worker_done_head;
+	job->state = WORKER_JOB_DONE;
+	worker_list_append(&worker_done_head, &worker_done_tail, job);
+	pthread_mutex_unlock(&worker_lock);
+
+	uint64_t one = 1;
+	if (wakeup && write(worker_done_fd, &one, sizeof(one)) != sizeof(one))
+		FATAL_ERRNO("Failed to hand back finished job to the event loop");
+}
+
+static void *
+worker_thread(UNUSED void *arg)
+{
+	for (;;) {
+		worker_job_t *job;
+
+		pthread_mutex_lock(&worker_lock);
+		while (!(job = worker_dequeue()))
+			pthread_cond_wait(&worker_cond, &worker_lock);
+		pthread_mutex_unlock(&worker_lock);
+
+		worker_job_run(job);
+	}
+	return NULL;
+}
+
+static void *
+worker_queue_thread(void *arg)
+{
+	worker_queue_t *queue = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&worker_lock);
+		while (!queue->head && !queue->closing)
+			pthread_cond_wait(&queue->cond, &worker_lock);
+		worker_job_t *job = queue->head;
+		if (job) {
+			worker_list_remove(&queue->head, &queue->tail, job);
+			job->state = WORKER_JOB_RUNNING;
+		}
+		pthread_mutex_unlock(&worker_lock);
+
+		if (!job)
+			break;
+		worker_job_run(job);
+	}
+
+	pthread_cond_destroy(&queue->cond);
+	mem_free0(queue);
+	return NULL;
+}
+
+/**
+ * Starts a detached thread which handles no signals, those are handled by the
+ * event loop thread only.
+ */
+static int
+worker_thread_create(void *(*func)(void *), void *arg)
+{
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	pthread_t thread;
+	int ret = pthread_create(&thread, NULL, func, arg);
+	if (!ret)
+		pthread_detach(thread);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return ret ? -1 : 0;
+}
+
+static void
+worker_outstanding_dec(void)
+{
+	// the event loop is only kept running while jobs are outstanding
+	if (!--worker_outstanding)
+		event_remove_io(worker_done_io);
+}
+
+static void
+worker_cb_done(int fd, unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+{
+	IF_FALSE_RETURN(events & EVENT_IO_READ);
+
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		WARN_ERRNO("Failed to read worker eventfd");
+
+	pthread_mutex_lock(&worker_lock);
+	worker_job_t *job = worker_done_head;
+	worker_done_head = worker_done_tail = NULL;
+	pthread_mutex_unlock(&worker_lock);
+
+	while (job) {
+		worker_job_t *next = job->next;
+		worker_outstanding_dec();
+		job->done(job->data);
+		mem_free0(job);
+		job = next;
+	}
+}
+
+/**
+ * Sets up handing back finished jobs to the event loop, shared by the pool and all queues.
+ */
+static int
+worker_done_init(void)
+{
+	IF_TRUE_RETVAL(worker_done_fd >= 0, 0);
+
+	worker_done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (worker_done_fd < 0) {
+		ERROR_ERRNO("Failed to create worker eventfd");
+		return -1;
+	}
+	worker_done_io = event_io_new(worker_done_fd, EVENT_IO_READ, worker_cb_done, NULL);
+	return 0;
+}
+
+static int
+worker_start(void)
+{
+	IF_TRUE_RETVAL(worker_done_init() < 0, -1);
+
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int nthreads = MAX(1, MIN(ncpus, WORKER_MAX_THREADS));
+
+	int started = 0;
+	for (int i = 0; i < nthreads; i++) {
+		if (worker_thread_create(worker_thread, NULL) < 0) {
+			WARN("Failed to start worker thread %d", i);
+			continue;
+		}
+		started++;
+	}
+
+	if (!started) {
+		ERROR("Could not start any worker thread");
+		return -1;
+	}
+
+	DEBUG("Started %d worker threads", started);
+	worker_started = true;
+	return 0;
+}
+
+static worker_job_t *
+worker_job_new(worker_prio_t prio, void (*work)(void *data), void (*done)(void *data),
+	       void *data)
+{
+	worker_job_t *job = mem_new0(worker_job_t, 1);
+	job->work = work;
+	job->done = done;
+	job->data = data;
+	job->prio = prio;
+	job->state = WORKER_JOB_QUEUED;
+
+	if (!worker_outstanding++)
+		event_add_io(worker_done_io);
+
+	return job;
+}
+
+worker_job_t *
+worker_submit(worker_prio_t prio, void (*work)(void *data), void (*done)(void *data),
+	      void *data)
+{
+	ASSERT(work);
+	ASSERT(done);
+	IF_TRUE_RETVAL_ERROR(prio < 0 || prio >= WORKER_PRIO_COUNT, NULL);
+
+	if (!worker_started && worker_start() < 0)
+		return NULL;
+
+	worker_job_t *job = worker_job_new(prio, work, done, data);
+
+	pthread_mutex_lock(&worker_lock);
+	worker_list_append(&worker_head[prio], &worker_tail[prio], job);
+	pthread_cond_signal(&worker_cond);
+	pthread_mutex_unlock(&worker_lock);
+
+	return job;
+}
+
+int
+worker_run(void (*work)(void *data), void (*done)(void *data), void *data)
+{
+	return worker_submit(WORKER_PRIO_NORMAL, work, done, data) ? 0 : -1;
+}
+
+int
+worker_cancel(worker_job_t *job)
+{
+	IF_NULL_RETVAL(job, -1);
+
+	pthread_mutex_lock(&worker_lock);
+	if (job->state != WORKER_JOB_QUEUED) {
+		__atomic_store_n(&job->cancelled, true, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&worker_lock);
+		return -1;
+	}
+	if (job->queue)
+		worker_list_remove(&job->queue->head, &job->queue->tail, job);
+	else
+		worker_list_remove(&worker_head[job->prio], &worker_tail[job->prio], job);
+	pthread_mutex_unlock(&worker_lock);
+
+	mem_free0(job);
+	worker_outstanding_dec();
+	return 0;
+}
+
+bool
+worker_cancelled(void)
+{
+	IF_NULL_RETVAL(worker_current, false);
+	return __atomic_load_n(&worker_current->cancelled, __ATOMIC_RELAXED);
+}
+
+worker_queue_t *
+worker_queue_new(void)
+{
+	IF_TRUE_RETVAL(worker_done_init() < 0, NULL);
+
+	worker_queue_t *queue = mem_new0(worker_queue_t, 1);
+	pthread_cond_init(&queue->cond, NULL);
+
+	if (worker_thread_create(worker_queue_thread, queue) < 0) {
+		ERROR("Failed to start thread of worker queue");
+		pthread_cond_destroy(&queue->cond);
+		mem_free0(queue);
+		return NULL;
+	}
+	return queue;
+}
+
+worker_job_t *
+worker_queue_submit(worker_queue_t *queue, void (*work)(void *data), void (*done)(void *data),
+		    void *data)
+{
+	ASSERT(queue);
+	ASSERT(work);
+	ASSERT(done);
+
+	worker_job_t *job = worker_job_new(WORKER_PRIO_NORMAL, work, done, data);
+	job->queue = queue;
+
+	pthread_mutex_lock(&worker_lock);
+	worker_list_append(&queue->head, &queue->tail, job);
+	pthread_cond_signal(&queue->cond);
+	pthread_mutex_unlock(&worker_lock);
+
+	return job;
+}
+
+void
+worker_queue_free(worker_queue_t *queue)
+{
+	IF_NULL_RETURN(queue);
+
+	pthread_mutex_lock(&worker_lock);
+	queue->closing = true;
+	pthread_cond_signal(&queue->cond);
+	pthread_mutex_unlock(&worker_lock);
+}
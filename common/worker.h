@@ -0,0 +1,124 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file worker.h
+ *
+ * A small pool of worker threads for long running, self-contained jobs (e.g. hashing
+ * large image files), which would otherwise block the event loop.
+ * Jobs must not touch any state owned by the event loop; their results are handed
+ * back to the event loop thread by a done callback, signaled through an eventfd.
+ * Queued jobs are started in order of their priority and can be cancelled until then.
+ * Jobs which may block for long, e.g., on a device, should rather go to a worker queue,
+ * whose own thread runs them one after the other without occupying the pool.
+ * All functions except worker_cancelled() must be called from the event loop thread.
+ */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdbool.h>
+
+/**
+ * Maximum number of worker threads; the pool uses at most one per online CPU.
+ */
+#define WORKER_MAX_THREADS 4
+
+typedef enum {
+	WORKER_PRIO_HIGH = 0, //!< jobs delaying a container start, e.g., verifying its images
+	WORKER_PRIO_NORMAL,   //!< default priority of worker_run()
+	WORKER_PRIO_LOW,      //!< background jobs, e.g., indexing images for updates
+	WORKER_PRIO_COUNT
+} worker_prio_t;
+
+typedef struct worker_job worker_job_t;
+
+typedef struct worker_queue worker_queue_t;
+
+/**
+ * Runs work(data) on a thread of the worker pool and afterwards done(data) in the
+ * event loop thread. The pool is started on first use.
+ *
+ * @param prio priority of the job, queued jobs of higher priority are started first
+ * @param work function running on a worker thread
+ * @param done function running in the event loop after work returned
+ * @param data data parameter passed to both functions
+ * @return the job which is valid until done is called or it was cancelled,
+ *	   NULL if the job could not be queued (neither function is called then)
+ */
+worker_job_t *
+worker_submit(worker_prio_t prio, void (*work)(void *data), void (*done)(void *data),
+	      void *data);
+
+/**
+ * Runs work(data) with WORKER_PRIO_NORMAL, see worker_submit().
+ *
+ * @return 0 if the job was queued, -1 otherwise (neither function is called then)
+ */
+int
+worker_run(void (*work)(void *data), void (*done)(void *data), void *data);
+
+/**
+ * Cancels a job. A job which did not start yet is dequeued and neither of its
+ * functions is called. A running job is only marked, which its work function may
+ * check by worker_cancelled() to return early; its done function is called anyway.
+ *
+ * @param job a job returned by worker_submit() whose done function was not yet called
+ * @return 0 if the job was dequeued, -1 if it already started
+ */
+int
+worker_cancel(worker_job_t *job);
+
+/**
+ * Returns whether the job running on the calling worker thread has been cancelled.
+ */
+bool
+worker_cancelled(void);
+
+/**
+ * Creates a worker queue with a dedicated thread.
+ *
+ * @return the new queue, NULL if its thread could not be started
+ */
+worker_queue_t *
+worker_queue_new(void);
+
+/**
+ * Queues work(data) on the thread of the given queue and afterwards runs done(data)
+ * in the event loop thread. The jobs of a queue run one after the other in the order
+ * they were queued, thus their done functions are called in that order, too. Jobs
+ * of the queue may be cancelled by worker_cancel().
+ *
+ * @return the job which is valid until done is called or it was cancelled
+ */
+worker_job_t *
+worker_queue_submit(worker_queue_t *queue, void (*work)(void *data), void (*done)(void *data),
+		    void *data);
+
+/**
+ * Frees the queue. Jobs queued before still run and their done functions are called.
+ */
+void
+worker_queue_free(worker_queue_t *queue);
+
+#endif /* WORKER_H */
@@ -0,0 +1,283 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "worker.h"
+#include "event.h"
+#include "logf.h"
+#include "mem.h"
+#include "macro.h"
+
+#include <unistd.h>
+
+#define TEST_JOBS 64
+
+static int test_done;
+static bool test_release;
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	logf_register(&logf_test_write, stderr);
+	test_done = 0;
+	test_release = false;
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	event_reset();
+}
+
+static void
+test_add_work(void *data)
+{
+	int *job = data;
+	*job += 1;
+}
+
+static void
+test_count_done(void *data)
+{
+	int *job = data;
+	munit_assert_int(*job, ==, 1);
+	test_done++;
+}
+
+static MunitResult
+test_worker_done(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	int jobs[TEST_JOBS] = { 0 };
+
+	for (int i = 0; i < TEST_JOBS; i++)
+		munit_assert_not_null(worker_submit(i % WORKER_PRIO_COUNT, test_add_work,
+						    test_count_done, &jobs[i]));
+
+	// the loop returns as soon as all done functions have been called
+	event_loop();
+
+	munit_assert_int(test_done, ==, TEST_JOBS);
+	return MUNIT_OK;
+}
+
+static void
+test_block_work(UNUSED void *data)
+{
+	while (!__atomic_load_n(&test_release, __ATOMIC_ACQUIRE))
+		usleep(1000);
+}
+
+static void
+test_block_done(UNUSED void *data)
+{
+	test_done++;
+}
+
+static void
+test_never_work(UNUSED void *data)
+{
+	munit_error("cancelled job was started");
+}
+
+static void
+test_never_done(UNUSED void *data)
+{
+	munit_error("cancelled job was finished");
+}
+
+static void
+test_release_cb(event_timer_t *timer, UNUSED void *data)
+{
+	__atomic_store_n(&test_release, true, __ATOMIC_RELEASE);
+	event_remove_timer(timer);
+	event_timer_free(timer);
+}
+
+static MunitResult
+test_worker_cancel_queued(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// occupy all worker threads, so that the following jobs stay queued
+	for (int i = 0; i < WORKER_MAX_THREADS; i++)
+		munit_assert_not_null(
+			worker_submit(WORKER_PRIO_HIGH, test_block_work, test_block_done, NULL));
+
+	worker_job_t *low = worker_submit(WORKER_PRIO_LOW, test_never_work, test_never_done, NULL);
+	worker_job_t *high =
+		worker_submit(WORKER_PRIO_HIGH, test_never_work, test_never_done, NULL);
+	munit_assert_not_null(low);
+	munit_assert_not_null(high);
+	munit_assert_int(worker_cancel(high), ==, 0);
+	munit_assert_int(worker_cancel(low), ==, 0);
+
+	event_timer_t *timer = event_timer_new(10, 1, test_release_cb, NULL);
+	event_add_timer(timer);
+	event_loop();
+
+	munit_assert_int(test_done, ==, WORKER_MAX_THREADS);
+	return MUNIT_OK;
+}
+
+typedef struct {
+	worker_job_t *job;
+	bool started;
+	bool cancelled;
+} test_running_t;
+
+static void
+test_running_work(void *data)
+{
+	test_running_t *t = data;
+
+	__atomic_store_n(&t->started, true, __ATOMIC_RELEASE);
+	for (int i = 0; i < 5000 && !worker_cancelled(); i++)
+		usleep(1000);
+	t->cancelled = worker_cancelled();
+}
+
+static void
+test_running_done(UNUSED void *data)
+{
+	test_done++;
+}
+
+static void
+test_cancel_cb(event_timer_t *timer, void *data)
+{
+	test_running_t *t = data;
+
+	IF_FALSE_RETURN(__atomic_load_n(&t->started, __ATOMIC_ACQUIRE));
+
+	// a running job is only marked and still finished
+	munit_assert_int(worker_cancel(t->job), ==, -1);
+	event_remove_timer(timer);
+	event_timer_free(timer);
+}
+
+static MunitResult
+test_worker_cancel_running(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	test_running_t t = { 0 };
+
+	t.job = worker_submit(WORKER_PRIO_NORMAL, test_running_work, test_running_done, &t);
+	munit_assert_not_null(t.job);
+
+	event_timer_t *timer =
+		event_timer_new(1, EVENT_TIMER_REPEAT_FOREVER, test_cancel_cb, &t);
+	event_add_timer(timer);
+	event_loop();
+
+	munit_assert_int(test_done, ==, 1);
+	munit_assert_true(t.cancelled);
+	return MUNIT_OK;
+}
+
+static int test_order[TEST_JOBS];
+static int test_order_next;
+
+static void
+test_order_work(void *data)
+{
+	int *job = data;
+	// jobs of a queue never run concurrently, thus no locking is needed
+	test_order[test_order_next++] = *job;
+}
+
+static void
+test_order_done(void *data)
+{
+	int *job = data;
+	munit_assert_int(*job, ==, test_done);
+	test_done++;
+}
+
+static MunitResult
+test_worker_queue_order(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	int jobs[TEST_JOBS];
+
+	worker_queue_t *queue = worker_queue_new();
+	munit_assert_not_null(queue);
+	test_order_next = 0;
+
+	for (int i = 0; i < TEST_JOBS; i++) {
+		jobs[i] = i;
+		munit_assert_not_null(
+			worker_queue_submit(queue, test_order_work, test_order_done, &jobs[i]));
+	}
+	// queued jobs still run after the queue was freed
+	worker_queue_free(queue);
+	event_loop();
+
+	munit_assert_int(test_done, ==, TEST_JOBS);
+	for (int i = 0; i < TEST_JOBS; i++)
+		munit_assert_int(test_order[i], ==, i);
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/done",		/* name */
+		test_worker_done,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/cancel_queued",	   /* name */
+		test_worker_cancel_queued, /* test */
+		setup,			   /* setup */
+		tear_down,		   /* tear_down */
+		MUNIT_TEST_OPTION_NONE,	   /* options */
+		NULL			   /* parameters */
+	},
+	{
+		"/cancel_running",	    /* name */
+		test_worker_cancel_running, /* test */
+		setup,			    /* setup */
+		tear_down,		    /* tear_down */
+		MUNIT_TEST_OPTION_NONE,	    /* options */
+		NULL			    /* parameters */
+	},
+	{
+		"/queue_order",		 /* name */
+		test_worker_queue_order, /* test */
+		setup,			 /* setup */
+		tear_down,		 /* tear_down */
+		MUNIT_TEST_OPTION_NONE,	 /* options */
+		NULL			 /* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite worker_suite = {
+	"/worker",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
@@ -0,0 +1,413 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file audit_bench.c
+ *
+ * Benchmark of the audit pipeline of the cml-daemon. It synthesizes audit records by
+ * sending user messages to the kernel audit subsystem at a controlled rate, which the
+ * kernel passes on to the daemon as the registered audit daemon. The daemon stores them
+ * for the audit logging container, whose service hashes, logs and acknowledges them.
+ *
+ * The counters of the daemon (GET_AUDIT_STATS) are sampled during the run to report the
+ * end-to-end latency from sending a message to its acknowledgement by the service, the
+ * round trip of the ACKs, the growth of the stored backlog and the records lost on the
+ * way as JSON. The daemon delivers the records of a container in order, thus the n-th
+ * record acknowledged after the start is taken as the n-th message sent; concurrent
+ * audit events of the device slightly distort the result.
+ */
+
+#include "control.pb-c.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/protobuf.h"
+#include "common/sock.h"
+#include "common/file.h"
+
+#include <linux/audit.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// clang-format off
+#define CONTROL_SOCKET SOCK_PATH(control)
+// clang-format on
+
+#define AUDIT_BENCH_COUNT_DEFAULT 10000
+#define AUDIT_BENCH_RATE_DEFAULT 1000
+#define AUDIT_BENCH_SIZE_DEFAULT 128
+#define AUDIT_BENCH_INTERVAL_DEFAULT 20 // ms
+#define AUDIT_BENCH_TIMEOUT_DEFAULT 30	// s
+
+#define AUDIT_BENCH_MSG_MAX 8192
+
+// same layout as the histogram of event.h
+#define AUDIT_BENCH_BUCKETS 20
+
+typedef struct audit_bench_sample {
+	uint64_t time_us; // since the start of the run
+	uint64_t records;
+	uint64_t acked;
+	uint64_t backlog_bytes;
+} audit_bench_sample_t;
+
+static void
+print_usage(const char *cmd)
+{
+	printf("\n");
+	printf("Usage: %s [options]\n", cmd);
+	printf("\n");
+	printf("Sends audit user messages to the kernel and reports how the daemon delivers\n"
+	       "them to the audit logging container as JSON. Requires the kernel audit to be\n"
+	       "enabled and the audit logging container to be running.\n\n");
+	printf("options:\n"
+	       "   -s <socket>      control socket of the daemon (default " CONTROL_SOCKET ")\n"
+	       "   -n <count>       number of messages (default %d)\n"
+	       "   -r <rate>        messages per second, 0 for as fast as possible (default %d)\n"
+	       "   -b <bytes>       size of each message (default %d)\n"
+	       "   -i <ms>          sampling interval of the daemon's counters (default %d)\n"
+	       "   -t <s>           time to wait for outstanding ACKs (default %d)\n\n",
+	       AUDIT_BENCH_COUNT_DEFAULT, AUDIT_BENCH_RATE_DEFAULT, AUDIT_BENCH_SIZE_DEFAULT,
+	       AUDIT_BENCH_INTERVAL_DEFAULT, AUDIT_BENCH_TIMEOUT_DEFAULT);
+	exit(-1);
+}
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/******************************************************************************/
+
+static int
+audit_bench_send(int sock, uint16_t type, const void *data, size_t len)
+{
+	struct {
+		struct nlmsghdr nlh;
+		char data[AUDIT_BENCH_MSG_MAX];
+	} req;
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+
+	IF_TRUE_RETVAL(len > sizeof(req.data), -1);
+
+	memset(&req.nlh, 0, sizeof(req.nlh));
+	req.nlh.nlmsg_len = NLMSG_LENGTH(len);
+	req.nlh.nlmsg_type = type;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST;
+	memcpy(NLMSG_DATA(&req.nlh), data, len);
+
+	return sendto(sock, &req, req.nlh.nlmsg_len, 0, (struct sockaddr *)&addr, sizeof(addr)) <
+			       0 ?
+		       -1 :
+		       0;
+}
+
+/**
+ * Queries the status of the kernel audit, e.g., its counter of lost messages.
+ */
+static int
+audit_bench_get_status(int sock, struct audit_status *status)
+{
+	if (audit_bench_send(sock, AUDIT_GET, NULL, 0) < 0) {
+		ERROR_ERRNO("Could not request the kernel audit status");
+		return -1;
+	}
+
+	char buf[AUDIT_BENCH_MSG_MAX];
+	for (;;) {
+		struct pollfd pfd = { .fd = sock, .events = POLLIN };
+		if (poll(&pfd, 1, 1000) <= 0) {
+			ERROR("No kernel audit status received");
+			return -1;
+		}
+		ssize_t len = recv(sock, buf, sizeof(buf), 0);
+		IF_TRUE_RETVAL(len < 0, -1);
+		struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+		for (; NLMSG_OK(nlh, (size_t)len); nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(nlh);
+				IF_TRUE_RETVAL(err->error, -1);
+			} else if (nlh->nlmsg_type == AUDIT_GET) {
+				memset(status, 0, sizeof(*status));
+				memcpy(status, NLMSG_DATA(nlh),
+				       MIN(sizeof(*status), (size_t)NLMSG_PAYLOAD(nlh, 0)));
+				return 0;
+			}
+		}
+	}
+}
+
+static AuditStats *
+audit_bench_get_stats(int ctl)
+{
+	ControllerToDaemon msg = CONTROLLER_TO_DAEMON__INIT;
+	msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_AUDIT_STATS;
+	if (protobuf_send_message(ctl, (ProtobufCMessage *)&msg) < 0) {
+		ERROR("Could not send command to the daemon");
+		return NULL;
+	}
+
+	DaemonToController *resp = (DaemonToController *)protobuf_recv_message(
+		ctl, &daemon_to_controller__descriptor);
+	IF_NULL_RETVAL(resp, NULL);
+	AuditStats *stats = resp->audit_stats;
+	if (!stats || stats->n_ack_rtt_histogram != AUDIT_BENCH_BUCKETS) {
+		ERROR("Unexpected response to GET_AUDIT_STATS");
+		protobuf_free_message((ProtobufCMessage *)resp);
+		return NULL;
+	}
+	// keep the stats only
+	resp->audit_stats = NULL;
+	protobuf_free_message((ProtobufCMessage *)resp);
+	return stats;
+}
+
+/**
+ * Returns the upper bound in us of the bucket which contains the given percentile of the
+ * ACK round trips recorded between before and after.
+ */
+static uint64_t
+audit_bench_rtt_percentile(const AuditStats *before, const AuditStats *after,
+			   unsigned int percentile)
+{
+	uint64_t count = after->acks - before->acks;
+	uint64_t rank = (count * percentile + 99) / 100, sum = 0;
+	for (unsigned int i = 0; i < AUDIT_BENCH_BUCKETS; i++) {
+		sum += after->ack_rtt_histogram[i] - before->ack_rtt_histogram[i];
+		if (sum >= rank && sum)
+			return 1ULL << i;
+	}
+	return 0;
+}
+
+static void
+audit_bench_print(unsigned int count, unsigned int rate, size_t size, uint64_t sent,
+		  uint64_t send_us, uint64_t *latencies, uint64_t n_latencies,
+		  const struct audit_status *kbefore, const struct audit_status *kafter,
+		  const AuditStats *before, const AuditStats *after, audit_bench_sample_t *samples,
+		  size_t n_samples)
+{
+	uint64_t acks = after->acks - before->acks;
+	uint64_t backlog_max = 0;
+	for (size_t i = 0; i < n_samples; i++)
+		backlog_max = MAX(backlog_max, samples[i].backlog_bytes);
+
+	qsort(latencies, n_latencies, sizeof(uint64_t), cmp_u64);
+#define LATENCY_MS(p) (n_latencies ? latencies[(n_latencies - 1) * (p) / 100] / 1000.0 : 0)
+
+	printf("{\n  \"config\": { \"count\": %u, \"rate\": %u, \"size\": %zu },\n", count, rate,
+	       size);
+	printf("  \"sent\": %" PRIu64 ",\n  \"send_ms\": %.1f,\n", sent, send_us / 1000.0);
+	printf("  \"kernel_lost\": %u,\n  \"enobufs\": %" PRIu64 ",\n  \"invalid\": %" PRIu64 ",\n",
+	       kafter->lost - kbefore->lost, after->enobufs - before->enobufs,
+	       after->invalid - before->invalid);
+	printf("  \"records\": %" PRIu64 ",\n  \"dropped\": %" PRIu64 ",\n  \"spilled\": %" PRIu64
+	       ",\n  \"acked\": %" PRIu64 ",\n",
+	       after->records - before->records, after->dropped - before->dropped,
+	       after->spilled - before->spilled, after->acked - before->acked);
+	printf("  \"latency_ms\": { \"count\": %" PRIu64 ", \"p50\": %.1f, \"p99\": %.1f, "
+	       "\"max\": %.1f },\n",
+	       n_latencies, LATENCY_MS(50), LATENCY_MS(99), LATENCY_MS(100));
+	printf("  \"ack_rtt_us\": { \"count\": %" PRIu64 ", \"mean\": %.1f, \"p50\": %" PRIu64
+	       ", \"p99\": %" PRIu64 ", \"max\": %.1f },\n",
+	       acks, acks ? (after->ack_rtt_ns - before->ack_rtt_ns) / 1000.0 / acks : 0,
+	       audit_bench_rtt_percentile(before, after, 50),
+	       audit_bench_rtt_percentile(before, after, 99), after->max_ack_rtt_ns / 1000.0);
+	printf("  \"backlog_max_bytes\": %" PRIu64 ",\n  \"samples\": [", backlog_max);
+	for (size_t i = 0; i < n_samples; i++) {
+		printf("%s\n    { \"time_ms\": %.1f, \"records\": %" PRIu64 ", \"acked\": %" PRIu64
+		       ", \"backlog_bytes\": %" PRIu64 " }",
+		       i ? "," : "", samples[i].time_us / 1000.0,
+		       samples[i].records - before->records, samples[i].acked - before->acked,
+		       samples[i].backlog_bytes);
+	}
+	printf("\n  ]\n}\n");
+#undef LATENCY_MS
+}
+
+int
+main(int argc, char *argv[])
+{
+	logf_register(&logf_test_write, stderr);
+
+	const char *socket_file = CONTROL_SOCKET;
+	unsigned int count = AUDIT_BENCH_COUNT_DEFAULT;
+	unsigned int rate = AUDIT_BENCH_RATE_DEFAULT;
+	size_t size = AUDIT_BENCH_SIZE_DEFAULT;
+	unsigned int interval = AUDIT_BENCH_INTERVAL_DEFAULT;
+	unsigned int timeout = AUDIT_BENCH_TIMEOUT_DEFAULT;
+
+	for (int c; -1 != (c = getopt(argc, argv, "s:n:r:b:i:t:h"));) {
+		switch (c) {
+		case 's':
+			socket_file = optarg;
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			rate = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			size = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			interval = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			timeout = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (optind != argc || !count || !interval || size < 64 || size >= AUDIT_BENCH_MSG_MAX)
+		print_usage(argv[0]);
+
+	if (!file_exists(socket_file))
+		FATAL("Could not find socket file %s. Aborting.", socket_file);
+	int ctl = sock_unix_create_and_connect(SOCK_STREAM, socket_file);
+	if (ctl < 0)
+		FATAL("Failed to connect to %s", socket_file);
+
+	int sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_AUDIT);
+	if (sock < 0)
+		FATAL_ERRNO("Could not create audit netlink socket");
+
+	struct audit_status kbefore, kafter;
+	if (audit_bench_get_status(sock, &kbefore) < 0)
+		FATAL("Could not get the kernel audit status");
+	if (!kbefore.enabled)
+		FATAL("The kernel audit is disabled, enable it with 'auditctl -e 1'");
+
+	AuditStats *before = audit_bench_get_stats(ctl);
+	if (!before)
+		FATAL("Could not get the audit stats of the daemon");
+
+	uint64_t *sent_at = mem_new0(uint64_t, count);
+	uint64_t *latencies = mem_new0(uint64_t, count);
+	size_t n_samples = 0, samples_size = 256;
+	audit_bench_sample_t *samples = mem_new0(audit_bench_sample_t, samples_size);
+	char *text = mem_alloc0(size + 1);
+
+	uint64_t start = now_us(), next_sample = start, sent = 0, n_latencies = 0;
+	uint64_t send_us = 0, last_progress = 0;
+	AuditStats *after = NULL;
+	for (;;) {
+		uint64_t now = now_us();
+
+		// send all messages which are due at the configured rate
+		while (sent < count && (!rate || sent * 1000000 / rate <= now - start)) {
+			int len = snprintf(text, size + 1,
+					   "cml-audit-bench seq=%" PRIu64 " res=success ", sent);
+			memset(text + len, 'x', size - len);
+			if (audit_bench_send(sock, AUDIT_USER, text, size) < 0)
+				FATAL_ERRNO("Could not send audit message %" PRIu64, sent);
+			sent_at[sent++] = now_us();
+			if (!rate && sent % 64 == 0)
+				break; // sample the daemon while sending as fast as possible
+		}
+		if (sent == count && !send_us)
+			send_us = now_us() - start;
+
+		if (now >= next_sample || sent == count) {
+			if (after)
+				protobuf_free_message((ProtobufCMessage *)after);
+			if (!(after = audit_bench_get_stats(ctl)))
+				FATAL("Could not get the audit stats of the daemon");
+			now = now_us();
+
+			if (n_samples == samples_size) {
+				samples_size *= 2;
+				samples = mem_realloc(samples,
+						      samples_size * sizeof(audit_bench_sample_t));
+			}
+			samples[n_samples++] = (audit_bench_sample_t){
+				.time_us = now - start,
+				.records = after->records,
+				.acked = after->acked,
+				.backlog_bytes = after->backlog_bytes,
+			};
+
+			// records are acknowledged in order, map them to the sent messages
+			uint64_t acked = MIN(after->acked - before->acked, sent);
+			if (acked > n_latencies)
+				last_progress = now;
+			for (; n_latencies < acked; n_latencies++)
+				latencies[n_latencies] = now - sent_at[n_latencies];
+			next_sample = now + interval * 1000ULL;
+
+			if (sent == count &&
+			    (n_latencies == count ||
+			     now - MAX(last_progress, start + send_us) > timeout * 1000000ULL))
+				break;
+		}
+
+		if (sent == count || rate) {
+			uint64_t wait_until = next_sample;
+			if (sent < count)
+				wait_until = MIN(wait_until, start + sent * 1000000 / rate);
+			now = now_us();
+			if (wait_until > now)
+				usleep(wait_until - now);
+		}
+	}
+
+	if (audit_bench_get_status(sock, &kafter) < 0)
+		kafter = kbefore;
+
+	audit_bench_print(count, rate, size, sent, send_us, latencies, n_latencies, &kbefore,
+			  &kafter, before, after, samples, n_samples);
+
+	protobuf_free_message((ProtobufCMessage *)before);
+	protobuf_free_message((ProtobufCMessage *)after);
+	mem_free0(text);
+	mem_free0(samples);
+	mem_free0(latencies);
+	mem_free0(sent_at);
+	close(sock);
+	close(ctl);
+
+	return n_latencies == count ? 0 : -1;
+}
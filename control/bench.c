@@ -0,0 +1,671 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file bench.c
+ *
+ * Load generator for the cml-daemon. It creates containers from a container config,
+ * drives them through start, freeze, unfreeze, exec and stop cycles via the control
+ * socket with a configurable number of operations in flight, removes them again and
+ * reports the latency of each operation type together with the cpu and memory usage
+ * of the daemon over time as JSON on stdout.
+ *
+ * Every operation uses its own connection, as the control tool does. Operations which
+ * change the state of a container complete once the daemon reports the target state
+ * on an OBSERVE_CONTAINERS connection, all others with the daemon's response.
+ */
+
+#include "control.pb-c.h"
+#include "container.pb-c.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/protobuf.h"
+#include "common/sock.h"
+#include "common/file.h"
+
+#include <google/protobuf-c/protobuf-c-text.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// clang-format off
+#define CONTROL_SOCKET SOCK_PATH(control)
+// clang-format on
+
+#define BENCH_CONTAINERS_DEFAULT 8
+#define BENCH_CONCURRENCY_DEFAULT 4
+#define BENCH_ROUNDS_DEFAULT 1
+#define BENCH_EXECS_DEFAULT 4
+#define BENCH_EXEC_COMMAND_DEFAULT "/bin/true"
+#define BENCH_SAMPLE_INTERVAL_DEFAULT 1000 // ms
+#define BENCH_TIMEOUT_DEFAULT 120000	   // ms
+
+typedef enum {
+	BENCH_OP_CREATE = 0,
+	BENCH_OP_START,
+	BENCH_OP_FREEZE,
+	BENCH_OP_UNFREEZE,
+	BENCH_OP_EXEC,
+	BENCH_OP_STOP,
+	BENCH_OP_REMOVE,
+	BENCH_OP_COUNT
+} bench_op_t;
+
+static const struct {
+	const char *name;
+	ControllerToDaemon__Command command;
+	ContainerState target; // state which completes the operation, 0 if the response does
+} bench_ops[BENCH_OP_COUNT] = {
+	[BENCH_OP_CREATE] = { "create", CONTROLLER_TO_DAEMON__COMMAND__CREATE_CONTAINER, 0 },
+	[BENCH_OP_START] = { "start", CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_START,
+			     CONTAINER_STATE__RUNNING },
+	[BENCH_OP_FREEZE] = { "freeze", CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_FREEZE,
+			      CONTAINER_STATE__FROZEN },
+	[BENCH_OP_UNFREEZE] = { "unfreeze", CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_UNFREEZE,
+				CONTAINER_STATE__RUNNING },
+	[BENCH_OP_EXEC] = { "exec", CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_EXEC_CMD, 0 },
+	[BENCH_OP_STOP] = { "stop", CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_STOP,
+			    CONTAINER_STATE__STOPPED },
+	[BENCH_OP_REMOVE] = { "remove", CONTROLLER_TO_DAEMON__COMMAND__REMOVE_CONTAINER, 0 },
+};
+
+typedef struct bench_container {
+	char *name;
+	char *uuid;		  // set once created
+	ContainerState state;	  // as last reported by the daemon
+	size_t step;		  // next operation in bench_sequence
+	bool pending;		  // an operation is in flight
+	int fd;			  // connection of the pending operation, -1 if closed
+	uint64_t started;	  // start of the pending operation (us)
+	bool responded;		  // the pending operation got its response
+	bool failed;		  // an operation failed, the remaining ones are skipped
+} bench_container_t;
+
+typedef struct bench_stats {
+	uint64_t *latencies; // us
+	size_t n;
+	size_t size;
+	size_t errors;
+} bench_stats_t;
+
+typedef struct bench_sample {
+	uint64_t time;	   // ms since the benchmark started
+	double cpu;	   // percent of one cpu since the last sample
+	uint64_t rss;	   // kB
+	struct bench_sample *next;
+} bench_sample_t;
+
+static const char *socket_file = CONTROL_SOCKET;
+static char *start_key = NULL;
+static const char *exec_command = BENCH_EXEC_COMMAND_DEFAULT;
+static unsigned int timeout_ms = BENCH_TIMEOUT_DEFAULT;
+
+static bench_op_t *bench_sequence = NULL; // operations every container goes through
+static size_t bench_sequence_len = 0;
+static bench_stats_t bench_stats[BENCH_OP_COUNT];
+
+static bench_container_t *containers = NULL;
+static size_t n_containers = BENCH_CONTAINERS_DEFAULT;
+
+static void
+print_usage(const char *cmd)
+{
+	printf("\n");
+	printf("Usage: %s [options] <container config>\n", cmd);
+	printf("\n");
+	printf("Creates containers from the given config, which must refer to an installed\n"
+	       "GuestOS, and drives them through the daemon's control socket.\n\n");
+	printf("options:\n"
+	       "   -s <socket>      control socket of the daemon (default " CONTROL_SOCKET ")\n"
+	       "   -n <count>       number of containers (default %d)\n"
+	       "   -j <count>       operations in flight (default %d)\n"
+	       "   -r <count>       start/freeze/unfreeze/exec/stop rounds (default %d)\n"
+	       "   -e <count>       exec sessions per round and container (default %d)\n"
+	       "   -x <command>     command run by the exec sessions (default %s)\n"
+	       "   -k <key>         key passed on start and stop, e.g. for token backed\n"
+	       "                    containers (e.g. with the swtpm docker setup of tpm2d)\n"
+	       "   -p <pid>         pid of the daemon to sample (default: found by name)\n"
+	       "   -i <ms>          sampling interval of the daemon (default %d)\n"
+	       "   -t <ms>          timeout of a single operation (default %d)\n\n",
+	       BENCH_CONTAINERS_DEFAULT, BENCH_CONCURRENCY_DEFAULT, BENCH_ROUNDS_DEFAULT,
+	       BENCH_EXECS_DEFAULT, BENCH_EXEC_COMMAND_DEFAULT, BENCH_SAMPLE_INTERVAL_DEFAULT,
+	       BENCH_TIMEOUT_DEFAULT);
+	exit(-1);
+}
+
+static uint64_t
+bench_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+bench_stats_add(bench_op_t op, uint64_t latency)
+{
+	bench_stats_t *stats = &bench_stats[op];
+	if (stats->n == stats->size) {
+		stats->size = stats->size ? 2 * stats->size : 64;
+		stats->latencies = mem_realloc(stats->latencies, stats->size * sizeof(uint64_t));
+	}
+	stats->latencies[stats->n++] = latency;
+}
+
+static int
+bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/******************************************************************************/
+
+/**
+ * Reads the cpu time (in clock ticks) and the resident set size (in kB) of a process.
+ */
+static int
+bench_proc_usage(pid_t pid, uint64_t *ticks, uint64_t *rss)
+{
+	char path[64];
+	char buf[1024];
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	int len = file_read(path, buf, sizeof(buf) - 1);
+	IF_TRUE_RETVAL(len <= 0, -1);
+	buf[len] = '\0';
+
+	// skip pid and comm, which may contain spaces, utime and stime are fields 14 and 15
+	char *p = strrchr(buf, ')');
+	IF_NULL_RETVAL(p, -1);
+	unsigned long long utime, stime;
+	if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime,
+		   &stime) != 2)
+		return -1;
+	*ticks = utime + stime;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	len = file_read(path, buf, sizeof(buf) - 1);
+	IF_TRUE_RETVAL(len <= 0, -1);
+	buf[len] = '\0';
+	p = strstr(buf, "VmRSS:");
+	IF_NULL_RETVAL(p, -1);
+	*rss = strtoull(p + strlen("VmRSS:"), NULL, 10);
+
+	return 0;
+}
+
+static pid_t
+bench_find_daemon(void)
+{
+	DIR *dir = opendir("/proc");
+	IF_NULL_RETVAL(dir, -1);
+
+	pid_t pid = -1;
+	struct dirent *entry;
+	while (pid < 0 && (entry = readdir(dir))) {
+		char path[64], comm[32];
+		if (!atoi(entry->d_name))
+			continue;
+		snprintf(path, sizeof(path), "/proc/%s/comm", entry->d_name);
+		int len = file_read(path, comm, sizeof(comm) - 1);
+		if (len <= 0)
+			continue;
+		comm[len] = '\0';
+		if (!strcmp(comm, "cmld\n"))
+			pid = atoi(entry->d_name);
+	}
+	closedir(dir);
+
+	return pid;
+}
+
+/******************************************************************************/
+
+static int
+bench_connect(void)
+{
+	int sock = sock_unix_create_and_connect(SOCK_STREAM, socket_file);
+	if (sock < 0)
+		ERROR("Failed to connect to %s", socket_file);
+	return sock;
+}
+
+static bench_container_t *
+bench_container_by_uuid(const char *uuid)
+{
+	for (size_t i = 0; uuid && i < n_containers; i++) {
+		if (containers[i].uuid && !strcmp(containers[i].uuid, uuid))
+			return &containers[i];
+	}
+	return NULL;
+}
+
+static void
+bench_op_finish(bench_container_t *c, bool ok)
+{
+	bench_op_t op = bench_sequence[c->step];
+
+	if (ok) {
+		bench_stats_add(op, bench_now_us() - c->started);
+	} else {
+		WARN("Operation %s on container %s failed", bench_ops[op].name, c->name);
+		bench_stats[op].errors++;
+		// a failed create leaves nothing to operate on, otherwise try to remove it
+		c->failed = true;
+	}
+
+	if (c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+	c->pending = false;
+	c->step++;
+	if (c->failed && c->uuid && c->step < bench_sequence_len - 1)
+		c->step = bench_sequence_len - 1;
+	else if (c->failed && !c->uuid)
+		c->step = bench_sequence_len;
+}
+
+/**
+ * Sends the next operation of the given container on a new connection.
+ */
+static void
+bench_op_begin(bench_container_t *c, const uint8_t *cfg, size_t cfg_len)
+{
+	bench_op_t op = bench_sequence[c->step];
+	ControllerToDaemon msg = CONTROLLER_TO_DAEMON__INIT;
+	ContainerStartParams start_params = CONTAINER_START_PARAMS__INIT;
+	char *uuids[1] = { c->uuid };
+
+	msg.command = bench_ops[op].command;
+	if (op == BENCH_OP_CREATE) {
+		msg.has_container_config_file = true;
+		msg.container_config_file.data = (uint8_t *)cfg;
+		msg.container_config_file.len = cfg_len;
+	} else {
+		msg.n_container_uuids = 1;
+		msg.container_uuids = uuids;
+	}
+	if ((op == BENCH_OP_START || op == BENCH_OP_STOP) && start_key) {
+		start_params.key = start_key;
+		msg.container_start_params = &start_params;
+	}
+	if (op == BENCH_OP_EXEC) {
+		msg.exec_command = (char *)exec_command;
+		msg.n_exec_args = 1;
+		msg.exec_args = (char **)&exec_command;
+		msg.has_exec_pty = true;
+		msg.exec_pty = false;
+	}
+
+	c->started = bench_now_us();
+	c->responded = false;
+	c->pending = true;
+	c->fd = bench_connect();
+	if (c->fd < 0 || protobuf_send_message(c->fd, (ProtobufCMessage *)&msg) < 0)
+		bench_op_finish(c, false);
+}
+
+static bool
+bench_response_ok(DaemonToController__Response response)
+{
+	switch (response) {
+	case DAEMON_TO_CONTROLLER__RESPONSE__CMD_OK:
+	case DAEMON_TO_CONTROLLER__RESPONSE__CONTAINER_START_OK:
+	case DAEMON_TO_CONTROLLER__RESPONSE__CONTAINER_STOP_OK:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * Handles a message of the daemon on the connection of the pending operation.
+ */
+static void
+bench_op_recv(bench_container_t *c)
+{
+	bench_op_t op = bench_sequence[c->step];
+	DaemonToController *resp = (DaemonToController *)protobuf_recv_message(
+		c->fd, &daemon_to_controller__descriptor);
+	if (!resp) {
+		// the daemon may close the connection before the target state is reached
+		if (bench_ops[op].target && c->responded) {
+			close(c->fd);
+			c->fd = -1;
+		} else {
+			bench_op_finish(c, false);
+		}
+		return;
+	}
+
+	switch (op) {
+	case BENCH_OP_CREATE:
+		if (resp->code != DAEMON_TO_CONTROLLER__CODE__CONTAINER_CONFIG)
+			break;
+		if (resp->n_container_uuids == 1) {
+			c->uuid = mem_strdup(resp->container_uuids[0]);
+			c->state = CONTAINER_STATE__STOPPED;
+		}
+		bench_op_finish(c, c->uuid != NULL);
+		break;
+	case BENCH_OP_EXEC:
+		if (resp->code == DAEMON_TO_CONTROLLER__CODE__EXEC_END)
+			bench_op_finish(c, true);
+		break;
+	default:
+		if (resp->code != DAEMON_TO_CONTROLLER__CODE__RESPONSE || !resp->has_response)
+			break;
+		c->responded = true;
+		if (!bench_response_ok(resp->response))
+			bench_op_finish(c, false);
+		else if (!bench_ops[op].target || c->state == bench_ops[op].target)
+			bench_op_finish(c, true);
+	}
+
+	protobuf_free_message((ProtobufCMessage *)resp);
+}
+
+/**
+ * Tracks the container states reported on the observer connection.
+ */
+static int
+bench_observer_recv(int fd)
+{
+	DaemonToController *resp = (DaemonToController *)protobuf_recv_message(
+		fd, &daemon_to_controller__descriptor);
+	IF_NULL_RETVAL(resp, -1);
+
+	ContainerEvent *event = resp->container_event;
+	bench_container_t *c = event ? bench_container_by_uuid(event->container_uuid) : NULL;
+	if (c && event->kind == CONTAINER_EVENT__KIND__STATE && event->status &&
+	    event->status->has_state) {
+		c->state = event->status->state;
+		if (c->pending) {
+			bench_op_t op = bench_sequence[c->step];
+			if (bench_ops[op].target && bench_ops[op].target == c->state)
+				bench_op_finish(c, true);
+		}
+	}
+
+	protobuf_free_message((ProtobufCMessage *)resp);
+	return 0;
+}
+
+static int
+bench_observer_new(void)
+{
+	int fd = bench_connect();
+	IF_TRUE_RETVAL(fd < 0, -1);
+
+	ContainerEvent__Kind kinds[] = { CONTAINER_EVENT__KIND__STATE };
+	ControllerToDaemon msg = CONTROLLER_TO_DAEMON__INIT;
+	msg.command = CONTROLLER_TO_DAEMON__COMMAND__OBSERVE_CONTAINERS;
+	msg.n_observe_kinds = 1;
+	msg.observe_kinds = kinds;
+	if (protobuf_send_message(fd, (ProtobufCMessage *)&msg) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * Builds the config of a benchmark container from the template, i.e., with its own name.
+ */
+static char *
+bench_config_new(ContainerConfig *template, const char *name)
+{
+	char *template_name = template->name;
+	template->name = (char *)name;
+	char *cfg = protobuf_c_text_to_string((ProtobufCMessage *)template, NULL);
+	template->name = template_name;
+	return cfg;
+}
+
+/******************************************************************************/
+
+static void
+bench_print_results(uint64_t duration_us, bench_sample_t *samples)
+{
+	printf("{\n  \"containers\": %zu,\n  \"duration_ms\": %" PRIu64 ",\n  \"operations\": [",
+	       n_containers, duration_us / 1000);
+	bool first = true;
+	for (int op = 0; op < BENCH_OP_COUNT; op++) {
+		bench_stats_t *stats = &bench_stats[op];
+		if (!stats->n && !stats->errors)
+			continue;
+		qsort(stats->latencies, stats->n, sizeof(uint64_t), bench_cmp_u64);
+		uint64_t sum = 0;
+		for (size_t i = 0; i < stats->n; i++)
+			sum += stats->latencies[i];
+#define BENCH_PCT(p) (stats->n ? stats->latencies[(stats->n - 1) * (p) / 100] / 1000.0 : 0)
+		printf("%s\n    { \"name\": \"%s\", \"count\": %zu, \"errors\": %zu, "
+		       "\"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f }",
+		       first ? "" : ",", bench_ops[op].name, stats->n, stats->errors,
+		       stats->n ? sum / 1000.0 / stats->n : 0, BENCH_PCT(50), BENCH_PCT(99),
+		       BENCH_PCT(100));
+#undef BENCH_PCT
+		first = false;
+	}
+	printf("\n  ],\n  \"daemon\": [");
+	first = true;
+	for (bench_sample_t *s = samples; s; s = s->next) {
+		printf("%s\n    { \"time_ms\": %" PRIu64 ", \"cpu_percent\": %.1f, "
+		       "\"rss_kb\": %" PRIu64 " }",
+		       first ? "" : ",", s->time, s->cpu, s->rss);
+		first = false;
+	}
+	printf("\n  ]\n}\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	logf_register(&logf_test_write, stderr);
+
+	size_t concurrency = BENCH_CONCURRENCY_DEFAULT;
+	size_t rounds = BENCH_ROUNDS_DEFAULT;
+	size_t execs = BENCH_EXECS_DEFAULT;
+	unsigned int interval = BENCH_SAMPLE_INTERVAL_DEFAULT;
+	pid_t daemon_pid = -1;
+
+	for (int c; -1 != (c = getopt(argc, argv, "s:n:j:r:e:x:k:p:i:t:h"));) {
+		switch (c) {
+		case 's':
+			socket_file = optarg;
+			break;
+		case 'n':
+			n_containers = strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			concurrency = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			rounds = strtoul(optarg, NULL, 10);
+			break;
+		case 'e':
+			execs = strtoul(optarg, NULL, 10);
+			break;
+		case 'x':
+			exec_command = optarg;
+			break;
+		case 'k':
+			start_key = optarg;
+			break;
+		case 'p':
+			daemon_pid = atoi(optarg);
+			break;
+		case 'i':
+			interval = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			timeout_ms = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || !n_containers || !concurrency || !interval)
+		print_usage(argv[0]);
+
+	if (!file_exists(socket_file))
+		FATAL("Could not find socket file %s. Aborting.", socket_file);
+
+	ContainerConfig *template = (ContainerConfig *)protobuf_message_new_from_textfile(
+		argv[optind], &container_config__descriptor);
+	if (!template)
+		FATAL("Failed to parse container config %s", argv[optind]);
+
+	if (daemon_pid < 0 && (daemon_pid = bench_find_daemon()) < 0)
+		WARN("Could not find the daemon process, its usage is not sampled");
+
+	// create, rounds of start, freeze, unfreeze, execs and stop, remove
+	bench_sequence_len = 2 + rounds * (4 + execs);
+	bench_sequence = mem_new(bench_op_t, bench_sequence_len);
+	size_t len = 0;
+	bench_sequence[len++] = BENCH_OP_CREATE;
+	for (size_t r = 0; r < rounds; r++) {
+		bench_sequence[len++] = BENCH_OP_START;
+		bench_sequence[len++] = BENCH_OP_FREEZE;
+		bench_sequence[len++] = BENCH_OP_UNFREEZE;
+		for (size_t e = 0; e < execs; e++)
+			bench_sequence[len++] = BENCH_OP_EXEC;
+		bench_sequence[len++] = BENCH_OP_STOP;
+	}
+	bench_sequence[len++] = BENCH_OP_REMOVE;
+
+	containers = mem_new0(bench_container_t, n_containers);
+	char **configs = mem_new0(char *, n_containers);
+	for (size_t i = 0; i < n_containers; i++) {
+		containers[i].name = mem_printf("bench-%zu", i);
+		containers[i].fd = -1;
+		configs[i] = bench_config_new(template, containers[i].name);
+	}
+
+	int observer = bench_observer_new();
+	if (observer < 0)
+		FATAL("Failed to observe containers");
+
+	struct pollfd *pfds = mem_new0(struct pollfd, n_containers + 1);
+	bench_sample_t *samples = NULL, **samples_tail = &samples;
+	uint64_t ticks_last = 0, rss;
+	long ticks_per_sec = sysconf(_SC_CLK_TCK);
+	if (daemon_pid > 0)
+		bench_proc_usage(daemon_pid, &ticks_last, &rss);
+
+	uint64_t begin = bench_now_us(), sampled = begin;
+	size_t next = 0; // round robin start of the search for containers to schedule
+	for (;;) {
+		// keep up to concurrency operations in flight, each container one at a time
+		size_t pending = 0, remaining = 0;
+		for (size_t i = 0; i < n_containers; i++) {
+			pending += containers[i].pending;
+			remaining += containers[i].step < bench_sequence_len;
+		}
+		if (!remaining)
+			break;
+		for (size_t k = 0; k < n_containers && pending < concurrency; k++) {
+			bench_container_t *c = &containers[(next + k) % n_containers];
+			if (c->pending || c->step >= bench_sequence_len)
+				continue;
+			size_t idx = c - containers;
+			bench_op_begin(c, (uint8_t *)configs[idx], strlen(configs[idx]));
+			pending += c->pending;
+		}
+		next = (next + 1) % n_containers;
+
+		nfds_t n = 0;
+		pfds[n++] = (struct pollfd){ .fd = observer, .events = POLLIN };
+		for (size_t i = 0; i < n_containers; i++)
+			pfds[n++] = (struct pollfd){ .fd = containers[i].fd, .events = POLLIN };
+
+		uint64_t now = bench_now_us();
+		int wait = interval - MIN((now - sampled) / 1000, interval);
+		if (poll(pfds, n, wait) < 0 && errno != EINTR)
+			FATAL_ERRNO("poll failed");
+
+		if ((pfds[0].revents & (POLLIN | POLLHUP)) && bench_observer_recv(observer) < 0)
+			FATAL("Lost the observer connection to the daemon");
+		for (size_t i = 0; i < n_containers; i++) {
+			bench_container_t *c = &containers[i];
+			if (c->fd >= 0 && pfds[i + 1].fd == c->fd &&
+			    (pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+				bench_op_recv(c);
+			if (c->pending && bench_now_us() - c->started > timeout_ms * 1000ULL) {
+				WARN("Operation %s on container %s timed out",
+				     bench_ops[bench_sequence[c->step]].name, c->name);
+				bench_op_finish(c, false);
+			}
+		}
+
+		now = bench_now_us();
+		if (now - sampled >= interval * 1000ULL) {
+			uint64_t ticks;
+			if (daemon_pid > 0 && !bench_proc_usage(daemon_pid, &ticks, &rss)) {
+				bench_sample_t *s = mem_new0(bench_sample_t, 1);
+				s->time = (now - begin) / 1000;
+				s->cpu = 100.0 * (ticks - ticks_last) / ticks_per_sec /
+					 ((now - sampled) / 1e6);
+				s->rss = rss;
+				*samples_tail = s;
+				samples_tail = &s->next;
+				ticks_last = ticks;
+			}
+			sampled = now;
+		}
+	}
+
+	bench_print_results(bench_now_us() - begin, samples);
+
+	close(observer);
+	while (samples) {
+		bench_sample_t *s = samples;
+		samples = s->next;
+		mem_free0(s);
+	}
+	for (size_t i = 0; i < n_containers; i++) {
+		mem_free0(containers[i].name);
+		mem_free0(containers[i].uuid);
+		free(configs[i]);
+	}
+	for (int op = 0; op < BENCH_OP_COUNT; op++)
+		mem_free0(bench_stats[op].latencies);
+	mem_free0(configs);
+	mem_free0(containers);
+	mem_free0(pfds);
+	mem_free0(bench_sequence);
+	protobuf_free_message((ProtobufCMessage *)template);
+
+	return 0;
+}
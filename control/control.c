@@ -24,9 +24,11 @@
 #ifdef ANDROID
 #include "device/fraunhofer/common/cml/control/control.pb-c.h"
 #include "device/fraunhofer/common/cml/control/container.pb-c.h"
+#include "device/fraunhofer/common/cml/common/logf.pb-c.h"
 #else
 #include "control.pb-c.h"
 #include "container.pb-c.h"
+#include "common/logf.pb-c.h"
 #endif
 
 //#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
@@ -38,9 +40,15 @@
 #include "common/mem.h"
 #include "common/uuid.h"
 
+#include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -50,6 +58,8 @@
 #define CONTROL_SOCKET SOCK_PATH(control)
 // clang-format on
 #define RUN_PATH "run"
+// maximum number of arguments of a command in batch mode
+#define BATCH_MAX_ARGS 64
 #define DEFAULT_KEY                                                                                \
 	"00000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
 
@@ -95,6 +105,9 @@ print_usage(const char *cmd)
 	       "        Freeze the specified container.\n\n");
 	printf("   unfreeze <container-uuid>\n"
 	       "        Unfreeze the specified container.\n\n");
+	printf("   checkpoint <container-uuid>\n"
+	       "        Checkpoint the processes of the specified container with CRIU and stop it.\n"
+	       "        Its next start restores them (requires checkpoint_size in its config).\n\n");
 	printf("   allow_audio <container-uuid>\n"
 	       "        Grant audio access to the specified container (cgroups).\n\n");
 	printf("   deny_audio <container-uuid>\n"
@@ -124,6 +137,50 @@ print_usage(const char *cmd)
 	       "        Prints the list of network interfaces assigned to the specified container.\n\n");
 	printf("   run <container-uuid> <command> [<arg_1> ... <arg_n>]\n"
 	       "        Runs the specified command with the given arguments inside the specified container.\n\n");
+	printf("   log_render <logfile>\n"
+	       "        Prints a binary log file written by logf_protobuf_write as text.\n"
+	       "        Does not require a running daemon.\n\n");
+	printf("   event_profile [start|stop|<count>]\n"
+	       "        Starts or stops profiling the callbacks of the daemon's event loop, or\n"
+	       "        prints the <count> (default 10) callbacks with the highest total run time.\n"
+	       "        Resolve the callback addresses with addr2line -f -e <cmld binary>.\n\n");
+	printf("   sampler start|stop [cmld|scd|tpm2d] [<hz> [<interval>]]\n"
+	       "        Starts or stops the sampling profiler of cmld (default), scd or tpm2d,\n"
+	       "        which takes <hz> (default 99) stack samples per second of cpu time and\n"
+	       "        writes them every <interval> (default 60) seconds in the folded format\n"
+	       "        of flamegraph.pl to /data/logs/<daemon>.folded (rotated).\n\n");
+	printf("   stats <container-uuid>\n"
+	       "        Prints the resource usage samples recorded for the specified container.\n\n");
+	printf("   start_traces <container-uuid>\n"
+	       "        Prints the timings of the start hooks and state transitions of the last\n"
+	       "        starts of the specified container, hooks of its child processes marked by '*'.\n\n");
+	printf("   audit_stats\n"
+	       "        Prints the counters of the daemon's reader for kernel audit messages,\n"
+	       "        including socket overruns in which audit messages were lost, and of the\n"
+	       "        delivery of audit records to the containers.\n\n");
+	printf("   uevent_stats\n"
+	       "        Prints the counters of the daemon's uevent handling, including socket\n"
+	       "        overruns in which uevents were lost and the time spent handling them.\n\n");
+	printf("   metrics\n"
+	       "        Prints the runtime metrics of the daemon in the Prometheus text\n"
+	       "        format.\n\n");
+	printf("   mem_stats\n"
+	       "        Prints the allocations of the daemon per call site, the sites with the\n"
+	       "        most live bytes first, if mem_accounting is enabled in the device\n"
+	       "        config.\n\n");
+	printf("   download_progress\n"
+	       "        Prints the progress of the running guestos image downloads.\n\n");
+	printf("   observe_pressure\n"
+	       "        Prints the stalls on cpu, memory and io of the device and the containers\n"
+	       "        as they occur, until interrupted.\n\n");
+	printf("   batch [<file>]\n"
+	       "        Runs the commands in file (stdin if omitted), one per line, over a single\n"
+	       "        connection. Container names are resolved only once. Lines starting with\n"
+	       "        '#' are skipped, run and observe commands are not supported. start and\n"
+	       "        stop need --key, unless a batch file is given.\n\n");
+	printf("   observe\n"
+	       "        Prints state changes, audit records and pressure stalls of the containers\n"
+	       "        as they occur, until interrupted.\n\n");
 	printf("\n");
 	exit(-1);
 }
@@ -184,41 +241,69 @@ get_container_usb_pin_entry(uuid_t *uuid, int sock)
 	return pin_entry;
 }
 
+// uuids and names of the containers as last received, reused by further commands in batch mode
+static DaemonToController *container_names = NULL;
+
+static void
+container_names_clear(void)
+{
+	if (container_names)
+		protobuf_free_message((ProtobufCMessage *)container_names);
+	container_names = NULL;
+}
+
+static uuid_t *
+container_names_lookup_new(const char *identifier)
+{
+	IF_NULL_RETVAL(container_names, NULL);
+
+	uuid_t *uuid = uuid_new(identifier);
+	if (uuid) {
+		for (size_t i = 0; i < container_names->n_container_status; ++i) {
+			TRACE("uuid %s", container_names->container_status[i]->uuid);
+			if (0 == strcmp(container_names->container_status[i]->uuid,
+					uuid_string(uuid)))
+				return uuid;
+		}
+		uuid_free(uuid);
+		return NULL;
+	}
+
+	INFO("Retrying with name");
+	for (size_t i = 0; i < container_names->n_container_status; ++i) {
+		const char *name = container_names->container_status[i]->name;
+		TRACE("name %s", name ? name : "");
+		if (name && 0 == strcmp(name, identifier))
+			return uuid_new(container_names->container_status[i]->uuid);
+	}
+	return NULL;
+}
+
 static uuid_t *
 get_container_uuid_new(const char *identifier, int sock)
 {
-	uuid_t *valid_uuid = NULL;
+	uuid_t *valid_uuid = container_names_lookup_new(identifier);
+	if (valid_uuid)
+		return valid_uuid;
+
+	// not known (yet), (re)load the names
+	container_names_clear();
+
 	ControllerToDaemon msg = CONTROLLER_TO_DAEMON__INIT;
 	msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_STATUS;
+	// only uuid and name are needed to resolve the identifier
+	ContainerStatusField fields[] = { CONTAINER_STATUS_FIELD__STATUS_UUID,
+					  CONTAINER_STATUS_FIELD__STATUS_NAME };
+	msg.n_status_fields = sizeof(fields) / sizeof(fields[0]);
+	msg.status_fields = fields;
 	send_message(sock, &msg);
 
-	DaemonToController *resp = recv_message(sock);
+	container_names = recv_message(sock);
 
-	uuid_t *uuid = uuid_new(identifier);
-	if (uuid) {
-		for (size_t i = 0; i < resp->n_container_status; ++i) {
-			TRACE("uuid %s", resp->container_status[i]->uuid);
-			if (0 == strcmp(resp->container_status[i]->uuid, uuid_string(uuid))) {
-				valid_uuid = uuid;
-				break;
-			}
-		}
-		if (valid_uuid == NULL)
-			uuid_free(uuid);
-	} else {
-		INFO("Retrying with name");
-		for (size_t i = 0; i < resp->n_container_status; ++i) {
-			TRACE("name %s", resp->container_status[i]->name);
-			if (0 == strcmp(resp->container_status[i]->name, identifier)) {
-				valid_uuid = uuid_new(resp->container_status[i]->uuid);
-				break;
-			}
-		}
-	}
+	valid_uuid = container_names_lookup_new(identifier);
 	if (!valid_uuid)
 		FATAL("Container with provided uuid/name does not exist!");
 
-	protobuf_free_message((ProtobufCMessage *)resp);
 	return valid_uuid;
 }
 
@@ -263,36 +348,124 @@ get_password_new(const char *prompt)
 	return mem_strdup(buf);
 }
 
-int
-main(int argc, char *argv[])
+static void
+print_event_profile(const DaemonToController *resp, size_t top)
 {
-	logf_register(&logf_test_write, stderr);
+	size_t n = MIN(resp->n_event_profile_stats, top);
+
+	printf("%-8s %-18s %10s %14s %12s %10s\n", "type", "func", "count", "total [us]",
+	       "max [us]", "avg [us]");
+	for (size_t i = 0; i < n; i++) {
+		const EventProfileStat *stat = resp->event_profile_stats[i];
+		uint64_t avg = stat->count ? stat->total_ns / stat->count : 0;
+
+		printf("%-8s 0x%016" PRIx64 " %10" PRIu64 " %14" PRIu64 " %12" PRIu64 " %10" PRIu64
+		       "\n",
+		       stat->type, stat->func, stat->count, stat->total_ns / 1000,
+		       stat->max_ns / 1000, avg / 1000);
+
+		printf("         histogram:");
+		for (size_t b = 0; b < stat->n_histogram; b++) {
+			if (!stat->histogram[b])
+				continue;
+			if (b == 0)
+				printf(" <1us:%" PRIu64, stat->histogram[b]);
+			else if (b == stat->n_histogram - 1)
+				printf(" >=%" PRIu64 "us:%" PRIu64, (uint64_t)1 << (b - 1),
+				       stat->histogram[b]);
+			else
+				printf(" <%" PRIu64 "us:%" PRIu64, (uint64_t)1 << b,
+				       stat->histogram[b]);
+		}
+		printf("\n");
+	}
+}
 
-	const char *socket_file = CONTROL_SOCKET;
-	uuid_t *uuid = NULL;
-	int sock = 0;
-	bool has_container_start_params_key = false;
+static void
+print_container_stats(const ContainerStats *stats)
+{
+	printf("%-14s %14s %12s %14s %14s %8s %14s\n", "time [ms]", "cpu [ms]", "mem [KiB]",
+	       "io read [KiB]", "io write [KiB]", "pids", "ksm [KiB]");
+	for (size_t i = 0; i < stats->n_samples; i++) {
+		const ContainerStatsSample *s = stats->samples[i];
+		printf("%-14" PRIu64 " %14" PRIu64 " %12" PRIu64 " %14" PRIu64 " %14" PRIu64
+		       " %8" PRIu64 " %14" PRIu64 "\n",
+		       s->time, s->cpu_usage_ns / 1000000, s->mem_usage / 1024,
+		       s->io_read_bytes / 1024, s->io_write_bytes / 1024, s->pids,
+		       s->ksm_merged_bytes / 1024);
+	}
+}
 
-	struct termios termios_before;
-	tcgetattr(STDIN_FILENO, &termios_before);
+static void
+print_container_start_traces(const DaemonToController *resp)
+{
+	for (size_t i = 0; i < resp->n_container_start_traces; i++) {
+		const ContainerStartTrace *trace = resp->container_start_traces[i];
+		printf("start at %" PRIu64 " ms\n", trace->time);
+		printf("  %12s %12s  %s\n", "begin [us]", "took [us]", "hook / state");
+		for (size_t j = 0; j < trace->n_events; j++) {
+			const ContainerStartTraceEvent *e = trace->events[j];
+			if (e->hook) {
+				printf("  %12" PRIu64 " %12" PRIu64 " %c%s\n", e->begin_ns / 1000,
+				       e->duration_ns / 1000, e->child ? '*' : ' ', e->hook);
+			} else {
+				const ProtobufCEnumValue *state =
+					protobuf_c_enum_descriptor_get_value(
+						&container_state__descriptor, e->state);
+				printf("  %12" PRIu64 " %12s  -> %s\n", e->begin_ns / 1000, "",
+				       state ? state->name : "?");
+			}
+		}
+	}
+}
 
-	for (int c, option_index = 0;
-	     - 1 != (c = getopt_long(argc, argv, "+s:h", global_options, &option_index));) {
-		switch (c) {
-		case 's':
-			socket_file = optarg;
-			break;
-		default: // includes cases 'h' and '?'
-			print_usage(argv[0]);
+static void
+log_render(const char *logfile)
+{
+	int fd = open(logfile, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		FATAL_ERRNO("Could not open log file %s", logfile);
+
+	LogMessage *record;
+	while ((record = (LogMessage *)protobuf_recv_message(fd, &log_message__descriptor))) {
+		if (record->has_timestamp) {
+			char buf1[64], buf2[64];
+			time_t sec = record->timestamp / 1000000;
+			struct tm *tm = localtime(&sec);
+			if (tm && strftime(buf1, sizeof(buf1), "%Y-%m-%dT%H:%M:%S", tm) &&
+			    strftime(buf2, sizeof(buf2), "%z", tm))
+				printf("%s.%06u%s ", buf1, (unsigned)(record->timestamp % 1000000),
+				       buf2);
 		}
+		if (record->has_pid)
+			printf("[%u] ", record->pid);
+		// LogPriority uses the values of logf_prio_t
+		printf("%s ", logf_prio_to_string((logf_prio_t)record->prio));
+		if (record->uuid)
+			printf("%s ", record->uuid);
+		if (record->file)
+			printf("%s+%u: ", record->file, record->line);
+		printf("%s\n", record->msg);
+
+		protobuf_free_message((ProtobufCMessage *)record);
 	}
+	close(fd);
+}
 
-	if (!file_exists(socket_file))
-		FATAL("Could not find socket file %s. Aborting.\n", socket_file);
+/**
+ * Runs the command argv[optind] with its arguments over the connection *sock_p, which
+ * is established first if *sock_p is 0. The connection is left open for further commands.
+ */
+static void
+run_command(const char *socket_file, int *sock_p, int argc, char *argv[])
+{
+	uuid_t *uuid = NULL;
+	int sock = *sock_p;
+	bool has_container_start_params_key = false;
+	size_t event_profile_top = 10;
 
-	// need at least one more argument (i.e. command string)
-	if (optind >= argc)
-		print_usage(argv[0]);
+	struct termios termios_before;
+	tcgetattr(STDIN_FILENO, &termios_before);
 
 	// build ControllerToDaemon message
 	ControllerToDaemon msg = CONTROLLER_TO_DAEMON__INIT;
@@ -403,6 +576,93 @@ main(int argc, char *argv[])
 		msg.guestos_rootcert.data = ca_cert;
 		goto send_message;
 	}
+	if (!strcasecmp(command, "event_profile")) {
+		if (optind < argc - 1)
+			print_usage(argv[0]);
+
+		if (optind == argc) {
+			msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_EVENT_PROFILE;
+		} else if (!strcasecmp(argv[optind], "start")) {
+			msg.command = CONTROLLER_TO_DAEMON__COMMAND__EVENT_PROFILE_START;
+		} else if (!strcasecmp(argv[optind], "stop")) {
+			msg.command = CONTROLLER_TO_DAEMON__COMMAND__EVENT_PROFILE_STOP;
+		} else {
+			char *end;
+			event_profile_top = strtoul(argv[optind], &end, 10);
+			if (*end != '\0')
+				print_usage(argv[0]);
+			msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_EVENT_PROFILE;
+		}
+		goto send_message;
+	}
+	if (!strcasecmp(command, "sampler")) {
+		if (optind == argc || optind < argc - 4)
+			print_usage(argv[0]);
+
+		if (!strcasecmp(argv[optind], "start"))
+			msg.command = CONTROLLER_TO_DAEMON__COMMAND__SAMPLER_START;
+		else if (!strcasecmp(argv[optind], "stop"))
+			msg.command = CONTROLLER_TO_DAEMON__COMMAND__SAMPLER_STOP;
+		else
+			print_usage(argv[0]);
+		optind++;
+
+		if (optind < argc) {
+			const char *target = argv[optind++];
+			msg.has_sampler_target = true;
+			if (!strcasecmp(target, "cmld"))
+				msg.sampler_target = CONTROLLER_TO_DAEMON__SAMPLER_TARGET__CMLD;
+			else if (!strcasecmp(target, "scd"))
+				msg.sampler_target = CONTROLLER_TO_DAEMON__SAMPLER_TARGET__SCD;
+			else if (!strcasecmp(target, "tpm2d"))
+				msg.sampler_target = CONTROLLER_TO_DAEMON__SAMPLER_TARGET__TPM2D;
+			else
+				print_usage(argv[0]);
+		}
+		if (optind < argc) {
+			char *end;
+			msg.has_sampler_hz = true;
+			msg.sampler_hz = strtoul(argv[optind++], &end, 10);
+			if (*end != '\0')
+				print_usage(argv[0]);
+		}
+		if (optind < argc) {
+			char *end;
+			msg.has_sampler_interval = true;
+			msg.sampler_interval = strtoul(argv[optind++], &end, 10);
+			if (*end != '\0')
+				print_usage(argv[0]);
+		}
+		goto send_message;
+	}
+	if (!strcasecmp(command, "audit_stats")) {
+		msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_AUDIT_STATS;
+		goto send_message;
+	}
+	if (!strcasecmp(command, "uevent_stats")) {
+		msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_UEVENT_STATS;
+		goto send_message;
+	}
+	if (!strcasecmp(command, "metrics")) {
+		msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_METRICS;
+		goto send_message;
+	}
+	if (!strcasecmp(command, "mem_stats")) {
+		msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_MEM_STATS;
+		goto send_message;
+	}
+	if (!strcasecmp(command, "download_progress")) {
+		msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_DOWNLOAD_PROGRESS;
+		goto send_message;
+	}
+	if (!strcasecmp(command, "observe_pressure")) {
+		msg.command = CONTROLLER_TO_DAEMON__COMMAND__OBSERVE_PRESSURE;
+		goto send_message;
+	}
+	if (!strcasecmp(command, "observe")) {
+		msg.command = CONTROLLER_TO_DAEMON__COMMAND__OBSERVE_CONTAINERS;
+		goto send_message;
+	}
 	if (!strcasecmp(command, "pull_csr")) {
 		// need exactly one more argument (certificate file)
 		if (optind != argc - 1)
@@ -490,7 +750,8 @@ main(int argc, char *argv[])
 	if (optind >= argc)
 		print_usage(argv[0]);
 
-	sock = sock_connect(socket_file);
+	if (!sock)
+		sock = sock_connect(socket_file);
 	uuid = get_container_uuid_new(argv[optind], sock);
 
 	ContainerStartParams container_start_params = CONTAINER_START_PARAMS__INIT;
@@ -574,6 +835,8 @@ main(int argc, char *argv[])
 		msg.command = CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_WIPE;
 	} else if (!strcasecmp(command, "snapshot")) {
 		msg.command = CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_SNAPSHOT;
+	} else if (!strcasecmp(command, "checkpoint")) {
+		msg.command = CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_CHECKPOINT;
 	} else if (!strcasecmp(command, "allow_audio")) {
 		msg.command = CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_ALLOWAUDIO;
 	} else if (!strcasecmp(command, "deny_audio")) {
@@ -630,6 +893,10 @@ main(int argc, char *argv[])
 			msg.container_config_certificate.len = certlen;
 			msg.container_config_certificate.data = cert;
 		}
+	} else if (!strcasecmp(command, "stats")) {
+		msg.command = CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_GET_STATS;
+	} else if (!strcasecmp(command, "start_traces")) {
+		msg.command = CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_GET_START_TRACES;
 	} else if (!strcasecmp(command, "ifaces")) {
 		msg.command = CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_LIST_IFACES;
 	} else if (!strcasecmp(command, "assign_iface") || !strcasecmp(command, "unassign_iface")) {
@@ -756,15 +1023,14 @@ send_message:
 			TRACE("[CLIENT] User input reading child forked, PID: %i", getpid());
 
 			char buf[128];
-			unsigned int count;
+			ssize_t count;
 
 			while (1) {
 				TRACE("[CLIENT] Trying to read input for exec'ed process");
 
-				if ((count = read(STDIN_FILENO, buf, 127)) > 0) {
-					buf[count] = 0;
-
-					TRACE("[CLIENT] Got input for exec'ed process: %s", buf);
+				if ((count = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+					TRACE("[CLIENT] Got %zd bytes of input for exec'ed process",
+					      count);
 
 					ControllerToDaemon inputmsg = CONTROLLER_TO_DAEMON__INIT;
 					inputmsg.container_uuids = mem_new(char *, 1);
@@ -772,7 +1038,9 @@ send_message:
 					inputmsg.n_container_uuids = 1;
 					inputmsg.command =
 						CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_EXEC_INPUT;
-					inputmsg.exec_input = buf;
+					inputmsg.has_exec_data = true;
+					inputmsg.exec_data.data = (uint8_t *)buf;
+					inputmsg.exec_data.len = count;
 
 					TRACE("[CLIENT] Sending input for exec'ed process in container %s",
 					      argv[optind]);
@@ -840,6 +1108,107 @@ handle_resp:
 			INFO("device csr written to %s", dev_csr_file);
 		}
 	} break;
+	case DAEMON_TO_CONTROLLER__CODE__EVENT_PROFILE: {
+		print_event_profile(resp, event_profile_top);
+	} break;
+	case DAEMON_TO_CONTROLLER__CODE__CONTAINER_STATS: {
+		if (resp->container_stats)
+			print_container_stats(resp->container_stats);
+	} break;
+	case DAEMON_TO_CONTROLLER__CODE__CONTAINER_START_TRACES: {
+		print_container_start_traces(resp);
+	} break;
+	case DAEMON_TO_CONTROLLER__CODE__AUDIT_STATS: {
+		if (!resp->audit_stats)
+			break;
+		printf("messages:  %" PRIu64 "\n", resp->audit_stats->messages);
+		printf("batches:   %" PRIu64 "\n", resp->audit_stats->batches);
+		printf("max_batch: %" PRIu64 "\n", resp->audit_stats->max_batch);
+		printf("enobufs:   %" PRIu64 "\n", resp->audit_stats->enobufs);
+		printf("invalid:   %" PRIu64 "\n", resp->audit_stats->invalid);
+		printf("records:   %" PRIu64 "\n", resp->audit_stats->records);
+		printf("dropped:   %" PRIu64 "\n", resp->audit_stats->dropped);
+		printf("spilled:   %" PRIu64 "\n", resp->audit_stats->spilled);
+		printf("sent:      %" PRIu64 "\n", resp->audit_stats->sent);
+		printf("acked:     %" PRIu64 "\n", resp->audit_stats->acked);
+		printf("ack_rtt:   %.1f us mean, %.1f us max\n",
+		       resp->audit_stats->acks ?
+			       resp->audit_stats->ack_rtt_ns / 1000.0 / resp->audit_stats->acks :
+			       0,
+		       resp->audit_stats->max_ack_rtt_ns / 1000.0);
+		printf("backlog:   %" PRIu64 " bytes\n", resp->audit_stats->backlog_bytes);
+	} break;
+	case DAEMON_TO_CONTROLLER__CODE__UEVENT_STATS: {
+		UeventStats *stats = resp->uevent_stats;
+		if (!stats)
+			break;
+		printf("messages:  %" PRIu64 "\n", stats->messages);
+		printf("batches:   %" PRIu64 "\n", stats->batches);
+		printf("max_batch: %" PRIu64 "\n", stats->max_batch);
+		printf("enobufs:   %" PRIu64 "\n", stats->enobufs);
+		printf("invalid:   %" PRIu64 "\n", stats->invalid);
+		printf("mean_us:   %.1f\n",
+		       stats->messages ? stats->handle_ns / 1000.0 / stats->messages : 0);
+		printf("max_us:    %.1f\n", stats->max_handle_ns / 1000.0);
+	} break;
+	case DAEMON_TO_CONTROLLER__CODE__MEM_STATS: {
+		if (resp->mem_stats)
+			fputs(resp->mem_stats, stdout);
+	} break;
+	case DAEMON_TO_CONTROLLER__CODE__METRICS: {
+		if (resp->metrics)
+			fputs(resp->metrics, stdout);
+	} break;
+	case DAEMON_TO_CONTROLLER__CODE__DOWNLOAD_PROGRESS: {
+		if (!resp->n_download_progress)
+			printf("No downloads running\n");
+		for (size_t i = 0; i < resp->n_download_progress; i++) {
+			DownloadProgress *p = resp->download_progress[i];
+			if (p->size > 0)
+				printf("%s: %" PRIu64 "/%" PRId64 " bytes (%" PRIu64 "%%)\n", p->url,
+				       p->received, p->size, p->received * 100 / p->size);
+			else
+				printf("%s: %" PRIu64 " bytes\n", p->url, p->received);
+		}
+	} break;
+	case DAEMON_TO_CONTROLLER__CODE__PRESSURE_EVENT: {
+		PressureEvent *p = resp->pressure_event;
+		if (p) {
+			const char *resource = "io";
+			if (p->resource == PRESSURE_EVENT__RESOURCE__CPU)
+				resource = "cpu";
+			else if (p->resource == PRESSURE_EVENT__RESOURCE__MEMORY)
+				resource = "memory";
+			printf("%s %s %s: avg10=%.2f%% avg60=%.2f%%%s%s\n",
+			       p->container_uuid ? p->container_uuid : "host", resource,
+			       p->full ? "full" : "some", p->avg10, p->avg60,
+			       p->action ? " -> " : "", p->action ? p->action : "");
+			fflush(stdout);
+		}
+		// keep observing until the connection is closed
+		protobuf_free_message((ProtobufCMessage *)resp);
+		goto handle_resp;
+	} break;
+	case DAEMON_TO_CONTROLLER__CODE__CONTAINER_EVENT: {
+		ContainerEvent *e = resp->container_event;
+		const char *uuid = e && e->container_uuid ? e->container_uuid : "host";
+		if (e && e->kind == CONTAINER_EVENT__KIND__STATE && e->status) {
+			const ProtobufCEnumValue *state = protobuf_c_enum_descriptor_get_value(
+				&container_state__descriptor, e->status->state);
+			printf("%s state %s\n", uuid, state ? state->name : "?");
+		} else if (e && e->kind == CONTAINER_EVENT__KIND__REMOVED) {
+			printf("%s removed\n", uuid);
+		} else if (e && e->kind == CONTAINER_EVENT__KIND__AUDIT) {
+			printf("%s audit record (%zu bytes)\n", uuid, e->audit_record.len);
+		} else if (e && e->kind == CONTAINER_EVENT__KIND__PRESSURE && e->pressure) {
+			printf("%s pressure %s avg10=%.2f%%\n", uuid,
+			       e->pressure->full ? "full" : "some", e->pressure->avg10);
+		}
+		fflush(stdout);
+		// keep observing until the connection is closed
+		protobuf_free_message((ProtobufCMessage *)resp);
+		goto handle_resp;
+	} break;
 	case DAEMON_TO_CONTROLLER__CODE__RESPONSE: {
 		if (!resp->has_response)
 			break;
@@ -860,7 +1229,7 @@ handle_resp:
 	protobuf_free_message((ProtobufCMessage *)resp);
 
 exit:
-	close(sock);
+	*sock_p = sock;
 	tcsetattr(STDIN_FILENO, TCSAFLUSH, &termios_before);
 
 	if (msg.has_container_config_file)
@@ -889,5 +1258,102 @@ exit:
 	if (uuid)
 		uuid_free(uuid);
 
+	// containers may have been added, removed or renamed
+	if (!strcasecmp(command, "create") || !strcasecmp(command, "remove") ||
+	    !strcasecmp(command, "update_config") || !strcasecmp(command, "reload"))
+		container_names_clear();
+}
+
+/**
+ * Runs the commands in file (stdin if NULL), one per line with whitespace separated
+ * arguments, over a single connection. Empty lines and lines starting with '#' are
+ * skipped. Commands which take over the connection or the terminal are refused.
+ */
+static void
+run_batch(const char *socket_file, int *sock, char *progname, const char *file)
+{
+	FILE *in = file ? fopen(file, "r") : stdin;
+	if (!in)
+		FATAL_ERRNO("Could not open batch file %s", file);
+
+	char *line = NULL;
+	size_t size = 0;
+	for (unsigned lineno = 1; getline(&line, &size, in) >= 0; lineno++) {
+		char *args[BATCH_MAX_ARGS + 1] = { progname };
+		int n = 1;
+		char *save = NULL;
+		for (char *tok = strtok_r(line, " \t\r\n", &save); tok;
+		     tok = strtok_r(NULL, " \t\r\n", &save)) {
+			if (n == 1 && tok[0] == '#')
+				break;
+			if (n == BATCH_MAX_ARGS)
+				FATAL("Too many arguments in line %u of batch", lineno);
+			args[n++] = tok;
+		}
+		if (n == 1)
+			continue;
+
+		if (!strcasecmp(args[1], "batch") || !strcasecmp(args[1], "run") ||
+		    !strcasecmp(args[1], "observe") || !strcasecmp(args[1], "observe_pressure") ||
+		    !strcasecmp(args[1], "log_render"))
+			FATAL("Command %s in line %u is not supported in batch mode", args[1],
+			      lineno);
+
+		TRACE("[CLIENT] Running batch line %u: %s", lineno, args[1]);
+		optind = 1;
+		run_command(socket_file, sock, n, args);
+	}
+
+	free(line);
+	if (file)
+		fclose(in);
+}
+
+int
+main(int argc, char *argv[])
+{
+	logf_register(&logf_test_write, stderr);
+
+	const char *socket_file = CONTROL_SOCKET;
+	int sock = 0;
+
+	for (int c, option_index = 0;
+	     - 1 != (c = getopt_long(argc, argv, "+s:h", global_options, &option_index));) {
+		switch (c) {
+		case 's':
+			socket_file = optarg;
+			break;
+		default: // includes cases 'h' and '?'
+			print_usage(argv[0]);
+		}
+	}
+
+	// need at least one more argument (i.e. command string)
+	if (optind >= argc)
+		print_usage(argv[0]);
+
+	// offline commands which do not talk to the daemon
+	if (!strcasecmp(argv[optind], "log_render")) {
+		if (optind != argc - 2)
+			print_usage(argv[0]);
+		log_render(argv[optind + 1]);
+		return 0;
+	}
+
+	if (!file_exists(socket_file))
+		FATAL("Could not find socket file %s. Aborting.\n", socket_file);
+
+	if (!strcasecmp(argv[optind], "batch")) {
+		if (optind < argc - 2)
+			print_usage(argv[0]);
+		run_batch(socket_file, &sock, argv[0], optind == argc - 2 ? argv[optind + 1] : NULL);
+	} else {
+		run_command(socket_file, &sock, argc, argv);
+	}
+
+	if (sock)
+		close(sock);
+	container_names_clear();
+
 	return 0;
 }
@@ -0,0 +1,460 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file uevent.c
+ *
+ * Records the kernel uevents of the device to a file and replays such recordings,
+ * e.g., of a coldboot or of plugging a populated usb hub, at configurable rates to
+ * test and benchmark the uevent handling of the cml-daemon without the hardware.
+ *
+ * The daemon drops kernel uevents which were not sent by the kernel, thus a replay
+ * is only accepted by a debug build of the daemon after registering the port of the
+ * replaying socket with UEVENT_REPLAY_SOURCE, which the benchmark mode does.
+ */
+
+#include "control.pb-c.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/protobuf.h"
+#include "common/sock.h"
+#include "common/file.h"
+
+#include <linux/netlink.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// clang-format off
+#define CONTROL_SOCKET SOCK_PATH(control)
+// clang-format on
+
+// multicast group of uevents sent by the kernel
+#define UEVENT_GROUP_KERNEL 1
+
+#define UEVENT_MSG_LEN 8192
+// large enough to record a coldboot without losing uevents
+#define UEVENT_RECORD_RCVBUF (16 * 1024 * 1024)
+
+// the daemon is considered done if it did not handle a replayed uevent for this long
+#define UEVENT_BENCH_IDLE 1000	    // ms
+#define UEVENT_BENCH_POLL 100	    // ms
+#define UEVENT_BENCH_TIMEOUT 60000 // ms
+
+// same layout as the histogram of event.h
+#define UEVENT_HISTOGRAM_BUCKETS 20
+
+/**
+ * Header of each uevent in a recording, followed by the raw message of len bytes.
+ */
+typedef struct {
+	uint64_t time_us; // since the start of the recording
+	uint32_t len;
+} uevent_record_t;
+
+static volatile sig_atomic_t stop = 0;
+
+static void
+print_usage(const char *cmd)
+{
+	printf("\n");
+	printf("Usage: %s [-s <socket file>] <command> [options] <file>\n", cmd);
+	printf("\n");
+	printf("commands:\n");
+	printf("   record <file>\n"
+	       "        Records the kernel uevents to file until interrupted, e.g., while\n"
+	       "        running 'udevadm trigger --action=add' or plugging a usb hub.\n\n");
+	printf("   replay [-r <rate>] [-l <loops>] [-b] <file>\n"
+	       "        Sends the recorded uevents to the uevent multicast group with their\n"
+	       "        recorded timing, or at <rate> uevents per second (0: as fast as possible),\n"
+	       "        <loops> times. With -b, the daemon accepts the replay (debug builds only)\n"
+	       "        and the drops and handling times of the daemon are reported as JSON.\n\n");
+	exit(-1);
+}
+
+static void
+handle_signal(UNUSED int signum)
+{
+	stop = 1;
+}
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+sleep_until_us(uint64_t time_us)
+{
+	struct timespec ts = { .tv_sec = time_us / 1000000, .tv_nsec = (time_us % 1000000) * 1000 };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !stop)
+		;
+}
+
+static int
+uevent_sock_new(uint32_t groups)
+{
+	int sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (sock < 0) {
+		ERROR_ERRNO("Could not create uevent netlink socket");
+		return -1;
+	}
+
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = groups };
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		ERROR_ERRNO("Could not bind uevent netlink socket");
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/******************************************************************************/
+
+static int
+uevent_record(const char *file)
+{
+	int sock = uevent_sock_new(UEVENT_GROUP_KERNEL);
+	IF_TRUE_RETVAL(sock < 0, -1);
+
+	int rcvbuf = UEVENT_RECORD_RCVBUF;
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
+		WARN_ERRNO("Could not enlarge the receive buffer, uevents may be lost");
+
+	FILE *out = fopen(file, "w");
+	if (!out) {
+		ERROR_ERRNO("Could not open %s", file);
+		close(sock);
+		return -1;
+	}
+
+	char buf[UEVENT_MSG_LEN];
+	uint64_t start = 0;
+	unsigned int count = 0, lost = 0;
+	while (!stop) {
+		struct sockaddr_nl addr;
+		socklen_t addr_len = sizeof(addr);
+		ssize_t len = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&addr,
+				       &addr_len);
+		if (len < 0) {
+			if (errno == ENOBUFS)
+				lost++;
+			else if (errno != EINTR)
+				WARN_ERRNO("Could not receive uevent");
+			continue;
+		}
+		// only record uevents of the kernel
+		if (addr.nl_pid != 0)
+			continue;
+
+		uint64_t now = now_us();
+		if (!count)
+			start = now;
+		uevent_record_t record = { .time_us = now - start, .len = len };
+		if (fwrite(&record, sizeof(record), 1, out) != 1 || fwrite(buf, len, 1, out) != 1) {
+			ERROR_ERRNO("Could not write to %s", file);
+			break;
+		}
+		count++;
+	}
+
+	fclose(out);
+	close(sock);
+
+	INFO("Recorded %u uevents to %s", count, file);
+	if (lost)
+		WARN("The receive buffer overran %u times, uevents were lost", lost);
+	return 0;
+}
+
+/******************************************************************************/
+
+/**
+ * Sends msg on the control connection and returns the response, NULL on failure.
+ */
+static DaemonToController *
+uevent_bench_request(int ctl, ControllerToDaemon *msg)
+{
+	if (protobuf_send_message(ctl, (ProtobufCMessage *)msg) < 0) {
+		ERROR("Could not send command to the daemon");
+		return NULL;
+	}
+	return (DaemonToController *)protobuf_recv_message(ctl, &daemon_to_controller__descriptor);
+}
+
+static int
+uevent_bench_set_source(int ctl, uint32_t port)
+{
+	ControllerToDaemon msg = CONTROLLER_TO_DAEMON__INIT;
+	msg.command = CONTROLLER_TO_DAEMON__COMMAND__UEVENT_REPLAY_SOURCE;
+	msg.has_uevent_replay_port = true;
+	msg.uevent_replay_port = port;
+
+	DaemonToController *resp = uevent_bench_request(ctl, &msg);
+	IF_NULL_RETVAL(resp, -1);
+	int ret = resp->has_response && resp->response == DAEMON_TO_CONTROLLER__RESPONSE__CMD_OK ?
+			  0 :
+			  -1;
+	protobuf_free_message((ProtobufCMessage *)resp);
+	return ret;
+}
+
+static UeventStats *
+uevent_bench_get_stats(int ctl)
+{
+	ControllerToDaemon msg = CONTROLLER_TO_DAEMON__INIT;
+	msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_UEVENT_STATS;
+
+	DaemonToController *resp = uevent_bench_request(ctl, &msg);
+	IF_NULL_RETVAL(resp, NULL);
+	UeventStats *stats = resp->uevent_stats;
+	if (!stats || stats->n_histogram != UEVENT_HISTOGRAM_BUCKETS) {
+		ERROR("Unexpected response to GET_UEVENT_STATS");
+		protobuf_free_message((ProtobufCMessage *)resp);
+		return NULL;
+	}
+	// keep the stats only
+	resp->uevent_stats = NULL;
+	protobuf_free_message((ProtobufCMessage *)resp);
+	return stats;
+}
+
+/**
+ * Returns the upper bound in us of the bucket which contains the given percentile of the
+ * difference of the histograms.
+ */
+static uint64_t
+uevent_bench_percentile(const UeventStats *before, const UeventStats *after, uint64_t count,
+			unsigned int percentile)
+{
+	uint64_t rank = (count * percentile + 99) / 100, sum = 0;
+	for (unsigned int i = 0; i < UEVENT_HISTOGRAM_BUCKETS; i++) {
+		sum += after->histogram[i] - before->histogram[i];
+		if (sum >= rank && sum)
+			return 1ULL << i;
+	}
+	return 0;
+}
+
+static void
+uevent_bench_print(uint64_t sent, uint64_t send_us, uint64_t drain_us, const UeventStats *before,
+		   const UeventStats *after)
+{
+	uint64_t handled = after->messages - before->messages;
+	uint64_t invalid = after->invalid - before->invalid;
+	uint64_t lost = sent > handled + invalid ? sent - handled - invalid : 0;
+
+	printf("{\n  \"sent\": %" PRIu64 ",\n  \"send_ms\": %.1f,\n  \"send_rate\": %.0f,\n", sent,
+	       send_us / 1000.0, send_us ? sent * 1e6 / send_us : 0);
+	printf("  \"handled\": %" PRIu64 ",\n  \"invalid\": %" PRIu64 ",\n  \"lost\": %" PRIu64
+	       ",\n  \"drop_rate\": %.4f,\n  \"enobufs\": %" PRIu64 ",\n",
+	       handled, invalid, lost, sent ? (double)lost / sent : 0,
+	       after->enobufs - before->enobufs);
+	printf("  \"drain_ms\": %.1f,\n  \"max_batch\": %" PRIu64 ",\n", drain_us / 1000.0,
+	       after->max_batch);
+	printf("  \"handle_mean_us\": %.1f,\n  \"handle_p50_us\": %" PRIu64
+	       ",\n  \"handle_p99_us\": %" PRIu64 ",\n  \"handle_max_us\": %.1f\n}\n",
+	       handled ? (after->handle_ns - before->handle_ns) / 1000.0 / handled : 0,
+	       uevent_bench_percentile(before, after, handled, 50),
+	       uevent_bench_percentile(before, after, handled, 99), after->max_handle_ns / 1000.0);
+}
+
+/******************************************************************************/
+
+static int
+uevent_replay(const char *file, const char *socket_file, double rate, unsigned int loops,
+	      bool bench)
+{
+	off_t size = file_size(file);
+	if (size <= 0) {
+		ERROR("Could not read recording %s", file);
+		return -1;
+	}
+	char *recording = mem_alloc(size);
+	if (file_read(file, recording, size) != size) {
+		ERROR("Could not read recording %s", file);
+		mem_free0(recording);
+		return -1;
+	}
+
+	int ret = -1, ctl = -1;
+	UeventStats *before = NULL, *after = NULL;
+	int sock = uevent_sock_new(0);
+	IF_TRUE_GOTO(sock < 0, out);
+
+	struct sockaddr_nl local;
+	socklen_t local_len = sizeof(local);
+	if (getsockname(sock, (struct sockaddr *)&local, &local_len) < 0) {
+		ERROR_ERRNO("Could not get netlink port");
+		goto out;
+	}
+
+	if (bench) {
+		if ((ctl = sock_unix_create_and_connect(SOCK_STREAM, socket_file)) < 0) {
+			ERROR("Failed to connect to %s", socket_file);
+			goto out;
+		}
+		if (uevent_bench_set_source(ctl, local.nl_pid) < 0) {
+			ERROR("The daemon does not accept replayed uevents (no debug build?)");
+			goto out;
+		}
+		IF_NULL_GOTO(before = uevent_bench_get_stats(ctl), out);
+	}
+
+	struct sockaddr_nl dest = { .nl_family = AF_NETLINK, .nl_groups = UEVENT_GROUP_KERNEL };
+	uint64_t sent = 0, start = now_us(), recorded_us = 0;
+	for (unsigned int loop = 0; loop < loops && !stop; loop++) {
+		uint64_t loop_start = now_us() - start, last_us = 0;
+		for (off_t pos = 0; pos + (off_t)sizeof(uevent_record_t) <= size && !stop;) {
+			uevent_record_t record;
+			memcpy(&record, recording + pos, sizeof(record));
+			pos += sizeof(record);
+			if (record.len > size - pos) {
+				WARN("Recording %s is truncated", file);
+				break;
+			}
+
+			if (rate > 0)
+				sleep_until_us(start + (uint64_t)(sent * 1e6 / rate));
+			else if (rate < 0)
+				sleep_until_us(start + loop_start + record.time_us);
+			last_us = record.time_us;
+
+			if (sendto(sock, recording + pos, record.len, 0, (struct sockaddr *)&dest,
+				   sizeof(dest)) < 0)
+				WARN_ERRNO("Could not send uevent");
+			else
+				sent++;
+			pos += record.len;
+		}
+		recorded_us += last_us;
+	}
+	uint64_t send_us = now_us() - start;
+	INFO("Replayed %" PRIu64 " uevents in %" PRIu64 " ms (recorded: %" PRIu64 " ms)", sent,
+	     send_us / 1000, recorded_us / 1000);
+
+	if (bench) {
+		// wait until the daemon handled the backlog of the socket
+		uint64_t drained = now_us(), handled = before->messages + before->invalid;
+		while (!stop && now_us() - drained < UEVENT_BENCH_IDLE * 1000ULL &&
+		       now_us() - start < send_us + UEVENT_BENCH_TIMEOUT * 1000ULL) {
+			poll(NULL, 0, UEVENT_BENCH_POLL);
+			if (after)
+				protobuf_free_message((ProtobufCMessage *)after);
+			IF_NULL_GOTO(after = uevent_bench_get_stats(ctl), out);
+			if (after->messages + after->invalid != handled) {
+				handled = after->messages + after->invalid;
+				drained = now_us();
+			}
+		}
+		IF_NULL_GOTO(after, out);
+		uevent_bench_print(sent, send_us, drained - start - send_us, before, after);
+	}
+	ret = 0;
+
+out:
+	if (ctl >= 0) {
+		uevent_bench_set_source(ctl, 0);
+		close(ctl);
+	}
+	if (before)
+		protobuf_free_message((ProtobufCMessage *)before);
+	if (after)
+		protobuf_free_message((ProtobufCMessage *)after);
+	if (sock >= 0)
+		close(sock);
+	mem_free0(recording);
+	return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+	logf_register(&logf_test_write, stderr);
+
+	const char *socket_file = CONTROL_SOCKET;
+	double rate = -1;
+	unsigned int loops = 1;
+	bool bench = false;
+
+	for (int c; -1 != (c = getopt(argc, argv, "+s:h"));) {
+		switch (c) {
+		case 's':
+			socket_file = optarg;
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (optind >= argc)
+		print_usage(argv[0]);
+
+	const char *command = argv[optind];
+	// parse the options of the command
+	optind++;
+	for (int c; -1 != (c = getopt(argc, argv, "r:l:b"));) {
+		switch (c) {
+		case 'r':
+			rate = strtod(optarg, NULL);
+			break;
+		case 'l':
+			loops = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			bench = true;
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		print_usage(argv[0]);
+
+	struct sigaction sa = { .sa_handler = handle_signal };
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (!strcasecmp(command, "record"))
+		return uevent_record(argv[optind]) ? -1 : 0;
+	if (!strcasecmp(command, "replay")) {
+		if (bench && !file_exists(socket_file))
+			FATAL("Could not find socket file %s. Aborting.", socket_file);
+		return uevent_replay(argv[optind], socket_file, rate, loops, bench) ? -1 : 0;
+	}
+	print_usage(argv[0]);
+	return -1;
+}
@@ -34,7 +34,8 @@ LOCAL_SRC_FILES := \
 	common/list.c \
 	common/mem.c \
 	common/fd.c \
-	cJSON/cJSON.c \
+	common/str.c \
+	json.c \
 	guestos.proto \
 	util.c \
 	docker.c \
@@ -84,8 +85,9 @@ LOCAL_SRC_FILES := \
 	common/list.c \
 	common/mem.c \
 	common/fd.c \
+	common/str.c \
 	common/protobuf.c \
-	cJSON/cJSON.c \
+	json.c \
 	guestos.proto \
 	util.c \
 	docker.c \
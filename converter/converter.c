@@ -36,6 +36,8 @@
 #include "common/mem.h"
 
 #include "docker.h"
+#include "layer.h"
+#include "store.h"
 #include "util.h"
 #include "control.h"
 
@@ -50,8 +52,6 @@
 #include <arpa/inet.h>
 #include <errno.h>
 
-#define BUF_SIZE 10 * 4096
-
 #define WORK_PATH "/tmp/trustx-converter"
 #define IMAGE_NAME_ROOT "root.img"
 #define MIN_INIT "/sbin/cservice"
@@ -93,8 +93,9 @@ err:
 }
 
 int
-write_guestos_config(docker_config_t *config, const char *root_image_file, const char *image_path,
-		     const char *image_name, const char *image_tag)
+write_guestos_config(docker_config_t *config, const char *root_image_file,
+		     util_image_format_t format, const char *image_path, const char *image_name,
+		     const char *image_tag)
 {
 	int ret = -1;
 	char *out_file;
@@ -123,7 +124,7 @@ write_guestos_config(docker_config_t *config, const char *root_image_file, const
 	GuestOSMount mount_root = GUEST_OSMOUNT__INIT;
 	mount_root.image_file = strtok(mem_strdup(IMAGE_NAME_ROOT), ".");
 	mount_root.mount_point = mem_strdup("/");
-	mount_root.fs_type = mem_strdup("squashfs");
+	mount_root.fs_type = mem_strdup(util_image_format_get_fs(format));
 	mount_root.mount_type = GUEST_OSMOUNT__TYPE__SHARED_RW;
 
 	// add image_sha1 and image_sha256 values
@@ -260,44 +261,106 @@ free_stuff:
 	return ret;
 }
 
+/**
+ * Returns the number of leading layers of manifest whose merged image is stored.
+ */
+static int
+merge_layers_find_stored(const docker_manifest_t *manifest, const store_t *store,
+			 util_image_format_t format, char **chain_image)
+{
+	for (int n = manifest->layers_size; n > 0; --n) {
+		char *chain_id = store_chain_id_new(manifest, n);
+		*chain_image = store_chain_image_new(store, chain_id, format);
+		mem_free0(chain_id);
+		if (file_exists(*chain_image))
+			return n;
+		mem_free0(*chain_image);
+	}
+	return 0;
+}
+
 char *
-merge_layers_new(docker_manifest_t *manifest, char *in_path, char *out_path, char *image_name,
-		 char *image_tag)
+merge_layers_new(docker_manifest_t *manifest, const store_t *store, util_image_format_t format,
+		 char *out_path, char *image_name, char *image_tag)
 {
 	char *target_image_path = mem_printf("%s/%s_%s", out_path, image_name, image_tag);
 	char *extracted_image_path =
 		mem_printf("%s/%s_%s_extracted", out_path, image_name, image_tag);
-	char *image_file = NULL;
+	char *image_file = mem_printf("%s/%s", target_image_path, IMAGE_NAME_ROOT);
+	char *chain_image = NULL;
+	char *chain_id = NULL;
+	layer_tree_t *tree = NULL;
+	int ret = -1;
 
-	if (dir_mkdir_p(extracted_image_path, 0755) < 0) {
-		ERROR_ERRNO("Can't create dir %s", extracted_image_path);
-		goto out;
-	}
 	if (dir_mkdir_p(target_image_path, 0755) < 0) {
 		ERROR_ERRNO("Can't create dir %s", target_image_path);
 		goto out;
 	}
+	// the image may be hard linked into the store, never overwrite it in place
+	unlink(image_file);
+
+	int stored = merge_layers_find_stored(manifest, store, format, &chain_image);
+	if (stored == manifest->layers_size) {
+		INFO("Reusing merged image %s", chain_image);
+		if (link(chain_image, image_file) < 0 &&
+		    file_copy(chain_image, image_file, -1, 512, 0) < 0) {
+			ERROR("Failed to copy %s", chain_image);
+			goto out;
+		}
+		ret = 0;
+		goto out;
+	}
 
-	for (int i = 0; i < manifest->layers_size; ++i) {
-		char *layer_file_name = mem_printf("%s/%s%s", in_path, manifest->layers[i]->digest,
+	if (!(tree = layer_tree_new(extracted_image_path))) {
+		ERROR_ERRNO("Can't create dir %s", extracted_image_path);
+		goto out;
+	}
+	if (stored > 0) {
+		INFO("Restoring first %d layers from %s", stored, chain_image);
+		if (layer_tree_restore(tree, chain_image, format) < 0) {
+			ERROR("Failed to restore %s", chain_image);
+			goto out;
+		}
+	}
+
+	for (int i = stored; i < manifest->layers_size; ++i) {
+		char *layer_file_name = mem_printf("%s/%s%s", store_get_blob_path(store),
+						   manifest->layers[i]->digest,
 						   manifest->layers[i]->suffix);
 		INFO("Extracting layer[%d]: %s", i, layer_file_name);
-		if (-1 == util_tar_extract(layer_file_name, extracted_image_path)) {
-			ERROR_ERRNO("Failed to extract %s", layer_file_name);
+		if (layer_tree_apply(tree, layer_file_name) < 0) {
+			ERROR("Failed to extract %s", layer_file_name);
 			mem_free0(layer_file_name);
 			goto out;
 		}
 		mem_free0(layer_file_name);
+
+		// new tags mostly change the top layer only, thus keep the base for reuse
+		if (i == manifest->layers_size - 2) {
+			chain_id = store_chain_id_new(manifest, i + 1);
+			if (layer_tree_squash(tree, image_file, format) < 0 ||
+			    store_chain_put(store, chain_id, format, image_file) < 0)
+				WARN("Could not store base layers of %s", image_name);
+			unlink(image_file);
+			mem_free0(chain_id);
+		}
 	}
-	image_file = mem_printf("%s/%s", target_image_path, IMAGE_NAME_ROOT);
-	if (util_squash_image(extracted_image_path, image_file) < 0) {
-		mem_free0(image_file);
-		image_file = NULL;
+
+	if (layer_tree_squash(tree, image_file, format) < 0)
 		goto out;
-	}
+
+	chain_id = store_chain_id_new(manifest, manifest->layers_size);
+	if (store_chain_put(store, chain_id, format, image_file) < 0)
+		WARN("Could not store merged image of %s", image_name);
+	ret = 0;
 out:
+	layer_tree_free(tree);
+	mem_free0(chain_id);
+	mem_free0(chain_image);
 	mem_free0(extracted_image_path);
 	mem_free0(target_image_path);
+	if (ret < 0)
+		mem_free0(image_file);
 	return image_file;
 }
 
@@ -307,17 +370,18 @@ print_usage(char *progname)
 	ERROR("Usage: %s login -u <username> -p <password>"
 	      " -r <hostname:port>",
 	      progname);
-	ERROR("Usage: %s pull [-r <hostname:port>] [-a <arch>]"
-	      " <imagename> [-t <imagetag>]",
+	ERROR("Usage: %s pull [-r <hostname:port>] [-a <arch>] [-j <parallel downloads>]"
+	      " [-f squashfs|erofs-lz4|erofs-lz4hc|erofs-lzma] <imagename> [-t <imagetag>]",
 	      progname);
 	exit(-1);
 }
 
-static const struct option pull_options[] = { { "registry", optional_argument, 0, 'r' },
-					      { "arch", optional_argument, 0, 'a' },
-					      { "tag", optional_argument, 0, 't' },
-					      { "help", no_argument, 0, 'h' },
-					      { 0, 0, 0, 0 } };
+static const struct option pull_options[] = {
+	{ "registry", optional_argument, 0, 'r' }, { "arch", optional_argument, 0, 'a' },
+	{ "tag", optional_argument, 0, 't' },	   { "jobs", required_argument, 0, 'j' },
+	{ "format", required_argument, 0, 'f' },   { "help", no_argument, 0, 'h' },
+	{ 0, 0, 0, 0 }
+};
 
 static const struct option login_options[] = { { "registry", required_argument, 0, 'r' },
 					       { "user", required_argument, 0, 'u' },
@@ -328,7 +392,6 @@ static const struct option login_options[] = { { "registry", required_argument,
 int
 main(UNUSED int argc, char **argv)
 {
-	char *buf;
 	char *manifest_file = NULL;
 	char *manifest_list_file = NULL;
 	char *image_tag = NULL;
@@ -344,6 +407,8 @@ main(UNUSED int argc, char **argv)
 	docker_manifest_list_t *ml = NULL;
 	char *manifest_url_digest = NULL;
 	docker_manifest_t *manifest = NULL;
+	store_t *store = NULL;
+	util_image_format_t image_format = UTIL_IMAGE_SQUASHFS;
 
 	logf_register(&logf_file_write, stdout);
 
@@ -368,7 +433,7 @@ main(UNUSED int argc, char **argv)
 		image_arch = "amd64";
 		image_tag = "latest";
 		for (int c, option_index = 0;
-		     - 1 != (c = getopt_long(pull_argc, pull_argv, "t:r:a:", pull_options,
+		     - 1 != (c = getopt_long(pull_argc, pull_argv, "t:r:a:j:f:", pull_options,
 					     &option_index));) {
 			switch (c) {
 			case 'r':
@@ -380,6 +445,15 @@ main(UNUSED int argc, char **argv)
 			case 'a':
 				image_arch = optarg ? optarg : "amd64";
 				break;
+			case 'j':
+				docker_set_download_parallel(atoi(optarg));
+				break;
+			case 'f':
+				if (util_image_format_from_string(optarg, &image_format) < 0) {
+					ERROR("Unknown image format %s", optarg);
+					print_usage(argv[0]);
+				}
+				break;
 			default:
 				print_usage(argv[0]);
 			}
@@ -441,17 +515,12 @@ main(UNUSED int argc, char **argv)
 		goto err;
 	}
 	DEBUG("Trying to read manifest list %s", manifest_list_file);
-	buf = file_read_new(manifest_list_file, BUF_SIZE);
-	if (!buf) {
+	ml = docker_parse_manifest_list_new(manifest_list_file);
+	if (!ml) {
 		ERROR("Could not read manifest list file");
 		goto err;
 	}
 
-	ml = docker_parse_manifest_list_new(buf);
-
-	mem_free0(buf);
-	buf = NULL;
-
 	for (int i = 0; i < ml->manifests_size; ++i) {
 		if (!strcmp(ml->manifests[i]->platform_arch, image_arch)) {
 			if (ml->manifests[i]->digest_algorithm == NULL) {
@@ -481,18 +550,17 @@ main(UNUSED int argc, char **argv)
 	}
 
 	DEBUG("Trying to read manifest %s", manifest_file);
-	buf = file_read_new(manifest_file, BUF_SIZE);
-	if (!buf) {
+	manifest = docker_parse_manifest_new(manifest_file);
+	if (!manifest) {
 		ERROR("Could not read manifest file");
 		goto err;
 	}
 
-	manifest = docker_parse_manifest_new(buf);
+	store = store_new(docker_image_path);
+	IF_NULL_GOTO_ERROR(store, err);
 
-	mem_free0(buf);
-	buf = NULL;
-
-	if (docker_download_image(token, manifest, docker_image_path, image_name, image_tag) < 0) {
+	if (docker_download_image(token, manifest, store_get_blob_path(store), image_name,
+				  image_tag) < 0) {
 		ERROR("Downloading image %s failed!", image_name);
 		goto err;
 	}
@@ -501,15 +569,14 @@ main(UNUSED int argc, char **argv)
 	if (file_exists(token_file))
 		remove(token_file);
 
-	config_file_name = mem_printf("%s/%s%s", docker_image_path, manifest->config->digest,
-				      manifest->config->suffix);
+	config_file_name = mem_printf("%s/%s%s", store_get_blob_path(store),
+				      manifest->config->digest, manifest->config->suffix);
 	DEBUG("Trying to read config %s", config_file_name);
-	buf = file_read_new(config_file_name, BUF_SIZE);
-	if (!buf) {
+	config = docker_parse_config_new(config_file_name);
+	if (!config) {
 		ERROR("Could not read config file");
 		goto err;
 	}
-	config = docker_parse_config_new(buf);
 
 	// replace the slashes in docker image name to be compatible with trustme
 	// guestos names, e.g. library/debian -> library_debian
@@ -523,14 +590,22 @@ main(UNUSED int argc, char **argv)
 		goto err;
 	}
 
-	trustx_image_file = merge_layers_new(manifest, docker_image_path, trustx_image_path,
-					     image_name, image_tag);
+	trustx_image_file =
+		merge_layers_new(manifest, store, image_format, trustx_image_path, image_name,
+				 image_tag);
 	if (NULL == trustx_image_file) {
 		ERROR("Failed to merge layers resulting image file is NULL!");
 		goto err;
 	}
 
-	write_guestos_config(config, trustx_image_file, trustx_image_path, image_name, image_tag);
+	// drop the blobs and merged images which only older tags of this image used
+	char *store_ref_name = mem_printf("%s_%s", image_name, image_tag);
+	if (store_ref(store, store_ref_name, manifest) < 0 || store_prune(store) < 0)
+		WARN("Could not clean up layer store");
+	mem_free0(store_ref_name);
+
+	write_guestos_config(config, trustx_image_file, image_format, trustx_image_path,
+			     image_name, image_tag);
 
 	mem_free0(manifest_list_file);
 	mem_free0(manifest_file);
@@ -540,6 +615,7 @@ main(UNUSED int argc, char **argv)
 
 	docker_manifest_free(manifest);
 	docker_config_free(config);
+	store_free(store);
 
 	mem_free0(token_file);
 	mem_free0(token);
@@ -570,5 +646,6 @@ err:
 		docker_manifest_free(manifest);
 	if (config)
 		docker_config_free(config);
+	store_free(store);
 	return -1;
 }
@@ -30,21 +30,31 @@
 #include "common/list.h"
 #include "common/mem.h"
 #include "common/proc.h"
+#include "common/fd.h"
 
-#include "cJSON/cJSON.h"
+#include "json.h"
 #include "util.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <inttypes.h>
+#include <signal.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 
 #define BUF_SIZE 10 * 4096
 #define CURL_PATH "curl"
+#define DOCKER_DOWNLOAD_PARALLEL_DEFAULT 4
+#define DOCKER_VERIFIED_MARKER_EXT ".verified"
 
 #define MEDIA_TYPE_MANIFEST_LIST_V2 "application/vnd.docker.distribution.manifest.list.v2+json"
 #define MEDIA_TYPE_MANIFEST_V2 "application/vnd.docker.distribution.manifest.v2+json"
 #define MEDIA_TYPE_MANIFEST_V1 "application/vnd.docker.distribution.manifest.v1+json"
 
 static char *host_url = NULL;
+static int download_parallel = DOCKER_DOWNLOAD_PARALLEL_DEFAULT;
 
 static void
 docker_remote_file_free(docker_remote_file_t *rf)
@@ -66,58 +76,146 @@ docker_remote_file_free(docker_remote_file_t *rf)
 }
 
 static docker_remote_file_t *
-parse_remote_file_new(cJSON *rf_obj, char *suffix)
+docker_remote_file_new(const char *suffix)
 {
 	docker_remote_file_t *rf = mem_new0(docker_remote_file_t, 1);
 	rf->suffix = mem_strdup(suffix);
+	return rf;
+}
 
-	cJSON *jmedia_type = cJSON_GetObjectItem(rf_obj, "mediaType");
-	if (cJSON_IsString(jmedia_type))
-		rf->media_type = mem_strdup(jmedia_type->valuestring);
-
-	cJSON *jsize = cJSON_GetObjectItem(rf_obj, "size");
-	if (cJSON_IsNumber(jsize))
-		rf->size = jsize->valueint;
+/**
+ * Fills rf from a member of the remote file object at depth rf_depth.
+ */
+static void
+docker_remote_file_parse(docker_remote_file_t *rf, const json_t *js, int rf_depth,
+			 json_event_t event, const char *value)
+{
+	int level = json_get_depth(js) - rf_depth;
+	const char *key = json_get_key(js, rf_depth + 1);
+	IF_TRUE_RETURN(!key || (event != JSON_STRING && event != JSON_NUMBER));
 
-	cJSON *jdigest = cJSON_GetObjectItem(rf_obj, "digest");
-	if (cJSON_IsString(jdigest)) {
-		rf->digest_algorithm = strtok(mem_strdup(jdigest->valuestring), ":");
+	if (level == 1 && event == JSON_STRING && !strcmp(key, "mediaType")) {
+		mem_free0(rf->media_type);
+		rf->media_type = mem_strdup(value);
+	} else if (level == 1 && event == JSON_NUMBER && !strcmp(key, "size")) {
+		rf->size = atoi(value);
+	} else if (level == 1 && event == JSON_STRING && !strcmp(key, "digest")) {
+		mem_free0(rf->digest_algorithm);
+		rf->digest_algorithm = strtok(mem_strdup(value), ":");
 		rf->digest = strtok(NULL, ":");
+	} else if (level == 2 && event == JSON_STRING && !strcmp(key, "platform")) {
+		const char *platform_key = json_get_key(js, rf_depth + 2);
+		IF_NULL_RETURN(platform_key);
+		if (!strcmp(platform_key, "architecture")) {
+			mem_free0(rf->platform_arch);
+			rf->platform_arch = mem_strdup(value);
+		} else if (!strcmp(platform_key, "variant")) {
+			mem_free0(rf->platform_variant);
+			rf->platform_variant = mem_strdup(value);
+		}
 	}
-	cJSON *jplatform = cJSON_GetObjectItem(rf_obj, "platform");
-	if (cJSON_IsObject(jplatform)) {
-		cJSON *jplatform_arch = cJSON_GetObjectItem(jplatform, "architecture");
-		if (cJSON_IsString(jplatform_arch))
-			rf->platform_arch = mem_strdup(jplatform_arch->valuestring);
-		cJSON *jplatform_variant = cJSON_GetObjectItem(jplatform, "variant");
-		if (cJSON_IsString(jplatform_variant))
-			rf->platform_variant = mem_strdup(jplatform_variant->valuestring);
-	}
+}
 
+static void
+docker_remote_file_log(const docker_remote_file_t *rf)
+{
 	INFO("Parsed remote file: \n\t type: %s\n\t size: %d\n\t digest %s :: %s (arch %s:%s)",
 	     rf->media_type, rf->size, rf->digest_algorithm, rf->digest, rf->platform_arch,
 	     rf->platform_variant);
-	return rf;
+}
+
+/**
+ * Tracks the remote file object at path while streaming a document. Returns
+ * the completed remote file on the object's end.
+ */
+static docker_remote_file_t *
+docker_remote_file_track(docker_remote_file_t **rf, const char *path, const char *suffix,
+			 const json_t *js, json_event_t event, const char *value)
+{
+	if (json_path_is(js, path)) {
+		if (event == JSON_OBJECT_START) {
+			*rf = docker_remote_file_new(suffix);
+		} else if (event == JSON_OBJECT_END && *rf) {
+			docker_remote_file_t *done = *rf;
+			*rf = NULL;
+			docker_remote_file_log(done);
+			return done;
+		}
+	} else if (*rf) {
+		// the path of the tracked object is a prefix of the current path
+		int rf_depth = 1;
+		for (const char *p = path; (p = strchr(p, '/')); ++p)
+			rf_depth++;
+		docker_remote_file_parse(*rf, js, rf_depth, event, value);
+	}
+	return NULL;
+}
+
+/**
+ * Moves the elements of list into a newly allocated array.
+ */
+static void **
+docker_list_to_array_new(list_t *list, int *size)
+{
+	*size = list_length(list);
+	void **array = mem_new0(void *, *size);
+
+	int i = 0;
+	for (list_t *l = list; l; l = l->next)
+		array[i++] = l->data;
+	list_delete(list);
+	return array;
+}
+
+typedef struct docker_manifest_list_parse {
+	docker_manifest_list_t *ml;
+	list_t *manifests;
+	docker_remote_file_t *rf; // manifest entry being parsed
+	char *architecture;	  // of a schema version 1 manifest
+	char *tag;
+} docker_manifest_list_parse_t;
+
+static int
+docker_manifest_list_parse_cb(const json_t *js, json_event_t event, const char *value, void *data)
+{
+	docker_manifest_list_parse_t *p = data;
+
+	docker_remote_file_t *rf =
+		docker_remote_file_track(&p->rf, "manifests/*", ".json", js, event, value);
+	if (rf)
+		p->manifests = list_append(p->manifests, rf);
+
+	IF_TRUE_RETVAL(json_get_depth(js) != 1, 0);
+
+	if (event == JSON_NUMBER && json_path_is(js, "schemaVersion")) {
+		p->ml->schema_version = atoi(value);
+	} else if (event == JSON_STRING && json_path_is(js, "mediaType")) {
+		mem_free0(p->ml->media_type);
+		p->ml->media_type = mem_strdup(value);
+	} else if (event == JSON_STRING && json_path_is(js, "architecture")) {
+		mem_free0(p->architecture);
+		p->architecture = mem_strdup(value);
+	} else if (event == JSON_STRING && json_path_is(js, "tag")) {
+		mem_free0(p->tag);
+		p->tag = mem_strdup(value);
+	}
+	return 0;
 }
 
 docker_manifest_list_t *
-docker_parse_manifest_list_new(const char *raw_file_buffer)
+docker_parse_manifest_list_new(const char *file)
 {
-	cJSON *jroot = NULL;
-	docker_manifest_list_t *ml = mem_alloc0(sizeof(docker_manifest_list_t));
+	docker_manifest_list_parse_t p = { .ml = mem_alloc0(sizeof(docker_manifest_list_t)) };
+	docker_manifest_list_t *ml = p.ml;
 
-	jroot = cJSON_Parse(raw_file_buffer);
+	if (json_parse_file(file, &docker_manifest_list_parse_cb, &p) < 0)
+		ml->schema_version = 0;
 
-	cJSON *jschema = cJSON_GetObjectItem(jroot, "schemaVersion");
-	if (cJSON_IsNumber(jschema))
-		ml->schema_version = jschema->valueint;
 	switch (ml->schema_version) {
 	case 1: {
 		// no manifetslist support (client answerd with v1 manifest)
 		// construct a default manifest list for the v2 manifest
-		cJSON *jarchitecture = cJSON_GetObjectItem(jroot, "architecture");
-		cJSON *jtag = cJSON_GetObjectItem(jroot, "tag");
-		if (cJSON_IsString(jarchitecture) && cJSON_IsString(jtag)) {
+		if (p.architecture && p.tag) {
 			ml->schema_version = 2;
 			ml->manifests_size = 1;
 			ml->manifests = mem_alloc0(sizeof(docker_remote_file_t *));
@@ -125,48 +223,44 @@ docker_parse_manifest_list_new(const char *raw_file_buffer)
 			ml->manifests[0]->media_type = mem_strdup(MEDIA_TYPE_MANIFEST_V2);
 			ml->manifests[0]->size = 0;
 			ml->manifests[0]->digest_algorithm = NULL;
-			ml->manifests[0]->digest = mem_strdup(jtag->valuestring);
-			ml->manifests[0]->platform_arch = mem_strdup(jarchitecture->valuestring);
+			ml->manifests[0]->digest = mem_strdup(p.tag);
+			ml->manifests[0]->platform_arch = mem_strdup(p.architecture);
 		} else {
 			ERROR("Unsuported schema verison = %d", ml->schema_version);
-			mem_free0(ml);
+			docker_manifest_list_free(ml);
 			ml = NULL;
-			goto out;
 		}
 		break;
 	}
 	case 2: {
-		cJSON *jmanifests = cJSON_GetObjectItem(jroot, "manifests");
-		ml->manifests_size = cJSON_GetArraySize(jmanifests);
-		if (ml->manifests_size < 0) {
+		if (!p.manifests) {
 			ERROR("No manifests in list");
-			mem_free0(ml);
+			docker_manifest_list_free(ml);
 			ml = NULL;
-			goto out;
-		}
-
-		cJSON *jmedia_type = cJSON_GetObjectItem(jroot, "mediaType");
-		if (cJSON_IsString(jmedia_type)) {
-			ml->media_type = mem_strdup(jmedia_type->valuestring);
-		}
-
-		ml->manifests = mem_alloc0(ml->manifests_size * sizeof(docker_remote_file_t *));
-		for (int i = 0; i < ml->manifests_size; ++i) {
-			cJSON *item = cJSON_GetArrayItem(jmanifests, i);
-			ml->manifests[i] = parse_remote_file_new(item, ".json");
+			break;
 		}
+		ml->manifests = (docker_remote_file_t **)docker_list_to_array_new(
+			p.manifests, &ml->manifests_size);
+		p.manifests = NULL;
 		break;
 	}
 	default:
 		ERROR("Unsuported schema verison = %d", ml->schema_version);
-		mem_free0(ml);
+		docker_manifest_list_free(ml);
 		ml = NULL;
 	}
-out:
-	cJSON_Delete(jroot);
+
+	for (list_t *l = p.manifests; l; l = l->next)
+		docker_remote_file_free(l->data);
+	list_delete(p.manifests);
+	if (p.rf)
+		docker_remote_file_free(p.rf);
+	mem_free0(p.architecture);
+	mem_free0(p.tag);
 	return ml;
 }
 
+
 void
 docker_manifest_list_free(docker_manifest_list_t *ml)
 {
@@ -176,38 +270,63 @@ docker_manifest_list_free(docker_manifest_list_t *ml)
 		if (ml->manifests[i])
 			docker_remote_file_free(ml->manifests[i]);
 	}
+	mem_free0(ml->manifests);
 	mem_free0(ml);
 }
 
-docker_manifest_t *
-docker_parse_manifest_new(const char *raw_file_buffer)
+typedef struct docker_manifest_parse {
+	docker_manifest_t *manifest;
+	list_t *layers;
+	docker_remote_file_t *config; // config being parsed
+	docker_remote_file_t *rf;     // layer being parsed
+} docker_manifest_parse_t;
+
+static int
+docker_manifest_parse_cb(const json_t *js, json_event_t event, const char *value, void *data)
 {
-	cJSON *jroot = NULL;
-	docker_manifest_t *manifest = mem_alloc0(sizeof(docker_manifest_t));
+	docker_manifest_parse_t *p = data;
+	docker_remote_file_t *rf;
+
+	rf = docker_remote_file_track(&p->config, "config", ".json", js, event, value);
+	if (rf) {
+		if (p->manifest->config)
+			docker_remote_file_free(p->manifest->config);
+		p->manifest->config = rf;
+	}
 
-	jroot = cJSON_Parse(raw_file_buffer);
-	// seems a manifest contains an array with just one item
-	cJSON *jschema = cJSON_GetArrayItem(jroot, 0);
-	if (cJSON_IsNumber(jschema))
-		manifest->schema_version = jschema->valueint;
+	rf = docker_remote_file_track(&p->rf, "layers/*", ".tar.gz", js, event, value);
+	if (rf)
+		p->layers = list_append(p->layers, rf);
 
-	cJSON *jmedia_type = cJSON_GetObjectItem(jroot, "mediaType");
-	if (cJSON_IsString(jmedia_type)) {
-		manifest->media_type = mem_strdup(jmedia_type->valuestring);
+	if (event == JSON_NUMBER && json_path_is(js, "schemaVersion")) {
+		p->manifest->schema_version = atoi(value);
+	} else if (event == JSON_STRING && json_path_is(js, "mediaType")) {
+		mem_free0(p->manifest->media_type);
+		p->manifest->media_type = mem_strdup(value);
 	}
+	return 0;
+}
 
-	cJSON *jconfig = cJSON_GetObjectItem(jroot, "config");
-	manifest->config = parse_remote_file_new(jconfig, ".json");
+docker_manifest_t *
+docker_parse_manifest_new(const char *file)
+{
+	docker_manifest_parse_t p = { .manifest = mem_alloc0(sizeof(docker_manifest_t)) };
+	docker_manifest_t *manifest = p.manifest;
 
-	cJSON *jlayers = cJSON_GetObjectItem(jroot, "layers");
-	manifest->layers_size = cJSON_GetArraySize(jlayers);
-	manifest->layers = mem_alloc0(manifest->layers_size * sizeof(docker_remote_file_t *));
-	for (int i = 0; i < manifest->layers_size; ++i) {
-		cJSON *item = cJSON_GetArrayItem(jlayers, i);
-		manifest->layers[i] = parse_remote_file_new(item, ".tar.gz");
-	}
+	int ret = json_parse_file(file, &docker_manifest_parse_cb, &p);
+
+	manifest->layers =
+		(docker_remote_file_t **)docker_list_to_array_new(p.layers, &manifest->layers_size);
+	if (p.config)
+		docker_remote_file_free(p.config);
+	if (p.rf)
+		docker_remote_file_free(p.rf);
 
-	cJSON_Delete(jroot);
+	if (ret < 0 || !manifest->config) {
+		ERROR("Invalid manifest %s", file);
+		docker_manifest_free(manifest);
+		return NULL;
+	}
 	return manifest;
 }
 
@@ -224,99 +343,72 @@ docker_manifest_free(docker_manifest_t *manifest)
 		if (manifest->layers[i])
 			docker_remote_file_free(manifest->layers[i]);
 	}
+	mem_free0(manifest->layers);
 	mem_free0(manifest);
 }
 
-docker_config_t *
-docker_parse_config_new(const char *raw_file_buffer)
-{
-	cJSON *jroot = NULL;
-	docker_config_t *config = mem_alloc0(sizeof(docker_config_t));
+typedef struct docker_config_parse {
+	docker_config_t *config;
+	list_t *env_list;
+	list_t *cmd_list;
+	list_t *entrypoint_list;
+} docker_config_parse_t;
 
-	jroot = cJSON_Parse(raw_file_buffer);
-
-	cJSON *jconfig = cJSON_GetObjectItem(jroot, "config");
-
-	cJSON *jhostname = cJSON_GetObjectItem(jconfig, "Hostname");
-	if (jhostname->type == cJSON_String)
-		config->hostname = mem_strdup(jhostname->valuestring);
-
-	cJSON *jdomainname = cJSON_GetObjectItem(jconfig, "Domainname");
-	if (jdomainname->type == cJSON_String)
-		config->domainname = mem_strdup(jdomainname->valuestring);
-
-	cJSON *juser = cJSON_GetObjectItem(jconfig, "User");
-	if (juser->type == cJSON_String)
-		config->user = mem_strdup(juser->valuestring);
-
-	if (cJSON_GetObjectItem(jconfig, "ExposedPorts")) {
-		cJSON *jexposedports = cJSON_GetObjectItem(jconfig, "ExposedPorts")->child;
-		for (cJSON *item = jexposedports; item; item = item->next) {
-			if (item && item->type == cJSON_Object) {
-				docker_exposed_port_t *port =
-					mem_alloc0(sizeof(docker_exposed_port_t));
-				INFO("Parsing port %s", item->string);
-				sscanf(item->string, "%d/%9s", &port->port, port->protocol);
-				config->exposedports_list =
-					list_append(config->exposedports_list, port);
-			}
-		}
-	}
-
-	cJSON *jenv = cJSON_GetObjectItem(jconfig, "Env");
-	if (cJSON_IsArray(jenv)) {
-		config->env_size = cJSON_GetArraySize(jenv);
-		config->env = mem_alloc0(config->env_size * sizeof(char *));
-		for (int i = 0; i < config->env_size; ++i) {
-			cJSON *item = cJSON_GetArrayItem(jenv, i);
-			if (item && item->type == cJSON_String)
-				config->env[i] = mem_strdup(item->valuestring);
-		}
+static int
+docker_config_parse_cb(const json_t *js, json_event_t event, const char *value, void *data)
+{
+	docker_config_parse_t *p = data;
+	docker_config_t *config = p->config;
+
+	if (event == JSON_STRING && json_path_is(js, "config/Hostname")) {
+		mem_free0(config->hostname);
+		config->hostname = mem_strdup(value);
+	} else if (event == JSON_STRING && json_path_is(js, "config/Domainname")) {
+		mem_free0(config->domainname);
+		config->domainname = mem_strdup(value);
+	} else if (event == JSON_STRING && json_path_is(js, "config/User")) {
+		mem_free0(config->user);
+		config->user = mem_strdup(value);
+	} else if (event == JSON_OBJECT_START && json_path_is(js, "config/ExposedPorts/*")) {
+		const char *port_key = json_get_key(js, 3);
+		docker_exposed_port_t *port = mem_alloc0(sizeof(docker_exposed_port_t));
+		INFO("Parsing port %s", port_key);
+		sscanf(port_key, "%d/%9s", &port->port, port->protocol);
+		config->exposedports_list = list_append(config->exposedports_list, port);
+	} else if (event == JSON_STRING && json_path_is(js, "config/Env/*")) {
+		p->env_list = list_append(p->env_list, mem_strdup(value));
+	} else if (event == JSON_STRING && json_path_is(js, "config/Cmd/*")) {
+		p->cmd_list = list_append(p->cmd_list, mem_strdup(value));
+	} else if (event == JSON_STRING && json_path_is(js, "config/Entrypoint/*")) {
+		p->entrypoint_list = list_append(p->entrypoint_list, mem_strdup(value));
+	} else if (event == JSON_OBJECT_START && json_path_is(js, "config/Volumes/*")) {
+		config->volumes_list =
+			list_append(config->volumes_list, mem_strdup(json_get_key(js, 3)));
+	} else if (event == JSON_OBJECT_START && json_path_is(js, "config/Labels/*")) {
+		config->labels_list =
+			list_append(config->labels_list, mem_strdup(json_get_key(js, 3)));
 	}
+	return 0;
+}
 
-	cJSON *jcmd = cJSON_GetObjectItem(jconfig, "Cmd");
-	if (cJSON_IsArray(jcmd)) {
-		config->cmd_size = cJSON_GetArraySize(jcmd);
-		config->cmd = mem_alloc0(config->cmd_size * sizeof(char *));
-		for (int i = 0; i < config->cmd_size; ++i) {
-			cJSON *item = cJSON_GetArrayItem(jcmd, i);
-			if (item && item->type == cJSON_String)
-				config->cmd[i] = mem_strdup(item->valuestring);
-		}
-	}
+docker_config_t *
+docker_parse_config_new(const char *file)
+{
+	docker_config_parse_t p = { .config = mem_alloc0(sizeof(docker_config_t)) };
+	docker_config_t *config = p.config;
 
-	cJSON *jentrypoint = cJSON_GetObjectItem(jconfig, "Entrypoint");
-	if (cJSON_IsArray(jentrypoint)) {
-		config->entrypoint_size = cJSON_GetArraySize(jentrypoint);
-		config->entrypoint = mem_alloc0(config->entrypoint_size * sizeof(char *));
-		for (int i = 0; i < config->entrypoint_size; ++i) {
-			cJSON *item = cJSON_GetArrayItem(jentrypoint, i);
-			if (item && item->type == cJSON_String)
-				config->entrypoint[i] = mem_strdup(item->valuestring);
-		}
-	}
+	int ret = json_parse_file(file, &docker_config_parse_cb, &p);
 
-	if (cJSON_GetObjectItem(jconfig, "Volumes")) {
-		cJSON *jvolumes = cJSON_GetObjectItem(jconfig, "Volumes")->child;
-		for (cJSON *item = jvolumes; item; item = item->next) {
-			if (item && item->type == cJSON_Object) {
-				config->volumes_list =
-					list_append(config->volumes_list, mem_strdup(item->string));
-			}
-		}
-	}
+	config->env = (char **)docker_list_to_array_new(p.env_list, &config->env_size);
+	config->cmd = (char **)docker_list_to_array_new(p.cmd_list, &config->cmd_size);
+	config->entrypoint =
+		(char **)docker_list_to_array_new(p.entrypoint_list, &config->entrypoint_size);
 
-	if (cJSON_GetObjectItem(jconfig, "Labels")) {
-		cJSON *jlabels = cJSON_GetObjectItem(jconfig, "Labels")->child;
-		for (cJSON *item = jlabels; item; item = item->next) {
-			if (item && item->type == cJSON_Object) {
-				config->labels_list =
-					list_append(config->labels_list, mem_strdup(item->string));
-			}
-		}
+	if (ret < 0) {
+		ERROR("Invalid config %s", file);
+		docker_config_free(config);
+		return NULL;
 	}
-
-	cJSON_Delete(jroot);
 	return config;
 }
 
@@ -353,6 +445,11 @@ docker_config_free(docker_config_t *cfg)
 		mem_free0(cfg->entrypoint);
 	}
 
+	for (list_t *l = cfg->volumes_list; l; l = l->next) {
+		mem_free0(l->data);
+	}
+	list_delete(cfg->volumes_list);
+
 	for (list_t *l = cfg->labels_list; l; l = l->next) {
 		mem_free0(l->data);
 	}
@@ -398,6 +495,18 @@ docker_generate_basic_auth(const char *user, const char *password, const char *t
 	return ret;
 }
 
+static int
+docker_token_parse_cb(const json_t *js, json_event_t event, const char *value, void *data)
+{
+	char **token = data;
+
+	if (event == JSON_STRING && json_path_is(js, "token")) {
+		mem_free0(*token);
+		*token = mem_strdup(value);
+	}
+	return 0;
+}
+
 char *
 docker_get_curl_token_new(char *image_name, char *token_file)
 {
@@ -409,23 +518,16 @@ docker_get_curl_token_new(char *image_name, char *token_file)
 		const char *const argv[] = { CURL_PATH, "-fsSL", url, "-o", token_file, NULL };
 		proc_fork_and_execvp(argv);
 	}
+	mem_free0(url);
 
-	cJSON *jroot = NULL;
-
-	char *buf = file_read_new(token_file, BUF_SIZE);
-	if (!buf) {
-		ERROR("Could not read token file");
+	char *token = NULL;
+	if (json_parse_file(token_file, &docker_token_parse_cb, &token) < 0 || !token) {
+		ERROR("Could not read token from %s", token_file);
+		mem_free0(token);
 		return NULL;
 	}
-
-	jroot = cJSON_Parse(buf);
-	cJSON *jtoken = cJSON_GetObjectItem(jroot, "token");
-
-	char *token = mem_strdup(jtoken->valuestring);
 	//DEBUG("token: %s", token);
 
-	mem_free0(url);
-	cJSON_Delete(jroot);
 	return token;
 }
 
@@ -490,80 +592,405 @@ docker_download_manifest(const char *curl_token, const char *out_file, const cha
 	return ret;
 }
 
-static int
-download_docker_remote_file(const char *curl_token, const docker_remote_file_t *rf,
-			    const char *out_path, const char *image_name)
+typedef struct docker_download {
+	const docker_remote_file_t *rf;
+	char *out_file;
+	char *url;
+	char *auth_basic;
+	char *auth_bearer;
+	bool basic; // bearer auth failed, retrying with basic auth
+	pid_t pid;
+	int pipe_fd;	     // curl's stdout
+	int out_fd;	     // out_file, opened for appending
+	off_t offset;	     // size of the partial out_file the download was resumed at
+	off_t received;	     // bytes received from the current curl process
+	util_sha256_t *hash; // digest of out_file's content so far
+} docker_download_t;
+
+static void
+docker_download_free(docker_download_t *dl)
 {
-	int ret = 0;
-	char *image_hash = NULL;
+	if (dl->pipe_fd >= 0)
+		close(dl->pipe_fd);
+	if (dl->out_fd >= 0)
+		close(dl->out_fd);
+	util_sha256_free(dl->hash);
+	mem_free0(dl->out_file);
+	mem_free0(dl->url);
+	mem_free0(dl->auth_basic);
+	mem_free0(dl->auth_bearer);
+	mem_free0(dl);
+}
+
+/**
+ * The verified marker records the file state a blob's digest was checked for,
+ * so that unchanged blobs need not be rehashed on subsequent runs.
+ */
+static char *
+docker_download_marker_new(const docker_download_t *dl)
+{
+	struct stat st;
+	IF_TRUE_RETVAL(stat(dl->out_file, &st) < 0, NULL);
+
+	return mem_printf("%s %" PRId64 " %" PRIu64 " %" PRId64 ".%09ld\n", dl->rf->digest,
+			  (int64_t)st.st_size, (uint64_t)st.st_ino, (int64_t)st.st_mtim.tv_sec,
+			  st.st_mtim.tv_nsec);
+}
 
-	char *out_file = mem_printf("%s/%s%s", out_path, rf->digest, rf->suffix);
+static void
+docker_download_marker_write(const docker_download_t *dl)
+{
+	char *marker_file = mem_printf("%s" DOCKER_VERIFIED_MARKER_EXT, dl->out_file);
+	char *marker = docker_download_marker_new(dl);
+	if (!marker || file_write(marker_file, marker, -1) < 0)
+		WARN("Could not write verified marker for %s", dl->rf->digest);
+	mem_free0(marker);
+	mem_free0(marker_file);
+}
+
+static bool
+docker_download_marker_valid(const docker_download_t *dl)
+{
+	char *marker_file = mem_printf("%s" DOCKER_VERIFIED_MARKER_EXT, dl->out_file);
+	char *marker = file_exists(marker_file) ? file_read_new(marker_file, 512) : NULL;
+	char *current = marker ? docker_download_marker_new(dl) : NULL;
+
+	bool valid = marker && current && !strcmp(marker, current);
+
+	mem_free0(current);
+	mem_free0(marker);
+	mem_free0(marker_file);
+	return valid;
+}
+
+static void
+docker_download_marker_remove(const docker_download_t *dl)
+{
+	char *marker_file = mem_printf("%s" DOCKER_VERIFIED_MARKER_EXT, dl->out_file);
+	unlink(marker_file);
+	mem_free0(marker_file);
+}
+
+static bool
+docker_download_hash_matches(const docker_download_t *dl)
+{
+	char *image_hash = util_hash_sha256_image_file_new(dl->out_file);
+	IF_NULL_RETVAL(image_hash, false);
 
-	if (file_exists(out_file) && file_size(out_file) == rf->size) {
-		image_hash = util_hash_sha256_image_file_new(out_file);
-		if (!strncmp(image_hash, rf->digest, strlen(image_hash))) {
+	bool match = !strncmp(image_hash, dl->rf->digest, strlen(image_hash));
+	mem_free0(image_hash);
+	return match;
+}
+
+/**
+ * Prepares the download of a remote file. Returns NULL if the file is already
+ * downloaded completely. A partially downloaded file is kept to be resumed.
+ */
+static docker_download_t *
+docker_download_new(const char *curl_token, const docker_remote_file_t *rf, const char *out_path,
+		    const char *image_name)
+{
+	docker_download_t *dl = mem_new0(docker_download_t, 1);
+	dl->rf = rf;
+	dl->out_file = mem_printf("%s/%s%s", out_path, rf->digest, rf->suffix);
+	dl->pid = -1;
+	dl->pipe_fd = -1;
+	dl->out_fd = -1;
+
+	if (file_exists(dl->out_file) && file_size(dl->out_file) >= rf->size) {
+		if (file_size(dl->out_file) == rf->size && docker_download_marker_valid(dl)) {
+			INFO("File %s already downloaded and verified!", rf->digest);
+			docker_download_free(dl);
+			return NULL;
+		}
+		// files of earlier converter versions have no marker, yet
+		if (file_size(dl->out_file) == rf->size && docker_download_hash_matches(dl)) {
 			INFO("File %s already downloaded!", rf->digest);
-			mem_free0(image_hash);
-			return ret;
+			docker_download_marker_write(dl);
+			docker_download_free(dl);
+			return NULL;
 		}
-		mem_free0(image_hash);
+		// nothing to resume, start over
+		unlink(dl->out_file);
 	}
+	docker_download_marker_remove(dl);
+
+	//dl->url = mem_printf("https://registry-1.docker.io/v2/library/%s/blobs/%s:%s",
+	dl->url = mem_printf("https://%s/v2/%s%s/blobs/%s:%s", host_url,
+			     !strchr(image_name, '/') ? "library/" : "", image_name,
+			     rf->digest_algorithm, rf->digest);
+	dl->auth_basic = mem_printf("Authorization: Basic %s", curl_token);
+	dl->auth_bearer = mem_printf("Authorization: Bearer %s", curl_token);
+	return dl;
+}
 
-	//char *url = mem_printf("https://registry-1.docker.io/v2/library/%s/blobs/%s:%s",
-	char *url = mem_printf("https://%s/v2/%s%s/blobs/%s:%s", host_url,
-			       !strchr(image_name, '/') ? "library/" : "", image_name,
-			       rf->digest_algorithm, rf->digest);
+/**
+ * Opens out_file for appending and hashes the part downloaded by an earlier run.
+ */
+static int
+docker_download_open(docker_download_t *dl)
+{
+	dl->out_fd = open(dl->out_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (dl->out_fd < 0) {
+		ERROR_ERRNO("Could not open %s", dl->out_file);
+		return -1;
+	}
 
-	char *auth_basic = mem_printf("Authorization: Basic %s", curl_token);
-	char *auth_bearer = mem_printf("Authorization: Bearer %s", curl_token);
-	const char *const argv_bearer[] = { CURL_PATH, "-fSL", "--progress", "-H", auth_bearer,
-					    url,       "-o",   out_file,     NULL };
-	const char *const argv_basic[] = { CURL_PATH, "-fSL", "--progress", "-H", auth_basic,
-					   url,	      "-o",   out_file,	    NULL };
+	dl->hash = util_sha256_new();
+	IF_NULL_RETVAL(dl->hash, -1);
 
-	ret = proc_fork_and_execvp(argv_bearer);
-	if (ret != 0)
-		ret = proc_fork_and_execvp(argv_basic);
+	dl->offset = lseek(dl->out_fd, 0, SEEK_END);
+	IF_TRUE_RETVAL(dl->offset < 0, -1);
+	if (dl->offset > 0 && util_sha256_update_file(dl->hash, dl->out_file, dl->offset) < 0) {
+		ERROR("Could not hash partial download %s", dl->out_file);
+		return -1;
+	}
+	return 0;
+}
 
-	mem_free0(url);
-	mem_free0(auth_basic);
-	mem_free0(auth_bearer);
+static int
+docker_download_start(docker_download_t *dl)
+{
+	if (dl->out_fd < 0 && docker_download_open(dl) < 0)
+		return -1;
 
-	if (ret < 0) {
-		ERROR("Download failed!");
-		return ret;
+	// resume a partially downloaded blob at its current size, curl writes to our pipe
+	char *range = mem_printf("%" PRId64, (int64_t)dl->offset);
+	const char *auth = dl->basic ? dl->auth_basic : dl->auth_bearer;
+	const char *const argv[] = { CURL_PATH, "-fsSL", "-C", range, "-H", auth, dl->url, NULL };
+
+	if (dl->offset > 0)
+		INFO("Resuming download of %s at %" PRId64 " of %d bytes", dl->rf->digest,
+		     (int64_t)dl->offset, dl->rf->size);
+	else
+		INFO("Downloading %s (%d bytes)", dl->rf->digest, dl->rf->size);
+
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		ERROR_ERRNO("Could not create pipe for download");
+		mem_free0(range);
+		return -1;
 	}
 
-	image_hash = util_hash_sha256_image_file_new(out_file);
-	if (strncmp(image_hash, rf->digest, strlen(image_hash))) {
-		ERROR("SHA256 sum missmatch!");
-		ret = -1;
+	dl->received = 0;
+	dl->pid = fork();
+	switch (dl->pid) {
+	case -1:
+		ERROR_ERRNO("Could not fork for %s", argv[0]);
+		close(fds[0]);
+		close(fds[1]);
+		mem_free0(range);
+		return -1;
+	case 0:
+		if (dup2(fds[1], STDOUT_FILENO) < 0)
+			FATAL_ERRNO("Could not redirect stdout of %s", argv[0]);
+		execvp(argv[0], (char *const *)argv);
+		FATAL_ERRNO("Could not execvp %s", argv[0]);
+	default:
+		break;
 	}
-	INFO("Download of file %s completed!", rf->digest);
 
-	if (image_hash)
-		mem_free0(image_hash);
+	close(fds[1]);
+	dl->pipe_fd = fds[0];
+	mem_free0(range);
+	return 0;
+}
 
-	return ret;
+/**
+ * Moves available data from curl to out_file and the running digest.
+ * Returns 1 while data is pending, 0 on end of stream, -1 on error.
+ */
+static int
+docker_download_read(docker_download_t *dl)
+{
+	unsigned char buf[BUF_SIZE];
+
+	ssize_t len = read(dl->pipe_fd, buf, sizeof(buf));
+	if (len < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 1;
+		ERROR_ERRNO("Could not read download of %s", dl->rf->digest);
+		return -1;
+	}
+	IF_TRUE_RETVAL(len == 0, 0);
+
+	if (fd_write(dl->out_fd, (char *)buf, len) != len) {
+		ERROR_ERRNO("Could not write %s", dl->out_file);
+		return -1;
+	}
+	util_sha256_update(dl->hash, buf, len);
+	dl->received += len;
+	return 1;
+}
+
+/**
+ * Reaps the curl process of a download whose stream ended.
+ * Returns true if curl succeeded.
+ */
+static bool
+docker_download_reap(docker_download_t *dl)
+{
+	int status;
+
+	close(dl->pipe_fd);
+	dl->pipe_fd = -1;
+
+	while (waitpid(dl->pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			ERROR_ERRNO("Could not wait for download of %s", dl->rf->digest);
+			dl->pid = -1;
+			return false;
+		}
+	}
+	dl->pid = -1;
+	return WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+static void
+docker_download_kill(docker_download_t *dl)
+{
+	IF_TRUE_RETURN(dl->pid < 0);
+	kill(dl->pid, SIGTERM);
+	waitpid(dl->pid, NULL, 0);
+	dl->pid = -1;
+}
+
+void
+docker_set_download_parallel(int parallel)
+{
+	download_parallel = MAX(parallel, 1);
+}
+
+/**
+ * Handles the end of a download's stream. Returns 1 if the download was restarted,
+ * 0 if it completed successfully and -1 on error.
+ */
+static int
+docker_download_finish(docker_download_t *dl, bool restart)
+{
+	bool ok = docker_download_reap(dl);
+
+	// an auth failure does not produce any output (-f), thus we can just retry
+	if (!ok && !dl->basic && !dl->received && restart) {
+		INFO("Bearer auth failed for %s, trying Basic auth", dl->rf->digest);
+		dl->basic = true;
+		IF_TRUE_RETVAL(docker_download_start(dl) == 0, 1);
+	}
+
+	if (!ok) {
+		ERROR("Failed to download %s!", dl->rf->digest);
+		return -1;
+	}
+
+	char *image_hash = util_sha256_final_new(dl->hash);
+	dl->hash = NULL;
+	bool match = image_hash && !strncmp(image_hash, dl->rf->digest, strlen(image_hash));
+	mem_free0(image_hash);
+
+	if (!match) {
+		ERROR("SHA256 sum missmatch for %s!", dl->rf->digest);
+		unlink(dl->out_file);
+		return -1;
+	}
+
+	close(dl->out_fd);
+	dl->out_fd = -1;
+	docker_download_marker_write(dl);
+	INFO("Download of file %s completed!", dl->rf->digest);
+	return 0;
 }
 
 int
 docker_download_image(char *curl_token, const docker_manifest_t *manifest, const char *out_path,
 		      const char *image_name, const char *image_tag)
 {
-	int ret = download_docker_remote_file(curl_token, manifest->config, out_path, image_name);
-	if (ret < 0) {
-		ERROR("Failed to download %s!", manifest->config->digest);
-		return -1;
-	}
+	int ret = 0;
+	list_t *pending = NULL;
+	list_t *running = NULL;
+
+	docker_download_t *dl =
+		docker_download_new(curl_token, manifest->config, out_path, image_name);
+	if (dl)
+		pending = list_append(pending, dl);
 	for (int i = 0; i < manifest->layers_size; ++i) {
-		ret = download_docker_remote_file(curl_token, manifest->layers[i], out_path,
-						  image_name);
-		if (ret < 0) {
-			ERROR("Failed to download %s!", manifest->config->digest);
-			return -1;
+		dl = docker_download_new(curl_token, manifest->layers[i], out_path, image_name);
+		if (dl)
+			pending = list_append(pending, dl);
+	}
+
+	// keep up to download_parallel curl processes busy, after an error just drain
+	while (pending || running) {
+		while (ret == 0 && pending && (int)list_length(running) < download_parallel) {
+			dl = pending->data;
+			pending = list_remove(pending, dl);
+			if (docker_download_start(dl) < 0) {
+				ERROR("Failed to download %s!", dl->rf->digest);
+				docker_download_free(dl);
+				ret = -1;
+				break;
+			}
+			running = list_append(running, dl);
+		}
+		if (!running)
+			break;
+
+		unsigned int n = list_length(running);
+		struct pollfd *fds = mem_new0(struct pollfd, n);
+		docker_download_t **dls = mem_new0(docker_download_t *, n);
+		unsigned int i = 0;
+		for (list_t *l = running; l; l = l->next, i++) {
+			dls[i] = l->data;
+			fds[i].fd = dls[i]->pipe_fd;
+			fds[i].events = POLLIN;
+		}
+
+		if (poll(fds, n, -1) < 0 && errno != EINTR) {
+			ERROR_ERRNO("Could not poll downloads");
+			ret = -1;
+		}
+
+		for (i = 0; ret == 0 && i < n; i++) {
+			if (!fds[i].revents)
+				continue;
+
+			dl = dls[i];
+			int r = docker_download_read(dl);
+			if (r > 0)
+				continue;
+
+			running = list_remove(running, dl);
+			if (r < 0) {
+				docker_download_kill(dl);
+			} else {
+				r = docker_download_finish(dl, ret == 0);
+				if (r > 0) {
+					running = list_append(running, dl);
+					continue;
+				}
+			}
+			if (r < 0)
+				ret = -1;
+			docker_download_free(dl);
 		}
+		mem_free0(fds);
+		mem_free0(dls);
+
+		IF_TRUE_GOTO(ret, out);
+	}
+
+out:
+	for (list_t *l = running; l; l = l->next) {
+		dl = l->data;
+		docker_download_kill(dl);
+		docker_download_free(dl);
 	}
+	list_delete(running);
+	for (list_t *l = pending; l; l = l->next)
+		docker_download_free(l->data);
+	list_delete(pending);
+
+	IF_TRUE_RETVAL(ret, -1);
+
 	INFO("Download image %s:%s completed!", image_name, image_tag);
 	return 0;
 }
@@ -74,13 +74,13 @@ typedef struct docker_manifest_list {
 } docker_manifest_list_t;
 
 docker_manifest_list_t *
-docker_parse_manifest_list_new(const char *raw_file_buffer);
+docker_parse_manifest_list_new(const char *file);
 
 docker_manifest_t *
-docker_parse_manifest_new(const char *raw_file_buffer);
+docker_parse_manifest_new(const char *file);
 
 docker_config_t *
-docker_parse_config_new(const char *raw_file_buffer);
+docker_parse_config_new(const char *file);
 
 void
 docker_manifest_list_free(docker_manifest_list_t *ml);
@@ -99,6 +99,11 @@ int
 docker_download_manifest(const char *curl_token, const char *out_file, const char *image_name,
 			 const char *image_tag);
 
+/**
+ * Downloads config and layers of an image. Up to the number of files set by
+ * docker_set_download_parallel() are downloaded concurrently and partially
+ * downloaded files of an earlier attempt are resumed.
+ */
 int
 docker_download_image(char *curl_token, const docker_manifest_t *manifest, const char *out_path,
 		      const char *image_name, const char *image_tag);
@@ -107,6 +112,12 @@ docker_download_image(char *curl_token, const docker_manifest_t *manifest, const
 void
 docker_set_host_url(const char *url);
 
+/**
+ * Sets the maximum number of concurrent downloads of docker_download_image().
+ */
+void
+docker_set_download_parallel(int parallel);
+
 int
 docker_generate_basic_auth(const char *user, const char *password, const char *token_file);
 
@@ -0,0 +1,424 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "json.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/str.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#define JSON_CHUNK_SIZE 4096
+#define JSON_MAX_DEPTH 64
+
+struct json {
+	int fd; // -1 when parsing a buffer
+	const char *buf;
+	size_t len;
+	size_t pos;
+	size_t offset; // of buf in the whole input, for error messages
+	char chunk[JSON_CHUNK_SIZE];
+
+	int depth;
+	char *keys[JSON_MAX_DEPTH + 1];
+	int index[JSON_MAX_DEPTH + 1];
+	str_t *value;
+
+	json_cb_t cb;
+	void *data;
+};
+
+static int
+json_parse_value(json_t *js);
+
+static int
+json_peek(json_t *js)
+{
+	if (js->pos == js->len) {
+		IF_TRUE_RETVAL(js->fd < 0, -1);
+
+		ssize_t len;
+		do {
+			len = read(js->fd, js->chunk, sizeof(js->chunk));
+		} while (len < 0 && errno == EINTR);
+		if (len < 0)
+			ERROR_ERRNO("Could not read JSON input");
+		IF_TRUE_RETVAL(len <= 0, -1);
+
+		js->offset += js->len;
+		js->len = len;
+		js->pos = 0;
+	}
+	return (unsigned char)js->buf[js->pos];
+}
+
+static int
+json_getc(json_t *js)
+{
+	int c = json_peek(js);
+	if (c >= 0)
+		js->pos++;
+	return c;
+}
+
+static int
+json_skip_ws(json_t *js)
+{
+	int c;
+	while ((c = json_peek(js)) == ' ' || c == '\t' || c == '\n' || c == '\r')
+		js->pos++;
+	return c;
+}
+
+static int
+json_error(const json_t *js)
+{
+	ERROR("JSON syntax error at offset %zu", js->offset + js->pos);
+	return -1;
+}
+
+static int
+json_emit(json_t *js, json_event_t event, const char *value)
+{
+	return js->cb(js, event, value, js->data) < 0 ? -1 : 0;
+}
+
+static void
+json_append_utf8(str_t *str, unsigned long cp)
+{
+	char utf8[4];
+	ssize_t len;
+
+	if (cp < 0x80) {
+		utf8[0] = cp;
+		len = 1;
+	} else if (cp < 0x800) {
+		utf8[0] = 0xc0 | (cp >> 6);
+		utf8[1] = 0x80 | (cp & 0x3f);
+		len = 2;
+	} else if (cp < 0x10000) {
+		utf8[0] = 0xe0 | (cp >> 12);
+		utf8[1] = 0x80 | ((cp >> 6) & 0x3f);
+		utf8[2] = 0x80 | (cp & 0x3f);
+		len = 3;
+	} else {
+		utf8[0] = 0xf0 | (cp >> 18);
+		utf8[1] = 0x80 | ((cp >> 12) & 0x3f);
+		utf8[2] = 0x80 | ((cp >> 6) & 0x3f);
+		utf8[3] = 0x80 | (cp & 0x3f);
+		len = 4;
+	}
+	str_append_len(str, utf8, len);
+}
+
+static long
+json_parse_hex4(json_t *js)
+{
+	long cp = 0;
+	for (int i = 0; i < 4; ++i) {
+		int c = json_getc(js);
+		cp <<= 4;
+		if (c >= '0' && c <= '9')
+			cp |= c - '0';
+		else if (c >= 'a' && c <= 'f')
+			cp |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			cp |= c - 'A' + 10;
+		else
+			return -1;
+	}
+	return cp;
+}
+
+/**
+ * Parses a string, whose opening quote is already consumed, into js->value.
+ */
+static int
+json_parse_string(json_t *js)
+{
+	str_truncate(js->value, 0);
+
+	for (;;) {
+		int c = json_getc(js);
+		if (c < 0)
+			return json_error(js);
+		if (c == '"')
+			return 0;
+		if (c != '\\') {
+			char ch = c;
+			str_append_len(js->value, &ch, 1);
+			continue;
+		}
+
+		const char *esc = "\"\"\\\\//b\bf\fn\nr\rt\t";
+		c = json_getc(js);
+		if (c == 'u') {
+			long cp = json_parse_hex4(js);
+			// combine surrogate pairs
+			if (cp >= 0xd800 && cp < 0xdc00) {
+				if (json_getc(js) != '\\' || json_getc(js) != 'u')
+					return json_error(js);
+				long low = json_parse_hex4(js);
+				if (low < 0xdc00 || low >= 0xe000)
+					return json_error(js);
+				cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+			}
+			if (cp < 0)
+				return json_error(js);
+			json_append_utf8(js->value, cp);
+			continue;
+		}
+		for (; *esc && *esc != c; esc += 2)
+			;
+		if (c < 0 || !*esc)
+			return json_error(js);
+		str_append_len(js->value, esc + 1, 1);
+	}
+}
+
+static int
+json_parse_number(json_t *js)
+{
+	int c;
+
+	str_truncate(js->value, 0);
+	while ((c = json_peek(js)) >= 0 && strchr("+-0123456789.eE", c)) {
+		char ch = json_getc(js);
+		str_append_len(js->value, &ch, 1);
+	}
+	return json_emit(js, JSON_NUMBER, str_buffer(js->value));
+}
+
+static int
+json_parse_literal(json_t *js, const char *literal, json_event_t event)
+{
+	for (const char *l = literal; *l; ++l) {
+		if (json_getc(js) != *l)
+			return json_error(js);
+	}
+	return json_emit(js, event, NULL);
+}
+
+static int
+json_parse_member(json_t *js, char *key, int index)
+{
+	if (js->depth == JSON_MAX_DEPTH) {
+		ERROR("JSON nested too deeply");
+		mem_free0(key);
+		return -1;
+	}
+
+	js->depth++;
+	js->keys[js->depth] = key;
+	js->index[js->depth] = index;
+	int ret = json_parse_value(js);
+	mem_free0(js->keys[js->depth]);
+	js->depth--;
+	return ret;
+}
+
+static int
+json_parse_object(json_t *js)
+{
+	IF_TRUE_RETVAL(json_emit(js, JSON_OBJECT_START, NULL), -1);
+
+	if (json_skip_ws(js) == '}') {
+		js->pos++;
+		return json_emit(js, JSON_OBJECT_END, NULL);
+	}
+
+	for (;;) {
+		if (json_skip_ws(js) != '"')
+			return json_error(js);
+		js->pos++;
+		IF_TRUE_RETVAL(json_parse_string(js), -1);
+		char *key = mem_strdup(str_buffer(js->value));
+
+		if (json_skip_ws(js) != ':') {
+			mem_free0(key);
+			return json_error(js);
+		}
+		js->pos++;
+		IF_TRUE_RETVAL(json_parse_member(js, key, -1), -1);
+
+		int c = json_skip_ws(js);
+		js->pos++;
+		if (c == '}')
+			break;
+		if (c != ',')
+			return json_error(js);
+	}
+	return json_emit(js, JSON_OBJECT_END, NULL);
+}
+
+static int
+json_parse_array(json_t *js)
+{
+	IF_TRUE_RETVAL(json_emit(js, JSON_ARRAY_START, NULL), -1);
+
+	if (json_skip_ws(js) == ']') {
+		js->pos++;
+		return json_emit(js, JSON_ARRAY_END, NULL);
+	}
+
+	for (int i = 0;; ++i) {
+		IF_TRUE_RETVAL(json_parse_member(js, NULL, i), -1);
+
+		int c = json_skip_ws(js);
+		js->pos++;
+		if (c == ']')
+			break;
+		if (c != ',')
+			return json_error(js);
+	}
+	return json_emit(js, JSON_ARRAY_END, NULL);
+}
+
+static int
+json_parse_value(json_t *js)
+{
+	int c = json_skip_ws(js);
+
+	switch (c) {
+	case '{':
+		js->pos++;
+		return json_parse_object(js);
+	case '[':
+		js->pos++;
+		return json_parse_array(js);
+	case '"':
+		js->pos++;
+		IF_TRUE_RETVAL(json_parse_string(js), -1);
+		return json_emit(js, JSON_STRING, str_buffer(js->value));
+	case 't':
+		return json_parse_literal(js, "true", JSON_TRUE);
+	case 'f':
+		return json_parse_literal(js, "false", JSON_FALSE);
+	case 'n':
+		return json_parse_literal(js, "null", JSON_NULL);
+	default:
+		if (c == '-' || (c >= '0' && c <= '9'))
+			return json_parse_number(js);
+		return json_error(js);
+	}
+}
+
+static int
+json_parse(json_t *js)
+{
+	js->value = str_new(NULL);
+
+	int ret = json_parse_value(js);
+	if (!ret && json_skip_ws(js) >= 0)
+		ret = json_error(js);
+
+	// free the path of an aborted parse
+	for (; js->depth > 0; js->depth--)
+		mem_free0(js->keys[js->depth]);
+	str_free(js->value, true);
+	return ret;
+}
+
+int
+json_parse_file(const char *file, json_cb_t cb, void *data)
+{
+	json_t *js = mem_new0(json_t, 1);
+	js->buf = js->chunk;
+	js->cb = cb;
+	js->data = data;
+
+	js->fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (js->fd < 0) {
+		ERROR_ERRNO("Could not open %s", file);
+		mem_free0(js);
+		return -1;
+	}
+
+	int ret = json_parse(js);
+	if (ret)
+		ERROR("Failed to parse %s", file);
+
+	close(js->fd);
+	mem_free0(js);
+	return ret;
+}
+
+int
+json_parse_buf(const char *buf, size_t len, json_cb_t cb, void *data)
+{
+	json_t *js = mem_new0(json_t, 1);
+	js->fd = -1;
+	js->buf = buf;
+	js->len = len;
+	js->cb = cb;
+	js->data = data;
+
+	int ret = json_parse(js);
+
+	mem_free0(js);
+	return ret;
+}
+
+int
+json_get_depth(const json_t *js)
+{
+	return js->depth;
+}
+
+const char *
+json_get_key(const json_t *js, int level)
+{
+	IF_TRUE_RETVAL(level < 1 || level > js->depth, NULL);
+	return js->keys[level];
+}
+
+int
+json_get_index(const json_t *js, int level)
+{
+	IF_TRUE_RETVAL(level < 1 || level > js->depth, -1);
+	return js->index[level];
+}
+
+bool
+json_path_is(const json_t *js, const char *path)
+{
+	int level = 1;
+
+	for (const char *p = path; *p; ++level) {
+		size_t len = strcspn(p, "/");
+		IF_TRUE_RETVAL(level > js->depth, false);
+
+		if (len != 1 || *p != '*') {
+			const char *key = js->keys[level];
+			IF_TRUE_RETVAL(!key || strlen(key) != len || strncmp(key, p, len), false);
+		}
+		p += len;
+		if (*p == '/')
+			p++;
+	}
+	return level - 1 == js->depth;
+}
@@ -0,0 +1,102 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file json.h
+ *
+ * Streaming (SAX-style) JSON parser. Instead of building a document tree, the
+ * input is read in small chunks and a callback is invoked for each value with
+ * the path at which the value occurs. Only the current path and the value at
+ * hand are kept in memory, so large documents parse with little allocation.
+ */
+
+#ifndef JSON_H
+#define JSON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct json json_t;
+
+typedef enum json_event {
+	JSON_STRING,
+	JSON_NUMBER,
+	JSON_TRUE,
+	JSON_FALSE,
+	JSON_NULL,
+	JSON_OBJECT_START,
+	JSON_OBJECT_END,
+	JSON_ARRAY_START,
+	JSON_ARRAY_END,
+} json_event_t;
+
+/**
+ * Called for each value. For strings and numbers, value holds the unescaped
+ * string or the number's literal, otherwise it is NULL.
+ * Return a value < 0 to abort parsing.
+ */
+typedef int (*json_cb_t)(const json_t *js, json_event_t event, const char *value, void *data);
+
+/**
+ * Parses the JSON document in file. Returns -1 on syntax errors, if the file
+ * could not be read, or if the callback aborted, 0 otherwise.
+ */
+int
+json_parse_file(const char *file, json_cb_t cb, void *data);
+
+/**
+ * Parses the JSON document in buf of length len.
+ */
+int
+json_parse_buf(const char *buf, size_t len, json_cb_t cb, void *data);
+
+/**
+ * Returns the depth of the current value, i.e., 0 for the root value.
+ */
+int
+json_get_depth(const json_t *js);
+
+/**
+ * Returns the member name of the value at depth 1 <= level <= json_get_depth(),
+ * or NULL if it is an array element.
+ */
+const char *
+json_get_key(const json_t *js, int level);
+
+/**
+ * Returns the index of the array element at depth level, or -1 if it is an
+ * object member.
+ */
+int
+json_get_index(const json_t *js, int level);
+
+/**
+ * Checks whether the current value is located at path. The path is a '/'
+ * separated list of member names, in which an element '*' matches any member
+ * or array element, e.g., "config/Env" matches the Env member of the config
+ * object in the root object.
+ */
+bool
+json_path_is(const json_t *js, const char *path);
+
+#endif /* JSON_H */
@@ -0,0 +1,324 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "layer.h"
+#include "util.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/dir.h"
+#include "common/list.h"
+#include "common/hashmap.h"
+#include "common/proc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define TAR_PATH "tar"
+#define WHITEOUT_PREFIX ".wh."
+#define WHITEOUT_OPAQUE WHITEOUT_PREFIX WHITEOUT_PREFIX ".opq"
+
+struct layer_tree {
+	char *path;
+	bool tmpfs;
+};
+
+typedef struct layer_opaque {
+	const char *root;
+	hashmap_t *members; // names of the entries of the current layer
+} layer_opaque_t;
+
+static int
+layer_remove(const char *path);
+
+static int
+layer_remove_cb(const char *path, const char *name, UNUSED void *data)
+{
+	char *file = mem_printf("%s/%s", path, name);
+	int ret = layer_remove(file);
+	mem_free0(file);
+	return ret;
+}
+
+/**
+ * Removes path recursively. In contrast to dir_delete_folder, symlinks are
+ * never followed as they point into the image's and not into our root.
+ */
+static int
+layer_remove(const char *path)
+{
+	struct stat st;
+
+	if (lstat(path, &st) < 0)
+		return errno == ENOENT ? 0 : -1;
+
+	if (S_ISDIR(st.st_mode)) {
+		IF_TRUE_RETVAL(dir_foreach(path, &layer_remove_cb, NULL) < 0, -1);
+		if (rmdir(path) < 0) {
+			ERROR_ERRNO("Could not remove dir %s", path);
+			return -1;
+		}
+	} else if (unlink(path) < 0) {
+		ERROR_ERRNO("Could not remove %s", path);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Removes everything below an opaque dir which is not part of the current layer.
+ */
+static int
+layer_opaque_cb(const char *path, const char *name, void *data)
+{
+	layer_opaque_t *opq = data;
+	struct stat st;
+	int ret = 0;
+
+	char *file = mem_printf("%s/%s", path, name);
+	const char *member = file + strlen(opq->root) + 1;
+	bool keep = hashmap_get(opq->members, member, strlen(member)) != NULL;
+
+	if (lstat(file, &st) < 0) {
+		ERROR_ERRNO("Could not stat %s", file);
+		ret = -1;
+	} else if (S_ISDIR(st.st_mode)) {
+		// tar archives need not contain the parents of their entries
+		ret = dir_foreach(file, &layer_opaque_cb, opq) < 0 ? -1 : 0;
+		if (!ret && !keep && rmdir(file) < 0 && errno != ENOTEMPTY) {
+			ERROR_ERRNO("Could not remove dir %s", file);
+			ret = -1;
+		}
+	} else if (!keep) {
+		ret = layer_remove(file);
+	}
+
+	mem_free0(file);
+	return ret;
+}
+
+/**
+ * Normalizes a member name as printed by tar, e.g., './etc/' to 'etc'.
+ */
+static char *
+layer_member_new(const char *line)
+{
+	while (!strncmp(line, "./", 2) || *line == '/')
+		line += (*line == '/') ? 1 : 2;
+
+	size_t len = strlen(line);
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '/'))
+		len--;
+	if (len == 0 || (len == 1 && *line == '.'))
+		return NULL;
+
+	char *member = mem_alloc0(len + 1);
+	memcpy(member, line, len);
+	return member;
+}
+
+/**
+ * Extracts layer_file into the tree and returns the names of its members.
+ */
+static int
+layer_extract(const layer_tree_t *tree, const char *layer_file, list_t **members)
+{
+	const char *const argv[] = { TAR_PATH, "-xvf", layer_file, "--quoting-style=literal",
+				     "-C", tree->path, NULL };
+	int status, fds[2];
+
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		ERROR_ERRNO("Could not create pipe for %s", argv[0]);
+		return -1;
+	}
+
+	pid_t pid = fork();
+	switch (pid) {
+	case -1:
+		ERROR_ERRNO("Could not fork for %s", argv[0]);
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	case 0:
+		if (dup2(fds[1], STDOUT_FILENO) < 0)
+			FATAL_ERRNO("Could not redirect stdout of %s", argv[0]);
+		execvp(argv[0], (char *const *)argv);
+		FATAL_ERRNO("Could not execvp %s", argv[0]);
+	default:
+		break;
+	}
+	close(fds[1]);
+
+	FILE *fp = fdopen(fds[0], "r");
+	if (!fp) {
+		ERROR_ERRNO("Could not read output of %s", argv[0]);
+		close(fds[0]);
+	} else {
+		char *line = NULL;
+		size_t n = 0;
+		while (getline(&line, &n, fp) > 0) {
+			char *member = layer_member_new(line);
+			if (member)
+				*members = list_append(*members, member);
+		}
+		free(line);
+		fclose(fp);
+	}
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			ERROR_ERRNO("Could not wait for %s", argv[0]);
+			return -1;
+		}
+	}
+	IF_FALSE_RETVAL(fp && WIFEXITED(status) && !WEXITSTATUS(status), -1);
+	return 0;
+}
+
+static int
+layer_apply_whiteouts(const layer_tree_t *tree, list_t *members)
+{
+	int ret = 0;
+	hashmap_t *names = hashmap_new();
+	layer_opaque_t opq = { .root = tree->path, .members = names };
+
+	for (list_t *l = members; l; l = l->next)
+		hashmap_put(names, l->data, strlen(l->data), l->data);
+
+	// opaque dirs hide all lower content, thus handle them before single files
+	for (list_t *l = members; l; l = l->next) {
+		char *member = l->data;
+		char *base = strrchr(member, '/');
+		base = base ? base + 1 : member;
+		if (strcmp(base, WHITEOUT_OPAQUE))
+			continue;
+
+		char *dir = (base == member) ? mem_strdup(tree->path) :
+					       mem_printf("%s/%.*s", tree->path,
+							  (int)(base - member - 1), member);
+		DEBUG("Clearing opaque dir %s", dir);
+		if (dir_foreach(dir, &layer_opaque_cb, &opq) < 0)
+			ret = -1;
+		mem_free0(dir);
+	}
+
+	for (list_t *l = members; l; l = l->next) {
+		char *member = l->data;
+		char *base = strrchr(member, '/');
+		base = base ? base + 1 : member;
+		if (strncmp(base, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX)))
+			continue;
+
+		if (strcmp(base, WHITEOUT_OPAQUE)) {
+			char *hidden = mem_printf("%s/%.*s%s", tree->path, (int)(base - member),
+						  member, base + strlen(WHITEOUT_PREFIX));
+			DEBUG("Removing whiteout file %s", hidden);
+			if (layer_remove(hidden) < 0)
+				ret = -1;
+			mem_free0(hidden);
+		}
+
+		char *whiteout = mem_printf("%s/%s", tree->path, member);
+		if (unlink(whiteout) < 0 && errno != ENOENT) {
+			ERROR_ERRNO("Could not remove %s", whiteout);
+			ret = -1;
+		}
+		mem_free0(whiteout);
+	}
+
+	hashmap_free(names);
+	return ret;
+}
+
+layer_tree_t *
+layer_tree_new(const char *path)
+{
+	IF_TRUE_RETVAL(dir_mkdir_p(path, 0755) < 0, NULL);
+
+	layer_tree_t *tree = mem_new0(layer_tree_t, 1);
+	tree->path = mem_strdup(path);
+
+	if (mount("tmpfs", path, "tmpfs", MS_NOSUID | MS_NODEV, "mode=0755") < 0) {
+		WARN_ERRNO("Could not mount tmpfs on %s, merging layers on disk", path);
+	} else {
+		tree->tmpfs = true;
+	}
+	return tree;
+}
+
+int
+layer_tree_restore(layer_tree_t *tree, const char *image_file, util_image_format_t format)
+{
+	return util_unsquash_image(image_file, tree->path, format);
+}
+
+int
+layer_tree_apply(layer_tree_t *tree, const char *layer_file)
+{
+	list_t *members = NULL;
+	int ret = -1;
+
+	if (layer_extract(tree, layer_file, &members) < 0) {
+		ERROR("Failed to extract %s", layer_file);
+		goto out;
+	}
+	if (layer_apply_whiteouts(tree, members) < 0) {
+		ERROR("Failed to apply whiteouts of %s", layer_file);
+		goto out;
+	}
+	ret = 0;
+out:
+	for (list_t *l = members; l; l = l->next)
+		mem_free0(l->data);
+	list_delete(members);
+	return ret;
+}
+
+int
+layer_tree_squash(const layer_tree_t *tree, const char *image_file, util_image_format_t format)
+{
+	return util_squash_image(tree->path, image_file, format);
+}
+
+void
+layer_tree_free(layer_tree_t *tree)
+{
+	IF_NULL_RETURN(tree);
+
+	if (tree->tmpfs && umount2(tree->path, MNT_DETACH) < 0)
+		WARN_ERRNO("Could not unmount %s", tree->path);
+	if (layer_remove(tree->path) < 0)
+		WARN("Could not remove %s", tree->path);
+
+	mem_free0(tree->path);
+	mem_free0(tree);
+}
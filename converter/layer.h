@@ -0,0 +1,71 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file layer.h
+ *
+ * Merges docker image layers into a single root file system tree, which is
+ * then packed into a read-only squashfs or erofs image. If possible, the tree is kept on a tmpfs
+ * so that the final image is the only data written to disk.
+ */
+
+#ifndef LAYER_H
+#define LAYER_H
+
+#include "util.h"
+
+typedef struct layer_tree layer_tree_t;
+
+/**
+ * Creates an empty tree at path and mounts a tmpfs on it if possible.
+ */
+layer_tree_t *
+layer_tree_new(const char *path);
+
+/**
+ * Fills the tree with the content of the image of already merged layers.
+ */
+int
+layer_tree_restore(layer_tree_t *tree, const char *image_file, util_image_format_t format);
+
+/**
+ * Extracts the layer tarball on top of the tree and applies its whiteouts,
+ * i.e., removes files hidden by '.wh.<name>' entries and the content of lower
+ * layers in directories marked opaque by '.wh..wh..opq'.
+ */
+int
+layer_tree_apply(layer_tree_t *tree, const char *layer_file);
+
+/**
+ * Packs the tree into the image image_file of the given format.
+ */
+int
+layer_tree_squash(const layer_tree_t *tree, const char *image_file, util_image_format_t format);
+
+/**
+ * Unmounts and removes the tree and frees its resources.
+ */
+void
+layer_tree_free(layer_tree_t *tree);
+
+#endif /* LAYER_H */
@@ -0,0 +1,225 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "store.h"
+#include "util.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/dir.h"
+#include "common/file.h"
+#include "common/hashmap.h"
+#include "common/str.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STORE_BLOBS "blobs"
+#define STORE_CHAINS "chains"
+#define STORE_REFS "refs"
+#define STORE_CHAIN_EXT ".img"
+
+struct store {
+	char *path;
+	char *blob_path;
+	char *chain_path;
+	char *ref_path;
+};
+
+store_t *
+store_new(const char *path)
+{
+	store_t *store = mem_new0(store_t, 1);
+	store->path = mem_strdup(path);
+	store->blob_path = mem_printf("%s/%s", path, STORE_BLOBS);
+	store->chain_path = mem_printf("%s/%s", path, STORE_CHAINS);
+	store->ref_path = mem_printf("%s/%s", path, STORE_REFS);
+
+	if (dir_mkdir_p(store->blob_path, 0755) < 0 || dir_mkdir_p(store->chain_path, 0755) < 0 ||
+	    dir_mkdir_p(store->ref_path, 0755) < 0) {
+		ERROR_ERRNO("Could not create store in %s", path);
+		store_free(store);
+		return NULL;
+	}
+	return store;
+}
+
+void
+store_free(store_t *store)
+{
+	IF_NULL_RETURN(store);
+
+	mem_free0(store->path);
+	mem_free0(store->blob_path);
+	mem_free0(store->chain_path);
+	mem_free0(store->ref_path);
+	mem_free0(store);
+}
+
+const char *
+store_get_blob_path(const store_t *store)
+{
+	ASSERT(store);
+	return store->blob_path;
+}
+
+char *
+store_chain_id_new(const docker_manifest_t *manifest, int n)
+{
+	IF_TRUE_RETVAL(n <= 0 || n > manifest->layers_size, NULL);
+
+	// like docker's chain ids, the id of a single layer is its digest
+	char *chain_id = mem_strdup(manifest->layers[0]->digest);
+	for (int i = 1; i < n && chain_id; ++i) {
+		char *buf = mem_printf("%s %s", chain_id, manifest->layers[i]->digest);
+		util_sha256_t *sha = util_sha256_new();
+		util_sha256_update(sha, buf, strlen(buf));
+		mem_free0(chain_id);
+		chain_id = util_sha256_final_new(sha);
+		mem_free0(buf);
+	}
+	return chain_id;
+}
+
+char *
+store_chain_image_new(const store_t *store, const char *chain_id, util_image_format_t format)
+{
+	// squashfs images keep the names of stores created before other formats existed
+	if (format == UTIL_IMAGE_SQUASHFS)
+		return mem_printf("%s/%s" STORE_CHAIN_EXT, store->chain_path, chain_id);
+	return mem_printf("%s/%s.%s" STORE_CHAIN_EXT, store->chain_path, chain_id,
+			  util_image_format_get_name(format));
+}
+
+int
+store_chain_put(const store_t *store, const char *chain_id, util_image_format_t format,
+		const char *image_file)
+{
+	int ret = -1;
+	char *chain_image = store_chain_image_new(store, chain_id, format);
+	char *tmp_image = mem_printf("%s.tmp", chain_image);
+
+	unlink(tmp_image);
+	if (link(image_file, tmp_image) < 0 &&
+	    file_copy(image_file, tmp_image, -1, 512, 0) < 0) {
+		ERROR("Could not add %s to store", image_file);
+		goto out;
+	}
+	if (rename(tmp_image, chain_image) < 0) {
+		ERROR_ERRNO("Could not add chain %s to store", chain_id);
+		unlink(tmp_image);
+		goto out;
+	}
+	DEBUG("Stored merged image of chain %s", chain_id);
+	ret = 0;
+out:
+	mem_free0(tmp_image);
+	mem_free0(chain_image);
+	return ret;
+}
+
+int
+store_ref(const store_t *store, const char *ref, const docker_manifest_t *manifest)
+{
+	str_t *refs = str_new(NULL);
+	str_append_printf(refs, "%s\n", manifest->config->digest);
+	for (int i = 0; i < manifest->layers_size; ++i) {
+		char *chain_id = store_chain_id_new(manifest, i + 1);
+		str_append_printf(refs, "%s\n%s\n", manifest->layers[i]->digest, chain_id);
+		mem_free0(chain_id);
+	}
+
+	char *ref_file = mem_printf("%s/%s", store->ref_path, ref);
+	char *tmp_file = mem_printf("%s.tmp", ref_file);
+	int ret = file_write(tmp_file, str_buffer(refs), str_length(refs));
+	if (ret < 0 || rename(tmp_file, ref_file) < 0) {
+		ERROR_ERRNO("Could not write store references of %s", ref);
+		unlink(tmp_file);
+		ret = -1;
+	} else {
+		ret = 0;
+	}
+
+	mem_free0(tmp_file);
+	mem_free0(ref_file);
+	str_free(refs, true);
+	return ret;
+}
+
+static int
+store_count_refs_cb(const char *path, const char *name, void *data)
+{
+	hashmap_t *counts = data;
+	char *ref_file = mem_printf("%s/%s", path, name);
+	char *refs = file_read_new(ref_file, file_size(ref_file) + 1);
+	mem_free0(ref_file);
+	IF_NULL_RETVAL(refs, -1);
+
+	char *saveptr = NULL;
+	for (char *id = strtok_r(refs, "\n", &saveptr); id; id = strtok_r(NULL, "\n", &saveptr)) {
+		uintptr_t count = (uintptr_t)hashmap_get(counts, id, strlen(id));
+		hashmap_put(counts, id, strlen(id), (void *)(count + 1));
+	}
+	mem_free0(refs);
+	return 0;
+}
+
+static int
+store_prune_cb(const char *path, const char *name, void *data)
+{
+	hashmap_t *counts = data;
+
+	// blobs, their markers and chain images are named <id>.<ext>
+	size_t len = strcspn(name, ".");
+	IF_TRUE_RETVAL(hashmap_get(counts, name, len), 0);
+
+	char *file = mem_printf("%s/%s", path, name);
+	INFO("Removing unreferenced %s", file);
+	if (unlink(file) < 0)
+		WARN_ERRNO("Could not remove %s", file);
+	mem_free0(file);
+	return 0;
+}
+
+int
+store_prune(const store_t *store)
+{
+	int ret = 0;
+	hashmap_t *counts = hashmap_new();
+
+	if (dir_foreach(store->ref_path, &store_count_refs_cb, counts) < 0) {
+		// do not remove anything still in use by an unreadable ref
+		ERROR("Could not count store references");
+		hashmap_free(counts);
+		return -1;
+	}
+	if (dir_foreach(store->blob_path, &store_prune_cb, counts) < 0)
+		ret = -1;
+	if (dir_foreach(store->chain_path, &store_prune_cb, counts) < 0)
+		ret = -1;
+
+	hashmap_free(counts);
+	return ret;
+}
@@ -0,0 +1,91 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file store.h
+ *
+ * Content-addressed store shared by all converted images. It keeps the
+ * downloaded blobs keyed by their digest and the images of merged layer chains
+ * keyed by their chain id, i.e., a digest over the digests of the chain's
+ * layers, and image format. Images sharing base layers thus reuse both.
+ *
+ * Each converted image records the blobs and chains it uses in a ref file.
+ * Entries whose reference count drops to zero are removed by store_prune().
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include "docker.h"
+#include "util.h"
+
+typedef struct store store_t;
+
+/**
+ * Opens the store at path, creating it if necessary.
+ */
+store_t *
+store_new(const char *path);
+
+void
+store_free(store_t *store);
+
+/**
+ * Returns the dir in which blobs are stored as <digest><suffix>.
+ */
+const char *
+store_get_blob_path(const store_t *store);
+
+/**
+ * Returns the chain id of the first n layers of manifest.
+ */
+char *
+store_chain_id_new(const docker_manifest_t *manifest, int n);
+
+/**
+ * Returns the path of the merged image of a chain in format, which need not exist.
+ */
+char *
+store_chain_image_new(const store_t *store, const char *chain_id, util_image_format_t format);
+
+/**
+ * Adds image_file as merged image of a chain in format. The file is hard linked
+ * if possible.
+ */
+int
+store_chain_put(const store_t *store, const char *chain_id, util_image_format_t format,
+		const char *image_file);
+
+/**
+ * Records the blobs and chains used by the image ref, replacing earlier records.
+ */
+int
+store_ref(const store_t *store, const char *ref, const docker_manifest_t *manifest);
+
+/**
+ * Removes the blobs and chains which are not referenced by any image.
+ */
+int
+store_prune(const store_t *store);
+
+#endif /* STORE_H */
@@ -26,6 +26,7 @@
 #include "common/macro.h"
 #include "common/mem.h"
 #include "common/file.h"
+#include "common/hex.h"
 #include "common/proc.h"
 
 #include <stdlib.h>
@@ -42,6 +43,9 @@
 #define MKSQUASHFS_PATH "mksquashfs"
 #define MKSQUASHFS_COMP "gzip"
 #define MKSQUASHFS_BSIZE "131072"
+#define UNSQUASHFS_PATH "unsquashfs"
+#define MKFS_EROFS_PATH "mkfs.erofs"
+#define FSCK_EROFS_PATH "fsck.erofs"
 
 #define SIGN_HASH_BUFFER_SIZE 4096
 
@@ -84,19 +88,6 @@ util_tar_extract(const char *tar_filename, const char *out_dir)
 	return proc_fork_and_execvp(argv);
 }
 
-static char *
-convert_bin_to_hex_new(const uint8_t *bin, int length)
-{
-	char *hex = mem_alloc0(sizeof(char) * length * 2 + 1);
-
-	for (int i = 0; i < length; ++i) {
-		// remember snprintf additionally writs a '0' byte
-		snprintf(hex + i * 2, 3, "%.2x", bin[i]);
-	}
-
-	return hex;
-}
-
 char *
 util_hash_sha_image_file_new(const char *image_file)
 {
@@ -118,7 +109,7 @@ util_hash_sha_image_file_new(const char *image_file)
 	fclose(fp);
 
 	SHA1_Final(buf, &ctx);
-	return convert_bin_to_hex_new(buf, SHA_DIGEST_LENGTH);
+	return hex_encode_new(buf, SHA_DIGEST_LENGTH);
 }
 
 char *
@@ -142,17 +133,145 @@ util_hash_sha256_image_file_new(const char *image_file)
 	fclose(fp);
 
 	SHA256_Final(buf, &ctx);
-	return convert_bin_to_hex_new(buf, SHA256_DIGEST_LENGTH);
+	return hex_encode_new(buf, SHA256_DIGEST_LENGTH);
+}
+
+struct util_sha256 {
+	SHA256_CTX ctx;
+};
+
+util_sha256_t *
+util_sha256_new(void)
+{
+	util_sha256_t *sha = mem_new0(util_sha256_t, 1);
+	SHA256_Init(&sha->ctx);
+	return sha;
+}
+
+void
+util_sha256_update(util_sha256_t *sha, const void *buf, size_t len)
+{
+	SHA256_Update(&sha->ctx, buf, len);
 }
 
 int
-util_squash_image(const char *dir, const char *image_file)
+util_sha256_update_file(util_sha256_t *sha, const char *file, off_t len)
 {
-	const char *const argv[] = { MKSQUASHFS_PATH, dir,  image_file,	      "-noappend", "-comp",
-				     MKSQUASHFS_COMP, "-b", MKSQUASHFS_BSIZE, NULL };
+	FILE *fp = NULL;
+
+	if (!(fp = fopen(file, "rb"))) {
+		ERROR_ERRNO("Error in file hasing, cannot open %s", file);
+		return -1;
+	}
+
+	size_t n = 0;
+	unsigned char buf[SIGN_HASH_BUFFER_SIZE];
+
+	while (len > 0) {
+		n = fread(buf, 1, MIN((off_t)sizeof(buf), len), fp);
+		if (n == 0)
+			break;
+		SHA256_Update(&sha->ctx, buf, n);
+		len -= n;
+	}
+	fclose(fp);
+
+	return len > 0 ? -1 : 0;
+}
+
+char *
+util_sha256_final_new(util_sha256_t *sha)
+{
+	unsigned char buf[SHA256_DIGEST_LENGTH];
+
+	IF_NULL_RETVAL(sha, NULL);
+
+	SHA256_Final(buf, &sha->ctx);
+	mem_free0(sha);
+	return hex_encode_new(buf, SHA256_DIGEST_LENGTH);
+}
+
+void
+util_sha256_free(util_sha256_t *sha)
+{
+	IF_NULL_RETURN(sha);
+	mem_free0(sha);
+}
+
+static const struct {
+	const char *name;
+	const char *fs;
+	const char *comp; // compressor argument of mkfs.erofs
+} util_image_formats[] = {
+	[UTIL_IMAGE_SQUASHFS] = { "squashfs", "squashfs", NULL },
+	[UTIL_IMAGE_EROFS_LZ4] = { "erofs-lz4", "erofs", "-zlz4" },
+	[UTIL_IMAGE_EROFS_LZ4HC] = { "erofs-lz4hc", "erofs", "-zlz4hc,12" },
+	[UTIL_IMAGE_EROFS_LZMA] = { "erofs-lzma", "erofs", "-zlzma" },
+};
+
+int
+util_image_format_from_string(const char *name, util_image_format_t *format)
+{
+	IF_NULL_RETVAL(name, -1);
+
+	for (size_t i = 0; i < sizeof(util_image_formats) / sizeof(util_image_formats[0]); i++) {
+		if (!strcmp(name, util_image_formats[i].name)) {
+			*format = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const char *
+util_image_format_get_name(util_image_format_t format)
+{
+	return util_image_formats[format].name;
+}
+
+const char *
+util_image_format_get_fs(util_image_format_t format)
+{
+	return util_image_formats[format].fs;
+}
+
+int
+util_squash_image(const char *dir, const char *image_file, util_image_format_t format)
+{
+	if (format == UTIL_IMAGE_SQUASHFS) {
+		const char *const argv[] = { MKSQUASHFS_PATH, dir,		image_file,
+					     "-noappend",     "-comp",		MKSQUASHFS_COMP,
+					     "-b",	      MKSQUASHFS_BSIZE, NULL };
+		return proc_fork_and_execvp(argv);
+	}
+
+	/*
+	 * Physical clusters are kept at the default of one block, so that a random read
+	 * decompresses no more than the block it needs. Identical data of different files
+	 * and layers is stored once, small tails are packed into their inodes.
+	 */
+	const char *const argv[] = { MKFS_EROFS_PATH, util_image_formats[format].comp,
+				     "-Ededupe",      "-Eztailpacking", image_file, dir, NULL };
 	return proc_fork_and_execvp(argv);
 }
 
+int
+util_unsquash_image(const char *image_file, const char *dir, util_image_format_t format)
+{
+	if (format == UTIL_IMAGE_SQUASHFS) {
+		const char *const argv[] = { UNSQUASHFS_PATH, "-f", "-n", "-d", dir, image_file,
+					     NULL };
+		return proc_fork_and_execvp(argv);
+	}
+
+	char *extract = mem_printf("--extract=%s", dir);
+	const char *const argv[] = { FSCK_EROFS_PATH, extract,	  "--overwrite",
+				     "--preserve",    image_file, NULL };
+	int ret = proc_fork_and_execvp(argv);
+	mem_free0(extract);
+	return ret;
+}
+
 int
 util_sign_guestos(const char *sig_file, const char *cfg_file, const char *key_file)
 {
@@ -42,11 +42,78 @@ util_hash_sha_image_file_new(const char *image_file);
 char *
 util_hash_sha256_image_file_new(const char *image_file);
 
+/**
+ * Incremental SHA256 digest, e.g., for hashing data while it is downloaded.
+ */
+typedef struct util_sha256 util_sha256_t;
+
+util_sha256_t *
+util_sha256_new(void);
+
+void
+util_sha256_update(util_sha256_t *sha, const void *buf, size_t len);
+
+/**
+ * Feeds the first len bytes of file into the digest.
+ */
+int
+util_sha256_update_file(util_sha256_t *sha, const char *file, off_t len);
+
+/**
+ * Returns the hex encoded digest and frees sha.
+ */
+char *
+util_sha256_final_new(util_sha256_t *sha);
+
+void
+util_sha256_free(util_sha256_t *sha);
+
 int
 util_tar_extract(const char *tar_filename, const char *out_dir);
 
+/**
+ * File system and compression of the root images created by the converter.
+ * squashfs is the default, the erofs variants deduplicate file data and give
+ * better random read performance for read-only container roots.
+ */
+typedef enum {
+	UTIL_IMAGE_SQUASHFS = 0,
+	UTIL_IMAGE_EROFS_LZ4,
+	UTIL_IMAGE_EROFS_LZ4HC,
+	UTIL_IMAGE_EROFS_LZMA,
+} util_image_format_t;
+
+/**
+ * Parses a format name as returned by util_image_format_get_name().
+ *
+ * @return 0 on success, -1 if name is no known format
+ */
+int
+util_image_format_from_string(const char *name, util_image_format_t *format);
+
+/**
+ * Returns the name of format, e.g. "erofs-lz4".
+ */
+const char *
+util_image_format_get_name(util_image_format_t format);
+
+/**
+ * Returns the file system type of images in format to be used for mounting.
+ */
+const char *
+util_image_format_get_fs(util_image_format_t format);
+
+/**
+ * Packs dir into the read-only image image_file of the given format.
+ */
+int
+util_squash_image(const char *dir, const char *image_file, util_image_format_t format);
+
+/**
+ * Extracts the content of image_file of the given format into the existing dir.
+ */
 int
-util_squash_image(const char *dir, const char *image_file);
+util_unsquash_image(const char *image_file, const char *dir, util_image_format_t format);
 
 int
 util_sign_guestos(const char *sig_file, const char *cfg_file, const char *key_file);
@@ -0,0 +1,220 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "activation.h"
+#include "cmld.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/list.h"
+#include "common/event.h"
+#include "common/dir.h"
+#include "common/uuid.h"
+
+#include <string.h>
+#include <unistd.h>
+
+typedef struct activation {
+	container_t *container;
+	container_callback_t *observer;
+	char *dir;
+	size_t n;
+	int *fds;
+	event_io_t **events; // registered while the container is stopped or frozen
+	bool armed;
+} activation_t;
+
+static list_t *activation_list = NULL;
+
+static activation_t *
+activation_get(const container_t *container)
+{
+	for (list_t *l = activation_list; l; l = l->next) {
+		activation_t *a = l->data;
+		if (a->container == container)
+			return a;
+	}
+	return NULL;
+}
+
+static void
+activation_arm(activation_t *a, bool armed)
+{
+	if (a->armed == armed)
+		return;
+
+	for (size_t i = 0; i < a->n; i++) {
+		if (armed)
+			event_add_io(a->events[i]);
+		else
+			event_remove_io(a->events[i]);
+	}
+	a->armed = armed;
+}
+
+static void
+activation_cb_accept(UNUSED int fd, UNUSED unsigned events, UNUSED event_io_t *io, void *data)
+{
+	activation_t *a = data;
+	container_t *container = a->container;
+
+	// the connection is left pending for the container, which accepts it after start
+	activation_arm(a, false);
+
+	container_state_t state = container_get_state(container);
+	if (state == CONTAINER_STATE_STOPPED) {
+		INFO("Connection on activation socket, starting container %s",
+		     container_get_description(container));
+		if (cmld_container_start(container) < 0)
+			WARN("Could not start container %s on demand, not listening anymore",
+			     container_get_description(container));
+	} else if (state == CONTAINER_STATE_FROZEN) {
+		INFO("Connection on activation socket, thawing container %s",
+		     container_get_description(container));
+		if (cmld_container_unfreeze(container) < 0)
+			WARN("Could not thaw container %s on demand, not listening anymore",
+			     container_get_description(container));
+	}
+}
+
+/*
+ * Listens on the sockets while nobody else accepts connections on them.
+ */
+static void
+activation_observer_cb(container_t *container, UNUSED container_callback_t *cb, void *data)
+{
+	activation_t *a = data;
+	container_state_t state = container_get_state(container);
+
+	activation_arm(a, state == CONTAINER_STATE_STOPPED || state == CONTAINER_STATE_FROZEN);
+}
+
+static void
+activation_free(activation_t *a)
+{
+	activation_arm(a, false);
+	if (a->observer)
+		container_unregister_observer(a->container, a->observer);
+	container_set_activation_fds(a->container, NULL);
+
+	size_t len;
+	char **names = container_get_activation_sockets(a->container, &len);
+	for (size_t i = 0; i < a->n; i++) {
+		if (a->events[i])
+			event_io_free(a->events[i]);
+		if (a->fds[i] >= 0) {
+			close(a->fds[i]);
+			char *path = mem_printf("%s/%s", a->dir, names[i]);
+			unlink(path);
+			mem_free0(path);
+		}
+	}
+	if (rmdir(a->dir) < 0)
+		TRACE_ERRNO("Could not remove %s", a->dir);
+
+	mem_free0(a->events);
+	mem_free0(a->fds);
+	mem_free0(a->dir);
+	mem_free0(a);
+}
+
+int
+activation_add(container_t *container)
+{
+	ASSERT(container);
+
+	size_t n;
+	char **names = container_get_activation_sockets(container, &n);
+	IF_TRUE_RETVAL(n == 0, 0);
+
+	activation_t *a = mem_new0(activation_t, 1);
+	a->container = container;
+	a->dir = mem_printf("%s/%s", ACTIVATION_SOCKET_DIR,
+			    uuid_string(container_get_uuid(container)));
+	a->n = n;
+	a->fds = mem_new0(int, n);
+	a->events = mem_new0(event_io_t *, n);
+	for (size_t i = 0; i < n; i++)
+		a->fds[i] = -1;
+
+	if (dir_mkdir_p(a->dir, 0755) < 0) {
+		ERROR_ERRNO("Could not create activation socket dir %s", a->dir);
+		goto error;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		if (!names[i][0] || strchr(names[i], '/') || !strcmp(names[i], ".") ||
+		    !strcmp(names[i], "..")) {
+			ERROR("Invalid activation socket name '%s' for container %s", names[i],
+			      container_get_description(container));
+			goto error;
+		}
+
+		char *path = mem_printf("%s/%s", a->dir, names[i]);
+		int fd = sock_unix_create(SOCK_STREAM | SOCK_CLOEXEC);
+		if (fd >= 0 && (sock_unix_bind(fd, path) < 0 || sock_unix_listen(fd) < 0)) {
+			close(fd);
+			fd = -1;
+		}
+		mem_free0(path);
+		IF_TRUE_GOTO(fd < 0, error);
+
+		a->fds[i] = fd;
+		a->events[i] = event_io_new(fd, EVENT_IO_READ, activation_cb_accept, a);
+	}
+
+	a->observer = container_register_observer(container, activation_observer_cb, a);
+	IF_NULL_GOTO_ERROR(a->observer, error);
+
+	container_set_activation_fds(container, a->fds);
+	activation_list = list_append(activation_list, a);
+	activation_observer_cb(container, a->observer, a);
+
+	INFO("Container %s is started on demand by %zu activation sockets in %s",
+	     container_get_description(container), n, a->dir);
+	return 0;
+
+error:
+	activation_free(a);
+	return -1;
+}
+
+void
+activation_remove(container_t *container)
+{
+	ASSERT(container);
+
+	activation_t *a = activation_get(container);
+	IF_NULL_RETURN(a);
+
+	activation_list = list_remove(activation_list, a);
+	activation_free(a);
+}
+
+bool
+activation_is_on_demand(const container_t *container)
+{
+	size_t n;
+	container_get_activation_sockets(container, &n);
+	return n > 0;
+}
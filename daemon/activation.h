@@ -0,0 +1,66 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file activation.h
+ *
+ * Socket activation of containers which are only needed occasionally. For each name
+ * in the activation_sockets of the container config, cmld listens on a unix socket
+ * in ACTIVATION_SOCKET_DIR/<uuid>/ while the container is stopped or frozen. The
+ * first connection starts or thaws the container, whose init receives the listening
+ * sockets as in sd_listen_fds(3) and accepts the pending connection itself. Thus,
+ * such containers do not take any memory or cpu time until they are used.
+ */
+
+#ifndef ACTIVATION_H
+#define ACTIVATION_H
+
+#include "container.h"
+
+#include "common/sock.h"
+
+#define ACTIVATION_SOCKET_DIR CMLD_SOCKET_DIR "/activation"
+
+/**
+ * Creates the activation sockets of the container and starts listening on them
+ * while the container is stopped or frozen. Does nothing if the container has no
+ * activation sockets.
+ *
+ * @return 0 on success, -1 if the sockets could not be created
+ */
+int
+activation_add(container_t *container);
+
+/**
+ * Closes and removes the activation sockets of the container, if any.
+ */
+void
+activation_remove(container_t *container);
+
+/**
+ * Returns whether the container is started on demand instead of being autostarted.
+ */
+bool
+activation_is_on_demand(const container_t *container);
+
+#endif /* ACTIVATION_H */
@@ -28,6 +28,7 @@
 #include "audit.h"
 
 #include "cmld.h"
+#include "control.h"
 #include "smartcard.h"
 
 #include "common/audit.h"
@@ -41,13 +42,22 @@
 #include "common/event.h"
 #include "common/fd.h"
 #include "common/nl.h"
+#include "common/list.h"
+#include "common/metrics.h"
+#include "common/probe.h"
 
+#include <arpa/inet.h>
+#include <endian.h>
 #include <fcntl.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <linux/audit.h>
 #include <inttypes.h>
 #include <google/protobuf-c/protobuf-c-text.h>
+#ifdef AUDIT_ZSTD
+#include <zstd.h>
+#endif
 
 //TODO implement ACK mechanism fpr all service messages inside c-service.c?
 #include "c_service.pb-c.h"
@@ -63,6 +73,23 @@
 
 #define AUDIT_DELIMITER "-----\n"
 
+// batching of the kernel audit netlink reader
+#define AUDIT_KERNEL_RECV_BATCH 32
+#define AUDIT_KERNEL_RECV_ROUNDS 8
+#define AUDIT_KERNEL_RCVBUF_SIZE (8 * 1024 * 1024)
+
+static audit_kernel_stats_t audit_kernel_stats;
+static audit_delivery_stats_t audit_delivery_stats;
+
+// upper bounds for the records delivered to a container in one message
+#define AUDIT_SEND_WINDOW_MAX 256
+#define AUDIT_SEND_BATCH_MAX_BYTES (PROTOBUF_MAX_MESSAGE_SIZE / 2)
+
+// in-memory ring of pending records, spilled to the journal on overflow or age
+#define AUDIT_RING_SIZE 256
+#define AUDIT_RING_MAX_AGE 2	       // seconds
+#define AUDIT_RING_FLUSH_INTERVAL 1000 // milliseconds
+
 //#undef LOGF_LOG_MIN_PRIO
 //#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
 
@@ -118,180 +145,592 @@ audit_get_log_container(const uuid_t *uuid)
 	return c;
 }
 
+/*
+ * Binary audit journal, one per logging container. The file starts with a
+ * header holding a magic and the offset of the first record not yet
+ * acknowledged by the container (read cursor). Each record follows as a
+ * 4 byte length in network byte order and the packed AuditRecord.
+ * Records are appended through an O_APPEND fd, so that records written by
+ * forked container children are never overwritten; the cursor is updated in
+ * place through a second fd.
+ */
+#define AUDIT_JOURNAL_MAGIC "CMLAUDJ1"
+#define AUDIT_JOURNAL_MAGIC_LEN 8
+#define AUDIT_JOURNAL_HEADER_LEN (AUDIT_JOURNAL_MAGIC_LEN + sizeof(uint64_t))
+#define AUDIT_JOURNAL_FRAME_LEN sizeof(uint32_t)
+
+/*
+ * If built with AUDIT_ZSTD, each record is stored zstd compressed in its frame
+ * if this saves space. Such frames are marked by the most significant bit of
+ * their length, thus journals without compressed records stay readable by all
+ * versions and the read cursor still points to single records.
+ */
+#define AUDIT_JOURNAL_FRAME_COMPRESSED 0x80000000u
+#define AUDIT_JOURNAL_ZSTD_LEVEL 3
+
+/*
+ * Records logged while the journal holds no pending records are kept packed
+ * in a bounded ring in memory and delivered from there. They are written to
+ * the journal only if the ring overflows, if they are not acknowledged within
+ * AUDIT_RING_MAX_AGE, or on audit_flush().
+ */
+typedef struct {
+	uint8_t *buf;
+	size_t len;
+	time_t time; /**< monotonic time the record was logged */
+} audit_ring_entry_t;
+
+typedef struct {
+	char *file;
+	int fd_append;	   /**< O_APPEND fd for new records */
+	int fd;		   /**< fd for reading records and updating the cursor */
+	uint64_t size;	   /**< size of the journal file */
+	uint64_t head;	   /**< offset of the next record to be sent */
+	uint64_t sent_end; /**< offset behind the records of the last sent message, 0 if none */
+	audit_ring_entry_t ring[AUDIT_RING_SIZE];
+	unsigned ring_first;   /**< index of the oldest record in the ring */
+	unsigned ring_count;   /**< number of records in the ring */
+	unsigned ring_sent;    /**< records of the ring contained in the last sent message */
+	uint64_t ring_bytes;   /**< size of the records in the ring including frame headers */
+	unsigned sent_records; /**< records contained in the last sent message */
+	uint64_t sent_ns;      /**< monotonic time the last message was sent */
+} audit_journal_t;
+
+static list_t *audit_journal_list = NULL;
+
+// pid of cmld, forked children bypass the ring which is not shared with them
+static pid_t audit_pid = 0;
+
 static char *
-audit_log_file_new(const char *uuid)
+audit_journal_file_new(const char *uuid)
 {
 	if (C0 == LOGMODE)
-		return mem_printf("%s/%s.log", AUDIT_LOGDIR, AUDIT_DEFAULT_CONTAINER);
+		return mem_printf("%s/%s.journal", AUDIT_LOGDIR, AUDIT_DEFAULT_CONTAINER);
 	else
-		return mem_printf("%s/%s.log", AUDIT_LOGDIR, uuid);
+		return mem_printf("%s/%s.journal", AUDIT_LOGDIR, uuid);
 }
 
-static uint64_t
-audit_remaining_storage(const char *uuid)
+static int
+audit_journal_write_head(audit_journal_t *j, uint64_t head)
 {
-	char *file = audit_log_file_new(uuid);
-	off_t size = file_size(file);
-
-	if (!file_exists(file)) {
-		mem_free0(file);
-		return AUDIT_STORAGE;
+	uint64_t head_be = htobe64(head);
+	if (pwrite(j->fd, &head_be, sizeof(head_be), AUDIT_JOURNAL_MAGIC_LEN) != sizeof(head_be)) {
+		ERROR_ERRNO("Failed to update read cursor of audit journal %s", j->file);
+		return -1;
 	}
-	mem_free0(file);
+	j->head = head;
+	return 0;
+}
 
-	if (0 > size) {
-		ERROR_ERRNO("Failed to retrieve size of audit log file");
-		return 0;
+/*
+ * Drops all records before the read cursor. The remaining records are copied
+ * to a new journal which atomically replaces the old one.
+ */
+static int
+audit_journal_compact(audit_journal_t *j)
+{
+	char buf[4096];
+	uint64_t from = j->head;
+	uint64_t head_be = htobe64(AUDIT_JOURNAL_HEADER_LEN);
+	char *tmp = mem_printf("%s.tmp", j->file);
+	int fd = -1, fd_append = -1;
+
+	IF_TRUE_GOTO(j->head <= AUDIT_JOURNAL_HEADER_LEN, out);
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	IF_TRUE_GOTO_ERROR(fd < 0, err);
+	IF_TRUE_GOTO_ERROR(fd_write(fd, AUDIT_JOURNAL_MAGIC, AUDIT_JOURNAL_MAGIC_LEN) < 0, err);
+	IF_TRUE_GOTO_ERROR(fd_write(fd, (char *)&head_be, sizeof(head_be)) < 0, err);
+
+	while (from < j->size) {
+		size_t len = MIN(sizeof(buf), j->size - from);
+		IF_TRUE_GOTO_ERROR(pread(j->fd, buf, len, from) != (ssize_t)len, err);
+		IF_TRUE_GOTO_ERROR(fd_write(fd, buf, len) < 0, err);
+		from += len;
 	}
+	IF_TRUE_GOTO_ERROR(fsync(fd), err);
+
+	fd_append = open(tmp, O_WRONLY | O_APPEND | O_CLOEXEC);
+	IF_TRUE_GOTO_ERROR(fd_append < 0, err);
+	IF_TRUE_GOTO_ERROR(rename(tmp, j->file), err);
+
+	close(j->fd);
+	close(j->fd_append);
+	j->fd = fd;
+	j->fd_append = fd_append;
+	j->size = AUDIT_JOURNAL_HEADER_LEN + (j->size - j->head);
+	j->sent_end =
+		j->sent_end > j->head ? j->sent_end - (j->head - AUDIT_JOURNAL_HEADER_LEN) : 0;
+	j->head = AUDIT_JOURNAL_HEADER_LEN;
+
+	DEBUG("Compacted audit journal %s to %" PRIu64 " bytes", j->file, j->size);
+out:
+	mem_free0(tmp);
+	return 0;
+err:
+	ERROR_ERRNO("Failed to compact audit journal %s", j->file);
+	if (fd >= 0)
+		close(fd);
+	if (fd_append >= 0)
+		close(fd_append);
+	unlink(tmp);
+	mem_free0(tmp);
+	return -1;
+}
 
-	if ((uint64_t)size > AUDIT_STORAGE) {
-		ERROR("Detected audit log overflow");
-		return 0;
+/*
+ * Checks the records behind the read cursor and cuts off a record which was
+ * only partially written, e.g., due to a power loss.
+ */
+static void
+audit_journal_recover(audit_journal_t *j)
+{
+	uint64_t off = j->head;
+
+	while (off + AUDIT_JOURNAL_FRAME_LEN <= j->size) {
+		uint32_t len_be;
+		if (pread(j->fd, &len_be, sizeof(len_be), off) != sizeof(len_be))
+			break;
+		uint64_t next = off + AUDIT_JOURNAL_FRAME_LEN +
+				(ntohl(len_be) & ~AUDIT_JOURNAL_FRAME_COMPRESSED);
+		if (next > j->size)
+			break;
+		off = next;
 	}
 
-	return AUDIT_STORAGE - size;
+	if (off != j->size) {
+		WARN("Truncating incomplete record at %" PRIu64 " of audit journal %s", off,
+		     j->file);
+		if (ftruncate(j->fd, off))
+			ERROR_ERRNO("Failed to truncate audit journal %s", j->file);
+		else
+			j->size = off;
+	}
 }
 
+static int
+audit_journal_append(audit_journal_t *j, const AuditRecord *record);
+
+static AuditRecord *
+audit_record_corrupt_new(const char *raw, size_t len);
+
+/*
+ * Imports the records of a text log written by earlier versions.
+ */
 static void
-audit_send_record_cb(const char *hash_string, const char *hash_file,
-		     UNUSED smartcard_crypto_hashalgo_t hash_algo, void *data)
+audit_journal_import_textfile(audit_journal_t *j, const char *uuid)
 {
-	uint8_t *buf = NULL;
-	const container_t *c = (const container_t *)data;
-	ASSERT(c);
+	char *file = C0 == LOGMODE ?
+			     mem_printf("%s/%s.log", AUDIT_LOGDIR, AUDIT_DEFAULT_CONTAINER) :
+			     mem_printf("%s/%s.log", AUDIT_LOGDIR, uuid);
 
-	// callback is triggert twice for cleanup
-	IF_NULL_RETURN_TRACE(hash_string);
+	IF_FALSE_GOTO(file_exists(file), out);
 
-	if (!hash_file) {
-		ERROR("audit_send_record_cb: hash_file was empty");
-		return;
+	protobuf_text_reader_t *reader = protobuf_text_reader_new(file, AUDIT_DELIMITER);
+	if (!reader) {
+		ERROR("Failed to import audit log %s", file);
+		goto out;
 	}
 
-	if (!data) {
-		ERROR("audit_send_record_cb: No container given");
-		return;
+	int ret;
+	ProtobufCMessage *msg;
+	while ((ret = protobuf_text_reader_next(reader, &audit_record__descriptor, &msg))) {
+		AuditRecord *record = (AuditRecord *)msg;
+		if (ret < 0) {
+			size_t len;
+			const char *raw = protobuf_text_reader_get_record(reader, &len);
+			record = audit_record_corrupt_new(raw, len);
+		}
+		audit_journal_append(j, record);
+		protobuf_free_message((ProtobufCMessage *)record);
 	}
+	protobuf_text_reader_free(reader);
 
-	uint32_t buf_len = file_size(hash_file);
-	buf = mem_alloc0(buf_len);
+	DEBUG("Imported audit log %s, removing file", file);
+	if (unlink(file))
+		ERROR_ERRNO("Failed to remove audit log file %s", file);
+out:
+	mem_free0(file);
+}
 
-	int read = file_read(hash_file, (char *)buf, buf_len);
+static audit_journal_t *
+audit_journal_open(const char *file)
+{
+	audit_journal_t *j = mem_new0(audit_journal_t, 1);
+	j->file = mem_strdup(file);
+	j->fd_append = -1;
 
-	if (read < 0 || buf_len != (unsigned int)read) {
-		ERROR("Processing SCD response: read %u bytes, expected %u", read, buf_len);
-		goto out;
+	if (!file_is_dir(AUDIT_LOGDIR) && dir_mkdir_p(AUDIT_LOGDIR, 0700)) {
+		ERROR("Failed to create logdir");
+		goto err;
 	}
 
-	TRACE("Got hash from SCD for file %s: %s", hash_file, hash_string);
+	j->fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (j->fd < 0) {
+		ERROR_ERRNO("Failed to open audit journal %s", file);
+		goto err;
+	}
+	j->fd_append = open(file, O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (j->fd_append < 0) {
+		ERROR_ERRNO("Failed to open audit journal %s", file);
+		goto err;
+	}
 
-	if (unlink(hash_file)) {
-		ERROR_ERRNO("Failed to unlink %s", hash_file);
+	char header[AUDIT_JOURNAL_HEADER_LEN];
+	ssize_t len = pread(j->fd, header, sizeof(header), 0);
+	if (len == sizeof(header) &&
+	    !memcmp(header, AUDIT_JOURNAL_MAGIC, AUDIT_JOURNAL_MAGIC_LEN)) {
+		uint64_t head_be;
+		memcpy(&head_be, header + AUDIT_JOURNAL_MAGIC_LEN, sizeof(head_be));
+		j->head = be64toh(head_be);
+		j->size = lseek(j->fd, 0, SEEK_END);
+		if (j->head < AUDIT_JOURNAL_HEADER_LEN || j->head > j->size) {
+			ERROR("Invalid read cursor in audit journal %s, resending all records",
+			      file);
+			IF_TRUE_GOTO(audit_journal_write_head(j, AUDIT_JOURNAL_HEADER_LEN), err);
+		}
+		audit_journal_recover(j);
+	} else {
+		if (len != 0)
+			WARN("Reinitializing corrupted audit journal %s", file);
+		IF_TRUE_GOTO_ERROR(ftruncate(j->fd, 0), err);
+		IF_TRUE_GOTO_ERROR(pwrite(j->fd, AUDIT_JOURNAL_MAGIC, AUDIT_JOURNAL_MAGIC_LEN, 0) !=
+					   AUDIT_JOURNAL_MAGIC_LEN,
+				   err);
+		IF_TRUE_GOTO(audit_journal_write_head(j, AUDIT_JOURNAL_HEADER_LEN), err);
+		j->size = AUDIT_JOURNAL_HEADER_LEN;
 	}
 
-	char *old_acked = mem_strdup(container_audit_get_last_ack(c));
-	container_audit_set_last_ack(c, hash_string);
+	TRACE("Opened audit journal %s (size %" PRIu64 ", head %" PRIu64 ")", file, j->size,
+	      j->head);
+	return j;
+err:
+	if (j->fd >= 0)
+		close(j->fd);
+	if (j->fd_append >= 0)
+		close(j->fd_append);
+	mem_free0(j->file);
+	mem_free0(j);
+	return NULL;
+}
 
-	if (0 > container_audit_record_send(c, buf, buf_len)) {
-		ERROR("Failed to send audit record to container");
-		// rollback
-		container_audit_set_last_ack(c, old_acked);
-		mem_free0(old_acked);
-		goto out;
+/*
+ * Returns the journal for the given container uuid, opening it on first use.
+ */
+static audit_journal_t *
+audit_journal_get(const char *uuid)
+{
+	char *file = audit_journal_file_new(uuid);
+
+	for (list_t *l = audit_journal_list; l; l = l->next) {
+		audit_journal_t *j = l->data;
+		if (!strcmp(j->file, file)) {
+			mem_free0(file);
+			return j;
+		}
 	}
-	mem_free0(old_acked);
 
-	TRACE("Sent audit record with ID %s to container %s", container_audit_get_last_ack(c),
-	      uuid_string(container_get_uuid(c)));
+	audit_journal_t *j = audit_journal_open(file);
+	mem_free0(file);
+	IF_NULL_RETVAL(j, NULL);
 
-out:
-	container_audit_set_processing_ack(c, false);
-	mem_free0(buf);
+	audit_journal_list = list_append(audit_journal_list, j);
+	audit_journal_import_textfile(j, uuid);
+	return j;
 }
 
-static AuditRecord *
-audit_record_from_textfile_new(const char *filename, bool purge)
+static bool
+audit_journal_is_empty(audit_journal_t *j)
 {
-	ASSERT(filename);
+	if (j->head < j->size)
+		return false;
+
+	// forked children may have appended records behind our back
+	off_t end = lseek(j->fd, 0, SEEK_END);
+	if (end > 0)
+		j->size = end;
+	return j->head >= j->size;
+}
 
-	TRACE("audit record from textfile using log '%s'", filename);
+static uint64_t
+audit_journal_remaining_storage(const audit_journal_t *j)
+{
+	uint64_t used = j->size - j->head + j->ring_bytes;
 
-	FILE *file = fopen(filename, "r");
-	if (!file) {
-		WARN_ERRNO("Could not open file \"%s\" for reading.", filename);
-		return NULL;
+	if (used > AUDIT_STORAGE) {
+		ERROR("Detected audit log overflow");
+		return 0;
 	}
+	return AUDIT_STORAGE - used;
+}
+
+static uint64_t
+audit_remaining_storage(const char *uuid)
+{
+	audit_journal_t *j = audit_journal_get(uuid);
+	return j ? audit_journal_remaining_storage(j) : 0;
+}
 
-	ssize_t size = file_size(filename);
+/*
+ * Returns the frame of a packed record and its length in frame_len.
+ */
+static uint8_t *
+audit_journal_frame_new(const uint8_t *buf, size_t len, size_t *frame_len)
+{
+	uint32_t hdr = len;
+#ifdef AUDIT_ZSTD
+	size_t bound = ZSTD_compressBound(len);
+	uint8_t *frame = mem_alloc(AUDIT_JOURNAL_FRAME_LEN + MAX(bound, len));
+	size_t zlen = ZSTD_compress(frame + AUDIT_JOURNAL_FRAME_LEN, bound, buf, len,
+				    AUDIT_JOURNAL_ZSTD_LEVEL);
+	if (!ZSTD_isError(zlen) && zlen < len)
+		hdr = zlen | AUDIT_JOURNAL_FRAME_COMPRESSED;
+	else
+		memcpy(frame + AUDIT_JOURNAL_FRAME_LEN, buf, len);
+#else
+	uint8_t *frame = mem_alloc(AUDIT_JOURNAL_FRAME_LEN + len);
+	memcpy(frame + AUDIT_JOURNAL_FRAME_LEN, buf, len);
+#endif
+	uint32_t hdr_be = htonl(hdr);
+	memcpy(frame, &hdr_be, sizeof(hdr_be));
+	*frame_len = AUDIT_JOURNAL_FRAME_LEN + (hdr & ~AUDIT_JOURNAL_FRAME_COMPRESSED);
+	return frame;
+}
 
-	if (0 > size) {
-		ERROR("Failed to retrieve size of audit record log '%s'", filename);
+/*
+ * Returns the packed record of a compressed frame payload, NULL if it is corrupt.
+ */
+static uint8_t *
+audit_journal_decompress_new(UNUSED const uint8_t *buf, UNUSED size_t len,
+			     UNUSED size_t *out_len)
+{
+#ifdef AUDIT_ZSTD
+	unsigned long long size = ZSTD_getFrameContentSize(buf, len);
+	IF_TRUE_RETVAL(size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN ||
+			       size > PROTOBUF_MAX_MESSAGE_SIZE,
+		       NULL);
+
+	uint8_t *out = mem_alloc(size ? size : 1);
+	size_t n = ZSTD_decompress(out, size, buf, len);
+	if (ZSTD_isError(n) || n != size) {
+		mem_free0(out);
 		return NULL;
 	}
+	*out_len = n;
+	return out;
+#else
+	ERROR("Compressed audit records require a build with AUDIT_ZSTD");
+	return NULL;
+#endif
+}
 
-	AuditRecord *record = NULL;
+/*
+ * Appends a packed record and returns the length of its frame, -1 on error.
+ */
+static ssize_t
+audit_journal_append_packed(audit_journal_t *j, const uint8_t *buf, size_t len)
+{
+	size_t frame_len;
+	uint8_t *frame = audit_journal_frame_new(buf, len, &frame_len);
+	ssize_t ret = -1;
 
-	// read file up to delimiter
-	char *buf = mem_alloc0(size + 1);
-	size_t read = 0;
-	bool delim_found = false;
+	// reclaim space of acknowledged records if the journal would grow too large
+	if (j->size + frame_len > AUDIT_JOURNAL_HEADER_LEN + AUDIT_STORAGE)
+		audit_journal_compact(j);
 
-	while (!delim_found && read < (size_t)size) {
-		ssize_t current = 0;
-		size_t n = 0;
-		char *line = NULL;
+	if (fd_write(j->fd_append, (char *)frame, frame_len) < 0) {
+		ERROR_ERRNO("Failed to append audit record to journal %s", j->file);
+		goto out;
+	}
 
-		if (0 > (current = getline(&line, &n, file))) {
-			ERROR_ERRNO("Failed to read line from file");
-			fclose(file);
-			mem_free0(line);
-			goto out;
-		}
+	// take the actual end of file, forked children may have appended as well
+	off_t end = lseek(j->fd_append, 0, SEEK_CUR);
+	j->size = end > 0 ? (uint64_t)end : j->size + frame_len;
+	ret = frame_len;
+out:
+	mem_free0(frame);
+	return ret;
+}
 
-		if (read + current > (size_t)size) {
-			ERROR("File was changed while reading");
-			fclose(file);
-			mem_free0(line);
-			goto out;
-		}
+static int
+audit_journal_append(audit_journal_t *j, const AuditRecord *record)
+{
+	size_t len = protobuf_c_message_get_packed_size((const ProtobufCMessage *)record);
+	uint8_t *buf = mem_alloc(len ? len : 1);
+
+	protobuf_c_message_pack((const ProtobufCMessage *)record, buf);
+	ssize_t ret = audit_journal_append_packed(j, buf, len);
+
+	mem_free0(buf);
+	return ret < 0 ? -1 : 0;
+}
 
-		// if delimiter line was read, stop further processing
-		if (!strcmp(AUDIT_DELIMITER, line)) {
-			delim_found = true;
-			mem_free0(line);
-			continue;
+static uint64_t
+audit_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static time_t
+audit_ring_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void
+audit_ring_push(audit_journal_t *j, const AuditRecord *record, size_t len)
+{
+	ASSERT(j->ring_count < AUDIT_RING_SIZE);
+
+	audit_ring_entry_t *e = &j->ring[(j->ring_first + j->ring_count) % AUDIT_RING_SIZE];
+	e->buf = mem_alloc(len ? len : 1);
+	e->len = protobuf_c_message_pack((const ProtobufCMessage *)record, e->buf);
+	e->time = audit_ring_now();
+
+	j->ring_count++;
+	j->ring_bytes += AUDIT_JOURNAL_FRAME_LEN + e->len;
+}
+
+/*
+ * Drops the n oldest records of the ring.
+ */
+static void
+audit_ring_drop(audit_journal_t *j, unsigned n)
+{
+	for (; n > 0 && j->ring_count > 0; n--) {
+		audit_ring_entry_t *e = &j->ring[j->ring_first];
+		j->ring_bytes -= AUDIT_JOURNAL_FRAME_LEN + e->len;
+		mem_free0(e->buf);
+		e->len = 0;
+		j->ring_first = (j->ring_first + 1) % AUDIT_RING_SIZE;
+		j->ring_count--;
+	}
+}
+
+static bool
+audit_journal_is_empty(audit_journal_t *j);
+
+static void
+audit_journal_advance(audit_journal_t *j, uint64_t next);
+
+/*
+ * Writes all records of the ring to the journal. Records of the ring which
+ * are currently awaiting an ACK stay covered by it, as they become the first
+ * pending records of the journal.
+ */
+static int
+audit_journal_spill_ring(audit_journal_t *j)
+{
+	IF_TRUE_RETVAL(j->ring_count == 0, 0);
+
+	TRACE("Spilling %u audit record(s) to journal %s", j->ring_count, j->file);
+
+	// start over with an empty journal, so that compaction does not move offsets underneath
+	bool empty = audit_journal_is_empty(j);
+	if (empty && j->head > AUDIT_JOURNAL_HEADER_LEN)
+		audit_journal_advance(j, j->size);
+
+	uint64_t sent_end = j->size;
+	unsigned sent = empty ? j->ring_sent : 0;
+	j->ring_sent = 0;
+	j->sent_end = 0;
+
+	while (j->ring_count > 0) {
+		audit_ring_entry_t *e = &j->ring[j->ring_first];
+		ssize_t frame_len = audit_journal_append_packed(j, e->buf, e->len);
+		if (frame_len < 0)
+			return -1;
+		audit_delivery_stats.spilled++;
+		if (sent > 0) {
+			sent_end += frame_len;
+			if (--sent == 0)
+				j->sent_end = sent_end;
 		}
+		audit_ring_drop(j, 1);
+	}
+
+	return 0;
+}
+
+static void
+audit_ring_flush_cb(UNUSED event_timer_t *timer, UNUSED void *data)
+{
+	time_t now = audit_ring_now();
 
-		memcpy(buf + read, line, current);
-		read += current;
-		mem_free0(line);
+	for (list_t *l = audit_journal_list; l; l = l->next) {
+		audit_journal_t *j = l->data;
+		if (j->ring_count > 0 && now - j->ring[j->ring_first].time >= AUDIT_RING_MAX_AGE)
+			audit_journal_spill_ring(j);
 	}
-	fclose(file);
+}
+
+/*
+ * Reads the record at offset off of the journal and stores the offset of the
+ * following record in next.
+ */
+static AuditRecord *
+audit_journal_read_at_new(audit_journal_t *j, uint64_t off, uint64_t *next)
+{
+	uint32_t len_be;
+	uint8_t *buf = NULL;
+	AuditRecord *record = NULL;
 
-	// parse record from file
-	if (0 == size) {
-		INFO("Read audit record with default values");
-		record = (AuditRecord *)mem_new0(AuditRecord, 1);
-		audit_record__init(record);
+	IF_TRUE_RETVAL_TRACE(off >= j->size, NULL);
+
+	if (pread(j->fd, &len_be, sizeof(len_be), off) != sizeof(len_be)) {
+		ERROR_ERRNO("Failed to read record length from audit journal %s", j->file);
+		return NULL;
+	}
+	uint32_t hdr = ntohl(len_be);
+	uint32_t len = hdr & ~AUDIT_JOURNAL_FRAME_COMPRESSED;
+	*next = off + AUDIT_JOURNAL_FRAME_LEN + len;
+
+	// the tail may have been appended by a child since we last looked
+	if (*next > j->size) {
+		off_t end = lseek(j->fd, 0, SEEK_END);
+		if (end > 0)
+			j->size = end;
+	}
+	if (*next > j->size) {
+		ERROR("Truncated record at %" PRIu64 " in audit journal %s", off, j->file);
+		return NULL;
+	}
+
+	buf = mem_alloc(len ? len : 1);
+	if (pread(j->fd, buf, len, off + AUDIT_JOURNAL_FRAME_LEN) != (ssize_t)len) {
+		ERROR_ERRNO("Failed to read record from audit journal %s", j->file);
 		goto out;
-	} else {
-		record = (AuditRecord *)protobuf_message_new_from_buf((uint8_t *)buf, read,
-								      &audit_record__descriptor);
 	}
 
+	if (hdr & AUDIT_JOURNAL_FRAME_COMPRESSED) {
+		size_t packed_len;
+		uint8_t *packed = audit_journal_decompress_new(buf, len, &packed_len);
+		if (packed) {
+			record = (AuditRecord *)protobuf_unpack_message(&audit_record__descriptor,
+									 packed, packed_len);
+			mem_free0(packed);
+		}
+	} else {
+		record = (AuditRecord *)protobuf_unpack_message(&audit_record__descriptor, buf,
+								 len);
+	}
 	if (!record) {
-		WARN("Failed to parse text protobuf message (%s) from file \"%s\"."
-		     "Generating new record with corrupted data as raw_text",
-		     audit_record__descriptor.name ? audit_record__descriptor.name : "UNKNOWN",
-		     filename);
+		WARN("Failed to unpack audit record from journal %s. "
+		     "Generating new record with corrupted data as raw_data",
+		     j->file);
 
 		AuditRecord__Meta **meta = mem_new0(AuditRecord__Meta *, 1);
 		meta[0] = mem_new0(AuditRecord__Meta, 1);
 		audit_record__meta__init(meta[0]);
 
-		// store corrput message as meta
-		meta[0]->key = mem_strdup("raw_text");
-		meta[0]->value = mem_strndup(buf, read);
+		// store corrupt message as meta
+		str_t *dump = str_hexdump_new(buf, len);
+		meta[0]->key = mem_strdup("raw_data");
+		meta[0]->value = str_free(dump, false);
 
 		char *type = mem_printf("%s.%s.%s.%s", audit_category_to_string(FSA),
 					audit_component_to_string(CMLD),
@@ -300,151 +739,204 @@ audit_record_from_textfile_new(const char *filename, bool purge)
 		record = audit_record_new(type, NULL, 1, meta);
 		mem_free0(type);
 	}
+out:
+	mem_free0(buf);
+	return record;
+}
 
-	if (purge) {
-		// delete record from file
-		if (read + strlen(AUDIT_DELIMITER) == (size_t)size) {
-			DEBUG("Audit log empty, removing file");
-			if (-1 == unlink(filename)) {
-				ERROR_ERRNO("Failed to remove audit log file");
-			}
-			goto out;
-		}
+/*
+ * Moves the read cursor to offset next, i.e., drops all records before it.
+ */
+static void
+audit_journal_advance(audit_journal_t *j, uint64_t next)
+{
+	off_t end = lseek(j->fd, 0, SEEK_END);
+	if (end > 0)
+		j->size = end;
+
+	j->sent_end = 0;
+	if (next >= j->size) {
+		// all records sent, start over with an empty journal
+		DEBUG("Audit journal %s empty, truncating", j->file);
+		if (!audit_journal_write_head(j, AUDIT_JOURNAL_HEADER_LEN) &&
+		    !ftruncate(j->fd, AUDIT_JOURNAL_HEADER_LEN))
+			j->size = AUDIT_JOURNAL_HEADER_LEN;
+		else
+			audit_journal_write_head(j, next);
+	} else {
+		audit_journal_write_head(j, next);
+	}
+}
 
-		char *filebuf = file_read_new(filename, AUDIT_STORAGE);
+static void
+audit_send_record_cb(const char *hash_string, const char *hash_file,
+		     UNUSED smartcard_crypto_hashalgo_t hash_algo, void *data)
+{
+	uint8_t *buf = NULL;
+	const container_t *c = (const container_t *)data;
+	ASSERT(c);
 
-		if (!filebuf) {
-			ERROR("Failed to read audit log file");
-			goto out;
-		}
+	// callback is triggert twice for cleanup
+	IF_NULL_RETURN_TRACE(hash_string);
 
-		size_t offset = read + strlen(AUDIT_DELIMITER);
-		if (-1 == file_write(filename, filebuf + offset, strlen(filebuf + offset))) {
-			ERROR_ERRNO("Failed to remove message from file: %s", filename);
-		}
-		mem_free0(filebuf);
+	if (!hash_file) {
+		ERROR("audit_send_record_cb: hash_file was empty");
+		return;
 	}
 
-out:
-	if (buf)
-		mem_free0(buf);
+	if (!data) {
+		ERROR("audit_send_record_cb: No container given");
+		return;
+	}
 
-	return (AuditRecord *)record;
-}
+	uint32_t buf_len = file_size(hash_file);
+	buf = mem_alloc0(buf_len);
 
-static bool
-audit_log_check_delimiter(const char *log_file)
-{
-	int fd = -1;
-	char buf[sizeof(AUDIT_DELIMITER)];
-	size_t log_file_size = 0;
-	bool ret = false;
+	int read = file_read(hash_file, (char *)buf, buf_len);
+
+	if (read < 0 || buf_len != (unsigned int)read) {
+		ERROR("Processing SCD response: read %u bytes, expected %u", read, buf_len);
+		goto out;
+	}
+
+	TRACE("Got hash from SCD for file %s: %s", hash_file, hash_string);
 
-	IF_TRUE_RETVAL_TRACE(0 >= (log_file_size = file_size(log_file)), true);
-	if (0 > (fd = open(log_file, O_RDONLY))) {
-		TRACE_ERRNO("open failed by returning fd=%d", fd);
-		return true;
+	if (unlink(hash_file)) {
+		ERROR_ERRNO("Failed to unlink %s", hash_file);
 	}
 
-	IF_TRUE_GOTO_WARN(-1 == lseek(fd, -strlen(AUDIT_DELIMITER), SEEK_END), out);
-	IF_TRUE_GOTO_WARN(-1 == fd_read(fd, buf, strlen(AUDIT_DELIMITER)), out);
+	char *old_acked = mem_strdup(container_audit_get_last_ack(c));
+	container_audit_set_last_ack(c, hash_string);
+
+	if (0 > container_audit_record_send(c, buf, buf_len)) {
+		ERROR("Failed to send audit record to container");
+		// rollback
+		container_audit_set_last_ack(c, old_acked);
+		mem_free0(old_acked);
+		goto out;
+	}
+	mem_free0(old_acked);
 
-	buf[sizeof(AUDIT_DELIMITER) - 1] = '\0';
+	audit_journal_t *j = audit_journal_get(uuid_string(container_get_uuid(c)));
+	if (j) {
+		j->sent_ns = audit_now_ns();
+		audit_delivery_stats.sent += j->sent_records;
+	}
 
-	// if delimiter line was read, all is fine
-	if (!strcmp(AUDIT_DELIMITER, buf))
-		ret = true;
+	TRACE("Sent audit record with ID %s to container %s", container_audit_get_last_ack(c),
+	      uuid_string(container_get_uuid(c)));
 
 out:
-	close(fd);
-	return ret;
+	container_audit_set_processing_ack(c, false);
+	mem_free0(buf);
 }
 
-static int
-audit_write_file(const uuid_t *uuid, const AuditRecord *msg)
+/*
+ * Wraps the text of a record which could not be parsed into a new record.
+ */
+static AuditRecord *
+audit_record_corrupt_new(const char *raw, size_t len)
 {
-	int ret = -1;
+	WARN("Generating new record with corrupted data as raw_text");
 
-	char *dir = mem_printf("%s/audit", AUDIT_LOGDIR);
+	AuditRecord__Meta **meta = mem_new0(AuditRecord__Meta *, 1);
+	meta[0] = mem_new0(AuditRecord__Meta, 1);
+	audit_record__meta__init(meta[0]);
 
-	if (!file_is_dir(dir) && dir_mkdir_p(dir, 0600)) {
-		ERROR("Failed to create logdir");
-		mem_free0(dir);
-		return -1;
-	}
-	mem_free0(dir);
+	// store corrput message as meta
+	meta[0]->key = mem_strdup("raw_text");
+	meta[0]->value = mem_strndup(raw, len);
+
+	char *type = mem_printf("%s.%s.%s.%s", audit_category_to_string(FSA),
+				audit_component_to_string(CMLD), audit_evclass_to_string(GENERIC),
+				"corrupt-record");
+
+	AuditRecord *record = audit_record_new(type, NULL, 1, meta);
+	mem_free0(type);
+	return record;
+}
 
-	char *file = audit_log_file_new(uuid_string(uuid));
+static int
+audit_write_file(const uuid_t *uuid, const AuditRecord *msg)
+{
+	audit_journal_t *j = audit_journal_get(uuid_string(uuid));
+	IF_NULL_RETVAL_ERROR(j, -1);
 
-	char *msg_text = protobuf_c_text_to_string((ProtobufCMessage *)msg, NULL);
+	size_t len = protobuf_c_message_get_packed_size((const ProtobufCMessage *)msg);
+	PROBE2(audit_write, j->file, len);
 
 	//TODO send error message
-	if (audit_remaining_storage(uuid_string(uuid)) <
-	    (strlen(msg_text) + strlen(AUDIT_DELIMITER))) {
+	uint64_t remaining = audit_journal_remaining_storage(j);
+	if (remaining < AUDIT_JOURNAL_FRAME_LEN + len) {
 		container_t *c = cmld_container_get_by_uuid(uuid);
 
 		TRACE("Trying to notify container %s about stored audit events,"
 		      " remaining storage: %" PRIu64,
-		      uuid_string(uuid), audit_remaining_storage(uuid_string(uuid)));
-		if ((!c) || (-1 == container_audit_record_notify(
-					   c, audit_remaining_storage(uuid_string(uuid))))) {
+		      uuid_string(uuid), remaining);
+		if ((!c) || (-1 == container_audit_record_notify(c, remaining))) {
 			ERROR("Failed to notify container about audit log overflow");
 		}
 		ERROR("Failed to store audit record: max. log size exceeded");
-		goto out;
-	}
-
-	TRACE("Logging audit record to file: %s", file);
-	if (!audit_log_check_delimiter(file)) {
-		TRACE("Fixup audit delimiter to %s", file);
-		if (0 > file_write_append(file, AUDIT_DELIMITER, strlen(AUDIT_DELIMITER))) {
-			ERROR("Failed to fixup audit log file: %s", file);
-			goto out;
-		}
+		return -1;
 	}
 
-	if (0 > file_write_append(file, msg_text, strlen(msg_text))) {
-		ERROR("Failed to log audit message to file: %s", file);
-		goto out;
-	}
+	// forked children have their own copy of the ring, they write to the journal directly
+	if (getpid() != audit_pid)
+		return audit_journal_append(j, msg);
 
-	if (0 > file_write_append(file, AUDIT_DELIMITER, strlen(AUDIT_DELIMITER))) {
-		ERROR("Failed to log audit message to file: %s", msg_text);
-		goto out;
+	// keep the record in memory unless older records are already waiting in the journal
+	if (j->head >= j->size && j->ring_count < AUDIT_RING_SIZE) {
+		TRACE("Queueing audit record for %s in memory", j->file);
+		audit_ring_push(j, msg, len);
+		return 0;
 	}
 
-	ret = 0;
+	if (audit_journal_spill_ring(j))
+		ERROR("Failed to spill queued audit records to journal %s", j->file);
 
-out:
-	mem_free0(file);
-	mem_free0(msg_text);
+	TRACE("Logging audit record to journal: %s", j->file);
+	PROBE2(audit_journal_append, j->file, len);
+	int ret = audit_journal_append(j, msg);
+	PROBE2(audit_journal_append_done, j->file, ret);
 
 	return ret;
 }
 
+/*
+ * Returns the next record to be sent, either the n-th record of the ring or
+ * the record at offset off of the journal, and advances n or off respectively.
+ * The size of the record is added to bytes.
+ */
 static AuditRecord *
-audit_next_record_new(const container_t *container, bool purge)
+audit_next_record_new(audit_journal_t *j, bool from_ring, unsigned *n, uint64_t *off, size_t *bytes)
 {
-	AuditRecord *r;
-
-	char *file = audit_log_file_new(uuid_string(container_get_uuid(container)));
-	TRACE("next record in log file '%s'", file);
-
-	if (!file_exists(file)) {
-		ERROR("Failed to read audit record: no file");
-		mem_free0(file);
-		return NULL;
+	if (from_ring) {
+		IF_TRUE_RETVAL_TRACE(*n >= j->ring_count, NULL);
+		audit_ring_entry_t *e = &j->ring[(j->ring_first + *n) % AUDIT_RING_SIZE];
+		AuditRecord *record = (AuditRecord *)protobuf_unpack_message(
+			&audit_record__descriptor, e->buf, e->len);
+		IF_NULL_RETVAL_ERROR(record, NULL);
+		*n += 1;
+		*bytes += AUDIT_JOURNAL_FRAME_LEN + e->len;
+		return record;
 	}
 
-	r = (AuditRecord *)audit_record_from_textfile_new(file, purge);
-
-	mem_free0(file);
-
-	return r;
+	uint64_t next;
+	AuditRecord *record = audit_journal_read_at_new(j, *off, &next);
+	IF_NULL_RETVAL(record, NULL);
+	*bytes += next - *off;
+	*off = next;
+	return record;
 }
 
+/*
+ * Sends the next stored records to the container, at most window records and
+ * AUDIT_SEND_BATCH_MAX_BYTES in one AUDIT_RECORDS message. The container
+ * acknowledges the whole message at once. Containers which do not announce a
+ * window get a single AUDIT_RECORD message.
+ */
 static int
-audit_do_send_record(const container_t *c)
+audit_do_send_record(const container_t *c, uint32_t window)
 {
 	uint8_t *packed = NULL;
 	uint32_t packed_len = 0;
@@ -461,15 +953,46 @@ audit_do_send_record(const container_t *c)
 		return -1;
 	}
 
+	audit_journal_t *j = audit_journal_get(uuid_string(container_get_uuid(c)));
+	IF_NULL_RETVAL_ERROR(j, -1);
+
 	CmldToServiceMessage *message_proto = mem_new0(CmldToServiceMessage, 1);
 	cmld_to_service_message__init(message_proto);
-	message_proto->code = CMLD_TO_SERVICE_MESSAGE__CODE__AUDIT_RECORD;
 
-	if (!(message_proto->audit_record = audit_next_record_new(c, false))) {
-		ERROR("Could not read next audit record");
-		goto out;
+	// records waiting in the journal are older than those in the ring
+	bool from_ring = audit_journal_is_empty(j);
+	uint64_t off = j->head;
+	unsigned n = 0;
+	size_t bytes = 0;
+	if (window <= 1) {
+		message_proto->code = CMLD_TO_SERVICE_MESSAGE__CODE__AUDIT_RECORD;
+		message_proto->audit_record = audit_next_record_new(j, from_ring, &n, &off, &bytes);
+		if (!message_proto->audit_record) {
+			ERROR("Could not read next audit record");
+			goto out;
+		}
+	} else {
+		window = MIN(window, AUDIT_SEND_WINDOW_MAX);
+
+		message_proto->code = CMLD_TO_SERVICE_MESSAGE__CODE__AUDIT_RECORDS;
+		message_proto->audit_records = mem_new0(AuditRecord *, window);
+		while (message_proto->n_audit_records < window &&
+		       bytes < AUDIT_SEND_BATCH_MAX_BYTES) {
+			AuditRecord *r = audit_next_record_new(j, from_ring, &n, &off, &bytes);
+			if (!r)
+				break;
+			message_proto->audit_records[message_proto->n_audit_records++] = r;
+		}
+		if (!message_proto->n_audit_records) {
+			ERROR("Could not read next audit record");
+			goto out;
+		}
 	}
-	TRACE("read next audit record sucessfully");
+	j->ring_sent = from_ring ? n : 0;
+	j->sent_end = from_ring ? 0 : off;
+	j->sent_records = message_proto->audit_record ? 1 : message_proto->n_audit_records;
+	TRACE("read %zu audit record(s) sucessfully",
+	      message_proto->audit_record ? 1 : message_proto->n_audit_records);
 
 	packed_len = protobuf_pack_message_new((ProtobufCMessage *)message_proto, &packed);
 
@@ -509,19 +1032,17 @@ out:
 }
 
 static int
-audit_send_next_stored(const container_t *c)
+audit_send_next_stored(const container_t *c, uint32_t window)
 {
 	if (!c)
 		return -1;
 
 	TRACE("send_next_stored");
-	char *file = audit_log_file_new(uuid_string(container_get_uuid(c)));
+	audit_journal_t *j = audit_journal_get(uuid_string(container_get_uuid(c)));
+	IF_NULL_RETVAL_ERROR(j, -1);
 
-	TRACE("send_next_stored log file: %s", file);
-
-	if (!file_exists(file)) {
+	if (audit_journal_is_empty(j) && j->ring_count == 0) {
 		DEBUG("Sent all stored audit messages");
-		mem_free0(file);
 
 		if (0 > container_audit_notify_complete(c)) {
 			ERROR("Failed to notify container that all records were sent");
@@ -533,13 +1054,12 @@ audit_send_next_stored(const container_t *c)
 
 		return 0;
 	}
-	mem_free0(file);
 
-	return audit_do_send_record(c);
+	return audit_do_send_record(c, window);
 }
 
 int
-audit_process_ack(const container_t *c, const char *ack)
+audit_process_ack(const container_t *c, const char *ack, uint32_t window)
 {
 	ASSERT(c);
 
@@ -574,15 +1094,36 @@ audit_process_ack(const container_t *c, const char *ack)
 	if (match_hash(AUDIT_HASH_ALGO_LEN, container_audit_get_last_ack(c), ack)) {
 		TRACE("ACK hash matched last sent record %s", container_audit_get_last_ack(c));
 
-		AuditRecord *record = audit_next_record_new(c, true);
-
-		if (!record) {
-			ERROR("Failed to delete audit record %s", ack);
+		audit_journal_t *j = audit_journal_get(uuid_string(container_get_uuid(c)));
+		if (!j) {
+			ERROR("Failed to delete audit record(s) %s", ack);
 			return -1;
 		}
 
-		protobuf_free_message((ProtobufCMessage *)record);
-		TRACE("Cleaned up ack'ed record");
+		if (j->sent_ns) {
+			uint64_t rtt = audit_now_ns() - j->sent_ns;
+			audit_delivery_stats.acked += j->sent_records;
+			audit_delivery_stats.acks++;
+			audit_delivery_stats.ack_rtt_ns += rtt;
+			audit_delivery_stats.max_ack_rtt_ns =
+				MAX(audit_delivery_stats.max_ack_rtt_ns, rtt);
+			audit_delivery_stats.ack_rtt_histogram[event_profile_bucket(rtt)]++;
+			j->sent_ns = 0;
+		}
+
+		// the ACK covers all records of the last sent message
+		if (j->ring_sent > 0) {
+			audit_ring_drop(j, j->ring_sent);
+			j->ring_sent = 0;
+			TRACE("Cleaned up ack'ed record(s)");
+		} else if (j->sent_end > j->head) {
+			audit_journal_advance(j, j->sent_end);
+			TRACE("Cleaned up ack'ed record(s)");
+		} else {
+			// sent records were spilled behind records appended by a forked child
+			WARN("Lost track of audit record(s) %s, sending pending records again",
+			     ack);
+		}
 
 		container_audit_set_last_ack(c, "");
 	} else {
@@ -590,7 +1131,7 @@ audit_process_ack(const container_t *c, const char *ack)
 		     uuid_string(container_get_uuid(c)));
 	}
 
-	return audit_send_next_stored(c);
+	return audit_send_next_stored(c, window);
 }
 
 static int
@@ -618,6 +1159,8 @@ audit_record_log(container_t *c, AuditRecord *record)
 		uuid_free(default_uuid);
 	}
 
+	audit_delivery_stats.records++;
+
 	if (c && (container_audit_get_processing_ack(c))) {
 		TRACE("Already processing ACK, do not notify container again");
 		goto out;
@@ -632,6 +1175,8 @@ audit_record_log(container_t *c, AuditRecord *record)
 		}
 	}
 out:
+	if (ret)
+		audit_delivery_stats.dropped++;
 	return ret;
 }
 
@@ -690,6 +1235,8 @@ audit_log_event(const uuid_t *uuid, AUDIT_CATEGORY category, AUDIT_COMPONENT com
 	DEBUG("Logging audit message %s", record_text ? record_text : "");
 	mem_free0(record_text);
 
+	control_notify_audit(uuid, (ProtobufCMessage *)record);
+
 	ret = audit_record_log(audit_get_log_container(uuid), record);
 
 out:
@@ -701,27 +1248,9 @@ out:
 }
 
 static void
-audit_cb_kernel_handle_log(int fd, unsigned events, UNUSED event_io_t *io, void *data)
+audit_kernel_handle_msg(struct nlmsghdr *nlmsg)
 {
-	nl_sock_t *audit_sock = data;
-	ASSERT(audit_sock);
-	ASSERT(fd == nl_sock_get_fd(audit_sock));
-
-	char *buf = mem_new0(char, MAX_AUDIT_MESSAGE_LENGTH);
 	char *log_record = NULL;
-
-	if (events & EVENT_IO_EXCEPT) {
-		goto out;
-	}
-
-	int msg_len;
-	if ((msg_len = nl_msg_receive_kernel(audit_sock, buf, MAX_AUDIT_MESSAGE_LENGTH, false)) <=
-	    0) {
-		WARN("could not read audit meassge.");
-		goto out;
-	}
-
-	struct nlmsghdr *nlmsg = (struct nlmsghdr *)buf;
 	uint16_t type = nlmsg->nlmsg_type;
 
 	if (type == AUDIT_TRUSTED_APP) {
@@ -737,7 +1266,11 @@ audit_cb_kernel_handle_log(int fd, unsigned events, UNUSED event_io_t *io, void
 		int record_text_len = strlen(record_text) - 1;
 		AuditRecord *record = (AuditRecord *)protobuf_message_new_from_buf(
 			(uint8_t *)record_text, record_text_len, &audit_record__descriptor);
-		audit_record_log(cmld_container_get_by_uid(uid), record);
+		container_t *container = cmld_container_get_by_uid(uid);
+		if (record)
+			control_notify_audit(container ? container_get_uuid(container) : NULL,
+					     (ProtobufCMessage *)record);
+		audit_record_log(container, record);
 		protobuf_free_message((ProtobufCMessage *)record);
 		TRACE("audit: type=%d %s", type, log_record);
 	} else if (type == AUDIT_USER || type == AUDIT_LOGIN ||
@@ -807,16 +1340,163 @@ audit_cb_kernel_handle_log(int fd, unsigned events, UNUSED event_io_t *io, void
 		TRACE("audit: type=%d %s", type, log_record);
 	}
 out:
-	mem_free0(buf);
+	return;
+}
+
+/*
+ * Receives the messages of the kernel audit subsystem in batches of up to
+ * AUDIT_KERNEL_RECV_BATCH messages per recvmmsg() call into preallocated
+ * buffers, until the socket is drained or AUDIT_KERNEL_RECV_ROUNDS batches
+ * were handled in one wakeup.
+ */
+static void
+audit_cb_kernel_handle_log(int fd, unsigned events, UNUSED event_io_t *io, void *data)
+{
+	nl_sock_t *audit_sock = data;
+	ASSERT(audit_sock);
+	ASSERT(fd == nl_sock_get_fd(audit_sock));
+
+	// one spare byte per buffer to terminate the message text
+	static char bufs[AUDIT_KERNEL_RECV_BATCH][MAX_AUDIT_MESSAGE_LENGTH + 1];
+	static struct sockaddr_nl addrs[AUDIT_KERNEL_RECV_BATCH];
+	struct iovec iovs[AUDIT_KERNEL_RECV_BATCH];
+	struct mmsghdr msgs[AUDIT_KERNEL_RECV_BATCH];
+
+	IF_TRUE_RETURN(events & EVENT_IO_EXCEPT);
+
+	for (int round = 0; round < AUDIT_KERNEL_RECV_ROUNDS; round++) {
+		memset(msgs, 0, sizeof(msgs));
+		for (int i = 0; i < AUDIT_KERNEL_RECV_BATCH; i++) {
+			iovs[i].iov_base = bufs[i];
+			iovs[i].iov_len = MAX_AUDIT_MESSAGE_LENGTH;
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+		}
+
+		int n = recvmmsg(fd, msgs, AUDIT_KERNEL_RECV_BATCH, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				// the kernel dropped messages since the socket buffer was full
+				audit_kernel_stats.enobufs++;
+				WARN("Audit netlink socket overrun, kernel audit messages were lost");
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				WARN_ERRNO("could not read audit meassge.");
+			break;
+		}
+
+		audit_kernel_stats.batches++;
+		audit_kernel_stats.max_batch = MAX(audit_kernel_stats.max_batch, (uint64_t)n);
+
+		for (int i = 0; i < n; i++) {
+			unsigned int len = msgs[i].msg_len;
+			struct nlmsghdr *nlmsg = (struct nlmsghdr *)bufs[i];
+
+			if ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ||
+			    addrs[i].nl_family != AF_NETLINK || !NLMSG_OK(nlmsg, len)) {
+				audit_kernel_stats.invalid++;
+				TRACE("Purged audit netlink message, as it did not pass sanity checks");
+				continue;
+			}
+			bufs[i][len] = '\0';
+			audit_kernel_stats.messages++;
+			audit_kernel_handle_msg(nlmsg);
+		}
+
+		if (n < AUDIT_KERNEL_RECV_BATCH)
+			break;
+	}
+}
+
+void
+audit_flush(void)
+{
+	IF_TRUE_RETURN(getpid() != audit_pid);
+
+	for (list_t *l = audit_journal_list; l; l = l->next) {
+		audit_journal_t *j = l->data;
+		if (audit_journal_spill_ring(j))
+			ERROR("Failed to persist queued audit records of %s", j->file);
+		if (fsync(j->fd_append))
+			WARN_ERRNO("Failed to sync audit journal %s", j->file);
+	}
+}
+
+void
+audit_get_kernel_stats(audit_kernel_stats_t *stats)
+{
+	ASSERT(stats);
+	*stats = audit_kernel_stats;
+}
+
+void
+audit_get_delivery_stats(audit_delivery_stats_t *stats)
+{
+	ASSERT(stats);
+	*stats = audit_delivery_stats;
+
+	stats->backlog_bytes = 0;
+	for (list_t *l = audit_journal_list; l; l = l->next) {
+		audit_journal_t *j = l->data;
+		stats->backlog_bytes += j->size - MIN(j->head, j->size) + j->ring_bytes;
+	}
+}
+
+static int64_t
+audit_metrics_get_counter(void *data)
+{
+	return *(uint64_t *)data;
+}
+
+static int64_t
+audit_metrics_get_backlog(UNUSED void *data)
+{
+	audit_delivery_stats_t stats;
+	audit_get_delivery_stats(&stats);
+	return stats.backlog_bytes;
+}
+
+static void
+audit_metrics_init(void)
+{
+	static const char *help = "Audit records by stage of their delivery to the containers.";
+	const struct {
+		const char *labels;
+		uint64_t *counter;
+	} records[] = {
+		{ "stage=\"stored\"", &audit_delivery_stats.records },
+		{ "stage=\"dropped\"", &audit_delivery_stats.dropped },
+		{ "stage=\"spilled\"", &audit_delivery_stats.spilled },
+		{ "stage=\"sent\"", &audit_delivery_stats.sent },
+		{ "stage=\"acked\"", &audit_delivery_stats.acked },
+	};
+
+	for (size_t i = 0; i < sizeof(records) / sizeof(records[0]); i++)
+		metrics_func_new(METRICS_COUNTER, "cml_audit_records_total", records[i].labels,
+				 help, audit_metrics_get_counter, records[i].counter);
+	metrics_func_new(METRICS_GAUGE, "cml_audit_backlog_bytes", NULL,
+			 "Size of the audit records awaiting an ACK.", audit_metrics_get_backlog,
+			 NULL);
 }
 
 int
 audit_init(uint32_t size)
 {
 	AUDIT_STORAGE = size * 1024 * 1024;
+	audit_pid = getpid();
 
 	TRACE("Initializing audit subsystem");
 
+	/* Persist records which stay unacknowledged in memory for too long */
+	event_timer_t *flush_timer = event_timer_new(
+		AUDIT_RING_FLUSH_INTERVAL, EVENT_TIMER_REPEAT_FOREVER, &audit_ring_flush_cb, NULL);
+	event_add_timer(flush_timer);
+
 	/* Open audit netlink socket */
 	nl_sock_t *audit_sock;
 	if (!(audit_sock = nl_sock_default_new(NETLINK_AUDIT))) {
@@ -831,6 +1511,14 @@ audit_init(uint32_t size)
 		return -1;
 	}
 
+	/* Absorb bursts of kernel audit messages, SO_RCVBUFFORCE ignores rmem_max */
+	int rcvbuf = AUDIT_KERNEL_RCVBUF_SIZE;
+	if (setsockopt(nl_sock_get_fd(audit_sock), SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf,
+		       sizeof(rcvbuf)) < 0 &&
+	    setsockopt(nl_sock_get_fd(audit_sock), SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) <
+		    0)
+		WARN_ERRNO("Failed to enlarge receive buffer of audit netlink socket");
+
 	event_io_t *audit_io_event = event_io_new(nl_sock_get_fd(audit_sock), EVENT_IO_READ,
 						  &audit_cb_kernel_handle_log, audit_sock);
 	event_add_io(audit_io_event);
@@ -842,5 +1530,7 @@ audit_init(uint32_t size)
 		return -1;
 	}
 
+	audit_metrics_init();
+
 	return 0;
 }
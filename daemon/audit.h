@@ -26,6 +26,7 @@
 
 #include "container.h"
 #include "common/audit.h"
+#include "common/event.h"
 
 typedef enum { SUA, FUA, SSA, FSA, RLE } AUDIT_CATEGORY;
 
@@ -48,8 +49,60 @@ audit_log_event(const uuid_t *uuid, AUDIT_CATEGORY category, AUDIT_COMPONENT com
 		AUDIT_EVENTCLASS evclass, const char *evtype, const char *subject_id,
 		int meta_count, ...);
 
+/**
+ * Processes an ACK of the container for the last sent audit message and sends
+ * the next stored records. window is the number of records the container
+ * accepts per message, 0 or 1 for single record delivery.
+ */
 int
-audit_process_ack(const container_t *audit, const char *ack);
+audit_process_ack(const container_t *audit, const char *ack, uint32_t window);
+
+/**
+ * Writes all audit records which are only queued in memory to the journals
+ * and syncs them to disk. Must be called before the device is rebooted or
+ * powered off.
+ */
+void
+audit_flush(void);
+
+/**
+ * Counters of the reader for the kernel audit netlink socket.
+ */
+typedef struct {
+	uint64_t messages;  /**< messages received and handled */
+	uint64_t batches;   /**< recvmmsg() calls which returned messages */
+	uint64_t max_batch; /**< largest number of messages received at once */
+	uint64_t enobufs;   /**< socket overruns, each one means lost messages */
+	uint64_t invalid;   /**< truncated or malformed messages which were dropped */
+} audit_kernel_stats_t;
+
+/**
+ * Copies the current counters of the kernel audit reader to stats.
+ */
+void
+audit_get_kernel_stats(audit_kernel_stats_t *stats);
+
+/**
+ * Counters of the delivery of audit records to the containers.
+ */
+typedef struct {
+	uint64_t records;				   /**< records stored for delivery */
+	uint64_t dropped;				   /**< records which could not be stored */
+	uint64_t spilled;				   /**< records moved to the journals */
+	uint64_t sent;					   /**< records sent to containers */
+	uint64_t acked;					   /**< records acknowledged by containers */
+	uint64_t acks;					   /**< ACKs of sent messages */
+	uint64_t ack_rtt_ns;				   /**< accumulated time from send to ACK */
+	uint64_t max_ack_rtt_ns;			   /**< longest time from send to ACK */
+	uint64_t ack_rtt_histogram[EVENT_PROFILE_BUCKETS]; /**< log2 histogram, see event.h */
+	uint64_t backlog_bytes;				   /**< size of records awaiting an ACK */
+} audit_delivery_stats_t;
+
+/**
+ * Copies the current counters of the delivery of audit records to stats.
+ */
+void
+audit_get_delivery_stats(audit_delivery_stats_t *stats);
 
 int
 audit_init(uint32_t size);
@@ -0,0 +1,202 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+//#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
+
+#include "audit_rules.h"
+
+#include "common/audit.h"
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/list.h"
+#include "common/nl.h"
+
+#include <errno.h>
+#include <string.h>
+#include <linux/audit.h>
+#include <linux/netlink.h>
+
+// ids mapped into the user namespace of a container, see c_user.c
+#define AUDIT_RULES_UID_RANGE 65536
+
+typedef struct audit_rules {
+	container_t *container;
+	container_callback_t *observer;
+	int uid; // start of the uid range the rules are installed for, 0 if none
+} audit_rules_t;
+
+static list_t *audit_rules_list = NULL;
+
+static audit_rules_t *
+audit_rules_get(const container_t *container)
+{
+	for (list_t *l = audit_rules_list; l; l = l->next) {
+		audit_rules_t *r = l->data;
+		if (r->container == container)
+			return r;
+	}
+	return NULL;
+}
+
+/*
+ * Fills rule to never pass events of the given filter list for the uid range. The
+ * rule is prepended, so that it takes precedence over rules of the host.
+ */
+static void
+audit_rules_fill(struct audit_rule_data *rule, uint32_t list, int uid)
+{
+	memset(rule, 0, sizeof(*rule));
+	rule->flags = list | AUDIT_FILTER_PREPEND;
+	rule->action = AUDIT_NEVER;
+	// all syscalls, only evaluated for the exit list
+	memset(rule->mask, 0xff, sizeof(rule->mask));
+
+	rule->fields[0] = AUDIT_UID;
+	rule->fieldflags[0] = AUDIT_GREATER_THAN_OR_EQUAL;
+	rule->values[0] = uid;
+	rule->fields[1] = AUDIT_UID;
+	rule->fieldflags[1] = AUDIT_LESS_THAN;
+	rule->values[1] = uid + AUDIT_RULES_UID_RANGE;
+	rule->field_count = 2;
+
+	if (list == AUDIT_FILTER_USER) {
+		// records of trusted apps are logged by cmld on behalf of the container
+		rule->fields[2] = AUDIT_MSGTYPE;
+		rule->fieldflags[2] = AUDIT_NOT_EQUAL;
+		rule->values[2] = AUDIT_TRUSTED_APP;
+		rule->field_count = 3;
+	}
+}
+
+static int
+audit_rules_send(uint16_t type, uint32_t list, int uid)
+{
+	struct audit_rule_data rule;
+	int ret = -1;
+
+	audit_rules_fill(&rule, list, uid);
+
+	nl_sock_t *sock = nl_sock_default_new(NETLINK_AUDIT);
+	IF_NULL_RETVAL_ERROR(sock, -1);
+
+	nl_msg_t *msg = nl_msg_new();
+	IF_NULL_GOTO_ERROR(msg, out);
+	nl_msg_set_type(msg, type);
+	nl_msg_set_flags(msg, NLM_F_REQUEST | NLM_F_ACK);
+	nl_msg_set_buf_unaligned(msg, (char *)&rule, sizeof(rule));
+
+	ret = nl_msg_send_kernel_verify(sock, msg);
+	// rules which survived a re-exec of cmld are still installed
+	if (ret < 0 && type == AUDIT_ADD_RULE && errno == EEXIST)
+		ret = 0;
+
+	nl_msg_free(msg);
+out:
+	nl_sock_free(sock);
+	return ret;
+}
+
+static void
+audit_rules_update(audit_rules_t *r, int uid)
+{
+	const container_audit_policy_t *policy = container_get_audit_policy(r->container);
+	IF_TRUE_RETURN(r->uid == uid);
+
+	if (r->uid) {
+		if (!policy->user_messages &&
+		    audit_rules_send(AUDIT_DEL_RULE, AUDIT_FILTER_USER, r->uid) < 0)
+			WARN_ERRNO("Could not remove audit user rule of %s",
+				   container_get_description(r->container));
+		if (!policy->syscall_events &&
+		    audit_rules_send(AUDIT_DEL_RULE, AUDIT_FILTER_EXIT, r->uid) < 0)
+			WARN_ERRNO("Could not remove audit syscall rule of %s",
+				   container_get_description(r->container));
+		r->uid = 0;
+	}
+
+	IF_TRUE_RETURN(uid <= 0);
+
+	if (!policy->user_messages &&
+	    audit_rules_send(AUDIT_ADD_RULE, AUDIT_FILTER_USER, uid) < 0)
+		WARN_ERRNO("Could not install audit user rule of %s",
+			   container_get_description(r->container));
+	if (!policy->syscall_events &&
+	    audit_rules_send(AUDIT_ADD_RULE, AUDIT_FILTER_EXIT, uid) < 0)
+		WARN_ERRNO("Could not install audit syscall rule of %s",
+			   container_get_description(r->container));
+	r->uid = uid;
+
+	DEBUG("Installed audit rules of %s for uids %d - %d",
+	      container_get_description(r->container), uid, uid + AUDIT_RULES_UID_RANGE - 1);
+}
+
+/*
+ * The uid range of the container is assigned during its start and released once it
+ * stopped.
+ */
+static void
+audit_rules_observer_cb(container_t *container, UNUSED container_callback_t *cb, void *data)
+{
+	audit_rules_t *r = data;
+	container_state_t state = container_get_state(container);
+
+	bool running = state != CONTAINER_STATE_STOPPED && state != CONTAINER_STATE_ZOMBIE;
+	audit_rules_update(r, running ? container_get_uid(container) : 0);
+}
+
+void
+audit_rules_add(container_t *container)
+{
+	ASSERT(container);
+
+	const container_audit_policy_t *policy = container_get_audit_policy(container);
+	IF_TRUE_RETURN(policy->user_messages && policy->syscall_events);
+	IF_TRUE_RETURN(audit_rules_get(container));
+
+	audit_rules_t *r = mem_new0(audit_rules_t, 1);
+	r->container = container;
+	r->observer = container_register_observer(container, audit_rules_observer_cb, r);
+	if (!r->observer) {
+		WARN("Could not register audit rules observer for %s",
+		     container_get_description(container));
+		mem_free0(r);
+		return;
+	}
+
+	audit_rules_list = list_append(audit_rules_list, r);
+	// the container may already run, e.g., after a re-exec of cmld
+	audit_rules_observer_cb(container, r->observer, r);
+}
+
+void
+audit_rules_remove(container_t *container)
+{
+	audit_rules_t *r = audit_rules_get(container);
+	IF_NULL_RETURN(r);
+
+	audit_rules_update(r, 0);
+	container_unregister_observer(container, r->observer);
+	audit_rules_list = list_remove(audit_rules_list, r);
+	mem_free0(r);
+}
@@ -0,0 +1,53 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+/**
+ * @file audit_rules.h
+ *
+ * Kernel side prefiltering of audit events according to the audit policy of each
+ * container. While a container with a user namespace is running, rules matching the
+ * uid range of the container are installed in the kernel, which drop the events the
+ * policy disables before they are sent to cmld. Containers without a user namespace
+ * share the uids of the host and are not filtered.
+ */
+
+#ifndef AUDIT_RULES_H
+#define AUDIT_RULES_H
+
+#include "container.h"
+
+/**
+ * Installs the audit rules of the container whenever it runs and removes them when
+ * it stops. Does nothing if the policy of the container passes all events.
+ */
+void
+audit_rules_add(container_t *container);
+
+/**
+ * Removes the audit rules of a container which is removed.
+ */
+void
+audit_rules_remove(container_t *container);
+
+#endif /* AUDIT_RULES_H */
@@ -0,0 +1,192 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "balloon.h"
+#include "cmld.h"
+#include "psi.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/event.h"
+#include "common/fd.h"
+#include "common/hashmap.h"
+#include "common/sock.h"
+#include "common/uuid.h"
+
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BALLOON_INTERVAL 10000
+
+/* host memory pressure (some avg10 in percent) to inflate above and deflate below */
+#define BALLOON_INFLATE_AVG10 10.0
+#define BALLOON_DEFLATE_AVG10 1.0
+
+/* share of the guest memory per step and at most held by the balloon */
+#define BALLOON_STEP_PERCENT 10
+#define BALLOON_MAX_PERCENT 50
+
+/* ipc message of kvmtool, which inflates (> 0) or deflates (< 0) by the given MiB */
+#define BALLOON_KVM_IPC_BALLOON 1
+
+typedef struct balloon_state {
+	uint32_t size; // MiB held by the balloon
+} balloon_state_t;
+
+static event_timer_t *balloon_timer = NULL;
+static hashmap_t *balloon_states = NULL; // balloon_state_t by uuid_bin_t of the container
+
+static balloon_state_t *
+balloon_state_get(const container_t *container, bool create)
+{
+	const uuid_bin_t *key = uuid_get_bin(container_get_uuid(container));
+
+	balloon_state_t *state =
+		balloon_states ? hashmap_get(balloon_states, key, sizeof(uuid_bin_t)) : NULL;
+	if (state || !create)
+		return state;
+
+	if (!balloon_states)
+		balloon_states = hashmap_new();
+	state = mem_new0(balloon_state_t, 1);
+	hashmap_put(balloon_states, key, sizeof(uuid_bin_t), state);
+	return state;
+}
+
+/*
+ * Asks the VMM of the container to inflate its balloon by mb MiB, or to deflate it
+ * if mb is negative. The VMM does not reply.
+ */
+static int
+balloon_send(const container_t *container, int32_t mb)
+{
+	char *path = container_get_kvm_ipc_path_new(container);
+	IF_NULL_RETVAL(path, -1);
+
+	int sock = sock_unix_create_and_connect(SOCK_STREAM | SOCK_NONBLOCK, path);
+	mem_free0(path);
+	IF_TRUE_RETVAL(sock < 0, -1);
+
+	// struct kvm_ipc_head followed by the amount
+	struct {
+		uint32_t type;
+		uint32_t len;
+		int32_t mb;
+	} msg = { BALLOON_KVM_IPC_BALLOON, sizeof(int32_t), mb };
+	int ret = fd_write(sock, (char *)&msg, sizeof(msg)) == sizeof(msg) ? 0 : -1;
+	close(sock);
+	return ret;
+}
+
+static void
+balloon_resize(container_t *container, balloon_state_t *state, int32_t mb)
+{
+	if (balloon_send(container, mb) < 0) {
+		WARN("Could not %s balloon of container %s", mb > 0 ? "inflate" : "deflate",
+		     container_get_description(container));
+		return;
+	}
+	state->size += mb;
+	INFO("%s balloon of container %s to %u MiB", mb > 0 ? "Inflated" : "Deflated",
+	     container_get_description(container), state->size);
+}
+
+static void
+balloon_cb(UNUSED event_timer_t *timer, UNUSED void *data)
+{
+	double avg10, avg60;
+	IF_TRUE_RETURN(psi_host_get_avg(PSI_MEMORY, &avg10, &avg60) < 0);
+
+	container_t *inflate = NULL, *deflate = NULL;
+	balloon_state_t *inflate_state = NULL, *deflate_state = NULL;
+
+	for (int i = 0; i < cmld_containers_get_count(); i++) {
+		container_t *container = cmld_container_get_by_index(i);
+		const container_kvm_config_t *kvm = container_get_kvm_config(container);
+		if (container_get_type(container) != CONTAINER_TYPE_KVM || !kvm->balloon ||
+		    !kvm->memory)
+			continue;
+
+		balloon_state_t *state = balloon_state_get(container, true);
+		container_state_t cstate = container_get_state(container);
+		if (cstate != CONTAINER_STATE_RUNNING) {
+			// a new VMM starts with an empty balloon
+			if (cstate != CONTAINER_STATE_FROZEN && cstate != CONTAINER_STATE_FREEZING)
+				state->size = 0;
+			continue;
+		}
+
+		uint32_t prio = container_get_boot_priority(container);
+		if (state->size < kvm->memory * BALLOON_MAX_PERCENT / 100 &&
+		    (!inflate || prio < container_get_boot_priority(inflate))) {
+			inflate = container;
+			inflate_state = state;
+		}
+		if (state->size > 0 && (!deflate || prio > container_get_boot_priority(deflate))) {
+			deflate = container;
+			deflate_state = state;
+		}
+	}
+
+	if (avg10 >= BALLOON_INFLATE_AVG10 && inflate) {
+		uint32_t memory = container_get_kvm_config(inflate)->memory;
+		uint32_t step = MAX(memory * BALLOON_STEP_PERCENT / 100, 1);
+		step = MIN(step, memory * BALLOON_MAX_PERCENT / 100 - inflate_state->size);
+		balloon_resize(inflate, inflate_state, step);
+	} else if (avg10 < BALLOON_DEFLATE_AVG10 && deflate) {
+		uint32_t memory = container_get_kvm_config(deflate)->memory;
+		uint32_t step = MAX(memory * BALLOON_STEP_PERCENT / 100, 1);
+		step = MIN(step, deflate_state->size);
+		balloon_resize(deflate, deflate_state, -(int32_t)step);
+	}
+}
+
+void
+balloon_init(void)
+{
+	balloon_timer =
+		event_timer_new(BALLOON_INTERVAL, EVENT_TIMER_REPEAT_FOREVER, &balloon_cb, NULL);
+	event_add_timer(balloon_timer);
+}
+
+uint64_t
+balloon_get_size(const container_t *container)
+{
+	ASSERT(container);
+
+	balloon_state_t *state = balloon_state_get(container, false);
+	return state ? (uint64_t)state->size << 20 : 0;
+}
+
+void
+balloon_remove(const container_t *container)
+{
+	ASSERT(container);
+	if (!balloon_states)
+		return;
+
+	const uuid_bin_t *key = uuid_get_bin(container_get_uuid(container));
+	balloon_state_t *state = hashmap_remove(balloon_states, key, sizeof(uuid_bin_t));
+	mem_free0(state);
+}
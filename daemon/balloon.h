@@ -0,0 +1,60 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file balloon.h
+ *
+ * Memory balloon control of KVM containers with a virtio-balloon. Under memory pressure
+ * of the host (PSI), the balloon of the running KVM container with the lowest boot
+ * priority is inflated step by step, up to half of its guest memory, so that the guest
+ * hands free pages back to the host. Once the pressure is gone, the balloons are
+ * deflated again, highest priority first. This allows to overcommit the memory of
+ * KVM containers without OOM kills on the host.
+ */
+
+#ifndef BALLOON_H
+#define BALLOON_H
+
+#include "container.h"
+
+#include <stdint.h>
+
+/**
+ * Starts the periodic balloon control, which requires the host pressure of psi.h.
+ */
+void
+balloon_init(void);
+
+/**
+ * Returns the bytes of guest memory currently held by the balloon of the container.
+ */
+uint64_t
+balloon_get_size(const container_t *container);
+
+/**
+ * Drops the balloon state of a container which is removed.
+ */
+void
+balloon_remove(const container_t *container);
+
+#endif /* BALLOON_H */
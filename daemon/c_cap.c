@@ -190,20 +190,11 @@ c_cap_do_exec_cap_systime(const container_t *container, char *const *argv)
 }
 
 static void
-c_cap_exec_cap_systime_sigchld_cb(UNUSED int signum, event_signal_t *sig, void *data)
+c_cap_exec_cap_systime_child_cb(pid_t pid, UNUSED int status, event_child_t *child,
+				UNUSED void *data)
 {
-	pid_t *pid = data;
-	int status = 0;
-
-	DEBUG("exec_cap_systime SIGCHLD handler called for PID %d", *pid);
-	if (waitpid(*pid, &status, WNOHANG) > 0) {
-		TRACE("Reaped exec_cap_systime process: %d", *pid);
-		event_remove_signal(sig);
-		event_signal_free(sig);
-		mem_free0(pid);
-	} else {
-		TRACE("Failed to reap exec_cap_systime process");
-	}
+	TRACE("Reaped exec_cap_systime process: %d", pid);
+	event_child_free(child);
 }
 
 int
@@ -257,12 +248,10 @@ c_cap_exec_cap_systime(const container_t *container, char *const *argv)
 	}
 
 	// sucessfully double forked child in target pidns
-	pid_t *_pid = mem_new(pid_t, 1);
-	*_pid = pid;
 	// register reaper for intermediate process
-	event_signal_t *sigchld =
-		event_signal_new(SIGCHLD, c_cap_exec_cap_systime_sigchld_cb, _pid);
-	event_add_signal(sigchld);
+	event_child_t *child = event_child_new(pid, c_cap_exec_cap_systime_child_cb, NULL);
+	if (event_add_child(child) < 0)
+		event_child_free(child);
 	return 0;
 }
 
@@ -31,15 +31,24 @@
 #include "uevent.h"
 #include "cmld.h"
 #include "mount.h"
+#include "cgroups_v2.h"
+#include "ksm.h"
+#include "psi.h"
+#include "placement.h"
+#include "procfs.h"
 
 #include "common/mem.h"
 #include "common/macro.h"
 #include "common/file.h"
 #include "common/event.h"
 #include "common/dir.h"
+#include "common/cryptfs.h"
 
+#include <dirent.h>
 #include <limits.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/mount.h>
@@ -47,6 +56,7 @@
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/inotify.h>
+#include <time.h>
 #include <errno.h>
 #include <unistd.h>
 
@@ -62,6 +72,19 @@
 // work-around a buggy kernel cgroups implementation for the "deb" device.
 //#define ACTIVE_CGROUPS_SUBSYSTEMS "cpu,memory,freezer,devices"
 
+/* Share of the RAM limit at which a cgroup v2 container is throttled (memory.high) */
+#define CGROUPS_V2_MEMORY_HIGH_PERCENT 90
+
+/* blkio.weight of cgroup v1 per io.weight of cgroup v2, i.e. the defaults 500 and 100 */
+#define CGROUPS_V1_IO_WEIGHT_FACTOR 5
+#define CGROUPS_V1_IO_WEIGHT_MIN 10
+#define CGROUPS_V1_IO_WEIGHT_MAX 1000
+
+/* Proactive reclaim is not worth it for less than this amount of memory */
+#define CGROUPS_RECLAIM_MIN_BYTES (4 * 1024 * 1024)
+/* Upper bound of reclaim attempts skipped after the kernel fell short */
+#define CGROUPS_RECLAIM_MAX_BACKOFF 32
+
 /* Define timeout for freeze in milliseconds */
 #define CGROUPS_FREEZER_TIMEOUT 5000
 /* Define the time interval between status checks while freezing */
@@ -69,6 +92,27 @@
 
 #define CGROUPS_FREEZER_RETRIES CGROUPS_FREEZER_TIMEOUT / CGROUPS_FREEZER_RETRY_INTERVAL
 
+/* Number of resource usage samples kept per container */
+#define CGROUPS_STATS_RING_SIZE 120
+/* Default interval between resource usage samples in milliseconds */
+#define CGROUPS_STATS_INTERVAL 5000
+
+/* For analyzation purposes, log the devices held open by the containers with each
+ * sample, e.g. to derive device whitelists */
+//#define C_CGROUPS_DEVICES_ANALYSIS
+
+enum c_cgroups_stats_file {
+	CGROUPS_STATS_FILE_CPU = 0,
+	CGROUPS_STATS_FILE_MEM,
+	CGROUPS_STATS_FILE_IO,
+	CGROUPS_STATS_FILE_PIDS,
+	CGROUPS_STATS_FILE_PROCS,
+	CGROUPS_STATS_FILE_MEMSTAT,
+	CGROUPS_STATS_FILE_COUNT,
+};
+
+static unsigned int c_cgroups_stats_interval = CGROUPS_STATS_INTERVAL;
+
 /* List of 2-element int arrays, representing maj:min of devices allowed to be used in the running containers.
   * wildcard '*' is mapped to -1 */
 list_t *global_allowed_devs_list = NULL;
@@ -77,10 +121,16 @@ list_t *global_allowed_devs_list = NULL;
   * wildcard '*' is mapped to -1 */
 list_t *global_assigned_devs_list = NULL;
 
+typedef struct {
+	char *rule;
+	bool allow;
+} c_cgroups_dev_batch_rule_t;
+
 struct c_cgroups {
 	container_t *container; // weak reference
-	char *cgroup_path;
+	char *cgroup_path;	/* cgroup of the container in the unified hierarchy (v2 only) */
 	list_t *active_cgroups;
+	bool v2; /* use the cgroup v2 unified hierarchy instead of the legacy hierarchies */
 
 	event_inotify_t *inotify_freezer_state;
 	event_timer_t *freeze_timer; /* timer to handle a container freeze timeout */
@@ -89,7 +139,28 @@ struct c_cgroups {
 				  wildcard '*' is mapped to -1 */
 	list_t *allowed_devs; /* list of 2 element int arrays, representing maj:min of devices allowed to be accessed.
 				  wildcard '*' is mapped to -1 */
+	list_t *dev_rules; /* ordered list of cgroups_v2_dev_rule_t compiled to the device filter (v2 only) */
+	bool dev_batch_active; /* collect device rules and apply them in c_cgroups_devices_batch_commit() */
+	list_t *dev_batch; /* ordered list of c_cgroups_dev_batch_rule_t (v1 only) */
+
+	event_timer_t *stats_timer;
+	int stats_fd[CGROUPS_STATS_FILE_COUNT]; /* held open, read with pread on each sample */
+	c_cgroups_stats_sample_t stats_ring[CGROUPS_STATS_RING_SIZE];
+	size_t stats_first;
+	size_t stats_count;
 	bool ns_cgroup;
+	bool ns_cgroup_adopted; /* cgroup and cgroupns prepared by a zygote (v2 only) */
+
+	bool mem_background;	     /* reclaimed first, see c_cgroups_set_mem_background() */
+	unsigned int reclaim_skip;   /* calls of c_cgroups_mem_reclaim() left to skip */
+	unsigned int reclaim_backoff; /* calls skipped after the last reclaim fell short */
+
+	psi_monitor_t *psi_monitors[PSI_RESOURCE_COUNT]; /* pressure of the cgroup (v2 only) */
+	procfs_view_t *procfs_view; /* views of /proc files, refreshed with each sample */
+
+	/* control files written repeatedly, kept open until cleanup (v2 only) */
+	file_handle_t *freeze_handle;
+	file_handle_t *procs_handle;
 };
 
 c_cgroups_t *
@@ -97,21 +168,55 @@ c_cgroups_new(container_t *container)
 {
 	c_cgroups_t *cgroups = mem_new0(c_cgroups_t, 1);
 	cgroups->container = container;
-	//cgroups->cgroup_path = mem_printf("%s/%s", CONTAINER_HIERARCHY, uuid_string(container_get_uuid(cgroups->container)));
+	cgroups->cgroup_path = mem_printf("%s/%s", CGROUPS_FOLDER,
+					  uuid_string(container_get_uuid(cgroups->container)));
+	cgroups->ns_cgroup_adopted = false;
 	cgroups->active_cgroups = hardware_get_active_cgroups_subsystems();
+	cgroups->v2 = cgroups_v2_enabled();
 
 	cgroups->inotify_freezer_state = NULL;
 	cgroups->freeze_timer = NULL;
 	cgroups->assigned_devs = NULL;
 	cgroups->allowed_devs = NULL;
+	cgroups->dev_rules = NULL;
+	cgroups->stats_timer = NULL;
+	for (int i = 0; i < CGROUPS_STATS_FILE_COUNT; i++)
+		cgroups->stats_fd[i] = -1;
 	cgroups->ns_cgroup = file_exists("/proc/self/ns/cgroup");
 	return cgroups;
 }
 
+/**
+ * Sets the cgroup in the unified hierarchy to the one of the container itself.
+ */
+static void
+c_cgroups_v2_reset_cgroup_path(c_cgroups_t *cgroups)
+{
+	mem_free0(cgroups->cgroup_path);
+	cgroups->cgroup_path = mem_printf("%s/%s", CGROUPS_FOLDER,
+					  uuid_string(container_get_uuid(cgroups->container)));
+	cgroups->ns_cgroup_adopted = false;
+}
+
+void
+c_cgroups_adopt(c_cgroups_t *cgroups, const char *cgroup_path)
+{
+	ASSERT(cgroups);
+	IF_TRUE_RETURN(!cgroup_path || !cgroups->v2);
+
+	DEBUG("Container %s adopts cgroup %s", container_get_description(cgroups->container),
+	      cgroup_path);
+	mem_free0(cgroups->cgroup_path);
+	cgroups->cgroup_path = mem_strdup(cgroup_path);
+	cgroups->ns_cgroup_adopted = true;
+}
+
 void
 c_cgroups_free(c_cgroups_t *cgroups)
 {
 	ASSERT(cgroups);
+	file_handle_close(cgroups->freeze_handle);
+	file_handle_close(cgroups->procs_handle);
 	mem_free0(cgroups->cgroup_path);
 	mem_free0(cgroups);
 }
@@ -244,7 +349,7 @@ c_cgroups_list_add(list_t **list, const int *dev)
 {
 	int *dev_copy = mem_new0(int, 2);
 	memcpy(dev_copy, dev, sizeof(int) * 2);
-	*list = list_append(*list, dev_copy);
+	*list = list_prepend(*list, dev_copy);
 }
 
 static void
@@ -275,9 +380,25 @@ c_cgroups_list_contains_match(const list_t *list, const int *dev)
 	return 0;
 }
 
+static bool
+c_cgroups_list_contains(const list_t *list, const int *dev)
+{
+	for (const list_t *elem = list; elem != NULL; elem = elem->next) {
+		const int *dev_elem = (const int *)elem->data;
+		if ((dev_elem[0] == dev[0]) && (dev_elem[1] == dev[1]))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Devices already in the container's list are not added again, neither to the
+ * global list, as c_cgroups_cleanup() removes one global entry per local one.
+ */
 static void
 c_cgroups_add_allowed(c_cgroups_t *cgroups, const int *dev)
 {
+	IF_TRUE_RETURN(c_cgroups_list_contains(cgroups->allowed_devs, dev));
 	c_cgroups_list_add(&global_allowed_devs_list, dev);
 	c_cgroups_list_add(&cgroups->allowed_devs, dev);
 }
@@ -285,13 +406,108 @@ c_cgroups_add_allowed(c_cgroups_t *cgroups, const int *dev)
 static void
 c_cgroups_add_assigned(c_cgroups_t *cgroups, const int *dev)
 {
+	IF_TRUE_RETURN(c_cgroups_list_contains(cgroups->assigned_devs, dev));
 	c_cgroups_list_add(&global_assigned_devs_list, dev);
 	c_cgroups_list_add(&cgroups->assigned_devs, dev);
 }
 
+static void
+c_cgroups_dev_batch_clear(c_cgroups_t *cgroups)
+{
+	for (list_t *l = cgroups->dev_batch; l; l = l->next) {
+		c_cgroups_dev_batch_rule_t *batch_rule = l->data;
+		mem_free0(batch_rule->rule);
+		mem_free0(batch_rule);
+	}
+	list_delete(cgroups->dev_batch);
+	cgroups->dev_batch = NULL;
+}
+
+/*
+ * Queues a rule for the legacy devices controller. Like in the kernel, "a"
+ * replaces all previous rules, and a rule which is already in effect with the
+ * same verdict is dropped.
+ */
+static void
+c_cgroups_dev_batch_add(c_cgroups_t *cgroups, const char *rule, bool allow)
+{
+	if (!strcmp(rule, "a")) {
+		c_cgroups_dev_batch_clear(cgroups);
+	} else {
+		for (list_t *l = list_tail(cgroups->dev_batch); l; l = l->prev) {
+			c_cgroups_dev_batch_rule_t *batch_rule = l->data;
+			if (strcmp(batch_rule->rule, rule))
+				continue;
+			if (batch_rule->allow == allow) {
+				TRACE("Skipping duplicate device rule '%s'", rule);
+				return;
+			}
+			break;
+		}
+	}
+
+	c_cgroups_dev_batch_rule_t *batch_rule = mem_new0(c_cgroups_dev_batch_rule_t, 1);
+	batch_rule->rule = mem_strdup(rule);
+	batch_rule->allow = allow;
+	cgroups->dev_batch = list_append(cgroups->dev_batch, batch_rule);
+}
+
+static void
+c_cgroups_v2_devices_clear(c_cgroups_t *cgroups)
+{
+	for (list_t *l = cgroups->dev_rules; l; l = l->next)
+		cgroups_v2_dev_rule_free(l->data);
+	list_delete(cgroups->dev_rules);
+	cgroups->dev_rules = NULL;
+}
+
+/*
+ * The unified hierarchy has no devices.allow/deny, thus the rules are collected
+ * in their order and the resulting device filter program is attached again.
+ */
+static int
+c_cgroups_v2_devices_add_rule(c_cgroups_t *cgroups, const char *rule, bool allow)
+{
+	cgroups_v2_dev_rule_t *dev_rule = cgroups_v2_dev_rule_new(rule, allow);
+	IF_NULL_RETVAL(dev_rule, -1);
+
+	if (cgroups_v2_dev_rule_is_all(dev_rule)) {
+		/* like "a" written to devices.allow/deny, this replaces all previous rules */
+		c_cgroups_v2_devices_clear(cgroups);
+	} else {
+		/* a rule for the same devices and access supersedes the previous one */
+		for (list_t *l = cgroups->dev_rules; l; l = l->next) {
+			if (cgroups_v2_dev_rule_equals(l->data, dev_rule)) {
+				cgroups_v2_dev_rule_free(l->data);
+				cgroups->dev_rules = list_unlink(cgroups->dev_rules, l);
+				break;
+			}
+		}
+	}
+
+	/* devices which are not matched by any rule are denied anyway */
+	if (allow || cgroups->dev_rules)
+		cgroups->dev_rules = list_append(cgroups->dev_rules, dev_rule);
+	else
+		cgroups_v2_dev_rule_free(dev_rule);
+
+	/* the filter is compiled once in c_cgroups_devices_batch_commit() */
+	IF_TRUE_RETVAL(cgroups->dev_batch_active, 0);
+
+	return cgroups_v2_dev_filter_attach(cgroups->cgroup_path, cgroups->dev_rules);
+}
+
 static int
 c_cgroups_allow_rule(c_cgroups_t *cgroups, const char *rule)
 {
+	if (cgroups->v2)
+		return c_cgroups_v2_devices_add_rule(cgroups, rule, true);
+
+	if (cgroups->dev_batch_active) {
+		c_cgroups_dev_batch_add(cgroups, rule, true);
+		return 0;
+	}
+
 	// first allow in host-side list, which cannot manipulated by container (if namspaced)
 	char *path = mem_printf("%s/devices/%s/devices.allow", CGROUPS_FOLDER,
 				uuid_string(container_get_uuid(cgroups->container)));
@@ -367,6 +583,14 @@ c_cgroups_devices_deny(c_cgroups_t *cgroups, const char *rule)
 	ASSERT(cgroups);
 	ASSERT(rule);
 
+	if (cgroups->v2)
+		return c_cgroups_v2_devices_add_rule(cgroups, rule, false);
+
+	if (cgroups->dev_batch_active) {
+		c_cgroups_dev_batch_add(cgroups, rule, false);
+		return 0;
+	}
+
 	// will automatically deny access to all sub folders including child
 	char *path = mem_printf("%s/devices/%s/devices.deny", CGROUPS_FOLDER,
 				uuid_string(container_get_uuid(cgroups->container)));
@@ -481,8 +705,82 @@ c_cgroups_devices_deny_audio(c_cgroups_t *cgroups)
 	return 0;
 }
 
+/*
+ * Starts collecting device rules instead of applying each one on its own.
+ * The allowed and assigned lists are still updated immediately.
+ */
+static void
+c_cgroups_devices_batch_begin(c_cgroups_t *cgroups)
+{
+	ASSERT(!cgroups->dev_batch_active);
+	cgroups->dev_batch_active = true;
+}
+
+static void
+c_cgroups_devices_batch_abort(c_cgroups_t *cgroups)
+{
+	c_cgroups_dev_batch_clear(cgroups);
+	cgroups->dev_batch_active = false;
+}
+
+/*
+ * Applies the collected rules: on cgroup v2 as a single device filter program,
+ * which replaces the previous one atomically, on v1 by writing all rules in
+ * order through one open devices.allow and devices.deny file each.
+ */
 static int
-c_cgroups_devices_init(c_cgroups_t *cgroups)
+c_cgroups_devices_batch_commit(c_cgroups_t *cgroups)
+{
+	int ret = -1;
+	int allow_fd = -1, deny_fd = -1;
+	char *allow_path = NULL, *deny_path = NULL;
+
+	cgroups->dev_batch_active = false;
+
+	if (cgroups->v2)
+		return cgroups_v2_dev_filter_attach(cgroups->cgroup_path, cgroups->dev_rules);
+
+	allow_path = mem_printf("%s/devices/%s/devices.allow", CGROUPS_FOLDER,
+				uuid_string(container_get_uuid(cgroups->container)));
+	deny_path = mem_printf("%s/devices/%s/devices.deny", CGROUPS_FOLDER,
+			       uuid_string(container_get_uuid(cgroups->container)));
+
+	if ((allow_fd = open(allow_path, O_WRONLY | O_CLOEXEC)) < 0) {
+		ERROR_ERRNO("Failed to open %s", allow_path);
+		goto out;
+	}
+	if ((deny_fd = open(deny_path, O_WRONLY | O_CLOEXEC)) < 0) {
+		ERROR_ERRNO("Failed to open %s", deny_path);
+		goto out;
+	}
+
+	/* the kernel parses one rule per write */
+	for (list_t *l = cgroups->dev_batch; l; l = l->next) {
+		c_cgroups_dev_batch_rule_t *batch_rule = l->data;
+		size_t len = strlen(batch_rule->rule);
+		if (write(batch_rule->allow ? allow_fd : deny_fd, batch_rule->rule, len) !=
+		    (ssize_t)len) {
+			ERROR_ERRNO("Failed to write '%s' to %s", batch_rule->rule,
+				    batch_rule->allow ? allow_path : deny_path);
+			goto out;
+		}
+	}
+	TRACE("Applied %u device rules to %s", list_length(cgroups->dev_batch), allow_path);
+
+	ret = 0;
+out:
+	if (allow_fd >= 0)
+		close(allow_fd);
+	if (deny_fd >= 0)
+		close(deny_fd);
+	mem_free0(allow_path);
+	mem_free0(deny_path);
+	c_cgroups_dev_batch_clear(cgroups);
+	return ret;
+}
+
+static int
+c_cgroups_devices_init_rules(c_cgroups_t *cgroups)
 {
 	ASSERT(cgroups);
 
@@ -529,6 +827,15 @@ c_cgroups_devices_init(c_cgroups_t *cgroups)
 		if (c_cgroups_devices_allow(cgroups, "c 10:232 rwm") < 0)
 			return -1;
 		INFO("Allowing acces to /dev/kvm for lkvm inside new namespace");
+
+		const container_kvm_config_t *kvm = container_get_kvm_config(cgroups->container);
+		/* /dev/vhost-net and /dev/net/tun for the tap of lkvm */
+		if (kvm->vhost_net && (c_cgroups_devices_allow(cgroups, "c 10:238 rwm") < 0 ||
+				       c_cgroups_devices_allow(cgroups, "c 10:200 rwm") < 0))
+			return -1;
+		/* /dev/vhost-vsock */
+		if (kvm->vsock_cid && c_cgroups_devices_allow(cgroups, "c 10:241 rwm") < 0)
+			return -1;
 	}
 
 	/* allow container specific device whitelist */
@@ -549,6 +856,33 @@ c_cgroups_devices_init(c_cgroups_t *cgroups)
 	}
 	DEBUG("Applied containers assign list");
 
+	return 0;
+}
+
+static int
+c_cgroups_devices_init(c_cgroups_t *cgroups)
+{
+	ASSERT(cgroups);
+
+	/* collect the complete policy first and apply it at once */
+	c_cgroups_devices_batch_begin(cgroups);
+	if (c_cgroups_devices_init_rules(cgroups) < 0) {
+		c_cgroups_devices_batch_abort(cgroups);
+		return -1;
+	}
+	if (c_cgroups_devices_batch_commit(cgroups) < 0) {
+		ERROR("Could not apply device policy for container %s",
+		      container_get_description(cgroups->container));
+		return -1;
+	}
+
+	if (cgroups->v2) {
+		DEBUG("Device filter for container %s compiled from %u rules",
+		      container_get_description(cgroups->container),
+		      list_length(cgroups->dev_rules));
+		return 0;
+	}
+
 	/* Print out the initialized devices whitelist */
 	char *list_path = mem_printf("%s/devices/%s/devices.list", CGROUPS_FOLDER,
 				     uuid_string(container_get_uuid(cgroups->container)));
@@ -576,6 +910,45 @@ c_cgroups_cleanup_freeze_timer(c_cgroups_t *cgroups)
 	cgroups->freezer_retries = 0;
 }
 
+static void
+c_cgroups_freezer_state_cb(const char *path, uint32_t mask, event_inotify_t *inotify, void *data);
+
+/*
+ * Writes value to the control file name below the cgroup of the container. The file
+ * is opened on first use and kept open in *handle until c_cgroups_cleanup().
+ */
+static int
+c_cgroups_v2_write_ctrl(c_cgroups_t *cgroups, file_handle_t **handle, const char *name,
+			const char *value)
+{
+	if (!*handle) {
+		char *path = mem_printf("%s/%s", cgroups->cgroup_path, name);
+		*handle = file_handle_open(path, O_WRONLY);
+		mem_free0(path);
+		IF_NULL_RETVAL(*handle, -1);
+	}
+
+	return file_handle_pwrite(*handle, value, strlen(value), 0) < 0 ? -1 : 0;
+}
+
+/*
+ * cgroup.events only changes once the cgroup is completely frozen or thawed,
+ * thus the state callback is triggered directly to handle the transition.
+ */
+static int
+c_cgroups_v2_set_freeze(c_cgroups_t *cgroups, bool freeze)
+{
+	if (c_cgroups_v2_write_ctrl(cgroups, &cgroups->freeze_handle, "cgroup.freeze",
+				    freeze ? "1" : "0") < 0) {
+		ERROR_ERRNO("Failed to write to freezer file of %s",
+			    container_get_description(cgroups->container));
+		return -1;
+	}
+
+	c_cgroups_freezer_state_cb(NULL, 0, NULL, cgroups);
+	return 0;
+}
+
 int
 c_cgroups_freeze(c_cgroups_t *cgroups)
 {
@@ -583,6 +956,9 @@ c_cgroups_freeze(c_cgroups_t *cgroups)
 
 	// TODO think about where to check for unnecessary state changes, currently done in container.c
 
+	if (cgroups->v2)
+		return c_cgroups_v2_set_freeze(cgroups, true);
+
 	char *freezer_state_path = mem_printf("%s/freezer/%s/freezer.state", CGROUPS_FOLDER,
 					      uuid_string(container_get_uuid(cgroups->container)));
 	if (file_write(freezer_state_path, "FROZEN", -1) == -1) {
@@ -601,6 +977,9 @@ c_cgroups_unfreeze(c_cgroups_t *cgroups)
 
 	// TODO think about where to check for unnecessary state changes
 
+	if (cgroups->v2)
+		return c_cgroups_v2_set_freeze(cgroups, false);
+
 	char *freezer_state_path = mem_printf("%s/freezer/%s/freezer.state", CGROUPS_FOLDER,
 					      uuid_string(container_get_uuid(cgroups->container)));
 	if (file_write(freezer_state_path, "THAWED", -1) == -1) {
@@ -612,9 +991,6 @@ c_cgroups_unfreeze(c_cgroups_t *cgroups)
 	return 0;
 }
 
-static void
-c_cgroups_freezer_state_cb(const char *path, uint32_t mask, event_inotify_t *inotify, void *data);
-
 static void
 c_cgroups_freeze_timeout_cb(UNUSED event_timer_t *timer, void *data)
 {
@@ -647,6 +1023,44 @@ c_cgroups_freeze_timeout_cb(UNUSED event_timer_t *timer, void *data)
 	c_cgroups_cleanup_freeze_timer(cgroups);
 }
 
+/*
+ * Returns the state of the freezer as in the legacy freezer.state, i.e.,
+ * "THAWED", "FREEZING" or "FROZEN". On cgroup v2 it is derived from the
+ * requested state in cgroup.freeze and the actual state in cgroup.events.
+ */
+static char *
+c_cgroups_freezer_state_new(const c_cgroups_t *cgroups)
+{
+	if (!cgroups->v2) {
+		char *freezer_state_path =
+			mem_printf("%s/freezer/%s/freezer.state", CGROUPS_FOLDER,
+				   uuid_string(container_get_uuid(cgroups->container)));
+		char *state = file_read_new(freezer_state_path, 10);
+		mem_free0(freezer_state_path);
+		return state;
+	}
+
+	char *freeze_path = mem_printf("%s/cgroup.freeze", cgroups->cgroup_path);
+	char *events_path = mem_printf("%s/cgroup.events", cgroups->cgroup_path);
+	char *freeze = file_read_new(freeze_path, 4);
+	char *events = file_read_new(events_path, 128);
+	char *state = NULL;
+
+	if (!freeze || !events) {
+		ERROR("Could not read freezer state of %s", cgroups->cgroup_path);
+	} else if (freeze[0] != '1') {
+		state = mem_strdup("THAWED");
+	} else {
+		state = mem_strdup(strstr(events, "frozen 1") ? "FROZEN" : "FREEZING");
+	}
+
+	mem_free0(freeze);
+	mem_free0(events);
+	mem_free0(freeze_path);
+	mem_free0(events_path);
+	return state;
+}
+
 static void
 c_cgroups_freezer_state_cb(UNUSED const char *path, UNUSED uint32_t mask,
 			   UNUSED event_inotify_t *inotify, void *data)
@@ -655,10 +1069,8 @@ c_cgroups_freezer_state_cb(UNUSED const char *path, UNUSED uint32_t mask,
 
 	ASSERT(cgroups);
 
-	char *freezer_state_path = mem_printf("%s/freezer/%s/freezer.state", CGROUPS_FOLDER,
-					      uuid_string(container_get_uuid(cgroups->container)));
-	char *state = file_read_new(freezer_state_path, 10);
-	mem_free0(freezer_state_path);
+	char *state = c_cgroups_freezer_state_new(cgroups);
+	IF_NULL_RETURN(state);
 
 	DEBUG("State of freezer for container %s is %s",
 	      container_get_description(cgroups->container), state);
@@ -678,8 +1090,16 @@ c_cgroups_freezer_state_cb(UNUSED const char *path, UNUSED uint32_t mask,
 
 		c_cgroups_cleanup_freeze_timer(cgroups);
 		/* register a timer to stop the freeze if it does not complete in time */
-		cgroups->freeze_timer = event_timer_new(CGROUPS_FREEZER_RETRY_INTERVAL, -1,
-							&c_cgroups_freeze_timeout_cb, cgroups);
+		if (cgroups->v2) {
+			/* completion is notified via cgroup.events, so just wait for the timeout */
+			cgroups->freezer_retries = CGROUPS_FREEZER_RETRIES;
+			cgroups->freeze_timer = event_timer_new(
+				CGROUPS_FREEZER_TIMEOUT, -1, &c_cgroups_freeze_timeout_cb, cgroups);
+		} else {
+			cgroups->freeze_timer =
+				event_timer_new(CGROUPS_FREEZER_RETRY_INTERVAL, -1,
+						&c_cgroups_freeze_timeout_cb, cgroups);
+		}
 		event_add_timer(cgroups->freeze_timer);
 
 		container_set_state(cgroups->container, CONTAINER_STATE_FREEZING);
@@ -693,6 +1113,78 @@ c_cgroups_freezer_state_cb(UNUSED const char *path, UNUSED uint32_t mask,
 	mem_free0(state);
 }
 
+/*
+ * On cgroup v2 the soft limit is memory.high, which starts throttling and reclaim
+ * before the container hits the OOM killer at memory.max. Without a configured soft
+ * limit it is set slightly below the RAM limit. On v1 memory.soft_limit_in_bytes
+ * only takes effect under global memory pressure, when the kernel first reclaims
+ * from cgroups exceeding their soft limit; background containers get 0.
+ */
+static int
+c_cgroups_set_ram_soft_limit(c_cgroups_t *cgroups)
+{
+	uint64_t limit = (uint64_t)container_get_ram_limit(cgroups->container) * 1024 * 1024;
+	uint64_t soft = (uint64_t)container_get_ram_soft_limit(cgroups->container) * 1024 * 1024;
+	char *path = NULL;
+	char *value = NULL;
+
+	if (cgroups->v2) {
+		if (!soft)
+			soft = limit / 100 * CGROUPS_V2_MEMORY_HIGH_PERCENT;
+		if (limit && soft > limit)
+			soft = limit;
+		path = mem_printf("%s/memory.high", cgroups->cgroup_path);
+		value = soft ? mem_printf("%" PRIu64, soft) : mem_strdup("max");
+	} else {
+		path = mem_printf("%s/memory/%s/memory.soft_limit_in_bytes", CGROUPS_FOLDER,
+				  uuid_string(container_get_uuid(cgroups->container)));
+		if (cgroups->mem_background)
+			soft = 0;
+		else if (!soft)
+			soft = UINT64_MAX;
+		value = soft == UINT64_MAX ? mem_strdup("-1") : mem_printf("%" PRIu64, soft);
+	}
+
+	int ret = file_printf(path, "%s", value);
+	if (ret < 0)
+		ERROR("Could not write to cgroup memory file %s", path);
+	else
+		DEBUG("Set soft RAM limit of container %s to %s",
+		      container_get_description(cgroups->container), value);
+
+	mem_free0(path);
+	mem_free0(value);
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+ * On cgroup v2 the limit is enforced by memory.max.
+ */
+static int
+c_cgroups_v2_set_ram_limit(c_cgroups_t *cgroups)
+{
+	int ret = -1;
+	uint64_t limit = (uint64_t)container_get_ram_limit(cgroups->container) * 1024 * 1024;
+	char *max_path = mem_printf("%s/memory.max", cgroups->cgroup_path);
+
+	if (!file_exists(max_path)) {
+		ERROR("%s file not found (cgroup memory controller not enabled?)", max_path);
+		goto out;
+	}
+	if (file_printf(max_path, "%" PRIu64, limit) == -1) {
+		ERROR("Could not write to cgroup memory file %s", max_path);
+		goto out;
+	}
+
+	INFO("Successfully set RAM limit of container %s to %d MBytes",
+	     container_get_description(cgroups->container),
+	     container_get_ram_limit(cgroups->container));
+	ret = 0;
+out:
+	mem_free0(max_path);
+	return ret;
+}
+
 int
 c_cgroups_set_ram_limit(c_cgroups_t *cgroups)
 {
@@ -701,7 +1193,15 @@ c_cgroups_set_ram_limit(c_cgroups_t *cgroups)
 	if (container_get_ram_limit(cgroups->container) == 0) {
 		INFO("Setting no RAM limit for container %s",
 		     container_get_description(cgroups->container));
-		return 0;
+		if (container_get_ram_soft_limit(cgroups->container) == 0)
+			return 0;
+		return c_cgroups_set_ram_soft_limit(cgroups);
+	}
+
+	if (cgroups->v2) {
+		if (c_cgroups_v2_set_ram_limit(cgroups) < 0)
+			return -1;
+		return c_cgroups_set_ram_soft_limit(cgroups);
 	}
 
 	int ret = -1;
@@ -728,12 +1228,81 @@ c_cgroups_set_ram_limit(c_cgroups_t *cgroups)
 	     container_get_description(cgroups->container),
 	     container_get_ram_limit(cgroups->container));
 
-	ret = 0;
+	ret = c_cgroups_set_ram_soft_limit(cgroups);
 out:
 	mem_free0(limit_in_bytes_path);
 	return ret;
 }
 
+int
+c_cgroups_set_mem_background(c_cgroups_t *cgroups, bool background)
+{
+	ASSERT(cgroups);
+	IF_TRUE_RETVAL(cgroups->mem_background == background, 0);
+
+	DEBUG("Container %s moved to the %s for memory management",
+	      container_get_description(cgroups->container),
+	      background ? "background" : "foreground");
+	cgroups->mem_background = background;
+	cgroups->reclaim_skip = 0;
+	cgroups->reclaim_backoff = 0;
+
+	return cgroups->v2 ? 0 : c_cgroups_set_ram_soft_limit(cgroups);
+}
+
+int
+c_cgroups_mem_reclaim(c_cgroups_t *cgroups, unsigned int percent)
+{
+	ASSERT(cgroups);
+	IF_FALSE_RETVAL_TRACE(cgroups->v2, -1);
+
+	if (cgroups->reclaim_skip) {
+		cgroups->reclaim_skip--;
+		return 0;
+	}
+
+	char *current_path = mem_printf("%s/memory.current", cgroups->cgroup_path);
+	char *current = file_read_new(current_path, 32);
+	uint64_t usage = current ? strtoull(current, NULL, 10) : 0;
+	mem_free0(current);
+	mem_free0(current_path);
+
+	uint64_t bytes = usage / 100 * percent;
+	if (bytes < CGROUPS_RECLAIM_MIN_BYTES)
+		return 0;
+
+	int ret = 0;
+	char *reclaim_path = mem_printf("%s/memory.reclaim", cgroups->cgroup_path);
+	int fd = open(reclaim_path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		TRACE_ERRNO("Proactive reclaim not supported (%s)", reclaim_path);
+		ret = -1;
+		goto out;
+	}
+
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "%" PRIu64, bytes);
+	if (write(fd, buf, len) < 0) {
+		// EAGAIN: the kernel could not reclaim as much as requested
+		if (errno != EAGAIN)
+			WARN_ERRNO("Could not reclaim memory of container %s",
+				   container_get_description(cgroups->container));
+		cgroups->reclaim_backoff = cgroups->reclaim_backoff ?
+						   MIN(2 * cgroups->reclaim_backoff,
+						       CGROUPS_RECLAIM_MAX_BACKOFF) :
+						   1;
+		cgroups->reclaim_skip = cgroups->reclaim_backoff;
+	} else {
+		DEBUG("Reclaimed %" PRIu64 " KiB of container %s", bytes / 1024,
+		      container_get_description(cgroups->container));
+		cgroups->reclaim_backoff = 0;
+	}
+	close(fd);
+out:
+	mem_free0(reclaim_path);
+	return ret;
+}
+
 static int
 c_cgroups_set_cpu_exclusive(const c_cgroups_t *cgroups, char *path)
 {
@@ -741,6 +1310,16 @@ c_cgroups_set_cpu_exclusive(const c_cgroups_t *cgroups, char *path)
 
 	IF_NULL_RETVAL(path, -1);
 
+	/* cgroup v2 provides exclusive cpus through a cpuset partition, which is
+	 * best effort as the kernel rejects it for overlapping sibling cpusets */
+	if (cgroups->v2) {
+		char *partition_path = mem_printf("%s/cpuset.cpus.partition", path);
+		if (file_printf(partition_path, "root") == -1)
+			WARN("Could not make cpuset of %s an exclusive partition", path);
+		mem_free0(partition_path);
+		return 0;
+	}
+
 	int ret = -1;
 	char *cpuset_cpu_exclusive_path = mem_printf("%s/cpuset.cpu_exclusive", path);
 	char *cpuset_cpu_exclusive = file_read_new(cpuset_cpu_exclusive_path, 2);
@@ -771,166 +1350,115 @@ out:
 	return ret;
 }
 
-/**
- * This functions gets the allowed cpus for the container from its associated container
- * object and configures the cgroups cpuset subsystem to restrict access to that cpus.
- */
 static int
-c_cgroups_set_cpus_allowed(const c_cgroups_t *cgroups, char *path)
+c_cgroups_write_cpuset(const char *path, const char *cpus, const char *mems)
 {
-	ASSERT(cgroups);
+	int ret = -1;
+	char *cpuset_cpus_path = mem_printf("%s/cpuset.cpus", path);
+	char *cpuset_mems_path = mem_printf("%s/cpuset.mems", path);
 
-	if (NULL == container_get_cpus_allowed(cgroups->container)) {
-		INFO("Setting no CPU restrictions for container %s",
-		     container_get_description(cgroups->container));
-		return 0;
-	}
-
-	IF_NULL_RETVAL(path, -1);
-
-	int ret = -1;
-	char *cpuset_cpus_path = mem_printf("%s/cpuset.cpus", path);
-	char *cpuset_mems_path = mem_printf("%s/cpuset.mems", path);
-
-	if (!file_exists(cpuset_cpus_path)) {
-		ERROR("%s file not found (cgroups or cgroups cpuset subsystem not mounted?)",
+	if (!file_exists(cpuset_cpus_path) || !file_exists(cpuset_mems_path)) {
+		DEBUG("%s file not found (cgroups or cgroups cpuset subsystem not mounted?)",
 		      cpuset_cpus_path);
 		goto out;
 	}
-	if (file_printf(cpuset_cpus_path, "%s", container_get_cpus_allowed(cgroups->container)) ==
-	    -1) {
-		ERROR("Could not write to cgroups cpuset file in %s", cpuset_cpus_path);
-		goto out;
-	}
-
-	if (!file_exists(cpuset_mems_path)) {
-		ERROR("%s file not found (cgroups or cgroups cpuset subsystem not mounted?)",
-		      cpuset_mems_path);
-		goto out;
-	}
-	if (file_printf(cpuset_mems_path, "0") == -1) {
-		ERROR("Could not write to cgroups cpuset file in %s", cpuset_mems_path);
-		goto out;
-	}
-
-	IF_TRUE_GOTO(c_cgroups_set_cpu_exclusive(cgroups, path) == -1, out);
-
-	INFO("Successfully set CPU restriction of container %s to cores %s",
-	     container_get_description(cgroups->container),
-	     container_get_cpus_allowed(cgroups->container));
-
+	// failures are logged by the callers, as they are expected while rebalancing
+	IF_TRUE_GOTO_TRACE(file_printf(cpuset_cpus_path, "%s", cpus) == -1, out);
+	IF_TRUE_GOTO_TRACE(file_printf(cpuset_mems_path, "%s", mems) == -1, out);
 	ret = 0;
 out:
 	mem_free0(cpuset_cpus_path);
 	mem_free0(cpuset_mems_path);
-
 	return ret;
 }
 
-#ifndef _BSD_SOURCE
-#define _BSD_SOURCE /* See feature_test_macros(7) */
-#endif
-
-static void
-c_cgroups_devices_watch_dev_dir_cb(const char *path, uint32_t mask, UNUSED event_inotify_t *inotify,
-				   void *data)
+/**
+ * This functions gets the cpus for the container from the placement, or the allowed
+ * cpus from its associated container object if no topology is available, and
+ * configures the cgroups cpuset subsystem to restrict access to that cpus.
+ */
+static int
+c_cgroups_set_cpus_allowed(const c_cgroups_t *cgroups, char *path)
 {
-	c_cgroups_t *cgroups = data;
-
-	char *type;
-
-	if (!path)
-		return;
+	ASSERT(cgroups);
 
-	//char *path = mem_printf("/proc/%d/root/dev/%s", container_get_pid(cgroups->container), p);
-
-	if (mask & IN_CREATE) {
-		/* we are only interested in IN_CREATE if a directory was created */
-		if (file_is_dir(path)) {
-			/* If a directory was created in the dev directory register the same callback for it */
-			event_inotify_t *inotify_dev =
-				event_inotify_new(path, IN_OPEN | IN_CREATE,
-						  &c_cgroups_devices_watch_dev_dir_cb, cgroups);
-			event_add_inotify(inotify_dev);
-			DEBUG("Registered inotify callback for %s", path);
+	char *cpus = NULL;
+	char *mems = NULL;
+	bool exclusive = false;
+	if (placement_get_cpuset(cgroups->container, &cpus, &mems, &exclusive) < 0) {
+		if (NULL == container_get_cpus_allowed(cgroups->container)) {
+			INFO("Setting no CPU restrictions for container %s",
+			     container_get_description(cgroups->container));
+			return 0;
 		}
-		return;
+		cpus = mem_strdup(container_get_cpus_allowed(cgroups->container));
+		mems = mem_strdup("0");
+		exclusive = true;
 	}
 
-	struct stat dev_stat;
-	memset(&dev_stat, 0, sizeof(dev_stat));
-
-	if (stat(path, &dev_stat) == -1) {
-		WARN_ERRNO("Could not stat %s", path);
-		return;
-	}
-
-	if (S_ISBLK(dev_stat.st_mode)) {
-		type = "b";
-	} else if (S_ISCHR(dev_stat.st_mode)) {
-		type = "c";
-	} else {
-		return;
-	}
-
-	unsigned int maj = major(dev_stat.st_rdev);
-	unsigned int min = minor(dev_stat.st_rdev);
-
-	/* print in the container like that:
-	 * in one shell: $ cml-logcat -A | grep "dev in container a2" > devs.txt
-	 * in another shell: $ cat devs.txt | sort -k 13 -n -k 14 -n -u
-	 */
-	DEBUG("dev in container %s: %s %u %u %s", container_get_description(cgroups->container),
-	      type, maj, min, basename(path));
-
-	//if (mask & IN_CREATE) {
-	//	DEBUG("dev in container %s: %s (create)", container_get_description(cgroups->container), path);
-	//} else if (mask & IN_OPEN) {
-	//	DEBUG("dev in container %s: %s (open)", container_get_description(cgroups->container), path);
-	//} else if (mask & IN_CLOSE) {
-	//	DEBUG("dev in container %s: %s (close)", container_get_description(cgroups->container), path);
-	//}
-}
-
-static int
-c_cgroups_devices_dev_dir_foreach_cb(const char *path, const char *name, void *data)
-{
-	char *full_path = mem_printf("%s/%s", path, name);
-
-	if (!file_is_dir(full_path))
+	int ret = -1;
+	IF_NULL_GOTO(path, out);
+
+	if (c_cgroups_write_cpuset(path, cpus, mems) == -1) {
+		// containers sharing cpus may run without a cpuset, e.g. if the controller is missing
+		if (!exclusive) {
+			WARN_ERRNO("Could not place container %s on shared cpus %s",
+				   container_get_description(cgroups->container), cpus);
+			ret = 0;
+			goto out;
+		}
+		ERROR_ERRNO("Could not restrict cpuset %s to cpus %s, memory nodes %s", path, cpus,
+			    mems);
 		goto out;
+	}
 
-	c_cgroups_t *cgroups = data;
-
-	event_inotify_t *inotify_dev = event_inotify_new(
-		full_path, IN_OPEN | IN_CREATE, &c_cgroups_devices_watch_dev_dir_cb, cgroups);
-	event_add_inotify(inotify_dev);
+	if (exclusive)
+		IF_TRUE_GOTO(c_cgroups_set_cpu_exclusive(cgroups, path) == -1, out);
 
-	if (dir_foreach(full_path, &c_cgroups_devices_dev_dir_foreach_cb, cgroups) < 0) {
-		WARN("Could not open %s for registering device watcher", full_path);
-	}
+	INFO("Successfully set CPU restriction of container %s to cores %s, memory nodes %s",
+	     container_get_description(cgroups->container), cpus, mems);
 
+	ret = 0;
 out:
-	mem_free0(full_path);
-	return 0;
+	mem_free0(cpus);
+	mem_free0(mems);
+
+	return ret;
 }
 
-UNUSED static void
-c_cgroups_devices_watch_dev_dir(c_cgroups_t *cgroups)
+int
+c_cgroups_set_cpuset(c_cgroups_t *cgroups, const char *cpus, const char *mems)
 {
 	ASSERT(cgroups);
 
-	char *dev_path = mem_printf("/proc/%d/root/dev", container_get_pid(cgroups->container));
+	// the child cgroup follows the effective cpus of its parent on cgroup v2
+	if (cgroups->v2)
+		return c_cgroups_write_cpuset(cgroups->cgroup_path, cpus, mems);
 
-	event_inotify_t *inotify_dev = event_inotify_new(
-		dev_path, IN_OPEN | IN_CREATE, &c_cgroups_devices_watch_dev_dir_cb, cgroups);
-	event_add_inotify(inotify_dev);
+	char *path = mem_printf("%s/cpuset/%s", CGROUPS_FOLDER,
+				uuid_string(container_get_uuid(cgroups->container)));
+	char *child_path = mem_printf("%s/child", path);
 
-	if (dir_foreach(dev_path, &c_cgroups_devices_dev_dir_foreach_cb, cgroups) < 0) {
-		WARN("Could not open %s for registering device watcher", dev_path);
+	/* a cgroup v1 cpuset must stay a subset of its parent, thus the child is
+	 * narrowed before its parent and widened after it */
+	int ret;
+	if (!file_is_dir(child_path)) {
+		ret = c_cgroups_write_cpuset(path, cpus, mems);
+	} else if (c_cgroups_write_cpuset(child_path, cpus, mems) == 0) {
+		ret = c_cgroups_write_cpuset(path, cpus, mems);
+	} else {
+		ret = c_cgroups_write_cpuset(path, cpus, mems);
+		if (ret == 0)
+			ret = c_cgroups_write_cpuset(child_path, cpus, mems);
 	}
 
-	mem_free0(dev_path);
+	if (ret < 0)
+		ERROR_ERRNO("Could not move container %s to cpus %s, memory nodes %s",
+			    container_get_description(cgroups->container), cpus, mems);
+
+	mem_free0(path);
+	mem_free0(child_path);
+	return ret;
 }
 
 int
@@ -1088,6 +1616,311 @@ c_cgroups_devices_is_dev_allowed(c_cgroups_t *cgroups, int major, int minor)
 	return false;
 }
 
+/*******************/
+/* Resource usage sampling */
+
+void
+c_cgroups_set_stats_interval(unsigned int interval_ms)
+{
+	c_cgroups_stats_interval = interval_ms;
+}
+
+/* returns the directory of the legacy hierarchy the controller is mounted in */
+static char *
+c_cgroups_v1_subsys_path_new(const c_cgroups_t *cgroups, const char *controller)
+{
+	for (const list_t *l = cgroups->active_cgroups; l; l = l->next) {
+		const char *subsys = l->data;
+		size_t len = strlen(controller);
+		for (const char *c = subsys; (c = strstr(c, controller)); c += len) {
+			if ((c == subsys || c[-1] == ',') && (c[len] == '\0' || c[len] == ','))
+				return mem_printf(
+					"%s/%s/%s", CGROUPS_FOLDER, subsys,
+					uuid_string(container_get_uuid(cgroups->container)));
+		}
+	}
+	return NULL;
+}
+
+static int
+c_cgroups_stats_open(const c_cgroups_t *cgroups, enum c_cgroups_stats_file file)
+{
+	static const char *v1_files[][2] = {
+		[CGROUPS_STATS_FILE_CPU] = { "cpuacct", "cpuacct.usage" },
+		[CGROUPS_STATS_FILE_MEM] = { "memory", "memory.usage_in_bytes" },
+		[CGROUPS_STATS_FILE_IO] = { "blkio", "blkio.throttle.io_service_bytes" },
+		[CGROUPS_STATS_FILE_PIDS] = { "pids", "pids.current" },
+		[CGROUPS_STATS_FILE_PROCS] = { "pids", "cgroup.procs" },
+		[CGROUPS_STATS_FILE_MEMSTAT] = { "memory", "memory.stat" },
+	};
+	static const char *v2_files[] = {
+		[CGROUPS_STATS_FILE_CPU] = "cpu.stat",
+		[CGROUPS_STATS_FILE_MEM] = "memory.current",
+		[CGROUPS_STATS_FILE_IO] = "io.stat",
+		[CGROUPS_STATS_FILE_PIDS] = "pids.current",
+		[CGROUPS_STATS_FILE_PROCS] = "cgroup.procs",
+		[CGROUPS_STATS_FILE_MEMSTAT] = "memory.stat",
+	};
+
+	char *path = NULL;
+	if (cgroups->v2) {
+		path = mem_printf("%s/%s", cgroups->cgroup_path, v2_files[file]);
+	} else {
+		char *subsys_path = c_cgroups_v1_subsys_path_new(cgroups, v1_files[file][0]);
+		IF_NULL_RETVAL_TRACE(subsys_path, -1);
+		path = mem_printf("%s/%s", subsys_path, v1_files[file][1]);
+		mem_free0(subsys_path);
+	}
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		TRACE_ERRNO("Not sampling %s", path);
+	mem_free0(path);
+	return fd;
+}
+
+/* reads the whole file from the start, returns false on error */
+static bool
+c_cgroups_stats_read(int fd, char *buf, size_t size)
+{
+	IF_TRUE_RETVAL(fd < 0, false);
+
+	ssize_t len = pread(fd, buf, size - 1, 0);
+	IF_TRUE_RETVAL(len < 0, false);
+
+	buf[len] = '\0';
+	return true;
+}
+
+/* returns the value following key in a flat keyed file (e.g. "usage_usec 42") */
+static bool
+c_cgroups_stats_parse_key(const char *buf, const char *key, uint64_t *value)
+{
+	size_t key_len = strlen(key);
+	for (const char *line = buf; line && *line; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			line++;
+		if (!strncmp(line, key, key_len) && line[key_len] == ' ') {
+			*value = strtoull(line + key_len + 1, NULL, 10);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Sums up the bytes over all devices of blkio.throttle.io_service_bytes
+ * ("8:0 Read 42") or io.stat ("8:0 rbytes=42 wbytes=23 ...").
+ */
+static void
+c_cgroups_stats_parse_io(const c_cgroups_t *cgroups, char *buf, uint64_t *rbytes, uint64_t *wbytes)
+{
+	*rbytes = *wbytes = 0;
+
+	char *saveptr = NULL;
+	for (char *line = strtok_r(buf, "\n", &saveptr); line;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		char *r, *w;
+		if (cgroups->v2) {
+			if ((r = strstr(line, " rbytes=")))
+				*rbytes += strtoull(r + strlen(" rbytes="), NULL, 10);
+			if ((w = strstr(line, " wbytes=")))
+				*wbytes += strtoull(w + strlen(" wbytes="), NULL, 10);
+		} else {
+			if ((r = strstr(line, " Read ")))
+				*rbytes += strtoull(r + strlen(" Read "), NULL, 10);
+			else if ((w = strstr(line, " Write ")))
+				*wbytes += strtoull(w + strlen(" Write "), NULL, 10);
+		}
+	}
+}
+
+/*
+ * Sums up the pages merged by KSM over all tasks listed in cgroup.procs,
+ * returns false if the kernel does not provide per process KSM stats.
+ */
+static bool
+c_cgroups_stats_ksm(const c_cgroups_t *cgroups, uint64_t *merged)
+{
+	static char buf[64 * 1024];
+	static long page_size = 0;
+	static int supported = -1;
+
+	if (supported < 0) {
+		supported = ksm_get_merging_pages(getpid()) >= 0;
+		page_size = sysconf(_SC_PAGESIZE);
+	}
+	if (!supported ||
+	    !c_cgroups_stats_read(cgroups->stats_fd[CGROUPS_STATS_FILE_PROCS], buf, sizeof(buf)))
+		return false;
+
+	bool valid = false;
+	*merged = 0;
+	for (char *line = buf; *line;) {
+		char *end = NULL;
+		long pages = ksm_get_merging_pages(strtol(line, &end, 10));
+		if (end == line)
+			break;
+		if (pages >= 0) {
+			*merged += (uint64_t)pages * page_size;
+			valid = true;
+		}
+		line = *end ? end + 1 : end;
+	}
+	return valid;
+}
+
+#ifdef C_CGROUPS_DEVICES_ANALYSIS
+/*
+ * Logs the devices held open by the tasks of the container, one line per device:
+ * in one shell: $ cml-logcat -A | grep "dev in container a2" > devs.txt
+ * in another shell: $ cat devs.txt | sort -k 13 -n -k 14 -n -u
+ */
+static void
+c_cgroups_devices_log_used(const c_cgroups_t *cgroups)
+{
+	static char buf[64 * 1024];
+	IF_FALSE_RETURN(
+		c_cgroups_stats_read(cgroups->stats_fd[CGROUPS_STATS_FILE_PROCS], buf, sizeof(buf)));
+
+	for (char *line = buf; *line;) {
+		char *end = NULL;
+		long pid = strtol(line, &end, 10);
+		if (end == line)
+			break;
+		line = *end ? end + 1 : end;
+
+		char *fd_dir = mem_printf("/proc/%ld/fd", pid);
+		DIR *dir = opendir(fd_dir);
+		for (struct dirent *e = dir ? readdir(dir) : NULL; e; e = readdir(dir)) {
+			struct stat dev_stat;
+			if (fstatat(dirfd(dir), e->d_name, &dev_stat, 0) < 0 ||
+			    !(S_ISBLK(dev_stat.st_mode) || S_ISCHR(dev_stat.st_mode)))
+				continue;
+			DEBUG("dev in container %s: %s %u %u (pid %ld)",
+			      container_get_description(cgroups->container),
+			      S_ISBLK(dev_stat.st_mode) ? "b" : "c", major(dev_stat.st_rdev),
+			      minor(dev_stat.st_rdev), pid);
+		}
+		if (dir)
+			closedir(dir);
+		mem_free0(fd_dir);
+	}
+}
+#endif
+
+static void
+c_cgroups_stats_sample_cb(UNUSED event_timer_t *timer, void *data)
+{
+	c_cgroups_t *cgroups = data;
+	ASSERT(cgroups);
+
+	char buf[4096];
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	size_t idx = (cgroups->stats_first + cgroups->stats_count) % CGROUPS_STATS_RING_SIZE;
+	if (cgroups->stats_count == CGROUPS_STATS_RING_SIZE)
+		cgroups->stats_first = (cgroups->stats_first + 1) % CGROUPS_STATS_RING_SIZE;
+	else
+		cgroups->stats_count++;
+
+	c_cgroups_stats_sample_t *sample = &cgroups->stats_ring[idx];
+	memset(sample, 0, sizeof(*sample));
+	sample->time = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	if (c_cgroups_stats_read(cgroups->stats_fd[CGROUPS_STATS_FILE_CPU], buf, sizeof(buf))) {
+		if (!cgroups->v2) {
+			sample->cpu_usage_ns = strtoull(buf, NULL, 10);
+			sample->valid |= C_CGROUPS_STATS_CPU;
+		} else if (c_cgroups_stats_parse_key(buf, "usage_usec", &sample->cpu_usage_ns)) {
+			sample->cpu_usage_ns *= 1000;
+			sample->valid |= C_CGROUPS_STATS_CPU;
+		}
+	}
+	if (c_cgroups_stats_read(cgroups->stats_fd[CGROUPS_STATS_FILE_MEM], buf, sizeof(buf))) {
+		sample->mem_usage = strtoull(buf, NULL, 10);
+		sample->valid |= C_CGROUPS_STATS_MEM;
+	}
+	if (c_cgroups_stats_read(cgroups->stats_fd[CGROUPS_STATS_FILE_IO], buf, sizeof(buf))) {
+		c_cgroups_stats_parse_io(cgroups, buf, &sample->io_read_bytes,
+					 &sample->io_write_bytes);
+		sample->valid |= C_CGROUPS_STATS_IO;
+	}
+	if (c_cgroups_stats_read(cgroups->stats_fd[CGROUPS_STATS_FILE_PIDS], buf, sizeof(buf))) {
+		sample->pids = strtoull(buf, NULL, 10);
+		sample->valid |= C_CGROUPS_STATS_PIDS;
+	}
+	if (c_cgroups_stats_ksm(cgroups, &sample->ksm_merged))
+		sample->valid |= C_CGROUPS_STATS_KSM;
+	if (c_cgroups_stats_read(cgroups->stats_fd[CGROUPS_STATS_FILE_MEMSTAT], buf, sizeof(buf)) &&
+	    c_cgroups_stats_parse_key(buf, cgroups->v2 ? "file" : "total_cache", &sample->mem_cache))
+		sample->valid |= C_CGROUPS_STATS_MEM_CACHE;
+
+	procfs_view_update(cgroups->procfs_view, sample);
+
+#ifdef C_CGROUPS_DEVICES_ANALYSIS
+	c_cgroups_devices_log_used(cgroups);
+#endif
+}
+
+static void
+c_cgroups_stats_stop(c_cgroups_t *cgroups)
+{
+	if (cgroups->stats_timer) {
+		event_remove_timer(cgroups->stats_timer);
+		event_timer_free(cgroups->stats_timer);
+		cgroups->stats_timer = NULL;
+	}
+	for (int i = 0; i < CGROUPS_STATS_FILE_COUNT; i++) {
+		if (cgroups->stats_fd[i] >= 0)
+			close(cgroups->stats_fd[i]);
+		cgroups->stats_fd[i] = -1;
+	}
+}
+
+static void
+c_cgroups_stats_start(c_cgroups_t *cgroups)
+{
+	if (c_cgroups_stats_interval == 0) {
+		/* without samples the proc views reflect at least the cpus of the container */
+		procfs_view_update(cgroups->procfs_view, NULL);
+		return;
+	}
+
+	c_cgroups_stats_stop(cgroups);
+	cgroups->stats_first = 0;
+	cgroups->stats_count = 0;
+
+	for (int i = 0; i < CGROUPS_STATS_FILE_COUNT; i++)
+		cgroups->stats_fd[i] = c_cgroups_stats_open(cgroups, i);
+
+	/* take the first sample right away */
+	c_cgroups_stats_sample_cb(NULL, cgroups);
+
+	cgroups->stats_timer = event_timer_new(c_cgroups_stats_interval, EVENT_TIMER_REPEAT_FOREVER,
+					       &c_cgroups_stats_sample_cb, cgroups);
+	event_add_timer(cgroups->stats_timer);
+}
+
+size_t
+c_cgroups_get_stats(const c_cgroups_t *cgroups, uint64_t since, c_cgroups_stats_sample_t **samples)
+{
+	ASSERT(cgroups);
+	ASSERT(samples);
+
+	*samples = mem_new0(c_cgroups_stats_sample_t, cgroups->stats_count);
+
+	size_t n = 0;
+	for (size_t i = 0; i < cgroups->stats_count; i++) {
+		const c_cgroups_stats_sample_t *sample =
+			&cgroups->stats_ring[(cgroups->stats_first + i) % CGROUPS_STATS_RING_SIZE];
+		if (sample->time > since)
+			(*samples)[n++] = *sample;
+	}
+	return n;
+}
+
 /*******************/
 /* Hooks */
 
@@ -1095,7 +1928,77 @@ int
 c_cgroups_start_pre_clone(c_cgroups_t *cgroups)
 {
 	ASSERT(cgroups);
-	return mount_cgroups(cgroups->active_cgroups);
+	IF_TRUE_RETVAL(mount_cgroups(cgroups->active_cgroups) < 0, -1);
+
+	// the hierarchy may not have been mounted before
+	cgroups->v2 = cgroups_v2_enabled();
+
+	/* the child bind mounts the views over its /proc, see c_vol */
+	procfs_view_free(cgroups->procfs_view);
+	cgroups->procfs_view = procfs_view_new(cgroups->container);
+	return 0;
+}
+
+/*
+ * Watches the freezer state and, on cgroup v2, the pressure of the container's cgroup.
+ */
+static void
+c_cgroups_monitors_start(c_cgroups_t *cgroups)
+{
+	/* the kernel notifies modifications of cgroup.events when "frozen" changes */
+	char *freezer_state_path =
+		cgroups->v2 ? mem_printf("%s/cgroup.events", cgroups->cgroup_path) :
+			      mem_printf("%s/freezer/%s/freezer.state", CGROUPS_FOLDER,
+					 uuid_string(container_get_uuid(cgroups->container)));
+	cgroups->inotify_freezer_state = event_inotify_new(freezer_state_path, IN_MODIFY,
+							   &c_cgroups_freezer_state_cb, cgroups);
+	event_add_inotify(cgroups->inotify_freezer_state);
+	mem_free0(freezer_state_path);
+
+	IF_FALSE_RETURN(cgroups->v2);
+
+	/* notify control clients of resource stalls of the container */
+	static const char *pressure_files[PSI_RESOURCE_COUNT] = {
+		[PSI_CPU] = "cpu.pressure",
+		[PSI_MEMORY] = "memory.pressure",
+		[PSI_IO] = "io.pressure",
+	};
+	for (int i = 0; i < PSI_RESOURCE_COUNT; i++) {
+		char *pressure_path = mem_printf("%s/%s", cgroups->cgroup_path, pressure_files[i]);
+		cgroups->psi_monitors[i] = psi_monitor_new(pressure_path, i, cgroups->container);
+		mem_free0(pressure_path);
+	}
+}
+
+static int
+c_cgroups_v2_start_post_clone(c_cgroups_t *cgroups)
+{
+	INFO("Creating cgroup %s", cgroups->cgroup_path);
+	if (mkdir(cgroups->cgroup_path, 0755) && errno != EEXIST) {
+		ERROR_ERRNO("Could not create cgroup for container %s",
+			    container_get_description(cgroups->container));
+		return -1;
+	}
+
+	/* the processes live in the child cgroup, which inherits the limits below */
+	if (cgroups_v2_enable_controllers(cgroups->cgroup_path) < 0)
+		WARN("Not all cgroup controllers enabled for container %s",
+		     container_get_description(cgroups->container));
+
+	if (c_cgroups_set_cpus_allowed(cgroups, cgroups->cgroup_path) < 0) {
+		ERROR("Could not configure cgroup to restrict cpus of container %s",
+		      container_get_description(cgroups->container));
+		return -1;
+	}
+
+	if (c_cgroups_set_ram_limit(cgroups) < 0) {
+		ERROR("Could not configure cgroup maximum ram for container %s",
+		      container_get_description(cgroups->container));
+		return -1;
+	}
+
+	c_cgroups_monitors_start(cgroups);
+	return 0;
 }
 
 int
@@ -1103,6 +2006,9 @@ c_cgroups_start_post_clone(c_cgroups_t *cgroups)
 {
 	ASSERT(cgroups);
 
+	if (cgroups->v2)
+		return c_cgroups_v2_start_post_clone(cgroups);
+
 	// temporarily add systemd to list
 	cgroups->active_cgroups = list_prepend(cgroups->active_cgroups, "systemd");
 
@@ -1140,14 +2046,7 @@ c_cgroups_start_post_clone(c_cgroups_t *cgroups)
 		goto error;
 	}
 
-	/* initialize freezer subsystem */
-	char *freezer_state_path = mem_printf("%s/freezer/%s/freezer.state", CGROUPS_FOLDER,
-					      uuid_string(container_get_uuid(cgroups->container)));
-	cgroups->inotify_freezer_state = event_inotify_new(freezer_state_path, IN_MODIFY,
-							   &c_cgroups_freezer_state_cb, cgroups);
-	event_add_inotify(cgroups->inotify_freezer_state);
-	mem_free0(freezer_state_path);
-
+	c_cgroups_monitors_start(cgroups);
 	return 0;
 error:
 	// remove temporarily added head
@@ -1155,15 +2054,309 @@ error:
 	return -1;
 }
 
+/*
+ * Returns the disk holding path, i.e. the whole disk of a partition, as the latency and
+ * weight based io controllers only act on the devices which queue requests. Returns 0
+ * if path is not on a block device.
+ */
+static dev_t
+c_cgroups_io_disk_of(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st) < 0 || major(st.st_dev) == 0)
+		return 0;
+
+	dev_t dev = st.st_dev;
+	char *sys = mem_printf("/sys/dev/block/%u:%u", major(dev), minor(dev));
+	char *partition = mem_printf("%s/partition", sys);
+	if (file_exists(partition)) {
+		char *parent = mem_printf("%s/../dev", sys);
+		char *buf = file_read_new(parent, 32);
+		unsigned int maj, min;
+		if (buf && sscanf(buf, "%u:%u", &maj, &min) == 2)
+			dev = makedev(maj, min);
+		mem_free0(buf);
+		mem_free0(parent);
+	}
+	mem_free0(partition);
+	mem_free0(sys);
+	return dev;
+}
+
+/*
+ * Collects the dm devices of the container's volumes, which see the io of the container
+ * before it is encrypted or passed to the loop devices, and the disk holding its images.
+ *
+ * @return the number of devices in devs
+ */
+static size_t
+c_cgroups_io_devs(const c_cgroups_t *cgroups, dev_t disk, dev_t *devs, size_t max)
+{
+	const mount_t *mnt = container_get_mount(cgroups->container);
+	const char *uuid = uuid_string(container_get_uuid(cgroups->container));
+	size_t n = 0;
+
+	for (size_t i = 0; mnt && i < mount_get_count(mnt) && n < max; i++) {
+		char *label =
+			mem_printf("%s-%s", uuid, mount_entry_get_img(mount_get_entry(mnt, i)));
+		char *dev_path = cryptfs_get_device_path_new(label);
+		struct stat st;
+		if (dev_path && !stat(dev_path, &st) && S_ISBLK(st.st_mode))
+			devs[n++] = st.st_rdev;
+		mem_free0(dev_path);
+		mem_free0(label);
+	}
+	if (disk && n < max)
+		devs[n++] = disk;
+	return n;
+}
+
+static char *
+c_cgroups_io_limit_new(uint64_t limit)
+{
+	return limit ? mem_printf("%" PRIu64, limit) : mem_strdup("max");
+}
+
+static int
+c_cgroups_v2_set_io_limits(c_cgroups_t *cgroups, const container_io_limits_t *io,
+			   const dev_t *devs, size_t n, dev_t disk)
+{
+	int ret = 0;
+
+	if (io->weight) {
+		char *path = mem_printf("%s/io.weight", cgroups->cgroup_path);
+		if (file_printf(path, "default %u", io->weight) < 0) {
+			WARN("Could not set io weight in %s (no io controller?)", path);
+			ret = -1;
+		}
+		mem_free0(path);
+	}
+
+	if (io->read_bps || io->write_bps || io->read_iops || io->write_iops) {
+		char *path = mem_printf("%s/io.max", cgroups->cgroup_path);
+		char *rbps = c_cgroups_io_limit_new(io->read_bps);
+		char *wbps = c_cgroups_io_limit_new(io->write_bps);
+		char *riops = c_cgroups_io_limit_new(io->read_iops);
+		char *wiops = c_cgroups_io_limit_new(io->write_iops);
+		// each write configures one device
+		for (size_t i = 0; i < n; i++) {
+			if (file_printf(path, "%u:%u rbps=%s wbps=%s riops=%s wiops=%s",
+					major(devs[i]), minor(devs[i]), rbps, wbps, riops,
+					wiops) < 0) {
+				WARN("Could not limit io of device %u:%u in %s", major(devs[i]),
+				     minor(devs[i]), path);
+				ret = -1;
+			}
+		}
+		mem_free0(wiops);
+		mem_free0(riops);
+		mem_free0(wbps);
+		mem_free0(rbps);
+		mem_free0(path);
+	}
+
+	if (io->latency_target && disk) {
+		char *path = mem_printf("%s/io.latency", cgroups->cgroup_path);
+		if (file_printf(path, "%u:%u target=%u", major(disk), minor(disk),
+				io->latency_target) < 0) {
+			WARN("Could not set io latency target in %s (no blk-iolatency?)", path);
+			ret = -1;
+		}
+		mem_free0(path);
+	}
+	return ret;
+}
+
+static int
+c_cgroups_v1_set_io_limits(c_cgroups_t *cgroups, const container_io_limits_t *io,
+			   const dev_t *devs, size_t n)
+{
+	int ret = 0;
+	char *blkio = mem_printf("%s/blkio/%s", CGROUPS_FOLDER,
+				 uuid_string(container_get_uuid(cgroups->container)));
+
+	if (io->weight) {
+		unsigned int weight = MAX(CGROUPS_V1_IO_WEIGHT_MIN,
+					  MIN(CGROUPS_V1_IO_WEIGHT_MAX,
+					      io->weight * CGROUPS_V1_IO_WEIGHT_FACTOR));
+		// CFQ is gone since 5.0, BFQ provides the weight in its own file
+		char *path = mem_printf("%s/blkio.weight", blkio);
+		if (!file_exists(path)) {
+			mem_free0(path);
+			path = mem_printf("%s/blkio.bfq.weight", blkio);
+		}
+		if (file_printf(path, "%u", weight) < 0) {
+			WARN("Could not set io weight in %s", path);
+			ret = -1;
+		}
+		mem_free0(path);
+	}
+
+	const struct {
+		const char *file;
+		uint64_t limit;
+	} throttles[] = {
+		{ "blkio.throttle.read_bps_device", io->read_bps },
+		{ "blkio.throttle.write_bps_device", io->write_bps },
+		{ "blkio.throttle.read_iops_device", io->read_iops },
+		{ "blkio.throttle.write_iops_device", io->write_iops },
+	};
+	for (size_t t = 0; t < sizeof(throttles) / sizeof(throttles[0]); t++) {
+		if (!throttles[t].limit)
+			continue;
+		char *path = mem_printf("%s/%s", blkio, throttles[t].file);
+		for (size_t i = 0; i < n; i++) {
+			if (file_printf(path, "%u:%u %" PRIu64, major(devs[i]), minor(devs[i]),
+					throttles[t].limit) < 0) {
+				WARN("Could not limit io of device %u:%u in %s", major(devs[i]),
+				     minor(devs[i]), path);
+				ret = -1;
+			}
+		}
+		mem_free0(path);
+	}
+
+	if (io->latency_target)
+		WARN("io latency targets require cgroup v2, ignored for container %s",
+		     container_get_description(cgroups->container));
+
+	mem_free0(blkio);
+	return ret;
+}
+
+/*
+ * Applies the block io limits of the container. The dm devices of its volumes only
+ * exist after c_vol set them up before the clone.
+ */
+static int
+c_cgroups_set_io_limits(c_cgroups_t *cgroups)
+{
+	const container_io_limits_t *io = container_get_io_limits(cgroups->container);
+	if (!io->weight && !io->read_bps && !io->write_bps && !io->read_iops && !io->write_iops &&
+	    !io->latency_target)
+		return 0;
+
+	const mount_t *mnt = container_get_mount(cgroups->container);
+	size_t max = (mnt ? mount_get_count(mnt) : 0) + 1;
+	dev_t *devs = mem_new0(dev_t, max);
+	dev_t disk = c_cgroups_io_disk_of(container_get_images_dir(cgroups->container));
+	size_t n = c_cgroups_io_devs(cgroups, disk, devs, max);
+
+	int ret = cgroups->v2 ? c_cgroups_v2_set_io_limits(cgroups, io, devs, n, disk) :
+				c_cgroups_v1_set_io_limits(cgroups, io, devs, n);
+	if (!ret)
+		INFO("Set io limits of container %s on %zu devices",
+		     container_get_description(cgroups->container), n);
+
+	mem_free0(devs);
+	return ret;
+}
+
+static int
+c_cgroups_v2_start_pre_exec(c_cgroups_t *cgroups)
+{
+	int ret = -1;
+	char *child_path = mem_printf("%s/child", cgroups->cgroup_path);
+	char *child_procs = mem_printf("%s/cgroup.procs", child_path);
+
+	INFO("Creating cgroup %s", child_path);
+	if (mkdir(child_path, 0755) && errno != EEXIST) {
+		ERROR_ERRNO("Could not create child cgroup for container %s",
+			    container_get_description(cgroups->container));
+		goto out;
+	}
+
+	/* delegate the child cgroup to the container */
+	if (container_shift_ids(cgroups->container, child_path, false)) {
+		ERROR("Could not shift ids of child cgroup for userns");
+		goto out;
+	}
+
+	/* assign the container to the cgroup */
+	if (file_printf(child_procs, "%d", container_get_pid(cgroups->container)) == -1) {
+		ERROR_ERRNO("Could not add container %s to its cgroup under %s",
+			    container_get_description(cgroups->container), child_path);
+		goto out;
+	}
+
+	ret = 0;
+out:
+	mem_free0(child_procs);
+	mem_free0(child_path);
+	return ret;
+}
+
+/*
+ * Returns the default huge page size in the notation of the hugetlb cgroup files,
+ * e.g. "2MB", or NULL if the kernel has no huge pages.
+ */
+static char *
+c_cgroups_hugepage_size_new(void)
+{
+	char *meminfo = file_read_new("/proc/meminfo", 8192);
+	IF_NULL_RETVAL(meminfo, NULL);
+
+	char *line = strstr(meminfo, "Hugepagesize:");
+	unsigned long kb = 0;
+	if (line)
+		sscanf(line, "Hugepagesize: %lu kB", &kb);
+	mem_free0(meminfo);
+
+	IF_TRUE_RETVAL(kb == 0, NULL);
+	if (kb % (1024 * 1024) == 0)
+		return mem_printf("%luGB", kb / (1024 * 1024));
+	if (kb % 1024 == 0)
+		return mem_printf("%luMB", kb / 1024);
+	return mem_printf("%luKB", kb);
+}
+
+/*
+ * Limits the huge pages the guest memory of a KVM container may use.
+ */
+static int
+c_cgroups_set_hugetlb_limit(c_cgroups_t *cgroups)
+{
+	IF_TRUE_RETVAL(container_get_type(cgroups->container) != CONTAINER_TYPE_KVM, 0);
+
+	uint64_t limit = container_get_kvm_config(cgroups->container)->hugetlb_limit;
+	IF_TRUE_RETVAL(limit == 0, 0);
+
+	int ret = -1;
+	char *path = NULL;
+	char *size = c_cgroups_hugepage_size_new();
+	if (!size) {
+		ERROR("Could not get the huge page size (no huge pages?)");
+		return -1;
+	}
+
+	if (cgroups->v2) {
+		path = mem_printf("%s/hugetlb.%s.max", cgroups->cgroup_path, size);
+	} else {
+		char *hugetlb = c_cgroups_v1_subsys_path_new(cgroups, "hugetlb");
+		if (hugetlb)
+			path = mem_printf("%s/hugetlb.%s.limit_in_bytes", hugetlb, size);
+		mem_free0(hugetlb);
+	}
+
+	if (!path || file_printf(path, "%" PRIu64, limit) < 0) {
+		ERROR("Could not limit huge pages of container %s (no hugetlb controller?)",
+		      container_get_description(cgroups->container));
+		goto out;
+	}
+	INFO("Limited %s huge pages of container %s to %" PRIu64 " bytes", size,
+	     container_get_description(cgroups->container), limit);
+	ret = 0;
+out:
+	mem_free0(path);
+	mem_free0(size);
+	return ret;
+}
+
 int
 c_cgroups_start_pre_exec(c_cgroups_t *cgroups)
 {
 	ASSERT(cgroups);
 
-	/* For analyzation purposes, start watching the devices of the container */
-	//c_cgroups_devices_watch_dev_dir(cgroups);
-	//return 0;
-
 	/* initialize devices subsystem */
 	if (c_cgroups_devices_init(cgroups) < 0) {
 		ERROR_ERRNO("devices init failed!");
@@ -1183,6 +2376,20 @@ c_cgroups_start_pre_exec(c_cgroups_t *cgroups)
 		c_cgroups_devices_usbdev_allow(cgroups, usbdev);
 	}
 
+	// io limits are not essential for the container to run
+	if (c_cgroups_set_io_limits(cgroups) < 0)
+		WARN("Not all io limits applied for container %s",
+		     container_get_description(cgroups->container));
+
+	if (c_cgroups_set_hugetlb_limit(cgroups) < 0)
+		return -1;
+
+	if (cgroups->v2) {
+		IF_TRUE_RETVAL(c_cgroups_v2_start_pre_exec(cgroups) < 0, -1);
+		c_cgroups_stats_start(cgroups);
+		return 0;
+	}
+
 	// temporarily add systemd to list
 	cgroups->active_cgroups = list_prepend(cgroups->active_cgroups, "systemd");
 
@@ -1232,6 +2439,8 @@ c_cgroups_start_pre_exec(c_cgroups_t *cgroups)
 
 	// remove temporarily added head
 	cgroups->active_cgroups = list_unlink(cgroups->active_cgroups, cgroups->active_cgroups);
+
+	c_cgroups_stats_start(cgroups);
 	return 0;
 error:
 	// remove temporarily added head
@@ -1239,11 +2448,98 @@ error:
 	return -1;
 }
 
+/**
+ * Takes over the cgroup of a running container from a previous cmld instance. The
+ * limits are still in place, whereas the placement, device and usb bookkeeping, the
+ * monitors and the proc views only lived in the memory of the previous instance.
+ */
+/**
+ * Reads the cgroup of the running container from its processes' cgroup, which is the one
+ * of a zygote if the container was started from one.
+ */
+static void
+c_cgroups_v2_reattach_cgroup_path(c_cgroups_t *cgroups)
+{
+	char *file = mem_printf("/proc/%d/cgroup", container_get_pid(cgroups->container));
+	char *content = file_read_new(file, 4096);
+	mem_free0(file);
+	IF_NULL_RETURN(content);
+
+	// the processes live in the child cgroup or below
+	char *path = strstr(content, "0::/");
+	char *child = path ? strstr(path, "/child") : NULL;
+	if (child && (child[6] == '/' || child[6] == '\n')) {
+		*child = '\0';
+		char *cgroup_path = mem_printf("%s%s", CGROUPS_FOLDER, path + 3);
+		if (strcmp(cgroup_path, cgroups->cgroup_path))
+			c_cgroups_adopt(cgroups, cgroup_path);
+		mem_free0(cgroup_path);
+	}
+	mem_free0(content);
+}
+
+int
+c_cgroups_reattach(c_cgroups_t *cgroups)
+{
+	ASSERT(cgroups);
+
+	cgroups->v2 = cgroups_v2_enabled();
+	if (cgroups->v2)
+		c_cgroups_v2_reattach_cgroup_path(cgroups);
+
+	char *cpuset_path =
+		cgroups->v2 ? mem_strdup(cgroups->cgroup_path) :
+			      mem_printf("%s/cpuset/%s", CGROUPS_FOLDER,
+					 uuid_string(container_get_uuid(cgroups->container)));
+	int ret = c_cgroups_set_cpus_allowed(cgroups, cpuset_path);
+	mem_free0(cpuset_path);
+	IF_TRUE_RETVAL(ret < 0, -1);
+
+	/*
+	 * The rules are collected again to track the allowed and assigned devices. A v2
+	 * device filter is replaced by an identical one, whereas writing the rules of v1
+	 * again would revoke the devices of the child cgroup, thus they are dropped.
+	 */
+	c_cgroups_devices_batch_begin(cgroups);
+	if (c_cgroups_devices_init_rules(cgroups) < 0) {
+		c_cgroups_devices_batch_abort(cgroups);
+		return -1;
+	}
+	if (!cgroups->v2)
+		c_cgroups_devices_batch_abort(cgroups);
+	else if (c_cgroups_devices_batch_commit(cgroups) < 0)
+		return -1;
+
+	for (list_t *l = container_get_usbdev_list(cgroups->container); l; l = l->next) {
+		uevent_usbdev_t *usbdev = l->data;
+		if (uevent_usbdev_get_type(usbdev) != UEVENT_USBDEV_TYPE_PIN_ENTRY)
+			c_cgroups_devices_usbdev_allow(cgroups, usbdev);
+	}
+
+	procfs_view_free(cgroups->procfs_view);
+	cgroups->procfs_view = procfs_view_new(cgroups->container);
+
+	c_cgroups_monitors_start(cgroups);
+	c_cgroups_stats_start(cgroups);
+	return 0;
+}
+
 int
 c_cgroups_add_pid(c_cgroups_t *cgroups, pid_t pid)
 {
 	ASSERT(cgroups);
 
+	if (cgroups->v2) {
+		char value[16];
+		snprintf(value, sizeof(value), "%d", pid);
+		int ret = c_cgroups_v2_write_ctrl(cgroups, &cgroups->procs_handle,
+						  "child/cgroup.procs", value);
+		if (ret == -1)
+			ERROR_ERRNO("Could not add pid %d of container %s to its cgroup", pid,
+				    container_get_description(cgroups->container));
+		return ret;
+	}
+
 	// temporarily add systemd to list
 	cgroups->active_cgroups = list_prepend(cgroups->active_cgroups, "systemd");
 
@@ -1283,6 +2579,9 @@ c_cgroups_start_pre_exec_child(c_cgroups_t *cgroups)
 	/* check if cgroupns is supported else do nothing */
 	IF_FALSE_RETVAL_TRACE(cgroups->ns_cgroup, 0);
 
+	/* the cgroupns of the zygote is rooted at the child cgroup already */
+	IF_TRUE_RETVAL_TRACE(cgroups->ns_cgroup_adopted, 0);
+
 	if (unshare(CLONE_NEWCGROUP) == -1) {
 		WARN_ERRNO("Could not unshare cgroup namespace!");
 		return -1;
@@ -1302,7 +2601,7 @@ c_cgroups_start_child(c_cgroups_t *cgroups)
 
 	/* We are doing our best to umount the cgroups related directories in child
 	 * but we do not stop if it does not work */
-	for (list_t *l = cgroups->active_cgroups; l; l = l->next) {
+	for (list_t *l = cgroups->v2 ? NULL : cgroups->active_cgroups; l; l = l->next) {
 		char *subsys = l->data;
 		char *subsys_path = mem_printf("%s/%s", CGROUPS_FOLDER, subsys);
 		if (umount(subsys_path) < 0) {
@@ -1338,6 +2637,27 @@ c_cgroups_cleanup_subsys_remove_cb(const char *path, const char *name, UNUSED vo
 	return ret;
 }
 
+static void
+c_cgroups_v2_cleanup(c_cgroups_t *cgroups)
+{
+	/* the device filter is detached by the kernel together with the cgroup */
+	c_cgroups_v2_devices_clear(cgroups);
+
+	if (!file_is_dir(cgroups->cgroup_path))
+		return;
+
+	/* recursively remove all subfolders which the container may have created */
+	if (dir_foreach(cgroups->cgroup_path, &c_cgroups_cleanup_subsys_remove_cb, NULL) < 0) {
+		WARN_ERRNO("Could not remove cgroup of container %s",
+			   container_get_description(cgroups->container));
+	} else if (rmdir(cgroups->cgroup_path) < 0) {
+		WARN_ERRNO("Could not delete cgroup %s", cgroups->cgroup_path);
+	} else {
+		INFO("Removed cgroup %s for container %s", cgroups->cgroup_path,
+		     container_get_description(cgroups->container));
+	}
+}
+
 void
 c_cgroups_cleanup(c_cgroups_t *cgroups)
 {
@@ -1350,6 +2670,34 @@ c_cgroups_cleanup(c_cgroups_t *cgroups)
 
 	c_cgroups_cleanup_freeze_timer(cgroups);
 
+	for (int i = 0; i < PSI_RESOURCE_COUNT; i++) {
+		psi_monitor_free(cgroups->psi_monitors[i]);
+		cgroups->psi_monitors[i] = NULL;
+	}
+
+	cgroups->mem_background = false;
+	cgroups->reclaim_skip = 0;
+	cgroups->reclaim_backoff = 0;
+
+	/* the recorded samples are kept until the next start */
+	c_cgroups_stats_stop(cgroups);
+
+	procfs_view_free(cgroups->procfs_view);
+	cgroups->procfs_view = NULL;
+
+	file_handle_close(cgroups->freeze_handle);
+	cgroups->freeze_handle = NULL;
+	file_handle_close(cgroups->procs_handle);
+	cgroups->procs_handle = NULL;
+
+	if (cgroups->v2) {
+		c_cgroups_v2_cleanup(cgroups);
+		/* a zygote's cgroup is used for one start only */
+		if (cgroups->ns_cgroup_adopted)
+			c_cgroups_v2_reset_cgroup_path(cgroups);
+		goto out;
+	}
+
 	// temporarily add systemd to list
 	cgroups->active_cgroups = list_prepend(cgroups->active_cgroups, "systemd");
 
@@ -1378,6 +2726,10 @@ c_cgroups_cleanup(c_cgroups_t *cgroups)
 	// remove temporarily added head
 	cgroups->active_cgroups = list_unlink(cgroups->active_cgroups, cgroups->active_cgroups);
 
+out:
+	/* the cpus of the removed cgroup are handed back to the containers sharing cpus */
+	placement_release(cgroups->container);
+
 	/* unregister usbdevs from uevent subsystem for hotplugging */
 	for (list_t *l = container_get_usbdev_list(cgroups->container); l; l = l->next) {
 		uevent_usbdev_t *usbdev = l->data;
@@ -74,6 +74,84 @@ c_cgroups_set_ram_limit(c_cgroups_t *cgroups);
 int
 c_cgroups_add_pid(c_cgroups_t *cgroups, pid_t pid);
 
+/**
+ * Lets the next start of the container use the cgroup prepared by a zygote, see
+ * zygote.h, instead of its own. The zygote's cgroup namespace is rooted at the child
+ * cgroup, thus the container does not create a cgroup namespace itself. The cgroup is
+ * removed and the container's own cgroup is used again on cleanup. Only supported on
+ * the unified hierarchy.
+ * @param cgroup_path the zygote's cgroup, NULL to keep the container's own
+ */
+void
+c_cgroups_adopt(c_cgroups_t *cgroups, const char *cgroup_path);
+
+/* flags of the metrics in a sample which could be read */
+#define C_CGROUPS_STATS_CPU (1 << 0)
+#define C_CGROUPS_STATS_MEM (1 << 1)
+#define C_CGROUPS_STATS_IO (1 << 2)
+#define C_CGROUPS_STATS_PIDS (1 << 3)
+#define C_CGROUPS_STATS_KSM (1 << 4)
+#define C_CGROUPS_STATS_MEM_CACHE (1 << 5)
+
+/**
+ * Resource usage of a container at one point in time as read from its cgroups.
+ */
+typedef struct c_cgroups_stats_sample {
+	uint64_t time;		 /* sampling time in ms since the epoch */
+	unsigned int valid;	 /* C_CGROUPS_STATS_* of the metrics below which are set */
+	uint64_t cpu_usage_ns;	 /* accumulated cpu time */
+	uint64_t mem_usage;	 /* current memory usage in bytes */
+	uint64_t io_read_bytes;	 /* accumulated bytes read from block devices */
+	uint64_t io_write_bytes; /* accumulated bytes written to block devices */
+	uint64_t pids;		 /* current number of tasks */
+	uint64_t ksm_merged;	 /* bytes of memory of the tasks backed by KSM merged pages */
+	uint64_t mem_cache;	 /* bytes of mem_usage used by the page cache */
+} c_cgroups_stats_sample_t;
+
+/**
+ * Sets the interval in ms at which the resource usage of running containers is
+ * sampled. Takes effect for containers started afterwards, 0 disables sampling.
+ */
+void
+c_cgroups_set_stats_interval(unsigned int interval_ms);
+
+/**
+ * Returns the recorded resource usage samples of the container taken after the
+ * given time, oldest first.
+ *
+ * @param since time in ms since the epoch, 0 for all recorded samples
+ * @param samples pointer to a newly allocated array of samples, to be freed by the caller
+ * @return number of samples in the array
+ */
+size_t
+c_cgroups_get_stats(const c_cgroups_t *cgroups, uint64_t since, c_cgroups_stats_sample_t **samples);
+
+/**
+ * Marks the container as background (e.g. frozen or idle) or foreground for memory
+ * management. On cgroup v1 the soft limit of background containers is dropped to 0,
+ * so that global reclaim takes their memory first. On cgroup v2 they are reclaimed
+ * proactively with c_cgroups_mem_reclaim() instead.
+ */
+int
+c_cgroups_set_mem_background(c_cgroups_t *cgroups, bool background);
+
+/**
+ * Asks the kernel to reclaim the given share of the memory currently used by the
+ * container (memory.reclaim, cgroup v2 only). Containers of which the kernel could
+ * not reclaim as much as requested are skipped for an increasing number of calls.
+ *
+ * @return 0 if memory was reclaimed or the call was skipped, -1 if not supported
+ */
+int
+c_cgroups_mem_reclaim(c_cgroups_t *cgroups, unsigned int percent);
+
+/**
+ * Moves the container to the given cpus and memory nodes (lists like "0-3,8") at
+ * runtime, used to rebalance the containers sharing cpus.
+ */
+int
+c_cgroups_set_cpuset(c_cgroups_t *cgroups, const char *cpus, const char *mems);
+
 /******************************/
 /*
  * Container start hooks
@@ -88,6 +166,12 @@ c_cgroups_start_post_clone(c_cgroups_t *cgroups);
 int
 c_cgroups_start_pre_exec(c_cgroups_t *cgroups);
 
+/**
+ * Takes over the cgroup of a running container from a previous cmld instance.
+ */
+int
+c_cgroups_reattach(c_cgroups_t *cgroups);
+
 int
 c_cgroups_start_pre_exec_child(c_cgroups_t *cgroups);
 
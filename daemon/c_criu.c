@@ -0,0 +1,436 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+#include "c_criu.h"
+#include "c_vol.h"
+#include "mount.h"
+#include "audit.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/file.h"
+#include "common/dir.h"
+#include "common/event.h"
+#include "common/sock.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define C_CRIU_BINARY "/usr/sbin/criu"
+// marks a dump in the checkpoint directory as complete and not yet restored
+#define C_CRIU_COMPLETE "dump.complete"
+
+// upper bound of the fixed options of a dump or restore, external mounts come on top
+#define C_CRIU_ARGC_MAX 32
+
+struct c_criu {
+	container_t *container;
+	event_child_t *dump; // criu dump, while it runs
+	pid_t dump_pid;	     // process of the criu dump
+	int criu_fd;	     // criu binary to restore with, opened by the early child
+	int dir_fd;	     // checkpoint directory to restore from, opened by the early child
+};
+
+c_criu_t *
+c_criu_new(container_t *container)
+{
+	ASSERT(container);
+
+	c_criu_t *criu = mem_new0(c_criu_t, 1);
+	criu->container = container;
+	criu->criu_fd = -1;
+	criu->dir_fd = -1;
+	return criu;
+}
+
+void
+c_criu_free(c_criu_t *criu)
+{
+	ASSERT(criu);
+
+	c_criu_cleanup(criu);
+	mem_free0(criu);
+}
+
+static char *
+c_criu_dir_new(const c_criu_t *criu)
+{
+	return mem_printf("%s/%s", container_get_images_dir(criu->container),
+			  C_VOL_CHECKPOINT_DIR);
+}
+
+/*
+ * Returns whether the mount of the volume is part of the container's mount namespace.
+ * The root is passed to criu separately, flash images are not mounted at all and bind
+ * mounted files are skipped with a user namespace.
+ */
+static bool
+c_criu_mount_is_external(const c_criu_t *criu, const mount_entry_t *mntent)
+{
+	IF_TRUE_RETVAL(!strcmp(mount_entry_get_dir(mntent), "/"), false);
+
+	switch (mount_entry_get_type(mntent)) {
+	case MOUNT_TYPE_FLASH:
+		return false;
+	case MOUNT_TYPE_BIND_FILE:
+	case MOUNT_TYPE_BIND_FILE_RW:
+		return !container_has_userns(criu->container);
+	default:
+		return true;
+	}
+}
+
+/*
+ * Appends the options which declare the mounts c_vol sets up on each start as
+ * external, so that criu restore binds the new mounts instead of recreating the
+ * dumped ones, which is impossible for block devices in a user namespace. The mounts
+ * are named after their images; /dev and the cmld socket directory after themselves.
+ * Called in the dump or restore child only, the strings are freed by the exec.
+ */
+static char **
+c_criu_argv_add_external_mounts(const c_criu_t *criu, char **argv, int *argc, bool restore)
+{
+	const mount_t *mnt = container_get_mount(criu->container);
+	size_t n = mount_get_count(mnt);
+
+	argv = mem_renew(char *, argv, C_CRIU_ARGC_MAX + 2 * (n + 2) + 1);
+
+	const char *names[] = { "dev", "cmld" };
+	const char *dirs[] = { "/dev", CMLD_SOCKET_DIR };
+	for (size_t i = 0; i < 2; i++) {
+		argv[(*argc)++] = "--external";
+		argv[(*argc)++] = restore ? mem_printf("mnt[%s]:%s", names[i], dirs[i]) :
+					    mem_printf("mnt[%s]:%s", dirs[i], names[i]);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		const mount_entry_t *mntent = mount_get_entry(mnt, i);
+		if (!c_criu_mount_is_external(criu, mntent))
+			continue;
+
+		const char *img = mount_entry_get_img(mntent);
+		const char *dir = mount_entry_get_dir(mntent);
+		const char *sep = dir[0] == '/' ? "" : "/";
+		argv[(*argc)++] = "--external";
+		argv[(*argc)++] = restore ? mem_printf("mnt[%s]:%s%s", img, sep, dir) :
+					    mem_printf("mnt[%s%s]:%s", sep, dir, img);
+	}
+
+	argv[*argc] = NULL;
+	return argv;
+}
+
+/*
+ * Returns the argv of the criu dump of the process tree of dump_pid to dir.
+ * Called in the dump child only, the strings are freed by the exec.
+ */
+static char **
+c_criu_dump_argv_new(const c_criu_t *criu, pid_t dump_pid, char *dir)
+{
+	int argc = 0;
+	char **argv = mem_new0(char *, C_CRIU_ARGC_MAX);
+	argv[argc++] = C_CRIU_BINARY;
+	argv[argc++] = "dump";
+	argv[argc++] = "-t";
+	argv[argc++] = mem_printf("%d", dump_pid);
+	argv[argc++] = "-D";
+	argv[argc++] = dir;
+	argv[argc++] = "-o";
+	argv[argc++] = "dump.log";
+	argv[argc++] = "--leave-stopped";
+	argv[argc++] = "--tcp-established";
+	argv[argc++] = "--ext-unix-sk";
+	argv[argc++] = "--file-locks";
+	argv[argc++] = "--link-remap";
+	argv[argc++] = "--manage-cgroups=ignore";
+	argv[argc++] = "--enable-external-sharing";
+	argv[argc++] = "--enable-external-masters";
+	return c_criu_argv_add_external_mounts(criu, argv, &argc, false);
+}
+
+/*
+ * Returns the argv of the criu restore from the checkpoint directory picked up by
+ * c_criu_start_child_early(). It runs after the pivot to the container's root, so the
+ * directory is passed as file descriptor and the root is the current one. Called in
+ * the container's child only, the strings are freed by the exec.
+ */
+static char **
+c_criu_restore_argv_new(const c_criu_t *criu)
+{
+	int argc = 0;
+	char **argv = mem_new0(char *, C_CRIU_ARGC_MAX);
+	argv[argc++] = "criu";
+	argv[argc++] = "restore";
+	argv[argc++] = "-D";
+	argv[argc++] = mem_printf("/proc/self/fd/%d", criu->dir_fd);
+	argv[argc++] = "-o";
+	argv[argc++] = "restore.log";
+	argv[argc++] = "--root";
+	argv[argc++] = "/";
+	argv[argc++] = "--tcp-established";
+	argv[argc++] = "--ext-unix-sk";
+	argv[argc++] = "--file-locks";
+	argv[argc++] = "--manage-cgroups=ignore";
+	argv[argc++] = "--join-ns";
+	argv[argc++] = "net:/proc/self/ns/net";
+	argv[argc++] = "--join-ns";
+	argv[argc++] = "uts:/proc/self/ns/uts";
+	argv[argc++] = "--join-ns";
+	argv[argc++] = "ipc:/proc/self/ns/ipc";
+	if (container_has_userns(criu->container)) {
+		argv[argc++] = "--join-ns";
+		argv[argc++] = "user:/proc/self/ns/user";
+	}
+	return c_criu_argv_add_external_mounts(criu, argv, &argc, true);
+}
+
+/*
+ * Returns the root of the process tree to dump: the container's init or, for a
+ * restored container, the restored init, which is the only child of criu restore.
+ */
+static pid_t
+c_criu_get_dump_pid(const c_criu_t *criu)
+{
+	pid_t pid = container_get_pid(criu->container);
+	char exe[PATH_MAX];
+
+	char *exe_link = mem_printf("/proc/%d/exe", pid);
+	ssize_t len = readlink(exe_link, exe, sizeof(exe) - 1);
+	mem_free0(exe_link);
+	if (len < 0) {
+		ERROR_ERRNO("Could not get the executable of init %d", pid);
+		return -1;
+	}
+	exe[len] = '\0';
+	IF_TRUE_RETVAL(strcmp(exe, C_CRIU_BINARY), pid);
+
+	char *children_file = mem_printf("/proc/%d/task/%d/children", pid, pid);
+	char *children = file_read_new(children_file, 64);
+	pid_t child = children ? atoi(children) : 0;
+	mem_free0(children_file);
+	mem_free0(children);
+	if (child <= 0) {
+		ERROR("Could not find the restored init below criu %d", pid);
+		return -1;
+	}
+	return child;
+}
+
+static int
+c_criu_unlink_cb(const char *path, const char *file, UNUSED void *data)
+{
+	char *file_path = mem_printf("%s/%s", path, file);
+	// lost+found is a directory and stays
+	if (unlink(file_path) < 0 && errno != EISDIR)
+		WARN_ERRNO("Could not remove %s", file_path);
+	mem_free0(file_path);
+	return 0;
+}
+
+static void
+c_criu_dump_child_cb(pid_t pid, int status, event_child_t *child, void *data)
+{
+	ASSERT(data);
+	c_criu_t *criu = data;
+	container_t *container = criu->container;
+
+	event_child_free(child);
+	criu->dump = NULL;
+
+	if (status < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		ERROR("criu dump (pid %d) of container %s failed, see dump.log of its checkpoint",
+		      pid, container_get_description(container));
+		audit_log_event(container_get_uuid(container), FSA, CMLD, CONTAINER_MGMT,
+				"checkpoint", uuid_string(container_get_uuid(container)), 0);
+		return;
+	}
+
+	// criu left the dumped processes stopped, they are not resumed either way
+	char *dir = c_criu_dir_new(criu);
+	char *complete = mem_printf("%s/%s", dir, C_CRIU_COMPLETE);
+	if (file_touch(complete) < 0) {
+		ERROR_ERRNO("Could not mark checkpoint of container %s complete",
+			    container_get_description(container));
+		audit_log_event(container_get_uuid(container), FSA, CMLD, CONTAINER_MGMT,
+				"checkpoint", uuid_string(container_get_uuid(container)), 0);
+	} else {
+		INFO("Checkpointed container %s to %s", container_get_description(container), dir);
+		audit_log_event(container_get_uuid(container), SSA, CMLD, CONTAINER_MGMT,
+				"checkpoint", uuid_string(container_get_uuid(container)), 0);
+	}
+	mem_free0(complete);
+	mem_free0(dir);
+
+	container_kill(container);
+}
+
+int
+c_criu_checkpoint(c_criu_t *criu)
+{
+	ASSERT(criu);
+	container_t *container = criu->container;
+
+	if (container_get_checkpoint_size(container) == 0 ||
+	    container_get_type(container) == CONTAINER_TYPE_KVM ||
+	    container_has_setup_mode(container)) {
+		WARN("Checkpoints are not enabled for container %s",
+		     container_get_description(container));
+		return -1;
+	}
+	if (container_get_state(container) != CONTAINER_STATE_RUNNING) {
+		WARN("Container %s is not running, cannot checkpoint it",
+		     container_get_description(container));
+		return -1;
+	}
+	if (criu->dump) {
+		WARN("Container %s is already being checkpointed",
+		     container_get_description(container));
+		return -1;
+	}
+
+	pid_t dump_pid = c_criu_get_dump_pid(criu);
+	IF_TRUE_RETVAL(dump_pid < 0, -1);
+
+	char *dir = c_criu_dir_new(criu);
+	pid_t pid = fork();
+	if (pid < 0) {
+		ERROR_ERRNO("Could not fork criu dump for container %s",
+			    container_get_description(container));
+		mem_free0(dir);
+		return -1;
+	}
+	if (pid == 0) {
+		// images of an earlier checkpoint must not mix with the new ones
+		dir_foreach(dir, &c_criu_unlink_cb, NULL);
+
+		char **argv = c_criu_dump_argv_new(criu, dump_pid, dir);
+		execv(argv[0], argv);
+		ERROR_ERRNO("Could not exec %s", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	mem_free0(dir);
+
+	criu->dump = event_child_new(pid, &c_criu_dump_child_cb, criu);
+	criu->dump_pid = pid;
+	if (event_add_child(criu->dump) < 0) {
+		ERROR("Could not watch criu dump of container %s",
+		      container_get_description(container));
+		event_child_free(criu->dump);
+		criu->dump = NULL;
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+
+	INFO("Checkpointing container %s (init %d) with criu %d",
+	     container_get_description(container), dump_pid, pid);
+	return 0;
+}
+
+int
+c_criu_start_child_early(c_criu_t *criu)
+{
+	ASSERT(criu);
+
+	IF_TRUE_RETVAL(container_get_checkpoint_size(criu->container) == 0, 0);
+
+	char *dir = c_criu_dir_new(criu);
+	char *complete = mem_printf("%s/%s", dir, C_CRIU_COMPLETE);
+	IF_FALSE_GOTO(file_exists(complete), out);
+
+	criu->criu_fd = open(C_CRIU_BINARY, O_RDONLY | O_CLOEXEC);
+	if (criu->criu_fd < 0) {
+		WARN_ERRNO("Could not open %s, starting container %s cold", C_CRIU_BINARY,
+			   container_get_description(criu->container));
+		goto out;
+	}
+	criu->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	// a failed restore must not be retried on the next start
+	if (criu->dir_fd < 0 || unlink(complete) < 0) {
+		WARN_ERRNO("Could not pick up checkpoint %s, starting container %s cold", dir,
+			   container_get_description(criu->container));
+		c_criu_cleanup(criu);
+		goto out;
+	}
+
+	INFO("Restoring container %s from checkpoint %s",
+	     container_get_description(criu->container), dir);
+out:
+	mem_free0(complete);
+	mem_free0(dir);
+	return 0;
+}
+
+int
+c_criu_start_exec_child(const c_criu_t *criu)
+{
+	ASSERT(criu);
+
+	IF_TRUE_RETVAL(criu->criu_fd < 0, 0);
+
+	// the checkpoint directory is not reachable from the container's root
+	if (fcntl(criu->dir_fd, F_SETFD, 0) < 0) {
+		ERROR_ERRNO("Could not pass checkpoint directory to criu restore");
+		return -1;
+	}
+
+	char **argv = c_criu_restore_argv_new(criu);
+
+	char *const envp[] = { NULL };
+	fexecve(criu->criu_fd, argv, envp);
+	ERROR_ERRNO("Could not exec criu restore for container %s",
+		    container_get_description(criu->container));
+	return -1;
+}
+
+void
+c_criu_cleanup(c_criu_t *criu)
+{
+	ASSERT(criu);
+
+	if (criu->dump) {
+		pid_t pid = criu->dump_pid;
+		WARN("Aborting criu dump %d of container %s", pid,
+		     container_get_description(criu->container));
+		event_remove_child(criu->dump);
+		event_child_free(criu->dump);
+		criu->dump = NULL;
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+	}
+
+	if (criu->criu_fd >= 0)
+		close(criu->criu_fd);
+	if (criu->dir_fd >= 0)
+		close(criu->dir_fd);
+	criu->criu_fd = -1;
+	criu->dir_fd = -1;
+}
@@ -0,0 +1,87 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/*
+ * @file c_criu.h
+ *
+ * This module checkpoints the processes of a container with CRIU and restores them
+ * on its next start, e.g. after a reboot of the device.
+ *
+ * The checkpoint is written by "criu dump" to the encrypted checkpoint image of the
+ * container, which c_vol mounts outside of the container's root (see
+ * C_VOL_CHECKPOINT_DIR). The dumped processes are left stopped until the dump is
+ * marked complete and are killed afterwards, which stops the container.
+ *
+ * On the next start, the container is set up as usual by all other modules. Only
+ * instead of its init, the container executes "criu restore", which recreates the
+ * dumped process tree in a nested pid and mount namespace and stays its parent. The
+ * restore joins the user, network, uts and ipc namespaces prepared for the container,
+ * and maps the volumes, /dev and the cmld socket directory to the mounts c_vol set up
+ * anew. As the container's root is pivoted before, criu is executed from a file
+ * descriptor opened in cmld's mount namespace and thus must be linked statically.
+ * A checkpoint is restored once, a failed restore is not retried on the next start.
+ */
+
+#ifndef C_CRIU_H
+#define C_CRIU_H
+
+#include "container.h"
+
+typedef struct c_criu c_criu_t;
+
+c_criu_t *
+c_criu_new(container_t *container);
+
+void
+c_criu_free(c_criu_t *criu);
+
+/**
+ * Dumps the processes of the running container to its checkpoint image and stops the
+ * container once the dump is complete. The dump runs asynchronously.
+ *
+ * @return 0 if the dump was started, -1 on error
+ */
+int
+c_criu_checkpoint(c_criu_t *criu);
+
+/**
+ * Picks up a complete checkpoint of the container to be restored. Must be called in
+ * the early child after c_vol mounted the checkpoint image. Without a usable
+ * checkpoint the container is started cold.
+ */
+int
+c_criu_start_child_early(c_criu_t *criu);
+
+/**
+ * Executes criu restore instead of the container's init, if a checkpoint was picked
+ * up by c_criu_start_child_early().
+ *
+ * @return 0 if the container is to be started cold, -1 if criu could not be executed
+ */
+int
+c_criu_start_exec_child(const c_criu_t *criu);
+
+void
+c_criu_cleanup(c_criu_t *criu);
+
+#endif /* C_CRIU_H */
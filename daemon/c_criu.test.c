@@ -0,0 +1,144 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file c_criu.test.c
+ *
+ * Unit Test for c_criu.c. Tests the command lines of criu dump and restore, in
+ * particular that the mounts set up by c_vol are declared external under the same
+ * names on both sides, so that the restore binds the new mounts.
+ */
+#define _GNU_SOURCE
+
+#include "container.stub.h"
+
+#include "c_criu.c"
+
+/*
+ * Returns the index of the option opt in argv, starting at index from, or -1.
+ */
+static int
+argv_find(char **argv, int from, const char *opt)
+{
+	for (int i = from; argv[i]; i++) {
+		if (!strcmp(argv[i], opt))
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Checks that the values of all --external options in argv are the ones in expected,
+ * in this order.
+ */
+static void
+check_externals(char **argv, const char *const *expected, int expected_len)
+{
+	int n = 0;
+	for (int i = argv_find(argv, 0, "--external"); i >= 0;
+	     i = argv_find(argv, i + 2, "--external")) {
+		ASSERT(argv[i + 1]);
+		ASSERT(n < expected_len);
+		DEBUG("external %s, expected %s", argv[i + 1], expected[n]);
+		ASSERT(!strcmp(argv[i + 1], expected[n]));
+		n++;
+	}
+	ASSERT(n == expected_len);
+}
+
+int
+main(void)
+{
+	logf_register(&logf_test_write, stdout);
+	DEBUG("Unit Test: c_criu.test.c");
+
+	mount_t *mnt = mount_new();
+	mount_add_entry(mnt, MOUNT_TYPE_SHARED, "root", "/", "squashfs", 0);
+	mount_add_entry(mnt, MOUNT_TYPE_EMPTY, "data", "/data", "ext4", 64);
+	mount_add_entry(mnt, MOUNT_TYPE_OVERLAY_RW, "etc", "etc", "ext4", 8);
+	mount_add_entry(mnt, MOUNT_TYPE_FLASH, "boot", "boot", "ext4", 0);
+	mount_add_entry(mnt, MOUNT_TYPE_BIND_FILE, "resolv", "/etc/resolv.conf", "none", 0);
+
+	container_t *container = container_stub_new("criu");
+	c_criu_t *criu = c_criu_new(container);
+
+	DEBUG("Check dump without user namespace");
+
+	container_stub_set_mount(container, mnt, false);
+	char *dir = mem_strdup("/checkpoint");
+	char **dump_argv = c_criu_dump_argv_new(criu, 42, dir);
+	ASSERT(!strcmp(dump_argv[0], C_CRIU_BINARY));
+	ASSERT(!strcmp(dump_argv[1], "dump"));
+	int i = argv_find(dump_argv, 0, "-t");
+	ASSERT(i > 0 && !strcmp(dump_argv[i + 1], "42"));
+	i = argv_find(dump_argv, 0, "-D");
+	ASSERT(i > 0 && !strcmp(dump_argv[i + 1], "/checkpoint"));
+	ASSERT(argv_find(dump_argv, 0, "--leave-stopped") > 0);
+	ASSERT(argv_find(dump_argv, 0, "--join-ns") < 0);
+
+	// root and flash images are not external, relative mount points are made absolute
+	const char *const dump_externals[] = { "mnt[/dev]:dev", "mnt[" CMLD_SOCKET_DIR "]:cmld",
+					       "mnt[/data]:data", "mnt[/etc]:etc",
+					       "mnt[/etc/resolv.conf]:resolv" };
+	check_externals(dump_argv, dump_externals, 5);
+
+	DEBUG("Check restore without user namespace");
+
+	criu->dir_fd = 7;
+	char **restore_argv = c_criu_restore_argv_new(criu);
+	ASSERT(!strcmp(restore_argv[1], "restore"));
+	i = argv_find(restore_argv, 0, "-D");
+	ASSERT(i > 0 && !strcmp(restore_argv[i + 1], "/proc/self/fd/7"));
+	i = argv_find(restore_argv, 0, "--root");
+	ASSERT(i > 0 && !strcmp(restore_argv[i + 1], "/"));
+	ASSERT(argv_find(restore_argv, 0, "user:/proc/self/ns/user") < 0);
+	ASSERT(argv_find(restore_argv, 0, "net:/proc/self/ns/net") > 0);
+
+	// the same names as in the dump, mapped to the mount points of the new mounts
+	const char *const restore_externals[] = { "mnt[dev]:/dev", "mnt[cmld]:" CMLD_SOCKET_DIR,
+						  "mnt[data]:/data", "mnt[etc]:/etc",
+						  "mnt[resolv]:/etc/resolv.conf" };
+	check_externals(restore_argv, restore_externals, 5);
+
+	DEBUG("Check dump and restore with user namespace");
+
+	// bind mounted files are skipped, the restore joins the user namespace
+	container_stub_set_mount(container, mnt, true);
+	dump_argv = c_criu_dump_argv_new(criu, 42, dir);
+	check_externals(dump_argv, dump_externals, 4);
+	restore_argv = c_criu_restore_argv_new(criu);
+	i = argv_find(restore_argv, 0, "user:/proc/self/ns/user");
+	ASSERT(i > 0 && !strcmp(restore_argv[i - 1], "--join-ns"));
+	check_externals(restore_argv, restore_externals, 4);
+
+	DEBUG("criu command line checking done");
+
+	// the argvs are owned by the exec in c_criu.c and thus leaked here
+	criu->dir_fd = -1;
+	c_criu_free(criu);
+	container_free(container);
+	mount_free(mnt);
+	mem_free0(dir);
+
+	return 0;
+}
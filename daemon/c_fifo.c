@@ -33,19 +33,36 @@
 #include "common/ns.h"
 #include "common/uuid.h"
 #include "common/str.h"
-#include "common/fd.h"
+#include "common/event.h"
+#include "common/list.h"
 
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sched.h>
+#include <sys/ioctl.h>
 
 #define FIFO_PATH "/dev/fifos"
 
+// bytes moved per splice() call and at most per event loop wakeup and FIFO
+#define C_FIFO_FORWARD_CHUNK (64 * 1024)
+#define C_FIFO_FORWARD_MAX_PER_WAKEUP (256 * 1024)
+
+typedef struct c_fifo_forward {
+	char *name;
+	char *from_path; // FIFO in c0
+	char *to_path;	 // FIFO in the target container
+	int from_fd;
+	int to_fd;
+	event_io_t *io; // watches from_fd for input or to_fd while blocked
+	bool blocked;
+} c_fifo_forward_t;
+
 struct c_fifo {
 	container_t *container;
 	list_t *fifo_list;
+	list_t *forwards; // c_fifo_forward_t, active while the container runs
 };
 
 c_fifo_t *
@@ -141,55 +158,162 @@ error:
 	return -1;
 }
 
+/*
+ * Opens one end of a FIFO for forwarding. Both ends are opened O_RDWR: on the
+ * c0 side this keeps a writer reference so that the read end does not signal
+ * EPOLLHUP (and read()==0) every time a c0 writer closes, on the container
+ * side open() never fails with ENXIO while no reader is attached yet and
+ * written data is kept in the pipe until a reader shows up.
+ */
 static int
-c_fifo_loop(char *fifo_path_c0, char *fifo_path_container)
+c_fifo_forward_open(const char *path)
 {
-	int fromfd = -1, tofd = -1;
+	int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		ERROR_ERRNO("Failed to open FIFO %s", path);
+	return fd;
+}
 
-	//keep repopening c0 FIFO when closed
-	while (1) {
-		if (fromfd != -1 && close(fromfd)) {
-			TRACE_ERRNO("Failed to close old reading fd");
+/*
+ * Moves data from the c0 FIFO to the container FIFO inside the kernel.
+ * Returns 0 if the source was drained (or the per wakeup budget is used up),
+ * 1 if the destination is full while data is still pending and -1 on error.
+ */
+static int
+c_fifo_forward_pump(c_fifo_forward_t *fwd)
+{
+	size_t total = 0;
+
+	while (total < C_FIFO_FORWARD_MAX_PER_WAKEUP) {
+		ssize_t n = splice(fwd->from_fd, NULL, fwd->to_fd, NULL, C_FIFO_FORWARD_CHUNK,
+				   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n > 0) {
+			total += n;
+			continue;
 		}
-
-		if (tofd != -1 && close(tofd)) {
-			TRACE_ERRNO("Failed to close old reading fd");
+		if (n == 0)
+			return 0;
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN) {
+			// EAGAIN is reported for an empty source as well as for a full destination
+			int pending = 0;
+			if (ioctl(fwd->from_fd, FIONREAD, &pending) == 0 && pending > 0)
+				return 1;
+			return 0;
 		}
+		ERROR_ERRNO("Failed to forward FIFO '%s'", fwd->name);
+		return -1;
+	}
 
-		if (-1 == (fromfd = open(fifo_path_c0, O_RDONLY))) {
-			ERROR_ERRNO("Failed to open fromfd at %s, exiting...", fifo_path_c0);
-			exit(-1);
-		}
-		TRACE("Opened reading end for %s", fifo_path_c0);
+	TRACE("Forwarded %zu bytes on FIFO '%s'", total, fwd->name);
+	return 0;
+}
 
-		if (-1 == (tofd = open(fifo_path_container, O_WRONLY))) {
-			ERROR_ERRNO("Failed to open tofd at %s, exiting ...", fifo_path_container);
-			exit(-1);
-		}
-		TRACE("Opened writing end for %s", fifo_path_container);
+static void
+c_fifo_forward_cb(int fd, unsigned events, event_io_t *io, void *data);
 
-		TRACE("Entering readloop with fromfd %d and tofd %d", fromfd, tofd);
+static void
+c_fifo_forward_watch(c_fifo_forward_t *fwd, bool blocked)
+{
+	if (fwd->io) {
+		event_remove_io(fwd->io);
+		event_io_free(fwd->io);
+	}
+	fwd->blocked = blocked;
+	fwd->io = blocked ? event_io_new(fwd->to_fd, EVENT_IO_WRITE, c_fifo_forward_cb, fwd) :
+			    event_io_new(fwd->from_fd, EVENT_IO_READ, c_fifo_forward_cb, fwd);
+	event_add_io(fwd->io);
+}
 
-		int count = 0;
-		char buf[1024];
+static void
+c_fifo_forward_stop(c_fifo_forward_t *fwd)
+{
+	if (fwd->io) {
+		event_remove_io(fwd->io);
+		event_io_free(fwd->io);
+		fwd->io = NULL;
+	}
+	if (fwd->from_fd >= 0)
+		close(fwd->from_fd);
+	if (fwd->to_fd >= 0)
+		close(fwd->to_fd);
+	fwd->from_fd = fwd->to_fd = -1;
+}
 
-		while (1) {
-			if (0 < (count = read(fromfd, &buf, sizeof(buf) - 1))) {
-				TRACE("[READLOOP] Read returned %d, writing to target FIFO", count);
+static int
+c_fifo_forward_start(c_fifo_forward_t *fwd)
+{
+	if ((fwd->from_fd = c_fifo_forward_open(fwd->from_path)) < 0)
+		goto error;
+	if ((fwd->to_fd = c_fifo_forward_open(fwd->to_path)) < 0)
+		goto error;
 
-				buf[count] = 0;
-				TRACE("[READLOOP] Read %d bytes from fd: %d: %s", count, fromfd,
-				      buf);
+	c_fifo_forward_watch(fwd, false);
+	return 0;
+error:
+	c_fifo_forward_stop(fwd);
+	return -1;
+}
 
-				if (count != fd_write(tofd, buf, count)) {
-					ERROR("Could not write all bytes to container FIFO end.");
-					break;
-				}
-			} else {
-				TRACE("[READLOOP] Read returned %d, try to reopen fds", count);
-			}
-		}
+static void
+c_fifo_forward_cb(UNUSED int fd, unsigned events, UNUSED event_io_t *io, void *data)
+{
+	c_fifo_forward_t *fwd = data;
+	ASSERT(fwd);
+
+	int ret = c_fifo_forward_pump(fwd);
+
+	if (ret == 0 && (events & EVENT_IO_EXCEPT)) {
+		// one of the FIFOs was removed or broken underneath us, start over
+		WARN("Exception on FIFO '%s', reopening", fwd->name);
+		c_fifo_forward_stop(fwd);
+		if (c_fifo_forward_start(fwd))
+			ERROR("Stopped forwarding FIFO '%s'", fwd->name);
+		return;
+	}
+
+	if (ret < 0) {
+		ERROR("Stopped forwarding FIFO '%s'", fwd->name);
+		c_fifo_forward_stop(fwd);
+		return;
 	}
+
+	// switch between waiting for input and waiting for the container to catch up
+	if ((ret == 1) != fwd->blocked)
+		c_fifo_forward_watch(fwd, ret == 1);
+}
+
+static void
+c_fifo_forward_free(c_fifo_forward_t *fwd)
+{
+	IF_NULL_RETURN(fwd);
+
+	c_fifo_forward_stop(fwd);
+	mem_free0(fwd->name);
+	mem_free0(fwd->from_path);
+	mem_free0(fwd->to_path);
+	mem_free0(fwd);
+}
+
+void
+c_fifo_cleanup(c_fifo_t *fifo)
+{
+	ASSERT(fifo);
+
+	for (list_t *l = fifo->forwards; l; l = l->next)
+		c_fifo_forward_free(l->data);
+	list_delete(fifo->forwards);
+	fifo->forwards = NULL;
+}
+
+void
+c_fifo_free(c_fifo_t *fifo)
+{
+	ASSERT(fifo);
+
+	c_fifo_cleanup(fifo);
+	mem_free0(fifo);
 }
 
 int
@@ -214,35 +338,29 @@ c_fifo_start_post_clone(c_fifo_t *fifo)
 			return -1;
 		}
 
-		//fork FIFO forwarding child
+		// forward all FIFOs from within cmld's event loop
 		for (list_t *elem = fifo->fifo_list; elem != NULL; elem = elem->next) {
 			char *current_fifo = elem->data;
 
-			int pid = fork();
-
-			if (-1 == pid) {
-				ERROR("Failed to clone forwarding child");
+			c_fifo_forward_t *fwd = mem_new0(c_fifo_forward_t, 1);
+			fwd->name = mem_strdup(current_fifo);
+			fwd->from_path = mem_printf("/tmp/%s/%s/%s",
+						    uuid_string(container_get_uuid(c0)), FIFO_PATH,
+						    current_fifo);
+			fwd->to_path = mem_printf("/tmp/%s/%s/%s",
+						  uuid_string(container_get_uuid(fifo->container)),
+						  FIFO_PATH, current_fifo);
+			fwd->from_fd = fwd->to_fd = -1;
+
+			DEBUG("Forwarding from %s to %s", fwd->from_path, fwd->to_path);
+
+			if (c_fifo_forward_start(fwd)) {
+				ERROR("Failed to set up forwarding for FIFO '%s'", current_fifo);
+				c_fifo_forward_free(fwd);
+				c_fifo_cleanup(fifo);
 				return -1;
-			} else if (pid == 0) {
-				DEBUG("Preparing forwarding for FIFO \'%s\'", current_fifo);
-
-				char *fifo_path_c0 = mem_printf("/tmp/%s/%s/%s",
-								uuid_string(container_get_uuid(c0)),
-								FIFO_PATH, current_fifo);
-				char *fifo_path_container =
-					mem_printf("/tmp/%s/%s/%s",
-						   uuid_string(container_get_uuid(fifo->container)),
-						   FIFO_PATH, current_fifo);
-
-				DEBUG("Forwarding from %s to %s", fifo_path_c0,
-				      fifo_path_container);
-
-				c_fifo_loop(fifo_path_c0, fifo_path_container);
-
-				exit(EXIT_FAILURE);
 			}
-
-			DEBUG("Forked FIFO forwarding child %d for %s", pid, current_fifo);
+			fifo->forwards = list_append(fifo->forwards, fwd);
 		}
 
 	} else {
@@ -37,4 +37,13 @@ c_fifo_start_post_clone(c_fifo_t *fifo);
 c_fifo_t *
 c_fifo_new(container_t *container, list_t *fifo_list);
 
+/**
+ * Stops forwarding the container's FIFOs and closes all FIFO ends held by cmld.
+ */
+void
+c_fifo_cleanup(c_fifo_t *fifo);
+
+void
+c_fifo_free(c_fifo_t *fifo);
+
 #endif /* C_FIFO_H */
@@ -30,13 +30,13 @@
 #include <stdbool.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
-#include <dirent.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <inttypes.h>
 #include <signal.h>
+#include <linux/pkt_sched.h>
 
 #include "common/macro.h"
 #include "common/mem.h"
@@ -48,36 +48,40 @@
 #include "common/dir.h"
 #include "common/network.h"
 #include "common/proc.h"
+#include "common/str.h"
 #include "common/event.h"
 #include "common/ns.h"
 #include "container.h"
 #include "cmld.h"
 #include "hardware.h"
 #include "uevent.h"
-
-/* Offset for ipv4/mac address allocation, e.g. 127.1.(IPV4_SUBNET_OFFS+x).2
- * Defines the start value for address allocation */
-// TODO: we can possibly run into collisions (increment in get next ip function if ip request fails
-#define IPV4_SUBNET_OFFS 0
-
-/* Max number of network structures that can be allocated depends on the available subnets */
-#define MAX_NUM_DEVICES (255 - IPV4_SUBNET_OFFS)
+#include "dhcpd.h"
 
 /* Path to search for net devices */
 #define SYS_NET_PATH "/sys/class/net"
 
-/* ipv4 addresses for cmld and cont endpoints, where the subnet depends on the container */
+/* Default pool of subnets from which each container interface gets an own /IPV4_PREFIX subnet.
+ * The offset of an interface is the index of its subnet inside the pool. Inside of a subnet,
+ * cmld's endpoint gets the host part IPV4_CMLD_HOST and the container IPV4_CONT_HOST. */
 #ifdef USE_LOCALNET_ROUTING
-#define IPV4_CMLD_ADDRESS "127.1.%d.1"
-#define IPV4_CONT_ADDRESS "127.1.%d.2"
-#define IPV4_DHCP_RANGE_START "127.1.%d.50"
-#define IPV4_DHCP_RANGE_END "127.1.%d.61"
+#define IPV4_SUBNET_POOL "127.1.0.0/16"
+#define IPV4_DHCP_RANGE_START 50
+#define IPV4_DHCP_RANGE_END 61
 #else
-#define IPV4_CMLD_ADDRESS "172.23.%d.1"
-#define IPV4_CONT_ADDRESS "172.23.%d.2"
-#define IPV4_DHCP_RANGE_START "172.23.%d.2"
-#define IPV4_DHCP_RANGE_END "172.23.%d.12"
+#define IPV4_SUBNET_POOL "172.23.0.0/16"
+#define IPV4_DHCP_RANGE_START 2
+#define IPV4_DHCP_RANGE_END 12
+#endif
 #define IPV4_DHCP_MASK "255.255.255.0"
+#define IPV4_CMLD_HOST 1
+#define IPV4_CONT_HOST 2
+
+/* Smallest prefix accepted for the subnet pool, i.e. at most 2^16 offsets */
+#define IPV4_SUBNET_POOL_MIN_PREFIX 8
+
+/* Occupied offsets and their owners, kept across cmld restarts while the system is up */
+#ifndef IPV4_OFFSETS_FILE
+#define IPV4_OFFSETS_FILE "/run/cmld.net_offsets"
 #endif
 
 // uplink interface for cmld inside of routing container (c0)
@@ -86,6 +90,18 @@
 /* Network prefix */
 #define IPV4_PREFIX 24
 
+/* Names of pooled veth pairs, which are renamed to r_/c_<offset> when taken */
+#define VETH_POOL_CMLD_NAME "vpr_%u"
+#define VETH_POOL_CONT_NAME "vpc_%u"
+#define VETH_POOL_CMLD_PREFIX "vpr_"
+
+/* Delay in ms between the creation of two pooled veth pairs in the background */
+#define VETH_POOL_REFILL_INTERVAL 100
+
+/* Default DSCP of the priority classes, lower effort (RFC 8622) and low-latency data (RFC 4594) */
+#define DSCP_BULK 1
+#define DSCP_INTERACTIVE 18
+
 /* Network interface structure with interface specific settings */
 typedef struct {
 	char *nw_name;		       //!< Name of the network device
@@ -98,7 +114,8 @@ typedef struct {
 	struct in_addr ipv4_bc_addr;   //!< ipv4 bcaddr of container/cmld subnet
 	int cont_offset;	       //!< gives information about the adresses to be set
 	uint8_t veth_mac[6];	       // generated or configured mac of nic in	container
-	pid_t dhcpd_pid;	       // pid of corresponding dhcpd if running for this ni
+	dhcpd_t *dhcpd;		       //!< dhcp responder serving veth_cmld_name
+	container_net_qos_t qos;       //!< bandwidth limits and priority of the traffic
 } c_net_interface_t;
 
 /* Network structure with specific network settings */
@@ -111,52 +128,218 @@ struct c_net {
 	int fd_netns;	      //!< fd to keep netns active during reboots
 };
 
+/* Pre-created veth pair, waiting in the root ns to be taken by a starting container */
+typedef struct {
+	char *cmld_name; //!< pooled name of the root ns endpoint
+	char *cont_name; //!< pooled name of the container endpoint
+} c_net_veth_pool_entry_t;
+
+static list_t *c_net_veth_pool = NULL;
+static unsigned int c_net_veth_pool_size = 0;
+static unsigned int c_net_veth_pool_next_id = 0;
+static event_timer_t *c_net_veth_pool_timer = NULL;
+
+/* Offset occupied by a container interface, owner is "<container uuid>/<interface name>" */
+typedef struct {
+	int offset;
+	char *owner;
+} c_net_offset_t;
+
 /**
- * bool array, which globally holds assigend offsets in order to
- * determine a new offset for a starting container.
- * address_offsets[i]==true means that a container holds this offset to get its specific ip address
+ * Bitmap which globally holds the assigned offsets in order to determine a new
+ * offset for a starting container. A set bit means that a container interface holds
+ * this offset to get its specific ip addresses.
  */
-static bool *address_offsets = NULL;
+static uint64_t *address_offsets = NULL;
+static int address_offsets_num = 0;
+static uint32_t address_pool = 0; //!< network address of the subnet pool, host byte order
+static list_t *address_offset_list = NULL;
 
 /**
- * sets the offset at the specified position to false.
+ * Writes the occupied offsets to IPV4_OFFSETS_FILE, so that a restarted cmld
+ * does not hand out subnets and veth names which are still in use.
+ */
+static void
+c_net_offsets_store(void)
+{
+	char *tmp_file = mem_printf("%s.tmp", IPV4_OFFSETS_FILE);
+	str_t *buf = str_new(NULL);
+
+	for (list_t *l = address_offset_list; l; l = l->next) {
+		c_net_offset_t *o = l->data;
+		str_append_printf(buf, "%d %s\n", o->offset, o->owner);
+	}
+
+	if (file_write(tmp_file, str_buffer(buf), str_length(buf)) < 0 ||
+	    rename(tmp_file, IPV4_OFFSETS_FILE) < 0)
+		WARN_ERRNO("Could not store network offsets in %s", IPV4_OFFSETS_FILE);
+
+	str_free(buf, true);
+	mem_free0(tmp_file);
+}
+
+static void
+c_net_offset_occupy(int offset, const char *owner)
+{
+	c_net_offset_t *o = mem_new0(c_net_offset_t, 1);
+	o->offset = offset;
+	o->owner = mem_strdup(owner);
+	address_offset_list = list_append(address_offset_list, o);
+
+	address_offsets[offset / 64] |= UINT64_C(1) << (offset % 64);
+	TRACE("Offset %d occupied by %s", offset, owner);
+}
+
+static void
+c_net_offsets_load(void)
+{
+	IF_FALSE_RETURN(file_exists(IPV4_OFFSETS_FILE));
+
+	char *content = file_read_new(IPV4_OFFSETS_FILE, 64 * address_offsets_num + 1);
+	IF_NULL_RETURN_WARN(content);
+
+	char *saveptr = NULL;
+	for (char *line = strtok_r(content, "\n", &saveptr); line;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		int offset;
+		char owner[64];
+		if (sscanf(line, "%d %63s", &offset, owner) != 2 || offset < 0 ||
+		    offset >= address_offsets_num) {
+			WARN("Dropping invalid network offset entry '%s'", line);
+			continue;
+		}
+		if (address_offsets[offset / 64] & (UINT64_C(1) << (offset % 64)))
+			continue;
+		c_net_offset_occupy(offset, owner);
+	}
+	mem_free0(content);
+
+	INFO("Restored %u occupied network offsets", list_length(address_offset_list));
+}
+
+int
+c_net_address_pool_init(const char *subnet_pool)
+{
+	char addr[INET_ADDRSTRLEN];
+	struct in_addr pool;
+	int prefix;
+
+	if (!subnet_pool)
+		subnet_pool = IPV4_SUBNET_POOL;
+
+	if (sscanf(subnet_pool, "%15[0-9.]/%d", addr, &prefix) != 2 || !inet_aton(addr, &pool) ||
+	    prefix < IPV4_SUBNET_POOL_MIN_PREFIX || prefix > IPV4_PREFIX) {
+		ERROR("Invalid container subnet pool '%s'", subnet_pool);
+		return -1;
+	}
+
+	for (list_t *l = address_offset_list; l; l = l->next) {
+		c_net_offset_t *o = l->data;
+		mem_free0(o->owner);
+		mem_free0(o);
+	}
+	list_delete(address_offset_list);
+	address_offset_list = NULL;
+	mem_free0(address_offsets);
+
+	address_offsets_num = 1 << (IPV4_PREFIX - prefix);
+	address_offsets = mem_new0(uint64_t, (address_offsets_num + 63) / 64);
+	address_pool = ntohl(pool.s_addr) & ~(UINT32_MAX >> prefix);
+
+	INFO("Container subnets are allocated from %s (%d subnets)", subnet_pool,
+	     address_offsets_num);
+
+	c_net_offsets_load();
+	return 0;
+}
+
+/**
+ * Releases the offset at the specified position,
  * indicates that a container releases its addresses.
  */
 static void
 c_net_unset_offset(int offset)
 {
-	ASSERT(offset >= 0 && offset < MAX_NUM_DEVICES);
+	IF_TRUE_RETURN(offset < 0);
+	ASSERT(offset < address_offsets_num);
 	TRACE("Offset %d released by a container", offset);
 
-	address_offsets[offset] = false;
+	address_offsets[offset / 64] &= ~(UINT64_C(1) << (offset % 64));
+
+	for (list_t *l = address_offset_list; l; l = l->next) {
+		c_net_offset_t *o = l->data;
+		if (o->offset != offset)
+			continue;
+		address_offset_list = list_unlink(address_offset_list, l);
+		mem_free0(o->owner);
+		mem_free0(o);
+		break;
+	}
+	c_net_offsets_store();
 }
 
 /**
- * determines first free slot and occupies it. Also responsible for allocating the offsets array.
- * @return failure, return -1, else return first free offset
+ * Returns the offset occupied by owner, -1 if there is none.
  */
 static int
-c_net_set_next_offset(void)
+c_net_offset_lookup(const char *owner)
 {
-	if (!address_offsets) {
-		address_offsets = mem_new0(bool, MAX_NUM_DEVICES);
-		address_offsets[0] = true;
-		TRACE("Offset 0 ocupied by a container");
-		return 0;
+	for (list_t *l = address_offset_list; l; l = l->next) {
+		c_net_offset_t *o = l->data;
+		if (!strcmp(o->owner, owner))
+			return o->offset;
 	}
+	return -1;
+}
 
-	for (int i = 0; i < MAX_NUM_DEVICES; i++) {
-		if (!address_offsets[i]) {
-			TRACE("Offset %d occupied by a container", i);
-			address_offsets[i] = true;
-			return i;
-		}
+/**
+ * Determines the offset for owner and occupies it. An offset which owner held before
+ * a cmld restart is handed out again, otherwise the first free one is taken.
+ * Also responsible for allocating the offsets bitmap.
+ * @return failure, return -1, else return the offset
+ */
+static int
+c_net_set_next_offset(const char *owner)
+{
+	ASSERT(owner);
+
+	if (!address_offsets && c_net_address_pool_init(NULL))
+		return -1;
+
+	int offset = c_net_offset_lookup(owner);
+	if (offset >= 0) {
+		DEBUG("Reusing offset %d of %s", offset, owner);
+		return offset;
+	}
+
+	for (int w = 0; w < (address_offsets_num + 63) / 64; w++) {
+		if (address_offsets[w] == UINT64_MAX)
+			continue;
+
+		int offset = w * 64 + __builtin_ctzll(~address_offsets[w]);
+		if (offset >= address_offsets_num)
+			break;
+
+		c_net_offset_occupy(offset, owner);
+		c_net_offsets_store();
+		return offset;
 	}
 
 	DEBUG("Unable to provide a valid ip address for c_net");
 	return -1;
 }
 
+/**
+ * Returns the address with the given host part inside the subnet of offset.
+ */
+static struct in_addr
+c_net_offset_addr(int offset, uint32_t host)
+{
+	struct in_addr addr = { .s_addr = htonl(address_pool +
+						((uint32_t)offset << (32 - IPV4_PREFIX)) + host) };
+	return addr;
+}
+
 /**
  * This function determines and sets the next available ipv4 address, depending on the container offset.
  * The ipv4 address relates to the ipv4 in the root namespace.
@@ -165,22 +348,11 @@ static int
 c_net_get_next_ipv4_cmld_addr(int offset, struct in_addr *ipv4_addr)
 {
 	ASSERT(ipv4_addr);
+	IF_TRUE_RETVAL_ERROR(offset < 0 || offset >= address_offsets_num, -1);
 
-	char *ipv4_next = mem_printf(IPV4_CMLD_ADDRESS, offset + IPV4_SUBNET_OFFS);
-
-	if (!ipv4_next) {
-		ERROR("failed to allocate ipv4 address string");
-		return -1;
-	}
-
-	if (!inet_aton(ipv4_next, ipv4_addr)) {
-		mem_free0(ipv4_next);
-		ERROR("failed to determine free ip address");
-		return -1;
-	}
+	*ipv4_addr = c_net_offset_addr(offset, IPV4_CMLD_HOST);
 
-	DEBUG("next free ip cmld address is: %s", ipv4_next);
-	mem_free0(ipv4_next);
+	DEBUG("next free ip cmld address is: %s", inet_ntoa(*ipv4_addr));
 	return 0;
 }
 
@@ -212,63 +384,29 @@ static int
 c_net_get_next_ipv4_cont_addr(int offset, struct in_addr *ipv4_addr)
 {
 	ASSERT(ipv4_addr);
+	IF_TRUE_RETVAL_ERROR(offset < 0 || offset >= address_offsets_num, -1);
 
-	char *ipv4_next = mem_printf(IPV4_CONT_ADDRESS, offset + IPV4_SUBNET_OFFS);
-
-	if (!ipv4_next) {
-		ERROR("failed to allocate ipv4 address string");
-		return -1;
-	}
+	*ipv4_addr = c_net_offset_addr(offset, IPV4_CONT_HOST);
 
-	if (!inet_aton(ipv4_next, ipv4_addr)) {
-		mem_free0(ipv4_next);
-		ERROR("failed to determine free ip address");
-		return -1;
-	}
-
-	DEBUG("next free ipv4 container address is: %s", ipv4_next);
-	mem_free0(ipv4_next);
+	DEBUG("next free ipv4 container address is: %s", inet_ntoa(*ipv4_addr));
 	return 0;
 }
 
 /**
  * This function checks if the specified veth name is free.
  * In case it is free, 0 is returned, if it's blocked 1
- * In case of failure, the function returns -1
  */
 static int
 c_net_is_veth_used(const char *if_name)
 {
 	ASSERT(if_name);
 
-	DIR *dirp = opendir(SYS_NET_PATH);
-	struct dirent *dp;
-
-	if (!dirp) {
-		ERROR_ERRNO("failed to open net directory");
-		return -1;
-	}
-
-	/* read the network directory and compare names */
-	while ((dp = readdir(dirp)) != NULL) {
-		char *path = mem_printf("%s/%s", SYS_NET_PATH, dp->d_name);
-
-		TRACE("veth lookup path: %s, name: %s, parameter to match: %s", path, dp->d_name,
-		      if_name);
-
-		if (file_is_link(path)) {
-			if (!strncmp(dp->d_name, if_name, IFNAMSIZ)) {
-				DEBUG("veth %s is occupied", if_name);
-				closedir(dirp);
-				mem_free0(path);
-				return 1;
-			}
-		}
-		mem_free0(path);
+	if (network_interface_exists(if_name)) {
+		DEBUG("veth %s is occupied", if_name);
+		return 1;
 	}
 
 	DEBUG("veth %s is free", if_name);
-	closedir(dirp);
 	return 0;
 }
 
@@ -310,7 +448,7 @@ c_net_create_veth_pair(const char *veth1, const char *veth2, uint8_t veth1_mac[6
 	nl_msg_t *req = NULL;
 
 	/* Open netlink socket */
-	if (!(nl_sock = nl_sock_routing_new())) {
+	if (!(nl_sock = nl_sock_pool_get(NETLINK_ROUTE))) {
 		ERROR("failed to allocate netlink socket");
 		return -1;
 	}
@@ -422,7 +560,7 @@ c_net_set_ipv4(const char *ifi_name, const struct in_addr *ipv4_addr,
 	}
 
 	/* Open netlink socket */
-	if (!(nl_sock = nl_sock_routing_new())) {
+	if (!(nl_sock = nl_sock_pool_get(NETLINK_ROUTE))) {
 		ERROR("failed to allocate netlink socket");
 		return -1;
 	}
@@ -490,36 +628,219 @@ c_net_interface_new(const char *if_name, uint8_t if_mac[6], bool configure)
 	ni->nw_name = mem_printf("%s", if_name);
 	memcpy(ni->veth_mac, if_mac, 6);
 	ni->configure = configure;
-	ni->dhcpd_pid = -1;
 	ni->cont_offset = -1;
 
 	return ni;
 }
 
+static void
+c_net_veth_pool_entry_free(c_net_veth_pool_entry_t *entry)
+{
+	IF_NULL_RETURN(entry);
+	mem_free0(entry->cmld_name);
+	mem_free0(entry->cont_name);
+	mem_free0(entry);
+}
+
+/**
+ * Creates one veth pair with a random local mac for the pool.
+ */
+static int
+c_net_veth_pool_add(void)
+{
+	c_net_veth_pool_entry_t *entry = mem_new0(c_net_veth_pool_entry_t, 1);
+
+	do {
+		mem_free0(entry->cmld_name);
+		mem_free0(entry->cont_name);
+		entry->cmld_name = mem_printf(VETH_POOL_CMLD_NAME, c_net_veth_pool_next_id);
+		entry->cont_name = mem_printf(VETH_POOL_CONT_NAME, c_net_veth_pool_next_id);
+		c_net_veth_pool_next_id++;
+	} while (c_net_is_veth_used(entry->cmld_name) || c_net_is_veth_used(entry->cont_name));
+
+	uint8_t mac[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 };
+	if (file_read("/dev/urandom", (char *)mac, 6) < 0)
+		WARN_ERRNO("Failed to read from /dev/urandom");
+	mac[0] &= 0xfe; /* clear multicast bit */
+	mac[0] |= 0x02; /* set local assignment bit (IEEE802) */
+
+	if (c_net_create_veth_pair(entry->cont_name, entry->cmld_name, mac)) {
+		c_net_veth_pool_entry_free(entry);
+		return -1;
+	}
+
+	TRACE("Added veth pair %s/%s to pool", entry->cont_name, entry->cmld_name);
+	c_net_veth_pool = list_append(c_net_veth_pool, entry);
+	return 0;
+}
+
+static void
+c_net_veth_pool_refill_cb(event_timer_t *timer, UNUSED void *data)
+{
+	if (list_length(c_net_veth_pool) < c_net_veth_pool_size && !c_net_veth_pool_add())
+		return;
+
+	if (list_length(c_net_veth_pool) < c_net_veth_pool_size)
+		WARN("Failed to refill veth pool, %u of %u pairs available",
+		     list_length(c_net_veth_pool), c_net_veth_pool_size);
+
+	event_remove_timer(timer);
+	event_timer_free(timer);
+	c_net_veth_pool_timer = NULL;
+}
+
+/**
+ * Refills the pool in the background, one pair per timer tick, so that
+ * the creation stays out of the critical path of container starts.
+ */
+static void
+c_net_veth_pool_schedule_refill(void)
+{
+	IF_TRUE_RETURN(c_net_veth_pool_timer || !c_net_veth_pool_size);
+
+	c_net_veth_pool_timer =
+		event_timer_new(VETH_POOL_REFILL_INTERVAL, EVENT_TIMER_REPEAT_FOREVER,
+				c_net_veth_pool_refill_cb, NULL);
+	event_add_timer(c_net_veth_pool_timer);
+}
+
+static nl_msg_t *
+c_net_veth_pool_rename_msg_new(const char *ifi_name, const char *new_name, uint8_t mac[6])
+{
+	unsigned int ifi_index = if_nametoindex(ifi_name);
+	IF_FALSE_RETVAL_ERROR(ifi_index, NULL);
+
+	nl_msg_t *req = nl_msg_new();
+	IF_NULL_RETVAL_ERROR(req, NULL);
+
+	struct ifinfomsg link_req = { .ifi_family = AF_INET, .ifi_index = ifi_index };
+
+	IF_TRUE_GOTO_ERROR(nl_msg_set_type(req, RTM_NEWLINK), msg_err);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_flags(req, NLM_F_REQUEST | NLM_F_ACK), msg_err);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_link_req(req, &link_req), msg_err);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_string(req, IFLA_IFNAME, new_name), msg_err);
+	if (mac)
+		IF_TRUE_GOTO_ERROR(nl_msg_add_buffer(req, IFLA_ADDRESS, (char *)mac, 6), msg_err);
+
+	return req;
+
+msg_err:
+	nl_msg_free(req);
+	return NULL;
+}
+
+/**
+ * Takes a pair from the pool and assigns it to the interface by renaming both
+ * endpoints to the names derived from its offset and setting the configured mac
+ * of the container endpoint, all with one netlink round trip.
+ * @return 0 on success, -1 if the pool is empty or the pair could not be assigned
+ */
+static int
+c_net_veth_pool_take(c_net_interface_t *ni)
+{
+	ASSERT(ni);
+
+	c_net_veth_pool_entry_t *entry = list_nth_data(c_net_veth_pool, 0);
+	IF_NULL_RETVAL(entry, -1);
+
+	c_net_veth_pool = list_remove(c_net_veth_pool, entry);
+	c_net_veth_pool_schedule_refill();
+
+	int ret = -1;
+	nl_msg_t *req = NULL;
+	nl_sock_t *nl_sock = nl_sock_pool_get(NETLINK_ROUTE);
+	nl_batch_t *batch = nl_batch_new();
+	IF_NULL_GOTO_ERROR(nl_sock, msg_err);
+
+	req = c_net_veth_pool_rename_msg_new(entry->cmld_name, ni->veth_cmld_name, NULL);
+	IF_TRUE_GOTO_ERROR(!req || nl_batch_add(batch, req) < 0, msg_err);
+	req = c_net_veth_pool_rename_msg_new(entry->cont_name, ni->veth_cont_name, ni->veth_mac);
+	IF_TRUE_GOTO_ERROR(!req || nl_batch_add(batch, req) < 0, msg_err);
+
+	ret = nl_batch_send_kernel_verify(nl_sock, batch);
+	if (ret) {
+		ERROR("Failed to assign pooled veth pair %s/%s", entry->cont_name,
+		      entry->cmld_name);
+		// the pair may be partially renamed, deleting one endpoint removes both
+		if (network_delete_link(c_net_is_veth_used(ni->veth_cmld_name) ?
+						ni->veth_cmld_name :
+						entry->cmld_name))
+			WARN("Failed to destroy pooled veth pair %s", entry->cmld_name);
+	} else {
+		DEBUG("Took pooled veth pair %s/%s as %s/%s", entry->cont_name, entry->cmld_name,
+		      ni->veth_cont_name, ni->veth_cmld_name);
+	}
+	goto out;
+
+msg_err:
+	nl_msg_free(req);
+	if (network_delete_link(entry->cmld_name))
+		WARN("Failed to destroy pooled veth pair %s", entry->cmld_name);
+out:
+	nl_batch_free(batch);
+	nl_sock_free(nl_sock);
+	c_net_veth_pool_entry_free(entry);
+	return ret;
+}
+
+static int
+c_net_veth_pool_delete_stale_cb(UNUSED const char *path, const char *file, UNUSED void *data)
+{
+	if (strncmp(file, VETH_POOL_CMLD_PREFIX, strlen(VETH_POOL_CMLD_PREFIX)))
+		return 0;
+
+	DEBUG("Deleting stale pooled veth pair %s", file);
+	if (network_delete_link(file))
+		WARN("Failed to delete stale pooled veth pair %s", file);
+	return 0;
+}
+
+int
+c_net_veth_pool_init(unsigned int size)
+{
+	c_net_veth_pool_size = size;
+
+	// pairs left behind by a previous cmld instance carry random macs, start over
+	if (dir_foreach(SYS_NET_PATH, c_net_veth_pool_delete_stale_cb, NULL) < 0)
+		WARN("Could not scan %s for stale pooled veth pairs", SYS_NET_PATH);
+
+	IF_FALSE_RETVAL(size, 0);
+
+	INFO("Keeping a pool of %u pre-created veth pairs", size);
+	c_net_veth_pool_schedule_refill();
+	return 0;
+}
+
+void
+c_net_veth_pool_free(void)
+{
+	if (c_net_veth_pool_timer) {
+		event_remove_timer(c_net_veth_pool_timer);
+		event_timer_free(c_net_veth_pool_timer);
+		c_net_veth_pool_timer = NULL;
+	}
+
+	for (list_t *l = c_net_veth_pool; l; l = l->next) {
+		c_net_veth_pool_entry_t *entry = l->data;
+		if (network_delete_link(entry->cmld_name))
+			WARN("Failed to delete pooled veth pair %s", entry->cmld_name);
+		c_net_veth_pool_entry_free(entry);
+	}
+	list_delete(c_net_veth_pool);
+	c_net_veth_pool = NULL;
+	c_net_veth_pool_size = 0;
+}
+
 /*
  * This funtion enables or disables the mac_filter according to param apply
  */
 static int
 c_net_mac_filter(const char *if_name, list_t *mac_whitelist, bool apply)
 {
-	int ret;
-	ret = network_iptables_phys_deny("INPUT", if_name, apply);
-	ret |= network_iptables_phys_deny("FORWARD", if_name, apply);
-	if (ret) {
-		ERROR("Failed to %s deny all on %s", apply ? "apply" : "reset", if_name);
+	if (network_phys_mac_filter(if_name, mac_whitelist, apply)) {
+		ERROR("Failed to %s mac filter on %s", apply ? "apply" : "reset", if_name);
 		return -1;
 	}
-	for (list_t *l = mac_whitelist; l; l = l->next) {
-		uint8_t *mac = l->data;
-		ret = network_phys_allow_mac("INPUT", if_name, mac, apply);
-		ret |= network_phys_allow_mac("FORWARD", if_name, mac, apply);
-		if (ret) {
-			char *mac_str = network_mac_addr_to_str_new(mac);
-			ERROR("Failed to allow %s on %s", mac_str, if_name);
-			mem_free0(mac_str);
-			return -1;
-		}
-	}
 	return 0;
 }
 
@@ -804,6 +1125,7 @@ c_net_new(container_t *container, bool net_ns, list_t *vnet_cfg_list, list_t *pn
 		c_net_interface_t *ni =
 			c_net_interface_new(cfg->vnet_name, cfg->vnet_mac, cfg->configure);
 		ASSERT(ni);
+		ni->qos = cfg->qos;
 		net->interface_list = list_append(net->interface_list, ni);
 
 		TRACE("new c_net_interface_t struct %s was allocated", ni->nw_name);
@@ -853,133 +1175,58 @@ c_net_new(container_t *container, bool net_ns, list_t *vnet_cfg_list, list_t *pn
 	return net;
 }
 
-void
-c_net_udhcpd_sigchld_cb(UNUSED int signum, event_signal_t *sig, void *data)
+/**
+ * Derives the veth names and the addresses of an interface from its offset.
+ */
+static int
+c_net_interface_set_addrs(c_net_interface_t *ni)
 {
-	c_net_interface_t *ni = data;
-	pid_t pid;
-	int status = 0;
-
-	DEBUG("dhcpd SIGCHLD handler called for PID %d", ni->dhcpd_pid);
-	if ((pid = waitpid(ni->dhcpd_pid, &status, WNOHANG)) > 0) {
-		TRACE("Reaped dhcpd process: %d", pid);
-		/* remove the sigchld callback for this container from the event loop */
-		event_remove_signal(sig);
-		event_signal_free(sig);
-		ni->dhcpd_pid = -1;
-	} else {
-		TRACE("Failed to reap dhcpd process");
-	}
-}
+	ni->veth_cmld_name = mem_printf("r_%d", ni->cont_offset);
+	ni->veth_cont_name = mem_printf("c_%d", ni->cont_offset);
 
-static void
-c_net_udhcpd_stop(c_net_interface_t *ni)
-{
-	ASSERT(ni);
-	if (ni->dhcpd_pid > 0) {
-		DEBUG("Stopping dhcpd process with pid=%d!", ni->dhcpd_pid);
-		kill(ni->dhcpd_pid, SIGTERM);
-	}
-}
+	IF_FALSE_RETVAL(ni->configure, 0);
 
-static int
-c_net_udhcpd_start(c_net_interface_t *ni)
-{
-	ASSERT(ni);
+	/* Get root ns ipv4 address */
+	if (c_net_get_next_ipv4_cmld_addr(ni->cont_offset, &ni->ipv4_cmld_addr)) {
+		ERROR("failed to retrieve a root/c0 ns ip address");
+		return -1;
+	}
+	/* set subnet string */
+	uint32_t ip = ntohl(ni->ipv4_cmld_addr.s_addr);
+	uint32_t mask = ~(((uint32_t)-1) >> IPV4_PREFIX);
+	struct in_addr net_prefix = { .s_addr = htonl(ip & mask) };
+	ni->subnet = mem_printf("%s/%d", inet_ntoa(net_prefix), IPV4_PREFIX);
 
-	int bytes_written = -1;
-
-	char *run_dir = mem_printf("/run/udhcpd");
-	char *conf_file = mem_printf("%s/%s.conf", run_dir, ni->veth_cmld_name);
-	char *ipv4_start = mem_printf(IPV4_DHCP_RANGE_START, ni->cont_offset);
-	char *ipv4_end = mem_printf(IPV4_DHCP_RANGE_END, ni->cont_offset);
-	char *lease_file = mem_printf("%s/%s.leases", run_dir, ni->veth_cmld_name);
-	char *pid_file = mem_printf("%s/%s.pid", run_dir, ni->veth_cmld_name);
-
-	// create config dir if not created yet
-	if (dir_mkdir_p(run_dir, 0755) < 0) {
-		DEBUG_ERRNO("Could not mkdir %s", run_dir);
-		goto out;
-	}
-
-	// if running stop dhcpd for this ni
-	if (ni->dhcpd_pid > 0)
-		c_net_udhcpd_stop(ni);
-
-	bytes_written = file_printf(conf_file,
-				    "interface %s\n"
-				    "start %s\n"
-				    "end %s\n"
-				    "option subnet %s\n"
-				    "lease_file %s\n"
-				    "pidfile %s",
-				    ni->veth_cmld_name, ipv4_start, ipv4_end, IPV4_DHCP_MASK,
-				    lease_file, pid_file);
-
-	IF_FALSE_GOTO(bytes_written > 0, out);
-
-	char *dhcpd_argv[] = { "udhcpd", "-f", conf_file, NULL };
-	ni->dhcpd_pid = fork();
-	if (ni->dhcpd_pid == -1) {
-		ERROR_ERRNO("Could not fork '%s' for %s", dhcpd_argv[0], ni->veth_cmld_name);
-		bytes_written = -1;
-	} else if (ni->dhcpd_pid == 0) {
-		INFO("Starting '%s' for %s", dhcpd_argv[0], ni->veth_cmld_name);
-		execvp(dhcpd_argv[0], dhcpd_argv);
-		FATAL_ERRNO("dhcpd: Could not exec '%s'!", dhcpd_argv[0]);
-	} else {
-		event_signal_t *sigchld = event_signal_new(SIGCHLD, c_net_udhcpd_sigchld_cb, ni);
-		event_add_signal(sigchld);
+	/* Get container ns ipv4 address */
+	if (c_net_get_next_ipv4_cont_addr(ni->cont_offset, &ni->ipv4_cont_addr)) {
+		ERROR("failed to retrieve an ip container address");
+		return -1;
 	}
-out:
-	mem_free0(lease_file);
-	mem_free0(pid_file);
-	mem_free0(run_dir);
-	mem_free0(conf_file);
-	mem_free0(ipv4_start);
-	mem_free0(ipv4_end);
-
-	return (bytes_written > 0) ? 0 : -1;
+	/* Get corresponding bcaddress */
+	if (c_net_get_next_ipv4_bcaddr(&ni->ipv4_cont_addr, &ni->ipv4_bc_addr)) {
+		ERROR("failed to retrieve the ip container broadcast address");
+		return -1;
+	}
+	return 0;
 }
 
 static int
-c_net_start_pre_clone_interface(c_net_interface_t *ni)
+c_net_start_pre_clone_interface(c_net_t *net, c_net_interface_t *ni)
 {
-	ASSERT(ni);
+	ASSERT(net && ni);
 
 	/* Get container offset based on currently started containers */
-	if ((ni->cont_offset = c_net_set_next_offset()) == -1) {
+	char *owner =
+		mem_printf("%s/%s", uuid_string(container_get_uuid(net->container)), ni->nw_name);
+	ni->cont_offset = c_net_set_next_offset(owner);
+	mem_free0(owner);
+	if (ni->cont_offset == -1) {
 		WARN_ERRNO("Maximum offset for Network interfaces reached!");
 		goto err;
 	}
 
-	ni->dhcpd_pid = -1;
-	ni->veth_cmld_name = mem_printf("r_%d", ni->cont_offset);
-	ni->veth_cont_name = mem_printf("c_%d", ni->cont_offset);
-
-	if (ni->configure) {
-		/* Get root ns ipv4 address */
-		if (c_net_get_next_ipv4_cmld_addr(ni->cont_offset, &ni->ipv4_cmld_addr)) {
-			ERROR("failed to retrieve a root/c0 ns ip address");
-			goto err;
-		}
-		/* set subnet string */
-		uint32_t ip = ntohl(ni->ipv4_cmld_addr.s_addr);
-		uint32_t mask = ~(((uint32_t)-1) >> IPV4_PREFIX);
-		struct in_addr net_prefix = { .s_addr = htonl(ip & mask) };
-		ni->subnet = mem_printf("%s/%d", inet_ntoa(net_prefix), IPV4_PREFIX);
-
-		/* Get container ns ipv4 address */
-		if (c_net_get_next_ipv4_cont_addr(ni->cont_offset, &ni->ipv4_cont_addr)) {
-			ERROR("failed to retrieve an ip container address");
-			goto err;
-		}
-		/* Get corresponding bcaddress */
-		if (c_net_get_next_ipv4_bcaddr(&ni->ipv4_cont_addr, &ni->ipv4_bc_addr)) {
-			ERROR("failed to retrieve the ip container broadcast address");
-			goto err;
-		}
-	}
+	if (c_net_interface_set_addrs(ni))
+		goto err;
 
 	/* Create free veth pair from container name, check if the interfaces are free */
 	if (c_net_is_veth_used(ni->veth_cmld_name)) {
@@ -996,16 +1243,17 @@ c_net_start_pre_clone_interface(c_net_interface_t *ni)
 	/* Start with second step: create veth pair, set root ns ipv4 add, bring the interface up */
 	DEBUG("Create veth pair %s/%s", ni->veth_cont_name, ni->veth_cmld_name);
 
-	/* Create veth pair */
-	if (c_net_create_veth_pair(ni->veth_cont_name, ni->veth_cmld_name, ni->veth_mac))
+	/* Take a pre-created veth pair from the pool or create a new one */
+	if (c_net_veth_pool_take(ni) &&
+	    c_net_create_veth_pair(ni->veth_cont_name, ni->veth_cmld_name, ni->veth_mac))
 		goto err;
 
 	return 0;
 
 	/* In case of an error, release the current offset */
 err:
-	if (ni->cont_offset >= 0)
-		c_net_unset_offset(ni->cont_offset);
+	c_net_unset_offset(ni->cont_offset);
+	ni->cont_offset = -1;
 	if (ni->veth_cmld_name) {
 		// delete veth pair if it was created!
 		if (c_net_is_veth_used(ni->veth_cmld_name)) {
@@ -1048,7 +1296,7 @@ c_net_start_pre_clone(c_net_t *net)
 	for (list_t *l = net->interface_list; l; l = l->next) {
 		c_net_interface_t *ni = l->data;
 
-		if (c_net_start_pre_clone_interface(ni) == -1)
+		if (c_net_start_pre_clone_interface(net, ni) == -1)
 			return -1;
 		if (!ni->configure)
 			continue;
@@ -1056,6 +1304,40 @@ c_net_start_pre_clone(c_net_t *net)
 	return 0;
 }
 
+/**
+ * Shapes the traffic towards the container on the root ns endpoint of its veth, and
+ * polices, marks and prioritizes the traffic from the container when it is forwarded.
+ * Both are enforced outside of the container's netns, so that it cannot lift them.
+ */
+static int
+c_net_setup_qos(const c_net_interface_t *ni, bool enable)
+{
+	ASSERT(ni);
+
+	int dscp = ni->qos.dscp;
+	unsigned int prio = 0;
+
+	switch (ni->qos.prio) {
+	case CONTAINER_NET_PRIO_BULK:
+		dscp = dscp < 0 ? DSCP_BULK : dscp;
+		prio = TC_PRIO_BULK;
+		break;
+	case CONTAINER_NET_PRIO_INTERACTIVE:
+		dscp = dscp < 0 ? DSCP_INTERACTIVE : dscp;
+		prio = TC_PRIO_INTERACTIVE;
+		break;
+	default:
+		break;
+	}
+
+	// the qdiscs are removed together with the veth
+	if (enable && network_set_egress_rate(ni->veth_cmld_name, ni->qos.download_rate))
+		return -1;
+
+	return network_setup_qos(ni->veth_cmld_name, ni->subnet, ni->qos.upload_rate, dscp, prio,
+				 enable);
+}
+
 static int
 c_net_start_post_clone_interface(pid_t pid, c_net_interface_t *ni)
 {
@@ -1082,25 +1364,11 @@ c_net_start_post_clone_interface(pid_t pid, c_net_interface_t *ni)
 	return 0;
 }
 
-void
-c_net_helper_sigchild_cb(UNUSED int signum, event_signal_t *sig, void *data)
+static void
+c_net_helper_child_cb(pid_t pid, UNUSED int status, event_child_t *child, UNUSED void *data)
 {
-	pid_t *c0_netns_pid = data;
-	pid_t pid;
-	int status = 0;
-
-	ASSERT(c0_netns_pid);
-
-	TRACE("cmld's c0 netns helper SIGCHLD handler called for PID %d", *c0_netns_pid);
-	if ((pid = waitpid(*c0_netns_pid, &status, WNOHANG)) > 0) {
-		TRACE("Reaped c0 netns helper process: %d", pid);
-		/* remove the sigchld callback for this container from the event loop */
-		event_remove_signal(sig);
-		event_signal_free(sig);
-		mem_free0(c0_netns_pid);
-	} else {
-		TRACE("Failed to reap c0 netns helper process");
-	}
+	TRACE("Reaped c0 netns helper process: %d", pid);
+	event_child_free(child);
 }
 
 /**
@@ -1165,13 +1433,11 @@ c_net_start_post_clone(c_net_t *net)
 	}
 
 	// configure moved rootns veth endpoint in c0's network namespace
-	pid_t *c0_netns_pid = mem_new0(pid_t, 1);
-	*c0_netns_pid = fork();
-	if (*c0_netns_pid == -1) {
+	pid_t c0_netns_pid = fork();
+	if (c0_netns_pid == -1) {
 		ERROR_ERRNO("Could not fork for switching to c0's netns");
-		mem_free0(c0_netns_pid);
 		return -1;
-	} else if (*c0_netns_pid == 0) {
+	} else if (c0_netns_pid == 0) {
 		const char *hostns = cmld_containers_get_c0() ? "c0" : "CML";
 
 		DEBUG("Configuring netifs in %s", hostns);
@@ -1223,9 +1489,9 @@ c_net_start_post_clone(c_net_t *net)
 				FATAL_ERRNO("Could not setup masquerading for %s!",
 					    ni->veth_cmld_name);
 
-			/* Start busybox' dhcpd server for veth */
-			if (c_net_udhcpd_start(ni))
-				FATAL_ERRNO("Could not start udhcpd!");
+			/* Rate limits and priority, inserted before the forwarding rules */
+			if (c_net_setup_qos(ni, true))
+				WARN("Could not setup QoS for %s!", ni->veth_cmld_name);
 
 			DEBUG("Successfully configured %s in %s, wait for child to exit.",
 			      ni->veth_cmld_name, hostns);
@@ -1233,11 +1499,11 @@ c_net_start_post_clone(c_net_t *net)
 		DEBUG("Setup of net ifs in netns of %s done, exiting netns child!", hostns);
 		exit(0);
 	} else {
-		DEBUG("Setup of nis should be done by pid=%d", *c0_netns_pid);
-		// register new sigchild handler for helper clone in netns of c0
-		event_signal_t *sig =
-			event_signal_new(SIGCHLD, c_net_helper_sigchild_cb, c0_netns_pid);
-		event_add_signal(sig);
+		DEBUG("Setup of nis should be done by pid=%d", c0_netns_pid);
+		// reap the helper clone in netns of c0 once it exits
+		event_child_t *child = event_child_new(c0_netns_pid, c_net_helper_child_cb, NULL);
+		if (event_add_child(child) < 0)
+			event_child_free(child);
 
 		/* setup uplink of cml */
 		c_net_interface_t *ni = list_nth_data(net->interface_list, 0);
@@ -1256,6 +1522,20 @@ c_net_start_post_clone(c_net_t *net)
 				ERROR("Failed to setup gateway for CML's uplink");
 			// TODO firewall connections to cml
 		}
+
+		/* Serve dhcp for the container endpoints from cmld's event loop */
+		pid_t netns_pid = (cmld_containers_get_c0() && pid != pid_c0) ? pid_c0 : 0;
+		for (list_t *l = net->interface_list; l; l = l->next) {
+			ni = l->data;
+			if (!ni->configure || !strcmp(ni->nw_name, CML_UPLINK_INTERFACE_NAME))
+				continue;
+
+			dhcpd_free(ni->dhcpd);
+			ni->dhcpd = dhcpd_new(netns_pid, ni->veth_cmld_name, &ni->ipv4_cmld_addr,
+					      &ni->ipv4_cont_addr, IPV4_PREFIX);
+			if (!ni->dhcpd)
+				WARN("Could not serve dhcp on %s", ni->veth_cmld_name);
+		}
 	}
 
 	// bind netns to file
@@ -1270,6 +1550,59 @@ c_net_start_post_clone(c_net_t *net)
 	return 0;
 }
 
+/**
+ * Restores the interfaces of a running container from the offsets which the previous
+ * cmld instance stored, as names and addresses are derived from them. The veths, routes
+ * and firewall rules are still in place, only the dhcp responders are started again.
+ */
+int
+c_net_reattach(c_net_t *net)
+{
+	ASSERT(net);
+
+	IF_FALSE_RETVAL(net->ns_net, 0);
+
+	pid_t pid = container_get_pid(net->container);
+	pid_t pid_c0 = cmld_containers_get_c0() ? container_get_pid(cmld_containers_get_c0()) : 0;
+	pid_t netns_pid = (cmld_containers_get_c0() && pid != pid_c0) ? pid_c0 : 0;
+
+	for (list_t *l = net->interface_list; l; l = l->next) {
+		c_net_interface_t *ni = l->data;
+
+		char *owner = mem_printf("%s/%s", uuid_string(container_get_uuid(net->container)),
+					 ni->nw_name);
+		ni->cont_offset = c_net_offset_lookup(owner);
+		mem_free0(owner);
+		if (ni->cont_offset < 0) {
+			ERROR("No stored network offset for %s of container %s", ni->nw_name,
+			      container_get_description(net->container));
+			return -1;
+		}
+
+		if (c_net_interface_set_addrs(ni))
+			return -1;
+
+		if (ni->cont_offset == 0 && hardware_get_radio_ifname()) {
+			mem_free0(ni->veth_cmld_name);
+			ni->veth_cmld_name = mem_strdup(hardware_get_radio_ifname());
+		}
+
+		if (!ni->configure || !strcmp(ni->nw_name, CML_UPLINK_INTERFACE_NAME))
+			continue;
+
+		ni->dhcpd = dhcpd_new(netns_pid, ni->veth_cmld_name, &ni->ipv4_cmld_addr,
+				      &ni->ipv4_cont_addr, IPV4_PREFIX);
+		if (!ni->dhcpd)
+			WARN("Could not serve dhcp on %s", ni->veth_cmld_name);
+	}
+
+	net->fd_netns = open(net->ns_path, O_RDONLY);
+	if (net->fd_netns < 0)
+		WARN_ERRNO("Could not open bound netns %s", net->ns_path);
+
+	return 0;
+}
+
 static int
 c_net_start_child_interface(c_net_interface_t *ni)
 {
@@ -1347,7 +1680,6 @@ c_net_cleanup_interface(c_net_interface_t *ni)
 	ASSERT(ni);
 
 	DEBUG("shut network interface %s down", ni->veth_cont_name);
-	c_net_udhcpd_stop(ni);
 
 	/* shut the network interface down */
 	// check if iface was allready destroyed by kernel
@@ -1361,9 +1693,6 @@ c_net_cleanup_interface(c_net_interface_t *ni)
 
 	TRACE("cleanup c_net_t structure");
 
-	/* Release the offset, as the ip addresses are no more occupied */
-	c_net_unset_offset(ni->cont_offset);
-
 	if (ni->subnet) {
 		mem_free0(ni->subnet);
 		ni->subnet = NULL;
@@ -1391,13 +1720,11 @@ c_net_cleanup_c0(c_net_t *net)
 	ASSERT(net);
 
 	// cleanup moved rootns veth endpoint in c0's network namespace
-	pid_t *c0_netns_pid = mem_new0(pid_t, 1);
-	*c0_netns_pid = fork();
-	if (*c0_netns_pid == -1) {
+	pid_t c0_netns_pid = fork();
+	if (c0_netns_pid == -1) {
 		ERROR_ERRNO("Could not fork for switching to c0's netns");
-		mem_free0(c0_netns_pid);
 		return -1;
-	} else if (*c0_netns_pid == 0) {
+	} else if (c0_netns_pid == 0) {
 		const char *hostns = cmld_containers_get_c0() ? "c0" : "CML";
 
 		DEBUG("Cleaning up netifs in %s", hostns);
@@ -1422,17 +1749,19 @@ c_net_cleanup_c0(c_net_t *net)
 			}
 			if (network_setup_masquerading(ni->subnet, false))
 				WARN("Failed to remove masquerading from %s", ni->subnet);
+			if (c_net_setup_qos(ni, false))
+				WARN("Failed to remove QoS from %s", ni->subnet);
 
 			c_net_cleanup_interface(ni);
 		}
 		DEBUG("Cleanup of net ifs in netns of %s done, exiting netns child!", hostns);
 		exit(0);
 	} else {
-		DEBUG("Cleanup of ni ifs should be done by pid=%d", *c0_netns_pid);
-		// register new sigchild handler for helper clone in netns of c0
-		event_signal_t *sig =
-			event_signal_new(SIGCHLD, c_net_helper_sigchild_cb, c0_netns_pid);
-		event_add_signal(sig);
+		DEBUG("Cleanup of ni ifs should be done by pid=%d", c0_netns_pid);
+		// reap the helper clone in netns of c0 once it exits
+		event_child_t *child = event_child_new(c0_netns_pid, c_net_helper_child_cb, NULL);
+		if (event_add_child(child) < 0)
+			event_child_free(child);
 	}
 	return 0;
 }
@@ -1480,6 +1809,15 @@ c_net_cleanup(c_net_t *net, bool is_rebooting)
 
 	if (c_net_cleanup_c0(net) == -1)
 		WARN("Failed to create helper child for cleanup in c0's netns");
+
+	/* Release offsets and dhcp responders here, as the helper child only cleans up its copy */
+	for (list_t *l = net->interface_list; l; l = l->next) {
+		c_net_interface_t *ni = l->data;
+		dhcpd_free(ni->dhcpd);
+		ni->dhcpd = NULL;
+		c_net_unset_offset(ni->cont_offset);
+		ni->cont_offset = -1;
+	}
 }
 
 /**
@@ -1492,6 +1830,7 @@ c_net_free_interface(c_net_interface_t *ni)
 
 	if (ni->subnet)
 		mem_free0(ni->subnet);
+	dhcpd_free(ni->dhcpd);
 	mem_free0(ni->veth_cmld_name);
 	mem_free0(ni->veth_cont_name);
 	mem_free0(ni->nw_name);
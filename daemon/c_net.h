@@ -65,6 +65,13 @@ c_net_start_pre_clone(c_net_t *net);
 int
 c_net_start_post_clone(c_net_t *net);
 
+/**
+ * Takes over the network configuration of a running container from a previous
+ * cmld instance.
+ */
+int
+c_net_reattach(c_net_t *net);
+
 /**
  * In the container's namespace, the container veth is configured
  * This Function is part of TSF.CML.CompartmentIsolation.
@@ -123,4 +130,31 @@ c_net_get_interface_mapping_new(c_net_t *net);
 int
 c_net_join_netns(const c_net_t *net);
 
+/**
+ * Sets the pool of IPv4 subnets from which container interfaces get their own
+ * /24 subnet and restores the subnets still occupied before a cmld restart.
+ * @param subnet_pool pool in CIDR notation with a prefix between 8 and 24, NULL for
+ * the built-in default
+ * @return 0 on success, -1 if the pool is invalid
+ */
+int
+c_net_address_pool_init(const char *subnet_pool);
+
+/**
+ * Initializes the pool of pre-created veth pairs which container starts take
+ * instead of creating a pair on their critical path. The pool is filled and
+ * replenished in the background from the event loop. Stale pairs of a previous
+ * cmld instance are removed.
+ * @param size number of pairs to keep available, 0 disables the pool
+ * @return 0 on success, -1 on error
+ */
+int
+c_net_veth_pool_init(unsigned int size);
+
+/**
+ * Deletes all pooled veth pairs and stops replenishing the pool.
+ */
+void
+c_net_veth_pool_free(void);
+
 #endif /* C_NET_H */
@@ -27,131 +27,138 @@
  * Unit Test for c_net.c. Tests the offset and address retrievel functionality, which
  * must be given to ensure that containers obtain and free correct adresses and devices.
  */
+#define _GNU_SOURCE
+
 #include "common/list.h"
 #include "container.stub.h"
+
+// keep the occupied offsets of the test away from a running cmld
+#define IPV4_OFFSETS_FILE "/tmp/c_net.test.offsets"
 #include "c_net.c"
 
+static void
+check_addresses(c_net_interface_t *ni, int subnet)
+{
+	ASSERT(c_net_get_next_ipv4_cmld_addr(ni->cont_offset, &ni->ipv4_cmld_addr) == 0);
+	ASSERT(c_net_get_next_ipv4_cont_addr(ni->cont_offset, &ni->ipv4_cont_addr) == 0);
+	ASSERT(c_net_get_next_ipv4_bcaddr(&ni->ipv4_cont_addr, &ni->ipv4_bc_addr) == 0);
+
+	char *cmld_ip_string = mem_printf("127.1.%d.1", subnet);
+	char *cont_ip_string = mem_printf("127.1.%d.2", subnet);
+	char *bc_ip_string = mem_printf("127.1.%d.255", subnet);
+
+	char *real_cmld_ip_string = mem_strdup(inet_ntoa(ni->ipv4_cmld_addr));
+	char *real_cont_ip_string = mem_strdup(inet_ntoa(ni->ipv4_cont_addr));
+	char *real_bc_ip_string = mem_strdup(inet_ntoa(ni->ipv4_bc_addr));
+	DEBUG("cmld ip: expected %s vs %s; cont ip: expected %s vs %s; bc ip: expected %s vs %s",
+	      cmld_ip_string, real_cmld_ip_string, cont_ip_string, real_cont_ip_string,
+	      bc_ip_string, real_bc_ip_string);
+
+	ASSERT(!strcmp(cmld_ip_string, real_cmld_ip_string));
+	ASSERT(!strcmp(cont_ip_string, real_cont_ip_string));
+	ASSERT(!strcmp(bc_ip_string, real_bc_ip_string));
+
+	mem_free0(real_cmld_ip_string);
+	mem_free0(real_cont_ip_string);
+	mem_free0(real_bc_ip_string);
+	mem_free0(cmld_ip_string);
+	mem_free0(cont_ip_string);
+	mem_free0(bc_ip_string);
+}
+
 int
 main(void)
 {
 	logf_register(&logf_test_write, stdout);
 	DEBUG("Unit Test: c_net.test.c");
 
-	DEBUG("Create a first container without namespace and do the common network setup");
+	unlink(IPV4_OFFSETS_FILE);
+	ASSERT(c_net_address_pool_init("127.1.0.0/16") == 0);
 
-	list_t *nw_name_list = NULL;
+	DEBUG("Create a first container without namespace and do the common network setup");
 
 	// this functions must work for a0, as it has no network namespace, i.e.
 	// the functions should return immediately.
 	container_t *cont0 = container_stub_new("a0");
-	c_net_t *net0 = c_net_new(cont0, false, nw_name_list, 0);
+	c_net_t *net0 = c_net_new(cont0, false, NULL, NULL);
 	ASSERT(net0);
 
 	ASSERT(c_net_start_pre_clone(net0) == 0);
 	ASSERT(c_net_start_post_clone(net0) == 0);
 	//ASSERT(c_net_start_child(net0) == 0); (should not be run on host)
-	c_net_cleanup(net0);
+	c_net_cleanup(net0, false);
 
-	DEBUG("Create a second container with network namespace and check offset and ip");
-	container_t *cont1 = container_stub_new("a1");
+	DEBUG("Create interfaces of two containers and check offsets and ips");
 
-	nw_name_list = list_append(nw_name_list, "wlan0");
-	c_net_t *net1 = c_net_new(cont1, true, nw_name_list, 0);
-	ASSERT(net1);
+	uint8_t mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+	c_net_interface_t *ni1 = c_net_interface_new("eth0", mac, true);
+	c_net_interface_t *ni2 = c_net_interface_new("eth0", mac, true);
+	ASSERT(ni1 && ni2);
 
-	// set and verify offset
-	list_t *nil1 = list_tail(net1->interface_list);
-	c_net_interface_t *ni1 = nil1->data;
-	ni1->cont_offset = c_net_set_next_offset();
+	// offsets are handed out from the start of the pool
+	ni1->cont_offset = c_net_set_next_offset("a1/eth0");
 	ASSERT(ni1->cont_offset == 0);
+	check_addresses(ni1, 0);
 
-	// get ip information for cont1
-	ASSERT(c_net_get_next_ipv4_cmld_addr(ni1->cont_offset, &ni1->ipv4_cmld_addr) == 0);
-	ASSERT(c_net_get_next_ipv4_cont_addr(ni1->cont_offset, &ni1->ipv4_cont_addr) == 0);
-	ASSERT(c_net_get_next_ipv4_bcaddr(&ni1->ipv4_cont_addr, &ni1->ipv4_bc_addr) == 0);
-
-	// check ip information of cont1
-	char *cmld_ip_string = mem_printf(IPV4_CMLD_ADDRESS, IPV4_SUBNET_OFFS);
-	char *cont_ip_string = mem_printf(IPV4_CONT_ADDRESS, IPV4_SUBNET_OFFS);
-
-	// assumption that 127.1. is defined. If define changes in c_net.c, this must be adapted
-	char *bc_ip_string = mem_printf("127.1.%d.255", IPV4_SUBNET_OFFS);
-
-	char *real_cmld_ip_string = mem_strdup(inet_ntoa(ni1->ipv4_cmld_addr));
-	char *real_cont_ip_string = mem_strdup(inet_ntoa(ni1->ipv4_cont_addr));
-	char *real_bc_ip_string = mem_strdup(inet_ntoa(ni1->ipv4_bc_addr));
-	DEBUG("cmld ip: expected %s vs %s; cont ip: expected %s vs %s; bc ip: expected %s vs %s",
-	      cmld_ip_string, real_cmld_ip_string, cont_ip_string, real_cont_ip_string,
-	      bc_ip_string, real_bc_ip_string);
-
-	ASSERT(!strncmp(cmld_ip_string, real_cmld_ip_string, strlen(cmld_ip_string)));
-	ASSERT(!strncmp(cont_ip_string, real_cont_ip_string, strlen(cont_ip_string)));
-	ASSERT(!strncmp(bc_ip_string, real_bc_ip_string, strlen(bc_ip_string)));
-
-	DEBUG("Create a third container with namespace and check ip and offsets");
-
-	container_t *cont3 = container_stub_new("a2");
-	c_net_t *net3 = c_net_new(cont3, true, nw_name_list, 0);
-	ASSERT(net3);
-
-	// third container, but second one with nw namespace, i.e. offset is 1
-	list_t *nil3 = list_tail(net3->interface_list);
-	c_net_interface_t *ni3 = nil3->data;
-	ASSERT(ni3);
-
-	ni3->cont_offset = c_net_set_next_offset();
-	ASSERT(ni3->cont_offset == 1);
-
-	ASSERT(c_net_get_next_ipv4_cmld_addr(ni3->cont_offset, &ni3->ipv4_cmld_addr) == 0);
-	ASSERT(c_net_get_next_ipv4_cont_addr(ni3->cont_offset, &ni3->ipv4_cont_addr) == 0);
-	ASSERT(c_net_get_next_ipv4_bcaddr(&ni3->ipv4_cont_addr, &ni3->ipv4_bc_addr) == 0);
-
-	cmld_ip_string = mem_printf(IPV4_CMLD_ADDRESS, IPV4_SUBNET_OFFS + 1);
-	cont_ip_string = mem_printf(IPV4_CONT_ADDRESS, IPV4_SUBNET_OFFS + 1);
-	// assumption that 127.1. is defined. If define changes in c_net.c, this must be adapted
-	bc_ip_string = mem_printf("127.1.%d.255", IPV4_SUBNET_OFFS + 1);
-
-	real_cmld_ip_string = mem_strdup(inet_ntoa(ni3->ipv4_cmld_addr));
-	real_cont_ip_string = mem_strdup(inet_ntoa(ni3->ipv4_cont_addr));
-	real_bc_ip_string = mem_strdup(inet_ntoa(ni3->ipv4_bc_addr));
-	DEBUG("cmld ip: expected %s vs %s; cont ip: expected %s vs %s; bc ip: expected %s vs %s",
-	      cmld_ip_string, real_cmld_ip_string, cont_ip_string, real_cont_ip_string,
-	      bc_ip_string, real_bc_ip_string);
-
-	ASSERT(!strncmp(cmld_ip_string, real_cmld_ip_string, strlen(cmld_ip_string)));
-	ASSERT(!strncmp(cont_ip_string, real_cont_ip_string, strlen(cont_ip_string)));
-	ASSERT(!strncmp(bc_ip_string, real_bc_ip_string, strlen(bc_ip_string)));
+	ni2->cont_offset = c_net_set_next_offset("a2/eth0");
+	ASSERT(ni2->cont_offset == 1);
+	check_addresses(ni2, 1);
 
 	DEBUG("Check offset functionality");
 
-	// shut down a container. in reality, a0 shouldn't be shut down
-	// however, this is only to test offsets
-	c_net_unset_offset(ni1->cont_offset);
-
-	// offset 0 should be free now
-	ASSERT(c_net_set_next_offset() == 0);
+	// an owner which already holds an offset gets it again
+	ASSERT(c_net_set_next_offset("a1/eth0") == 0);
+	ASSERT(c_net_set_next_offset("a2/eth0") == 1);
 
-	ASSERT(c_net_set_next_offset() == 2);
-	ASSERT(c_net_set_next_offset() == 3);
+	// a released offset is the first free one again
+	c_net_unset_offset(ni1->cont_offset);
+	ASSERT(c_net_set_next_offset("a3/eth0") == 0);
+	ASSERT(c_net_set_next_offset("a1/eth0") == 2);
+
+	// free offsets are found beyond the first word of the bitmap
+	for (int i = 3; i < 130; i++) {
+		char *owner = mem_printf("b%d/eth0", i);
+		ASSERT(c_net_set_next_offset(owner) == i);
+		mem_free0(owner);
+	}
+	c_net_unset_offset(65);
+	c_net_unset_offset(100);
+	ASSERT(c_net_set_next_offset("c1/eth0") == 65);
+	ASSERT(c_net_set_next_offset("c2/eth0") == 100);
+	ASSERT(c_net_set_next_offset("c3/eth0") == 130);
+
+	DEBUG("Check that occupied offsets survive a restart of cmld");
+
+	// reinitializing the pool restores the offsets and their owners from the file
+	ASSERT(c_net_address_pool_init("127.1.0.0/16") == 0);
+	ASSERT(c_net_set_next_offset("c1/eth0") == 65);
+	ASSERT(c_net_set_next_offset("a3/eth0") == 0);
+	ASSERT(c_net_set_next_offset("c4/eth0") == 131);
+
+	DEBUG("Check exhaustion of a small pool");
+
+	unlink(IPV4_OFFSETS_FILE);
+	ASSERT(c_net_address_pool_init("127.1.0.0/22") == 0);
+	for (int i = 0; i < 4; i++) {
+		char *owner = mem_printf("d%d/eth0", i);
+		ASSERT(c_net_set_next_offset(owner) == i);
+		mem_free0(owner);
+	}
+	ASSERT(c_net_set_next_offset("d4/eth0") == -1);
 	c_net_unset_offset(2);
-	ASSERT(c_net_set_next_offset() == 2);
-	ASSERT(c_net_set_next_offset() == 4);
+	ASSERT(c_net_set_next_offset("d4/eth0") == 2);
+
+	// offsets outside of the pool have no addresses
+	ni1->cont_offset = 4;
+	ASSERT(c_net_get_next_ipv4_cmld_addr(ni1->cont_offset, &ni1->ipv4_cmld_addr) == -1);
 
 	DEBUG("offset checking done");
 
-	list_delete(nw_name_list);
-	mem_free0(real_cmld_ip_string);
-	mem_free0(real_cont_ip_string);
-	mem_free0(real_bc_ip_string);
-	mem_free0(cmld_ip_string);
-	mem_free0(cont_ip_string);
-	mem_free0(bc_ip_string);
+	unlink(IPV4_OFFSETS_FILE);
+	c_net_free_interface(ni1);
+	c_net_free_interface(ni2);
 	container_free(cont0);
 	c_net_free(net0);
-	container_free(cont1);
-	c_net_free(net1);
-	container_free(cont3);
-	c_net_free(net3);
 
 	return 0;
 }
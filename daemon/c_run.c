@@ -52,10 +52,34 @@
 //TODO define in container.h?
 #define CLONE_STACK_SIZE 8192
 
-typedef struct c_run_session {
+// buffer of each direction of a PTY session
+#define C_RUN_RELAY_BUF_SIZE (64 * 1024)
+// bytes relayed per wakeup before other events get their turn
+#define C_RUN_RELAY_MAX_PER_WAKEUP (4 * C_RUN_RELAY_BUF_SIZE)
+
+typedef struct c_run_session c_run_session_t;
+
+/*
+ * Copies data from one fd to another without blocking. While the destination does not
+ * accept more data, the relay waits for it to become writable instead of reading more.
+ */
+typedef struct c_run_relay {
+	c_run_session_t *session;
+	int from_fd;
+	int to_fd;
+	event_io_t *io; // watches from_fd for reading or to_fd for writing
+	int io_fd;
+	char *buf;
+	size_t len; // bytes in buf
+	size_t off; // bytes of buf already written
+} c_run_relay_t;
+
+struct c_run_session {
 	c_run_t *run;
-	int fd;
+	int fd;		  // control connection which started the session
+	uint32_t channel; // exec channel on that connection, 0 if not multiplexed
 	pid_t active_exec_pid;
+	event_child_t *child; // reaps active_exec_pid
 	int console_sock_cmld;
 	int console_sock_container;
 	int pty_master;
@@ -65,7 +89,9 @@ typedef struct c_run_session {
 	char *cmd;
 	ssize_t argc;
 	char **argv;
-} c_run_session_t;
+	c_run_relay_t *relay_out; // pty master -> console socket
+	c_run_relay_t *relay_in;  // console socket -> pty master
+};
 
 struct c_run {
 	container_t *container;
@@ -83,7 +109,7 @@ c_run_new(container_t *container)
 
 c_run_session_t *
 c_run_session_new(c_run_t *run, int create_pty, char *cmd, ssize_t argc, char **argv,
-		  int session_fd)
+		  int session_fd, uint32_t channel)
 {
 	if (argv == NULL || argc < 1) {
 		ERROR("No command was specified to execute.");
@@ -101,6 +127,7 @@ c_run_session_new(c_run_t *run, int create_pty, char *cmd, ssize_t argc, char **
 
 	c_run_session_t *session = mem_new0(c_run_session_t, 1);
 	session->fd = session_fd;
+	session->channel = channel;
 	session->run = run;
 	session->pty_master = -1;
 	session->active_exec_pid = -1;
@@ -133,10 +160,30 @@ c_run_session_new(c_run_t *run, int create_pty, char *cmd, ssize_t argc, char **
 	return session;
 }
 
+static void
+c_run_relay_free(c_run_relay_t *relay);
+
+static void
+c_run_orphan_child_cb(pid_t pid, UNUSED int status, event_child_t *child, UNUSED void *data)
+{
+	TRACE("Reaped injected process %d of a closed session", pid);
+	event_child_free(child);
+}
+
 void
 c_run_session_free(c_run_session_t *session)
 {
 	ASSERT(session);
+	if (session->child) {
+		/* the process was killed on cleanup, reap it without the session */
+		event_child_free(session->child);
+		event_child_t *orphan = event_child_new(session->active_exec_pid,
+							c_run_orphan_child_cb, NULL);
+		if (event_add_child(orphan) < 0)
+			event_child_free(orphan);
+	}
+	c_run_relay_free(session->relay_out);
+	c_run_relay_free(session->relay_in);
 	if (session->cmd)
 		mem_free0(session->cmd);
 	if (session->pty_slave_name)
@@ -217,99 +264,55 @@ do_clone(int (*func)(void *), unsigned long flags, void *data)
 }
 
 static c_run_session_t *
-c_run_get_session_by_fd(const c_run_t *run, int session_fd)
+c_run_get_session(const c_run_t *run, int session_fd, uint32_t channel)
 {
 	for (list_t *l = run->sessions; l; l = l->next) {
 		c_run_session_t *session = l->data;
-		if (session_fd == session->fd)
+		if (session_fd == session->fd && channel == session->channel)
 			return session;
 	}
-	ERROR("Session for fd=%d does not exist!", session_fd);
+	ERROR("Session for fd=%d, channel=%u does not exist!", session_fd, channel);
 	return NULL;
 }
 
 int
-c_run_get_console_sock_cmld(const c_run_t *run, int session_fd)
+c_run_get_console_sock_cmld(const c_run_t *run, int session_fd, uint32_t channel)
 {
 	ASSERT(run);
-	c_run_session_t *session = c_run_get_session_by_fd(run, session_fd);
+	c_run_session_t *session = c_run_get_session(run, session_fd, channel);
 	IF_NULL_RETVAL(session, -1);
 
 	return session->console_sock_cmld;
 }
 
-int
-c_run_write_exec_input(const c_run_t *run, char *exec_input, int session_fd)
-{
-	ASSERT(run);
-	c_run_session_t *session = c_run_get_session_by_fd(run, session_fd);
-	IF_NULL_RETVAL(session, -1);
-
-	if (session->active_exec_pid != -1) {
-		TRACE("Write message \"%s\" to fd: %d", exec_input, session->console_sock_cmld);
-		return write(session->console_sock_cmld, exec_input, strlen(exec_input));
-	} else {
-		WARN("Currently no process executing. Can't write input");
-		return -1;
-	}
-}
-
-void
-c_run_sigchld_cb(UNUSED int signum, event_signal_t *sig, void *data)
+static void
+c_run_child_cb(pid_t pid, int status, event_child_t *child, void *data)
 {
 	c_run_session_t *session = data;
-
 	c_run_t *run = session->run;
-	if (NULL == run) {
-		// cleanup of c_run subsystem already done just remove signal handler
-		TRACE("SIGCHLD handler called for already dead c_run session");
-		event_remove_signal(sig);
-		event_signal_free(sig);
-		return;
-	}
 
-	TRACE("SIGCHLD handler called for c_run injected process in container %s with PID %d",
-	      container_get_description(run->container), container_get_pid(run->container));
-	/* The exec loop is started in a new session having it's PID as PGID.
-	 * Therefore wait for this PGID. If a descendant process call setsid it doesn't
-	 * get reaped by this handler. This enables the user to inject processes who
-	 * continue running after the command injected by control exits */
-	pid_t exec_pid = session->active_exec_pid;
-	pid_t pid = 0;
-	int status = 0;
-	while ((pid = waitpid(session->active_exec_pid, &status, WNOHANG))) {
-		TRACE("Got exited child with PID: %d, exec pid: %d", pid, exec_pid);
-
-		//if (pid == exec_pid || pid == run->pty_master_read_pid || run->pty_master_write_pid) {
-		if (pid == exec_pid) {
-			TRACE("Injected process exited. Cleaning up.");
-			if (WIFEXITED(status)) {
-				INFO("Exec'ed process in container %s terminated (status=%d)",
-				     container_get_description(run->container),
-				     WEXITSTATUS(status));
-			} else if (WIFSIGNALED(status)) {
-				INFO("Injected process in container %s killed by signal %d",
-				     container_get_description(run->container), WTERMSIG(status));
-			} else {
-				continue;
-			}
-
-			/* remove the sigchld callback for this container from the event loop */
-			event_remove_signal(sig);
-			event_signal_free(sig);
-
-			/* Close sockets of the session */
-			run->sessions = list_remove(run->sessions, session);
-			c_run_session_cleanup(session);
-			c_run_session_free(session);
-			break;
-		} else {
-			DEBUG("Reaped a descendant process with PID %d of injected process in container %s",
-			      pid, container_get_description(run->container));
-		}
+	TRACE("Injected process %d in container %s exited. Cleaning up.", pid,
+	      container_get_description(run->container));
+
+	if (status < 0) {
+		WARN("Injected process %d in container %s was reaped elsewhere", pid,
+		     container_get_description(run->container));
+	} else if (WIFEXITED(status)) {
+		INFO("Exec'ed process in container %s terminated (status=%d)",
+		     container_get_description(run->container), WEXITSTATUS(status));
+	} else if (WIFSIGNALED(status)) {
+		INFO("Injected process in container %s killed by signal %d",
+		     container_get_description(run->container), WTERMSIG(status));
 	}
 
-	TRACE("No more childs to reap. Exiting handler.");
+	event_child_free(child);
+	session->child = NULL;
+	session->active_exec_pid = -1;
+
+	/* Close sockets of the session */
+	run->sessions = list_remove(run->sessions, session);
+	c_run_session_cleanup(session);
+	c_run_session_free(session);
 }
 
 static int
@@ -420,74 +423,140 @@ error:
 	exit(EXIT_FAILURE);
 }
 
-static int
-readloop(int from_fd, int to_fd)
-{
-	TRACE("[EXEC] Starting read loop in process %d; from fd %d, to fd %d, PPID: %d", getpid(),
-	      from_fd, to_fd, getppid());
+static void
+c_run_relay_cb(int fd, unsigned events, event_io_t *io, void *data);
 
-	int count = 0;
-	char buf[1024];
+/*
+ * Watches fd for the given events instead of the currently watched fd, or nothing
+ * if fd is -1.
+ */
+static void
+c_run_relay_watch(c_run_relay_t *relay, int fd, unsigned events)
+{
+	IF_TRUE_RETURN(relay->io && relay->io_fd == fd);
 
-	while (0 < (count = read(from_fd, &buf, sizeof(buf) - 1))) {
-		buf[count] = 0;
-		TRACE("[READLOOP] Read %d bytes from fd: %d: %s", count, from_fd, buf);
-		if (write(to_fd, buf, count + 1) < 0) {
-			TRACE_ERRNO("[READLOOP] write failed.");
-			return -1;
-		}
-	}
-	if (count < 0 && errno != EAGAIN) {
-		TRACE_ERRNO("[READLOOP] read failed.");
-		return -1;
+	if (relay->io) {
+		event_remove_io(relay->io);
+		event_io_free(relay->io);
+		relay->io = NULL;
 	}
-	return 0;
+	relay->io_fd = fd;
+	IF_TRUE_RETURN(fd < 0);
+
+	relay->io = event_io_new(fd, events | EVENT_IO_EXCEPT, c_run_relay_cb, relay);
+	event_add_io(relay->io);
+}
+
+static c_run_relay_t *
+c_run_relay_new(c_run_session_t *session, int from_fd, int to_fd)
+{
+	c_run_relay_t *relay = mem_new0(c_run_relay_t, 1);
+	relay->session = session;
+	relay->from_fd = from_fd;
+	relay->to_fd = to_fd;
+	relay->io_fd = -1;
+	relay->buf = mem_alloc(C_RUN_RELAY_BUF_SIZE);
+
+	c_run_relay_watch(relay, from_fd, EVENT_IO_READ);
+	return relay;
 }
 
 static void
-c_run_cb_read_pty(int fd, unsigned events, UNUSED event_io_t *io, void *data)
+c_run_relay_free(c_run_relay_t *relay)
 {
-	ASSERT(data);
-	c_run_session_t *session = data;
+	IF_NULL_RETURN(relay);
+	c_run_relay_watch(relay, -1, 0);
+	mem_free0(relay->buf);
+	mem_free0(relay);
+}
 
-	if (events & EVENT_IO_EXCEPT) {
-		TRACE("Exception on reading pty fd %d", fd);
-		event_remove_io(io);
-		event_io_free(io);
-		close(fd);
-		return;
+/*
+ * Writes the buffered data. Returns 1 if all of it was written, 0 if the destination
+ * would block and -1 on errors.
+ */
+static int
+c_run_relay_flush(c_run_relay_t *relay)
+{
+	while (relay->off < relay->len) {
+		ssize_t count =
+			write(relay->to_fd, relay->buf + relay->off, relay->len - relay->off);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (count < 0) {
+			TRACE_ERRNO("[RELAY] write to fd %d failed.", relay->to_fd);
+			return -1;
+		}
+		relay->off += count;
 	}
+	relay->len = relay->off = 0;
+	return 1;
+}
 
-	TRACE("Entering PTY master reading loop");
-	if (-1 == readloop(session->pty_master, session->console_sock_container)) {
-		ERROR("Readloop returned an error, cleanup!");
-		c_run_t *run = session->run;
-		run->sessions = list_remove(run->sessions, session);
-		c_run_session_cleanup(session);
-		c_run_session_free(session);
+/*
+ * Relays data until the source is drained, the destination would block or
+ * C_RUN_RELAY_MAX_PER_WAKEUP bytes were relayed. Returns 0 if the source is drained,
+ * 1 at the end of the source, 2 if data is left to relay and -1 on errors.
+ */
+static int
+c_run_relay_pump(c_run_relay_t *relay)
+{
+	size_t total = 0;
+
+	for (;;) {
+		int ret = c_run_relay_flush(relay);
+		IF_TRUE_RETVAL(ret < 0, -1);
+		if (ret == 0) {
+			c_run_relay_watch(relay, relay->to_fd, EVENT_IO_WRITE);
+			return 2;
+		}
+		c_run_relay_watch(relay, relay->from_fd, EVENT_IO_READ);
+		// the source is still readable, the event loop calls again
+		IF_TRUE_RETVAL(total >= C_RUN_RELAY_MAX_PER_WAKEUP, 2);
+
+		ssize_t count = read(relay->from_fd, relay->buf, C_RUN_RELAY_BUF_SIZE);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		// a PTY master reports EIO once the slave side was closed
+		if (count < 0 && errno != EIO) {
+			TRACE_ERRNO("[RELAY] read from fd %d failed.", relay->from_fd);
+			return -1;
+		}
+		IF_TRUE_RETVAL(count <= 0, 1);
+
+		TRACE("[RELAY] Read %zd bytes from fd %d for fd %d", count, relay->from_fd,
+		      relay->to_fd);
+		relay->len = count;
+		total += count;
 	}
 }
 
 static void
-c_run_cb_write_pty(int fd, unsigned events, UNUSED event_io_t *io, void *data)
+c_run_relay_cb(int fd, unsigned events, UNUSED event_io_t *io, void *data)
 {
-	ASSERT(data);
-	c_run_session_t *session = data;
-
-	if (events & EVENT_IO_EXCEPT) {
-		TRACE("Exception on console socket fd %d", fd);
-		event_remove_io(io);
-		event_io_free(io);
-		close(fd);
-		return;
+	c_run_relay_t *relay = data;
+	ASSERT(relay);
+
+	// data which arrived before a hangup is relayed first
+	int ret = c_run_relay_pump(relay);
+	if (ret == 0 && (events & EVENT_IO_EXCEPT)) {
+		TRACE("Exception on fd %d, stop relaying from fd %d", fd, relay->from_fd);
+		ret = 1;
 	}
-
-	TRACE("Entering console sock reading loop");
-	if (-1 == readloop(session->console_sock_container, session->pty_master)) {
-		ERROR("Readloop returned an error, cleanup!");
+	if (ret == 1) {
+		TRACE("Reached end of fd %d, stop relaying", relay->from_fd);
+		c_run_relay_watch(relay, -1, 0);
+	} else if (ret < 0) {
+		ERROR("Relaying from fd %d to fd %d failed, cleanup!", relay->from_fd,
+		      relay->to_fd);
+		c_run_session_t *session = relay->session;
 		c_run_t *run = session->run;
 		run->sessions = list_remove(run->sessions, session);
 		c_run_session_cleanup(session);
+		// also frees the relay and its io
 		c_run_session_free(session);
 	}
 }
@@ -528,17 +597,11 @@ c_run_prepare_exec(c_run_session_t *session)
 
 		fd_make_non_blocking(session->pty_master);
 
-		DEBUG("Registering read callback for PTY master fd");
-		event_io_t *pty_master_write_io =
-			event_io_new(session->console_sock_container,
-				     EVENT_IO_READ | EVENT_IO_EXCEPT, c_run_cb_write_pty, session);
-		event_add_io(pty_master_write_io);
-
-		DEBUG("Registering read callback for console socket");
-		event_io_t *pty_master_read_io =
-			event_io_new(session->pty_master, EVENT_IO_READ | EVENT_IO_EXCEPT,
-				     c_run_cb_read_pty, session);
-		event_add_io(pty_master_read_io);
+		DEBUG("Relaying between PTY master and console socket");
+		session->relay_in = c_run_relay_new(session, session->console_sock_container,
+						    session->pty_master);
+		session->relay_out = c_run_relay_new(session, session->pty_master,
+						     session->console_sock_container);
 
 		//clone child to execute command
 		TRACE("clone child process to execute command with PTY");
@@ -573,21 +636,26 @@ error:
 
 int
 c_run_exec_process(c_run_t *run, int create_pty, char *cmd, ssize_t argc, char **argv,
-		   int session_fd)
+		   int session_fd, uint32_t channel)
 {
 	TRACE("Trying to excute command \"%s\" inside container", cmd);
 	ASSERT(cmd);
 
-	c_run_session_t *session = c_run_session_new(run, create_pty, cmd, argc, argv, session_fd);
+	c_run_session_t *session = c_run_session_new(run, create_pty, cmd, argc, argv, session_fd,
+							channel);
 	IF_NULL_RETVAL(session, -1);
 
 	run->sessions = list_append(run->sessions, session);
 
 	IF_TRUE_GOTO(c_run_prepare_exec(session) < 0, error);
 
-	TRACE("Registering SIGCHLD handler for injected processes");
-	event_signal_t *sig = event_signal_new(SIGCHLD, c_run_sigchld_cb, session);
-	event_add_signal(sig);
+	TRACE("Registering child event for injected process");
+	session->child = event_child_new(session->active_exec_pid, c_run_child_cb, session);
+	if (event_add_child(session->child) < 0) {
+		event_child_free(session->child);
+		session->child = NULL;
+		goto error;
+	}
 
 	return session->fd;
 
@@ -37,14 +37,11 @@ c_run_free(c_run_t *run);
 void
 c_run_cleanup(c_run_t *run);
 
-int
-c_run_write_exec_input(const c_run_t *run, char *exec_input, int session_fd);
-
 int
 c_run_exec_process(c_run_t *run, int create_pty, char *cmd, ssize_t argc, char **argv,
-		   int session_fd);
+		   int session_fd, uint32_t channel);
 
 int
-c_run_get_console_sock_cmld(const c_run_t *run, int session_fd);
+c_run_get_console_sock_cmld(const c_run_t *run, int session_fd, uint32_t channel);
 
 #endif /* C_RUN_H */
@@ -32,6 +32,7 @@
 #include "common/macro.h"
 #include "common/mem.h"
 #include "common/protobuf.h"
+#include "common/shm_ring.h"
 #include "common/sock.h"
 
 #include <inttypes.h>
@@ -43,6 +44,9 @@
 #define C_SERVICE_SOCKET SOCK_PATH(service)
 // clang-format on
 
+// size of the shared memory ring for audit messages, holds several full windows of records
+#define C_SERVICE_AUDIT_RING_SIZE (1024 * 1024)
+
 //#undef LOGF_LOG_MIN_PRIO
 //#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
 
@@ -52,8 +56,47 @@ struct c_service {
 	int sock_connected;
 	event_io_t *event_io_sock;
 	event_io_t *event_io_sock_connected;
+	protobuf_reader_t *reader; // framed reader of sock_connected
+	shm_ring_t *audit_ring;	   // optional transport of audit messages to the service
+	bool audit_ring_attached;  // the service confirmed the ring with its last ACK
 };
 
+static void
+c_service_audit_ring_free(c_service_t *service)
+{
+	if (service->audit_ring) {
+		shm_ring_free(service->audit_ring);
+		service->audit_ring = NULL;
+	}
+	service->audit_ring_attached = false;
+}
+
+/**
+ * Sets up a shared memory ring for audit messages as requested by the service and
+ * passes it to the service. Audit messages are still sent over the socket if this fails.
+ */
+static int
+c_service_audit_ring_setup(c_service_t *service)
+{
+	c_service_audit_ring_free(service);
+
+	shm_ring_t *ring = shm_ring_new(C_SERVICE_AUDIT_RING_SIZE);
+	IF_NULL_RETVAL(ring, -1);
+
+	CmldToServiceMessage message_proto = CMLD_TO_SERVICE_MESSAGE__INIT;
+	message_proto.code = CMLD_TO_SERVICE_MESSAGE__CODE__AUDIT_RING;
+
+	int fds[2] = { shm_ring_get_mem_fd(ring), shm_ring_get_doorbell_fd(ring) };
+	int ret = protobuf_send_message(service->sock_connected, (ProtobufCMessage *)&message_proto);
+	if (ret < 0 || sock_unix_send_fds(service->sock_connected, fds, 2) < 0) {
+		shm_ring_free(ring);
+		return -1;
+	}
+
+	service->audit_ring = ring;
+	return 0;
+}
+
 static int
 c_service_send_container_cfg_name_proto(c_service_t *service)
 {
@@ -149,13 +192,22 @@ c_service_handle_received_message(c_service_t *service, const ServiceToCmldMessa
 		INFO("Got ACK from Container %s",
 		     uuid_string(container_get_uuid(service->container)));
 
-		if (0 > container_audit_process_ack(service->container, message->audit_ack)) {
+		service->audit_ring_attached = message->has_audit_ring && message->audit_ring;
+
+		if (0 > container_audit_process_ack(service->container, message->audit_ack,
+						    message->audit_window)) {
 			ERROR("Failed to process audit ACK from container %s",
 			      uuid_string(container_get_uuid(service->container)));
 		}
 		break;
 	}
 
+	case SERVICE_TO_CMLD_MESSAGE__CODE__AUDIT_RING_REQ:
+		if (c_service_audit_ring_setup(service))
+			WARN("Failed to set up audit ring for container %s, using socket",
+			     container_get_description(service->container));
+		break;
+
 	default:
 		WARN("Received unknown message code from Trustme Service: %d", message->code);
 		return;
@@ -174,13 +226,16 @@ c_service_cb_receive_message(int fd, unsigned events, event_io_t *io, void *data
 	c_service_t *service = data;
 
 	if (events & EVENT_IO_READ) {
-		ServiceToCmldMessage *message = (ServiceToCmldMessage *)protobuf_recv_message(
-			fd, &service_to_cmld_message__descriptor);
+		ServiceToCmldMessage *message;
+		int ret;
+		while ((ret = protobuf_reader_recv_message(service->reader,
+							   &service_to_cmld_message__descriptor,
+							   (ProtobufCMessage **)&message)) > 0) {
+			c_service_handle_received_message(service, message);
+			protobuf_c_message_free_unpacked((ProtobufCMessage *)message, NULL);
+		}
 		// close connection if client EOF, or protocol parse error
-		IF_NULL_GOTO_TRACE(message, connection_err);
-
-		c_service_handle_received_message(service, message);
-		protobuf_c_message_free_unpacked((ProtobufCMessage *)message, NULL);
+		IF_TRUE_GOTO_TRACE(ret < 0, connection_err);
 	}
 
 	// also check EXCEPT flag
@@ -195,6 +250,9 @@ connection_err:
 	event_remove_io(io);
 	event_io_free(io);
 	service->event_io_sock_connected = NULL;
+	protobuf_reader_free(service->reader);
+	service->reader = NULL;
+	c_service_audit_ring_free(service);
 	if (close(fd) < 0)
 		WARN_ERRNO("Failed to close connected service socket");
 	service->sock_connected = -1;
@@ -222,6 +280,11 @@ c_service_cb_accept(int fd, unsigned events, event_io_t *io, void *data)
 	TRACE("Accepted connection %d from %s", service->sock_connected,
 	      container_get_description(service->container));
 
+	fd_make_non_blocking(service->sock_connected);
+	protobuf_reader_free(service->reader);
+	service->reader = protobuf_reader_new(service->sock_connected);
+	c_service_audit_ring_free(service);
+
 	service->event_io_sock_connected = event_io_new(service->sock_connected, EVENT_IO_READ,
 							&c_service_cb_receive_message, service);
 	event_add_io(service->event_io_sock_connected);
@@ -268,6 +331,11 @@ c_service_cleanup(c_service_t *service)
 		}
 		service->sock_connected = -1;
 	}
+	if (service->reader) {
+		protobuf_reader_free(service->reader);
+		service->reader = NULL;
+	}
+	c_service_audit_ring_free(service);
 	if (service->sock > 0) {
 		if (close(service->sock) < 0) {
 			WARN_ERRNO("Failed to close service socket");
@@ -339,6 +407,44 @@ c_service_start_pre_exec(c_service_t *service)
 	return 0;
 }
 
+void
+c_service_get_socks(const c_service_t *service, int *sock, int *sock_connected)
+{
+	ASSERT(service);
+	ASSERT(sock && sock_connected);
+
+	*sock = service->sock;
+	*sock_connected = service->sock_connected;
+}
+
+int
+c_service_reattach(c_service_t *service, int sock, int sock_connected)
+{
+	ASSERT(service);
+
+	c_service_cleanup(service);
+
+	if (sock >= 0) {
+		service->sock = sock;
+		service->event_io_sock =
+			event_io_new(service->sock, EVENT_IO_READ, &c_service_cb_accept, service);
+		event_add_io(service->event_io_sock);
+	}
+
+	// the audit ring is not handed over, records are sent on the socket until requested again
+	if (sock_connected >= 0) {
+		service->sock_connected = sock_connected;
+		fd_make_non_blocking(service->sock_connected);
+		service->reader = protobuf_reader_new(service->sock_connected);
+		service->event_io_sock_connected =
+			event_io_new(service->sock_connected, EVENT_IO_READ,
+				     &c_service_cb_receive_message, service);
+		event_add_io(service->event_io_sock_connected);
+	}
+
+	return service->sock < 0 ? -1 : 0;
+}
+
 /**
  * Helper function that generates and sends a protobuf message to the Trustme Service.
  */
@@ -364,6 +470,17 @@ c_service_audit_send_record(c_service_t *service, const uint8_t *buf, uint32_t b
 	TRACE("Trying to send packed audit record of size %u to container %s", buf_len,
 	      uuid_string(container_get_uuid(service->container)));
 
+	if (service->audit_ring && service->audit_ring_attached) {
+		if (!shm_ring_write(service->audit_ring, buf, buf_len))
+			return 0;
+		if (errno != ENOSPC) {
+			WARN("Dropping broken audit ring of container %s",
+			     uuid_string(container_get_uuid(service->container)));
+			c_service_audit_ring_free(service);
+		}
+		// messages which do not fit are sent over the socket
+	}
+
 	if (-1 == protobuf_send_message_packed(service->sock_connected, buf, buf_len)) {
 		ERROR("Failed to send packed audit record to container %s",
 		      uuid_string(container_get_uuid(service->container)));
@@ -115,6 +115,21 @@ c_service_start_child(c_service_t *service);
 int
 c_service_start_pre_exec(c_service_t *service);
 
+/**
+ * Returns the listening and the connected socket to the TrustmeService, which are
+ * handed over to a re-executed cmld. Either one is -1 if it is not open.
+ */
+void
+c_service_get_socks(const c_service_t *service, int *sock, int *sock_connected);
+
+/**
+ * Takes over the sockets of a running container from a previous cmld instance.
+ *
+ * @return 0 on success, -1 if there is no listening socket the service could connect to
+ */
+int
+c_service_reattach(c_service_t *service, int sock, int sock_connected);
+
 /**
  * Send packed audit record to service.
  * @param service The service object of the associated container.
@@ -159,6 +159,13 @@ c_time_start_post_exec(c_time_t *_time)
 	return 0;
 }
 
+void
+c_time_reattach(c_time_t *_time, time_t uptime)
+{
+	ASSERT(_time);
+	_time->time_started = time(NULL) - uptime;
+}
+
 int
 c_time_start_pre_exec_child(const c_time_t *time)
 {
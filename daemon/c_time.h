@@ -60,6 +60,13 @@ c_time_start_pre_exec(const c_time_t *time);
 int
 c_time_start_post_exec(c_time_t *time);
 
+/**
+ * Restores the start time of a running container taken over from a previous cmld
+ * instance, which is only aware of the uptime of the container.
+ */
+void
+c_time_reattach(c_time_t *time, time_t uptime);
+
 int
 c_time_start_pre_exec_child(const c_time_t *time);
 
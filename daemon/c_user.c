@@ -31,7 +31,10 @@
 #include <sched.h>
 #include <sys/prctl.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
 #include <unistd.h>
 
 #include "common/macro.h"
@@ -55,6 +58,23 @@
 
 #define SHIFTFS_DIR "/tmp/shiftfs"
 
+/*
+ * Records the uid_start a volume's files are currently shifted to, so that unchanged
+ * volumes skip the recursive chown on the next start. A value of 0 means the files
+ * carry the plain container ids, as expected by idmapped mounts.
+ */
+#define C_USER_SHIFT_XATTR "trusted.cml.uid_start"
+
+#ifndef SYS_open_tree
+#define SYS_open_tree 428
+#endif
+#ifndef SYS_move_mount
+#define SYS_move_mount 429
+#endif
+#ifndef SYS_mount_setattr
+#define SYS_mount_setattr 442
+#endif
+
 struct c_user_shift {
 	char *target;
 	char *mark;
@@ -70,6 +90,7 @@ struct c_user {
 	list_t *marks;		//marks to be mounted in userns
 	int mark_index;
 	int fd_userns;
+	int fd_idmap; //!< userns only carrying the id mapping of this container for idmapped mounts
 	char *ns_path;
 };
 
@@ -202,6 +223,7 @@ c_user_new(container_t *container, bool user_ns)
 	user->container = container;
 	user->ns_usr = user_ns;
 	user->uid_start = 0;
+	user->fd_idmap = -1;
 
 	// path to bind userns (used for reboots)
 	dir_mkdir_p("/var/run/userns", 00755);
@@ -217,15 +239,15 @@ c_user_new(container_t *container, bool user_ns)
  * Setup mappings for uids and gids
  */
 static int
-c_user_setup_mapping(const c_user_t *user)
+c_user_setup_mapping(const c_user_t *user, pid_t pid)
 {
 	ASSERT(user);
 
 	char *uid_mapping = mem_printf(C_USER_MAP_FORMAT, 0, user->uid_start, UID_MAX);
 	INFO("mapping: '%s'", uid_mapping);
 
-	char *uid_map_path = mem_printf(C_USER_UID_MAP_PATH, container_get_pid(user->container));
-	char *gid_map_path = mem_printf(C_USER_GID_MAP_PATH, container_get_pid(user->container));
+	char *uid_map_path = mem_printf(C_USER_UID_MAP_PATH, pid);
+	char *gid_map_path = mem_printf(C_USER_GID_MAP_PATH, pid);
 
 	// write mapping to proc
 	if (file_printf(uid_map_path, "%s", uid_mapping) == -1) {
@@ -291,6 +313,10 @@ c_user_cleanup(c_user_t *user, bool is_rebooting)
 		close(user->fd_userns);
 		user->fd_userns = -1;
 	}
+	if (user->fd_idmap >= 0) {
+		close(user->fd_idmap);
+		user->fd_idmap = -1;
+	}
 
 	c_user_unset_offset(user->offset);
 
@@ -327,8 +353,8 @@ c_user_chown_dev_cb(const char *path, const char *file, void *data)
 {
 	struct stat s;
 	int ret = 0;
-	c_user_t *user = data;
-	ASSERT(user);
+	const int *uid_start = data;
+	ASSERT(uid_start);
 
 	char *file_to_chown = mem_printf("%s/%s", path, file);
 	if (lstat(file_to_chown, &s) == -1) {
@@ -337,12 +363,12 @@ c_user_chown_dev_cb(const char *path, const char *file, void *data)
 	}
 
 	// modulo operation avoids shifting twice
-	uid_t uid = s.st_uid % UID_RANGE + user->uid_start;
-	gid_t gid = s.st_gid % UID_RANGE + user->uid_start;
+	uid_t uid = s.st_uid % UID_RANGE + *uid_start;
+	gid_t gid = s.st_gid % UID_RANGE + *uid_start;
 
 	if (file_is_dir(file_to_chown)) {
 		TRACE("Path %s is dir", file_to_chown);
-		if (dir_foreach(file_to_chown, &c_user_chown_dev_cb, user) < 0) {
+		if (dir_foreach(file_to_chown, &c_user_chown_dev_cb, data) < 0) {
 			ERROR_ERRNO("Could not chown all dir contents in '%s'", file_to_chown);
 			ret--;
 		}
@@ -350,15 +376,15 @@ c_user_chown_dev_cb(const char *path, const char *file, void *data)
 			ERROR_ERRNO("Could not chown dir '%s' to (%d:%d)", file_to_chown, uid, gid);
 			ret--;
 		}
-	} else {
+	} else if (s.st_uid != uid || s.st_gid != gid) {
+		// unchanged ids are skipped, e.g., to avoid needless copy-ups on overlays
 		if (lchown(file_to_chown, uid, gid) < 0) {
 			ERROR_ERRNO("Could not chown file '%s' to (%d:%d)", file_to_chown, uid,
 				    gid);
 			ret--;
 		}
 	}
-	TRACE("Chown file '%s' to (%d:%d) (uid_start %d)", file_to_chown, uid, gid,
-	      user->uid_start);
+	TRACE("Chown file '%s' to (%d:%d) (uid_start %d)", file_to_chown, uid, gid, *uid_start);
 
 	// chown .
 	if (chown(path, uid, gid) < 0) {
@@ -391,6 +417,155 @@ c_user_start_child(const c_user_t *user)
 	return c_user_setuid0(user);
 }
 
+/**
+ * Returns the uid_start the files below path have been shifted to, as recorded
+ * in C_USER_SHIFT_XATTR, or -1 if unknown.
+ */
+static int
+c_user_shift_xattr_get(const char *path)
+{
+	int uid_start = -1;
+
+	if (getxattr(path, C_USER_SHIFT_XATTR, &uid_start, sizeof(uid_start)) != sizeof(uid_start))
+		return -1;
+	return uid_start;
+}
+
+/**
+ * Recursively shifts the ids of all files below path to uid_start, which may be 0
+ * to restore the plain container ids. Volumes already carrying a matching
+ * C_USER_SHIFT_XATTR are left alone.
+ */
+static int
+c_user_chown_tree(const char *path, int uid_start)
+{
+	if (c_user_shift_xattr_get(path) == uid_start) {
+		DEBUG("Ids of '%s' already shifted to %d, skipping chown", path, uid_start);
+		return 0;
+	}
+
+	if (chown(path, uid_start, uid_start) < 0) {
+		ERROR_ERRNO("Could not chown mnt point '%s' to (%d:%d)", path, uid_start,
+			    uid_start);
+		return -1;
+	}
+	if (dir_foreach(path, &c_user_chown_dev_cb, &uid_start) < 0) {
+		ERROR("Could not chown %s to target uid:gid (%d:%d)", path, uid_start, uid_start);
+		return -1;
+	}
+
+	if (setxattr(path, C_USER_SHIFT_XATTR, &uid_start, sizeof(uid_start), 0) < 0)
+		WARN_ERRNO("Could not record shifted ids of '%s'", path);
+
+	return 0;
+}
+
+/**
+ * Creates a user namespace carrying the id mapping of the container and returns
+ * an fd to it. The namespace is only used as the idmapping of idmapped mounts,
+ * thus the helper process populating it exits right away.
+ */
+static int
+c_user_open_idmap_userns(const c_user_t *user)
+{
+	int fd = -1;
+	int sync[2];
+	char c = 0;
+
+	if (pipe(sync) < 0) {
+		ERROR_ERRNO("Could not create sync pipe");
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		ERROR_ERRNO("Could not fork idmap userns helper");
+		close(sync[0]);
+		close(sync[1]);
+		return -1;
+	} else if (pid == 0) {
+		close(sync[0]);
+		if (unshare(CLONE_NEWUSER) < 0)
+			_exit(-1);
+		// tell parent that the userns exists and wait until it is done
+		if (write(sync[1], &c, 1) != 1)
+			_exit(-1);
+		pause();
+		_exit(0);
+	}
+
+	close(sync[1]);
+	if (read(sync[0], &c, 1) != 1) {
+		ERROR("Idmap userns helper failed to unshare its userns");
+		goto out;
+	}
+	if (c_user_setup_mapping(user, pid) < 0)
+		goto out;
+
+	char *ns_path = mem_printf("/proc/%d/ns/user", pid);
+	fd = open(ns_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		ERROR_ERRNO("Could not open '%s'", ns_path);
+	mem_free0(ns_path);
+out:
+	close(sync[0]);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return fd;
+}
+
+/**
+ * Stacks an idmapped mount of path onto path itself, so that the plain container ids
+ * on disk appear shifted to the container's uid range. On first use the ids of a
+ * volume which has been chowned on a former start are restored to the plain ones.
+ *
+ * @return 0 on success, -1 if idmapped mounts are not available for path
+ */
+static int
+c_user_idmap_mount(c_user_t *user, const char *path)
+{
+	// checked once per process; EINVAL only means that this filesystem lacks support
+	static bool idmap_unsupported = false;
+	int fd_tree = -1;
+
+	IF_TRUE_RETVAL(idmap_unsupported, -1);
+
+	if (user->fd_idmap < 0 && (user->fd_idmap = c_user_open_idmap_userns(user)) < 0) {
+		idmap_unsupported = true;
+		return -1;
+	}
+
+	fd_tree = syscall(SYS_open_tree, AT_FDCWD, path, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+	if (fd_tree < 0) {
+		TRACE_ERRNO("Could not clone mount tree of '%s'", path);
+		idmap_unsupported = (errno == ENOSYS);
+		return -1;
+	}
+
+	struct mount_attr attr = { .attr_set = MOUNT_ATTR_IDMAP, .userns_fd = user->fd_idmap };
+	if (syscall(SYS_mount_setattr, fd_tree, "", AT_EMPTY_PATH, &attr, sizeof(attr)) < 0) {
+		TRACE_ERRNO("No idmapped mount support for '%s'", path);
+		idmap_unsupported = (errno == ENOSYS);
+		goto error;
+	}
+
+	// files are now expected to carry the plain container ids
+	if (c_user_chown_tree(path, 0) < 0)
+		goto error;
+
+	if (syscall(SYS_move_mount, fd_tree, "", AT_FDCWD, path, MOVE_MOUNT_F_EMPTY_PATH) < 0) {
+		ERROR_ERRNO("Could not attach idmapped mount at '%s'", path);
+		goto error;
+	}
+
+	INFO("Shifted ids of '%s' by idmapped mount", path);
+	close(fd_tree);
+	return 0;
+error:
+	close(fd_tree);
+	return -1;
+}
+
 /**
  * Shifts or sets uid/gids of path using the parent ids for this c_user_t
  *
@@ -420,7 +595,7 @@ c_user_shift_ids(c_user_t *user, const char *path, bool is_root)
 	// if dev or a cgroup subsys just chown the files
 	if ((strlen(path) >= 4 && !strcmp(strrchr(path, '\0') - 4, "/dev")) ||
 	    (strstr(path, "/cgroup") != NULL)) {
-		if (dir_foreach(path, &c_user_chown_dev_cb, user) < 0) {
+		if (dir_foreach(path, &c_user_chown_dev_cb, &user->uid_start) < 0) {
 			ERROR("Could not chown %s to target uid:gid (%d:%d)", path, user->uid_start,
 			      user->uid_start);
 			goto error;
@@ -428,19 +603,15 @@ c_user_shift_ids(c_user_t *user, const char *path, bool is_root)
 		goto success;
 	}
 
+	// idmapped mounts shift the ids without touching the files at all
+	if (c_user_idmap_mount(user, path) == 0)
+		goto success;
+
 	// if kernel does not support shiftfs just chown the files
 	// and do bind mounts (see jump mark shift)
 	if (!cmld_is_shiftfs_supported()) {
-		if (chown(path, user->uid_start, user->uid_start) < 0) {
-			ERROR_ERRNO("Could not chown mnt point '%s' to (%d:%d)", path,
-				    user->uid_start, user->uid_start);
+		if (c_user_chown_tree(path, user->uid_start) < 0)
 			goto error;
-		}
-		if (dir_foreach(path, &c_user_chown_dev_cb, user) < 0) {
-			ERROR("Could not chown %s to target uid:gid (%d:%d)", path, user->uid_start,
-			      user->uid_start);
-			goto error;
-		}
 		goto shift;
 	}
 
@@ -537,7 +708,40 @@ c_user_start_post_clone(c_user_t *user)
 	if (user->fd_userns < 0)
 		WARN("Could not keep userns active for reboot!");
 
-	return c_user_setup_mapping(user);
+	return c_user_setup_mapping(user, container_get_pid(user->container));
+}
+
+/**
+ * Occupies the uid range of a running container again, which a previous cmld instance
+ * stored for the container, and keeps its bound userns open.
+ */
+int
+c_user_reattach(c_user_t *user)
+{
+	ASSERT(user);
+
+	IF_FALSE_RETVAL(user->ns_usr, 0);
+
+	// the mapping is in place already, thus only the stored offset will do
+	char *file_name_uid = mem_printf("%s.uid", container_get_images_dir(user->container));
+	int offset = -1;
+	if (file_read(file_name_uid, (char *)&offset, sizeof(offset)) < 0 || offset < 0 ||
+	    offset >= MAX_UID_RANGES || c_user_set_offset(offset) < 0) {
+		ERROR("Could not restore uid range of container %s from %s",
+		      container_get_description(user->container), file_name_uid);
+		mem_free0(file_name_uid);
+		return -1;
+	}
+	mem_free0(file_name_uid);
+
+	user->offset = offset;
+	user->uid_start = UID_RANGES_START + (user->offset * UID_RANGE);
+
+	user->fd_userns = open(user->ns_path, O_RDONLY);
+	if (user->fd_userns < 0)
+		WARN_ERRNO("Could not open bound userns %s", user->ns_path);
+
+	return 0;
 }
 
 int
@@ -64,6 +64,13 @@ c_user_start_child(const c_user_t *user);
 int
 c_user_start_post_clone(c_user_t *user);
 
+/**
+ * Takes over the uid range and userns of a running container from a previous
+ * cmld instance.
+ */
+int
+c_user_reattach(c_user_t *user);
+
 /**
  * Cleans up the c_user_t struct.
  */
@@ -37,19 +37,23 @@
 #include "common/loopdev.h"
 #include "common/cryptfs.h"
 #include "common/dir.h"
+#include "common/dir_walk.h"
 #include "common/proc.h"
 #include "common/sock.h"
 #include "common/str.h"
+#include "common/probe.h"
 
 #include "cmld.h"
 #include "hardware.h"
 #include "guestos.h"
 #include "smartcard.h"
 #include "lxcfs.h"
+#include "procfs.h"
 #include "audit.h"
 
 #include <unistd.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/wait.h>
 #include <sys/types.h>
@@ -58,7 +62,9 @@
 #include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <libgen.h>
+#include <pthread.h>
 
 #define MAKE_EXT4FS "mkfs.ext4"
 #define BTRFSTUNE "btrfstune"
@@ -68,7 +74,26 @@
 #define SHARED_FILES_PATH DEFAULT_BASE_PATH "/files_shared"
 #define SHARED_FILES_STORE_SIZE 100
 
+// mount points of read-only images shared by containers in cmld's mount namespace
+#define SHARED_MOUNTS_PATH "/tmp/shared_mounts"
+
 #define BUSYBOX_PATH "/bin/busybox"
+// busybox and its applet symlinks, prepared once and bind-mounted read-only into setup mode
+#define BUSYBOX_TOOLS_PATH "/tmp/busybox_tools"
+// attempts to get a loop device if others grab the free ones concurrently
+#define C_VOL_LOOPDEV_RETRIES 8
+// time in ms for loop and device mapper nodes to appear once the kernel created the device
+#define C_VOL_DEV_WAIT_TIMEOUT 5000
+
+// upper bound of worker threads used to prepare missing images in parallel
+#define C_VOL_PREPARE_THREADS_MAX 8
+
+// time in ms after the start of a container when its boot reads are recorded
+#define C_VOL_READAHEAD_RECORD_DELAY 30000
+// non-resident pages between two resident ranges up to which both are recorded as one
+#define C_VOL_READAHEAD_GAP 16
+// upper bound of bytes read ahead per image and start
+#define C_VOL_READAHEAD_MAX (256 * 1024 * 1024)
 
 #ifndef FALLOC_FL_ZERO_RANGE
 #define FALLOC_FL_ZERO_RANGE 0x10
@@ -78,8 +103,26 @@ struct c_vol {
 	const container_t *container;
 	char *root;
 	int overlay_count;
+	list_t *new_images;    // images created but not yet formatted by c_vol_prepare_images()
+	list_t *shared_mounts; // c_vol_shared_mount_t references held by this container
+	event_timer_t *readahead_timer; // records missing readahead profiles after boot
 };
 
+/**
+ * A read-only image mounted once in cmld's mount namespace. Containers started
+ * afterwards inherit the mount through their cloned mount namespace and bind-mount
+ * it instead of setting up their own loop device, thus also sharing its page cache.
+ */
+typedef struct c_vol_shared_mount {
+	char *sha256; // hash of the image, identifies it across guestos versions
+	char *dir;
+	char *label; // label of the verity device, NULL if none is used
+	unsigned refs;
+} c_vol_shared_mount_t;
+
+// list of c_vol_shared_mount_t objects of all containers and zygotes
+static list_t *c_vol_shared_mounts = NULL;
+
 /******************************************************************************/
 
 /**
@@ -148,6 +191,17 @@ c_vol_meta_image_path_new(c_vol_t *vol, const mount_entry_t *mntent)
 	return mem_printf("%s/%s.meta.img", dir, mount_entry_get_img(mntent));
 }
 
+/**
+ * Returns true if the image of the mount entry is encrypted and protected by
+ * dm-integrity, which keeps its data in a separate meta image.
+ */
+static bool
+c_vol_use_integrity(const mount_entry_t *mntent)
+{
+	return mount_entry_is_encrypted(mntent) &&
+	       mount_entry_get_crypt_opts(mntent)->integrity != CRYPTFS_INTEGRITY_NONE;
+}
+
 /**
  * Check wether a container image is ready to be mounted.
  * @return On error -1 is returned, otherwise 0.
@@ -170,43 +224,52 @@ c_vol_check_image(c_vol_t *vol, const char *img)
 	return ret;
 }
 
+/**
+ * Attaches img to a free loop device. All images are attached with direct I/O,
+ * as their contents are cached by the file system mounted on top anyway.
+ */
 static char *
-c_vol_create_loopdev_new(int *fd, const char *img)
+c_vol_create_loopdev_new(int *fd, const char *img, bool read_only)
 {
-	char *dev = loopdev_new();
-	if (!dev) {
-		ERROR("Could not get free loop device for %s", img);
-		return NULL;
-	}
+	for (int i = 0; i < C_VOL_LOOPDEV_RETRIES; i++) {
+		char *dev = loopdev_new();
+		if (!dev) {
+			ERROR("Could not get free loop device for %s", img);
+			return NULL;
+		}
 
-	// wait until the devie appears...
-	// TODO: how was this timeout chosen?
-	// TODO: maybe better wait for the uevent?
-	if (loopdev_wait(dev, 10) < 0) {
-		ERROR("Device %s for image %s was not created", dev, img);
-		goto error;
-	}
+		// wait until the device appears, usually cmld pre-created it on startup
+		if (loopdev_wait(dev, C_VOL_DEV_WAIT_TIMEOUT) < 0) {
+			ERROR("Device %s for image %s was not created", dev, img);
+			mem_free0(dev);
+			return NULL;
+		}
 
-	// TODO: there might be another process trying to setup a device for dev
-	*fd = loopdev_setup_device(img, dev);
-	if (*fd < 0) {
-		ERROR("Could not setup loop device %s for %s", dev, img);
-		goto error;
+		*fd = loopdev_setup_device(img, dev, true, read_only);
+		if (*fd >= 0)
+			return dev;
+
+		// another process may have bound the device after we got it
+		int err = errno;
+		mem_free0(dev);
+		if (err != EBUSY)
+			break;
+		DEBUG("Loop device for %s was taken concurrently, retrying", img);
 	}
-	return dev;
-error:
-	mem_free0(dev);
+
+	ERROR("Could not setup loop device for %s", img);
 	return NULL;
 }
 
 static int
-c_vol_create_sparse_file(const char *img, off64_t storage_size)
+c_vol_create_sparse_file(const char *img, off64_t storage_size, enum mount_prealloc prealloc)
 {
 	int fd;
 
 	ASSERT(img);
 
-	INFO("Creating empty image file %s with %llu bytes", img, (unsigned long long)storage_size);
+	INFO("Creating empty image file %s with %llu bytes (preallocation %d)", img,
+	     (unsigned long long)storage_size, prealloc);
 
 	fd = open(img, O_LARGEFILE | O_WRONLY | O_CREAT | O_TRUNC, 0666);
 	if (fd < 0) {
@@ -221,23 +284,25 @@ c_vol_create_sparse_file(const char *img, off64_t storage_size)
 		return -1;
 	}
 
-	if (lseek64(fd, storage_size - 1, SEEK_SET) < 0) {
-		ERROR_ERRNO("Could not lseek image file %s", img);
-		close(fd);
-		return -1;
-	}
-
-	if (write(fd, "\0", 1) < 1) {
-		ERROR_ERRNO("Could not write to image file %s", img);
-		close(fd);
-		return -1;
-	}
-
-	// also allocate with  zeros for dm-integrity
-	if (fallocate(fd, FALLOC_FL_ZERO_RANGE, 0, storage_size)) {
-		ERROR_ERRNO("Could not write to image file %s", img);
-		close(fd);
-		return -1;
+	switch (prealloc) {
+	case MOUNT_PREALLOC_KEEP_SIZE:
+		// reserve unwritten extents, which still read as zeros
+		if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, storage_size)) {
+			ERROR_ERRNO("Could not preallocate image file %s", img);
+			close(fd);
+			return -1;
+		}
+		break;
+	case MOUNT_PREALLOC_FULL:
+		// also allocate with  zeros for dm-integrity
+		if (fallocate(fd, FALLOC_FL_ZERO_RANGE, 0, storage_size)) {
+			ERROR_ERRNO("Could not write to image file %s", img);
+			close(fd);
+			return -1;
+		}
+		break;
+	default:
+		break;
 	}
 
 	close(fd);
@@ -245,7 +310,8 @@ c_vol_create_sparse_file(const char *img, off64_t storage_size)
 }
 
 static int
-c_vol_create_image_empty(const char *img, const char *img_meta, uint64_t size)
+c_vol_create_image_empty(const char *img, const char *img_meta, uint64_t size,
+			 enum mount_prealloc prealloc)
 {
 	off64_t storage_size;
 	ASSERT(img);
@@ -254,11 +320,11 @@ c_vol_create_image_empty(const char *img, const char *img_meta, uint64_t size)
 	storage_size = MAX(size, 10);
 	storage_size *= 1024 * 1024;
 
-	IF_TRUE_RETVAL(-1 == c_vol_create_sparse_file(img, storage_size), -1);
+	IF_TRUE_RETVAL(-1 == c_vol_create_sparse_file(img, storage_size, prealloc), -1);
 
 	if (img_meta) {
 		off64_t meta_size = storage_size / 10;
-		IF_TRUE_RETVAL(-1 == c_vol_create_sparse_file(img_meta, meta_size), -1);
+		IF_TRUE_RETVAL(-1 == c_vol_create_sparse_file(img_meta, meta_size, prealloc), -1);
 	}
 
 	return 0;
@@ -339,8 +405,13 @@ c_vol_create_image(c_vol_t *vol, const char *img, const mount_entry_t *mntent)
 	case MOUNT_TYPE_SHARED_RW:
 	case MOUNT_TYPE_OVERLAY_RW:
 	case MOUNT_TYPE_EMPTY: {
-		char *img_meta = c_vol_meta_image_path_new(vol, mntent);
-		int ret = c_vol_create_image_empty(img, img_meta, mount_entry_get_size(mntent));
+		char *img_meta =
+			c_vol_use_integrity(mntent) ? c_vol_meta_image_path_new(vol, mntent) : NULL;
+		enum mount_prealloc prealloc = mount_entry_get_prealloc(mntent);
+		if (prealloc == MOUNT_PREALLOC_AUTO)
+			prealloc = img_meta ? MOUNT_PREALLOC_FULL : MOUNT_PREALLOC_NONE;
+		int ret = c_vol_create_image_empty(img, img_meta, mount_entry_get_size(mntent),
+						   prealloc);
 		mem_free0(img_meta);
 		return ret;
 	}
@@ -360,6 +431,17 @@ c_vol_create_image(c_vol_t *vol, const char *img, const mount_entry_t *mntent)
 	return 0;
 }
 
+/**
+ * Returns whether fs is a compressed read-only image file system, e.g. of a
+ * root converted from a docker image, which can neither be mounted writable
+ * nor formatted.
+ */
+static bool
+c_vol_fs_is_readonly(const char *fs)
+{
+	return !strcmp("squashfs", fs) || !strcmp("erofs", fs);
+}
+
 static int
 c_vol_format_image(const char *dev, const char *fs)
 {
@@ -590,7 +672,8 @@ err:
 static char *
 c_vol_get_tmpfs_opts_new(const char *mount_data, int uid, int gid)
 {
-	str_t *opts = str_new(NULL);
+	str_stack_t stack;
+	str_t *opts = str_init_stack(&stack, NULL);
 
 	// Only mount tmpfs with uid, gid options if shiftfs is not supported
 	// since later one it would be shifted by shiftfs twice.
@@ -604,46 +687,365 @@ c_vol_get_tmpfs_opts_new(const char *mount_data, int uid, int gid)
 }
 
 /*
- * Copy busybox binary to target_base directory.
+ * Prepares BUSYBOX_TOOLS_PATH in cmld's mount namespace: a copy of busybox and a
+ * symlink for each of its applets. The directory is built under a temporary name
+ * and renamed into place, so its existence means it is complete.
+ */
+static int
+c_vol_setup_busybox_tools(void)
+{
+	IF_TRUE_RETVAL_TRACE(file_is_dir(BUSYBOX_TOOLS_PATH), 0);
+
+	if (!file_exists(BUSYBOX_PATH)) {
+		WARN("Could not find %s for setup mode", BUSYBOX_PATH);
+		return -1;
+	}
+
+	int ret = -1;
+	char *tmp_dir = mem_printf("%s.%d", BUSYBOX_TOOLS_PATH, getpid());
+	char *tmp_bin = mem_printf("%s/busybox", tmp_dir);
+	// the symlinks point to BUSYBOX_PATH, which is where the container sees the copy
+	const char *const argv[] = { BUSYBOX_PATH, "--install", "-s", tmp_dir, NULL };
+
+	if (dir_mkdir_p(tmp_dir, 0755) < 0) {
+		WARN_ERRNO("Could not mkdir '%s' dir", tmp_dir);
+		goto out;
+	}
+	if (file_copy(BUSYBOX_PATH, tmp_bin, -1, 512, 0) < 0 || chmod(tmp_bin, 0755) < 0) {
+		WARN_ERRNO("Could not copy %s to %s", BUSYBOX_PATH, tmp_bin);
+		goto out;
+	}
+	if (proc_fork_and_execvp(argv) < 0) {
+		WARN("Could not install busybox symlinks to %s", tmp_dir);
+		goto out;
+	}
+	if (rename(tmp_dir, BUSYBOX_TOOLS_PATH) < 0 && !file_is_dir(BUSYBOX_TOOLS_PATH)) {
+		WARN_ERRNO("Could not move %s to %s", tmp_dir, BUSYBOX_TOOLS_PATH);
+		goto out;
+	}
+	INFO("Prepared busybox tools for setup mode in %s", BUSYBOX_TOOLS_PATH);
+	ret = 0;
+out:
+	if (file_is_dir(tmp_dir) && dir_walk_delete(tmp_dir, 0) < 0)
+		WARN("Could not remove %s", tmp_dir);
+	mem_free0(tmp_bin);
+	mem_free0(tmp_dir);
+	return ret;
+}
+
+/*
+ * Bind-mounts the shared busybox tools read-only to /bin and /sbin below target_base.
  * Remeber, this will only succeed if targetfs is writable.
  */
 static int
-c_vol_setup_busybox_copy(const char *target_base)
+c_vol_setup_busybox_bind(const char *target_base)
 {
-	int ret = 0;
-	char *target_bin = mem_printf("%s%s", target_base, BUSYBOX_PATH);
-	char *target_dir = mem_strdup(target_bin);
-	char *target_dir_p = dirname(target_dir);
-	if ((ret = dir_mkdir_p(target_dir_p, 0755)) < 0) {
-		WARN_ERRNO("Could not mkdir '%s' dir", target_dir_p);
-	} else if (file_exists("/bin/busybox")) {
-		file_copy("/bin/busybox", target_bin, -1, 512, 0);
-		INFO("Copied %s to container", target_bin);
-		if (chmod(target_bin, 0755)) {
-			WARN_ERRNO("Could not set %s executable", target_bin);
+	static const char *const dirs[] = { "/bin", "/sbin" };
+	const unsigned long remount_ro = MS_REMOUNT | MS_BIND | MS_RDONLY;
+
+	IF_FALSE_RETVAL_ERROR(file_is_dir(BUSYBOX_TOOLS_PATH), -1);
+
+	for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+		char *target_dir = mem_printf("%s%s", target_base, dirs[i]);
+		int ret = dir_mkdir_p(target_dir, 0755);
+		if (ret < 0) {
+			WARN_ERRNO("Could not mkdir '%s' dir", target_dir);
+		} else if (mount(BUSYBOX_TOOLS_PATH, target_dir, NULL, MS_BIND, NULL) < 0 ||
+			   mount(NULL, target_dir, NULL, remount_ro, NULL) < 0) {
+			WARN_ERRNO("Could not bind %s to %s", BUSYBOX_TOOLS_PATH, target_dir);
 			ret = -1;
 		}
-	} else {
-		WARN_ERRNO("Could not copy %s to container", target_bin);
-		ret = -1;
+		mem_free0(target_dir);
+		IF_TRUE_RETVAL(ret < 0, -1);
 	}
 
-	mem_free0(target_bin);
-	mem_free0(target_dir);
-	return ret;
+	INFO("Bound busybox tools into container");
+	return 0;
+}
+
+/**
+ * Returns true if the image of the mount entry is read-only and carries a
+ * dm-verity hash tree, i.e., it can be verified on access instead of up front.
+ */
+static bool
+c_vol_use_verity(const mount_entry_t *mntent)
+{
+	switch (mount_entry_get_type(mntent)) {
+	case MOUNT_TYPE_SHARED:
+	case MOUNT_TYPE_SHARED_RW:
+	case MOUNT_TYPE_OVERLAY_RO:
+		return mount_entry_has_verity(mntent);
+	default:
+		return false;
+	}
+}
+
+static void
+c_vol_shared_mount_free(c_vol_shared_mount_t *sm)
+{
+	if (sm->label && cryptfs_delete_blk_dev(sm->label) < 0)
+		WARN("Could not delete dm %s", sm->label);
+	if (rmdir(sm->dir) < 0)
+		DEBUG_ERRNO("Could not remove %s", sm->dir);
+	mem_free0(sm->sha256);
+	mem_free0(sm->dir);
+	mem_free0(sm->label);
+	mem_free0(sm);
+}
+
+static bool
+c_vol_shared_mount_applies(const mount_entry_t *mntent)
+{
+	// only share images which are verified against their hash
+	return mount_entry_get_type(mntent) == MOUNT_TYPE_SHARED &&
+	       !mount_entry_is_encrypted(mntent) && mount_entry_get_sha256(mntent);
+}
+
+/**
+ * Takes another reference of an existing shared mount of the image with the given hash.
+ * @return The shared mount or NULL if the image is not mounted yet.
+ */
+static c_vol_shared_mount_t *
+c_vol_shared_mount_ref(const char *sha256)
+{
+	for (list_t *l = c_vol_shared_mounts; l; l = l->next) {
+		c_vol_shared_mount_t *sm = l->data;
+		if (strcmp(sm->sha256, sha256) == 0) {
+			sm->refs++;
+			return sm;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Mounts the image of the mount entry read-only in cmld's mount namespace or takes
+ * another reference of an existing mount of the same image.
+ * @return The shared mount or NULL if the image is not shared.
+ */
+static c_vol_shared_mount_t *
+c_vol_shared_mount_acquire(const guestos_t *os, const mount_entry_t *mntent)
+{
+	const char *sha256 = mount_entry_get_sha256(mntent);
+	char *img = NULL, *dev = NULL;
+	int fd = -1;
+
+	IF_FALSE_RETVAL(c_vol_shared_mount_applies(mntent), NULL);
+
+	c_vol_shared_mount_t *sm = c_vol_shared_mount_ref(sha256);
+	IF_TRUE_RETVAL(sm, sm);
+
+	sm = mem_new0(c_vol_shared_mount_t, 1);
+	sm->sha256 = mem_strdup(sha256);
+	sm->dir = mem_printf("%s/%s", SHARED_MOUNTS_PATH, sha256);
+	sm->refs = 1;
+
+	img = mem_printf("%s/%s.img", guestos_get_dir(os), mount_entry_get_img(mntent));
+
+	if (dir_mkdir_p(sm->dir, 0700) < 0) {
+		ERROR_ERRNO("Could not mkdir %s", sm->dir);
+		goto error;
+	}
+
+	dev = c_vol_create_loopdev_new(&fd, img, true);
+	IF_NULL_GOTO(dev, error);
+
+	if (c_vol_use_verity(mntent)) {
+		sm->label = mem_printf("shared-%s", sha256);
+		char *verity = cryptfs_get_device_path_new(sm->label);
+		if (!file_is_blk(verity)) {
+			mem_free0(verity);
+			verity = cryptfs_setup_verity_new(sm->label, dev,
+							  mount_entry_get_verity_data_size(mntent),
+							  mount_entry_get_verity_root_hash(mntent),
+							  mount_entry_get_verity_salt(mntent));
+		}
+		if (!verity) {
+			ERROR("Setting up verity volume %s for %s failed", sm->label, dev);
+			mem_free0(sm->label);
+			goto error;
+		}
+		loopdev_free(dev);
+		dev = verity;
+
+		if (file_wait_dev(dev, C_VOL_DEV_WAIT_TIMEOUT) < 0) {
+			ERROR("Device %s did not appear", dev);
+			goto error;
+		}
+	}
+
+	// containers apply their own mount flags on top of their bind mounts
+	if (mount(dev, sm->dir, mount_entry_get_fs(mntent), MS_RDONLY | MS_NOATIME,
+		  mount_entry_get_mount_data(mntent)) < 0 &&
+	    mount(dev, sm->dir, mount_entry_get_fs(mntent), MS_RDONLY | MS_NOATIME, NULL) < 0) {
+		ERROR_ERRNO("Could not mount shared image %s using %s to %s", img, dev, sm->dir);
+		goto error;
+	}
+
+	INFO("Mounted shared image %s to %s", img, sm->dir);
+	c_vol_shared_mounts = list_append(c_vol_shared_mounts, sm);
+
+	close(fd);
+	loopdev_free(dev);
+	mem_free0(img);
+	return sm;
+
+error:
+	if (fd >= 0)
+		close(fd);
+	if (dev)
+		loopdev_free(dev);
+	mem_free0(img);
+	c_vol_shared_mount_free(sm);
+	return NULL;
+}
+
+/**
+ * Takes a reference of a shared mount which a previous cmld instance left mounted in
+ * cmld's mount namespace for a running container.
+ * @return The shared mount or NULL if the image is not mounted.
+ */
+static c_vol_shared_mount_t *
+c_vol_shared_mount_adopt(const mount_entry_t *mntent)
+{
+	const char *sha256 = mount_entry_get_sha256(mntent);
+
+	IF_FALSE_RETVAL(c_vol_shared_mount_applies(mntent), NULL);
+
+	c_vol_shared_mount_t *sm = c_vol_shared_mount_ref(sha256);
+	IF_TRUE_RETVAL(sm, sm);
+
+	char *dir = mem_printf("%s/%s", SHARED_MOUNTS_PATH, sha256);
+	if (!file_is_mountpoint(dir)) {
+		mem_free0(dir);
+		return NULL;
+	}
+
+	sm = mem_new0(c_vol_shared_mount_t, 1);
+	sm->sha256 = mem_strdup(sha256);
+	sm->dir = dir;
+	sm->label = c_vol_use_verity(mntent) ? mem_printf("shared-%s", sha256) : NULL;
+	sm->refs = 1;
+
+	INFO("Adopted shared mount %s", sm->dir);
+	c_vol_shared_mounts = list_append(c_vol_shared_mounts, sm);
+	return sm;
+}
+
+static void
+c_vol_shared_mount_release(c_vol_shared_mount_t *sm)
+{
+	if (--sm->refs > 0)
+		return;
+
+	DEBUG("Last container released shared mount %s", sm->dir);
+	if (umount(sm->dir) < 0 && umount2(sm->dir, MNT_DETACH) < 0)
+		WARN_ERRNO("Could not umount %s", sm->dir);
+
+	c_vol_shared_mounts = list_remove(c_vol_shared_mounts, sm);
+	c_vol_shared_mount_free(sm);
+}
+
+static c_vol_shared_mount_t *
+c_vol_shared_mount_find(const c_vol_t *vol, const mount_entry_t *mntent)
+{
+	const char *sha256 = mount_entry_get_sha256(mntent);
+	IF_NULL_RETVAL(sha256, NULL);
+
+	for (list_t *l = vol->shared_mounts; l; l = l->next) {
+		c_vol_shared_mount_t *sm = l->data;
+		if (strcmp(sm->sha256, sha256) == 0)
+			return sm;
+	}
+	return NULL;
+}
+
+static void
+c_vol_shared_mounts_release_all(c_vol_t *vol)
+{
+	c_vol_shared_mounts_release(vol->shared_mounts);
+	vol->shared_mounts = NULL;
 }
 
+list_t *
+c_vol_shared_mounts_acquire(const guestos_t *os)
+{
+	ASSERT(os);
+
+	list_t *shared_mounts = NULL;
+	mount_t *mount = mount_new();
+	guestos_fill_mount(os, mount);
+
+	for (size_t i = 0; i < mount_get_count(mount); i++) {
+		c_vol_shared_mount_t *sm =
+			c_vol_shared_mount_acquire(os, mount_get_entry(mount, i));
+		if (sm)
+			shared_mounts = list_append(shared_mounts, sm);
+	}
+
+	mount_free(mount);
+	return shared_mounts;
+}
+
+void
+c_vol_shared_mounts_release(list_t *shared_mounts)
+{
+	for (list_t *l = shared_mounts; l; l = l->next)
+		c_vol_shared_mount_release(l->data);
+	list_delete(shared_mounts);
+}
+
+/**
+ * Checks if the image at img was created by c_vol_prepare_images() but still
+ * lacks a file system and forgets about it, as the caller takes care of it now.
+ */
+static bool
+c_vol_take_new_image(c_vol_t *vol, const char *img)
+{
+	for (list_t *l = vol->new_images; l; l = l->next) {
+		if (strcmp(l->data, img))
+			continue;
+		mem_free0(l->data);
+		vol->new_images = list_unlink(vol->new_images, l);
+		return true;
+	}
+	return false;
+}
+
+static void
+c_vol_new_images_clear(c_vol_t *vol)
+{
+	for (list_t *l = vol->new_images; l; l = l->next)
+		mem_free0(l->data);
+	list_delete(vol->new_images);
+	vol->new_images = NULL;
+}
+
+/*
+ * Stacks an ephemeral overlay on dir, whose upper dir is kept in a tmpfs limited to the
+ * size of the mount entry. Neither an image nor a loop or dm device is involved.
+ */
 static int
-c_vol_setup_busybox_install(void)
+c_vol_mount_overlay_ephemeral(c_vol_t *vol, const char *dir, const mount_entry_t *mntent,
+			      unsigned long mountflags)
 {
-	// skip if busybox was not coppied
-	IF_FALSE_RETVAL_TRACE(file_exists("/bin/busybox"), 0);
+	char *tmpfs_opts = mem_printf("size=%" PRIu64 "m", MAX(mount_entry_get_size(mntent), 10));
+	char *overlayfs_mount_dir = mem_printf("/tmp/overlayfs/%s/%d",
+					       uuid_string(container_get_uuid(vol->container)),
+					       ++vol->overlay_count);
 
-	IF_TRUE_RETVAL(dir_mkdir_p("/bin", 0755) < 0, -1);
-	IF_TRUE_RETVAL(dir_mkdir_p("/sbin", 0755) < 0, -1);
+	int ret = c_vol_mount_overlay(dir, "tmpfs", NULL, mountflags, tmpfs_opts, NULL, NULL,
+				      overlayfs_mount_dir);
+	if (ret < 0)
+		ERROR("Could not mount ephemeral overlay %s to %s", mount_entry_get_img(mntent),
+		      dir);
+	else
+		DEBUG("Successfully mounted ephemeral overlay %s to %s",
+		      mount_entry_get_img(mntent), dir);
 
-	const char *const argv[] = { "busybox", "--install", "-s", NULL };
-	return proc_fork_and_execvp(argv);
+	mem_free0(tmpfs_opts);
+	mem_free0(overlayfs_mount_dir);
+	return ret;
 }
 
 /**
@@ -672,6 +1074,8 @@ c_vol_mount_image(c_vol_t *vol, const char *root, const mount_entry_t *mntent)
 
 	img = dev = img_meta = dev_meta = dir = NULL;
 
+	PROBE1(vol_mount_image, mount_entry_get_img(mntent));
+
 	if (mount_entry_get_dir(mntent)[0] == '/')
 		dir = mem_printf("%s%s", root, mount_entry_get_dir(mntent));
 	else
@@ -720,6 +1124,10 @@ c_vol_mount_image(c_vol_t *vol, const char *root, const mount_entry_t *mntent)
 		goto error;
 	}
 
+	// overlays mount their lower image read-only anyway
+	if (!overlay && c_vol_fs_is_readonly(mount_entry_get_fs(mntent)))
+		mountflags |= MS_RDONLY;
+
 	// try to create mount point before mount, usually not necessary...
 	if (dir_mkdir_p(dir, 0777) < 0)
 		DEBUG_ERRNO("Could not mkdir %s", dir);
@@ -731,8 +1139,8 @@ c_vol_mount_image(c_vol_t *vol, const char *root, const mount_entry_t *mntent)
 			  tmpfs_opts) >= 0) {
 			DEBUG("Sucessfully mounted %s to %s", mount_entry_get_fs(mntent), dir);
 			mem_free0(tmpfs_opts);
-			if (is_root && setup_mode && c_vol_setup_busybox_copy(dir) < 0)
-				WARN("Cannot copy busybox for setup mode!");
+			if (is_root && setup_mode && c_vol_setup_busybox_bind(dir) < 0)
+				WARN("Cannot bind busybox for setup mode!");
 			goto final;
 		} else {
 			ERROR_ERRNO("Cannot mount %s to %s", mount_entry_get_fs(mntent), dir);
@@ -741,14 +1149,33 @@ c_vol_mount_image(c_vol_t *vol, const char *root, const mount_entry_t *mntent)
 		}
 	}
 
+	c_vol_shared_mount_t *shared = NULL;
+	if (mount_entry_get_type(mntent) == MOUNT_TYPE_SHARED &&
+	    (shared = c_vol_shared_mount_find(vol, mntent))) {
+		DEBUG("Binding shared mount %s of image %s to %s", shared->dir, img, dir);
+		if (mount(shared->dir, dir, NULL, MS_BIND, NULL) < 0 ||
+		    mount(NULL, dir, NULL, MS_REMOUNT | MS_BIND | mountflags, NULL) < 0) {
+			ERROR_ERRNO("Could not bind shared mount %s to %s", shared->dir, dir);
+			goto error;
+		}
+		goto final;
+	}
+
+	if (mount_entry_is_ephemeral(mntent)) {
+		IF_TRUE_GOTO(c_vol_mount_overlay_ephemeral(vol, dir, mntent, mountflags) < 0, error);
+		goto final;
+	}
+
 	if (c_vol_check_image(vol, img) < 0) {
 		new_image = true;
 		if (c_vol_create_image(vol, img, mntent) < 0) {
 			goto error;
 		}
+	} else {
+		new_image = c_vol_take_new_image(vol, img);
 	}
 
-	dev = c_vol_create_loopdev_new(&fd, img);
+	dev = c_vol_create_loopdev_new(&fd, img, (mountflags & MS_RDONLY) && !encrypted);
 	IF_NULL_GOTO(dev, error);
 
 	if (encrypted) {
@@ -773,18 +1200,25 @@ c_vol_mount_image(c_vol_t *vol, const char *root, const mount_entry_t *mntent)
 		} else {
 			DEBUG("Setting up cryptfs volume %s for %s", label, dev);
 
-			img_meta = c_vol_meta_image_path_new(vol, mntent);
-			dev_meta = c_vol_create_loopdev_new(&fd_meta, img_meta);
+			if (c_vol_use_integrity(mntent)) {
+				img_meta = c_vol_meta_image_path_new(vol, mntent);
+				dev_meta = c_vol_create_loopdev_new(&fd_meta, img_meta, false);
 
-			IF_NULL_GOTO(dev_meta, error);
+				IF_NULL_GOTO(dev_meta, error);
+			}
 
 			mem_free0(crypt);
-			crypt = cryptfs_setup_volume_new(
-				label, dev, container_get_key(vol->container), dev_meta);
+			crypt = cryptfs_setup_volume_new(label, dev,
+							 container_get_key(vol->container),
+							 dev_meta,
+							 mount_entry_get_crypt_opts(mntent));
 
 			// release loopdev fd (crypt device should keep it open now)
-			close(fd_meta);
-			mem_free0(img_meta);
+			if (fd_meta > 0)
+				close(fd_meta);
+			fd_meta = 0;
+			if (img_meta)
+				mem_free0(img_meta);
 
 			if (!crypt) {
 				audit_log_event(container_get_uuid(vol->container), FSA, CMLD,
@@ -805,10 +1239,46 @@ c_vol_mount_image(c_vol_t *vol, const char *root, const mount_entry_t *mntent)
 		mem_free0(dev);
 		dev = crypt;
 
-		// TODO: timeout?
-		while (access(dev, F_OK) < 0) {
-			usleep(1000 * 10);
-			DEBUG("Waiting for %s", dev);
+		if (file_wait_dev(dev, C_VOL_DEV_WAIT_TIMEOUT) < 0) {
+			ERROR("Device %s did not appear", dev);
+			goto error;
+		}
+	}
+
+	if (!encrypted && c_vol_use_verity(mntent)) {
+		char *label, *verity;
+
+		label = mem_printf("%s-%s", uuid_string(container_get_uuid(vol->container)),
+				   mount_entry_get_img(mntent));
+
+		verity = cryptfs_get_device_path_new(label);
+		if (file_is_blk(verity)) {
+			INFO("Using existing verity device: %s", verity);
+		} else {
+			DEBUG("Setting up verity volume %s for %s", label, dev);
+			mem_free0(verity);
+			verity = cryptfs_setup_verity_new(label, dev,
+							  mount_entry_get_verity_data_size(mntent),
+							  mount_entry_get_verity_root_hash(mntent),
+							  mount_entry_get_verity_salt(mntent));
+			if (!verity) {
+				audit_log_event(container_get_uuid(vol->container), FSA, CMLD,
+						CONTAINER_MGMT, "setup-verity-volume",
+						uuid_string(container_get_uuid(vol->container)), 2,
+						"label", label);
+				ERROR("Setting up verity volume %s for %s failed", label, dev);
+				mem_free0(label);
+				goto error;
+			}
+		}
+
+		mem_free0(label);
+		mem_free0(dev);
+		dev = verity;
+
+		if (file_wait_dev(dev, C_VOL_DEV_WAIT_TIMEOUT) < 0) {
+			ERROR("Device %s did not appear", dev);
+			goto error;
 		}
 	}
 
@@ -892,7 +1362,8 @@ c_vol_mount_image(c_vol_t *vol, const char *root, const mount_entry_t *mntent)
 	     "superblock was detected.",
 	     img, dev, dir);
 
-	if (mount_entry_get_type(mntent) != MOUNT_TYPE_EMPTY)
+	if (mount_entry_get_type(mntent) != MOUNT_TYPE_EMPTY ||
+	    c_vol_fs_is_readonly(mount_entry_get_fs(mntent)))
 		goto error;
 
 	/* TODO better password handling before in order to remove this condition. */
@@ -946,6 +1417,7 @@ final:
 		close(fd);
 	if (fd_meta)
 		close(fd_meta);
+	PROBE2(vol_mount_image_done, mount_entry_get_img(mntent), 0);
 	return 0;
 
 error:
@@ -963,6 +1435,7 @@ error:
 		close(fd);
 	if (fd_meta)
 		close(fd_meta);
+	PROBE2(vol_mount_image_done, mount_entry_get_img(mntent), -1);
 	return -1;
 }
 
@@ -1006,6 +1479,58 @@ c_vol_umount_dir(const char *mount_dir)
 	return 0;
 }
 
+/*
+ * Returns a mount table with the encrypted image the processes of the container are
+ * checkpointed to, see c_criu.h, or NULL if checkpoints are disabled for the container.
+ */
+static mount_t *
+c_vol_checkpoint_mount_new(const c_vol_t *vol)
+{
+	uint32_t size = container_get_checkpoint_size(vol->container);
+	IF_TRUE_RETVAL(size == 0 || container_has_setup_mode(vol->container), NULL);
+	IF_TRUE_RETVAL(container_get_type(vol->container) == CONTAINER_TYPE_KVM, NULL);
+
+	mount_t *mnt = mount_new();
+	mount_add_entry(mnt, MOUNT_TYPE_EMPTY, C_VOL_CHECKPOINT_DIR, C_VOL_CHECKPOINT_DIR, "ext4",
+			size);
+	return mnt;
+}
+
+/*
+ * Mounts the checkpoint image to <images_dir>/checkpoint in cmld's mount namespace.
+ * It is mounted outside of the container's root, so the container never sees it.
+ */
+static int
+c_vol_mount_checkpoint(c_vol_t *vol)
+{
+	mount_t *mnt = c_vol_checkpoint_mount_new(vol);
+	IF_NULL_RETVAL(mnt, 0);
+
+	int ret = c_vol_mount_image(vol, container_get_images_dir(vol->container),
+				    mount_get_entry(mnt, 0));
+	mount_free(mnt);
+	return ret;
+}
+
+static void
+c_vol_cleanup_checkpoint(c_vol_t *vol, bool is_rebooting)
+{
+	char *dir = mem_printf("%s/%s", container_get_images_dir(vol->container),
+			       C_VOL_CHECKPOINT_DIR);
+	if (c_vol_umount_dir(dir) < 0)
+		WARN("Could not umount checkpoint of container %s",
+		     container_get_description(vol->container));
+	mem_free0(dir);
+
+	IF_TRUE_RETURN(is_rebooting);
+
+	char *label = mem_printf("%s-%s", uuid_string(container_get_uuid(vol->container)),
+				 C_VOL_CHECKPOINT_DIR);
+	if (cryptfs_delete_blk_dev(label) < 0)
+		DEBUG("Could not delete dm %s", label);
+	mem_free0(label);
+}
+
 static int
 c_vol_cleanup_overlays_cb(const char *path, const char *file, UNUSED void *data)
 {
@@ -1086,6 +1611,252 @@ error:
  * Mount all image files.
  * This function is called in the rootns.
  */
+/**
+ * Sets up the dm devices of all encrypted images of a mount table at once, so
+ * that c_vol_mount_image() finds existing mapper devices for them. Images which
+ * have to be created first, or whose batch setup failed, are left to the
+ * sequential setup in c_vol_mount_image().
+ */
+static void
+c_vol_setup_crypt_batch(c_vol_t *vol, const mount_t *mount)
+{
+	list_t *loopdevs = NULL;
+	list_t *fds = NULL;
+	list_t *labels = NULL;
+	size_t n = mount_get_count(mount);
+
+	IF_NULL_RETURN(container_get_key(vol->container));
+
+	cryptfs_batch_t *batch = cryptfs_batch_new();
+
+	for (size_t i = 0; i < n; i++) {
+		const mount_entry_t *mntent = mount_get_entry(mount, i);
+		if (!mount_entry_is_encrypted(mntent))
+			continue;
+
+		char *label = mem_printf("%s-%s", uuid_string(container_get_uuid(vol->container)),
+					 mount_entry_get_img(mntent));
+		char *crypt = cryptfs_get_device_path_new(label);
+		char *img = c_vol_image_path_new(vol, mntent);
+		bool integrity = c_vol_use_integrity(mntent);
+		char *img_meta = integrity ? c_vol_meta_image_path_new(vol, mntent) : NULL;
+		char *dev = NULL, *dev_meta = NULL;
+		int fd = -1, fd_meta = -1;
+
+		if (file_is_blk(crypt) || !img || access(img, F_OK) < 0 ||
+		    (integrity && (!img_meta || access(img_meta, F_OK) < 0)))
+			goto next;
+
+		dev = c_vol_create_loopdev_new(&fd, img, false);
+		IF_NULL_GOTO(dev, next);
+		if (integrity) {
+			dev_meta = c_vol_create_loopdev_new(&fd_meta, img_meta, false);
+			IF_NULL_GOTO(dev_meta, next);
+		}
+
+		if (cryptfs_batch_add(batch, label, dev, container_get_key(vol->container),
+				      dev_meta, mount_entry_get_crypt_opts(mntent)) < 0)
+			goto next;
+
+		labels = list_append(labels, label);
+		label = NULL;
+	next:
+		// the loopdevs are kept until the crypt devices hold them
+		if (dev) {
+			loopdevs = list_append(loopdevs, dev);
+			fds = list_append(fds, (void *)(intptr_t)fd);
+		}
+		if (dev_meta) {
+			loopdevs = list_append(loopdevs, dev_meta);
+			fds = list_append(fds, (void *)(intptr_t)fd_meta);
+		}
+		if (label)
+			mem_free0(label);
+		if (img)
+			mem_free0(img);
+		if (img_meta)
+			mem_free0(img_meta);
+		mem_free0(crypt);
+	}
+
+	if (labels) {
+		DEBUG("Setting up %u cryptfs volumes in batch", list_length(labels));
+		cryptfs_batch_setup(batch);
+	}
+
+	for (list_t *l = labels; l; l = l->next) {
+		char *label = l->data;
+		if (cryptfs_batch_get_device(batch, label))
+			audit_log_event(container_get_uuid(vol->container), SSA, CMLD,
+					CONTAINER_MGMT, "setup-crypted-volume",
+					uuid_string(container_get_uuid(vol->container)), 2, "label",
+					label);
+		mem_free0(label);
+	}
+	list_delete(labels);
+
+	// release loopdev fds (crypt devices should keep them open now)
+	for (list_t *l = fds; l; l = l->next)
+		close((int)(intptr_t)l->data);
+	list_delete(fds);
+	for (list_t *l = loopdevs; l; l = l->next)
+		loopdev_free(l->data);
+	list_delete(loopdevs);
+
+	cryptfs_batch_free(batch);
+}
+
+typedef struct c_vol_prepare_job {
+	const mount_entry_t *mntent;
+	char *img;
+	bool formatted;
+	int ret;
+} c_vol_prepare_job_t;
+
+typedef struct c_vol_prepare {
+	c_vol_t *vol;
+	c_vol_prepare_job_t *jobs;
+	size_t count;
+	size_t next;
+	pthread_mutex_t lock;
+} c_vol_prepare_t;
+
+static void *
+c_vol_prepare_worker(void *data)
+{
+	c_vol_prepare_t *prep = data;
+
+	for (;;) {
+		pthread_mutex_lock(&prep->lock);
+		size_t i = prep->next++;
+		pthread_mutex_unlock(&prep->lock);
+		if (i >= prep->count)
+			break;
+
+		c_vol_prepare_job_t *job = &prep->jobs[i];
+		enum mount_type type = mount_entry_get_type(job->mntent);
+
+		job->ret = c_vol_create_image(prep->vol, job->img, job->mntent);
+		if (job->ret < 0)
+			continue;
+
+		/*
+		 * Plain images get their file system right away, encrypted ones have to be
+		 * formatted through their crypt device later on in c_vol_mount_image().
+		 */
+		if (mount_entry_is_encrypted(job->mntent) ||
+		    (type != MOUNT_TYPE_EMPTY && type != MOUNT_TYPE_OVERLAY_RW))
+			continue;
+
+		job->ret = c_vol_format_image(job->img, mount_entry_get_fs(job->mntent));
+		if (job->ret < 0)
+			ERROR("Could not format new image %s", job->img);
+		else
+			job->formatted = true;
+	}
+	return NULL;
+}
+
+/**
+ * Creates all images of the mount table which do not exist yet, using a pool of
+ * worker threads as copying, preallocating and formatting them are independent of
+ * each other. Only the images are prepared here: mounting stays sequential in the
+ * order of the mount table, since later entries (e.g. overlays) are stacked on the
+ * mount points of earlier ones.
+ * @return -1 if any of the images could not be created, 0 otherwise.
+ */
+static int
+c_vol_prepare_images(c_vol_t *vol, const mount_t *mount)
+{
+	size_t n = mount_get_count(mount);
+	int ret = 0;
+
+	c_vol_prepare_t prep = { .vol = vol, .jobs = mem_new0(c_vol_prepare_job_t, MAX(n, 1)) };
+
+	for (size_t i = 0; i < n; i++) {
+		const mount_entry_t *mntent = mount_get_entry(mount, i);
+
+		switch (mount_entry_get_type(mntent)) {
+		case MOUNT_TYPE_SHARED_RW:
+		case MOUNT_TYPE_OVERLAY_RW:
+		case MOUNT_TYPE_EMPTY:
+		case MOUNT_TYPE_COPY:
+		case MOUNT_TYPE_DEVICE:
+		case MOUNT_TYPE_DEVICE_RW:
+			break;
+		default:
+			continue; // nothing to create for this entry
+		}
+		if (strcmp(mount_entry_get_fs(mntent), "tmpfs") == 0 ||
+		    mount_entry_is_ephemeral(mntent))
+			continue;
+
+		char *img = c_vol_image_path_new(vol, mntent);
+		if (!img || access(img, F_OK) == 0) {
+			mem_free0(img);
+			continue;
+		}
+		for (size_t j = 0; img && j < prep.count; j++) {
+			if (strcmp(prep.jobs[j].img, img) == 0)
+				mem_free0(img);
+		}
+		if (!img)
+			continue;
+
+		prep.jobs[prep.count].mntent = mntent;
+		prep.jobs[prep.count].img = img;
+		prep.count++;
+	}
+
+	if (prep.count == 0)
+		goto out;
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t nthreads = MIN(prep.count, C_VOL_PREPARE_THREADS_MAX);
+	if (cpus > 0)
+		nthreads = MIN(nthreads, (size_t)cpus);
+
+	DEBUG("Preparing %zu new images using %zu threads", prep.count, nthreads);
+
+	pthread_mutex_init(&prep.lock, NULL);
+
+	// the calling thread is a worker on its own
+	pthread_t *threads = mem_new0(pthread_t, nthreads);
+	size_t started = 0;
+	for (; started + 1 < nthreads; started++) {
+		if (pthread_create(&threads[started], NULL, c_vol_prepare_worker, &prep)) {
+			WARN("Could not start image preparation thread");
+			break;
+		}
+	}
+	c_vol_prepare_worker(&prep);
+	for (size_t i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	mem_free0(threads);
+
+	pthread_mutex_destroy(&prep.lock);
+
+	for (size_t i = 0; i < prep.count; i++) {
+		c_vol_prepare_job_t *job = &prep.jobs[i];
+		if (job->ret < 0) {
+			ERROR("Could not prepare image %s", job->img);
+			// do not leave a partially created image behind for the next start
+			if (unlink(job->img) < 0 && errno != ENOENT)
+				WARN_ERRNO("Could not remove image %s", job->img);
+			ret = -1;
+		} else if (!job->formatted) {
+			vol->new_images = list_append(vol->new_images, job->img);
+			job->img = NULL;
+		}
+	}
+
+out:
+	for (size_t i = 0; i < prep.count; i++)
+		mem_free0(prep.jobs[i].img);
+	mem_free0(prep.jobs);
+	return ret;
+}
+
 static int
 c_vol_mount_images(c_vol_t *vol)
 {
@@ -1115,6 +1886,11 @@ c_vol_mount_images(c_vol_t *vol)
 			DEBUG_ERRNO("Could not mkdir %s", c_root);
 	}
 
+	if (c_vol_prepare_images(vol, container_get_mount(vol->container)) < 0)
+		goto err;
+
+	c_vol_setup_crypt_batch(vol, container_get_mount(vol->container));
+
 	n = mount_get_count(container_get_mount(vol->container));
 	for (i = 0; i < n; i++) {
 		const mount_entry_t *mntent;
@@ -1125,9 +1901,11 @@ c_vol_mount_images(c_vol_t *vol)
 			goto err;
 		}
 	}
+	c_vol_new_images_clear(vol);
 	mem_free0(c_root);
 	return 0;
 err:
+	c_vol_new_images_clear(vol);
 	c_vol_umount_all(vol);
 	c_vol_cleanup_dm(vol);
 	mem_free0(c_root);
@@ -1212,8 +1990,11 @@ c_vol_verify_mount_entries(const c_vol_t *vol)
 		if (mount_entry_get_type(mntent) == MOUNT_TYPE_SHARED ||
 		    mount_entry_get_type(mntent) == MOUNT_TYPE_SHARED_RW ||
 		    mount_entry_get_type(mntent) == MOUNT_TYPE_OVERLAY_RO) {
+			// verity images are verified block-wise by the kernel on access,
+			// thus only do the quick (size) check here
+			bool thorough = !c_vol_use_verity(mntent);
 			if (guestos_check_mount_image_block(container_get_os(vol->container),
-							    mntent, true) != CHECK_IMAGE_GOOD) {
+							    mntent, thorough) != CHECK_IMAGE_GOOD) {
 				ERROR("Cannot verify image %s: image file is corrupted",
 				      mount_entry_get_img(mntent));
 				return false;
@@ -1223,6 +2004,147 @@ c_vol_verify_mount_entries(const c_vol_t *vol)
 	return true;
 }
 
+/**
+ * Returns whether mntent is a read-only guestos image whose blocks read during boot
+ * are the same for every start of the guestos version, i.e. which gets a readahead
+ * profile.
+ */
+static bool
+c_vol_readahead_applies(const mount_entry_t *mntent)
+{
+	return (mount_entry_get_type(mntent) == MOUNT_TYPE_SHARED ||
+		mount_entry_get_type(mntent) == MOUNT_TYPE_SHARED_RW) &&
+	       strcmp(mount_entry_get_fs(mntent), "tmpfs");
+}
+
+/**
+ * Writes the ranges of img which are in the page cache to the profile file, as
+ * "<offset> <length>" lines in bytes sorted by offset.
+ */
+static int
+c_vol_readahead_record(const char *img, const char *profile)
+{
+	void *map = MAP_FAILED;
+	unsigned char *vec = NULL;
+	str_t *ranges = NULL;
+	char *tmp = NULL;
+	struct stat st;
+	int ret = -1;
+
+	int fd = open(img, O_RDONLY | O_CLOEXEC);
+	IF_TRUE_RETVAL(fd < 0, -1);
+	IF_TRUE_GOTO(fstat(fd, &st) < 0 || st.st_size <= 0, out);
+
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t pages = (st.st_size + page_size - 1) / page_size;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	IF_TRUE_GOTO(map == MAP_FAILED, out);
+	vec = mem_alloc(pages);
+	IF_TRUE_GOTO(mincore(map, st.st_size, vec) < 0, out);
+
+	ranges = str_new(NULL);
+	for (size_t i = 0; i < pages;) {
+		if (!(vec[i] & 1)) {
+			i++;
+			continue;
+		}
+		size_t start = i, end = i + 1;
+		for (i = end; i < pages && i < end + C_VOL_READAHEAD_GAP; i++) {
+			if (vec[i] & 1)
+				end = i + 1;
+		}
+		i = end;
+		str_append_printf(ranges, "%zu %zu\n", start * page_size, (end - start) * page_size);
+	}
+
+	ret = 0;
+	if (str_length(ranges) == 0)
+		goto out;
+
+	tmp = mem_printf("%s.tmp", profile);
+	if (file_write(tmp, str_buffer(ranges), str_length(ranges)) < 0 ||
+	    rename(tmp, profile) < 0) {
+		unlink(tmp);
+		ret = -1;
+	}
+out:
+	if (map != MAP_FAILED)
+		munmap(map, st.st_size);
+	if (ranges)
+		str_free(ranges, true);
+	mem_free0(vec);
+	mem_free0(tmp);
+	close(fd);
+	return ret;
+}
+
+/**
+ * Records the profiles of all images which do not have one yet. As the page cache
+ * is shared, this includes blocks read by other containers of the same images, which
+ * are read during their boot as well in the common case.
+ */
+static void
+c_vol_readahead_record_cb(event_timer_t *timer, void *data)
+{
+	c_vol_t *vol = data;
+	ASSERT(vol);
+
+	event_timer_free(timer);
+	vol->readahead_timer = NULL;
+
+	const mount_t *mount = container_get_mount(vol->container);
+	for (size_t i = 0; i < mount_get_count(mount); i++) {
+		const mount_entry_t *mntent = mount_get_entry(mount, i);
+		if (!c_vol_readahead_applies(mntent))
+			continue;
+
+		char *img = c_vol_image_path_new(vol, mntent);
+		char *profile = mem_printf("%s" GUESTOS_READAHEAD_EXT, img);
+		if (!file_exists(profile)) {
+			if (c_vol_readahead_record(img, profile) < 0)
+				WARN_ERRNO("Could not record readahead profile of %s", img);
+			else
+				DEBUG("Recorded readahead profile of %s", img);
+		}
+		mem_free0(profile);
+		mem_free0(img);
+	}
+}
+
+/**
+ * Asks the kernel to read the ranges of the profile of img into the page cache. The
+ * reads are only queued, thus they proceed while the container is set up.
+ */
+static void
+c_vol_readahead_replay(const char *img, const char *profile)
+{
+	char *ranges = file_read_new(profile, file_size(profile) + 1);
+	IF_NULL_RETURN(ranges);
+
+	int fd = open(img, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		mem_free0(ranges);
+		return;
+	}
+
+	size_t total = 0;
+	char *saveptr = NULL;
+	for (char *line = strtok_r(ranges, "\n", &saveptr); line && total < C_VOL_READAHEAD_MAX;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		unsigned long long off, len;
+		if (sscanf(line, "%llu %llu", &off, &len) != 2)
+			break;
+		len = MIN(len, (unsigned long long)(C_VOL_READAHEAD_MAX - total));
+		if (posix_fadvise(fd, off, len, POSIX_FADV_WILLNEED))
+			break;
+		total += len;
+	}
+	DEBUG("Queued readahead of %zu bytes of %s", total, img);
+
+	close(fd);
+	mem_free0(ranges);
+}
+
 /******************************************************************************/
 
 c_vol_t *
@@ -1243,6 +2165,12 @@ c_vol_free(c_vol_t *vol)
 {
 	ASSERT(vol);
 
+	c_vol_new_images_clear(vol);
+	c_vol_shared_mounts_release_all(vol);
+	if (vol->readahead_timer) {
+		event_remove_timer(vol->readahead_timer);
+		event_timer_free(vol->readahead_timer);
+	}
 	mem_free0(vol->root);
 	mem_free0(vol);
 }
@@ -1280,7 +2208,8 @@ c_vol_do_shared_bind_mounts(const c_vol_t *vol)
 	// setup persitent image as date store for shared objects
 	bind_img_path = mem_printf("%s/_store.img", SHARED_FILES_PATH);
 	if (!file_exists(bind_img_path)) {
-		if (c_vol_create_image_empty(bind_img_path, NULL, SHARED_FILES_STORE_SIZE) < 0) {
+		if (c_vol_create_image_empty(bind_img_path, NULL, SHARED_FILES_STORE_SIZE,
+					     MOUNT_PREALLOC_NONE) < 0) {
 			goto err;
 		}
 		if (c_vol_format_image(bind_img_path, "ext4") < 0) {
@@ -1288,7 +2217,7 @@ c_vol_do_shared_bind_mounts(const c_vol_t *vol)
 		}
 		INFO("Succesfully created image for %s", SHARED_FILES_PATH);
 	}
-	bind_dev = c_vol_create_loopdev_new(&loop_fd, bind_img_path);
+	bind_dev = c_vol_create_loopdev_new(&loop_fd, bind_img_path, false);
 	IF_NULL_GOTO(bind_dev, err);
 	if (mount(bind_dev, SHARED_FILES_PATH, "ext4", MS_NOATIME | MS_NODEV | MS_NOEXEC, NULL) <
 	    0) {
@@ -1382,6 +2311,67 @@ err:
 	return ret;
 }
 
+int
+c_vol_start_pre_clone(c_vol_t *vol)
+{
+	ASSERT(vol);
+
+	if (container_has_setup_mode(vol->container) && c_vol_setup_busybox_tools() < 0)
+		WARN("Cannot prepare busybox tools for setup mode!");
+
+	const mount_t *mount = container_get_mount(vol->container);
+	size_t n = mount_get_count(mount);
+
+	// in mount table order, thus the blocks of the root image are queued first
+	for (size_t i = 0; i < n; i++) {
+		const mount_entry_t *mntent = mount_get_entry(mount, i);
+		if (!c_vol_readahead_applies(mntent))
+			continue;
+
+		char *img = c_vol_image_path_new(vol, mntent);
+		char *profile = mem_printf("%s" GUESTOS_READAHEAD_EXT, img);
+		if (file_exists(profile))
+			c_vol_readahead_replay(img, profile);
+		mem_free0(profile);
+		mem_free0(img);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		const mount_entry_t *mntent = mount_get_entry(mount, i);
+		if (c_vol_shared_mount_find(vol, mntent))
+			continue;
+
+		// images which cannot be shared are mounted by the container itself
+		c_vol_shared_mount_t *sm =
+			c_vol_shared_mount_acquire(container_get_os(vol->container), mntent);
+		if (sm)
+			vol->shared_mounts = list_append(vol->shared_mounts, sm);
+	}
+
+	return 0;
+}
+
+int
+c_vol_reattach(c_vol_t *vol)
+{
+	ASSERT(vol);
+
+	const mount_t *mount = container_get_mount(vol->container);
+	size_t n = mount_get_count(mount);
+
+	for (size_t i = 0; i < n; i++) {
+		const mount_entry_t *mntent = mount_get_entry(mount, i);
+		if (c_vol_shared_mount_find(vol, mntent))
+			continue;
+
+		c_vol_shared_mount_t *sm = c_vol_shared_mount_adopt(mntent);
+		if (sm)
+			vol->shared_mounts = list_append(vol->shared_mounts, sm);
+	}
+
+	return 0;
+}
+
 int
 c_vol_start_child_early(c_vol_t *vol)
 {
@@ -1420,6 +2410,11 @@ c_vol_start_child_early(c_vol_t *vol)
 	DEBUG("Mounting /dev");
 	IF_TRUE_GOTO_ERROR(c_vol_mount_dev(vol) < 0, error);
 
+	if (c_vol_mount_checkpoint(vol) < 0) {
+		ERROR("Could not mount checkpoint image for container start");
+		goto error;
+	}
+
 	/*
 	 * copy cml-service-container binary to target as defined in CSERVICE_TARGET
 	 * Remeber, This will only succeed if targetfs is writable
@@ -1497,6 +2492,12 @@ c_vol_start_pre_exec(c_vol_t *vol)
 		return -1;
 	}
 
+	if (!vol->readahead_timer) {
+		vol->readahead_timer = event_timer_new(C_VOL_READAHEAD_RECORD_DELAY, 1,
+						       &c_vol_readahead_record_cb, vol);
+		event_add_timer(vol->readahead_timer);
+	}
+
 	mem_free0(dev_mnt);
 	return 0;
 }
@@ -1519,6 +2520,10 @@ c_vol_mount_proc_and_sys(const c_vol_t *vol, const char *dir)
 		ERROR_ERRNO("Could not apply lxcfs overlay on mount %s", mnt_proc);
 		goto error;
 	}
+	if (procfs_mount_proc_overlay(vol->container, mnt_proc)) {
+		ERROR_ERRNO("Could not apply proc views on mount %s", mnt_proc);
+		goto error;
+	}
 
 	DEBUG("Mounting sys on %s", mnt_sys);
 	unsigned long sysopts = MS_RELATIME | MS_NOSUID;
@@ -1717,9 +2722,6 @@ c_vol_start_child(c_vol_t *vol)
 		goto error;
 	}
 
-	if (container_has_setup_mode(vol->container) && c_vol_setup_busybox_install() < 0)
-		WARN("Cannot install busybox symlinks for setup mode!");
-
 	char *mount_output = file_read_new("/proc/self/mounts", 2048);
 	INFO("Mounted filesystems:");
 	INFO("%s", mount_output);
@@ -1731,6 +2733,94 @@ error:
 	return -1;
 }
 
+/*
+ * Reflinks a single image file, falls back to a full copy if the filesystem
+ * does not support reflinks.
+ */
+static int
+c_vol_clone_image_file(const char *src, const char *dst)
+{
+	int ret = -1;
+	int in_fd = open(src, O_RDONLY | O_CLOEXEC);
+	int out_fd = -1;
+
+	if (in_fd < 0) {
+		ERROR_ERRNO("Could not open image %s", src);
+		return -1;
+	}
+	out_fd = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (out_fd < 0) {
+		ERROR_ERRNO("Could not create image %s", dst);
+		goto out;
+	}
+
+	if ((ret = file_reflink_fd(in_fd, out_fd)) < 0) {
+		DEBUG_ERRNO("Could not reflink %s, copying it", src);
+		ret = file_copy_fd(in_fd, out_fd);
+	}
+	if (ret < 0)
+		ERROR("Could not clone image %s to %s", src, dst);
+out:
+	if (out_fd >= 0)
+		close(out_fd);
+	close(in_fd);
+	return ret;
+}
+
+int
+c_vol_clone_images(c_vol_t *vol, const container_t *src)
+{
+	ASSERT(vol);
+	ASSERT(src);
+
+	const char *src_dir = container_get_images_dir(src);
+	const mount_t *mnt = container_get_mount(vol->container);
+	int ret = 0;
+
+	if (mkdir(container_get_images_dir(vol->container), 0755) < 0 && errno != EEXIST) {
+		ERROR_ERRNO("Could not mkdir container directory %s",
+			    container_get_images_dir(vol->container));
+		return -1;
+	}
+
+	for (size_t i = 0; i < mount_get_count(mnt) && ret == 0; i++) {
+		const mount_entry_t *mntent = mount_get_entry(mnt, i);
+
+		switch (mount_entry_get_type(mntent)) {
+		case MOUNT_TYPE_DEVICE_RW:
+		case MOUNT_TYPE_EMPTY:
+		case MOUNT_TYPE_COPY:
+		case MOUNT_TYPE_OVERLAY_RW:
+			break;
+		default:
+			// images of the guest os or the device are shared anyway
+			continue;
+		}
+
+		// the key of the clone differs, a new image is created on first start
+		if (mount_entry_is_encrypted(mntent)) {
+			INFO("Not cloning encrypted image %s", mount_entry_get_img(mntent));
+			continue;
+		}
+
+		char *src_img = mem_printf("%s/%s.img", src_dir, mount_entry_get_img(mntent));
+		char *img = c_vol_image_path_new(vol, mntent);
+
+		if (!file_exists(src_img)) {
+			DEBUG("Image %s does not exist yet, nothing to clone", src_img);
+		} else if ((ret = c_vol_clone_image_file(src_img, img)) == 0 &&
+			   !strcmp("btrfs", mount_entry_get_fs(mntent))) {
+			INFO("Regenerate UUID for btrfs filesystem on %s", img);
+			ret = c_vol_btrfs_regen_uuid(img);
+		}
+
+		mem_free0(src_img);
+		mem_free0(img);
+	}
+
+	return ret;
+}
+
 bool
 c_vol_is_encrypted(c_vol_t *vol)
 {
@@ -1760,4 +2850,16 @@ c_vol_cleanup(c_vol_t *vol, bool is_rebooting)
 	// keep dm crypt/integrity device up for reboot
 	if (!is_rebooting && c_vol_cleanup_dm(vol))
 		WARN("Could not remove mounts properly");
+
+	c_vol_cleanup_checkpoint(vol, is_rebooting);
+
+	// the container's bind mounts are gone with its mount namespace
+	c_vol_shared_mounts_release_all(vol);
+
+	// a container stopped during boot did not read what a full boot reads
+	if (vol->readahead_timer) {
+		event_remove_timer(vol->readahead_timer);
+		event_timer_free(vol->readahead_timer);
+		vol->readahead_timer = NULL;
+	}
 }
@@ -34,6 +34,14 @@
 
 #include "container.h"
 
+/**
+ * Name of the encrypted image in the images directory of the container to which its
+ * processes are checkpointed, if enabled by checkpoint_size in the container config.
+ * While the container runs, the image is mounted on the directory of the same name
+ * next to it in cmld's mount namespace.
+ */
+#define C_VOL_CHECKPOINT_DIR "checkpoint"
+
 typedef struct c_vol c_vol_t;
 
 /**
@@ -53,7 +61,50 @@ c_vol_get_rootdir(c_vol_t *vol);
 bool
 c_vol_is_encrypted(c_vol_t *vol);
 
+/**
+ * Mounts the verified read-only images of a guestos in cmld's mount namespace, as
+ * c_vol_start_pre_clone() does for a container, or takes a reference on existing
+ * mounts. Used to keep the images mounted ahead of container starts.
+ * @return list of the references taken, to be released by c_vol_shared_mounts_release()
+ */
+list_t *
+c_vol_shared_mounts_acquire(const guestos_t *os);
+
+/**
+ * Releases the references on shared image mounts taken by c_vol_shared_mounts_acquire()
+ * and frees the list. The last reference unmounts an image.
+ */
+void
+c_vol_shared_mounts_release(list_t *shared_mounts);
+
+/**
+ * Populates the images directory of the container with thin clones of the
+ * container-specific images of src, which must be stopped or frozen. Images are
+ * reflinked where the filesystem supports it and copied otherwise. Encrypted
+ * images are skipped and thus created afresh on first start.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+c_vol_clone_images(c_vol_t *vol, const container_t *src);
+
 /* Start hooks */
+
+/**
+ * Mounts the verified read-only images of the container in cmld's mount namespace,
+ * or takes a reference on them if another container mounted them already. The
+ * container then bind-mounts them instead of setting up its own loop devices.
+ */
+int
+c_vol_start_pre_clone(c_vol_t *vol);
+
+/**
+ * Takes references on the shared mounts of a running container, which a previous
+ * cmld instance left mounted in cmld's mount namespace.
+ */
+int
+c_vol_reattach(c_vol_t *vol);
+
 int
 c_vol_start_child_early(c_vol_t *vol);
 
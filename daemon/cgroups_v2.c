@@ -0,0 +1,364 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "cgroups_v2.h"
+
+#include "mount.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/bpf.h>
+#include <linux/magic.h>
+
+#ifndef CGROUP2_SUPER_MAGIC
+#define CGROUP2_SUPER_MAGIC 0x63677270
+#endif
+
+#define CGROUPS_V2_DEV_ACC_ALL (BPF_DEVCG_ACC_MKNOD | BPF_DEVCG_ACC_READ | BPF_DEVCG_ACC_WRITE)
+
+/* instructions of the program prologue and epilogue and the maximum per rule */
+#define CGROUPS_V2_BPF_PROLOGUE_LEN 6
+#define CGROUPS_V2_BPF_EPILOGUE_LEN 2
+#define CGROUPS_V2_BPF_RULE_MAX_LEN 8
+
+struct cgroups_v2_dev_rule {
+	int type;   /* BPF_DEVCG_DEV_*, 0 for any type */
+	int major;  /* -1 for wildcard */
+	int minor;  /* -1 for wildcard */
+	int access; /* BPF_DEVCG_ACC_* bitmask */
+	bool allow;
+};
+
+bool
+cgroups_v2_enabled(void)
+{
+#ifdef CGROUPS_V2
+	return true;
+#else
+	struct statfs sfs;
+	if (statfs(MOUNT_CGROUPS_FOLDER, &sfs) < 0)
+		return false;
+	return sfs.f_type == CGROUP2_SUPER_MAGIC;
+#endif
+}
+
+int
+cgroups_v2_enable_controllers(const char *path)
+{
+	IF_NULL_RETVAL(path, -1);
+
+	int ret = 0;
+	char *controllers_path = mem_printf("%s/cgroup.controllers", path);
+	char *subtree_control_path = mem_printf("%s/cgroup.subtree_control", path);
+	char *controllers = file_read_new(controllers_path, 1024);
+	if (!controllers) {
+		ERROR("Could not read available cgroup controllers from %s", controllers_path);
+		ret = -1;
+		goto out;
+	}
+
+	char *saveptr = NULL;
+	for (char *c = strtok_r(controllers, " \n", &saveptr); c;
+	     c = strtok_r(NULL, " \n", &saveptr)) {
+		/* enable one by one, a busy controller should not prevent the others */
+		if (file_printf(subtree_control_path, "+%s", c) < 0) {
+			WARN_ERRNO("Could not enable cgroup controller %s in %s", c, path);
+			ret = -1;
+		}
+	}
+
+out:
+	mem_free0(controllers);
+	mem_free0(controllers_path);
+	mem_free0(subtree_control_path);
+	return ret;
+}
+
+static int
+cgroups_v2_dev_rule_parse_num(const char *str, int *num)
+{
+	if (!strcmp(str, "*")) {
+		*num = -1;
+		return 0;
+	}
+
+	char *end = NULL;
+	errno = 0;
+	long parsed = strtol(str, &end, 10);
+	IF_TRUE_RETVAL(errno || end == str || *end != '\0', -1);
+	IF_TRUE_RETVAL(parsed < 0 || parsed > INT32_MAX, -1);
+
+	*num = (int)parsed;
+	return 0;
+}
+
+cgroups_v2_dev_rule_t *
+cgroups_v2_dev_rule_new(const char *rule, bool allow)
+{
+	IF_NULL_RETVAL(rule, NULL);
+
+	cgroups_v2_dev_rule_t *dev_rule = mem_new0(cgroups_v2_dev_rule_t, 1);
+	dev_rule->major = -1;
+	dev_rule->minor = -1;
+	dev_rule->access = CGROUPS_V2_DEV_ACC_ALL;
+	dev_rule->allow = allow;
+
+	char *rule_cp = mem_strdup(rule);
+	char *saveptr = NULL;
+
+	char *type = strtok_r(rule_cp, " ", &saveptr);
+	IF_NULL_GOTO_ERROR(type, error);
+
+	switch (type[0]) {
+	case 'a':
+		/* "a" matches everything regardless of the remaining fields */
+		dev_rule->type = 0;
+		goto out;
+	case 'b':
+		dev_rule->type = BPF_DEVCG_DEV_BLOCK;
+		break;
+	case 'c':
+		dev_rule->type = BPF_DEVCG_DEV_CHAR;
+		break;
+	default:
+		goto error;
+	}
+
+	char *dev = strtok_r(NULL, " ", &saveptr);
+	IF_NULL_GOTO_ERROR(dev, error);
+
+	char *dev_saveptr = NULL;
+	char *maj_str = strtok_r(dev, ":", &dev_saveptr);
+	char *min_str = strtok_r(NULL, ":", &dev_saveptr);
+	IF_TRUE_GOTO_ERROR(!maj_str || !min_str, error);
+	IF_TRUE_GOTO_ERROR(cgroups_v2_dev_rule_parse_num(maj_str, &dev_rule->major), error);
+	IF_TRUE_GOTO_ERROR(cgroups_v2_dev_rule_parse_num(min_str, &dev_rule->minor), error);
+
+	char *access = strtok_r(NULL, " ", &saveptr);
+	if (access) {
+		dev_rule->access = 0;
+		for (char *a = access; *a; a++) {
+			switch (*a) {
+			case 'r':
+				dev_rule->access |= BPF_DEVCG_ACC_READ;
+				break;
+			case 'w':
+				dev_rule->access |= BPF_DEVCG_ACC_WRITE;
+				break;
+			case 'm':
+				dev_rule->access |= BPF_DEVCG_ACC_MKNOD;
+				break;
+			default:
+				goto error;
+			}
+		}
+	}
+
+out:
+	mem_free0(rule_cp);
+	return dev_rule;
+error:
+	ERROR("Invalid device rule '%s'", rule);
+	mem_free0(rule_cp);
+	mem_free0(dev_rule);
+	return NULL;
+}
+
+void
+cgroups_v2_dev_rule_free(cgroups_v2_dev_rule_t *dev_rule)
+{
+	IF_NULL_RETURN(dev_rule);
+	mem_free0(dev_rule);
+}
+
+bool
+cgroups_v2_dev_rule_equals(const cgroups_v2_dev_rule_t *a, const cgroups_v2_dev_rule_t *b)
+{
+	ASSERT(a && b);
+	return a->type == b->type && a->major == b->major && a->minor == b->minor &&
+	       a->access == b->access;
+}
+
+bool
+cgroups_v2_dev_rule_is_all(const cgroups_v2_dev_rule_t *dev_rule)
+{
+	ASSERT(dev_rule);
+	return dev_rule->type == 0 && dev_rule->major == -1 && dev_rule->minor == -1 &&
+	       dev_rule->access == CGROUPS_V2_DEV_ACC_ALL;
+}
+
+static struct bpf_insn
+cgroups_v2_bpf_insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+	struct bpf_insn insn = {
+		.code = code, .dst_reg = dst, .src_reg = src, .off = off, .imm = imm
+	};
+	return insn;
+}
+
+/*
+ * Emits the check of one rule at insns: if the access described in r2 (type),
+ * r3 (access), r4 (major) and r5 (minor) matches, the program returns the verdict
+ * of the rule, otherwise it jumps over the remaining instructions of the rule.
+ * Returns the number of emitted instructions.
+ */
+static int
+cgroups_v2_bpf_emit_rule(struct bpf_insn *insns, const cgroups_v2_dev_rule_t *dev_rule)
+{
+	bool check_access = dev_rule->access != CGROUPS_V2_DEV_ACC_ALL;
+	int len = 2 + (dev_rule->type ? 1 : 0) + (check_access ? 3 : 0) +
+		  (dev_rule->major >= 0 ? 1 : 0) + (dev_rule->minor >= 0 ? 1 : 0);
+	int i = 0;
+
+	/* jump offsets are relative to the next instruction and skip to the end of the rule */
+	if (dev_rule->type) {
+		insns[i] = cgroups_v2_bpf_insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_2, 0, len - i - 1,
+					       dev_rule->type);
+		i++;
+	}
+	if (check_access) {
+		/* the requested access has to be a subset of the access of the rule */
+		insns[i++] =
+			cgroups_v2_bpf_insn(BPF_ALU | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_3, 0, 0);
+		insns[i++] = cgroups_v2_bpf_insn(BPF_ALU | BPF_AND | BPF_K, BPF_REG_1, 0, 0,
+						 dev_rule->access);
+		insns[i] = cgroups_v2_bpf_insn(BPF_JMP | BPF_JNE | BPF_X, BPF_REG_1, BPF_REG_3,
+					       len - i - 1, 0);
+		i++;
+	}
+	if (dev_rule->major >= 0) {
+		insns[i] = cgroups_v2_bpf_insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, len - i - 1,
+					       dev_rule->major);
+		i++;
+	}
+	if (dev_rule->minor >= 0) {
+		insns[i] = cgroups_v2_bpf_insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, len - i - 1,
+					       dev_rule->minor);
+		i++;
+	}
+	insns[i++] =
+		cgroups_v2_bpf_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, dev_rule->allow);
+	insns[i++] = cgroups_v2_bpf_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+	ASSERT(i == len);
+	return len;
+}
+
+static int
+cgroups_v2_bpf_prog_load(const struct bpf_insn *insns, int insn_cnt)
+{
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_CGROUP_DEVICE;
+	attr.insns = (uint64_t)(uintptr_t)insns;
+	attr.insn_cnt = insn_cnt;
+	attr.license = (uint64_t)(uintptr_t) "GPL";
+
+	return syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+}
+
+int
+cgroups_v2_dev_filter_attach(const char *path, const list_t *rules)
+{
+	IF_NULL_RETVAL(path, -1);
+
+	int ret = -1;
+	int prog_fd = -1;
+	int cgroup_fd = -1;
+
+	int insn_max = CGROUPS_V2_BPF_PROLOGUE_LEN + CGROUPS_V2_BPF_EPILOGUE_LEN +
+		       list_length(rules) * CGROUPS_V2_BPF_RULE_MAX_LEN;
+	struct bpf_insn *insns = mem_new0(struct bpf_insn, insn_max);
+	int n = 0;
+
+	/* r2 = type, r3 = access, r4 = major, r5 = minor of the access to be checked */
+	insns[n++] = cgroups_v2_bpf_insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1,
+					 offsetof(struct bpf_cgroup_dev_ctx, access_type), 0);
+	insns[n++] = cgroups_v2_bpf_insn(BPF_ALU | BPF_AND | BPF_K, BPF_REG_2, 0, 0, 0xffff);
+	insns[n++] = cgroups_v2_bpf_insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1,
+					 offsetof(struct bpf_cgroup_dev_ctx, access_type), 0);
+	insns[n++] = cgroups_v2_bpf_insn(BPF_ALU | BPF_RSH | BPF_K, BPF_REG_3, 0, 0, 16);
+	insns[n++] = cgroups_v2_bpf_insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_4, BPF_REG_1,
+					 offsetof(struct bpf_cgroup_dev_ctx, major), 0);
+	insns[n++] = cgroups_v2_bpf_insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_5, BPF_REG_1,
+					 offsetof(struct bpf_cgroup_dev_ctx, minor), 0);
+
+	/* the first matching rule decides, thus emit the rules from last to first */
+	for (const list_t *l = rules ? list_tail((list_t *)rules) : NULL; l; l = l->prev)
+		n += cgroups_v2_bpf_emit_rule(&insns[n], l->data);
+
+	/* deny everything else */
+	insns[n++] = cgroups_v2_bpf_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0);
+	insns[n++] = cgroups_v2_bpf_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+	ASSERT(n <= insn_max);
+
+	prog_fd = cgroups_v2_bpf_prog_load(insns, n);
+	if (prog_fd < 0) {
+		ERROR_ERRNO("Could not load device filter for cgroup %s", path);
+		goto out;
+	}
+
+	cgroup_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (cgroup_fd < 0) {
+		ERROR_ERRNO("Could not open cgroup %s", path);
+		goto out;
+	}
+
+	/*
+	 * Without BPF_F_ALLOW_MULTI, attaching replaces the program which is currently
+	 * attached, and without BPF_F_ALLOW_OVERRIDE the container cannot attach a
+	 * more permissive filter to its own child cgroups.
+	 */
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.target_fd = cgroup_fd;
+	attr.attach_bpf_fd = prog_fd;
+	attr.attach_type = BPF_CGROUP_DEVICE;
+	attr.attach_flags = 0;
+	if (syscall(__NR_bpf, BPF_PROG_ATTACH, &attr, sizeof(attr)) < 0) {
+		ERROR_ERRNO("Could not attach device filter to cgroup %s", path);
+		goto out;
+	}
+
+	TRACE("Attached device filter with %d rules (%d insns) to %s", list_length(rules), n, path);
+	ret = 0;
+out:
+	if (cgroup_fd >= 0)
+		close(cgroup_fd);
+	if (prog_fd >= 0)
+		close(prog_fd);
+	mem_free0(insns);
+	return ret;
+}
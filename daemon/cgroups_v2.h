@@ -0,0 +1,99 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file cgroups_v2.h
+ *
+ * Helpers for the cgroup v2 unified hierarchy. Since the unified hierarchy has no
+ * devices controller, device access is filtered by a BPF_PROG_TYPE_CGROUP_DEVICE
+ * program which is generated from an ordered list of device rules.
+ */
+
+#ifndef CGROUPS_V2_H
+#define CGROUPS_V2_H
+
+#include "common/list.h"
+
+#include <stdbool.h>
+
+typedef struct cgroups_v2_dev_rule cgroups_v2_dev_rule_t;
+
+/**
+ * Checks whether the cgroup hierarchy at MOUNT_CGROUPS_FOLDER is (or, if built
+ * with CGROUPS_V2, is to be set up as) the cgroup v2 unified hierarchy.
+ *
+ * @return true if cgroup v2 should be used, false for the legacy hierarchies
+ */
+bool
+cgroups_v2_enabled(void);
+
+/**
+ * Enables all controllers available in the cgroup at path for its children
+ * by writing them to its cgroup.subtree_control.
+ *
+ * @param path path of the cgroup directory
+ * @return 0 on success, -1 if a controller could not be enabled
+ */
+int
+cgroups_v2_enable_controllers(const char *path);
+
+/**
+ * Parses a device rule in the format of the legacy devices controller, e.g.
+ * "c 1:3 rwm" or "a", into a new rule object.
+ *
+ * @param rule the rule string
+ * @param allow true for an allow rule, false for a deny rule
+ * @return the new rule, or NULL if the rule could not be parsed
+ */
+cgroups_v2_dev_rule_t *
+cgroups_v2_dev_rule_new(const char *rule, bool allow);
+
+void
+cgroups_v2_dev_rule_free(cgroups_v2_dev_rule_t *dev_rule);
+
+/**
+ * Checks whether two rules match the same devices with the same access,
+ * regardless of whether they allow or deny it.
+ */
+bool
+cgroups_v2_dev_rule_equals(const cgroups_v2_dev_rule_t *a, const cgroups_v2_dev_rule_t *b);
+
+/**
+ * Returns true if the rule matches every device and every access.
+ */
+bool
+cgroups_v2_dev_rule_is_all(const cgroups_v2_dev_rule_t *dev_rule);
+
+/**
+ * Compiles the ordered list of rules into a device filter program and attaches
+ * it to the cgroup at path, replacing a previously attached filter. Later rules
+ * take precedence over earlier ones; devices matched by no rule are denied.
+ *
+ * @param path path of the cgroup directory
+ * @param rules list of cgroups_v2_dev_rule_t, may be NULL to deny all devices
+ * @return 0 on success, -1 on error
+ */
+int
+cgroups_v2_dev_filter_attach(const char *path, const list_t *rules);
+
+#endif /* CGROUPS_V2_H */
@@ -0,0 +1,390 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "chunk_index.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/fd.h"
+#include "common/file.h"
+#include "common/hashmap.h"
+#include "common/hex.h"
+#include "common/worker.h"
+
+#include <openssl/evp.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+#define CHUNK_ALIGN (4 * 1024)
+#define CHUNK_MIN_SIZE (16 * 1024)
+#define CHUNK_MAX_SIZE (1024 * 1024)
+// a boundary is placed at 1/16 of the aligned offsets, i.e., ~64 KiB after the minimum
+#define CHUNK_BOUNDARY_MASK 0xf000000000000000ULL
+#define CHUNK_READ_SIZE (1024 * 1024)
+#define CHUNK_SHA256_LEN 32
+
+typedef struct chunk {
+	uint64_t offset;
+	uint32_t len;
+	unsigned char sha256[CHUNK_SHA256_LEN];
+} chunk_t;
+
+typedef struct chunk_index {
+	chunk_t *chunks;
+	size_t n;
+} chunk_index_t;
+
+/*
+ * A deduplication processed by a worker thread. Only ret and shared are written by the
+ * worker.
+ */
+typedef struct chunk_index_job {
+	char *file;
+	char **base_files;
+	size_t n;
+	int ret;
+	uint64_t shared;
+	chunk_index_dedup_callback_t cb;
+	void *data;
+} chunk_index_job_t;
+
+static uint64_t chunk_gear[256];
+
+static void
+chunk_gear_init(void)
+{
+	// fixed pseudo random values, boundaries must not change between runs
+	uint64_t x = 0x9e3779b97f4a7c15ULL;
+	for (size_t i = 0; i < 256; i++) {
+		uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		chunk_gear[i] = z ^ (z >> 31);
+	}
+}
+
+char *
+chunk_index_get_file_new(const char *file)
+{
+	return mem_printf("%s.chunks", file);
+}
+
+static void
+chunk_index_free(chunk_index_t *index)
+{
+	IF_NULL_RETURN(index);
+	mem_free0(index->chunks);
+	mem_free0(index);
+}
+
+static void
+chunk_index_add(chunk_index_t *index, uint64_t offset, uint32_t len, EVP_MD_CTX *md)
+{
+	chunk_t *chunk;
+
+	// grow in steps of 256 chunks
+	if (index->n % 256 == 0)
+		index->chunks = mem_realloc(index->chunks, (index->n + 256) * sizeof(chunk_t));
+	chunk = &index->chunks[index->n++];
+	chunk->offset = offset;
+	chunk->len = len;
+	EVP_DigestFinal_ex(md, chunk->sha256, NULL);
+	EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+}
+
+static chunk_index_t *
+chunk_index_build_new(int fd)
+{
+	chunk_index_t *index = mem_new0(chunk_index_t, 1);
+	unsigned char *buf = mem_alloc(CHUNK_READ_SIZE);
+	EVP_MD_CTX *md = EVP_MD_CTX_new();
+	uint64_t pos = 0, h = 0;
+	uint32_t len = 0;
+	ssize_t n;
+
+	IF_TRUE_GOTO(!md || !EVP_DigestInit_ex(md, EVP_sha256(), NULL), err);
+
+	while ((n = read(fd, buf, CHUNK_READ_SIZE)) > 0) {
+		size_t start = 0;
+		for (size_t i = 0; i < (size_t)n; i++) {
+			h = (h << 1) + chunk_gear[buf[i]];
+			pos++;
+			len++;
+			if (pos % CHUNK_ALIGN || len < CHUNK_MIN_SIZE)
+				continue;
+			if ((h & CHUNK_BOUNDARY_MASK) && len < CHUNK_MAX_SIZE)
+				continue;
+			EVP_DigestUpdate(md, buf + start, i + 1 - start);
+			chunk_index_add(index, pos - len, len, md);
+			start = i + 1;
+			len = 0;
+		}
+		EVP_DigestUpdate(md, buf + start, n - start);
+	}
+	IF_TRUE_GOTO(n < 0, err);
+	if (len > 0)
+		chunk_index_add(index, pos - len, len, md);
+
+	EVP_MD_CTX_free(md);
+	mem_free0(buf);
+	return index;
+err:
+	EVP_MD_CTX_free(md);
+	mem_free0(buf);
+	chunk_index_free(index);
+	return NULL;
+}
+
+/*
+ * Loads the chunk index of a file if it was built for the current state of the file.
+ * The first line of an index holds size, modification time and inode of the file,
+ * followed by one line per chunk with offset, length and hex encoded sha256.
+ */
+static chunk_index_t *
+chunk_index_load_new(const char *index_file, const struct stat *st)
+{
+	FILE *f = fopen(index_file, "re");
+	IF_NULL_RETVAL(f, NULL);
+
+	chunk_index_t *index = NULL;
+	int64_t size, sec, nsec;
+	uint64_t ino;
+	if (fscanf(f, "%" SCNd64 " %" SCNd64 " %" SCNd64 " %" SCNu64 "\n", &size, &sec, &nsec,
+		   &ino) != 4 ||
+	    size != st->st_size || sec != st->st_mtim.tv_sec || nsec != st->st_mtim.tv_nsec ||
+	    ino != st->st_ino)
+		goto out;
+
+	index = mem_new0(chunk_index_t, 1);
+	uint64_t offset;
+	uint32_t len;
+	char hex[2 * CHUNK_SHA256_LEN + 1];
+	while (fscanf(f, "%" SCNu64 " %" SCNu32 " %64s\n", &offset, &len, hex) == 3) {
+		if (index->n % 256 == 0)
+			index->chunks =
+				mem_realloc(index->chunks, (index->n + 256) * sizeof(chunk_t));
+		chunk_t *chunk = &index->chunks[index->n++];
+		chunk->offset = offset;
+		chunk->len = len;
+		IF_TRUE_GOTO(hex_decode(chunk->sha256, hex, strlen(hex)) != CHUNK_SHA256_LEN, err);
+	}
+	IF_TRUE_GOTO(!feof(f), err);
+out:
+	fclose(f);
+	return index;
+err:
+	chunk_index_free(index);
+	fclose(f);
+	return NULL;
+}
+
+static void
+chunk_index_store(const char *index_file, const struct stat *st, const chunk_index_t *index)
+{
+	char *tmp_file = mem_printf("%s.tmp", index_file);
+	FILE *f = fopen(tmp_file, "we");
+	IF_NULL_GOTO(f, out);
+
+	fprintf(f, "%" PRId64 " %" PRId64 " %" PRId64 " %" PRIu64 "\n", (int64_t)st->st_size,
+		(int64_t)st->st_mtim.tv_sec, (int64_t)st->st_mtim.tv_nsec, (uint64_t)st->st_ino);
+	for (size_t i = 0; i < index->n; i++) {
+		char hex[2 * CHUNK_SHA256_LEN + 1];
+		hex_encode(hex, index->chunks[i].sha256, CHUNK_SHA256_LEN);
+		fprintf(f, "%" PRIu64 " %" PRIu32 " %s\n", index->chunks[i].offset,
+			index->chunks[i].len, hex);
+	}
+	if (fclose(f) == 0 && rename(tmp_file, index_file) == 0)
+		goto out;
+	unlink(tmp_file);
+out:
+	mem_free0(tmp_file);
+}
+
+/*
+ * Returns the chunk index of the file opened as fd, building it if necessary.
+ */
+static chunk_index_t *
+chunk_index_get_new(const char *file, int fd)
+{
+	struct stat st;
+	IF_TRUE_RETVAL(fstat(fd, &st) < 0, NULL);
+
+	char *index_file = chunk_index_get_file_new(file);
+	chunk_index_t *index = chunk_index_load_new(index_file, &st);
+	if (!index) {
+		index = chunk_index_build_new(fd);
+		if (index)
+			chunk_index_store(index_file, &st, index);
+	}
+	mem_free0(index_file);
+	return index;
+}
+
+/*
+ * Shares the blocks of the given range of dest with the range of src at src_offset.
+ * Returns the number of shared bytes.
+ */
+static uint64_t
+chunk_index_dedup_range(int src_fd, uint64_t src_offset, int dest_fd, uint64_t dest_offset,
+			uint64_t len)
+{
+	struct file_dedupe_range *range =
+		mem_alloc0(sizeof(*range) + sizeof(struct file_dedupe_range_info));
+	uint64_t shared = 0;
+
+	range->src_offset = src_offset;
+	range->src_length = len;
+	range->dest_count = 1;
+	range->info[0].dest_fd = dest_fd;
+	range->info[0].dest_offset = dest_offset;
+
+	if (ioctl(src_fd, FIDEDUPERANGE, range) == 0 && range->info[0].status == 0)
+		shared = range->info[0].bytes_deduped;
+
+	mem_free0(range);
+	return shared;
+}
+
+/*
+ * Runs on a worker thread.
+ */
+static void
+chunk_index_job_work(void *data)
+{
+	chunk_index_job_t *job = data;
+	hashmap_t *map = hashmap_new();
+	chunk_index_t **base_indexes = mem_new0(chunk_index_t *, job->n);
+	int *base_fds = mem_new0(int, job->n);
+	chunk_index_t *index = NULL;
+	int fd = -1;
+
+	job->ret = -1;
+	job->shared = 0;
+
+	for (size_t i = 0; i < job->n; i++) {
+		base_fds[i] = open(job->base_files[i], O_RDONLY | O_CLOEXEC);
+		if (base_fds[i] < 0)
+			continue;
+		base_indexes[i] = chunk_index_get_new(job->base_files[i], base_fds[i]);
+		for (size_t j = 0; base_indexes[i] && j < base_indexes[i]->n; j++) {
+			chunk_t *chunk = &base_indexes[i]->chunks[j];
+			// the file the chunk belongs to is encoded by its position in memory
+			hashmap_put(map, chunk->sha256, CHUNK_SHA256_LEN, chunk);
+		}
+	}
+
+	fd = open(job->file, O_RDWR | O_CLOEXEC);
+	IF_TRUE_GOTO(fd < 0, out);
+	index = chunk_index_get_new(job->file, fd);
+	IF_NULL_GOTO(index, out);
+
+	for (size_t i = 0; i < index->n; i++) {
+		chunk_t *chunk = &index->chunks[i];
+		chunk_t *base = hashmap_get(map, chunk->sha256, CHUNK_SHA256_LEN);
+		if (!base || base->len != chunk->len)
+			continue;
+
+		for (size_t j = 0; j < job->n; j++) {
+			if (!base_indexes[j] || base < base_indexes[j]->chunks ||
+			    base >= base_indexes[j]->chunks + base_indexes[j]->n)
+				continue;
+			job->shared += chunk_index_dedup_range(base_fds[j], base->offset, fd,
+							      chunk->offset, chunk->len);
+			break;
+		}
+	}
+	job->ret = 0;
+out:
+	if (fd >= 0)
+		close(fd);
+	chunk_index_free(index);
+	for (size_t i = 0; i < job->n; i++) {
+		if (base_fds[i] >= 0)
+			close(base_fds[i]);
+		chunk_index_free(base_indexes[i]);
+	}
+	mem_free0(base_fds);
+	mem_free0(base_indexes);
+	hashmap_free(map);
+}
+
+static void
+chunk_index_job_free(chunk_index_job_t *job)
+{
+	for (size_t i = 0; i < job->n; i++)
+		mem_free0(job->base_files[i]);
+	mem_free0(job->base_files);
+	mem_free0(job->file);
+	mem_free0(job);
+}
+
+static void
+chunk_index_job_done(void *data)
+{
+	chunk_index_job_t *job = data;
+
+	if (job->ret < 0)
+		WARN("Could not deduplicate %s", job->file);
+	else
+		INFO("Deduplicated %s, %" PRIu64 " bytes share blocks with other images", job->file,
+		     job->shared);
+
+	job->cb(job->ret, job->shared, job->data);
+	chunk_index_job_free(job);
+}
+
+int
+chunk_index_dedup(const char *file, const char *const *base_files, size_t n,
+		  chunk_index_dedup_callback_t cb, void *data)
+{
+	ASSERT(file);
+	ASSERT(base_files || n == 0);
+	ASSERT(cb);
+
+	if (!chunk_gear[0])
+		chunk_gear_init();
+
+	chunk_index_job_t *job = mem_new0(chunk_index_job_t, 1);
+	job->file = mem_strdup(file);
+	job->base_files = mem_new0(char *, n);
+	for (size_t i = 0; i < n; i++)
+		job->base_files[i] = mem_strdup(base_files[i]);
+	job->n = n;
+	job->cb = cb;
+	job->data = data;
+
+	if (worker_run(chunk_index_job_work, chunk_index_job_done, job) < 0) {
+		WARN("Could not hand off deduplication of %s to a worker", file);
+		chunk_index_job_free(job);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file chunk_index.h
+ *
+ * Deduplicates the images of different GuestOS versions on disk.
+ *
+ * Images are split into content-defined chunks. Chunk boundaries are only placed at
+ * 4 KiB offsets, so that equal chunks of two images can share their blocks on file
+ * systems supporting FIDEDUPERANGE (e.g. btrfs, xfs). The kernel compares the data
+ * before sharing it, and the images stay regular files which are loop mounted as before.
+ * The chunk index of an image is kept next to it in <image>.chunks and is rebuilt
+ * whenever the image changed.
+ */
+
+#ifndef CHUNK_INDEX_H
+#define CHUNK_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Callback for the result of chunk_index_dedup().
+ *
+ * @param ret 0 on success, -1 on error
+ * @param shared number of bytes of file which now share blocks with the base files
+ * @param data the data parameter given to chunk_index_dedup()
+ */
+typedef void (*chunk_index_dedup_callback_t)(int ret, uint64_t shared, void *data);
+
+/**
+ * Returns the path of the chunk index belonging to the given file.
+ */
+char *
+chunk_index_get_file_new(const char *file);
+
+/**
+ * Shares the blocks of all chunks of file which also occur in one of the base files.
+ * Runs on a worker thread and calls cb in the event loop afterwards.
+ *
+ * @param file the file whose blocks are replaced by shared ones
+ * @param base_files files to share blocks with
+ * @param n number of base files
+ * @param cb callback called with the result
+ * @param data data parameter passed to the callback
+ * @return 0 if deduplication was started, -1 otherwise (cb is not called then)
+ */
+int
+chunk_index_dedup(const char *file, const char *const *base_files, size_t n,
+		  chunk_index_dedup_callback_t cb, void *data);
+
+#endif /* CHUNK_INDEX_H */
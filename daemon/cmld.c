@@ -36,34 +36,58 @@
 #include "common/event.h"
 #include "common/logf.h"
 #include "common/list.h"
+#include "common/hashmap.h"
 #include "common/file.h"
+#include "common/file_writer.h"
 #include "common/sock.h"
 #include "common/mem.h"
 #include "common/dir.h"
+#include "common/dir_walk.h"
 #include "common/network.h"
+#include "common/loopdev.h"
 #include "common/reboot.h"
+#include "common/fd.h"
+#include "common/str.h"
 #include "hardware.h"
 #include "mount.h"
 #include "device_config.h"
 #include "control.h"
 #include "guestos_mgr.h"
 #include "guestos.h"
+#include "config_cache.h"
 #include "smartcard.h"
 #include "tss.h"
 #include "ksm.h"
+#include "reclaim.h"
+#include "psi.h"
+#include "exporter.h"
+#include "placement.h"
+#include "activation.h"
+#include "balloon.h"
+#include "idle.h"
 #include "uevent.h"
 #include "time.h"
 #include "lxcfs.h"
 #include "audit.h"
+#include "audit_rules.h"
 #include "time.h"
+#include "c_cgroups.h"
+#include "c_net.h"
+#include "zygote.h"
+#include "download.h"
+#include "crypto_hash.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <dirent.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
 
 // clang-format off
 #define CMLD_CONTROL_SOCKET SOCK_PATH(control)
@@ -79,11 +103,19 @@
 #define CMLD_PATH_CONTAINER_KEYS_DIR "keys"
 #define CMLD_PATH_CONTAINER_TOKENS_DIR "tokens"
 #define CMLD_PATH_SHARED_DATA_DIR "shared"
+#define CMLD_PATH_CONFIG_CACHE "config.cache"
 
 #define CMLD_WAKE_LOCK_STARTUP "ContainerStartup"
 
 #define CMLD_KSM_AGGRESSIVE_TIME_AFTER_CONTAINER_BOOT 70000
 
+// number of free loop devices pre-created for container images on startup
+#define CMLD_LOOPDEV_POOL_SIZE 32
+
+/* Runtime state handed over to the next cmld instance by cmld_reexec_prepare(),
+ * i.e., one line per daemon, control socket and running container. */
+#define CMLD_REEXEC_STATE_FILE "/run/cmld.reexec"
+
 /*
  * dummy key used for unecnrypted c0 and for reboots where the real key
  * is already in kernel
@@ -95,6 +127,26 @@ static const char *cmld_path = DEFAULT_BASE_PATH;
 
 static list_t *cmld_containers_list = NULL; // usually first element is c0
 
+/* Lookup indexes for cmld_containers_list, which are maintained by
+ * cmld_containers_add() and cmld_containers_remove(). If several containers
+ * share a key, the index refers to the first one in cmld_containers_list. */
+static hashmap_t *cmld_containers_by_uuid = NULL;
+static hashmap_t *cmld_containers_by_token_serial = NULL;
+static hashmap_t *cmld_containers_by_token_devpath = NULL;
+
+/* The uid range of a container is assigned on container start, thus the uid
+ * index is an array of ranges sorted by their start, which is rebuilt lazily
+ * after containers have been added, removed or changed their state. */
+typedef struct cmld_uid_range {
+	int uid;		//!< start of the uid range of the container
+	size_t pos;		//!< position of the container in cmld_containers_list
+	container_t *container; //!< the container
+} cmld_uid_range_t;
+
+static cmld_uid_range_t *cmld_containers_by_uid = NULL;
+static size_t cmld_containers_by_uid_len = 0;
+static bool cmld_containers_by_uid_dirty = true;
+
 static control_t *cmld_control_mdm = NULL;
 static control_t *cmld_control_gui = NULL;
 static control_t *cmld_control_cml = NULL;
@@ -106,15 +158,39 @@ static char *cmld_device_update_base_url = NULL;
 static char *cmld_device_host_dns = NULL;
 static char *cmld_c0os_name = NULL;
 
+// booted by kexec on device reboot if set, otherwise the firmware is run again
+static char *cmld_kexec_kernel = NULL;
+static char *cmld_kexec_initrd = NULL;
+
 static char *cmld_shared_data_dir = NULL;
 
 static list_t *cmld_netif_phys_list = NULL;
 
+/* Autostarted containers waiting for their start. At most cmld_boot_concurrency
+ * of them (0 for no limit) set up their volumes, network, etc. at the same time,
+ * i.e., are in CONTAINER_STATE_STARTING. */
+static list_t *cmld_boot_queue = NULL;
+static unsigned int cmld_boot_concurrency = 0;
+static unsigned int cmld_boot_active = 0;
+
 static bool cmld_hostedmode = false;
 static bool cmld_signed_configs = false;
 
 static bool cmld_device_provisioned = false;
 
+/* sha256 of the config file each container was loaded from, indexed by uuid,
+ * so that reloading the containers only recreates those with changed configs */
+static hashmap_t *cmld_containers_config_hashes = NULL;
+
+/* Names of config files which changed in the containers directory. They are
+ * reloaded together once writing them has settled. */
+#define CMLD_CONFIG_RELOAD_DELAY 500
+static list_t *cmld_config_reload_pending = NULL;
+static event_timer_t *cmld_config_reload_timer = NULL;
+
+/* State lines of the containers still running from before cmld re-executed itself */
+static list_t *cmld_reexec_containers = NULL;
+
 /******************************************************************************/
 
 static int
@@ -152,16 +228,166 @@ cmld_container_get_c_root_netns()
 	return ((found) ? found : found_c0);
 }
 
+static void
+cmld_containers_index_token(container_t *container)
+{
+	if (CONTAINER_TOKEN_TYPE_USB != container_get_token_type(container))
+		return;
+
+	char *serial = container_get_usbtoken_serial(container);
+	if (serial && !hashmap_get_str(cmld_containers_by_token_serial, serial))
+		hashmap_put_str(cmld_containers_by_token_serial, serial, container);
+
+	char *devpath = container_get_usbtoken_devpath(container);
+	if (devpath && !hashmap_get_str(cmld_containers_by_token_devpath, devpath))
+		hashmap_put_str(cmld_containers_by_token_devpath, devpath, container);
+}
+
+static void
+cmld_containers_index_tokens_rebuild(void)
+{
+	hashmap_clear(cmld_containers_by_token_serial);
+	hashmap_clear(cmld_containers_by_token_devpath);
+
+	for (list_t *l = cmld_containers_list; l; l = l->next)
+		cmld_containers_index_token(l->data);
+}
+
+static void
+cmld_containers_uid_index_cb(UNUSED container_t *container, UNUSED container_callback_t *cb,
+			     UNUSED void *data)
+{
+	// the uid range is (re)assigned during container start
+	cmld_containers_by_uid_dirty = true;
+}
+
+static int
+cmld_uid_range_cmp(const void *a, const void *b)
+{
+	const cmld_uid_range_t *ra = a;
+	const cmld_uid_range_t *rb = b;
+
+	if (ra->uid != rb->uid)
+		return (ra->uid < rb->uid) ? -1 : 1;
+	return (ra->pos < rb->pos) ? -1 : (ra->pos > rb->pos);
+}
+
+static void
+cmld_containers_index_uid_rebuild(void)
+{
+	size_t n = list_length(cmld_containers_list);
+
+	mem_free0(cmld_containers_by_uid);
+	cmld_containers_by_uid = n ? mem_new(cmld_uid_range_t, n) : NULL;
+	cmld_containers_by_uid_len = n;
+
+	size_t i = 0;
+	for (list_t *l = cmld_containers_list; l; l = l->next, i++) {
+		cmld_containers_by_uid[i].uid = container_get_uid(l->data);
+		cmld_containers_by_uid[i].pos = i;
+		cmld_containers_by_uid[i].container = l->data;
+	}
+	if (n)
+		qsort(cmld_containers_by_uid, n, sizeof(cmld_uid_range_t), cmld_uid_range_cmp);
+
+	cmld_containers_by_uid_dirty = false;
+}
+
+static void
+cmld_containers_index_add(container_t *container)
+{
+	if (!cmld_containers_by_uuid) {
+		cmld_containers_by_uuid = hashmap_new();
+		cmld_containers_by_token_serial = hashmap_new();
+		cmld_containers_by_token_devpath = hashmap_new();
+	}
+
+	hashmap_put(cmld_containers_by_uuid, uuid_get_bin(container_get_uuid(container)),
+		    sizeof(uuid_bin_t), container);
+	cmld_containers_index_token(container);
+	cmld_containers_by_uid_dirty = true;
+
+	if (!container_register_observer(container, &cmld_containers_uid_index_cb, NULL))
+		WARN("Could not register uid index observer callback for %s",
+		     container_get_description(container));
+}
+
+static void
+cmld_containers_notify_cb(container_t *container, UNUSED container_callback_t *cb,
+			  UNUSED void *data)
+{
+	control_notify_container(container, false);
+}
+
+/**
+ * Appends the container to the list of managed containers and indexes it.
+ */
+static void
+cmld_containers_add(container_t *container)
+{
+	cmld_containers_list = list_append(cmld_containers_list, container);
+	cmld_containers_index_add(container);
+
+	// push status changes to control clients observing containers
+	if (!container_register_observer(container, &cmld_containers_notify_cb, NULL))
+		WARN("Could not register control notify observer callback for %s",
+		     container_get_description(container));
+	control_notify_container(container, false);
+
+	if (!cmld_containers_config_hashes)
+		cmld_containers_config_hashes = hashmap_new();
+	file_writer_flush(container_get_config_filename(container));
+	char *hash = crypto_hash_file_block_new(container_get_config_filename(container),
+						CRYPTO_HASH_SHA256);
+	if (hash)
+		hashmap_put_str(cmld_containers_config_hashes,
+				uuid_string(container_get_uuid(container)), hash);
+
+	if (activation_add(container) < 0)
+		WARN("Could not set up the activation sockets of %s",
+		     container_get_description(container));
+
+	audit_rules_add(container);
+}
+
+/**
+ * Removes the container from the list of managed containers and its indexes.
+ */
+static void
+cmld_containers_remove(container_t *container)
+{
+	cmld_containers_list = list_remove(cmld_containers_list, container);
+	cmld_boot_queue = list_remove(cmld_boot_queue, container);
+	control_notify_container(container, true);
+	activation_remove(container);
+	idle_remove(container);
+	balloon_remove(container);
+	audit_rules_remove(container);
+
+	hashmap_remove(cmld_containers_by_uuid, uuid_get_bin(container_get_uuid(container)),
+		       sizeof(uuid_bin_t));
+	char *hash = hashmap_remove_str(cmld_containers_config_hashes,
+					uuid_string(container_get_uuid(container)));
+	mem_free0(hash);
+	// another container might share a token key with the removed one
+	cmld_containers_index_tokens_rebuild();
+	cmld_containers_by_uid_dirty = true;
+}
+
+static void
+cmld_container_set_token_devpath(container_t *container, char *devpath)
+{
+	container_set_usbtoken_devpath(container, devpath);
+	cmld_containers_index_tokens_rebuild();
+}
+
 container_t *
 cmld_container_get_by_uuid(const uuid_t *uuid)
 {
 	ASSERT(uuid);
+	IF_NULL_RETVAL_TRACE(cmld_containers_by_uuid, NULL);
 
-	for (list_t *l = cmld_containers_list; l; l = l->next)
-		if (uuid_equals(container_get_uuid(l->data), uuid))
-			return l->data;
-
-	return NULL;
+	return hashmap_get(cmld_containers_by_uuid, uuid_get_bin(uuid), sizeof(uuid_bin_t));
 }
 
 container_t *
@@ -170,18 +396,9 @@ cmld_container_get_by_token_serial(const char *serial)
 	IF_NULL_RETVAL_TRACE(serial, NULL);
 
 	TRACE("Looking for container with token serial %s", serial);
+	IF_NULL_RETVAL_TRACE(cmld_containers_by_token_serial, NULL);
 
-	for (list_t *l = cmld_containers_list; l; l = l->next) {
-		if (CONTAINER_TOKEN_TYPE_USB != container_get_token_type(l->data))
-			continue;
-
-		char *s = container_get_usbtoken_serial(l->data);
-
-		if (s && !strcmp(s, serial))
-			return l->data;
-	}
-
-	return NULL;
+	return hashmap_get_str(cmld_containers_by_token_serial, serial);
 }
 
 container_t *
@@ -190,49 +407,78 @@ cmld_container_get_by_devpath(const char *devpath)
 	ASSERT(devpath);
 
 	TRACE("Looking for container with token devpath %s", devpath);
+	IF_NULL_RETVAL_TRACE(cmld_containers_by_token_devpath, NULL);
 
-	for (list_t *l = cmld_containers_list; l; l = l->next) {
-		if (CONTAINER_TOKEN_TYPE_USB != container_get_token_type(l->data))
-			continue;
-
-		char *p = container_get_usbtoken_devpath(l->data);
-
-		if (p && !strcmp(p, devpath))
-			return l->data;
-	}
-
-	return NULL;
+	return hashmap_get_str(cmld_containers_by_token_devpath, devpath);
 }
 
 #define UID_MAX 65535
 container_t *
 cmld_container_get_by_uid(int uid)
 {
-	for (list_t *l = cmld_containers_list; l; l = l->next) {
-		container_t *c = l->data;
-		if ((uid >= container_get_uid(c)) && (uid < container_get_uid(c) + UID_MAX))
-			return c;
+	if (cmld_containers_by_uid_dirty)
+		cmld_containers_index_uid_rebuild();
+
+	// find the last range which starts at or below uid
+	size_t lo = 0, hi = cmld_containers_by_uid_len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (cmld_containers_by_uid[mid].uid <= uid)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	IF_TRUE_RETVAL_TRACE(lo == 0, NULL);
+
+	// the first container in the list wins if containers share a range
+	size_t i = lo - 1;
+	while (i > 0 && cmld_containers_by_uid[i - 1].uid == cmld_containers_by_uid[i].uid)
+		i--;
+
+	if (uid < cmld_containers_by_uid[i].uid + UID_MAX)
+		return cmld_containers_by_uid[i].container;
+
 	return NULL;
 }
 
 static bool
-cmld_containers_are_all_stopped(void)
+cmld_containers_are_all_stopped_except(const container_t *except)
 {
 	for (list_t *l = cmld_containers_list; l; l = l->next) {
 		container_t *c = l->data;
-		if (container_get_state(c) != CONTAINER_STATE_STOPPED)
+		if (c != except && container_get_state(c) != CONTAINER_STATE_STOPPED)
 			return false;
-		else
-			continue;
 	}
 	return true;
 }
 
+static bool
+cmld_containers_are_all_stopped(void)
+{
+	return cmld_containers_are_all_stopped_except(NULL);
+}
+
 typedef struct cmld_container_stop_data {
 	void (*on_all_stopped)(void);
+	container_t *c0; // stopped once all other containers are down, NULL if already stopped
 } cmld_container_stop_data_t;
 
+static void
+cmld_container_stop_cb(container_t *container, container_callback_t *cb, void *data);
+
+/* stops the container and observes it until it is down */
+static int
+cmld_containers_stop_container(container_t *container, cmld_container_stop_data_t *stop_data)
+{
+	container_stop(container);
+	/* Register observer to wait for completed container_stop */
+	if (!container_register_observer(container, &cmld_container_stop_cb, stop_data)) {
+		DEBUG("Could not register stop callback");
+		return -1;
+	}
+	return 0;
+}
+
 static void
 cmld_container_stop_cb(container_t *container, container_callback_t *cb, void *data)
 {
@@ -251,10 +497,21 @@ cmld_container_stop_cb(container_t *container, container_callback_t *cb, void *d
 	audit_log_event(container_get_uuid(container), SSA, CMLD, CONTAINER_MGMT,
 			"container-stopped", uuid_string(container_get_uuid(container)), 0);
 
+	/* c0 may provide services to the others, thus it goes down after them */
+	if (stop_data->c0 && cmld_containers_are_all_stopped_except(stop_data->c0)) {
+		container_t *c0 = stop_data->c0;
+		stop_data->c0 = NULL;
+		INFO("all other containers are stopped now, stopping c0");
+		if (cmld_containers_stop_container(c0, stop_data) < 0)
+			container_kill(c0);
+		return;
+	}
+
 	/* execute on_all_stopped, if all containers are stopped now */
 	if (cmld_containers_are_all_stopped()) {
 		INFO("all containers are stopped now, execution of on_all_stopped()");
 		stop_data->on_all_stopped();
+		mem_free0(stop_data);
 	}
 }
 
@@ -271,17 +528,22 @@ cmld_containers_stop(void (*on_all_stopped)(void))
 	cmld_container_stop_data_t *stop_data = mem_new0(cmld_container_stop_data_t, 1);
 	stop_data->on_all_stopped = on_all_stopped;
 
+	container_t *c0 = cmld_containers_get_c0();
+	if (c0 && container_get_state(c0) != CONTAINER_STATE_STOPPED &&
+	    !cmld_containers_are_all_stopped_except(c0))
+		stop_data->c0 = c0;
+
+	/*
+	 * All other containers are stopped at once, so that the shutdown takes as long as
+	 * the slowest of them. Each is killed after its adaptive stop timeout.
+	 */
 	for (list_t *l = cmld_containers_list; l; l = l->next) {
 		container_t *container = l->data;
-		if (container_get_state(container) != CONTAINER_STATE_STOPPED) {
-			container_stop(container);
-			/* Register observer to wait for completed container_stop */
-			if (!container_register_observer(container, &cmld_container_stop_cb,
-							 stop_data)) {
-				DEBUG("Could not register stop callback");
-				return -1;
-			}
-		}
+		if (container == stop_data->c0 ||
+		    container_get_state(container) == CONTAINER_STATE_STOPPED)
+			continue;
+		if (cmld_containers_stop_container(container, stop_data) < 0)
+			return -1;
 	}
 	return 0;
 }
@@ -398,6 +660,24 @@ cmld_container_token_init(container_t *container)
 	return 0;
 }
 
+/**
+ * Returns true if the config file of the container still has the content
+ * the container was created from.
+ */
+static bool
+cmld_container_config_unchanged(const container_t *container)
+{
+	const char *old_hash = hashmap_get_str(cmld_containers_config_hashes,
+					       uuid_string(container_get_uuid(container)));
+	IF_NULL_RETVAL(old_hash, false);
+
+	char *hash = crypto_hash_file_block_new(container_get_config_filename(container),
+						CRYPTO_HASH_SHA256);
+	bool unchanged = hash && !strcmp(hash, old_hash);
+	mem_free0(hash);
+	return unchanged;
+}
+
 static int
 cmld_load_containers_cb(const char *path, const char *name, UNUSED void *data)
 {
@@ -432,9 +712,15 @@ cmld_load_containers_cb(const char *path, const char *name, UNUSED void *data)
 				      name, container_get_name(c));
 				goto cleanup;
 			}
+			if (cmld_container_config_unchanged(c)) {
+				TRACE("Config %s of container %s did not change", name,
+				      container_get_name(c));
+				res = 1;
+				goto cleanup;
+			}
 			DEBUG("Removing outdated created container %s for config update",
 			      container_get_name(c));
-			cmld_containers_list = list_remove(cmld_containers_list, c);
+			cmld_containers_remove(c);
 			container_free(c);
 		}
 		c = container_new(path, uuid, NULL, 0, NULL, 0, NULL, 0);
@@ -442,7 +728,7 @@ cmld_load_containers_cb(const char *path, const char *name, UNUSED void *data)
 			DEBUG("Loaded config for container %s from %s", container_get_name(c),
 			      name);
 			cmld_container_token_init(c);
-			cmld_containers_list = list_append(cmld_containers_list, c);
+			cmld_containers_add(c);
 			res = 1;
 			goto cleanup;
 		}
@@ -477,12 +763,71 @@ cmld_reload_containers(void)
 {
 	int ret = -1;
 	char *path = mem_printf("%s/%s", cmld_path, CMLD_PATH_CONTAINERS_DIR);
+	// configs are reloaded from disk, thus pending updates have to be written first
+	file_writer_flush(NULL);
 	ret = cmld_load_containers(path);
 
 	mem_free0(path);
 	return ret;
 }
 
+static void
+cmld_config_reload_cb(event_timer_t *timer, UNUSED void *data)
+{
+	event_timer_free(timer);
+	cmld_config_reload_timer = NULL;
+
+	char *path = mem_printf("%s/%s", cmld_path, CMLD_PATH_CONTAINERS_DIR);
+	for (list_t *l = cmld_config_reload_pending; l; l = l->next) {
+		char *name = l->data;
+		DEBUG("Reloading changed container config %s", name);
+		cmld_load_containers_cb(path, name, NULL);
+		mem_free0(name);
+	}
+	list_delete(cmld_config_reload_pending);
+	cmld_config_reload_pending = NULL;
+	mem_free0(path);
+}
+
+static void
+cmld_containers_dir_inotify_cb(const char *path, UNUSED uint32_t mask,
+			       UNUSED event_inotify_t *inotify, UNUSED void *data)
+{
+	const char *name = strrchr(path, '/');
+	IF_NULL_RETURN(name);
+	name++;
+
+	size_t len = strlen(name);
+	if (len < 5 || strcmp(name + len - 5, ".conf"))
+		return;
+
+	for (list_t *l = cmld_config_reload_pending; l; l = l->next)
+		if (!strcmp(l->data, name))
+			return;
+	cmld_config_reload_pending = list_append(cmld_config_reload_pending, mem_strdup(name));
+
+	if (!cmld_config_reload_timer) {
+		cmld_config_reload_timer = event_timer_new(CMLD_CONFIG_RELOAD_DELAY, 1,
+							   &cmld_config_reload_cb, NULL);
+		event_add_timer(cmld_config_reload_timer);
+	}
+}
+
+/**
+ * Reloads container configs as soon as they are written to the containers
+ * directory, instead of waiting for an explicit reload of all containers.
+ */
+static void
+cmld_watch_containers_dir(const char *path)
+{
+	event_inotify_t *inotify = event_inotify_new(path, IN_CLOSE_WRITE | IN_MOVED_TO,
+						     &cmld_containers_dir_inotify_cb, NULL);
+	if (event_add_inotify(inotify) < 0) {
+		WARN("Could not watch %s for config changes", path);
+		event_inotify_free(inotify);
+	}
+}
+
 /**
  * Checks if a filename in the /data/logs directory contains
  * "1970" and renames the found files with a new timestamp
@@ -508,8 +853,10 @@ cmld_rename_logfiles()
 					logf_file_new_name(filename);
 				char *old_filename_with_path =
 					mem_printf("%s/%s", LOGFILE_DIR, entry->d_name);
+				// keep the suffix of log files which were compressed after rotation
 				char *new_filename_with_path = mem_printf(
-					"%s/%s", LOGFILE_DIR, filename_with_correct_timestamp);
+					"%s/%s%s", LOGFILE_DIR, filename_with_correct_timestamp,
+					strstr(entry->d_name, ".gz") ? ".gz" : "");
 				if (rename(old_filename_with_path, new_filename_with_path))
 					ERROR_ERRNO("Rename not successful %s -> %s",
 						    old_filename_with_path, new_filename_with_path);
@@ -705,6 +1052,70 @@ cmld_get_control_gui_sock(void)
 	return control_get_client_sock(cmld_control_gui);
 }
 
+static void
+cmld_boot_queue_run(void);
+
+/*
+ * Releases the boot slot of an autostarted container as soon as it leaves the
+ * starting phase, i.e., booting, running or failed, and starts the next one.
+ */
+static void
+cmld_boot_slot_cb(container_t *container, container_callback_t *cb, UNUSED void *data)
+{
+	IF_TRUE_RETURN(container_get_state(container) == CONTAINER_STATE_STARTING);
+
+	DEBUG("Container %s finished its start, releasing boot slot",
+	      container_get_description(container));
+	container_unregister_observer(container, cb);
+	cmld_boot_active--;
+	cmld_boot_queue_run();
+}
+
+/*
+ * Takes the queued container with the highest boot priority, in the order of
+ * cmld_containers_list for equal priorities.
+ */
+static container_t *
+cmld_boot_queue_pop(void)
+{
+	list_t *next = cmld_boot_queue;
+	for (list_t *l = cmld_boot_queue; l; l = l->next) {
+		if (container_get_boot_priority(l->data) > container_get_boot_priority(next->data))
+			next = l;
+	}
+	IF_NULL_RETVAL(next, NULL);
+
+	container_t *container = next->data;
+	cmld_boot_queue = list_unlink(cmld_boot_queue, next);
+	return container;
+}
+
+static void
+cmld_boot_queue_run(void)
+{
+	while (cmld_boot_queue &&
+	       (cmld_boot_concurrency == 0 || cmld_boot_active < cmld_boot_concurrency)) {
+		container_t *container = cmld_boot_queue_pop();
+
+		// might have been started manually in the meantime
+		if (container_get_state(container) != CONTAINER_STATE_STOPPED)
+			continue;
+
+		INFO("Autostarting container %s in background (priority %u)",
+		     container_get_name(container), container_get_boot_priority(container));
+		if (cmld_container_start(container) < 0 ||
+		    container_get_state(container) != CONTAINER_STATE_STARTING)
+			continue;
+
+		if (!container_register_observer(container, &cmld_boot_slot_cb, NULL)) {
+			WARN("Could not register boot slot observer for %s",
+			     container_get_description(container));
+			continue;
+		}
+		cmld_boot_active++;
+	}
+}
+
 /******************************************************************************/
 
 static void
@@ -736,14 +1147,16 @@ cmld_c0_boot_complete_cb(container_t *container, container_callback_t *cb, UNUSE
 			uevent_udev_trigger_coldboot(container);
 		container_unregister_observer(container, cb);
 
+		// c0 is up, now start the other containers through the boot queue
 		for (list_t *l = cmld_containers_list; l; l = l->next) {
 			container_t *container = l->data;
-			if (container_get_allow_autostart(container)) {
-				INFO("Autostarting container %s in background",
-				     container_get_name(container));
-				cmld_container_start(container);
-			}
+			// containers with activation sockets are started on the first connection
+			if (container_get_allow_autostart(container) &&
+			    !activation_is_on_demand(container) &&
+			    !list_find(cmld_boot_queue, container))
+				cmld_boot_queue = list_append(cmld_boot_queue, container);
 		}
+		cmld_boot_queue_run();
 	}
 }
 
@@ -780,6 +1193,8 @@ cmld_shutdown_container_cb(container_t *container, container_callback_t *cb, UNU
 
 	audit_log_event(container_get_uuid(container), SSA, CMLD, CONTAINER_MGMT, "shutdown",
 			uuid_string(container_get_uuid(container)), 0);
+	audit_flush();
+	file_writer_flush(NULL);
 
 #ifndef TRUSTME_DEBUG
 	reboot_reboot(POWER_OFF);
@@ -839,6 +1254,8 @@ cmld_shutdown_c0_cb(container_t *c0, container_callback_t *cb, UNUSED void *data
 		DEBUG("Device shutdown: all containers already down; shutdown now");
 		audit_log_event(container_get_uuid(c0), SSA, CMLD, CONTAINER_MGMT, "shutdown",
 				uuid_string(container_get_uuid(c0)), 0);
+		audit_flush();
+		file_writer_flush(NULL);
 #ifndef TRUSTME_DEBUG
 		reboot_reboot(POWER_OFF);
 		// should never arrive here, but in case the shutdown fails somehow, we exit
@@ -893,6 +1310,7 @@ cmld_init_c0(const char *path, const char *c0os)
 
 	/* store c0 as first element of the cmld_containers_list */
 	cmld_containers_list = list_prepend(cmld_containers_list, new_c0);
+	cmld_containers_index_add(new_c0);
 
 	mem_free0(c0_images_folder);
 
@@ -950,6 +1368,142 @@ cmld_start_c0(container_t *new_c0)
 	return 0;
 }
 
+/*
+ * Reads the state handed over by the previous cmld instance, which is only
+ * valid for this one start of cmld.
+ */
+static bool
+cmld_reexec_state_read(pid_t *lxcfs_pid, int *control_gui_sock)
+{
+	IF_FALSE_RETVAL(file_exists(CMLD_REEXEC_STATE_FILE), false);
+
+	char *state = file_read_new(CMLD_REEXEC_STATE_FILE, 1024 * 1024);
+	unlink(CMLD_REEXEC_STATE_FILE);
+	IF_NULL_RETVAL_ERROR(state, false);
+
+	char *saveptr = NULL;
+	for (char *line = strtok_r(state, "\n", &saveptr); line;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		int val;
+		if (sscanf(line, "lxcfs %d", &val) == 1)
+			*lxcfs_pid = val;
+		else if (sscanf(line, "control %d", &val) == 1)
+			*control_gui_sock = val;
+		else if (!strncmp(line, "container ", 10))
+			cmld_reexec_containers =
+				list_append(cmld_reexec_containers, mem_strdup(line + 10));
+		else
+			WARN("Ignoring invalid re-exec state '%s'", line);
+	}
+
+	mem_free0(state);
+	INFO("cmld was re-executed, taking over %u containers",
+	     list_length(cmld_reexec_containers));
+	return true;
+}
+
+/*
+ * Takes over the containers listed by the previous cmld instance and registers
+ * the observers cmld_container_start() or cmld_start_c0() would have.
+ *
+ * @return true if c0 was taken over, i.e., must not be started again
+ */
+static bool
+cmld_reexec_containers_reattach(int control_gui_sock)
+{
+	bool c0_running = false;
+
+	for (list_t *l = cmld_reexec_containers; l; l = l->next) {
+		char *line = l->data;
+		char *state = strchr(line, ' ');
+		IF_NULL_GOTO(state, next);
+		*state++ = '\0';
+
+		uuid_t *uuid = uuid_new(line);
+		container_t *container = uuid ? cmld_container_get_by_uuid(uuid) : NULL;
+		if (uuid)
+			uuid_free(uuid);
+		if (!container || container_reattach(container, state) < 0) {
+			WARN("Could not take over container %s", line);
+			goto next;
+		}
+
+		if (container == cmld_containers_get_c0()) {
+			c0_running = true;
+			if (control_gui_sock >= 0)
+				cmld_control_gui = control_new(control_gui_sock, true);
+			if (!container_register_observer(container, &cmld_shutdown_c0_cb, NULL))
+				WARN("Could not register observer shutdown callback for c0");
+			if (!container_register_observer(container, &cmld_reboot_c0_cb, NULL))
+				WARN("Could not register observer reboot callback for c0");
+		} else if (!container_register_observer(container, &cmld_reboot_container_cb,
+							NULL)) {
+			WARN("Could not register container reboot observer callback for %s",
+			     container_get_description(container));
+		}
+	next:
+		mem_free0(line);
+	}
+	list_delete(cmld_reexec_containers);
+	cmld_reexec_containers = NULL;
+
+	return c0_running;
+}
+
+int
+cmld_reexec_prepare(void)
+{
+	for (list_t *l = cmld_containers_list; l; l = l->next) {
+		container_state_t state = container_get_state(l->data);
+		if (state != CONTAINER_STATE_STOPPED && state != CONTAINER_STATE_RUNNING &&
+		    state != CONTAINER_STATE_FROZEN) {
+			WARN("Container %s is in transition, not re-executing cmld",
+			     container_get_description(l->data));
+			return -1;
+		}
+	}
+
+	// the new image reads the configs from disk
+	file_writer_flush(NULL);
+
+	// everything not explicitly handed over is closed on exec
+	if (fd_cloexec_all(3) < 0)
+		return -1;
+
+	str_t *state = str_new(NULL);
+	if (lxcfs_get_pid() > 0)
+		str_append_printf(state, "lxcfs %d\n", lxcfs_get_pid());
+	if (cmld_control_gui && !fd_keep_on_exec(control_get_sock(cmld_control_gui)))
+		str_append_printf(state, "control %d\n", control_get_sock(cmld_control_gui));
+	for (list_t *l = cmld_containers_list; l; l = l->next) {
+		container_t *container = l->data;
+		char *line = container_reexec_state_new(container);
+		if (line) {
+			str_append_printf(state, "container %s %s\n",
+					  uuid_string(container_get_uuid(container)), line);
+			mem_free0(line);
+		}
+	}
+
+	int ret = file_write(CMLD_REEXEC_STATE_FILE, str_buffer(state), -1);
+	str_free(state, true);
+	IF_TRUE_RETVAL_ERROR(ret < 0, -1);
+
+	// pooled zygotes are not handed over, their cgroups and image mounts are released
+	zygote_pool_free();
+
+	// the helper daemons are restarted by the next instance
+	if (cmld_smartcard) {
+		smartcard_free(cmld_smartcard);
+		cmld_smartcard = NULL;
+	}
+	tss_cleanup();
+
+	audit_log_event(NULL, SSA, CMLD, GENERIC, "cmld-reexec", NULL, 0);
+	INFO("Handed over runtime state, re-executing cmld");
+	return 0;
+}
+
 static void
 cmld_tune_network(const char *host_addr, uint32_t host_subnet, const char *host_if,
 		  const char *host_gateway, const char *host_dns)
@@ -981,13 +1535,25 @@ cmld_tune_network(const char *host_addr, uint32_t host_subnet, const char *host_
 	network_enable_ip_forwarding();
 }
 
+static void
+cmld_start_c0_tss_ready_cb(UNUSED void *data)
+{
+	if (cmld_start_c0(cmld_containers_get_c0()) < 0)
+		FATAL("Could not start c0");
+}
+
 int
 cmld_init(const char *path)
 {
 	INFO("Storage path is %s", path);
 	cmld_path = path;
 
-	if (mount_private_tmp())
+	pid_t reexec_lxcfs_pid = 0;
+	int reexec_control_gui_sock = -1;
+	bool reexec = cmld_reexec_state_read(&reexec_lxcfs_pid, &reexec_control_gui_sock);
+
+	// the running containers still use the private tmp of the previous instance
+	if (!reexec && mount_private_tmp())
 		FATAL("Could not setup private tmp!");
 
 	/* Currently the given path is used by the config module to generate the
@@ -1010,6 +1576,12 @@ cmld_init(const char *path)
 	// activate signature checking of container configs if enabled
 	cmld_signed_configs = device_config_get_signed_configs(device_config);
 
+	if (loopdev_pool_fill(CMLD_LOOPDEV_POOL_SIZE) < 0)
+		WARN("Could not pre-create loop devices");
+
+	if (network_link_cache_init() < 0)
+		WARN("Could not init link cache, querying links directly");
+
 	cmld_tune_network(device_config_get_host_addr(device_config),
 			  device_config_get_host_subnet(device_config),
 			  device_config_get_host_if(device_config),
@@ -1032,6 +1604,11 @@ cmld_init(const char *path)
 	const char *c0os_name = device_config_get_c0os(device_config);
 	cmld_c0os_name = c0os_name ? mem_strdup(c0os_name) : NULL;
 
+	const char *kexec_kernel = device_config_get_kexec_kernel(device_config);
+	const char *kexec_initrd = device_config_get_kexec_initrd(device_config);
+	cmld_kexec_kernel = kexec_kernel && *kexec_kernel ? mem_strdup(kexec_kernel) : NULL;
+	cmld_kexec_initrd = kexec_initrd && *kexec_initrd ? mem_strdup(kexec_initrd) : NULL;
+
 	if (mount_remount_root_ro() < 0 && !cmld_hostedmode)
 		FATAL("Could not remount rootfs read-only");
 
@@ -1040,6 +1617,8 @@ cmld_init(const char *path)
 	else
 		INFO("mounted debugfs");
 
+	c_cgroups_set_stats_interval(device_config_get_cgroups_stats_interval(device_config));
+
 	// init audit and set max audit log file size
 	if (audit_init(device_config_get_audit_size(device_config)) < 0)
 		WARN("Could not init audit module");
@@ -1063,6 +1642,37 @@ cmld_init(const char *path)
 	else
 		INFO("ksm initialized.");
 
+	if (reclaim_init(device_config_get_zram_swap_size(device_config)) < 0)
+		WARN("Could not set up zram swap");
+	else
+		INFO("memory reclaim initialized.");
+
+	if (placement_init() < 0)
+		WARN("Could not read cpu topology, containers are placed as configured");
+	else
+		INFO("container placement initialized.");
+
+	if (psi_init(device_config_get_psi_freeze_policy(device_config)) < 0)
+		WARN("Could not init pressure stall monitoring");
+	else
+		INFO("pressure stall monitoring initialized.");
+
+	idle_init();
+	INFO("idle policy initialized.");
+
+	balloon_init();
+	INFO("balloon control initialized.");
+
+	if (device_config_get_mem_accounting(device_config)) {
+		mem_accounting_enable(true);
+		INFO("accounting of allocations enabled.");
+	}
+
+	if (exporter_init(device_config_get_metrics_socket(device_config)) < 0)
+		WARN("Could not init metrics socket");
+	else
+		INFO("metrics exporter initialized.");
+
 	if (device_config_get_tpm_enabled(device_config)) {
 		if (tss_init() < 0)
 			FATAL("Failed to initialize TSS / TPM 2.0 and tpm2d");
@@ -1070,11 +1680,24 @@ cmld_init(const char *path)
 			INFO("tss initialized.");
 	}
 
-	if (lxcfs_init() < 0)
+	if ((reexec ? lxcfs_reattach(reexec_lxcfs_pid) : lxcfs_init()) < 0)
 		WARN("Plattform does not support LXCFS");
 	else
 		INFO("lxcfs initialized.");
 
+	if (c_net_address_pool_init(device_config_get_container_subnet_pool(device_config)) < 0)
+		FATAL("Could not init container subnet pool");
+
+	cmld_boot_concurrency = device_config_get_boot_concurrency(device_config);
+
+	download_set_rate_limit((uint64_t)device_config_get_update_rate_limit(device_config) * 1024);
+
+	if (c_net_veth_pool_init(device_config_get_veth_pool_size(device_config)) < 0)
+		WARN("Could not init veth pool");
+
+	if (zygote_pool_init(device_config_get_zygote_pool_size(device_config)) < 0)
+		WARN("Could not init zygote pool");
+
 	// Read the provision-status-file to set provisioned flag of control structs accordingly
 	char *provisioned_file = mem_printf("%s/%s", DEFAULT_BASE_PATH, PROVISIONED_FILE_NAME);
 	if (file_exists(provisioned_file)) {
@@ -1116,6 +1739,11 @@ cmld_init(const char *path)
 	cmld_smartcard = smartcard_new(tokens_path);
 	mem_free0(tokens_path);
 
+	char *config_cache_path = mem_printf("%s/%s", path, CMLD_PATH_CONFIG_CACHE);
+	if (config_cache_init(config_cache_path) < 0)
+		WARN("Could not load config cache, parsing all configs");
+	mem_free0(config_cache_path);
+
 	char *guestos_path = mem_printf("%s/%s", path, CMLD_PATH_GUESTOS_DIR);
 	bool allow_locally_signed = device_config_get_locally_signed_images(device_config);
 	if (guestos_mgr_init(guestos_path, allow_locally_signed) < 0 && !cmld_hostedmode)
@@ -1144,8 +1772,13 @@ cmld_init(const char *path)
 	if (cmld_load_containers(containers_path) < 0)
 		FATAL("Could not load containers");
 
-	if (cmld_start_c0(cmld_containers_get_c0()) < 0)
-		FATAL("Could not start c0");
+	cmld_watch_containers_dir(containers_path);
+
+	bool c0_running = reexec && cmld_reexec_containers_reattach(reexec_control_gui_sock);
+
+	// the TPM is initialized by tpm2d meanwhile, c0 is started once it is connected
+	if (!c0_running)
+		tss_notify_ready(cmld_start_c0_tss_ready_cb, NULL);
 
 	mem_free0(containers_path);
 
@@ -1153,12 +1786,76 @@ cmld_init(const char *path)
 	return 0;
 }
 
+static uint8_t *
+cmld_file_read_bin_new(const char *file, size_t *len)
+{
+	off_t size = file_size(file);
+	IF_TRUE_RETVAL(size <= 0, NULL);
+
+	uint8_t *buf = mem_alloc(size);
+	if (file_read(file, (char *)buf, size) != size) {
+		ERROR("Failed to read file '%s'", file);
+		mem_free0(buf);
+		return NULL;
+	}
+	*len = size;
+	return buf;
+}
+
 container_t *
 cmld_container_create_clone(container_t *container)
 {
 	ASSERT(container);
-	ASSERT(0); // TODO
-	return NULL;
+
+	const char *config_file = container_get_config_filename(container);
+	IF_NULL_RETVAL_ERROR(config_file, NULL);
+
+	size_t config_len = 0, sig_len = 0, cert_len = 0;
+	uint8_t *sig = NULL, *cert = NULL;
+	container_t *clone = NULL;
+
+	file_writer_flush(config_file);
+	uint8_t *config = cmld_file_read_bin_new(config_file, &config_len);
+	IF_NULL_RETVAL_ERROR(config, NULL);
+
+	// the clone shares the signed config of its origin, only the uuid differs
+	char *prefix = mem_strdup(config_file);
+	char *suffix = strrchr(prefix, '.');
+	if (suffix)
+		*suffix = '\0';
+	char *sig_file = mem_printf("%s.sig", prefix);
+	char *cert_file = mem_printf("%s.cert", prefix);
+	if (file_exists(sig_file) && file_exists(cert_file)) {
+		sig = cmld_file_read_bin_new(sig_file, &sig_len);
+		cert = cmld_file_read_bin_new(cert_file, &cert_len);
+	}
+
+	clone = cmld_container_create_from_config(config, config_len, sig, sig_len, cert,
+						  cert_len);
+	IF_NULL_GOTO(clone, out);
+
+	if (container_clone_images(clone, container) < 0) {
+		ERROR("Could not clone images of container %s",
+		      container_get_description(container));
+		audit_log_event(container_get_uuid(clone), FSA, CMLD, CONTAINER_MGMT,
+				"container-clone", uuid_string(container_get_uuid(container)), 0);
+		cmld_container_destroy(clone);
+		clone = NULL;
+		goto out;
+	}
+
+	audit_log_event(container_get_uuid(clone), SSA, CMLD, CONTAINER_MGMT, "container-clone",
+			uuid_string(container_get_uuid(container)), 0);
+	INFO("Cloned container %s to %s", container_get_description(container),
+	     container_get_description(clone));
+out:
+	mem_free0(sig_file);
+	mem_free0(cert_file);
+	mem_free0(prefix);
+	mem_free0(config);
+	mem_free0(sig);
+	mem_free0(cert);
+	return clone;
 }
 
 container_t *
@@ -1182,7 +1879,7 @@ cmld_container_create_from_config(const uint8_t *config, size_t config_len, uint
 			cmld_container_destroy(c);
 			c = NULL;
 		} else {
-			cmld_containers_list = list_append(cmld_containers_list, c);
+			cmld_containers_add(c);
 			audit_log_event(container_get_uuid(c), SSA, CMLD, CONTAINER_MGMT,
 					"container-create", uuid_string(container_get_uuid(c)), 0);
 			INFO("Created container %s (uuid=%s).", container_get_name(c),
@@ -1234,7 +1931,7 @@ cmld_container_destroy_cb(container_t *container, container_callback_t *cb, UNUS
 	}
 
 	/* cleanup container */
-	cmld_containers_list = list_remove(cmld_containers_list, container);
+	cmld_containers_remove(container);
 	audit_log_event(container_get_uuid(container), SSA, CMLD, CONTAINER_MGMT,
 			"container-remove", uuid_string(container_get_uuid(container)), 0);
 	container_free(container);
@@ -1305,6 +2002,106 @@ cmld_container_unfreeze(container_t *container)
 	return container_unfreeze(container);
 }
 
+typedef struct cmld_containers_freeze_data {
+	void (*on_all_frozen)(unsigned int failed, void *data);
+	void *data;
+	unsigned int pending; /* containers still freezing, plus one while issuing */
+	unsigned int failed;
+} cmld_containers_freeze_data_t;
+
+static void
+cmld_containers_freeze_done(cmld_containers_freeze_data_t *freeze_data, bool failed)
+{
+	if (failed)
+		freeze_data->failed++;
+
+	if (--freeze_data->pending > 0)
+		return;
+
+	INFO("Freezing containers completed, %u failed", freeze_data->failed);
+	freeze_data->on_all_frozen(freeze_data->failed, freeze_data->data);
+	mem_free0(freeze_data);
+}
+
+static void
+cmld_containers_freeze_cb(container_t *container, container_callback_t *cb, void *data)
+{
+	cmld_containers_freeze_data_t *freeze_data = data;
+
+	ASSERT(container);
+	ASSERT(cb);
+	ASSERT(freeze_data);
+
+	container_state_t state = container_get_state(container);
+	IF_TRUE_RETURN_TRACE(state == CONTAINER_STATE_FREEZING);
+
+	container_unregister_observer(container, cb);
+
+	/* any other state than frozen means the freeze was aborted, e.g. on timeout */
+	if (state != CONTAINER_STATE_FROZEN)
+		WARN("Could not freeze container %s", container_get_description(container));
+
+	cmld_containers_freeze_done(freeze_data, state != CONTAINER_STATE_FROZEN);
+}
+
+int
+cmld_containers_freeze(void (*on_all_frozen)(unsigned int failed, void *data), void *data)
+{
+	ASSERT(on_all_frozen);
+
+	cmld_containers_freeze_data_t *freeze_data = mem_new0(cmld_containers_freeze_data_t, 1);
+	freeze_data->on_all_frozen = on_all_frozen;
+	freeze_data->data = data;
+	freeze_data->pending = 1;
+
+	/* issue all freezes first, the kernel freezes the cgroups concurrently */
+	for (list_t *l = cmld_containers_list; l; l = l->next) {
+		container_t *container = l->data;
+		if (container_get_state(container) != CONTAINER_STATE_RUNNING)
+			continue;
+
+		/* register before freezing, as the freeze may already complete in the call */
+		container_callback_t *cb = container_register_observer(
+			container, &cmld_containers_freeze_cb, freeze_data);
+		if (!cb) {
+			WARN("Could not register freeze callback for %s",
+			     container_get_description(container));
+			freeze_data->failed++;
+			continue;
+		}
+
+		freeze_data->pending++;
+		if (container_freeze(container) < 0) {
+			container_unregister_observer(container, cb);
+			cmld_containers_freeze_done(freeze_data, true);
+		}
+	}
+
+	cmld_containers_freeze_done(freeze_data, false);
+	return 0;
+}
+
+int
+cmld_containers_unfreeze(void)
+{
+	int ret = 0;
+
+	for (list_t *l = cmld_containers_list; l; l = l->next) {
+		container_t *container = l->data;
+		container_state_t state = container_get_state(container);
+		if (state != CONTAINER_STATE_FROZEN && state != CONTAINER_STATE_FREEZING)
+			continue;
+
+		if (container_unfreeze(container) < 0) {
+			WARN("Could not unfreeze container %s",
+			     container_get_description(container));
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
 int
 cmld_container_allow_audio(container_t *container)
 {
@@ -1325,8 +2122,16 @@ int
 cmld_container_snapshot(container_t *container)
 {
 	ASSERT(container);
-	WARN("Container snapshot is not implemented, yet");
-	return 0;
+
+	return container_snapshot(container);
+}
+
+int
+cmld_container_checkpoint(container_t *container)
+{
+	ASSERT(container);
+
+	return container_checkpoint(container);
 }
 
 int
@@ -1337,18 +2142,169 @@ cmld_container_wipe(container_t *container)
 	return container_wipe(container);
 }
 
-void
-cmld_wipe_device()
+// background deletions of a device wipe still running
+static unsigned int cmld_wipe_pending = 0;
+
+static void
+cmld_wipe_device_finish(void)
 {
-	dir_delete_folder(cmld_path, CMLD_PATH_GUESTOS_DIR);
-	dir_delete_folder(cmld_path, CMLD_PATH_CONTAINERS_DIR);
 	dir_delete_folder(cmld_path, CMLD_PATH_CONTAINER_KEYS_DIR);
 	dir_delete_folder(cmld_path, CMLD_PATH_CONTAINER_TOKENS_DIR);
 	dir_delete_folder(LOGFILE_DIR, "");
+	audit_flush();
 	if (!cmld_hostedmode)
 		reboot_reboot(POWER_OFF);
 }
 
+static void
+cmld_wipe_device_progress_cb(const dir_walk_progress_t *progress, UNUSED void *data)
+{
+	INFO("Wiping device, deleted %zu entries so far", progress->entries);
+}
+
+static void
+cmld_wipe_device_done_cb(int ret, UNUSED const dir_walk_progress_t *progress, void *data)
+{
+	char *dir = data;
+
+	if (ret < 0)
+		WARN("Could not delete all of %s", dir);
+	mem_free0(dir);
+
+	if (--cmld_wipe_pending == 0)
+		cmld_wipe_device_finish();
+}
+
+static void
+cmld_wipe_device_dir(const char *dir_name)
+{
+	char *dir = mem_printf("%s/%s", cmld_path, dir_name);
+
+	cmld_wipe_pending++;
+	if (dir_walk_delete_async(dir, &cmld_wipe_device_progress_cb, &cmld_wipe_device_done_cb,
+				  dir) < 0)
+		cmld_wipe_device_done_cb(dir_walk_delete(dir, 0), NULL, dir);
+}
+
+void
+cmld_wipe_device()
+{
+	if (cmld_wipe_pending) {
+		WARN("Device wipe already in progress");
+		return;
+	}
+
+	/*
+	 * guestos images and container volumes are large trees, thus delete them in the
+	 * background; the extra reference finishes the wipe only after both are started
+	 */
+	cmld_wipe_pending++;
+	cmld_wipe_device_dir(CMLD_PATH_GUESTOS_DIR);
+	cmld_wipe_device_dir(CMLD_PATH_CONTAINERS_DIR);
+	if (--cmld_wipe_pending == 0)
+		cmld_wipe_device_finish();
+}
+
+/*
+ * Measures an image loaded for kexec into the TPM, reading it from the fd which is
+ * passed to the kernel afterwards.
+ */
+static int
+cmld_kexec_measure(const char *file, int fd)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len = 0;
+	char buf[64 * 1024];
+	ssize_t len;
+	int ret = -1;
+
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	IF_NULL_RETVAL_ERROR(ctx, -1);
+	IF_FALSE_GOTO(EVP_DigestInit_ex(ctx, EVP_sha256(), NULL), out);
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		IF_FALSE_GOTO(EVP_DigestUpdate(ctx, buf, len), out);
+	}
+	if (len < 0 || !EVP_DigestFinal_ex(ctx, md, &md_len) || lseek(fd, 0, SEEK_SET) < 0) {
+		ERROR_ERRNO("Could not hash %s", file);
+		goto out;
+	}
+
+	tss_ml_append((char *)file, md, md_len, TSS_SHA256);
+	ret = 0;
+out:
+	EVP_MD_CTX_free(ctx);
+	return ret;
+}
+
+/*
+ * Loads the configured kernel and initrd for kexec with the command line of the
+ * running kernel.
+ */
+static int
+cmld_kexec_load(void)
+{
+	IF_NULL_RETVAL_TRACE(cmld_kexec_kernel, -1);
+
+	int ret = -1, initrd_fd = -1;
+	char *cmdline = NULL;
+
+	int kernel_fd = open(cmld_kexec_kernel, O_RDONLY | O_CLOEXEC);
+	if (kernel_fd < 0) {
+		ERROR_ERRNO("Could not open kexec kernel %s", cmld_kexec_kernel);
+		return -1;
+	}
+	if (cmld_kexec_initrd && (initrd_fd = open(cmld_kexec_initrd, O_RDONLY | O_CLOEXEC)) < 0) {
+		ERROR_ERRNO("Could not open kexec initrd %s", cmld_kexec_initrd);
+		goto out;
+	}
+
+	if (cmld_kexec_measure(cmld_kexec_kernel, kernel_fd) < 0 ||
+	    (initrd_fd >= 0 && cmld_kexec_measure(cmld_kexec_initrd, initrd_fd) < 0))
+		goto out;
+
+	cmdline = file_read_new("/proc/cmdline", 4096);
+	IF_NULL_GOTO_ERROR(cmdline, out);
+	cmdline[strcspn(cmdline, "\n")] = '\0';
+
+	if (reboot_kexec_load(kernel_fd, initrd_fd, cmdline) < 0) {
+		ERROR_ERRNO("Could not load kexec kernel %s", cmld_kexec_kernel);
+		goto out;
+	}
+	ret = 0;
+out:
+	mem_free0(cmdline);
+	if (initrd_fd >= 0)
+		close(initrd_fd);
+	close(kernel_fd);
+	return ret;
+}
+
+static void
+cmld_reboot_device_cb(void)
+{
+	audit_log_event(NULL, SSA, CMLD, GENERIC, "reboot", NULL, 0);
+	audit_flush();
+	file_writer_flush(NULL);
+	sync();
+
+	if (cmld_kexec_kernel && !cmld_kexec_load()) {
+		INFO("Device reboot: all containers down, booting %s by kexec", cmld_kexec_kernel);
+		reboot_reboot(KEXEC);
+		ERROR_ERRNO("kexec failed, falling back to a full reboot");
+	}
+
+	INFO("Device reboot: all containers down, rebooting now");
+	if (reboot_reboot(REBOOT) < 0)
+		ERROR_ERRNO("Could not reboot device");
+}
+
+int
+cmld_reboot_device(void)
+{
+	INFO("Device reboot: stopping all containers first");
+	return cmld_containers_stop(&cmld_reboot_device_cb);
+}
+
 const char *
 cmld_get_c0os(void)
 {
@@ -1427,7 +2383,7 @@ cmld_token_attach(const char *serial, char *devpath)
 
 	TRACE("Handling attachment of token with serial %s at %s", serial, devpath);
 
-	container_set_usbtoken_devpath(container, mem_strdup(devpath));
+	cmld_container_set_token_devpath(container, mem_strdup(devpath));
 
 	// initialize the USB token
 	int block_return = cmld_container_token_init(container);
@@ -1450,7 +2406,7 @@ cmld_token_detach(char *devpath)
 
 	DEBUG("Handling detachment of token at %s", devpath);
 
-	container_set_usbtoken_devpath(container, NULL);
+	cmld_container_set_token_devpath(container, NULL);
 
 	DEBUG("Stopping Container");
 	if (cmld_container_stop(container)) {
@@ -1467,11 +2423,29 @@ cmld_token_detach(char *devpath)
 void
 cmld_cleanup(void)
 {
+	file_writer_flush(NULL);
+
 	for (list_t *l = cmld_containers_list; l; l = l->next) {
 		container_t *container = l->data;
+		activation_remove(container);
+	idle_remove(container);
+	balloon_remove(container);
+		audit_rules_remove(container);
 		container_free(container);
 	}
 	list_delete(cmld_containers_list);
+	cmld_containers_list = NULL;
+	list_delete(cmld_boot_queue);
+	cmld_boot_queue = NULL;
+
+	hashmap_free(cmld_containers_by_uuid);
+	hashmap_free(cmld_containers_by_token_serial);
+	hashmap_free(cmld_containers_by_token_devpath);
+	cmld_containers_by_uuid = NULL;
+	cmld_containers_by_token_serial = NULL;
+	cmld_containers_by_token_devpath = NULL;
+	mem_free0(cmld_containers_by_uid);
+	cmld_containers_by_uid_len = 0;
 
 	if (cmld_control_mdm)
 		control_free(cmld_control_mdm);
@@ -1483,10 +2457,14 @@ cmld_cleanup(void)
 	if (cmld_smartcard)
 		smartcard_free(cmld_smartcard);
 
+	exporter_cleanup();
+
 	mem_free0(cmld_device_uuid);
 	mem_free0(cmld_device_update_base_url);
 	mem_free0(cmld_device_host_dns);
 	mem_free0(cmld_c0os_name);
+	mem_free0(cmld_kexec_kernel);
+	mem_free0(cmld_kexec_initrd);
 	mem_free0(cmld_shared_data_dir);
 
 	for (list_t *l = cmld_netif_phys_list; l; l = l->next) {
@@ -1494,4 +2472,10 @@ cmld_cleanup(void)
 		mem_free0(name);
 	}
 	list_delete(cmld_netif_phys_list);
+
+	c_net_veth_pool_free();
+	zygote_pool_free();
+	network_link_cache_free();
+
+	exporter_mem_leak_check();
 }
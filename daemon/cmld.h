@@ -70,6 +70,16 @@ cmld_init(const char *path);
 void
 cmld_cleanup(void);
 
+/**
+ * Prepares re-executing cmld without stopping the running containers, e.g., to
+ * update it. The runtime state is handed over to the next instance, which takes
+ * over the containers in cmld_init(). Afterwards, the caller has to exec cmld.
+ *
+ * @return 0 on success, -1 if cmld cannot be re-executed now
+ */
+int
+cmld_reexec_prepare(void);
+
 /**
  * Reloads all containers from storage path.
  *
@@ -79,7 +89,9 @@ int
 cmld_reload_containers(void);
 
 /**
- * Create a container by cloning from another one.
+ * Create a container by cloning from another one. The clone gets a new uuid but
+ * shares the (signed) config of its origin, its images are thin clones of those of
+ * the origin, which thus has to be stopped or frozen.
  *
  * @param container The container object to clone from.
  * @return The newly cloned container.
@@ -143,6 +155,27 @@ cmld_container_freeze(container_t *container);
 int
 cmld_container_unfreeze(container_t *container);
 
+/**
+ * Freezes all running containers at once, e.g., before suspending the device.
+ * The freezes are issued concurrently and on_all_frozen is called once after
+ * every container has either been frozen or its freeze has been aborted.
+ *
+ * @param on_all_frozen callback, which gets the number of containers which
+ * 	could not be frozen, may be called before this function returns
+ * @param data custom data passed to on_all_frozen
+ * @return 0 if the freezes have been issued
+ */
+int
+cmld_containers_freeze(void (*on_all_frozen)(unsigned int failed, void *data), void *data);
+
+/**
+ * Thaws all frozen or freezing containers.
+ *
+ * @return 0 on success, -1 if any container could not be thawed
+ */
+int
+cmld_containers_unfreeze(void);
+
 int
 cmld_container_allow_audio(container_t *container);
 
@@ -158,12 +191,24 @@ cmld_container_deny_audio(container_t *container);
 int
 cmld_container_snapshot(container_t *container);
 
+int
+cmld_container_checkpoint(container_t *container);
+
 int
 cmld_container_wipe(container_t *container);
 
 void
 cmld_wipe_device();
 
+/**
+ * Reboots the device once all containers are stopped. If a kexec kernel is configured,
+ * it is measured and booted directly, otherwise or if that fails, the device is reset.
+ *
+ * @return 0 if the containers are being stopped, -1 otherwise
+ */
+int
+cmld_reboot_device(void);
+
 container_t *
 cmld_container_get_by_uuid(const uuid_t *uuid);
 
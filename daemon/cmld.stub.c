@@ -159,6 +159,14 @@ cmld_container_snapshot(container_t *container)
 	return 0;
 }
 
+int
+cmld_container_checkpoint(container_t *container)
+{
+	dprintf(g_feedback_fd, "%s: %s", __func__, container_get_name(container));
+
+	return 0;
+}
+
 int
 cmld_container_wipe(container_t *container)
 {
@@ -173,6 +181,12 @@ cmld_wipe_device()
 	return;
 }
 
+int
+cmld_reboot_device(void)
+{
+	return 0;
+}
+
 container_t *
 cmld_container_get_by_uuid(uuid_t *uuid)
 {
@@ -0,0 +1,312 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "config_cache.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/file.h"
+#include "common/list.h"
+#include "common/hashmap.h"
+#include "common/event.h"
+#include "common/protobuf.h"
+
+#include <openssl/evp.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CONFIG_CACHE_MAGIC "CMLCFGC1"
+#define CONFIG_CACHE_MAGIC_LEN 8
+#define CONFIG_CACHE_SHA256_LEN 32
+// changes made while loading all configs at startup are written back at once
+#define CONFIG_CACHE_SYNC_DELAY 1000
+
+typedef struct config_cache_entry {
+	char *file;
+	char *type; // name of the message descriptor
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint8_t sha256[CONFIG_CACHE_SHA256_LEN];
+	uint8_t *msg; // the packed message
+	uint32_t msg_len;
+	bool used;
+} config_cache_entry_t;
+
+static char *config_cache_file = NULL;
+static hashmap_t *config_cache_map = NULL;
+static list_t *config_cache_list = NULL;
+static event_timer_t *config_cache_sync_timer = NULL;
+
+static void
+config_cache_entry_free(config_cache_entry_t *entry)
+{
+	IF_NULL_RETURN(entry);
+	mem_free0(entry->file);
+	mem_free0(entry->type);
+	mem_free0(entry->msg);
+	mem_free0(entry);
+}
+
+static void
+config_cache_entry_put(config_cache_entry_t *entry)
+{
+	config_cache_entry_t *old = hashmap_get_str(config_cache_map, entry->file);
+	if (old) {
+		config_cache_list = list_remove(config_cache_list, old);
+		config_cache_entry_free(old);
+	}
+	hashmap_put_str(config_cache_map, entry->file, entry);
+	config_cache_list = list_append(config_cache_list, entry);
+}
+
+/*
+ * The index consists of the magic followed by the entries. Each entry holds the
+ * config file name, the message type, size and modification time of the file as
+ * well as the sha256 of its content and finally the packed message. Strings and
+ * the packed message are prefixed by their length.
+ */
+static bool
+config_cache_read(const uint8_t **p, const uint8_t *end, void *dst, size_t len)
+{
+	if ((size_t)(end - *p) < len)
+		return false;
+	memcpy(dst, *p, len);
+	*p += len;
+	return true;
+}
+
+static char *
+config_cache_read_str_new(const uint8_t **p, const uint8_t *end)
+{
+	uint32_t len;
+	IF_FALSE_RETVAL(config_cache_read(p, end, &len, sizeof(len)), NULL);
+	IF_TRUE_RETVAL((size_t)(end - *p) < len, NULL);
+
+	char *str = mem_alloc(len + 1);
+	memcpy(str, *p, len);
+	str[len] = '\0';
+	*p += len;
+	return str;
+}
+
+static config_cache_entry_t *
+config_cache_entry_read_new(const uint8_t **p, const uint8_t *end)
+{
+	config_cache_entry_t *entry = mem_new0(config_cache_entry_t, 1);
+
+	entry->file = config_cache_read_str_new(p, end);
+	IF_NULL_GOTO(entry->file, err);
+	entry->type = config_cache_read_str_new(p, end);
+	IF_NULL_GOTO(entry->type, err);
+	IF_FALSE_GOTO(config_cache_read(p, end, &entry->size, sizeof(entry->size)), err);
+	IF_FALSE_GOTO(config_cache_read(p, end, &entry->mtime_sec, sizeof(entry->mtime_sec)), err);
+	IF_FALSE_GOTO(config_cache_read(p, end, &entry->mtime_nsec, sizeof(entry->mtime_nsec)),
+		      err);
+	IF_FALSE_GOTO(config_cache_read(p, end, entry->sha256, sizeof(entry->sha256)), err);
+	IF_FALSE_GOTO(config_cache_read(p, end, &entry->msg_len, sizeof(entry->msg_len)), err);
+	IF_TRUE_GOTO((size_t)(end - *p) < entry->msg_len, err);
+	entry->msg = mem_alloc(entry->msg_len);
+	IF_FALSE_GOTO(config_cache_read(p, end, entry->msg, entry->msg_len), err);
+
+	return entry;
+err:
+	config_cache_entry_free(entry);
+	return NULL;
+}
+
+static void
+config_cache_write_str(FILE *f, const char *str)
+{
+	uint32_t len = strlen(str);
+	fwrite(&len, sizeof(len), 1, f);
+	fwrite(str, 1, len, f);
+}
+
+static void
+config_cache_entry_write(FILE *f, const config_cache_entry_t *entry)
+{
+	config_cache_write_str(f, entry->file);
+	config_cache_write_str(f, entry->type);
+	fwrite(&entry->size, sizeof(entry->size), 1, f);
+	fwrite(&entry->mtime_sec, sizeof(entry->mtime_sec), 1, f);
+	fwrite(&entry->mtime_nsec, sizeof(entry->mtime_nsec), 1, f);
+	fwrite(entry->sha256, sizeof(entry->sha256), 1, f);
+	fwrite(&entry->msg_len, sizeof(entry->msg_len), 1, f);
+	fwrite(entry->msg, 1, entry->msg_len, f);
+}
+
+/*
+ * Writes all entries used since startup to the index, the others belong to
+ * configs which do not exist anymore.
+ */
+static void
+config_cache_sync(void)
+{
+	char *tmp_file = mem_printf("%s.tmp", config_cache_file);
+	FILE *f = fopen(tmp_file, "we");
+	if (!f) {
+		WARN_ERRNO("Could not open %s", tmp_file);
+		goto out;
+	}
+
+	fwrite(CONFIG_CACHE_MAGIC, 1, CONFIG_CACHE_MAGIC_LEN, f);
+	for (list_t *l = config_cache_list; l;) {
+		config_cache_entry_t *entry = l->data;
+		l = l->next;
+		if (entry->used) {
+			config_cache_entry_write(f, entry);
+		} else {
+			hashmap_remove_str(config_cache_map, entry->file);
+			config_cache_list = list_remove(config_cache_list, entry);
+			config_cache_entry_free(entry);
+		}
+	}
+
+	bool failed = ferror(f);
+	if (fclose(f) != 0 || failed || rename(tmp_file, config_cache_file) < 0) {
+		WARN_ERRNO("Could not write config cache %s", config_cache_file);
+		unlink(tmp_file);
+		goto out;
+	}
+	DEBUG("Wrote %zu entries to config cache %s", hashmap_size(config_cache_map),
+	      config_cache_file);
+out:
+	mem_free0(tmp_file);
+}
+
+static void
+config_cache_sync_cb(event_timer_t *timer, UNUSED void *data)
+{
+	event_timer_free(timer);
+	config_cache_sync_timer = NULL;
+
+	config_cache_sync();
+}
+
+static void
+config_cache_schedule_sync(void)
+{
+	IF_TRUE_RETURN(config_cache_sync_timer);
+
+	config_cache_sync_timer = event_timer_new(CONFIG_CACHE_SYNC_DELAY, 1,
+						  &config_cache_sync_cb, NULL);
+	event_add_timer(config_cache_sync_timer);
+}
+
+int
+config_cache_init(const char *file)
+{
+	ASSERT(file);
+	IF_TRUE_RETVAL(config_cache_file, -1);
+
+	config_cache_file = mem_strdup(file);
+	config_cache_map = hashmap_new();
+
+	IF_FALSE_RETVAL(file_exists(file), 0);
+
+	off_t len = file_size(file);
+	IF_TRUE_RETVAL(len < 0, -1);
+
+	uint8_t *buf = mem_alloc(len > 0 ? len : 1);
+	if (file_read(file, (char *)buf, len) < 0) {
+		WARN("Could not read config cache %s", file);
+		mem_free0(buf);
+		return -1;
+	}
+
+	const uint8_t *p = buf, *end = buf + len;
+	char magic[CONFIG_CACHE_MAGIC_LEN];
+	if (!config_cache_read(&p, end, magic, sizeof(magic)) ||
+	    memcmp(magic, CONFIG_CACHE_MAGIC, sizeof(magic))) {
+		WARN("Ignoring config cache %s with unknown format", file);
+		mem_free0(buf);
+		return 0;
+	}
+
+	while (p < end) {
+		config_cache_entry_t *entry = config_cache_entry_read_new(&p, end);
+		if (!entry) {
+			WARN("Ignoring truncated config cache %s", file);
+			break;
+		}
+		config_cache_entry_put(entry);
+	}
+	mem_free0(buf);
+
+	INFO("Loaded %zu entries from config cache %s", hashmap_size(config_cache_map), file);
+	return 0;
+}
+
+ProtobufCMessage *
+config_cache_message_new(const char *file, const uint8_t *buf, size_t len,
+			 const ProtobufCMessageDescriptor *descriptor)
+{
+	ASSERT(file);
+	ASSERT(buf);
+	ASSERT(descriptor);
+
+	ProtobufCMessage *msg = NULL;
+	struct stat st;
+
+	// configs provided as buffer are only stored to file afterwards
+	if (!config_cache_file || stat(file, &st) < 0 || (size_t)st.st_size != len)
+		return protobuf_message_new_from_buf(buf, len, descriptor);
+
+	uint8_t sha256[CONFIG_CACHE_SHA256_LEN];
+	if (!EVP_Digest(buf, len, sha256, NULL, EVP_sha256(), NULL))
+		return protobuf_message_new_from_buf(buf, len, descriptor);
+
+	config_cache_entry_t *entry = hashmap_get_str(config_cache_map, file);
+	if (entry && !strcmp(entry->type, descriptor->name) && entry->size == st.st_size &&
+	    entry->mtime_sec == st.st_mtim.tv_sec && entry->mtime_nsec == st.st_mtim.tv_nsec &&
+	    !memcmp(entry->sha256, sha256, sizeof(sha256))) {
+		msg = protobuf_unpack_message(descriptor, entry->msg, entry->msg_len);
+		if (msg) {
+			TRACE("Loaded %s from config cache", file);
+			entry->used = true;
+			return msg;
+		}
+		WARN("Could not unpack cached config %s", file);
+	}
+
+	msg = protobuf_message_new_from_buf(buf, len, descriptor);
+	IF_NULL_RETVAL(msg, NULL);
+
+	entry = mem_new0(config_cache_entry_t, 1);
+	entry->file = mem_strdup(file);
+	entry->type = mem_strdup(descriptor->name);
+	entry->size = st.st_size;
+	entry->mtime_sec = st.st_mtim.tv_sec;
+	entry->mtime_nsec = st.st_mtim.tv_nsec;
+	memcpy(entry->sha256, sha256, sizeof(sha256));
+	entry->msg_len = protobuf_pack_message_new(msg, &entry->msg);
+	entry->used = true;
+	config_cache_entry_put(entry);
+
+	config_cache_schedule_sync();
+	return msg;
+}
@@ -0,0 +1,70 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file config_cache.h
+ *
+ * Caches the text protobuf configs of containers and GuestOSes in binary form.
+ *
+ * Parsing the text format is by far the most expensive part of loading a config,
+ * so each parsed config is kept packed in a single index file and decoded from
+ * there on the next load. An entry is only used if size, modification time and
+ * sha256 of the config file still match the ones it was built from, otherwise the
+ * text is parsed again and the entry replaced. Signatures are verified on the
+ * config text by the callers as before; the cache never replaces verification.
+ */
+
+#ifndef CONFIG_CACHE_H
+#define CONFIG_CACHE_H
+
+#include <protobuf-c/protobuf-c.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Loads the cache index from the given file. Entries which are not used until
+ * the index is written again are dropped from it.
+ *
+ * @param file path of the index file
+ * @return 0 on success (also if there was no index yet), -1 on error
+ */
+int
+config_cache_init(const char *file);
+
+/**
+ * Returns the message stored in the text config file, preferably from the cache.
+ * The caller has already read the file into buf, e.g., to verify its signature.
+ * Changed entries are written back to the index shortly afterwards.
+ *
+ * @param file the config file buf was read from
+ * @param buf the content of the config file
+ * @param len the length of buf
+ * @param descriptor the descriptor of the message type
+ * @return the message which must be freed with protobuf_free_message(), NULL on error
+ */
+ProtobufCMessage *
+config_cache_message_new(const char *file, const uint8_t *buf, size_t len,
+			 const ProtobufCMessageDescriptor *descriptor);
+
+#endif /* CONFIG_CACHE_H */
@@ -35,9 +35,15 @@
 #include "common/sock.h"
 #include "common/event.h"
 #include "common/file.h"
+#include "common/file_writer.h"
 #include "common/dir.h"
+#include "common/dir_walk.h"
+#include "common/fd.h"
 #include "common/proc.h"
 #include "common/ns.h"
+#include "common/metrics.h"
+#include "common/probe.h"
+#include "common/str.h"
 
 #include "cmld.h"
 #include "c_user.h"
@@ -51,12 +57,14 @@
 #include "c_run.h"
 #include "c_run.h"
 #include "c_audit.h"
+#include "c_criu.h"
 #include "container_config.h"
 #include "guestos_mgr.h"
 #include "guestos.h"
 #include "hardware.h"
 #include "uevent.h"
 #include "audit.h"
+#include "zygote.h"
 
 #include <inttypes.h>
 #include <stdint.h>
@@ -66,9 +74,13 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
 #include <pty.h>
+#include <time.h>
 
 #define CLONE_STACK_SIZE 8192
 /* Define some missing clone flags in BIONIC */
@@ -97,12 +109,47 @@
 #define CONTAINER_START_TIMEOUT 800000
 /* Timeout until a container to be stopped gets killed if not yet down */
 #define CONTAINER_STOP_TIMEOUT 45000
+/*
+ * Once the latencies of previous stops are known, the timeout is twice the slowest
+ * of the last CONTAINER_STOP_LATENCIES stops plus a margin, but at least
+ * CONTAINER_STOP_TIMEOUT_MIN and at most CONTAINER_STOP_TIMEOUT.
+ */
+#define CONTAINER_STOP_TIMEOUT_MIN 5000
+#define CONTAINER_STOP_TIMEOUT_MARGIN 2000
+#define CONTAINER_STOP_LATENCIES 8
 
 #define TOKEN_IS_PAIRED_FILE_NAME "token_is_paired"
 
+/* directory of the root of a KVM container and HOME of its VMM with the ipc socket */
+#define CONTAINER_KVM_ROOT "/tmp/%s"
+#define CONTAINER_KVM_VMM_HOME CONTAINER_KVM_ROOT ".vmm"
+#define CONTAINER_KVM_VMM_NAME "vm"
+
+/*
+ * Start traces of the last starts, kept in a shared mapping so that the
+ * child processes of a container start can record their hooks as well.
+ */
+typedef struct container_start_traces {
+	unsigned count; // number of starts traced so far
+	container_start_trace_t traces[CONTAINER_START_TRACES];
+} container_start_traces_t;
+
+/*
+ * Runs the start hook of a submodule and records how long it took in the
+ * current start trace of the container.
+ */
+#define CONTAINER_TRACE_HOOK(container, hook, arg)                                                 \
+	__extension__({                                                                            \
+		uint64_t __begin = container_trace_now();                                          \
+		int __ret = hook(arg);                                                             \
+		container_trace_add(container, #hook, 0, __begin);                                 \
+		__ret;                                                                             \
+	})
+
 struct container {
 	container_state_t state;
 	container_state_t prev_state;
+	uint64_t status_generation; /* container_status_generation of the last status change */
 	uuid_t *uuid;
 	char *name;
 	container_type_t type;
@@ -132,6 +179,13 @@ struct container {
 
 	list_t *observer_list; /* list of function callbacks to be called when the state changes */
 	event_timer_t *stop_timer;  /* timer to handle container stop timeout */
+	uint64_t stop_begin;	    /* container_trace_now() of the pending stop, 0 if none */
+	uint64_t start_begin;	    /* container_trace_now() of the pending start, 0 if none */
+	unsigned int stop_timeout;  /* ms until the pending stop is forced by a kill */
+	/* ms of the last stops, oldest first */
+	unsigned int stop_latencies[CONTAINER_STOP_LATENCIES];
+	unsigned int stop_latencies_count;
+	bool stop_latencies_loaded;
 	event_timer_t *start_timer; /* timer to handle a container start timeout */
 
 	/* TODO maybe we should try to get rid of this state since it is only
@@ -151,6 +205,8 @@ struct container {
 	c_run_t *run;
 	c_audit_t *audit;
 	c_time_t *time;
+	c_criu_t *criu;
+	zygote_t *zygote; // namespaces taken from the pool for the current start
 	// Wifi module?
 
 	char *imei;
@@ -172,6 +228,21 @@ struct container {
 	container_token_config_t token;
 
 	bool usb_pin_entry;
+	uint32_t boot_priority;
+	uint32_t checkpoint_size; /* checkpoint image in MBytes, see c_criu.h */
+	unsigned int ram_soft_limit; /* RAM usage in MBytes above which the container is reclaimed */
+	unsigned int dedicated_cores; /* physical cores exclusively placed on, see placement.h */
+
+	char **activation_sockets; /* names of the sockets for socket activation, see activation.h */
+	size_t activation_sockets_len;
+	const int *activation_fds; /* listening sockets passed to init, owned by activation.c */
+	unsigned int idle_freeze_timeout; /* in seconds, see idle.h */
+	container_io_limits_t io_limits;
+	container_kvm_config_t kvm_config;
+	container_audit_policy_t audit_policy;
+
+	container_start_traces_t *start_traces;
+	pid_t cmld_pid; // to tell events of the child processes apart
 };
 
 struct container_callback {
@@ -196,6 +267,84 @@ enum container_start_sync_msg {
 	CONTAINER_START_SYNC_MSG_ERROR,
 };
 
+/* incremented on every status change of any container */
+static uint64_t container_status_generation = 0;
+
+/* time from starting a container until it is running, created on the first start */
+static metrics_t *container_metrics_start = NULL;
+
+static uint64_t
+container_trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Adds an event which began at begin and ends now to the current start trace.
+ * Hooks pass their name, state transitions pass NULL and the new state.
+ */
+static void
+container_trace_add(container_t *container, const char *name, container_state_t state,
+		    uint64_t begin)
+{
+	IF_NULL_RETURN(container->start_traces);
+	IF_TRUE_RETURN(container->start_traces->count == 0);
+
+	container_start_traces_t *st = container->start_traces;
+	container_start_trace_t *trace = &st->traces[(st->count - 1) % CONTAINER_START_TRACES];
+
+	// the parent and the child processes of a start may add events concurrently
+	unsigned i = __atomic_fetch_add(&trace->n, 1, __ATOMIC_RELAXED);
+	IF_TRUE_RETURN(i >= CONTAINER_START_TRACE_EVENTS);
+
+	container_trace_event_t *event = &trace->events[i];
+	event->name = name;
+	event->state = state;
+	event->child = getpid() != container->cmld_pid;
+	event->begin_ns = begin;
+	event->end_ns = container_trace_now();
+}
+
+static void
+container_trace_start(container_t *container)
+{
+	IF_NULL_RETURN(container->start_traces);
+
+	container_start_traces_t *st = container->start_traces;
+	container_start_trace_t *trace = &st->traces[st->count % CONTAINER_START_TRACES];
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	memset(trace, 0, sizeof(*trace));
+	trace->time = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	st->count++;
+}
+
+size_t
+container_get_start_traces(const container_t *container, container_start_trace_t **traces)
+{
+	ASSERT(container);
+	ASSERT(traces);
+
+	*traces = NULL;
+	IF_NULL_RETVAL(container->start_traces, 0);
+
+	const container_start_traces_t *st = container->start_traces;
+	size_t n = MIN(st->count, CONTAINER_START_TRACES);
+	IF_TRUE_RETVAL(n == 0, 0);
+
+	*traces = mem_new(container_start_trace_t, n);
+	for (size_t i = 0; i < n; i++) {
+		size_t slot = (st->count - n + i) % CONTAINER_START_TRACES;
+		(*traces)[i] = st->traces[slot];
+		(*traces)[i].n = MIN((*traces)[i].n, CONTAINER_START_TRACE_EVENTS);
+	}
+	return n;
+}
+
 void
 container_free_key(container_t *container)
 {
@@ -223,6 +372,7 @@ container_new_internal(const uuid_t *uuid, const char *name, container_type_t ty
 
 	container->state = CONTAINER_STATE_STOPPED;
 	container->prev_state = CONTAINER_STATE_STOPPED;
+	container->status_generation = ++container_status_generation;
 
 	container->uuid = uuid_new(uuid_string(uuid));
 	container->name = mem_strdup(name);
@@ -312,6 +462,14 @@ container_new_internal(const uuid_t *uuid, const char *name, container_type_t ty
 		goto error;
 	}
 
+	container->start_traces = mmap(NULL, sizeof(container_start_traces_t),
+				       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (container->start_traces == MAP_FAILED) {
+		WARN_ERRNO("Could not map start traces for container %s", container->name);
+		container->start_traces = NULL;
+	}
+	container->cmld_pid = getpid();
+
 	container->vol = c_vol_new(container);
 	if (!container->vol) {
 		WARN("Could not initialize volume subsystem for container %s (UUID: %s)",
@@ -354,6 +512,13 @@ container_new_internal(const uuid_t *uuid, const char *name, container_type_t ty
 		goto error;
 	}
 
+	container->criu = c_criu_new(container);
+	if (!container->criu) {
+		WARN("Could not initialize criu subsystem for container %s (UUID: %s)",
+		     container->name, uuid_string(container->uuid));
+		goto error;
+	}
+
 	// construct an argv buffer for execve
 	container->init_argv = guestos_get_init_argv_new(os);
 
@@ -400,6 +565,10 @@ container_new_internal(const uuid_t *uuid, const char *name, container_type_t ty
 
 	container->usb_pin_entry = usb_pin_entry;
 
+	// containers without a config pass all audit events
+	container->audit_policy.user_messages = true;
+	container->audit_policy.syscall_events = true;
+
 	return container;
 
 error:
@@ -561,8 +730,22 @@ container_new(const char *store_path, const uuid_t *existing_uuid, const uint8_t
 				       allow_autostart, dns_server, net_ifaces, allowed_devices,
 				       assigned_devices, vnet_cfg_list, usbdev_list, init_env,
 				       init_env_len, fifo_list, ttype, usb_pin_entry);
-	if (c)
+	if (c) {
+		c->boot_priority = container_config_get_boot_priority(conf);
+		c->checkpoint_size = container_config_get_checkpoint_size(conf);
+		c->ram_soft_limit = container_config_get_ram_soft_limit(conf);
+		c->dedicated_cores = container_config_get_dedicated_cores(conf);
+		c->idle_freeze_timeout = container_config_get_idle_freeze_timeout(conf);
+		container_config_get_io_limits(conf, &c->io_limits);
+		container_config_get_kvm_config(conf, &c->kvm_config);
+		container_config_get_audit_policy(conf, &c->audit_policy);
+		c->activation_sockets_len = container_config_get_activation_sockets_len(conf);
+		c->activation_sockets = mem_new0(char *, c->activation_sockets_len + 1);
+		char **activation_sockets = container_config_get_activation_sockets(conf);
+		for (size_t i = 0; i < c->activation_sockets_len; i++)
+			c->activation_sockets[i] = mem_strdup(activation_sockets[i]);
 		container_config_write(conf);
+	}
 
 	uuid_free(uuid);
 	mem_free0(images_dir);
@@ -619,6 +802,12 @@ container_free(container_t *container)
 		}
 		mem_free0(container->init_env);
 	}
+	if (container->activation_sockets) {
+		for (char **arg = container->activation_sockets; *arg; arg++) {
+			mem_free0(*arg);
+		}
+		mem_free0(container->activation_sockets);
+	}
 
 	if (container->mnt)
 		mount_free(container->mnt);
@@ -637,8 +826,12 @@ container_free(container_t *container)
 		c_run_free(container->run);
 	if (container->time)
 		c_time_free(container->time);
+	if (container->criu)
+		c_criu_free(container->criu);
 	if (container->service)
 		c_service_free(container->service);
+	if (container->fifo)
+		c_fifo_free(container->fifo);
 	if (container->imei)
 		mem_free0(container->imei);
 	if (container->mac_address)
@@ -663,6 +856,9 @@ container_free(container_t *container)
 
 	if (container->token.devpath)
 		mem_free0(container->token.devpath);
+
+	if (container->start_traces)
+		munmap(container->start_traces, sizeof(container_start_traces_t));
 	mem_free0(container);
 }
 
@@ -736,20 +932,25 @@ container_get_service_pid(const container_t *container)
 		return -1;
 	}
 
+	proc_table_t *table = proc_table_new();
+	IF_NULL_RETVAL(table, -1);
+
 	/* Determine PID of container's zygote */
-	pid_t zygote = proc_find(init, "main");
+	pid_t service = -1;
+	pid_t zygote = proc_table_find(table, init, "main");
 	if (zygote <= 0) {
 		DEBUG("Could not determine PID of container's zygote");
-		return -1;
+		goto out;
 	}
 
 	/* Determine PID of container's trustme service */
-	pid_t service = proc_find(zygote, "trustme.service");
+	service = proc_table_find(table, zygote, "trustme.service");
 	if (service <= 0) {
 		DEBUG("Could not determine PID of container's service");
-		return -1;
+		service = -1;
 	}
-
+out:
+	proc_table_free(table);
 	return service;
 }
 
@@ -787,6 +988,35 @@ container_add_pid_to_cgroups(const container_t *container, pid_t pid)
 	return c_cgroups_add_pid(container->cgroups, pid);
 }
 
+size_t
+container_get_stats(const container_t *container, uint64_t since,
+		    c_cgroups_stats_sample_t **samples)
+{
+	ASSERT(container);
+	return c_cgroups_get_stats(container->cgroups, since, samples);
+}
+
+int
+container_set_mem_background(container_t *container, bool background)
+{
+	ASSERT(container);
+	return c_cgroups_set_mem_background(container->cgroups, background);
+}
+
+int
+container_mem_reclaim(container_t *container, unsigned int percent)
+{
+	ASSERT(container);
+	return c_cgroups_mem_reclaim(container->cgroups, percent);
+}
+
+int
+container_set_cpuset(container_t *container, const char *cpus, const char *mems)
+{
+	ASSERT(container);
+	return c_cgroups_set_cpuset(container->cgroups, cpus, mems);
+}
+
 int
 container_set_cap_current_process(const container_t *container)
 {
@@ -795,10 +1025,10 @@ container_set_cap_current_process(const container_t *container)
 }
 
 int
-container_get_console_sock_cmld(const container_t *container, int session_fd)
+container_get_console_sock_cmld(const container_t *container, int session_fd, uint32_t channel)
 {
 	ASSERT(container);
-	return c_run_get_console_sock_cmld(container->run, session_fd);
+	return c_run_get_console_sock_cmld(container->run, session_fd, channel);
 }
 
 int
@@ -933,9 +1163,9 @@ container_audit_notify_complete(const container_t *container)
 }
 
 int
-container_audit_process_ack(const container_t *container, const char *ack)
+container_audit_process_ack(const container_t *container, const char *ack, uint32_t window)
 {
-	return audit_process_ack(container, ack);
+	return audit_process_ack(container, ack, window);
 }
 
 void
@@ -963,10 +1193,13 @@ container_audit_get_loginuid(const container_t *container)
 static void
 container_cleanup(container_t *container, bool is_rebooting)
 {
+	uevent_unregister_container(container);
 	c_cgroups_cleanup(container->cgroups);
 	c_service_cleanup(container->service);
 	c_run_cleanup(container->run);
 	c_time_cleanup(container->time);
+	c_fifo_cleanup(container->fifo);
+	c_criu_cleanup(container->criu);
 
 	/*
 	 * maintain some state concerning mounts and corresponding shifted uid
@@ -1000,118 +1233,289 @@ container_cleanup(container_t *container, bool is_rebooting)
 	container_set_state(container, state);
 }
 
-void
-container_sigchld_cb(UNUSED int signum, event_signal_t *sig, void *data)
+/*
+ * Handles the termination of the container's init process with the given wait status.
+ */
+static void
+container_init_exited(container_t *container, pid_t init_pid, int status)
 {
-	ASSERT(data);
+	bool rebooting = false;
+	if (status < 0) {
+		WARN("Init process of container %s was reaped elsewhere",
+		     container_get_description(container));
+	} else if (WIFEXITED(status)) {
+		INFO("Container %s terminated (init process exited with status=%d)",
+		     container_get_description(container), WEXITSTATUS(status));
+		container->exit_status = WEXITSTATUS(status);
+	} else if (WIFSIGNALED(status)) {
+		INFO("Container %s killed by signal %d", container_get_description(container),
+		     WTERMSIG(status));
+		/* Since Kernel 3.4 reboot inside pid namspaces
+		 * are signaled by SIGHUP (see manpage REBOOT(2)) */
+		if (WTERMSIG(status) == SIGHUP)
+			rebooting = true;
+	}
+	/* cleanup and set states accordingly to notify observers */
+	container_cleanup(container, rebooting);
+
+	audit_log_event(container_get_uuid(container), SSA, CMLD, CONTAINER_MGMT,
+			rebooting ? "reboot" : "stop", uuid_string(container_get_uuid(container)),
+			0);
 
+	/* In the start function the childs init process gets set a process group which has
+	 * the same pgid as its pid. Reap the remaining processes of this group which are
+	 * our children as well. */
+	pid_t pid;
+	while ((pid = waitpid(-init_pid, &status, WNOHANG)) > 0)
+		DEBUG("Reaped a child with PID %d for container %s", pid,
+		      container_get_description(container));
+	if (pid < 0 && errno != ECHILD)
+		WARN_ERRNO("waitpid failed for container %s", container_get_description(container));
+}
+
+static void
+container_child_cb(pid_t pid, int status, event_child_t *child, void *data)
+{
 	container_t *container = data;
+	ASSERT(container);
 
-	TRACE("SIGCHLD handler called for container %s with PID %d",
-	      container_get_description(container), container->pid);
+	TRACE("Init process of container %s with PID %d terminated",
+	      container_get_description(container), pid);
 
-	/* In the start function the childs init process gets set a process group which has
-	 * the same pgid as its pid. We wait for all processes belonging to our container's
-	 * process group, but only change the containers state to stopped if the init exited */
-	pid_t container_pid = container->pid;
-	pid_t pid = 0;
-	int status = 0;
-	while ((pid = waitpid(-(container_pid), &status, WNOHANG))) {
-		if (pid == container_pid) {
-			bool rebooting = false;
-			if (WIFEXITED(status)) {
-				INFO("Container %s terminated (init process exited with status=%d)",
-				     container_get_description(container), WEXITSTATUS(status));
-				container->exit_status = WEXITSTATUS(status);
-			} else if (WIFSIGNALED(status)) {
-				INFO("Container %s killed by signal %d",
-				     container_get_description(container), WTERMSIG(status));
-				/* Since Kernel 3.4 reboot inside pid namspaces
-				 * are signaled by SIGHUP (see manpage REBOOT(2)) */
-				if (WTERMSIG(status) == SIGHUP)
-					rebooting = true;
-			} else {
-				continue;
-			}
-			/* remove the sigchld callback for this container from the event loop */
-			event_remove_signal(sig);
-			event_signal_free(sig);
-			/* cleanup and set states accordingly to notify observers */
-			container_cleanup(container, rebooting);
-
-			audit_log_event(container_get_uuid(container), SSA, CMLD, CONTAINER_MGMT,
-					rebooting ? "reboot" : "stop",
-					uuid_string(container_get_uuid(container)), 0);
-		} else if (pid == -1) {
-			if (errno == ECHILD) {
-				DEBUG("Process group of container %s terminated completely",
-				      container_get_description(container));
-			} else {
-				audit_log_event(container_get_uuid(container), FSA, CMLD,
-						CONTAINER_MGMT, "container-observer-error",
-						uuid_string(container_get_uuid(container)), 0);
-				WARN_ERRNO("waitpid failed for container %s",
-					   container_get_description(container));
-			}
-			break;
-		} else {
-			DEBUG("Reaped a child with PID %d for container %s", pid,
-			      container_get_description(container));
-		}
-	}
+	event_child_free(child);
+	container_init_exited(container, pid, status);
+}
 
-	TRACE("No more childs to reap. Callback exiting...");
+/*
+ * Watches the init process of the container, which is cleaned up as soon as init
+ * exits. As nobody would notice that otherwise, the container is stopped right away
+ * if init cannot be watched.
+ */
+static int
+container_watch_init(container_t *container)
+{
+	pid_t pid = container->pid;
+
+	event_child_t *child = event_child_new(pid, container_child_cb, container);
+	if (event_add_child(child) == 0)
+		return 0;
+
+	event_child_free(child);
+	ERROR("Could not watch init process %d of container %s", pid,
+	      container_get_description(container));
+
+	int status = 0;
+	container_kill(container);
+	if (waitpid(pid, &status, 0) < 0)
+		status = -1;
+	container_init_exited(container, pid, status);
+	return -1;
 }
 
-void
-container_sigchld_early_cb(UNUSED int signum, event_signal_t *sig, void *data)
+static void
+container_early_child_cb(pid_t pid, int status, event_child_t *child, void *data)
 {
 	container_t *container = data;
 	ASSERT(container);
 
-	pid_t pid;
-	int status = 0;
+	TRACE("Reaped early container child process: %d", pid);
+	event_child_free(child);
 
-	TRACE("SIGCHLD handler called for container %s early start child with PID %d",
-	      container_get_description(container), container->pid);
-
-	if ((pid = waitpid(container->pid_early, &status, WNOHANG)) > 0) {
-		TRACE("Reaped early container child process: %d", pid);
-		/* remove the sigchld callback for this early child from the event loop */
-		event_remove_signal(sig);
-		event_signal_free(sig);
-		// cleanup if early child returned with an error
-		if ((WIFEXITED(status) && WEXITSTATUS(status)) || WIFSIGNALED(status)) {
-			container_set_state(container, CONTAINER_STATE_STOPPED);
-			container->pid_early = -1;
+	// cleanup if early child returned with an error
+	if (status >= 0 && ((WIFEXITED(status) && WEXITSTATUS(status)) || WIFSIGNALED(status)))
+		container_set_state(container, CONTAINER_STATE_STOPPED);
+	container->pid_early = -1;
+}
+
+
+#define CONTAINER_LISTEN_FDS_START 3
+
+/*
+ * Passes the listening sockets of socket activation to init as the file descriptors
+ * starting at 3, and returns the environment announcing them as in sd_listen_fds(3).
+ * Must be called in the child after all file descriptors were set to close on exec.
+ */
+static char **
+container_start_child_activation_env_new(container_t *container)
+{
+	size_t n = container->activation_fds ? container->activation_sockets_len : 0;
+	if (n == 0)
+		return container->init_env;
+
+	// move the sockets above the target range first, as both may overlap
+	int *fds = mem_new0(int, n);
+	for (size_t i = 0; i < n; i++) {
+		fds[i] = fcntl(container->activation_fds[i], F_DUPFD_CLOEXEC,
+			       (int)(CONTAINER_LISTEN_FDS_START + n));
+		if (fds[i] < 0) {
+			WARN_ERRNO("Could not pass activation socket %s",
+				   container->activation_sockets[i]);
+			mem_free0(fds);
+			return container->init_env;
 		}
 	}
+	// dup2() clears the close on exec flag of the new descriptors
+	for (size_t i = 0; i < n; i++) {
+		if (dup2(fds[i], CONTAINER_LISTEN_FDS_START + i) < 0) {
+			WARN_ERRNO("Could not pass activation socket %s",
+				   container->activation_sockets[i]);
+			mem_free0(fds);
+			return container->init_env;
+		}
+	}
+	mem_free0(fds);
+
+	size_t env_len = 0;
+	while (container->init_env[env_len])
+		env_len++;
+
+	str_t *names = str_new(container->activation_sockets[0]);
+	for (size_t i = 1; i < n; i++)
+		str_append_printf(names, ":%s", container->activation_sockets[i]);
+
+	// init has pid 1 in the pid namespace of the container
+	char **env = mem_new0(char *, env_len + 4);
+	memcpy(env, container->init_env, env_len * sizeof(char *));
+	env[env_len] = mem_printf("LISTEN_FDS=%zu", n);
+	env[env_len + 1] = mem_printf("LISTEN_PID=%d", getpid());
+	env[env_len + 2] = mem_printf("LISTEN_FDNAMES=%s", str_buffer(names));
+	str_free(names, true);
+
+	DEBUG("Passing %zu activation sockets to init", n);
+	return env;
 }
 
-static int
-container_close_all_fds_cb(UNUSED const char *path, const char *file, UNUSED void *data)
+/*
+ * Mounts a hugetlbfs for the guest memory of a KVM container next to its kvm_root,
+ * inside the mount namespace of the container.
+ *
+ * @return the mount point, NULL if huge pages are not available
+ */
+static char *
+container_kvm_hugetlbfs_new(const char *kvm_root)
 {
-	int fd = atoi(file);
+	char *path = mem_printf("%s.hugepages", kvm_root);
 
-	DEBUG("Closing file descriptor %d", fd);
+	if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+		WARN_ERRNO("Could not create %s", path);
+		goto err;
+	}
+	if (mount("hugetlbfs", path, "hugetlbfs", MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL) < 0) {
+		WARN_ERRNO("Could not mount hugetlbfs on %s", path);
+		goto err;
+	}
+	return path;
+err:
+	mem_free0(path);
+	return NULL;
+}
 
-	if (close(fd) < 0)
-		WARN_ERRNO("Could not close file descriptor %d", fd);
+/*
+ * Builds the command line of lkvm from the VMM options of the container.
+ */
+static char **
+container_kvm_argv_new(const container_t *container, const char *kvm_root, const char *hugetlbfs,
+		       unsigned int cpus)
+{
+	const container_kvm_config_t *kvm = &container->kvm_config;
+	char **argv = mem_new0(char *, 20);
+	int n = 0;
 
-	return 0;
+	argv[n++] = mem_strdup("/usr/bin/lkvm");
+	argv[n++] = mem_strdup("run");
+	argv[n++] = mem_strdup("-d");
+	argv[n++] = mem_strdup(kvm_root);
+	argv[n++] = mem_strdup("--name");
+	argv[n++] = mem_strdup(CONTAINER_KVM_VMM_NAME);
+	if (kvm->memory) {
+		argv[n++] = mem_strdup("-m");
+		argv[n++] = mem_printf("%u", kvm->memory);
+	}
+	if (cpus) {
+		argv[n++] = mem_strdup("-c");
+		argv[n++] = mem_printf("%u", cpus);
+	}
+	if (hugetlbfs) {
+		argv[n++] = mem_strdup("--hugetlbfs");
+		argv[n++] = mem_strdup(hugetlbfs);
+	}
+	if (kvm->vhost_net) {
+		argv[n++] = mem_strdup("-n");
+		argv[n++] = mem_strdup("mode=tap,vhost=1");
+	}
+	if (kvm->vsock_cid) {
+		argv[n++] = mem_strdup("--vsock");
+		argv[n++] = mem_printf("%u", kvm->vsock_cid);
+	}
+	if (kvm->balloon)
+		argv[n++] = mem_strdup("--balloon");
+	return argv;
 }
 
+typedef struct {
+	pid_t vmm_pid;
+	const cpu_set_t *cpus;
+	int n_cpus;
+	int pinned;
+} container_kvm_pin_t;
+
 static int
-container_close_all_fds()
+container_kvm_pin_vcpu_cb(UNUSED const char *path, const char *file, void *data)
 {
-	if (dir_foreach("/proc/self/fd", &container_close_all_fds_cb, NULL) < 0) {
-		WARN("Could not open /proc/self/fd directory, /proc not mounted?");
-		return -1;
+	container_kvm_pin_t *pin = data;
+	unsigned int vcpu;
+
+	char *comm_path = mem_printf("/proc/%d/task/%s/comm", pin->vmm_pid, file);
+	char *comm = file_read_new(comm_path, 32);
+	mem_free0(comm_path);
+
+	// kvmtool names its vCPU threads kvm-vcpu-<n>
+	if (!comm || sscanf(comm, "kvm-vcpu-%u", &vcpu) != 1) {
+		mem_free0(comm);
+		return 0;
+	}
+	mem_free0(comm);
+
+	// the n-th allowed cpu for vCPU n, wrapping around if there are more vCPUs
+	int nth = vcpu % pin->n_cpus;
+	int cpu = 0;
+	for (; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, pin->cpus) && nth-- == 0)
+			break;
 	}
 
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(atoi(file), sizeof(set), &set) < 0) {
+		WARN_ERRNO("Could not pin vCPU %u to cpu %d", vcpu, cpu);
+		return 0;
+	}
+	TRACE("Pinned vCPU %u to cpu %d", vcpu, cpu);
+	pin->pinned++;
 	return 0;
 }
 
+/*
+ * Pins each vCPU thread of the VMM to one of the cpus the container may use, so
+ * that the vCPUs neither migrate nor compete for the same cpu.
+ *
+ * @return the number of pinned vCPU threads
+ */
+static int
+container_kvm_pin_vcpus(pid_t vmm_pid, const cpu_set_t *cpus)
+{
+	container_kvm_pin_t pin = {
+		.vmm_pid = vmm_pid, .cpus = cpus, .n_cpus = CPU_COUNT(cpus), .pinned = 0
+	};
+	IF_TRUE_RETVAL(pin.n_cpus == 0, 0);
+
+	char *task_dir = mem_printf("/proc/%d/task", vmm_pid);
+	dir_foreach(task_dir, container_kvm_pin_vcpu_cb, &pin);
+	mem_free0(task_dir);
+	return pin.pinned;
+}
+
 static int
 container_start_child(void *data)
 {
@@ -1120,7 +1524,7 @@ container_start_child(void *data)
 	int ret = 0;
 
 	container_t *container = data;
-	char *kvm_root = mem_printf("/tmp/%s", uuid_string(container->uuid));
+	char *kvm_root = mem_printf(CONTAINER_KVM_ROOT, uuid_string(container->uuid));
 
 	/*******************************************************************/
 	// wait on synchronization socket for start message code from parent
@@ -1149,37 +1553,37 @@ container_start_child(void *data)
 		goto error;
 	}
 
-	if (c_user_start_child(container->user) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_user_start_child, container->user) < 0) {
 		ret = CONTAINER_ERROR_USER;
 		goto error;
 	}
 
-	if (c_net_start_child(container->net) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_net_start_child, container->net) < 0) {
 		ret = CONTAINER_ERROR_NET;
 		goto error;
 	}
 
-	if (c_cgroups_start_child(container->cgroups) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_cgroups_start_child, container->cgroups) < 0) {
 		ret = CONTAINER_ERROR_CGROUPS;
 		goto error;
 	}
 
-	if (c_vol_start_child(container->vol) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_vol_start_child, container->vol) < 0) {
 		ret = CONTAINER_ERROR_VOL;
 		goto error;
 	}
 
-	if (c_time_start_child(container->time) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_time_start_child, container->time) < 0) {
 		ret = CONTAINER_ERROR_TIME;
 		goto error;
 	}
 
-	if (c_service_start_child(container->service) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_service_start_child, container->service) < 0) {
 		ret = CONTAINER_ERROR_SERVICE;
 		goto error;
 	}
 
-	if (c_cap_start_child(container) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_cap_start_child, container) < 0) {
 		//ret = 1; // FIXME
 		goto error;
 	}
@@ -1218,12 +1622,13 @@ container_start_child(void *data)
 		return 0;
 	}
 
-	if (c_cgroups_start_pre_exec_child(container->cgroups) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_cgroups_start_pre_exec_child, container->cgroups) <
+	    0) {
 		ret = CONTAINER_ERROR_CGROUPS;
 		goto error;
 	}
 
-	if (c_time_start_pre_exec_child(container->time) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_time_start_pre_exec_child, container->time) < 0) {
 		ret = CONTAINER_ERROR_TIME;
 		goto error;
 	}
@@ -1241,6 +1646,19 @@ container_start_child(void *data)
 	}
 
 	if (container->type == CONTAINER_TYPE_KVM) {
+		const container_kvm_config_t *kvm = &container->kvm_config;
+		char *hugetlbfs = kvm->hugepages ? container_kvm_hugetlbfs_new(kvm_root) : NULL;
+
+		// the cpus of the container's cpuset, which the cgroups hook has applied
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0)
+			WARN_ERRNO("Could not get the cpus of kvm container %s",
+				   uuid_string(container->uuid));
+		unsigned int n_vcpus = kvm->cpus;
+		if (!n_vcpus && kvm->pin_vcpus)
+			n_vcpus = CPU_COUNT(&cpus);
+
 		int fd_master;
 		int pid = forkpty(&fd_master, NULL, NULL, NULL);
 
@@ -1249,36 +1667,56 @@ container_start_child(void *data)
 			goto error;
 		}
 		if (pid == 0) { // child
-			char *const argv[] = { "/usr/bin/lkvm", "run", "-d", kvm_root, NULL };
+			// lkvm creates its ipc socket in $HOME/.lkvm
+			char *home =
+				mem_printf(CONTAINER_KVM_VMM_HOME, uuid_string(container->uuid));
+			if ((mkdir(home, 0700) < 0 && errno != EEXIST) || setenv("HOME", home, 1))
+				WARN_ERRNO("Could not set up %s for the VMM", home);
+			char **argv = container_kvm_argv_new(container, kvm_root, hugetlbfs,
+							     n_vcpus);
 			execv(argv[0], argv);
 			WARN("Could not run exec for kvm container %s",
 			     uuid_string(container->uuid));
 		} else { // parent
 			char buffer[128];
 			ssize_t read_bytes;
+			// the vCPU threads exist once the guest starts writing to its console
+			int pinned = kvm->pin_vcpus ? 0 : (int)n_vcpus;
 			char *kvm_log =
 				mem_printf("%s.kvm.log", container_get_images_dir(container));
-			read_bytes = read(fd_master, buffer, 128);
-			file_write(kvm_log, buffer, read_bytes);
-			while ((read_bytes = read(fd_master, buffer, 128))) {
-				file_write_append(kvm_log, buffer, read_bytes);
+			// appended to in small chunks, so keep it open
+			int flags = O_WRONLY | O_CREAT | O_TRUNC | O_APPEND;
+			file_handle_t *kvm_log_file = file_handle_open(kvm_log, flags);
+			while (kvm_log_file && (read_bytes = read(fd_master, buffer, 128)) > 0) {
+				file_handle_pwrite(kvm_log_file, buffer, read_bytes, 0);
+				if (pinned < (int)n_vcpus)
+					pinned = container_kvm_pin_vcpus(pid, &cpus);
 			}
+			file_handle_close(kvm_log_file);
+			mem_free0(kvm_log);
 			return CONTAINER_ERROR;
 		}
 	}
 
+	/* all file descriptors are closed by execve, logging works until then */
 	if (container_get_state(container) != CONTAINER_STATE_SETUP) {
-		DEBUG("After closing all file descriptors no further debugging info can be printed");
-		if (container_close_all_fds()) {
+		if (fd_cloexec_all(0)) {
 			WARN("Closing all file descriptors failed, continuing anyway...");
 		}
 	}
 
+	// a checkpointed container is restored by criu instead of being booted by its init
+	if (c_criu_start_exec_child(container->criu) < 0)
+		goto error;
+
+	char **init_env = container_start_child_activation_env_new(container);
+
 	// if init provided by guestos does not exists use mapped c_service as init
 	const char *container_init = file_exists(guestos_get_init(container->os)) ?
 					     guestos_get_init(container->os) :
 					     CSERVICE_TARGET;
-	execve(container_init, container->init_argv, container->init_env);
+	container_trace_add(container, "execve", 0, container_trace_now());
+	execve(container_init, container->init_argv, init_env);
 
 	/* handle possibly empty rootfs in setup_mode */
 	if (container_get_state(container) == CONTAINER_STATE_SETUP) {
@@ -1306,7 +1744,7 @@ error:
 
 	// TODO call c_<module>_cleanup_child() hooks
 
-	if (container_close_all_fds()) {
+	if (fd_close_all(0)) {
 		WARN("Closing all file descriptors in container start error failed");
 	}
 	return ret; // exit the child process
@@ -1323,12 +1761,17 @@ container_start_child_early(void *data)
 
 	close(container->sync_sock_parent);
 
-	if (c_audit_start_child_early(container->audit) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_audit_start_child_early, container->audit) < 0) {
 		ret = CONTAINER_ERROR_AUDIT;
 		goto error;
 	}
 
-	if (c_vol_start_child_early(container->vol) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_vol_start_child_early, container->vol) < 0) {
+		ret = CONTAINER_ERROR_VOL;
+		goto error;
+	}
+
+	if (CONTAINER_TRACE_HOOK(container, c_criu_start_child_early, container->criu) < 0) {
 		ret = CONTAINER_ERROR_VOL;
 		goto error;
 	}
@@ -1358,6 +1801,13 @@ container_start_child_early(void *data)
 			ret = CONTAINER_ERROR_NET;
 			goto error;
 		}
+	} else if (container->zygote) {
+		// the zygote provides new userns, mntns, netns, utsns, ipcns and cgroupns
+		if (zygote_join(container->zygote) < 0) {
+			ret = CONTAINER_ERROR_USER;
+			goto error;
+		}
+		clone_flags &= ~(CLONE_NEWNS | CLONE_NEWUTS | CLONE_NEWIPC);
 	} else {
 		if (container->ns_usr)
 			clone_flags |= CLONE_NEWUSER;
@@ -1390,7 +1840,7 @@ error:
 		WARN_ERRNO("write to sync socket failed");
 	}
 
-	if (container_close_all_fds()) {
+	if (fd_close_all(0)) {
 		WARN("Closing all file descriptors in container start error failed");
 	}
 	return ret; // exit the child process
@@ -1452,22 +1902,22 @@ container_start_post_clone_cb(int fd, unsigned events, event_io_t *io, void *dat
 
 	/********************************************************/
 	/* on success call all c_<module>_start_pre_exec hooks */
-	if (c_time_start_pre_exec(container->time) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_time_start_pre_exec, container->time) < 0) {
 		WARN("c_time_start_pre_exec failed");
 		goto error_pre_exec;
 	}
 
-	if (c_cgroups_start_pre_exec(container->cgroups) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_cgroups_start_pre_exec, container->cgroups) < 0) {
 		WARN("c_cgroups_start_pre_exec failed");
 		goto error_pre_exec;
 	}
 	// during reboot c_vol state is not cleared, thus skip pre_exec here
-	if (c_vol_start_pre_exec(container->vol) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_vol_start_pre_exec, container->vol) < 0) {
 		WARN("c_vol_start_pre_exec failed");
 		goto error_pre_exec;
 	}
 
-	if (c_service_start_pre_exec(container->service) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_service_start_pre_exec, container->service) < 0) {
 		WARN("c_service_start_pre_exec failed");
 		goto error_pre_exec;
 	}
@@ -1490,7 +1940,7 @@ container_start_post_clone_cb(int fd, unsigned events, event_io_t *io, void *dat
 	}
 
 	/* Call all c_<module>_start_post_exec hooks */
-	if (c_time_start_post_exec(container->time) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_time_start_post_exec, container->time) < 0) {
 		WARN("c_time_start_post_exec failed");
 		goto error;
 	}
@@ -1521,7 +1971,7 @@ error:
 
 int
 container_run(container_t *container, int create_pty, char *cmd, ssize_t argc, char **argv,
-	      int session_fd)
+	      int session_fd, uint32_t channel)
 {
 	ASSERT(container);
 	ASSERT(cmd);
@@ -1538,14 +1988,8 @@ container_run(container_t *container, int create_pty, char *cmd, ssize_t argc, c
 	}
 
 	TRACE("Forwarding request to c_run subsystem");
-	return c_run_exec_process(container->run, create_pty, cmd, argc, argv, session_fd);
-}
-
-int
-container_write_exec_input(container_t *container, char *exec_input, int session_fd)
-{
-	TRACE("Forwarding write request to c_run subsystem");
-	return c_run_write_exec_input(container->run, exec_input, session_fd);
+	return c_run_exec_process(container->run, create_pty, cmd, argc, argv, session_fd,
+				  channel);
 }
 
 static void
@@ -1585,38 +2029,40 @@ container_start_post_clone_early_cb(int fd, unsigned events, event_io_t *io, voi
 	container->pid = atoi(pid_msg);
 	mem_free0(pid_msg);
 
+	/* register child event which sets the state and
+	 * calls the appropriate cleanup functions if the child
+	 * dies */
+	if (container_watch_init(container) < 0) {
+		close(fd);
+		return;
+	}
+
 	/*********************************************************/
 	/* REGISTER SOCKET TO RECEIVE STATUS MESSAGES FROM CHILD */
 	event_io_t *sync_sock_parent_event =
 		event_io_new(fd, EVENT_IO_READ, &container_start_post_clone_cb, container);
 	event_add_io(sync_sock_parent_event);
 
-	/* register SIGCHILD handler which sets the state and
-	 * calls the appropriate cleanup functions if the child
-	 * dies */
-	event_signal_t *sig = event_signal_new(SIGCHLD, container_sigchld_cb, container);
-	event_add_signal(sig);
-
 	/*********************************************************/
 	/* POST CLONE HOOKS */
 	// execute all necessary c_<module>_start_post_clone hooks
 	// goto error_post_clone on an error
-	if (c_cgroups_start_post_clone(container->cgroups)) {
+	if (CONTAINER_TRACE_HOOK(container, c_cgroups_start_post_clone, container->cgroups)) {
 		ret = CONTAINER_ERROR_CGROUPS;
 		goto error_post_clone;
 	}
 
-	if (c_net_start_post_clone(container->net)) {
+	if (CONTAINER_TRACE_HOOK(container, c_net_start_post_clone, container->net)) {
 		ret = CONTAINER_ERROR_NET;
 		goto error_post_clone;
 	}
 
-	if (c_user_start_post_clone(container->user)) {
+	if (CONTAINER_TRACE_HOOK(container, c_user_start_post_clone, container->user)) {
 		ret = CONTAINER_ERROR_USER;
 		goto error_post_clone;
 	}
 
-	if (c_fifo_start_post_clone(container->fifo)) {
+	if (CONTAINER_TRACE_HOOK(container, c_fifo_start_post_clone, container->fifo)) {
 		ret = CONTAINER_ERROR_FIFO;
 		goto error_post_clone;
 	}
@@ -1662,31 +2108,43 @@ container_start(container_t *container) //, const char *key)
 
 	int ret = 0;
 
+	if (!container_metrics_start)
+		container_metrics_start =
+			metrics_new(METRICS_HISTOGRAM, "cml_container_start_seconds", NULL,
+				    "Time from starting a container until it is running.");
+
+	container_trace_start(container);
+	container->start_begin = container_trace_now();
 	container_set_state(container, CONTAINER_STATE_STARTING);
 
 	/*********************************************************/
 	/* PRE CLONE HOOKS */
 
-	if (c_user_start_pre_clone(container->user) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_user_start_pre_clone, container->user) < 0) {
 		ret = CONTAINER_ERROR_USER;
 		goto error_pre_clone;
 	}
 
-	if (c_cgroups_start_pre_clone(container->cgroups) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_cgroups_start_pre_clone, container->cgroups) < 0) {
 		ret = CONTAINER_ERROR_CGROUPS;
 		goto error_pre_clone;
 	}
 
-	if (c_net_start_pre_clone(container->net) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_net_start_pre_clone, container->net) < 0) {
 		ret = CONTAINER_ERROR_NET;
 		goto error_pre_clone;
 	}
 
-	if (c_service_start_pre_clone(container->service) < 0) {
+	if (CONTAINER_TRACE_HOOK(container, c_service_start_pre_clone, container->service) < 0) {
 		ret = CONTAINER_ERROR_SERVICE;
 		goto error_pre_clone;
 	}
 
+	if (CONTAINER_TRACE_HOOK(container, c_vol_start_pre_clone, container->vol) < 0) {
+		ret = CONTAINER_ERROR_VOL;
+		goto error_pre_clone;
+	}
+
 	// Wifi module?
 
 	/*********************************************************/
@@ -1722,14 +2180,29 @@ container_start(container_t *container) //, const char *key)
 		INFO("Container in setup mode!");
 	}
 
+	// zygotes provide all of userns, netns and ipcns, c0 rejoins its namespaces on reboots
+	if (container->ns_usr && container->ns_net && container->ns_ipc &&
+	    cmld_containers_get_c0() != container)
+		container->zygote = zygote_pool_take(container->os);
+	if (container->zygote) {
+		DEBUG("Container %s takes a zygote", container_get_description(container));
+		c_cgroups_adopt(container->cgroups, zygote_get_cgroup(container->zygote));
+	}
+
 	/* TODO find out if stack is only necessary with CLONE_VM */
 	pid_t container_pid =
 		clone(container_start_child_early, container_stack_high, clone_flags, container);
+
+	// the early child holds the namespaces of the zygote by now
+	zygote_free(container->zygote);
+	container->zygote = NULL;
+
 	if (container_pid < 0) {
 		WARN_ERRNO("Clone container failed");
 		goto error_pre_clone;
 	}
 	container->pid = container_pid;
+	container->pid_early = container_pid;
 
 	/* close the childs end of the sync sockets */
 	close(container->sync_sock_child);
@@ -1742,10 +2215,11 @@ container_start(container_t *container) //, const char *key)
 	event_add_io(sync_sock_parent_event);
 
 	// handler for early start child process which dies after double fork
-	event_signal_t *sig = event_signal_new(SIGCHLD, container_sigchld_early_cb, container);
-	event_add_signal(sig);
+	event_child_t *child = event_child_new(container_pid, container_early_child_cb, container);
+	if (event_add_child(child) < 0)
+		event_child_free(child);
 
-	if (c_audit_start_post_clone_early(container->audit)) {
+	if (CONTAINER_TRACE_HOOK(container, c_audit_start_post_clone_early, container->audit)) {
 		ERROR("c_audit_start_post_clone");
 	}
 
@@ -1758,6 +2232,90 @@ error_pre_clone:
 	return ret;
 }
 
+char *
+container_reexec_state_new(container_t *container)
+{
+	ASSERT(container);
+
+	switch (container->state) {
+	case CONTAINER_STATE_RUNNING:
+	case CONTAINER_STATE_FROZEN:
+		break;
+	default:
+		return NULL;
+	}
+
+	int sock = -1, sock_connected = -1;
+	c_service_get_socks(container->service, &sock, &sock_connected);
+	if ((sock >= 0 && fd_keep_on_exec(sock)) ||
+	    (sock_connected >= 0 && fd_keep_on_exec(sock_connected)))
+		return NULL;
+
+	return mem_printf("%d %d %lld %d %d", container->pid, container->state,
+			  (long long)container_get_uptime(container), sock, sock_connected);
+}
+
+int
+container_reattach(container_t *container, const char *state)
+{
+	ASSERT(container);
+	ASSERT(state);
+
+	int pid, container_state, sock, sock_connected;
+	long long uptime;
+	if (sscanf(state, "%d %d %lld %d %d", &pid, &container_state, &uptime, &sock,
+		   &sock_connected) != 5 ||
+	    pid <= 0 ||
+	    (container_state != CONTAINER_STATE_RUNNING &&
+	     container_state != CONTAINER_STATE_FROZEN)) {
+		ERROR("Invalid runtime state '%s' of container %s", state,
+		      container_get_description(container));
+		return -1;
+	}
+
+	if (container->state != CONTAINER_STATE_STOPPED) {
+		ERROR("Container %s is already in use, cannot reattach it",
+		      container_get_description(container));
+		return -1;
+	}
+
+	// exec kept the pid, thus the init process is still our child
+	siginfo_t info = { 0 };
+	if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) < 0) {
+		ERROR_ERRNO("Init process %d of container %s is gone", pid,
+			    container_get_description(container));
+		return -1;
+	}
+
+	container->pid = pid;
+	c_time_reattach(container->time, uptime);
+
+	/* the container keeps running even if some state could not be restored */
+	if (c_user_reattach(container->user) < 0)
+		WARN("c_user_reattach failed for container %s",
+		     container_get_description(container));
+	if (c_cgroups_reattach(container->cgroups) < 0)
+		WARN("c_cgroups_reattach failed for container %s",
+		     container_get_description(container));
+	if (c_net_reattach(container->net) < 0)
+		WARN("c_net_reattach failed for container %s",
+		     container_get_description(container));
+	if (c_vol_reattach(container->vol) < 0)
+		WARN("c_vol_reattach failed for container %s",
+		     container_get_description(container));
+	if (c_service_reattach(container->service, sock, sock_connected) < 0)
+		WARN("c_service_reattach failed for container %s",
+		     container_get_description(container));
+
+	container_set_state(container, container_state);
+	INFO("Reattached container %s with pid %d", container_get_description(container), pid);
+	audit_log_event(container_get_uuid(container), SSA, CMLD, CONTAINER_MGMT, "reattach",
+			uuid_string(container_get_uuid(container)), 0);
+
+	// if init exited while nobody watched it, its child event triggers right away
+	return container_watch_init(container);
+}
+
 void
 container_kill(container_t *container)
 {
@@ -1777,6 +2335,77 @@ container_kill(container_t *container)
 	}
 }
 
+/* the latencies of previous stops are kept next to the container's .created file */
+static char *
+container_stop_latencies_file_new(const container_t *container)
+{
+	return mem_printf("%s.stop", container_get_images_dir(container));
+}
+
+static void
+container_stop_latencies_load(container_t *container)
+{
+	IF_TRUE_RETURN(container->stop_latencies_loaded);
+	container->stop_latencies_loaded = true;
+
+	char *file = container_stop_latencies_file_new(container);
+	char *buf = file_exists(file) ? file_read_new(file, 256) : NULL;
+	mem_free0(file);
+	IF_NULL_RETURN(buf);
+
+	char *saveptr = NULL;
+	for (char *line = strtok_r(buf, "\n", &saveptr);
+	     line && container->stop_latencies_count < CONTAINER_STOP_LATENCIES;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		unsigned int latency = strtoul(line, NULL, 10);
+		container->stop_latencies[container->stop_latencies_count++] = latency;
+	}
+	mem_free0(buf);
+}
+
+static void
+container_stop_latencies_add(container_t *container, unsigned int latency)
+{
+	container_stop_latencies_load(container);
+
+	if (container->stop_latencies_count == CONTAINER_STOP_LATENCIES) {
+		memmove(container->stop_latencies, container->stop_latencies + 1,
+			(CONTAINER_STOP_LATENCIES - 1) * sizeof(unsigned int));
+		container->stop_latencies_count--;
+	}
+	container->stop_latencies[container->stop_latencies_count++] = latency;
+
+	char buf[CONTAINER_STOP_LATENCIES * 12] = { 0 };
+	size_t len = 0;
+	for (unsigned int i = 0; i < container->stop_latencies_count; i++)
+		len += snprintf(buf + len, sizeof(buf) - len, "%u\n", container->stop_latencies[i]);
+
+	char *file = container_stop_latencies_file_new(container);
+	if (file_write(file, buf, len) < 0)
+		WARN("Could not store stop latencies of container %s in %s",
+		     container_get_description(container), file);
+	mem_free0(file);
+}
+
+/*
+ * Derives the stop timeout from the latencies of previous stops, so that containers
+ * which hang on shutdown are not waited for much longer than they ever needed.
+ */
+static unsigned int
+container_get_stop_timeout(container_t *container)
+{
+	container_stop_latencies_load(container);
+	IF_TRUE_RETVAL(container->stop_latencies_count == 0, CONTAINER_STOP_TIMEOUT);
+
+	unsigned int slowest = 0;
+	for (unsigned int i = 0; i < container->stop_latencies_count; i++)
+		slowest = MAX(slowest, container->stop_latencies[i]);
+
+	unsigned int timeout =
+		2 * MIN(slowest, CONTAINER_STOP_TIMEOUT) + CONTAINER_STOP_TIMEOUT_MARGIN;
+	return MAX(MIN(timeout, CONTAINER_STOP_TIMEOUT), CONTAINER_STOP_TIMEOUT_MIN);
+}
+
 /* This callback determines the container's state and forces its shutdown,
  * when a container could not be stopped in time*/
 static void
@@ -1785,8 +2414,13 @@ container_stop_timeout_cb(event_timer_t *timer, void *data)
 	ASSERT(data);
 
 	container_t *container = data;
-	DEBUG("Reached container stop timeout for container %s. Doing the kill now",
-	      container_get_description(container));
+	DEBUG("Reached container stop timeout of %u ms for container %s. Doing the kill now",
+	      container->stop_timeout, container_get_description(container));
+
+	/* a stop which had to be forced counts with the full timeout, which lets the
+	 * timeout grow again for containers slowing down */
+	container_stop_latencies_add(container, container->stop_timeout);
+	container->stop_begin = 0;
 
 	// kill container. sichld cb handles the cleanup and state change
 	container_kill(container);
@@ -1805,8 +2439,16 @@ container_stop(container_t *container)
 	int ret = 0;
 
 	/* register timer with callback doing the kill, if stop fails */
+	if (container->stop_timer) {
+		event_remove_timer(container->stop_timer);
+		event_timer_free(container->stop_timer);
+	}
+	container->stop_timeout = container_get_stop_timeout(container);
+	container->stop_begin = container_trace_now();
+	DEBUG("Stopping container %s, killing it after %u ms",
+	      container_get_description(container), container->stop_timeout);
 	event_timer_t *container_stop_timer =
-		event_timer_new(CONTAINER_STOP_TIMEOUT, 1, &container_stop_timeout_cb, container);
+		event_timer_new(container->stop_timeout, 1, &container_stop_timeout_cb, container);
 	event_add_timer(container_stop_timer);
 	container->stop_timer = container_stop_timer;
 
@@ -1942,45 +2584,251 @@ container_deny_audio(container_t *container)
 	return c_cgroups_devices_deny_audio(container->cgroups);
 }
 
+typedef struct container_snapshot {
+	container_t *container;
+	int fd; // snapshot directory
+	int ret;
+	bool freezing; // the freeze for the snapshot has started
+} container_snapshot_t;
+
+static int
+container_snapshot_image_cb(int dirfd, const char *path, const char *name,
+			    UNUSED unsigned char type, void *data)
+{
+	ASSERT(data);
+	container_snapshot_t *snap = data;
+
+	int len = strlen(name);
+	IF_FALSE_RETVAL(len >= 4 && !strcmp(name + len - 4, ".img"), 0);
+
+	int in_fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	int out_fd = -1;
+	if (in_fd >= 0)
+		out_fd = openat(snap->fd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (out_fd < 0 || file_reflink_fd(in_fd, out_fd) < 0) {
+		ERROR_ERRNO("Could not snapshot image %s/%s", path, name);
+		snap->ret = -1;
+	} else {
+		DEBUG("Snapshotted image of container %s: %s/%s",
+		      container_get_description(snap->container), path, name);
+	}
+
+	if (out_fd >= 0)
+		close(out_fd);
+	if (in_fd >= 0)
+		close(in_fd);
+	return snap->ret;
+}
+
+/*
+ * Reflinks all images of the container into the new directory
+ * <images_dir>.snapshot-<UTC time>. Data is never copied, so a running container is
+ * frozen only briefly; on filesystems without reflinks, e.g. ext4, the snapshot fails.
+ */
+static int
+container_snapshot_images(container_t *container)
+{
+	char stamp[32];
+	struct tm tm;
+	time_t now = time(NULL);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", gmtime_r(&now, &tm));
+
+	char *snap_dir = mem_printf("%s.snapshot-%s", container->images_dir, stamp);
+	container_snapshot_t snap = { .container = container, .fd = -1, .ret = 0 };
+	int ret = -1;
+
+	// flush the filesystems on the volumes to their image files
+	sync();
+
+	if (mkdir(snap_dir, 0700) < 0 ||
+	    (snap.fd = open(snap_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		ERROR_ERRNO("Could not create snapshot directory %s", snap_dir);
+		goto out;
+	}
+
+	ret = dir_foreach_at(AT_FDCWD, container->images_dir, &container_snapshot_image_cb, &snap);
+	close(snap.fd);
+	if (ret < 0 || snap.ret < 0) {
+		ERROR("Could not snapshot container %s", container_get_description(container));
+		if (dir_walk_delete(snap_dir, 0) < 0)
+			WARN("Could not remove incomplete snapshot %s", snap_dir);
+		ret = -1;
+		goto out;
+	}
+
+	INFO("Created snapshot %s of container %s", snap_dir,
+	     container_get_description(container));
+	ret = 0;
+out:
+	mem_free0(snap_dir);
+	return ret;
+}
+
+static void
+container_snapshot_cb(container_t *container, container_callback_t *cb, void *data)
+{
+	ASSERT(container);
+	ASSERT(data);
+	container_snapshot_t *snap = data;
+
+	switch (container_get_state(container)) {
+	case CONTAINER_STATE_FREEZING:
+		snap->freezing = true;
+		return;
+	case CONTAINER_STATE_RUNNING:
+		// not frozen yet or the freeze was aborted on timeout
+		IF_FALSE_RETURN(snap->freezing);
+		WARN("Freeze of container %s failed, no snapshot taken",
+		     container_get_description(container));
+		break;
+	case CONTAINER_STATE_FROZEN:
+		container_snapshot_images(container);
+		if (container_unfreeze(container) < 0)
+			ERROR("Could not thaw container %s after snapshot",
+			      container_get_description(container));
+		break;
+	default:
+		WARN("Container %s left running state, no snapshot taken",
+		     container_get_description(container));
+		break;
+	}
+
+	container_unregister_observer(container, cb);
+	mem_free0(snap);
+}
+
 int
 container_snapshot(container_t *container)
 {
 	ASSERT(container);
-	// TODO implement
+
+	switch (container_get_state(container)) {
+	case CONTAINER_STATE_STOPPED:
+	case CONTAINER_STATE_FROZEN:
+		// nothing writes to the images, snapshot right away
+		return container_snapshot_images(container);
+	case CONTAINER_STATE_RUNNING:
+		break;
+	default:
+		WARN("Container %s is neither running nor stopped, cannot snapshot",
+		     container_get_description(container));
+		return -1;
+	}
+
+	// freeze -> snapshot -> thaw, the snapshot is taken by the observer once frozen
+	container_snapshot_t *snap = mem_new0(container_snapshot_t, 1);
+	snap->container = container;
+	container_callback_t *cb =
+		container_register_observer(container, &container_snapshot_cb, snap);
+	if (!cb) {
+		mem_free0(snap);
+		return -1;
+	}
+	if (container_freeze(container) < 0) {
+		container_unregister_observer(container, cb);
+		mem_free0(snap);
+		return -1;
+	}
+	INFO("Freezing container %s for snapshot", container_get_description(container));
 	return 0;
 }
 
+int
+container_checkpoint(container_t *container)
+{
+	ASSERT(container);
+	return c_criu_checkpoint(container->criu);
+}
+
+int
+container_clone_images(container_t *container, const container_t *src)
+{
+	ASSERT(container);
+	ASSERT(src);
+
+	container_state_t state = container_get_state(src);
+	if (state != CONTAINER_STATE_STOPPED && state != CONTAINER_STATE_FROZEN) {
+		WARN("Container %s is neither stopped nor frozen, cannot clone its images",
+		     container_get_description(src));
+		return -1;
+	}
+
+	// flush the filesystems of a frozen source to its image files
+	if (state == CONTAINER_STATE_FROZEN)
+		sync();
+
+	return c_vol_clone_images(container->vol, src);
+}
+
+typedef struct container_wipe_trash {
+	container_t *container;
+	int fd;
+} container_wipe_trash_t;
+
 static int
-container_wipe_image_cb(const char *path, const char *name, UNUSED void *data)
+container_wipe_image_cb(int dirfd, const char *path, const char *name, UNUSED unsigned char type,
+			void *data)
 {
 	ASSERT(data);
-	container_t *container = data;
+	container_wipe_trash_t *trash = data;
 	/* Only do the rest of the callback if the file name ends with .img */
 	int len = strlen(name);
 	if (len >= 4 && !strcmp(name + len - 4, ".img")) {
-		char *image_path = mem_printf("%s/%s", path, name);
-		DEBUG("Deleting image of container %s: %s", container_get_description(container),
-		      image_path);
-		if (unlink(image_path) == -1) {
-			ERROR_ERRNO("Could not delete image %s", image_path);
+		DEBUG("Deleting image of container %s: %s/%s",
+		      container_get_description(trash->container), path, name);
+		// moving is cheap, the actual deletion of large images happens in the background
+		if ((trash->fd < 0 || renameat(dirfd, name, trash->fd, name) < 0) &&
+		    unlinkat(dirfd, name, 0) < 0) {
+			ERROR_ERRNO("Could not delete image %s/%s", path, name);
 		}
-		mem_free0(image_path);
 	}
 	return 0;
 }
 
+static void
+container_wipe_trash_done_cb(int ret, UNUSED const dir_walk_progress_t *progress, void *data)
+{
+	char *trash_dir = data;
+
+	if (ret < 0)
+		WARN("Could not delete all wiped images in %s", trash_dir);
+	mem_free0(trash_dir);
+}
+
 int
 container_wipe_finish(container_t *container)
 {
 	ASSERT(container);
 
+	/*
+	 * Move all images into a fresh trash dir next to the images dir, so that the
+	 * container can be started again while they are deleted on the worker pool.
+	 */
+	char *trash_dir = mem_printf("%s.wipe-XXXXXX", container->images_dir);
+	container_wipe_trash_t trash = { .container = container, .fd = -1 };
+	if (mkdtemp(trash_dir))
+		trash.fd = open(trash_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (trash.fd < 0)
+		WARN_ERRNO("Could not create %s, deleting images in place", trash_dir);
+
 	/* remove all images of the container */
-	if (dir_foreach(container->images_dir, &container_wipe_image_cb, container) < 0) {
+	int ret = 0;
+	if (dir_foreach_at(AT_FDCWD, container->images_dir, &container_wipe_image_cb, &trash) < 0) {
 		WARN("Could not open %s images path for wiping container",
 		     container_get_description(container));
-		return -1;
+		ret = -1;
 	}
-	return 0;
+
+	if (trash.fd < 0) {
+		mem_free0(trash_dir);
+		return ret;
+	}
+	close(trash.fd);
+
+	if (dir_walk_delete_async(trash_dir, NULL, &container_wipe_trash_done_cb, trash_dir) < 0)
+		container_wipe_trash_done_cb(dir_walk_delete(trash_dir, 0), NULL, trash_dir);
+
+	return ret;
 }
 
 static void
@@ -2062,6 +2910,12 @@ container_destroy(container_t *container)
 	unlink(path);
 	mem_free0(path);
 
+	path = container_stop_latencies_file_new(container);
+	unlink(path);
+	mem_free0(path);
+
+	// a pending update must not recreate the config
+	file_writer_discard(container_get_config_filename(container));
 	if ((ret = unlink(container_get_config_filename(container))))
 		ERROR_ERRNO("Can't delete config file!");
 	return ret;
@@ -2114,7 +2968,24 @@ container_set_state(container_t *container, container_state_t state)
 	container->prev_state = container->state;
 
 	DEBUG("Setting container state: %d", state);
+	PROBE3(container_state, container->name, container->prev_state, state);
 	container->state = state;
+	container->status_generation = ++container_status_generation;
+
+	if (state == CONTAINER_STATE_STOPPED && container->stop_begin) {
+		container_stop_latencies_add(container, (container_trace_now() -
+							 container->stop_begin) / 1000000);
+		container->stop_begin = 0;
+	}
+	if (container->start_begin &&
+	    (state == CONTAINER_STATE_RUNNING || state == CONTAINER_STATE_STOPPED)) {
+		// failed starts are not accounted
+		if (state == CONTAINER_STATE_RUNNING)
+			metrics_observe(container_metrics_start,
+					container_trace_now() - container->start_begin);
+		container->start_begin = 0;
+	}
+	container_trace_add(container, NULL, state, container_trace_now());
 
 	container_notify_observers(container);
 }
@@ -2133,6 +3004,19 @@ container_get_prev_state(const container_t *container)
 	return container->prev_state;
 }
 
+uint64_t
+container_get_status_generation(const container_t *container)
+{
+	ASSERT(container);
+	return container->status_generation;
+}
+
+uint64_t
+container_get_current_status_generation(void)
+{
+	return container_status_generation;
+}
+
 container_type_t
 container_get_type(const container_t *container)
 {
@@ -2226,6 +3110,82 @@ container_set_ram_limit(container_t *container, unsigned int ram_limit)
 	return c_cgroups_set_ram_limit(container->cgroups);
 }
 
+uint32_t
+container_get_checkpoint_size(const container_t *container)
+{
+	ASSERT(container);
+	return container->checkpoint_size;
+}
+
+unsigned int
+container_get_ram_soft_limit(const container_t *container)
+{
+	ASSERT(container);
+	return container->ram_soft_limit;
+}
+
+unsigned int
+container_get_dedicated_cores(const container_t *container)
+{
+	ASSERT(container);
+	return container->dedicated_cores;
+}
+
+const container_io_limits_t *
+container_get_io_limits(const container_t *container)
+{
+	ASSERT(container);
+	return &container->io_limits;
+}
+
+const container_kvm_config_t *
+container_get_kvm_config(const container_t *container)
+{
+	ASSERT(container);
+	return &container->kvm_config;
+}
+
+const container_audit_policy_t *
+container_get_audit_policy(const container_t *container)
+{
+	ASSERT(container);
+	return &container->audit_policy;
+}
+
+char *
+container_get_kvm_ipc_path_new(const container_t *container)
+{
+	ASSERT(container);
+	IF_TRUE_RETVAL(container->type != CONTAINER_TYPE_KVM || container->pid <= 0, NULL);
+
+	// through the root of the container, as the VMM runs in its mount namespace
+	return mem_printf("/proc/%d/root" CONTAINER_KVM_VMM_HOME "/.lkvm/%s.sock", container->pid,
+			  uuid_string(container->uuid), CONTAINER_KVM_VMM_NAME);
+}
+
+unsigned int
+container_get_idle_freeze_timeout(const container_t *container)
+{
+	ASSERT(container);
+	return container->idle_freeze_timeout;
+}
+
+char **
+container_get_activation_sockets(const container_t *container, size_t *len)
+{
+	ASSERT(container);
+	ASSERT(len);
+	*len = container->activation_sockets_len;
+	return container->activation_sockets;
+}
+
+void
+container_set_activation_fds(container_t *container, const int *fds)
+{
+	ASSERT(container);
+	container->activation_fds = fds;
+}
+
 void
 container_set_imei(container_t *container, char *imei)
 {
@@ -2452,6 +3412,7 @@ container_vnet_cfg_new(const char *if_name, const char *rootns_name, const uint8
 	memcpy(vnet_cfg->vnet_mac, mac, 6);
 	vnet_cfg->rootns_name = rootns_name ? mem_strdup(rootns_name) : NULL;
 	vnet_cfg->configure = configure;
+	vnet_cfg->qos = (container_net_qos_t){ .dscp = -1 };
 	return vnet_cfg;
 }
 
@@ -2679,3 +3640,10 @@ container_get_usb_pin_entry(const container_t *container)
 	ASSERT(container);
 	return container->usb_pin_entry;
 }
+
+uint32_t
+container_get_boot_priority(const container_t *container)
+{
+	ASSERT(container);
+	return container->boot_priority;
+}
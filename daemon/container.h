@@ -84,6 +84,22 @@ typedef enum {
 	CONTAINER_TOKEN_TYPE_USB,
 } container_token_type_t;
 
+typedef enum {
+	CONTAINER_NET_PRIO_BEST_EFFORT = 0,
+	CONTAINER_NET_PRIO_BULK,
+	CONTAINER_NET_PRIO_INTERACTIVE,
+} container_net_prio_t;
+
+/**
+ * Bandwidth limits and prioritization of the traffic of a virtual network interface.
+ */
+typedef struct container_net_qos {
+	uint64_t download_rate;	   //!< bytes/s towards the container, 0 for unlimited
+	uint64_t upload_rate;	   //!< bytes/s from the container, 0 for unlimited
+	container_net_prio_t prio; //!< priority class of the traffic from the container
+	int dscp;		   //!< DSCP of the traffic from the container, -1 for default
+} container_net_qos_t;
+
 /**
  * Structure to define the configuration for a virtual network
  * interface in a container. It defines the name and if cmld
@@ -94,6 +110,7 @@ typedef struct container_vnet_cfg {
 	char *rootns_name;
 	uint8_t vnet_mac[6];
 	bool configure;
+	container_net_qos_t qos;
 } container_vnet_cfg_t;
 
 /**
@@ -126,6 +143,40 @@ typedef struct container_token_config {
 	char *devpath;
 } container_token_config_t;
 
+/**
+ * Block io limits of a container, 0 for none in each field, see c_cgroups.
+ */
+typedef struct container_io_limits {
+	uint32_t weight;	 // relative share of disk time, 1 - 10000
+	uint64_t read_bps;	 // bytes per second
+	uint64_t write_bps;	 // bytes per second
+	uint32_t read_iops;	 // operations per second
+	uint32_t write_iops;	 // operations per second
+	uint32_t latency_target; // microseconds, cgroup v2 only
+} container_io_limits_t;
+
+/**
+ * Options of the VMM of a KVM container, 0 or false for the defaults.
+ */
+typedef struct container_kvm_config {
+	uint32_t memory;	// MiB of guest memory
+	uint32_t cpus;		// number of vCPUs
+	bool hugepages;		// guest memory on a hugetlbfs private to the container
+	uint64_t hugetlb_limit; // bytes of huge pages, see c_cgroups
+	bool pin_vcpus;		// pin each vCPU thread to one cpu of the container's cpuset
+	bool vhost_net;		// virtio-net through tap and vhost-net
+	uint32_t vsock_cid;	// guest cid of virtio-vsock through vhost-vsock
+	bool balloon;		// virtio-balloon controlled by cmld, see balloon.h
+} container_kvm_config_t;
+
+/**
+ * Kernel audit events of the container which are passed to cmld, see audit_rules.h.
+ */
+typedef struct container_audit_policy {
+	bool user_messages;  // audit messages of user space, except of trusted apps
+	bool syscall_events; // syscall audit records
+} container_audit_policy_t;
+
 /**
  * Represents the current container state.
  */
@@ -291,6 +342,75 @@ container_oom_protect_service(const container_t *container);
 int
 container_add_pid_to_cgroups(const container_t *container, pid_t pid);
 
+struct c_cgroups_stats_sample;
+
+/**
+ * Returns the resource usage samples of the container taken after since (ms
+ * since the epoch), oldest first, see c_cgroups_get_stats().
+ */
+size_t
+container_get_stats(const container_t *container, uint64_t since,
+		    struct c_cgroups_stats_sample **samples);
+
+/**
+ * Marks the container as background for memory management, see
+ * c_cgroups_set_mem_background().
+ */
+int
+container_set_mem_background(container_t *container, bool background);
+
+/**
+ * Proactively reclaims a share of the memory of the container, see c_cgroups_mem_reclaim().
+ */
+int
+container_mem_reclaim(container_t *container, unsigned int percent);
+
+/**
+ * Moves the running container to the given cpus and memory nodes, see
+ * c_cgroups_set_cpuset().
+ */
+int
+container_set_cpuset(container_t *container, const char *cpus, const char *mems);
+
+/**
+ * Number of container starts for which a start trace is kept.
+ */
+#define CONTAINER_START_TRACES 4
+
+/**
+ * Maximum number of hooks and state transitions recorded per start.
+ */
+#define CONTAINER_START_TRACE_EVENTS 64
+
+/**
+ * One event of a start trace. Start hooks are recorded with their name and the
+ * CLOCK_MONOTONIC times they ran, state transitions with a NULL name, the new
+ * state and begin_ns equal to end_ns.
+ */
+typedef struct container_trace_event {
+	const char *name;
+	container_state_t state;
+	bool child; // recorded by one of the container's child processes
+	uint64_t begin_ns;
+	uint64_t end_ns;
+} container_trace_event_t;
+
+typedef struct container_start_trace {
+	uint64_t time; // start time in ms since the epoch
+	unsigned n;    // number of events, later ones are dropped
+	container_trace_event_t events[CONTAINER_START_TRACE_EVENTS];
+} container_start_trace_t;
+
+/**
+ * Returns copies of the start traces of the last CONTAINER_START_TRACES starts of the
+ * container, oldest first. The traces are allocated and must be freed by the caller.
+ * A trace keeps collecting state transitions until the next start, e.g., the
+ * transition to CONTAINER_STATE_RUNNING or back to CONTAINER_STATE_STOPPED.
+ * @return The number of traces.
+ */
+size_t
+container_get_start_traces(const container_t *container, container_start_trace_t **traces);
+
 /*
  * Set capapilites for calling process as for given container's init
  */
@@ -324,10 +444,11 @@ container_get_color_rgb_string(const container_t *container);
 
 /**
  * Get socket fd used to communicate with process executed in container context
- * by using the control run interface
+ * by using the control run interface. Sessions are identified by the control
+ * connection and the exec channel on it (0 if the connection is not multiplexed).
  */
 int
-container_get_console_sock_cmld(const container_t *container, int session_fd);
+container_get_console_sock_cmld(const container_t *container, int session_fd, uint32_t channel);
 
 /**
  * Remove a container persistently from disk, i.e. remove its configuration and
@@ -390,10 +511,7 @@ container_resume(container_t *container);
  */
 int
 container_run(container_t *container, int create_pty, char *cmd, ssize_t argc, char **argv,
-	      int session_fd);
-
-int
-container_write_exec_input(container_t *container, char *exec_input, int session_fd);
+	      int session_fd, uint32_t channel);
 
 /**
  * Start the given container using the given key to decrypt its filesystem
@@ -416,6 +534,26 @@ container_write_exec_input(container_t *container, char *exec_input, int session
 int
 container_start(container_t *container); //, const char *key);
 
+/**
+ * Describes the runtime state of a running or frozen container in a single line, which
+ * a re-executed cmld passes to container_reattach(), and keeps the fds the line refers
+ * to open across the exec.
+ *
+ * @return The newly allocated line, NULL if the container cannot be handed over.
+ */
+char *
+container_reexec_state_new(container_t *container);
+
+/**
+ * Takes over a container which was started by the previous cmld instance before
+ * it re-executed itself. Command sessions and fifo forwards are not handed over.
+ *
+ * @param state The line returned by container_reexec_state_new() in that instance.
+ * @return 0 on success, -1 if the container could not be taken over.
+ */
+int
+container_reattach(container_t *container, const char *state);
+
 /**
  * Gracefully terminate the execution of a container. Gives the container the
  * chance to do a normal shutdown. May take some time to complete and sets the
@@ -507,11 +645,35 @@ int
 container_deny_audio(container_t *container);
 
 /**
- * TODO Document 'snapshot' function.
+ * Takes a copy-on-write snapshot of all images of the container into the directory
+ * <images_dir>.snapshot-<UTC time>. A running container is frozen, snapshotted and
+ * thawed again asynchronously; a stopped or frozen one is snapshotted right away.
+ * Requires a filesystem with reflink support, e.g. btrfs or xfs, for the images.
+ *
+ * @return 0 if the snapshot was taken or started, -1 on error.
  */
 int
 container_snapshot(container_t *container);
 
+/**
+ * Checkpoints the processes of the running container with CRIU to its encrypted
+ * checkpoint image and stops it, so that its next start restores them, see c_criu.h.
+ * Requires a checkpoint_size in the container config.
+ *
+ * @return 0 if the checkpoint was started, -1 on error.
+ */
+int
+container_checkpoint(container_t *container);
+
+/**
+ * Populates the images directory of a freshly created container with thin clones
+ * (reflinks where possible) of the images of the stopped or frozen container src.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+container_clone_images(container_t *container, const container_t *src);
+
 /**
  * Update the state of the container and notify observers.
  *
@@ -533,6 +695,21 @@ container_get_state(const container_t *container);
 container_state_t
 container_get_prev_state(const container_t *container);
 
+/**
+ * Returns the status generation of the last status change (creation or state
+ * change) of the container. Generations are shared by all containers and increase
+ * with every change, thus a client can ask for the changes since the generation
+ * returned by container_get_current_status_generation() at some earlier time.
+ */
+uint64_t
+container_get_status_generation(const container_t *container);
+
+/**
+ * Returns the generation of the latest status change of any container.
+ */
+uint64_t
+container_get_current_status_generation(void);
+
 /**
  * Returns the the type of the container.
  */
@@ -572,6 +749,76 @@ container_get_ram_limit(const container_t *container);
 int
 container_set_ram_limit(container_t *container, unsigned int ram_limit);
 
+/**
+ * Returns the size of the checkpoint image of the container in MBytes, 0 if
+ * checkpoints are disabled.
+ */
+uint32_t
+container_get_checkpoint_size(const container_t *container);
+
+/**
+ * Returns the RAM usage in MBytes above which the container is throttled and
+ * reclaimed first, 0 if not configured.
+ */
+unsigned int
+container_get_ram_soft_limit(const container_t *container);
+
+/**
+ * Returns the number of physical cores dedicated to the container while it runs,
+ * 0 if it shares the cpus with other containers.
+ */
+unsigned int
+container_get_dedicated_cores(const container_t *container);
+
+/**
+ * Returns the block io limits of the container.
+ */
+const container_io_limits_t *
+container_get_io_limits(const container_t *container);
+
+/**
+ * Returns the VMM options of a KVM container.
+ */
+const container_kvm_config_t *
+container_get_kvm_config(const container_t *container);
+
+/**
+ * Returns the kernel audit events of the container which are passed to cmld.
+ */
+const container_audit_policy_t *
+container_get_audit_policy(const container_t *container);
+
+/**
+ * Returns the path of the control socket of the VMM of a running KVM container,
+ * reachable from cmld's mount namespace.
+ */
+char *
+container_get_kvm_ipc_path_new(const container_t *container);
+
+/**
+ * Returns the seconds without activity after which the running container is frozen
+ * by the idle policy, 0 if never.
+ */
+unsigned int
+container_get_idle_freeze_timeout(const container_t *container);
+
+/**
+ * Returns the NULL terminated names of the sockets on which the container is started
+ * on demand, see activation.h.
+ *
+ * @param len returns the number of names, 0 if the container is not started on demand
+ */
+char **
+container_get_activation_sockets(const container_t *container, size_t *len);
+
+/**
+ * Sets the listening sockets, one per name of container_get_activation_sockets(),
+ * which are passed to init on the next starts. The array is owned by the caller and
+ * must stay valid until it is reset to NULL.
+ */
+void
+container_set_activation_fds(container_t *container, const int *fds);
+
 const char *
 container_get_cpus_allowed(const container_t *container);
 
@@ -860,6 +1107,12 @@ container_exec_cap_systime(const container_t *container, char *const *argv);
 bool
 container_get_usb_pin_entry(const container_t *container);
 
+/**
+ * Returns the priority of the container for autostarts, higher ones start first.
+ */
+uint32_t
+container_get_boot_priority(const container_t *container);
+
 /**
  * Send audit record to container
  */
@@ -904,10 +1157,11 @@ int
 container_audit_record_send(const container_t *container, const uint8_t *buf, uint32_t buflen);
 
 /**
- * Process audit record ACK received from a container
+ * Process audit record ACK received from a container. window is the number of
+ * records the container accepts per delivered message.
  */
 int
-container_audit_process_ack(const container_t *container, const char *ack);
+container_audit_process_ack(const container_t *container, const char *ack, uint32_t window);
 
 int
 container_audit_notify_complete(const container_t *container);
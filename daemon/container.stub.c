@@ -38,6 +38,8 @@ struct container {
 	char *imei;
 	char *mac_address;
 	char *phone_number;
+	const mount_t *mnt;
+	bool ns_usr;
 };
 
 container_t *
@@ -124,3 +126,25 @@ container_get_phone_number(container_t *container)
 	ASSERT(container);
 	return container->phone_number;
 }
+
+void
+container_stub_set_mount(container_t *container, const mount_t *mnt, bool ns_usr)
+{
+	ASSERT(container);
+	container->mnt = mnt;
+	container->ns_usr = ns_usr;
+}
+
+const mount_t *
+container_get_mount(const container_t *container)
+{
+	ASSERT(container);
+	return container->mnt;
+}
+
+bool
+container_has_userns(const container_t *container)
+{
+	ASSERT(container);
+	return container->ns_usr;
+}
@@ -77,4 +77,16 @@ container_set_radio_dns(container_t *container, char *dns);
 void
 container_set_radio_gateway(container_t *container, char *gateway);
 
+/**
+ * Sets the mount table and whether the dummy container stub has a user namespace.
+ */
+void
+container_stub_set_mount(container_t *container, const mount_t *mnt, bool ns_usr);
+
+const mount_t *
+container_get_mount(const container_t *container);
+
+bool
+container_has_userns(const container_t *container);
+
 #endif // CONTAINER_STUB_H
@@ -30,6 +30,7 @@
 #include "common/macro.h"
 #include "common/mem.h"
 #include "common/file.h"
+#include "common/file_writer.h"
 #include "common/list.h"
 #include "common/protobuf.h"
 
@@ -43,6 +44,7 @@
 #include "network.h"
 #include "uevent.h"
 #include "smartcard.h"
+#include "config_cache.h"
 
 struct container_config {
 	char *file;
@@ -51,6 +53,9 @@ struct container_config {
 
 #define C_CONFIG_VERIFY_HASH_ALGO SHA512
 
+// results of asynchronous verifications kept for container_config_new()
+#define C_CONFIG_VERIFIED_MAX 8
+
 #define C_CONFIG_MAX_RAM_LIMIT (1 << 30) // TODO 1GB? (< 4GB due to uint32)
 #define C_CONFIG_MAX_STORAGE (4LL << 30) // TODO 4GB?
 
@@ -103,8 +108,122 @@ container_config_proto_to_usb_type(ContainerUsbType type)
 	}
 }
 
+static container_net_prio_t
+container_config_proto_to_net_prio(ContainerNetPriority prio)
+{
+	switch (prio) {
+	case CONTAINER_NET_PRIORITY__NET_PRIO_BULK:
+		return CONTAINER_NET_PRIO_BULK;
+	case CONTAINER_NET_PRIORITY__NET_PRIO_INTERACTIVE:
+		return CONTAINER_NET_PRIO_INTERACTIVE;
+	default:
+		return CONTAINER_NET_PRIO_BEST_EFFORT;
+	}
+}
+
 /******************************************************************************/
 
+/*
+ * The result of an asynchronous verification of pushed buffers, which is consumed by
+ * the next container_config_verify() of the same buffers instead of asking scd again.
+ */
+typedef struct container_config_verified {
+	uint8_t *conf_buf;
+	size_t conf_len;
+	uint8_t *sig_buf;
+	size_t sig_len;
+	uint8_t *cert_buf;
+	size_t cert_len;
+	bool good;
+} container_config_verified_t;
+
+static list_t *container_config_verified_list = NULL;
+
+typedef struct container_config_verify_task {
+	container_config_verify_cb_t cb;
+	void *data;
+} container_config_verify_task_t;
+
+static void
+container_config_verified_free(container_config_verified_t *verified)
+{
+	container_config_verified_list = list_remove(container_config_verified_list, verified);
+	mem_free0(verified->conf_buf);
+	mem_free0(verified->sig_buf);
+	mem_free0(verified->cert_buf);
+	mem_free0(verified);
+}
+
+static container_config_verified_t *
+container_config_verified_get(const uint8_t *conf_buf, size_t conf_len, const uint8_t *sig_buf,
+			      size_t sig_len, const uint8_t *cert_buf, size_t cert_len)
+{
+	for (list_t *l = container_config_verified_list; l; l = l->next) {
+		container_config_verified_t *v = l->data;
+		if (v->conf_len == conf_len && v->sig_len == sig_len && v->cert_len == cert_len &&
+		    !memcmp(v->conf_buf, conf_buf, conf_len) &&
+		    !memcmp(v->sig_buf, sig_buf, sig_len) &&
+		    !memcmp(v->cert_buf, cert_buf, cert_len))
+			return v;
+	}
+	return NULL;
+}
+
+static void
+container_config_verify_buf_cb(smartcard_crypto_verify_result_t verify_result,
+			       unsigned char *conf_buf, size_t conf_len, unsigned char *sig_buf,
+			       size_t sig_len, unsigned char *cert_buf, size_t cert_len,
+			       UNUSED smartcard_crypto_hashalgo_t hash_algo, void *data)
+{
+	container_config_verify_task_t *task = data;
+	ASSERT(task);
+
+	// errors, e.g., an unreachable scd, are not kept, thus retried on use
+	if (verify_result != VERIFY_ERROR) {
+		// results which were never used, e.g., of a closed connection, are dropped
+		if (list_length(container_config_verified_list) >= C_CONFIG_VERIFIED_MAX)
+			container_config_verified_free(container_config_verified_list->data);
+
+		container_config_verified_t *verified = mem_new0(container_config_verified_t, 1);
+		verified->conf_buf = mem_memcpy(conf_buf, conf_len);
+		verified->conf_len = conf_len;
+		verified->sig_buf = mem_memcpy(sig_buf, sig_len);
+		verified->sig_len = sig_len;
+		verified->cert_buf = mem_memcpy(cert_buf, cert_len);
+		verified->cert_len = cert_len;
+		verified->good = (verify_result == VERIFY_GOOD);
+		container_config_verified_list =
+			list_append(container_config_verified_list, verified);
+	}
+
+	task->cb(verify_result == VERIFY_GOOD, task->data);
+	mem_free0(task);
+}
+
+int
+container_config_verify_async(const uint8_t *buf, size_t len, const uint8_t *sig_buf,
+			      size_t sig_len, const uint8_t *cert_buf, size_t cert_len,
+			      container_config_verify_cb_t cb, void *data)
+{
+	IF_NULL_RETVAL(buf, -1);
+	IF_NULL_RETVAL(sig_buf, -1);
+	IF_NULL_RETVAL(cert_buf, -1);
+	ASSERT(cb);
+
+	container_config_verify_task_t *task = mem_new0(container_config_verify_task_t, 1);
+	task->cb = cb;
+	task->data = data;
+
+	if (smartcard_crypto_verify_buf((unsigned char *)buf, len, (unsigned char *)sig_buf,
+					sig_len, (unsigned char *)cert_buf, cert_len,
+					C_CONFIG_VERIFY_HASH_ALGO, container_config_verify_buf_cb,
+					task) < 0) {
+		mem_free0(task);
+		return -1;
+	}
+	return 0;
+}
+
 /**
  * This function verifies the container configuration file at load time
  * as part of TSF.CML.SecureCompartmentInit
@@ -162,10 +281,18 @@ container_config_verify(const char *prefix, uint8_t *conf_buf, size_t conf_len,
 	// check cert and signature buffers
 	IF_TRUE_GOTO(cert_size <= 0 || sig_size <= 0 || cert == NULL || sig == NULL, out);
 
-	smartcard_crypto_verify_result_t verify_result = smartcard_crypto_verify_buf_block(
-		conf_buf, conf_len, sig, sig_size, cert, cert_size, C_CONFIG_VERIFY_HASH_ALGO);
-
-	ret = (verify_result == VERIFY_GOOD) ? true : false;
+	container_config_verified_t *verified =
+		container_config_verified_get(conf_buf, conf_len, sig, sig_size, cert, cert_size);
+	if (verified) {
+		TRACE("Using result of asynchronous verification");
+		ret = verified->good;
+		container_config_verified_free(verified);
+	} else {
+		smartcard_crypto_verify_result_t verify_result = smartcard_crypto_verify_buf_block(
+			conf_buf, conf_len, sig, sig_size, cert, cert_size,
+			C_CONFIG_VERIFY_HASH_ALGO);
+		ret = (verify_result == VERIFY_GOOD) ? true : false;
+	}
 out:
 	INFO("Verify Result of target with prefix '%s': %s", prefix, ret ? "GOOD" : "UNSIGNED");
 
@@ -195,8 +322,12 @@ container_config_new(const char *file, const uint8_t *buf, size_t len, uint8_t *
 	// check if config comes from buffer or needs to be read from file
 	if (buf == NULL) {
 		DEBUG("Loading container config from file \"%s\".", file);
-		conf_len = file_size(file);
-		if (conf_len > 0) {
+		size_t pending_len;
+		buf_internal = (uint8_t *)file_writer_get_pending_new(file, &pending_len);
+		if (buf_internal) {
+			// an update which is not yet written to the file
+			conf_len = pending_len;
+		} else if ((conf_len = file_size(file)) > 0) {
 			buf_internal = mem_alloc(conf_len);
 			if (-1 == file_read(file, (char *)buf_internal, conf_len)) {
 				mem_free0(buf_internal);
@@ -215,8 +346,8 @@ container_config_new(const char *file, const uint8_t *buf, size_t len, uint8_t *
 		goto out;
 	}
 
-	ccfg = (ContainerConfig *)protobuf_message_new_from_buf(buf_internal, conf_len,
-								&container_config__descriptor);
+	ccfg = (ContainerConfig *)config_cache_message_new(file, buf_internal, conf_len,
+							   &container_config__descriptor);
 	if (!ccfg) {
 		WARN("Failed loading container config from buf");
 		goto out;
@@ -224,15 +355,18 @@ container_config_new(const char *file, const uint8_t *buf, size_t len, uint8_t *
 
 	// if config was provided by buf, update all files according to buffers
 	if (buf) {
-		if (-1 == file_write(file, (char *)buf, conf_len)) {
+		if (-1 == file_writer_write(file, (char *)buf, conf_len)) {
 			WARN("Could not store configuration in file \"%s\".", file);
 		} else if (cmld_uses_signed_configs()) {
 			char *sig_file = mem_printf("%s.sig", prefix);
 			char *cert_file = mem_printf("%s.cert", prefix);
 
-			if (-1 == file_write(sig_file, (char *)sig_buf, sig_len))
+			// signature and certificate are read from disk, keep them in sync
+			if (-1 == file_writer_flush(file))
+				WARN("Could not store configuration in file \"%s\".", file);
+			if (-1 == file_write_atomic(sig_file, (char *)sig_buf, sig_len))
 				WARN("Could not update sig_file '%s'", sig_file);
-			if (-1 == file_write(cert_file, (char *)cert_buf, cert_len))
+			if (-1 == file_write_atomic(cert_file, (char *)cert_buf, cert_len))
 				WARN("Could not update cert_file '%s'", cert_file);
 		}
 	}
@@ -267,11 +401,15 @@ container_config_write(const container_config_t *config)
 		return 0;
 	}
 
-	if (protobuf_message_write_to_file(config->file, (ProtobufCMessage *)config->cfg) < 0) {
+	// updates in quick succession, e.g., of several settings, result in a single write
+	char *string = protobuf_message_to_string_new((ProtobufCMessage *)config->cfg);
+	if (!string || file_writer_write(config->file, string, -1) < 0) {
 		WARN("Could not write container config to \"%s\"", config->file);
+		mem_free0(string);
 		return -1;
 	}
 
+	mem_free0(string);
 	return 0;
 }
 
@@ -333,6 +471,27 @@ container_config_set_ram_limit(container_config_t *config, unsigned int ram_limi
 	config->cfg->ram_limit = ram_limit;
 }
 
+/*
+ * Applies the host specific dm-crypt tuning of the image. Only options which do not
+ * change the on-disk format may be overridden by the container config.
+ */
+static void
+container_config_fill_crypt_opts(const ContainerImageSize *img, mount_entry_t *mntent)
+{
+	cryptfs_opts_t opts = *mount_entry_get_crypt_opts(mntent);
+
+	if (img->has_crypt_no_workqueue)
+		opts.no_workqueue = img->crypt_no_workqueue;
+	if (img->has_crypt_same_cpu)
+		opts.same_cpu_crypt = img->crypt_same_cpu;
+	if (img->has_crypt_submit_from_crypt_cpus)
+		opts.submit_from_crypt_cpus = img->crypt_submit_from_crypt_cpus;
+	if (img->has_crypt_allow_discards)
+		opts.allow_discards = img->crypt_allow_discards;
+
+	mount_entry_set_crypt_opts(mntent, &opts);
+}
+
 void
 container_config_fill_mount(const container_config_t *config, mount_t *mnt)
 {
@@ -360,6 +519,9 @@ container_config_fill_mount(const container_config_t *config, mount_t *mnt)
 		    (mount_entry_get_type(mntent) == MOUNT_TYPE_OVERLAY_RW)) {
 			uint64_t size = cfg->image_sizes[i]->image_size;
 			mount_entry_set_size(mntent, size);
+			container_config_fill_crypt_opts(cfg->image_sizes[i], mntent);
+			if (cfg->image_sizes[i]->has_ephemeral)
+				mount_entry_set_ephemeral(mntent, cfg->image_sizes[i]->ephemeral);
 		} else {
 			ERROR("Forbidden: Cannot override image size for mount entry \"%s\" "
 			      "in config for container \"%s\"!",
@@ -567,6 +729,18 @@ container_config_get_vnet_cfg_list_new(const container_config_t *config)
 		container_vnet_cfg_t *if_cfg =
 			container_vnet_cfg_new(config->cfg->vnet_configs[i]->if_name, NULL, mac,
 					       config->cfg->vnet_configs[i]->configure);
+
+		const ContainerVnetConfig *vnet = config->cfg->vnet_configs[i];
+		if_cfg->qos.download_rate = vnet->download_rate;
+		if_cfg->qos.upload_rate = vnet->upload_rate;
+		if_cfg->qos.prio = container_config_proto_to_net_prio(vnet->priority);
+		if (vnet->has_dscp) {
+			if (vnet->dscp > 63)
+				WARN("Ignoring invalid DSCP %u for if %s", vnet->dscp,
+				     vnet->if_name);
+			else
+				if_cfg->qos.dscp = vnet->dscp;
+		}
 		if_cfg_list = list_append(if_cfg_list, if_cfg);
 	}
 
@@ -655,6 +829,122 @@ container_config_get_usb_pin_entry(const container_config_t *config)
 	return config->cfg->usb_pin_entry;
 }
 
+uint32_t
+container_config_get_boot_priority(const container_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+	return config->cfg->boot_priority;
+}
+
+uint32_t
+container_config_get_checkpoint_size(const container_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+	return config->cfg->checkpoint_size;
+}
+
+uint32_t
+container_config_get_ram_soft_limit(const container_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+	return config->cfg->ram_soft_limit;
+}
+
+uint32_t
+container_config_get_dedicated_cores(const container_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+	return config->cfg->dedicated_cores;
+}
+
+void
+container_config_get_io_limits(const container_config_t *config, container_io_limits_t *limits)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+	ASSERT(limits);
+
+	const ContainerIoLimits *io = config->cfg->io_limits;
+	*limits = (container_io_limits_t){ 0 };
+	if (!io)
+		return;
+
+	limits->weight = MIN(io->weight, 10000);
+	limits->read_bps = io->read_bps;
+	limits->write_bps = io->write_bps;
+	limits->read_iops = io->read_iops;
+	limits->write_iops = io->write_iops;
+	limits->latency_target = io->latency_target;
+}
+
+void
+container_config_get_kvm_config(const container_config_t *config, container_kvm_config_t *kvm)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+	ASSERT(kvm);
+
+	const ContainerKvmConfig *cfg = config->cfg->kvm;
+	*kvm = (container_kvm_config_t){ 0 };
+	if (!cfg)
+		return;
+
+	kvm->memory = cfg->memory;
+	kvm->cpus = cfg->cpus;
+	kvm->hugepages = cfg->hugepages;
+	kvm->hugetlb_limit = cfg->hugetlb_limit;
+	kvm->pin_vcpus = cfg->pin_vcpus;
+	kvm->vhost_net = cfg->vhost_net;
+	kvm->balloon = cfg->balloon;
+	// cids 0 - 2 are reserved for the hypervisor and the host
+	if (cfg->vsock_cid > 2)
+		kvm->vsock_cid = cfg->vsock_cid;
+	else if (cfg->vsock_cid)
+		WARN("Ignoring reserved vsock cid %u", cfg->vsock_cid);
+}
+
+void
+container_config_get_audit_policy(const container_config_t *config,
+				  container_audit_policy_t *policy)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+	ASSERT(policy);
+
+	// everything is passed unless the config restricts it
+	const ContainerAuditPolicy *cfg = config->cfg->audit_policy;
+	policy->user_messages = cfg ? cfg->user_messages : true;
+	policy->syscall_events = cfg ? cfg->syscall_events : true;
+}
+
+uint32_t
+container_config_get_idle_freeze_timeout(const container_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+	return config->cfg->idle_freeze_timeout;
+}
+
+char **
+container_config_get_activation_sockets(const container_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+	return config->cfg->activation_sockets;
+}
+
+size_t
+container_config_get_activation_sockets_len(const container_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+	return config->cfg->n_activation_sockets;
+}
+
 const char *
 container_config_get_cpus_allowed(const container_config_t *config)
 {
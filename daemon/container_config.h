@@ -43,6 +43,32 @@
 
 typedef struct container_config container_config_t;
 
+/**
+ * Called with the result of container_config_verify_async().
+ */
+typedef void (*container_config_verify_cb_t)(bool verified, void *data);
+
+/**
+ * Verifies the signature of a pushed config asynchronously. The result is kept and
+ * used by the next container_config_new() with the same buffers, which then does not
+ * block on scd. Thus, a pushed signed config should be verified with this function
+ * before creating or updating a container from it.
+ *
+ * @param buf config buffer
+ * @param len length of the given buf
+ * @param sig_buf buffer containing the signature of the configuration
+ * @param sig_len length of the given sig_buf
+ * @param cert_buf buffer containing the certificate of the configuration
+ * @param cert_len length of the given cert_buf
+ * @param cb called once the verification has completed
+ * @param data passed to cb
+ * @return 0 if the verification was started, -1 otherwise
+ */
+int
+container_config_verify_async(const uint8_t *buf, size_t len, const uint8_t *sig_buf,
+			      size_t sig_len, const uint8_t *cert_buf, size_t cert_len,
+			      container_config_verify_cb_t cb, void *data);
+
 /**
  * Create a new container_config object which can be used to parse or write a
  * configuration to a given filename.
@@ -71,6 +97,10 @@ container_config_new(const char *file, const uint8_t *buf, size_t len, uint8_t *
 void
 container_config_free(container_config_t *config);
 
+/**
+ * Write the config to its file. The write is deferred by common/file_writer.h, so that
+ * several updates in quick succession result in a single write.
+ */
 int
 container_config_write(const container_config_t *config);
 
@@ -232,4 +262,62 @@ container_config_get_token_type(const container_config_t *config);
 bool
 container_config_get_usb_pin_entry(const container_config_t *config);
 
+/**
+ * Returns the priority of the container for autostarts, higher ones start first.
+ */
+uint32_t
+container_config_get_boot_priority(const container_config_t *config);
+
+/**
+ * Returns the size of the checkpoint image in MBytes, 0 if checkpoints are disabled.
+ */
+uint32_t
+container_config_get_checkpoint_size(const container_config_t *config);
+
+/**
+ * Returns the soft RAM limit of the container in MBytes, 0 if not set.
+ */
+uint32_t
+container_config_get_ram_soft_limit(const container_config_t *config);
+
+/**
+ * Returns the number of physical cores dedicated to the container, 0 if none.
+ */
+uint32_t
+container_config_get_dedicated_cores(const container_config_t *config);
+
+/**
+ * Fills limits with the block io limits of the container, 0 for the unset ones.
+ */
+void
+container_config_get_io_limits(const container_config_t *config, container_io_limits_t *limits);
+
+/**
+ * Fills kvm with the VMM options of a KVM container, 0 or false for the unset ones.
+ */
+void
+container_config_get_kvm_config(const container_config_t *config, container_kvm_config_t *kvm);
+
+/**
+ * Fills policy with the kernel audit events of the container which are passed to cmld.
+ */
+void
+container_config_get_audit_policy(const container_config_t *config,
+				  container_audit_policy_t *policy);
+
+/**
+ * Returns the seconds without activity after which the container is frozen, 0 if never.
+ */
+uint32_t
+container_config_get_idle_freeze_timeout(const container_config_t *config);
+
+/**
+ * Returns the names of the sockets on which the container is started on demand.
+ */
+char **
+container_config_get_activation_sockets(const container_config_t *config);
+
+size_t
+container_config_get_activation_sockets_len(const container_config_t *config);
+
 #endif /* C_CONFIG_H */
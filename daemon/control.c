@@ -21,12 +21,17 @@
  * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for memrchr()
+#endif
+
 #include "control.h"
 
 #include "control.pb-c.h"
 #include "container.pb-c.h"
 
 #include "container.h"
+#include "container_config.h"
 #include "guestos_mgr.h"
 #include "guestos.h"
 #include "cmld.h"
@@ -35,11 +40,18 @@
 #include "input.h"
 #include "uevent.h"
 #include "audit.h"
+#include "c_cgroups.h"
+#include "download.h"
+#include "tss.h"
+#include "exporter.h"
+#include "balloon.h"
+#include "idle.h"
 
 //#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
 #include "common/macro.h"
 #include "common/mem.h"
 #include "common/protobuf.h"
+#include "common/protobuf_writer.h"
 #include "common/sock.h"
 #include "common/uuid.h"
 #include "common/event.h"
@@ -47,22 +59,51 @@
 #include "common/logf.h"
 #include "common/list.h"
 #include "common/network.h"
-#include "common/reboot.h"
 #include "common/file.h"
+#include "common/file_writer.h"
+#include "common/metrics.h"
+#include "common/sampler.h"
 
 #include <unistd.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
 
 #include <google/protobuf-c/protobuf-c-text.h>
 
 // maximum no. of connections waiting to be accepted on the listening socket
 #define CONTROL_SOCK_LISTEN_BACKLOG 8
 
-// time between reconnection attempts of a remote client socket
-#define CONTROL_REMOTE_RECONNECT_INTERVAL 10000
+// delay between reconnection attempts of a remote client socket, doubled after
+// each failed attempt up to the maximum and randomized to avoid reconnect storms
+#define CONTROL_REMOTE_RECONNECT_MIN 2000
+#define CONTROL_REMOTE_RECONNECT_MAX 300000
+
+// keepalive of the remote connection, a dead peer is detected after ~2 minutes
+#define CONTROL_REMOTE_KEEPALIVE_IDLE 60
+#define CONTROL_REMOTE_KEEPALIVE_INTVL 10
+#define CONTROL_REMOTE_KEEPALIVE_CNT 6
 
 #define LOGGER_ENTRY_MAX_LEN (5 * 1024)
 
+// log files are sent in chunks of this size, CONTROL_LOG_CHUNKS_PER_TICK per timer tick
+#define CONTROL_LOG_CHUNK_SIZE (32 * 1024)
+#define CONTROL_LOG_CHUNKS_PER_TICK 4
+#define CONTROL_LOG_TICK_INTERVAL 1
+
+// call sites with the most live bytes included in the response to GET_MEM_STATS
+#define CONTROL_MEM_STATS_SITES 50
+
+// input accepted per exec channel until the daemon grants more with EXEC_WINDOW
+#define CONTROL_EXEC_INPUT_WINDOW (64 * 1024)
+// output window of a multiplexed exec channel if the client does not announce one
+#define CONTROL_EXEC_OUTPUT_WINDOW (64 * 1024)
+// console output is forwarded in messages of up to this size, a few per wakeup
+#define CONTROL_EXEC_OUTPUT_CHUNK (64 * 1024)
+#define CONTROL_EXEC_CHUNKS_PER_WAKEUP 4
+
 struct control {
 	int sock; // listen socket fd
 	int sock_client;
@@ -71,104 +112,221 @@ struct control {
 	int port;	// remote port
 	bool connected; // FIXME: we should reconsider this...
 	event_timer_t *reconnect_timer;
+	unsigned int reconnect_delay; // ms until the next reconnection attempt
 	bool privileged;
+	mem_arena_t *arena; // request scoped allocations, released after each message
+	list_t *readers;    // protobuf_reader_t of each connected client
 };
 
 static list_t *control_list = NULL;
 
+// handling time of ControllerToDaemon messages, shared by all control sockets
+static metrics_t *control_metrics_handle = NULL;
+
 static int
 control_remote_reconnect(control_t *control);
 
-static void UNUSED
-control_send_log_file(int fd, char *log_file_name, bool read_low_level, bool send_last_line_info)
-{
-	int fp_low = -1;
-	bool skipped_lines = false;
-	FILE *fp = NULL;
-	char *line;
-	char line_low[LOGGER_ENTRY_MAX_LEN + 1];
-	size_t HEADER_LENGTH = 21;
-	ssize_t bytes_read;
-	bool file_is_open = false;
+/**
+ * State of a log file transfer, which is served chunk by chunk from the event loop
+ * instead of sending the whole file in one go.
+ */
+typedef struct control_log_transfer {
+	int fd;		 // control client connection
+	int log_fd;	 // log file or logger device
+	char *name;	 // name of the log file
+	bool low_level;	 // read entry by entry from a logger device
+	uint64_t offset; // file offset of the next chunk
+	uint8_t *buf;	 // chunk buffer of CONTROL_LOG_CHUNK_SIZE bytes
+	event_timer_t *timer;
+} control_log_transfer_t;
 
-	LogMessage message = LOG_MESSAGE__INIT;
-	message.prio = (LogPriority)LOGF_PRIO_DEBUG;
-	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
-	out.code = DAEMON_TO_CONTROLLER__CODE__LOG_MESSAGE;
-	if (cmld_get_device_uuid()) {
-		TRACE("Setting uuid: %s", cmld_get_device_uuid());
-		out.device_uuid = mem_strdup(cmld_get_device_uuid());
+static list_t *control_log_transfer_list = NULL;
+
+// connections of clients observing pressure events, as int *
+static list_t *control_pressure_observer_list = NULL;
+
+/*
+ * A client observing containers, see OBSERVE_CONTAINERS.
+ */
+typedef struct control_container_observer {
+	int fd;
+	uint32_t kinds; // mask of the ContainerEvent kinds to send
+	list_t *uuids;	// uuid strings of the observed containers, all if NULL
+} control_container_observer_t;
+
+static list_t *control_container_observer_list = NULL;
+
+static void
+control_log_transfer_free(control_log_transfer_t *transfer)
+{
+	if (transfer->timer) {
+		event_remove_timer(transfer->timer);
+		event_timer_free(transfer->timer);
 	}
+	if (close(transfer->log_fd) < 0)
+		WARN_ERRNO("Failed to close %s", transfer->name);
 
-	DEBUG("Opening and sending %s", log_file_name);
-	if (read_low_level) {
-		fp_low = open(log_file_name, O_RDONLY | O_NONBLOCK);
-		if (fp_low == -1) {
-			ERROR("Could not open %s", log_file_name);
-		} else {
-			file_is_open = true;
-		}
-	} else {
-		fp = fopen(log_file_name, "r");
-		line = NULL;
-		if (fp == NULL) {
-			ERROR("Could not open %s", log_file_name);
-		} else {
-			file_is_open = true;
+	control_log_transfer_list = list_remove(control_log_transfer_list, transfer);
+	mem_free0(transfer->name);
+	mem_free0(transfer->buf);
+	mem_free0(transfer);
+}
+
+/**
+ * Aborts all log transfers to the given client connection.
+ */
+static void
+control_log_transfer_cancel(int fd)
+{
+	for (list_t *l = control_log_transfer_list; l;) {
+		control_log_transfer_t *transfer = l->data;
+		l = l->next;
+		if (transfer->fd == fd) {
+			DEBUG("Aborting transfer of %s at offset %" PRIu64, transfer->name,
+			      transfer->offset);
+			control_log_transfer_free(transfer);
 		}
 	}
+}
 
-	while (file_is_open) {
-		if (read_low_level) {
-			/* The driver let's us read entry by entry */
-			bytes_read = read(fp_low, line_low, LOGGER_ENTRY_MAX_LEN);
-			if (bytes_read <= 0)
-				break;
-			char *first_string = line_low + HEADER_LENGTH;
-			size_t string_len = strlen(first_string);
-			char *second_string = line_low + HEADER_LENGTH + string_len + 1;
-			message.msg = mem_printf("%s/%s", first_string, second_string);
-		} else {
-			size_t len = 0;
-			bytes_read = getline(&line, &len, fp);
-			if (bytes_read == -1)
+/**
+ * Reads the next chunk of the log file into the chunk buffer.
+ *
+ * @return the number of bytes in the chunk, 0 on EOF or -1 on error
+ */
+static ssize_t
+control_log_transfer_read(control_log_transfer_t *transfer)
+{
+	if (transfer->low_level) {
+		/* The driver let's us read entry by entry, batch as many as fit */
+		char entry[LOGGER_ENTRY_MAX_LEN + 1];
+		size_t HEADER_LENGTH = 21;
+		size_t len = 0;
+
+		while (CONTROL_LOG_CHUNK_SIZE - len > sizeof(entry)) {
+			ssize_t bytes_read = read(transfer->log_fd, entry, LOGGER_ENTRY_MAX_LEN);
+			if (bytes_read <= (ssize_t)HEADER_LENGTH)
 				break;
-			message.msg = mem_strdup(line);
+			entry[bytes_read] = '\0';
+			char *first_string = entry + HEADER_LENGTH;
+			size_t string_len = strnlen(first_string, bytes_read - HEADER_LENGTH);
+			char *second_string =
+				first_string + MIN(string_len + 1, bytes_read - HEADER_LENGTH);
+			len += snprintf((char *)transfer->buf + len, CONTROL_LOG_CHUNK_SIZE - len,
+					"%s/%s\n", first_string, second_string);
 		}
-		out.log_message = &message;
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
-			ERROR_ERRNO("Could not finish sending %s", log_file_name);
-			skipped_lines = true;
-			break;
-		}
-		mem_free0(message.msg);
+		return len;
 	}
-	if (send_last_line_info) {
-		message.msg = mem_printf("Last line of log");
-		out.log_message = &message;
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
-			ERROR("Could not sent last line info for %s", log_file_name);
-		}
-		mem_free0(message.msg);
+
+	ssize_t len;
+	do {
+		len = pread(transfer->log_fd, transfer->buf, CONTROL_LOG_CHUNK_SIZE,
+			    transfer->offset);
+	} while (len < 0 && errno == EINTR);
+	if (len < 0) {
+		ERROR_ERRNO("Could not read %s at offset %" PRIu64, transfer->name,
+			    transfer->offset);
+		return -1;
 	}
-	if (out.device_uuid != NULL) {
-		mem_free0(out.device_uuid);
+
+	// end full chunks after the last complete line, a chunk without any
+	// line break is sent as raw byte range
+	if (len == CONTROL_LOG_CHUNK_SIZE) {
+		uint8_t *nl = memrchr(transfer->buf, '\n', len);
+		if (nl)
+			len = nl - transfer->buf + 1;
 	}
-	if (file_is_open) {
-		if (read_low_level) {
-			close(fp_low);
-		} else {
-			fclose(fp);
-			if (line)
-				free(line);
+	return len;
+}
+
+/**
+ * Sends the next chunk of the log file.
+ *
+ * @return true if there is more data to send, false if the transfer is done or failed
+ */
+static bool
+control_log_transfer_send_chunk(control_log_transfer_t *transfer)
+{
+	ssize_t len = control_log_transfer_read(transfer);
+
+	LogChunk chunk = LOG_CHUNK__INIT;
+	chunk.file = transfer->name;
+	chunk.offset = transfer->offset;
+	chunk.has_data = len > 0;
+	chunk.data.data = transfer->buf;
+	chunk.data.len = MAX(len, 0);
+	chunk.has_eof = len <= 0;
+	chunk.eof = len <= 0;
+
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__LOG_CHUNK;
+	out.log_chunk = &chunk;
+	out.device_uuid = (char *)cmld_get_device_uuid();
+
+	if (protobuf_writer_send_message(transfer->fd, (ProtobufCMessage *)&out) < 0) {
+		ERROR("Could not finish sending %s", transfer->name);
+		return false;
+	}
+	transfer->offset += chunk.data.len;
+
+	if (chunk.eof)
+		DEBUG("Finished sending %s (%" PRIu64 " bytes)", transfer->name, transfer->offset);
+	return !chunk.eof;
+}
+
+static void
+control_log_transfer_cb(UNUSED event_timer_t *timer, void *data)
+{
+	control_log_transfer_t *transfer = data;
+	ASSERT(transfer);
+
+	for (int i = 0; i < CONTROL_LOG_CHUNKS_PER_TICK; i++) {
+		// let the client catch up before queueing more data
+		protobuf_writer_t *writer = protobuf_writer_get_by_fd(transfer->fd);
+		if (writer && protobuf_writer_is_congested(writer))
+			return;
+
+		if (!control_log_transfer_send_chunk(transfer)) {
+			control_log_transfer_free(transfer);
+			return;
 		}
 	}
+}
 
-	if (!skipped_lines) {
-		DEBUG("Finished sending complete %s", log_file_name);
-	} else {
-		DEBUG("Finished sending %s; skipped lines", log_file_name);
+/**
+ * Starts the chunked transfer of a log file to a control client, starting at the given
+ * offset. The chunks are sent from the event loop as fast as the client receives them.
+ *
+ * @param fd		client connection the log file is sent to
+ * @param log_file_name	name of the log file
+ * @param read_low_level true, if log_file_name is a logger device which only allows
+ *			to read entry by entry
+ * @param offset	offset to start at, ignored for logger devices
+ * @return 0 on success, -1 if the log file could not be opened
+ */
+static int UNUSED
+control_log_transfer_start(int fd, const char *log_file_name, bool read_low_level, uint64_t offset)
+{
+	DEBUG("Opening and sending %s", log_file_name);
+	int log_fd = open(log_file_name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (log_fd < 0) {
+		ERROR_ERRNO("Could not open %s", log_file_name);
+		return -1;
 	}
+
+	control_log_transfer_t *transfer = mem_new0(control_log_transfer_t, 1);
+	transfer->fd = fd;
+	transfer->log_fd = log_fd;
+	transfer->name = mem_strdup(log_file_name);
+	transfer->low_level = read_low_level;
+	transfer->offset = read_low_level ? 0 : offset;
+	transfer->buf = mem_alloc(CONTROL_LOG_CHUNK_SIZE);
+	transfer->timer = event_timer_new(CONTROL_LOG_TICK_INTERVAL, EVENT_TIMER_REPEAT_FOREVER,
+					  control_log_transfer_cb, transfer);
+	event_add_timer(transfer->timer);
+
+	control_log_transfer_list = list_append(control_log_transfer_list, transfer);
+	return 0;
 }
 
 /**
@@ -219,26 +377,48 @@ control_container_type_to_proto(container_type_t type)
 	}
 }
 
+// bit of a ContainerStatusField in a field mask of control_container_status_new
+#define CONTROL_STATUS_FIELD(field) (1u << CONTAINER_STATUS_FIELD__STATUS_##field)
+#define CONTROL_STATUS_FIELDS_ALL 0xffffffffu
+
 /**
- * Get the ContainerStatus for the given container.
+ * Fills in the ContainerStatus for the given container.
  *
+ * @param c_status the ContainerStatus object to initialize
  * @param container the container object from which to generate the ContainerStatus
- * @return  a new ContainerStatus object with information about the given container;
- *          has to be free'd with control_container_status_free()
+ * @param fields mask of the fields to fill in, see CONTROL_STATUS_FIELD; the uuid is always set
+ * @return  c_status, which references strings of the container, thus it must be
+ *          sent before returning to the event loop
  */
 static ContainerStatus *
-control_container_status_new(const container_t *container)
+control_container_status_init(ContainerStatus *c_status, const container_t *container,
+			      uint32_t fields)
 {
-	ContainerStatus *c_status = mem_new(ContainerStatus, 1);
 	container_status__init(c_status);
-	c_status->uuid = mem_strdup(uuid_string(container_get_uuid(container)));
-	c_status->name = mem_strdup(container_get_name(container));
-	c_status->type = control_container_type_to_proto(container_get_type(container));
-	c_status->state = control_container_state_to_proto(container_get_state(container));
-	c_status->uptime = container_get_uptime(container);
-	c_status->created = container_get_creation_time(container);
-	c_status->guestos = mem_strdup(guestos_get_name(container_get_guestos(container)));
+	c_status->uuid = (char *)uuid_string(container_get_uuid(container));
+	if (fields & CONTROL_STATUS_FIELD(NAME))
+		c_status->name = (char *)container_get_name(container);
+	if (fields & CONTROL_STATUS_FIELD(TYPE)) {
+		c_status->has_type = true;
+		c_status->type = control_container_type_to_proto(container_get_type(container));
+	}
+	if (fields & CONTROL_STATUS_FIELD(STATE)) {
+		c_status->has_state = true;
+		c_status->state = control_container_state_to_proto(container_get_state(container));
+	}
+	if (fields & CONTROL_STATUS_FIELD(UPTIME)) {
+		c_status->has_uptime = true;
+		c_status->uptime = container_get_uptime(container);
+	}
+	if (fields & CONTROL_STATUS_FIELD(CREATED)) {
+		c_status->has_created = true;
+		c_status->created = container_get_creation_time(container);
+	}
+	if (fields & CONTROL_STATUS_FIELD(GUESTOS))
+		c_status->guestos = (char *)guestos_get_name(container_get_guestos(container));
+	IF_FALSE_RETVAL(fields & CONTROL_STATUS_FIELD(TRUST_LEVEL), c_status);
 
+	c_status->has_trust_level = true;
 	switch (guestos_get_verify_result(container_get_guestos(container))) {
 	case GUESTOS_SIGNED:
 		c_status->trust_level = CONTAINER_TRUST__SIGNED;
@@ -253,90 +433,346 @@ control_container_status_new(const container_t *container)
 	return c_status;
 }
 
+static ContainerStatus *
+control_container_status_new(mem_arena_t *arena, const container_t *container, uint32_t fields)
+{
+	ContainerStatus *c_status = mem_arena_alloc(arena, sizeof(ContainerStatus));
+	return control_container_status_init(c_status, container, fields);
+}
+
 /**
- * Free the given ContainerStatus object that was previously allocated
- * by control_container_status_new().
- *
- * @param c_status the previously allocated ContainerStatus object
+ * Checks whether the container matches the filters of a GET_CONTAINER_STATUS request.
  */
+static bool
+control_container_status_matches(const ControllerToDaemon *msg, const container_t *container)
+{
+	if (msg->has_status_changed_since &&
+	    container_get_status_generation(container) <= msg->status_changed_since)
+		return false;
+
+	if (msg->n_status_states > 0) {
+		ContainerState state =
+			control_container_state_to_proto(container_get_state(container));
+		size_t i;
+		for (i = 0; i < msg->n_status_states && msg->status_states[i] != state; i++)
+			;
+		IF_TRUE_RETVAL(i == msg->n_status_states, false);
+	}
+
+	if (msg->n_status_types > 0) {
+		ContainerType type = control_container_type_to_proto(container_get_type(container));
+		size_t i;
+		for (i = 0; i < msg->n_status_types && msg->status_types[i] != type; i++)
+			;
+		IF_TRUE_RETVAL(i == msg->n_status_types, false);
+	}
+
+	return true;
+}
+
+/**
+ * An exec session started by a control client. Clients may run many sessions over
+ * one connection by tagging them with channel ids; the output of such a channel is
+ * only read while the client has granted window for it, so a slow or stalled session
+ * neither blocks the others nor piles up output in the daemon. Sessions without a
+ * channel id (legacy clients) have an unlimited output window and untagged messages.
+ */
+typedef struct control_exec_channel {
+	int fd;		     // control client connection
+	uint32_t id;	     // channel id chosen by the client, 0 if not multiplexed
+	int console_fd;	     // cmld end of the console socket of the c_run session
+	event_io_t *io;	     // watches console_fd as requested by io_events
+	unsigned io_events;  // READ while there is output window, WRITE while input is pending
+	uint64_t out_window; // output bytes the client still accepts
+	uint8_t *in_buf;     // input of CONTROL_EXEC_INPUT_WINDOW bytes, not yet written
+	size_t in_len;
+	size_t in_acked;     // input written to the console but not yet granted again
+} control_exec_channel_t;
+
+static list_t *control_exec_channel_list = NULL;
+
+static control_exec_channel_t *
+control_exec_channel_get(int fd, uint32_t id)
+{
+	for (list_t *l = control_exec_channel_list; l; l = l->next) {
+		control_exec_channel_t *channel = l->data;
+		if (channel->fd == fd && channel->id == id)
+			return channel;
+	}
+	return NULL;
+}
+
 static void
-control_container_status_free(ContainerStatus *c_status)
+control_exec_send_end(int fd, uint32_t id)
 {
-	IF_NULL_RETURN(c_status);
-	mem_free0(c_status->name);
-	mem_free0(c_status->uuid);
-	mem_free0(c_status->guestos);
-	mem_free0(c_status);
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__EXEC_END;
+	out.has_exec_channel = id != 0;
+	out.exec_channel = id;
+
+	if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0)
+		WARN("Could not send exec end to control client");
 }
 
-static ssize_t
-control_read_send(int cfd, int fd)
+static void
+control_exec_channel_free(control_exec_channel_t *channel)
+{
+	if (channel->io) {
+		event_remove_io(channel->io);
+		event_io_free(channel->io);
+	}
+	if (close(channel->console_fd) < 0)
+		WARN_ERRNO("Failed to close console socket of exec channel %u", channel->id);
+
+	control_exec_channel_list = list_remove(control_exec_channel_list, channel);
+	mem_free0(channel->in_buf);
+	mem_free0(channel);
+}
+
+/**
+ * Aborts all exec channels of the given client connection.
+ */
+static void
+control_exec_channel_cancel(int fd)
+{
+	for (list_t *l = control_exec_channel_list; l;) {
+		control_exec_channel_t *channel = l->data;
+		l = l->next;
+		if (channel->fd == fd) {
+			DEBUG("Closing exec channel %u of connection %d", channel->id, fd);
+			control_exec_channel_free(channel);
+		}
+	}
+}
+
+static void
+control_exec_channel_cb(int fd, unsigned events, event_io_t *io, void *data);
+
+/**
+ * Registers interest in the console socket according to the channel's windows.
+ * Without output window and pending input, nothing is watched at all, as the
+ * end of the session is only processed after its output has been consumed.
+ */
+static void
+control_exec_channel_watch(control_exec_channel_t *channel)
+{
+	unsigned events = (channel->out_window ? EVENT_IO_READ : 0) |
+			  (channel->in_len ? EVENT_IO_WRITE : 0);
+
+	if (channel->io && events == channel->io_events)
+		return;
+
+	if (channel->io) {
+		event_remove_io(channel->io);
+		event_io_free(channel->io);
+		channel->io = NULL;
+	}
+	channel->io_events = events;
+	if (events) {
+		channel->io = event_io_new(channel->console_fd, events, control_exec_channel_cb,
+					   channel);
+		event_add_io(channel->io);
+	}
+}
+
+/**
+ * Writes pending input to the console socket and grants the client new input
+ * window once half of it has been consumed or all input has been written.
+ *
+ * @return 0 on success or if the socket does not accept more data, -1 on error
+ */
+static int
+control_exec_channel_write(control_exec_channel_t *channel)
 {
-	uint8_t buf[1024];
-	ssize_t count = -1;
+	while (channel->in_len) {
+		ssize_t n = write(channel->console_fd, channel->in_buf, channel->in_len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			WARN_ERRNO("Failed to write input of exec channel %u", channel->id);
+			return -1;
+		}
+		channel->in_len -= n;
+		memmove(channel->in_buf, channel->in_buf + n, channel->in_len);
+		channel->in_acked += n;
+	}
 
-	TRACE("Trying to read data from console socket.");
+	if (channel->id && channel->in_acked &&
+	    (!channel->in_len || channel->in_acked >= CONTROL_EXEC_INPUT_WINDOW / 2)) {
+		DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+		out.code = DAEMON_TO_CONTROLLER__CODE__EXEC_WINDOW;
+		out.has_exec_channel = true;
+		out.exec_channel = channel->id;
+		out.has_exec_window = true;
+		out.exec_window = channel->in_acked;
+		if (protobuf_writer_send_message(channel->fd, (ProtobufCMessage *)&out) < 0)
+			WARN("Could not send exec input window to control client");
+		channel->in_acked = 0;
+	}
+	return 0;
+}
 
-	if ((count = read(fd, buf, 1023)) > 0) {
-		buf[count] = 0;
+/**
+ * Forwards output of the session as far as the window allows.
+ *
+ * @return 1 if there may be more output, 0 at the end of the session, -1 on error
+ */
+static int
+control_exec_channel_read(control_exec_channel_t *channel)
+{
+	// the message is packed before it is queued, thus the buffer can be reused
+	static uint8_t buf[CONTROL_EXEC_OUTPUT_CHUNK];
+
+	// bound the work per wakeup so that busy sessions cannot starve others
+	for (int i = 0; i < CONTROL_EXEC_CHUNKS_PER_WAKEUP && channel->out_window; i++) {
+		size_t len = MIN(sizeof(buf), channel->out_window);
+		ssize_t count = read(channel->console_fd, buf, len);
+		if (count == 0)
+			return 0;
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			TRACE_ERRNO("Read from console socket of exec channel %u failed",
+				    channel->id);
+			return -1;
+		}
 
 		DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
 		out.code = DAEMON_TO_CONTROLLER__CODE__EXEC_OUTPUT;
 		out.has_exec_output = true;
 		out.exec_output.len = count;
 		out.exec_output.data = buf;
+		out.has_exec_channel = channel->id != 0;
+		out.exec_channel = channel->id;
 
-		TRACE("[CONTROL] Read %zd bytes: %s. Sending to control client...", count, buf);
+		if (protobuf_writer_send_message(channel->fd, (ProtobufCMessage *)&out) < 0)
+			WARN("Could not send exec output to control client");
 
-		if (protobuf_send_message(cfd, (ProtobufCMessage *)&out) < 0) {
-			WARN("Could not send exec output to MDM");
-		}
-	} else {
-		TRACE_ERRNO("[CONTROL] Read from console socket returned %zd", count);
+		if (channel->out_window != UINT64_MAX)
+			channel->out_window -= count;
 	}
-
-	return count;
+	return 1;
 }
 
 static void
-control_cb_read_console(int fd, unsigned events, event_io_t *io, void *data)
+control_exec_channel_cb(UNUSED int fd, unsigned events, UNUSED event_io_t *io, void *data)
 {
-	int *cfd = data;
+	control_exec_channel_t *channel = data;
+	bool end = false;
+
+	if ((events & EVENT_IO_WRITE) && control_exec_channel_write(channel) < 0)
+		channel->in_len = 0; // nobody will consume the input anymore
+
+	if (channel->io_events & EVENT_IO_READ) {
+		// the output is drained before a hangup is processed by reading EOF
+		end = control_exec_channel_read(channel) <= 0;
+	} else if (events & EVENT_IO_EXCEPT) {
+		// the session is gone, remaining output is read once window is granted
+		channel->in_len = 0;
+	}
 
-	TRACE("Console callback called, events: read: %u, write: %u, except: %u",
-	      (events & EVENT_IO_READ), (events & EVENT_IO_WRITE), (events & EVENT_IO_EXCEPT));
+	if (end) {
+		TRACE("Detected termination of command on exec channel %u", channel->id);
+		control_exec_send_end(channel->fd, channel->id);
+		control_exec_channel_free(channel);
+		return;
+	}
 
-	if ((events & EVENT_IO_READ)) {
-		TRACE("Got output from exec'ed command, trying to read from console socket");
+	control_exec_channel_watch(channel);
+}
 
-		int count = 0;
+static void
+control_exec_channel_new(int fd, uint32_t id, int console_fd, uint64_t out_window)
+{
+	control_exec_channel_t *channel = mem_new0(control_exec_channel_t, 1);
+	channel->fd = fd;
+	channel->id = id;
+	channel->console_fd = console_fd;
+	channel->out_window = out_window;
+	channel->in_buf = mem_alloc(CONTROL_EXEC_INPUT_WINDOW);
+
+	control_exec_channel_list = list_append(control_exec_channel_list, channel);
+	control_exec_channel_watch(channel);
+}
 
-		// necessary to get all output from interactive commands
-		do {
-			TRACE("Trying to read all available data from socket");
-			count = control_read_send(*cfd, fd);
+static void
+control_handle_cmd_container_exec(container_t *container, const ControllerToDaemon *msg, int fd)
+{
+	uint32_t id = msg->has_exec_channel ? msg->exec_channel : 0;
 
-			TRACE_ERRNO("Response from read was %d", count);
-		} while (count > 0);
+	TRACE("Got exec command: %s, attach PTY: %d, channel: %u", msg->exec_command,
+	      msg->exec_pty, id);
+	if (!msg->exec_command || !msg->has_exec_pty) {
+		ERROR("Missing command or exec_pty info");
+		return;
+	}
+	// the command would hang in a container frozen for being idle
+	idle_wake(container);
+	if (id && control_exec_channel_get(fd, id)) {
+		WARN("Exec channel %u is already in use on connection %d", id, fd);
+		control_exec_send_end(fd, id);
+		return;
+	}
+	if (container_run(container, msg->exec_pty, msg->exec_command, msg->n_exec_args,
+			  msg->exec_args, fd, id) < 0) {
+		ERROR("Failed to exec");
+		control_exec_send_end(fd, id);
+		TRACE("Sent notification of command termination to control client");
+		return;
 	}
 
-	if ((events & EVENT_IO_EXCEPT)) {
-		TRACE("Detected termination of executed command. Stop listening.");
+	uint64_t out_window = UINT64_MAX;
+	if (id)
+		out_window = msg->has_exec_window ? msg->exec_window : CONTROL_EXEC_OUTPUT_WINDOW;
 
-		event_remove_io(io);
-		event_io_free(io);
-		close(fd);
+	DEBUG("Registering read callback for cmld console socket");
+	control_exec_channel_new(fd, id, container_get_console_sock_cmld(container, fd, id),
+				 out_window);
+}
 
-		DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
-		out.code = DAEMON_TO_CONTROLLER__CODE__EXEC_END;
+static void
+control_handle_cmd_container_exec_input(const ControllerToDaemon *msg, int fd)
+{
+	uint32_t id = msg->has_exec_channel ? msg->exec_channel : 0;
+	control_exec_channel_t *channel = control_exec_channel_get(fd, id);
+	if (!channel) {
+		WARN("No exec session for channel %u on connection %d", id, fd);
+		return;
+	}
 
-		if (protobuf_send_message(*cfd, (ProtobufCMessage *)&out) < 0) {
-			WARN("Could not send exec output to MDM");
-		}
+	const uint8_t *data = msg->has_exec_data ? msg->exec_data.data : (uint8_t *)msg->exec_input;
+	size_t len = msg->has_exec_data ? msg->exec_data.len :
+			  (msg->exec_input ? strlen(msg->exec_input) : 0);
 
-		TRACE("Sent notification of command termination to client");
-		mem_free0(cfd);
+	if (len > CONTROL_EXEC_INPUT_WINDOW - channel->in_len) {
+		WARN("Input on exec channel %u exceeds the window, dropping %zu bytes", id, len);
+		return;
 	}
+	TRACE("Got %zu bytes of input for exec channel %u", len, id);
+	memcpy(channel->in_buf + channel->in_len, data, len);
+	channel->in_len += len;
+
+	if (control_exec_channel_write(channel) < 0)
+		channel->in_len = 0;
+	control_exec_channel_watch(channel);
+}
+
+static void
+control_handle_cmd_container_exec_window(const ControllerToDaemon *msg, int fd)
+{
+	control_exec_channel_t *channel =
+		control_exec_channel_get(fd, msg->has_exec_channel ? msg->exec_channel : 0);
+	if (!channel || !channel->id || !msg->has_exec_window) {
+		WARN("Ignoring exec window for unknown or legacy channel");
+		return;
+	}
+
+	channel->out_window = MIN(channel->out_window + msg->exec_window, UINT32_MAX);
+	control_exec_channel_watch(channel);
 }
 
 static container_t *
@@ -519,7 +955,7 @@ control_send_message(control_message_t message, int fd)
 		return -1;
 	}
 
-	return protobuf_send_message(fd, (ProtobufCMessage *)&out);
+	return protobuf_writer_send_message(fd, (ProtobufCMessage *)&out);
 }
 
 /**
@@ -544,7 +980,7 @@ control_handle_cmd_list_guestos_configs(UNUSED const ControllerToDaemon *msg, in
 	out.code = DAEMON_TO_CONTROLLER__CODE__GUESTOS_CONFIGS_LIST;
 	out.n_guestos_configs = n;
 	out.guestos_configs = results;
-	if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+	if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0) {
 		WARN("Could not send list of guestos configs to MDM");
 	}
 
@@ -552,6 +988,512 @@ control_handle_cmd_list_guestos_configs(UNUSED const ControllerToDaemon *msg, in
 	mem_free0(results);
 }
 
+/**
+ * Handles get_event_profile cmd.
+ * Sends the callback statistics of the event loop sorted by accumulated wall time.
+ */
+static void
+control_handle_cmd_get_event_profile(int fd)
+{
+	event_profile_stat_t *stats = NULL;
+	size_t n = event_profile_get_stats(&stats);
+
+	EventProfileStat *results = mem_new(EventProfileStat, n);
+	EventProfileStat **results_ptr = mem_new(EventProfileStat *, n);
+
+	for (size_t i = 0; i < n; i++) {
+		event_profile_stat__init(&results[i]);
+		results[i].type = (char *)event_profile_type_to_string(stats[i].type);
+		results[i].func = (uintptr_t)stats[i].func;
+		results[i].has_count = true;
+		results[i].count = stats[i].count;
+		results[i].has_total_ns = true;
+		results[i].total_ns = stats[i].total_ns;
+		results[i].has_max_ns = true;
+		results[i].max_ns = stats[i].max_ns;
+		results[i].n_histogram = EVENT_PROFILE_BUCKETS;
+		results[i].histogram = stats[i].histogram;
+		results_ptr[i] = &results[i];
+	}
+
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__EVENT_PROFILE;
+	out.n_event_profile_stats = n;
+	out.event_profile_stats = results_ptr;
+	if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		WARN("Could not send event profile");
+	}
+
+	mem_free0(results_ptr);
+	mem_free0(results);
+	mem_free0(stats);
+}
+
+/**
+ * Handles container_get_start_traces cmd.
+ * Sends the start traces of the last starts of the container.
+ */
+static void
+control_handle_cmd_container_get_start_traces(const container_t *container, int fd)
+{
+	container_start_trace_t *traces = NULL;
+	size_t n = container_get_start_traces(container, &traces);
+	size_t n_events = 0;
+
+	for (size_t i = 0; i < n; i++)
+		n_events += traces[i].n;
+
+	ContainerStartTrace *results = mem_new(ContainerStartTrace, n);
+	ContainerStartTrace **results_ptr = mem_new(ContainerStartTrace *, n);
+	ContainerStartTraceEvent *events = mem_new(ContainerStartTraceEvent, n_events);
+	ContainerStartTraceEvent **events_ptr = mem_new(ContainerStartTraceEvent *, n_events);
+
+	for (size_t i = 0, k = 0; i < n; i++) {
+		const container_start_trace_t *trace = &traces[i];
+		uint64_t begin = trace->n ? trace->events[0].begin_ns : 0;
+
+		container_start_trace__init(&results[i]);
+		results[i].time = trace->time;
+		results[i].n_events = trace->n;
+		results[i].events = &events_ptr[k];
+		results_ptr[i] = &results[i];
+
+		for (size_t j = 0; j < trace->n; j++, k++) {
+			const container_trace_event_t *event = &trace->events[j];
+			container_start_trace_event__init(&events[k]);
+			events[k].hook = (char *)event->name;
+			if (!event->name) {
+				events[k].has_state = true;
+				events[k].state = control_container_state_to_proto(event->state);
+			}
+			events[k].has_child = event->child;
+			events[k].child = event->child;
+			events[k].begin_ns = event->begin_ns - MIN(begin, event->begin_ns);
+			events[k].has_duration_ns = event->name != NULL;
+			events[k].duration_ns = event->end_ns - event->begin_ns;
+			events_ptr[k] = &events[k];
+		}
+	}
+
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINER_START_TRACES;
+	out.n_container_start_traces = n;
+	out.container_start_traces = results_ptr;
+	if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		WARN("Could not send container start traces");
+	}
+
+	mem_free0(events_ptr);
+	mem_free0(events);
+	mem_free0(results_ptr);
+	mem_free0(results);
+	mem_free0(traces);
+}
+
+/**
+ * Handles container_get_stats cmd.
+ * Sends the resource usage samples of the container taken after since.
+ */
+static void
+control_handle_cmd_container_get_stats(const container_t *container, uint64_t since, int fd)
+{
+	c_cgroups_stats_sample_t *samples = NULL;
+	size_t n = container_get_stats(container, since, &samples);
+
+	ContainerStatsSample *results = mem_new(ContainerStatsSample, n);
+	ContainerStatsSample **results_ptr = mem_new(ContainerStatsSample *, n);
+
+	for (size_t i = 0; i < n; i++) {
+		container_stats_sample__init(&results[i]);
+		results[i].time = samples[i].time;
+		results[i].has_cpu_usage_ns = samples[i].valid & C_CGROUPS_STATS_CPU;
+		results[i].cpu_usage_ns = samples[i].cpu_usage_ns;
+		results[i].has_mem_usage = samples[i].valid & C_CGROUPS_STATS_MEM;
+		results[i].mem_usage = samples[i].mem_usage;
+		results[i].has_io_read_bytes = samples[i].valid & C_CGROUPS_STATS_IO;
+		results[i].io_read_bytes = samples[i].io_read_bytes;
+		results[i].has_io_write_bytes = samples[i].valid & C_CGROUPS_STATS_IO;
+		results[i].io_write_bytes = samples[i].io_write_bytes;
+		results[i].has_pids = samples[i].valid & C_CGROUPS_STATS_PIDS;
+		results[i].pids = samples[i].pids;
+		results[i].has_ksm_merged_bytes = samples[i].valid & C_CGROUPS_STATS_KSM;
+		results[i].ksm_merged_bytes = samples[i].ksm_merged;
+		results_ptr[i] = &results[i];
+	}
+
+	ContainerStats out_stats = CONTAINER_STATS__INIT;
+	out_stats.container_uuid = (char *)uuid_string(container_get_uuid(container));
+	out_stats.n_samples = n;
+	out_stats.samples = results_ptr;
+	const container_kvm_config_t *kvm = container_get_kvm_config(container);
+	if (container_get_type(container) == CONTAINER_TYPE_KVM && kvm->memory) {
+		out_stats.has_guest_memory = true;
+		out_stats.guest_memory = (uint64_t)kvm->memory << 20;
+		out_stats.has_balloon_size = true;
+		out_stats.balloon_size = balloon_get_size(container);
+	}
+
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINER_STATS;
+	out.container_stats = &out_stats;
+	if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		WARN("Could not send container stats");
+	}
+
+	mem_free0(results_ptr);
+	mem_free0(results);
+	mem_free0(samples);
+}
+
+static void
+control_download_progress_append_cb(const download_t *dl, void *data)
+{
+	list_t **progress_list = data;
+
+	DownloadProgress *progress = mem_new(DownloadProgress, 1);
+	download_progress__init(progress);
+	progress->url = (char *)download_get_url(dl);
+	progress->file = (char *)download_get_file(dl);
+	progress->received = download_get_size(dl);
+	progress->has_size = true;
+	progress->size = download_get_total(dl);
+	*progress_list = list_append(*progress_list, progress);
+}
+
+/**
+ * Handles get_download_progress cmd.
+ */
+static void
+control_handle_cmd_get_download_progress(int fd)
+{
+	list_t *progress_list = NULL;
+	download_foreach_active(control_download_progress_append_cb, &progress_list);
+
+	size_t n = list_length(progress_list);
+	DownloadProgress **progress = mem_new0(DownloadProgress *, n);
+	size_t i = 0;
+	for (list_t *l = progress_list; l; l = l->next)
+		progress[i++] = l->data;
+
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__DOWNLOAD_PROGRESS;
+	out.n_download_progress = n;
+	out.download_progress = progress;
+	if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		WARN("Could not send download progress");
+	}
+
+	for (list_t *l = progress_list; l; l = l->next)
+		mem_free0(l->data);
+	list_delete(progress_list);
+	mem_free0(progress);
+}
+
+/**
+ * Handles observe_pressure cmd. The connection receives pressure events until it is closed.
+ */
+static void
+control_handle_cmd_observe_pressure(int fd)
+{
+	for (list_t *l = control_pressure_observer_list; l; l = l->next) {
+		if (*(int *)l->data == fd)
+			return;
+	}
+
+	int *observer = mem_new0(int, 1);
+	*observer = fd;
+	control_pressure_observer_list = list_append(control_pressure_observer_list, observer);
+	DEBUG("Client on fd %d is observing pressure events", fd);
+}
+
+static void
+control_pressure_observer_cancel(int fd)
+{
+	for (list_t *l = control_pressure_observer_list; l; l = l->next) {
+		int *observer = l->data;
+		if (*observer == fd) {
+			control_pressure_observer_list =
+				list_unlink(control_pressure_observer_list, l);
+			mem_free0(observer);
+			return;
+		}
+	}
+}
+
+static void
+control_container_observer_free(control_container_observer_t *observer)
+{
+	for (list_t *l = observer->uuids; l; l = l->next)
+		mem_free0(l->data);
+	list_delete(observer->uuids);
+	mem_free0(observer);
+}
+
+static void
+control_container_observer_cancel(int fd)
+{
+	for (list_t *l = control_container_observer_list; l; l = l->next) {
+		control_container_observer_t *observer = l->data;
+		if (observer->fd == fd) {
+			control_container_observer_list =
+				list_unlink(control_container_observer_list, l);
+			control_container_observer_free(observer);
+			return;
+		}
+	}
+}
+
+/**
+ * Handles observe_containers cmd. The connection receives container events until it is
+ * closed, a repeated command replaces the previous subscription.
+ */
+static void
+control_handle_cmd_observe_containers(const ControllerToDaemon *msg, int fd)
+{
+	control_container_observer_cancel(fd);
+
+	control_container_observer_t *observer = mem_new0(control_container_observer_t, 1);
+	observer->fd = fd;
+	observer->kinds = msg->n_observe_kinds > 0 ? 0 : 0xffffffffu;
+	for (size_t i = 0; i < msg->n_observe_kinds; i++) {
+		if (msg->observe_kinds[i] < 32)
+			observer->kinds |= 1u << msg->observe_kinds[i];
+	}
+	for (size_t i = 0; i < msg->n_container_uuids; i++)
+		observer->uuids =
+			list_append(observer->uuids, mem_strdup(msg->container_uuids[i]));
+
+	control_container_observer_list = list_append(control_container_observer_list, observer);
+	DEBUG("Client on fd %d is observing containers", fd);
+}
+
+/*
+ * Sends the event to all clients observing events of its kind for its container.
+ */
+static void
+control_container_observers_send(ContainerEvent *event)
+{
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINER_EVENT;
+	out.container_event = event;
+
+	for (list_t *l = control_container_observer_list; l; l = l->next) {
+		control_container_observer_t *observer = l->data;
+		if (!(observer->kinds & (1u << event->kind)))
+			continue;
+		if (observer->uuids) {
+			list_t *u;
+			for (u = observer->uuids; u; u = u->next) {
+				if (event->container_uuid && !strcmp(u->data, event->container_uuid))
+					break;
+			}
+			if (!u)
+				continue;
+		}
+		if (protobuf_writer_send_message(observer->fd, (ProtobufCMessage *)&out) < 0)
+			WARN("Could not send container event to client on fd %d", observer->fd);
+	}
+}
+
+void
+control_notify_container(const container_t *container, bool removed)
+{
+	ASSERT(container);
+	IF_NULL_RETURN(control_container_observer_list);
+
+	ContainerEvent event = CONTAINER_EVENT__INIT;
+	ContainerStatus status;
+	event.container_uuid = (char *)uuid_string(container_get_uuid(container));
+	if (removed) {
+		event.kind = CONTAINER_EVENT__KIND__REMOVED;
+	} else {
+		event.kind = CONTAINER_EVENT__KIND__STATE;
+		event.status =
+			control_container_status_init(&status, container, CONTROL_STATUS_FIELDS_ALL);
+	}
+	control_container_observers_send(&event);
+}
+
+void
+control_notify_audit(const uuid_t *uuid, const ProtobufCMessage *record)
+{
+	ASSERT(record);
+	IF_NULL_RETURN(control_container_observer_list);
+
+	size_t len = protobuf_c_message_get_packed_size(record);
+	uint8_t *buf = mem_alloc(len ? len : 1);
+	protobuf_c_message_pack(record, buf);
+
+	ContainerEvent event = CONTAINER_EVENT__INIT;
+	event.kind = CONTAINER_EVENT__KIND__AUDIT;
+	event.container_uuid = uuid ? (char *)uuid_string(uuid) : NULL;
+	event.has_audit_record = true;
+	event.audit_record.data = buf;
+	event.audit_record.len = len;
+	control_container_observers_send(&event);
+
+	mem_free0(buf);
+}
+
+void
+control_notify_pressure(const psi_event_t *event)
+{
+	ASSERT(event);
+	IF_TRUE_RETURN(!control_pressure_observer_list && !control_container_observer_list);
+
+	PressureEvent pressure = PRESSURE_EVENT__INIT;
+	switch (event->resource) {
+	case PSI_CPU:
+		pressure.resource = PRESSURE_EVENT__RESOURCE__CPU;
+		break;
+	case PSI_MEMORY:
+		pressure.resource = PRESSURE_EVENT__RESOURCE__MEMORY;
+		break;
+	default:
+		pressure.resource = PRESSURE_EVENT__RESOURCE__IO;
+		break;
+	}
+	if (event->container)
+		pressure.container_uuid =
+			(char *)uuid_string(container_get_uuid(event->container));
+	pressure.has_full = true;
+	pressure.full = event->full;
+	pressure.has_avg10 = true;
+	pressure.avg10 = event->avg10;
+	pressure.has_avg60 = true;
+	pressure.avg60 = event->avg60;
+	pressure.action = (char *)event->action;
+
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__PRESSURE_EVENT;
+	out.pressure_event = &pressure;
+
+	for (list_t *l = control_pressure_observer_list; l; l = l->next) {
+		int fd = *(int *)l->data;
+		if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0)
+			WARN("Could not send pressure event to client on fd %d", fd);
+	}
+
+	ContainerEvent container_event = CONTAINER_EVENT__INIT;
+	container_event.kind = CONTAINER_EVENT__KIND__PRESSURE;
+	container_event.container_uuid = pressure.container_uuid;
+	container_event.pressure = &pressure;
+	control_container_observers_send(&container_event);
+}
+
+/**
+ * Handles get_audit_stats cmd.
+ */
+static void
+control_handle_cmd_get_audit_stats(int fd)
+{
+	audit_kernel_stats_t stats;
+	audit_get_kernel_stats(&stats);
+	audit_delivery_stats_t delivery;
+	audit_get_delivery_stats(&delivery);
+
+	AuditStats out_stats = AUDIT_STATS__INIT;
+	out_stats.has_messages = true;
+	out_stats.messages = stats.messages;
+	out_stats.has_batches = true;
+	out_stats.batches = stats.batches;
+	out_stats.has_max_batch = true;
+	out_stats.max_batch = stats.max_batch;
+	out_stats.has_enobufs = true;
+	out_stats.enobufs = stats.enobufs;
+	out_stats.has_invalid = true;
+	out_stats.invalid = stats.invalid;
+	out_stats.has_records = true;
+	out_stats.records = delivery.records;
+	out_stats.has_dropped = true;
+	out_stats.dropped = delivery.dropped;
+	out_stats.has_spilled = true;
+	out_stats.spilled = delivery.spilled;
+	out_stats.has_sent = true;
+	out_stats.sent = delivery.sent;
+	out_stats.has_acked = true;
+	out_stats.acked = delivery.acked;
+	out_stats.has_acks = true;
+	out_stats.acks = delivery.acks;
+	out_stats.has_ack_rtt_ns = true;
+	out_stats.ack_rtt_ns = delivery.ack_rtt_ns;
+	out_stats.has_max_ack_rtt_ns = true;
+	out_stats.max_ack_rtt_ns = delivery.max_ack_rtt_ns;
+	out_stats.n_ack_rtt_histogram = EVENT_PROFILE_BUCKETS;
+	out_stats.ack_rtt_histogram = delivery.ack_rtt_histogram;
+	out_stats.has_backlog_bytes = true;
+	out_stats.backlog_bytes = delivery.backlog_bytes;
+
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__AUDIT_STATS;
+	out.audit_stats = &out_stats;
+	if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		WARN("Could not send audit stats");
+	}
+}
+
+/**
+ * Handles get_uevent_stats cmd.
+ */
+static void
+control_handle_cmd_get_uevent_stats(int fd)
+{
+	uevent_stats_t stats;
+	uevent_get_stats(&stats);
+
+	UeventStats out_stats = UEVENT_STATS__INIT;
+	out_stats.has_messages = true;
+	out_stats.messages = stats.messages;
+	out_stats.has_batches = true;
+	out_stats.batches = stats.batches;
+	out_stats.has_max_batch = true;
+	out_stats.max_batch = stats.max_batch;
+	out_stats.has_enobufs = true;
+	out_stats.enobufs = stats.enobufs;
+	out_stats.has_invalid = true;
+	out_stats.invalid = stats.invalid;
+	out_stats.has_handle_ns = true;
+	out_stats.handle_ns = stats.handle_ns;
+	out_stats.has_max_handle_ns = true;
+	out_stats.max_handle_ns = stats.max_handle_ns;
+	out_stats.n_histogram = EVENT_PROFILE_BUCKETS;
+	out_stats.histogram = stats.histogram;
+
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__UEVENT_STATS;
+	out.uevent_stats = &out_stats;
+	if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		WARN("Could not send uevent stats");
+	}
+}
+
+/**
+ * Handles get_metrics cmd.
+ */
+static void
+control_handle_cmd_get_metrics(int fd)
+{
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__METRICS;
+	out.metrics = metrics_format_new();
+	if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		WARN("Could not send metrics");
+	}
+	mem_free0(out.metrics);
+}
+
+static void
+control_handle_cmd_get_mem_stats(int fd)
+{
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__MEM_STATS;
+	out.mem_stats = exporter_mem_stats_new(CONTROL_MEM_STATS_SITES);
+	if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		WARN("Could not send memory statistics");
+	}
+	mem_free0(out.mem_stats);
+}
+
 /**
  * Handles push_guestos_configs cmd
  * Used in both priv and unpriv control handlers.
@@ -631,48 +1573,287 @@ control_handle_container_start(control_t *control, container_t *container,
 			control_send_message(CONTROL_RESPONSE_CONTAINER_START_OK, fd);
 		}
 	}
-	return res;
+	return res;
+}
+
+static int
+control_handle_container_stop(control_t *control, container_t *container,
+			      ContainerStartParams *start_params, int fd)
+{
+	int res = -1;
+
+	// Check if pin should be interactively requested via pin pad reader
+	if (container_get_usb_pin_entry(container)) {
+		TRACE("Container stop with pin entry chosen. Stopping");
+		res = input_register_container_ctrl_cb(control, container,
+						       CMLD_CONTAINER_CTRL_STOP);
+		if (res != 0) {
+			control_send_message(CONTROL_RESPONSE_CONTAINER_USB_PIN_ENTRY_FAIL, fd);
+		}
+	} else if (start_params) {
+		char *key = start_params->key;
+		TRACE("Default container stop without pin entry chosen. Stopping");
+		res = cmld_container_ctrl_with_smartcard(control, container, key,
+							 CMLD_CONTAINER_CTRL_STOP);
+		if (res != 0) {
+			ERROR("Failed to stop container %s", container_get_name(container));
+			// TODO control_send_message required here? also check in start function
+		}
+	} else if (container_is_encrypted(container)) {
+		res = -1;
+		control_send_message(CONTROL_RESPONSE_CONTAINER_STOP_PASSWD_WRONG, fd);
+	} else {
+		// TODO if the modules cannot be stopped successfully, the container is killed. The return
+		// value in this case is CONTAINER_ERROR, even if the container was killed. This is
+		// ignored atm and just STOP_OK is returned. How should we treat this?
+		res = cmld_container_stop(container);
+		if (res == -1) {
+			control_send_message(CONTROL_RESPONSE_CONTAINER_STOP_FAILED_NOT_RUNNING,
+					     fd);
+		} else {
+			control_send_message(CONTROL_RESPONSE_CONTAINER_STOP_OK, fd);
+		}
+	}
+	return res;
+}
+
+/**
+ * Handles create_container cmd, once a signed config has been verified.
+ */
+static void
+control_handle_cmd_create_container(const ControllerToDaemon *msg, int fd)
+{
+	char **cuuid_str = NULL;
+	ContainerConfig **ccfg = NULL;
+
+	// build default response message for controller
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINER_CONFIG;
+	out.n_container_configs = 0;
+	out.n_container_uuids = 0;
+
+	if (!msg->has_container_config_file || msg->container_config_file.data == NULL) {
+		WARN("CREATE_CONTAINER without config file does not work, doing nothing...");
+		if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0)
+			WARN("Could not send empty Response to CREATE");
+		return;
+	}
+	container_t *c = NULL;
+	if (msg->has_container_config_signature && msg->has_container_config_certificate) {
+		c = cmld_container_create_from_config(msg->container_config_file.data,
+						      msg->container_config_file.len,
+						      msg->container_config_signature.data,
+						      msg->container_config_signature.len,
+						      msg->container_config_certificate.data,
+						      msg->container_config_certificate.len);
+	} else {
+		c = cmld_container_create_from_config(msg->container_config_file.data,
+						      msg->container_config_file.len, NULL, 0,
+						      NULL, 0);
+	}
+	if (NULL == c) {
+		if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0)
+			WARN("Could not send empty Response to CREATE");
+		return;
+	}
+
+	ccfg = mem_new(ContainerConfig *, 1);
+	file_writer_flush(container_get_config_filename(c));
+	ccfg[0] = (ContainerConfig *)protobuf_message_new_from_textfile(
+		container_get_config_filename(c), &container_config__descriptor);
+	cuuid_str = mem_new(char *, 1);
+	cuuid_str[0] = mem_strdup(uuid_string(container_get_uuid(c)));
+
+	if (!ccfg[0]) {
+		ERROR("Failed to get new config for %s", cuuid_str[0]);
+		mem_free0(ccfg);
+		mem_free0(cuuid_str[0]);
+		mem_free0(cuuid_str);
+		if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0)
+			WARN("Could not send empty Response to CREATE");
+		return;
+	}
+	// build and send response message to controller
+	out.n_container_configs = 1;
+	out.container_configs = ccfg;
+	out.n_container_uuids = 1;
+	out.container_uuids = cuuid_str;
+	if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		WARN("Could not send container config as Response to CREATE");
+	}
+	mem_free0(cuuid_str[0]);
+	mem_free0(cuuid_str);
+	protobuf_free_message((ProtobufCMessage *)ccfg[0]);
+	mem_free0(ccfg);
+}
+
+/**
+ * Handles container_update_config cmd, once a signed config has been verified.
+ */
+static void
+control_handle_cmd_container_update_config(container_t *container, const ControllerToDaemon *msg,
+					   int fd)
+{
+	int res;
+	char **cuuid_str = NULL;
+	ContainerConfig **ccfg = NULL;
+
+	// build default response message for controller
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINER_CONFIG;
+	out.n_container_configs = 0;
+	out.n_container_uuids = 0;
+
+	if (NULL == container) {
+		WARN("Container does not exist!");
+		if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0)
+			WARN("Could not send empty Response to UPDATE_CONFIG");
+		return;
+	}
+	if (!msg->has_container_config_file) {
+		WARN("UPDATE_CONFIG without config file does not work, doing nothing...");
+		if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0)
+			WARN("Could not send empty Response to UPDATE_CONFIG");
+		return;
+	}
+	if (msg->has_container_config_signature && msg->has_container_config_certificate) {
+		res = container_update_config(container, msg->container_config_file.data,
+					      msg->container_config_file.len,
+					      msg->container_config_signature.data,
+					      msg->container_config_signature.len,
+					      msg->container_config_certificate.data,
+					      msg->container_config_certificate.len);
+	} else {
+		res = container_update_config(container, msg->container_config_file.data,
+					      msg->container_config_file.len, NULL, 0, NULL, 0);
+	}
+	if (res) {
+		if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0)
+			WARN("Could not send empty Response to UPDATE_CONFIG");
+		return;
+	}
+
+	ccfg = mem_new(ContainerConfig *, 1);
+	// the updated config is sent back as stored
+	file_writer_flush(container_get_config_filename(container));
+	ccfg[0] = (ContainerConfig *)protobuf_message_new_from_textfile(
+		container_get_config_filename(container), &container_config__descriptor);
+	cuuid_str = mem_new(char *, 1);
+	cuuid_str[0] = mem_strdup(uuid_string(container_get_uuid(container)));
+
+	if (!ccfg[0]) {
+		ERROR("Failed to get new config for %s", cuuid_str[0]);
+		mem_free0(ccfg);
+		mem_free0(cuuid_str[0]);
+		mem_free0(cuuid_str);
+		if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0)
+			WARN("Could not send empty Response to UPDATE_CONFIG");
+		return;
+	}
+	// reload configs if container is in state
+	container_state_t state = container_get_state(container);
+	if (state == CONTAINER_STATE_STOPPED)
+		cmld_reload_containers();
+
+	// build and send response message to controller
+	out.n_container_configs = 1;
+	out.container_configs = ccfg;
+	out.n_container_uuids = 1;
+	out.container_uuids = cuuid_str;
+	if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		WARN("Could not send container config as Response to UPDATE_CONFIG");
+	}
+	mem_free0(cuuid_str[0]);
+	mem_free0(cuuid_str);
+	protobuf_free_message((ProtobufCMessage *)ccfg[0]);
+	mem_free0(ccfg);
 }
 
-static int
-control_handle_container_stop(control_t *control, container_t *container,
-			      ContainerStartParams *start_params, int fd)
+/**
+ * A CREATE_CONTAINER or CONTAINER_UPDATE_CONFIG command with a signed config, which is
+ * handled once the config has been verified by scd instead of blocking on it.
+ */
+typedef struct control_verify_job {
+	int fd;			 // client connection, -1 if it has been closed meanwhile
+	ControllerToDaemon *msg; // copy of the command, as the received one is freed
+} control_verify_job_t;
+
+static list_t *control_verify_job_list = NULL;
+
+static void
+control_verify_job_cancel(int fd)
 {
-	int res = -1;
+	for (list_t *l = control_verify_job_list; l; l = l->next) {
+		control_verify_job_t *job = l->data;
+		if (job->fd == fd)
+			job->fd = -1;
+	}
+}
 
-	// Check if pin should be interactively requested via pin pad reader
-	if (container_get_usb_pin_entry(container)) {
-		TRACE("Container stop with pin entry chosen. Stopping");
-		res = input_register_container_ctrl_cb(control, container,
-						       CMLD_CONTAINER_CTRL_STOP);
-		if (res != 0) {
-			control_send_message(CONTROL_RESPONSE_CONTAINER_USB_PIN_ENTRY_FAIL, fd);
-		}
-	} else if (start_params) {
-		char *key = start_params->key;
-		TRACE("Default container stop without pin entry chosen. Stopping");
-		res = cmld_container_ctrl_with_smartcard(control, container, key,
-							 CMLD_CONTAINER_CTRL_STOP);
-		if (res != 0) {
-			ERROR("Failed to stop container %s", container_get_name(container));
-			// TODO control_send_message required here? also check in start function
-		}
-	} else if (container_is_encrypted(container)) {
-		res = -1;
-		control_send_message(CONTROL_RESPONSE_CONTAINER_STOP_PASSWD_WRONG, fd);
+static void
+control_verify_config_cb(bool verified, void *data)
+{
+	control_verify_job_t *job = data;
+	ASSERT(job);
+
+	control_verify_job_list = list_remove(control_verify_job_list, job);
+
+	if (job->fd < 0) {
+		DEBUG("Control connection closed during config verification, dropping command");
+	} else if (job->msg->command == CONTROLLER_TO_DAEMON__COMMAND__CREATE_CONTAINER) {
+		DEBUG("Pushed container config verified (%s)", verified ? "GOOD" : "FAILED");
+		control_handle_cmd_create_container(job->msg, job->fd);
 	} else {
-		// TODO if the modules cannot be stopped successfully, the container is killed. The return
-		// value in this case is CONTAINER_ERROR, even if the container was killed. This is
-		// ignored atm and just STOP_OK is returned. How should we treat this?
-		res = cmld_container_stop(container);
-		if (res == -1) {
-			control_send_message(CONTROL_RESPONSE_CONTAINER_STOP_FAILED_NOT_RUNNING,
-					     fd);
-		} else {
-			control_send_message(CONTROL_RESPONSE_CONTAINER_STOP_OK, fd);
-		}
+		DEBUG("Pushed container config verified (%s)", verified ? "GOOD" : "FAILED");
+		// the container may have been removed meanwhile
+		control_handle_cmd_container_update_config(
+			control_get_container_by_uuid_string(job->msg->container_uuids[0]),
+			job->msg, job->fd);
 	}
-	return res;
+
+	protobuf_free_message((ProtobufCMessage *)job->msg);
+	mem_free0(job);
+}
+
+/**
+ * Starts the asynchronous verification of the signed config pushed by msg, which
+ * container_config_new() then uses instead of a blocking round trip to scd.
+ *
+ * @return true if msg is handled by control_verify_config_cb() later on
+ */
+static bool
+control_verify_config_deferred(const ControllerToDaemon *msg, int fd)
+{
+	IF_FALSE_RETVAL(cmld_uses_signed_configs(), false);
+	IF_FALSE_RETVAL(msg->has_container_config_file && msg->container_config_file.data &&
+				msg->has_container_config_signature &&
+				msg->has_container_config_certificate,
+			false);
+
+	uint8_t *packed = NULL;
+	uint32_t packed_len = protobuf_pack_message_new((ProtobufCMessage *)msg, &packed);
+	ControllerToDaemon *copy = (ControllerToDaemon *)protobuf_unpack_message(
+		&controller_to_daemon__descriptor, packed, packed_len);
+	mem_free0(packed);
+	IF_NULL_RETVAL(copy, false);
+
+	control_verify_job_t *job = mem_new0(control_verify_job_t, 1);
+	job->fd = fd;
+	job->msg = copy;
+
+	if (container_config_verify_async(
+		    copy->container_config_file.data, copy->container_config_file.len,
+		    copy->container_config_signature.data, copy->container_config_signature.len,
+		    copy->container_config_certificate.data,
+		    copy->container_config_certificate.len, control_verify_config_cb, job) < 0) {
+		// falls back to the blocking verification
+		protobuf_free_message((ProtobufCMessage *)copy);
+		mem_free0(job);
+		return false;
+	}
+
+	control_verify_job_list = list_append(control_verify_job_list, job);
+	return true;
 }
 
 static bool
@@ -685,6 +1866,7 @@ control_check_command(control_t *control, const ControllerToDaemon *msg)
 	if (!((msg->command == CONTROLLER_TO_DAEMON__COMMAND__LIST_GUESTOS_CONFIGS) ||
 	      (msg->command == CONTROLLER_TO_DAEMON__COMMAND__LIST_CONTAINERS) ||
 	      (msg->command == CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_STATUS) ||
+	      (msg->command == CONTROLLER_TO_DAEMON__COMMAND__OBSERVE_CONTAINERS) ||
 	      (msg->command == CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_CONFIG) ||
 	      (msg->command == CONTROLLER_TO_DAEMON__COMMAND__PUSH_GUESTOS_CONFIG) ||
 	      (msg->command == CONTROLLER_TO_DAEMON__COMMAND__RELOAD_CONTAINERS) ||
@@ -731,6 +1913,10 @@ control_check_command(control_t *control, const ControllerToDaemon *msg)
 	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_START) ||
 	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_UPDATE_CONFIG) ||
 	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_STATUS) ||
+	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_GET_STATS) ||
+	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__OBSERVE_PRESSURE) ||
+	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__OBSERVE_CONTAINERS) ||
+	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_GET_START_TRACES) ||
 	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_CMLD_HANDLES_PIN) ||
 	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_STOP) ||
 	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__PUSH_GUESTOS_CONFIG)) {
@@ -800,13 +1986,13 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 	case CONTROLLER_TO_DAEMON__COMMAND__LIST_CONTAINERS: {
 		// assemble list of relevant containers and allocate memory for result
 		size_t n = cmld_containers_get_count();
-		char **results = mem_new(char *, n);
+		char **results = mem_arena_alloc(control->arena, n * sizeof(char *));
 
 		// fill result with data from guestos
 		for (size_t i = 0; i < n; i++) {
 			container_t *container = cmld_container_get_by_index(i);
 			const char *uuid = uuid_string(container_get_uuid(container));
-			results[i] = mem_strdup(uuid);
+			results[i] = mem_arena_strdup(control->arena, uuid);
 		}
 
 		// build and send response message to controller
@@ -814,14 +2000,9 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 		out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINERS_LIST;
 		out.n_container_uuids = n;
 		out.container_uuids = results;
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0) {
 			WARN("Could not send list of containers to MDM");
 		}
-
-		// collect garbage
-		for (size_t i = 0; i < n; i++)
-			mem_free0(results[i]);
-		mem_free0(results);
 	} break;
 
 	case CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_STATUS: {
@@ -829,28 +2010,44 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 		list_t *containers = control_build_container_list_from_uuids(msg->n_container_uuids,
 									     msg->container_uuids);
 		size_t n = list_length(containers);
-		ContainerStatus **results = mem_new(ContainerStatus *, n);
+		ContainerStatus **results =
+			mem_arena_alloc(control->arena, n * sizeof(ContainerStatus *));
 
-		// fill result with data from container
-		for (size_t i = 0; i < n; i++) {
-			container_t *container = list_nth_data(containers, i);
-			results[i] = control_container_status_new(container);
+		uint32_t fields = msg->n_status_fields > 0 ? 0 : CONTROL_STATUS_FIELDS_ALL;
+		for (size_t i = 0; i < msg->n_status_fields; i++) {
+			if (msg->status_fields[i] < 32)
+				fields |= 1u << msg->status_fields[i];
 		}
 
-		// build and send response message to controller
 		DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
 		out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINER_STATUS;
-		out.n_container_status = n;
+		out.has_status_generation = true;
+		out.status_generation = container_get_current_status_generation();
+
+		// fill result with data from matching containers of the requested page
+		size_t matches = 0;
+		for (list_t *l = containers; l; l = l->next) {
+			if (!control_container_status_matches(msg, l->data))
+				continue;
+			if (matches++ < msg->status_offset)
+				continue;
+			if (msg->status_limit && out.n_container_status == msg->status_limit) {
+				out.has_status_next_offset = true;
+				out.status_next_offset = msg->status_offset + msg->status_limit;
+				break;
+			}
+			results[out.n_container_status++] =
+				control_container_status_new(control->arena, l->data, fields);
+		}
 		out.container_status = results;
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+
+		// build and send response message to controller
+		if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0) {
 			WARN("Could not send container status to MDM");
 		}
 
 		// collect garbage
 		list_delete(containers);
-		for (size_t i = 0; i < n; i++)
-			control_container_status_free(results[i]);
-		mem_free0(results);
 	} break;
 
 	case CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_CONFIG: {
@@ -877,6 +2074,7 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 			} else {
 				TRACE("Container %s has config file; appending to list...",
 				      container_get_name(container));
+				file_writer_flush(config_filename);
 				results[number_of_configs] =
 					(ContainerConfig *)protobuf_message_new_from_textfile(
 						config_filename, &container_config__descriptor);
@@ -945,7 +2143,7 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 			out.n_container_uuids = number_of_configs;
 			out.container_uuids = result_uuids;
 		}
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0) {
 			WARN("Could not send container configs to MDM");
 		}
 
@@ -961,9 +2159,91 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 	} break;
 
 	case CONTROLLER_TO_DAEMON__COMMAND__GET_LAST_LOG: {
+#ifdef DEBUG_BUILD
+		uint64_t offset = msg->has_log_offset ? msg->log_offset : 0;
+		int ret = control_log_transfer_start(fd, "/proc/last_kmsg", false, offset);
+		if (offset == 0 && control_log_transfer_start(fd, "/dev/log/main", true, 0) == 0)
+			ret = 0;
+		if (ret < 0)
+			control_send_message(CONTROL_RESPONSE_CMD_FAILED, fd);
+#else
 		WARN("Due to privacy concerns this command is currently not supported.");
-		//control_send_log_file(fd, "/proc/last_kmsg", false, false);
-		//control_send_log_file(fd, "/dev/log/main", true, true);
+#endif
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__GET_EVENT_PROFILE: {
+		control_handle_cmd_get_event_profile(fd);
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__GET_AUDIT_STATS: {
+		control_handle_cmd_get_audit_stats(fd);
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__GET_DOWNLOAD_PROGRESS: {
+		control_handle_cmd_get_download_progress(fd);
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__OBSERVE_PRESSURE: {
+		control_handle_cmd_observe_pressure(fd);
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__OBSERVE_CONTAINERS: {
+		control_handle_cmd_observe_containers(msg, fd);
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__GET_UEVENT_STATS: {
+		control_handle_cmd_get_uevent_stats(fd);
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__GET_METRICS: {
+		control_handle_cmd_get_metrics(fd);
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__GET_MEM_STATS: {
+		control_handle_cmd_get_mem_stats(fd);
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__UEVENT_REPLAY_SOURCE: {
+#ifdef DEBUG_BUILD
+		uevent_set_replay_port(msg->has_uevent_replay_port ? msg->uevent_replay_port : 0);
+		control_send_message(CONTROL_RESPONSE_CMD_OK, fd);
+#else
+		WARN("Replaying uevents is only supported in debug builds.");
+		control_send_message(CONTROL_RESPONSE_CMD_FAILED, fd);
+#endif
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__SAMPLER_START:
+	case CONTROLLER_TO_DAEMON__COMMAND__SAMPLER_STOP: {
+		bool start = msg->command == CONTROLLER_TO_DAEMON__COMMAND__SAMPLER_START;
+		switch (msg->sampler_target) {
+		case CONTROLLER_TO_DAEMON__SAMPLER_TARGET__SCD:
+			res = smartcard_sampler_ctrl(start, msg->sampler_hz, msg->sampler_interval);
+			break;
+		case CONTROLLER_TO_DAEMON__SAMPLER_TARGET__TPM2D:
+			res = tss_sampler_ctrl(start, msg->sampler_hz, msg->sampler_interval);
+			break;
+		default:
+			res = 0;
+			if (start)
+				res = sampler_start(LOGFILE_DIR "/cmld.folded", msg->sampler_hz,
+						    msg->sampler_interval);
+			else
+				sampler_stop();
+		}
+		control_send_message(res ? CONTROL_RESPONSE_CMD_FAILED : CONTROL_RESPONSE_CMD_OK,
+				     fd);
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__EVENT_PROFILE_START: {
+		event_profile_reset();
+		event_profile_enable(true);
+		control_send_message(CONTROL_RESPONSE_CMD_OK, fd);
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__EVENT_PROFILE_STOP: {
+		event_profile_enable(false);
+		control_send_message(CONTROL_RESPONSE_CMD_OK, fd);
 	} break;
 
 	case CONTROLLER_TO_DAEMON__COMMAND__PUSH_GUESTOS_CONFIG: {
@@ -1012,7 +2292,7 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 	} break;
 
 	case CONTROLLER_TO_DAEMON__COMMAND__REBOOT_DEVICE: {
-		res = reboot_reboot(REBOOT);
+		res = cmld_reboot_device();
 		control_send_message(res ? CONTROL_RESPONSE_CMD_FAILED : CONTROL_RESPONSE_CMD_OK,
 				     fd);
 	} break;
@@ -1025,7 +2305,7 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 		out.has_device_csr = csr ? true : false;
 		out.device_csr.data = csr;
 
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0) {
 			WARN("Could not send device csr!");
 		}
 		if (csr)
@@ -1048,69 +2328,10 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 				     fd);
 	} break;
 
-	case CONTROLLER_TO_DAEMON__COMMAND__CREATE_CONTAINER: {
-		char **cuuid_str = NULL;
-		ContainerConfig **ccfg = NULL;
-
-		// build default response message for controller
-		DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
-		out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINER_CONFIG;
-		out.n_container_configs = 0;
-		out.n_container_uuids = 0;
-
-		if (!msg->has_container_config_file || msg->container_config_file.data == NULL) {
-			WARN("CREATE_CONTAINER without config file does not work, doing nothing...");
-			if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0)
-				WARN("Could not send empty Response to CREATE");
-			break;
-		}
-		container_t *c = NULL;
-		if (msg->has_container_config_signature && msg->has_container_config_certificate) {
-			c = cmld_container_create_from_config(
-				msg->container_config_file.data, msg->container_config_file.len,
-				msg->container_config_signature.data,
-				msg->container_config_signature.len,
-				msg->container_config_certificate.data,
-				msg->container_config_certificate.len);
-		} else {
-			c = cmld_container_create_from_config(msg->container_config_file.data,
-							      msg->container_config_file.len, NULL,
-							      0, NULL, 0);
-		}
-		if (NULL == c) {
-			if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0)
-				WARN("Could not send empty Response to CREATE");
-			break;
-		}
-
-		ccfg = mem_new(ContainerConfig *, 1);
-		ccfg[0] = (ContainerConfig *)protobuf_message_new_from_textfile(
-			container_get_config_filename(c), &container_config__descriptor);
-		cuuid_str = mem_new(char *, 1);
-		cuuid_str[0] = mem_strdup(uuid_string(container_get_uuid(c)));
-
-		if (!ccfg[0]) {
-			ERROR("Failed to get new config for %s", cuuid_str[0]);
-			mem_free0(ccfg);
-			mem_free0(cuuid_str[0]);
-			mem_free0(cuuid_str);
-			if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0)
-				WARN("Could not send empty Response to CREATE");
-			break;
-		}
-		// build and send response message to controller
-		out.n_container_configs = 1;
-		out.container_configs = ccfg;
-		out.n_container_uuids = 1;
-		out.container_uuids = cuuid_str;
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
-			WARN("Could not send container config as Response to CREATE");
-		}
-		mem_free0(cuuid_str[0]);
-		mem_free0(cuuid_str);
-		protobuf_free_message((ProtobufCMessage *)ccfg[0]);
-		mem_free0(ccfg);
-	} break;
+	case CONTROLLER_TO_DAEMON__COMMAND__CREATE_CONTAINER:
+		IF_TRUE_RETURN(control_verify_config_deferred(msg, fd));
+		control_handle_cmd_create_container(msg, fd);
+		break;
 
 	// Container-specific commands:
 	case CONTROLLER_TO_DAEMON__COMMAND__REMOVE_CONTAINER:
@@ -1124,79 +2345,10 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 				     fd);
 		break;
 
-	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_UPDATE_CONFIG: {
-		char **cuuid_str = NULL;
-		ContainerConfig **ccfg = NULL;
-
-		// build default response message for controller
-		DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
-		out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINER_CONFIG;
-		out.n_container_configs = 0;
-		out.n_container_uuids = 0;
-
-		if (NULL == container) {
-			WARN("Container does not exist!");
-			if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0)
-				WARN("Could not send empty Response to UPDATE_CONFIG");
-			break;
-		}
-		if (!msg->has_container_config_file) {
-			WARN("UPDATE_CONFIG without config file does not work, doing nothing...");
-			if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0)
-				WARN("Could not send empty Response to UPDATE_CONFIG");
-			break;
-		}
-		if (msg->has_container_config_signature && msg->has_container_config_certificate) {
-			res = container_update_config(container, msg->container_config_file.data,
-						      msg->container_config_file.len,
-						      msg->container_config_signature.data,
-						      msg->container_config_signature.len,
-						      msg->container_config_certificate.data,
-						      msg->container_config_certificate.len);
-		} else {
-			res = container_update_config(container, msg->container_config_file.data,
-						      msg->container_config_file.len, NULL, 0, NULL,
-						      0);
-		}
-		if (res) {
-			if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0)
-				WARN("Could not send empty Response to UPDATE_CONFIG");
-			break;
-		}
-
-		ccfg = mem_new(ContainerConfig *, 1);
-		ccfg[0] = (ContainerConfig *)protobuf_message_new_from_textfile(
-			container_get_config_filename(container), &container_config__descriptor);
-		cuuid_str = mem_new(char *, 1);
-		cuuid_str[0] = mem_strdup(uuid_string(container_get_uuid(container)));
-
-		if (!ccfg[0]) {
-			ERROR("Failed to get new config for %s", cuuid_str[0]);
-			mem_free0(ccfg);
-			mem_free0(cuuid_str[0]);
-			mem_free0(cuuid_str);
-			if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0)
-				WARN("Could not send empty Response to UPDATE_CONFIG");
-			break;
-		}
-		// reload configs if container is in state
-		container_state_t state = container_get_state(container);
-		if (state == CONTAINER_STATE_STOPPED)
-			cmld_reload_containers();
-
-		// build and send response message to controller
-		out.n_container_configs = 1;
-		out.container_configs = ccfg;
-		out.n_container_uuids = 1;
-		out.container_uuids = cuuid_str;
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
-			WARN("Could not send container config as Response to UPDATE_CONFIG");
-		}
-		mem_free0(cuuid_str[0]);
-		mem_free0(cuuid_str);
-		protobuf_free_message((ProtobufCMessage *)ccfg[0]);
-		mem_free0(ccfg);
-	} break;
+	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_UPDATE_CONFIG:
+		IF_TRUE_RETURN(container && control_verify_config_deferred(msg, fd));
+		control_handle_cmd_container_update_config(container, msg, fd);
+		break;
 	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_START: {
 		if (NULL == container) {
 			audit_log_event(NULL, FSA, CMLD, CONTAINER_MGMT,
@@ -1267,6 +2419,13 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 				     fd);
 		break;
 
+	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_CHECKPOINT:
+		IF_NULL_RETURN(container);
+		res = cmld_container_checkpoint(container);
+		control_send_message(res ? CONTROL_RESPONSE_CMD_FAILED : CONTROL_RESPONSE_CMD_OK,
+				     fd);
+		break;
+
 	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_ASSIGNIFACE: {
 		IF_NULL_RETURN(container);
 		if (!msg->assign_iface_params || !msg->assign_iface_params->iface_name) {
@@ -1309,68 +2468,36 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 		out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINER_IFACES;
 
 		size_t n = list_length(link_list);
-		char **results = mem_new(char *, n);
+		char **results = mem_arena_alloc(control->arena, n * sizeof(char *));
 
-		for (size_t i = 0; i < n; i++) {
-			char *link_line = list_nth_data(link_list, i);
-			results[i] = mem_strdup(link_line);
-		}
+		size_t i = 0;
+		for (list_t *l = link_list; l; l = l->next)
+			results[i++] = l->data;
 
 		out.n_container_ifaces = n;
 		out.container_ifaces = results;
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0) {
 			WARN("Could not send container network interfaces to MDM");
 		}
 
 		// collect garbage
+		for (list_t *l = link_list; l; l = l->next)
+			mem_free0(l->data);
 		list_delete(link_list);
-		for (size_t i = 0; i < n; i++)
-			mem_free0(results[i]);
-		mem_free0(results);
 	} break;
 
-	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_EXEC_CMD: {
+	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_EXEC_CMD:
 		IF_NULL_RETURN(container);
-		TRACE("Got exec command: %s, attach PTY: %d", msg->exec_command, msg->exec_pty);
-		if (!msg->exec_command || !msg->has_exec_pty) {
-			ERROR("Missing command or exec_pty info");
-			break;
-		}
-		if (container_run(container, msg->exec_pty, msg->exec_command, msg->n_exec_args,
-				  msg->exec_args, fd) < 0) {
-			ERROR("Failed to exec");
-
-			DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
-			out.code = DAEMON_TO_CONTROLLER__CODE__EXEC_END;
-
-			if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
-				WARN("Could not send exec output to MDM");
-			}
-
-			TRACE("Sent notification of command termination to control client");
-			break;
-
-		} else {
-			DEBUG("Registering read callback for cmld console socket");
-			int *cfd = mem_new(int, 1);
-			*cfd = fd;
-			event_io_t *event =
-				event_io_new(container_get_console_sock_cmld(container, fd),
-					     EVENT_IO_READ | EVENT_IO_EXCEPT,
-					     control_cb_read_console, cfd);
-			event_add_io(event);
-		}
-	} break;
+		control_handle_cmd_container_exec(container, msg, fd);
+		break;
 
-	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_EXEC_INPUT: {
-		IF_NULL_RETURN(container);
-		TRACE("Got input for exec'ed process. Sending message on fd");
+	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_EXEC_INPUT:
+		control_handle_cmd_container_exec_input(msg, fd);
+		break;
 
-		int ret = container_write_exec_input(container, msg->exec_input, fd);
-		if (ret < 0) {
-			ERROR_ERRNO("Failed to write input to exec'ed process");
-		}
-	} break;
+	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_EXEC_WINDOW:
+		control_handle_cmd_container_exec_window(msg, fd);
+		break;
 
 	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_CHANGE_TOKEN_PIN: {
 		IF_NULL_RETURN(container);
@@ -1382,13 +2509,24 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 						msg->device_newpin);
 	} break;
 
+	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_GET_STATS:
+		IF_NULL_RETURN(container);
+		control_handle_cmd_container_get_stats(
+			container, msg->has_stats_since ? msg->stats_since : 0, fd);
+		break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_GET_START_TRACES:
+		IF_NULL_RETURN(container);
+		control_handle_cmd_container_get_start_traces(container, fd);
+		break;
+
 	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_CMLD_HANDLES_PIN: {
 		IF_NULL_RETURN(container);
 		DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
 		out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINER_CMLD_HANDLES_PIN;
 		out.has_container_cmld_handles_pin = true;
 		out.container_cmld_handles_pin = container_get_usb_pin_entry(container);
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0) {
 			WARN("Could not send container cmld handles pin info");
 		}
 	} break;
@@ -1400,6 +2538,74 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 	}
 }
 
+/**
+ * Handles a ControllerToDaemon message and accounts its handling time.
+ */
+static void
+control_handle_message_measured(control_t *control, const ControllerToDaemon *msg, int fd)
+{
+	uint64_t begin = metrics_now_ns();
+	control_handle_message(control, msg, fd);
+	metrics_observe(control_metrics_handle, metrics_now_ns() - begin);
+}
+
+/**
+ * Returns the framed message reader of the given client connection,
+ * creating it on first use.
+ */
+static protobuf_reader_t *
+control_reader_get(control_t *control, int fd)
+{
+	for (list_t *l = control->readers; l; l = l->next) {
+		protobuf_reader_t *reader = l->data;
+		if (protobuf_reader_get_fd(reader) == fd)
+			return reader;
+	}
+
+	protobuf_reader_t *reader = protobuf_reader_new(fd);
+	control->readers = list_prepend(control->readers, reader);
+	return reader;
+}
+
+/**
+ * Sets up the framed message reader and the outbound queue of a new client connection.
+ */
+static void
+control_client_add(control_t *control, int fd)
+{
+	control_reader_get(control, fd);
+	protobuf_writer_t *writer = protobuf_writer_new(fd, 0, NULL, NULL);
+	if (!writer)
+		WARN("Could not create outbound queue for fd %d, sending synchronously", fd);
+	else if (control->type == AF_INET)
+		// replies and events to the remote host go out batched per loop iteration
+		protobuf_writer_set_coalescing(writer, true);
+}
+
+/**
+ * Drops the framed message reader, the outbound queue and all pending data
+ * of a client connection which is about to be closed.
+ */
+static void
+control_client_release(control_t *control, int fd)
+{
+	control_log_transfer_cancel(fd);
+	control_exec_channel_cancel(fd);
+	control_pressure_observer_cancel(fd);
+	control_container_observer_cancel(fd);
+	control_verify_job_cancel(fd);
+	protobuf_writer_free(protobuf_writer_get_by_fd(fd));
+
+	for (list_t *l = control->readers; l; l = l->next) {
+		protobuf_reader_t *reader = l->data;
+		if (protobuf_reader_get_fd(reader) == fd) {
+			control->readers = list_unlink(control->readers, l);
+			protobuf_reader_free(reader);
+			return;
+		}
+	}
+}
+
 /**
  * Event callback for incoming data that receives a ControllerToDaemon message (remote)
  *
@@ -1430,6 +2636,8 @@ control_cb_recv_message(int fd, unsigned events, event_io_t *io, void *data)
 		} else {
 			DEBUG("Connected to remote host %s:%d", control->hostip, control->port);
 			control->connected = true;
+			control->reconnect_delay = 0;
+			control_client_add(control, fd);
 			container_t *container_c0 = cmld_containers_get_c0();
 			char *imei = container_get_imei(container_c0);
 			char *mac_address = container_get_mac_address(container_c0);
@@ -1466,7 +2674,7 @@ control_cb_recv_message(int fd, unsigned events, event_io_t *io, void *data)
 				DEBUG("Setting phone_number: %s", phone_number);
 				out.logon_phone_number = mem_strdup(phone_number);
 			}
-			if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+			if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0) {
 				WARN("Could not send LOGON message");
 			}
 			DEBUG("Sent LOGON message");
@@ -1485,14 +2693,19 @@ control_cb_recv_message(int fd, unsigned events, event_io_t *io, void *data)
 			event_add_io(io);
 		}
 	} else if (events & EVENT_IO_READ) {
-		ControllerToDaemon *msg = (ControllerToDaemon *)protobuf_recv_message(
-			fd, &controller_to_daemon__descriptor);
-		if (msg != NULL) {
-			control_handle_message(control, msg, fd);
+		protobuf_reader_t *reader = control_reader_get(control, fd);
+		ControllerToDaemon *msg;
+		int ret;
+		while ((ret = protobuf_reader_recv_message(reader,
+							   &controller_to_daemon__descriptor,
+							   (ProtobufCMessage **)&msg)) > 0) {
+			control_handle_message_measured(control, msg, fd);
+			mem_arena_reset(control->arena);
 			TRACE("Handled control connection %d", fd);
 			protobuf_free_message((ProtobufCMessage *)msg);
-			return;
 		}
+		if (ret == 0)
+			return;
 		if (!(events & EVENT_IO_EXCEPT)) {
 			WARN("Failed to receive and decode ControllerToDaemon protobuf message!");
 			if (control->type == AF_INET)
@@ -1501,6 +2714,7 @@ control_cb_recv_message(int fd, unsigned events, event_io_t *io, void *data)
 	}
 	if ((events & EVENT_IO_EXCEPT) || connection_error) {
 		TRACE("MDM Connection Error: %d", (int)connection_error);
+		control_client_release(control, fd);
 		event_remove_io(io);
 		event_io_free(io);
 		close(fd);
@@ -1532,13 +2746,20 @@ control_cb_recv_message_local(int fd, unsigned events, event_io_t *io, void *dat
 	 * Thus, we have to read pending date before handling the EXCEPT event.
 	 */
 	if (events & EVENT_IO_READ) {
-		ControllerToDaemon *msg = (ControllerToDaemon *)protobuf_recv_message(
-			fd, &controller_to_daemon__descriptor);
+		protobuf_reader_t *reader = control_reader_get(control, fd);
+		ControllerToDaemon *msg;
+		int ret;
+		// handle all complete messages, a partial one is kept until more data arrives
+		while ((ret = protobuf_reader_recv_message(reader,
+							   &controller_to_daemon__descriptor,
+							   (ProtobufCMessage **)&msg)) > 0) {
+			control_handle_message_measured(control, msg, fd);
+			mem_arena_reset(control->arena);
+			TRACE("Handled control connection %d", fd);
+			protobuf_free_message((ProtobufCMessage *)msg);
+		}
 		// close connection if client EOF, or protocol parse error
-		IF_NULL_GOTO_TRACE(msg, connection_err);
-		control_handle_message(control, msg, fd);
-		TRACE("Handled control connection %d", fd);
-		protobuf_free_message((ProtobufCMessage *)msg);
+		IF_TRUE_GOTO_TRACE(ret < 0, connection_err);
 	}
 	// also check EXCEPT flag
 	if (events & EVENT_IO_EXCEPT) {
@@ -1549,6 +2770,7 @@ control_cb_recv_message_local(int fd, unsigned events, event_io_t *io, void *dat
 
 connection_err:
 	input_clean_pin_entry();
+	control_client_release(control, fd);
 	event_remove_io(io);
 	event_io_free(io);
 	if (close(fd) < 0)
@@ -1593,6 +2815,7 @@ control_cb_accept(int fd, unsigned events, event_io_t *io, void *data)
 	DEBUG("Accepted control connection %d", cfd);
 
 	fd_make_non_blocking(cfd);
+	control_client_add(control, cfd);
 
 	event_io_t *event =
 		event_io_new(cfd, EVENT_IO_READ, control_cb_recv_message_local, control);
@@ -1605,15 +2828,19 @@ control_cb_accept(int fd, unsigned events, event_io_t *io, void *data)
  * Timer callback to retry connection to remote socket till success
  */
 static void
-control_remote_reconnect_cb(UNUSED event_timer_t *timer, void *data)
+control_remote_reconnect_cb(event_timer_t *timer, void *data)
 {
 	control_t *control = data;
 
 	ASSERT(control);
 
+	event_timer_free(timer);
+	control->reconnect_timer = NULL;
+
 	control->sock_client = sock_inet_create(SOCK_STREAM);
 	if (control->sock_client < 0) {
 		WARN("Could not create AF_INET socket");
+		control_remote_reconnect(control);
 		return;
 	}
 	fd_make_non_blocking(control->sock_client);
@@ -1622,15 +2849,15 @@ control_remote_reconnect_cb(UNUSED event_timer_t *timer, void *data)
 	if (-1 == res) {
 		DEBUG_ERRNO("Connecting failed to remote host %s:%d", control->hostip,
 			    control->port);
+		close(control->sock_client);
+		control->sock_client = -1;
+		control_remote_reconnect(control);
 		return;
 	}
 
-	event_remove_timer(control->reconnect_timer);
-	event_timer_free(control->reconnect_timer);
-	control->reconnect_timer = NULL;
-
 	/* connection succeeded so register socket for receiving data */
-	fd_make_non_blocking(control->sock_client);
+	sock_inet_set_keepalive(control->sock_client, CONTROL_REMOTE_KEEPALIVE_IDLE,
+				CONTROL_REMOTE_KEEPALIVE_INTVL, CONTROL_REMOTE_KEEPALIVE_CNT);
 
 	event_io_t *event = event_io_new(control->sock_client, EVENT_IO_READ | EVENT_IO_WRITE,
 					 control_cb_recv_message, control);
@@ -1642,23 +2869,50 @@ control_remote_reconnect_cb(UNUSED event_timer_t *timer, void *data)
 static int
 control_remote_reconnect(control_t *control)
 {
+	static bool seeded = false;
+
 	ASSERT(control->type == AF_INET);
 	ASSERT(control->hostip);
 	ASSERT(control->port);
 	control->connected = false;
 
-	/* try to reconnect every CONTROL_REMOTE_RECONNECT_INTERVAL ms */
+	if (!seeded) {
+		srandom(time(NULL) ^ getpid());
+		seeded = true;
+	}
+
+	/* exponential backoff, the actual delay is drawn from [delay/2, delay) */
+	if (control->reconnect_delay == 0)
+		control->reconnect_delay = CONTROL_REMOTE_RECONNECT_MIN;
+	else if (control->reconnect_delay < CONTROL_REMOTE_RECONNECT_MAX / 2)
+		control->reconnect_delay *= 2;
+	else
+		control->reconnect_delay = CONTROL_REMOTE_RECONNECT_MAX;
+	unsigned int delay =
+		control->reconnect_delay / 2 + random() % (control->reconnect_delay / 2);
+
+	TRACE("Next connection attempt to %s:%d in %u ms", control->hostip, control->port,
+	      delay);
+
 	if (control->reconnect_timer) {
 		event_remove_timer(control->reconnect_timer);
 		event_timer_free(control->reconnect_timer);
 	}
-	control->reconnect_timer = event_timer_new(CONTROL_REMOTE_RECONNECT_INTERVAL, -1,
-						   control_remote_reconnect_cb, control);
+	control->reconnect_timer = event_timer_new(delay, 1, control_remote_reconnect_cb, control);
 	event_add_timer(control->reconnect_timer);
 
 	return 0;
 }
 
+static void
+control_metrics_init(void)
+{
+	if (!control_metrics_handle)
+		control_metrics_handle = metrics_new(
+			METRICS_HISTOGRAM, "cml_control_message_seconds", NULL,
+			"Time spent handling control messages, counting all messages.");
+}
+
 control_t *
 control_new(int sock, bool privileged)
 {
@@ -1672,6 +2926,8 @@ control_new(int sock, bool privileged)
 	control->sock_client = -1;
 	control->type = AF_UNIX;
 	control->privileged = privileged;
+	control->arena = mem_arena_new(0);
+	control_metrics_init();
 
 	event_io_t *event = event_io_new(sock, EVENT_IO_READ, control_cb_accept, control);
 	event_add_io(event);
@@ -1679,6 +2935,13 @@ control_new(int sock, bool privileged)
 	return control;
 }
 
+int
+control_get_sock(const control_t *control)
+{
+	ASSERT(control);
+	return control->sock;
+}
+
 control_t *
 control_local_new(const char *path)
 {
@@ -1706,6 +2969,8 @@ control_remote_new(const char *hostip, const char *service)
 	control->sock = -1;
 	control->sock_client = -1;
 	control->privileged = true;
+	control->arena = mem_arena_new(0);
+	control_metrics_init();
 
 	control->reconnect_timer = NULL;
 
@@ -1741,6 +3006,7 @@ control_remote_disconnect(control_t *control)
 		control->reconnect_timer = NULL;
 	}
 	if (control->sock_client >= 0) {
+		control_client_release(control, control->sock_client);
 		DEBUG("Shutting down control socket");
 		if (shutdown(control->sock_client, SHUT_RDWR) == -1) {
 			WARN_ERRNO("Shutting down the control socket failed");
@@ -1756,7 +3022,10 @@ void
 control_free(control_t *control)
 {
 	ASSERT(control);
+	while (control->readers)
+		control_client_release(control, protobuf_reader_get_fd(control->readers->data));
 	if (control->sock_client >= 0) {
+		control_client_release(control, control->sock_client);
 		shutdown(control->sock_client, SHUT_RDWR);
 		close(control->sock_client);
 	}
@@ -1771,6 +3040,7 @@ control_free(control_t *control)
 
 	control_list = list_remove(control_list, control);
 
+	mem_arena_free(control->arena);
 	mem_free0(control);
 	return;
 }
@@ -35,7 +35,12 @@
 #ifndef CONTROL_H
 #define CONTROL_H
 
+#include "psi.h"
+
+#include "common/uuid.h"
+
 #include <stdbool.h>
+#include <protobuf-c/protobuf-c.h>
 
 /**
  * Data structure containing the variables associated to a control socket.
@@ -87,6 +92,12 @@ typedef enum {
 control_t *
 control_new(int socket, bool privileged);
 
+/**
+ * Returns the listening socket of the given control_t object.
+ */
+int
+control_get_sock(const control_t *control);
+
 /**
  * Creates a new control_t object listening on a UNIX socket bound to the specified file.
  * Uses privileged control interface.
@@ -145,4 +156,25 @@ control_get_client_sock(control_t *control);
 int
 control_send_message(control_message_t message, int fd);
 
+/**
+ * Sends the pressure event to all clients which observe pressure events.
+ */
+void
+control_notify_pressure(const psi_event_t *event);
+
+/**
+ * Sends the status of the container to all clients which observe it, or that it
+ * has been removed if removed is set. Called when a container has been added or
+ * removed and whenever its observers are notified.
+ */
+void
+control_notify_container(const container_t *container, bool removed);
+
+/**
+ * Sends the audit record to all clients which observe audit events of the
+ * container with the given uuid, or of the host if uuid is NULL.
+ */
+void
+control_notify_audit(const uuid_t *uuid, const ProtobufCMessage *record);
+
 #endif /* CONTROL_H */
@@ -275,6 +275,11 @@ run_testsuite(int cmld_fd, void (*inject)(ControllerToDaemon *msg, void *data),
 	test_handle_message(&msg_in, inject, data, cmld_fd,
 			    (const char *[]){ "cmld_container_snapshot: A1", NULL });
 
+	// test CONTAINER_CHECKPOINT
+	msg_in.command = CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_CHECKPOINT;
+	test_handle_message(&msg_in, inject, data, cmld_fd,
+			    (const char *[]){ "cmld_container_checkpoint: A1", NULL });
+
 	// test GET_CONTAINER_STATUS
 	msg_in.command = CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_STATUS;
 	test_handle_message(&msg_in, inject, data, cmld_fd, NULL);
@@ -0,0 +1,302 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "crypto_hash.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/list.h"
+#include "common/hex.h"
+#include "common/ssl_util.h"
+#include "common/worker.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+// number of files whose digests are kept in memory
+#define CRYPTO_HASH_CACHE_MAX_ENTRIES 64
+
+typedef struct crypto_hash_cache_entry {
+	char *file;
+	struct stat st;
+	const char *algo;
+	char *hash;
+} crypto_hash_cache_entry_t;
+
+// most recently used entries first, only accessed from the event loop
+static list_t *crypto_hash_cache = NULL;
+
+/*
+ * A hash request processed by a worker thread. Only hashes, hash_lens, ret, st and
+ * cacheable are written by the worker.
+ */
+typedef struct crypto_hash_job {
+	char *file;
+	size_t n;
+	const char *algos[CRYPTO_HASH_MULTI_MAX];
+	unsigned char *hashes[CRYPTO_HASH_MULTI_MAX];
+	unsigned int hash_lens[CRYPTO_HASH_MULTI_MAX];
+	char *hash_strings[CRYPTO_HASH_MULTI_MAX];
+	int ret;
+	bool cached;	// hash_strings were taken from the cache
+	bool cacheable; // the file did not change while it was hashed
+	struct stat st; // state of the file while it was hashed
+	crypto_hash_callback_t cb;
+	void *data;
+} crypto_hash_job_t;
+
+static const char *
+crypto_hash_algo_to_name(crypto_hash_algo_t algo)
+{
+	switch (algo) {
+	case CRYPTO_HASH_SHA1:
+		return "SHA1";
+	case CRYPTO_HASH_SHA256:
+		return "SHA256";
+	case CRYPTO_HASH_SHA512:
+		return "SHA512";
+	default:
+		FATAL("Invalid crypto_hash_algo_t value: %d", algo);
+	}
+}
+
+static char *
+crypto_hash_to_string_new(const unsigned char *hash, unsigned int len)
+{
+	IF_NULL_RETVAL(hash, NULL);
+	IF_TRUE_RETVAL(len == 0, NULL);
+
+	return hex_encode_new(hash, len);
+}
+
+static bool
+crypto_hash_stat_equal(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+	       a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+	       a->st_ctim.tv_sec == b->st_ctim.tv_sec && a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+static void
+crypto_hash_cache_entry_free(crypto_hash_cache_entry_t *entry)
+{
+	mem_free0(entry->file);
+	mem_free0(entry->hash);
+	mem_free0(entry);
+}
+
+static crypto_hash_cache_entry_t *
+crypto_hash_cache_find(const char *file, const struct stat *st, const char *algo)
+{
+	for (list_t *l = crypto_hash_cache; l; l = l->next) {
+		crypto_hash_cache_entry_t *entry = l->data;
+		if (entry->algo == algo && !strcmp(entry->file, file) &&
+		    crypto_hash_stat_equal(&entry->st, st))
+			return entry;
+	}
+	return NULL;
+}
+
+/*
+ * Looks up the hashes of all algorithms of the job for the current state of the file.
+ */
+static bool
+crypto_hash_cache_lookup(crypto_hash_job_t *job)
+{
+	struct stat st;
+	crypto_hash_cache_entry_t *entries[CRYPTO_HASH_MULTI_MAX];
+
+	IF_TRUE_RETVAL(stat(job->file, &st) < 0, false);
+
+	for (size_t i = 0; i < job->n; i++) {
+		entries[i] = crypto_hash_cache_find(job->file, &st, job->algos[i]);
+		IF_NULL_RETVAL(entries[i], false);
+	}
+	for (size_t i = 0; i < job->n; i++) {
+		job->hash_strings[i] = mem_strdup(entries[i]->hash);
+		// move to the front
+		crypto_hash_cache = list_remove(crypto_hash_cache, entries[i]);
+		crypto_hash_cache = list_prepend(crypto_hash_cache, entries[i]);
+	}
+	return true;
+}
+
+static void
+crypto_hash_cache_store(const char *file, const struct stat *st, const char *algo, const char *hash)
+{
+	crypto_hash_cache_entry_t *entry = crypto_hash_cache_find(file, st, algo);
+	if (entry) {
+		crypto_hash_cache = list_remove(crypto_hash_cache, entry);
+	} else {
+		entry = mem_new0(crypto_hash_cache_entry_t, 1);
+		entry->file = mem_strdup(file);
+		entry->st = *st;
+		entry->algo = algo;
+		entry->hash = mem_strdup(hash);
+	}
+	crypto_hash_cache = list_prepend(crypto_hash_cache, entry);
+
+	// evict the least recently used entry
+	if (list_length(crypto_hash_cache) > CRYPTO_HASH_CACHE_MAX_ENTRIES) {
+		list_t *last = list_tail(crypto_hash_cache);
+		crypto_hash_cache_entry_free(last->data);
+		crypto_hash_cache = list_unlink(crypto_hash_cache, last);
+	}
+}
+
+static crypto_hash_job_t *
+crypto_hash_job_new(const char *file, const crypto_hash_algo_t *algos, size_t n,
+		    crypto_hash_callback_t cb, void *data)
+{
+	IF_TRUE_RETVAL_ERROR(n == 0 || n > CRYPTO_HASH_MULTI_MAX, NULL);
+
+	crypto_hash_job_t *job = mem_new0(crypto_hash_job_t, 1);
+	job->file = mem_strdup(file);
+	job->n = n;
+	for (size_t i = 0; i < n; i++)
+		job->algos[i] = crypto_hash_algo_to_name(algos[i]);
+	job->ret = -1;
+	job->cb = cb;
+	job->data = data;
+	return job;
+}
+
+static void
+crypto_hash_job_free(crypto_hash_job_t *job)
+{
+	for (size_t i = 0; i < job->n; i++) {
+		if (job->hashes[i])
+			mem_free0(job->hashes[i]);
+		if (job->hash_strings[i])
+			mem_free0(job->hash_strings[i]);
+	}
+	mem_free0(job->file);
+	mem_free0(job);
+}
+
+/*
+ * Runs on a worker thread.
+ */
+static void
+crypto_hash_job_work(void *data)
+{
+	crypto_hash_job_t *job = data;
+	struct stat st_after;
+
+	IF_TRUE_RETURN(job->cached);
+
+	bool stat_ok = stat(job->file, &job->st) == 0;
+	job->ret = ssl_hash_file_multi(job->file, job->n, job->algos, job->hashes, job->hash_lens);
+	// only cache digests which belong to exactly this state of the file
+	job->cacheable = stat_ok && job->ret == 0 && stat(job->file, &st_after) == 0 &&
+			 crypto_hash_stat_equal(&job->st, &st_after);
+}
+
+static void
+crypto_hash_job_done(void *data)
+{
+	crypto_hash_job_t *job = data;
+
+	if (job->ret < 0) {
+		ERROR("Hashing file %s failed", job->file);
+		job->cb(NULL, job->n, job->file, job->data);
+		crypto_hash_job_free(job);
+		return;
+	}
+
+	for (size_t i = 0; i < job->n && !job->cached; i++) {
+		job->hash_strings[i] = crypto_hash_to_string_new(job->hashes[i], job->hash_lens[i]);
+		if (job->cacheable && job->hash_strings[i])
+			crypto_hash_cache_store(job->file, &job->st, job->algos[i],
+						job->hash_strings[i]);
+	}
+	job->cb((const char *const *)job->hash_strings, job->n, job->file, job->data);
+	crypto_hash_job_free(job);
+}
+
+int
+crypto_hash_file(const char *file, const crypto_hash_algo_t *algos, size_t n,
+		 crypto_hash_callback_t cb, void *data)
+{
+	ASSERT(file);
+	ASSERT(algos);
+	ASSERT(cb);
+
+	crypto_hash_job_t *job = crypto_hash_job_new(file, algos, n, cb, data);
+	IF_NULL_RETVAL(job, -1);
+
+	/*
+	 * Cache hits are also reported through the worker, so that the callback is never
+	 * called before this function returned.
+	 */
+	if (crypto_hash_cache_lookup(job)) {
+		TRACE("Using cached hashes of %s", file);
+		job->cached = true;
+		job->ret = 0;
+	}
+
+	if (worker_run(crypto_hash_job_work, crypto_hash_job_done, job) < 0) {
+		WARN("Could not hand off hashing to a worker, hashing synchronously");
+		crypto_hash_job_work(job);
+		crypto_hash_job_done(job);
+	}
+	return 0;
+}
+
+char *
+crypto_hash_file_block_new(const char *file, crypto_hash_algo_t algo)
+{
+	ASSERT(file);
+
+	const char *algos[] = { crypto_hash_algo_to_name(algo) };
+	unsigned char *hash = NULL;
+	unsigned int hash_len = 0;
+	struct stat st, st_after;
+	crypto_hash_cache_entry_t *entry;
+
+	bool stat_ok = stat(file, &st) == 0;
+	if (stat_ok && (entry = crypto_hash_cache_find(file, &st, algos[0])))
+		return mem_strdup(entry->hash);
+
+	IF_TRUE_RETVAL(ssl_hash_file_multi(file, 1, algos, &hash, &hash_len) < 0, NULL);
+
+	char *hash_string = crypto_hash_to_string_new(hash, hash_len);
+	mem_free0(hash);
+
+	if (hash_string && stat_ok && stat(file, &st_after) == 0 &&
+	    crypto_hash_stat_equal(&st, &st_after))
+		crypto_hash_cache_store(file, &st, algos[0], hash_string);
+	return hash_string;
+}
+
+void
+crypto_hash_file_add_cached(const char *file, crypto_hash_algo_t algo, const char *hash)
+{
+	ASSERT(file);
+	ASSERT(hash);
+
+	struct stat st;
+	IF_TRUE_RETURN_WARN(stat(file, &st) < 0);
+
+	crypto_hash_cache_store(file, &st, crypto_hash_algo_to_name(algo), hash);
+}
@@ -0,0 +1,98 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file crypto_hash.h
+ *
+ * Hashing of files inside of cmld. Computing digests of guestos images, audit records
+ * and the like does not need any key material, thus it does not go through the scd.
+ * Files are hashed on a pool of worker threads with all requested algorithms in a
+ * single pass. Digests are cached in memory for files which did not change since they
+ * were hashed, e.g., images which are verified on each container start.
+ */
+
+#ifndef CRYPTO_HASH_H
+#define CRYPTO_HASH_H
+
+#include <stddef.h>
+
+/**
+ * Maximum number of hash algorithms for one request.
+ */
+#define CRYPTO_HASH_MULTI_MAX 4
+
+/**
+ * Choice of supported hash algorithms.
+ */
+typedef enum crypto_hash_algo {
+	CRYPTO_HASH_SHA1,
+	CRYPTO_HASH_SHA256,
+	CRYPTO_HASH_SHA512
+} crypto_hash_algo_t;
+
+/**
+ * Callback function for receiving the results of crypto_hash_file().
+ * hash_strings holds the n hashes as hex strings in the order of the requested
+ * algorithms, or is NULL if hashing failed.
+ */
+typedef void (*crypto_hash_callback_t)(const char *const *hash_strings, size_t n, const char *file,
+				       void *data);
+
+/**
+ * Hashes the given file with n hash algorithms without blocking the event loop and
+ * reports the hashes to the given callback.
+ *
+ * @param file the file to hash
+ * @param algos the hash algorithms to use
+ * @param n the number of hash algorithms, at most CRYPTO_HASH_MULTI_MAX
+ * @param cb the callback to receive the result
+ * @param data custom data parameter to pass to the callback
+ * @return 0 if the callback is expected to be called, -1 otherwise
+ */
+int
+crypto_hash_file(const char *file, const crypto_hash_algo_t *algos, size_t n,
+		 crypto_hash_callback_t cb, void *data);
+
+/**
+ * Hashes the given file in the calling thread and directly returns the hash.
+ *
+ * @param file the file to hash
+ * @param algo the hash algorithm to use
+ * @return pointer to a newly allocated hex string with the hash, or NULL on error
+ */
+char *
+crypto_hash_file_block_new(const char *file, crypto_hash_algo_t algo);
+
+/**
+ * Adds a hash of the given file which was computed while the file was written, e.g.,
+ * during a download, to the cache. Subsequent requests for the unchanged file do not
+ * read it again.
+ *
+ * @param file the file which has just been written completely
+ * @param algo the hash algorithm used
+ * @param hash the hash as hex string
+ */
+void
+crypto_hash_file_add_cached(const char *file, crypto_hash_algo_t algo, const char *hash);
+
+#endif /* CRYPTO_HASH_H */
@@ -0,0 +1,251 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "delta.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/fd.h"
+#include "common/hex.h"
+#include "common/worker.h"
+
+#include <openssl/evp.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DELTA_MAGIC "CMLDELT1"
+#define DELTA_BUF_SIZE (256 * 1024)
+
+enum delta_record { DELTA_RECORD_END = 0, DELTA_RECORD_COPY = 1, DELTA_RECORD_DATA = 2 };
+
+/*
+ * A reconstruction processed by a worker thread. Only ret is written by the worker.
+ */
+typedef struct delta_job {
+	char *base_file;
+	char *delta_file;
+	char *delta_sha256;
+	char *out_file;
+	int ret;
+	delta_callback_t cb;
+	void *data;
+} delta_job_t;
+
+typedef struct delta_reader {
+	int fd;
+	EVP_MD_CTX *md;
+} delta_reader_t;
+
+/*
+ * Reads exactly len bytes of the delta file and adds them to its digest.
+ */
+static int
+delta_read(delta_reader_t *r, void *buf, size_t len)
+{
+	IF_TRUE_RETVAL(fd_read(r->fd, buf, len) != (ssize_t)len, -1);
+	IF_TRUE_RETVAL(!EVP_DigestUpdate(r->md, buf, len), -1);
+	return 0;
+}
+
+static int
+delta_read_u32(delta_reader_t *r, uint32_t *val)
+{
+	IF_TRUE_RETVAL(delta_read(r, val, sizeof(*val)) < 0, -1);
+	*val = be32toh(*val);
+	return 0;
+}
+
+static int
+delta_read_u64(delta_reader_t *r, uint64_t *val)
+{
+	IF_TRUE_RETVAL(delta_read(r, val, sizeof(*val)) < 0, -1);
+	*val = be64toh(*val);
+	return 0;
+}
+
+static bool
+delta_digest_matches(delta_reader_t *r, const char *sha256)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len = 0;
+	char hex[2 * EVP_MAX_MD_SIZE + 1];
+
+	IF_TRUE_RETVAL(!EVP_DigestFinal_ex(r->md, md, &md_len), false);
+	hex_encode(hex, md, md_len);
+	return !strcasecmp(hex, sha256);
+}
+
+/*
+ * Applies the records of the delta file. Returns the number of bytes written or -1.
+ */
+static int64_t
+delta_apply_records(delta_reader_t *r, int base_fd, int out_fd, uint64_t size)
+{
+	char *buf = mem_alloc(DELTA_BUF_SIZE);
+	uint64_t written = 0;
+	int64_t ret = -1;
+
+	for (;;) {
+		uint8_t type;
+		uint64_t offset = 0;
+		uint32_t len;
+
+		IF_TRUE_GOTO(delta_read(r, &type, 1) < 0, out);
+		if (type == DELTA_RECORD_END)
+			break;
+
+		if (type == DELTA_RECORD_COPY)
+			IF_TRUE_GOTO(delta_read_u64(r, &offset) < 0, out);
+		else if (type != DELTA_RECORD_DATA)
+			goto out;
+		IF_TRUE_GOTO(delta_read_u32(r, &len) < 0, out);
+		IF_TRUE_GOTO(len > size - written, out);
+
+		while (len > 0) {
+			size_t chunk = MIN(len, DELTA_BUF_SIZE);
+			if (type == DELTA_RECORD_COPY) {
+				ssize_t n = pread(base_fd, buf, chunk, offset);
+				IF_TRUE_GOTO(n != (ssize_t)chunk, out);
+				offset += chunk;
+			} else {
+				IF_TRUE_GOTO(delta_read(r, buf, chunk) < 0, out);
+			}
+			IF_TRUE_GOTO(fd_write(out_fd, buf, chunk) != (ssize_t)chunk, out);
+			written += chunk;
+			len -= chunk;
+		}
+	}
+	ret = written;
+out:
+	mem_free0(buf);
+	return ret;
+}
+
+/*
+ * Runs on a worker thread.
+ */
+static void
+delta_job_work(void *data)
+{
+	delta_job_t *job = data;
+	delta_reader_t r = { .fd = -1, .md = NULL };
+	int base_fd = -1, out_fd = -1;
+	char *tmp_file = mem_printf("%s.delta-tmp", job->out_file);
+	char magic[sizeof(DELTA_MAGIC) - 1];
+	uint64_t size;
+
+	job->ret = -1;
+
+	r.md = EVP_MD_CTX_new();
+	IF_TRUE_GOTO(!r.md || !EVP_DigestInit_ex(r.md, EVP_sha256(), NULL), out);
+	r.fd = open(job->delta_file, O_RDONLY | O_CLOEXEC);
+	IF_TRUE_GOTO(r.fd < 0, out);
+	base_fd = open(job->base_file, O_RDONLY | O_CLOEXEC);
+	IF_TRUE_GOTO(base_fd < 0, out);
+	out_fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	IF_TRUE_GOTO(out_fd < 0, out);
+
+	IF_TRUE_GOTO(delta_read(&r, magic, sizeof(magic)) < 0, out);
+	IF_TRUE_GOTO(memcmp(magic, DELTA_MAGIC, sizeof(magic)), out);
+	IF_TRUE_GOTO(delta_read_u64(&r, &size) < 0, out);
+
+	int64_t written = delta_apply_records(&r, base_fd, out_fd, size);
+	IF_TRUE_GOTO(written < 0 || (uint64_t)written != size, out);
+
+	// trailing data would not be covered by the records, but is by the digest
+	char c;
+	IF_TRUE_GOTO(read(r.fd, &c, 1) != 0, out);
+	IF_TRUE_GOTO(!delta_digest_matches(&r, job->delta_sha256), out);
+
+	IF_TRUE_GOTO(fsync(out_fd) < 0, out);
+	IF_TRUE_GOTO(rename(tmp_file, job->out_file) < 0, out);
+	job->ret = 0;
+out:
+	if (job->ret < 0)
+		unlink(tmp_file);
+	if (out_fd >= 0)
+		close(out_fd);
+	if (base_fd >= 0)
+		close(base_fd);
+	if (r.fd >= 0)
+		close(r.fd);
+	EVP_MD_CTX_free(r.md);
+	mem_free0(tmp_file);
+}
+
+static void
+delta_job_free(delta_job_t *job)
+{
+	mem_free0(job->base_file);
+	mem_free0(job->delta_file);
+	mem_free0(job->delta_sha256);
+	mem_free0(job->out_file);
+	mem_free0(job);
+}
+
+static void
+delta_job_done(void *data)
+{
+	delta_job_t *job = data;
+
+	if (job->ret < 0)
+		ERROR("Could not reconstruct %s from %s and delta %s", job->out_file,
+		      job->base_file, job->delta_file);
+	else
+		INFO("Reconstructed %s from %s", job->out_file, job->base_file);
+
+	job->cb(job->ret == 0, job->out_file, job->data);
+	delta_job_free(job);
+}
+
+int
+delta_apply(const char *base_file, const char *delta_file, const char *delta_sha256,
+	    const char *out_file, delta_callback_t cb, void *data)
+{
+	ASSERT(base_file);
+	ASSERT(delta_file);
+	ASSERT(delta_sha256);
+	ASSERT(out_file);
+	ASSERT(cb);
+
+	delta_job_t *job = mem_new0(delta_job_t, 1);
+	job->base_file = mem_strdup(base_file);
+	job->delta_file = mem_strdup(delta_file);
+	job->delta_sha256 = mem_strdup(delta_sha256);
+	job->out_file = mem_strdup(out_file);
+	job->cb = cb;
+	job->data = data;
+
+	if (worker_run(delta_job_work, delta_job_done, job) < 0) {
+		ERROR("Could not hand off reconstruction of %s to a worker", out_file);
+		delta_job_free(job);
+		return -1;
+	}
+	return 0;
+}
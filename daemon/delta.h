@@ -0,0 +1,68 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file delta.h
+ *
+ * Reconstructs an image file from a base image and a delta file, so that an update of a
+ * GuestOS only transfers the parts of its images which changed.
+ *
+ * A delta file starts with the magic "CMLDELT1" and the size of the target image as
+ * big-endian uint64, followed by records which produce the target image sequentially:
+ *
+ *   0x01 COPY   uint64 offset, uint32 length: copy length bytes of the base image at offset
+ *   0x02 DATA   uint32 length, data:          append the literal data
+ *   0x00 END
+ *
+ * All integers are big-endian. The reconstructed image must be verified by the caller.
+ */
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdbool.h>
+
+/**
+ * Callback for the result of delta_apply().
+ */
+typedef void (*delta_callback_t)(bool success, const char *out_file, void *data);
+
+/**
+ * Reconstructs out_file from base_file and delta_file on a worker thread and calls cb in
+ * the event loop afterwards. The delta file is only applied completely if its sha256
+ * matches delta_sha256. out_file is replaced atomically on success and left untouched
+ * otherwise.
+ *
+ * @param base_file the image the delta was created against
+ * @param delta_file the delta file
+ * @param delta_sha256 hex encoded sha256 of the delta file
+ * @param out_file the image file to create
+ * @param cb callback called with the result
+ * @param data data parameter passed to the callback
+ * @return 0 if reconstruction was started, -1 otherwise (cb is not called then)
+ */
+int
+delta_apply(const char *base_file, const char *delta_file, const char *delta_sha256,
+	    const char *out_file, delta_callback_t cb, void *data);
+
+#endif /* DELTA_H */
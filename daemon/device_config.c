@@ -295,3 +295,111 @@ device_config_get_audit_size(const device_config_t *config)
 
 	return config->cfg->audit_size;
 }
+
+uint32_t
+device_config_get_cgroups_stats_interval(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->cgroups_stats_interval;
+}
+
+uint32_t
+device_config_get_veth_pool_size(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->veth_pool_size;
+}
+
+uint32_t
+device_config_get_zygote_pool_size(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->zygote_pool_size;
+}
+
+const char *
+device_config_get_container_subnet_pool(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->container_subnet_pool;
+}
+
+uint32_t
+device_config_get_boot_concurrency(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->boot_concurrency;
+}
+
+uint32_t
+device_config_get_update_rate_limit(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->update_rate_limit;
+}
+
+uint32_t
+device_config_get_zram_swap_size(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->zram_swap_size;
+}
+
+bool
+device_config_get_psi_freeze_policy(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->psi_freeze_policy;
+}
+
+bool
+device_config_get_metrics_socket(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->metrics_socket;
+}
+
+bool
+device_config_get_mem_accounting(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->mem_accounting;
+}
+
+const char *
+device_config_get_kexec_kernel(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->kexec_kernel;
+}
+
+const char *
+device_config_get_kexec_initrd(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->kexec_initrd;
+}
@@ -107,6 +107,42 @@ device_config_get_signed_configs(const device_config_t *config);
 bool
 device_config_get_audit_size(const device_config_t *config);
 
+uint32_t
+device_config_get_cgroups_stats_interval(const device_config_t *config);
+
+uint32_t
+device_config_get_veth_pool_size(const device_config_t *config);
+
+uint32_t
+device_config_get_zygote_pool_size(const device_config_t *config);
+
+const char *
+device_config_get_container_subnet_pool(const device_config_t *config);
+
+uint32_t
+device_config_get_boot_concurrency(const device_config_t *config);
+
+uint32_t
+device_config_get_update_rate_limit(const device_config_t *config);
+
+uint32_t
+device_config_get_zram_swap_size(const device_config_t *config);
+
+bool
+device_config_get_psi_freeze_policy(const device_config_t *config);
+
+bool
+device_config_get_metrics_socket(const device_config_t *config);
+
+bool
+device_config_get_mem_accounting(const device_config_t *config);
+
+const char *
+device_config_get_kexec_kernel(const device_config_t *config);
+
+const char *
+device_config_get_kexec_initrd(const device_config_t *config);
+
 bool
 device_config_get_tpm_enabled(const device_config_t *config);
 #endif /* DEVICE_H */
@@ -0,0 +1,374 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "dhcpd.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/event.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/socket.h>
+
+#define DHCP_SERVER_PORT 67
+#define DHCP_CLIENT_PORT 68
+
+/* lease time in seconds, clients keep their address anyway as it never changes */
+#define DHCP_LEASE_TIME 864000
+
+#define DHCP_BOOTREQUEST 1
+#define DHCP_BOOTREPLY 2
+#define DHCP_MAGIC_COOKIE 0x63825363
+#define DHCP_FLAG_BROADCAST 0x8000
+
+/* option codes, see RFC 2132 */
+#define DHCP_OPT_PAD 0
+#define DHCP_OPT_SUBNET_MASK 1
+#define DHCP_OPT_ROUTER 3
+#define DHCP_OPT_REQUESTED_IP 50
+#define DHCP_OPT_LEASE_TIME 51
+#define DHCP_OPT_MSG_TYPE 53
+#define DHCP_OPT_SERVER_ID 54
+#define DHCP_OPT_END 255
+
+/* message types */
+#define DHCPDISCOVER 1
+#define DHCPOFFER 2
+#define DHCPREQUEST 3
+#define DHCPACK 5
+#define DHCPNAK 6
+#define DHCPINFORM 8
+
+/* options field size of a packet which fits a minimal ip datagram of 576 bytes */
+#define DHCP_OPTIONS_LEN 312
+
+typedef struct {
+	uint8_t op;
+	uint8_t htype;
+	uint8_t hlen;
+	uint8_t hops;
+	uint32_t xid;
+	uint16_t secs;
+	uint16_t flags;
+	uint32_t ciaddr;
+	uint32_t yiaddr;
+	uint32_t siaddr;
+	uint32_t giaddr;
+	uint8_t chaddr[16];
+	uint8_t sname[64];
+	uint8_t file[128];
+	uint32_t cookie;
+	uint8_t options[DHCP_OPTIONS_LEN];
+} __attribute__((packed)) dhcp_packet_t;
+
+/* fixed part of a packet without options */
+#define DHCP_PACKET_MIN_LEN (sizeof(dhcp_packet_t) - DHCP_OPTIONS_LEN)
+
+/* smallest reply accepted by legacy BOOTP relays and clients */
+#define DHCP_REPLY_MIN_LEN 300
+
+struct dhcpd {
+	char *ifname;		//!< served interface
+	int fd;			//!< udp socket bound to ifname
+	event_io_t *io;		//!< read event of fd
+	struct in_addr server;	//!< own address, also used as router
+	struct in_addr client;	//!< address handed out to the client
+	struct in_addr netmask; //!< netmask of the shared subnet
+};
+
+/*
+ * Creates a udp socket in the network namespace of netns_pid and switches back
+ * to the own namespace. The socket stays bound to the namespace it was created in.
+ */
+static int
+dhcpd_socket_ns_new(pid_t netns_pid)
+{
+	if (netns_pid <= 0)
+		return socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	int sock = -1;
+	char *ns_path = mem_printf("/proc/%d/ns/net", netns_pid);
+	int ns_fd = open(ns_path, O_RDONLY | O_CLOEXEC);
+	if (ns_fd < 0) {
+		ERROR_ERRNO("Could not open %s", ns_path);
+		mem_free0(ns_path);
+		return -1;
+	}
+	mem_free0(ns_path);
+
+	int self_fd = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+	if (self_fd < 0) {
+		ERROR_ERRNO("Could not open own netns");
+		goto out;
+	}
+
+	if (setns(ns_fd, CLONE_NEWNET)) {
+		ERROR_ERRNO("Could not join netns of pid %d", netns_pid);
+		goto out;
+	}
+
+	sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (setns(self_fd, CLONE_NEWNET))
+		FATAL_ERRNO("Could not switch back to own netns");
+out:
+	if (self_fd >= 0)
+		close(self_fd);
+	close(ns_fd);
+	return sock;
+}
+
+/*
+ * Parses the options of a received packet. Returns the message type or -1 if
+ * the packet carries no valid message type option.
+ */
+static int
+dhcpd_parse_options(const dhcp_packet_t *packet, size_t len, uint32_t *requested_ip,
+		    uint32_t *server_id)
+{
+	int type = -1;
+	const uint8_t *opt = packet->options;
+	const uint8_t *end = (const uint8_t *)packet + len;
+
+	while (opt < end && *opt != DHCP_OPT_END) {
+		if (*opt == DHCP_OPT_PAD) {
+			opt++;
+			continue;
+		}
+		if (opt + 2 > end || opt + 2 + opt[1] > end)
+			break;
+
+		const uint8_t *val = opt + 2;
+		switch (opt[0]) {
+		case DHCP_OPT_MSG_TYPE:
+			if (opt[1] == 1)
+				type = val[0];
+			break;
+		case DHCP_OPT_REQUESTED_IP:
+			if (opt[1] == 4)
+				memcpy(requested_ip, val, 4);
+			break;
+		case DHCP_OPT_SERVER_ID:
+			if (opt[1] == 4)
+				memcpy(server_id, val, 4);
+			break;
+		default:
+			break;
+		}
+		opt += 2 + opt[1];
+	}
+	return type;
+}
+
+static uint8_t *
+dhcpd_add_option(uint8_t *opt, uint8_t code, const void *val, uint8_t len)
+{
+	opt[0] = code;
+	opt[1] = len;
+	memcpy(opt + 2, val, len);
+	return opt + 2 + len;
+}
+
+/*
+ * Sends a reply of the given type for request out of the served interface.
+ * If assign is set, the reply hands out the client address including a lease.
+ */
+static void
+dhcpd_send_reply(dhcpd_t *dhcpd, const dhcp_packet_t *request, uint8_t type, bool assign)
+{
+	dhcp_packet_t reply;
+	memset(&reply, 0, sizeof(reply));
+
+	reply.op = DHCP_BOOTREPLY;
+	reply.htype = request->htype;
+	reply.hlen = request->hlen;
+	reply.xid = request->xid;
+	reply.flags = request->flags;
+	reply.giaddr = request->giaddr;
+	memcpy(reply.chaddr, request->chaddr, sizeof(reply.chaddr));
+	reply.cookie = htonl(DHCP_MAGIC_COOKIE);
+
+	if (type != DHCPNAK)
+		reply.ciaddr = request->ciaddr;
+	if (assign)
+		reply.yiaddr = dhcpd->client.s_addr;
+
+	uint8_t *opt = reply.options;
+	opt = dhcpd_add_option(opt, DHCP_OPT_MSG_TYPE, &type, 1);
+	opt = dhcpd_add_option(opt, DHCP_OPT_SERVER_ID, &dhcpd->server.s_addr, 4);
+	if (type != DHCPNAK) {
+		if (assign) {
+			uint32_t lease = htonl(DHCP_LEASE_TIME);
+			opt = dhcpd_add_option(opt, DHCP_OPT_LEASE_TIME, &lease, 4);
+		}
+		opt = dhcpd_add_option(opt, DHCP_OPT_SUBNET_MASK, &dhcpd->netmask.s_addr, 4);
+		opt = dhcpd_add_option(opt, DHCP_OPT_ROUTER, &dhcpd->server.s_addr, 4);
+	}
+	*opt++ = DHCP_OPT_END;
+
+	/*
+	 * The client has no address yet unless it renews, thus broadcast in this case.
+	 * As the socket is bound to the veth endpoint, the only peer receiving it
+	 * is the container.
+	 */
+	struct sockaddr_in dst = { .sin_family = AF_INET, .sin_port = htons(DHCP_CLIENT_PORT) };
+	if (request->ciaddr && type != DHCPNAK && !(ntohs(request->flags) & DHCP_FLAG_BROADCAST))
+		dst.sin_addr.s_addr = request->ciaddr;
+	else
+		dst.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+
+	size_t len = MAX((size_t)(opt - (uint8_t *)&reply), (size_t)DHCP_REPLY_MIN_LEN);
+	if (sendto(dhcpd->fd, &reply, len, 0, (struct sockaddr *)&dst, sizeof(dst)) < 0)
+		WARN_ERRNO("Could not send dhcp reply on %s", dhcpd->ifname);
+}
+
+static void
+dhcpd_handle_packet(dhcpd_t *dhcpd, const dhcp_packet_t *packet, size_t len)
+{
+	uint32_t requested_ip = 0;
+	uint32_t server_id = 0;
+
+	IF_TRUE_RETURN_TRACE(len < DHCP_PACKET_MIN_LEN || packet->op != DHCP_BOOTREQUEST);
+	IF_TRUE_RETURN_TRACE(ntohl(packet->cookie) != DHCP_MAGIC_COOKIE);
+
+	int type = dhcpd_parse_options(packet, len, &requested_ip, &server_id);
+
+	switch (type) {
+	case DHCPDISCOVER:
+		TRACE("DHCPDISCOVER on %s", dhcpd->ifname);
+		dhcpd_send_reply(dhcpd, packet, DHCPOFFER, true);
+		break;
+	case DHCPREQUEST:
+		// the client selected the offer of another server
+		if (server_id && server_id != dhcpd->server.s_addr)
+			break;
+		if (!requested_ip)
+			requested_ip = packet->ciaddr;
+		TRACE("DHCPREQUEST on %s", dhcpd->ifname);
+		if (requested_ip == dhcpd->client.s_addr)
+			dhcpd_send_reply(dhcpd, packet, DHCPACK, true);
+		else
+			dhcpd_send_reply(dhcpd, packet, DHCPNAK, false);
+		break;
+	case DHCPINFORM:
+		TRACE("DHCPINFORM on %s", dhcpd->ifname);
+		// INFORM is answered with an ACK without address and lease time
+		dhcpd_send_reply(dhcpd, packet, DHCPACK, false);
+		break;
+	default:
+		// RELEASE and DECLINE do not change the fixed assignment
+		TRACE("Ignoring dhcp message type %d on %s", type, dhcpd->ifname);
+		break;
+	}
+}
+
+static void
+dhcpd_read_cb(int fd, unsigned events, UNUSED event_io_t *io, void *data)
+{
+	dhcpd_t *dhcpd = data;
+	dhcp_packet_t packet;
+
+	IF_FALSE_RETURN(events & EVENT_IO_READ);
+
+	for (;;) {
+		ssize_t len = recv(fd, &packet, sizeof(packet), 0);
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				WARN_ERRNO("Could not receive dhcp packet on %s", dhcpd->ifname);
+			return;
+		}
+		dhcpd_handle_packet(dhcpd, &packet, len);
+	}
+}
+
+dhcpd_t *
+dhcpd_new(pid_t netns_pid, const char *ifname, const struct in_addr *server_addr,
+	  const struct in_addr *client_addr, unsigned int prefix)
+{
+	ASSERT(ifname && server_addr && client_addr);
+	IF_TRUE_RETVAL(prefix == 0 || prefix > 30, NULL);
+
+	int one = 1;
+	struct sockaddr_in addr = { .sin_family = AF_INET,
+				    .sin_port = htons(DHCP_SERVER_PORT),
+				    .sin_addr.s_addr = htonl(INADDR_ANY) };
+
+	int fd = dhcpd_socket_ns_new(netns_pid);
+	if (fd < 0) {
+		ERROR_ERRNO("Could not create dhcp socket for %s", ifname);
+		return NULL;
+	}
+
+	// the device name is resolved in the netns the socket belongs to
+	if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, ifname, strlen(ifname) + 1) ||
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+	    setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one))) {
+		ERROR_ERRNO("Could not set options of dhcp socket for %s", ifname);
+		goto err;
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		ERROR_ERRNO("Could not bind dhcp socket to %s", ifname);
+		goto err;
+	}
+
+	dhcpd_t *dhcpd = mem_new0(dhcpd_t, 1);
+	dhcpd->ifname = mem_strdup(ifname);
+	dhcpd->fd = fd;
+	dhcpd->server = *server_addr;
+	dhcpd->client = *client_addr;
+	dhcpd->netmask.s_addr = htonl(~0U << (32 - prefix));
+
+	dhcpd->io = event_io_new(fd, EVENT_IO_READ, dhcpd_read_cb, dhcpd);
+	event_add_io(dhcpd->io);
+
+	DEBUG("Serving dhcp on %s for %s", ifname, inet_ntoa(*client_addr));
+	return dhcpd;
+err:
+	close(fd);
+	return NULL;
+}
+
+void
+dhcpd_free(dhcpd_t *dhcpd)
+{
+	IF_NULL_RETURN(dhcpd);
+
+	DEBUG("Stop serving dhcp on %s", dhcpd->ifname);
+	if (dhcpd->io) {
+		event_remove_io(dhcpd->io);
+		event_io_free(dhcpd->io);
+	}
+	close(dhcpd->fd);
+	mem_free0(dhcpd->ifname);
+	mem_free0(dhcpd);
+}
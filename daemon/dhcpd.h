@@ -0,0 +1,64 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file dhcpd.h
+ *
+ * Minimal DHCP responder running inside of cmld's event loop. Each instance serves
+ * exactly one veth endpoint and answers DISCOVER, REQUEST and INFORM messages with the
+ * single address c_net already assigned to the container side of that veth pair.
+ * Thus, no dynamic lease database is needed and no external dhcp daemon is forked.
+ */
+
+#ifndef DHCPD_H
+#define DHCPD_H
+
+#include <netinet/in.h>
+#include <sys/types.h>
+
+typedef struct dhcpd dhcpd_t;
+
+/**
+ * Starts serving DHCP on the given interface.
+ *
+ * @param netns_pid pid of a process in whose network namespace ifname resides,
+ *                  0 for cmld's own network namespace
+ * @param ifname name of the interface to serve, i.e., cmld's endpoint of a veth pair
+ * @param server_addr address of ifname, also announced as router and server identifier
+ * @param client_addr the address handed out to the client
+ * @param prefix prefix length of the subnet shared by server and client
+ * @return the new dhcpd instance registered in the event loop, NULL on error
+ */
+dhcpd_t *
+dhcpd_new(pid_t netns_pid, const char *ifname, const struct in_addr *server_addr,
+	  const struct in_addr *client_addr, unsigned int prefix);
+
+/**
+ * Stops serving DHCP, removes the instance from the event loop and frees it.
+ *
+ * @param dhcpd the dhcpd instance to be freed, may be NULL
+ */
+void
+dhcpd_free(dhcpd_t *dhcpd);
+
+#endif /* DHCPD_H */
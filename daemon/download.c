@@ -22,131 +22,914 @@
  */
 
 #include "download.h"
+#include "crypto_hash.h"
 
 #include "common/macro.h"
 #include "common/mem.h"
 #include "common/event.h"
+#include "common/fd.h"
 #include "common/file.h"
+#include "common/hex.h"
+#include "common/list.h"
 
+#include <sys/socket.h>
 #include <sys/wait.h>
+#include <netdb.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-#define WGET_PATH "wget"
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#define DOWNLOAD_CHUNK_SIZE (64 * 1024)
+#define DOWNLOAD_HEADER_MAX (16 * 1024)
+#define DOWNLOAD_MAX_REDIRECTS 5
+#define DOWNLOAD_TICK 250	       // ms between checks for timeouts and throttled downloads
+#define DOWNLOAD_TIMEOUT (60 * 1000) // ms without any progress before a download fails
+
+// digests computed while downloading a file from its start
+static const crypto_hash_algo_t download_hash_algos[] = { CRYPTO_HASH_SHA1, CRYPTO_HASH_SHA256 };
+#define DOWNLOAD_HASH_COUNT (sizeof(download_hash_algos) / sizeof(download_hash_algos[0]))
+
+typedef enum download_state {
+	DOWNLOAD_STATE_CONNECT,
+	DOWNLOAD_STATE_HANDSHAKE,
+	DOWNLOAD_STATE_REQUEST,
+	DOWNLOAD_STATE_HEADER,
+	DOWNLOAD_STATE_BODY,
+} download_state_t;
 
 struct download {
 	char *url;
 	char *file;
 	download_callback_t on_complete;
 	void *data;
-	pid_t wget_pid;
+	pid_t copy_pid; // child copying a file:// url
+
+	// location of the current request, differs from url after redirects
+	bool tls;
+	char *host;
+	char *port;
+	char *path;
+	unsigned int redirects;
+
+	download_state_t state;
+	int sock;
+	SSL *ssl;
+	event_io_t *io;
+	unsigned int io_events;
+	event_timer_t *tick;
+	bool throttled;
+	uint64_t last_progress; // ms, monotonic
+
+	char *request;
+	size_t request_len, request_sent;
+	char *header;
+	size_t header_len;
+
+	int out_fd;
+	off_t size;	    // current size of file
+	off_t total;	    // expected final size of file, -1 if unknown
+	off_t content_left; // body bytes still expected, -1 if unknown
+	off_t expected;	    // size the file must have, -1 if unknown
+
+	EVP_MD_CTX *md[DOWNLOAD_HASH_COUNT]; // NULL unless the body starts at offset 0
 };
 
+static SSL_CTX *download_ssl_ctx = NULL;
+static list_t *download_active_list = NULL;
+
+// shared by all downloads, 0 for no limit
+static uint64_t download_rate_limit = 0;
+static uint64_t download_rate_budget = 0;
+static uint64_t download_rate_refilled = 0;
+
+static void
+download_io_cb(int fd, unsigned events, event_io_t *io, void *data);
+
+static int
+download_connect(download_t *dl);
+
+static uint64_t
+download_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void
+download_set_rate_limit(uint64_t bytes_per_sec)
+{
+	download_rate_limit = bytes_per_sec;
+	download_rate_budget = bytes_per_sec;
+	download_rate_refilled = download_now_ms();
+	if (bytes_per_sec)
+		INFO("Limiting download rate to %" PRIu64 " bytes/s", bytes_per_sec);
+}
+
+/**
+ * Returns how many bytes may be received now with respect to the rate limit.
+ */
+static size_t
+download_rate_allowance(size_t want)
+{
+	IF_TRUE_RETVAL(!download_rate_limit, want);
+
+	uint64_t now = download_now_ms();
+	download_rate_budget += (now - download_rate_refilled) * download_rate_limit / 1000;
+	download_rate_budget = MIN(download_rate_budget, download_rate_limit);
+	download_rate_refilled = now;
+
+	return MIN(want, download_rate_budget);
+}
+
+static void
+download_rate_consume(size_t len)
+{
+	IF_TRUE_RETURN(!download_rate_limit);
+	download_rate_budget -= MIN(download_rate_budget, len);
+}
+
 download_t *
 download_new(const char *url, const char *file, download_callback_t on_complete, void *data)
 {
-	download_t *dl = mem_new(download_t, 1);
+	download_t *dl = mem_new0(download_t, 1);
 	dl->url = mem_strdup(url);
 	dl->file = mem_strdup(file);
 	dl->on_complete = on_complete;
 	dl->data = data;
+	dl->copy_pid = -1;
+	dl->sock = -1;
+	dl->out_fd = -1;
+	dl->total = -1;
+	dl->expected = -1;
 	return dl;
 }
 
+void
+download_set_expected_size(download_t *dl, uint64_t size)
+{
+	ASSERT(dl);
+	dl->expected = size;
+}
+
+static void
+download_hash_free(download_t *dl)
+{
+	for (size_t i = 0; i < DOWNLOAD_HASH_COUNT; i++) {
+		EVP_MD_CTX_free(dl->md[i]);
+		dl->md[i] = NULL;
+	}
+}
+
+static void
+download_hash_init(download_t *dl)
+{
+	static const EVP_MD *(*const md_types[])(void) = { EVP_sha1, EVP_sha256 };
+
+	download_hash_free(dl);
+	for (size_t i = 0; i < DOWNLOAD_HASH_COUNT; i++) {
+		dl->md[i] = EVP_MD_CTX_new();
+		if (!dl->md[i] || !EVP_DigestInit_ex(dl->md[i], md_types[i](), NULL)) {
+			// the file is just hashed again when it is verified
+			download_hash_free(dl);
+			return;
+		}
+	}
+}
+
+/**
+ * Hands the digests of a completely downloaded file to the hash cache, so that
+ * verifying the file does not read it again.
+ */
+static void
+download_hash_finish(download_t *dl)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len;
+	char hex[2 * EVP_MAX_MD_SIZE + 1];
+
+	for (size_t i = 0; i < DOWNLOAD_HASH_COUNT && dl->md[i]; i++) {
+		IF_TRUE_RETURN(!EVP_DigestFinal_ex(dl->md[i], md, &md_len));
+		hex_encode(hex, md, md_len);
+		crypto_hash_file_add_cached(dl->file, download_hash_algos[i], hex);
+	}
+}
+
+static void
+download_disconnect(download_t *dl)
+{
+	if (dl->io) {
+		event_remove_io(dl->io);
+		event_io_free(dl->io);
+		dl->io = NULL;
+		dl->io_events = 0;
+	}
+	if (dl->ssl) {
+		SSL_free(dl->ssl);
+		dl->ssl = NULL;
+	}
+	if (dl->sock >= 0) {
+		close(dl->sock);
+		dl->sock = -1;
+	}
+	mem_free0(dl->request);
+	mem_free0(dl->header);
+	dl->header_len = 0;
+}
+
+/**
+ * Releases all resources of a running download.
+ */
+static void
+download_stop(download_t *dl)
+{
+	download_disconnect(dl);
+	if (dl->tick) {
+		event_remove_timer(dl->tick);
+		event_timer_free(dl->tick);
+		dl->tick = NULL;
+	}
+	if (dl->out_fd >= 0) {
+		close(dl->out_fd);
+		dl->out_fd = -1;
+	}
+	download_active_list = list_remove(download_active_list, dl);
+}
+
 void
 download_free(download_t *dl)
 {
 	IF_NULL_RETURN(dl);
+	download_stop(dl);
+	download_hash_free(dl);
 	mem_free0(dl->url);
 	mem_free0(dl->file);
+	mem_free0(dl->host);
+	mem_free0(dl->port);
+	mem_free0(dl->path);
 	mem_free0(dl);
 }
 
 static void
-download_sigchld_cb(UNUSED int signum, event_signal_t *sig, void *data)
+download_finish(download_t *dl, bool success)
+{
+	if (success && dl->expected >= 0 && dl->size != dl->expected) {
+		ERROR("Downloaded %" PRId64 " bytes of %s, expected %" PRId64, (int64_t)dl->size,
+		      dl->url, (int64_t)dl->expected);
+		success = false;
+	}
+	if (success)
+		INFO("Downloaded %s (%" PRId64 " bytes)", dl->url, (int64_t)dl->size);
+	download_stop(dl);
+	if (success)
+		download_hash_finish(dl);
+	download_hash_free(dl);
+	dl->on_complete(dl, success, dl->data);
+}
+
+/**
+ * Watches the socket for the given events, replacing the current watch.
+ */
+static void
+download_watch(download_t *dl, unsigned int events)
+{
+	IF_TRUE_RETURN(dl->io && dl->io_events == events);
+
+	if (dl->io) {
+		event_remove_io(dl->io);
+		event_io_free(dl->io);
+		dl->io = NULL;
+	}
+	dl->io_events = events;
+	IF_TRUE_RETURN(!events);
+
+	dl->io = event_io_new(dl->sock, events, download_io_cb, dl);
+	event_add_io(dl->io);
+}
+
+/**
+ * Sets host, port and path of the download from an absolute http(s) url.
+ */
+static int
+download_set_location(download_t *dl, const char *url)
+{
+	const char *host;
+	if (!strncmp(url, "https://", 8)) {
+		dl->tls = true;
+		host = url + 8;
+	} else if (!strncmp(url, "http://", 7)) {
+		dl->tls = false;
+		host = url + 7;
+	} else {
+		ERROR("Unsupported url %s", url);
+		return -1;
+	}
+
+	const char *path = strchr(host, '/');
+	size_t host_len = path ? (size_t)(path - host) : strlen(host);
+	const char *port = NULL;
+
+	// IPv6 literals are enclosed in brackets
+	const char *host_end = host;
+	if (*host == '[') {
+		host_end = memchr(host, ']', host_len);
+		IF_NULL_RETVAL_ERROR(host_end, -1);
+	}
+	port = memchr(host_end, ':', host_len - (host_end - host));
+
+	mem_free0(dl->host);
+	mem_free0(dl->port);
+	mem_free0(dl->path);
+
+	if (*host == '[')
+		dl->host = mem_strndup(host + 1, host_end - host - 1);
+	else
+		dl->host = mem_strndup(host, port ? (size_t)(port - host) : host_len);
+	dl->port = port ? mem_strndup(port + 1, host_len - (port + 1 - host)) :
+			  mem_strdup(dl->tls ? "443" : "80");
+	dl->path = mem_strdup(path ? path : "/");
+	return 0;
+}
+
+static int
+download_ssl_init(void)
+{
+	IF_TRUE_RETVAL(download_ssl_ctx, 0);
+
+	download_ssl_ctx = SSL_CTX_new(TLS_client_method());
+	IF_NULL_RETVAL_ERROR(download_ssl_ctx, -1);
+
+	SSL_CTX_set_min_proto_version(download_ssl_ctx, TLS1_2_VERSION);
+	SSL_CTX_set_verify(download_ssl_ctx, SSL_VERIFY_PEER, NULL);
+	if (!SSL_CTX_set_default_verify_paths(download_ssl_ctx))
+		WARN("Could not load default CA certificates for downloads");
+	return 0;
+}
+
+static int
+download_ssl_error(download_t *dl, int ret)
+{
+	switch (SSL_get_error(dl->ssl, ret)) {
+	case SSL_ERROR_WANT_READ:
+		download_watch(dl, EVENT_IO_READ);
+		return -2;
+	case SSL_ERROR_WANT_WRITE:
+		download_watch(dl, EVENT_IO_WRITE);
+		return -2;
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	default:
+		ERROR("TLS error for %s: %s", dl->url, ERR_error_string(ERR_get_error(), NULL));
+		return -1;
+	}
+}
+
+/**
+ * Returns the number of bytes sent, -2 if the socket would block, or -1 on error.
+ */
+static ssize_t
+download_send(download_t *dl, const char *buf, size_t len)
+{
+	if (dl->ssl) {
+		int ret = SSL_write(dl->ssl, buf, len);
+		return ret > 0 ? ret : download_ssl_error(dl, ret);
+	}
+
+	ssize_t ret = send(dl->sock, buf, len, MSG_NOSIGNAL);
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		download_watch(dl, EVENT_IO_WRITE);
+		return -2;
+	}
+	if (ret < 0)
+		ERROR_ERRNO("Could not send request for %s", dl->url);
+	return ret;
+}
+
+/**
+ * Returns the number of bytes received, 0 at the end of the stream,
+ * -2 if the socket would block, or -1 on error.
+ */
+static ssize_t
+download_recv(download_t *dl, char *buf, size_t len)
+{
+	if (dl->ssl) {
+		int ret = SSL_read(dl->ssl, buf, len);
+		return ret > 0 ? ret : download_ssl_error(dl, ret);
+	}
+
+	ssize_t ret = recv(dl->sock, buf, len, 0);
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		download_watch(dl, EVENT_IO_READ);
+		return -2;
+	}
+	if (ret < 0)
+		ERROR_ERRNO("Could not receive %s", dl->url);
+	return ret;
+}
+
+static void
+download_build_request(download_t *dl)
+{
+	char *host = strchr(dl->host, ':') ? mem_printf("[%s]", dl->host) : mem_strdup(dl->host);
+	bool default_port = !strcmp(dl->port, dl->tls ? "443" : "80");
+
+	// HTTP/1.0 keeps servers from using chunked transfer encoding
+	char *range = dl->size > 0 ?
+			      mem_printf("Range: bytes=%" PRId64 "-\r\n", (int64_t)dl->size) :
+			      mem_strdup("");
+	dl->request = mem_printf("GET %s HTTP/1.0\r\n"
+				 "Host: %s%s%s\r\n"
+				 "User-Agent: cmld\r\n"
+				 "Accept-Encoding: identity\r\n"
+				 "%s"
+				 "\r\n",
+				 dl->path, host, default_port ? "" : ":",
+				 default_port ? "" : dl->port, range);
+	dl->request_len = strlen(dl->request);
+	dl->request_sent = 0;
+
+	mem_free0(range);
+	mem_free0(host);
+}
+
+/**
+ * Returns the value of the given header field or NULL.
+ */
+static char *
+download_header_get_new(const char *header, const char *name)
+{
+	size_t name_len = strlen(name);
+
+	for (const char *line = strstr(header, "\r\n"); line; line = strstr(line, "\r\n")) {
+		line += 2;
+		if (strncasecmp(line, name, name_len) || line[name_len] != ':')
+			continue;
+
+		const char *value = line + name_len + 1;
+		value += strspn(value, " \t");
+		return mem_strndup(value, strcspn(value, "\r\n"));
+	}
+	return NULL;
+}
+
+/**
+ * Handles redirects by reconnecting to the new location. Returns 0 if the
+ * download continues, -1 on error.
+ */
+static int
+download_redirect(download_t *dl, const char *location)
+{
+	if (++dl->redirects > DOWNLOAD_MAX_REDIRECTS) {
+		ERROR("Too many redirects for %s", dl->url);
+		return -1;
+	}
+
+	char *url;
+	if (location[0] == '/')
+		url = mem_printf("%s://%s%s%s%s%s%s", dl->tls ? "https" : "http",
+				 strchr(dl->host, ':') ? "[" : "", dl->host,
+				 strchr(dl->host, ':') ? "]" : "", ":", dl->port, location);
+	else
+		url = mem_strdup(location);
+
+	DEBUG("Redirecting download of %s to %s", dl->url, url);
+	int ret = download_set_location(dl, url);
+	mem_free0(url);
+	IF_TRUE_RETVAL(ret < 0, -1);
+
+	download_disconnect(dl);
+	return download_connect(dl);
+}
+
+/**
+ * Parses the response header and prepares the file for the body.
+ * Returns 1 if the body follows, 0 if the download continues elsewhere, -1 on error.
+ */
+static int
+download_handle_header(download_t *dl)
 {
-	download_t *dl = data;
-	ASSERT(dl);
-	pid_t wget_pid = dl->wget_pid;
-	pid_t pid = 0;
 	int status = 0;
-	DEBUG("SIGCHLD handler called for wget (PID=%d)", wget_pid);
-	if (wget_pid <= 0) {
-		DEBUG("wget PID not yet set; returning");
-		return;
+	if (sscanf(dl->header, "HTTP/%*d.%*d %d", &status) != 1) {
+		ERROR("Malformed response for %s", dl->url);
+		return -1;
+	}
+
+	char *encoding = download_header_get_new(dl->header, "Transfer-Encoding");
+	if (encoding && strcasecmp(encoding, "identity")) {
+		ERROR("Unsupported transfer encoding '%s' for %s", encoding, dl->url);
+		mem_free0(encoding);
+		return -1;
+	}
+	mem_free0(encoding);
+
+	if (status == 301 || status == 302 || status == 303 || status == 307 || status == 308) {
+		char *location = download_header_get_new(dl->header, "Location");
+		IF_NULL_RETVAL_ERROR(location, -1);
+		int ret = download_redirect(dl, location);
+		mem_free0(location);
+		return ret < 0 ? -1 : 0;
+	}
+
+	// the partial file is not a prefix of the resource, start over
+	if (status == 416 && dl->size > 0) {
+		WARN("Server rejected resuming %s at %" PRId64 ", restarting", dl->url,
+		     (int64_t)dl->size);
+		if (ftruncate(dl->out_fd, 0) < 0)
+			return -1;
+		dl->size = 0;
+		download_disconnect(dl);
+		return download_connect(dl) < 0 ? -1 : 0;
+	}
+
+	if (status != 200 && status != 206) {
+		ERROR("Server responded with status %d for %s", status, dl->url);
+		return -1;
+	}
+
+	char *length = download_header_get_new(dl->header, "Content-Length");
+	dl->content_left = length ? strtoll(length, NULL, 10) : -1;
+	mem_free0(length);
+
+	if (status == 206) {
+		char *range = download_header_get_new(dl->header, "Content-Range");
+		int64_t start = -1, total = -1;
+		if (!range || sscanf(range, "bytes %" SCNd64 "-%*d/%" SCNd64, &start, &total) < 1 ||
+		    start != dl->size) {
+			ERROR("Unexpected range '%s' for %s", range ? range : "", dl->url);
+			mem_free0(range);
+			return -1;
+		}
+		mem_free0(range);
+		dl->total = total;
+		INFO("Resuming download of %s at %" PRId64, dl->url, (int64_t)dl->size);
+	} else {
+		// the server ignored or does not support ranges
+		if (dl->size > 0 && ftruncate(dl->out_fd, 0) < 0) {
+			ERROR_ERRNO("Could not truncate %s", dl->file);
+			return -1;
+		}
+		dl->size = 0;
+		dl->total = dl->content_left;
 	}
-	bool remove = false;
-	while ((pid = waitpid(wget_pid, &status, WNOHANG))) {
-		if (pid == wget_pid) {
-			bool success = false;
-			if (WIFEXITED(status)) {
-				DEBUG("wget terminated with status=%d", WEXITSTATUS(status));
-				success = !WEXITSTATUS(status);
-			} else if (WIFSIGNALED(status)) {
-				DEBUG("wget killed by signal %d", WTERMSIG(status));
-			} else {
-				continue;
+
+	// a file of unexpected size can be rejected before its body is downloaded
+	if (dl->expected >= 0 && dl->total >= 0 && dl->total != dl->expected) {
+		ERROR("Server announced %" PRId64 " bytes for %s, expected %" PRId64,
+		      (int64_t)dl->total, dl->url, (int64_t)dl->expected);
+		return -1;
+	}
+
+	if (dl->size == 0)
+		download_hash_init(dl);
+	else
+		download_hash_free(dl);
+
+	if (lseek(dl->out_fd, dl->size, SEEK_SET) < 0)
+		return -1;
+	return 1;
+}
+
+/**
+ * Writes received body data to the file.
+ */
+static int
+download_write_body(download_t *dl, const char *buf, size_t len)
+{
+	if (dl->content_left >= 0 && (off_t)len > dl->content_left)
+		len = dl->content_left;
+
+	if (dl->expected >= 0 && (off_t)len > dl->expected - dl->size) {
+		ERROR("Received more than the expected %" PRId64 " bytes for %s",
+		      (int64_t)dl->expected, dl->url);
+		return -1;
+	}
+	if (fd_write(dl->out_fd, buf, len) != (ssize_t)len) {
+		ERROR_ERRNO("Could not write %s", dl->file);
+		return -1;
+	}
+	for (size_t i = 0; i < DOWNLOAD_HASH_COUNT && dl->md[i]; i++)
+		EVP_DigestUpdate(dl->md[i], buf, len);
+	dl->size += len;
+	if (dl->content_left >= 0)
+		dl->content_left -= len;
+	dl->last_progress = download_now_ms();
+	return 0;
+}
+
+/**
+ * Receives the response header. Returns 1 if the body follows, 0 while
+ * more data is needed or the download moved, -1 on error.
+ */
+static int
+download_recv_header(download_t *dl)
+{
+	if (!dl->header)
+		dl->header = mem_alloc0(DOWNLOAD_HEADER_MAX + 1);
+
+	for (;;) {
+		ssize_t len = download_recv(dl, dl->header + dl->header_len,
+					    DOWNLOAD_HEADER_MAX - dl->header_len);
+		IF_TRUE_RETVAL(len == -2, 0);
+		if (len <= 0) {
+			ERROR("Connection closed before response for %s", dl->url);
+			return -1;
+		}
+		dl->header_len += len;
+		dl->header[dl->header_len] = '\0';
+
+		char *end = strstr(dl->header, "\r\n\r\n");
+		if (!end) {
+			if (dl->header_len == DOWNLOAD_HEADER_MAX) {
+				ERROR("Response header too large for %s", dl->url);
+				return -1;
 			}
-			remove = true;
-			dl->on_complete(dl, success, dl->data);
-		} else if (pid == 0) {
-			DEBUG("waitpid child(ren) (PID %d) exist without state change", wget_pid);
-			break;
-		} else if (pid == -1) {
-			if (errno == ECHILD)
-				DEBUG("Process group of wget terminated completely");
-			else
-				WARN_ERRNO("waitpid failed for wget");
-			remove = true;
-			break;
-		} else {
-			DEBUG("Reaped a child with PID %d for wget", pid);
+			continue;
 		}
+
+		// keep the first part of the body received along with the header
+		size_t header_len = end + 4 - dl->header;
+		size_t body_len = dl->header_len - header_len;
+		char *body = mem_alloc(body_len + 1);
+		memcpy(body, end + 4, body_len);
+		end[2] = '\0';
+
+		int ret = download_handle_header(dl);
+		if (ret > 0) {
+			mem_free0(dl->header);
+			dl->header_len = 0;
+			dl->state = DOWNLOAD_STATE_BODY;
+			if (body_len && download_write_body(dl, body, body_len) < 0)
+				ret = -1;
+		}
+		mem_free0(body);
+		return ret;
 	}
-	if (remove) {
-		event_remove_signal(sig);
-		event_signal_free(sig);
+}
+
+/**
+ * Receives body data up to the rate limit. Returns 1 when the body is complete,
+ * 0 if more data is expected, -1 on error.
+ */
+static int
+download_recv_body(download_t *dl)
+{
+	char buf[DOWNLOAD_CHUNK_SIZE];
+
+	for (;;) {
+		if (dl->content_left == 0)
+			return 1;
+
+		size_t want = download_rate_allowance(sizeof(buf));
+		if (!want) {
+			// the tick resumes the download once the rate budget was refilled
+			dl->throttled = true;
+			download_watch(dl, 0);
+			return 0;
+		}
+
+		ssize_t len = download_recv(dl, buf, want);
+		IF_TRUE_RETVAL(len == -2, 0);
+		IF_TRUE_RETVAL(len < 0, -1);
+		if (len == 0) {
+			if (dl->content_left > 0) {
+				ERROR("Connection closed %" PRId64 " bytes before the end of %s",
+				      (int64_t)dl->content_left, dl->url);
+				return -1;
+			}
+			return 1;
+		}
+		download_rate_consume(len);
+		IF_TRUE_RETVAL(download_write_body(dl, buf, len) < 0, -1);
 	}
 }
 
-int
-download_start(download_t *dl)
+/**
+ * Advances the download's state machine as far as possible.
+ */
+static void
+download_progress(download_t *dl)
 {
+	int ret = 0;
+
+	switch (dl->state) {
+	case DOWNLOAD_STATE_CONNECT: {
+		int err = 0;
+		socklen_t err_len = sizeof(err);
+		if (getsockopt(dl->sock, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err) {
+			ERROR("Could not connect to %s:%s: %s", dl->host, dl->port, strerror(err));
+			goto error;
+		}
+		if (!dl->tls) {
+			dl->state = DOWNLOAD_STATE_REQUEST;
+			download_progress(dl);
+			return;
+		}
+
+		IF_TRUE_GOTO(download_ssl_init() < 0, error);
+		dl->ssl = SSL_new(download_ssl_ctx);
+		IF_NULL_GOTO_ERROR(dl->ssl, error);
+		SSL_set_fd(dl->ssl, dl->sock);
+		SSL_set_tlsext_host_name(dl->ssl, dl->host);
+		SSL_set1_host(dl->ssl, dl->host);
+		dl->state = DOWNLOAD_STATE_HANDSHAKE;
+	}
+	// fall through
+	case DOWNLOAD_STATE_HANDSHAKE: {
+		int r = SSL_connect(dl->ssl);
+		if (r <= 0) {
+			IF_TRUE_GOTO(download_ssl_error(dl, r) != -2, error);
+			return;
+		}
+		dl->state = DOWNLOAD_STATE_REQUEST;
+	}
+	// fall through
+	case DOWNLOAD_STATE_REQUEST:
+		if (!dl->request)
+			download_build_request(dl);
+		while (dl->request_sent < dl->request_len) {
+			ssize_t len = download_send(dl, dl->request + dl->request_sent,
+						    dl->request_len - dl->request_sent);
+			IF_TRUE_RETURN(len == -2);
+			IF_TRUE_GOTO(len <= 0, error);
+			dl->request_sent += len;
+		}
+		dl->state = DOWNLOAD_STATE_HEADER;
+		download_watch(dl, EVENT_IO_READ);
+	// fall through
+	case DOWNLOAD_STATE_HEADER:
+		ret = download_recv_header(dl);
+		IF_TRUE_GOTO(ret < 0, error);
+		// on redirects, the download already continues with a new connection
+		IF_TRUE_RETURN(ret == 0 || dl->state != DOWNLOAD_STATE_BODY);
+	// fall through
+	case DOWNLOAD_STATE_BODY:
+		ret = download_recv_body(dl);
+		IF_TRUE_GOTO(ret < 0, error);
+		if (ret > 0)
+			download_finish(dl, true);
+		return;
+	}
+	return;
+
+error:
+	WARN("Download of %s interrupted at %" PRId64 " bytes", dl->url, (int64_t)dl->size);
+	download_finish(dl, false);
+}
+
+static void
+download_io_cb(UNUSED int fd, UNUSED unsigned events, UNUSED event_io_t *io, void *data)
+{
+	download_t *dl = data;
 	ASSERT(dl);
-	pid_t pid = fork();
 
-	char *const argv[] = { WGET_PATH, "-O", dl->file, dl->url, NULL };
+	download_progress(dl);
+}
+
+static void
+download_tick_cb(UNUSED event_timer_t *timer, void *data)
+{
+	download_t *dl = data;
+	ASSERT(dl);
+
+	if (dl->throttled && download_rate_allowance(1)) {
+		dl->throttled = false;
+		download_watch(dl, EVENT_IO_READ);
+		download_progress(dl);
+		return;
+	}
+
+	if (!dl->throttled && download_now_ms() - dl->last_progress > DOWNLOAD_TIMEOUT) {
+		WARN("Download of %s timed out at %" PRId64 " bytes", dl->url, (int64_t)dl->size);
+		download_finish(dl, false);
+	}
+}
+
+static int
+download_connect(download_t *dl)
+{
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	struct addrinfo *res = NULL;
+
+	int err = getaddrinfo(dl->host, dl->port, &hints, &res);
+	if (err) {
+		ERROR("Could not resolve %s: %s", dl->host, gai_strerror(err));
+		return -1;
+	}
+
+	// the first address is tried, the download is retried as a whole on errors
+	dl->sock = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (dl->sock < 0) {
+		ERROR_ERRNO("Could not create socket for %s", dl->url);
+		freeaddrinfo(res);
+		return -1;
+	}
+	if (connect(dl->sock, res->ai_addr, res->ai_addrlen) < 0 && errno != EINPROGRESS) {
+		ERROR_ERRNO("Could not connect to %s:%s", dl->host, dl->port);
+		freeaddrinfo(res);
+		return -1;
+	}
+	freeaddrinfo(res);
+
+	dl->state = DOWNLOAD_STATE_CONNECT;
+	dl->last_progress = download_now_ms();
+	download_watch(dl, EVENT_IO_WRITE);
+	return 0;
+}
+
+static void
+download_copy_child_cb(pid_t pid, int status, event_child_t *child, void *data)
+{
+	download_t *dl = data;
+	ASSERT(dl);
+	bool success = false;
+
+	DEBUG("Copy of %s (PID=%d) terminated", dl->url, pid);
+	if (status < 0) {
+		WARN("Could not get exit status of copy");
+	} else if (WIFEXITED(status)) {
+		success = !WEXITSTATUS(status);
+	} else if (WIFSIGNALED(status)) {
+		DEBUG("Copy killed by signal %d", WTERMSIG(status));
+	}
+	event_child_free(child);
+	dl->copy_pid = -1;
+
+	download_finish(dl, success);
+}
+
+static int
+download_start_copy(download_t *dl)
+{
+	const char *local_dl_src = dl->url + 7;
 
+	pid_t pid = fork();
 	switch (pid) {
 	case -1:
-		ERROR_ERRNO("Could not fork wget to download image %s", dl->file);
+		ERROR_ERRNO("Could not fork to copy image %s", dl->file);
 		return -1;
 	case 0: {
-		if (strlen(dl->url) > 7 && !strncmp(dl->url, "file://", 7)) {
-			char *local_dl_src = dl->url + 7;
-			INFO("Copying file from %s -> %s", local_dl_src, dl->file);
-			int ret =
-				file_copy(local_dl_src, dl->file, file_size(local_dl_src), 512, 0);
-			if (ret < 0)
-				ERROR("Failed retrieving '%s'!", dl->url);
-			_exit(ret);
-		} else {
-			execvp(argv[0], argv);
-			ERROR_ERRNO("Could not exec %s", argv[0]);
-			_exit(-1);
-		}
+		INFO("Copying file from %s -> %s", local_dl_src, dl->file);
+		int ret = file_copy(local_dl_src, dl->file, file_size(local_dl_src), 512, 0);
+		if (ret < 0)
+			ERROR("Failed retrieving '%s'!", dl->url);
+		_exit(ret);
 	}
 	default:
-		DEBUG("Started wget with PID %d", pid);
-		dl->wget_pid = pid;
-		event_signal_t *sig = event_signal_new(SIGCHLD, download_sigchld_cb, dl);
-		event_add_signal(sig);
+		dl->copy_pid = pid;
+		event_child_t *child = event_child_new(pid, download_copy_child_cb, dl);
+		if (event_add_child(child) < 0) {
+			event_child_free(child);
+			return -1;
+		}
 		return 0;
 	}
 }
 
+int
+download_start(download_t *dl)
+{
+	ASSERT(dl);
+
+	if (strlen(dl->url) > 7 && !strncmp(dl->url, "file://", 7)) {
+		IF_TRUE_RETVAL(download_start_copy(dl) < 0, -1);
+		download_active_list = list_append(download_active_list, dl);
+		return 0;
+	}
+
+	dl->redirects = 0;
+	IF_TRUE_RETVAL(download_set_location(dl, dl->url) < 0, -1);
+
+	// a partial file of an interrupted download is resumed
+	dl->out_fd = open(dl->file, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (dl->out_fd < 0) {
+		ERROR_ERRNO("Could not open %s", dl->file);
+		return -1;
+	}
+	dl->size = lseek(dl->out_fd, 0, SEEK_END);
+	if (dl->size < 0 || download_connect(dl) < 0) {
+		download_stop(dl);
+		return -1;
+	}
+
+	dl->tick = event_timer_new(DOWNLOAD_TICK, EVENT_TIMER_REPEAT_FOREVER, download_tick_cb, dl);
+	event_add_timer(dl->tick);
+	download_active_list = list_append(download_active_list, dl);
+
+	DEBUG("Started download of %s to %s at offset %" PRId64, dl->url, dl->file,
+	      (int64_t)dl->size);
+	return 0;
+}
+
 const char *
 download_get_url(const download_t *dl)
 {
@@ -160,3 +943,24 @@ download_get_file(const download_t *dl)
 	ASSERT(dl);
 	return dl->file;
 }
+
+uint64_t
+download_get_size(const download_t *dl)
+{
+	ASSERT(dl);
+	return dl->size;
+}
+
+int64_t
+download_get_total(const download_t *dl)
+{
+	ASSERT(dl);
+	return dl->total;
+}
+
+void
+download_foreach_active(void (*func)(const download_t *dl, void *data), void *data)
+{
+	for (list_t *l = download_active_list; l; l = l->next)
+		func(l->data, data);
+}
@@ -26,10 +26,15 @@
 
 /**
  * @file downloader.h Defines an API to download files.
- * Uses 'wget' for now to do the actual work.
+ * HTTP(S) downloads run non-blocking on the event loop, so several downloads can be
+ * active at once. A partial file left by an interrupted download is resumed with a
+ * range request. file:// URLs are copied by a child process.
+ * A file downloaded from its start is hashed while it is written. The digests are added
+ * to the cache of crypto_hash, so verifying the file afterwards does not read it again.
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 
 /**
  * A structure representing a download.
@@ -53,6 +58,13 @@ typedef void (*download_callback_t)(download_t *dl, bool success, void *data);
 download_t *
 download_new(const char *url, const char *file, download_callback_t on_complete, void *data);
 
+/**
+ * Sets the size the downloaded file must have. The download fails as soon as the
+ * server announces or sends a different amount of data.
+ */
+void
+download_set_expected_size(download_t *dl, uint64_t size);
+
 /**
  * Frees the given download instance.
  * @param dl the download instance to free
@@ -80,4 +92,29 @@ download_get_url(const download_t *dl);
 const char *
 download_get_file(const download_t *dl);
 
+/**
+ * Returns the number of bytes of the file downloaded so far.
+ */
+uint64_t
+download_get_size(const download_t *dl);
+
+/**
+ * Returns the expected size of the downloaded file or -1 if it is not known (yet).
+ */
+int64_t
+download_get_total(const download_t *dl);
+
+/**
+ * Calls func for each download which has been started but not completed yet.
+ */
+void
+download_foreach_active(void (*func)(const download_t *dl, void *data), void *data);
+
+/**
+ * Limits the bandwidth shared by all running downloads.
+ * @param bytes_per_sec the maximum rate in bytes per second, 0 for no limit
+ */
+void
+download_set_rate_limit(uint64_t bytes_per_sec);
+
 #endif // DOWNLOAD_H
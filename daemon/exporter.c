@@ -0,0 +1,226 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "exporter.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/event.h"
+#include "common/fd.h"
+#include "common/metrics.h"
+#include "common/sock.h"
+#include "common/str.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define EXPORTER_SOCKET SOCK_PATH(metrics)
+
+/* a client which does not take up the response within this time is dropped (ms) */
+#define EXPORTER_SEND_TIMEOUT 1000
+/* number of allocation sites logged by exporter_mem_leak_check */
+#define EXPORTER_LEAK_SITES 20
+
+static const char exporter_http_header[] = "HTTP/1.0 200 OK\r\n"
+					   "Content-Type: text/plain; version=0.0.4\r\n"
+					   "Connection: close\r\n\r\n";
+
+static int exporter_sock = -1;
+static event_io_t *exporter_accept_io = NULL;
+
+static int64_t
+exporter_get_dispatched(void *data)
+{
+	return event_get_dispatched(*(event_profile_type_t *)data);
+}
+
+static void
+exporter_metrics_init(void)
+{
+	static event_profile_type_t types[] = { EVENT_PROFILE_IO, EVENT_PROFILE_TIMER,
+						EVENT_PROFILE_SIGNAL, EVENT_PROFILE_INOTIFY };
+
+	for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		char *labels = mem_printf("type=\"%s\"", event_profile_type_to_string(types[i]));
+		metrics_func_new(METRICS_COUNTER, "cml_event_callbacks_total", labels,
+				 "Callbacks dispatched by the event loop of cmld.",
+				 exporter_get_dispatched, &types[i]);
+		mem_free0(labels);
+	}
+}
+
+/*
+ * Responds to any request, or to the client closing its sending side, with all
+ * metrics and closes the connection. The request itself is not inspected, as the
+ * socket only serves the metrics.
+ */
+static void
+exporter_cb_request(int fd, unsigned events, event_io_t *io, UNUSED void *data)
+{
+	if (events & EVENT_IO_READ) {
+		char buf[512];
+		if (read(fd, buf, sizeof(buf)) < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+
+		char *text = metrics_format_new();
+		if (fd_write(fd, exporter_http_header, strlen(exporter_http_header)) < 0 ||
+		    fd_write(fd, text, strlen(text)) < 0)
+			WARN_ERRNO("Could not send metrics to client %d", fd);
+		mem_free0(text);
+	}
+
+	event_remove_io(io);
+	event_io_free(io);
+	close(fd);
+}
+
+static void
+exporter_cb_accept(int fd, UNUSED unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+{
+	int client = sock_unix_accept(fd);
+	if (client < 0) {
+		WARN_ERRNO("Could not accept metrics client");
+		return;
+	}
+
+	// do not let a stalled client block the event loop for long
+	struct timeval timeout = { .tv_sec = EXPORTER_SEND_TIMEOUT / 1000,
+				   .tv_usec = (EXPORTER_SEND_TIMEOUT % 1000) * 1000 };
+	if (setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0)
+		WARN_ERRNO("Could not set send timeout of metrics client %d", client);
+
+	event_io_t *request = event_io_new(client, EVENT_IO_READ, exporter_cb_request, NULL);
+	event_add_io(request);
+}
+
+int
+exporter_init(bool socket)
+{
+	exporter_metrics_init();
+
+	IF_FALSE_RETVAL(socket, 0);
+
+	exporter_sock = sock_unix_create_and_bind(SOCK_STREAM, EXPORTER_SOCKET);
+	if (exporter_sock < 0) {
+		WARN("Could not create metrics socket %s", EXPORTER_SOCKET);
+		return -1;
+	}
+	if (listen(exporter_sock, 8) < 0) {
+		WARN_ERRNO("Could not listen on metrics socket %s", EXPORTER_SOCKET);
+		close(exporter_sock);
+		exporter_sock = -1;
+		return -1;
+	}
+
+	exporter_accept_io = event_io_new(exporter_sock, EVENT_IO_READ, exporter_cb_accept, NULL);
+	event_add_io(exporter_accept_io);
+
+	INFO("Serving metrics on %s", EXPORTER_SOCKET);
+	return 0;
+}
+
+static void
+exporter_append_site(str_t *out, uintptr_t site)
+{
+	Dl_info info;
+
+	if (!site) {
+		str_append(out, "[other sites]");
+	} else if (dladdr((void *)site, &info) && info.dli_sname) {
+		str_append_printf(out, "%s+0x%" PRIxPTR, info.dli_sname,
+				  site - (uintptr_t)info.dli_saddr);
+	} else if (info.dli_fname && info.dli_fbase) {
+		const char *name = strrchr(info.dli_fname, '/');
+		str_append_printf(out, "%s+0x%" PRIxPTR, name ? name + 1 : info.dli_fname,
+				  site - (uintptr_t)info.dli_fbase);
+	} else {
+		str_append_printf(out, "0x%" PRIxPTR, site);
+	}
+}
+
+char *
+exporter_mem_stats_new(size_t top)
+{
+	mem_site_stats_t total;
+	mem_site_stats_t *sites = mem_accounting_get_new(&total);
+	str_t *out = str_new(NULL);
+
+	str_append_printf(out, "accounting %s, %zu bytes live, %zu bytes peak, %" PRIu64
+			  " allocs, %" PRIu64 " frees\n",
+			  mem_accounting_is_enabled() ? "enabled" : "disabled", total.live_bytes,
+			  total.peak_bytes, total.allocs, total.frees);
+	str_append_printf(out, "%12s %12s %10s %10s  %s\n", "LIVE", "PEAK", "ALLOCS", "FREES",
+			  "SITE");
+	for (size_t i = 0; i < top && sites[i].allocs; i++) {
+		str_append_printf(out, "%12zu %12zu %10" PRIu64 " %10" PRIu64 "  ",
+				  sites[i].live_bytes, sites[i].peak_bytes, sites[i].allocs,
+				  sites[i].frees);
+		exporter_append_site(out, sites[i].site);
+		str_append(out, "\n");
+	}
+
+	mem_free0(sites);
+	return str_free(out, false);
+}
+
+void
+exporter_mem_leak_check(void)
+{
+	IF_FALSE_RETURN(mem_accounting_is_enabled());
+
+	mem_site_stats_t total;
+	mem_site_stats_t *sites = mem_accounting_get_new(&total);
+
+	if (total.live_bytes)
+		WARN("%zu bytes in %" PRIu64 " allocations still live", total.live_bytes,
+		     total.allocs - total.frees);
+	for (size_t i = 0; i < EXPORTER_LEAK_SITES && sites[i].live_bytes; i++) {
+		str_stack_t stack;
+		str_t *site = str_init_stack(&stack, NULL);
+		exporter_append_site(site, sites[i].site);
+		WARN("  %zu bytes in %" PRIu64 " allocations from %s", sites[i].live_bytes,
+		     sites[i].allocs - sites[i].frees, str_buffer(site));
+		str_free(site, true);
+	}
+
+	mem_free0(sites);
+}
+
+void
+exporter_cleanup(void)
+{
+	if (exporter_accept_io) {
+		event_remove_io(exporter_accept_io);
+		event_io_free(exporter_accept_io);
+		exporter_accept_io = NULL;
+	}
+	if (exporter_sock >= 0) {
+		close(exporter_sock);
+		exporter_sock = -1;
+	}
+}
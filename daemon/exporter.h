@@ -0,0 +1,73 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file exporter.h
+ *
+ * Exports the runtime metrics of cmld (see common/metrics.h). Besides the metrics
+ * the modules register themselves, the exporter registers the metrics of the event
+ * loop. All metrics can be queried with the GET_METRICS control command, and are
+ * optionally served in the Prometheus text format on a unix socket, e.g., to be
+ * scraped through a forwarding proxy.
+ *
+ * The exporter also formats the allocation statistics of common/mem.h, if their
+ * accounting was enabled by the device config.
+ */
+
+#ifndef EXPORTER_H
+#define EXPORTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Registers the metrics of the event loop and, if enabled, starts listening on the
+ * metrics socket.
+ *
+ * @param socket serve the metrics on the unix socket SOCK_PATH(metrics)
+ * @return 0 on success, -1 if the metrics socket could not be created
+ */
+int
+exporter_init(bool socket);
+
+void
+exporter_cleanup(void);
+
+/**
+ * Formats the allocation statistics of cmld per call site, resolved to the
+ * calling function where possible.
+ *
+ * @param top Number of sites to include, those with the most live bytes.
+ * @return Newly allocated text table.
+ */
+char *
+exporter_mem_stats_new(size_t top);
+
+/**
+ * Logs the allocations which are still live, e.g., at shutdown after all modules
+ * freed their memory, if the accounting of allocations is enabled.
+ */
+void
+exporter_mem_leak_check(void);
+
+#endif /* EXPORTER_H */
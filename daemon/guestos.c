@@ -26,6 +26,8 @@
 
 #include "hardware.h"
 #include "download.h"
+#include "delta.h"
+#include "chunk_index.h"
 #include "cmld.h"
 #include "smartcard.h"
 #include "tss.h"
@@ -34,7 +36,11 @@
 #include "common/macro.h"
 #include "common/mem.h"
 #include "common/file.h"
+#include "common/hex.h"
+#include "common/metrics.h"
+#include "common/fanout.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -54,8 +60,8 @@ struct guestos {
 
 #define GUESTOS_MAX_DOWNLOAD_ATTEMPTS 3
 #define GUESTOS_FLASHED_FILE "flash_complete" // TODO check contents of partitions instead!
-#define GUESTOS_FLASH_BLOCKSIZE 512	      // blocksize in bytes for flashing partitions
 #define GUESTOS_VERIFY_BLOCKSIZE 4096	      // blocksize in bytes for verifying partitions
+#define GUESTOS_FLASH_CHUNKSIZE (1 << 20)     // bytes read at once when diffing partitions
 
 /******************************************************************************/
 
@@ -170,18 +176,33 @@ typedef struct check_mount_image {
 	char *img_path; // free me after use
 	check_mount_image_complete_cb cb;
 	void *data;
+	uint64_t begin_ns; // metrics_now_ns() when hashing was requested
 } check_mount_image_t;
 
+// thorough checks of images, created on the first check
+static metrics_t *guestos_metrics_verify = NULL;
+static metrics_t *guestos_metrics_verify_bytes = NULL;
+
 static check_mount_image_t *
 check_mount_image_new(guestos_t *os, mount_entry_t *e, char *img_path,
 		      check_mount_image_complete_cb cb, void *data)
 {
+	if (!guestos_metrics_verify) {
+		guestos_metrics_verify =
+			metrics_new(METRICS_HISTOGRAM, "cml_image_verify_seconds", NULL,
+				    "Time to hash and verify a guest OS image.");
+		guestos_metrics_verify_bytes =
+			metrics_new(METRICS_COUNTER, "cml_image_verify_bytes_total", NULL,
+				    "Size of the guest OS images hashed for verification.");
+	}
+
 	check_mount_image_t *task = mem_new(check_mount_image_t, 1);
 	task->os = os;
 	task->e = e;
 	task->cb = cb;
 	task->img_path = mem_strdup(img_path);
 	task->data = data;
+	task->begin_ns = metrics_now_ns();
 	return task;
 }
 
@@ -194,64 +215,26 @@ check_mount_image_free(check_mount_image_t *task)
 }
 
 static void
-check_mount_image_cb_sha256(const char *hash_string, UNUSED const char *hash_file,
-			    UNUSED smartcard_crypto_hashalgo_t hash_algo, void *data)
+check_mount_image_cb_hashes(const char *const *hash_strings, UNUSED size_t n,
+			    UNUSED const char *hash_file, void *data)
 {
 	check_mount_image_t *task = data;
 	ASSERT(task);
 
-	bool match = mount_entry_match_sha256(task->e, hash_string);
+	if (hash_strings) {
+		metrics_observe(guestos_metrics_verify, metrics_now_ns() - task->begin_ns);
+		metrics_add(guestos_metrics_verify_bytes, mount_entry_get_size(task->e));
+	}
+
+	// SHA1 and SHA256 have been computed in a single pass over the image
+	bool match = hash_strings && mount_entry_match_sha1(task->e, hash_strings[0]) &&
+		     mount_entry_match_sha256(task->e, hash_strings[1]);
 	task->cb(match ? CHECK_IMAGE_GOOD : CHECK_IMAGE_HASH_MISMATCH, task->os, task->e,
 		 task->data);
 
 	check_mount_image_free(task);
 }
 
-static void
-check_mount_image_cb_sha1(const char *hash_string, UNUSED const char *hash_file,
-			  UNUSED smartcard_crypto_hashalgo_t hash_algo, void *data)
-{
-	check_mount_image_t *task = data;
-	ASSERT(task);
-
-	bool match = mount_entry_match_sha1(task->e, hash_string);
-	if (match) {
-		// compute next hash
-		smartcard_crypto_hash_file(task->img_path, SHA256, check_mount_image_cb_sha256,
-					   task);
-		return;
-	}
-	task->cb(CHECK_IMAGE_HASH_MISMATCH, task->os, task->e, task->data);
-
-	check_mount_image_free(task);
-}
-
-static uint8_t *
-convert_hex_to_bin_new(const char *hex_str, int *out_length)
-{
-	int len = strlen(hex_str);
-	int i = 0, j = 0;
-	*out_length = (len + 1) / 2;
-
-	uint8_t *bin = mem_alloc0(*out_length);
-
-	if (len % 2 == 1) {
-		// odd length -> we need to pad
-		IF_FALSE_GOTO(sscanf(&(hex_str[0]), "%1hhx", &(bin[0])) == 1, err);
-		i = j = 1;
-	}
-
-	for (; i < len; i += 2, j++) {
-		IF_FALSE_GOTO(sscanf(&(hex_str[i]), "%2hhx", &(bin[j])) == 1, err);
-	}
-
-	return bin;
-err:
-	ERROR("Converstion of hex string to bin failed!");
-	mem_free0(bin);
-	return NULL;
-}
-
 guestos_check_mount_image_result_t
 guestos_check_mount_image_block(const guestos_t *os, const mount_entry_t *e, bool thorough)
 {
@@ -288,10 +271,11 @@ guestos_check_mount_image_block(const guestos_t *os, const mount_entry_t *e, boo
 			char *sha256 = smartcard_crypto_hash_file_block_new(img_path, SHA256);
 			match = mount_entry_match_sha256(e, sha256);
 			if (match) { // will only be executed if hash matches to signed config
-				int sha256_bin_len;
-				uint8_t *sha256_bin =
-					convert_hex_to_bin_new(sha256, &sha256_bin_len);
-				tss_ml_append(img_path, sha256_bin, sha256_bin_len, TSS_SHA256);
+				size_t sha256_bin_len = 0;
+				uint8_t *sha256_bin = hex_decode_new(sha256, &sha256_bin_len);
+				if (sha256_bin)
+					tss_ml_append(img_path, sha256_bin, sha256_bin_len,
+						      TSS_SHA256);
 				mem_free0(sha256_bin);
 			}
 			mem_free0(sha256);
@@ -360,178 +344,94 @@ guestos_check_mount_image(guestos_t *os, mount_entry_t *e, check_mount_image_com
 	char *img_path = mem_printf("%s/%s.img", guestos_get_dir(os), img_name);
 	DEBUG("Checking image %s (thorough, non-blocking)", img_path);
 
+	static const smartcard_crypto_hashalgo_t algos[] = { SHA1, SHA256 };
 	check_mount_image_t *task = check_mount_image_new(os, e, img_path, cb, data);
-	smartcard_crypto_hash_file(img_path, SHA1, check_mount_image_cb_sha1, task);
+	if (smartcard_crypto_hash_file_multi(img_path, algos, sizeof(algos) / sizeof(algos[0]),
+					     check_mount_image_cb_hashes, task) < 0) {
+		check_mount_image_free(task);
+		cb(CHECK_IMAGE_ERROR, os, e, data);
+	}
 
 	mem_free0(img_path);
 }
 
-// ITERATE IMAGES
-
-// internal task callback types
-typedef struct iterate_images iterate_images_t;
-
-typedef void (*iterate_images_callback_t)(iterate_images_t *task,
-					  guestos_check_mount_image_result_t res, mount_entry_t *e);
+// CHECK IMAGES
 
-typedef union {
-	guestos_images_check_complete_cb_t check_complete;
-	guestos_images_download_complete_cb_t download_complete;
-} iterate_images_on_complete_cb_t;
+/*
+ * Unlike downloads, image checks are independent of each other. Thus, up to
+ * GUESTOS_CHECK_IMAGES_PARALLEL of them are in flight at once, which the scd
+ * serves concurrently on its worker threads.
+ */
+#define GUESTOS_CHECK_IMAGES_PARALLEL 4
 
-struct iterate_images {
-	// locals
+typedef struct check_images {
 	guestos_t *os;
 	mount_t *mnt;
-	size_t n, i;
-	// iterator callback
-	iterate_images_callback_t iter_cb;
-	// callbacks to report back final result to caller
-	iterate_images_on_complete_cb_t on_complete;
-	void *complete_data;
-	// download
-	unsigned int dl_attempts;
-	unsigned int dl_count;
-	bool dl_started;
-};
-
-static iterate_images_t *
-iterate_images_new(guestos_t *os, mount_t *mnt, size_t n, iterate_images_callback_t iter_cb,
-		   iterate_images_on_complete_cb_t complete_cb, void *complete_data)
-{
-	iterate_images_t *task = mem_new(iterate_images_t, 1);
-	task->os = os;
-	task->mnt = mnt;
-	task->n = n;
-	task->i = 0;
-	task->iter_cb = iter_cb;
-	task->on_complete = complete_cb;
-	task->complete_data = complete_data;
-	task->dl_attempts = 0;
-	task->dl_count = 0;
-	task->dl_started = false;
-	return task;
-}
+	fanout_t *fanout;
+	guestos_images_check_complete_cb_t cb;
+	void *data;
+} check_images_t;
 
-static void
-iterate_images_free(iterate_images_t *task)
+/*
+ * Returns whether the image of the mount entry is provided by the GuestOS and thus
+ * has to be checked or downloaded.
+ */
+static bool
+guestos_mount_entry_has_image(const mount_entry_t *e)
 {
-	IF_NULL_RETURN(task);
-	mount_free(task->mnt);
-	mem_free0(task);
+	enum mount_type t = mount_entry_get_type(e);
+	return t == MOUNT_TYPE_SHARED || t == MOUNT_TYPE_FLASH || t == MOUNT_TYPE_OVERLAY_RO ||
+	       t == MOUNT_TYPE_SHARED_RW;
 }
 
 static void
-iterate_images_cb_check_image(guestos_check_mount_image_result_t res,
-			      UNUSED guestos_t *os /*already in task*/, mount_entry_t *e,
-			      void *data)
+check_images_cb_check_image(guestos_check_mount_image_result_t res, UNUSED guestos_t *os,
+			    mount_entry_t *e, void *data)
 {
-	iterate_images_t *task = data;
-	ASSERT(task);
+	check_images_t *task = data;
 	ASSERT(task->os == os);
 
-	task->iter_cb(task, res, e);
-}
-
-/**
- * Trigger image check for the next relevant (i.e. for SHARED or FLASH type) GuestOS image.
- *
- * @return true if next image was found and check for it was triggered, false otherwise.
- */
-static bool
-iterate_images_trigger_check(iterate_images_t *task)
-{
-	// look for next SHARED or FLASH type image
-	while (task->i < task->n) {
-		mount_entry_t *e = mount_get_entry(task->mnt, task->i);
-		enum mount_type t = mount_entry_get_type(e);
-		if (t == MOUNT_TYPE_SHARED || t == MOUNT_TYPE_FLASH || t == MOUNT_TYPE_OVERLAY_RO ||
-		    t == MOUNT_TYPE_SHARED_RW) {
-			DEBUG("Found next image %s.img for GuestOS %s v%" PRIu64
-			      ", triggering check.",
-			      mount_entry_get_img(e), guestos_get_name(task->os),
-			      guestos_get_version(task->os));
-			guestos_check_mount_image(task->os, e, iterate_images_cb_check_image, task);
-			return true;
-		}
-		++task->i;
+	if (res == CHECK_IMAGE_GOOD) {
+		DEBUG("GuestOS %s v%" PRIu64 " image %s.img is GOOD", guestos_get_name(task->os),
+		      guestos_get_version(task->os), mount_entry_get_img(e));
+	} else {
+		DEBUG("GuestOS %s v%" PRIu64 " image %s.img is BAD, stopping ...",
+		      guestos_get_name(task->os), guestos_get_version(task->os),
+		      mount_entry_get_img(e));
 	}
-	DEBUG("No more images to check for GuestOS %s v%" PRIu64 ", stopping iteration.",
-	      guestos_get_name(task->os), guestos_get_version(task->os));
-	return false;
+
+	fanout_item_done(task->fanout, res == CHECK_IMAGE_GOOD);
 }
 
-/**
- * Iterate over all (SHARED and FLASH type) images that are provided by the GuestOS
- * and call the given iter_cb callback for each of them.
- * The final result of the operation is returned via the complete_cb, if given.
- *
- * @param   os the GuestOS
- * @param   iter_cb the callback called for each GuestOS image
- * @param   complete_cb the callback to report the final result
- * @param   complete_data data parameter passed to the final result callback
- * @return  true if iteration was started (iter_cb should be called at least once),
- *	    false otherwise (e.g. when there are no images to iterate over)
- */
 static bool
-iterate_images_start(guestos_t *os, iterate_images_callback_t iter_cb,
-		     iterate_images_on_complete_cb_t on_complete, void *complete_data)
+check_images_start(UNUSED fanout_t *fanout, size_t index, void *data)
 {
-	ASSERT(os);
-
-	DEBUG("Iterating through images of GuestOS %s v%" PRIu64 "...", guestos_get_name(os),
-	      guestos_get_version(os));
+	check_images_t *task = data;
 
-	mount_t *mnt = mount_new(); // need to get "mounts" to get image URLs... feels wrong
-	guestos_fill_mount(os, mnt);
-	size_t n = mount_get_count(mnt);
-	if (n == 0) {
-		WARN("GuestOS %s v%" PRIu64 " has no mounts/images to iterate through.",
-		     guestos_get_name(os), guestos_get_version(os));
-		mount_free(mnt);
+	mount_entry_t *e = mount_get_entry(task->mnt, index);
+	if (!guestos_mount_entry_has_image(e))
 		return false;
-	}
 
-	iterate_images_t *task =
-		iterate_images_new(os, mnt, n, iter_cb, on_complete, complete_data);
-	if (iterate_images_trigger_check(task))
-		return true;
-
-	mount_free(mnt);
-	iterate_images_free(task);
-	return false;
+	DEBUG("Found next image %s.img for GuestOS %s v%" PRIu64 ", triggering check.",
+	      mount_entry_get_img(e), guestos_get_name(task->os), guestos_get_version(task->os));
+	guestos_check_mount_image(task->os, e, check_images_cb_check_image, task);
+	return true;
 }
 
-// CHECK IMAGES
-
 static void
-iterate_images_cb_check(iterate_images_t *task, guestos_check_mount_image_result_t res,
-			mount_entry_t *e)
+check_images_done(UNUSED fanout_t *fanout, bool good, void *data)
 {
-	ASSERT(task);
+	check_images_t *task = data;
 
-	bool good = (res == CHECK_IMAGE_GOOD);
-	if (good) {
-		DEBUG("GuestOS %s v%" PRIu64 " image %s.img is GOOD, proceeding ...",
-		      guestos_get_name(task->os), guestos_get_version(task->os),
-		      mount_entry_get_img(e));
-		task->i++;
-		if (iterate_images_trigger_check(task))
-			return;
+	if (good)
 		INFO("GuestOS %s v%" PRIu64 " is complete, all images are good.",
 		     guestos_get_name(task->os), guestos_get_version(task->os));
-	} else {
-		DEBUG("GuestOS %s v%" PRIu64 " image %s.img is BAD, stopping ...",
-		      guestos_get_name(task->os), guestos_get_version(task->os),
-		      mount_entry_get_img(e));
-	}
 
 	// bad or last image: notify caller
-	if (task->on_complete.check_complete)
-		task->on_complete.check_complete(good, task->os, task->complete_data);
+	task->cb(good, task->os, task->data);
 
-	// cleanup
-	iterate_images_free(task);
+	mount_free(task->mnt);
+	mem_free0(task);
 }
 
 void
@@ -541,56 +441,242 @@ guestos_images_check(guestos_t *os, guestos_images_check_complete_cb_t cb, void
 	ASSERT(cb);
 	INFO("Checking images of GuestOS %s v%" PRIu64 " (thorough)", guestos_get_name(os),
 	     guestos_get_version(os));
-	// prepare image iteration
-	if (!iterate_images_start(os, iterate_images_cb_check,
-				  (iterate_images_on_complete_cb_t){ .check_complete = cb },
-				  data)) {
+
+	check_images_t *task = mem_new0(check_images_t, 1);
+	task->os = os;
+	task->mnt = mount_new(); // need to get "mounts" to get image URLs... feels wrong
+	guestos_fill_mount(os, task->mnt);
+	task->cb = cb;
+	task->data = data;
+
+	size_t n = mount_get_count(task->mnt);
+	if (n == 0)
 		DEBUG("No images to check for GuestOS %s v%" PRIu64, guestos_get_name(os),
 		      guestos_get_version(os));
-		// notify caller and free
-		if (cb)
-			cb(true, os, data);
-	}
+
+	// after a bad image, no further checks are started
+	task->fanout = fanout_new(n, GUESTOS_CHECK_IMAGES_PARALLEL, check_images_start,
+				  check_images_done, task);
+	fanout_run(task->fanout);
 }
 
 // DOWNLOAD IMAGES
-/* TODO do we need this (notify caller about result)?
-typedef enum download_images_result {
-	DOWNLOAD_IMAGES_STARTED,
-	DOWNLOAD_IMAGES_ERROR,
-	DOWNLOAD_IMAGES_INPROGRESS
-} download_images_result_t;
-*/
+
+/*
+ * Bad images are downloaded concurrently, up to GUESTOS_DOWNLOAD_IMAGES_PARALLEL at once,
+ * sharing the bandwidth limit of the downloader. Each image is checked again after its
+ * download and retried up to GUESTOS_MAX_DOWNLOAD_ATTEMPTS times.
+ */
+#define GUESTOS_DOWNLOAD_IMAGES_PARALLEL 4
+
+typedef struct download_images {
+	guestos_t *os;
+	mount_t *mnt;
+	fanout_t *fanout;
+	unsigned int dl_count;
+	guestos_images_download_complete_cb_t cb;
+	void *data;
+} download_images_t;
+
+typedef struct download_image {
+	download_images_t *task;
+	mount_entry_t *e;
+	unsigned int attempts;
+	bool downloaded;  // the image has been downloaded completely at least once
+	bool delta_tried; // reconstruction from the delta base version was considered
+	bool fetched;	  // a download or reconstruction of the image was started
+	char *base_path;  // image of the delta base version
+} download_image_t;
+
 static void
-iterate_images_cb_download_complete(download_t *dl, bool success, void *data);
+download_image_cb_check(guestos_check_mount_image_result_t res, guestos_t *os, mount_entry_t *e,
+			void *data);
+
+static void
+download_image_done(download_image_t *img, bool good)
+{
+	download_images_t *task = img->task;
+
+	if (good && img->fetched)
+		task->dl_count++;
+	mem_free0(img->base_path);
+	mem_free0(img);
+
+	fanout_item_done(task->fanout, good);
+}
+
+static void
+download_image_cb_complete(download_t *dl, bool success, void *data)
+{
+	download_image_t *img = data;
+	ASSERT(img);
+
+	// the image was hashed while downloading, the check uses those digests
+	if (success) {
+		INFO("Download of %s succeeded!", download_get_url(dl));
+		img->downloaded = true;
+	} else {
+		// the partial file is kept, the next attempt resumes it
+		WARN("Download of %s failed!", download_get_url(dl));
+	}
+	download_free(dl);
+
+	guestos_check_mount_image(img->task->os, img->e, download_image_cb_check, img);
+}
+
+static char *
+download_image_get_url_new(const download_image_t *img, const char *suffix)
+{
+	guestos_t *os = img->task->os;
+
+	// check if guestos has update file server, use device.conf as fallback
+	const char *update_base_url = guestos_config_get_update_base_url(os->cfg) ?
+					      guestos_config_get_update_base_url(os->cfg) :
+					      cmld_get_device_update_base_url();
+	return mem_printf("%s/operatingsystems/%s/%s-%" PRIu64 "/%s.%s", update_base_url,
+			  hardware_get_name(), guestos_get_name(os), guestos_get_version(os),
+			  mount_entry_get_img(img->e), suffix);
+}
 
 static bool
-iterate_images_trigger_download(iterate_images_t *task)
+download_image_start(download_image_t *img);
+
+static void
+download_image_fallback(download_image_t *img)
 {
-	ASSERT(task);
+	WARN("Delta update of %s.img failed, downloading the complete image",
+	     mount_entry_get_img(img->e));
+	if (!download_image_start(img))
+		download_image_done(img, false);
+}
 
-	mount_entry_t *e = mount_get_entry(task->mnt, task->i);
-	const char *img_name = mount_entry_get_img(e);
+static void
+download_image_cb_delta_applied(bool success, UNUSED const char *out_file, void *data)
+{
+	download_image_t *img = data;
+	ASSERT(img);
+
+	guestos_t *os = img->task->os;
+	char *delta_path =
+		mem_printf("%s/%s.delta", guestos_get_dir(os), mount_entry_get_img(img->e));
+	if (unlink(delta_path) < 0 && errno != ENOENT)
+		WARN_ERRNO("Could not remove delta file %s", delta_path);
+	mem_free0(delta_path);
+
+	if (!success) {
+		download_image_fallback(img);
+		return;
+	}
+
+	// verify the result like a download, it is removed if the check fails
+	img->downloaded = true;
+	guestos_check_mount_image(os, img->e, download_image_cb_check, img);
+}
 
-	TRACE("dl_attempt = %u for %s.img", task->dl_attempts, img_name);
-	if (task->dl_attempts >= GUESTOS_MAX_DOWNLOAD_ATTEMPTS) {
+static void
+download_image_cb_delta_complete(download_t *dl, bool success, void *data)
+{
+	download_image_t *img = data;
+	ASSERT(img);
+
+	guestos_t *os = img->task->os;
+	char *img_path = mem_printf("%s/%s.img", guestos_get_dir(os), mount_entry_get_img(img->e));
+	if (success && !delta_apply(img->base_path, download_get_file(dl),
+				    mount_entry_get_delta_sha256(img->e), img_path,
+				    download_image_cb_delta_applied, img)) {
+		INFO("Download of %s succeeded, reconstructing %s", download_get_url(dl), img_path);
+		mem_free0(img_path);
+		download_free(dl);
+		return;
+	}
+	mem_free0(img_path);
+
+	if (unlink(download_get_file(dl)) < 0 && errno != ENOENT)
+		WARN_ERRNO("Could not remove delta file %s", download_get_file(dl));
+	download_free(dl);
+	download_image_fallback(img);
+}
+
+/**
+ * Starts downloading the delta file of the given image, if the GuestOS provides one
+ * and the image of the delta base version is present.
+ *
+ * @return true if the download was started, false otherwise.
+ */
+static bool
+download_image_start_delta(download_image_t *img)
+{
+	guestos_t *os = img->task->os;
+	const char *img_name = mount_entry_get_img(img->e);
+	uint64_t base_version = guestos_config_get_delta_base_version(os->cfg);
+
+	IF_TRUE_RETVAL(!base_version || !mount_entry_get_delta_sha256(img->e), false);
+
+	// GuestOS directories of all versions share the same parent directory
+	const char *base_dir_end = strrchr(guestos_get_dir(os), '/');
+	IF_NULL_RETVAL(base_dir_end, false);
+	img->base_path = mem_printf("%.*s/%s-%" PRIu64 "/%s.img",
+				    (int)(base_dir_end - guestos_get_dir(os)), guestos_get_dir(os),
+				    guestos_get_name(os), base_version, img_name);
+	if (!file_exists(img->base_path)) {
+		DEBUG("Base image %s for delta update of %s.img not available", img->base_path,
+		      img_name);
+		return false;
+	}
+
+	char *delta_path = mem_printf("%s/%s.delta", guestos_get_dir(os), img_name);
+	char *delta_url = download_image_get_url_new(img, "delta");
+	DEBUG("Downloading delta %s to %s against v%" PRIu64, delta_url, delta_path, base_version);
+	download_t *dl = download_new(delta_url, delta_path, download_image_cb_delta_complete, img);
+	mem_free0(delta_url);
+	mem_free0(delta_path);
+	if (download_start(dl) < 0) {
+		ERROR("Failed to start download for %s", download_get_url(dl));
+		download_free(dl);
+		return false;
+	}
+	img->fetched = true;
+	return true;
+}
+
+/**
+ * Starts the next download attempt for the given image. The first attempt tries to
+ * reconstruct the image from the delta base version.
+ *
+ * @return true if the download was started, false otherwise.
+ */
+static bool
+download_image_start(download_image_t *img)
+{
+	guestos_t *os = img->task->os;
+	const char *img_name = mount_entry_get_img(img->e);
+
+	if (!img->delta_tried) {
+		img->delta_tried = true;
+		if (download_image_start_delta(img))
+			return true;
+	}
+
+	TRACE("dl_attempt = %u for %s.img", img->attempts, img_name);
+	if (img->attempts >= GUESTOS_MAX_DOWNLOAD_ATTEMPTS) {
 		WARN("Maximum download attempts (%d) exceeded for %s.img. Aborting image downloads.",
 		     GUESTOS_MAX_DOWNLOAD_ATTEMPTS, img_name);
 		return false;
 	}
-	task->dl_attempts++; // increase dl_attempt counter
+	img->attempts++;
+
+	char *img_path = mem_printf("%s/%s.img", guestos_get_dir(os), img_name);
+	char *img_url = download_image_get_url_new(img, "img");
+
+	// a complete download which failed the check must not be resumed
+	if (img->downloaded && unlink(img_path) < 0 && errno != ENOENT)
+		WARN_ERRNO("Could not remove bad image %s", img_path);
+	img->downloaded = false;
 
-	// check if guestos has update file server, use device.conf as fallback
-	const char *update_base_url = guestos_config_get_update_base_url(task->os->cfg) ?
-					      guestos_config_get_update_base_url(task->os->cfg) :
-					      cmld_get_device_update_base_url();
-	char *img_path = mem_printf("%s/%s.img", guestos_get_dir(task->os), img_name);
-	char *img_url = mem_printf("%s/operatingsystems/%s/%s-%" PRIu64 "/%s.img", update_base_url,
-				   hardware_get_name(), guestos_get_name(task->os),
-				   guestos_get_version(task->os), img_name);
 	// invoke downloader
-	DEBUG("Downloading %s to %s (attempt=%u).", img_url, img_path, task->dl_attempts);
-	download_t *dl = download_new(img_url, img_path, iterate_images_cb_download_complete, task);
+	DEBUG("Downloading %s to %s (attempt=%u).", img_url, img_path, img->attempts);
+	download_t *dl = download_new(img_url, img_path, download_image_cb_complete, img);
+	download_set_expected_size(dl, mount_entry_get_size(img->e));
 	mem_free0(img_url);
 	mem_free0(img_path);
 	if (download_start(dl) < 0) {
@@ -598,72 +684,67 @@ iterate_images_trigger_download(iterate_images_t *task)
 		download_free(dl);
 		return false;
 	}
+	img->fetched = true;
 	return true;
 }
 
 static void
-iterate_images_cb_download_complete(download_t *dl, bool success, void *data)
+download_image_cb_check(guestos_check_mount_image_result_t res, UNUSED guestos_t *os,
+			mount_entry_t *e, void *data)
 {
-	iterate_images_t *task = data;
-	ASSERT(task);
+	download_image_t *img = data;
+	ASSERT(img);
+	ASSERT(img->task->os == os);
 
-	if (success) {
-		INFO("Download of %s succeeded!", download_get_url(dl));
-		bool res = iterate_images_trigger_check(task);
-		ASSERT(res);
-	} else {
-		WARN("Download of %s failed!", download_get_url(dl));
-		if (!iterate_images_trigger_download(task)) {
-			// notify caller
-			if (task->on_complete.download_complete)
-				task->on_complete.download_complete(false, task->dl_count, task->os,
-								    task->complete_data);
-			task->os->downloading = false;
-			// cleanup
-			iterate_images_free(task);
-		}
+	if (res == CHECK_IMAGE_GOOD) {
+		DEBUG("GuestOS %s v%" PRIu64 " image %s.img is GOOD, proceeding ...",
+		      guestos_get_name(os), guestos_get_version(os), mount_entry_get_img(e));
+		download_image_done(img, true);
+		return;
 	}
-	download_free(dl);
+
+	// bad image: trigger actual download, unless another image already failed
+	DEBUG("GuestOS %s v%" PRIu64 " image %s.img is BAD, triggering download ...",
+	      guestos_get_name(os), guestos_get_version(os), mount_entry_get_img(e));
+	if (!fanout_is_ok(img->task->fanout) || !download_image_start(img))
+		download_image_done(img, false);
+}
+
+static bool
+download_images_start(UNUSED fanout_t *fanout, size_t index, void *data)
+{
+	download_images_t *task = data;
+
+	mount_entry_t *e = mount_get_entry(task->mnt, index);
+	if (!guestos_mount_entry_has_image(e))
+		return false;
+
+	DEBUG("Found next image %s.img for GuestOS %s v%" PRIu64 ", triggering check.",
+	      mount_entry_get_img(e), guestos_get_name(task->os), guestos_get_version(task->os));
+
+	download_image_t *img = mem_new0(download_image_t, 1);
+	img->task = task;
+	img->e = e;
+	guestos_check_mount_image(task->os, e, download_image_cb_check, img);
+	return true;
 }
 
 static void
-iterate_images_cb_download_check(iterate_images_t *task, guestos_check_mount_image_result_t res,
-				 mount_entry_t *e)
+download_images_done(UNUSED fanout_t *fanout, bool good, void *data)
 {
-	ASSERT(task);
+	download_images_t *task = data;
 
-	bool good = (res == CHECK_IMAGE_GOOD);
-	if (good) {
-		DEBUG("GuestOS %s v%" PRIu64 " image %s.img is GOOD, proceeding ...",
-		      guestos_get_name(task->os), guestos_get_version(task->os),
-		      mount_entry_get_img(e));
-		task->dl_attempts = 0; // reset dl_attempt counter
-		if (task->dl_started) {
-			task->dl_count++;
-			task->dl_started = false;
-		}
-		task->i++;
-		if (iterate_images_trigger_check(task))
-			return;
+	if (good)
 		INFO("GuestOS %s v%" PRIu64 " is now complete, all images have been downloaded.",
 		     guestos_get_name(task->os), guestos_get_version(task->os));
-	} else {
-		// bad image: trigger actual download
-		DEBUG("GuestOS %s v%" PRIu64 " image %s.img is BAD, triggering download ...",
-		      guestos_get_name(task->os), guestos_get_version(task->os),
-		      mount_entry_get_img(e));
-		task->dl_started = true;
-		if (iterate_images_trigger_download(task))
-			return;
-	}
 
 	// notify caller
-	if (task->on_complete.download_complete)
-		task->on_complete.download_complete(good, task->dl_count, task->os,
-						    task->complete_data);
 	task->os->downloading = false;
-	// cleanup
-	iterate_images_free(task);
+	if (task->cb)
+		task->cb(good, task->dl_count, task->os, task->data);
+
+	mount_free(task->mnt);
+	mem_free0(task);
 }
 
 bool
@@ -691,96 +772,225 @@ guestos_images_download(guestos_t *os, guestos_images_download_complete_cb_t cb,
 		      guestos_get_name(os), guestos_get_version(os));
 		return os->downloading;
 	}
-	// prepare image iteration
-	os->downloading = true;
-	if (!iterate_images_start(os, iterate_images_cb_download_check,
-				  (iterate_images_on_complete_cb_t){ .download_complete = cb },
-				  data)) {
+
+	download_images_t *task = mem_new0(download_images_t, 1);
+	task->os = os;
+	task->mnt = mount_new(); // need to get "mounts" to get image URLs... feels wrong
+	guestos_fill_mount(os, task->mnt);
+	task->cb = cb;
+	task->data = data;
+
+	size_t n = mount_get_count(task->mnt);
+	if (n == 0) {
 		audit_log_event(NULL, SSA, CMLD, GUESTOS_MGMT, "download-os-nothing-to-download",
 				guestos_get_name(os), 0);
 		DEBUG("No images to download for GuestOS %s v%" PRIu64, guestos_get_name(os),
 		      guestos_get_version(os));
-		// notify caller
-		if (cb)
-			cb(true, 0, os, data);
-		os->downloading = false;
-		return os->downloading;
 	}
+
+	// the callback may already have been called when this returns
+	os->downloading = true;
+	task->fanout = fanout_new(n, GUESTOS_DOWNLOAD_IMAGES_PARALLEL, download_images_start,
+				  download_images_done, task);
+	fanout_run(task->fanout);
 	return os->downloading;
 }
 
+// DEDUPLICATE IMAGES
+
+static void
+guestos_images_dedup_cb(UNUSED int ret, UNUSED uint64_t shared, UNUSED void *data)
+{
+	// the result is logged by chunk_index, a failure just leaves the images unshared
+}
+
+void
+guestos_images_dedup(const guestos_t *os, const guestos_t *const *bases, size_t n)
+{
+	ASSERT(os);
+	IF_TRUE_RETURN(n == 0);
+
+	mount_t *mnt = mount_new();
+	guestos_fill_mount(os, mnt);
+	char **base_files = mem_new0(char *, n);
+
+	for (size_t i = 0; i < mount_get_count(mnt); i++) {
+		mount_entry_t *e = mount_get_entry(mnt, i);
+		enum mount_type t = mount_entry_get_type(e);
+		if (t != MOUNT_TYPE_SHARED && t != MOUNT_TYPE_FLASH && t != MOUNT_TYPE_OVERLAY_RO &&
+		    t != MOUNT_TYPE_SHARED_RW)
+			continue;
+
+		size_t n_files = 0;
+		for (size_t j = 0; j < n; j++) {
+			char *base_file = mem_printf("%s/%s.img", guestos_get_dir(bases[j]),
+						     mount_entry_get_img(e));
+			if (file_exists(base_file))
+				base_files[n_files++] = base_file;
+			else
+				mem_free0(base_file);
+		}
+
+		char *img_path =
+			mem_printf("%s/%s.img", guestos_get_dir(os), mount_entry_get_img(e));
+		if (n_files > 0)
+			chunk_index_dedup(img_path, (const char *const *)base_files, n_files,
+					  guestos_images_dedup_cb, NULL);
+		mem_free0(img_path);
+		for (size_t j = 0; j < n_files; j++)
+			mem_free0(base_files[j]);
+	}
+
+	mem_free0(base_files);
+	mount_free(mnt);
+}
+
 // FLASH IMAGES
 
-typedef enum {
-	VERIFY_PARTITION_MATCH,
-	VERIFY_PARTITION_ERROR,
-	VERIFY_PARTITION_MISMATCH,
-} verify_partition_result_t;
+/**
+ * Reads up to len bytes, retrying on short reads until EOF.
+ */
+static ssize_t
+flash_read_full(int fd, char *buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = read(fd, buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+static int
+flash_write_run(int fd, const char *buf, size_t len, off_t off)
+{
+	while (len > 0) {
+		ssize_t n = pwrite(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
 
 /**
- * Verifies if the contents of the partition and image match.
+ * Compares the image with the partition in large chunks and, unless dry_run is set,
+ * rewrites only the GUESTOS_VERIFY_BLOCKSIZE blocks of the partition that differ.
+ * Adjacent differing blocks are written at once and the partition is synced once at
+ * the end. Written data is dropped from the page cache, so a following verification
+ * reads back what actually hit the partition.
  *
  * @param img_path path to the image file
  * @param part_path full path to the partition
- * @return whether the contents MATCH or MISMATCH, or ERROR if something goes wrong
+ * @param dry_run only compare, do not write anything
+ * @return the number of differing blocks, -1 on error
  */
-static verify_partition_result_t
-verify_partition(const char *img_path, const char *part_path)
+static ssize_t
+flash_partition_diff(const char *img_path, const char *part_path, bool dry_run)
 {
 	ASSERT(img_path);
 	ASSERT(part_path);
 
-	verify_partition_result_t res = VERIFY_PARTITION_ERROR;
-	int img = open(img_path, O_RDONLY);
-	int part = open(part_path, O_RDONLY);
+	ssize_t diff_blocks = -1;
+	char *img_buf = NULL, *part_buf = NULL;
+	int img = open(img_path, O_RDONLY | O_CLOEXEC);
+	int part = open(part_path, (dry_run ? O_RDONLY : O_RDWR) | O_CLOEXEC);
 	if (img == -1) {
 		WARN_ERRNO("Verifying partition %s: Cannot open image %s for reading.", part_path,
 			   img_path);
-		goto cleanup_files;
+		goto cleanup;
 	}
 	if (part == -1) {
-		WARN_ERRNO("Verifying partition %s: Cannot open partition for reading.", part_path);
-		goto cleanup_files;
+		WARN_ERRNO("Verifying partition %s: Cannot open partition.", part_path);
+		goto cleanup;
 	}
 
-	char *img_buf = mem_alloc(GUESTOS_VERIFY_BLOCKSIZE);
-	char *part_buf = mem_alloc(GUESTOS_VERIFY_BLOCKSIZE);
-	ssize_t img_bytes, part_bytes;
-	do {
-		img_bytes = read(img, img_buf, GUESTOS_VERIFY_BLOCKSIZE);
+	posix_fadvise(img, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(part, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	img_buf = mem_alloc(GUESTOS_FLASH_CHUNKSIZE);
+	part_buf = mem_alloc(GUESTOS_FLASH_CHUNKSIZE);
+	diff_blocks = 0;
+
+	for (off_t off = 0;; off += GUESTOS_FLASH_CHUNKSIZE) {
+		ssize_t img_bytes = flash_read_full(img, img_buf, GUESTOS_FLASH_CHUNKSIZE);
 		if (img_bytes < 0) {
 			ERROR_ERRNO("Verifying partition %s: Cannot read from image %s.", part_path,
 				    img_path);
-			goto cleanup;
+			goto error;
 		}
-		if (img_bytes == 0) {
-			DEBUG("Verifying partition %s: Success. Content matches with image %s.",
-			      part_path, img_path);
-			res = VERIFY_PARTITION_MATCH;
-			goto cleanup;
-		}
-		ASSERT(img_bytes <= GUESTOS_VERIFY_BLOCKSIZE);
-		part_bytes = read(part, part_buf, img_bytes);
+		if (img_bytes == 0)
+			break;
+
+		ssize_t part_bytes = flash_read_full(part, part_buf, img_bytes);
 		if (part_bytes < 0) {
 			ERROR_ERRNO("Verifying partition %s: Cannot read from partition.",
 				    part_path);
-			goto cleanup;
+			goto error;
 		}
-	} while (img_bytes == part_bytes && !memcmp(img_buf, part_buf, img_bytes));
+		if (part_bytes < img_bytes) {
+			ERROR("Verifying partition %s: Partition is smaller than image %s.",
+			      part_path, img_path);
+			goto error;
+		}
+
+		// collect runs of differing blocks and write each run at once
+		ssize_t run_start = -1;
+		for (ssize_t pos = 0;; pos += GUESTOS_VERIFY_BLOCKSIZE) {
+			bool end = pos >= img_bytes;
+			size_t len = end ? 0 : MIN(GUESTOS_VERIFY_BLOCKSIZE, img_bytes - pos);
+			if (!end && memcmp(img_buf + pos, part_buf + pos, len)) {
+				diff_blocks++;
+				if (run_start < 0)
+					run_start = pos;
+				continue;
+			}
+			ssize_t run_end = MIN(pos, img_bytes);
+			if (run_start >= 0 && !dry_run &&
+			    flash_write_run(part, img_buf + run_start, run_end - run_start,
+					    off + run_start) < 0) {
+				ERROR_ERRNO("Flashing partition %s: Cannot write at offset %lld.",
+					    part_path, (long long)(off + run_start));
+				goto error;
+			}
+			run_start = -1;
+			if (end)
+				break;
+		}
+
+		if (img_bytes < GUESTOS_FLASH_CHUNKSIZE)
+			break;
+	}
 
-	DEBUG("Verifying partition %s: Failed. Content differs from image %s.", part_path,
-	      img_path);
-	res = VERIFY_PARTITION_MISMATCH;
+	if (!dry_run && diff_blocks > 0) {
+		if (fsync(part) < 0) {
+			ERROR_ERRNO("Flashing partition %s: Cannot sync partition.", part_path);
+			goto error;
+		}
+		posix_fadvise(part, 0, 0, POSIX_FADV_DONTNEED);
+	}
+	goto cleanup;
 
+error:
+	diff_blocks = -1;
 cleanup:
 	mem_free0(part_buf);
 	mem_free0(img_buf);
-cleanup_files:
 	if (img != -1)
 		close(img);
 	if (part != -1)
 		close(part);
-	return res;
+	return diff_blocks;
 }
 
 /**
@@ -820,30 +1030,19 @@ verify_flash_mount_entry(guestos_t *os, mount_entry_t *e)
 			mem_strdup(flash_partition);
 	DEBUG("Flashing image %s to partition %s", img_path, flash_path);
 
-	switch (verify_partition(img_path, flash_path)) {
-	case VERIFY_PARTITION_MATCH:
+	ssize_t diff_blocks = flash_partition_diff(img_path, flash_path, false);
+	if (diff_blocks < 0) {
+		ERROR("Failed to flash image %s to partition %s", img_path, flash_path);
+	} else if (diff_blocks == 0) {
 		DEBUG("Skipping flashing of partition %s: Already up to date with image %s.",
 		      flash_path, img_path);
 		res = 0;
-		break;
-	case VERIFY_PARTITION_MISMATCH:
-		DEBUG("Flashing partition %s with image %s.", flash_path, img_path);
-		file_copy(img_path, flash_path, mount_entry_get_size(e), GUESTOS_FLASH_BLOCKSIZE,
-			  0);
-
-		switch (verify_partition(img_path, flash_path)) {
-		case VERIFY_PARTITION_MATCH:
-			DEBUG("Successfully flashed image %s to %s", img_path, flash_path);
-			res = 1;
-			break;
-		default:
-			ERROR("Failed to flash image %s to partition %s", img_path, flash_path);
-			break;
-		}
-		break;
-	default:
+	} else if (flash_partition_diff(img_path, flash_path, true) != 0) {
 		ERROR("Failed to verify partition %s against image %s", flash_path, img_path);
-		break;
+	} else {
+		DEBUG("Successfully flashed image %s to %s, rewrote %zd blocks", img_path,
+		      flash_path, diff_blocks);
+		res = 1;
 	}
 
 	mem_free0(flash_path);
@@ -931,6 +1130,16 @@ guestos_purge(guestos_t *os)
 		if (file_exists(img_path) && unlink(img_path) < 0) {
 			WARN_ERRNO("Failed to erase file %s", img_path);
 		}
+		char *chunks_path = chunk_index_get_file_new(img_path);
+		if (file_exists(chunks_path) && unlink(chunks_path) < 0) {
+			WARN_ERRNO("Failed to erase file %s", chunks_path);
+		}
+		mem_free0(chunks_path);
+		char *readahead_path = mem_printf("%s" GUESTOS_READAHEAD_EXT, img_path);
+		if (file_exists(readahead_path) && unlink(readahead_path) < 0) {
+			WARN_ERRNO("Failed to erase file %s", readahead_path);
+		}
+		mem_free0(readahead_path);
 		mem_free0(img_path);
 	}
 	// remove config and signature file
@@ -43,6 +43,12 @@
 
 #include <stdbool.h>
 
+/**
+ * Suffix of the readahead profile kept next to a guestos image, which lists the
+ * ranges of the image read during the boot of a container, see c_vol.c.
+ */
+#define GUESTOS_READAHEAD_EXT ".readahead"
+
 /**
  * A structure to present an guest operating system
  */
@@ -185,6 +191,17 @@ guestos_images_download(guestos_t *os, guestos_images_download_complete_cb_t cb,
 int
 guestos_images_flash(guestos_t *os);
 
+/**
+ * Shares identical blocks of the images of the given GuestOS with the images of the
+ * same name of other versions of it in the background, see chunk_index.h.
+ *
+ * @param os the GuestOS whose images are deduplicated
+ * @param bases other versions of the GuestOS
+ * @param n number of other versions
+ */
+void
+guestos_images_dedup(const guestos_t *os, const guestos_t *const *bases, size_t n);
+
 /******************************************************************************/
 
 /**
@@ -25,10 +25,12 @@
 #include "guestos.pb-c.h"
 
 #include "mount.h"
+#include "config_cache.h"
 
 #include "common/macro.h"
 #include "common/mem.h"
 #include "common/protobuf.h"
+#include "common/file.h"
 
 /******************************************************************************/
 guestos_config_t *
@@ -37,8 +39,15 @@ guestos_config_new_from_file(const char *file)
 	ASSERT(file);
 	DEBUG("Loading GuestOS config from \"%s\".", file);
 
-	GuestOSConfig *cfg = (GuestOSConfig *)protobuf_message_new_from_textfile(
-		file, &guest_osconfig__descriptor);
+	GuestOSConfig *cfg = NULL;
+	off_t len = file_size(file);
+	if (len > 0) {
+		char *buf = mem_alloc(len);
+		if (file_read(file, buf, len) >= 0)
+			cfg = (GuestOSConfig *)config_cache_message_new(
+				file, (uint8_t *)buf, len, &guest_osconfig__descriptor);
+		mem_free0(buf);
+	}
 	if (!cfg) {
 		ERROR("Failed loading GuestOS config from file \"%s\".", file);
 	}
@@ -158,6 +167,58 @@ guestos_config_mount_type_to_protobuf(enum mount_type mt)
 }
 #endif // currently unused
 
+static enum mount_prealloc
+guestos_config_mount_prealloc_from_protobuf(GuestOSMount__Preallocation prealloc)
+{
+	switch (prealloc) {
+	case GUEST_OSMOUNT__PREALLOCATION__PREALLOC_NONE:
+		return MOUNT_PREALLOC_NONE;
+	case GUEST_OSMOUNT__PREALLOCATION__PREALLOC_KEEP_SIZE:
+		return MOUNT_PREALLOC_KEEP_SIZE;
+	case GUEST_OSMOUNT__PREALLOCATION__PREALLOC_FULL:
+		return MOUNT_PREALLOC_FULL;
+	default:
+		return MOUNT_PREALLOC_AUTO;
+	}
+}
+
+static void
+guestos_config_mount_crypt_opts_from_protobuf(const GuestOSMount *m, cryptfs_opts_t *opts)
+{
+	switch (m->integrity) {
+	case GUEST_OSMOUNT__INTEGRITY__INTEGRITY_BITMAP:
+		opts->integrity = CRYPTFS_INTEGRITY_BITMAP;
+		break;
+	case GUEST_OSMOUNT__INTEGRITY__INTEGRITY_DIRECT:
+		opts->integrity = CRYPTFS_INTEGRITY_DIRECT;
+		break;
+	case GUEST_OSMOUNT__INTEGRITY__INTEGRITY_NONE:
+		opts->integrity = CRYPTFS_INTEGRITY_NONE;
+		break;
+	default:
+		opts->integrity = CRYPTFS_INTEGRITY_JOURNAL;
+		break;
+	}
+
+	switch (m->crypt_cipher) {
+	case GUEST_OSMOUNT__CIPHER__CIPHER_ADIANTUM:
+		opts->cipher = CRYPTFS_CIPHER_ADIANTUM;
+		break;
+	case GUEST_OSMOUNT__CIPHER__CIPHER_AUTO:
+		opts->cipher = CRYPTFS_CIPHER_AUTO;
+		break;
+	default:
+		opts->cipher = CRYPTFS_CIPHER_AES_XTS;
+		break;
+	}
+
+	opts->sector_size = m->crypt_sector_size;
+	opts->no_workqueue = m->crypt_no_workqueue;
+	opts->same_cpu_crypt = m->crypt_same_cpu;
+	opts->submit_from_crypt_cpus = m->crypt_submit_from_crypt_cpus;
+	opts->allow_discards = m->crypt_allow_discards;
+}
+
 static void
 guestos_config_fill_mount_internal(GuestOSMount **mounts, size_t n_mounts, mount_t *mount)
 {
@@ -174,8 +235,20 @@ guestos_config_fill_mount_internal(GuestOSMount **mounts, size_t n_mounts, mount
 			mount_entry_set_sha1(e, m->image_sha1);
 		if (m->image_sha2_256)
 			mount_entry_set_sha256(e, m->image_sha2_256);
+		if (m->verity_root_hash)
+			mount_entry_set_verity(e, m->verity_data_size, m->verity_root_hash,
+					       m->verity_salt);
+		if (m->image_delta_sha2_256)
+			mount_entry_set_delta_sha256(e, m->image_delta_sha2_256);
 		if (m->mount_data)
 			mount_entry_set_mount_data(e, m->mount_data);
+		mount_entry_set_prealloc(
+			e, guestos_config_mount_prealloc_from_protobuf(m->preallocation));
+		mount_entry_set_ephemeral(e, m->ephemeral);
+
+		cryptfs_opts_t crypt_opts = { 0 };
+		guestos_config_mount_crypt_opts_from_protobuf(m, &crypt_opts);
+		mount_entry_set_crypt_opts(e, &crypt_opts);
 	}
 }
 
@@ -320,3 +393,10 @@ guestos_config_get_update_base_url(const guestos_config_t *cfg)
 	ASSERT(cfg);
 	return cfg->update_base_url;
 }
+
+uint64_t
+guestos_config_get_delta_base_version(const guestos_config_t *cfg)
+{
+	ASSERT(cfg);
+	return cfg->has_delta_base_version ? cfg->delta_base_version : 0;
+}
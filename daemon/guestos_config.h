@@ -166,4 +166,11 @@ guestos_config_get_feature_install_guest(const guestos_config_t *cfg);
 const char *
 guestos_config_get_update_base_url(const guestos_config_t *cfg);
 
+/**
+ * Returns the version of the GuestOS which delta files of this GuestOS's images
+ * apply to, or 0 if there are none.
+ */
+uint64_t
+guestos_config_get_delta_base_version(const guestos_config_t *cfg);
+
 #endif /* GUESTOS_CONFIG_H */
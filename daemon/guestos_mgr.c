@@ -34,18 +34,23 @@
 #include "common/list.h"
 #include "common/mem.h"
 #include "common/file.h"
-#include "common/fd.h"
 #include "common/dir.h"
 #include "common/event.h"
+#include "common/hashmap.h"
+#include "common/hex.h"
 
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <stdlib.h>
+
+#include <openssl/evp.h>
 
 #define GUESTOS_MGR_VERIFY_HASH_ALGO SHA512
-#define GUESTOS_MGR_FILE_MOVE_BLOCKSIZE 4096
+// obsolete GuestOS versions are verified and purged this long after startup
+#define GUESTOS_MGR_DEFERRED_PURGE_DELAY 60000
 
 // Log title and messages regarding trustme system updates.
 #define GUESTOS_MGR_UPDATE_TITLE "Trustme Update"
@@ -62,6 +67,23 @@
 
 static list_t *guestos_list = NULL;
 
+/* GuestOS versions whose config was not verified and loaded yet. At startup
+ * only the versions down to the latest complete one of each GuestOS are
+ * verified, older versions are deferred until they are actually used. */
+typedef struct guestos_mgr_deferred {
+	char *dir;	  // directory of the GuestOS version
+	char *dir_name;	  // last component of dir
+	char *name;	  // GuestOS name as encoded in the directory name
+	uint64_t version; // version as encoded in the directory name
+} guestos_mgr_deferred_t;
+
+static list_t *guestos_mgr_deferred_list = NULL;
+
+/* Outcomes of signature verifications, indexed by the sha256 of config, signature
+ * and certificate. Results are only kept in memory, a persistent cache would have
+ * to be trusted as much as the signatures it replaces. */
+static hashmap_t *guestos_mgr_verify_cache = NULL;
+
 static const char *guestos_basepath = NULL;
 static bool guestos_mgr_allow_locally_signed = false;
 
@@ -84,27 +106,124 @@ guestos_mgr_purge_obsolete(void)
 	}
 }
 
+static char *
+guestos_mgr_verify_cache_key_new(const unsigned char *cfg, size_t cfglen, const unsigned char *sig,
+				 size_t siglen, const unsigned char *cert, size_t certlen)
+{
+	const unsigned char *bufs[] = { cfg, sig, cert };
+	size_t lens[] = { cfglen, siglen, certlen };
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len;
+
+	char *key = mem_alloc0(3 * (2 * 32 + 1));
+	char *p = key;
+	for (size_t i = 0; i < 3; i++) {
+		if (!EVP_Digest(bufs[i], lens[i], md, &md_len, EVP_sha256(), NULL)) {
+			mem_free0(key);
+			return NULL;
+		}
+		hex_encode(p, md, md_len);
+		p += 2 * md_len;
+		*p++ = ':';
+	}
+	*--p = '\0';
+	return key;
+}
+
+/* results are stored as value + 1 in the cache, as VERIFY_GOOD would be NULL */
+static bool
+guestos_mgr_verify_cache_get(const char *key, smartcard_crypto_verify_result_t *result)
+{
+	IF_NULL_RETVAL(key, false);
+
+	uintptr_t cached = (uintptr_t)hashmap_get_str(guestos_mgr_verify_cache, key);
+	IF_FALSE_RETVAL(cached, false);
+
+	*result = (smartcard_crypto_verify_result_t)(cached - 1);
+	return true;
+}
+
+static void
+guestos_mgr_verify_cache_put(const char *key, smartcard_crypto_verify_result_t result)
+{
+	IF_NULL_RETURN(key);
+	// errors, e.g., an unreachable scd, do not tell anything about the config
+	IF_TRUE_RETURN(result == VERIFY_ERROR);
+
+	if (!guestos_mgr_verify_cache)
+		guestos_mgr_verify_cache = hashmap_new();
+
+	hashmap_put_str(guestos_mgr_verify_cache, key, (void *)((uintptr_t)result + 1));
+}
+
+/**
+ * Drops all cached verification results, e.g., after the trusted CAs changed.
+ */
+static void
+guestos_mgr_verify_cache_clear(void)
+{
+	IF_NULL_RETURN(guestos_mgr_verify_cache);
+
+	hashmap_free(guestos_mgr_verify_cache);
+	guestos_mgr_verify_cache = NULL;
+}
+
+static smartcard_crypto_verify_result_t
+guestos_mgr_verify_files(const char *cfg_file, const char *sig_file, const char *cert_file)
+{
+	smartcard_crypto_verify_result_t result = VERIFY_ERROR;
+	char *key = NULL;
+	off_t cfglen = file_size(cfg_file);
+	off_t siglen = file_size(sig_file);
+	off_t certlen = file_size(cert_file);
+	unsigned char *cfg = NULL, *sig = NULL, *cert = NULL;
+
+	IF_FALSE_RETVAL(cfglen > 0 && siglen > 0 && certlen > 0, VERIFY_ERROR);
+
+	// the verified buffers are the hashed ones, thus the cached result belongs to them
+	cfg = mem_alloc(cfglen);
+	sig = mem_alloc(siglen);
+	cert = mem_alloc(certlen);
+	if (file_read(cfg_file, (char *)cfg, cfglen) < 0 ||
+	    file_read(sig_file, (char *)sig, siglen) < 0 ||
+	    file_read(cert_file, (char *)cert, certlen) < 0)
+		goto out;
+
+	key = guestos_mgr_verify_cache_key_new(cfg, cfglen, sig, siglen, cert, certlen);
+	if (guestos_mgr_verify_cache_get(key, &result)) {
+		DEBUG("Using cached verification result for %s", cfg_file);
+	} else {
+		result = smartcard_crypto_verify_buf_block(cfg, cfglen, sig, siglen, cert, certlen,
+							   GUESTOS_MGR_VERIFY_HASH_ALGO);
+		guestos_mgr_verify_cache_put(key, result);
+	}
+out:
+
+	mem_free0(cfg);
+	mem_free0(sig);
+	mem_free0(cert);
+	mem_free0(key);
+	return result;
+}
+
 /**
  * This function verifies the guestos configuration file at load time
  * as part of TSF.CML.SecureCompartmentInit
+ *
+ * @return the loaded GuestOS or NULL if it could not be verified or loaded
  */
-static int
-guestos_mgr_load_operatingsystems_cb(const char *path, const char *name, UNUSED void *data)
+static guestos_t *
+guestos_mgr_load_dir(const char *dir, const char *name)
 {
-	int res = 0; // counter
+	guestos_t *os = NULL;
 	guestos_verify_result_t guestos_verified = GUESTOS_UNSIGNED;
 
-	char *dir = mem_printf("%s/%s", path, name);
-	if (!file_is_dir(dir)) {
-		goto cleanup;
-	}
-
 	char *cfg_file = guestos_get_cfg_file_new(dir);
 	char *sig_file = guestos_get_sig_file_new(dir);
 	char *cert_file = guestos_get_cert_file_new(dir);
 
-	smartcard_crypto_verify_result_t verify_result = smartcard_crypto_verify_file_block(
-		cfg_file, sig_file, cert_file, GUESTOS_MGR_VERIFY_HASH_ALGO);
+	smartcard_crypto_verify_result_t verify_result =
+		guestos_mgr_verify_files(cfg_file, sig_file, cert_file);
 
 	switch (verify_result) {
 	case VERIFY_GOOD:
@@ -129,23 +248,148 @@ guestos_mgr_load_operatingsystems_cb(const char *path, const char *name, UNUSED
 
 		ERROR("Signature verification failed (%d) while loading GuestOS config %s, skipping.",
 		      verify_result, cfg_file);
-		res = 1;
 		goto cleanup_files;
 	}
 
-	if (guestos_mgr_add_from_file(cfg_file, guestos_verified) < 0) {
+	os = guestos_new_from_file(cfg_file, guestos_basepath);
+	if (!os) {
 		audit_log_event(NULL, FSA, CMLD, GUESTOS_MGMT, "load-os-failed-to-add", cfg_file,
 				0);
 		WARN("Could not add guest operating system from file %s.", cfg_file);
 	} else {
 		audit_log_event(NULL, SSA, CMLD, GUESTOS_MGMT, "load-os", cfg_file, 0);
-		res = 1;
+		guestos_set_verify_result(os, guestos_verified);
+		guestos_list = list_append(guestos_list, os);
 	}
 
 cleanup_files:
 	mem_free0(cfg_file);
 	mem_free0(sig_file);
 	mem_free0(cert_file);
+	return os;
+}
+
+static void
+guestos_mgr_deferred_free(guestos_mgr_deferred_t *deferred)
+{
+	mem_free0(deferred->dir);
+	mem_free0(deferred->dir_name);
+	mem_free0(deferred->name);
+	mem_free0(deferred);
+}
+
+/**
+ * Returns true if a complete GuestOS name newer than version has been loaded.
+ */
+static bool
+guestos_mgr_has_complete_newer(const char *name, uint64_t version)
+{
+	for (list_t *l = guestos_list; l; l = l->next) {
+		guestos_t *os = l->data;
+		if (!strcmp(name, guestos_get_name(os)) && guestos_get_version(os) > version &&
+		    guestos_images_are_complete(os, false))
+			return true;
+	}
+	return false;
+}
+
+static bool
+guestos_mgr_has_deferred(const char *name)
+{
+	for (list_t *l = guestos_mgr_deferred_list; l; l = l->next) {
+		guestos_mgr_deferred_t *deferred = l->data;
+		if (!strcmp(name, deferred->name))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Verifies and loads the deferred versions of the GuestOS name, or of all GuestOSes
+ * if name is NULL, starting with the newest one. If only_needed is set, versions
+ * older than a loaded complete version stay deferred.
+ */
+static void
+guestos_mgr_load_deferred(const char *name, bool only_needed)
+{
+	for (;;) {
+		guestos_mgr_deferred_t *next = NULL;
+		for (list_t *l = guestos_mgr_deferred_list; l; l = l->next) {
+			guestos_mgr_deferred_t *deferred = l->data;
+			if (name && strcmp(name, deferred->name))
+				continue;
+			if (only_needed &&
+			    guestos_mgr_has_complete_newer(deferred->name, deferred->version))
+				continue;
+			if (!next || deferred->version > next->version)
+				next = deferred;
+		}
+		if (!next)
+			return;
+
+		guestos_mgr_deferred_list = list_remove(guestos_mgr_deferred_list, next);
+		guestos_mgr_load_dir(next->dir, next->dir_name);
+		guestos_mgr_deferred_free(next);
+	}
+}
+
+/**
+ * Verifies the deferred versions which are older than a complete version once
+ * startup is over and purges them, as guestos_mgr_purge_obsolete() would have
+ * done at startup. None of them can be used by a container.
+ */
+static void
+guestos_mgr_purge_deferred_cb(event_timer_t *timer, UNUSED void *data)
+{
+	event_timer_free(timer);
+
+	for (list_t *l = guestos_mgr_deferred_list; l;) {
+		guestos_mgr_deferred_t *deferred = l->data;
+		l = l->next;
+
+		if (!guestos_mgr_has_complete_newer(deferred->name, deferred->version))
+			continue;
+
+		guestos_mgr_deferred_list = list_remove(guestos_mgr_deferred_list, deferred);
+		guestos_t *os = guestos_mgr_load_dir(deferred->dir, deferred->dir_name);
+		if (os) {
+			guestos_list = list_remove(guestos_list, os);
+			guestos_purge(os);
+			guestos_free(os);
+		}
+		guestos_mgr_deferred_free(deferred);
+	}
+}
+
+static int
+guestos_mgr_load_operatingsystems_cb(const char *path, const char *name, UNUSED void *data)
+{
+	int res = 0;
+	char *dir = mem_printf("%s/%s", path, name);
+	if (!file_is_dir(dir)) {
+		goto cleanup;
+	}
+
+	// GuestOS directories are named <name>-<version>, see guestos_new_internal()
+	const char *sep = strrchr(name, '-');
+	char *end = NULL;
+	uint64_t version = 0;
+	if (sep && sep != name && sep[1]) {
+		errno = 0;
+		version = strtoull(sep + 1, &end, 10);
+	}
+	if (!end || *end || errno) {
+		res = guestos_mgr_load_dir(dir, name) ? 1 : 0;
+		goto cleanup;
+	}
+
+	guestos_mgr_deferred_t *deferred = mem_new0(guestos_mgr_deferred_t, 1);
+	deferred->dir = dir;
+	deferred->dir_name = mem_strdup(name);
+	deferred->name = mem_strndup(name, sep - name);
+	deferred->version = version;
+	guestos_mgr_deferred_list = list_append(guestos_mgr_deferred_list, deferred);
+	return 1;
 cleanup:
 	mem_free0(dir);
 	return res;
@@ -159,6 +403,15 @@ guestos_mgr_load_operatingsystems(void)
 		return -1;
 	}
 
+	guestos_mgr_load_deferred(NULL, true);
+	if (guestos_mgr_deferred_list) {
+		INFO("Deferred verification of %u older GuestOS versions",
+		     list_length(guestos_mgr_deferred_list));
+		event_timer_t *timer = event_timer_new(GUESTOS_MGR_DEFERRED_PURGE_DELAY, 1,
+						       &guestos_mgr_purge_deferred_cb, NULL);
+		event_add_timer(timer);
+	}
+
 	if (!guestos_list) {
 		// Seems we dont have any operating system on storage
 		WARN("No guest OS found on storage.");
@@ -240,6 +493,25 @@ guestos_mgr_delete(guestos_t *os)
 
 /******************************************************************************/
 
+/**
+ * Shares identical blocks of the images of the given GuestOS with the other versions
+ * of it which are still on disk.
+ */
+static void
+guestos_mgr_dedup_images(guestos_t *os)
+{
+	size_t n = 0;
+	const guestos_t **bases = mem_new0(const guestos_t *, list_length(guestos_list));
+
+	for (list_t *l = guestos_list; l; l = l->next) {
+		guestos_t *other = l->data;
+		if (other != os && !strcmp(guestos_get_name(other), guestos_get_name(os)))
+			bases[n++] = other;
+	}
+	guestos_images_dedup(os, bases, n);
+	mem_free0(bases);
+}
+
 static void
 download_complete_cb(bool complete, unsigned int count, guestos_t *os, void *data)
 {
@@ -272,6 +544,7 @@ download_complete_cb(bool complete, unsigned int count, guestos_t *os, void *dat
 					guestos_get_name(os), 0);
 			INFO("%s %s", GUESTOS_MGR_UPDATE_TITLE, GUESTOS_MGR_UPDATE_SUCCESS);
 			resp = CONTROL_RESPONSE_GUESTOS_MGR_INSTALL_COMPLETED;
+			guestos_mgr_dedup_images(os);
 		}
 	} else {
 		audit_log_event(NULL, FSA, CMLD, GUESTOS_MGMT, "download-os-failed",
@@ -344,28 +617,6 @@ guestos_mgr_update_images(void)
 	}
 }
 
-static char *
-write_to_tmpfile_new(unsigned char *buf, size_t buflen)
-{
-	/* this fixes the problem that /tmp is unshared between cmld and scd which is why
-	 * it cannot be used to share files to be hashed (e.g. newca_certs)
-	 * FIXME: move SCD in own container and introduce shared mount
-	 */
-	char *file = mem_printf("%s/shared/tmpXXXXXXXX", DEFAULT_BASE_PATH);
-	int fd = mkstemp(file);
-	if (fd != -1) {
-		int len = fd_write(fd, (char *)buf, buflen);
-		close(fd);
-		if (len >= 0 && (size_t)len == buflen)
-			return file;
-		ERROR("Failed to write entire data (%zu bytes) to temp file %s", buflen, file);
-	} else {
-		ERROR("Failed to create temp file.");
-	}
-	mem_free0(file);
-	return NULL;
-}
-
 static void
 push_config_verify_buf_cb(smartcard_crypto_verify_result_t verify_result, unsigned char *cfg_buf,
 			  size_t cfg_buf_len, unsigned char *sig_buf, size_t sig_buf_len,
@@ -376,6 +627,11 @@ push_config_verify_buf_cb(smartcard_crypto_verify_result_t verify_result, unsign
 	int *resp_fd = data;
 	ASSERT(resp_fd);
 
+	char *key = guestos_mgr_verify_cache_key_new(cfg_buf, cfg_buf_len, sig_buf, sig_buf_len,
+						     cert_buf, cert_buf_len);
+	guestos_mgr_verify_cache_put(key, verify_result);
+	mem_free0(key);
+
 	guestos_t *os = guestos_new_from_buffer(cfg_buf, cfg_buf_len, guestos_basepath);
 	const char *os_name = NULL;
 	if (!os) {
@@ -518,9 +774,22 @@ guestos_mgr_push_config(unsigned char *cfg, size_t cfglen, unsigned char *sig, s
 		audit_log_event(NULL, FSA, CMLD, GUESTOS_MGMT, "push-os-missing-certificate",
 				guestos_basepath, 0);
 	} else {
-		res = smartcard_crypto_verify_buf(cfg, cfglen, sig, siglen, cert, certlen,
-						  GUESTOS_MGR_VERIFY_HASH_ALGO,
-						  push_config_verify_buf_cb, cb_resp_fd);
+		// configs are pushed again, e.g., to retrigger the download of their images
+		smartcard_crypto_verify_result_t verify_result;
+		char *key = guestos_mgr_verify_cache_key_new(cfg, cfglen, sig, siglen, cert,
+							     certlen);
+		if (guestos_mgr_verify_cache_get(key, &verify_result)) {
+			DEBUG("Using cached verification result for pushed GuestOS config");
+			push_config_verify_buf_cb(verify_result, cfg, cfglen, sig, siglen, cert,
+						  certlen, GUESTOS_MGR_VERIFY_HASH_ALGO,
+						  cb_resp_fd);
+			res = 0;
+		} else {
+			res = smartcard_crypto_verify_buf(cfg, cfglen, sig, siglen, cert, certlen,
+							  GUESTOS_MGR_VERIFY_HASH_ALGO,
+							  push_config_verify_buf_cb, cb_resp_fd);
+		}
+		mem_free0(key);
 	}
 	if (res < 0) {
 		if (control_send_message(CONTROL_RESPONSE_GUESTOS_MGR_INSTALL_FAILED, resp_fd) < 0)
@@ -537,18 +806,12 @@ guestos_mgr_register_localca(unsigned char *cacert, size_t cacertlen)
 	int ret = -1;
 	IF_TRUE_RETVAL(file_exists(LOCALCA_ROOT_CERT), ret);
 
-	char *tmp_cacert_file = write_to_tmpfile_new(cacert, cacertlen);
-	IF_NULL_RETVAL(tmp_cacert_file, ret);
-
-	if ((ret = file_move(tmp_cacert_file, LOCALCA_ROOT_CERT, GUESTOS_MGR_FILE_MOVE_BLOCKSIZE)) <
-	    0) {
-		ERROR_ERRNO("Failed to move localca root certificate %s to %s", tmp_cacert_file,
-			    LOCALCA_ROOT_CERT);
+	if ((ret = file_write_atomic(LOCALCA_ROOT_CERT, (char *)cacert, cacertlen)) < 0) {
+		ERROR("Failed to install localca root certificate to %s", LOCALCA_ROOT_CERT);
 	} else {
-		INFO("Successfully installed localca root certificate %s to %s", tmp_cacert_file,
-		     LOCALCA_ROOT_CERT);
+		INFO("Successfully installed localca root certificate to %s", LOCALCA_ROOT_CERT);
+		guestos_mgr_verify_cache_clear();
 	}
-	mem_free0(tmp_cacert_file);
 	return ret;
 }
 
@@ -564,30 +827,31 @@ guestos_mgr_register_newca(unsigned char *cacert, size_t cacertlen)
 		return ret;
 	}
 
-	char *tmp_cacert_file = write_to_tmpfile_new(cacert, cacertlen);
-	IF_NULL_RETVAL(tmp_cacert_file, ret);
+	// the certificate is hashed in memory, no temporary copy is needed
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len;
+	if (!EVP_Digest(cacert, cacertlen, md, &md_len, EVP_sha1(), NULL)) {
+		ERROR("Failed to hash new ca certificate");
+		return ret;
+	}
 
-	char *cacert_hash = smartcard_crypto_hash_file_block_new(tmp_cacert_file, SHA1);
+	char *cacert_hash = hex_encode_new(md, md_len);
 	char *cacert_file = mem_printf("%s/%s", TRUSTED_CA_STORE, cacert_hash);
 	if (file_exists(cacert_file)) {
 		INFO("Certificate with hash %s already installed!", cacert_hash);
-		if (unlink(tmp_cacert_file))
-			WARN_ERRNO("Failed to delete tmpfile %s failed!", tmp_cacert_file);
 		ret = 0;
 		goto out;
 	}
 
-	if ((ret = file_move(tmp_cacert_file, cacert_file, GUESTOS_MGR_FILE_MOVE_BLOCKSIZE)) < 0) {
-		ERROR_ERRNO("Failed to move new ca certificate %s to %s", tmp_cacert_file,
-			    cacert_file);
+	if ((ret = file_write_atomic(cacert_file, (char *)cacert, cacertlen)) < 0) {
+		ERROR("Failed to install new ca certificate to %s", cacert_file);
 	} else {
-		INFO("Successfully installed new ca certificate %s to %s", tmp_cacert_file,
-		     cacert_file);
+		INFO("Successfully installed new ca certificate to %s", cacert_file);
+		guestos_mgr_verify_cache_clear();
 	}
 out:
 	mem_free0(cacert_file);
 	mem_free0(cacert_hash);
-	mem_free0(tmp_cacert_file);
 	return ret;
 }
 
@@ -619,12 +883,19 @@ guestos_mgr_get_latest_by_name(const char *name, bool complete)
 			}
 		}
 	}
+
+	if (!latest_os && guestos_mgr_has_deferred(name)) {
+		guestos_mgr_load_deferred(name, true);
+		return guestos_mgr_get_latest_by_name(name, complete);
+	}
 	return latest_os;
 }
 
 size_t
 guestos_mgr_get_guestos_count(void)
 {
+	// listing all GuestOSes uses the deferred ones
+	guestos_mgr_load_deferred(NULL, false);
 	return list_length(guestos_list);
 }
 
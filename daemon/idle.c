@@ -0,0 +1,190 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "idle.h"
+#include "cmld.h"
+#include "c_cgroups.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/event.h"
+#include "common/hashmap.h"
+#include "common/uuid.h"
+
+#include <time.h>
+
+#define IDLE_INTERVAL 10000
+
+/* running containers which used less cpu time than this over an interval are quiet */
+#define IDLE_CPU_PERMILLE 10
+
+typedef struct idle_state {
+	uint64_t last_active; // in ms since the epoch
+	bool running;	      // was running at the last check
+	bool frozen;	      // frozen by the idle policy
+} idle_state_t;
+
+static event_timer_t *idle_timer = NULL;
+static hashmap_t *idle_states = NULL; // idle_state_t by uuid_bin_t of the container
+
+static uint64_t
+idle_time_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static idle_state_t *
+idle_state_get(const container_t *container, bool create)
+{
+	const uuid_bin_t *key = uuid_get_bin(container_get_uuid(container));
+
+	idle_state_t *state = idle_states ? hashmap_get(idle_states, key, sizeof(uuid_bin_t)) :
+					    NULL;
+	if (state || !create)
+		return state;
+
+	if (!idle_states)
+		idle_states = hashmap_new();
+	state = mem_new0(idle_state_t, 1);
+	hashmap_put(idle_states, key, sizeof(uuid_bin_t), state);
+	return state;
+}
+
+/*
+ * A running container is active if its samples since the given time show cpu usage
+ * above IDLE_CPU_PERMILLE or any block io. Without samples, e.g. if sampling is
+ * disabled, containers are considered active.
+ */
+static bool
+idle_container_is_active(const container_t *container, uint64_t since)
+{
+	c_cgroups_stats_sample_t *samples = NULL;
+	size_t n = container_get_stats(container, since, &samples);
+
+	bool active = true;
+	if (n >= 2 && (samples[0].valid & samples[n - 1].valid & C_CGROUPS_STATS_CPU)) {
+		c_cgroups_stats_sample_t *first = &samples[0], *last = &samples[n - 1];
+		uint64_t cpu_ns = last->cpu_usage_ns - first->cpu_usage_ns;
+		uint64_t wall_ms = last->time - first->time;
+		active = !wall_ms || cpu_ns / 1000 >= wall_ms * IDLE_CPU_PERMILLE;
+		if (first->valid & last->valid & C_CGROUPS_STATS_IO)
+			active = active || last->io_read_bytes != first->io_read_bytes ||
+				 last->io_write_bytes != first->io_write_bytes;
+	}
+	mem_free0(samples);
+	return active;
+}
+
+static void
+idle_check(container_t *container, uint64_t now)
+{
+	unsigned int timeout = container_get_idle_freeze_timeout(container);
+	idle_state_t *state = idle_state_get(container, timeout > 0);
+	if (!state)
+		return;
+
+	container_state_t cstate = container_get_state(container);
+	if (cstate != CONTAINER_STATE_RUNNING) {
+		state->running = false;
+		if (cstate != CONTAINER_STATE_FROZEN && cstate != CONTAINER_STATE_FREEZING)
+			state->frozen = false;
+		return;
+	}
+
+	// (re)started or thawed since the last check
+	if (!state->running) {
+		state->running = true;
+		state->frozen = false;
+		state->last_active = now;
+		return;
+	}
+
+	if (idle_container_is_active(container, now - IDLE_INTERVAL)) {
+		state->last_active = now;
+		return;
+	}
+	if (now - state->last_active < (uint64_t)timeout * 1000)
+		return;
+
+	INFO("Container %s was idle for %u s, freezing it", container_get_description(container),
+	     timeout);
+	if (container_freeze(container) < 0) {
+		WARN("Could not freeze idle container %s", container_get_description(container));
+		state->last_active = now;
+		return;
+	}
+	state->frozen = true;
+}
+
+static void
+idle_cb(UNUSED event_timer_t *timer, UNUSED void *data)
+{
+	container_t *c0 = cmld_containers_get_c0();
+	uint64_t now = idle_time_ms();
+
+	for (int i = 0; i < cmld_containers_get_count(); i++) {
+		container_t *container = cmld_container_get_by_index(i);
+		if (container != c0)
+			idle_check(container, now);
+	}
+}
+
+void
+idle_init(void)
+{
+	idle_timer = event_timer_new(IDLE_INTERVAL, EVENT_TIMER_REPEAT_FOREVER, &idle_cb, NULL);
+	event_add_timer(idle_timer);
+}
+
+void
+idle_wake(container_t *container)
+{
+	ASSERT(container);
+
+	idle_state_t *state = idle_state_get(container, false);
+	if (!state)
+		return;
+
+	state->last_active = idle_time_ms();
+	if (!state->frozen || container_get_state(container) != CONTAINER_STATE_FROZEN)
+		return;
+
+	INFO("Activity for idle container %s, thawing it", container_get_description(container));
+	state->frozen = false;
+	if (container_unfreeze(container) < 0)
+		WARN("Could not thaw idle container %s", container_get_description(container));
+}
+
+void
+idle_remove(const container_t *container)
+{
+	ASSERT(container);
+	if (!idle_states)
+		return;
+
+	const uuid_bin_t *key = uuid_get_bin(container_get_uuid(container));
+	idle_state_t *state = hashmap_remove(idle_states, key, sizeof(uuid_bin_t));
+	mem_free0(state);
+}
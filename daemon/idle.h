@@ -0,0 +1,59 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file idle.h
+ *
+ * Idle policy: running containers with an idle_freeze_timeout which did not use any
+ * noticeable cpu time or block io for that long, according to their resource usage
+ * samples, are frozen. Their memory is then reclaimed in the background (see
+ * reclaim.h). On the next activity directed at the container, i.e., a connection on
+ * an activation socket, an exec or a forwarded uevent, it is thawed transparently.
+ * Containers frozen by other means are left alone.
+ */
+
+#ifndef IDLE_H
+#define IDLE_H
+
+#include "container.h"
+
+/**
+ * Starts the periodic idle checks of the containers.
+ */
+void
+idle_init(void);
+
+/**
+ * Records activity directed at the container and thaws it if it was frozen by the
+ * idle policy. Must be called before the container is expected to respond.
+ */
+void
+idle_wake(container_t *container);
+
+/**
+ * Drops the idle state of a container which is removed.
+ */
+void
+idle_remove(const container_t *container);
+
+#endif /* IDLE_H */
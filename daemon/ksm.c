@@ -22,12 +22,21 @@
  */
 
 #include "ksm.h"
+#include "cmld.h"
+#include "container.h"
 
 #include "common/macro.h"
+#include "common/mem.h"
 #include "common/event.h"
 #include "common/file.h"
 
+#include <fcntl.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
+
 #define KSM_PATH "/sys/kernel/mm/ksm/"
+#define KSM_PSI_MEMORY "/proc/pressure/memory"
 
 #define KSM_RELAXED_SLEEP_MILLISECS 1500
 #define KSM_RELAXED_PAGES_TO_SCAN 100
@@ -35,71 +44,237 @@
 #define KSM_AGGRESSIVE_SLEEP_MILLISECS 100
 #define KSM_AGGRESSIVE_PAGES_TO_SCAN 500
 
-static event_timer_t *ksm_timer;
+/*
+ * Bounds of the adaptive controller. It starts with the relaxed settings and moves
+ * in factors of two between idle (rarely scanning a few pages) and the aggressive
+ * settings, or beyond those under memory pressure with many containers running.
+ */
+#define KSM_CONTROL_INTERVAL 5000
+#define KSM_MIN_PAGES_TO_SCAN 25
+#define KSM_MAX_PAGES_TO_SCAN 4000
+#define KSM_MIN_SLEEP_MILLISECS 20
+#define KSM_MAX_SLEEP_MILLISECS 6000
+// the upper bound of pages_to_scan grows with the number of running containers
+#define KSM_PAGES_TO_SCAN_PER_CONTAINER 500
+// some avg10 of the PSI memory pressure (in percent) regarded as high resp. low
+#define KSM_PSI_HIGH 5.0
+#define KSM_PSI_LOW 0.5
+// newly shared pages per full scan below which scanning is not worth the cpu time
+#define KSM_MIN_GAIN_PER_SCAN 256
+
+typedef struct ksm_counters {
+	long pages_shared;
+	long pages_sharing;
+	long pages_unshared;
+	long pages_volatile;
+	long full_scans;
+} ksm_counters_t;
+
+static event_timer_t *ksm_timer;	// adaptive control, if the KSM counters are available
+static event_timer_t *ksm_relax_timer; // ends the aggressive phase without adaptive control
+
+// the knobs retuned by the adaptive control, kept open across calls
+static file_handle_t *ksm_sleep_millisecs_file;
+static file_handle_t *ksm_pages_to_scan_file;
+
+static int ksm_sleep_millisecs = KSM_RELAXED_SLEEP_MILLISECS;
+static int ksm_pages_to_scan = KSM_RELAXED_PAGES_TO_SCAN;
+static ksm_counters_t ksm_last;
+static time_t ksm_aggressive_until;
 
 static void
 ksm_set(int sleep_millisecs, int pages_to_scan)
 {
-	if (file_printf(KSM_PATH "sleep_millisecs", "%d", sleep_millisecs) < 0) {
+	if (sleep_millisecs == ksm_sleep_millisecs && pages_to_scan == ksm_pages_to_scan)
+		return;
+
+	if (file_handle_printf(ksm_sleep_millisecs_file, "%d", sleep_millisecs) < 0) {
 		WARN("Could not configure KSM; no kernel support?");
 		return;
 	}
-	if (file_printf(KSM_PATH "pages_to_scan", "%d", pages_to_scan) < 0) {
+	if (file_handle_printf(ksm_pages_to_scan_file, "%d", pages_to_scan) < 0) {
 		WARN("Could not configure KSM; no kernel support?");
+		return;
 	}
+	ksm_sleep_millisecs = sleep_millisecs;
+	ksm_pages_to_scan = pages_to_scan;
 }
 
-static void
-ksm_set_aggressive()
+static long
+ksm_read_counter(const char *name)
 {
-	DEBUG("Setting KSM aggressive settings (sleep_millisecs=%d, pages_to_scan=%d",
-	      KSM_AGGRESSIVE_SLEEP_MILLISECS, KSM_AGGRESSIVE_PAGES_TO_SCAN);
-	ksm_set(KSM_AGGRESSIVE_SLEEP_MILLISECS, KSM_AGGRESSIVE_PAGES_TO_SCAN);
+	char *path = mem_printf(KSM_PATH "%s", name);
+	char *str = file_read_new(path, 64);
+	long value = str ? strtol(str, NULL, 10) : -1;
+	mem_free0(str);
+	mem_free0(path);
+	return value;
+}
+
+static int
+ksm_read_counters(ksm_counters_t *counters)
+{
+	counters->pages_shared = ksm_read_counter("pages_shared");
+	counters->pages_sharing = ksm_read_counter("pages_sharing");
+	counters->pages_unshared = ksm_read_counter("pages_unshared");
+	counters->pages_volatile = ksm_read_counter("pages_volatile");
+	counters->full_scans = ksm_read_counter("full_scans");
+
+	return (counters->pages_shared < 0 || counters->pages_sharing < 0 ||
+		counters->pages_unshared < 0 || counters->pages_volatile < 0 ||
+		counters->full_scans < 0) ?
+		       -1 :
+		       0;
+}
+
+/*
+ * Returns the share of time in percent in which some tasks stalled on memory
+ * over the last 10 seconds, or -1 if the kernel does not provide PSI.
+ */
+static double
+ksm_read_memory_pressure(void)
+{
+	double avg10 = -1;
+	char *str = file_read_new(KSM_PSI_MEMORY, 256);
+	IF_NULL_RETVAL(str, -1);
+
+	// "some avg10=0.00 avg60=0.00 avg300=0.00 total=0"
+	if (sscanf(str, "some avg10=%lf", &avg10) != 1)
+		avg10 = -1;
+	mem_free0(str);
+	return avg10;
+}
+
+static int
+ksm_count_running_containers(void)
+{
+	int running = 0;
+	for (int i = 0; i < cmld_containers_get_count(); i++) {
+		if (container_get_state(cmld_container_get_by_index(i)) == CONTAINER_STATE_RUNNING)
+			running++;
+	}
+	return running;
 }
 
 static void
-ksm_set_relaxed()
+ksm_control_cb(UNUSED event_timer_t *timer, UNUSED void *data)
 {
-	DEBUG("Setting KSM relaxed settings (sleep_millisecs=%d, pages_to_scan=%d",
-	      KSM_RELAXED_SLEEP_MILLISECS, KSM_RELAXED_PAGES_TO_SCAN);
-	ksm_set(KSM_RELAXED_SLEEP_MILLISECS, KSM_RELAXED_PAGES_TO_SCAN);
+	ksm_counters_t now;
+	if (ksm_read_counters(&now) < 0) {
+		WARN("Could not read KSM counters, stopping adaptive KSM control");
+		event_remove_timer(ksm_timer);
+		event_timer_free(ksm_timer);
+		ksm_timer = NULL;
+		return;
+	}
+
+	long scans = now.full_scans - ksm_last.full_scans;
+	long gain = now.pages_sharing - ksm_last.pages_sharing;
+	double pressure = ksm_read_memory_pressure();
+	int containers = ksm_count_running_containers();
+
+	int max_pages = MIN(KSM_MAX_PAGES_TO_SCAN, containers * KSM_PAGES_TO_SCAN_PER_CONTAINER);
+	max_pages = MAX(KSM_AGGRESSIVE_PAGES_TO_SCAN, max_pages);
+	int sleep_millisecs = ksm_sleep_millisecs;
+	int pages_to_scan = ksm_pages_to_scan;
+
+	if (time(NULL) < ksm_aggressive_until) {
+		// a container just booted, merge its pages at least at the aggressive rate
+		sleep_millisecs = MIN(sleep_millisecs, KSM_AGGRESSIVE_SLEEP_MILLISECS);
+		pages_to_scan = MAX(pages_to_scan, KSM_AGGRESSIVE_PAGES_TO_SCAN);
+	} else if (pressure >= KSM_PSI_HIGH && containers > 1) {
+		// memory is scarce and there are candidates for merging, scan faster
+		sleep_millisecs /= 2;
+		pages_to_scan *= 2;
+	} else if (scans > 0) {
+		/*
+		 * A full pass over all mergeable memory completed since the last
+		 * decision; judge whether it paid off. Pages changing too quickly
+		 * to be merged (volatile) only cost cpu time.
+		 */
+		long gain_per_scan = gain / scans;
+		bool wasteful = now.pages_volatile > now.pages_sharing ||
+				gain_per_scan < KSM_MIN_GAIN_PER_SCAN;
+		if (wasteful && pressure < KSM_PSI_LOW) {
+			sleep_millisecs *= 2;
+			pages_to_scan /= 2;
+		} else if (!wasteful) {
+			sleep_millisecs /= 2;
+			pages_to_scan *= 2;
+		}
+	}
+
+	sleep_millisecs = MIN(KSM_MAX_SLEEP_MILLISECS, sleep_millisecs);
+	sleep_millisecs = MAX(KSM_MIN_SLEEP_MILLISECS, sleep_millisecs);
+	pages_to_scan = MAX(KSM_MIN_PAGES_TO_SCAN, MIN(max_pages, pages_to_scan));
+
+	if (sleep_millisecs != ksm_sleep_millisecs || pages_to_scan != ksm_pages_to_scan) {
+		DEBUG("Adjusting KSM (sleep_millisecs=%d, pages_to_scan=%d): sharing=%ld, "
+		      "unshared=%ld, volatile=%ld, gain=%ld in %ld scans, pressure=%.2f, "
+		      "%d containers",
+		      sleep_millisecs, pages_to_scan, now.pages_sharing, now.pages_unshared,
+		      now.pages_volatile, gain, scans, pressure, containers);
+		ksm_set(sleep_millisecs, pages_to_scan);
+	}
+
+	ksm_last = now;
 }
 
 static void
 ksm_set_aggressive_timeout_cb(UNUSED event_timer_t *timer, UNUSED void *data)
 {
-	ksm_set_relaxed();
+	DEBUG("Setting KSM relaxed settings (sleep_millisecs=%d, pages_to_scan=%d)",
+	      KSM_RELAXED_SLEEP_MILLISECS, KSM_RELAXED_PAGES_TO_SCAN);
+	ksm_set(KSM_RELAXED_SLEEP_MILLISECS, KSM_RELAXED_PAGES_TO_SCAN);
 
-	event_remove_timer(ksm_timer);
-	event_timer_free(ksm_timer);
-	ksm_timer = NULL;
+	event_remove_timer(ksm_relax_timer);
+	event_timer_free(ksm_relax_timer);
+	ksm_relax_timer = NULL;
 }
 
 void
 ksm_set_aggressive_for(int millisecs)
 {
-	ksm_set_aggressive();
+	DEBUG("Setting KSM aggressive settings (sleep_millisecs=%d, pages_to_scan=%d) for %d ms",
+	      KSM_AGGRESSIVE_SLEEP_MILLISECS, KSM_AGGRESSIVE_PAGES_TO_SCAN, millisecs);
+	ksm_set(MIN(ksm_sleep_millisecs, KSM_AGGRESSIVE_SLEEP_MILLISECS),
+		MAX(ksm_pages_to_scan, KSM_AGGRESSIVE_PAGES_TO_SCAN));
 
-	if (ksm_timer) {
+	/* the controller takes over again after millisecs time */
+	ksm_aggressive_until = time(NULL) + (millisecs + 999) / 1000;
+	IF_TRUE_RETURN(ksm_timer);
+
+	if (ksm_relax_timer) {
 		/* if there is already a timer, renew it */
-		event_remove_timer(ksm_timer);
-		event_timer_free(ksm_timer);
-		ksm_timer = NULL;
+		event_remove_timer(ksm_relax_timer);
+		event_timer_free(ksm_relax_timer);
 	}
+	ksm_relax_timer = event_timer_new(millisecs, 1, &ksm_set_aggressive_timeout_cb, NULL);
+	event_add_timer(ksm_relax_timer);
+}
 
-	/* register timer to relax KSM after millisecs time */
-	ksm_timer = event_timer_new(millisecs, 1, &ksm_set_aggressive_timeout_cb, NULL);
-	event_add_timer(ksm_timer);
+long
+ksm_get_merging_pages(pid_t pid)
+{
+	char *path = mem_printf("/proc/%d/ksm_merging_pages", pid);
+	char *str = file_read_new(path, 64);
+	long pages = str ? strtol(str, NULL, 10) : -1;
+	mem_free0(str);
+	mem_free0(path);
+	return pages;
 }
 
 int
 ksm_init()
 {
-	if (file_printf(KSM_PATH "sleep_millisecs", "%d", KSM_RELAXED_SLEEP_MILLISECS) < 0) {
+	ksm_sleep_millisecs_file = file_handle_open(KSM_PATH "sleep_millisecs", O_WRONLY);
+	ksm_pages_to_scan_file = file_handle_open(KSM_PATH "pages_to_scan", O_WRONLY);
+
+	if (file_handle_printf(ksm_sleep_millisecs_file, "%d", KSM_RELAXED_SLEEP_MILLISECS) < 0) {
 		WARN("Could not configure KSM; no kernel support?");
 		return -1;
 	}
-	if (file_printf(KSM_PATH "pages_to_scan", "%d", KSM_RELAXED_PAGES_TO_SCAN) < 0) {
+	if (file_handle_printf(ksm_pages_to_scan_file, "%d", KSM_RELAXED_PAGES_TO_SCAN) < 0) {
 		WARN("Could not configure KSM; no kernel support?");
 		return -1;
 	}
@@ -107,5 +282,13 @@ ksm_init()
 		WARN("Could not configure KSM; no kernel support?");
 		return -1;
 	}
+
+	if (ksm_read_counters(&ksm_last) < 0) {
+		WARN("Could not read KSM counters, keeping relaxed settings");
+		return 0;
+	}
+	ksm_timer = event_timer_new(KSM_CONTROL_INTERVAL, EVENT_TIMER_REPEAT_FOREVER,
+				    &ksm_control_cb, NULL);
+	event_add_timer(ksm_timer);
 	return 0;
 }
@@ -24,13 +24,26 @@
 #ifndef KSM_H
 #define KSM_H
 
+#include <sys/types.h>
+
 /**
  * Configure KSM to be aggressive for some time before returning to normal
- * settings
+ * settings, i.e. to the adaptive control or the relaxed settings without it.
  */
 void
 ksm_set_aggressive_for(int millisecs);
 
+/**
+ * Returns the number of pages of the given process which are merged by KSM,
+ * or -1 if the kernel does not provide per process KSM stats.
+ */
+long
+ksm_get_merging_pages(pid_t pid);
+
+/**
+ * Enables KSM and starts the adaptive control of its scan rate, which follows the
+ * KSM merge counters, the memory pressure (PSI) and the number of running containers.
+ */
 int
 ksm_init();
 
@@ -24,6 +24,7 @@
 #include "lxcfs.h"
 #include "hardware.h"
 #include "mount.h"
+#include "procfs.h"
 
 #include "common/macro.h"
 #include "common/mem.h"
@@ -66,21 +67,12 @@ lxcfs_get_bin_path_if_supported(void)
 }
 
 static void
-lxcfs_daemon_sigchld_cb(UNUSED int signum, event_signal_t *sig, void *data)
+lxcfs_daemon_child_cb(pid_t pid, UNUSED int status, event_child_t *child, UNUSED void *data)
 {
-	pid_t *lxcfs_pid = data;
-	pid_t pid;
-	int status = 0;
-
-	DEBUG("lxcfs SIGCHLD handler called for PID %d", *lxcfs_pid);
-	if ((pid = waitpid(*lxcfs_pid, &status, WNOHANG)) > 0) {
-		TRACE("Reaped lxcfs process: %d", pid);
-		/* remove the sigchld callback for the lxcfs daemon from the event loop */
-		event_remove_signal(sig);
-		event_signal_free(sig);
-	} else {
-		TRACE("Failed to reap lxcfs process");
-	}
+	TRACE("Reaped lxcfs process: %d", pid);
+	if (pid == lxcfs_daemon_pid)
+		lxcfs_daemon_pid = -1;
+	event_child_free(child);
 }
 
 static void
@@ -123,9 +115,10 @@ lxcfs_daemon_start(const char *rt_path)
 		exit(-1);
 	} else {
 		INFO("lxcfs daemon start done");
-		event_signal_t *sigchld =
-			event_signal_new(SIGCHLD, lxcfs_daemon_sigchld_cb, &lxcfs_daemon_pid);
-		event_add_signal(sigchld);
+		event_child_t *child =
+			event_child_new(lxcfs_daemon_pid, lxcfs_daemon_child_cb, NULL);
+		if (event_add_child(child) < 0)
+			event_child_free(child);
 	}
 
 	return 0;
@@ -147,6 +140,10 @@ lxcfs_proc_dir_foreach_cb(const char *path, const char *file, void *data)
 		TRACE("Skipping 'mounts'");
 		return 0;
 	}
+	if (procfs_is_virtualized(file)) {
+		TRACE("Skipping '%s', served by the cmld's proc views", file);
+		return 0;
+	}
 
 	char *dst = mem_printf("%s/%s", target_path, file);
 	char *src = mem_printf("%s/%s", path, file);
@@ -195,6 +192,31 @@ lxcfs_init(void)
 	return -1;
 }
 
+int
+lxcfs_reattach(pid_t pid)
+{
+	lxcfs_rt_path = LXCFS_RT_PATH;
+	lxcfs_bin_path = lxcfs_get_bin_path_if_supported();
+
+	IF_NULL_RETVAL(lxcfs_bin_path, -1);
+	IF_TRUE_RETVAL(pid <= 0, lxcfs_init());
+
+	// the daemon was forked by the previous cmld instance and is still our child
+	lxcfs_daemon_pid = pid;
+	event_child_t *child = event_child_new(lxcfs_daemon_pid, lxcfs_daemon_child_cb, NULL);
+	if (event_add_child(child) < 0)
+		event_child_free(child);
+
+	INFO("Reattached lxcfs daemon with pid=%d", pid);
+	return 0;
+}
+
+pid_t
+lxcfs_get_pid(void)
+{
+	return lxcfs_daemon_pid;
+}
+
 void
 lxcfs_cleanup(void)
 {
@@ -22,6 +22,7 @@
  */
 
 #include <stdbool.h>
+#include <sys/types.h>
 
 /**
  * Initialize the lxcfs submodule, gather pathes and start daemon.
@@ -31,6 +32,22 @@
 int
 lxcfs_init(void);
 
+/**
+ * Initialize the lxcfs submodule for a re-executed cmld, which takes over the
+ * daemon started by its previous instance instead of starting a new one.
+ *
+ * @param pid The pid of the running daemon, or 0 if none was running
+ * @return 0 if sucessfully initialized, -1 otherwise
+ */
+int
+lxcfs_reattach(pid_t pid);
+
+/**
+ * Returns the pid of the lxcfs daemon, or a value <= 0 if it is not running.
+ */
+pid_t
+lxcfs_get_pid(void);
+
 /**
  * Cleanup the lxcfs submodule, mainly stop daemon.
  */
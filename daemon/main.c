@@ -45,9 +45,12 @@
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
+#include <unistd.h>
 
 static logf_handler_t *cml_daemon_logfile_handler = NULL;
+static void *cml_daemon_logfile_sink = NULL;
 static bool is_handling_sigint = false;
+static char **main_argv = NULL;
 
 /******************************************************************************/
 
@@ -69,6 +72,7 @@ main_exit(void)
 	lxcfs_cleanup();
 	tss_cleanup();
 	cmld_cleanup();
+	logf_async_flush(cml_daemon_logfile_sink);
 	exit(0);
 }
 
@@ -94,13 +98,27 @@ main_sigterm_cb(UNUSED int signum, UNUSED event_signal_t *sig, UNUSED void *data
 }
 
 static void
-main_logfile_rename_cb(UNUSED event_timer_t *timer, UNUSED void *data)
+main_sigusr2_cb(UNUSED int signum, UNUSED event_signal_t *sig, UNUSED void *data)
 {
-	DEBUG("Logfile will be closed and a new file opened");
-	logf_unregister(cml_daemon_logfile_handler);
-	cml_daemon_logfile_handler =
-		logf_register(&logf_file_write, logf_file_new(LOGFILE_DIR "/cml-daemon"));
+	INFO("Received SIGUSR2..");
+	if (cmld_reexec_prepare() < 0) {
+		ERROR("Could not prepare re-executing cmld");
+		return;
+	}
+
+	logf_async_flush(cml_daemon_logfile_sink);
+	execv("/proc/self/exe", main_argv);
+	// the helper daemons are already gone, thus there is no way back
+	FATAL_ERRNO("Could not re-execute cmld");
+}
+
+static void
+main_logfile_prio_cb(event_timer_t *timer, UNUSED void *data)
+{
+	// the log file is rotated by its stream, only the first day is logged verbosely
+	DEBUG("Restricting logfile to warnings");
 	logf_handler_set_prio(cml_daemon_logfile_handler, LOGF_PRIO_WARN);
+	event_timer_free(timer);
 }
 
 /******************************************************************************/
@@ -115,8 +133,12 @@ main(int argc, char **argv)
 
 	// TODO: where should we store the log files?
 	// TODO: disable for non developer builds?
-	cml_daemon_logfile_handler =
-		logf_register(&logf_file_write, logf_file_new(LOGFILE_DIR "/cml-daemon"));
+	// written from a background thread, so that TRACE bursts do not stall the event loop
+	cml_daemon_logfile_sink = logf_async_new(
+		logf_file_rotating_new(LOGFILE_DIR "/cml-daemon", LOGF_FILE_ROTATE_SIZE,
+				       LOGF_FILE_ROTATE_AGE, LOGF_FILE_ROTATE_TOTAL),
+		0);
+	cml_daemon_logfile_handler = logf_register(&logf_async_write, cml_daemon_logfile_sink);
 	logf_handler_set_prio(cml_daemon_logfile_handler, LOGF_PRIO_TRACE);
 
 	main_core_dump_enable();
@@ -137,10 +159,14 @@ main(int argc, char **argv)
 	event_signal_t *sig_term = event_signal_new(SIGTERM, &main_sigterm_cb, NULL);
 	event_add_signal(sig_term);
 
+	// re-executes cmld in place, e.g., after an update, keeping the containers running
+	main_argv = argv;
+	event_signal_t *sig_usr2 = event_signal_new(SIGUSR2, &main_sigusr2_cb, NULL);
+	event_add_signal(sig_usr2);
+
 	DEBUG("Initializing cmld...");
 	event_timer_t *logfile_timer =
-		event_timer_new(HOURS_TO_MILLISECONDS(24), EVENT_TIMER_REPEAT_FOREVER,
-				main_logfile_rename_cb, NULL);
+		event_timer_new(HOURS_TO_MILLISECONDS(24), 1, main_logfile_prio_cb, NULL);
 	event_add_timer(logfile_timer);
 
 	if (cmld_init(path) < 0)
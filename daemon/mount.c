@@ -26,6 +26,7 @@
 
 #include "mount.h"
 #include "smartcard.h"
+#include "cgroups_v2.h"
 
 #include "common/macro.h"
 #include "common/mem.h"
@@ -52,6 +53,13 @@ struct mount_entry {
 	// TODO: add list of hash, min/max size for EMPTY images, etc.
 	char *sha1;
 	char *sha256;
+	uint64_t verity_data_size;    /**< size of the fs data in front of the verity hash tree */
+	char *verity_root_hash;	      /**< root hash of the verity hash tree, NULL if not used */
+	char *verity_salt;	      /**< salt of the verity hash tree */
+	char *delta_sha256;	      /**< hash of the delta file reconstructing the image */
+	enum mount_prealloc prealloc; /**< block allocation of the image file on creation */
+	cryptfs_opts_t crypt_opts;    /**< dm-crypt/dm-integrity options if encrypted */
+	bool ephemeral;		      /**< overlay upper dir on tmpfs instead of an image */
 	char *mount_data; /**< mount_data to use for mount syscall e.g. "uid=1000,gid=1000,dmask=227,fmask=337,context=u:object_r:firmware_file:s0" */
 };
 
@@ -77,6 +85,13 @@ mount_add_entry(mount_t *mnt, enum mount_type type, const char *image_file, cons
 	mntent->image_size = 0;
 	mntent->sha1 = NULL;
 	mntent->sha256 = NULL;
+	mntent->verity_data_size = 0;
+	mntent->verity_root_hash = NULL;
+	mntent->verity_salt = NULL;
+	mntent->delta_sha256 = NULL;
+	mntent->prealloc = MOUNT_PREALLOC_AUTO;
+	memset(&mntent->crypt_opts, 0, sizeof(mntent->crypt_opts));
+	mntent->ephemeral = false;
 	mntent->mount_data = NULL;
 
 	mnt->list = list_append(mnt->list, mntent);
@@ -100,6 +115,12 @@ mount_free(mount_t *mnt)
 			mem_free0(mntent->sha1);
 		if (mntent->sha256)
 			mem_free0(mntent->sha256);
+		if (mntent->verity_root_hash)
+			mem_free0(mntent->verity_root_hash);
+		if (mntent->verity_salt)
+			mem_free0(mntent->verity_salt);
+		if (mntent->delta_sha256)
+			mem_free0(mntent->delta_sha256);
 		if (mntent->mount_data)
 			mem_free0(mntent->mount_data);
 		mem_free0(mntent);
@@ -224,6 +245,97 @@ mount_entry_set_sha256(mount_entry_t *mntent, char *sha256)
 	mntent->sha256 = mem_strdup(sha256);
 }
 
+void
+mount_entry_set_verity(mount_entry_t *mntent, uint64_t data_size, const char *root_hash,
+		       const char *salt)
+{
+	ASSERT(mntent);
+	IF_NULL_RETURN(root_hash);
+
+	if (mntent->verity_root_hash)
+		mem_free0(mntent->verity_root_hash);
+	if (mntent->verity_salt)
+		mem_free0(mntent->verity_salt);
+
+	mntent->verity_data_size = data_size;
+	mntent->verity_root_hash = mem_strdup(root_hash);
+	mntent->verity_salt = salt ? mem_strdup(salt) : NULL;
+}
+
+bool
+mount_entry_has_verity(const mount_entry_t *mntent)
+{
+	ASSERT(mntent);
+	return mntent->verity_root_hash && mntent->verity_data_size;
+}
+
+uint64_t
+mount_entry_get_verity_data_size(const mount_entry_t *mntent)
+{
+	ASSERT(mntent);
+	return mntent->verity_data_size;
+}
+
+const char *
+mount_entry_get_verity_root_hash(const mount_entry_t *mntent)
+{
+	ASSERT(mntent);
+	return mntent->verity_root_hash;
+}
+
+void
+mount_entry_set_prealloc(mount_entry_t *mntent, enum mount_prealloc prealloc)
+{
+	ASSERT(mntent);
+	mntent->prealloc = prealloc;
+}
+
+enum mount_prealloc
+mount_entry_get_prealloc(const mount_entry_t *mntent)
+{
+	ASSERT(mntent);
+	return mntent->prealloc;
+}
+
+void
+mount_entry_set_crypt_opts(mount_entry_t *mntent, const cryptfs_opts_t *opts)
+{
+	ASSERT(mntent);
+	ASSERT(opts);
+	mntent->crypt_opts = *opts;
+}
+
+const cryptfs_opts_t *
+mount_entry_get_crypt_opts(const mount_entry_t *mntent)
+{
+	ASSERT(mntent);
+	return &mntent->crypt_opts;
+}
+
+const char *
+mount_entry_get_verity_salt(const mount_entry_t *mntent)
+{
+	ASSERT(mntent);
+	return mntent->verity_salt;
+}
+
+void
+mount_entry_set_delta_sha256(mount_entry_t *mntent, const char *delta_sha256)
+{
+	ASSERT(mntent);
+
+	if (mntent->delta_sha256)
+		mem_free0(mntent->delta_sha256);
+	mntent->delta_sha256 = delta_sha256 ? mem_strdup(delta_sha256) : NULL;
+}
+
+const char *
+mount_entry_get_delta_sha256(const mount_entry_t *mntent)
+{
+	ASSERT(mntent);
+	return mntent->delta_sha256;
+}
+
 void
 mount_entry_set_mount_data(mount_entry_t *mntent, char *mount_data)
 {
@@ -273,12 +385,26 @@ mount_entry_is_encrypted(const mount_entry_t *e)
 	case MOUNT_TYPE_EMPTY:
 		return strncmp(e->fs_type, "tmpfs", 5);
 	case MOUNT_TYPE_OVERLAY_RW:
-		return true;
+		return !e->ephemeral;
 	default:
 		return false;
 	}
 }
 
+void
+mount_entry_set_ephemeral(mount_entry_t *mntent, bool ephemeral)
+{
+	ASSERT(mntent);
+	mntent->ephemeral = ephemeral;
+}
+
+bool
+mount_entry_is_ephemeral(const mount_entry_t *mntent)
+{
+	ASSERT(mntent);
+	return mntent->type == MOUNT_TYPE_OVERLAY_RW && mntent->ephemeral;
+}
+
 int
 mount_remount_root_ro(void)
 {
@@ -380,9 +506,37 @@ mount_cgroups_create_and_mount_subsys(const char *subsys, const char *mount_path
 	return ret;
 }
 
+static int
+mount_cgroups_v2(void)
+{
+	if (!file_is_mountpoint(MOUNT_CGROUPS_FOLDER)) {
+		INFO("Mounting cgroup2 unified hierarchy");
+		if (mkdir(MOUNT_CGROUPS_FOLDER, 0755) && errno != EEXIST) {
+			ERROR_ERRNO("Could not create cgroup mount directory");
+			return -1;
+		}
+		if (mount("cgroup2", MOUNT_CGROUPS_FOLDER, "cgroup2",
+			  MS_NOEXEC | MS_NODEV | MS_NOSUID | MS_RELATIME, NULL) == -1 &&
+		    errno != EBUSY) {
+			ERROR_ERRNO("Could not mount cgroup2");
+			return -1;
+		}
+	}
+
+	// controllers have to be enabled top-down for the containers' cgroups
+	if (cgroups_v2_enable_controllers(MOUNT_CGROUPS_FOLDER) < 0)
+		WARN("Not all cgroup controllers could be enabled");
+
+	INFO("cgroup2 set up successfully");
+	return 0;
+}
+
 int
 mount_cgroups(list_t *cgroups_subsystems)
 {
+	if (cgroups_v2_enabled())
+		return mount_cgroups_v2();
+
 	// mount cgroups control stuff if not already done (necessary globally once)
 	// tmpfs does not always result in EBUSY if already mounted
 	if (!file_is_mountpoint(MOUNT_CGROUPS_FOLDER)) {
@@ -29,6 +29,7 @@
 #include <stdlib.h>
 
 #include "common/list.h"
+#include "common/cryptfs.h"
 
 #define MOUNT_CGROUPS_FOLDER "/sys/fs/cgroup"
 
@@ -65,6 +66,16 @@ enum mount_type {
 	MOUNT_TYPE_BIND_FILE_RW = 11, /**< file is bind mounted to container (RW) */
 };
 
+/**
+ * An enum to present how the blocks of a newly created image file are allocated.
+ */
+enum mount_prealloc {
+	MOUNT_PREALLOC_AUTO = 0, /**< FULL for images protected by dm-integrity, NONE otherwise */
+	MOUNT_PREALLOC_NONE = 1, /**< sparse file, blocks are allocated on first write */
+	MOUNT_PREALLOC_KEEP_SIZE = 2, /**< blocks are reserved but not initialized */
+	MOUNT_PREALLOC_FULL = 3,      /**< blocks are allocated and zeroed */
+};
+
 mount_t *
 mount_new(void);
 
@@ -136,6 +147,75 @@ mount_entry_set_sha1(mount_entry_t *mntent, char *sha1);
 void
 mount_entry_set_sha256(mount_entry_t *mntent, char *sha256);
 
+/**
+ * Sets the dm-verity parameters of the mount entry. The hash tree is expected
+ * to be appended to the image file at offset data_size.
+ */
+void
+mount_entry_set_verity(mount_entry_t *mntent, uint64_t data_size, const char *root_hash,
+		       const char *salt);
+
+/**
+ * Returns true if the image of the mount entry carries a dm-verity hash tree.
+ */
+bool
+mount_entry_has_verity(const mount_entry_t *mntent);
+
+/**
+ * Returns the size of the file system data in front of the verity hash tree.
+ */
+uint64_t
+mount_entry_get_verity_data_size(const mount_entry_t *mntent);
+
+/**
+ * Returns the hex encoded root hash of the verity hash tree.
+ */
+const char *
+mount_entry_get_verity_root_hash(const mount_entry_t *mntent);
+
+/**
+ * Returns the hex encoded salt of the verity hash tree or NULL.
+ */
+const char *
+mount_entry_get_verity_salt(const mount_entry_t *mntent);
+
+/**
+ * Sets the SHA256 hash of the delta file which reconstructs the image of the mount entry
+ * from the image of the GuestOS's delta base version.
+ */
+void
+mount_entry_set_delta_sha256(mount_entry_t *mntent, const char *delta_sha256);
+
+/**
+ * Returns the SHA256 hash of the delta file of the mount entry or NULL if there is none.
+ */
+const char *
+mount_entry_get_delta_sha256(const mount_entry_t *mntent);
+
+/**
+ * Sets how the blocks of the image file are allocated when it is created.
+ */
+void
+mount_entry_set_prealloc(mount_entry_t *mntent, enum mount_prealloc prealloc);
+
+/**
+ * Returns how the blocks of the image file are allocated when it is created.
+ */
+enum mount_prealloc
+mount_entry_get_prealloc(const mount_entry_t *mntent);
+
+/**
+ * Sets the dm-crypt/dm-integrity options used if the image is encrypted.
+ */
+void
+mount_entry_set_crypt_opts(mount_entry_t *mntent, const cryptfs_opts_t *opts);
+
+/**
+ * Returns the dm-crypt/dm-integrity options used if the image is encrypted.
+ */
+const cryptfs_opts_t *
+mount_entry_get_crypt_opts(const mount_entry_t *mntent);
+
 /**
  * Checks if the given SHA1 hash matches with the one stored in the mount entry.
  */
@@ -202,6 +282,19 @@ mount_entry_get_mount_data(const mount_entry_t *mntent);
 bool
 mount_entry_is_encrypted(const mount_entry_t *mntent);
 
+/**
+ * Sets if the upper dir of an OVERLAY_RW entry is kept in a tmpfs instead of an image.
+ */
+void
+mount_entry_set_ephemeral(mount_entry_t *mntent, bool ephemeral);
+
+/**
+ * Returns true if the entry is an OVERLAY_RW entry whose changes are only kept in a
+ * tmpfs, so that there is no image to create, format or encrypt for it.
+ */
+bool
+mount_entry_is_ephemeral(const mount_entry_t *mntent);
+
 /**
  * Remounts rootfs read-only
  */
@@ -228,6 +321,8 @@ mount_private_tmp(void);
  * Mount cgroups fs and subsystem controllers if not already done
  *
  * This is necessary globally once, and also before lxcfs_init()
+ * If cgroups_v2_enabled(), the unified hierarchy is mounted instead and
+ * cgroups_subsystems is ignored.
  * @param cgroups_subsystems a list of subsystems to be mounted/created
  * @return 0 on success, -1 on error
  */
@@ -0,0 +1,427 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+
+#include "placement.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/file.h"
+#include "common/list.h"
+#include "common/str.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PLACEMENT_SYS_CPU "/sys/devices/system/cpu"
+#define PLACEMENT_SYS_NODE "/sys/devices/system/node"
+#define PLACEMENT_MAX_NODES 64
+
+typedef struct placement_core {
+	cpu_set_t cpus; // SMT siblings of the core
+	int package;
+	int core_id;
+	int node;
+	const container_t *owner; // container the core is dedicated to, NULL if shared
+} placement_core_t;
+
+typedef enum {
+	PLACEMENT_SHARED = 0, // shares the cpus not used by the other placements
+	PLACEMENT_DEDICATED,  // whole cores assigned by the placement
+	PLACEMENT_ASSIGNED,   // cpus assigned by the container config
+} placement_type_t;
+
+typedef struct placement_member {
+	container_t *container; // weak reference
+	placement_type_t type;
+	cpu_set_t cpus;
+} placement_member_t;
+
+static placement_core_t *placement_cores = NULL;
+static int placement_core_count = 0;
+static cpu_set_t placement_online;
+static cpu_set_t placement_nodes;
+
+static list_t *placement_member_list = NULL;
+
+/*
+ * Parses a cpu or node list as used by sysfs and cpusets, e.g. "0-3,8,10-11".
+ */
+static int
+placement_parse_list(const char *list, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+
+	const char *p = list;
+	while (*p && *p != '\n') {
+		char *end;
+		long first = strtol(p, &end, 10);
+		long last = first;
+		IF_TRUE_RETVAL(end == p || first < 0, -1);
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			IF_TRUE_RETVAL(end == p || last < first, -1);
+		}
+		IF_TRUE_RETVAL(last >= CPU_SETSIZE, -1);
+		for (long i = first; i <= last; i++)
+			CPU_SET(i, set);
+
+		p = end;
+		if (*p == ',')
+			p++;
+		else
+			IF_FALSE_RETVAL(*p == '\0' || *p == '\n', -1);
+	}
+	return 0;
+}
+
+static char *
+placement_list_new(const cpu_set_t *set)
+{
+	str_stack_t stack;
+	str_t *list = str_init_stack(&stack, NULL);
+
+	for (int i = 0; i < CPU_SETSIZE; i++) {
+		if (!CPU_ISSET(i, set))
+			continue;
+		int last = i;
+		while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+			last++;
+		str_append_printf(list, "%s%d", str_length(list) ? "," : "", i);
+		if (last > i)
+			str_append_printf(list, "-%d", last);
+		i = last;
+	}
+	return str_free(list, false);
+}
+
+static int
+placement_read_list(const char *path, cpu_set_t *set)
+{
+	char *list = file_read_new(path, 4096);
+	IF_NULL_RETVAL(list, -1);
+	int ret = placement_parse_list(list, set);
+	mem_free0(list);
+	return ret;
+}
+
+static int
+placement_read_topology_id(int cpu, const char *name)
+{
+	char *path = mem_printf("%s/cpu%d/topology/%s", PLACEMENT_SYS_CPU, cpu, name);
+	char *id = file_read_new(path, 32);
+	mem_free0(path);
+
+	// some architectures do not provide the topology of all cpus
+	int ret = id ? atoi(id) : cpu;
+	mem_free0(id);
+	return ret;
+}
+
+static bool
+placement_cpus_overlap(const cpu_set_t *a, const cpu_set_t *b)
+{
+	cpu_set_t and;
+	CPU_AND(&and, a, b);
+	return CPU_COUNT(&and) > 0;
+}
+
+static placement_member_t *
+placement_member_get(const container_t *container)
+{
+	for (list_t *l = placement_member_list; l; l = l->next) {
+		placement_member_t *member = l->data;
+		if (member->container == container)
+			return member;
+	}
+	return NULL;
+}
+
+/*
+ * Cpus which may not be shared: the dedicated cores and the cpus assigned by config.
+ */
+static void
+placement_get_reserved(cpu_set_t *reserved)
+{
+	CPU_ZERO(reserved);
+	for (list_t *l = placement_member_list; l; l = l->next) {
+		placement_member_t *member = l->data;
+		if (member->type != PLACEMENT_SHARED)
+			CPU_OR(reserved, reserved, &member->cpus);
+	}
+}
+
+static void
+placement_get_shared(cpu_set_t *shared)
+{
+	cpu_set_t reserved;
+	placement_get_reserved(&reserved);
+	CPU_XOR(shared, &placement_online, &reserved);
+	CPU_AND(shared, shared, &placement_online);
+
+	// never leave the shared containers without any cpu
+	if (CPU_COUNT(shared) == 0)
+		CPU_OR(shared, &placement_online, &placement_online);
+}
+
+static bool
+placement_core_is_free(const placement_core_t *core, const cpu_set_t *reserved)
+{
+	return !core->owner && !placement_cpus_overlap(&core->cpus, reserved);
+}
+
+static int
+placement_node_count_free(int node, const cpu_set_t *reserved)
+{
+	int count = 0;
+	for (int i = 0; i < placement_core_count; i++) {
+		if (placement_cores[i].node == node &&
+		    placement_core_is_free(&placement_cores[i], reserved))
+			count++;
+	}
+	return count;
+}
+
+/*
+ * Assigns whole cores to the member, filling up the NUMA node with the most free
+ * cores first, so that the cores share caches and memory as far as possible.
+ * At least one core is always left to the shared containers.
+ */
+static int
+placement_assign_cores(placement_member_t *member, int count)
+{
+	cpu_set_t reserved;
+	placement_get_reserved(&reserved);
+
+	int free = 0;
+	for (int i = 0; i < placement_core_count; i++)
+		if (placement_core_is_free(&placement_cores[i], &reserved))
+			free++;
+	if (free <= count) {
+		WARN("Only %d free cores left, cannot dedicate %d cores to container %s", free,
+		     count, container_get_description(member->container));
+		return -1;
+	}
+
+	CPU_ZERO(&member->cpus);
+	for (int assigned = 0; assigned < count;) {
+		int node = -1;
+		int node_free = 0;
+		for (int n = 0; n < CPU_SETSIZE; n++) {
+			if (!CPU_ISSET(n, &placement_nodes))
+				continue;
+			int nfree = placement_node_count_free(n, &reserved);
+			if (nfree > node_free) {
+				node = n;
+				node_free = nfree;
+			}
+		}
+		ASSERT(node >= 0);
+
+		for (int i = 0; i < placement_core_count && assigned < count; i++) {
+			placement_core_t *core = &placement_cores[i];
+			if (core->node != node || !placement_core_is_free(core, &reserved))
+				continue;
+			core->owner = member->container;
+			CPU_OR(&member->cpus, &member->cpus, &core->cpus);
+			assigned++;
+		}
+	}
+	return 0;
+}
+
+static void
+placement_get_mems(const cpu_set_t *cpus, cpu_set_t *mems)
+{
+	CPU_ZERO(mems);
+	for (int i = 0; i < placement_core_count; i++) {
+		if (placement_cpus_overlap(&placement_cores[i].cpus, cpus))
+			CPU_SET(placement_cores[i].node, mems);
+	}
+	if (CPU_COUNT(mems) == 0)
+		CPU_OR(mems, &placement_nodes, &placement_nodes);
+}
+
+/*
+ * Moves the containers sharing cpus to the cpus which are currently not reserved.
+ */
+static void
+placement_rebalance(void)
+{
+	cpu_set_t shared;
+	placement_get_shared(&shared);
+	char *cpus = placement_list_new(&shared);
+	char *mems = placement_list_new(&placement_nodes);
+
+	for (list_t *l = placement_member_list; l; l = l->next) {
+		placement_member_t *member = l->data;
+		if (member->type != PLACEMENT_SHARED || CPU_EQUAL(&member->cpus, &shared))
+			continue;
+
+		DEBUG("Moving container %s to shared cpus %s",
+		      container_get_description(member->container), cpus);
+		if (container_set_cpuset(member->container, cpus, mems) < 0)
+			WARN("Could not move container %s to shared cpus %s",
+			     container_get_description(member->container), cpus);
+		member->cpus = shared;
+	}
+
+	mem_free0(cpus);
+	mem_free0(mems);
+}
+
+static placement_member_t *
+placement_member_new(container_t *container)
+{
+	placement_member_t *member = mem_new0(placement_member_t, 1);
+	member->container = container;
+
+	const char *cpus_allowed = container_get_cpus_allowed(container);
+	if (cpus_allowed) {
+		if (placement_parse_list(cpus_allowed, &member->cpus) < 0) {
+			ERROR("Invalid cpus '%s' assigned to container %s", cpus_allowed,
+			      container_get_description(container));
+			mem_free0(member);
+			return NULL;
+		}
+		member->type = PLACEMENT_ASSIGNED;
+	} else if (container_get_dedicated_cores(container) > 0 &&
+		   placement_assign_cores(member, container_get_dedicated_cores(container)) ==
+			   0) {
+		member->type = PLACEMENT_DEDICATED;
+	} else {
+		member->type = PLACEMENT_SHARED;
+		placement_get_shared(&member->cpus);
+	}
+
+	placement_member_list = list_append(placement_member_list, member);
+
+	// shrink the shared containers before the cpus are exclusively used
+	if (member->type != PLACEMENT_SHARED)
+		placement_rebalance();
+
+	return member;
+}
+
+int
+placement_get_cpuset(container_t *container, char **cpus, char **mems, bool *exclusive)
+{
+	ASSERT(container);
+	ASSERT(cpus && mems && exclusive);
+
+	IF_NULL_RETVAL(placement_cores, -1);
+
+	placement_member_t *member = placement_member_get(container);
+	if (!member)
+		member = placement_member_new(container);
+	IF_NULL_RETVAL(member, -1);
+
+	cpu_set_t nodes;
+	placement_get_mems(&member->cpus, &nodes);
+
+	*cpus = placement_list_new(&member->cpus);
+	*mems = placement_list_new(&nodes);
+	*exclusive = member->type != PLACEMENT_SHARED;
+	return 0;
+}
+
+void
+placement_release(const container_t *container)
+{
+	placement_member_t *member = placement_member_get(container);
+	IF_NULL_RETURN(member);
+
+	for (int i = 0; i < placement_core_count; i++) {
+		if (placement_cores[i].owner == container)
+			placement_cores[i].owner = NULL;
+	}
+
+	placement_member_list = list_remove(placement_member_list, member);
+	if (member->type != PLACEMENT_SHARED)
+		placement_rebalance();
+	mem_free0(member);
+}
+
+int
+placement_init(void)
+{
+	if (placement_read_list(PLACEMENT_SYS_CPU "/online", &placement_online) < 0) {
+		WARN("Could not read the online cpus");
+		return -1;
+	}
+
+	cpu_set_t node_cpus[PLACEMENT_MAX_NODES];
+	int node_max = -1;
+	if (placement_read_list(PLACEMENT_SYS_NODE "/online", &placement_nodes) < 0) {
+		// kernel without NUMA support
+		CPU_ZERO(&placement_nodes);
+		CPU_SET(0, &placement_nodes);
+	} else {
+		for (int n = 0; n < PLACEMENT_MAX_NODES; n++) {
+			if (!CPU_ISSET(n, &placement_nodes))
+				continue;
+			char *path = mem_printf("%s/node%d/cpulist", PLACEMENT_SYS_NODE, n);
+			if (placement_read_list(path, &node_cpus[n]) < 0)
+				CPU_ZERO(&node_cpus[n]);
+			mem_free0(path);
+			node_max = n;
+		}
+	}
+
+	placement_cores = mem_new0(placement_core_t, CPU_COUNT(&placement_online));
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &placement_online))
+			continue;
+
+		int package = placement_read_topology_id(cpu, "physical_package_id");
+		int core_id = placement_read_topology_id(cpu, "core_id");
+		int node = 0;
+		for (int n = 0; n <= node_max; n++) {
+			if (CPU_ISSET(n, &placement_nodes) && CPU_ISSET(cpu, &node_cpus[n]))
+				node = n;
+		}
+
+		placement_core_t *core = NULL;
+		for (int i = 0; i < placement_core_count; i++) {
+			if (placement_cores[i].package == package &&
+			    placement_cores[i].core_id == core_id) {
+				core = &placement_cores[i];
+				break;
+			}
+		}
+		if (!core) {
+			core = &placement_cores[placement_core_count++];
+			core->package = package;
+			core->core_id = core_id;
+			core->node = node;
+		}
+		CPU_SET(cpu, &core->cpus);
+	}
+
+	INFO("Placing containers on %d cpus in %d cores on %d NUMA nodes",
+	     CPU_COUNT(&placement_online), placement_core_count, CPU_COUNT(&placement_nodes));
+	return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file placement.h
+ *
+ * Places the containers on the cpus and NUMA memory nodes of the device. Containers
+ * configured with dedicated cores get whole physical cores, i.e. all SMT siblings
+ * sharing the core's caches, preferably from a single NUMA node, with their memory
+ * allocated from the same node(s). Containers with explicitly assigned cpus keep
+ * them. All other containers share the remaining cpus, which are rebalanced
+ * whenever a container with dedicated or assigned cpus starts or stops.
+ */
+
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include "container.h"
+
+#include <stdbool.h>
+
+/**
+ * Reads the cpu and NUMA topology from sysfs.
+ *
+ * @return 0 on success, -1 if the topology is not available
+ */
+int
+placement_init(void);
+
+/**
+ * Returns the cpus and memory nodes the container is placed on as newly allocated
+ * lists, e.g. "0-3,8". The container keeps its placement until placement_release().
+ * Placing a container with dedicated or assigned cpus shrinks the cpusets of the
+ * other containers sharing the remaining cpus.
+ *
+ * @param exclusive set to true if no other container may use the cpus
+ * @return 0 on success, -1 if no placement is available, e.g. no topology was read
+ */
+int
+placement_get_cpuset(container_t *container, char **cpus, char **mems, bool *exclusive);
+
+/**
+ * Releases the placement of a stopped container and hands its cpus back to the
+ * containers sharing cpus.
+ */
+void
+placement_release(const container_t *container);
+
+#endif /* PLACEMENT_H */
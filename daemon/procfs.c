@@ -0,0 +1,384 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+
+#include "procfs.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/dir.h"
+#include "common/file.h"
+#include "common/str.h"
+#include "common/uuid.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <unistd.h>
+
+#define PROCFS_PATH "/run/cmld/procfs"
+
+/* maximum sizes of the host files read to build the views */
+#define PROCFS_CPUINFO_MAX (1024 * 1024)
+#define PROCFS_STAT_MAX (256 * 1024)
+#define PROCFS_MEMINFO_MAX (16 * 1024)
+
+/* no. of counters of a cpu line in /proc/stat (user ... guest_nice) */
+#define PROCFS_STAT_FIELDS 10
+
+enum procfs_file {
+	PROCFS_MEMINFO = 0,
+	PROCFS_CPUINFO,
+	PROCFS_STAT,
+	PROCFS_UPTIME,
+	PROCFS_FILE_COUNT,
+};
+
+static const char *procfs_file_names[PROCFS_FILE_COUNT] = {
+	[PROCFS_MEMINFO] = "meminfo",
+	[PROCFS_CPUINFO] = "cpuinfo",
+	[PROCFS_STAT] = "stat",
+	[PROCFS_UPTIME] = "uptime",
+};
+
+struct procfs_view {
+	const container_t *container; // weak reference
+	char *dir;
+	int fd[PROCFS_FILE_COUNT];
+	cpu_set_t cpus;	 // cpus the cpuinfo view was built for
+	bool cpuinfo_valid;
+};
+
+/* /proc/cpuinfo does not change at runtime, thus it is read only once */
+static char *procfs_host_cpuinfo = NULL;
+
+static char *
+procfs_view_dir_new(const container_t *container)
+{
+	return mem_printf("%s/%s", PROCFS_PATH, uuid_string(container_get_uuid(container)));
+}
+
+/* replaces the content of the view file in place, as it is bind mounted by inode */
+static void
+procfs_view_write(procfs_view_t *view, enum procfs_file file, const char *buf, size_t len)
+{
+	int fd = view->fd[file];
+	IF_TRUE_RETURN(fd < 0);
+
+	if (pwrite(fd, buf, len, 0) != (ssize_t)len || ftruncate(fd, len) < 0)
+		WARN_ERRNO("Could not update %s view of container %s", procfs_file_names[file],
+			   container_get_description(view->container));
+}
+
+/* returns the value in kB of a /proc/meminfo line such as "MemTotal:  1024 kB" */
+static bool
+procfs_meminfo_get(const char *meminfo, const char *key, uint64_t *kb)
+{
+	size_t key_len = strlen(key);
+	for (const char *line = meminfo; line && *line; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			line++;
+		if (!strncmp(line, key, key_len) && line[key_len] == ':') {
+			*kb = strtoull(line + key_len + 1, NULL, 10);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Scales the host's meminfo to the RAM limit of the container. Containers without
+ * a limit or without a usage sample see the host's meminfo.
+ */
+static void
+procfs_view_update_meminfo(procfs_view_t *view, const c_cgroups_stats_sample_t *sample)
+{
+	char *host = file_read_new("/proc/meminfo", PROCFS_MEMINFO_MAX);
+	IF_NULL_RETURN(host);
+
+	uint64_t host_total = 0;
+	uint64_t limit = (uint64_t)container_get_ram_limit(view->container) * 1024;
+	if (!limit || !sample || !(sample->valid & C_CGROUPS_STATS_MEM) ||
+	    !procfs_meminfo_get(host, "MemTotal", &host_total)) {
+		procfs_view_write(view, PROCFS_MEMINFO, host, strlen(host));
+		mem_free0(host);
+		return;
+	}
+
+	uint64_t total = MIN(limit, host_total);
+	uint64_t used = MIN(sample->mem_usage / 1024, total);
+	uint64_t cache = MIN(sample->mem_cache / 1024, used);
+
+	str_t *meminfo = str_new(NULL);
+	char *saveptr = NULL;
+	for (char *line = strtok_r(host, "\n", &saveptr); line;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		uint64_t kb;
+		if (!strncmp(line, "MemTotal:", 9))
+			kb = total;
+		else if (!strncmp(line, "MemFree:", 8))
+			kb = total - used;
+		else if (!strncmp(line, "MemAvailable:", 13))
+			kb = total - used + cache;
+		else if (!strncmp(line, "Cached:", 7))
+			kb = cache;
+		else if (!strncmp(line, "Buffers:", 8))
+			kb = 0;
+		else {
+			str_append_printf(meminfo, "%s\n", line);
+			continue;
+		}
+		char *colon = strchr(line, ':');
+		str_append_printf(meminfo, "%-16.*s%8" PRIu64 " kB\n", (int)(colon - line + 1), line,
+				  kb);
+	}
+
+	procfs_view_write(view, PROCFS_MEMINFO, str_buffer(meminfo), str_length(meminfo));
+	str_free(meminfo, true);
+	mem_free0(host);
+}
+
+/*
+ * Keeps the processor entries of the cpus of the container, numbered from 0 like
+ * within a cpuset. Entries not describing a processor (e.g. "Hardware" on arm) are kept.
+ */
+static void
+procfs_view_update_cpuinfo(procfs_view_t *view, const cpu_set_t *cpus)
+{
+	IF_TRUE_RETURN(view->cpuinfo_valid && CPU_EQUAL(&view->cpus, cpus));
+
+	if (!procfs_host_cpuinfo)
+		procfs_host_cpuinfo = file_read_new("/proc/cpuinfo", PROCFS_CPUINFO_MAX);
+	IF_NULL_RETURN(procfs_host_cpuinfo);
+
+	str_t *cpuinfo = str_new(NULL);
+	int processor = 0;
+	for (const char *entry = procfs_host_cpuinfo; *entry;) {
+		const char *end = strstr(entry, "\n\n");
+		size_t len = end ? (size_t)(end - entry) + 2 : strlen(entry);
+
+		int cpu;
+		if (sscanf(entry, "processor : %d", &cpu) != 1) {
+			str_append_len(cpuinfo, entry, len);
+		} else if (cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, cpus)) {
+			const char *eol = memchr(entry, '\n', len);
+			str_append_printf(cpuinfo, "processor\t: %d", processor++);
+			if (eol)
+				str_append_len(cpuinfo, eol, len - (eol - entry));
+		}
+		entry += len;
+	}
+
+	procfs_view_write(view, PROCFS_CPUINFO, str_buffer(cpuinfo), str_length(cpuinfo));
+	str_free(cpuinfo, true);
+
+	view->cpus = *cpus;
+	view->cpuinfo_valid = true;
+}
+
+/*
+ * Keeps the cpu lines of the cpus of the container, numbered from 0, and sums them
+ * up in the aggregated "cpu" line. All other lines are the host's.
+ */
+static void
+procfs_view_update_stat(procfs_view_t *view, const cpu_set_t *cpus)
+{
+	char *host = file_read_new("/proc/stat", PROCFS_STAT_MAX);
+	IF_NULL_RETURN(host);
+
+	uint64_t sum[PROCFS_STAT_FIELDS] = { 0 };
+	str_t *lines = str_new(NULL);
+	str_t *others = str_new(NULL);
+	int n = 0;
+
+	char *saveptr = NULL;
+	for (char *line = strtok_r(host, "\n", &saveptr); line;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		if (strncmp(line, "cpu", 3)) {
+			str_append_printf(others, "%s\n", line);
+			continue;
+		}
+		char *end;
+		long cpu = strtol(line + 3, &end, 10);
+		if (end == line + 3 || cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, cpus))
+			continue;
+
+		str_append_printf(lines, "cpu%d", n++);
+		for (int i = 0; i < PROCFS_STAT_FIELDS; i++) {
+			uint64_t value = strtoull(end, &end, 10);
+			sum[i] += value;
+			str_append_printf(lines, " %" PRIu64, value);
+		}
+		str_append(lines, "\n");
+	}
+
+	str_t *stat = str_new("cpu ");
+	for (int i = 0; i < PROCFS_STAT_FIELDS; i++)
+		str_append_printf(stat, " %" PRIu64, sum[i]);
+	str_append_printf(stat, "\n%s%s", str_buffer(lines), str_buffer(others));
+
+	procfs_view_write(view, PROCFS_STAT, str_buffer(stat), str_length(stat));
+	str_free(stat, true);
+	str_free(lines, true);
+	str_free(others, true);
+	mem_free0(host);
+}
+
+/*
+ * The uptime of the container and the idle time of its cpus since it was started.
+ */
+static void
+procfs_view_update_uptime(procfs_view_t *view, const c_cgroups_stats_sample_t *sample, int ncpus)
+{
+	double uptime = container_get_uptime(view->container);
+	double idle = uptime * ncpus;
+	if (sample && (sample->valid & C_CGROUPS_STATS_CPU))
+		idle -= sample->cpu_usage_ns / 1e9;
+
+	char *buf = mem_printf("%.2f %.2f\n", uptime, MAX(idle, 0.0));
+	procfs_view_write(view, PROCFS_UPTIME, buf, strlen(buf));
+	mem_free0(buf);
+}
+
+void
+procfs_view_update(procfs_view_t *view, const c_cgroups_stats_sample_t *sample)
+{
+	IF_NULL_RETURN(view);
+
+	// the affinity of the container's init reflects its cpuset
+	cpu_set_t cpus;
+	pid_t pid = container_get_pid(view->container);
+	if ((pid <= 0 || sched_getaffinity(pid, sizeof(cpus), &cpus) < 0) &&
+	    sched_getaffinity(0, sizeof(cpus), &cpus) < 0) {
+		WARN_ERRNO("Could not get cpus of container %s",
+			   container_get_description(view->container));
+		return;
+	}
+
+	procfs_view_update_meminfo(view, sample);
+	procfs_view_update_cpuinfo(view, &cpus);
+	procfs_view_update_stat(view, &cpus);
+	procfs_view_update_uptime(view, sample, CPU_COUNT(&cpus));
+}
+
+procfs_view_t *
+procfs_view_new(const container_t *container)
+{
+	ASSERT(container);
+
+	procfs_view_t *view = mem_new0(procfs_view_t, 1);
+	view->container = container;
+	view->dir = procfs_view_dir_new(container);
+	for (int i = 0; i < PROCFS_FILE_COUNT; i++)
+		view->fd[i] = -1;
+
+	if (dir_mkdir_p(view->dir, 0755) < 0) {
+		WARN_ERRNO("Could not create %s, no proc views for container %s", view->dir,
+			   container_get_description(container));
+		procfs_view_free(view);
+		return NULL;
+	}
+
+	for (int i = 0; i < PROCFS_FILE_COUNT; i++) {
+		char *path = mem_printf("%s/%s", view->dir, procfs_file_names[i]);
+		view->fd[i] = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0444);
+		if (view->fd[i] < 0)
+			WARN_ERRNO("Could not create proc view %s", path);
+		mem_free0(path);
+	}
+
+	// the container has no usage yet, the views are refined by the first sample
+	procfs_view_update(view, NULL);
+
+	TRACE("Created proc views of container %s in %s", container_get_description(container),
+	      view->dir);
+	return view;
+}
+
+void
+procfs_view_free(procfs_view_t *view)
+{
+	IF_NULL_RETURN(view);
+
+	for (int i = 0; i < PROCFS_FILE_COUNT; i++) {
+		if (view->fd[i] < 0)
+			continue;
+		close(view->fd[i]);
+		char *path = mem_printf("%s/%s", view->dir, procfs_file_names[i]);
+		if (unlink(path) < 0)
+			WARN_ERRNO("Could not remove proc view %s", path);
+		mem_free0(path);
+	}
+	if (rmdir(view->dir) < 0 && errno != ENOENT)
+		WARN_ERRNO("Could not remove %s", view->dir);
+
+	mem_free0(view->dir);
+	mem_free0(view);
+}
+
+bool
+procfs_is_virtualized(const char *file)
+{
+	for (int i = 0; i < PROCFS_FILE_COUNT; i++) {
+		if (!strcmp(file, procfs_file_names[i]))
+			return true;
+	}
+	return false;
+}
+
+int
+procfs_mount_proc_overlay(const container_t *container, const char *target)
+{
+	int ret = 0;
+	char *dir = procfs_view_dir_new(container);
+
+	for (int i = 0; i < PROCFS_FILE_COUNT; i++) {
+		char *src = mem_printf("%s/%s", dir, procfs_file_names[i]);
+		char *dst = mem_printf("%s/%s", target, procfs_file_names[i]);
+
+		if (!file_exists(src)) {
+			TRACE("No proc view %s", src);
+		} else if (mount(src, dst, NULL, MS_BIND, NULL) < 0) {
+			ERROR_ERRNO("Could not overlay %s with %s", dst, src);
+			ret = -1;
+		} else if (mount(NULL, dst, NULL, MS_BIND | MS_REMOUNT | MS_RDONLY, NULL) < 0) {
+			// the view must not be writable by the container's root
+			ERROR_ERRNO("Could not remount %s read-only", dst);
+			ret = -1;
+		} else {
+			TRACE("Applied overlay on %s with %s", dst, src);
+		}
+
+		mem_free0(src);
+		mem_free0(dst);
+	}
+
+	mem_free0(dir);
+	return ret;
+}
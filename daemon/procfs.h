@@ -0,0 +1,78 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file procfs.h
+ *
+ * Provides container specific views of /proc/meminfo, cpuinfo, stat and uptime
+ * without a FUSE round trip per read. The views are regular files in a tmpfs which
+ * are bind mounted over the container's /proc and rewritten in place whenever the
+ * resource usage of the container is sampled (see c_cgroups_set_stats_interval()).
+ * Files not virtualized here are still provided by lxcfs if available.
+ */
+
+#ifndef PROCFS_H
+#define PROCFS_H
+
+#include "container.h"
+#include "c_cgroups.h"
+
+#include <stdbool.h>
+
+typedef struct procfs_view procfs_view_t;
+
+/**
+ * Creates the view files of the container with their initial content. Must be
+ * called before the container's child mounts its /proc.
+ */
+procfs_view_t *
+procfs_view_new(const container_t *container);
+
+/**
+ * Rewrites the view files from a resource usage sample of the container.
+ */
+void
+procfs_view_update(procfs_view_t *view, const c_cgroups_stats_sample_t *sample);
+
+/**
+ * Removes the view files of the container.
+ */
+void
+procfs_view_free(procfs_view_t *view);
+
+/**
+ * Returns true if the given file in /proc is virtualized by a view.
+ */
+bool
+procfs_is_virtualized(const char *file);
+
+/**
+ * Bind mounts the view files of the container over the proc mounted at target.
+ * Called in the container's child.
+ *
+ * @return 0 on success or if there is no view of the container, -1 otherwise
+ */
+int
+procfs_mount_proc_overlay(const container_t *container, const char *target);
+
+#endif /* PROCFS_H */
@@ -0,0 +1,321 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "psi.h"
+#include "cmld.h"
+#include "control.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/event.h"
+#include "common/file.h"
+#include "common/list.h"
+#include "common/uuid.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PSI_PROC_PATH "/proc/pressure"
+
+/* triggers fire if some tasks stalled for threshold us within a window of PSI_WINDOW us */
+#define PSI_WINDOW 1000000
+#define PSI_THRESHOLD_CPU 500000
+#define PSI_THRESHOLD_MEMORY 100000
+#define PSI_THRESHOLD_IO 200000
+
+/* a monitor notifies at most once in this interval (seconds) during sustained pressure */
+#define PSI_NOTIFY_INTERVAL 10
+
+/*
+ * The freeze policy freezes a container if the memory pressure of the host reaches
+ * PSI_FREEZE_AVG10, at most once per PSI_FREEZE_INTERVAL (seconds). The containers
+ * are resumed one by one, last frozen first, after the pressure stayed below
+ * PSI_RESUME_AVG10 for PSI_RESUME_CHECKS checks in PSI_RESUME_INTERVAL ms.
+ */
+#define PSI_FREEZE_AVG10 20.0
+#define PSI_FREEZE_INTERVAL 30
+#define PSI_RESUME_AVG10 2.0
+#define PSI_RESUME_CHECKS 3
+#define PSI_RESUME_INTERVAL 10000
+
+struct psi_monitor {
+	char *file;
+	psi_resource_t resource;
+	const container_t *container; // NULL for the host
+	int fd;
+	event_io_t *io;
+	time_t last_notify;
+};
+
+static const char *psi_resource_names[PSI_RESOURCE_COUNT] = {
+	[PSI_CPU] = "cpu",
+	[PSI_MEMORY] = "memory",
+	[PSI_IO] = "io",
+};
+
+static const unsigned int psi_thresholds[PSI_RESOURCE_COUNT] = {
+	[PSI_CPU] = PSI_THRESHOLD_CPU,
+	[PSI_MEMORY] = PSI_THRESHOLD_MEMORY,
+	[PSI_IO] = PSI_THRESHOLD_IO,
+};
+
+static psi_monitor_t *psi_host_monitors[PSI_RESOURCE_COUNT];
+
+static bool psi_freeze_policy = false;
+static list_t *psi_frozen_list = NULL; // uuid_t of the containers frozen by the policy
+static time_t psi_last_freeze = 0;
+static event_timer_t *psi_resume_timer = NULL;
+static int psi_resume_checks = 0;
+
+static time_t
+psi_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*
+ * Reads the averages of the "some" or "full" line of a pressure file, e.g.
+ * "some avg10=0.00 avg60=0.00 avg300=0.00 total=0".
+ */
+static int
+psi_read_avg(int fd, bool full, double *avg10, double *avg60)
+{
+	char buf[256];
+	ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+	IF_TRUE_RETVAL(len <= 0, -1);
+	buf[len] = '\0';
+
+	const char *line = full ? strstr(buf, "full ") : buf;
+	IF_NULL_RETVAL(line, -1);
+	if (sscanf(line + 5, "avg10=%lf avg60=%lf", avg10, avg60) != 2)
+		return -1;
+	return 0;
+}
+
+static void
+psi_resume_cb(UNUSED event_timer_t *timer, UNUSED void *data);
+
+/*
+ * Freezes the running container with the lowest boot priority, except c0.
+ */
+static container_t *
+psi_policy_freeze(void)
+{
+	IF_TRUE_RETVAL(psi_now() - psi_last_freeze < PSI_FREEZE_INTERVAL, NULL);
+
+	container_t *c0 = cmld_containers_get_c0();
+	container_t *victim = NULL;
+	for (int i = 0; i < cmld_containers_get_count(); i++) {
+		container_t *container = cmld_container_get_by_index(i);
+		if (container == c0 || container_get_state(container) != CONTAINER_STATE_RUNNING)
+			continue;
+		if (!victim ||
+		    container_get_boot_priority(container) < container_get_boot_priority(victim))
+			victim = container;
+	}
+	IF_NULL_RETVAL(victim, NULL);
+
+	WARN("Freezing container %s due to memory pressure", container_get_description(victim));
+	if (container_freeze(victim) < 0) {
+		WARN("Could not freeze container %s", container_get_description(victim));
+		return NULL;
+	}
+
+	psi_last_freeze = psi_now();
+	psi_frozen_list = list_prepend(psi_frozen_list,
+				       uuid_new(uuid_string(container_get_uuid(victim))));
+	psi_resume_checks = 0;
+	if (!psi_resume_timer) {
+		psi_resume_timer = event_timer_new(PSI_RESUME_INTERVAL, EVENT_TIMER_REPEAT_FOREVER,
+						   &psi_resume_cb, NULL);
+		event_add_timer(psi_resume_timer);
+	}
+	return victim;
+}
+
+static void
+psi_resume_cb(UNUSED event_timer_t *timer, UNUSED void *data)
+{
+	double avg10, avg60;
+	psi_monitor_t *monitor = psi_host_monitors[PSI_MEMORY];
+
+	if (monitor && psi_read_avg(monitor->fd, false, &avg10, &avg60) == 0 &&
+	    avg10 >= PSI_RESUME_AVG10) {
+		psi_resume_checks = 0;
+		return;
+	}
+	IF_TRUE_RETURN(++psi_resume_checks < PSI_RESUME_CHECKS);
+	psi_resume_checks = 0;
+
+	if (psi_frozen_list) {
+		uuid_t *uuid = psi_frozen_list->data;
+		psi_frozen_list = list_unlink(psi_frozen_list, psi_frozen_list);
+
+		// the container may have been removed or resumed in the meantime
+		container_t *container = cmld_container_get_by_uuid(uuid);
+		if (container && container_get_state(container) == CONTAINER_STATE_FROZEN) {
+			INFO("Memory pressure is gone, resuming container %s",
+			     container_get_description(container));
+			if (container_unfreeze(container) < 0)
+				WARN("Could not resume container %s",
+				     container_get_description(container));
+		}
+		uuid_free(uuid);
+	}
+
+	if (!psi_frozen_list) {
+		event_remove_timer(psi_resume_timer);
+		event_timer_free(psi_resume_timer);
+		psi_resume_timer = NULL;
+	}
+}
+
+static void
+psi_monitor_cb(UNUSED int fd, unsigned events, UNUSED event_io_t *io, void *data)
+{
+	psi_monitor_t *monitor = data;
+	ASSERT(monitor);
+
+	if (events & EVENT_IO_EXCEPT) {
+		// the cgroup was removed, its monitor is freed with it
+		TRACE("Pressure file %s is gone", monitor->file);
+		event_remove_io(monitor->io);
+		event_io_free(monitor->io);
+		monitor->io = NULL;
+		return;
+	}
+
+	psi_event_t event = { .resource = monitor->resource, .container = monitor->container };
+	if (psi_read_avg(monitor->fd, false, &event.avg10, &event.avg60) < 0) {
+		WARN("Could not read pressure from %s", monitor->file);
+		return;
+	}
+	// report a full stall if all tasks were affected, not only some of them
+	double full_avg10, full_avg60;
+	if (psi_read_avg(monitor->fd, true, &full_avg10, &full_avg60) == 0 && full_avg10 > 0) {
+		event.full = true;
+		event.avg10 = full_avg10;
+		event.avg60 = full_avg60;
+	}
+
+	char *action = NULL;
+	if (!monitor->container && monitor->resource == PSI_MEMORY && psi_freeze_policy &&
+	    event.avg10 >= PSI_FREEZE_AVG10) {
+		container_t *frozen = psi_policy_freeze();
+		if (frozen) {
+			action = mem_printf("froze %s", uuid_string(container_get_uuid(frozen)));
+			event.action = action;
+		}
+	}
+
+	if (action || psi_now() - monitor->last_notify >= PSI_NOTIFY_INTERVAL) {
+		DEBUG("Pressure on %s of %s: avg10=%.2f avg60=%.2f%s%s",
+		      psi_resource_names[monitor->resource],
+		      monitor->container ? container_get_description(monitor->container) : "host",
+		      event.avg10, event.avg60, action ? ", " : "", action ? action : "");
+		control_notify_pressure(&event);
+		monitor->last_notify = psi_now();
+	}
+	mem_free0(action);
+}
+
+psi_monitor_t *
+psi_monitor_new(const char *file, psi_resource_t resource, const container_t *container)
+{
+	ASSERT(file);
+	ASSERT(resource < PSI_RESOURCE_COUNT);
+
+	int fd = open(file, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		TRACE_ERRNO("Not monitoring %s", file);
+		return NULL;
+	}
+
+	char trigger[64];
+	int len = snprintf(trigger, sizeof(trigger), "some %u %u", psi_thresholds[resource],
+			   PSI_WINDOW);
+	// the trigger is written including the terminating null byte
+	if (write(fd, trigger, len + 1) < 0) {
+		WARN_ERRNO("Could not register PSI trigger on %s", file);
+		close(fd);
+		return NULL;
+	}
+
+	psi_monitor_t *monitor = mem_new0(psi_monitor_t, 1);
+	monitor->file = mem_strdup(file);
+	monitor->resource = resource;
+	monitor->container = container;
+	monitor->fd = fd;
+	monitor->io = event_io_new(fd, EVENT_IO_PRI, &psi_monitor_cb, monitor);
+	event_add_io(monitor->io);
+
+	TRACE("Monitoring %s with trigger \"%s\"", file, trigger);
+	return monitor;
+}
+
+void
+psi_monitor_free(psi_monitor_t *monitor)
+{
+	IF_NULL_RETURN(monitor);
+
+	if (monitor->io) {
+		event_remove_io(monitor->io);
+		event_io_free(monitor->io);
+	}
+	close(monitor->fd);
+	mem_free0(monitor->file);
+	mem_free0(monitor);
+}
+
+int
+psi_host_get_avg(psi_resource_t resource, double *avg10, double *avg60)
+{
+	ASSERT(resource < PSI_RESOURCE_COUNT);
+
+	psi_monitor_t *monitor = psi_host_monitors[resource];
+	IF_NULL_RETVAL(monitor, -1);
+	return psi_read_avg(monitor->fd, false, avg10, avg60);
+}
+
+int
+psi_init(bool freeze_policy)
+{
+	if (!file_is_dir(PSI_PROC_PATH)) {
+		WARN("No pressure stall information in %s; no kernel support?", PSI_PROC_PATH);
+		return -1;
+	}
+
+	psi_freeze_policy = freeze_policy;
+	for (int i = 0; i < PSI_RESOURCE_COUNT; i++) {
+		char *file = mem_printf("%s/%s", PSI_PROC_PATH, psi_resource_names[i]);
+		psi_host_monitors[i] = psi_monitor_new(file, i, NULL);
+		mem_free0(file);
+	}
+	return psi_host_monitors[PSI_MEMORY] ? 0 : -1;
+}
@@ -0,0 +1,93 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file psi.h
+ *
+ * Monitors the pressure stall information (PSI) of the host and of the containers
+ * with PSI triggers, which wake up the event loop only if tasks stalled on a resource
+ * for more than a threshold within a time window. Control clients are notified of
+ * such stalls, and on sustained memory pressure of the host the container with the
+ * lowest boot priority may be frozen until the pressure is gone.
+ */
+
+#ifndef PSI_H
+#define PSI_H
+
+#include "container.h"
+
+#include <stdbool.h>
+
+typedef enum {
+	PSI_CPU = 0,
+	PSI_MEMORY,
+	PSI_IO,
+	PSI_RESOURCE_COUNT,
+} psi_resource_t;
+
+/**
+ * A stall on a resource which exceeded the threshold of a monitor.
+ */
+typedef struct psi_event {
+	psi_resource_t resource;
+	const container_t *container; // NULL for the host
+	bool full;		      // all tasks stalled, not only some of them
+	double avg10;		      // share of time stalled in percent
+	double avg60;
+	const char *action; // policy action taken in response, NULL if none
+} psi_event_t;
+
+typedef struct psi_monitor psi_monitor_t;
+
+/**
+ * Starts monitoring the given pressure file (e.g. memory.pressure of a cgroup v2)
+ * for stalls of the tasks of the container.
+ *
+ * @return the new monitor or NULL if the kernel does not support PSI triggers
+ */
+psi_monitor_t *
+psi_monitor_new(const char *file, psi_resource_t resource, const container_t *container);
+
+void
+psi_monitor_free(psi_monitor_t *monitor);
+
+/**
+ * Reads the share of time in percent in which some tasks of the host stalled on the
+ * resource, averaged over 10 and 60 seconds.
+ *
+ * @return 0 on success, -1 if the host pressure is not monitored
+ */
+int
+psi_host_get_avg(psi_resource_t resource, double *avg10, double *avg60);
+
+/**
+ * Starts the monitors of the host wide pressure in /proc/pressure.
+ *
+ * @param freeze_policy freeze the running container with the lowest boot priority
+ *		       on sustained memory pressure
+ * @return 0 on success, -1 if the kernel does not provide PSI
+ */
+int
+psi_init(bool freeze_policy);
+
+#endif /* PSI_H */
@@ -0,0 +1,214 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "reclaim.h"
+#include "cmld.h"
+#include "container.h"
+#include "c_cgroups.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/event.h"
+#include "common/file.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/swap.h>
+
+#define RECLAIM_INTERVAL 10000
+
+/* running containers which used less cpu time than this over the window are idle */
+#define RECLAIM_IDLE_WINDOW 60000
+#define RECLAIM_IDLE_CPU_PERMILLE 10
+
+/* share of the memory of a background container reclaimed per interval */
+#define RECLAIM_PERCENT_FROZEN 20
+#define RECLAIM_PERCENT_IDLE 5
+
+#define RECLAIM_ZRAM_DEV "zram0"
+#define RECLAIM_ZRAM_COMP_ALGORITHM "lz4"
+/* prefer the compressed in-memory swap over any disk based swap */
+#define RECLAIM_ZRAM_SWAP_PRIO 100
+
+static event_timer_t *reclaim_timer;
+
+static uint64_t
+reclaim_time_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * A running container is idle if its recorded resource usage samples over the
+ * last RECLAIM_IDLE_WINDOW show almost no cpu usage.
+ */
+static bool
+reclaim_container_is_idle(const container_t *container)
+{
+	uint64_t now = reclaim_time_ms();
+	if (container_get_uptime(container) < RECLAIM_IDLE_WINDOW / 1000)
+		return false;
+
+	c_cgroups_stats_sample_t *samples = NULL;
+	size_t n = container_get_stats(container, now - RECLAIM_IDLE_WINDOW, &samples);
+
+	bool idle = false;
+	if (n >= 2 && (samples[0].valid & samples[n - 1].valid & C_CGROUPS_STATS_CPU)) {
+		uint64_t cpu_ns = samples[n - 1].cpu_usage_ns - samples[0].cpu_usage_ns;
+		uint64_t wall_ms = samples[n - 1].time - samples[0].time;
+		idle = wall_ms && cpu_ns / 1000 < wall_ms * RECLAIM_IDLE_CPU_PERMILLE;
+	}
+	mem_free0(samples);
+	return idle;
+}
+
+static void
+reclaim_cb(UNUSED event_timer_t *timer, UNUSED void *data)
+{
+	container_t *c0 = cmld_containers_get_c0();
+
+	for (int i = 0; i < cmld_containers_get_count(); i++) {
+		container_t *container = cmld_container_get_by_index(i);
+		if (container == c0)
+			continue;
+
+		unsigned int percent = 0;
+		switch (container_get_state(container)) {
+		case CONTAINER_STATE_FROZEN:
+			percent = RECLAIM_PERCENT_FROZEN;
+			break;
+		case CONTAINER_STATE_RUNNING:
+			if (reclaim_container_is_idle(container))
+				percent = RECLAIM_PERCENT_IDLE;
+			break;
+		default:
+			continue;
+		}
+
+		container_set_mem_background(container, percent > 0);
+		if (percent > 0)
+			container_mem_reclaim(container, percent);
+	}
+}
+
+/*
+ * Writes a swap signature (as mkswap does) to the start of the device.
+ */
+static int
+reclaim_mkswap(const char *dev, uint64_t size)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	uint8_t *page = mem_alloc0(page_size);
+
+	/* struct swap_header_v1_2 follows the 1024 bytes of boot sector space */
+	uint32_t *info = (uint32_t *)(page + 1024);
+	info[0] = 1;			// version
+	info[1] = size / page_size - 1; // last_page
+	info[2] = 0;			// nr_badpages
+	memcpy(page + page_size - 10, "SWAPSPACE2", 10);
+
+	int ret = -1;
+	int fd = open(dev, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ERROR_ERRNO("Could not open %s", dev);
+		goto out;
+	}
+	if (write(fd, page, page_size) != page_size || fsync(fd) < 0)
+		ERROR_ERRNO("Could not write swap signature to %s", dev);
+	else
+		ret = 0;
+	close(fd);
+out:
+	mem_free0(page);
+	return ret;
+}
+
+static int
+reclaim_zram_swap_init(uint32_t size_mb)
+{
+	const char *sys = "/sys/block/" RECLAIM_ZRAM_DEV;
+	const char *dev = "/dev/" RECLAIM_ZRAM_DEV;
+	uint64_t size = (uint64_t)size_mb * 1024 * 1024;
+
+	if (!file_exists(sys)) {
+		WARN("No zram device %s; no kernel support?", sys);
+		return -1;
+	}
+
+	char *disksize_path = mem_printf("%s/disksize", sys);
+	char *disksize = file_read_new(disksize_path, 32);
+	bool initialized = disksize && strtoull(disksize, NULL, 10) > 0;
+	mem_free0(disksize);
+
+	int ret = -1;
+	if (initialized) {
+		INFO("zram device %s is already set up, not changing it", dev);
+		ret = 0;
+		goto out;
+	}
+
+	char *algorithm_path = mem_printf("%s/comp_algorithm", sys);
+	if (file_printf(algorithm_path, "%s", RECLAIM_ZRAM_COMP_ALGORITHM) < 0)
+		WARN("Could not select %s compression for %s, using the default",
+		     RECLAIM_ZRAM_COMP_ALGORITHM, dev);
+	mem_free0(algorithm_path);
+
+	if (file_printf(disksize_path, "%" PRIu64, size) < 0) {
+		ERROR("Could not set size of zram device %s", dev);
+		goto out;
+	}
+	IF_TRUE_GOTO(reclaim_mkswap(dev, size) < 0, out);
+
+	int flags = SWAP_FLAG_PREFER |
+		    ((RECLAIM_ZRAM_SWAP_PRIO << SWAP_FLAG_PRIO_SHIFT) & SWAP_FLAG_PRIO_MASK);
+	if (swapon(dev, flags) < 0) {
+		ERROR_ERRNO("Could not enable swap on %s", dev);
+		goto out;
+	}
+
+	INFO("Enabled %u MBytes of zram swap on %s", size_mb, dev);
+	ret = 0;
+out:
+	mem_free0(disksize_path);
+	return ret;
+}
+
+int
+reclaim_init(uint32_t zram_swap_size)
+{
+	int ret = 0;
+	if (zram_swap_size > 0 && reclaim_zram_swap_init(zram_swap_size) < 0)
+		ret = -1;
+
+	reclaim_timer = event_timer_new(RECLAIM_INTERVAL, EVENT_TIMER_REPEAT_FOREVER, &reclaim_cb,
+					NULL);
+	event_add_timer(reclaim_timer);
+	return ret;
+}
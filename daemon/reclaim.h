@@ -0,0 +1,49 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file reclaim.h
+ *
+ * Memory management across containers. Containers which are frozen or have been idle
+ * for a while are moved to the background: their memory is reclaimed proactively and,
+ * on cgroup v1, taken first under global memory pressure. Foreground containers are
+ * only throttled at their soft limit. Reclaimed anonymous memory may go to a zram
+ * swap device, so that more containers fit on a host without OOM kills.
+ */
+
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+#include <stdint.h>
+
+/**
+ * Sets up the zram swap device (if zram_swap_size is not 0) and starts the periodic
+ * memory management of the containers.
+ *
+ * @param zram_swap_size size of the zram swap device in MBytes, 0 for none
+ * @return 0 on success, -1 if the zram swap device could not be set up
+ */
+int
+reclaim_init(uint32_t zram_swap_size);
+
+#endif /* RECLAIM_H */
@@ -28,16 +28,22 @@
 #include "control.h"
 #include "audit.h"
 #include "scd_shared.h"
+#include "crypto_hash.h"
 
 #include "common/macro.h"
 #include "common/event.h"
 #include "common/logf.h"
 #include "common/fd.h"
 #include "common/file.h"
+#include "common/hex.h"
 #include "common/sock.h"
 #include "common/mem.h"
 #include "common/protobuf.h"
+#include "common/protobuf_writer.h"
+#include "common/list.h"
 #include "common/proc.h"
+#include "common/metrics.h"
+#include "common/probe.h"
 
 #include <google/protobuf-c/protobuf-c-text.h>
 #include <sys/types.h>
@@ -69,6 +75,10 @@ struct smartcard {
 	pid_t scd_pid;
 };
 
+// latency of blocking and asynchronous requests to scd
+static metrics_t *smartcard_metrics_block = NULL;
+static metrics_t *smartcard_metrics_async = NULL;
+
 typedef struct smartcard_startdata {
 	smartcard_t *smartcard;
 	container_t *container;
@@ -81,20 +91,6 @@ typedef struct smartcard_scdtoken_data {
 	char *token_uuid;
 } smartcard_scdtoken_data_t;
 
-static char *
-bytes_to_string_new(unsigned char *data, size_t len)
-{
-	IF_NULL_RETVAL(data, NULL);
-	IF_TRUE_RETVAL(len == 0, NULL);
-	size_t len_chunk = MUL_WITH_OVERFLOW_CHECK(len, (size_t)2);
-	len_chunk = ADD_WITH_OVERFLOW_CHECK(len_chunk, 1);
-
-	char *str = mem_alloc(len_chunk);
-	for (size_t i = 0; i < len; i++)
-		snprintf(str + 2 * i, 3, "%02x", data[i]);
-	return str;
-}
-
 static TokenType
 smartcard_tokentype_to_proto(container_token_type_t tokentype)
 {
@@ -170,6 +166,7 @@ smartcard_send_recv_block(const DaemonToToken *out)
 
 	DEBUG("smartcard_send_recv_block: connected to sock %d", sock);
 
+	uint64_t begin = metrics_now_ns();
 	if (protobuf_send_message(sock, (ProtobufCMessage *)out) < 0) {
 		ERROR("Failed to send message to scd on sock %d", sock);
 		close(sock);
@@ -179,6 +176,8 @@ smartcard_send_recv_block(const DaemonToToken *out)
 	TokenToDaemon *msg = NULL;
 	msg = (TokenToDaemon *)protobuf_recv_message(sock, &token_to_daemon__descriptor);
 	close(sock);
+	if (msg)
+		metrics_observe(smartcard_metrics_block, metrics_now_ns() - begin);
 	return msg;
 }
 
@@ -418,7 +417,7 @@ smartcard_cb_start_container(int fd, unsigned events, event_io_t *io, void *data
 					TOKEN_MGMT, "gen-container-key",
 					uuid_string(container_get_uuid(startdata->container)), 0);
 				// set the key
-				char *ascii_key = bytes_to_string_new(key, keylen);
+				char *ascii_key = hex_encode_new(key, keylen);
 				container_set_key(startdata->container, ascii_key);
 				// delete key from RAM
 				memset(ascii_key, 0, strlen(ascii_key));
@@ -481,8 +480,8 @@ smartcard_cb_start_container(int fd, unsigned events, event_io_t *io, void *data
 					TOKEN_MGMT, "unwrap-container-key",
 					uuid_string(container_get_uuid(startdata->container)), 0);
 			TRACE("Successfully retrieved unwrapped key from SCD");
-			char *ascii_key = bytes_to_string_new(msg->unwrapped_key.data,
-							      msg->unwrapped_key.len);
+			char *ascii_key =
+				hex_encode_new(msg->unwrapped_key.data, msg->unwrapped_key.len);
 			container_set_key(startdata->container, ascii_key);
 			//delete key from RAM
 			memset(ascii_key, 0, strlen(ascii_key));
@@ -1099,6 +1098,14 @@ smartcard_new(const char *path)
 	smartcard_t *smartcard = mem_alloc(sizeof(smartcard_t));
 	smartcard->path = mem_strdup(path);
 
+	if (!smartcard_metrics_block) {
+		const char *help = "Latency of requests to scd.";
+		smartcard_metrics_block = metrics_new(METRICS_HISTOGRAM, "cml_scd_request_seconds",
+						      "kind=\"block\"", help);
+		smartcard_metrics_async = metrics_new(METRICS_HISTOGRAM, "cml_scd_request_seconds",
+						      "kind=\"async\"", help);
+	}
+
 	// Start SCD and wait for control interface
 	smartcard->scd_pid = fork_and_exec_scd();
 	IF_TRUE_RETVAL_TRACE(smartcard->scd_pid == -1, NULL);
@@ -1129,6 +1136,9 @@ smartcard_scd_stop(smartcard_t *smartcard)
 {
 	DEBUG("Stopping %s process with pid=%d!", SCD_BINARY_NAME, smartcard->scd_pid);
 	kill(smartcard->scd_pid, SIGTERM);
+	// a new scd must not find the socket of this one, e.g., after cmld re-executed itself
+	if (waitpid(smartcard->scd_pid, NULL, 0) < 0)
+		WARN_ERRNO("Could not wait for %s process", SCD_BINARY_NAME);
 }
 
 void
@@ -1179,11 +1189,11 @@ smartcard_crypto_verify_result_from_proto(TokenToDaemon__Code code)
 }
 
 typedef struct crypto_callback_task {
-	smartcard_crypto_hash_callback_t hash_complete;
+	uint32_t request_id; // matches the response of scd to this task
+	uint64_t sent_ns;    // metrics_now_ns() when the request was sent
 	smartcard_crypto_verify_callback_t verify_complete;
 	smartcard_crypto_verify_buf_callback_t verify_buf_complete;
 	void *data;
-	char *hash_file;
 	smartcard_crypto_hashalgo_t hash_algo;
 	char *verify_data_file;
 	char *verify_sig_file;
@@ -1196,18 +1206,6 @@ typedef struct crypto_callback_task {
 	size_t verify_cert_buf_len;
 } crypto_callback_task_t;
 
-static crypto_callback_task_t *
-crypto_callback_hash_task_new(smartcard_crypto_hash_callback_t cb, void *data,
-			      const char *hash_file, smartcard_crypto_hashalgo_t hash_algo)
-{
-	crypto_callback_task_t *task = mem_new0(crypto_callback_task_t, 1);
-	task->hash_complete = cb;
-	task->data = data;
-	task->hash_file = mem_strdup(hash_file);
-	task->hash_algo = hash_algo;
-	return task;
-}
-
 static crypto_callback_task_t *
 crypto_callback_verify_task_new(smartcard_crypto_verify_callback_t cb, void *data,
 				const char *data_file, const char *sig_file, const char *cert_file,
@@ -1250,8 +1248,6 @@ static void
 crypto_callback_task_free(crypto_callback_task_t *task)
 {
 	IF_NULL_RETURN(task);
-	if (task->hash_file)
-		mem_free0(task->hash_file);
 	if (task->verify_data_file)
 		mem_free0(task->verify_data_file);
 	if (task->verify_sig_file)
@@ -1267,90 +1263,123 @@ crypto_callback_task_free(crypto_callback_task_t *task)
 	mem_free0(task);
 }
 
+/*
+ * All asynchronous crypto requests share one connection to scd. Each request carries an
+ * id which scd echoes in its response, thus many requests may be in flight and scd may
+ * answer them out of order as its workers finish.
+ */
+static int smartcard_crypto_sock = -1;
+static event_io_t *smartcard_crypto_io = NULL;
+static list_t *smartcard_crypto_tasks = NULL; // tasks waiting for a response
+static uint32_t smartcard_crypto_next_request_id = 1;
+
 static void
-smartcard_cb_crypto(int fd, unsigned events, event_io_t *io, void *data)
+smartcard_crypto_task_complete(crypto_callback_task_t *task, const TokenToDaemon *msg)
 {
-	crypto_callback_task_t *task = data;
 	ASSERT(task);
 
+	// a missing message reports an error, e.g., since the connection to scd broke
+	TokenToDaemon__Code code = msg ? msg->code : TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_ERROR;
+
+	switch (code) {
+	// deal with CRYPTO_VERIFY_* cases
+	case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_GOOD:
+	case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_ERROR:
+	case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_BAD_SIGNATURE:
+	case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_BAD_CERTIFICATE:
+	case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_LOCALLY_SIGNED:
+		if (task->verify_complete) {
+			task->verify_complete(smartcard_crypto_verify_result_from_proto(code),
+					      task->verify_data_file, task->verify_sig_file,
+					      task->verify_cert_file, task->hash_algo, task->data);
+		} else if (task->verify_buf_complete) {
+			task->verify_buf_complete(smartcard_crypto_verify_result_from_proto(code),
+						  task->verify_data_buf, task->verify_data_buf_len,
+						  task->verify_sig_buf, task->verify_sig_buf_len,
+						  task->verify_cert_buf, task->verify_cert_buf_len,
+						  task->hash_algo, task->data);
+		}
+		break;
+	default:
+		ERROR("TokenToDaemon command %d unknown or not implemented yet", code);
+		break;
+	}
+}
+
+static void
+smartcard_crypto_disconnect(void)
+{
+	IF_TRUE_RETURN(smartcard_crypto_sock < 0);
+
+	protobuf_writer_free(protobuf_writer_get_by_fd(smartcard_crypto_sock));
+	event_remove_io(smartcard_crypto_io);
+	event_io_free(smartcard_crypto_io);
+	close(smartcard_crypto_sock);
+	smartcard_crypto_io = NULL;
+	smartcard_crypto_sock = -1;
+
+	// callbacks may already issue new requests, which use a new connection
+	list_t *tasks = smartcard_crypto_tasks;
+	smartcard_crypto_tasks = NULL;
+	if (tasks)
+		WARN("Lost connection to scd, failing %u pending crypto requests",
+		     list_length(tasks));
+	for (list_t *l = tasks; l; l = l->next) {
+		crypto_callback_task_t *task = l->data;
+		smartcard_crypto_task_complete(task, NULL);
+		crypto_callback_task_free(task);
+	}
+	list_delete(tasks);
+}
+
+static void
+smartcard_cb_crypto(int fd, unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+{
 	TRACE("Received message from SCD");
 
-	// TODO outsource socket/fd/events handling
 	if (events & EVENT_IO_READ) {
 		// use protobuf for communication with scd
 		TokenToDaemon *msg =
 			(TokenToDaemon *)protobuf_recv_message(fd, &token_to_daemon__descriptor);
 		if (!msg) {
 			ERROR("Failed to receive message although EVENT_IO_READ was set. Aborting smartcard crypto.");
-			goto cleanup;
+			smartcard_crypto_disconnect();
+			return;
 		}
-		switch (msg->code) {
-		// deal with CRYPTO_HASH_* cases
-		case TOKEN_TO_DAEMON__CODE__CRYPTO_HASH_OK:
-			TRACE("Received HASH_OK message, ");
-			if (msg->has_hash_value) {
-				char *hash = bytes_to_string_new(msg->hash_value.data,
-								 msg->hash_value.len);
-
-				TRACE("Received hash for file %s: %s",
-				      task->hash_file ? task->hash_file : "<empty>", hash);
-				task->hash_complete(hash, task->hash_file, task->hash_algo,
-						    task->data);
-				if (hash != NULL) {
-					mem_free0(hash);
-				}
-				break;
-			}
-			ERROR("Missing hash_value in CRYPTO_HASH_OK response!"); // fallthrough
-		case TOKEN_TO_DAEMON__CODE__CRYPTO_HASH_ERROR:
-			task->hash_complete(NULL, task->hash_file, task->hash_algo, task->data);
-			break;
 
-		// deal with CRYPTO_VERIFY_* cases
-		case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_GOOD:
-		case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_ERROR:
-		case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_BAD_SIGNATURE:
-		case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_BAD_CERTIFICATE:
-		case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_LOCALLY_SIGNED:
-			if (task->verify_complete) {
-				task->verify_complete(
-					smartcard_crypto_verify_result_from_proto(msg->code),
-					task->verify_data_file, task->verify_sig_file,
-					task->verify_cert_file, task->hash_algo, task->data);
-			} else if (task->verify_buf_complete) {
-				task->verify_buf_complete(
-					smartcard_crypto_verify_result_from_proto(msg->code),
-					task->verify_data_buf, task->verify_data_buf_len,
-					task->verify_sig_buf, task->verify_sig_buf_len,
-					task->verify_cert_buf, task->verify_cert_buf_len,
-					task->hash_algo, task->data);
+		crypto_callback_task_t *task = NULL;
+		for (list_t *l = smartcard_crypto_tasks; l && msg->has_request_id; l = l->next) {
+			crypto_callback_task_t *t = l->data;
+			if (t->request_id == msg->request_id) {
+				task = t;
+				break;
 			}
-			break;
-		default:
-			ERROR("TokenToDaemon command %d unknown or not implemented yet", msg->code);
-			break;
 		}
+		if (!task) {
+			WARN("Dropping scd response %d without pending request (id %u)", msg->code,
+			     msg->request_id);
+			protobuf_free_message((ProtobufCMessage *)msg);
+			return;
+		}
+
+		smartcard_crypto_tasks = list_remove(smartcard_crypto_tasks, task);
+		metrics_observe(smartcard_metrics_async, metrics_now_ns() - task->sent_ns);
+		PROBE2(scd_request_done, task->request_id, msg->code);
+		smartcard_crypto_task_complete(task, msg);
+		crypto_callback_task_free(task);
 		protobuf_free_message((ProtobufCMessage *)msg);
 	} else if (events & EVENT_IO_EXCEPT) {
 		WARN("Got EVENT_IO_EXCEPT in smartcard_cb_crypto().");
-		// TODO
+		smartcard_crypto_disconnect();
 	} else {
 		WARN("Got other event %x in smartcard_cb_crypto(), ignoring.", events);
-		return; // do nothing (i.e. do not free resources) for other kinds of events
 	}
-
-cleanup:
-	event_remove_io(io);
-	event_io_free(io);
-	crypto_callback_task_free(task);
-	close(fd);
 }
 
 static int
-smartcard_send_crypto(const DaemonToToken *out, crypto_callback_task_t *task)
+smartcard_crypto_connect(void)
 {
-	ASSERT(out);
-	ASSERT(task);
+	IF_TRUE_RETVAL(smartcard_crypto_sock >= 0, 0);
 
 	int sock = sock_unix_create_and_connect(SOCK_SEQPACKET | SOCK_NONBLOCK, SCD_CONTROL_SOCKET);
 	if (sock < 0) {
@@ -1358,10 +1387,32 @@ smartcard_send_crypto(const DaemonToToken *out, crypto_callback_task_t *task)
 			    SCD_CONTROL_SOCKET);
 		return -1;
 	}
+	DEBUG("smartcard_crypto_connect: connected to sock %d", sock);
 
-	DEBUG("smartcard_send_crypto: connected to sock %d", sock);
-	event_io_t *event = event_io_new(sock, EVENT_IO_READ, smartcard_cb_crypto, task);
-	event_add_io(event);
+	// do not block the event loop if scd is slow in taking up requests
+	if (!protobuf_writer_new(sock, 0, NULL, NULL))
+		WARN("Could not create outbound queue for fd %d, sending synchronously", sock);
+
+	smartcard_crypto_sock = sock;
+	smartcard_crypto_io = event_io_new(sock, EVENT_IO_READ, smartcard_cb_crypto, NULL);
+	event_add_io(smartcard_crypto_io);
+	return 0;
+}
+
+static int
+smartcard_send_crypto(DaemonToToken *out, crypto_callback_task_t *task)
+{
+	ASSERT(out);
+	ASSERT(task);
+
+	IF_TRUE_RETVAL(smartcard_crypto_connect() < 0, -1);
+
+	// 0 is not used as an id, so that it never matches a response without id
+	if (smartcard_crypto_next_request_id == 0)
+		smartcard_crypto_next_request_id++;
+	task->request_id = smartcard_crypto_next_request_id++;
+	out->has_request_id = true;
+	out->request_id = task->request_id;
 
 	/*
 	char *string = protobuf_c_text_to_string((ProtobufCMessage *) out, NULL);
@@ -1371,14 +1422,54 @@ smartcard_send_crypto(const DaemonToToken *out, crypto_callback_task_t *task)
 	mem_free0(string);
 	*/
 
-	if (protobuf_send_message(sock, (ProtobufCMessage *)out) < 0) {
-		event_remove_io(event);
-		event_io_free(event);
+	task->sent_ns = metrics_now_ns();
+	PROBE2(scd_request, task->request_id, out->code);
+	if (protobuf_writer_send_message(smartcard_crypto_sock, (ProtobufCMessage *)out) < 0) {
+		ERROR("Failed to send crypto request %u to scd", task->request_id);
 		return -1;
 	}
+	smartcard_crypto_tasks = list_append(smartcard_crypto_tasks, task);
 	return 0;
 }
 
+static crypto_hash_algo_t
+smartcard_hashalgo_to_crypto_hash(smartcard_crypto_hashalgo_t hashalgo)
+{
+	switch (hashalgo) {
+	case SHA1:
+		return CRYPTO_HASH_SHA1;
+	case SHA256:
+		return CRYPTO_HASH_SHA256;
+	case SHA512:
+		return CRYPTO_HASH_SHA512;
+	default:
+		FATAL("Invalid smartcard_hashalgo_t value: %d", hashalgo);
+	}
+}
+
+typedef struct smartcard_crypto_hash_task {
+	smartcard_crypto_hash_callback_t hash_complete;
+	smartcard_crypto_hash_multi_callback_t hash_multi_complete;
+	smartcard_crypto_hashalgo_t hash_algo;
+	void *data;
+} smartcard_crypto_hash_task_t;
+
+static void
+smartcard_crypto_hash_cb(const char *const *hash_strings, size_t n, const char *file, void *data)
+{
+	smartcard_crypto_hash_task_t *task = data;
+	ASSERT(task);
+
+	if (task->hash_multi_complete) {
+		task->hash_multi_complete(hash_strings, n, file, task->data);
+	} else {
+		TRACE("Hashed file %s: %s", file, hash_strings ? hash_strings[0] : "<error>");
+		task->hash_complete(hash_strings ? hash_strings[0] : NULL, file, task->hash_algo,
+				    task->data);
+	}
+	mem_free0(task);
+}
+
 int
 smartcard_crypto_hash_file(const char *file, smartcard_crypto_hashalgo_t hashalgo,
 			   smartcard_crypto_hash_callback_t cb, void *data)
@@ -1386,18 +1477,45 @@ smartcard_crypto_hash_file(const char *file, smartcard_crypto_hashalgo_t hashalg
 	ASSERT(file);
 	ASSERT(cb);
 
-	crypto_callback_task_t *task = crypto_callback_hash_task_new(cb, data, file, hashalgo);
+	smartcard_crypto_hash_task_t *task = mem_new0(smartcard_crypto_hash_task_t, 1);
+	task->hash_complete = cb;
+	task->hash_algo = hashalgo;
+	task->data = data;
 
-	DaemonToToken out = DAEMON_TO_TOKEN__INIT;
-	out.code = DAEMON_TO_TOKEN__CODE__CRYPTO_HASH_FILE;
-	out.has_hash_algo = true;
-	out.hash_algo = smartcard_hashalgo_to_proto(hashalgo);
-	out.hash_file = task->hash_file;
+	crypto_hash_algo_t algo = smartcard_hashalgo_to_crypto_hash(hashalgo);
 
-	TRACE("Requesting scd to hash file at %s", task->hash_file);
+	TRACE("Hashing file at %s", file);
 
-	if (smartcard_send_crypto(&out, task) < 0) {
-		crypto_callback_task_free(task);
+	if (crypto_hash_file(file, &algo, 1, smartcard_crypto_hash_cb, task) < 0) {
+		mem_free0(task);
+		return -1;
+	}
+	return 0;
+}
+
+int
+smartcard_crypto_hash_file_multi(const char *file, const smartcard_crypto_hashalgo_t *hashalgos,
+				 size_t n, smartcard_crypto_hash_multi_callback_t cb, void *data)
+{
+	ASSERT(file);
+	ASSERT(hashalgos);
+	ASSERT(n > 0);
+	ASSERT(cb);
+
+	IF_TRUE_RETVAL_ERROR(n > CRYPTO_HASH_MULTI_MAX, -1);
+
+	smartcard_crypto_hash_task_t *task = mem_new0(smartcard_crypto_hash_task_t, 1);
+	task->hash_multi_complete = cb;
+	task->data = data;
+
+	crypto_hash_algo_t algos[CRYPTO_HASH_MULTI_MAX];
+	for (size_t i = 0; i < n; i++)
+		algos[i] = smartcard_hashalgo_to_crypto_hash(hashalgos[i]);
+
+	TRACE("Hashing file at %s with %zu algorithms", file, n);
+
+	if (crypto_hash_file(file, algos, n, smartcard_crypto_hash_cb, task) < 0) {
+		mem_free0(task);
 		return -1;
 	}
 	return 0;
@@ -1470,36 +1588,11 @@ char *
 smartcard_crypto_hash_file_block_new(const char *file, smartcard_crypto_hashalgo_t hashalgo)
 {
 	ASSERT(file);
-	char *ret = NULL;
 
-	DaemonToToken out = DAEMON_TO_TOKEN__INIT;
-	out.code = DAEMON_TO_TOKEN__CODE__CRYPTO_HASH_FILE;
-	out.has_hash_algo = true;
-	out.hash_algo = smartcard_hashalgo_to_proto(hashalgo);
-	out.hash_file = mem_strdup(file);
-
-	TokenToDaemon *msg = smartcard_send_recv_block(&out);
-	mem_free0(out.hash_file);
-
-	IF_NULL_RETVAL(msg, NULL);
-
-	switch (msg->code) {
-	// deal with CRYPTO_HASH_* cases
-	case TOKEN_TO_DAEMON__CODE__CRYPTO_HASH_OK:
-		if (msg->has_hash_value) {
-			ret = bytes_to_string_new(msg->hash_value.data, msg->hash_value.len);
-		} else {
-			ERROR("Missing hash_value in CRYPTO_HASH_OK response for file %s", file);
-		}
-		break;
-	case TOKEN_TO_DAEMON__CODE__CRYPTO_HASH_ERROR:
+	char *hash = crypto_hash_file_block_new(file, smartcard_hashalgo_to_crypto_hash(hashalgo));
+	if (!hash)
 		ERROR("Hashing file %s failed!", file);
-		break;
-	default:
-		ERROR("Invalid TokenToDaemon command %d when hashing file %s", msg->code, file);
-	}
-	protobuf_free_message((ProtobufCMessage *)msg);
-	return ret;
+	return hash;
 }
 
 smartcard_crypto_verify_result_t
@@ -1589,6 +1682,25 @@ smartcard_crypto_verify_buf_block(unsigned char *data_buf, size_t data_buf_len,
 	return ret;
 }
 
+int
+smartcard_sampler_ctrl(bool start, unsigned hz, unsigned interval)
+{
+	DaemonToToken out = DAEMON_TO_TOKEN__INIT;
+	out.code = start ? DAEMON_TO_TOKEN__CODE__SAMPLER_START :
+			   DAEMON_TO_TOKEN__CODE__SAMPLER_STOP;
+	out.has_sampler_hz = true;
+	out.sampler_hz = hz;
+	out.has_sampler_interval = true;
+	out.sampler_interval = interval;
+
+	TokenToDaemon *msg = smartcard_send_recv_block(&out);
+	IF_NULL_RETVAL(msg, -1);
+
+	int ret = msg->code == TOKEN_TO_DAEMON__CODE__SAMPLER_OK ? 0 : -1;
+	protobuf_free_message((ProtobufCMessage *)msg);
+	return ret;
+}
+
 uint8_t *
 smartcard_pull_csr_new(size_t *csr_len)
 {
@@ -134,7 +134,8 @@ typedef void (*smartcard_crypto_hash_callback_t)(const char *hash_string, const
 						 smartcard_crypto_hashalgo_t hash_algo, void *data);
 
 /**
- * Requests the scd to hash the given file and report the hash to the given callback.
+ * Hashes the given file inside of cmld, see crypto_hash.h, and reports the hash to the
+ * given callback.
  *
  * @param file the file to hash
  * @param hashalgo the hash algorithm to use
@@ -147,7 +148,30 @@ smartcard_crypto_hash_file(const char *file, smartcard_crypto_hashalgo_t hashalg
 			   smartcard_crypto_hash_callback_t cb, void *data);
 
 /**
- * Requests the scd to hash the given file, wait for the result and directly return it.
+ * Callback function for receiving the results of a multi hash operation.
+ * hash_strings holds the n hashes in the order of the requested algorithms,
+ * or is NULL if hashing failed.
+ */
+typedef void (*smartcard_crypto_hash_multi_callback_t)(const char *const *hash_strings, size_t n,
+						       const char *hash_file, void *data);
+
+/**
+ * Hashes the given file inside of cmld with several hash algorithms in a single
+ * pass over the file and report the hashes to the given callback.
+ *
+ * @param file the file to hash
+ * @param hashalgos the hash algorithms to use
+ * @param n the number of hash algorithms
+ * @param cb the callback to receive the result
+ * @param data custom data parameter to pass to the callback
+ * @return 0 if the hash request was sent and the callback is expected to be called, -1 otherwise
+ */
+int
+smartcard_crypto_hash_file_multi(const char *file, const smartcard_crypto_hashalgo_t *hashalgos,
+				 size_t n, smartcard_crypto_hash_multi_callback_t cb, void *data);
+
+/**
+ * Hashes the given file inside of cmld and directly returns the hash.
  *
  * @param file the file to hash
  * @param hashalgo the hash algorithm to use
@@ -254,6 +278,17 @@ smartcard_crypto_verify_buf_block(unsigned char *data_buf, size_t data_buf_len,
 				  unsigned char *cert_buf, size_t cert_buf_len,
 				  smartcard_crypto_hashalgo_t hashalgo);
 
+/**
+ * Starts or stops the sampling profiler of scd (see common/sampler.h).
+ *
+ * @param start true to start, false to stop the sampler
+ * @param hz Samples per second of cpu time, only used for starting.
+ * @param interval Seconds between writing the samples, only used for starting.
+ * @return 0 on success, -1 otherwise
+ */
+int
+smartcard_sampler_ctrl(bool start, unsigned hz, unsigned interval);
+
 /**
  * Pulls the device CSR from the tokens directory,
  * If a TPM is connected, the corresponding Private Key is stored inside the TPM,
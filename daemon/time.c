@@ -36,7 +36,9 @@
 #include <stdio.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
+#include <sys/random.h>
 #include <stdbool.h>
+#include <unistd.h>
 
 #define NTP_SERVICE_PORT "123"
 #define NTP_TIMESTAMP_DELTA 2208988800ull
@@ -66,41 +68,195 @@ typedef struct {
 	uint32_t tx_timestamp_frac;
 } ntp_v3_t;
 
+/*
+ * The servers are queried in parallel and the first valid response is taken, while
+ * cmld's event loop keeps running. Queries still pending after TIME_NTP_TIMEOUT
+ * milliseconds are dropped.
+ */
+static const char *time_ntp_servers[] = { "0.de.pool.ntp.org", "1.de.pool.ntp.org",
+					  "2.de.pool.ntp.org" };
+#define TIME_NTP_SERVERS (sizeof(time_ntp_servers) / sizeof(time_ntp_servers[0]))
+#define TIME_NTP_TIMEOUT 5000
+
+typedef struct time_ntp_query time_ntp_query_t;
+
+typedef struct {
+	time_ntp_query_t *query;
+	const char *server;
+	int sock;
+	event_io_t *io;
+} time_ntp_request_t;
+
+struct time_ntp_query {
+	time_ntp_request_t requests[TIME_NTP_SERVERS];
+	size_t pending;
+	uint32_t tx_timestamp[2]; // random, echoed by the server as orig_timestamp
+	event_timer_t *timeout;
+};
+
 static time_t btime_cml;
-static char *time_ntp_server = "de.pool.ntp.org";
+static time_ntp_query_t *time_ntp_query = NULL; // NULL if no query is in flight
 event_timer_t *time_clock_check_timer = NULL;
 static bool time_out_of_sync = false;
 
-static time_t
-time_get_ntp_coarse(char *server)
+static void
+time_ntp_request_close(time_ntp_request_t *request)
+{
+	IF_TRUE_RETURN(request->sock < 0);
+
+	event_remove_io(request->io);
+	event_io_free(request->io);
+	request->io = NULL;
+	close(request->sock);
+	request->sock = -1;
+	request->query->pending--;
+}
+
+static void
+time_ntp_query_free(time_ntp_query_t *query)
+{
+	for (size_t i = 0; i < TIME_NTP_SERVERS; i++)
+		time_ntp_request_close(&query->requests[i]);
+	if (query->timeout) {
+		event_remove_timer(query->timeout);
+		event_timer_free(query->timeout);
+	}
+	if (time_ntp_query == query)
+		time_ntp_query = NULL;
+	mem_free0(query);
+}
+
+static void
+time_check_and_reset_clock(time_t ntp_now)
 {
+	time_t system_now = time(NULL);
+	IF_TRUE_RETURN(system_now == (time_t)-1);
+
+	if (fabs(difftime(ntp_now, system_now)) > TIME_SYSTEM_OFF_ALLOW) {
+		INFO("System clock out of trusted range. updating internal btime according to NTP");
+		btime_cml = ntp_now - btime_cml;
+		if (time_clock_check_timer) {
+			event_remove_timer(time_clock_check_timer);
+			event_timer_free(time_clock_check_timer);
+			time_clock_check_timer = NULL;
+		}
+		time_out_of_sync = true;
+	} else {
+		INFO("System clock still in trusted range.");
+	}
+}
+
+/*
+ * Takes the first response which answers our request, i.e. a server reply of a
+ * synchronized server echoing our transmit timestamp, and drops all other requests.
+ */
+static void
+time_ntp_recv_cb(int fd, unsigned events, UNUSED event_io_t *io, void *data)
+{
+	time_ntp_request_t *request = data;
+	time_ntp_query_t *query = request->query;
+	ntp_v3_t ntp;
+
+	ssize_t len = (events & EVENT_IO_READ) ? read(fd, &ntp, sizeof(ntp)) : -1;
+	if (len < 0 && errno == EAGAIN)
+		return;
+
+	if (len != sizeof(ntp) || (ntp.li_version_mode & 0x07) != 4 || ntp.stratum == 0 ||
+	    ntp.stratum > 15 || ntp.orig_timestamp_sec != query->tx_timestamp[0] ||
+	    ntp.orig_timestamp_frac != query->tx_timestamp[1] || !ntp.tx_timestamp_sec) {
+		WARN("No valid response from NTP server '%s'", request->server);
+		time_ntp_request_close(request);
+		if (!query->pending) {
+			ERROR("No valid response from any NTP server");
+			time_ntp_query_free(query);
+		}
+		return;
+	}
+
 	/*
 	 * since we cannot trust our local time we just take
 	 * the servers transmit timestamp into account and ignore
 	 * local timestamps for roundtrip elimination
 	 */
-	ntp_v3_t *ntp = mem_new0(ntp_v3_t, 1);
+	time_t ntp_now = (time_t)(ntohl(ntp.tx_timestamp_sec) - NTP_TIMESTAMP_DELTA);
+	INFO("Got current time from server %s: %s", request->server, ctime(&ntp_now));
 
-	// li = 0 , version = 3 , mode = 3
-	ntp->li_version_mode = NTP_LI_VERSION_MODE(0, 3, 3);
+	time_ntp_query_free(query);
+	time_check_and_reset_clock(ntp_now);
+}
+
+static void
+time_ntp_timeout_cb(UNUSED event_timer_t *timer, void *data)
+{
+	time_ntp_query_t *query = data;
 
-	int sock = sock_inet_create_and_connect(SOCK_DGRAM, server, NTP_SERVICE_PORT);
-	IF_TRUE_GOTO(sock < 0, err);
-	IF_TRUE_GOTO(write(sock, (char *)ntp, sizeof(ntp_v3_t)) < 0, err);
-	IF_TRUE_GOTO(read(sock, (char *)ntp, sizeof(ntp_v3_t)) < 0, err);
+	ERROR("No response from any NTP server within %d ms", TIME_NTP_TIMEOUT);
+	// the timer is not repeated and thus already removed from the event loop
+	event_timer_free(query->timeout);
+	query->timeout = NULL;
+	time_ntp_query_free(query);
+}
 
-	ntp->tx_timestamp_sec = ntohl(ntp->tx_timestamp_sec);
-	ntp->tx_timestamp_frac = ntohl(ntp->tx_timestamp_frac);
+static int
+time_ntp_request_send(time_ntp_request_t *request)
+{
+	ntp_v3_t ntp = { 0 };
 
-	time_t ret = (time_t)(ntp->tx_timestamp_sec - NTP_TIMESTAMP_DELTA);
+	// li = 0 , version = 3 , mode = 3
+	ntp.li_version_mode = NTP_LI_VERSION_MODE(0, 3, 3);
+	ntp.tx_timestamp_sec = request->query->tx_timestamp[0];
+	ntp.tx_timestamp_frac = request->query->tx_timestamp[1];
 
-	INFO("Got current time from server %s", ctime(&ret));
-	mem_free0(ntp);
-	return ret;
+	request->sock =
+		sock_inet_create_and_connect(SOCK_DGRAM, request->server, NTP_SERVICE_PORT);
+	IF_TRUE_GOTO(request->sock < 0, err);
+	IF_TRUE_GOTO(fd_make_non_blocking(request->sock) < 0, err);
+	IF_TRUE_GOTO(write(request->sock, &ntp, sizeof(ntp)) != sizeof(ntp), err);
+
+	request->io = event_io_new(request->sock, EVENT_IO_READ, time_ntp_recv_cb, request);
+	event_add_io(request->io);
+	request->query->pending++;
+	return 0;
 err:
-	ERROR("Communication Error with NTP Server '%s'!", server);
-	mem_free0(ntp);
-	return (time_t)-1;
+	ERROR("Communication Error with NTP Server '%s'!", request->server);
+	if (request->sock >= 0)
+		close(request->sock);
+	request->sock = -1;
+	return -1;
+}
+
+/*
+ * Starts an asynchronous query of all NTP servers which resets the clock according
+ * to the first valid response.
+ */
+static void
+time_ntp_query_start(void)
+{
+	time_ntp_query_t *query = mem_new0(time_ntp_query_t, 1);
+
+	if (getrandom(query->tx_timestamp, sizeof(query->tx_timestamp), 0) !=
+	    sizeof(query->tx_timestamp)) {
+		ERROR_ERRNO("Failed to get random NTP transmit timestamp");
+		mem_free0(query);
+		return;
+	}
+
+	for (size_t i = 0; i < TIME_NTP_SERVERS; i++) {
+		query->requests[i].query = query;
+		query->requests[i].server = time_ntp_servers[i];
+		query->requests[i].sock = -1;
+	}
+	for (size_t i = 0; i < TIME_NTP_SERVERS; i++)
+		time_ntp_request_send(&query->requests[i]);
+
+	if (!query->pending) {
+		mem_free0(query);
+		return;
+	}
+
+	query->timeout = event_timer_new(TIME_NTP_TIMEOUT, 1, time_ntp_timeout_cb, query);
+	event_add_timer(query->timeout);
+	time_ntp_query = query;
 }
 
 static bool
@@ -129,22 +285,12 @@ time_check_and_reset_clock_cb(event_timer_t *timer, UNUSED void *data)
 		return;
 	}
 
-	time_t ntp_now = time_get_ntp_coarse(time_ntp_server);
-	IF_TRUE_RETURN(ntp_now == (time_t)-1);
-
-	time_t system_now = time(NULL);
-	IF_TRUE_RETURN(system_now == (time_t)-1);
-
-	if (fabs(difftime(ntp_now, system_now)) > TIME_SYSTEM_OFF_ALLOW) {
-		INFO("System clock out of trusted range. updating internal btime according to NTP");
-		btime_cml = ntp_now - btime_cml;
-		event_remove_timer(timer);
-		event_timer_free(timer);
-		time_clock_check_timer = NULL;
-		time_out_of_sync = true;
-	} else {
-		INFO("System clock still in trusted range.");
+	if (time_ntp_query) {
+		DEBUG("NTP query still in progress");
+		return;
 	}
+
+	time_ntp_query_start();
 }
 
 int
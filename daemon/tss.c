@@ -31,6 +31,10 @@
 #include "common/protobuf.h"
 #include "common/proc.h"
 #include "common/file.h"
+#include "common/metrics.h"
+#include "common/event.h"
+#include "common/list.h"
+#include "common/sock.h"
 
 #include <google/protobuf-c/protobuf-c-text.h>
 #include <stdbool.h>
@@ -41,9 +45,34 @@
 #define TPM2D_BINARY_NAME "tpm2d"
 #endif
 
+// interval in ms of the attempts to connect to the starting tpm2d
+#define TSS_CONNECT_INTERVAL 100
+
 static int tss_sock = -1;
 static pid_t tss_tpm2d_pid = -1;
 
+/*
+ * While tpm2d initializes the TPM, cmld goes on with its own initialization. Until the
+ * socket of tpm2d is connected, measurements are queued and appended in order.
+ */
+static event_timer_t *tss_connect_timer = NULL;
+static unsigned int tss_connect_attempts = 0;
+
+typedef struct {
+	char *filename;
+	uint8_t *filehash;
+	int filehash_len;
+	tss_hash_algo_t hashalgo;
+} tss_ml_pending_t;
+
+static list_t *tss_ml_pending_list = NULL;
+
+static void (*tss_ready_cb)(void *data) = NULL;
+static void *tss_ready_data = NULL;
+
+// latency of measurements appended by tpm2d
+static metrics_t *tss_metrics_ml_append = NULL;
+
 /**
  * Returns the HashAlgLen (proto) for the given tss_hash_algo_t algo.
  */
@@ -63,6 +92,53 @@ tss_hash_algo_get_len_proto(tss_hash_algo_t algo)
 	}
 }
 
+static void
+tss_ml_append_send(char *filename, uint8_t *filehash, int filehash_len, tss_hash_algo_t hashalgo)
+{
+	ControllerToTpm msg = CONTROLLER_TO_TPM__INIT;
+
+	msg.code = CONTROLLER_TO_TPM__CODE__ML_APPEND;
+	msg.ml_filename = filename;
+	msg.has_ml_datahash = true;
+	msg.ml_datahash.len = filehash_len;
+	msg.ml_datahash.data = filehash;
+	msg.has_ml_hashalg = true;
+
+	HashAlgLen hash_len = tss_hash_algo_get_len_proto(hashalgo);
+	IF_TRUE_RETURN(hash_len == 0);
+	msg.ml_hashalg = hash_len;
+
+	uint64_t begin = metrics_now_ns();
+	if (protobuf_send_message(tss_sock, (ProtobufCMessage *)&msg) < 0) {
+		WARN("Failed to send measurement to tpm2d");
+	}
+
+	TpmToController *resp =
+		(TpmToController *)protobuf_recv_message(tss_sock, &tpm_to_controller__descriptor);
+	if (!resp) {
+		WARN("Failed to receive and decode TpmToController protobuf message!");
+		return;
+	}
+	metrics_observe(tss_metrics_ml_append, metrics_now_ns() - begin);
+
+	if (resp->code != TPM_TO_CONTROLLER__CODE__GENERIC_RESPONSE ||
+	    resp->response != TPM_TO_CONTROLLER__GENERIC_RESPONSE__CMD_OK) {
+		ERROR("tpmd failed to append measurement to ML");
+	} else {
+		INFO("Sucessfully appended measurement to ML: file %s", filename);
+	}
+
+	protobuf_free_message((ProtobufCMessage *)resp);
+}
+
+static void
+tss_ml_pending_free(tss_ml_pending_t *pending)
+{
+	mem_free0(pending->filename);
+	mem_free0(pending->filehash);
+	mem_free0(pending);
+}
+
 static bool
 tss_is_tpm2d_installed(void)
 {
@@ -108,6 +184,39 @@ fork_and_exec_tpm2d(void)
 	return -1;
 }
 
+static void
+tss_connect_cb(event_timer_t *timer, UNUSED void *data)
+{
+	tss_connect_attempts++;
+	// tpm2d creates its socket only after it initialized the TPM
+	IF_FALSE_RETURN_TRACE(file_exists(TPM2D_SOCKET));
+
+	tss_sock = sock_unix_create_and_connect(SOCK_STREAM, TPM2D_SOCKET);
+	if (tss_sock < 0) {
+		TRACE("Retry %u connecting to tpm2d", tss_connect_attempts);
+		return;
+	}
+
+	event_remove_timer(timer);
+	event_timer_free(timer);
+	tss_connect_timer = NULL;
+	INFO("Connected to tpm2d after %u ms", tss_connect_attempts * TSS_CONNECT_INTERVAL);
+
+	for (list_t *l = tss_ml_pending_list; l; l = l->next) {
+		tss_ml_pending_t *pending = l->data;
+		tss_ml_append_send(pending->filename, pending->filehash, pending->filehash_len,
+				   pending->hashalgo);
+		tss_ml_pending_free(pending);
+	}
+	list_delete(tss_ml_pending_list);
+	tss_ml_pending_list = NULL;
+
+	void (*cb)(void *data) = tss_ready_cb;
+	tss_ready_cb = NULL;
+	if (cb)
+		cb(tss_ready_data);
+}
+
 int
 tss_init(void)
 {
@@ -121,18 +230,28 @@ tss_init(void)
 	tss_tpm2d_pid = fork_and_exec_tpm2d();
 	IF_TRUE_RETVAL_TRACE(tss_tpm2d_pid == -1, -1);
 
-	// Connect to tpm2d
-	size_t retries = 0;
-	do {
-		usleep(500000);
-		tss_sock = sock_unix_create_and_connect(SOCK_STREAM, TPM2D_SOCKET);
-		retries++;
-		TRACE("Retry %zu connecting to tpm2d", retries);
-		printf(".");
-		fflush(stdout);
-	} while (tss_sock < 0);
-
-	return (tss_sock < 0) ? -1 : 0;
+	tss_metrics_ml_append = metrics_new(METRICS_HISTOGRAM, "cml_tpm_request_seconds",
+					    "kind=\"ml_append\"", "Latency of requests to tpm2d.");
+
+	tss_connect_attempts = 0;
+	tss_connect_timer = event_timer_new(TSS_CONNECT_INTERVAL, EVENT_TIMER_REPEAT_FOREVER,
+					    tss_connect_cb, NULL);
+	event_add_timer(tss_connect_timer);
+
+	return 0;
+}
+
+void
+tss_notify_ready(void (*cb)(void *data), void *data)
+{
+	ASSERT(cb);
+
+	if (!tss_connect_timer) {
+		cb(data);
+		return;
+	}
+	tss_ready_cb = cb;
+	tss_ready_data = data;
 }
 
 static void
@@ -141,53 +260,78 @@ tss_tpm2d_stop(void)
 	IF_TRUE_RETURN_TRACE(tss_tpm2d_pid == -1);
 	DEBUG("Stopping %s process with pid=%d!", TPM2D_BINARY_NAME, tss_tpm2d_pid);
 	kill(tss_tpm2d_pid, SIGTERM);
+	// a new tpm2d must not find the socket of this one, e.g., after cmld re-executed itself
+	if (waitpid(tss_tpm2d_pid, NULL, 0) < 0)
+		WARN_ERRNO("Could not wait for %s process", TPM2D_BINARY_NAME);
+	tss_tpm2d_pid = -1;
 }
 
 void
 tss_cleanup(void)
 {
+	if (tss_connect_timer) {
+		event_remove_timer(tss_connect_timer);
+		event_timer_free(tss_connect_timer);
+		tss_connect_timer = NULL;
+	}
+	for (list_t *l = tss_ml_pending_list; l; l = l->next)
+		tss_ml_pending_free(l->data);
+	list_delete(tss_ml_pending_list);
+	tss_ml_pending_list = NULL;
+	tss_ready_cb = NULL;
+
 	tss_tpm2d_stop();
 }
 
 void
 tss_ml_append(char *filename, uint8_t *filehash, int filehash_len, tss_hash_algo_t hashalgo)
 {
+	if (tss_connect_timer) {
+		tss_ml_pending_t *pending = mem_new0(tss_ml_pending_t, 1);
+		pending->filename = mem_strdup(filename);
+		pending->filehash = mem_memcpy(filehash, filehash_len);
+		pending->filehash_len = filehash_len;
+		pending->hashalgo = hashalgo;
+		tss_ml_pending_list = list_append(tss_ml_pending_list, pending);
+		TRACE("Queued measurement of %s until tpm2d is connected", filename);
+		return;
+	}
+
 	/*
 	 * check if tpm2d socket is connected otherwise silently return,
 	 * since platform may not support tss/tpm2 functionality
 	 */
 	IF_TRUE_RETURN(tss_sock < 0);
 
-	ControllerToTpm msg = CONTROLLER_TO_TPM__INIT;
+	tss_ml_append_send(filename, filehash, filehash_len, hashalgo);
+}
 
-	msg.code = CONTROLLER_TO_TPM__CODE__ML_APPEND;
-	msg.ml_filename = filename;
-	msg.has_ml_datahash = true;
-	msg.ml_datahash.len = filehash_len;
-	msg.ml_datahash.data = filehash;
-	msg.has_ml_hashalg = true;
+int
+tss_sampler_ctrl(bool start, unsigned hz, unsigned interval)
+{
+	IF_TRUE_RETVAL(tss_sock < 0, -1);
 
-	HashAlgLen hash_len = tss_hash_algo_get_len_proto(hashalgo);
-	IF_TRUE_RETURN(hash_len == 0);
-	msg.ml_hashalg = hash_len;
+	ControllerToTpm msg = CONTROLLER_TO_TPM__INIT;
+	msg.code = start ? CONTROLLER_TO_TPM__CODE__SAMPLER_START :
+			   CONTROLLER_TO_TPM__CODE__SAMPLER_STOP;
+	msg.has_sampler_hz = true;
+	msg.sampler_hz = hz;
+	msg.has_sampler_interval = true;
+	msg.sampler_interval = interval;
 
 	if (protobuf_send_message(tss_sock, (ProtobufCMessage *)&msg) < 0) {
-		WARN("Failed to send measurement to tpm2d");
+		WARN("Failed to send sampler request to tpm2d");
+		return -1;
 	}
 
 	TpmToController *resp =
 		(TpmToController *)protobuf_recv_message(tss_sock, &tpm_to_controller__descriptor);
-	if (!resp) {
-		WARN("Failed to receive and decode TpmToController protobuf message!");
-		return;
-	}
+	IF_NULL_RETVAL(resp, -1);
 
+	int ret = 0;
 	if (resp->code != TPM_TO_CONTROLLER__CODE__GENERIC_RESPONSE ||
-	    resp->response != TPM_TO_CONTROLLER__GENERIC_RESPONSE__CMD_OK) {
-		ERROR("tpmd failed to append measurement to ML");
-	} else {
-		INFO("Sucessfully appended measurement to ML: file %s", filename);
-	}
-
+	    resp->response != TPM_TO_CONTROLLER__GENERIC_RESPONSE__CMD_OK)
+		ret = -1;
 	protobuf_free_message((ProtobufCMessage *)resp);
+	return ret;
 }
@@ -24,6 +24,7 @@
 #ifndef TSS_H
 #define TSS_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 /*
@@ -31,16 +32,43 @@
  */
 typedef enum { TSS_SHA1 = 0, TSS_SHA256, TSS_SHA384 } tss_hash_algo_t;
 
+/**
+ * Starts tpm2d if the platform has a TPM. Does not wait for tpm2d to initialize the
+ * TPM, the connection is established in the background by the event loop.
+ * @return 0 on success, -1 if tpm2d could not be started.
+ */
 int
 tss_init(void);
 
+/**
+ * Calls cb once tpm2d is connected, or right away if it already is or is not used
+ * at all. Only the latest registered callback is called.
+ */
+void
+tss_notify_ready(void (*cb)(void *data), void *data);
+
 /**
  * Cleanup the tss submodule, mainly stop tpm2d daemon.
  */
 void
 tss_cleanup(void);
 
+/**
+ * Appends a measurement to the measurement log of tpm2d. Measurements made before
+ * tpm2d is connected are queued and appended in order on connection.
+ */
 void
 tss_ml_append(char *filename, uint8_t *filehash, int filehash_len, tss_hash_algo_t hashalgo);
 
+/**
+ * Starts or stops the sampling profiler of tpm2d (see common/sampler.h).
+ *
+ * @param start true to start, false to stop the sampler
+ * @param hz Samples per second of cpu time, only used for starting.
+ * @param interval Seconds between writing the samples, only used for starting.
+ * @return 0 on success, -1 if tpm2d is not connected or failed.
+ */
+int
+tss_sampler_ctrl(bool start, unsigned hz, unsigned interval);
+
 #endif /* TSS_H */
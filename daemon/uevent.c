@@ -28,23 +28,37 @@
 #include "uevent.h"
 #include <arpa/inet.h>
 #include <sched.h>
+#include <stddef.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/wait.h>
+#include <net/if.h>
+#include <linux/filter.h>
+#include <linux/rtnetlink.h>
 #include <fcntl.h>
 #include <grp.h>
 #include <libgen.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "cmld.h"
 #include "container.h"
+#include "idle.h"
 #include "common/event.h"
 #include "common/fd.h"
 #include "common/file.h"
+#include "common/hashmap.h"
 #include "common/dir.h"
 #include "common/macro.h"
 #include "common/mem.h"
+#include "common/metrics.h"
+#include "common/probe.h"
 #include "common/network.h"
 #include "common/nl.h"
 #include "common/proc.h"
@@ -54,14 +68,43 @@
 #define UEVENT_SEND 16
 #endif
 
+// number of uevents received with a single recvmmsg() call
+#define UEVENT_RECV_BATCH 16
+
 static nl_sock_t *uevent_netlink_sock = NULL;
 static event_io_t *uevent_io_event = NULL;
+// allocations which are only needed while handling a single uevent
+static mem_arena_t *uevent_arena = NULL;
+// preallocated receive buffers
+static struct uevent *uevent_pool = NULL;
+
+static uevent_stats_t uevent_stats;
+
+static metrics_t *uevent_metrics_handled = NULL;
+static metrics_t *uevent_metrics_forwarded = NULL;
+static metrics_t *uevent_metrics_handle = NULL;
+
+/*
+ * Track usb devices mapped to containers. Both indexes map to lists of
+ * mappings, as a device may be mapped to several containers:
+ * by vendor id, product id and serial, and by device number once bound.
+ */
+static hashmap_t *uevent_usbdev_index = NULL;
+static hashmap_t *uevent_usbdev_devnum_index = NULL;
+
+// track net devices mapped to containers, indexed by mac
+static hashmap_t *uevent_netdev_index = NULL;
 
-// track usb devices mapped to containers
-static list_t *uevent_container_dev_mapping_list = NULL;
-//
-// track net devices mapped to containers
-static list_t *uevent_container_netdev_mapping_list = NULL;
+// add uevents of network interfaces waiting for their link to be announced
+static list_t *uevent_netdev_pending = NULL;
+// subscribed to RTNLGRP_LINK
+static nl_sock_t *uevent_link_sock = NULL;
+static event_io_t *uevent_link_io = NULL;
+
+#define UEVENT_LINK_BUF_LEN 8192
+
+// usb serials are read with a limit of 255 characters
+#define UEVENT_USBDEV_KEY_LEN (sizeof("ffff:ffff:") + 255)
 
 #define UDEV_MONITOR_TAG "libudev"
 #define UDEV_MONITOR_MAGIC 0xfeedcafe
@@ -225,6 +268,90 @@ uevent_container_dev_mapping_free(uevent_container_dev_mapping_t *mapping)
 	mem_free0(mapping);
 }
 
+/*
+ * Appends mapping to the list of mappings stored for key in index.
+ */
+static void
+uevent_index_add(hashmap_t **index, const void *key, size_t key_len, void *mapping)
+{
+	if (!*index)
+		*index = hashmap_new();
+
+	list_t *mappings = hashmap_get(*index, key, key_len);
+	mappings = list_append(mappings, mapping);
+	hashmap_put(*index, key, key_len, mappings);
+}
+
+/*
+ * Removes mapping from the list of mappings stored for key in index.
+ */
+static void
+uevent_index_remove(hashmap_t *index, const void *key, size_t key_len, void *mapping)
+{
+	IF_NULL_RETURN(index);
+
+	list_t *mappings = hashmap_get(index, key, key_len);
+	mappings = list_remove(mappings, mapping);
+	if (mappings)
+		hashmap_put(index, key, key_len, mappings);
+	else
+		hashmap_remove(index, key, key_len);
+}
+
+static list_t *
+uevent_index_get(const hashmap_t *index, const void *key, size_t key_len)
+{
+	return index ? hashmap_get(index, key, key_len) : NULL;
+}
+
+static size_t
+uevent_usbdev_key(char *key, uint16_t id_vendor, uint16_t id_product, const char *i_serial)
+{
+	int len = snprintf(key, UEVENT_USBDEV_KEY_LEN, "%04x:%04x:%s", id_vendor, id_product,
+			   i_serial ? i_serial : "");
+	return MIN((size_t)len, UEVENT_USBDEV_KEY_LEN - 1);
+}
+
+static void
+uevent_usbdev_index_add(uevent_container_dev_mapping_t *mapping)
+{
+	char key[UEVENT_USBDEV_KEY_LEN];
+	size_t key_len = uevent_usbdev_key(key, mapping->usbdev->id_vendor,
+					   mapping->usbdev->id_product, mapping->usbdev->i_serial);
+	dev_t devnum = makedev(mapping->usbdev->major, mapping->usbdev->minor);
+
+	uevent_index_add(&uevent_usbdev_index, key, key_len, mapping);
+	uevent_index_add(&uevent_usbdev_devnum_index, &devnum, sizeof(devnum), mapping);
+}
+
+static void
+uevent_usbdev_index_remove(uevent_container_dev_mapping_t *mapping)
+{
+	char key[UEVENT_USBDEV_KEY_LEN];
+	size_t key_len = uevent_usbdev_key(key, mapping->usbdev->id_vendor,
+					   mapping->usbdev->id_product, mapping->usbdev->i_serial);
+	dev_t devnum = makedev(mapping->usbdev->major, mapping->usbdev->minor);
+
+	uevent_index_remove(uevent_usbdev_index, key, key_len, mapping);
+	uevent_index_remove(uevent_usbdev_devnum_index, &devnum, sizeof(devnum), mapping);
+}
+
+/*
+ * Updates the device number of a mapped usb device which got bound.
+ */
+static void
+uevent_usbdev_set_devnum(uevent_container_dev_mapping_t *mapping, int major, int minor)
+{
+	dev_t devnum = makedev(mapping->usbdev->major, mapping->usbdev->minor);
+	uevent_index_remove(uevent_usbdev_devnum_index, &devnum, sizeof(devnum), mapping);
+
+	mapping->usbdev->major = major;
+	mapping->usbdev->minor = minor;
+
+	devnum = makedev(major, minor);
+	uevent_index_add(&uevent_usbdev_devnum_index, &devnum, sizeof(devnum), mapping);
+}
+
 static void
 uevent_container_netdev_mapping_free(uevent_container_netdev_mapping_t *mapping)
 {
@@ -343,86 +470,75 @@ uevent_parse(struct uevent *uevent, char *raw_p)
 	      uevent->subsystem, uevent->devname, uevent->major, uevent->minor, uevent->interface);
 }
 
-static struct uevent *
-uevent_replace_member(const struct uevent *uevent, char *oldmember, char *newmember)
-{
-	ASSERT(uevent);
-	ASSERT(oldmember > uevent->msg.raw && oldmember < uevent->msg.raw + uevent->msg_len);
-
-	struct uevent *newevent = mem_new(struct uevent, 1);
-	//interface name is located in name and devpath members
-	int diff_len = strlen(newmember) - strlen(oldmember);
-
-	newevent->msg_len = uevent->msg_len + diff_len;
-
-	//copy netlink header to cloned uevent
-	if (!memcpy(&newevent->msg.nlh, &uevent->msg.nlh,
-		    sizeof(struct udev_monitor_netlink_header))) {
-		ERROR("Failed to clone netlink header");
-		goto error;
-	}
-	newevent->msg.nlh.properties_len = uevent->msg.nlh.properties_len + diff_len;
-
-	//copy uevent up to position of interface string
-	int off_member = oldmember - uevent->msg.raw;
-	if (!memcpy(newevent->msg.raw, uevent->msg.raw, off_member)) {
-		ERROR("Failed to copy beginning of uevent");
-		goto error;
-	}
-
-	//copy new member to uevent
-	if (!strcpy(newevent->msg.raw + off_member, newmember)) {
-		ERROR("Failed to new member to uevent");
-		goto error;
-	}
-
-	//copy uevent after interface string
-	size_t off_after_old = off_member + strlen(oldmember) + 1;
-	size_t off_after_new = off_member + strlen(newmember) + 1;
-
-	if (!memcpy(newevent->msg.raw + off_after_new, uevent->msg.raw + off_after_old,
-		    uevent->msg_len - off_after_old)) {
-		ERROR("Failed to copy remainder of uevent");
-		goto error;
-	}
-
-	uevent_parse(newevent, newevent->msg.raw);
-
-	return newevent;
-
-error:
-	if (newevent)
-		mem_free0(newevent);
+/*
+ * Scatter/gather view of a uevent with spans of its raw buffer replaced by
+ * other strings. Rewritten uevents are forwarded from this view, so that
+ * neither the raw buffer is copied nor the uevent is parsed again. The parsed
+ * members of the uevent keep pointing to the original values.
+ */
+#define UEVENT_REWRITE_MAX 2
+
+typedef struct {
+	const struct uevent *uevent;
+	struct {
+		const char *span; //!< start of the replaced span inside of uevent->msg.raw
+		size_t span_len;
+		const char *value; //!< null-terminated replacement of the span
+	} repl[UEVENT_REWRITE_MAX];
+	int n;
+	struct iovec iov[2 * UEVENT_REWRITE_MAX + 1];
+	int iovcnt;
+} uevent_rewrite_t;
 
-	return NULL;
+static void
+uevent_rewrite_init(uevent_rewrite_t *rw, const struct uevent *uevent)
+{
+	rw->uevent = uevent;
+	rw->n = 0;
+	rw->iov[0].iov_base = (char *)uevent->msg.raw;
+	rw->iov[0].iov_len = uevent->msg_len;
+	rw->iovcnt = 1;
 }
 
-static char *
-uevent_replace_devpath_new(const char *str, const char *oldstr, const char *newstr)
+/*
+ * Replaces span_len bytes at span, which points inside of the raw buffer of
+ * the uevent, by value. Replaced spans must not overlap.
+ */
+static int
+uevent_rewrite_replace(uevent_rewrite_t *rw, const char *span, size_t span_len, const char *value)
 {
-	char *ptr_old = NULL;
-	int len_diff = strlen(newstr) - strlen(oldstr);
-
-	if (!(ptr_old = strstr(str, oldstr))) {
-		DEBUG("Could not find %s in %s", oldstr, str);
-		return NULL;
+	const char *raw = rw->uevent->msg.raw;
+	const char *raw_end = raw + rw->uevent->msg_len;
+
+	IF_TRUE_RETVAL_ERROR(rw->n >= UEVENT_REWRITE_MAX, -1);
+	IF_TRUE_RETVAL_ERROR(span < raw || span + span_len > raw_end, -1);
+
+	// keep the replacements ordered by their position in the raw buffer
+	int i = rw->n;
+	while (i > 0 && rw->repl[i - 1].span > span)
+		i--;
+	IF_TRUE_RETVAL_ERROR(i > 0 && rw->repl[i - 1].span + rw->repl[i - 1].span_len > span, -1);
+	IF_TRUE_RETVAL_ERROR(i < rw->n && span + span_len > rw->repl[i].span, -1);
+
+	memmove(&rw->repl[i + 1], &rw->repl[i], (rw->n - i) * sizeof(rw->repl[0]));
+	rw->repl[i].span = span;
+	rw->repl[i].span_len = span_len;
+	rw->repl[i].value = value;
+	rw->n++;
+
+	const char *pos = raw;
+	rw->iovcnt = 0;
+	for (i = 0; i < rw->n; i++) {
+		rw->iov[rw->iovcnt].iov_base = (char *)pos;
+		rw->iov[rw->iovcnt++].iov_len = rw->repl[i].span - pos;
+		rw->iov[rw->iovcnt].iov_base = (char *)rw->repl[i].value;
+		rw->iov[rw->iovcnt++].iov_len = strlen(rw->repl[i].value);
+		pos = rw->repl[i].span + rw->repl[i].span_len;
 	}
+	rw->iov[rw->iovcnt].iov_base = (char *)pos;
+	rw->iov[rw->iovcnt++].iov_len = raw_end - pos;
 
-	unsigned int off_old;
-	char *str_replaced = mem_alloc0((strlen(str) + 1) + len_diff);
-	unsigned int pos_new = 0;
-
-	off_old = ptr_old - str;
-
-	strncpy(str_replaced, str, off_old);
-	pos_new += off_old;
-
-	strcpy(str_replaced + pos_new, newstr);
-	pos_new += strlen(newstr);
-
-	strcpy(str_replaced + pos_new, ptr_old + strlen(oldstr));
-
-	return str_replaced;
+	return 0;
 }
 
 char *
@@ -456,8 +572,13 @@ uevent_rename_ifi_new(const char *oldname, const char *infix)
 	return newname;
 }
 
-static struct uevent *
-uevent_rename_interface(const struct uevent *uevent)
+/*
+ * Renames the interface of a net uevent and replaces the old name in its
+ * INTERFACE and DEVPATH values in rw. Returns the new name, which must stay
+ * valid as long as rw is used.
+ */
+static char *
+uevent_rename_interface_new(const struct uevent *uevent, uevent_rewrite_t *rw)
 {
 	char *new_ifname = uevent_rename_ifi_new(uevent->interface, uevent->devtype);
 
@@ -467,34 +588,21 @@ uevent_rename_interface(const struct uevent *uevent)
 	if (cmld_netif_phys_remove_by_name(uevent->interface))
 		cmld_netif_phys_add_by_name(new_ifname);
 
-	char *new_devpath =
-		uevent_replace_devpath_new(uevent->devpath, uevent->interface, new_ifname);
-
-	if (!(new_ifname && new_devpath)) {
-		DEBUG("Failed to prepare renamed uevent members");
-		return NULL;
-	}
-
-	struct uevent *uev_chname = uevent_replace_member(uevent, uevent->interface, new_ifname);
-
-	if (!uev_chname) {
+	size_t ifname_len = strlen(uevent->interface);
+	if (uevent_rewrite_replace(rw, uevent->interface, ifname_len, new_ifname)) {
 		ERROR("Failed to rename interface name %s in uevent", uevent->interface);
-		return NULL;
+		return new_ifname;
 	}
 	DEBUG("Injected renamed interface name %s into uevent", new_ifname);
-	uevent_parse(uev_chname, uev_chname->msg.raw);
 
-	struct uevent *uev_chdevpath = uevent_replace_member(uevent, uevent->devpath, new_devpath);
-
-	if (!uev_chdevpath) {
+	const char *devpath_ifname = strstr(uevent->devpath, uevent->interface);
+	if (!devpath_ifname || uevent_rewrite_replace(rw, devpath_ifname, ifname_len, new_ifname)) {
 		ERROR("Failed to rename devpath %s in uevent", uevent->devpath);
-		mem_free0(uev_chname);
-		return NULL;
+		return new_ifname;
 	}
-	DEBUG("Injected renamed devpath %s into uevent", new_ifname);
-	uevent_parse(uev_chdevpath, uev_chdevpath->msg.raw);
+	DEBUG("Injected renamed devpath into uevent");
 
-	return uev_chname;
+	return new_ifname;
 }
 
 static uint16_t
@@ -530,8 +638,55 @@ uevent_get_usb_product(struct uevent *uevent)
  * is connected and a new message containing the raw uevent will be created and
  * sent to that socket.
  */
+/*
+ * Joins the network namespace of netns_pid and, if requested, its user namespace
+ * before. Only to be called in forked children of cmld, exits on failure.
+ */
+static void
+uevent_join_netns(pid_t netns_pid, bool join_userns)
+{
+	if (join_userns) {
+		char *usrns = mem_printf("/proc/%d/ns/user", netns_pid);
+		int usrns_fd = open(usrns, O_RDONLY);
+		if (usrns_fd == -1)
+			FATAL_ERRNO("Could not open userns file %s!", usrns);
+		mem_free0(usrns);
+		if (setns(usrns_fd, CLONE_NEWUSER) == -1)
+			FATAL_ERRNO("Could not join uesr namespace of pid %d!", netns_pid);
+		if (setuid(0) < 0)
+			FATAL_ERRNO("Could setuid to root in user namespace of pid %d!", netns_pid);
+		if (setgid(0) < 0)
+			FATAL_ERRNO("Could setgid to root in user namespace of pid %d!", netns_pid);
+		if (setgroups(0, NULL) < 0)
+			FATAL_ERRNO("Could setgroups to root in user namespace of pid %d!",
+				    netns_pid);
+		close(usrns_fd);
+	}
+	char *netns = mem_printf("/proc/%d/ns/net", netns_pid);
+	int netns_fd = open(netns, O_RDONLY);
+	if (netns_fd == -1)
+		FATAL_ERRNO("Could not open netns file %s!", netns);
+	mem_free0(netns);
+	if (setns(netns_fd, CLONE_NEWNET) == -1)
+		FATAL_ERRNO("Could not join network namespace of pid %d!", netns_pid);
+	close(netns_fd);
+}
+
+static nl_msg_t *
+uevent_nl_msg_new(void)
+{
+	nl_msg_t *nl_msg = nl_msg_new();
+	if (NULL == nl_msg)
+		FATAL_ERRNO("Could not allocate nl_msg!");
+	if (nl_msg_set_type(nl_msg, UEVENT_SEND) < 0)
+		FATAL("Could not set type UEVENT_SEND of nl_msg!");
+	if (nl_msg_set_flags(nl_msg, NLM_F_ACK | NLM_F_REQUEST))
+		FATAL("Could not set flages for acked request of nl_msg!");
+	return nl_msg;
+}
+
 static int
-uevent_inject_into_netns(char *uevent, size_t size, pid_t netns_pid, bool join_userns)
+uevent_inject_into_netns(const struct iovec *iov, int iovcnt, pid_t netns_pid, bool join_userns)
 {
 	int status;
 	pid_t pid = fork();
@@ -540,42 +695,12 @@ uevent_inject_into_netns(char *uevent, size_t size, pid_t netns_pid, bool join_u
 		ERROR_ERRNO("Could not fork for switching to netns of %d", netns_pid);
 		return -1;
 	} else if (pid == 0) {
-		if (join_userns) {
-			char *usrns = mem_printf("/proc/%d/ns/user", netns_pid);
-			int usrns_fd = open(usrns, O_RDONLY);
-			if (usrns_fd == -1)
-				FATAL_ERRNO("Could not open userns file %s!", usrns);
-			mem_free0(usrns);
-			if (setns(usrns_fd, CLONE_NEWUSER) == -1)
-				FATAL_ERRNO("Could not join uesr namespace of pid %d!", netns_pid);
-			if (setuid(0) < 0)
-				FATAL_ERRNO("Could setuid to root in user namespace of pid %d!",
-					    netns_pid);
-			if (setgid(0) < 0)
-				FATAL_ERRNO("Could setgid to root in user namespace of pid %d!",
-					    netns_pid);
-			if (setgroups(0, NULL) < 0)
-				FATAL_ERRNO("Could setgroups to root in user namespace of pid %d!",
-					    netns_pid);
-		}
-		char *netns = mem_printf("/proc/%d/ns/net", netns_pid);
-		int netns_fd = open(netns, O_RDONLY);
-		if (netns_fd == -1)
-			FATAL_ERRNO("Could not open netns file %s!", netns);
-		mem_free0(netns);
-		if (setns(netns_fd, CLONE_NEWNET) == -1)
-			FATAL_ERRNO("Could not join network namespace of pid %d!", netns_pid);
+		uevent_join_netns(netns_pid, join_userns);
 		nl_sock_t *target = nl_sock_uevent_new(0);
 		if (NULL == target)
 			FATAL("Could not connect to nl socket!");
-		nl_msg_t *nl_msg = nl_msg_new();
-		if (NULL == nl_msg)
-			FATAL_ERRNO("Could not allocate nl_msg!");
-		if (nl_msg_set_type(nl_msg, UEVENT_SEND) < 0)
-			FATAL("Could not set type UEVENT_SEND of nl_msg!");
-		if (nl_msg_set_flags(nl_msg, NLM_F_ACK | NLM_F_REQUEST))
-			FATAL("Could not set flages for acked request of nl_msg!");
-		if (nl_msg_set_buf_unaligned(nl_msg, uevent, size) < 0)
+		nl_msg_t *nl_msg = uevent_nl_msg_new();
+		if (nl_msg_set_buf_iov(nl_msg, iov, iovcnt) < 0)
 			FATAL_ERRNO("Could not add uevent to nl_msg!");
 		if (nl_msg_send_kernel(target, nl_msg) < 0)
 			FATAL_ERRNO("Could not inject uevent!");
@@ -596,6 +721,192 @@ uevent_inject_into_netns(char *uevent, size_t size, pid_t netns_pid, bool join_u
 	return -1;
 }
 
+/*
+ * Long-lived helper per container, which stays in the network namespace of
+ * the container with an open uevent netlink socket. cmld passes uevents to it
+ * over a socketpair, instead of forking into the namespace for every uevent.
+ */
+typedef struct {
+	container_t *container;
+	pid_t netns_pid; //!< pid of the container whose netns the helper joined
+	pid_t pid;
+	int sock;
+	event_child_t *child;
+} uevent_injector_t;
+
+static list_t *uevent_injector_list = NULL;
+
+static void
+uevent_injector_main(int sock, pid_t netns_pid, bool join_userns)
+{
+	event_reset(); // reset event_loop of cloned from parent
+
+	if (prctl(PR_SET_PDEATHSIG, SIGKILL))
+		WARN_ERRNO("Could not set parent death signal of uevent injector");
+
+	uevent_join_netns(netns_pid, join_userns);
+	nl_sock_t *target = nl_sock_uevent_new(0);
+	if (NULL == target)
+		FATAL("Could not connect to nl socket!");
+	nl_msg_t *nl_msg = uevent_nl_msg_new();
+	char *buf = mem_alloc(UEVENT_BUF_LEN);
+
+	for (;;) {
+		ssize_t len = recv(sock, buf, UEVENT_BUF_LEN, 0);
+		if (len < 0 && errno == EINTR)
+			continue;
+		// cmld closed its end of the socketpair
+		if (len <= 0)
+			break;
+
+		if (nl_msg_set_buf_unaligned(nl_msg, buf, len) < 0)
+			WARN_ERRNO("Could not add uevent to nl_msg!");
+		else if (nl_msg_send_kernel(target, nl_msg) < 0)
+			WARN_ERRNO("Could not inject uevent into netns of %d!", netns_pid);
+		else if (nl_msg_receive_and_check_kernel(target))
+			WARN_ERRNO("Could not verify resp to injected uevent!");
+	}
+
+	mem_free0(buf);
+	nl_msg_free(nl_msg);
+	nl_sock_free(target);
+	exit(0);
+}
+
+static void
+uevent_injector_child_cb(pid_t pid, UNUSED int status, event_child_t *child, void *data)
+{
+	uevent_injector_t *injector = data;
+
+	ASSERT(injector);
+
+	WARN("Uevent injector %d of container %s exited", pid,
+	     container_get_name(injector->container));
+	event_child_free(child);
+	injector->child = NULL;
+	injector->pid = -1;
+	if (injector->sock >= 0)
+		close(injector->sock);
+	injector->sock = -1;
+}
+
+static void
+uevent_injector_free(uevent_injector_t *injector)
+{
+	uevent_injector_list = list_remove(uevent_injector_list, injector);
+
+	if (injector->child)
+		event_child_free(injector->child);
+	if (injector->sock >= 0)
+		close(injector->sock);
+	if (injector->pid > 0) {
+		kill(injector->pid, SIGKILL);
+		if (waitpid(injector->pid, NULL, 0) < 0)
+			WARN_ERRNO("Could not reap uevent injector %d", injector->pid);
+	}
+	mem_free0(injector);
+}
+
+static uevent_injector_t *
+uevent_injector_new(container_t *container)
+{
+	int fds[2];
+	pid_t netns_pid = container_get_pid(container);
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds)) {
+		ERROR_ERRNO("Could not create socketpair for uevent injector");
+		return NULL;
+	}
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		ERROR_ERRNO("Could not fork uevent injector for netns of %d", netns_pid);
+		close(fds[0]);
+		close(fds[1]);
+		return NULL;
+	} else if (pid == 0) {
+		close(fds[0]);
+		uevent_injector_main(fds[1], netns_pid, container_has_userns(container));
+	}
+	close(fds[1]);
+
+	// do not stall the event loop if the helper does not keep up
+	if (fd_make_non_blocking(fds[0]))
+		WARN("Could not make socket of uevent injector non-blocking");
+
+	uevent_injector_t *injector = mem_new0(uevent_injector_t, 1);
+	injector->container = container;
+	injector->netns_pid = netns_pid;
+	injector->pid = pid;
+	injector->sock = fds[0];
+	injector->child = event_child_new(pid, uevent_injector_child_cb, injector);
+	if (event_add_child(injector->child) < 0) {
+		event_child_free(injector->child);
+		injector->child = NULL;
+	}
+
+	uevent_injector_list = list_append(uevent_injector_list, injector);
+
+	DEBUG("Started uevent injector %d for container %s", pid, container_get_name(container));
+	return injector;
+}
+
+static uevent_injector_t *
+uevent_injector_get(container_t *container)
+{
+	for (list_t *l = uevent_injector_list; l; l = l->next) {
+		uevent_injector_t *injector = l->data;
+		if (injector->container != container)
+			continue;
+
+		// the helper may have died or the container may have been restarted
+		if (injector->pid > 0 && injector->netns_pid == container_get_pid(container))
+			return injector;
+
+		uevent_injector_free(injector);
+		break;
+	}
+
+	return uevent_injector_new(container);
+}
+
+/*
+ * Injects the uevent given by iov into the netns of the container through its
+ * injector, falling back to forking into the netns if the injector is not usable.
+ */
+static int
+uevent_inject_into_container(container_t *container, const struct iovec *iov, int iovcnt)
+{
+	uevent_injector_t *injector = uevent_injector_get(container);
+
+	// a frozen container would not handle the uevent until thawed
+	idle_wake(container);
+
+	if (injector) {
+		struct msghdr msg = { .msg_iov = (struct iovec *)iov, .msg_iovlen = iovcnt };
+		if (sendmsg(injector->sock, &msg, MSG_NOSIGNAL) >= 0) {
+			metrics_inc(uevent_metrics_forwarded);
+			return 0;
+		}
+
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			// the injector lags behind, keep it for later uevents
+			DEBUG("Uevent injector of container %s is busy, forking instead",
+			      container_get_name(container));
+		} else {
+			WARN_ERRNO("Could not pass uevent to injector of container %s",
+				   container_get_name(container));
+			uevent_injector_free(injector);
+		}
+	}
+
+	int ret = uevent_inject_into_netns(iov, iovcnt, container_get_pid(container),
+					   container_has_userns(container));
+	if (!ret)
+		metrics_inc(uevent_metrics_forwarded);
+	return ret;
+}
+
 static int
 uevent_create_device_node(struct uevent *uevent, char *path, container_t *container)
 {
@@ -638,6 +949,7 @@ uevent_netdev_move(struct uevent *uevent)
 {
 	uint8_t iface_mac[6];
 	char *macstr = NULL;
+	char *new_ifname = NULL;
 
 	if (network_get_mac_by_ifname(uevent->interface, iface_mac)) {
 		ERROR("Iface '%s' with no mac, skipping!", uevent->interface);
@@ -646,13 +958,11 @@ uevent_netdev_move(struct uevent *uevent)
 
 	container_t *container = NULL;
 	container_pnet_cfg_t *pnet_cfg = NULL;
-	for (list_t *l = uevent_container_netdev_mapping_list; l; l = l->next) {
-		uevent_container_netdev_mapping_t *mapping = l->data;
-		if (0 == memcmp(iface_mac, mapping->mac, 6)) {
-			container = mapping->container;
-			pnet_cfg = mapping->pnet_cfg;
-			break;
-		}
+	list_t *mappings = uevent_index_get(uevent_netdev_index, iface_mac, sizeof(iface_mac));
+	if (mappings) {
+		uevent_container_netdev_mapping_t *mapping = mappings->data;
+		container = mapping->container;
+		pnet_cfg = mapping->pnet_cfg;
 	}
 
 	// no mapping found move to c0
@@ -671,23 +981,20 @@ uevent_netdev_move(struct uevent *uevent)
 
 	// rename network interface to avoid name clashes when moving to container
 	DEBUG("Renaming new interface we were notified about");
-	struct uevent *newevent = uevent_rename_interface(uevent);
-
-	// uevent pointer is not freed inside this function, therefore we can safely drop it
-	if (newevent) {
-		DEBUG("Using renamed uevent");
-		uevent = newevent;
-	} else {
+	uevent_rewrite_t rw;
+	uevent_rewrite_init(&rw, uevent);
+	new_ifname = uevent_rename_interface_new(uevent, &rw);
+	if (!new_ifname)
 		ERROR("Failed to rename interface %s. Injecting uevent as it is",
 		      uevent->interface);
-	}
 
 	macstr = network_mac_addr_to_str_new(iface_mac);
 	if (container_add_net_iface(container, pnet_cfg, false)) {
 		ERROR("Cannot move '%s' to %s!", macstr, container_get_name(container));
 		goto error;
 	} else {
-		INFO("Moved phys network interface '%s' (mac: %s) to %s", uevent->interface, macstr,
+		INFO("Moved phys network interface '%s' (mac: %s) to %s",
+		     new_ifname ? new_ifname : uevent->interface, macstr,
 		     container_get_name(container));
 	}
 
@@ -695,12 +1002,12 @@ uevent_netdev_move(struct uevent *uevent)
 	// need to send the uevent about the physical if
 	if (pnet_cfg->mac_filter) {
 		mem_free0(macstr);
+		mem_free0(new_ifname);
 		return 0;
 	}
 
 	// if moving was successful also inject uevent
-	if (uevent_inject_into_netns(uevent->msg.raw, uevent->msg_len, container_get_pid(container),
-				     container_has_userns(container)) < 0) {
+	if (uevent_inject_into_container(container, rw.iov, rw.iovcnt) < 0) {
 		WARN("Could not inject uevent into netns of container %s!",
 		     container_get_name(container));
 	} else {
@@ -709,35 +1016,124 @@ uevent_netdev_move(struct uevent *uevent)
 	}
 
 	mem_free0(macstr);
+	mem_free0(new_ifname);
 	return 0;
 error:
 	mem_free0(macstr);
+	mem_free0(new_ifname);
 	return -1;
 }
 
-static void
-uevent_sysfs_netif_timer_cb(event_timer_t *timer, void *data)
+/*
+ * The sysfs entries of a wifi interface, e.g. phy80211, are only created after the add
+ * uevent has been sent, but before the link is announced by RTM_NEWLINK.
+ */
+static bool
+uevent_netdev_is_ready(const struct uevent *uevent)
 {
-	ASSERT(data);
-	struct uevent *uevent_cb = data;
-	uevent_parse(uevent_cb, uevent_cb->msg.raw);
-
-	// if sysfs is not ready in case of wifi just return and retry.
-	IF_TRUE_RETURN(!strcmp(uevent_cb->devtype, "wlan") &&
-		       !network_interface_is_wifi(uevent_cb->interface));
+	return strcmp(uevent->devtype, "wlan") || network_interface_is_wifi(uevent->interface);
+}
 
-	if (uevent_netdev_move(uevent_cb) == -1)
+static void
+uevent_netdev_move_and_log(struct uevent *uevent)
+{
+	if (uevent_netdev_move(uevent) == -1)
 		WARN("Did not move net interface!");
 	else
 		INFO("Moved net interface to target.");
+}
+
+/*
+ * Moves a new network interface right away if it is ready, otherwise once a
+ * RTM_NEWLINK notification announces it.
+ */
+static void
+uevent_netdev_move_or_defer(struct uevent *uevent)
+{
+	if (uevent_netdev_is_ready(uevent)) {
+		uevent_netdev_move_and_log(uevent);
+		return;
+	}
+
+	// the receive buffer is reused, thus keep a copy which points to its own raw data
+	struct uevent *pending = mem_new0(struct uevent, 1);
+	memcpy(pending, uevent, sizeof(struct uevent));
+	uevent_parse(pending, pending->msg.raw);
+	uevent_netdev_pending = list_append(uevent_netdev_pending, pending);
+	DEBUG("Deferred moving net interface %s until it is announced", pending->interface);
+}
+
+/*
+ * Moves the pending interfaces which became ready. If name is given, only the
+ * interface of this name is considered, which is dropped if it was removed.
+ */
+static void
+uevent_netdev_pending_update(const char *name, bool removed)
+{
+	for (list_t *l = uevent_netdev_pending; l;) {
+		struct uevent *pending = l->data;
+		l = l->next;
+
+		if (name && strncmp(pending->interface, name, IFNAMSIZ))
+			continue;
+		if (!removed && !uevent_netdev_is_ready(pending))
+			continue;
+
+		uevent_netdev_pending = list_remove(uevent_netdev_pending, pending);
+		if (removed)
+			DEBUG("Pending net interface %s was removed", pending->interface);
+		else
+			uevent_netdev_move_and_log(pending);
+		mem_free0(pending);
+	}
+}
 
-	mem_free0(uevent_cb);
-	event_remove_timer(timer);
-	event_timer_free(timer);
+static void
+uevent_link_handle_msg(struct nlmsghdr *nlh)
+{
+	IF_FALSE_RETURN(nlh->nlmsg_type == RTM_NEWLINK || nlh->nlmsg_type == RTM_DELLINK);
+	IF_TRUE_RETURN(nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifinfomsg)));
+
+	struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+	int len = IFLA_PAYLOAD(nlh);
+	for (struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFLA_IFNAME) {
+			uevent_netdev_pending_update(RTA_DATA(rta),
+						     nlh->nlmsg_type == RTM_DELLINK);
+			return;
+		}
+	}
 }
 
 static void
-uevent_device_node_and_forward(struct uevent *uevent, container_t *container)
+uevent_link_handle(UNUSED int fd, UNUSED unsigned events, UNUSED event_io_t *io,
+		   UNUSED void *data)
+{
+	char buf[UEVENT_LINK_BUF_LEN];
+
+	for (;;) {
+		int len = nl_msg_receive_kernel(uevent_link_sock, buf, sizeof(buf), false);
+		if (len < 0 && errno == ENOBUFS) {
+			// notifications were dropped, thus recheck all pending interfaces
+			uevent_netdev_pending_update(NULL, false);
+			continue;
+		}
+		if (len <= 0)
+			return;
+
+		for (struct nlmsghdr *nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, (unsigned)len);
+		     nlh = NLMSG_NEXT(nlh, len))
+			uevent_link_handle_msg(nlh);
+	}
+}
+
+/*
+ * Creates or removes the device node of the uevent in the container and forwards
+ * the uevent, or its rewritten form rw if given, into the netns of the container.
+ */
+static void
+uevent_device_node_and_forward(struct uevent *uevent, const uevent_rewrite_t *rw,
+			       container_t *container)
 {
 	IF_NULL_RETURN(uevent);
 	IF_NULL_RETURN(container);
@@ -753,14 +1149,13 @@ uevent_device_node_and_forward(struct uevent *uevent, container_t *container)
 	}
 
 	// newer versions of udev prepends '/dev/' in DEVNAME
-	char *devname =
-		mem_printf("%s%s%s", container_get_rootdir(container),
-			   strncmp("/dev/", uevent->devname, 4) ? "/dev/" : "", uevent->devname);
+	char *devname = mem_arena_printf(uevent_arena, "%s%s%s", container_get_rootdir(container),
+					 strncmp("/dev/", uevent->devname, 4) ? "/dev/" : "",
+					 uevent->devname);
 
 	if (!strncmp(uevent->action, "add", 3)) {
 		if (uevent_create_device_node(uevent, devname, container) < 0) {
 			ERROR("Could not create device node");
-			mem_free0(devname);
 			return;
 		}
 	} else if (!strncmp(uevent->action, "remove", 6)) {
@@ -769,15 +1164,19 @@ uevent_device_node_and_forward(struct uevent *uevent, container_t *container)
 		}
 	}
 
-	if (uevent_inject_into_netns(uevent->msg.raw, uevent->msg_len, container_get_pid(container),
-				     container_has_userns(container)) < 0) {
+	uevent_rewrite_t plain;
+	if (!rw) {
+		uevent_rewrite_init(&plain, uevent);
+		rw = &plain;
+	}
+
+	if (uevent_inject_into_container(container, rw->iov, rw->iovcnt) < 0) {
 		WARN("Could not inject uevent into netns of container %s!",
 		     container_get_name(container));
 	} else {
 		TRACE("Sucessfully injected uevent into netns of container %s!",
 		      container_get_name(container));
 	}
-	mem_free0(devname);
 }
 
 /*
@@ -803,30 +1202,29 @@ uevent_handle_usb_device(struct uevent *uevent)
 			}
 		}
 
-		for (list_t *l = uevent_container_dev_mapping_list; l; l = l->next) {
+		dev_t devnum = makedev(uevent->major, uevent->minor);
+		for (list_t *l =
+			     uevent_index_get(uevent_usbdev_devnum_index, &devnum, sizeof(devnum));
+		     l; l = l->next) {
 			uevent_container_dev_mapping_t *mapping = l->data;
-			if ((uevent->major == mapping->usbdev->major) &&
-			    (uevent->minor == mapping->usbdev->minor)) {
-				container_device_deny(mapping->container, mapping->usbdev->major,
-						      mapping->usbdev->minor);
-				INFO("Denied access to unbound device node %d:%d mapped in container %s",
-				     mapping->usbdev->major, mapping->usbdev->minor,
-				     container_get_name(mapping->container));
-			}
+			container_device_deny(mapping->container, mapping->usbdev->major,
+					      mapping->usbdev->minor);
+			INFO("Denied access to unbound device node %d:%d mapped in container %s",
+			     mapping->usbdev->major, mapping->usbdev->minor,
+			     container_get_name(mapping->container));
 		}
 	}
 
 	if (0 == strncmp(uevent->action, "add", 3)) {
 		TRACE("add");
 
-		char *serial_path = mem_printf("/sys/%s/serial", uevent->devpath);
+		char *serial_path =
+			mem_arena_printf(uevent_arena, "/sys/%s/serial", uevent->devpath);
 		char *serial = NULL;
 
 		if (file_exists(serial_path))
 			serial = file_read_new(serial_path, 255);
 
-		mem_free0(serial_path);
-
 		if (!serial || strlen(serial) < 1) {
 			TRACE("Failed to read serial of usb device");
 			return false;
@@ -847,40 +1245,149 @@ uevent_handle_usb_device(struct uevent *uevent)
 			}
 		}
 
-		for (list_t *l = uevent_container_dev_mapping_list; l; l = l->next) {
+		uint16_t vendor_id = uevent_get_usb_vendor(uevent);
+		uint16_t product_id = uevent_get_usb_product(uevent);
+		char key[UEVENT_USBDEV_KEY_LEN];
+		size_t key_len = uevent_usbdev_key(key, vendor_id, product_id, serial);
+
+		// re-indexing by device number does not modify the list iterated here
+		for (list_t *l = uevent_index_get(uevent_usbdev_index, key, key_len); l;
+		     l = l->next) {
 			uevent_container_dev_mapping_t *mapping = l->data;
-			uint16_t vendor_id = uevent_get_usb_vendor(uevent);
-			uint16_t product_id = uevent_get_usb_product(uevent);
-
-			INFO("check mapping: %04x:%04x '%s' for %s bound device node %d:%d -> container %s",
-			     vendor_id, product_id, serial, (mapping->assign) ? "assign" : "allow",
-			     uevent->major, uevent->minor, container_get_name(mapping->container));
-
-			if ((mapping->usbdev->id_vendor == vendor_id) &&
-			    (mapping->usbdev->id_product == product_id) &&
-			    (0 == strcmp(mapping->usbdev->i_serial, serial))) {
-				mapping->usbdev->major = uevent->major;
-				mapping->usbdev->minor = uevent->minor;
-				INFO("%s bound device node %d:%d -> container %s",
-				     (mapping->assign) ? "assign" : "allow", mapping->usbdev->major,
-				     mapping->usbdev->minor,
-				     container_get_name(mapping->container));
-
-				container_device_allow(mapping->container, mapping->usbdev->major,
-						       mapping->usbdev->minor, mapping->assign);
-			}
+
+			uevent_usbdev_set_devnum(mapping, uevent->major, uevent->minor);
+			INFO("%s bound device node %d:%d -> container %s",
+			     (mapping->assign) ? "assign" : "allow", mapping->usbdev->major,
+			     mapping->usbdev->minor, container_get_name(mapping->container));
+
+			container_device_allow(mapping->container, mapping->usbdev->major,
+					       mapping->usbdev->minor, mapping->assign);
 		}
 		mem_free0(serial);
 	}
 	return false;
 }
 
+/*
+ * Inventory of the devices in sysfs which have a device node, built on the
+ * first coldboot and kept up to date by kernel uevents. Coldboot triggers for
+ * a container are then issued from the inventory without walking sysfs.
+ */
+typedef struct {
+	char *path;	   //!< sysfs directory of the device, also the key of the index
+	char *uevent_file; //!< uevent trigger file of the device
+	int major;
+	int minor;
+} uevent_sysfs_dev_t;
+
+static list_t *uevent_sysfs_dev_list = NULL;
+static hashmap_t *uevent_sysfs_dev_index = NULL;
+
+static void
+uevent_sysfs_dev_add(const char *path, int major, int minor)
+{
+	uevent_sysfs_dev_t *dev = hashmap_get_str(uevent_sysfs_dev_index, path);
+
+	if (!dev) {
+		dev = mem_new0(uevent_sysfs_dev_t, 1);
+		dev->path = mem_strdup(path);
+		dev->uevent_file = mem_printf("%s/uevent", path);
+		hashmap_put_str(uevent_sysfs_dev_index, dev->path, dev);
+		uevent_sysfs_dev_list = list_append(uevent_sysfs_dev_list, dev);
+	}
+	dev->major = major;
+	dev->minor = minor;
+}
+
+static void
+uevent_sysfs_dev_remove(uevent_sysfs_dev_t *dev)
+{
+	hashmap_remove_str(uevent_sysfs_dev_index, dev->path);
+	uevent_sysfs_dev_list = list_remove(uevent_sysfs_dev_list, dev);
+	mem_free0(dev->path);
+	mem_free0(dev->uevent_file);
+	mem_free0(dev);
+}
+
+static int
+uevent_sysfs_inventory_foreach_cb(int dirfd, const char *path, const char *name,
+				  unsigned char type, UNUSED void *data)
+{
+	int ret = 0;
+	char buf[256];
+	int major, minor;
+
+	char *full_path = NULL;
+	char *dev_file = NULL;
+
+	// symlinks, e.g. 'subsystem' or 'driver', are reported as DT_LNK and not followed
+	if (type == DT_DIR) {
+		full_path = mem_printf("%s/%s", path, name);
+		int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0 ||
+		    0 > dir_foreach_fd(fd, full_path, &uevent_sysfs_inventory_foreach_cb, NULL)) {
+			WARN("Could not scan sysfs devices! No '%s'!", full_path);
+			ret--;
+		}
+		if (fd >= 0)
+			close(fd);
+	} else if (!strcmp(name, "uevent")) {
+		IF_TRUE_GOTO_TRACE(faccessat(dirfd, "dev", F_OK, 0), out);
+		dev_file = mem_printf("%s/dev", path);
+
+		major = minor = -1;
+		IF_TRUE_GOTO(-1 == file_read(dev_file, buf, sizeof(buf)), out);
+		IF_TRUE_GOTO((sscanf(buf, "%d:%d", &major, &minor) < 0), out);
+		IF_FALSE_GOTO((major > -1 && minor > -1), out);
+
+		uevent_sysfs_dev_add(path, major, minor);
+	}
+out:
+	mem_free0(full_path);
+	mem_free0(dev_file);
+	return ret;
+}
+
+static void
+uevent_sysfs_inventory_init(void)
+{
+	const char *sysfs_devices = "/sys/devices";
+
+	uevent_sysfs_dev_index = hashmap_new();
+	if (0 > dir_foreach_at(AT_FDCWD, sysfs_devices, &uevent_sysfs_inventory_foreach_cb, NULL)) {
+		WARN("Could not scan sysfs devices! No '%s'!", sysfs_devices);
+	}
+	DEBUG("Found %zu devices with device nodes in sysfs", hashmap_size(uevent_sysfs_dev_index));
+}
+
+/*
+ * Keeps the sysfs inventory in sync with added and removed devices.
+ */
+static void
+uevent_sysfs_inventory_update(struct uevent *uevent)
+{
+	IF_NULL_RETURN(uevent_sysfs_dev_index);
+	IF_TRUE_RETURN(!uevent->devpath[0]);
+
+	char *path = mem_arena_printf(uevent_arena, "/sys%s", uevent->devpath);
+
+	if (!strncmp(uevent->action, "add", 3) && uevent->major > -1 && uevent->minor > -1) {
+		uevent_sysfs_dev_add(path, uevent->major, uevent->minor);
+	} else if (!strncmp(uevent->action, "remove", 6)) {
+		uevent_sysfs_dev_t *dev = hashmap_get_str(uevent_sysfs_dev_index, path);
+		if (dev)
+			uevent_sysfs_dev_remove(dev);
+	}
+}
+
 static void
 handle_kernel_event(struct uevent *uevent, char *raw_p)
 {
 	TRACE("handle_kernel_event");
 	uevent_parse(uevent, raw_p);
 
+	uevent_sysfs_inventory_update(uevent);
+
 	/* just handle add,remove or change events to containers */
 	IF_TRUE_RETURN_TRACE(strncmp(uevent->action, "add", 3) &&
 			     strncmp(uevent->action, "remove", 6) &&
@@ -897,13 +1404,14 @@ handle_kernel_event(struct uevent *uevent, char *raw_p)
 	container_t *container = (uevent_uuid) ? cmld_container_get_by_uuid(uevent_uuid) : NULL;
 	if (container) {
 		TRACE("Got synth add/remove/change uevent SYNTH_UUID=%s", uevent->synth_uuid);
-		struct uevent *uev_fwd = uevent_replace_member(uevent, uevent->synth_uuid, "0");
-		if (!uev_fwd) {
+		uevent_rewrite_t rw;
+		uevent_rewrite_init(&rw, uevent);
+		if (uevent_rewrite_replace(&rw, uevent->synth_uuid, strlen(uevent->synth_uuid),
+					   "0")) {
 			ERROR("Failed to mask out container uuid from SYNTH_UUID in uevent");
 			goto out;
 		}
-		uevent_device_node_and_forward(uev_fwd, container);
-		mem_free0(uev_fwd);
+		uevent_device_node_and_forward(uevent, &rw, container);
 		goto out;
 	}
 
@@ -915,20 +1423,14 @@ handle_kernel_event(struct uevent *uevent, char *raw_p)
 		// got new physical interface, initially add to cmld tracking list
 		cmld_netif_phys_add_by_name(uevent->interface);
 
-		struct uevent *uevent_cb = mem_new0(struct uevent, 1);
-		memcpy(uevent_cb, uevent, sizeof(struct uevent));
-
-		// give sysfs some time to settle if iface is wifi
-		event_timer_t *e = event_timer_new(100, EVENT_TIMER_REPEAT_FOREVER,
-						   uevent_sysfs_netif_timer_cb, uevent_cb);
-		event_add_timer(e);
+		uevent_netdev_move_or_defer(uevent);
 		goto out;
 	}
 
 	/* handle new events targetting all containers */
 	for (int i = 0; i < cmld_containers_get_count(); i++) {
 		container_t *container = cmld_container_get_by_index(i);
-		uevent_device_node_and_forward(uevent, container);
+		uevent_device_node_and_forward(uevent, NULL, container);
 	}
 
 out:
@@ -946,17 +1448,8 @@ handle_udev_event(struct uevent *uevent, char *raw_p)
 }
 
 static void
-uevent_handle(UNUSED int fd, UNUSED unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+uevent_handle_msg(struct uevent *uev)
 {
-	struct uevent *uev = mem_new0(struct uevent, 1);
-
-	// read uevent into raw buffer and assure that last char is '\0'
-	if ((uev->msg_len = nl_msg_receive_kernel(uevent_netlink_sock, uev->msg.raw,
-						  sizeof(uev->msg.raw) - 1, true)) <= 0) {
-		WARN("could not read uevent");
-		goto err;
-	}
-
 	char *raw_p = uev->msg.raw;
 
 	if (strncmp(uev->msg.nlh.prefix, "libudev", uev->msg_len) == 0) {
@@ -964,12 +1457,12 @@ uevent_handle(UNUSED int fd, UNUSED unsigned events, UNUSED event_io_t *io, UNUS
 		if (uev->msg.nlh.magic != htonl(UDEV_MONITOR_MAGIC)) {
 			WARN("unrecognized message signature (%x != %x)", uev->msg.nlh.magic,
 			     htonl(UDEV_MONITOR_MAGIC));
-			goto err;
+			return;
 		}
 		if (uev->msg.nlh.properties_off + 32 > uev->msg_len) {
 			WARN("message smaller than expected (%u > %zd)",
 			     uev->msg.nlh.properties_off + 32, uev->msg_len);
-			goto err;
+			return;
 		}
 		raw_p += uev->msg.nlh.properties_off;
 		handle_udev_event(uev, raw_p);
@@ -982,8 +1475,123 @@ uevent_handle(UNUSED int fd, UNUSED unsigned events, UNUSED event_io_t *io, UNUS
 		/* kernel message */
 		TRACE("no uevent: %s", raw_p);
 	}
-err:
-	mem_free0(uev);
+}
+
+/*
+ * In-kernel filter of the uevent socket. Only kernel uevents starting with
+ * "add@", "remove@" or "change@" are handled, see handle_kernel_event(). The
+ * messages of udevd start with "libudev" and are dropped as well, since they
+ * are only parsed and discarded. Events of all subsystems are passed, as any
+ * device node may be allowed by the device cgroup of a container.
+ */
+#define UEVENT_FILTER_ADD 0x61646440  // "add@"
+#define UEVENT_FILTER_REMO 0x72656d6f // "remo"
+#define UEVENT_FILTER_CHAN 0x6368616e // "chan"
+
+static int
+uevent_attach_filter(nl_sock_t *sock)
+{
+	struct sock_filter filter[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, UEVENT_FILTER_ADD, 4, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, UEVENT_FILTER_REMO, 1, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, UEVENT_FILTER_CHAN, 0, 3),
+		// "remove@" and "change@" both have the '@' at offset 6
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 6),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, '@', 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog prog = { .len = sizeof(filter) / sizeof(filter[0]), .filter = filter };
+
+	return setsockopt(nl_sock_get_fd(sock), SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+			  sizeof(prog));
+}
+
+static void
+uevent_stats_record(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t ns = (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec -
+		      start->tv_nsec;
+
+	uevent_stats.messages++;
+	uevent_stats.handle_ns += ns;
+	uevent_stats.max_handle_ns = MAX(uevent_stats.max_handle_ns, ns);
+	uevent_stats.histogram[event_profile_bucket(ns)]++;
+	metrics_observe(uevent_metrics_handle, ns);
+}
+
+static int64_t
+uevent_metrics_get_handled(UNUSED void *data)
+{
+	return uevent_stats.messages;
+}
+
+static void
+uevent_handle(UNUSED int fd, UNUSED unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+{
+	char *bufs[UEVENT_RECV_BATCH];
+	ssize_t lens[UEVENT_RECV_BATCH];
+
+	for (int i = 0; i < UEVENT_RECV_BATCH; i++)
+		bufs[i] = uevent_pool[i].msg.raw;
+
+	/*
+	 * The socket is registered edge-triggered, thus we have to
+	 * drain all pending messages until the socket would block.
+	 */
+	for (;;) {
+		// keep room for a terminating '\0' behind each message
+		int n = nl_msg_receive_kernel_batch(uevent_netlink_sock, bufs,
+						    sizeof(uevent_pool[0].msg.raw) - 1, lens,
+						    UEVENT_RECV_BATCH, true);
+		if (n < 0 && errno == ENOBUFS) {
+			// the kernel dropped uevents since the socket buffer was full
+			uevent_stats.enobufs++;
+			WARN("Uevent netlink socket overrun, uevents were lost");
+			continue;
+		}
+		if (n <= 0) {
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+				WARN_ERRNO("could not read uevent");
+			break;
+		}
+
+		uevent_stats.batches++;
+		uevent_stats.max_batch = MAX(uevent_stats.max_batch, (uint64_t)n);
+
+		for (int i = 0; i < n; i++) {
+			struct uevent *uev = &uevent_pool[i];
+
+			// message did not pass sanity checks, skip it
+			if (lens[i] <= 0) {
+				uevent_stats.invalid++;
+				WARN("could not read uevent");
+				continue;
+			}
+
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+			// only the parsed members need to be reset, raw is overwritten on receive
+			memset((char *)uev + offsetof(struct uevent, msg_len), 0,
+			       sizeof(struct uevent) - offsetof(struct uevent, msg_len));
+			uev->msg.raw[lens[i]] = '\0';
+			uev->msg_len = lens[i];
+
+			PROBE2(uevent_handle, uev->msg.raw, lens[i]);
+			uevent_handle_msg(uev);
+			PROBE1(uevent_handle_done, uev->msg.raw);
+			mem_arena_reset(uevent_arena);
+			uevent_stats_record(&start);
+		}
+
+		if (n < UEVENT_RECV_BATCH)
+			break;
+	}
 }
 
 int
@@ -1010,8 +1618,13 @@ uevent_init()
 	}
 
 	/* find the udevd started by cml's init */
-	pid_t udevd_pid = proc_find(1, "systemd-udevd");
-	pid_t eudevd_pid = proc_find(1, "udevd");
+	pid_t udevd_pid = -1, eudevd_pid = -1;
+	proc_table_t *procs = proc_table_new();
+	if (procs) {
+		udevd_pid = proc_table_find(procs, 1, "systemd-udevd");
+		eudevd_pid = proc_table_find(procs, 1, "udevd");
+		proc_table_free(procs);
+	}
 
 	if (eudevd_pid < udevd_pid && eudevd_pid > 0)
 		udevd_pid = eudevd_pid;
@@ -1027,10 +1640,42 @@ uevent_init()
 		return -1;
 	}
 
-	uevent_io_event = event_io_new(nl_sock_get_fd(uevent_netlink_sock), EVENT_IO_READ,
-				       &uevent_handle, NULL);
+	// not fatal, the filtered uevents are skipped in uevent_handle_msg() as well
+	if (uevent_attach_filter(uevent_netlink_sock))
+		WARN_ERRNO("Could not attach filter to uevent netlink socket");
+
+	// subscribe before handling uevents, so that no announcement of a new link is lost
+	int group = RTNLGRP_LINK;
+	if (!(uevent_link_sock = nl_sock_routing_new()) ||
+	    setsockopt(nl_sock_get_fd(uevent_link_sock), SOL_NETLINK, NETLINK_ADD_MEMBERSHIP,
+		       &group, sizeof(group)) ||
+	    fd_make_non_blocking(nl_sock_get_fd(uevent_link_sock))) {
+		ERROR_ERRNO("Could not subscribe to link notifications");
+		nl_sock_free(uevent_link_sock);
+		uevent_link_sock = NULL;
+		nl_sock_free(uevent_netlink_sock);
+		uevent_netlink_sock = NULL;
+		return -1;
+	}
+	uevent_link_io = event_io_new(nl_sock_get_fd(uevent_link_sock), EVENT_IO_READ,
+				      &uevent_link_handle, NULL);
+	event_add_io(uevent_link_io);
+
+	uevent_arena = mem_arena_new(0);
+	uevent_pool = mem_new0(struct uevent, UEVENT_RECV_BATCH);
+
+	uevent_io_event = event_io_new(nl_sock_get_fd(uevent_netlink_sock),
+				       EVENT_IO_READ | EVENT_IO_EDGE, &uevent_handle, NULL);
 	event_add_io(uevent_io_event);
 
+	uevent_metrics_handled =
+		metrics_func_new(METRICS_COUNTER, "cml_uevents_handled_total", NULL,
+				 "Uevents received and handled.", uevent_metrics_get_handled, NULL);
+	uevent_metrics_forwarded = metrics_new(METRICS_COUNTER, "cml_uevents_forwarded_total",
+					       NULL, "Uevents forwarded into containers.");
+	uevent_metrics_handle = metrics_new(METRICS_HISTOGRAM, "cml_uevent_handle_seconds", NULL,
+					    "Time spent handling a single uevent.");
+
 	return 0;
 }
 
@@ -1044,6 +1689,68 @@ uevent_deinit()
 	if (uevent_netlink_sock) {
 		nl_sock_free(uevent_netlink_sock);
 	}
+	if (uevent_link_io) {
+		event_remove_io(uevent_link_io);
+		event_io_free(uevent_link_io);
+		uevent_link_io = NULL;
+	}
+	nl_sock_free(uevent_link_sock);
+	uevent_link_sock = NULL;
+	for (list_t *l = uevent_netdev_pending; l; l = l->next)
+		mem_free0(l->data);
+	list_delete(uevent_netdev_pending);
+	uevent_netdev_pending = NULL;
+	if (uevent_arena) {
+		mem_arena_free(uevent_arena);
+		uevent_arena = NULL;
+	}
+	mem_free0(uevent_pool);
+
+	metrics_free(uevent_metrics_handled);
+	metrics_free(uevent_metrics_forwarded);
+	metrics_free(uevent_metrics_handle);
+	uevent_metrics_handled = uevent_metrics_forwarded = uevent_metrics_handle = NULL;
+
+	while (uevent_injector_list)
+		uevent_injector_free(uevent_injector_list->data);
+
+	while (uevent_sysfs_dev_list)
+		uevent_sysfs_dev_remove(uevent_sysfs_dev_list->data);
+	if (uevent_sysfs_dev_index) {
+		hashmap_free(uevent_sysfs_dev_index);
+		uevent_sysfs_dev_index = NULL;
+	}
+}
+
+void
+uevent_get_stats(uevent_stats_t *stats)
+{
+	ASSERT(stats);
+	*stats = uevent_stats;
+}
+
+void
+uevent_set_replay_port(uint32_t port)
+{
+	if (port)
+		WARN("Accepting kernel uevents replayed by netlink port %u", port);
+	else
+		INFO("Accepting kernel uevents from the kernel only");
+	nl_sock_uevent_set_replay_port(port);
+}
+
+void
+uevent_unregister_container(container_t *container)
+{
+	for (list_t *l = uevent_injector_list; l; l = l->next) {
+		uevent_injector_t *injector = l->data;
+		if (injector->container == container) {
+			DEBUG("Stopping uevent injector %d of container %s", injector->pid,
+			      container_get_name(container));
+			uevent_injector_free(injector);
+			return;
+		}
+	}
 }
 
 int
@@ -1051,7 +1758,7 @@ uevent_register_usbdevice(container_t *container, uevent_usbdev_t *usbdev)
 {
 	uevent_container_dev_mapping_t *mapping =
 		uevent_container_dev_mapping_new(container, usbdev);
-	uevent_container_dev_mapping_list = list_append(uevent_container_dev_mapping_list, mapping);
+	uevent_usbdev_index_add(mapping);
 
 	INFO("Registered usbdevice %04x:%04x '%s' [c %d:%d] for container %s",
 	     mapping->usbdev->id_vendor, mapping->usbdev->id_product, mapping->usbdev->i_serial,
@@ -1065,21 +1772,19 @@ int
 uevent_unregister_usbdevice(container_t *container, uevent_usbdev_t *usbdev)
 {
 	uevent_container_dev_mapping_t *mapping_to_remove = NULL;
+	char key[UEVENT_USBDEV_KEY_LEN];
+	size_t key_len =
+		uevent_usbdev_key(key, usbdev->id_vendor, usbdev->id_product, usbdev->i_serial);
 
-	for (list_t *l = uevent_container_dev_mapping_list; l; l = l->next) {
+	for (list_t *l = uevent_index_get(uevent_usbdev_index, key, key_len); l; l = l->next) {
 		uevent_container_dev_mapping_t *mapping = l->data;
-		if ((mapping->container == container) &&
-		    (mapping->usbdev->id_vendor == usbdev->id_vendor) &&
-		    (mapping->usbdev->id_product == usbdev->id_product) &&
-		    (0 == strcmp(mapping->usbdev->i_serial, usbdev->i_serial))) {
+		if (mapping->container == container)
 			mapping_to_remove = mapping;
-		}
 	}
 
 	IF_NULL_RETVAL(mapping_to_remove, -1);
 
-	uevent_container_dev_mapping_list =
-		list_remove(uevent_container_dev_mapping_list, mapping_to_remove);
+	uevent_usbdev_index_remove(mapping_to_remove);
 
 	INFO("Unregistered usbdevice %04x:%04x '%s' for container %s",
 	     mapping_to_remove->usbdev->id_vendor, mapping_to_remove->usbdev->id_product,
@@ -1098,8 +1803,7 @@ uevent_register_netdev(container_t *container, container_pnet_cfg_t *pnet_cfg)
 
 	IF_NULL_RETVAL(mapping, -1);
 
-	uevent_container_netdev_mapping_list =
-		list_append(uevent_container_netdev_mapping_list, mapping);
+	uevent_index_add(&uevent_netdev_index, mapping->mac, sizeof(mapping->mac), mapping);
 	char *macstr = network_mac_addr_to_str_new(mapping->mac);
 
 	INFO("Registered netdev '%s' for container %s", macstr,
@@ -1114,17 +1818,17 @@ uevent_unregister_netdev(container_t *container, uint8_t mac[6])
 {
 	uevent_container_netdev_mapping_t *mapping_to_remove = NULL;
 
-	for (list_t *l = uevent_container_netdev_mapping_list; l; l = l->next) {
+	for (list_t *l = uevent_index_get(uevent_netdev_index, mac, 6); l; l = l->next) {
 		uevent_container_netdev_mapping_t *mapping = l->data;
-		if ((mapping->container == container) && (0 == memcmp(mapping->mac, mac, 6))) {
+		if (mapping->container == container) {
 			mapping_to_remove = mapping;
 		}
 	}
 
 	IF_NULL_RETVAL(mapping_to_remove, -1);
 
-	uevent_container_netdev_mapping_list =
-		list_remove(uevent_container_netdev_mapping_list, mapping_to_remove);
+	uevent_index_remove(uevent_netdev_index, mapping_to_remove->mac,
+			    sizeof(mapping_to_remove->mac), mapping_to_remove);
 
 	char *macstr = network_mac_addr_to_str_new(mapping_to_remove->mac);
 
@@ -1137,58 +1841,36 @@ uevent_unregister_netdev(container_t *container, uint8_t mac[6])
 	return 0;
 }
 
-static int
-uevent_trigger_coldboot_foreach_cb(const char *path, const char *name, void *data)
+void
+uevent_udev_trigger_coldboot(container_t *container)
 {
-	int ret = 0;
-	char buf[256];
-	int major, minor;
+	// for the first time iterate through sysfs to find devices
+	if (!uevent_sysfs_dev_index)
+		uevent_sysfs_inventory_init();
 
-	container_t *container = data;
-	IF_NULL_RETVAL(container, -1);
+	char *trigger = mem_printf("add %s", uuid_string(container_get_uuid(container)));
+	int triggered = 0;
 
-	char *full_path = mem_printf("%s/%s", path, name);
-	char *dev_file = NULL;
-
-	if (file_is_dir(full_path)) {
-		if (0 > dir_foreach(full_path, &uevent_trigger_coldboot_foreach_cb, container)) {
-			WARN("Could not trigger coldboot uevents! No '%s'!", full_path);
-			ret--;
-		}
-	} else if (!strcmp(name, "uevent")) {
-		dev_file = mem_printf("%s/dev", path);
-
-		IF_FALSE_GOTO_TRACE(file_exists(dev_file), out);
-
-		major = minor = -1;
-		IF_TRUE_GOTO(-1 == file_read(dev_file, buf, sizeof(buf)), out);
-		IF_TRUE_GOTO((sscanf(buf, "%d:%d", &major, &minor) < 0), out);
-		IF_FALSE_GOTO((major > -1 && minor > -1), out);
+	for (list_t *l = uevent_sysfs_dev_list; l;) {
+		uevent_sysfs_dev_t *dev = l->data;
+		l = l->next;
 
 		// only trigger for allowed devices
-		IF_FALSE_GOTO_TRACE(container_is_device_allowed(container, major, minor), out);
-
-		char *trigger = mem_printf("add %s", uuid_string(container_get_uuid(container)));
-		if (-1 == file_printf(full_path, trigger)) {
-			WARN("Could not trigger event %s <- %s", full_path, trigger);
-			ret--;
+		if (!container_is_device_allowed(container, dev->major, dev->minor))
+			continue;
+
+		if (-1 == file_printf(dev->uevent_file, "%s", trigger)) {
+			WARN("Could not trigger event %s <- %s", dev->uevent_file, trigger);
+			// drop devices which vanished without a remove uevent, e.g., on a move
+			if (!file_exists(dev->uevent_file))
+				uevent_sysfs_dev_remove(dev);
 		} else {
-			DEBUG("Trigger event %s <- %s", full_path, trigger);
+			TRACE("Trigger event %s <- %s", dev->uevent_file, trigger);
+			triggered++;
 		}
-		mem_free0(trigger);
 	}
-out:
-	mem_free0(full_path);
-	mem_free0(dev_file);
-	return ret;
-}
 
-void
-uevent_udev_trigger_coldboot(container_t *container)
-{
-	const char *sysfs_devices = "/sys/devices";
-	// for the first time iterate through sysfs to find device
-	if (0 > dir_foreach(sysfs_devices, &uevent_trigger_coldboot_foreach_cb, container)) {
-		WARN("Could not trigger coldboot uevents! No '%s'!", sysfs_devices);
-	}
+	DEBUG("Triggered %d coldboot uevents for container %s", triggered,
+	      container_get_name(container));
+	mem_free0(trigger);
 }
@@ -34,6 +34,7 @@
 #include <stdint.h>
 
 #include "container.h"
+#include "common/event.h"
 #include "uuid.h"
 
 #define UEVENT_BUF_LEN 64 * 1024
@@ -119,6 +120,16 @@ uevent_register_netdev(container_t *container, container_pnet_cfg_t *pnet_cfg);
 int
 uevent_unregister_netdev(container_t *container, uint8_t mac[6]);
 
+/**
+ * Releases the resources the uevent subsystem holds for a container, i.e.,
+ * stops the helper which injects uevents into the network namespace of the
+ * container. Called when the container stops.
+ *
+ * @param container container which is cleaned up
+ */
+void
+uevent_unregister_container(container_t *container);
+
 /**
  * Trigger cold boot events to allow user namespaced containers to fixup
  * their device nodes by udevd in container.
@@ -130,4 +141,33 @@ uevent_unregister_netdev(container_t *container, uint8_t mac[6]);
 void
 uevent_udev_trigger_coldboot(container_t *container);
 
+/**
+ * Counters of the uevent handling.
+ */
+typedef struct {
+	uint64_t messages;			   /**< messages received and handled */
+	uint64_t batches;			   /**< recvmmsg() calls which returned messages */
+	uint64_t max_batch;			   /**< most messages received at once */
+	uint64_t enobufs;			   /**< socket overruns, i.e., lost messages */
+	uint64_t invalid;			   /**< messages failing the sanity checks */
+	uint64_t handle_ns;			   /**< accumulated time spent handling messages */
+	uint64_t max_handle_ns;			   /**< longest handling of a single message */
+	uint64_t histogram[EVENT_PROFILE_BUCKETS]; /**< log2 histogram of handling times */
+} uevent_stats_t;
+
+/**
+ * Copies the current counters of the uevent handling to stats.
+ */
+void
+uevent_get_stats(uevent_stats_t *stats);
+
+/**
+ * Additionally accepts kernel uevents sent by the given netlink port, e.g., by a tool
+ * replaying recorded uevents to benchmark their handling.
+ *
+ * @param port netlink port id of the replaying socket, 0 to accept the kernel only again
+ */
+void
+uevent_set_replay_port(uint32_t port);
+
 #endif /* UEVENT_H */
@@ -0,0 +1,480 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#define _GNU_SOURCE
+
+#include "zygote.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/list.h"
+#include "common/event.h"
+#include "common/file.h"
+#include "c_vol.h"
+#include "cgroups_v2.h"
+#include "guestos_mgr.h"
+#include "mount.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#ifndef SYS_open_tree
+#define SYS_open_tree 428
+#endif
+#ifndef SYS_move_mount
+#define SYS_move_mount 429
+#endif
+
+#define ZYGOTE_REFILL_INTERVAL 100 // ms between the creation of two zygotes
+#define ZYGOTE_STACK_SIZE 8192
+
+// cmld's mounts which are not copied to the zygote but moved in by zygote_join()
+#define ZYGOTE_TMP_DIR "/tmp"
+
+#define ZYGOTE_UNSHARE_FLAGS                                                                       \
+	(CLONE_NEWUSER | CLONE_NEWNS | CLONE_NEWNET | CLONE_NEWUTS | CLONE_NEWIPC)
+
+/*
+ * The namespaces of a zygote in the order they are joined, the user namespace owns
+ * the others.
+ */
+static const struct {
+	const char *name;
+	int nstype;
+} zygote_ns[] = {
+	{ "user", CLONE_NEWUSER }, { "mnt", CLONE_NEWNS }, { "cgroup", CLONE_NEWCGROUP },
+	{ "net", CLONE_NEWNET },   { "uts", CLONE_NEWUTS }, { "ipc", CLONE_NEWIPC },
+};
+
+#define ZYGOTE_NS_COUNT (sizeof(zygote_ns) / sizeof(zygote_ns[0]))
+
+struct zygote {
+	int fd_ns[ZYGOTE_NS_COUNT]; // -1 for a namespace not provided by the zygote
+	char *cgroup;		    // cgroup of the zygote, NULL without a cgroup namespace
+	list_t *shared_mounts;	    // references on the shared images of the guestos
+};
+
+typedef struct zygote_pool {
+	char *os_name;
+	uint64_t os_version; // version of the guestos the zygotes are prepared for
+	list_t *zygotes;
+	event_timer_t *timer;
+} zygote_pool_t;
+
+typedef struct zygote_hold {
+	int fd_ready;	  // written by the holder after creating the namespaces
+	int fd_release;	  // closed by cmld after opening the namespaces
+	int fd_release_w; // cmld's end, closed by the holder
+	const char *cgroup_procs;
+} zygote_hold_t;
+
+static list_t *zygote_pools = NULL;
+static unsigned int zygote_pool_size = 0;
+static unsigned int zygote_count = 0;
+
+/**
+ * Creates the namespaces of a zygote and holds them alive until cmld opened them,
+ * which is signaled by closing the release pipe.
+ */
+static int
+zygote_hold(void *data)
+{
+	zygote_hold_t *hold = data;
+	char c = 0;
+
+	close(hold->fd_release_w);
+
+	// the cgroup namespace is rooted at the cgroup of the holder
+	if (hold->cgroup_procs && file_printf(hold->cgroup_procs, "0") == -1)
+		return EXIT_FAILURE;
+
+	// the copy of cmld's mount namespace does not keep containers' mounts busy
+	if (umount2(ZYGOTE_TMP_DIR, MNT_DETACH) < 0)
+		return EXIT_FAILURE;
+
+	if (unshare(ZYGOTE_UNSHARE_FLAGS | (hold->cgroup_procs ? CLONE_NEWCGROUP : 0)) < 0)
+		return EXIT_FAILURE;
+
+	if (write(hold->fd_ready, &c, 1) < 0)
+		return EXIT_FAILURE;
+
+	if (read(hold->fd_release, &c, 1) < 0)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+static void
+zygote_hold_child_cb(pid_t pid, int status, event_child_t *child, UNUSED void *data)
+{
+	if (status)
+		TRACE("Zygote holder %d exited with status %d", pid, status);
+
+	event_remove_child(child);
+	event_child_free(child);
+}
+
+static int
+zygote_open_ns(pid_t pid, const char *ns)
+{
+	char *path = mem_printf("/proc/%d/ns/%s", pid, ns);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		ERROR_ERRNO("Could not open %s", path);
+	mem_free0(path);
+	return fd;
+}
+
+/**
+ * Creates the cgroup of a zygote in the unified hierarchy with the child cgroup, in
+ * which the container is placed later, see c_cgroups.
+ */
+static char *
+zygote_cgroup_new(void)
+{
+	char *cgroup = mem_printf("%s/zygote-%d-%u", MOUNT_CGROUPS_FOLDER, getpid(), zygote_count);
+	char *child = mem_printf("%s/child", cgroup);
+
+	if (mkdir(cgroup, 0755) < 0 || mkdir(child, 0755) < 0) {
+		ERROR_ERRNO("Could not create cgroup %s for zygote", child);
+		if (rmdir(cgroup) < 0)
+			TRACE_ERRNO("Could not remove %s", cgroup);
+		mem_free0(cgroup);
+	}
+
+	mem_free0(child);
+	return cgroup;
+}
+
+static void
+zygote_cgroup_remove(const char *cgroup)
+{
+	char *child = mem_printf("%s/child", cgroup);
+	if (rmdir(child) < 0 || rmdir(cgroup) < 0)
+		WARN_ERRNO("Could not remove cgroup %s of zygote", cgroup);
+	mem_free0(child);
+}
+
+void
+zygote_free(zygote_t *zygote)
+{
+	IF_NULL_RETURN(zygote);
+
+	for (size_t i = 0; i < ZYGOTE_NS_COUNT; i++) {
+		if (zygote->fd_ns[i] >= 0)
+			close(zygote->fd_ns[i]);
+	}
+	c_vol_shared_mounts_release(zygote->shared_mounts);
+	mem_free0(zygote->cgroup);
+	mem_free0(zygote);
+}
+
+/**
+ * Frees a zygote which has not been taken by a container, including its cgroup.
+ */
+static void
+zygote_destroy(zygote_t *zygote)
+{
+	if (zygote->cgroup)
+		zygote_cgroup_remove(zygote->cgroup);
+	zygote_free(zygote);
+}
+
+/**
+ * Creates a zygote for a guestos. The namespaces are created by a holder process,
+ * cloned with a new mount namespace to drop the mounts under /tmp before it unshares
+ * the other namespaces, which in turn copies the cleaned mount namespace.
+ */
+static zygote_t *
+zygote_new(const guestos_t *os)
+{
+	int fd_ready[2] = { -1, -1 }, fd_release[2] = { -1, -1 };
+	char *cgroup_procs = NULL;
+	pid_t pid = -1;
+	char c;
+
+	zygote_t *zygote = mem_new0(zygote_t, 1);
+	for (size_t i = 0; i < ZYGOTE_NS_COUNT; i++)
+		zygote->fd_ns[i] = -1;
+
+	zygote->shared_mounts = c_vol_shared_mounts_acquire(os);
+
+	if (cgroups_v2_enabled() && file_exists("/proc/self/ns/cgroup")) {
+		zygote->cgroup = zygote_cgroup_new();
+		IF_NULL_GOTO(zygote->cgroup, error);
+		cgroup_procs = mem_printf("%s/child/cgroup.procs", zygote->cgroup);
+	}
+	zygote_count++;
+
+	if (pipe2(fd_ready, O_CLOEXEC) < 0 || pipe2(fd_release, O_CLOEXEC) < 0) {
+		ERROR_ERRNO("Could not create pipes for zygote holder");
+		goto error;
+	}
+
+	zygote_hold_t hold = { .fd_ready = fd_ready[1],
+			       .fd_release = fd_release[0],
+			       .fd_release_w = fd_release[1],
+			       .cgroup_procs = cgroup_procs };
+
+	void *stack = alloca(ZYGOTE_STACK_SIZE);
+	void *stack_high = (void *)((const char *)stack + ZYGOTE_STACK_SIZE);
+
+	pid = clone(zygote_hold, stack_high, CLONE_NEWNS | SIGCHLD, &hold);
+	if (pid < 0) {
+		ERROR_ERRNO("Could not clone zygote holder");
+		goto error;
+	}
+	close(fd_ready[1]);
+	fd_ready[1] = -1;
+
+	if (read(fd_ready[0], &c, 1) != 1) {
+		ERROR("Zygote holder %d failed to create namespaces", pid);
+		goto error_holder;
+	}
+
+	for (size_t i = 0; i < ZYGOTE_NS_COUNT; i++) {
+		if (zygote_ns[i].nstype == CLONE_NEWCGROUP && !zygote->cgroup)
+			continue;
+		zygote->fd_ns[i] = zygote_open_ns(pid, zygote_ns[i].name);
+		IF_TRUE_GOTO(zygote->fd_ns[i] < 0, error_holder);
+	}
+
+	event_child_t *child = event_child_new(pid, zygote_hold_child_cb, NULL);
+	if (event_add_child(child) < 0) {
+		ERROR("Could not watch zygote holder %d", pid);
+		event_child_free(child);
+		goto error_holder;
+	}
+
+	// let the holder exit, the namespaces are kept alive by the opened fds
+	close(fd_release[1]);
+	close(fd_release[0]);
+	close(fd_ready[0]);
+	mem_free0(cgroup_procs);
+
+	TRACE("Created zygote of holder %d for guestos %s", pid, guestos_get_name(os));
+	return zygote;
+
+error_holder:
+	kill(pid, SIGKILL);
+	if (waitpid(pid, NULL, 0) < 0)
+		WARN_ERRNO("Could not wait for zygote holder %d", pid);
+error:
+	for (int i = 0; i < 2; i++) {
+		if (fd_ready[i] >= 0)
+			close(fd_ready[i]);
+		if (fd_release[i] >= 0)
+			close(fd_release[i]);
+	}
+	mem_free0(cgroup_procs);
+	zygote_destroy(zygote);
+	return NULL;
+}
+
+/**
+ * Looks up the guestos a pool is prepared for. Guestos objects are replaced on updates,
+ * thus pools refer to them by name and version.
+ */
+static const guestos_t *
+zygote_pool_get_os(const zygote_pool_t *pool)
+{
+	for (size_t i = 0; i < guestos_mgr_get_guestos_count(); i++) {
+		const guestos_t *os = guestos_mgr_get_guestos_by_index(i);
+		if (!strcmp(guestos_get_name(os), pool->os_name) &&
+		    guestos_get_version(os) == pool->os_version)
+			return os;
+	}
+	return NULL;
+}
+
+static void
+zygote_pool_stop_refill(zygote_pool_t *pool)
+{
+	IF_NULL_RETURN(pool->timer);
+
+	event_remove_timer(pool->timer);
+	event_timer_free(pool->timer);
+	pool->timer = NULL;
+}
+
+static void
+zygote_pool_refill_cb(UNUSED event_timer_t *timer, void *data)
+{
+	zygote_pool_t *pool = data;
+	ASSERT(pool);
+
+	if (list_length(pool->zygotes) < zygote_pool_size) {
+		const guestos_t *os = zygote_pool_get_os(pool);
+		zygote_t *zygote = os ? zygote_new(os) : NULL;
+		if (zygote) {
+			pool->zygotes = list_append(pool->zygotes, zygote);
+			return;
+		}
+		WARN("Failed to refill zygote pool of guestos %s, %u of %u zygotes available",
+		     pool->os_name, list_length(pool->zygotes), zygote_pool_size);
+	}
+
+	zygote_pool_stop_refill(pool);
+}
+
+/**
+ * Refills the pool in the background, one zygote per timer tick, so that
+ * the creation stays out of the critical path of container starts.
+ */
+static void
+zygote_pool_schedule_refill(zygote_pool_t *pool)
+{
+	IF_TRUE_RETURN(pool->timer);
+
+	pool->timer = event_timer_new(ZYGOTE_REFILL_INTERVAL, EVENT_TIMER_REPEAT_FOREVER,
+				      zygote_pool_refill_cb, pool);
+	event_add_timer(pool->timer);
+}
+
+static void
+zygote_pool_clear(zygote_pool_t *pool)
+{
+	for (list_t *l = pool->zygotes; l; l = l->next)
+		zygote_destroy(l->data);
+	list_delete(pool->zygotes);
+	pool->zygotes = NULL;
+}
+
+static zygote_pool_t *
+zygote_pool_get(const guestos_t *os)
+{
+	const char *name = guestos_get_name(os);
+
+	for (list_t *l = zygote_pools; l; l = l->next) {
+		zygote_pool_t *pool = l->data;
+		if (!strcmp(pool->os_name, name))
+			return pool;
+	}
+
+	INFO("Keeping a pool of %u zygotes for guestos %s", zygote_pool_size, name);
+	zygote_pool_t *pool = mem_new0(zygote_pool_t, 1);
+	pool->os_name = mem_strdup(name);
+	pool->os_version = guestos_get_version(os);
+	zygote_pools = list_append(zygote_pools, pool);
+	return pool;
+}
+
+zygote_t *
+zygote_pool_take(const guestos_t *os)
+{
+	ASSERT(os);
+	IF_FALSE_RETVAL(zygote_pool_size, NULL);
+
+	zygote_pool_t *pool = zygote_pool_get(os);
+
+	// zygotes holding the images of another version are of no use
+	if (pool->os_version != guestos_get_version(os)) {
+		DEBUG("Preparing zygotes for version %" PRIu64 " of guestos %s instead of %" PRIu64,
+		      guestos_get_version(os), pool->os_name, pool->os_version);
+		zygote_pool_clear(pool);
+		pool->os_version = guestos_get_version(os);
+	}
+
+	zygote_t *zygote = list_nth_data(pool->zygotes, 0);
+	if (zygote)
+		pool->zygotes = list_remove(pool->zygotes, zygote);
+
+	zygote_pool_schedule_refill(pool);
+	return zygote;
+}
+
+const char *
+zygote_get_cgroup(const zygote_t *zygote)
+{
+	ASSERT(zygote);
+	return zygote->cgroup;
+}
+
+int
+zygote_join(const zygote_t *zygote)
+{
+	ASSERT(zygote);
+	int ret = -1;
+
+	// the container's root and the mounts set up for it, taken along into the zygote
+	int fd_tree = syscall(SYS_open_tree, AT_FDCWD, ZYGOTE_TMP_DIR,
+			      OPEN_TREE_CLONE | AT_RECURSIVE | OPEN_TREE_CLOEXEC);
+	if (fd_tree < 0) {
+		ERROR_ERRNO("Could not clone mount tree of %s", ZYGOTE_TMP_DIR);
+		return -1;
+	}
+
+	for (size_t i = 0; i < ZYGOTE_NS_COUNT; i++) {
+		if (zygote->fd_ns[i] < 0)
+			continue;
+		if (setns(zygote->fd_ns[i], zygote_ns[i].nstype) < 0) {
+			ERROR_ERRNO("Could not join %s namespace of zygote", zygote_ns[i].name);
+			goto out;
+		}
+	}
+
+	if (syscall(SYS_move_mount, fd_tree, "", AT_FDCWD, ZYGOTE_TMP_DIR,
+		    MOVE_MOUNT_F_EMPTY_PATH) < 0) {
+		ERROR_ERRNO("Could not attach mount tree at %s in zygote", ZYGOTE_TMP_DIR);
+		goto out;
+	}
+
+	ret = 0;
+out:
+	close(fd_tree);
+	return ret;
+}
+
+int
+zygote_pool_init(unsigned int size)
+{
+	zygote_pool_size = size;
+	IF_FALSE_RETVAL(size, 0);
+
+	INFO("Keeping pools of %u zygotes per guestos", size);
+	return 0;
+}
+
+void
+zygote_pool_free(void)
+{
+	for (list_t *l = zygote_pools; l; l = l->next) {
+		zygote_pool_t *pool = l->data;
+		zygote_pool_stop_refill(pool);
+		zygote_pool_clear(pool);
+		mem_free0(pool->os_name);
+		mem_free0(pool);
+	}
+	list_delete(zygote_pools);
+	zygote_pools = NULL;
+}
@@ -0,0 +1,101 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+
+/**
+ * @file zygote.h
+ *
+ * Pools of zygotes, i.e., sets of fresh namespaces prepared in the background ahead
+ * of container starts, one pool per guestos. Creating the namespaces, a network
+ * namespace in particular, and mounting the images of the guestos are a noticeable
+ * part of a container start. A starting container takes a zygote of its guestos
+ * instead, its early child joins the namespaces of the zygote and clones the
+ * container's init with a new pid namespace only.
+ *
+ * A zygote consists of user, mount, net, uts and ipc namespaces and, with the unified
+ * cgroup hierarchy, a cgroup with a cgroup namespace rooted at its child cgroup. It
+ * keeps the shared read-only images of its guestos mounted, see c_vol.h. The uid
+ * mapping and the network interfaces are set up by the start hooks of c_user and c_net
+ * as for namespaces created by the clone. The mount namespace is a copy of cmld's one
+ * without the mounts under /tmp, which zygote_join() brings in from cmld at the start,
+ * the container's root in particular.
+ */
+
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include "guestos.h"
+
+typedef struct zygote zygote_t;
+
+/**
+ * Initializes the pools of zygotes. The pool of a guestos is created by the first
+ * container start taking a zygote of it, and is filled and replenished in the
+ * background from the event loop.
+ * @param size number of zygotes to keep available per guestos, 0 disables the pools
+ * @return 0 on success, -1 on error
+ */
+int
+zygote_pool_init(unsigned int size);
+
+/**
+ * Releases all pooled zygotes and stops replenishing the pools.
+ */
+void
+zygote_pool_free(void);
+
+/**
+ * Takes a zygote from the pool of a guestos.
+ * @param os the guestos of the starting container
+ * @return the zygote, NULL if the pool is empty
+ */
+zygote_t *
+zygote_pool_take(const guestos_t *os);
+
+/**
+ * Returns the cgroup prepared by the zygote, to be adopted by the container taking it,
+ * see c_cgroups_adopt(). The container removes the cgroup on its cleanup.
+ * @return path of the cgroup, NULL if the zygote has no cgroup namespace
+ */
+const char *
+zygote_get_cgroup(const zygote_t *zygote);
+
+/**
+ * Joins the calling process to the namespaces of the zygote. Children cloned afterwards
+ * without the corresponding CLONE_NEW* flags share these namespaces. The mounts under
+ * /tmp of the caller's mount namespace are moved over to the one of the zygote. To be
+ * called in the container's early child, after the root of the container is mounted.
+ * @return 0 on success, -1 on error
+ */
+int
+zygote_join(const zygote_t *zygote);
+
+/**
+ * Releases the namespaces and images held by a zygote taken from the pool. Namespaces
+ * which have been joined by a process are kept alive by it.
+ */
+void
+zygote_free(zygote_t *zygote);
+
+#endif /* ZYGOTE_H */
@@ -34,6 +34,8 @@
 #include "common/event.h"
 #include "common/sock.h"
 #include "common/fd.h"
+#include "common/hex.h"
+#include "common/merkle.h"
 #include "common/ssl_util.h"
 
 #include "attestation.pb-c.h"
@@ -42,6 +44,7 @@
 #include "config.h"
 #include "modsig.h"
 #include "hash.h"
+#include "digest_index.h"
 #include "ima_verify.h"
 #include "container_verify.h"
 
@@ -49,25 +52,104 @@
 
 struct attestation_resp_cb_data {
 	void (*resp_verified_cb)(bool);
+	void (*host_verified_cb)(const char *host, bool verified, void *data);
+	void *data;
+	char *host;
 	size_t nonce_len;
 	uint8_t *nonce;
 	RAttestationConfig *config;
+	bool free_config; // config is owned by this request
+	attestation_ml_state_t *ml_state;
 };
 
-static char *
-convert_bin_to_hex_new(const uint8_t *bin, int length)
+struct attestation_ml_state {
+	char *boot_id;		   // boot of the device the offsets refer to, NULL if unknown
+	uint64_t ima_offset;	   // bytes of the IMA log verified so far
+	uint32_t container_offset; // entries of the container list verified so far
+	uint8_t *container_pcr;	   // PCR 11 replayed over these entries
+	size_t container_pcr_len;
+};
+
+attestation_ml_state_t *
+attestation_ml_state_new(void)
 {
-	size_t len = MUL_WITH_OVERFLOW_CHECK(length, (size_t)2);
-	len = MUL_WITH_OVERFLOW_CHECK(len, sizeof(char));
-	len = ADD_WITH_OVERFLOW_CHECK(len, 1);
-	char *hex = mem_alloc0(len);
+	return mem_new0(attestation_ml_state_t, 1);
+}
+
+static void
+attestation_ml_state_reset(attestation_ml_state_t *ml_state)
+{
+	mem_free0(ml_state->boot_id);
+	mem_free0(ml_state->container_pcr);
+	ml_state->ima_offset = 0;
+	ml_state->container_offset = 0;
+	ml_state->container_pcr_len = 0;
+}
 
-	for (int i = 0; i < length; ++i) {
-		// remember snprintf additionally writes a '0' byte
-		snprintf(hex + i * 2, 3, "%.2x", bin[i]);
+void
+attestation_ml_state_free(attestation_ml_state_t *ml_state)
+{
+	IF_NULL_RETURN(ml_state);
+	attestation_ml_state_reset(ml_state);
+	mem_free0(ml_state);
+}
+
+/*
+ * Records the end of the measurement lists of a successfully verified response,
+ * so that the next request only asks for the entries appended since.
+ */
+static void
+attestation_ml_state_update(attestation_ml_state_t *ml_state, const Tpm2dToRemote *resp)
+{
+	attestation_ml_state_reset(ml_state);
+	IF_NULL_RETURN(resp->boot_id);
+
+	ml_state->boot_id = mem_strdup(resp->boot_id);
+	ml_state->ima_offset = (resp->has_ml_ima_offset ? resp->ml_ima_offset : 0) +
+			       resp->ml_ima_entry.len;
+	ml_state->container_offset =
+		(resp->has_ml_container_offset ? resp->ml_container_offset : 0) +
+		resp->n_ml_container_entry;
+	ml_state->container_pcr =
+		mem_memcpy(resp->pcr_values[11]->value.data, resp->pcr_values[11]->value.len);
+	ml_state->container_pcr_len = resp->pcr_values[11]->value.len;
+}
+
+/*
+ * The known-good digests of a configuration are indexed once and kept for all further
+ * attestations with the same configuration, e.g. in serve mode.
+ */
+static digest_index_t *attestation_digest_index = NULL;
+static const RAttestationConfig *attestation_digest_index_config = NULL;
+
+static int
+attestation_digest_index_get(const RAttestationConfig *config, const digest_index_t **index)
+{
+	if (config != attestation_digest_index_config) {
+		digest_index_free(attestation_digest_index);
+		attestation_digest_index = NULL;
+		attestation_digest_index_config = NULL;
+
+		if (config->digest_index) {
+			attestation_digest_index = digest_index_new_from_file(config->digest_index);
+			IF_NULL_RETVAL_ERROR(attestation_digest_index, -1);
+		} else if (config->n_container_digests > 0 || config->n_ima_digests > 0) {
+			attestation_digest_index = digest_index_new_from_config(config);
+			IF_NULL_RETVAL_ERROR(attestation_digest_index, -1);
+		}
+		attestation_digest_index_config = config;
 	}
+	*index = attestation_digest_index;
+	return 0;
+}
 
-	return hex;
+static void
+attestation_digest_index_release(const RAttestationConfig *config)
+{
+	IF_FALSE_RETURN(config == attestation_digest_index_config);
+	digest_index_free(attestation_digest_index);
+	attestation_digest_index = NULL;
+	attestation_digest_index_config = NULL;
 }
 
 static bool
@@ -106,9 +188,42 @@ convert_hex_to_bin(const char *in, size_t inlen, uint8_t *out, size_t outlen)
 	return 0;
 }
 
+/**
+ * Checks the qualifying data of the quote, which is either the nonce itself or,
+ * if tpm2d answered several requests with one quote, the merkle root over their
+ * nonces which has to be recomputed from the inclusion proof of this nonce.
+ */
+static bool
+attestation_verify_nonce(const Tpm2dToRemote *resp, const uint8_t *quoted_nonce,
+			 size_t quoted_nonce_len, const uint8_t *nonce, size_t nonce_len)
+{
+	if (!resp->has_nonce_count || resp->nonce_count <= 1)
+		return quoted_nonce_len == nonce_len && !memcmp(quoted_nonce, nonce, nonce_len);
+
+	IF_FALSE_RETVAL_ERROR(resp->has_nonce_index, false);
+	IF_FALSE_RETVAL_ERROR(quoted_nonce_len == MERKLE_HASH_LEN, false);
+
+	bool ret = false;
+	const uint8_t **proof = mem_new0(const uint8_t *, MAX(resp->n_nonce_proof, 1));
+	for (size_t i = 0; i < resp->n_nonce_proof; i++) {
+		if (resp->nonce_proof[i].len != MERKLE_HASH_LEN) {
+			ERROR("Invalid length %zu of nonce proof hash", resp->nonce_proof[i].len);
+			goto out;
+		}
+		proof[i] = resp->nonce_proof[i].data;
+	}
+	ret = merkle_proof_verify(nonce, nonce_len, resp->nonce_index, resp->nonce_count, proof,
+				  resp->n_nonce_proof, quoted_nonce);
+	DEBUG("Nonce %u of %u batched requests, inclusion proof %s", resp->nonce_index,
+	      resp->nonce_count, ret ? "valid" : "invalid");
+out:
+	mem_free0(proof);
+	return ret;
+}
+
 static bool
 attestation_verify_resp(Tpm2dToRemote *resp, RAttestationConfig *config, uint8_t *nonce,
-			size_t nonce_len)
+			size_t nonce_len, attestation_ml_state_t *ml_state)
 {
 	ASSERT(config);
 	ASSERT(nonce);
@@ -127,7 +242,7 @@ attestation_verify_resp(Tpm2dToRemote *resp, RAttestationConfig *config, uint8_t
 	char *pcr_strings[resp->n_pcr_values];
 
 	if (resp->has_quoted) {
-		char *quote_str = convert_bin_to_hex_new(resp->quoted.data, resp->quoted.len);
+		char *quote_str = hex_encode_new(resp->quoted.data, resp->quoted.len);
 		DEBUG("Quote (Length %zu): %s", resp->quoted.len, quote_str);
 		mem_free0(quote_str);
 	} else {
@@ -137,7 +252,7 @@ attestation_verify_resp(Tpm2dToRemote *resp, RAttestationConfig *config, uint8_t
 	}
 
 	if (resp->has_signature) {
-		char *sig_str = convert_bin_to_hex_new(resp->signature.data, resp->signature.len);
+		char *sig_str = hex_encode_new(resp->signature.data, resp->signature.len);
 		DEBUG("Signature (Length %zu): %s\n", resp->signature.len, sig_str);
 		mem_free0(sig_str);
 	} else {
@@ -162,8 +277,8 @@ attestation_verify_resp(Tpm2dToRemote *resp, RAttestationConfig *config, uint8_t
 
 	bool ret_pcr = true;
 	for (size_t i = 0; i < config->n_pcr_values; i++) {
-		pcr_strings[i] = convert_bin_to_hex_new(resp->pcr_values[i]->value.data,
-							resp->pcr_values[i]->value.len);
+		pcr_strings[i] = hex_encode_new(resp->pcr_values[i]->value.data,
+						resp->pcr_values[i]->value.len);
 		if (convert_hex_to_bin(config->pcr_values[i]->value,
 				       strlen(config->pcr_values[i]->value), pcr[i],
 				       config->halg)) {
@@ -216,16 +331,17 @@ attestation_verify_resp(Tpm2dToRemote *resp, RAttestationConfig *config, uint8_t
 	}
 
 	// Nonce verification
-	int ret_nonce = memcmp(tpms_attest.extraData.t.buffer, nonce, nonce_len);
+	bool ret_nonce = attestation_verify_nonce(resp, tpms_attest.extraData.t.buffer,
+						  tpms_attest.extraData.t.size, nonce, nonce_len);
 
-	char *nonce_str = convert_bin_to_hex_new(nonce, nonce_len);
-	char *rcv_nonce_str = convert_bin_to_hex_new(tpms_attest.extraData.t.buffer,
-						     tpms_attest.extraData.t.size);
+	char *nonce_str = hex_encode_new(nonce, nonce_len);
+	char *rcv_nonce_str =
+		hex_encode_new(tpms_attest.extraData.t.buffer, tpms_attest.extraData.t.size);
 	DEBUG("Nonce (sent %s, received %s) - %s", nonce_str, rcv_nonce_str,
-	      ret_nonce ? "VERIFICATION FAILED" : "VERIFICATION SUCCESSFUL");
+	      ret_nonce ? "VERIFICATION SUCCESSFUL" : "VERIFICATION FAILED");
 	mem_free0(nonce_str);
 	mem_free0(rcv_nonce_str);
-	if (ret_nonce) {
+	if (!ret_nonce) {
 		ret = false;
 		goto err;
 	}
@@ -255,8 +371,8 @@ attestation_verify_resp(Tpm2dToRemote *resp, RAttestationConfig *config, uint8_t
 	}
 
 	// Verify aggregated PCR value
-	char *pcr_digest = convert_bin_to_hex_new(tpms_attest.attested.quote.pcrDigest.t.buffer,
-						  tpms_attest.attested.quote.pcrDigest.t.size);
+	char *pcr_digest = hex_encode_new(tpms_attest.attested.quote.pcrDigest.t.buffer,
+					  tpms_attest.attested.quote.pcrDigest.t.size);
 	DEBUG("Quote PCR Digest: %s", pcr_digest);
 	mem_free0(pcr_digest);
 	SHA256_CTX ctx;
@@ -273,22 +389,48 @@ attestation_verify_resp(Tpm2dToRemote *resp, RAttestationConfig *config, uint8_t
 	}
 	INFO("VERIFY AGGREGATED PCR SUCCESSFUL");
 
+	const digest_index_t *digest_index = NULL;
+	if (attestation_digest_index_get(config, &digest_index) < 0) {
+		ERROR("Failed to load known-good digests");
+		goto err;
+	}
+
 	// PCR10 kernel module verification (from /sys/kernel/security/ima/binary_runtime_measuremts)
 	hash_algo_t hash_algo = size_to_hash_algo((int)resp->halg);
-	int ret_ima = ima_verify_binary_runtime_measurements(resp->ml_ima_entry.data,
-							     resp->ml_ima_entry.len,
-							     config->kmod_sign_cert, hash_algo,
-							     resp->pcr_values[10]->value.data);
+	char *ima_checkpoint = NULL;
+	if (config->ima_checkpoint_dir) {
+		// devices are told apart by their TPM certificate which signed the quote
+		uint8_t cert_hash[SHA256_DIGEST_LENGTH];
+		hash_sha256(cert_hash, resp->certificate.data, resp->certificate.len);
+		char *cert_hash_str = hex_encode_new(cert_hash, SHA256_DIGEST_LENGTH);
+		ima_checkpoint = mem_printf("%s/%s.ima", config->ima_checkpoint_dir, cert_hash_str);
+		mem_free0(cert_hash_str);
+	}
+	int ret_ima = ima_verify_binary_runtime_measurements(
+		resp->ml_ima_entry.data, resp->ml_ima_entry.len,
+		resp->has_ml_ima_offset ? resp->ml_ima_offset : 0, config->kmod_sign_cert,
+		digest_index, hash_algo, resp->pcr_values[10]->value.data, ima_checkpoint);
+	mem_free0(ima_checkpoint);
 	if (ret_ima != 0) {
 		ERROR("Failed to verify measurement list");
 		goto err;
 	}
 
-	// PCR11 container verification
-	int ret_container =
-		container_verify_runtime_measurements(resp->ml_container_entry,
-						      resp->n_ml_container_entry, hash_algo,
-						      resp->pcr_values[11]->value.data);
+	// PCR11 container verification, a partial list continues the former attestation
+	const uint8_t *container_pcr = NULL;
+	if (resp->has_ml_container_offset && resp->ml_container_offset > 0) {
+		if (!ml_state || !ml_state->boot_id ||
+		    resp->ml_container_offset != ml_state->container_offset ||
+		    resp->pcr_values[11]->value.len != ml_state->container_pcr_len) {
+			ERROR("Unexpected container measurement list offset %u",
+			      resp->ml_container_offset);
+			goto err;
+		}
+		container_pcr = ml_state->container_pcr;
+	}
+	int ret_container = container_verify_runtime_measurements(
+		resp->ml_container_entry, resp->n_ml_container_entry, hash_algo,
+		resp->pcr_values[11]->value.data, container_pcr, digest_index);
 	if (ret_container != 0) {
 		ERROR("Failed to verify container measurement list");
 		goto err;
@@ -297,6 +439,14 @@ attestation_verify_resp(Tpm2dToRemote *resp, RAttestationConfig *config, uint8_t
 	ret = true;
 
 err:
+	// without a verified state, the next request asks for the complete lists again
+	if (ml_state) {
+		if (ret)
+			attestation_ml_state_update(ml_state, resp);
+		else
+			attestation_ml_state_reset(ml_state);
+	}
+
 	DEBUG("---------------------------");
 	DEBUG("REMOTE ATTESTATION: %s", ret ? "SUCCESSFUL" : "FAILED");
 	DEBUG("---------------------------");
@@ -328,7 +478,7 @@ attestation_response_recv_cb(int fd, unsigned events, event_io_t *io, void *data
 	IF_NULL_GOTO_ERROR(resp, cleanup);
 
 	verified = attestation_verify_resp(resp, resp_cb_data->config, resp_cb_data->nonce,
-					   resp_cb_data->nonce_len);
+					   resp_cb_data->nonce_len, resp_cb_data->ml_state);
 
 	protobuf_free_message((ProtobufCMessage *)resp);
 	INFO("Handled response on connection %d", fd);
@@ -341,14 +491,21 @@ cleanup:
 	// call registerd handler with verification result
 	if (resp_cb_data->resp_verified_cb)
 		(resp_cb_data->resp_verified_cb)(verified);
+	if (resp_cb_data->host_verified_cb)
+		(resp_cb_data->host_verified_cb)(resp_cb_data->host, verified, resp_cb_data->data);
 	if (resp_cb_data->nonce)
 		mem_free0(resp_cb_data->nonce);
-	protobuf_free_message((ProtobufCMessage *)resp_cb_data->config);
+	if (resp_cb_data->free_config) {
+		attestation_digest_index_release(resp_cb_data->config);
+		protobuf_free_message((ProtobufCMessage *)resp_cb_data->config);
+	}
+	mem_free0(resp_cb_data->host);
 	mem_free0(resp_cb_data);
 }
 
-int
-attestation_do_request(const char *host, char *config_file, void (*resp_verified_cb)(bool))
+static int
+attestation_send_request(const char *host, RAttestationConfig *config,
+			 struct attestation_resp_cb_data *resp_cb_data)
 {
 	// Set nonce
 	size_t nonce_len = 8;
@@ -358,15 +515,6 @@ attestation_do_request(const char *host, char *config_file, void (*resp_verified
 		return -1;
 	}
 
-	// Read the configuration which contains information about the remote attestation request
-	// as well as the expected values for the PCRs
-	RAttestationConfig *config = rattestation_read_config_new(config_file);
-	if (!config) {
-		ERROR("Failed to read config file %s. The file has to be provided as a command line argument",
-		      config_file);
-		return -1;
-	}
-
 	// build RemoteToTpm2d message
 	RemoteToTpm2d msg = REMOTE_TO_TPM2D__INIT;
 
@@ -385,23 +533,37 @@ attestation_do_request(const char *host, char *config_file, void (*resp_verified
 		msg.pcrs = config->pcrs;
 	}
 
+	// only ask for the measurement list entries appended since the last attestation
+	attestation_ml_state_t *ml_state = resp_cb_data->ml_state;
+	if (ml_state && ml_state->boot_id) {
+		msg.boot_id = ml_state->boot_id;
+		msg.has_ml_container_offset = true;
+		msg.ml_container_offset = ml_state->container_offset;
+		// a partial IMA log can only be verified from a checkpoint
+		if (config->ima_checkpoint_dir) {
+			msg.has_ml_ima_offset = true;
+			msg.ml_ima_offset = ml_state->ima_offset;
+		}
+	}
+
 	int sock = sock_inet_create_and_connect(SOCK_STREAM, host, TPM2D_SERVICE_PORT);
 	IF_TRUE_RETVAL(sock < 0, -1);
 
 	DEBUG("Sending attestation request to TPM2D on %s:%s", host, TPM2D_SERVICE_PORT);
 
 	ssize_t msg_size = protobuf_send_message(sock, (ProtobufCMessage *)&msg);
-	IF_TRUE_RETVAL(msg_size < 0, -1);
+	if (msg_size < 0) {
+		close(sock);
+		return -1;
+	}
 
 	INFO("Send message with size %zd", msg_size);
 
-	char *nonce_str = convert_bin_to_hex_new(nonce, nonce_len);
+	char *nonce_str = hex_encode_new(nonce, nonce_len);
 	INFO("Request with Nonce %s, Request size=%zd", nonce_str, msg_size);
 	mem_free0(nonce_str);
 
-	struct attestation_resp_cb_data *resp_cb_data =
-		mem_new0(struct attestation_resp_cb_data, 1);
-	resp_cb_data->resp_verified_cb = resp_verified_cb;
+	resp_cb_data->host = mem_strdup(host);
 	resp_cb_data->nonce = mem_new0(uint8_t, nonce_len);
 	memcpy(resp_cb_data->nonce, nonce, nonce_len);
 	resp_cb_data->nonce_len = nonce_len;
@@ -415,3 +577,49 @@ attestation_do_request(const char *host, char *config_file, void (*resp_verified
 
 	return 0;
 }
+
+int
+attestation_do_request(const char *host, char *config_file, void (*resp_verified_cb)(bool))
+{
+	// Read the configuration which contains information about the remote attestation request
+	// as well as the expected values for the PCRs
+	RAttestationConfig *config = rattestation_read_config_new(config_file);
+	if (!config) {
+		ERROR("Failed to read config file %s. The file has to be provided as a command line argument",
+		      config_file);
+		return -1;
+	}
+
+	struct attestation_resp_cb_data *resp_cb_data =
+		mem_new0(struct attestation_resp_cb_data, 1);
+	resp_cb_data->resp_verified_cb = resp_verified_cb;
+	resp_cb_data->free_config = true;
+
+	if (attestation_send_request(host, config, resp_cb_data) < 0) {
+		protobuf_free_message((ProtobufCMessage *)config);
+		mem_free0(resp_cb_data);
+		return -1;
+	}
+	return 0;
+}
+
+int
+attestation_do_request_config(const char *host, RAttestationConfig *config,
+			      attestation_ml_state_t *ml_state,
+			      void (*host_verified_cb)(const char *host, bool verified, void *data),
+			      void *data)
+{
+	ASSERT(config);
+
+	struct attestation_resp_cb_data *resp_cb_data =
+		mem_new0(struct attestation_resp_cb_data, 1);
+	resp_cb_data->host_verified_cb = host_verified_cb;
+	resp_cb_data->data = data;
+	resp_cb_data->ml_state = ml_state;
+
+	if (attestation_send_request(host, config, resp_cb_data) < 0) {
+		mem_free0(resp_cb_data);
+		return -1;
+	}
+	return 0;
+}
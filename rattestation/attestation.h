@@ -1,5 +1,23 @@
 #ifndef IP_AGENT_ATTESTATION_H
 #define IP_AGENT_ATTESTATION_H
+
+#include <stdbool.h>
+
+#include "config.pb-c.h"
+
+/*
+ * Measurement list state of an attested device kept by the caller between
+ * repeated attestations, so that the device only sends the measurement list
+ * entries appended since the last successful attestation.
+ */
+typedef struct attestation_ml_state attestation_ml_state_t;
+
+attestation_ml_state_t *
+attestation_ml_state_new(void);
+
+void
+attestation_ml_state_free(attestation_ml_state_t *ml_state);
+
 /*
  * Do the attestation request
  *
@@ -11,4 +29,19 @@
  */
 int
 attestation_do_request(const char *host, char *config_file, void (*resp_verified_cb)(bool));
+
+/*
+ * Do the attestation request using an already loaded configuration
+ *
+ * Same as attestation_do_request, but the configuration is kept by the caller
+ * and may be shared by many concurrent requests. The verification result is
+ * provided together with the attested host and data to host_verified_cb.
+ * If ml_state is given, it is used and updated by the request, which must not
+ * run concurrently with another request of the same ml_state.
+ */
+int
+attestation_do_request_config(const char *host, RAttestationConfig *config,
+			      attestation_ml_state_t *ml_state,
+			      void (*host_verified_cb)(const char *host, bool verified, void *data),
+			      void *data);
 #endif /* IP_AGENT_ATTESTATION_H */
@@ -28,35 +28,158 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <openssl/evp.h>
 #include <openssl/sha.h>
 
 #include "common/mem.h"
 #include "common/macro.h"
+#include "common/hex.h"
 
 #include "hash.h"
+#include "digest_index.h"
+#include "container_verify.h"
+
+/*
+ * Upper bound of threads validating the entries of one measurement list, each of
+ * which takes at least CONTAINER_VERIFY_ENTRIES_PER_THREAD entries
+ */
+#define CONTAINER_VERIFY_THREADS_MAX 8
+#define CONTAINER_VERIFY_ENTRIES_PER_THREAD 64
+
+typedef struct {
+	MlContainerEntry **entries;
+	size_t len;
+	size_t next; // next entry to be validated, protected by lock
+	pthread_mutex_t lock;
+	hash_algo_t pcr_hash_algo;
+	const digest_index_t *index; // NULL if any digest is accepted
+	bool failed;
+} container_verify_t;
+
+/*
+ * Checks a single entry independently of all others, i.e., its hash algorithm and,
+ * if configured, that its data hash is one of the known-good container digests.
+ */
+static int
+container_verify_entry(const container_verify_t *verify, const MlContainerEntry *entry)
+{
+	size_t hash_size = hash_algo_to_size(verify->pcr_hash_algo);
+
+	if (strcmp(entry->template_hash_alg, hash_algo_to_string(verify->pcr_hash_algo))) {
+		ERROR("Failed to verify container runtime measurement list: Hash algos do not match");
+		return -1;
+	}
+	// the replay extends the PCR by hash_size bytes of the data hash
+	if (entry->data_hash.len < hash_size) {
+		ERROR("Invalid data hash length %zu of container %s", entry->data_hash.len,
+		      entry->filename);
+		return -1;
+	}
+	if (verify->index && !digest_index_contains(verify->index, DIGEST_INDEX_CONTAINER,
+						     entry->data_hash.data, entry->data_hash.len)) {
+		char *digest = hex_encode_new(entry->data_hash.data, entry->data_hash.len);
+		ERROR("Container %s has unknown digest %s", entry->filename, digest);
+		mem_free0(digest);
+		return -1;
+	}
+
+	TRACE("Verified container %s", entry->filename);
+	return 0;
+}
+
+static void *
+container_verify_worker(void *data)
+{
+	container_verify_t *verify = data;
+
+	for (;;) {
+		pthread_mutex_lock(&verify->lock);
+		size_t i = verify->failed ? verify->len : verify->next;
+		verify->next = i + CONTAINER_VERIFY_ENTRIES_PER_THREAD;
+		pthread_mutex_unlock(&verify->lock);
+		if (i >= verify->len)
+			break;
+
+		size_t end = MIN(i + CONTAINER_VERIFY_ENTRIES_PER_THREAD, verify->len);
+		for (; i < end; i++) {
+			if (container_verify_entry(verify, verify->entries[i]) == 0)
+				continue;
+			// stop all threads at their next batch
+			pthread_mutex_lock(&verify->lock);
+			verify->failed = true;
+			pthread_mutex_unlock(&verify->lock);
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Validates all entries on up to CONTAINER_VERIFY_THREADS_MAX threads, which only
+ * read the list and the digest index.
+ */
+static int
+container_verify_entries(container_verify_t *verify)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t nthreads = MIN(CONTAINER_VERIFY_THREADS_MAX,
+			      (verify->len + CONTAINER_VERIFY_ENTRIES_PER_THREAD - 1) /
+				      CONTAINER_VERIFY_ENTRIES_PER_THREAD);
+	if (cpus > 0)
+		nthreads = MIN(nthreads, (size_t)cpus);
+
+	pthread_mutex_init(&verify->lock, NULL);
+
+	// the calling thread is a worker on its own
+	pthread_t threads[CONTAINER_VERIFY_THREADS_MAX];
+	size_t started = 0;
+	for (; started + 1 < nthreads; started++) {
+		if (pthread_create(&threads[started], NULL, container_verify_worker, verify)) {
+			WARN("Could not start container verification thread");
+			break;
+		}
+	}
+	container_verify_worker(verify);
+	for (size_t i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&verify->lock);
+
+	return verify->failed ? -1 : 0;
+}
 
 int
 container_verify_runtime_measurements(MlContainerEntry **entries, size_t len,
-				      hash_algo_t pcr_hash_algo, uint8_t *pcr_tpm)
+				      hash_algo_t pcr_hash_algo, uint8_t *pcr_tpm,
+				      const uint8_t *pcr_start, const digest_index_t *index)
 {
 	int hash_size = hash_algo_to_size(pcr_hash_algo);
 	IF_FALSE_RETVAL_ERROR(hash_size > 0, -1);
 
-	uint8_t pcr_calculated[hash_size];
+	bool known_only = digest_index_has_type(index, DIGEST_INDEX_CONTAINER);
+	container_verify_t verify = { .entries = entries,
+				      .len = len,
+				      .pcr_hash_algo = pcr_hash_algo,
+				      .index = known_only ? index : NULL };
 
-	// Static PCRs are initialized with zero's
-	memset(pcr_calculated, 0, hash_size);
+	if (container_verify_entries(&verify)) {
+		ERROR("Failed to verify container measurement list entries");
+		return -1;
+	}
 
-	for (size_t i = 0; i < len; i++) {
-		if (strcmp(entries[i]->template_hash_alg, hash_algo_to_string(pcr_hash_algo))) {
-			ERROR("Failed to verify container runtime measurement list: Hash algos do not match");
-			return -1;
-		}
+	// the PCR replay is inherently sequential and only left with the hash chain
+	uint8_t pcr_calculated[hash_size];
 
-		INFO("Verifying container %s", entries[i]->filename);
+	// Static PCRs are initialized with zero's, a partial list continues the former replay
+	if (pcr_start)
+		memcpy(pcr_calculated, pcr_start, hash_size);
+	else
+		memset(pcr_calculated, 0, hash_size);
 
+	for (size_t i = 0; i < len; i++) {
 		if (pcr_hash_algo == HASH_ALGO_SHA256) {
 			SHA256_CTX c_256;
 			SHA256_Init(&c_256);
@@ -77,8 +200,9 @@ container_verify_runtime_measurements(MlContainerEntry **entries, size_t len,
 		return -1;
 	}
 
-	INFO("Verify container TPM PCR SUCCESSFUL");
-	WARN("Verify container signatures not yet implemented");
+	INFO("Verify container TPM PCR SUCCESSFUL (%zu entries)", len);
+	if (!known_only)
+		WARN("No known container digests configured, accepting any container");
 
 	return 0;
-}
\ No newline at end of file
+}
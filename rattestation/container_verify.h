@@ -24,8 +24,19 @@
 #ifndef CONTAINER_VERIFY_H_
 #define CONTAINER_VERIFY_H_
 
+/**
+ * Verifies the container measurement list against the TPM PCR. The entries are
+ * validated in parallel against the known-good digests first, then the PCR is replayed.
+ *
+ * @param pcr_start the PCR value replayed over the list entries before entries[0],
+ *	  NULL if entries holds the whole list
+ * @param index the known-good digests, any container is accepted if it holds no
+ *	  container digests
+ * @return 0 if the list was verified successfully, -1 otherwise
+ */
 int
 container_verify_runtime_measurements(MlContainerEntry **entries, size_t len,
-				      hash_algo_t pcr_hash_algo, uint8_t *pcr_tpm);
+				      hash_algo_t pcr_hash_algo, uint8_t *pcr_tpm,
+				      const uint8_t *pcr_start, const digest_index_t *index);
 
 #endif // CONTAINER_VERIFY_H_
\ No newline at end of file
@@ -0,0 +1,339 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "digest_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/file.h"
+#include "common/hex.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define DIGEST_INDEX_MAGIC "RATDIGX1"
+#define DIGEST_INDEX_FANOUT 256
+#define DIGEST_INDEX_DIGEST_LEN_MAX 64
+
+/*
+ * The index consists of this header, the section table and the sorted digests of all
+ * sections. It is stored in host byte order, like the IMA checkpoints.
+ */
+typedef struct {
+	char magic[8];
+	uint32_t n_sections;
+	uint32_t reserved;
+} digest_index_hdr_t;
+
+typedef struct {
+	uint32_t type;
+	uint32_t digest_len;
+	uint64_t count;
+	uint64_t offset;		      // of the sorted digests from the start of the index
+	uint32_t fanout[DIGEST_INDEX_FANOUT]; // number of digests with a first byte <= i
+} digest_index_section_t;
+
+struct digest_index {
+	uint8_t *data;
+	size_t size;
+	bool mapped; // data is mapped from a file, otherwise allocated
+	const digest_index_section_t *sections;
+	uint32_t n_sections;
+};
+
+typedef struct {
+	uint8_t *digest;
+	size_t len;
+} digest_index_entry_t;
+
+static int
+digest_index_entry_cmp(const void *a, const void *b)
+{
+	const digest_index_entry_t *x = a;
+	const digest_index_entry_t *y = b;
+
+	if (x->len != y->len)
+		return x->len < y->len ? -1 : 1;
+	return memcmp(x->digest, y->digest, x->len);
+}
+
+static void
+digest_index_entries_free(digest_index_entry_t *entries, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		mem_free0(entries[i].digest);
+	mem_free0(entries);
+}
+
+/*
+ * Decodes the hex digests and sorts them by length and value without duplicates.
+ */
+static digest_index_entry_t *
+digest_index_entries_new(char **digests, size_t n, size_t *n_entries)
+{
+	digest_index_entry_t *entries = mem_new0(digest_index_entry_t, MAX(n, 1));
+
+	for (size_t i = 0; i < n; i++) {
+		entries[i].digest = hex_decode_new(digests[i], &entries[i].len);
+		if (!entries[i].digest || entries[i].len == 0 ||
+		    entries[i].len > DIGEST_INDEX_DIGEST_LEN_MAX) {
+			ERROR("Invalid digest %s", digests[i]);
+			digest_index_entries_free(entries, n);
+			return NULL;
+		}
+	}
+
+	qsort(entries, n, sizeof(digest_index_entry_t), digest_index_entry_cmp);
+
+	size_t k = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (k > 0 && !digest_index_entry_cmp(&entries[k - 1], &entries[i])) {
+			mem_free0(entries[i].digest);
+			continue;
+		}
+		entries[k++] = entries[i];
+	}
+	*n_entries = k;
+	return entries;
+}
+
+/*
+ * Checks the section table and bounds of an index before it is used, as a mapped
+ * file may be truncated or corrupt.
+ */
+static digest_index_t *
+digest_index_new_from_buf(uint8_t *data, size_t size, bool mapped)
+{
+	const digest_index_hdr_t *hdr = (const digest_index_hdr_t *)data;
+
+	if (size < sizeof(digest_index_hdr_t) ||
+	    memcmp(hdr->magic, DIGEST_INDEX_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->n_sections >
+		    (size - sizeof(digest_index_hdr_t)) / sizeof(digest_index_section_t)) {
+		ERROR("Invalid digest index header");
+		return NULL;
+	}
+
+	const digest_index_section_t *sections =
+		(const digest_index_section_t *)(data + sizeof(digest_index_hdr_t));
+	for (uint32_t i = 0; i < hdr->n_sections; i++) {
+		const digest_index_section_t *s = &sections[i];
+		if (s->digest_len == 0 || s->digest_len > DIGEST_INDEX_DIGEST_LEN_MAX ||
+		    s->offset > size || s->count > (size - s->offset) / s->digest_len ||
+		    s->fanout[DIGEST_INDEX_FANOUT - 1] != s->count) {
+			ERROR("Invalid digest index section %u", i);
+			return NULL;
+		}
+		for (size_t b = 1; b < DIGEST_INDEX_FANOUT; b++) {
+			if (s->fanout[b] < s->fanout[b - 1]) {
+				ERROR("Invalid digest index section %u", i);
+				return NULL;
+			}
+		}
+	}
+
+	digest_index_t *index = mem_new0(digest_index_t, 1);
+	index->data = data;
+	index->size = size;
+	index->mapped = mapped;
+	index->sections = sections;
+	index->n_sections = hdr->n_sections;
+	return index;
+}
+
+digest_index_t *
+digest_index_new_from_config(const RAttestationConfig *config)
+{
+	ASSERT(config);
+
+	struct {
+		digest_index_type_t type;
+		digest_index_entry_t *entries;
+		size_t n;
+	} types[] = { { DIGEST_INDEX_CONTAINER, NULL, 0 }, { DIGEST_INDEX_IMA, NULL, 0 } };
+	digest_index_t *index = NULL;
+
+	types[0].entries = digest_index_entries_new(config->container_digests,
+						    config->n_container_digests, &types[0].n);
+	types[1].entries =
+		digest_index_entries_new(config->ima_digests, config->n_ima_digests, &types[1].n);
+	IF_TRUE_GOTO(!types[0].entries || !types[1].entries, out);
+
+	// one section per type and digest length
+	size_t n_sections = 0;
+	size_t size = sizeof(digest_index_hdr_t);
+	for (size_t t = 0; t < ARRAY_SIZE(types); t++) {
+		for (size_t i = 0; i < types[t].n; i++) {
+			if (i == 0 || types[t].entries[i].len != types[t].entries[i - 1].len)
+				n_sections++;
+			size += types[t].entries[i].len;
+		}
+	}
+	size += n_sections * sizeof(digest_index_section_t);
+
+	uint8_t *data = mem_alloc0(size);
+	digest_index_hdr_t *hdr = (digest_index_hdr_t *)data;
+	memcpy(hdr->magic, DIGEST_INDEX_MAGIC, sizeof(hdr->magic));
+	hdr->n_sections = n_sections;
+
+	digest_index_section_t *s = (digest_index_section_t *)(data + sizeof(digest_index_hdr_t));
+	size_t offset = sizeof(digest_index_hdr_t) + n_sections * sizeof(digest_index_section_t);
+	for (size_t t = 0; t < ARRAY_SIZE(types); t++) {
+		digest_index_entry_t *entries = types[t].entries;
+		for (size_t i = 0; i < types[t].n; s++) {
+			s->type = types[t].type;
+			s->digest_len = entries[i].len;
+			s->offset = offset;
+			for (; i < types[t].n && entries[i].len == s->digest_len; i++) {
+				memcpy(data + offset, entries[i].digest, s->digest_len);
+				offset += s->digest_len;
+				s->fanout[entries[i].digest[0]]++;
+				s->count++;
+			}
+			for (size_t b = 1; b < DIGEST_INDEX_FANOUT; b++)
+				s->fanout[b] += s->fanout[b - 1];
+		}
+	}
+
+	index = digest_index_new_from_buf(data, size, false);
+	if (!index)
+		mem_free0(data);
+out:
+	if (types[0].entries)
+		digest_index_entries_free(types[0].entries, types[0].n);
+	if (types[1].entries)
+		digest_index_entries_free(types[1].entries, types[1].n);
+	return index;
+}
+
+digest_index_t *
+digest_index_new_from_file(const char *file)
+{
+	ASSERT(file);
+
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	IF_TRUE_RETVAL_ERROR_ERRNO(fd < 0, NULL);
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+		ERROR("Failed to get size of digest index %s", file);
+		close(fd);
+		return NULL;
+	}
+
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		ERROR_ERRNO("Failed to map digest index %s", file);
+		return NULL;
+	}
+
+	digest_index_t *index = digest_index_new_from_buf(data, st.st_size, true);
+	if (!index) {
+		munmap(data, st.st_size);
+		return NULL;
+	}
+
+	DEBUG("Mapped digest index %s with %u sections", file, index->n_sections);
+	return index;
+}
+
+void
+digest_index_free(digest_index_t *index)
+{
+	IF_NULL_RETURN(index);
+
+	if (index->mapped)
+		munmap(index->data, index->size);
+	else
+		mem_free0(index->data);
+	mem_free0(index);
+}
+
+int
+digest_index_write(const digest_index_t *index, const char *file)
+{
+	ASSERT(index);
+	ASSERT(file);
+
+	// a verifier may have mapped the former index, thus it is replaced instead of rewritten
+	char *tmp = mem_printf("%s.tmp", file);
+	int ret = file_write(tmp, (const char *)index->data, index->size);
+	if (ret < 0 || rename(tmp, file) < 0) {
+		ERROR_ERRNO("Failed to write digest index %s", file);
+		unlink(tmp);
+		ret = -1;
+	}
+	mem_free0(tmp);
+	return ret < 0 ? -1 : 0;
+}
+
+bool
+digest_index_has_type(const digest_index_t *index, digest_index_type_t type)
+{
+	IF_NULL_RETVAL(index, false);
+
+	for (uint32_t i = 0; i < index->n_sections; i++) {
+		if (index->sections[i].type == type && index->sections[i].count > 0)
+			return true;
+	}
+	return false;
+}
+
+bool
+digest_index_contains(const digest_index_t *index, digest_index_type_t type,
+		      const uint8_t *digest, size_t digest_len)
+{
+	IF_NULL_RETVAL(index, false);
+	IF_TRUE_RETVAL(digest_len == 0, false);
+
+	for (uint32_t i = 0; i < index->n_sections; i++) {
+		const digest_index_section_t *s = &index->sections[i];
+		if (s->type != type || s->digest_len != digest_len)
+			continue;
+
+		// only the bucket of digests with the same first byte is searched
+		const uint8_t *base = index->data + s->offset;
+		size_t lo = digest[0] ? s->fanout[digest[0] - 1] : 0;
+		size_t hi = s->fanout[digest[0]];
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			int cmp = memcmp(base + mid * digest_len, digest, digest_len);
+			if (cmp == 0)
+				return true;
+			if (cmp < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return false;
+	}
+	return false;
+}
@@ -0,0 +1,91 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file digest_index.h
+ *
+ * Index of the known-good digests of a verifier configuration, i.e. container image
+ * hashes and IMA file hashes. The digests of each kind and length are stored sorted
+ * together with a table of 256 bucket bounds indexed by their first byte, so that a
+ * lookup is a short binary search inside one bucket. The index is either built from
+ * the text configuration or compiled offline into a file which is mapped as is.
+ */
+
+#ifndef DIGEST_INDEX_H_
+#define DIGEST_INDEX_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.pb-c.h"
+
+typedef enum {
+	DIGEST_INDEX_CONTAINER = 1, //!< data hashes of container images
+	DIGEST_INDEX_IMA,	    //!< hashes of files measured by IMA
+} digest_index_type_t;
+
+typedef struct digest_index digest_index_t;
+
+/**
+ * Builds the index from the container_digests and ima_digests of config.
+ *
+ * @return the index, NULL if config contains an invalid digest
+ */
+digest_index_t *
+digest_index_new_from_config(const RAttestationConfig *config);
+
+/**
+ * Maps a compiled index file read-only.
+ *
+ * @return the index, NULL if the file could not be mapped or is no valid index
+ */
+digest_index_t *
+digest_index_new_from_file(const char *file);
+
+void
+digest_index_free(digest_index_t *index);
+
+/**
+ * Writes the index to file, which can then be loaded by digest_index_new_from_file.
+ *
+ * @return 0 on success, -1 otherwise
+ */
+int
+digest_index_write(const digest_index_t *index, const char *file);
+
+/**
+ * Returns whether the index holds any digest of the given type, i.e. whether only
+ * known digests of this type are to be accepted.
+ */
+bool
+digest_index_has_type(const digest_index_t *index, digest_index_type_t type);
+
+/**
+ * Looks up a digest of the given type.
+ */
+bool
+digest_index_contains(const digest_index_t *index, digest_index_type_t type,
+		      const uint8_t *digest, size_t digest_len);
+
+#endif // DIGEST_INDEX_H_
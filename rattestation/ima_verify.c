@@ -35,6 +35,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <inttypes.h>
 
 #include <openssl/pkcs7.h>
 #include <openssl/ssl.h>
@@ -42,6 +43,9 @@
 #include <openssl/evp.h>
 
 #include "common/file.h"
+#include "common/hashmap.h"
+#include "common/hex.h"
+#include "common/list.h"
 #include "common/ssl_util.h"
 #include "common/logf.h"
 #include "common/mem.h"
@@ -49,11 +53,16 @@
 
 #include "hash.h"
 #include "modsig.h"
+#include "digest_index.h"
 #include "ima_verify.h"
 
 #define TCG_EVENT_NAME_LEN_MAX 255
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+#define IMA_CHECKPOINT_MAGIC 0x494d4143 // "IMAC"
+
+#define IMA_SIG_CACHE_MAX 8192
+
 /*
  * IMA template descriptor definition
  */
@@ -93,6 +102,52 @@ struct event {
 	uint8_t *template_data;
 };
 
+/*
+ * Verification state of the IMA log of one attested device. It is stored as header
+ * followed by the template digests of all entries whose template data already passed
+ * verify_template_data, so that only entries appended since the last successful
+ * attestation need to be replayed and only new signatures need to be checked.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t hash_size;
+	uint8_t cert_hash[SHA256_DIGEST_LENGTH]; // kmod cert the signatures were verified with
+	uint64_t offset;			 // bytes of the log already replayed into pcr
+	uint64_t n_entries;			 // entries of the log already replayed into pcr
+	uint8_t pcr[SHA256_DIGEST_LENGTH];
+	uint64_t n_verified;
+} ima_checkpoint_hdr_t;
+
+typedef struct {
+	ima_checkpoint_hdr_t hdr;
+	uint8_t *verified; // n_verified template digests, SHA_DIGEST_LENGTH each
+	size_t verified_size;
+	hashmap_t *verified_map;
+} ima_checkpoint_t;
+
+/*
+ * A kmod signing certificate with its public key parsed once for all signatures
+ */
+typedef struct {
+	uint8_t hash[SHA256_DIGEST_LENGTH];
+	EVP_PKEY *pkey;
+} ima_cert_t;
+
+/*
+ * Result of a signature verification, keyed by the hash over certificate, signed
+ * digest and signature blob. Entries are kept in least recently used order.
+ */
+typedef struct {
+	uint8_t key[SHA256_DIGEST_LENGTH];
+	int result;
+	list_t *elem;
+} ima_sig_cache_entry_t;
+
+// certificates and verification results are kept for all attestations of this process
+static hashmap_t *ima_certs = NULL;
+static hashmap_t *ima_sig_cache = NULL;
+static list_queue_t ima_sig_cache_lru;
+
 // Known IMA template descriptors
 static ima_template_desc_t ima_template_desc[] = { { .name = "ima", .fmt = "d|n" },
 						   { .name = "ima-ng", .fmt = "d-ng|n-ng" },
@@ -115,16 +170,9 @@ print_module_name(uint8_t *buffer, size_t len)
 static void
 print_data(uint8_t *buf, size_t len, const char *info)
 {
-	uint32_t l = 2 * len + strlen(info) + 3;
-	char s[l];
-	uint32_t count = 0;
-	if (info) {
-		count += snprintf(s + count, sizeof(s) - count, "%s: ", info);
-	}
-	for (uint32_t i = 0; i < len; i++) {
-		count += snprintf(s + count, sizeof(s) - count, "%02x", buf[i]);
-	}
-	TRACE("%s", s);
+	char *hex = hex_encode_new(buf, len);
+	TRACE("%s: %s", info ? info : "", hex);
+	mem_free0(hex);
 }
 
 static int
@@ -140,8 +188,133 @@ buf_read(void *dest, uint8_t **ptr, size_t size, size_t *remain)
 	return 0;
 }
 
+static const ima_cert_t *
+ima_cert_get(const char *cert)
+{
+	uint8_t hash[SHA256_DIGEST_LENGTH];
+	hash_sha256(hash, (uint8_t *)cert, strlen(cert));
+
+	if (!ima_certs)
+		ima_certs = hashmap_new();
+
+	ima_cert_t *ima_cert = hashmap_get(ima_certs, hash, sizeof(hash));
+	if (ima_cert)
+		return ima_cert;
+
+	EVP_PKEY *pkey = ssl_pubkey_from_cert_buf_new(cert, strlen(cert) + 1);
+	IF_NULL_RETVAL_ERROR(pkey, NULL);
+
+	ima_cert = mem_new0(ima_cert_t, 1);
+	memcpy(ima_cert->hash, hash, sizeof(hash));
+	ima_cert->pkey = pkey;
+	hashmap_put(ima_certs, hash, sizeof(hash), ima_cert);
+	return ima_cert;
+}
+
+static ima_sig_cache_entry_t *
+ima_sig_cache_get(const uint8_t *key)
+{
+	IF_NULL_RETVAL(ima_sig_cache, NULL);
+
+	ima_sig_cache_entry_t *entry = hashmap_get(ima_sig_cache, key, SHA256_DIGEST_LENGTH);
+	IF_NULL_RETVAL(entry, NULL);
+
+	// move to the most recently used end
+	list_queue_unlink(&ima_sig_cache_lru, entry->elem);
+	list_queue_append(&ima_sig_cache_lru, entry);
+	entry->elem = ima_sig_cache_lru.tail;
+	return entry;
+}
+
+static void
+ima_sig_cache_put(const uint8_t *key, int result)
+{
+	if (!ima_sig_cache)
+		ima_sig_cache = hashmap_new();
+
+	if (hashmap_size(ima_sig_cache) >= IMA_SIG_CACHE_MAX) {
+		ima_sig_cache_entry_t *lru = ima_sig_cache_lru.head->data;
+		hashmap_remove(ima_sig_cache, lru->key, sizeof(lru->key));
+		list_queue_unlink(&ima_sig_cache_lru, lru->elem);
+		mem_free0(lru);
+	}
+
+	ima_sig_cache_entry_t *entry = mem_new0(ima_sig_cache_entry_t, 1);
+	memcpy(entry->key, key, sizeof(entry->key));
+	entry->result = result;
+	list_queue_append(&ima_sig_cache_lru, entry);
+	entry->elem = ima_sig_cache_lru.tail;
+	hashmap_put(ima_sig_cache, entry->key, sizeof(entry->key), entry);
+}
+
+static void
+ima_sig_cache_key(uint8_t *key, const ima_cert_t *cert, const uint8_t *digest, size_t digest_len,
+		  const uint8_t *sig, size_t sig_len)
+{
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	EVP_DigestInit(ctx, EVP_sha256());
+	EVP_DigestUpdate(ctx, cert->hash, sizeof(cert->hash));
+	EVP_DigestUpdate(ctx, digest, digest_len);
+	EVP_DigestUpdate(ctx, sig, sig_len);
+	EVP_DigestFinal(ctx, key, NULL);
+	EVP_MD_CTX_free(ctx);
+}
+
+/*
+ * Verifies the signature of digest stored in the template field sig_field. The field is
+ * either a raw signature or, if is_modsig is set, an appended module signature which
+ * has to be parsed first. Definite results are cached, so that files measured on many
+ * devices or boots only need to be verified once.
+ */
 static int
-verify_template_data(struct event *template, const char *cert)
+ima_verify_signature(const ima_cert_t *cert, const uint8_t *digest, size_t digest_len,
+		     const uint8_t *sig_field, size_t sig_field_len, bool is_modsig)
+{
+	uint8_t key[SHA256_DIGEST_LENGTH];
+	int ret;
+
+	IF_NULL_RETVAL_ERROR(digest, -1);
+	IF_TRUE_RETVAL_ERROR(!is_modsig && sig_field_len <= sizeof(struct signature_v2_hdr), -1);
+
+	ima_sig_cache_key(key, cert, digest, digest_len, sig_field, sig_field_len);
+	ima_sig_cache_entry_t *entry = ima_sig_cache_get(key);
+	if (entry) {
+		TRACE("Signature verification result cached");
+		return entry->result;
+	}
+
+	print_data((uint8_t *)digest, digest_len, "Digest");
+
+	if (is_modsig) {
+		sig_info_t *sig_info = modsig_parse_new((const char *)sig_field, sig_field_len);
+		if (!sig_info) {
+			ERROR("Failed to parse module signature");
+			return -1;
+		}
+		print_data(sig_info->sig, sig_info->sig_len, "Signature");
+		ret = ssl_verify_signature_from_digest_pkey(cert->pkey,
+							    (const uint8_t *)sig_info->sig,
+							    sig_info->sig_len, digest, digest_len,
+							    "SHA256");
+		modsig_free(sig_info);
+	} else {
+		const struct signature_v2_hdr *sig = (const struct signature_v2_hdr *)sig_field;
+		size_t sig_len = sig_field_len - sizeof(struct signature_v2_hdr);
+
+		print_data((uint8_t *)sig->sig, sig_len, "Signature");
+		ret = ssl_verify_signature_from_digest_pkey(cert->pkey, sig->sig, sig_len, digest,
+							    digest_len, "SHA256");
+	}
+
+	// unexpected errors (-2) are not cached, they may not occur on a retry
+	if (ret == 0 || ret == -1)
+		ima_sig_cache_put(key, ret);
+
+	return ret;
+}
+
+static int
+verify_template_data(struct event *template, const ima_cert_t *cert, const digest_index_t *index)
 {
 	int offset = 0;
 	size_t i;
@@ -193,6 +366,13 @@ verify_template_data(struct event *template, const char *cert)
 				digest_len = field_len - algo_len;
 
 			} else if (strncmp(f, "sig", 3) == 0) {
+				// known-good files are accepted without the costly signature check
+				if (digest_index_contains(index, DIGEST_INDEX_IMA, digest,
+							  digest_len)) {
+					TRACE("%s: Known file digest, signature not verified", f);
+					continue;
+				}
+
 				if (template->template_data_len <= (uint32_t)offset) {
 					WARN("%s: No signature present", f);
 					continue;
@@ -205,20 +385,8 @@ verify_template_data(struct event *template, const char *cert)
 					continue;
 				}
 
-				struct signature_v2_hdr *sig =
-					(struct signature_v2_hdr *)(template->template_data +
-								    offset);
-
-				print_data(digest, digest_len, "Digest");
-				print_data(sig->sig, field_len - sizeof(struct signature_v2_hdr),
-					   "Signature");
-
-				int retssl = ssl_verify_signature_from_digest(
-					(const char *)cert,
-					strlen(cert) +
-						1, //keep the NULL terminator to preserve previous behaviour
-					sig->sig, field_len - sizeof(struct signature_v2_hdr),
-					digest, digest_len, "SHA256");
+				int retssl = ima_verify_signature(cert, digest, digest_len,
+								  field_buf, field_len, false);
 				if (retssl != 0) {
 					ERROR("Signature verification FAILED for %s", f);
 					ret = -1;
@@ -241,25 +409,9 @@ verify_template_data(struct event *template, const char *cert)
 				digest_len = field_len - algo_len;
 
 			} else if (strcmp(f, "modsig") == 0) {
-				sig_info_t *sig_info = NULL;
-				sig_info = modsig_parse_new(
-					(const char *)(template->template_data + offset),
-					field_len);
-				if (!sig_info) {
-					ERROR("Failed to parse module signature");
-					ret = -1;
-					goto out;
-				}
-
-				print_data(digest, digest_len, "Digest");
-				print_data(sig_info->sig, sig_info->sig_len, "Signature");
-
-				int retssl = ssl_verify_signature_from_digest(
-					(const char *)cert,
-					strlen(cert) +
-						1, //keep the NULL terminator to preserve previous behaviour
-					(const uint8_t *)sig_info->sig, sig_info->sig_len, digest,
-					digest_len, "SHA256");
+				int retssl = ima_verify_signature(cert, digest, digest_len,
+								  template->template_data + offset,
+								  field_len, true);
 				if (retssl != 0) {
 					ERROR("Signature verification FAILED for %s", f);
 					ret = -1;
@@ -268,8 +420,6 @@ verify_template_data(struct event *template, const char *cert)
 					INFO("Signature verification SUCCESSFUL for %s", f);
 				}
 
-				modsig_free(sig_info);
-
 			} else if (strncmp(f, "n-ng", 4) == 0) {
 				print_module_name(template->template_data + offset, field_len);
 			}
@@ -328,25 +478,112 @@ verify_template_hash(struct event *template)
 	return -1;
 }
 
-int
-ima_verify_binary_runtime_measurements(uint8_t *buf, size_t size, const char *cert,
-				       hash_algo_t template_hash_algo, uint8_t *pcr_tpm)
+static void
+ima_checkpoint_add_verified(ima_checkpoint_t *cp, const uint8_t *digest)
 {
-	ASSERT(buf);
-	ASSERT(cert);
-	ASSERT(pcr_tpm);
+	if ((cp->hdr.n_verified + 1) * SHA_DIGEST_LENGTH > cp->verified_size) {
+		cp->verified_size = MAX(2 * cp->verified_size, 64 * SHA_DIGEST_LENGTH);
+		cp->verified = mem_realloc(cp->verified, cp->verified_size);
+	}
+	memcpy(cp->verified + cp->hdr.n_verified * SHA_DIGEST_LENGTH, digest, SHA_DIGEST_LENGTH);
+	cp->hdr.n_verified++;
+	// the map only serves as set, its values are never dereferenced
+	hashmap_put(cp->verified_map, digest, SHA_DIGEST_LENGTH, cp);
+}
 
-	struct event template;
-	uint8_t *ptr = buf;
-	size_t remain = size;
+static void
+ima_checkpoint_reset(ima_checkpoint_t *cp)
+{
+	cp->hdr.offset = 0;
+	cp->hdr.n_entries = 0;
+	// PCRs are initialized with zero's
+	memset(cp->hdr.pcr, 0, sizeof(cp->hdr.pcr));
+}
 
-	int hash_size = hash_algo_to_size(template_hash_algo);
-	IF_FALSE_RETVAL_ERROR(hash_size > 0, -1);
+static void
+ima_checkpoint_free(ima_checkpoint_t *cp)
+{
+	hashmap_free(cp->verified_map);
+	mem_free0(cp->verified);
+	mem_free0(cp);
+}
+
+/**
+ * Loads the checkpoint from file if it exists and still matches cert and hash_size,
+ * otherwise a fresh checkpoint starting at the beginning of the log is returned.
+ */
+static ima_checkpoint_t *
+ima_checkpoint_new(const char *file, const ima_cert_t *cert, int hash_size)
+{
+	const uint8_t *cert_hash = cert->hash;
+
+	ima_checkpoint_t *cp = mem_new0(ima_checkpoint_t, 1);
+	cp->verified_map = hashmap_new();
+	cp->hdr.magic = IMA_CHECKPOINT_MAGIC;
+	cp->hdr.hash_size = hash_size;
+	memcpy(cp->hdr.cert_hash, cert_hash, sizeof(cp->hdr.cert_hash));
+
+	IF_TRUE_RETVAL(!file || !file_exists(file), cp);
+
+	off_t size = file_size(file);
+	IF_TRUE_RETVAL(size < (off_t)sizeof(ima_checkpoint_hdr_t), cp);
+
+	uint8_t *data = (uint8_t *)file_read_new(file, size);
+	IF_NULL_RETVAL(data, cp);
+
+	ima_checkpoint_hdr_t hdr;
+	memcpy(&hdr, data, sizeof(hdr));
+	if (hdr.magic != IMA_CHECKPOINT_MAGIC || hdr.hash_size != (uint32_t)hash_size ||
+	    memcmp(hdr.cert_hash, cert_hash, sizeof(hdr.cert_hash)) ||
+	    hdr.n_verified > (size - sizeof(hdr)) / SHA_DIGEST_LENGTH) {
+		WARN("Ignoring stale or invalid IMA checkpoint %s", file);
+		mem_free0(data);
+		return cp;
+	}
 
-	uint8_t pcr[hash_size];
+	uint64_t n_verified = hdr.n_verified;
+	hdr.n_verified = 0;
+	cp->hdr = hdr;
+	for (uint64_t i = 0; i < n_verified; i++)
+		ima_checkpoint_add_verified(cp, data + sizeof(hdr) + i * SHA_DIGEST_LENGTH);
 
-	// PCRs are initialized with zero's
-	memset(pcr, 0, hash_size);
+	DEBUG("Loaded IMA checkpoint %s at entry %" PRIu64 " (%" PRIu64 " verified templates)",
+	      file, cp->hdr.n_entries, cp->hdr.n_verified);
+	mem_free0(data);
+	return cp;
+}
+
+static int
+ima_checkpoint_write(const ima_checkpoint_t *cp, const char *file)
+{
+	size_t verified_len = cp->hdr.n_verified * SHA_DIGEST_LENGTH;
+	size_t len = sizeof(cp->hdr) + verified_len;
+	uint8_t *data = mem_alloc0(len);
+
+	memcpy(data, &cp->hdr, sizeof(cp->hdr));
+	if (verified_len)
+		memcpy(data + sizeof(cp->hdr), cp->verified, verified_len);
+
+	int ret = file_write(file, (const char *)data, len);
+	mem_free0(data);
+	return ret < 0 ? -1 : 0;
+}
+
+/**
+ * Replays the log from the state stored in cp up to its end, updating cp on the way,
+ * and compares the resulting simulated PCR with pcr_tpm. buf holds the log starting at
+ * buf_offset, which must not be behind the offset of cp.
+ */
+static int
+ima_verify_replay(ima_checkpoint_t *cp, uint8_t *buf, size_t size, uint64_t buf_offset,
+		  const ima_cert_t *cert, const digest_index_t *index,
+		  hash_algo_t template_hash_algo, uint8_t *pcr_tpm)
+{
+	struct event template;
+	uint8_t *ptr = buf + (cp->hdr.offset - buf_offset);
+	size_t remain = size - (cp->hdr.offset - buf_offset);
+	uint8_t *pcr = cp->hdr.pcr;
+	int hash_size = cp->hdr.hash_size;
 
 	while (!buf_read(&template.header, &ptr, sizeof(template.header), &remain)) {
 		TRACE("PCR %02d Measurement:", template.header.pcr);
@@ -364,12 +601,17 @@ ima_verify_binary_runtime_measurements(uint8_t *buf, size_t size, const char *ce
 
 		if (verify_template_hash(&template) != 0) {
 			ERROR("Failed to verify template hash for %s", template.name);
-			return -1;
+			goto err;
 		}
 
-		if (verify_template_data(&template, cert) != 0) {
+		// the template hash covers the template data, thus verified data can be skipped
+		if (hashmap_get(cp->verified_map, template.header.digest, SHA_DIGEST_LENGTH)) {
+			TRACE("Template data of %s already verified", template.name);
+		} else if (verify_template_data(&template, cert, index) != 0) {
 			ERROR("Failed to parse measurement entry %s", template.name);
-			return -1;
+			goto err;
+		} else {
+			ima_checkpoint_add_verified(cp, template.header.digest);
 		}
 
 		if (template_hash_algo == HASH_ALGO_SHA256) {
@@ -389,10 +631,12 @@ ima_verify_binary_runtime_measurements(uint8_t *buf, size_t size, const char *ce
 
 		} else {
 			ERROR("Hash algorithm not supported");
-			return -1;
+			goto err;
 		}
 
 		free(template.template_data);
+		cp->hdr.offset = buf_offset + (ptr - buf);
+		cp->hdr.n_entries++;
 	}
 
 	if (memcmp(pcr, pcr_tpm, hash_size) != 0) {
@@ -400,6 +644,68 @@ ima_verify_binary_runtime_measurements(uint8_t *buf, size_t size, const char *ce
 		return -1;
 	}
 
+	return 0;
+err:
+	free(template.template_data);
+	return -1;
+}
+
+int
+ima_verify_binary_runtime_measurements(uint8_t *buf, size_t size, uint64_t buf_offset,
+				       const char *cert, const digest_index_t *index,
+				       hash_algo_t template_hash_algo, uint8_t *pcr_tpm,
+				       const char *checkpoint_file)
+{
+	ASSERT(buf);
+	ASSERT(cert);
+	ASSERT(pcr_tpm);
+
+	int hash_size = hash_algo_to_size(template_hash_algo);
+	IF_FALSE_RETVAL_ERROR(hash_size > 0 && hash_size <= SHA256_DIGEST_LENGTH, -1);
+
+	const ima_cert_t *ima_cert = ima_cert_get(cert);
+	if (!ima_cert) {
+		ERROR("Failed to load kmod signing certificate");
+		return -1;
+	}
+
+	ima_checkpoint_t *cp = ima_checkpoint_new(checkpoint_file, ima_cert, hash_size);
+	int ret = -1;
+
+	// only entries appended since the checkpoint need to be replayed, as long as the
+	// device was not rebooted in the meantime and thus still extends the same PCR
+	if (cp->hdr.offset > 0 && cp->hdr.offset >= buf_offset &&
+	    cp->hdr.offset <= buf_offset + size) {
+		uint64_t n_entries = cp->hdr.n_entries;
+		ret = ima_verify_replay(cp, buf, size, buf_offset, ima_cert, index,
+					template_hash_algo, pcr_tpm);
+		if (ret == 0)
+			INFO("Verified IMA log incrementally from entry %" PRIu64, n_entries);
+		else
+			INFO("IMA log does not continue checkpoint, replaying whole log");
+	}
+
+	// a partial log can only be verified from a matching checkpoint
+	if (ret != 0 && buf_offset > 0) {
+		ERROR("IMA log sent from offset %" PRIu64 " does not continue checkpoint",
+		      buf_offset);
+		ima_checkpoint_free(cp);
+		return -1;
+	}
+
+	if (ret != 0) {
+		ima_checkpoint_reset(cp);
+		ret = ima_verify_replay(cp, buf, size, 0, ima_cert, index, template_hash_algo,
+					pcr_tpm);
+	}
+
+	if (ret == 0 && checkpoint_file && ima_checkpoint_write(cp, checkpoint_file) < 0)
+		WARN("Failed to write IMA checkpoint %s", checkpoint_file);
+
+	ima_checkpoint_free(cp);
+
+	IF_TRUE_RETVAL(ret != 0, -1);
+
 	INFO("Verify IMA TPM PCR SUCCESSFUL");
 
 	return 0;
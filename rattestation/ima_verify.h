@@ -24,8 +24,25 @@
 #ifndef IMA_VERIFY_H_
 #define IMA_VERIFY_H_
 
+/**
+ * Verifies the IMA binary runtime measurements against the TPM PCR value.
+ *
+ * If checkpoint_file is given, the verification state of a former successful run
+ * stored in it is used to replay only the entries appended since then and to skip
+ * signature checks of already verified templates. The file is updated on success.
+ *
+ * If buf_offset is not 0, buf only holds the log from that byte on, which can only be
+ * verified if the checkpoint was taken at or behind buf_offset.
+ *
+ * @param buf_offset position of buf in the log, 0 if buf holds the whole log
+ * @param index known-good file digests whose signatures are not verified, may be NULL
+ * @param checkpoint_file per-device checkpoint file, NULL for a full verification
+ * @return 0 if the log was verified successfully, -1 otherwise
+ */
 int
-ima_verify_binary_runtime_measurements(uint8_t *buf, size_t size, const char *cert,
-				       hash_algo_t template_hash_algo, uint8_t *pcr_tpm);
+ima_verify_binary_runtime_measurements(uint8_t *buf, size_t size, uint64_t buf_offset,
+				       const char *cert, const digest_index_t *index,
+				       hash_algo_t template_hash_algo, uint8_t *pcr_tpm,
+				       const char *checkpoint_file);
 
 #endif // IMA_VERIFY_H_
\ No newline at end of file
@@ -26,12 +26,16 @@
 #include "common/file.h"
 #include "common/logf.h"
 #include "common/event.h"
+#include "common/list.h"
+#include "common/protobuf.h"
 
 #include <unistd.h>
 #include <sys/types.h>
 #include <signal.h>
 
 #include "attestation.h"
+#include "config.h"
+#include "digest_index.h"
 
 #include <openssl/err.h>
 #include <openssl/sha.h>
@@ -48,26 +52,25 @@
 #define LOGFILE_DIR "/data/logs"
 #define LOGFILE_PATH LOGFILE_DIR "/rattestation"
 
-static logf_handler_t *ipagent_logfile_handler = NULL;
-static logf_handler_t *ipagent_logfile_handler_stdout = NULL;
+// default interval in seconds between two attestations of a device in serve mode
+#define SERVE_INTERVAL_DEFAULT 60
+// upper bound of concurrently running attestation sessions in serve mode
+#define SERVE_SESSIONS_MAX 64
 
-char *
-convert_bin_to_hex_new(const uint8_t *bin, int length)
-{
-	IF_TRUE_RETVAL(0 > length, NULL);
+typedef struct {
+	char *host;
+	bool in_flight;
+	unsigned int n_verified;
+	unsigned int n_failed;
+	attestation_ml_state_t *ml_state;
+} main_device_t;
 
-	size_t len = MUL_WITH_OVERFLOW_CHECK(length, (size_t)2);
-	len = MUL_WITH_OVERFLOW_CHECK(len, sizeof(char));
-	len = ADD_WITH_OVERFLOW_CHECK(len, 1);
-	char *hex = mem_alloc0(len);
+static list_t *main_devices = NULL;
+static RAttestationConfig *main_config = NULL;
+static int main_sessions = 0;
 
-	for (int i = 0; i < length; ++i) {
-		// remember snprintf additionally writs a '0' byte
-		snprintf(hex + i * 2, 3, "%.2x", bin[i]);
-	}
-
-	return hex;
-}
+static logf_handler_t *ipagent_logfile_handler = NULL;
+static logf_handler_t *ipagent_logfile_handler_stdout = NULL;
 
 static void
 main_sigint_cb(UNUSED int signum, UNUSED event_signal_t *sig, UNUSED void *data)
@@ -83,6 +86,117 @@ main_return_result_and_exit(bool validated)
 	exit(validated ? 0 : -1);
 }
 
+static void
+main_device_verified_cb(const char *host, bool verified, void *data)
+{
+	main_device_t *device = data;
+
+	device->in_flight = false;
+	main_sessions--;
+	if (verified)
+		device->n_verified++;
+	else
+		device->n_failed++;
+
+	INFO("Attestation of %s %s (%u successful, %u failed so far)", host,
+	     verified ? "SUCCESSFUL" : "FAILED", device->n_verified, device->n_failed);
+}
+
+static void
+main_serve_timer_cb(UNUSED event_timer_t *timer, UNUSED void *data)
+{
+	for (list_t *l = main_devices; l; l = l->next) {
+		main_device_t *device = l->data;
+
+		// a device which did not answer yet keeps its session
+		if (device->in_flight)
+			continue;
+		if (main_sessions >= SERVE_SESSIONS_MAX) {
+			DEBUG("Reached %d concurrent sessions, deferring remaining devices",
+			      SERVE_SESSIONS_MAX);
+			return;
+		}
+
+		if (attestation_do_request_config(device->host, main_config, device->ml_state,
+						  main_device_verified_cb, device) < 0) {
+			WARN("Connection to remote host %s failed!", device->host);
+			device->n_failed++;
+			continue;
+		}
+		device->in_flight = true;
+		main_sessions++;
+	}
+}
+
+/*
+ * Serve mode: periodically attests all hosts listed (one per line) in hosts_file
+ * with the same, once loaded configuration. Sessions run concurrently on the event loop.
+ */
+static int
+main_serve(const char *hosts_file, const char *config_file, int interval)
+{
+	main_config = rattestation_read_config_new(config_file);
+	if (!main_config) {
+		ERROR("Failed to read config file %s", config_file);
+		return -1;
+	}
+
+	char *hosts = file_read_new(hosts_file, 1 << 20);
+	if (!hosts) {
+		ERROR("Failed to read hosts file %s", hosts_file);
+		return -1;
+	}
+
+	char *saveptr = NULL;
+	for (char *host = strtok_r(hosts, "\r\n", &saveptr); host;
+	     host = strtok_r(NULL, "\r\n", &saveptr)) {
+		if (host[0] == '#' || host[0] == ' ' || host[0] == '\t')
+			continue;
+		main_device_t *device = mem_new0(main_device_t, 1);
+		device->host = mem_strdup(host);
+		device->ml_state = attestation_ml_state_new();
+		main_devices = list_append(main_devices, device);
+	}
+	mem_free0(hosts);
+
+	IF_NULL_RETVAL_ERROR(main_devices, -1);
+
+	INFO("Attesting %u devices every %d seconds", list_length(main_devices), interval);
+
+	event_timer_t *timer = event_timer_new(interval * 1000, EVENT_TIMER_REPEAT_FOREVER,
+					       main_serve_timer_cb, NULL);
+	event_add_timer(timer);
+
+	// do not wait a whole interval for the first round
+	main_serve_timer_cb(timer, NULL);
+
+	return 0;
+}
+
+/*
+ * Compiles the known-good digests of config_file into index_file, which verifiers then
+ * map instead of indexing the digest lists on every start.
+ */
+static int
+main_build_index(const char *config_file, const char *index_file)
+{
+	RAttestationConfig *config = rattestation_read_config_new(config_file);
+	if (!config) {
+		ERROR("Failed to read config file %s", config_file);
+		return -1;
+	}
+
+	digest_index_t *index = digest_index_new_from_config(config);
+	protobuf_free_message((ProtobufCMessage *)config);
+	IF_NULL_RETVAL_ERROR(index, -1);
+
+	int ret = digest_index_write(index, index_file);
+	digest_index_free(index);
+	if (ret == 0)
+		INFO("Wrote digest index %s", index_file);
+	return ret;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -92,15 +206,32 @@ main(int argc, char **argv)
 	logf_handler_set_prio(ipagent_logfile_handler, LOGF_PRIO_TRACE);
 	logf_handler_set_prio(ipagent_logfile_handler_stdout, LOGF_PRIO_TRACE);
 
-	char *rhost = (argc < 2) ? "127.0.0.1" : argv[1];
-	char *config_file = (argc < 3) ? "rattestation.conf" : argv[2];
-
 	event_init();
 
 	/* register keyboard sigint */
 	event_signal_t *sig = event_signal_new(SIGINT, &main_sigint_cb, NULL);
 	event_add_signal(sig);
 
+	if (argc >= 4 && !strcmp(argv[1], "--build-index"))
+		return main_build_index(argv[2], argv[3]) < 0 ? -1 : 0;
+
+	if (argc >= 3 && !strcmp(argv[1], "--serve")) {
+		char *config_file = (argc < 4) ? "rattestation.conf" : argv[3];
+		int interval = (argc < 5) ? SERVE_INTERVAL_DEFAULT : atoi(argv[4]);
+		if (interval <= 0) {
+			ERROR("Invalid interval %s", argv[4]);
+			return -1;
+		}
+		if (main_serve(argv[2], config_file, interval) < 0)
+			return -1;
+
+		event_loop();
+		return 0;
+	}
+
+	char *rhost = (argc < 2) ? "127.0.0.1" : argv[1];
+	char *config_file = (argc < 3) ? "rattestation.conf" : argv[2];
+
 	/*
 	 * do attestation and register the main_retrun_result_and_exit handler
 	 * as callback when the response has been validated
@@ -35,17 +35,23 @@ LOCAL_SRC_FILES := \
 	common/mem.c \
 	common/sock.c \
 	common/event.c \
+	common/hashmap.c \
 	common/str.c \
 	common/file.c \
 	common/dir.c \
 	common/fd.c \
 	common/uuid.c \
 	common/protobuf.c \
+	common/protobuf_writer.c \
+	common/worker.c \
 	common/reboot.c \
 	common/ssl_util.c \
 	scd.proto \
 	device.proto \
 	control.c \
+	hash_cache.c \
+	key_cache.c \
+	key_pool.c \
 	softtoken.c \
 	scd.c
 
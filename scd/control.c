@@ -31,6 +31,7 @@
 #include "usbtoken.h"
 #include "softtoken.h"
 #include "scd.h"
+#include "hash_cache.h"
 
 #include "common/macro.h"
 #include "common/mem.h"
@@ -38,10 +39,12 @@
 #include "common/fd.h"
 #include "common/event.h"
 #include "common/list.h"
-#include "common/dir.h"
 #include "common/file.h"
 #include "common/protobuf.h"
+#include "common/protobuf_writer.h"
 #include "common/ssl_util.h"
+#include "common/worker.h"
+#include "common/sampler.h"
 
 #include <unistd.h>
 
@@ -50,6 +53,8 @@
 // maximum no. of connections waiting to be accepted on the listening socket
 #define SCD_CONTROL_SOCK_LISTEN_BACKLOG 8
 #define KEY_LENGTH_BYTES 64
+// folded stacks of the sampling profiler, next to the logs of cmld
+#define SCD_SAMPLER_FILE "/data/logs/scd.folded"
 
 //#undef LOGF_LOG_MIN_PRIO
 //#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
@@ -81,89 +86,244 @@ switch_proto_hash_algo(int hash_algo)
 	return NULL;
 }
 
-static char *
-write_to_tmpfile_new(unsigned char *buf, size_t buflen)
+/*
+ * A CRYPTO_HASH_FILE request which is processed by a worker thread.
+ * All fields except hashes, hash_lens and ret are only accessed from the event loop.
+ */
+typedef struct scd_control_hash_job {
+	int fd; // connection to respond on, -1 if it has been closed meanwhile
+	bool has_request_id;
+	uint32_t request_id;
+	char *file;
+	bool multi; // respond with hash_values instead of hash_value
+	size_t n;
+	const char *algos[SSL_HASH_FILE_MULTI_MAX];
+	unsigned char *hashes[SSL_HASH_FILE_MULTI_MAX];
+	unsigned int hash_lens[SSL_HASH_FILE_MULTI_MAX];
+	int ret;
+	bool cached;	// hashes were taken from the hash cache
+	bool cacheable; // the file did not change while it was hashed
+	struct stat st; // state of the file while it was hashed
+} scd_control_hash_job_t;
+
+// hash jobs currently in progress
+static list_t *scd_control_hash_jobs = NULL;
+
+static scd_control_hash_job_t *
+scd_control_hash_job_new(const DaemonToToken *msg, int fd)
 {
-	char *file = mem_strdup("/tmp/tmpXXXXXXXX");
-	int fd = mkstemp(file);
-	if (fd != -1) {
-		int len = fd_write(fd, (char *)buf, buflen);
-		close(fd);
-		if (len >= 0 && (size_t)len == buflen)
-			return file;
-		ERROR("Failed to write entire data (%zu bytes) to temp file %s", buflen, file);
+	IF_NULL_RETVAL_ERROR(msg->hash_file, NULL);
+
+	scd_control_hash_job_t *job = mem_new0(scd_control_hash_job_t, 1);
+	job->fd = fd;
+	job->has_request_id = msg->has_request_id;
+	job->request_id = msg->request_id;
+	job->ret = -1;
+
+	if (msg->n_hash_algos > 0) {
+		job->multi = true;
+		if (msg->n_hash_algos > SSL_HASH_FILE_MULTI_MAX) {
+			ERROR("Too many hash algorithms requested (%zu)", msg->n_hash_algos);
+			goto err;
+		}
+		for (size_t i = 0; i < msg->n_hash_algos; i++) {
+			if (!(job->algos[i] = switch_proto_hash_algo(msg->hash_algos[i])))
+				goto err;
+		}
+		job->n = msg->n_hash_algos;
 	} else {
-		ERROR("Failed to create temp file.");
+		if (!(job->algos[0] = switch_proto_hash_algo(msg->hash_algo)))
+			goto err;
+		job->n = 1;
 	}
-	mem_free0(file);
+	job->file = mem_strdup(msg->hash_file);
+	job->cached =
+		scd_hash_cache_lookup(job->file, job->n, job->algos, job->hashes, job->hash_lens);
+	if (job->cached)
+		job->ret = 0;
+
+	scd_control_hash_jobs = list_append(scd_control_hash_jobs, job);
+	return job;
+err:
+	mem_free0(job);
 	return NULL;
 }
 
-struct verify_cert_ca_cb_data {
-	const char *cert_file;
-	bool verified;
-};
+static void
+scd_control_hash_job_free(scd_control_hash_job_t *job)
+{
+	scd_control_hash_jobs = list_remove(scd_control_hash_jobs, job);
+	for (size_t i = 0; i < job->n; i++)
+		if (job->hashes[i])
+			mem_free0(job->hashes[i]);
+	mem_free0(job->file);
+	mem_free0(job);
+}
+
+/*
+ * Runs on a worker thread.
+ */
+static void
+scd_control_hash_job_work(void *data)
+{
+	scd_control_hash_job_t *job = data;
+	struct stat st_after;
+
+	bool stat_ok = stat(job->file, &job->st) == 0;
+	job->ret = ssl_hash_file_multi(job->file, job->n, job->algos, job->hashes, job->hash_lens);
+	// only cache digests which belong to exactly this state of the file
+	job->cacheable = stat_ok && job->ret == 0 && stat(job->file, &st_after) == 0 &&
+			 scd_hash_cache_stat_equal(&job->st, &st_after);
+}
 
-static int
-scd_control_verify_cert_ca_cb(const char *path, const char *file, void *data)
+static void
+scd_control_hash_job_done(void *data)
 {
-	int ret = 0;
-	struct verify_cert_ca_cb_data *cb_data = data;
-	char *ca_file = mem_printf("%s/%s", path, file);
-
-	if (ssl_verify_certificate(cb_data->cert_file, ca_file, true) != 0) {
-		ERROR("Error during certificate validation using ca: %s", ca_file);
-		cb_data->verified = false;
-		ret = 1;
+	scd_control_hash_job_t *job = data;
+
+	if (job->cacheable)
+		scd_hash_cache_store(job->file, &job->st, job->n, job->algos, job->hashes,
+				     job->hash_lens);
+
+	if (job->fd < 0) {
+		DEBUG("Client disconnected before hashing %s finished", job->file);
+		scd_control_hash_job_free(job);
+		return;
+	}
+
+	TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
+	ProtobufCBinaryData values[SSL_HASH_FILE_MULTI_MAX];
+	if (job->ret < 0) {
+		ERROR("Hashing file failed");
+		out.code = TOKEN_TO_DAEMON__CODE__CRYPTO_HASH_ERROR;
+	} else if (job->multi) {
+		for (size_t i = 0; i < job->n; i++) {
+			values[i].len = job->hash_lens[i];
+			values[i].data = job->hashes[i];
+		}
+		out.n_hash_values = job->n;
+		out.hash_values = values;
+		out.code = TOKEN_TO_DAEMON__CODE__CRYPTO_HASH_OK;
 	} else {
-		INFO("Certificate validation succeeded using ca: %s", ca_file);
-		cb_data->verified = true;
-		// break dir_foreach
-		ret = -1;
+		out.has_hash_value = true;
+		out.hash_value.len = job->hash_lens[0];
+		out.hash_value.data = job->hashes[0];
+		out.code = TOKEN_TO_DAEMON__CODE__CRYPTO_HASH_OK;
+	}
+	out.has_request_id = job->has_request_id;
+	out.request_id = job->request_id;
+	protobuf_writer_send_message(job->fd, (ProtobufCMessage *)&out);
+
+	scd_control_hash_job_free(job);
+}
+
+/*
+ * A CRYPTO_VERIFY_FILE or CRYPTO_VERIFY_BUF request which is processed by a worker
+ * thread. Only the buffers and code are written by the worker.
+ */
+typedef struct scd_control_verify_job {
+	int fd; // connection to respond on, -1 if it has been closed meanwhile
+	bool has_request_id;
+	uint32_t request_id;
+	char *data_file; // NULL for CRYPTO_VERIFY_BUF requests
+	char *sig_file;
+	char *cert_file;
+	uint8_t *data_buf; // only set for CRYPTO_VERIFY_BUF requests
+	size_t data_len;
+	uint8_t *sig_buf; // copied from the request or read from sig_file
+	size_t sig_len;
+	uint8_t *cert_buf; // copied from the request or read from cert_file
+	size_t cert_len;
+	const char *hash_algo;
+	TokenToDaemon__Code code;
+} scd_control_verify_job_t;
+
+// verify jobs currently in progress
+static list_t *scd_control_verify_jobs = NULL;
+
+/*
+ * A request which operates on a token and is processed on the token's queue. The
+ * worker only writes code and key. Requests without request_id are answered in order,
+ * thus reading from their connection (io) pauses until the response has been sent.
+ */
+typedef struct scd_control_token_job {
+	DaemonToToken *msg;
+	int fd;		// connection to respond on, -1 if it has been closed meanwhile
+	event_io_t *io; // paused connection, NULL if it is not paused
+	TokenToDaemon__Code code;
+	unsigned char *key; // wrapped or unwrapped key of the response, if any
+	int key_len;
+} scd_control_token_job_t;
+
+// token jobs currently in progress
+static list_t *scd_control_token_jobs = NULL;
+
+/*
+ * Keeps finished jobs from responding on a closed (and maybe reused) fd.
+ */
+static void
+scd_control_jobs_disconnect(int fd)
+{
+	for (list_t *l = scd_control_hash_jobs; l; l = l->next) {
+		scd_control_hash_job_t *job = l->data;
+		if (job->fd == fd)
+			job->fd = -1;
+	}
+	for (list_t *l = scd_control_verify_jobs; l; l = l->next) {
+		scd_control_verify_job_t *job = l->data;
+		if (job->fd == fd)
+			job->fd = -1;
+	}
+	for (list_t *l = scd_control_token_jobs; l; l = l->next) {
+		scd_control_token_job_t *job = l->data;
+		if (job->fd == fd) {
+			job->fd = -1;
+			job->io = NULL;
+		}
 	}
-	mem_free0(ca_file);
-	return ret;
 }
 
+// trust anchors for verifications, loaded once and reloaded only if they change
+static ssl_verify_ctx_t *scd_control_verify_ctx_ssig = NULL;
+static ssl_verify_ctx_t *scd_control_verify_ctx_trusted = NULL;
+static ssl_verify_ctx_t *scd_control_verify_ctx_localca = NULL;
+
 /*
  * This function mainly handles verify request as part of
  * TSF.CML.SecureCompartmentInit and TSF.CML.Updates.
  * It wraps the corresponding OpenSSL calls.
  */
 static TokenToDaemon__Code
-scd_control_handle_verify(const char *verify_data_file, const char *verify_sig_file,
-			  const char *verify_cert_file, const char *hash_algo)
+scd_control_handle_verify(const scd_control_verify_job_t *job)
 {
 	int ret;
 	TokenToDaemon__Code out_code = TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_ERROR;
-	IF_NULL_RETVAL(hash_algo, out_code);
+	IF_NULL_RETVAL(job->hash_algo, out_code);
 
 	bool verified = false;
 	// At first, we explicitly assume that the file to be verified is a software update file,
 	// and we thus use the software signing root CA.
-	if ((ret = ssl_verify_certificate(verify_cert_file, SSIG_ROOT_CERT, true)) == 0) {
+	if ((ret = ssl_verify_ctx_verify_certificate(scd_control_verify_ctx_ssig, job->cert_buf,
+						     job->cert_len)) == 0) {
+		verified = true;
+	} else if (ssl_verify_ctx_verify_certificate(scd_control_verify_ctx_trusted, job->cert_buf,
+						     job->cert_len) == 0) {
+		// Verified by one of the CAs in trusted CA store
+		INFO("Certificate validation succeeded using trusted CA store");
 		verified = true;
+		ret = 0;
+	} else if (ret == -1) {
+		ERROR("Certificate not a valid ssig cert");
+		out_code = TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_BAD_CERTIFICATE;
 	} else {
-		// Try all CA files in trusted CA store
-		struct verify_cert_ca_cb_data cb_data = { .cert_file = verify_cert_file,
-							  .verified = false };
-
-		dir_foreach(TRUSTED_CA_STORE, scd_control_verify_cert_ca_cb, &cb_data);
-		if (cb_data.verified) {
-			verified = true;
-			ret = 0;
-		} else if (ret == -1) {
-			ERROR("Certificate not a valid ssig cert");
-			out_code = TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_BAD_CERTIFICATE;
-		} else {
-			ERROR("Error during certificate validation");
-			out_code = TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_ERROR;
-		}
+		ERROR("Error during certificate validation");
+		out_code = TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_ERROR;
 	}
 	IF_TRUE_GOTO(verified, do_signature);
 
 	// Retry with Local CA
-	if ((ret = ssl_verify_certificate(verify_cert_file, LOCALCA_ROOT_CERT, true)) == 0) {
+	if ((ret = ssl_verify_ctx_verify_certificate(scd_control_verify_ctx_localca, job->cert_buf,
+						     job->cert_len)) == 0) {
 		goto do_signature;
 	} else if (ret == -1) {
 		ERROR("Certificate not a valid local ssig cert");
@@ -175,8 +335,26 @@ scd_control_handle_verify(const char *verify_data_file, const char *verify_sig_f
 	return out_code;
 
 do_signature:
-	if ((ret = ssl_verify_signature(verify_cert_file, verify_sig_file, verify_data_file,
-					hash_algo)) == 0) {
+	if (job->data_file) {
+		unsigned int hash_len;
+		unsigned char *hash = ssl_hash_file(job->data_file, &hash_len, job->hash_algo);
+		if (!hash) {
+			ERROR("Failed to hash file: %s", job->data_file);
+			ret = -1;
+		} else {
+			ret = ssl_verify_signature_from_digest((const char *)job->cert_buf,
+							       job->cert_len, job->sig_buf,
+							       job->sig_len, hash, hash_len,
+							       job->hash_algo);
+			mem_free0(hash);
+		}
+	} else {
+		ret = ssl_verify_signature_from_buf(job->cert_buf, job->cert_len, job->sig_buf,
+						    job->sig_len, job->data_buf, job->data_len,
+						    job->hash_algo);
+	}
+
+	if (ret == 0) {
 		out_code = (verified) ? TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_GOOD :
 					TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_LOCALLY_SIGNED;
 	} else if (ret == -1) {
@@ -189,208 +367,362 @@ do_signature:
 	return out_code;
 }
 
-static void
-scd_control_handle_message(const DaemonToToken *msg, int fd)
+static uint8_t *
+scd_control_read_file_new(const char *file, size_t *len)
 {
-	if (NULL == msg) {
-		WARN("msg=NULL, returning");
-		return;
+	off_t size = file_size(file);
+	if (size < 0) {
+		ERROR("Failed to get size of %s", file);
+		return NULL;
 	}
 
-	if (LOGF_PRIO_TRACE >= LOGF_LOG_MIN_PRIO) {
-		char *msg_text = protobuf_c_text_to_string((ProtobufCMessage *)msg, NULL);
-		TRACE("Handling DaemonToToken message:\n%s", msg_text ? msg_text : "NULL");
-		if (msg_text)
-			free(msg_text);
+	uint8_t *buf = mem_alloc0(size + 1);
+	if (file_read(file, (char *)buf, size) != size) {
+		ERROR("Failed to read %s", file);
+		mem_free0(buf);
+		return NULL;
 	}
+	*len = size;
+	return buf;
+}
 
-	switch (msg->code) {
-	case DAEMON_TO_TOKEN__CODE__TOKEN_ADD: {
-		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
-		out.code = TOKEN_TO_DAEMON__CODE__TOKEN_ADD_FAILED;
+static scd_control_verify_job_t *
+scd_control_verify_job_new(const DaemonToToken *msg, int fd)
+{
+	scd_control_verify_job_t *job = mem_new0(scd_control_verify_job_t, 1);
+	job->fd = fd;
+	job->has_request_id = msg->has_request_id;
+	job->request_id = msg->request_id;
+	job->hash_algo = switch_proto_hash_algo(msg->hash_algo);
+	job->code = TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_ERROR;
+
+	if (msg->code == DAEMON_TO_TOKEN__CODE__CRYPTO_VERIFY_BUF) {
+		// the request is freed before the worker runs
+		if (msg->verify_data_buf.data && msg->verify_sig_buf.data &&
+		    msg->verify_cert_buf.data) {
+			job->data_buf =
+				mem_memcpy(msg->verify_data_buf.data, msg->verify_data_buf.len);
+			job->data_len = msg->verify_data_buf.len;
+			job->sig_buf = mem_memcpy(msg->verify_sig_buf.data, msg->verify_sig_buf.len);
+			job->sig_len = msg->verify_sig_buf.len;
+			job->cert_buf =
+				mem_memcpy(msg->verify_cert_buf.data, msg->verify_cert_buf.len);
+			job->cert_len = msg->verify_cert_buf.len;
+		}
+	} else {
+		job->data_file = msg->verify_data_file ? mem_strdup(msg->verify_data_file) : NULL;
+		job->sig_file = msg->verify_sig_file ? mem_strdup(msg->verify_sig_file) : NULL;
+		job->cert_file = msg->verify_cert_file ? mem_strdup(msg->verify_cert_file) : NULL;
+	}
 
-		scd_token_t *token = scd_get_token_from_msg(msg);
+	scd_control_verify_jobs = list_append(scd_control_verify_jobs, job);
+	return job;
+}
 
-		if (token != NULL) {
-			INFO("Token already exists.");
-			out.code = TOKEN_TO_DAEMON__CODE__TOKEN_ADD_SUCCESSFUL;
-		} else if (scd_token_new(msg) == 0) {
-			out.code = TOKEN_TO_DAEMON__CODE__TOKEN_ADD_SUCCESSFUL;
-		} else {
-			ERROR("Could not create new token");
+static void
+scd_control_verify_job_free(scd_control_verify_job_t *job)
+{
+	scd_control_verify_jobs = list_remove(scd_control_verify_jobs, job);
+
+	mem_free0(job->data_file);
+	mem_free0(job->sig_file);
+	mem_free0(job->cert_file);
+	mem_free0(job->data_buf);
+	mem_free0(job->sig_buf);
+	mem_free0(job->cert_buf);
+	mem_free0(job);
+}
+
+/*
+ * Runs on a worker thread.
+ */
+static void
+scd_control_verify_job_work(void *data)
+{
+	scd_control_verify_job_t *job = data;
+
+	if (job->cert_file && job->sig_file && job->data_file) {
+		// the data file may be a large image, it is hashed in chunks later on
+		job->cert_buf = scd_control_read_file_new(job->cert_file, &job->cert_len);
+		IF_NULL_RETURN(job->cert_buf);
+		job->sig_buf = scd_control_read_file_new(job->sig_file, &job->sig_len);
+		if (!job->sig_buf) {
+			job->code = TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_BAD_SIGNATURE;
+			return;
 		}
+	}
+	IF_FALSE_RETURN(job->cert_buf && job->sig_buf && (job->data_file || job->data_buf));
 
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
-	} break;
-	case DAEMON_TO_TOKEN__CODE__TOKEN_REMOVE: {
-		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
-		out.code = TOKEN_TO_DAEMON__CODE__TOKEN_REMOVE_FAILED;
+	job->code = scd_control_handle_verify(job);
+}
 
-		scd_token_t *token = scd_get_token_from_msg(msg);
+static void
+scd_control_verify_job_done(void *data)
+{
+	scd_control_verify_job_t *job = data;
 
-		if (token == NULL) {
-			ERROR("Token not found");
-		} else {
-			scd_token_free(token);
-			out.code = TOKEN_TO_DAEMON__CODE__TOKEN_REMOVE_SUCCESSFUL;
-		}
+	if (job->fd < 0) {
+		DEBUG("Client disconnected before verification finished");
+		scd_control_verify_job_free(job);
+		return;
+	}
 
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
-	} break;
-	case DAEMON_TO_TOKEN__CODE__UNLOCK: {
-		TRACE("SCD: Handle messsage UNLOCK");
-		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
-		out.code = TOKEN_TO_DAEMON__CODE__UNLOCK_FAILED;
+	TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
+	out.code = job->code;
+	out.has_request_id = job->has_request_id;
+	out.request_id = job->request_id;
+	protobuf_writer_send_message(job->fd, (ProtobufCMessage *)&out);
 
-		scd_token_t *token = scd_get_token_from_msg(msg);
+	scd_control_verify_job_free(job);
+}
+
+/*
+ * Runs on the queue of the token.
+ */
+static void
+scd_control_token_job_work(scd_token_t *token, void *data)
+{
+	scd_control_token_job_t *job = data;
+	const DaemonToToken *msg = job->msg;
 
-		if (!token) {
-			ERROR("No token loaded, unlock failed");
-		} else if (!msg->token_pin) {
+	switch (msg->code) {
+	case DAEMON_TO_TOKEN__CODE__UNLOCK: {
+		job->code = TOKEN_TO_DAEMON__CODE__UNLOCK_FAILED;
+		if (!msg->token_pin) {
 			ERROR("Token passphrase not specified");
 		} else if (token->is_locked_till_reboot(token)) {
-			out.code = TOKEN_TO_DAEMON__CODE__LOCKED_TILL_REBOOT;
+			job->code = TOKEN_TO_DAEMON__CODE__LOCKED_TILL_REBOOT;
 		} else {
+			// a new session starts, keys of an earlier one are not carried over
+			token_key_cache_wipe(token);
 			int ret = token->unlock(token, msg->token_pin, msg->pairing_secret.data,
 						msg->pairing_secret.len);
 			if (ret == 0)
-				out.code = TOKEN_TO_DAEMON__CODE__UNLOCK_SUCCESSFUL;
+				job->code = TOKEN_TO_DAEMON__CODE__UNLOCK_SUCCESSFUL;
 			else if (ret == -2) {
 				if (token->is_locked_till_reboot(token))
-					out.code = TOKEN_TO_DAEMON__CODE__LOCKED_TILL_REBOOT;
+					job->code = TOKEN_TO_DAEMON__CODE__LOCKED_TILL_REBOOT;
 				else
-					out.code = TOKEN_TO_DAEMON__CODE__PASSWD_WRONG;
+					job->code = TOKEN_TO_DAEMON__CODE__PASSWD_WRONG;
 			} else
-				out.code = TOKEN_TO_DAEMON__CODE__UNLOCK_FAILED;
+				job->code = TOKEN_TO_DAEMON__CODE__UNLOCK_FAILED;
 		}
-
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
 	} break;
 	case DAEMON_TO_TOKEN__CODE__LOCK: {
-		TRACE("SCD: Handle messsage LOCK");
-		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
-		out.code = TOKEN_TO_DAEMON__CODE__LOCK_FAILED;
-
-		scd_token_t *token = scd_get_token_from_msg(msg);
-		if (!token) {
-			ERROR("No token loaded, lock failed");
-		} else if (token->lock(token) == 0) {
-			out.code = TOKEN_TO_DAEMON__CODE__LOCK_SUCCESSFUL;
-		}
-
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		job->code = TOKEN_TO_DAEMON__CODE__LOCK_FAILED;
+		token_key_cache_wipe(token);
+		if (token->lock(token) == 0)
+			job->code = TOKEN_TO_DAEMON__CODE__LOCK_SUCCESSFUL;
 	} break;
 	case DAEMON_TO_TOKEN__CODE__WRAP_KEY: {
-		TRACE("SCD: Handle messsage WRAP_KEY");
-		int wrapped_key_len;
-		unsigned char *wrapped_key;
-		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
-		out.code = TOKEN_TO_DAEMON__CODE__WRAPPED_KEY;
-
-		scd_token_t *token = scd_get_token_from_msg(msg);
-		if (!token) {
-			ERROR("No token loaded, wrap failed");
-		} else if (token->is_locked(token)) {
+		job->code = TOKEN_TO_DAEMON__CODE__WRAPPED_KEY;
+		if (token->is_locked(token)) {
 			ERROR("Token is locked. Unlock first.");
 		} else if (!msg->has_unwrapped_key) {
 			ERROR("Unwrapped key not specified.");
 		} else if (token->wrap_key(token, msg->container_uuid, msg->unwrapped_key.data,
-					   msg->unwrapped_key.len, &wrapped_key,
-					   &wrapped_key_len) == 0) {
-			out.has_wrapped_key = true;
-			out.wrapped_key.len = wrapped_key_len;
-			out.wrapped_key.data = wrapped_key;
-		} else {
+					   msg->unwrapped_key.len, &job->key,
+					   &job->key_len) != 0) {
 			ERROR("Key wrapping failed");
-		}
-
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
-		if (out.has_wrapped_key) {
-			memset(wrapped_key, 0, wrapped_key_len);
-			mem_free0(wrapped_key);
+			job->key = NULL;
 		}
 	} break;
 	case DAEMON_TO_TOKEN__CODE__UNWRAP_KEY: {
-		TRACE("SCD: Handle messsage UNWRAP_KEY");
-		int unwrapped_key_len;
-		unsigned char *unwrapped_key;
-		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
-		out.code = TOKEN_TO_DAEMON__CODE__UNWRAPPED_KEY;
-
-		scd_token_t *token = scd_get_token_from_msg(msg);
-		if (!token) {
-			ERROR("No token loaded, unwrap failed");
-		} else if (token->is_locked(token)) {
+		job->code = TOKEN_TO_DAEMON__CODE__UNWRAPPED_KEY;
+		if (token->is_locked(token)) {
 			ERROR("Token is locked. Unlock first.");
+			token_key_cache_wipe(token);
 		} else if (!msg->has_wrapped_key) {
 			ERROR("Wrapped key not specified.");
-		} else if (token->unwrap_key(token, msg->container_uuid, msg->wrapped_key.data,
-					     msg->wrapped_key.len, &unwrapped_key,
-					     &unwrapped_key_len) == 0) {
-			out.has_unwrapped_key = true;
-			out.unwrapped_key.len = unwrapped_key_len;
-			out.unwrapped_key.data = unwrapped_key;
-		} else {
+		} else if (token_unwrap_key_cached(token, msg->container_uuid,
+						   msg->wrapped_key.data, msg->wrapped_key.len,
+						   &job->key, &job->key_len) != 0) {
 			ERROR("Key unwrapping failed");
+			job->key = NULL;
 		}
-
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
-		if (out.has_unwrapped_key) {
-			memset(unwrapped_key, 0, unwrapped_key_len);
-			mem_free0(unwrapped_key);
+	} break;
+	case DAEMON_TO_TOKEN__CODE__CHANGE_PIN:
+	case DAEMON_TO_TOKEN__CODE__PROVISION_PIN: {
+		bool provisioning = msg->code == DAEMON_TO_TOKEN__CODE__PROVISION_PIN;
+		job->code = TOKEN_TO_DAEMON__CODE__CHANGE_PIN_FAILED;
+		if (!msg->token_pin) {
+			ERROR("Token passphrase not specified");
+		} else if (token->is_locked_till_reboot(token)) {
+			job->code = TOKEN_TO_DAEMON__CODE__LOCKED_TILL_REBOOT;
+		} else {
+			int ret = token->change_passphrase(token, msg->token_pin, msg->token_newpin,
+							   msg->pairing_secret.data,
+							   msg->pairing_secret.len, provisioning);
+			if (ret == 0) {
+				TRACE("SCD: change_passphrase successful");
+				job->code = provisioning ?
+						    TOKEN_TO_DAEMON__CODE__PROVISION_PIN_SUCCESSFUL :
+						    TOKEN_TO_DAEMON__CODE__CHANGE_PIN_SUCCESSFUL;
+			} else {
+				TRACE("SCD: change_passphrase failed");
+				job->code = provisioning ?
+						    TOKEN_TO_DAEMON__CODE__PROVISION_PIN_FAILED :
+						    TOKEN_TO_DAEMON__CODE__CHANGE_PIN_FAILED;
+			}
 		}
 	} break;
-	case DAEMON_TO_TOKEN__CODE__CHANGE_PIN: {
-		TRACE("SCD: Handle messsage CHANGE_PIN");
+	default:
+		ASSERT(0);
+	}
+}
+
+static void
+scd_control_token_job_done(void *data)
+{
+	scd_control_token_job_t *job = data;
+
+	scd_control_token_jobs = list_remove(scd_control_token_jobs, job);
+
+	if (job->fd < 0) {
+		DEBUG("Client disconnected before token operation finished");
+	} else {
 		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
+		out.code = job->code;
+		if (job->key && job->msg->code == DAEMON_TO_TOKEN__CODE__WRAP_KEY) {
+			out.has_wrapped_key = true;
+			out.wrapped_key.len = job->key_len;
+			out.wrapped_key.data = job->key;
+		} else if (job->key) {
+			out.has_unwrapped_key = true;
+			out.unwrapped_key.len = job->key_len;
+			out.unwrapped_key.data = job->key;
+		}
+		out.has_request_id = job->msg->has_request_id;
+		out.request_id = job->msg->request_id;
+		protobuf_writer_send_message(job->fd, (ProtobufCMessage *)&out);
+	}
+
+	// continue with the next request of the connection
+	if (job->io)
+		event_add_io(job->io);
+
+	if (job->key) {
+		memset(job->key, 0, job->key_len);
+		mem_free0(job->key);
+	}
+	protobuf_free_message((ProtobufCMessage *)job->msg);
+	mem_free0(job);
+}
+
+/*
+ * Hands a request over to the queue of its token. Returns false if the request has not
+ * been taken over, in which case the caller still owns msg.
+ */
+static bool
+scd_control_token_job_run(DaemonToToken *msg, int fd, event_io_t *io)
+{
+	TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
+
+	scd_token_t *token = scd_get_token_from_msg(msg);
+	if (!token) {
+		ERROR("No token loaded, operation %d failed", msg->code);
+		goto err;
+	}
+
+	scd_control_token_job_t *job = mem_new0(scd_control_token_job_t, 1);
+	job->msg = msg;
+	job->fd = fd;
+	job->io = msg->has_request_id ? NULL : io;
+
+	if (token_run(token, scd_control_token_job_work, scd_control_token_job_done, job) < 0) {
+		mem_free0(job);
+		goto err;
+	}
+	scd_control_token_jobs = list_append(scd_control_token_jobs, job);
+
+	// the response has to be sent before the next request is handled
+	if (job->io)
+		event_remove_io(job->io);
+	return true;
+
+err:
+	switch (msg->code) {
+	case DAEMON_TO_TOKEN__CODE__UNLOCK:
+		out.code = TOKEN_TO_DAEMON__CODE__UNLOCK_FAILED;
+		break;
+	case DAEMON_TO_TOKEN__CODE__LOCK:
+		out.code = TOKEN_TO_DAEMON__CODE__LOCK_FAILED;
+		break;
+	case DAEMON_TO_TOKEN__CODE__WRAP_KEY:
+		out.code = TOKEN_TO_DAEMON__CODE__WRAPPED_KEY;
+		break;
+	case DAEMON_TO_TOKEN__CODE__UNWRAP_KEY:
+		out.code = TOKEN_TO_DAEMON__CODE__UNWRAPPED_KEY;
+		break;
+	default:
 		out.code = TOKEN_TO_DAEMON__CODE__CHANGE_PIN_FAILED;
+	}
+	out.has_request_id = msg->has_request_id;
+	out.request_id = msg->request_id;
+	protobuf_writer_send_message(fd, (ProtobufCMessage *)&out);
+	return false;
+}
+
+/*
+ * Returns true if msg has been handed over to a job which frees it.
+ */
+static bool
+scd_control_handle_message(DaemonToToken *msg, int fd, event_io_t *io)
+{
+	if (NULL == msg) {
+		WARN("msg=NULL, returning");
+		return false;
+	}
+
+	if (LOGF_PRIO_TRACE >= LOGF_LOG_MIN_PRIO) {
+		char *msg_text = protobuf_c_text_to_string((ProtobufCMessage *)msg, NULL);
+		TRACE("Handling DaemonToToken message:\n%s", msg_text ? msg_text : "NULL");
+		if (msg_text)
+			free(msg_text);
+	}
+
+	switch (msg->code) {
+	case DAEMON_TO_TOKEN__CODE__TOKEN_ADD: {
+		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
+		out.code = TOKEN_TO_DAEMON__CODE__TOKEN_ADD_FAILED;
 
 		scd_token_t *token = scd_get_token_from_msg(msg);
-		if (!token) {
-			ERROR("No token loaded, change pass failed");
-		} else if (!msg->token_pin) {
-			ERROR("Token passphrase not specified");
-		} else if (token->is_locked_till_reboot(token)) {
-			out.code = TOKEN_TO_DAEMON__CODE__LOCKED_TILL_REBOOT;
+
+		if (token != NULL) {
+			INFO("Token already exists.");
+			out.code = TOKEN_TO_DAEMON__CODE__TOKEN_ADD_SUCCESSFUL;
+		} else if (scd_token_new(msg) == 0) {
+			out.code = TOKEN_TO_DAEMON__CODE__TOKEN_ADD_SUCCESSFUL;
 		} else {
-			int ret = token->change_passphrase(token, msg->token_pin, msg->token_newpin,
-							   msg->pairing_secret.data,
-							   msg->pairing_secret.len, false);
-			if (ret == 0)
-				out.code = TOKEN_TO_DAEMON__CODE__CHANGE_PIN_SUCCESSFUL;
-			else
-				out.code = TOKEN_TO_DAEMON__CODE__CHANGE_PIN_FAILED;
+			ERROR("Could not create new token");
 		}
 
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		protobuf_writer_send_message(fd, (ProtobufCMessage *)&out);
 	} break;
-	case DAEMON_TO_TOKEN__CODE__PROVISION_PIN: {
-		TRACE("SCD: Handle messsage PROVISION_PIN");
+	case DAEMON_TO_TOKEN__CODE__TOKEN_REMOVE: {
 		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
-		out.code = TOKEN_TO_DAEMON__CODE__CHANGE_PIN_FAILED;
+		out.code = TOKEN_TO_DAEMON__CODE__TOKEN_REMOVE_FAILED;
 
 		scd_token_t *token = scd_get_token_from_msg(msg);
-		if (!token) {
-			ERROR("No token loaded, change pass failed");
-		} else if (!msg->token_pin) {
-			ERROR("Token passphrase not specified");
-		} else if (token->is_locked_till_reboot(token)) {
-			out.code = TOKEN_TO_DAEMON__CODE__LOCKED_TILL_REBOOT;
+
+		if (token == NULL) {
+			ERROR("Token not found");
 		} else {
-			int ret = token->change_passphrase(token, msg->token_pin, msg->token_newpin,
-							   msg->pairing_secret.data,
-							   msg->pairing_secret.len, true);
-			if (ret == 0) {
-				TRACE("SCD: change_passphrase successful");
-				out.code = TOKEN_TO_DAEMON__CODE__PROVISION_PIN_SUCCESSFUL;
-			} else {
-				TRACE("SCD: change_passphrase failed");
-				out.code = TOKEN_TO_DAEMON__CODE__PROVISION_PIN_FAILED;
-			}
+			scd_token_free(token);
+			out.code = TOKEN_TO_DAEMON__CODE__TOKEN_REMOVE_SUCCESSFUL;
 		}
 
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		protobuf_writer_send_message(fd, (ProtobufCMessage *)&out);
 	} break;
+	case DAEMON_TO_TOKEN__CODE__UNLOCK:
+	case DAEMON_TO_TOKEN__CODE__LOCK:
+	case DAEMON_TO_TOKEN__CODE__WRAP_KEY:
+	case DAEMON_TO_TOKEN__CODE__UNWRAP_KEY:
+	case DAEMON_TO_TOKEN__CODE__CHANGE_PIN:
+	case DAEMON_TO_TOKEN__CODE__PROVISION_PIN:
+		TRACE("SCD: Handle messsage %d on the token's queue", msg->code);
+		// a slow token must not block the other tokens and clients
+		return scd_control_token_job_run(msg, fd, io);
 	case DAEMON_TO_TOKEN__CODE__PULL_DEVICE_CSR: {
 		TRACE("SCD: Handle messsage PULL_DEV_CSR");
 		uint8_t *csr = NULL;
@@ -412,7 +744,7 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 				out.device_csr.data = csr;
 			}
 		}
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		protobuf_writer_send_message(fd, (ProtobufCMessage *)&out);
 		INFO("csr: %p", csr);
 		if (csr)
 			mem_free0(csr);
@@ -432,7 +764,7 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 		} else {
 			out.code = TOKEN_TO_DAEMON__CODE__DEVICE_CERT_OK;
 		}
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		protobuf_writer_send_message(fd, (ProtobufCMessage *)&out);
 	} break;
 	/*
 	 * This case handles hashing request as part of
@@ -441,81 +773,63 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 	 */
 	case DAEMON_TO_TOKEN__CODE__CRYPTO_HASH_FILE: {
 		TRACE("SCD: Handle messsage CRYPTO_HASH_FILE");
-		unsigned int hash_len;
-		const char *hash_algo;
-		unsigned char *hash = NULL;
-		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
-		out.code = TOKEN_TO_DAEMON__CODE__CRYPTO_HASH_ERROR;
-
-		hash_algo = switch_proto_hash_algo(msg->hash_algo);
-
-		if (hash_algo) {
-			if ((hash = ssl_hash_file(msg->hash_file, &hash_len, hash_algo)) == NULL) {
-				ERROR("Hashing file failed");
-			} else {
-				out.has_hash_value = true;
-				out.hash_value.len = hash_len;
-				out.hash_value.data = hash;
-				out.code = TOKEN_TO_DAEMON__CODE__CRYPTO_HASH_OK;
-			}
+		scd_control_hash_job_t *job = scd_control_hash_job_new(msg, fd);
+		if (!job) {
+			TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
+			out.code = TOKEN_TO_DAEMON__CODE__CRYPTO_HASH_ERROR;
+			out.has_request_id = msg->has_request_id;
+			out.request_id = msg->request_id;
+			protobuf_writer_send_message(fd, (ProtobufCMessage *)&out);
+			break;
 		}
-
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
-		if (hash)
-			mem_free0(hash);
-	} break;
-	/*
-	 * This case handles verify requests as part of TSF.CML.Updates
-	 */
-	case DAEMON_TO_TOKEN__CODE__CRYPTO_VERIFY_BUF: {
-		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
-		out.code = TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_ERROR;
-		char *tmp_data_file =
-			write_to_tmpfile_new(msg->verify_data_buf.data, msg->verify_data_buf.len);
-		char *tmp_sig_file =
-			write_to_tmpfile_new(msg->verify_sig_buf.data, msg->verify_sig_buf.len);
-		char *tmp_cert_file =
-			write_to_tmpfile_new(msg->verify_cert_buf.data, msg->verify_cert_buf.len);
-		if (tmp_data_file && tmp_sig_file && tmp_cert_file) {
-			out.code =
-				scd_control_handle_verify(tmp_data_file, tmp_sig_file,
-							  tmp_cert_file,
-							  switch_proto_hash_algo(msg->hash_algo));
-		}
-
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
-		if (tmp_data_file) {
-			unlink(tmp_data_file);
-			mem_free0(tmp_data_file);
+		if (job->cached) {
+			scd_control_hash_job_done(job);
+			break;
 		}
-		if (tmp_sig_file) {
-			unlink(tmp_sig_file);
-			mem_free0(tmp_sig_file);
+		// hashing large images takes a while, do not block other clients meanwhile
+		if (worker_run(scd_control_hash_job_work, scd_control_hash_job_done, job) < 0) {
+			WARN("Could not hand off hashing to a worker, hashing synchronously");
+			scd_control_hash_job_work(job);
+			scd_control_hash_job_done(job);
 		}
-		if (tmp_cert_file) {
-			unlink(tmp_cert_file);
-			mem_free0(tmp_cert_file);
-		}
-
 	} break;
 	/*
-	 * This case handles verify requests as part of TSF.CML.SecureCompartmentInit
+	 * These cases handle verify requests as part of TSF.CML.Updates
+	 * and TSF.CML.SecureCompartmentInit
 	 */
+	case DAEMON_TO_TOKEN__CODE__CRYPTO_VERIFY_BUF:
 	case DAEMON_TO_TOKEN__CODE__CRYPTO_VERIFY_FILE: {
-		TRACE("SCD: Handle messsage CRYPTO_VERIFY_FILE");
+		TRACE("SCD: Handle messsage CRYPTO_VERIFY_%s",
+		      msg->code == DAEMON_TO_TOKEN__CODE__CRYPTO_VERIFY_BUF ? "BUF" : "FILE");
+		scd_control_verify_job_t *job = scd_control_verify_job_new(msg, fd);
+		// verifications of several images may run in parallel
+		if (worker_run(scd_control_verify_job_work, scd_control_verify_job_done, job) < 0) {
+			WARN("Could not hand off verification to a worker, verifying synchronously");
+			scd_control_verify_job_work(job);
+			scd_control_verify_job_done(job);
+		}
+	} break;
+	case DAEMON_TO_TOKEN__CODE__SAMPLER_START: {
 		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
-		out.code = scd_control_handle_verify(msg->verify_data_file, msg->verify_sig_file,
-						     msg->verify_cert_file,
-						     switch_proto_hash_algo(msg->hash_algo));
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		out.code = sampler_start(SCD_SAMPLER_FILE, msg->sampler_hz, msg->sampler_interval) ?
+				   TOKEN_TO_DAEMON__CODE__SAMPLER_FAILED :
+				   TOKEN_TO_DAEMON__CODE__SAMPLER_OK;
+		protobuf_writer_send_message(fd, (ProtobufCMessage *)&out);
+	} break;
+	case DAEMON_TO_TOKEN__CODE__SAMPLER_STOP: {
+		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
+		sampler_stop();
+		out.code = TOKEN_TO_DAEMON__CODE__SAMPLER_OK;
+		protobuf_writer_send_message(fd, (ProtobufCMessage *)&out);
 	} break;
 	default:
 		WARN("DaemonToToken command %d unknown or not implemented yet", msg->code);
 		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
 		out.code = TOKEN_TO_DAEMON__CODE__CMD_UNKNOWN;
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		protobuf_writer_send_message(fd, (ProtobufCMessage *)&out);
 		break;
 	}
+	return false;
 }
 
 /**
@@ -538,8 +852,8 @@ scd_control_cb_recv_message(int fd, unsigned events, event_io_t *io, UNUSED void
 		// close connection if client EOF, or protocol parse error
 		IF_NULL_GOTO_TRACE(msg, connection_err);
 
-		scd_control_handle_message(msg, fd);
-		protobuf_free_message((ProtobufCMessage *)msg);
+		if (!scd_control_handle_message(msg, fd, io))
+			protobuf_free_message((ProtobufCMessage *)msg);
 		DEBUG("Handled control connection %d", fd);
 	}
 	if (events & EVENT_IO_EXCEPT) {
@@ -549,6 +863,8 @@ scd_control_cb_recv_message(int fd, unsigned events, event_io_t *io, UNUSED void
 	return;
 
 connection_err:
+	scd_control_jobs_disconnect(fd);
+	protobuf_writer_free(protobuf_writer_get_by_fd(fd));
 	event_remove_io(io);
 	event_io_free(io);
 	if (close(fd) < 0)
@@ -588,6 +904,8 @@ scd_control_cb_accept(int fd, unsigned events, event_io_t *io, void *data)
 	DEBUG("Accepted control connection %d", cfd);
 
 	fd_make_non_blocking(cfd);
+	if (!protobuf_writer_new(cfd, 0, NULL, NULL))
+		WARN("Could not create outbound queue for fd %d, sending synchronously", cfd);
 
 	event_io_t *event = event_io_new(cfd, EVENT_IO_READ, scd_control_cb_recv_message, control);
 	event_add_io(event);
@@ -607,6 +925,12 @@ scd_control_new(const char *path)
 		return NULL;
 	}
 
+	if (!scd_control_verify_ctx_ssig) {
+		scd_control_verify_ctx_ssig = ssl_verify_ctx_new(SSIG_ROOT_CERT, true);
+		scd_control_verify_ctx_trusted = ssl_verify_ctx_new(TRUSTED_CA_STORE, true);
+		scd_control_verify_ctx_localca = ssl_verify_ctx_new(LOCALCA_ROOT_CERT, true);
+	}
+
 	scd_control_t *scd_control = mem_new0(scd_control_t, 1);
 	scd_control->sock = sock;
 
@@ -0,0 +1,336 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "hash_cache.h"
+#include "scd_shared.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/list.h"
+#include "common/file.h"
+#include "common/hex.h"
+#include "common/str.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SCD_HASH_CACHE_FILE SCD_TOKEN_DIR "/image_hash.cache"
+#define SCD_HASH_CACHE_KEY_FILE SCD_TOKEN_DIR "/image_hash.key"
+#define SCD_HASH_CACHE_KEY_LEN 32
+#define SCD_HASH_CACHE_MAX_ENTRIES 256
+#define SCD_HASH_CACHE_MAX_FILE_SIZE (1024 * 1024)
+
+typedef struct scd_hash_cache_entry {
+	uint64_t dev, ino, size;
+	int64_t mtime_sec, mtime_nsec;
+	int64_t ctime_sec, ctime_nsec;
+	char *algo;
+	char *digest; // hex
+	char *path;
+} scd_hash_cache_entry_t;
+
+static list_t *scd_hash_cache = NULL;
+static bool scd_hash_cache_loaded = false;
+static unsigned char scd_hash_cache_key[SCD_HASH_CACHE_KEY_LEN];
+
+static unsigned char *
+scd_hash_cache_bin_new(const char *hex, int *len)
+{
+	size_t hex_len = strlen(hex);
+	IF_TRUE_RETVAL(hex_len % 2, NULL);
+
+	unsigned char *bin = mem_alloc0(hex_len / 2);
+	for (size_t i = 0; i < hex_len / 2; i++) {
+		if (sscanf(hex + 2 * i, "%2hhx", &bin[i]) != 1) {
+			mem_free0(bin);
+			return NULL;
+		}
+	}
+	*len = hex_len / 2;
+	return bin;
+}
+
+static void
+scd_hash_cache_entry_free(scd_hash_cache_entry_t *entry)
+{
+	mem_free0(entry->algo);
+	mem_free0(entry->digest);
+	mem_free0(entry->path);
+	mem_free0(entry);
+}
+
+static void
+scd_hash_cache_entry_set_stat(scd_hash_cache_entry_t *entry, const struct stat *st)
+{
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->size = st->st_size;
+	entry->mtime_sec = st->st_mtim.tv_sec;
+	entry->mtime_nsec = st->st_mtim.tv_nsec;
+	entry->ctime_sec = st->st_ctim.tv_sec;
+	entry->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+static bool
+scd_hash_cache_entry_matches(const scd_hash_cache_entry_t *entry, const char *path,
+			     const struct stat *st, const char *algo)
+{
+	scd_hash_cache_entry_t cur;
+	scd_hash_cache_entry_set_stat(&cur, st);
+
+	return cur.dev == entry->dev && cur.ino == entry->ino && cur.size == entry->size &&
+	       cur.mtime_sec == entry->mtime_sec && cur.mtime_nsec == entry->mtime_nsec &&
+	       cur.ctime_sec == entry->ctime_sec && cur.ctime_nsec == entry->ctime_nsec &&
+	       !strcmp(entry->algo, algo) && !strcmp(entry->path, path);
+}
+
+bool
+scd_hash_cache_stat_equal(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+	       a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+	       a->st_ctim.tv_sec == b->st_ctim.tv_sec && a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+/*
+ * Reads the HMAC key, or creates a new one (which invalidates any existing cache).
+ */
+static int
+scd_hash_cache_load_key(void)
+{
+	if (file_exists(SCD_HASH_CACHE_KEY_FILE)) {
+		if (file_read(SCD_HASH_CACHE_KEY_FILE, (char *)scd_hash_cache_key,
+			      SCD_HASH_CACHE_KEY_LEN) == SCD_HASH_CACHE_KEY_LEN)
+			return 0;
+		WARN("Invalid hash cache key, creating a new one");
+	}
+
+	if (RAND_bytes(scd_hash_cache_key, SCD_HASH_CACHE_KEY_LEN) != 1) {
+		ERROR("Failed to generate hash cache key");
+		return -1;
+	}
+	int fd = open(SCD_HASH_CACHE_KEY_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		ERROR_ERRNO("Failed to create %s", SCD_HASH_CACHE_KEY_FILE);
+		return -1;
+	}
+	ssize_t len = write(fd, scd_hash_cache_key, SCD_HASH_CACHE_KEY_LEN);
+	close(fd);
+	if (len != SCD_HASH_CACHE_KEY_LEN) {
+		ERROR_ERRNO("Failed to write %s", SCD_HASH_CACHE_KEY_FILE);
+		unlink(SCD_HASH_CACHE_KEY_FILE);
+		return -1;
+	}
+	unlink(SCD_HASH_CACHE_FILE);
+	return 0;
+}
+
+static char *
+scd_hash_cache_hmac_new(const char *buf, size_t len)
+{
+	unsigned char mac[EVP_MAX_MD_SIZE];
+	unsigned int mac_len = 0;
+
+	if (!HMAC(EVP_sha256(), scd_hash_cache_key, SCD_HASH_CACHE_KEY_LEN,
+		  (const unsigned char *)buf, len, mac, &mac_len))
+		return NULL;
+
+	return hex_encode_new(mac, mac_len);
+}
+
+static void
+scd_hash_cache_load(void)
+{
+	scd_hash_cache_loaded = true;
+
+	if (scd_hash_cache_load_key() < 0) {
+		// without a key, the cache is disabled
+		scd_hash_cache_loaded = false;
+		return;
+	}
+
+	char *buf = file_read_new(SCD_HASH_CACHE_FILE, SCD_HASH_CACHE_MAX_FILE_SIZE);
+	IF_NULL_RETURN(buf);
+
+	// the last line holds the HMAC over everything before it
+	char *mac_line = strstr(buf, "hmac ");
+	while (mac_line && mac_line != buf && mac_line[-1] != '\n')
+		mac_line = strstr(mac_line + 1, "hmac ");
+	char *mac = mac_line ? scd_hash_cache_hmac_new(buf, mac_line - buf) : NULL;
+	size_t mac_hex_len = mac ? strlen(mac) : 0;
+	if (!mac || strlen(mac_line) < 5 + mac_hex_len ||
+	    CRYPTO_memcmp(mac, mac_line + 5, mac_hex_len)) {
+		WARN("Hash cache failed verification, discarding it");
+		mem_free0(mac);
+		mem_free0(buf);
+		unlink(SCD_HASH_CACHE_FILE);
+		return;
+	}
+	mem_free0(mac);
+	*mac_line = '\0';
+
+	char *saveptr = NULL;
+	for (char *line = strtok_r(buf, "\n", &saveptr); line;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		scd_hash_cache_entry_t *entry = mem_new0(scd_hash_cache_entry_t, 1);
+		char algo[16], digest[2 * EVP_MAX_MD_SIZE + 1];
+		int path_off = 0;
+		if (sscanf(line,
+			   "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNd64 ".%" SCNd64 " %" SCNd64
+			   ".%" SCNd64 " %15s %128s %n",
+			   &entry->dev, &entry->ino, &entry->size, &entry->mtime_sec,
+			   &entry->mtime_nsec, &entry->ctime_sec, &entry->ctime_nsec, algo, digest,
+			   &path_off) < 9 ||
+		    !path_off) {
+			WARN("Skipping malformed hash cache entry");
+			mem_free0(entry);
+			continue;
+		}
+		entry->algo = mem_strdup(algo);
+		entry->digest = mem_strdup(digest);
+		entry->path = mem_strdup(line + path_off);
+		scd_hash_cache = list_append(scd_hash_cache, entry);
+	}
+	mem_free0(buf);
+
+	DEBUG("Loaded %u hash cache entries", list_length(scd_hash_cache));
+}
+
+static void
+scd_hash_cache_save(void)
+{
+	str_t *out = str_new(NULL);
+	for (list_t *l = scd_hash_cache; l; l = l->next) {
+		scd_hash_cache_entry_t *entry = l->data;
+		str_append_printf(out,
+				  "%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRId64 ".%09" PRId64
+				  " %" PRId64 ".%09" PRId64 " %s %s %s\n",
+				  entry->dev, entry->ino, entry->size, entry->mtime_sec,
+				  entry->mtime_nsec, entry->ctime_sec, entry->ctime_nsec,
+				  entry->algo, entry->digest, entry->path);
+	}
+	char *mac = scd_hash_cache_hmac_new(str_buffer(out), str_length(out));
+	if (!mac) {
+		ERROR("Failed to authenticate hash cache");
+		str_free(out, true);
+		return;
+	}
+	str_append_printf(out, "hmac %s\n", mac);
+	mem_free0(mac);
+
+	// replace the cache atomically
+	char *tmp = mem_printf("%s.tmp", SCD_HASH_CACHE_FILE);
+	if (file_write(tmp, str_buffer(out), str_length(out)) < 0 ||
+	    rename(tmp, SCD_HASH_CACHE_FILE) < 0) {
+		WARN_ERRNO("Failed to write hash cache");
+		unlink(tmp);
+	}
+	mem_free0(tmp);
+	str_free(out, true);
+}
+
+bool
+scd_hash_cache_lookup(const char *file, size_t n, const char *const *algos, unsigned char **hashes,
+		      unsigned int *lens)
+{
+	ASSERT(file);
+
+	if (!scd_hash_cache_loaded)
+		scd_hash_cache_load();
+
+	struct stat st;
+	if (stat(file, &st) < 0)
+		return false;
+
+	for (size_t i = 0; i < n; i++)
+		hashes[i] = NULL;
+
+	for (size_t i = 0; i < n; i++) {
+		for (list_t *l = scd_hash_cache; l; l = l->next) {
+			scd_hash_cache_entry_t *entry = l->data;
+			if (!scd_hash_cache_entry_matches(entry, file, &st, algos[i]))
+				continue;
+			int len = 0;
+			hashes[i] = scd_hash_cache_bin_new(entry->digest, &len);
+			lens[i] = len;
+			break;
+		}
+		if (!hashes[i])
+			goto miss;
+	}
+	TRACE("Hash cache hit for %s", file);
+	return true;
+
+miss:
+	for (size_t i = 0; i < n; i++)
+		if (hashes[i])
+			mem_free0(hashes[i]);
+	return false;
+}
+
+void
+scd_hash_cache_store(const char *file, const struct stat *st, size_t n, const char *const *algos,
+		     unsigned char *const *hashes, const unsigned int *lens)
+{
+	ASSERT(file);
+	ASSERT(st);
+
+	if (!scd_hash_cache_loaded)
+		scd_hash_cache_load();
+	IF_FALSE_RETURN(scd_hash_cache_loaded);
+
+	// drop outdated entries of this file
+	for (list_t *l = scd_hash_cache; l;) {
+		scd_hash_cache_entry_t *entry = l->data;
+		l = l->next;
+		if (!strcmp(entry->path, file)) {
+			scd_hash_cache = list_remove(scd_hash_cache, entry);
+			scd_hash_cache_entry_free(entry);
+		}
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		scd_hash_cache_entry_t *entry = mem_new0(scd_hash_cache_entry_t, 1);
+		scd_hash_cache_entry_set_stat(entry, st);
+		entry->algo = mem_strdup(algos[i]);
+		entry->digest = hex_encode_new(hashes[i], lens[i]);
+		entry->path = mem_strdup(file);
+		scd_hash_cache = list_append(scd_hash_cache, entry);
+	}
+
+	while (list_length(scd_hash_cache) > SCD_HASH_CACHE_MAX_ENTRIES) {
+		scd_hash_cache_entry_t *oldest = scd_hash_cache->data;
+		scd_hash_cache = list_remove(scd_hash_cache, oldest);
+		scd_hash_cache_entry_free(oldest);
+	}
+
+	scd_hash_cache_save();
+}
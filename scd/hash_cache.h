@@ -0,0 +1,76 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2021 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file hash_cache.h
+ *
+ * Persistent cache of file digests computed by the scd, e.g., for guestos images.
+ * Entries are keyed by path, device, inode, size, mtime and ctime of the file, so any
+ * modification of the file invalidates its entry. The cache file is authenticated with
+ * an HMAC whose key is kept next to the device key in the token directory; a cache
+ * which fails verification is discarded as a whole.
+ */
+
+#ifndef SCD_HASH_CACHE_H
+#define SCD_HASH_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/**
+ * Looks up the digests of file for all n hash algorithms.
+ *
+ * @param file path of the file
+ * @param n number of hash algorithms
+ * @param algos names of the hash algorithms, e.g. "SHA256"
+ * @param hashes on a hit, set to newly allocated buffers holding the digests
+ * @param lens on a hit, set to the lengths of the digests
+ * @return true if all digests were found for the current state of the file
+ */
+bool
+scd_hash_cache_lookup(const char *file, size_t n, const char *const *algos, unsigned char **hashes,
+		      unsigned int *lens);
+
+/**
+ * Records the digests of a file and persists the cache.
+ *
+ * @param file path of the file
+ * @param st the state of the file while the digests were computed
+ * @param n number of hash algorithms
+ * @param algos names of the hash algorithms
+ * @param hashes the digests
+ * @param lens the lengths of the digests
+ */
+void
+scd_hash_cache_store(const char *file, const struct stat *st, size_t n, const char *const *algos,
+		     unsigned char *const *hashes, const unsigned int *lens);
+
+/**
+ * Checks whether the state of a file is still the one given by st, i.e., the file has
+ * not been modified in the meantime.
+ */
+bool
+scd_hash_cache_stat_equal(const struct stat *a, const struct stat *b);
+
+#endif /* SCD_HASH_CACHE_H */
@@ -0,0 +1,174 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "key_cache.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SCD_KEY_CACHE_SLOTS 16
+#define SCD_KEY_CACHE_MAX_KEY_LEN 128
+
+typedef struct scd_key_cache_entry {
+	bool used;
+	uint64_t last_use;
+	unsigned char id[SHA256_DIGEST_LENGTH];
+	int key_len;
+	unsigned char key[SCD_KEY_CACHE_MAX_KEY_LEN];
+} scd_key_cache_entry_t;
+
+struct scd_key_cache {
+	scd_key_cache_entry_t *entries; // mlock'ed mapping of SCD_KEY_CACHE_SLOTS entries
+	size_t map_len;
+	uint64_t clock;
+};
+
+static int
+scd_key_cache_id(unsigned char *id, const char *label, const unsigned char *wrapped_key,
+		 size_t wrapped_key_len)
+{
+	int ret = -1;
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	IF_NULL_RETVAL(ctx, -1);
+
+	// include the terminating '\0' to separate label and wrapped key
+	IF_TRUE_GOTO(EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1, out);
+	IF_TRUE_GOTO(EVP_DigestUpdate(ctx, label ? label : "", label ? strlen(label) + 1 : 1) != 1,
+		     out);
+	IF_TRUE_GOTO(EVP_DigestUpdate(ctx, wrapped_key, wrapped_key_len) != 1, out);
+	IF_TRUE_GOTO(EVP_DigestFinal_ex(ctx, id, NULL) != 1, out);
+	ret = 0;
+out:
+	EVP_MD_CTX_free(ctx);
+	return ret;
+}
+
+scd_key_cache_t *
+scd_key_cache_new(void)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t len = SCD_KEY_CACHE_SLOTS * sizeof(scd_key_cache_entry_t);
+	if (page_size > 0)
+		len = (len + page_size - 1) / page_size * page_size;
+
+	void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		ERROR_ERRNO("Could not map memory for key cache");
+		return NULL;
+	}
+	if (mlock(map, len) < 0) {
+		ERROR_ERRNO("Could not lock memory for key cache");
+		munmap(map, len);
+		return NULL;
+	}
+	if (madvise(map, len, MADV_DONTDUMP) < 0)
+		WARN_ERRNO("Could not exclude key cache from core dumps");
+
+	scd_key_cache_t *cache = mem_new0(scd_key_cache_t, 1);
+	cache->entries = map;
+	cache->map_len = len;
+	return cache;
+}
+
+int
+scd_key_cache_lookup(scd_key_cache_t *cache, const char *label, const unsigned char *wrapped_key,
+		     size_t wrapped_key_len, unsigned char **plain_key, int *plain_key_len)
+{
+	IF_NULL_RETVAL(cache, -1);
+	ASSERT(plain_key);
+	ASSERT(plain_key_len);
+
+	unsigned char id[SHA256_DIGEST_LENGTH];
+	IF_TRUE_RETVAL(scd_key_cache_id(id, label, wrapped_key, wrapped_key_len), -1);
+
+	for (int i = 0; i < SCD_KEY_CACHE_SLOTS; i++) {
+		scd_key_cache_entry_t *entry = &cache->entries[i];
+		if (!entry->used || CRYPTO_memcmp(entry->id, id, sizeof(id)))
+			continue;
+
+		entry->last_use = ++cache->clock;
+		*plain_key = mem_alloc(entry->key_len);
+		memcpy(*plain_key, entry->key, entry->key_len);
+		*plain_key_len = entry->key_len;
+		return 0;
+	}
+	return -1;
+}
+
+void
+scd_key_cache_store(scd_key_cache_t *cache, const char *label, const unsigned char *wrapped_key,
+		    size_t wrapped_key_len, const unsigned char *plain_key, int plain_key_len)
+{
+	IF_NULL_RETURN(cache);
+	IF_TRUE_RETURN(plain_key_len <= 0 || plain_key_len > SCD_KEY_CACHE_MAX_KEY_LEN);
+
+	unsigned char id[SHA256_DIGEST_LENGTH];
+	IF_TRUE_RETURN(scd_key_cache_id(id, label, wrapped_key, wrapped_key_len));
+
+	// reuse the entry of the same key, a free entry or the least recently used one
+	scd_key_cache_entry_t *slot = NULL;
+	for (int i = 0; i < SCD_KEY_CACHE_SLOTS; i++) {
+		scd_key_cache_entry_t *entry = &cache->entries[i];
+		if (entry->used && !memcmp(entry->id, id, sizeof(id))) {
+			slot = entry;
+			break;
+		}
+		if (!slot || (slot->used && (!entry->used || entry->last_use < slot->last_use)))
+			slot = entry;
+	}
+
+	OPENSSL_cleanse(slot, sizeof(*slot));
+	memcpy(slot->id, id, sizeof(id));
+	memcpy(slot->key, plain_key, plain_key_len);
+	slot->key_len = plain_key_len;
+	slot->last_use = ++cache->clock;
+	slot->used = true;
+}
+
+void
+scd_key_cache_wipe(scd_key_cache_t *cache)
+{
+	IF_NULL_RETURN(cache);
+	OPENSSL_cleanse(cache->entries, cache->map_len);
+}
+
+void
+scd_key_cache_free(scd_key_cache_t *cache)
+{
+	IF_NULL_RETURN(cache);
+
+	scd_key_cache_wipe(cache);
+	munlock(cache->entries, cache->map_len);
+	munmap(cache->entries, cache->map_len);
+	mem_free0(cache);
+}
@@ -0,0 +1,85 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file key_cache.h
+ *
+ * Cache of unwrapped container keys, owned by a single scd token. Entries live in a
+ * dedicated mlock'ed mapping which is excluded from core dumps and are looked up by a
+ * digest of label and wrapped key. The cache is meant to be scoped to an unlocked session
+ * of its token, i.e., it must be wiped whenever the token is (re)locked or removed.
+ */
+
+#ifndef SCD_KEY_CACHE_H
+#define SCD_KEY_CACHE_H
+
+#include <stddef.h>
+
+typedef struct scd_key_cache scd_key_cache_t;
+
+/**
+ * Creates a new, empty key cache.
+ *
+ * @return the new cache, NULL if the locked memory could not be set up
+ */
+scd_key_cache_t *
+scd_key_cache_new(void);
+
+/**
+ * Looks up the plain key for a wrapped key.
+ *
+ * @param cache the cache to search
+ * @param label label the key has been wrapped with
+ * @param wrapped_key the wrapped key
+ * @param wrapped_key_len length of wrapped_key
+ * @param plain_key on a hit, set to a newly allocated copy of the plain key
+ * @param plain_key_len on a hit, set to the length of plain_key
+ * @return 0 on a hit, -1 otherwise
+ */
+int
+scd_key_cache_lookup(scd_key_cache_t *cache, const char *label, const unsigned char *wrapped_key,
+		     size_t wrapped_key_len, unsigned char **plain_key, int *plain_key_len);
+
+/**
+ * Records the plain key of a wrapped key, evicting the least recently used entry
+ * if the cache is full. Keys exceeding the slot size are not cached.
+ */
+void
+scd_key_cache_store(scd_key_cache_t *cache, const char *label, const unsigned char *wrapped_key,
+		    size_t wrapped_key_len, const unsigned char *plain_key, int plain_key_len);
+
+/**
+ * Wipes all entries of the cache.
+ */
+void
+scd_key_cache_wipe(scd_key_cache_t *cache);
+
+/**
+ * Wipes the cache and releases its locked memory.
+ *
+ * @param cache the cache to be freed, may be NULL
+ */
+void
+scd_key_cache_free(scd_key_cache_t *cache);
+
+#endif /* SCD_KEY_CACHE_H */
@@ -0,0 +1,143 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "key_pool.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/list.h"
+#include "common/event.h"
+#include "common/worker.h"
+#include "common/ssl_util.h"
+
+// delay in ms before the pool is filled, to stay out of the way of the boot
+#define SCD_KEY_POOL_FILL_DELAY 60000
+
+typedef struct scd_key_pool_job {
+	worker_job_t *job;
+	EVP_PKEY *pkey;
+} scd_key_pool_job_t;
+
+static list_t *scd_key_pool_keys = NULL;
+static event_timer_t *scd_key_pool_timer = NULL;
+static scd_key_pool_job_t *scd_key_pool_job = NULL; // job generating the next key pair
+static bool scd_key_pool_filling = false;
+
+static void
+scd_key_pool_work(void *data)
+{
+	scd_key_pool_job_t *job = data;
+	job->pkey = ssl_mkkeypair(RSA_SSA_PADDING);
+}
+
+static void
+scd_key_pool_fill(void);
+
+static void
+scd_key_pool_done(void *data)
+{
+	scd_key_pool_job_t *job = data;
+	scd_key_pool_job = NULL;
+
+	if (!job->pkey) {
+		// do not retry right away, it would most likely fail again
+		WARN("Failed to generate a key pair for the key pool");
+	} else if (!scd_key_pool_filling) {
+		EVP_PKEY_free(job->pkey);
+	} else {
+		scd_key_pool_keys = list_append(scd_key_pool_keys, job->pkey);
+		DEBUG("Key pool holds %u key pairs", list_length(scd_key_pool_keys));
+		scd_key_pool_fill();
+	}
+	mem_free0(job);
+}
+
+/*
+ * Generates one key pair at a time, so at most one thread of the worker pool is busy.
+ */
+static void
+scd_key_pool_fill(void)
+{
+	IF_FALSE_RETURN(scd_key_pool_filling);
+	IF_TRUE_RETURN(scd_key_pool_job || scd_key_pool_timer);
+	IF_TRUE_RETURN(list_length(scd_key_pool_keys) >= SCD_KEY_POOL_SIZE);
+
+	scd_key_pool_job_t *job = mem_new0(scd_key_pool_job_t, 1);
+	job->job = worker_submit(WORKER_PRIO_LOW, scd_key_pool_work, scd_key_pool_done, job);
+	if (!job->job) {
+		WARN("Could not queue key pair generation for the key pool");
+		mem_free0(job);
+		return;
+	}
+	scd_key_pool_job = job;
+}
+
+static void
+scd_key_pool_timer_cb(event_timer_t *timer, UNUSED void *data)
+{
+	event_timer_free(timer);
+	scd_key_pool_timer = NULL;
+	scd_key_pool_fill();
+}
+
+void
+scd_key_pool_init(void)
+{
+	IF_TRUE_RETURN(SCD_KEY_POOL_SIZE <= 0 || scd_key_pool_filling);
+
+	scd_key_pool_filling = true;
+	scd_key_pool_timer =
+		event_timer_new(SCD_KEY_POOL_FILL_DELAY, 1, scd_key_pool_timer_cb, NULL);
+	event_add_timer(scd_key_pool_timer);
+}
+
+EVP_PKEY *
+scd_key_pool_take(void)
+{
+	IF_NULL_RETVAL(scd_key_pool_keys, NULL);
+
+	EVP_PKEY *pkey = scd_key_pool_keys->data;
+	scd_key_pool_keys = list_remove(scd_key_pool_keys, pkey);
+	scd_key_pool_fill();
+	return pkey;
+}
+
+void
+scd_key_pool_free(void)
+{
+	scd_key_pool_filling = false;
+
+	if (scd_key_pool_timer) {
+		event_remove_timer(scd_key_pool_timer);
+		event_timer_free(scd_key_pool_timer);
+		scd_key_pool_timer = NULL;
+	}
+	// a running job frees its key pair once done
+	if (scd_key_pool_job && worker_cancel(scd_key_pool_job->job) == 0)
+		mem_free0(scd_key_pool_job);
+
+	for (list_t *l = scd_key_pool_keys; l; l = l->next)
+		EVP_PKEY_free(l->data);
+	list_delete(scd_key_pool_keys);
+	scd_key_pool_keys = NULL;
+}
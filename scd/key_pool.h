@@ -0,0 +1,67 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file key_pool.h
+ *
+ * Pool of RSA key pairs for new softtokens, generated in the background by low priority
+ * jobs of the worker pool. Creating the softtoken of a new container then only takes
+ * a key pair from the pool instead of generating one, which takes seconds on slow
+ * devices. The pool is filled some time after the scd started and refilled whenever a
+ * key pair has been taken. Its key pairs are only kept in memory.
+ */
+
+#ifndef SCD_KEY_POOL_H
+#define SCD_KEY_POOL_H
+
+#include <openssl/evp.h>
+
+/**
+ * Number of key pairs kept in the pool, 0 disables the pool.
+ */
+#ifndef SCD_KEY_POOL_SIZE
+#define SCD_KEY_POOL_SIZE 1
+#endif
+
+/**
+ * Schedules filling the pool. Must be called from the event loop thread, as all
+ * functions of this module.
+ */
+void
+scd_key_pool_init(void);
+
+/**
+ * Takes a key pair from the pool and triggers its replacement.
+ *
+ * @return a key pair to be freed by the caller, NULL if the pool is empty
+ */
+EVP_PKEY *
+scd_key_pool_take(void);
+
+/**
+ * Frees all pooled key pairs and stops filling the pool.
+ */
+void
+scd_key_pool_free(void);
+
+#endif /* SCD_KEY_POOL_H */
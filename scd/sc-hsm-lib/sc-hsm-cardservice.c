@@ -68,6 +68,11 @@ dump(unsigned char *mem, int len)
 /**
  * Process an ISO 7816 APDU with the underlying CT-API terminal hardware.
  *
+ * Short length fields are used as long as Lc and Le fit, otherwise the command is sent
+ * as extended length APDU, which the SmartCard-HSM supports. This saves the round trips
+ * of command chaining or GET RESPONSE for larger payloads. The complete command and
+ * response must fit into MAX_APDULEN.
+ *
  * @param ctn the card terminal number
  * @param todad the destination address in the CT-API protocol
  * @param CLA  Class byte of instruction
@@ -87,7 +92,7 @@ processAPDU(int ctn, int todad, unsigned char CLA, unsigned char INS, unsigned c
 	    unsigned char P2, int OutLen, unsigned char *OutData, int InLen, unsigned char *InData,
 	    int InSize, unsigned short *SW1SW2)
 {
-	int rv, rc;
+	int rv, rc, extended;
 	unsigned short lenr;
 	unsigned char dad, sad;
 	unsigned char scr[MAX_APDULEN], *po;
@@ -95,6 +100,24 @@ processAPDU(int ctn, int todad, unsigned char CLA, unsigned char INS, unsigned c
 	/* Reset status word */
 	*SW1SW2 = 0x0000;
 
+	if (!OutData) {
+		OutLen = 0;
+	}
+
+	if ((OutLen < 0) || (InLen < 0)) {
+		return -1;
+	}
+
+	/* Le = 256 is still encoded in the short form as 0x00 */
+	extended = (OutLen > 255) || (InLen > 256);
+
+	/* Header, Lc, data and Le */
+	if (4 + (OutLen ? (extended ? 3 : 1) + OutLen : 0) +
+		    (InData && InSize ? (extended ? (OutLen ? 2 : 3) : 1) : 0) >
+	    MAX_APDULEN) {
+		return -1;
+	}
+
 	scr[0] = CLA;
 	scr[1] = INS;
 	scr[2] = P1;
@@ -102,8 +125,8 @@ processAPDU(int ctn, int todad, unsigned char CLA, unsigned char INS, unsigned c
 	po = scr + 4;
 	rv = 0;
 
-	if (OutData && OutLen) {
-		if ((OutLen <= 255) && (InLen <= 255)) {
+	if (OutLen) {
+		if (!extended) {
 			*po++ = (unsigned char)OutLen;
 		} else {
 			*po++ = 0;
@@ -116,14 +139,15 @@ processAPDU(int ctn, int todad, unsigned char CLA, unsigned char INS, unsigned c
 	}
 
 	if (InData && InSize) {
-		if ((InLen <= 255) && (OutLen <= 255)) {
+		if (!extended) {
 			*po++ = (unsigned char)InLen;
 		} else {
-			if (InLen >= 65556) {
+			/* Le = 65536 is encoded as 0x0000 */
+			if (InLen >= 65536) {
 				InLen = 0;
 			}
 
-			if (!OutData) {
+			if (!OutLen) {
 				*po++ = 0;
 			}
 
@@ -143,9 +167,9 @@ processAPDU(int ctn, int todad, unsigned char CLA, unsigned char INS, unsigned c
 
 	rc = CT_data(ctn, &dad, &sad, po - scr, scr, &lenr, scr);
 
-	if (rc < 0) {
+	if ((rc < 0) || (lenr < 2)) {
 		memset(scr, 0, sizeof(scr));
-		return rc;
+		return (rc < 0) ? rc : -1;
 	}
 
 #ifdef DEBUG_BUILD
@@ -44,6 +44,10 @@
 #include "common/list.h"
 #include "common/ssl_util.h"
 #include "token.h"
+#include "softtoken.h"
+#include "key_pool.h"
+
+#include <openssl/crypto.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -51,6 +55,8 @@
 #include <unistd.h>
 #include <signal.h>
 
+#define SCD_SECURE_HEAP_SIZE (64 * 1024)
+
 // clang-format off
 #define SCD_CONTROL_SOCKET SOCK_PATH(scd-control)
 // clang-format on
@@ -290,13 +296,12 @@ provisioning_mode()
 }
 
 static void
-scd_logfile_rename_cb(UNUSED event_timer_t *timer, UNUSED void *data)
+scd_logfile_prio_cb(event_timer_t *timer, UNUSED void *data)
 {
-	INFO("Logfile must be closed and a new file opened");
-	logf_unregister(scd_logfile_handler);
-	scd_logfile_handler =
-		logf_register(&logf_file_write, logf_file_new(LOGFILE_DIR "/cml-scd"));
+	// the log file is rotated by its stream, only the first day is logged verbosely
+	INFO("Restricting logfile to warnings");
 	logf_handler_set_prio(scd_logfile_handler, LOGF_PRIO_WARN);
+	event_timer_free(timer);
 }
 
 int
@@ -310,12 +315,14 @@ main(int argc, char **argv)
 		logf_register(&logf_klog_write, logf_klog_new(argv[0]));
 	logf_register(&logf_file_write, stdout);
 
-	scd_logfile_handler =
-		logf_register(&logf_file_write, logf_file_new(LOGFILE_DIR "/cml-scd"));
+	scd_logfile_handler = logf_register(
+		&logf_file_write,
+		logf_file_rotating_new(LOGFILE_DIR "/cml-scd", LOGF_FILE_ROTATE_SIZE,
+				       LOGF_FILE_ROTATE_AGE, LOGF_FILE_ROTATE_TOTAL));
 	logf_handler_set_prio(scd_logfile_handler, LOGF_PRIO_TRACE);
 
-	event_timer_t *logfile_timer = event_timer_new(
-		HOURS_TO_MILLISECONDS(24), EVENT_TIMER_REPEAT_FOREVER, scd_logfile_rename_cb, NULL);
+	event_timer_t *logfile_timer =
+		event_timer_new(HOURS_TO_MILLISECONDS(24), 1, scd_logfile_prio_cb, NULL);
 	event_add_timer(logfile_timer);
 
 	event_signal_t *sig_term = event_signal_new(SIGTERM, &scd_sigterm_cb, NULL);
@@ -325,6 +332,10 @@ main(int argc, char **argv)
 	DEBUG("Creating libctccid log directory at /var/tmp/sc-hsm-embedded");
 	dir_mkdir_p("/var/tmp/sc-hsm-embedded", 0755);
 #endif
+#ifdef ENABLESCHSM
+	if (usbtoken_readers_watch() < 0)
+		WARN("Could not watch usb uevents, token readers are enumerated on each lookup");
+#endif
 
 	provisioning_mode();
 
@@ -335,6 +346,10 @@ main(int argc, char **argv)
 		FATAL("Failed to initialize OpenSSL stack for scd runtime");
 	}
 
+	// softtoken keys may outlive a lock (idle window), keep their secrets in locked memory
+	if (SOFTTOKEN_IDLE_TIMEOUT > 0 && CRYPTO_secure_malloc_init(SCD_SECURE_HEAP_SIZE, 64) != 1)
+		WARN("Failed to set up secure heap, softtoken keys may be swapped out");
+
 	DEBUG("Try to create directory for socket if not existing");
 	if (dir_mkdir_p(CMLD_SOCKET_DIR, 0755) < 0) {
 		FATAL("Could not create directory for scd_control socket");
@@ -347,6 +362,9 @@ main(int argc, char **argv)
 
 	INFO("created control socket.");
 
+	// key pairs for the softtokens of new containers are generated while idle
+	scd_key_pool_init();
+
 	DEBUG("Try to create directory for tokencontrl sockets if not existing");
 	if (dir_mkdir_p(SCD_TOKENCONTROL_SOCKET, 0755) < 0) {
 		FATAL("Could not create directory for scd_control socket");
@@ -360,6 +378,7 @@ main(int argc, char **argv)
 #endif
 
 	event_loop();
+	scd_key_pool_free();
 	ssl_free();
 
 	return 0;
@@ -418,6 +437,10 @@ scd_proto_to_tokentype(const DaemonToToken *msg)
 scd_token_t *
 scd_get_token(scd_tokentype_t type, char *tuuid)
 {
+	// compare binary UUIDs instead of formatting the one of each token
+	uuid_bin_t bin;
+	IF_TRUE_RETVAL_TRACE(uuid_bin_parse(&bin, tuuid) < 0, NULL);
+
 	for (list_t *l = scd_token_list; l; l = l->next) {
 		scd_token_t *t = (scd_token_t *)l->data;
 		ASSERT(t);
@@ -426,7 +449,7 @@ scd_get_token(scd_tokentype_t type, char *tuuid)
 			continue;
 		}
 
-		if (strcmp(tuuid, uuid_string(token_get_uuid(t))) == 0) {
+		if (uuid_bin_equals(&bin, uuid_get_bin(token_get_uuid(t)))) {
 			TRACE("Token %s found in scd_token_list", uuid_string(token_get_uuid(t)));
 			return t;
 		}
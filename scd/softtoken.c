@@ -28,9 +28,15 @@
 #include "common/mem.h"
 #include "common/file.h"
 
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
 #include <string.h>
+#include <sys/stat.h>
 
 #define SOFTTOKEN_MAX_WRONG_UNLOCK_ATTEMPTS 3
+#define SOFTTOKEN_PASS_SALT_LEN 16
 
 struct softtoken {
 	char *token_file;		// absolute path to softtoken w. filename
@@ -39,13 +45,19 @@ struct softtoken {
 	EVP_PKEY *pkey;			// holds the token public key pair when unlocked
 	X509 *cert;			// holds the token's certificate, if available
 	STACK_OF(X509) * ca;		// holds the token's certificate chain, if available
+
+	// unlocked session, kept for SOFTTOKEN_IDLE_TIMEOUT after locking
+	bool has_session; // whether pkey, cert and ca may be resumed
+	unsigned char pass_salt[SOFTTOKEN_PASS_SALT_LEN];
+	unsigned char pass_digest[SHA256_DIGEST_LENGTH];
+	struct stat token_stat; // state of token_file when the secrets were read
 };
 
 /**
  * creates a new pkcs12 softtoken.
  */
 int
-softtoken_create_p12(const char *filename, const char *passwd, const char *name)
+softtoken_create_p12(const char *filename, const char *passwd, const char *name, EVP_PKEY *pkey)
 {
 	ASSERT(filename);
 	ASSERT(passwd);
@@ -57,7 +69,9 @@ softtoken_create_p12(const char *filename, const char *passwd, const char *name)
 		return -1;
 	}
 
-	if (ssl_create_pkcs12_token(filename, NULL, passwd, name, RSA_SSA_PADDING) != 0) {
+	int ret = pkey ? ssl_create_pkcs12_token_from_key(filename, NULL, passwd, name, pkey) :
+			 ssl_create_pkcs12_token(filename, NULL, passwd, name, RSA_SSA_PADDING);
+	if (ret != 0) {
 		ERROR("Unable to create pkcs12 token");
 		return -1;
 	}
@@ -95,13 +109,6 @@ softtoken_new_from_p12(const char *filename)
 	return token;
 }
 
-int
-softtoken_change_passphrase(softtoken_t *token, const char *oldpass, const char *newpass)
-{
-	ASSERT(token);
-	return ssl_newpass_pkcs12_token(token->token_file, oldpass, newpass);
-}
-
 /**
  * Free key and certificate data.
  * TODO distinguish private/secret data (which must be removed when locking)
@@ -111,6 +118,10 @@ static void
 softtoken_free_secrets(softtoken_t *token)
 {
 	ASSERT(token);
+	token->has_session = false;
+	OPENSSL_cleanse(token->pass_salt, sizeof(token->pass_salt));
+	OPENSSL_cleanse(token->pass_digest, sizeof(token->pass_digest));
+
 	if (token->pkey) {
 		// TODO check if we need to erase (overwrite) private key data from memory
 		EVP_PKEY_free(token->pkey);
@@ -126,6 +137,106 @@ softtoken_free_secrets(softtoken_t *token)
 	}
 }
 
+int
+softtoken_change_passphrase(softtoken_t *token, const char *oldpass, const char *newpass)
+{
+	ASSERT(token);
+
+	// a session kept for the old passphrase must not be resumable by it anymore
+	if (softtoken_is_locked(token))
+		softtoken_free_secrets(token);
+	else
+		token->has_session = false;
+
+	return ssl_newpass_pkcs12_token(token->token_file, oldpass, newpass);
+}
+
+static int
+softtoken_pass_digest(const unsigned char *salt, const char *passphrase, unsigned char *digest)
+{
+	int ret = -1;
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	IF_NULL_RETVAL(ctx, -1);
+
+	IF_TRUE_GOTO(EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1, out);
+	IF_TRUE_GOTO(EVP_DigestUpdate(ctx, salt, SOFTTOKEN_PASS_SALT_LEN) != 1, out);
+	IF_TRUE_GOTO(EVP_DigestUpdate(ctx, passphrase, strlen(passphrase)) != 1, out);
+	IF_TRUE_GOTO(EVP_DigestFinal_ex(ctx, digest, NULL) != 1, out);
+	ret = 0;
+out:
+	EVP_MD_CTX_free(ctx);
+	return ret;
+}
+
+static bool
+softtoken_stat_equal(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+	       a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+	       a->st_ctim.tv_sec == b->st_ctim.tv_sec && a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+/**
+ * Remembers the passphrase (salted digest) and file state of a successful unlock, so that
+ * the session can be resumed after locking.
+ */
+static void
+softtoken_session_remember(softtoken_t *token, const char *passphrase)
+{
+	token->has_session = false;
+	IF_TRUE_RETURN(SOFTTOKEN_IDLE_TIMEOUT <= 0);
+
+	IF_TRUE_RETURN(stat(token->token_file, &token->token_stat) < 0);
+	IF_TRUE_RETURN(RAND_bytes(token->pass_salt, sizeof(token->pass_salt)) != 1);
+	IF_TRUE_RETURN(softtoken_pass_digest(token->pass_salt, passphrase, token->pass_digest));
+
+	token->has_session = true;
+}
+
+/**
+ * Resumes a session kept after locking if passphrase and token file still match.
+ * Otherwise, the kept key material is dropped and the token has to be read again.
+ */
+static int
+softtoken_session_resume(softtoken_t *token, const char *passphrase)
+{
+	IF_FALSE_RETVAL(token->has_session && token->pkey, -1);
+
+	struct stat st;
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	bool match = stat(token->token_file, &st) == 0 &&
+		     softtoken_stat_equal(&st, &token->token_stat) &&
+		     softtoken_pass_digest(token->pass_salt, passphrase, digest) == 0 &&
+		     CRYPTO_memcmp(digest, token->pass_digest, sizeof(digest)) == 0;
+	OPENSSL_cleanse(digest, sizeof(digest));
+
+	if (!match) {
+		softtoken_free_secrets(token);
+		return -1;
+	}
+
+	DEBUG("Resuming unlocked session of softtoken %s", token->token_file);
+	return 0;
+}
+
+bool
+softtoken_has_idle_session(softtoken_t *token)
+{
+	ASSERT(token);
+	return token->locked && token->has_session && token->pkey;
+}
+
+void
+softtoken_drop_idle_session(softtoken_t *token)
+{
+	ASSERT(token);
+	IF_FALSE_RETURN(softtoken_has_idle_session(token));
+
+	DEBUG("Idle window of locked softtoken %s expired, dropping key material",
+	      token->token_file);
+	softtoken_free_secrets(token);
+}
+
 void
 softtoken_free(softtoken_t *token)
 {
@@ -197,6 +308,13 @@ softtoken_unlock(softtoken_t *token, char *passphrase)
 		ERROR("No token present");
 		return -1;
 	}
+
+	if (token->has_session && softtoken_session_resume(token, passphrase) == 0) {
+		token->locked = false;
+		token->wrong_unlock_attempts = 0;
+		return 0;
+	}
+
 	int res = ssl_read_pkcs12_token(token->token_file, passphrase, &token->pkey, &token->cert,
 					&token->ca);
 	if (res == -1) // wrong password
@@ -204,6 +322,7 @@ softtoken_unlock(softtoken_t *token, char *passphrase)
 	else if (res == 0) {
 		token->locked = false;
 		token->wrong_unlock_attempts = 0;
+		softtoken_session_remember(token, passphrase);
 	}
 	// TODO what to do with wrong_unlock_attempts if unlock failed for some other reason?
 
@@ -223,7 +342,11 @@ softtoken_lock(softtoken_t *token)
 		return 0;
 	}
 
-	softtoken_free_secrets(token);
 	token->locked = true;
+
+	// keep the key material until softtoken_drop_idle_session() to allow resuming the session
+	IF_TRUE_RETVAL(token->has_session, 0);
+
+	softtoken_free_secrets(token);
 	return 0;
 }
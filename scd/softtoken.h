@@ -32,13 +32,23 @@
 
 #define STOKEN_DEFAULT_EXT ".p12"
 
+/**
+ * Seconds the parsed key material of a softtoken is kept after locking. An unlock with
+ * the same passphrase within this idle window resumes the session without decrypting and
+ * parsing the PKCS#12 file again. 0 disables keeping key material of locked tokens.
+ */
+#ifndef SOFTTOKEN_IDLE_TIMEOUT
+#define SOFTTOKEN_IDLE_TIMEOUT 0
+#endif
+
 typedef struct softtoken softtoken_t;
 
 /**
- * creates new p12 token file.
+ * creates new p12 token file for the key pair pkey or, if pkey is NULL, a newly
+ * generated one. pkey is not freed.
  */
 int
-softtoken_create_p12(const char *filename, const char *passwd, const char *name);
+softtoken_create_p12(const char *filename, const char *passwd, const char *name, EVP_PKEY *pkey);
 
 /**
  * removes a pkcs12 token file.
@@ -73,6 +83,20 @@ softtoken_unlock(softtoken_t *token, char *passphrase);
 int
 softtoken_lock(softtoken_t *token);
 
+/**
+ * checks whether the softtoken is locked but keeps the key material of its last session
+ * for resuming it, which has to be dropped by softtoken_drop_idle_session() after
+ * SOFTTOKEN_IDLE_TIMEOUT seconds.
+ */
+bool
+softtoken_has_idle_session(softtoken_t *token);
+
+/**
+ * drops the key material of the idle session of a locked softtoken, if any
+ */
+void
+softtoken_drop_idle_session(softtoken_t *token);
+
 /**
  * checks whether the softtoken is locked or not
  */
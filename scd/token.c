@@ -24,6 +24,8 @@
 #include "token.h"
 
 #include "tokencontrol.pb-c.h"
+#include "key_cache.h"
+#include "key_pool.h"
 
 #include "common/macro.h"
 #include "common/mem.h"
@@ -34,9 +36,12 @@
 #include "common/list.h"
 #include "common/str.h"
 #include "common/fd.h"
+#include "common/worker.h"
 #include "file.h"
 #include "unistd.h"
 
+#include <pthread.h>
+
 #define SCD_TOKENCONTROL_SOCK_LISTEN_BACKLOG 1
 
 typedef struct scd_tokencontrol {
@@ -55,8 +60,30 @@ struct scd_token_data {
 	scd_tokentype_t type;
 	uuid_t *token_uuid;
 	tctrl_t *tctrl;
+	scd_key_cache_t *key_cache; // NULL if key caching is disabled
+
+	// all operations on the token run on its own queue, see token_run()
+	worker_queue_t *queue;
+	event_timer_t *idle_timer; // drops the idle session of a locked softtoken
+	bool removed;		   // token_free() was called, the token is freed after its jobs
 };
 
+typedef struct token_job {
+	scd_token_t *token;
+	void (*work)(scd_token_t *token, void *data);
+	void (*done)(void *data);
+	void *data;
+	bool idle_session; // state of the softtoken after the job, see token_idle_timer_update()
+} token_job_t;
+
+#ifdef ENABLESCHSM
+/*
+ * The CT-API is shared by all usb tokens. Card terminals are only opened and closed
+ * exclusively, while the per terminal calls of different tokens may run in parallel.
+ */
+static pthread_rwlock_t token_ctapi_lock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
+
 #ifdef ENABLESCHSM // tokencontrol socket only relevant for usbtoken
 static void
 wrapped_remove_event_io(void *elem)
@@ -71,44 +98,64 @@ wrapped_remove_event_io(void *elem)
 static void
 scd_tokencontrol_cb_accept(int fd, unsigned events, UNUSED event_io_t *io, void *data);
 
+/*
+ * A ContainerToToken request which is processed on the queue of the token. Reading from
+ * the connection pauses until the response has been sent.
+ */
+typedef struct scd_tokencontrol_job {
+	ContainerToToken *msg;
+	int fd;
+	event_io_t *io;
+	scd_token_t *token;
+	unsigned char *brsp;
+	int len; // of the response, < 0 on error
+} scd_tokencontrol_job_t;
+
 static void
-scd_tokencontrol_handle_message(const ContainerToToken *msg, int fd, void *data)
+scd_tokencontrol_disconnect(scd_token_t *token, int fd, event_io_t *io)
 {
-	ASSERT(msg);
-	ASSERT(data);
+	token->token_data->tctrl->events = list_remove(token->token_data->tctrl->events, io);
+	event_remove_io(io);
+	event_io_free(io);
 
-	DEBUG("scd_tokencontrol_handle_message");
+	token->token_data->tctrl->cfd = -1;
+	if (close(fd) < 0)
+		WARN_ERRNO("Failed to close connected control socket");
+
+	// accept new connection for respective token
+	event_io_t *event = event_io_new(token->token_data->tctrl->lsock, EVENT_IO_READ,
+					 scd_tokencontrol_cb_accept, token);
+	token->token_data->tctrl->events = list_append(token->token_data->tctrl->events, event);
+	event_add_io(event);
+}
 
-	scd_token_t *t = (scd_token_t *)(data);
-	tctrl_t *tctrl = t->token_data->tctrl;
-	int len = 0;
-	unsigned char *brsp = NULL;
+/*
+ * Runs on the queue of the token.
+ */
+static void
+scd_tokencontrol_handle_message(scd_token_t *t, void *data)
+{
+	scd_tokencontrol_job_t *job = data;
+	const ContainerToToken *msg = job->msg;
 
-	IF_NULL_GOTO_WARN(msg, err);
-	IF_NULL_GOTO_ERROR(tctrl, err);
+	DEBUG("scd_tokencontrol_handle_message");
 
-	TokenToContainer out = TOKEN_TO_CONTAINER__INIT;
-	brsp = mem_alloc0(MAX_APDU_BUF_LEN);
+	job->len = -1;
+	job->brsp = mem_alloc0(MAX_APDU_BUF_LEN);
 
 	switch (msg->command) {
 	case CONTAINER_TO_TOKEN__COMMAND__GET_ATR:
 		DEBUG("Handle CONTAINER_TO_TOKEN__COMMAND__GET_ATR msg");
-		len = t->get_atr(t, brsp, MAX_APDU_BUF_LEN);
-		if (len < 0) {
-			WARN("GET_ATR failed wit code %d", len);
-			goto err;
-		}
-		goto out;
+		job->len = t->get_atr(t, job->brsp, MAX_APDU_BUF_LEN);
+		if (job->len < 0)
+			WARN("GET_ATR failed wit code %d", job->len);
 		break;
 
 	case CONTAINER_TO_TOKEN__COMMAND__UNLOCK_TOKEN:
 		DEBUG("Handle CONTAINER_TO_TOKEN__COMMAND__UNLOCK_TOKEN");
-		len = t->reset_auth(t, brsp, MAX_APDU_BUF_LEN);
-		if (len < 0) {
-			WARN("GET_ATR failed wit code %d", len);
-			goto err;
-		}
-		goto out;
+		job->len = t->reset_auth(t, job->brsp, MAX_APDU_BUF_LEN);
+		if (job->len < 0)
+			WARN("GET_ATR failed wit code %d", job->len);
 		break;
 
 	case CONTAINER_TO_TOKEN__COMMAND__SEND_APDU:
@@ -118,48 +165,53 @@ scd_tokencontrol_handle_message(const ContainerToToken *msg, int fd, void *data)
 		TRACE("Got APDU with with len: %zu, data: %s", msg->apdu.len, str_buffer(dump));
 		str_free(dump, true);
 #endif
-		len = t->send_apdu(t, msg->apdu.data, msg->apdu.len, brsp, MAX_APDU_BUF_LEN);
-		if (len < 0) {
-			WARN("SEND_APDU failed wit code %d", len);
-			goto err;
-		}
-		goto out;
+		job->len = t->send_apdu(t, msg->apdu.data, msg->apdu.len, job->brsp,
+					MAX_APDU_BUF_LEN);
+		if (job->len < 0)
+			WARN("SEND_APDU failed wit code %d", job->len);
 		break;
 
 	default:
 		WARN("ContainerToToken command %d unknown or not implemented yet", msg->command);
 	}
+}
 
-err:
-	/* TODO: distinguish error soruces and set return code accordingly */
-	out.return_code = TOKEN_TO_CONTAINER__CODE__ERR_INVALID;
-	if ((protobuf_send_message(fd, (ProtobufCMessage *)&out)) < 0) {
-		ERROR("Could not send protobuf response on socker %d", fd);
-	}
-	goto close_fd;
+static void
+scd_tokencontrol_job_done(void *data)
+{
+	scd_tokencontrol_job_t *job = data;
+	TokenToContainer out = TOKEN_TO_CONTAINER__INIT;
 
-close_fd:
-	mem_free0(brsp);
-	if (close(fd) < 0)
-		WARN_ERRNO("Failed to close connected control socket");
-	return;
+	if (job->len < 0) {
+		/* TODO: distinguish error soruces and set return code accordingly */
+		out.return_code = TOKEN_TO_CONTAINER__CODE__ERR_INVALID;
+		if ((protobuf_send_message(job->fd, (ProtobufCMessage *)&out)) < 0) {
+			ERROR("Could not send protobuf response on socker %d", job->fd);
+		}
+		scd_tokencontrol_disconnect(job->token, job->fd, job->io);
+		goto out;
+	}
 
-out:
 	out.return_code = TOKEN_TO_CONTAINER__CODE__OK;
 	out.has_response = true;
-	out.response.len = len;
-	out.response.data = brsp;
+	out.response.len = job->len;
+	out.response.data = job->brsp;
 
 #ifdef DEBUG_BUILD
-	str_t *dump = str_hexdump_new(brsp, len);
+	str_t *dump = str_hexdump_new(job->brsp, job->len);
 	TRACE("Returning apdu with len: %zu, data: %s", out.response.len, str_buffer(dump));
 	str_free(dump, true);
 #endif
 
-	if ((protobuf_send_message(fd, (ProtobufCMessage *)&out)) < 0) {
-		ERROR("Could not send protobuf response on socket %d", fd);
+	if ((protobuf_send_message(job->fd, (ProtobufCMessage *)&out)) < 0) {
+		ERROR("Could not send protobuf response on socket %d", job->fd);
 	}
-	mem_free0(brsp);
+	DEBUG("Handled control connection %d", job->fd);
+	event_add_io(job->io);
+out:
+	protobuf_free_message((ProtobufCMessage *)job->msg);
+	mem_free0(job->brsp);
+	mem_free0(job);
 }
 
 /**
@@ -186,9 +238,20 @@ scd_tokencontrol_cb_recv_message(int fd, unsigned events, event_io_t *io, void *
 		// close connection if client EOF, or protocol parse error
 		IF_NULL_GOTO_TRACE(msg, connection_err);
 
-		scd_tokencontrol_handle_message(msg, fd, data);
-		protobuf_free_message((ProtobufCMessage *)msg);
-		DEBUG("Handled control connection %d", fd);
+		scd_tokencontrol_job_t *job = mem_new0(scd_tokencontrol_job_t, 1);
+		job->msg = msg;
+		job->fd = fd;
+		job->io = io;
+		job->token = token;
+
+		if (token_run(token, scd_tokencontrol_handle_message, scd_tokencontrol_job_done,
+			      job) < 0) {
+			protobuf_free_message((ProtobufCMessage *)msg);
+			mem_free0(job);
+			goto connection_err;
+		}
+		// the next request is read once the response has been sent
+		event_remove_io(io);
 	} else if (events & EVENT_IO_EXCEPT) {
 		INFO("TokenControl client closed connection; disconnecting socket.");
 		goto connection_err;
@@ -200,21 +263,7 @@ scd_tokencontrol_cb_recv_message(int fd, unsigned events, event_io_t *io, void *
 	return;
 
 connection_err:
-	token->token_data->tctrl->events = list_remove(token->token_data->tctrl->events, io);
-	event_remove_io(io);
-	event_io_free(io);
-
-	token->token_data->tctrl->cfd = -1;
-	if (close(fd) < 0)
-		WARN_ERRNO("Failed to close connected control socket");
-
-	// accept new connection for respective token
-	event_io_t *event = event_io_new(token->token_data->tctrl->lsock, EVENT_IO_READ,
-					 scd_tokencontrol_cb_accept, token);
-	token->token_data->tctrl->events = list_append(token->token_data->tctrl->events, event);
-	event_add_io(event);
-
-	return;
+	scd_tokencontrol_disconnect(token, fd, io);
 }
 
 /**
@@ -406,7 +455,11 @@ int_get_atr_st(UNUSED scd_token_t *token, UNUSED unsigned char *brsp, UNUSED siz
 int
 int_lock_usb(scd_token_t *token)
 {
-	return usbtoken_lock(token->token_data->int_token.usbtoken);
+	int ret;
+	pthread_rwlock_rdlock(&token_ctapi_lock);
+	ret = usbtoken_lock(token->token_data->int_token.usbtoken);
+	pthread_rwlock_unlock(&token_ctapi_lock);
+	return ret;
 }
 
 int
@@ -414,8 +467,12 @@ int_unlock_usb(scd_token_t *token, char *passwd, unsigned char *pairing_secret,
 	       size_t pairing_sec_len)
 {
 	TRACE("SCD: int_usb_unlock");
-	return usbtoken_unlock(token->token_data->int_token.usbtoken, passwd, pairing_secret,
-			       pairing_sec_len);
+	int ret;
+	pthread_rwlock_rdlock(&token_ctapi_lock);
+	ret = usbtoken_unlock(token->token_data->int_token.usbtoken, passwd, pairing_secret,
+			      pairing_sec_len);
+	pthread_rwlock_unlock(&token_ctapi_lock);
+	return ret;
 }
 
 bool
@@ -434,46 +491,70 @@ int
 int_wrap_usb(scd_token_t *token, char *label, unsigned char *plain_key, size_t plain_key_len,
 	     unsigned char **wrapped_key, int *wrapped_key_len)
 {
-	return usbtoken_wrap_key(token->token_data->int_token.usbtoken, (unsigned char *)label,
-				 strlen(label), plain_key, plain_key_len, wrapped_key,
-				 wrapped_key_len);
+	int ret;
+	pthread_rwlock_rdlock(&token_ctapi_lock);
+	ret = usbtoken_wrap_key(token->token_data->int_token.usbtoken, (unsigned char *)label,
+				strlen(label), plain_key, plain_key_len, wrapped_key,
+				wrapped_key_len);
+	pthread_rwlock_unlock(&token_ctapi_lock);
+	return ret;
 }
 
 int
 int_unwrap_usb(scd_token_t *token, char *label, unsigned char *wrapped_key, size_t wrapped_key_len,
 	       unsigned char **plain_key, int *plain_key_len)
 {
-	return usbtoken_unwrap_key(token->token_data->int_token.usbtoken, (unsigned char *)label,
-				   strlen(label), wrapped_key, wrapped_key_len, plain_key,
-				   plain_key_len);
+	int ret;
+	pthread_rwlock_rdlock(&token_ctapi_lock);
+	ret = usbtoken_unwrap_key(token->token_data->int_token.usbtoken, (unsigned char *)label,
+				  strlen(label), wrapped_key, wrapped_key_len, plain_key,
+				  plain_key_len);
+	pthread_rwlock_unlock(&token_ctapi_lock);
+	return ret;
 }
 
 int
 int_change_pw_usb(scd_token_t *token, const char *oldpass, const char *newpass,
 		  unsigned char *pairing_secret, size_t pairing_sec_len, bool is_provisioning)
 {
-	return usbtoken_change_passphrase(token->token_data->int_token.usbtoken, oldpass, newpass,
-					  pairing_secret, pairing_sec_len, is_provisioning);
+	int ret;
+	pthread_rwlock_rdlock(&token_ctapi_lock);
+	ret = usbtoken_change_passphrase(token->token_data->int_token.usbtoken, oldpass, newpass,
+					 pairing_secret, pairing_sec_len, is_provisioning);
+	pthread_rwlock_unlock(&token_ctapi_lock);
+	return ret;
 }
 
 int
 int_send_apdu_usb(scd_token_t *token, unsigned char *apdu, size_t apdu_len, unsigned char *brsp,
 		  size_t brsp_len)
 {
-	return usbtoken_send_apdu(token->token_data->int_token.usbtoken, apdu, apdu_len, brsp,
-				  brsp_len);
+	int ret;
+	pthread_rwlock_rdlock(&token_ctapi_lock);
+	ret = usbtoken_send_apdu(token->token_data->int_token.usbtoken, apdu, apdu_len, brsp,
+				 brsp_len);
+	pthread_rwlock_unlock(&token_ctapi_lock);
+	return ret;
 }
 
 int
 int_reset_auth_usb(scd_token_t *token, unsigned char *brsp, size_t brsp_len)
 {
-	return usbtoken_reset_auth(token->token_data->int_token.usbtoken, brsp, brsp_len);
+	int ret;
+	pthread_rwlock_rdlock(&token_ctapi_lock);
+	ret = usbtoken_reset_auth(token->token_data->int_token.usbtoken, brsp, brsp_len);
+	pthread_rwlock_unlock(&token_ctapi_lock);
+	return ret;
 }
 
 int
 int_get_atr_usb(scd_token_t *token, unsigned char *brsp, size_t brsp_len)
 {
-	return usbtoken_get_atr(token->token_data->int_token.usbtoken, brsp, brsp_len);
+	int ret;
+	pthread_rwlock_rdlock(&token_ctapi_lock);
+	ret = usbtoken_get_atr(token->token_data->int_token.usbtoken, brsp, brsp_len);
+	pthread_rwlock_unlock(&token_ctapi_lock);
+	return ret;
 }
 #endif // ENABLESCHSM
 
@@ -491,7 +572,7 @@ token_new(const token_constr_data_t *constr_data)
 		return NULL;
 	}
 
-	new_token->token_data = mem_new(scd_token_data_t, 1);
+	new_token->token_data = mem_new0(scd_token_data_t, 1);
 	if (!new_token->token_data) {
 		ERROR("Could not allocate memory for token_data_t");
 		goto err;
@@ -503,6 +584,12 @@ token_new(const token_constr_data_t *constr_data)
 		goto err;
 	}
 
+	new_token->token_data->queue = worker_queue_new();
+	if (!new_token->token_data->queue) {
+		ERROR("Could not start worker queue for token %s", constr_data->uuid);
+		goto err;
+	}
+
 	switch (constr_data->type) {
 	case (NONE): {
 		WARN("Create scd_token with internal type 'NONE' selected. No token will be created.");
@@ -517,8 +604,12 @@ token_new(const token_constr_data_t *constr_data)
 		token_file = mem_printf("%s/%s%s", constr_data->init_str.softtoken_dir,
 					constr_data->uuid, STOKEN_DEFAULT_EXT);
 		if (!file_exists(token_file)) {
-			if (softtoken_create_p12(token_file, STOKEN_DEFAULT_PASS,
-						 constr_data->uuid) != 0) {
+			// a pooled key pair spares generating one while cmld waits
+			EVP_PKEY *pkey = scd_key_pool_take();
+			int ret = softtoken_create_p12(token_file, STOKEN_DEFAULT_PASS,
+						       constr_data->uuid, pkey);
+			EVP_PKEY_free(pkey);
+			if (ret != 0) {
 				ERROR("Could not create new softtoken file");
 				mem_free0(token_file);
 				goto err;
@@ -552,8 +643,10 @@ token_new(const token_constr_data_t *constr_data)
 		ASSERT(constr_data->uuid);
 		ASSERT(constr_data->init_str.usbtoken_serial);
 
+		pthread_rwlock_wrlock(&token_ctapi_lock);
 		new_token->token_data->int_token.usbtoken =
 			usbtoken_new(constr_data->init_str.usbtoken_serial);
+		pthread_rwlock_unlock(&token_ctapi_lock);
 		if (!new_token->token_data->int_token.usbtoken) {
 			ERROR("Creation of usbtoken failed");
 			goto err;
@@ -583,9 +676,18 @@ token_new(const token_constr_data_t *constr_data)
 		goto err;
 	}
 
+#ifdef SCD_KEY_CACHE
+	new_token->token_data->key_cache = scd_key_cache_new();
+	if (!new_token->token_data->key_cache)
+		WARN("Could not set up key cache for token %s, keys are unwrapped on each request",
+		     constr_data->uuid);
+#endif
+
 	return new_token;
 
 err:
+	if (new_token->token_data->queue)
+		worker_queue_free(new_token->token_data->queue);
 	if (new_token->token_data->token_uuid)
 		uuid_free(new_token->token_data->token_uuid);
 	if (new_token->token_data)
@@ -596,6 +698,113 @@ err:
 	return NULL;
 }
 
+static void
+token_free_work(scd_token_t *token, UNUSED void *data);
+
+static void
+token_job_work(void *data)
+{
+	token_job_t *job = data;
+	scd_token_t *token = job->token;
+
+	job->work(token, job->data);
+
+	// the event loop must not touch the token itself, thus its state is taken here
+	if (token->token_data->type == SOFT && job->work != token_free_work)
+		job->idle_session =
+			softtoken_has_idle_session(token->token_data->int_token.softtoken);
+}
+
+static void
+token_idle_timer_update(scd_token_t *token, bool idle_session);
+
+static void
+token_job_done(void *data)
+{
+	token_job_t *job = data;
+
+	// a removed token is freed by the done function of its last job
+	if (!job->token->token_data->removed)
+		token_idle_timer_update(job->token, job->idle_session);
+
+	job->done(job->data);
+	mem_free0(job);
+}
+
+static int
+token_submit(scd_token_t *token, void (*work)(scd_token_t *token, void *data),
+	     void (*done)(void *data), void *data)
+{
+	token_job_t *job = mem_new0(token_job_t, 1);
+	job->token = token;
+	job->work = work;
+	job->done = done;
+	job->data = data;
+
+	if (!worker_queue_submit(token->token_data->queue, token_job_work, token_job_done, job)) {
+		mem_free0(job);
+		return -1;
+	}
+	return 0;
+}
+
+int
+token_run(scd_token_t *token, void (*work)(scd_token_t *token, void *data),
+	  void (*done)(void *data), void *data)
+{
+	ASSERT(token);
+	ASSERT(token->token_data);
+	IF_TRUE_RETVAL_ERROR(token->token_data->removed, -1);
+
+	return token_submit(token, work, done, data);
+}
+
+static void
+token_idle_drop_work(scd_token_t *token, UNUSED void *data)
+{
+	softtoken_drop_idle_session(token->token_data->int_token.softtoken);
+}
+
+static void
+token_idle_drop_done(UNUSED void *data)
+{
+}
+
+static void
+token_idle_timeout_cb(event_timer_t *timer, void *data)
+{
+	scd_token_t *token = data;
+	ASSERT(token);
+
+	event_remove_timer(timer);
+	event_timer_free(timer);
+	token->token_data->idle_timer = NULL;
+	IF_TRUE_RETURN(token->token_data->removed);
+
+	DEBUG("Idle window of locked token %s expired", uuid_string(token->token_data->token_uuid));
+	if (token_run(token, token_idle_drop_work, token_idle_drop_done, NULL) < 0)
+		WARN("Could not drop idle session of token %s",
+		     uuid_string(token->token_data->token_uuid));
+}
+
+/*
+ * The idle window of a locked softtoken starts when its session becomes idle and ends
+ * when the session is resumed or dropped, as seen after each job of the token.
+ */
+static void
+token_idle_timer_update(scd_token_t *token, bool idle_session)
+{
+	if (idle_session && !token->token_data->idle_timer) {
+		token->token_data->idle_timer = event_timer_new(SOFTTOKEN_IDLE_TIMEOUT * 1000, 1,
+								token_idle_timeout_cb, token);
+		event_add_timer(token->token_data->idle_timer);
+	} else if (!idle_session && token->token_data->idle_timer) {
+		event_remove_timer(token->token_data->idle_timer);
+		event_timer_free(token->token_data->idle_timer);
+		token->token_data->idle_timer = NULL;
+	}
+}
+
 scd_tokentype_t
 token_get_type(scd_token_t *token)
 {
@@ -612,34 +821,104 @@ token_get_uuid(scd_token_t *token)
 	return token->token_data->token_uuid;
 }
 
+int
+token_unwrap_key_cached(scd_token_t *token, char *label, unsigned char *wrapped_key,
+			size_t wrapped_key_len, unsigned char **plain_key, int *plain_key_len)
+{
+	ASSERT(token);
+	ASSERT(token->token_data);
+
+	scd_key_cache_t *cache = token->token_data->key_cache;
+
+	// the token may have been locked behind our back, e.g. after failed unlock attempts
+	if (token->is_locked(token)) {
+		scd_key_cache_wipe(cache);
+		return -1;
+	}
+
+	if (scd_key_cache_lookup(cache, label, wrapped_key, wrapped_key_len, plain_key,
+				 plain_key_len) == 0) {
+		TRACE("Unwrapped key for %s taken from key cache", label);
+		return 0;
+	}
+
+	IF_TRUE_RETVAL(token->unwrap_key(token, label, wrapped_key, wrapped_key_len, plain_key,
+					 plain_key_len),
+		       -1);
+
+	scd_key_cache_store(cache, label, wrapped_key, wrapped_key_len, *plain_key, *plain_key_len);
+	return 0;
+}
+
 void
-token_free(scd_token_t *token)
+token_key_cache_wipe(scd_token_t *token)
 {
-	IF_NULL_RETURN(token);
+	ASSERT(token);
+	ASSERT(token->token_data);
+
+	scd_key_cache_wipe(token->token_data->key_cache);
+}
 
-	if (token->token_data) {
-		switch (token->token_data->type) {
-		case (NONE):
-			break;
-		case (SOFT):
-			TRACE("Removing softtoken %s", uuid_string(token->token_data->token_uuid));
-			softtoken_remove_p12(token->token_data->int_token.softtoken);
-			softtoken_free(token->token_data->int_token.softtoken);
-			break;
+/*
+ * Releases the token itself, runs as the last job on its queue.
+ */
+static void
+token_free_work(scd_token_t *token, UNUSED void *data)
+{
+	switch (token->token_data->type) {
+	case (SOFT):
+		TRACE("Removing softtoken %s", uuid_string(token->token_data->token_uuid));
+		softtoken_remove_p12(token->token_data->int_token.softtoken);
+		softtoken_free(token->token_data->int_token.softtoken);
+		break;
 #ifdef ENABLESCHSM
-		case (USB):
-			scd_tokencontrol_free(token);
-			usbtoken_free(token->token_data->int_token.usbtoken);
-			break;
+	case (USB):
+		pthread_rwlock_wrlock(&token_ctapi_lock);
+		usbtoken_free(token->token_data->int_token.usbtoken);
+		pthread_rwlock_unlock(&token_ctapi_lock);
+		break;
 #endif // ENABLESCHSM
-		default:
-			ERROR("Failed to determine token type. Cannot clean up");
-			return;
-		}
+	default:
+		break;
+	}
+}
 
-		if (token->token_data->token_uuid)
-			uuid_free(token->token_data->token_uuid);
-		mem_free0(token->token_data);
+static void
+token_free_int(scd_token_t *token)
+{
+	if (token->token_data->idle_timer) {
+		event_remove_timer(token->token_data->idle_timer);
+		event_timer_free(token->token_data->idle_timer);
 	}
+	scd_key_cache_free(token->token_data->key_cache);
+#ifdef ENABLESCHSM
+	if (token->token_data->tctrl)
+		scd_tokencontrol_free(token);
+#endif
+	if (token->token_data->token_uuid)
+		uuid_free(token->token_data->token_uuid);
+	mem_free0(token->token_data);
 	mem_free0(token);
 }
+
+static void
+token_free_done(void *data)
+{
+	token_free_int(data);
+}
+
+void
+token_free(scd_token_t *token)
+{
+	IF_NULL_RETURN(token);
+	ASSERT(token->token_data);
+
+	// jobs queued before still have to finish, the queue ends with freeing the token
+	worker_queue_t *queue = token->token_data->queue;
+	token->token_data->removed = true;
+	if (token_submit(token, token_free_work, token_free_done, token) < 0) {
+		token_free_work(token, NULL);
+		token_free_int(token);
+	}
+	worker_queue_free(queue);
+}
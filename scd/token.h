@@ -126,7 +126,46 @@ scd_token_t *
 token_new(const token_constr_data_t *constr_data);
 
 /**
- * frees a generic scd token
+ * runs an operation on the token's own worker queue, so that a slow token does not
+ * delay the event loop or other tokens. The operations of a token run one after the
+ * other in the order they were queued. All operations of the token, except for
+ * token_get_type() and token_get_uuid(), have to go through this function.
+ * @param token the token to operate on
+ * @param work called with the token on the token's worker thread
+ * @param done called afterwards in the event loop thread, also if the token was freed
+ *	       meanwhile (the token itself is freed only after this)
+ *
+ * @return 0 on success, -1 if the operation could not be queued
+ */
+int
+token_run(scd_token_t *token, void (*work)(scd_token_t *token, void *data),
+	  void (*done)(void *data), void *data);
+
+/**
+ * unwraps a key like token->unwrap_key(), but serves repeated requests for the same
+ * wrapped key from the token's key cache while the token stays unlocked. Without key
+ * cache (see SCD_KEY_CACHE) this is equivalent to token->unwrap_key().
+ * @param token the token to operate on
+ *
+ * @return 0 on success, -1 on error or if the token is locked
+ */
+int
+token_unwrap_key_cached(scd_token_t *token, char *label, unsigned char *wrapped_key,
+			size_t wrapped_key_len, unsigned char **plain_key, int *plain_key_len);
+
+/**
+ * wipes all keys cached for a token
+ * must be called whenever the unlocked session of the token ends or restarts
+ * @param token the token to operate on
+ *
+ * @return void
+ */
+void
+token_key_cache_wipe(scd_token_t *token);
+
+/**
+ * frees a generic scd token once the operations queued before have finished.
+ * The token must not be used anymore afterwards.
  * @param token the token to be freed
  *
  * @return void
@@ -31,11 +31,17 @@
 #include "common/file.h"
 #include "common/str.h"
 #include "common/ssl_util.h"
+#include "common/list.h"
+#include "common/event.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
 
 #define TOKEN_MAX_AUTH_CODE_LEN 16
 #define TOKEN_KEY_LEN 32 /* must be coordinated with ssl_util.c */
@@ -47,10 +53,32 @@
 
 #define USBTOKEN_SUCCESS 0x9000
 
+#define USBTOKEN_UEVENT_GROUP_KERNEL 1
+#define USBTOKEN_UEVENT_BUF_LEN 4096
+
 //#undef LOGF_LOG_MIN_PRIO
 //#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
 
-static unsigned short g_ctn = 0;
+/*
+ * Registry of the attached sc-hsm readers. It maps the serial of a reader to its usb
+ * port and to the card terminal number used for it, which stays the same for a serial.
+ * Readers are only enumerated again by CT_list() after usb devices were added or
+ * removed, as signaled by uevents.
+ */
+typedef struct usbtoken_reader {
+	char *serial;
+	unsigned short port;
+	unsigned short ctn;
+	bool present; // found by the last enumeration
+} usbtoken_reader_t;
+
+static pthread_mutex_t usbtoken_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static list_t *usbtoken_readers = NULL; // protected by usbtoken_readers_lock
+static bool usbtoken_readers_stale = true;
+static unsigned short usbtoken_readers_next_ctn = 0;
+
+// incremented on usb uevents, card sessions authenticated before are not trusted anymore
+static unsigned usbtoken_usb_generation = 0;
 
 /* following are implementation specific byte arrays used to commuicate with 'sc-hsm' tokens
  * manufactored by CardContact.
@@ -81,8 +109,26 @@ struct usbtoken {
 
 	unsigned char *latr; // ATR of last reset
 	size_t latr_len;
+
+	// the card session is kept selected and authenticated while the token is unlocked
+	bool authenticated;
+	unsigned generation; // usbtoken_usb_generation when the session was authenticated
 };
 
+static void
+usbtoken_session_set(usbtoken_t *token, bool authenticated)
+{
+	token->authenticated = authenticated;
+	token->generation = __atomic_load_n(&usbtoken_usb_generation, __ATOMIC_ACQUIRE);
+}
+
+static bool
+usbtoken_session_valid(usbtoken_t *token)
+{
+	return token->authenticated &&
+	       token->generation == __atomic_load_n(&usbtoken_usb_generation, __ATOMIC_ACQUIRE);
+}
+
 /**
  * Derive an authentication code from a parining secret and a user pin/passwd.
  * TODO: use an actual KDF
@@ -197,19 +243,27 @@ produceKey(usbtoken_t *token, unsigned char *label, size_t label_len, unsigned c
 {
 	int rc;
 
-	if ((rc = (authenticateUser(token->ctn, token->auth_code, token->auth_code_len))) < 0) {
-		// this should not possibly happen; TODO: handle properly if it happens anyway
-		ERROR("Failed to authenticate to token");
-		return rc;
-	}
-
 	if ((NULL == label) || (0 == label_len)) {
 		ERROR("No label was provided for key derivation");
 		return -1;
-	} else {
+	}
+
+	// the key is derived in the session authenticated before, if it is still valid
+	if (usbtoken_session_valid(token)) {
 		rc = deriveKey(token->ctn, 1, label, label_len, key, key_len);
+		IF_TRUE_RETVAL(rc >= 0, 0);
+		DEBUG("USBTOKEN: deriveKey failed in kept session, authenticating again");
+	}
+
+	if ((rc = (authenticateUser(token->ctn, token->auth_code, token->auth_code_len))) < 0) {
+		// this should not possibly happen; TODO: handle properly if it happens anyway
+		ERROR("Failed to authenticate to token");
+		usbtoken_session_set(token, false);
+		return rc;
 	}
+	usbtoken_session_set(token, true);
 
+	rc = deriveKey(token->ctn, 1, label, label_len, key, key_len);
 	if (rc < 0) {
 		ERROR("USBTOKEN: deriveKey failed");
 		return -1;
@@ -219,63 +273,135 @@ produceKey(usbtoken_t *token, unsigned char *label, size_t label_len, unsigned c
 }
 
 /**
- * returns the port of the desired reader
+ * Enumerates the readers by CT_list() and updates the registry. Must be called with
+ * usbtoken_readers_lock held.
  *
- * @param readers a buffer that contains port numbers and associated reader names
- *	as returned from CT_list()
- * @param lr actual length of @param readers
- * @param serial the serial number of the usb smartcard reader
- * @param port the port reader with the given serial or NULL
- * @return 0 on success
+ * The reader list consists of one entry per reader:
+ *	|-|-|---X---|-|
+ *	 1 2    3    4
+ *	1: uint8_t libusb_get_bus_number()
+ *	2: uint8_t libusb_get_device_address()
+ *	3: string  "SmartCard-HSM (" iSerialNumber ")"
+ *	4: NULL byte to delimit next reader
  */
-int
-token_filter_by_serial(const unsigned char *readers, const unsigned short lr, const char *serial,
-		       unsigned short *port)
+static void
+usbtoken_readers_enumerate(void)
 {
-	ASSERT(readers);
-	ASSERT(serial);
-
-	char *po;
-	unsigned short idx;
-	unsigned short iport;
-
-	char *s = (char *)mem_memcpy(readers, lr);
-	/* readers: |-|-|---15---|---X---|-|-|
-	 *	 fields  1 2     3       4    5 6
-	 * 		1: uint8_t libusb_get_bus_number()
-	 * 		2: uint8_t libusb_get_device_address
-	 * 		3: string  "SmartCard-HSM ("
-	 * 		4: string  iSerialNumber
-	 * 		5: string  ")"
-	 * 		6: NULL byte to delimit next reader
-	 */
-	po = s;
-	idx = 0;
+	unsigned char *readers = mem_alloc0(MAX_CT_READERS_SIZE);
+	unsigned short lr = MAX_CT_READERS_SIZE - 1;
 
-	while (idx < lr) {
-		iport = *po << 8 | *(po + 1);
-		po += 2;
-		idx += 2;
+	CT_list(readers, &lr, 0);
 
-		po += 15;
+	for (list_t *l = usbtoken_readers; l; l = l->next)
+		((usbtoken_reader_t *)l->data)->present = false;
+
+	for (size_t idx = 0; idx + 2 < lr;) {
+		unsigned short port = readers[idx] << 8 | readers[idx + 1];
+		char *name = (char *)readers + idx + 2;
+		idx += 2 + strlen(name) + 1;
+
+		char *serial = strchr(name, '(');
+		char *end = strrchr(name, ')');
+		if (!serial || !end || end <= serial + 1)
+			continue;
+		serial = mem_strndup(serial + 1, end - serial - 1);
+
+		usbtoken_reader_t *reader = NULL;
+		for (list_t *l = usbtoken_readers; l && !reader; l = l->next)
+			if (!strcmp(((usbtoken_reader_t *)l->data)->serial, serial))
+				reader = l->data;
+		if (!reader) {
+			reader = mem_new0(usbtoken_reader_t, 1);
+			reader->serial = serial;
+			reader->ctn = usbtoken_readers_next_ctn++;
+			usbtoken_readers = list_append(usbtoken_readers, reader);
+		} else {
+			mem_free0(serial);
+		}
+		reader->port = port;
+		reader->present = true;
+		TRACE("USBTOKEN: found reader with serial %s at port 0x%04x, ctn %hu",
+		      reader->serial, port, reader->ctn);
+	}
 
-		size_t s_len = strlen(po) - 1;
+	mem_free0(readers);
+	usbtoken_readers_stale = false;
+}
 
-		if ((s_len > 0) && (strncmp(po, serial, s_len) == 0)) {
-			TRACE("USBTOKEN: token_filter_by_serial() found reader with serial: %s at port 0x%04x",
-			      serial, iport);
-			*port = iport;
-			mem_free0(s);
-			return 0;
+/**
+ * Looks up the port and card terminal number of the reader with the given serial.
+ * @return 0 on success, -1 if no such reader is attached
+ */
+static int
+usbtoken_readers_lookup(const char *serial, unsigned short *port, unsigned short *ctn)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&usbtoken_readers_lock);
+	for (int pass = 0; pass < 2 && ret < 0; pass++) {
+		// a reader missing from a current registry is looked for once more anyway
+		if (usbtoken_readers_stale || pass > 0)
+			usbtoken_readers_enumerate();
+		for (list_t *l = usbtoken_readers; l; l = l->next) {
+			usbtoken_reader_t *reader = l->data;
+			if (reader->present && !strcmp(reader->serial, serial)) {
+				*port = reader->port;
+				*ctn = reader->ctn;
+				ret = 0;
+				break;
+			}
 		}
+	}
+	pthread_mutex_unlock(&usbtoken_readers_lock);
+	return ret;
+}
+
+static void
+usbtoken_readers_cb_uevent(int fd, unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+{
+	IF_FALSE_RETURN(events & EVENT_IO_READ);
+
+	char buf[USBTOKEN_UEVENT_BUF_LEN];
+	ssize_t len;
+	bool usb = false;
+
+	while ((len = recv(fd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+		buf[len] = '\0';
+		// the message consists of "action@devpath" and KEY=value strings
+		for (char *p = buf; p < buf + len; p += strlen(p) + 1)
+			if (!strcmp(p, "SUBSYSTEM=usb"))
+				usb = true;
+	}
+	IF_FALSE_RETURN(usb);
+
+	TRACE("USBTOKEN: usb devices changed, reader registry is stale");
+	pthread_mutex_lock(&usbtoken_readers_lock);
+	usbtoken_readers_stale = true;
+	pthread_mutex_unlock(&usbtoken_readers_lock);
+	__atomic_add_fetch(&usbtoken_usb_generation, 1, __ATOMIC_RELEASE);
+}
+
+int
+usbtoken_readers_watch(void)
+{
+	int sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			  NETLINK_KOBJECT_UEVENT);
+	if (sock < 0) {
+		ERROR_ERRNO("Could not create uevent netlink socket");
+		return -1;
+	}
 
-		po += 15 + s_len + 1;
-		idx += 15 + s_len + 1;
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK,
+				    .nl_groups = USBTOKEN_UEVENT_GROUP_KERNEL };
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		ERROR_ERRNO("Could not bind uevent netlink socket");
+		close(sock);
+		return -1;
 	}
 
-	*port = 0;
-	mem_free0(s);
-	return -1;
+	event_io_t *io = event_io_new(sock, EVENT_IO_READ, usbtoken_readers_cb_uevent, NULL);
+	event_add_io(io);
+	return 0;
 }
 
 static int
@@ -290,6 +416,8 @@ usbtoken_reset_schsm_sess(usbtoken_t *token, unsigned char *brsp, size_t brsp_le
 		      token->port);
 		return -1;
 	}
+	// a reset card has to be selected and authenticated again
+	usbtoken_session_set(token, false);
 	if (NULL != token->latr)
 		mem_free0(token->latr);
 	token->latr = mem_memcpy(brsp, lr);
@@ -303,8 +431,11 @@ usbtoken_reset_schsm_sess(usbtoken_t *token, unsigned char *brsp, size_t brsp_le
 			      token->port);
 			return -1;
 		}
+#ifdef DEBUG_BUILD
+		// the pin state is only logged, spare the round trip otherwise
 		rc = queryPIN(token->ctn);
 		DEBUG("usbtoken_init queryPIN: 0x%04x", rc);
+#endif
 	}
 	return lr;
 }
@@ -324,43 +455,28 @@ usbtoken_init_ctapi_int(usbtoken_t *token, unsigned char *brsp, size_t brsp_len)
 	ASSERT(token);
 
 	int rc = -1;
-	unsigned short lr, port;
-	unsigned char *readers = mem_alloc0(MAX_CT_READERS_SIZE);
-
-	lr = MAX_CT_READERS_SIZE;
-	CT_list(readers, &lr, 0);
-
-	if (lr <= 0) {
-		ERROR("No usb token reader found.");
-		goto err;
-	}
 
-	rc = token_filter_by_serial(readers, lr, token->serial, &port);
+	rc = usbtoken_readers_lookup(token->serial, &token->port, &token->ctn);
 	if (rc != 0) {
 		ERROR("Could not find specified token reader with serial %s", token->serial);
-		goto err;
+		return -1;
 	}
-	mem_free0(readers);
-	token->port = port;
 
-	rc = CT_init(token->ctn, port);
+	rc = CT_init(token->ctn, token->port);
 	if (rc != 0) {
 		ERROR("USBTOKEN: Token reader initialization failed. Ret code: %d", rc);
-		goto err;
+		return -1;
 	}
 
 	if (0 > usbtoken_reset_schsm_sess(token, brsp, brsp_len)) {
 		ERROR("Could not initiate schsm session");
-		goto err;
+		CT_close(token->ctn);
+		return -1;
 	}
 
 	DEBUG("Successfully initialized CTAPI session for reader with serial  %s", token->serial);
 
 	return 0;
-
-err:
-	mem_free0(readers);
-	return -1;
 }
 
 /**
@@ -382,7 +498,6 @@ usbtoken_new(const char *serial)
 	IF_NULL_RETVAL_ERROR(token, NULL);
 
 	token->locked = true;
-	token->ctn = g_ctn++;
 	token->serial = mem_strdup(serial);
 	IF_NULL_GOTO_ERROR(token->serial, err);
 
@@ -525,6 +640,9 @@ usbtoken_change_passphrase(usbtoken_t *token, const char *oldpass, const char *n
 	ASSERT(oldpass);
 	ASSERT(newpass);
 
+	// the pin is verified as part of changing it, a kept session is not reused afterwards
+	usbtoken_session_set(token, false);
+
 	return (is_provisioning ?
 			provision_auth_code(token, oldpass, newpass, pairing_secret,
 					    pairing_sec_len) :
@@ -540,6 +658,7 @@ usbtoken_free_secrets(usbtoken_t *token)
 	TRACE("USBTOKEN: usbtoken_free_secrets");
 
 	ASSERT(token);
+	usbtoken_session_set(token, false);
 	IF_NULL_RETURN(token->auth_code);
 
 	memset(token->auth_code, 0, token->auth_code_len);
@@ -563,7 +682,6 @@ usbtoken_free(usbtoken_t *token)
 	usbtoken_free_secrets(token);
 
 	mem_free0(token);
-	g_ctn--;
 }
 
 /**
@@ -701,6 +819,7 @@ usbtoken_unlock(usbtoken_t *token, char *passwd, unsigned char *pairing_secret,
 		token->wrong_unlock_attempts = 0;
 		token->auth_code_len = auth_code_len;
 		token->auth_code = mem_memcpy(code, token->auth_code_len);
+		usbtoken_session_set(token, true);
 		DEBUG("Usbtoken unlock successful");
 	} else {
 		ERROR("Usbtoken unlock failed");
@@ -745,6 +864,7 @@ usbtoken_reset_auth(usbtoken_t *token, unsigned char *brsp, size_t brsp_len)
 	if (rc == -2) { // wrong password
 		ERROR("Usbtoken authenticatio reset failed (wrong PW). This should not happen");
 	} else if (rc == 0) {
+		usbtoken_session_set(token, true);
 		DEBUG("Usbtoken authenticatio reset successful");
 	} else {
 		ERROR("Usbtoken reset failed");
@@ -772,6 +892,9 @@ usbtoken_lock(usbtoken_t *token)
 	else
 		token->locked = true;
 
+	// the authentication code is kept, but the card session is not
+	usbtoken_session_set(token, false);
+
 	return 0;
 }
 
@@ -785,6 +908,9 @@ usbtoken_send_apdu(usbtoken_t *token, unsigned char *apdu, size_t apdu_len, unsi
 
 	TRACE("usbtoken_send_apdu");
 
+	// the container may change the state of the card, e.g., log out or select another applet
+	usbtoken_session_set(token, false);
+
 	unsigned short lr;
 	unsigned char dad, sad;
 
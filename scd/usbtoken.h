@@ -33,6 +33,14 @@ typedef struct usbtoken usbtoken_t;
 
 #ifdef ENABLESCHSM
 
+/**
+ * Keeps the registry of attached token readers current by watching usb uevents.
+ * Must be called from the event loop thread.
+ * @return 0 on success, -1 if the registry cannot be kept current
+ */
+int
+usbtoken_readers_watch(void);
+
 /**
  * Initializes a usb token, iff the serial number of the usb token reader matches
  * @param serial the iSerial of the usb reader of the token
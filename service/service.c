@@ -33,9 +33,11 @@
 #include "common/file.h"
 #include "common/logf.h"
 #include "common/protobuf.h"
+#include "common/shm_ring.h"
 #include "common/sock.h"
 #include "common/event.h"
 #include "common/fd.h"
+#include "common/hex.h"
 #include "common/dir.h"
 #include "common/str.h"
 
@@ -45,6 +47,9 @@
 #include <sys/wait.h>
 #include <signal.h>
 #include <inttypes.h>
+#include <stdio.h>
+
+#include <openssl/evp.h>
 
 #include "dumb_init.h"
 
@@ -54,12 +59,22 @@
 
 #define LOGFILE_DIR "/tmp/log/"
 #define AUDIT_LOGDIR "/var/log/cmld_audit/"
+// max. number of audit records cmld may deliver in one message
+#define AUDIT_WINDOW 64
 
 //#undef LOGF_LOG_MIN_PRIO
 //#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
 
 char *LAST_AUDIT_HASH;
 
+// audit.log is kept open, records of one message are flushed together before the ACK
+static FILE *audit_log = NULL;
+
+// shared memory ring through which cmld delivers audit messages, if set up
+static shm_ring_t *audit_ring = NULL;
+static event_io_t *audit_ring_io = NULL;
+static bool audit_awaiting_record = false;
+
 static logf_handler_t *service_logfile_handler = NULL;
 
 #ifndef BOOT_COMPLETE_ONLY
@@ -169,62 +184,86 @@ service_fork_execvp(char *prog, char **argv)
 	return 0;
 }
 
-static int
-process_audit_record(CmldToServiceMessage *msg, uint8_t *buf, uint32_t buf_len)
+/**
+ * Computes the SHA-512 of the given buffer as lower case hex string, as cmld
+ * expects it in the ACK of an audit message.
+ */
+static char *
+audit_hash_buf_new(const uint8_t *buf, size_t buf_len)
 {
-	ASSERT(msg);
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len = 0;
 
-	int ret = -1;
+	if (!EVP_Digest(buf, buf_len, md, &md_len, EVP_sha512(), NULL)) {
+		ERROR("Failed to hash audit message");
+		return NULL;
+	}
 
-	char tmpfile[17] = "/tmp/audit_XXXXXX";
+	return hex_encode_new(md, md_len);
+}
 
-	if (!strcmp("", mktemp(tmpfile))) {
-		ERROR_ERRNO("Failed to generate temporary filename");
-		return -1;
+static FILE *
+audit_log_get(void)
+{
+	if (audit_log)
+		return audit_log;
+
+	if (!file_is_dir(AUDIT_LOGDIR) && dir_mkdir_p(AUDIT_LOGDIR, 0600)) {
+		ERROR("Failed to create audit log directory");
+		return NULL;
 	}
+	if (!(audit_log = fopen(AUDIT_LOGDIR "/audit.log", "a"))) {
+		ERROR_ERRNO("Failed to open audit log");
+		return NULL;
+	}
+	setvbuf(audit_log, NULL, _IOFBF, BUFSIZ);
 
-	//TODO find reason why received buffer contains trailing null byte
-	if (0 > file_write(tmpfile, (char *)buf, buf_len)) {
-		ERROR("Failed to write file");
+	return audit_log;
+}
 
-		if (unlink(tmpfile))
-			ERROR_ERRNO("Failed to unlink %s", tmpfile);
+static int
+process_audit_record(CmldToServiceMessage *msg, const uint8_t *buf, size_t buf_len)
+{
+	ASSERT(msg);
 
-		return ret;
+	if (!msg->audit_record && !msg->n_audit_records) {
+		WARN("Got empty audit message from cmld");
+		return -1;
 	}
 
-	char *cmd = mem_printf("sha512sum /%s", tmpfile);
-	FILE *hash_file = popen(cmd, "r");
-	char *hash_buf = mem_alloc0(129);
+	char *hash = audit_hash_buf_new(buf, buf_len);
+	IF_NULL_RETVAL(hash, -1);
 
-	if (!fgets(hash_buf, 129, hash_file)) {
-		ERROR("Hash length was smaller than 64 bytes");
-		fclose(hash_file);
-		mem_free0(hash_buf);
-		goto out;
+	FILE *log = audit_log_get();
+	if (!log) {
+		mem_free0(hash);
+		return -1;
 	}
-	fclose(hash_file);
 
-	if (!file_is_dir(AUDIT_LOGDIR) && dir_mkdir_p(AUDIT_LOGDIR, 0600)) {
-		ERROR("Failed to create audit log directory");
-	} else if (msg->audit_record) {
-		char *record =
-			protobuf_c_text_to_string((ProtobufCMessage *)msg->audit_record, NULL);
+	AuditRecord **records = msg->audit_record ? &msg->audit_record : msg->audit_records;
+	size_t n = msg->audit_record ? 1 : msg->n_audit_records;
+
+	for (size_t i = 0; i < n; i++) {
+		char *record = protobuf_c_text_to_string((ProtobufCMessage *)records[i], NULL);
 		TRACE("Storing audit record %s", record);
-		file_write_append(AUDIT_LOGDIR "/audit.log", record, strlen(record));
+		fputs(record, log);
+		mem_free0(record);
+	}
 
-		mem_free0(LAST_AUDIT_HASH);
-		LAST_AUDIT_HASH = hash_buf;
-		ret = 0;
-	} else {
-		WARN("Got empty audit message from cmld");
+	// records are only ACKed once they reached the file
+	if (fflush(log) == EOF) {
+		ERROR_ERRNO("Failed to write audit log");
+		fclose(audit_log);
+		audit_log = NULL;
+		mem_free0(hash);
+		return -1;
 	}
 
-out:
-	if (unlink(tmpfile))
-		ERROR_ERRNO("Failed to unlink %s", tmpfile);
+	// one ACK for the whole message, i.e., all contained records
+	mem_free0(LAST_AUDIT_HASH);
+	LAST_AUDIT_HASH = hash;
 
-	return ret;
+	return 0;
 }
 
 static int
@@ -236,6 +275,11 @@ audit_send_ack(int sock, const char *hash)
 	if (hash) {
 		auditmsg.audit_ack = mem_strdup((char *)hash);
 	}
+	auditmsg.has_audit_window = true;
+	auditmsg.audit_window = AUDIT_WINDOW;
+	// records which arrive after this ACK are taken from the ring
+	auditmsg.has_audit_ring = audit_ring != NULL;
+	auditmsg.audit_ring = audit_ring != NULL;
 
 	ssize_t msg_size = protobuf_send_message(sock, (ProtobufCMessage *)&auditmsg);
 	if (msg_size < 0)
@@ -247,10 +291,103 @@ audit_send_ack(int sock, const char *hash)
 }
 
 static void
-service_cb_recv_message(int fd, unsigned events, event_io_t *io, UNUSED void *data)
+service_handle_audit_records(int fd, CmldToServiceMessage *msg, const uint8_t *buf, size_t buf_len)
+{
+	TRACE("Got audit record from cmld");
+
+	audit_awaiting_record = false;
+	if (0 != process_audit_record(msg, buf, buf_len)) {
+		ERROR("Failed to process audit record");
+	}
+
+	// if processing of the last record failed,
+	// send ACK with old hash to trigger delivery again
+	if (0 != audit_send_ack(fd, LAST_AUDIT_HASH)) {
+		ERROR("Failed to send ack to cmld");
+	} else {
+		audit_awaiting_record = true;
+	}
+}
+
+static void
+service_audit_ring_free(void)
+{
+	if (audit_ring_io) {
+		event_remove_io(audit_ring_io);
+		event_io_free(audit_ring_io);
+		audit_ring_io = NULL;
+	}
+	if (audit_ring) {
+		shm_ring_free(audit_ring);
+		audit_ring = NULL;
+	}
+}
+
+/**
+ * Drains the audit ring when cmld rings its doorbell. Messages are processed in
+ * place, i.e., without copying them out of the ring.
+ */
+static void
+service_cb_audit_ring(UNUSED int fd, unsigned events, UNUSED event_io_t *io, void *data)
+{
+	int *sock_ptr = data;
+
+	if (events & EVENT_IO_EXCEPT) {
+		WARN("Exception on audit ring doorbell, falling back to socket");
+		service_audit_ring_free();
+		return;
+	}
+
+	shm_ring_clear_doorbell(audit_ring);
+
+	const uint8_t *buf;
+	uint32_t buf_len;
+	while (audit_ring && (buf = shm_ring_peek(audit_ring, &buf_len))) {
+		CmldToServiceMessage *msg = (CmldToServiceMessage *)protobuf_unpack_message(
+			&cmld_to_service_message__descriptor, buf, buf_len);
+		if (!msg) {
+			ERROR("Failed to decode protobuf message from audit ring");
+		} else if (CMLD_TO_SERVICE_MESSAGE__CODE__AUDIT_RECORD == msg->code ||
+			   CMLD_TO_SERVICE_MESSAGE__CODE__AUDIT_RECORDS == msg->code) {
+			service_handle_audit_records(*sock_ptr, msg, buf, buf_len);
+		} else {
+			WARN("Unexpected message with code %d in audit ring", msg->code);
+		}
+		if (msg)
+			protobuf_free_message((ProtobufCMessage *)msg);
+		shm_ring_consume(audit_ring);
+	}
+}
+
+/**
+ * Attaches to the audit ring whose file descriptors follow the AUDIT_RING message.
+ */
+static void
+service_audit_ring_attach(int *sock_ptr)
+{
+	int fds[2];
+
+	service_audit_ring_free();
+
+	if (sock_unix_recv_fds(*sock_ptr, fds, 2) < 0) {
+		WARN("Failed to receive audit ring, falling back to socket");
+		return;
+	}
+	if (!(audit_ring = shm_ring_attach(fds[0], fds[1]))) {
+		WARN("Failed to attach to audit ring, falling back to socket");
+		return;
+	}
+
+	audit_ring_io = event_io_new(shm_ring_get_doorbell_fd(audit_ring), EVENT_IO_READ,
+				     service_cb_audit_ring, sock_ptr);
+	event_add_io(audit_ring_io);
+	INFO("Receiving audit records through shared memory ring");
+}
+
+static void
+service_cb_recv_message(int fd, unsigned events, event_io_t *io, void *data)
 {
 	DEBUG("Received message from cmld");
-	static bool awaiting_record = false;
 
 	uint8_t *buf = NULL;
 	CmldToServiceMessage *msg = NULL;
@@ -273,7 +410,7 @@ service_cb_recv_message(int fd, unsigned events, event_io_t *io, UNUSED void *da
 		}
 
 		if (CMLD_TO_SERVICE_MESSAGE__CODE__AUDIT_NOTIFY == msg->code) {
-			if (awaiting_record) {
+			if (audit_awaiting_record) {
 				TRACE("Got AUDIT_NOTIFY but already awaiting a record, ignoring...");
 			} else {
 				TRACE("New audit records available, remaining storage: %" PRIu64
@@ -283,30 +420,20 @@ service_cb_recv_message(int fd, unsigned events, event_io_t *io, UNUSED void *da
 				if (0 != audit_send_ack(fd, LAST_AUDIT_HASH)) {
 					ERROR("Failed to send ack to cmld");
 				} else {
-					awaiting_record = true;
+					audit_awaiting_record = true;
 				}
 			}
-		} else if (CMLD_TO_SERVICE_MESSAGE__CODE__AUDIT_RECORD == msg->code) {
-			TRACE("Got audit record from cmld");
-
-			awaiting_record = false;
-			if (0 != process_audit_record(msg, buf, buf_len)) {
-				ERROR("Failed to process audit record");
-			}
-
-			// if processing of the last record failed,
-			// send ACK with old hash to trigger delivery again
-			if (0 != audit_send_ack(fd, LAST_AUDIT_HASH)) {
-				ERROR("Failed to send ack to cmld");
-			} else {
-				awaiting_record = true;
-			}
-
+		} else if (CMLD_TO_SERVICE_MESSAGE__CODE__AUDIT_RECORD == msg->code ||
+			   CMLD_TO_SERVICE_MESSAGE__CODE__AUDIT_RECORDS == msg->code) {
+			service_handle_audit_records(fd, msg, buf, buf_len);
 			goto out;
 		} else if (CMLD_TO_SERVICE_MESSAGE__CODE__AUDIT_COMPLETE == msg->code) {
 			TRACE("Fetched all available audit records");
-			awaiting_record = false;
+			audit_awaiting_record = false;
 
+			goto out;
+		} else if (CMLD_TO_SERVICE_MESSAGE__CODE__AUDIT_RING == msg->code) {
+			service_audit_ring_attach(data);
 			goto out;
 		} else {
 			ERROR_ERRNO("Received message with unknown code from cmld");
@@ -315,6 +442,7 @@ service_cb_recv_message(int fd, unsigned events, event_io_t *io, UNUSED void *da
 
 	if (events & EVENT_IO_EXCEPT) {
 		WARN("CML connection Error");
+		service_audit_ring_free();
 		event_remove_io(io);
 		event_io_free(io);
 		close(fd);
@@ -349,30 +477,6 @@ open_service_socket()
 	return sock;
 }
 
-static int
-container_close_all_fds_cb(UNUSED const char *path, const char *file, UNUSED void *data)
-{
-	int fd = atoi(file);
-
-	DEBUG("Closing file descriptor %d", fd);
-
-	if (close(fd) < 0)
-		WARN_ERRNO("Could not close file descriptor %d", fd);
-
-	return 0;
-}
-
-static int
-service_close_all_fds()
-{
-	if (dir_foreach("/proc/self/fd", &container_close_all_fds_cb, NULL) < 0) {
-		WARN("Could not open /proc/self/fd directory, /proc not mounted?");
-		return -1;
-	}
-
-	return 0;
-}
-
 static void
 fork_service_message_handler()
 {
@@ -381,7 +485,7 @@ fork_service_message_handler()
 	if (-1 == pid) {
 		ERROR("Failed to fork service handler");
 	} else if (0 == pid) {
-		if (service_close_all_fds()) {
+		if (fd_close_all(0)) {
 			ERROR("Failed to close parent fds.");
 		}
 
@@ -406,9 +510,15 @@ fork_service_message_handler()
 		fd_make_non_blocking(sock);
 
 		event_io_t *event =
-			event_io_new(*sock_ptr, EVENT_IO_READ, service_cb_recv_message, NULL);
+			event_io_new(*sock_ptr, EVENT_IO_READ, service_cb_recv_message, sock_ptr);
 		event_add_io(event);
 
+		// ask for the shared memory transport, cmld falls back to the socket without it
+		ServiceToCmldMessage ringmsg = SERVICE_TO_CMLD_MESSAGE__INIT;
+		ringmsg.code = SERVICE_TO_CMLD_MESSAGE__CODE__AUDIT_RING_REQ;
+		if (protobuf_send_message(*sock_ptr, (ProtobufCMessage *)&ringmsg) < 0)
+			WARN("Failed to request audit ring from cmld");
+
 		if (0 != audit_send_ack(*sock_ptr, LAST_AUDIT_HASH)) {
 			ERROR("Failed to send ack to cmld");
 		}
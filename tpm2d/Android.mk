@@ -39,11 +39,14 @@ LOCAL_SRC_FILES := \
 	common/mem.c \
 	common/sock.c \
 	common/event.c \
+	common/hashmap.c \
 	common/dir.c \
 	common/file.c \
 	common/fd.c \
 	common/protobuf.c \
+	common/protobuf_writer.c \
 	common/cryptfs.c \
+	common/merkle.c \
 	attestation.proto \
 	tpm2d.proto \
 	control.c \
@@ -53,6 +56,7 @@ LOCAL_SRC_FILES := \
 	ml.c \
 	ek.c \
 	tpm2d.c \
+	worker.c \
 
 LOCAL_WHOLE_STATIC_LIBRARIES := \
 	libibmtss
@@ -32,6 +32,7 @@
 #include "nvmcrypt.h"
 #include "ml.h"
 #include "ek.h"
+#include "worker.h"
 
 #include "common/macro.h"
 #include "common/mem.h"
@@ -40,12 +41,18 @@
 #include "common/event.h"
 #include "common/list.h"
 #include "common/file.h"
+#include "common/hex.h"
 #include "common/protobuf.h"
+#include "common/protobuf_writer.h"
+#include "common/probe.h"
+#include "common/sampler.h"
 
 #include <google/protobuf-c/protobuf-c-text.h>
 
 // maximum no. of connections waiting to be accepted on the listening socket
 #define TPM2D_CONTROL_SOCK_LISTEN_BACKLOG 8
+// folded stacks of the sampling profiler, next to the logs of cmld
+#define TPM2D_SAMPLER_FILE "/data/logs/tpm2d.folded"
 
 struct tpm2d_control {
 	int sock; // listen socket fd
@@ -53,6 +60,20 @@ struct tpm2d_control {
 
 UNUSED static list_t *control_list = NULL;
 
+/*
+ * A received message handled on the TPM worker thread. Reading from the client
+ * connection is suspended until the job is done, so that responses keep the
+ * order of requests on each connection.
+ */
+typedef struct tpm2d_control_job {
+	ControllerToTpm *msg;
+	int fd;
+	event_io_t *io;
+	tpm2d_control_t *control;
+	uint8_t *reply; // packed TpmToController response, sent from the event loop
+	size_t reply_len;
+} tpm2d_control_job_t;
+
 /**
  * The usual identity map between two corresponding C and protobuf enums.
  */
@@ -113,10 +134,30 @@ tpm2d_control_get_algid_from_proto(HashAlgLen hash_alg_len)
 	}
 }
 
+/**
+ * Packs the response to the job's request on the worker thread, since the connection
+ * itself must only be written from the event loop.
+ */
 static void
-tpm2d_control_handle_message(const ControllerToTpm *msg, int fd, tpm2d_control_t *control)
+tpm2d_control_job_reply(tpm2d_control_job_t *job, const ProtobufCMessage *out)
 {
-	ASSERT(control);
+	if (job->reply) {
+		WARN("Dropping additional response on control connection %d", job->fd);
+		return;
+	}
+	job->reply_len = protobuf_c_message_get_packed_size(out);
+	job->reply = mem_alloc(MAX(job->reply_len, 1));
+	protobuf_c_message_pack(out, job->reply);
+}
+
+static void
+tpm2d_control_handle_message(tpm2d_control_job_t *job)
+{
+	ASSERT(job);
+	ASSERT(job->control);
+
+	const ControllerToTpm *msg = job->msg;
+	int fd = job->fd;
 
 	TRACE("Handle message from client fd=%d", fd);
 
@@ -133,6 +174,7 @@ tpm2d_control_handle_message(const ControllerToTpm *msg, int fd, tpm2d_control_t
 	}
 
 	tss2_init();
+	PROBE1(tpm_command, msg->code);
 
 	switch (msg->code) {
 	case CONTROLLER_TO_TPM__CODE__DMCRYPT_SETUP: {
@@ -141,19 +183,15 @@ tpm2d_control_handle_message(const ControllerToTpm *msg, int fd, tpm2d_control_t
 		out.has_fde_response = true;
 		nvmcrypt_fde_state_t state = nvmcrypt_dm_setup(msg->dmcrypt_device, msg->password);
 		out.fde_response = tpm2d_control_fdestate_to_proto(state);
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
-	} break;
-	case CONTROLLER_TO_TPM__CODE__EXIT: {
-		INFO("Received EXIT command!");
-		tpm2d_exit();
+		tpm2d_control_job_reply(job, (ProtobufCMessage *)&out);
 	} break;
 	case CONTROLLER_TO_TPM__CODE__RANDOM_REQ: {
 		TpmToController out = TPM_TO_CONTROLLER__INIT;
 		out.code = TPM_TO_CONTROLLER__CODE__RANDOM_RESPONSE;
 		uint8_t *rand = tpm2_getrandom_new(msg->rand_size);
-		char *rand_hex = convert_bin_to_hex_new(rand, msg->rand_size);
+		char *rand_hex = hex_encode_new(rand, msg->rand_size);
 		out.rand_data = rand_hex;
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		tpm2d_control_job_reply(job, (ProtobufCMessage *)&out);
 		if (rand)
 			mem_free0(rand);
 		if (rand_hex)
@@ -167,7 +205,7 @@ tpm2d_control_handle_message(const ControllerToTpm *msg, int fd, tpm2d_control_t
 		int ret = tpm2_clear(msg->password);
 		ret |= tpm2_dictionaryattacklockreset(msg->password);
 		out.response = tpm2d_control_resp_to_proto(ret ? CMD_FAILED : CMD_OK);
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		tpm2d_control_job_reply(job, (ProtobufCMessage *)&out);
 	} break;
 	case CONTROLLER_TO_TPM__CODE__DMCRYPT_LOCK: {
 		TpmToController out = TPM_TO_CONTROLLER__INIT;
@@ -175,7 +213,7 @@ tpm2d_control_handle_message(const ControllerToTpm *msg, int fd, tpm2d_control_t
 		out.has_fde_response = true;
 		nvmcrypt_fde_state_t state = nvmcrypt_dm_lock(msg->password);
 		out.fde_response = tpm2d_control_fdestate_to_proto(state);
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		tpm2d_control_job_reply(job, (ProtobufCMessage *)&out);
 	} break;
 	case CONTROLLER_TO_TPM__CODE__CHANGE_OWNER_PWD: {
 		TpmToController out = TPM_TO_CONTROLLER__INIT;
@@ -183,7 +221,7 @@ tpm2d_control_handle_message(const ControllerToTpm *msg, int fd, tpm2d_control_t
 		out.has_response = true;
 		int ret = tpm2_hierarchychangeauth(TPM_RH_OWNER, msg->password, msg->password_new);
 		out.response = tpm2d_control_resp_to_proto(ret ? CMD_FAILED : CMD_OK);
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		tpm2d_control_job_reply(job, (ProtobufCMessage *)&out);
 	} break;
 	case CONTROLLER_TO_TPM__CODE__DMCRYPT_RESET: {
 		TpmToController out = TPM_TO_CONTROLLER__INIT;
@@ -191,7 +229,7 @@ tpm2d_control_handle_message(const ControllerToTpm *msg, int fd, tpm2d_control_t
 		out.has_fde_response = true;
 		nvmcrypt_fde_state_t state = nvmcrypt_dm_reset(msg->password);
 		out.fde_response = tpm2d_control_fdestate_to_proto(state);
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		tpm2d_control_job_reply(job, (ProtobufCMessage *)&out);
 	} break;
 	case CONTROLLER_TO_TPM__CODE__ML_APPEND: {
 		TpmToController out = TPM_TO_CONTROLLER__INIT;
@@ -201,19 +239,56 @@ tpm2d_control_handle_message(const ControllerToTpm *msg, int fd, tpm2d_control_t
 			msg->ml_filename, tpm2d_control_get_algid_from_proto(msg->ml_hashalg),
 			msg->ml_datahash.data, msg->ml_datahash.len);
 		out.response = tpm2d_control_resp_to_proto(ret ? CMD_FAILED : CMD_OK);
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		tpm2d_control_job_reply(job, (ProtobufCMessage *)&out);
 	} break;
 	default:
 		WARN("ControllerToTpm command %d unknown or not implemented yet", msg->code);
 		break;
 	}
+	PROBE1(tpm_command_done, msg->code);
 	tss2_destroy();
 }
 
+static void
+tpm2d_control_job_work(void *data)
+{
+	tpm2d_control_handle_message(data);
+}
+
+static void
+tpm2d_control_job_done(void *data)
+{
+	tpm2d_control_job_t *job = data;
+
+	if (job->reply && protobuf_writer_send_packed(job->fd, job->reply, job->reply_len) < 0)
+		WARN("Failed to send response on control connection %d", job->fd);
+	DEBUG("Handled control connection %d", job->fd);
+
+	// resume reading further requests of this client
+	event_add_io(job->io);
+
+	protobuf_free_message((ProtobufCMessage *)job->msg);
+	mem_free0(job->reply);
+	mem_free0(job);
+}
+
+static tpm2d_worker_prio_t
+tpm2d_control_get_prio(const ControllerToTpm *msg)
+{
+	switch (msg->code) {
+	// on the container and device start path
+	case CONTROLLER_TO_TPM__CODE__DMCRYPT_SETUP:
+	case CONTROLLER_TO_TPM__CODE__ML_APPEND:
+		return TPM2D_WORKER_PRIO_HIGH;
+	default:
+		return TPM2D_WORKER_PRIO_NORMAL;
+	}
+}
+
 /**
  * Event callback for incoming data that a ControllerToTpm message.
  *
- * The handle_message function will be called to handle the received message.
+ * The message is handled by the TPM worker thread, see tpm2d_control_handle_message.
  *
  * @param fd	    file descriptor of the client connection
  *		    from which the incoming message is read
@@ -233,9 +308,46 @@ tpm2d_control_cb_recv_message(int fd, unsigned events, event_io_t *io, void *dat
 		// close connection if client EOF, or protocol parse error
 		IF_NULL_GOTO_TRACE(msg, connection_err);
 
-		tpm2d_control_handle_message(msg, fd, control);
-		protobuf_free_message((ProtobufCMessage *)msg);
-		DEBUG("Handled control connection %d", fd);
+		if (msg->code == CONTROLLER_TO_TPM__CODE__EXIT) {
+			INFO("Received EXIT command!");
+			tpm2d_exit();
+		}
+
+		// the sampler must be controlled by the thread running the event loop
+		if (msg->code == CONTROLLER_TO_TPM__CODE__SAMPLER_START ||
+		    msg->code == CONTROLLER_TO_TPM__CODE__SAMPLER_STOP) {
+			int ret = 0;
+			if (msg->code == CONTROLLER_TO_TPM__CODE__SAMPLER_START)
+				ret = sampler_start(TPM2D_SAMPLER_FILE, msg->sampler_hz,
+						    msg->sampler_interval);
+			else
+				sampler_stop();
+
+			TpmToController out = TPM_TO_CONTROLLER__INIT;
+			out.code = TPM_TO_CONTROLLER__CODE__GENERIC_RESPONSE;
+			out.has_response = true;
+			out.response = tpm2d_control_resp_to_proto(ret ? CMD_FAILED : CMD_OK);
+			if (protobuf_writer_send_message(fd, (ProtobufCMessage *)&out) < 0)
+				WARN("Failed to send response on control connection %d", fd);
+			protobuf_free_message((ProtobufCMessage *)msg);
+			return;
+		}
+
+		tpm2d_control_job_t *job = mem_new0(tpm2d_control_job_t, 1);
+		job->msg = msg;
+		job->fd = fd;
+		job->io = io;
+		job->control = control;
+
+		// suspend reading until the response is sent, see tpm2d_control_job_done
+		event_remove_io(io);
+		if (tpm2d_worker_run(tpm2d_control_get_prio(msg), tpm2d_control_job_work,
+				     tpm2d_control_job_done, job) < 0) {
+			// handle the message in place if there is no worker
+			tpm2d_control_job_work(job);
+			tpm2d_control_job_done(job);
+		}
+		return;
 	}
 	if (events & EVENT_IO_EXCEPT) {
 		INFO("Client closed connection; disconnecting control socket.");
@@ -244,6 +356,7 @@ tpm2d_control_cb_recv_message(int fd, unsigned events, event_io_t *io, void *dat
 	return;
 
 connection_err:
+	protobuf_writer_free(protobuf_writer_get_by_fd(fd));
 	event_remove_io(io);
 	event_io_free(io);
 	if (close(fd) < 0)
@@ -283,6 +396,8 @@ tpm2d_control_cb_accept(int fd, unsigned events, event_io_t *io, void *data)
 	DEBUG("Accepted control connection %d", cfd);
 
 	fd_make_non_blocking(cfd);
+	if (!protobuf_writer_new(cfd, 0, NULL, NULL))
+		WARN("Could not create outbound queue for fd %d, sending synchronously", cfd);
 
 	event_io_t *event =
 		event_io_new(cfd, EVENT_IO_READ, tpm2d_control_cb_recv_message, control);
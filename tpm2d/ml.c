@@ -27,6 +27,7 @@
 #include "common/macro.h"
 #include "common/mem.h"
 #include "common/list.h"
+#include "common/hashmap.h"
 #include "common/file.h"
 
 #define _GNU_SOURCE
@@ -36,9 +37,12 @@
 #include <fcntl.h>
 #include <errno.h>
 
+#include <openssl/evp.h>
+
 #define CONTAINER_PCR_INDEX 11
 
 #define BINARY_RUNTIME_MEASUREMENTS "/sys/kernel/security/ima/binary_runtime_measurements"
+#define BOOT_ID "/proc/sys/kernel/random/boot_id"
 
 typedef struct ml_elem {
 	char *filename;
@@ -50,6 +54,57 @@ typedef struct ml_elem {
 
 static list_t *measurement_list = NULL;
 static size_t measurement_list_len = 0;
+// index of measurement_list by datahash and filename
+static hashmap_t *measurement_map = NULL;
+
+/*
+ * Software copy of CONTAINER_PCR_INDEX, read from the TPM once and then extended
+ * alongside the TPM. This saves a TPM2_PCR_Read round trip per measured image.
+ */
+static tpm2d_pcr_t *container_pcr = NULL;
+
+static const char *
+halg_id_to_ima_string(TPM_ALG_ID alg_id);
+
+// both measurement lists only grow until reboot, which changes the boot id
+static char *boot_id = NULL;
+
+static char *
+ml_measurement_key_new(const char *filename, const uint8_t *datahash, size_t datahash_len,
+		       size_t *key_len)
+{
+	size_t filename_len = strlen(filename);
+	*key_len = datahash_len + filename_len;
+	char *key = mem_alloc0(*key_len);
+	memcpy(key, datahash, datahash_len);
+	memcpy(key + datahash_len, filename, filename_len);
+	return key;
+}
+
+/*
+ * Extends the software copy of the container PCR the same way the TPM does,
+ * i.e., new = H(old || data), with data zero padded or truncated to the digest size.
+ */
+static int
+ml_container_pcr_extend(const uint8_t *data, size_t data_len)
+{
+	const EVP_MD *md = EVP_get_digestbyname(halg_id_to_ima_string(container_pcr->halg_id));
+	IF_NULL_RETVAL_ERROR(md, -1);
+
+	size_t md_size = EVP_MD_size(md);
+	IF_FALSE_RETVAL_ERROR(md_size == container_pcr->pcr_size, -1);
+
+	uint8_t digest[EVP_MAX_MD_SIZE] = { 0 };
+	memcpy(digest, data, MIN(data_len, md_size));
+
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	EVP_DigestInit(ctx, md);
+	EVP_DigestUpdate(ctx, container_pcr->pcr_value, container_pcr->pcr_size);
+	EVP_DigestUpdate(ctx, digest, md_size);
+	EVP_DigestFinal(ctx, container_pcr->pcr_value, NULL);
+	EVP_MD_CTX_free(ctx);
+	return 0;
+}
 
 int
 ml_measurement_list_append(const char *filename, TPM_ALG_ID algid, const uint8_t *datahash,
@@ -60,16 +115,24 @@ ml_measurement_list_append(const char *filename, TPM_ALG_ID algid, const uint8_t
 	IF_NULL_RETVAL(datahash, -1);
 	IF_FALSE_RETVAL((datahash_len > 0), -1);
 
+	if (!measurement_map)
+		measurement_map = hashmap_new();
+
 	// check if filehash is in list
-	for (list_t *l = measurement_list; l; l = l->next) {
-		ml_elem_t *ml_elem = l->data;
-		if (NULL == ml_elem)
-			continue;
-		if ((0 == memcmp(ml_elem->datahash, datahash, datahash_len)) &&
-		    (0 == memcmp(ml_elem->filename, filename, strlen(filename)))) {
-			return 0; // container image with that name alread in list
-		}
+	size_t key_len;
+	char *key = ml_measurement_key_new(filename, datahash, datahash_len, &key_len);
+	if (hashmap_get(measurement_map, key, key_len)) {
+		mem_free0(key);
+		return 0; // container image with that name alread in list
+	}
+
+	// the PCR value is only read before the first extend, afterwards it is simulated
+	if (!container_pcr) {
+		container_pcr = tpm2_pcrread_new(CONTAINER_PCR_INDEX, TPM2D_HASH_ALGORITHM);
+		if (!container_pcr)
+			WARN("Failed to read PCR %d", CONTAINER_PCR_INDEX);
 	}
+
 	INFO("Appending new hash for %s len=%zu", filename, datahash_len);
 	// new hash to be added
 	ml_elem_t *new_ml_elem = mem_new0(ml_elem_t, 1);
@@ -81,15 +144,32 @@ ml_measurement_list_append(const char *filename, TPM_ALG_ID algid, const uint8_t
 	new_ml_elem->algid = algid;
 
 	// extend to TPM
-	int ret = tpm2_pcrextend(CONTAINER_PCR_INDEX, TPM2D_HASH_ALGORITHM, datahash, datahash_len);
+	TPMI_ALG_HASH halg = TPM2D_HASH_ALGORITHM;
+	int ret = tpm2_pcrextend_banks(CONTAINER_PCR_INDEX, 1, &halg, &datahash, &datahash_len);
 	if (ret) {
 		ERROR("tpm extend failed");
 	}
+
+	if (!container_pcr || ret || ml_container_pcr_extend(datahash, datahash_len)) {
+		// possibly out of sync with the TPM, fall back to reading the PCR
+		if (container_pcr)
+			tpm2_pcrread_free(container_pcr);
+		container_pcr = tpm2_pcrread_new(CONTAINER_PCR_INDEX, TPM2D_HASH_ALGORITHM);
+	}
+
 	// store the template as in the ML elem
-	new_ml_elem->template = tpm2_pcrread_new(CONTAINER_PCR_INDEX, TPM2D_HASH_ALGORITHM);
+	if (container_pcr) {
+		new_ml_elem->template = mem_new0(tpm2d_pcr_t, 1);
+		new_ml_elem->template->halg_id = container_pcr->halg_id;
+		new_ml_elem->template->pcr_size = container_pcr->pcr_size;
+		new_ml_elem->template->pcr_value =
+			mem_memcpy(container_pcr->pcr_value, container_pcr->pcr_size);
+	}
 
 	measurement_list = list_append(measurement_list, new_ml_elem);
 	measurement_list_len++;
+	hashmap_put(measurement_map, key, key_len, new_ml_elem);
+	mem_free0(key);
 
 	return 0;
 }
@@ -109,6 +189,16 @@ halg_id_to_ima_string(TPM_ALG_ID alg_id)
 	}
 }
 
+/*
+ * The IMA log only grows until reboot. Thus, the part read on former requests is kept
+ * and only the tail appended since then is read from the kernel.
+ */
+static uint8_t *ima_list = NULL;
+static size_t ima_list_len = 0;
+static size_t ima_list_size = 0;
+
+#define IMA_LIST_READ_CHUNK 65536
+
 uint8_t *
 ml_get_ima_list_new(size_t *len)
 {
@@ -121,36 +211,53 @@ ml_get_ima_list_new(size_t *len)
 		return NULL;
 	}
 
-	int ret = 0;
-	uint8_t *buf = NULL;
-	size_t l = 0;
-
 	// The binary measurement file in /sys is a special file where the file size cannot
-	// be determined. Therefore it must be read byte by byte
-	while (true) {
-		buf = (uint8_t *)mem_realloc(buf, l + 1);
-		ret = read(fd, buf + l, 1);
+	// be determined. Therefore it is read in chunks until EOF into a geometrically
+	// growing buffer, starting behind the already cached part
+	if (lseek(fd, ima_list_len, SEEK_SET) != (off_t)ima_list_len) {
+		WARN_ERRNO("Could not seek behind cached IMA list, rereading it");
+		ima_list_len = 0;
+		if (lseek(fd, 0, SEEK_SET) < 0) {
+			ERROR_ERRNO("Failed to rewind binary_runtime_measurements");
+			goto err;
+		}
+	}
 
-		if (ret == 0) {
-			goto out;
+	while (true) {
+		if (ima_list_size - ima_list_len < IMA_LIST_READ_CHUNK) {
+			ima_list_size = MAX(2 * ima_list_size, ima_list_len + IMA_LIST_READ_CHUNK);
+			ima_list = mem_realloc(ima_list, ima_list_size);
 		}
+
+		ssize_t ret = read(fd, ima_list + ima_list_len, ima_list_size - ima_list_len);
+		if (ret == 0)
+			break;
 		if (ret < 0) {
-			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
 				TRACE("Reading from fd %d: Blocked, retrying...", fd);
 				continue;
 			}
-			mem_free0(buf);
-			l = 0;
 			ERROR("Failed to read binary_runtime_measurements");
-			goto out;
+			goto err;
 		}
-		l++;
+		ima_list_len += ret;
 	}
 
-out:
 	close(fd);
-	*len = l;
+	TRACE("IMA list has %zu bytes", ima_list_len);
+	*len = ima_list_len;
+
+	uint8_t *buf = mem_alloc0(MAX(ima_list_len, 1));
+	memcpy(buf, ima_list, ima_list_len);
 	return buf;
+err:
+	// drop the cache, it may not be consistent anymore
+	mem_free0(ima_list);
+	ima_list_len = 0;
+	ima_list_size = 0;
+	close(fd);
+	*len = 0;
+	return NULL;
 }
 
 void
@@ -198,3 +305,14 @@ ml_get_container_list_new(size_t *len)
 
 	return entries;
 }
+
+const char *
+ml_get_boot_id(void)
+{
+	if (!boot_id) {
+		boot_id = file_read_new(BOOT_ID, 64);
+		IF_NULL_RETVAL_WARN(boot_id, NULL);
+		boot_id[strcspn(boot_id, "\n")] = '\0';
+	}
+	return boot_id;
+}
@@ -54,4 +54,12 @@ ml_get_container_list_new(size_t *len);
 void
 ml_container_list_free(MlContainerEntry **entries, size_t len);
 
+/**
+ * Return the id of the current boot. Offsets into the measurement lists stay
+ * valid as long as it does not change.
+ * @return The boot id or NULL if it is not available
+ */
+const char *
+ml_get_boot_id(void);
+
 #endif /* ML_H */
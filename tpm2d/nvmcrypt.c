@@ -31,6 +31,7 @@
 #include "common/macro.h"
 #include "common/mem.h"
 #include "common/file.h"
+#include "common/hex.h"
 #include "common/cryptfs.h"
 
 static nvmcrypt_fde_state_t fde_state = FDE_RESET;
@@ -57,11 +58,17 @@ nvmcrypt_start_policy_session(TPM_SE session_type, TPMI_SH_AUTH_SESSION *session
 		}
 	}
 
-	ret = tpm2_startauthsession(session_type, session_handle, bind_handle, bind_pwd);
+	// trial sessions are flushed by the caller, others are returned by tpm2_nv_read()
+	if (session_type == TPM_SE_TRIAL)
+		ret = tpm2_startauthsession(session_type, session_handle, bind_handle, bind_pwd);
+	else
+		ret = tpm2_session_get(session_type, session_handle, bind_handle, bind_pwd);
 	IF_FALSE_RETVAL(TPM_RC_SUCCESS == ret, ret);
 
 	// mask PCR 7
 	ret = tpm2_policypcr(*session_handle, 0x80, pcrs, pcrs_len);
+	if (TPM_RC_SUCCESS != ret && session_type != TPM_SE_TRIAL)
+		tpm2_session_put(*session_handle, ret);
 cleanup:
 	for (size_t i = 0; i < pcrs_len; ++i)
 		if (pcrs[i])
@@ -220,11 +227,11 @@ nvmcrypt_dm_setup(const char *device_path, const char *fde_pw)
 	IF_NULL_RETVAL(key, fde_state);
 
 	// cryptfs_setup_volume_new expects an ascii string as key
-	char *ascii_key = convert_bin_to_hex_new(key, CRYPTFS_FDE_KEY_LEN);
+	char *ascii_key = hex_encode_new(key, CRYPTFS_FDE_KEY_LEN);
 
 	INFO("Setting up crypto device mapping for %s to %s", device_path, dev_name);
 
-	char *mapped_path = cryptfs_setup_volume_new(dev_name, device_path, ascii_key, NULL);
+	char *mapped_path = cryptfs_setup_volume_new(dev_name, device_path, ascii_key, NULL, NULL);
 
 	if (mapped_path == NULL) {
 		ERROR("Failed to setup device mapping for %s", device_path);
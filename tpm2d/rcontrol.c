@@ -35,22 +35,58 @@
 #include "tpm2d_shared.h"
 #include "ml.h"
 #include "ek.h"
+#include "worker.h"
 
 #include "common/macro.h"
 #include "common/mem.h"
 #include "common/fd.h"
 #include "common/event.h"
 #include "common/file.h"
+#include "common/list.h"
+#include "common/merkle.h"
 #include "common/protobuf.h"
 
 #include <google/protobuf-c/protobuf-c-text.h>
+#include <inttypes.h>
+#include <pthread.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x)[0])
 
+// maximum number of attestation requests answered by a single quote
+#define TPM2D_RCONTROL_BATCH_MAX 64
+
+typedef struct tpm2d_rcontrol_batch tpm2d_rcontrol_batch_t;
+
 struct tpm2d_rcontrol {
-	int sock; // listen ip socket fd
+	int sock;			 // listen ip socket fd
+	tpm2d_rcontrol_batch_t *pending; // queued on the worker, still open for further requests
+};
+
+/*
+ * A received remote request handled on the TPM worker thread, see control.c
+ */
+typedef struct tpm2d_rcontrol_job {
+	RemoteToTpm2d *msg;
+	int fd;
+	event_io_t *io;
+	tpm2d_rcontrol_t *rcontrol;
+	uint8_t *reply; // packed Tpm2dToRemote response, sent from the event loop
+	size_t reply_len;
+} tpm2d_rcontrol_job_t;
+
+/*
+ * Attestation requests for the same PCRs which arrive while an earlier one still
+ * waits for the worker are answered by a single quote over the merkle root of
+ * their nonces, each reply carrying the inclusion proof of its own nonce.
+ */
+struct tpm2d_rcontrol_batch {
+	list_queue_t jobs; // tpm2d_rcontrol_job_t, in order of the nonce leaves
+	tpm2d_rcontrol_t *rcontrol;
 };
 
+// protects tpm2d_rcontrol_t.pending, which is closed by the worker thread
+static pthread_mutex_t tpm2d_rcontrol_batch_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
  * Returns the HashAlgLen (proto) for the given TPM_ALG_ID alg_id.
  */
@@ -70,23 +106,43 @@ tpm2d_rcontrol_hash_algo_get_len_proto(TPM_ALG_ID alg_id)
 	}
 }
 
-static void
-tpm2d_rcontrol_handle_message(const RemoteToTpm2d *msg, int fd, tpm2d_rcontrol_t *rcontrol)
+static bool
+tpm2d_rcontrol_batch_can_join(const tpm2d_rcontrol_batch_t *batch, const RemoteToTpm2d *msg)
 {
-	ASSERT(rcontrol);
+	const tpm2d_rcontrol_job_t *first = batch->jobs.head->data;
 
-	TRACE("Handle message from client fd=%d", fd);
+	IF_TRUE_RETVAL(list_length(batch->jobs.head) >= TPM2D_RCONTROL_BATCH_MAX, false);
+	IF_FALSE_RETVAL(msg->code == REMOTE_TO_TPM2D__CODE__ATTESTATION_REQ, false);
+	IF_FALSE_RETVAL(first->msg->code == REMOTE_TO_TPM2D__CODE__ATTESTATION_REQ, false);
 
-	if (NULL == msg) {
-		WARN("msg=NULL, returning");
-		return;
-	}
+	// the shared quote has to cover exactly the requested PCRs
+	IF_FALSE_RETVAL(msg->atype == first->msg->atype, false);
+	if (msg->atype == IDS_ATTESTATION_TYPE__ADVANCED)
+		IF_FALSE_RETVAL(msg->pcrs == first->msg->pcrs, false);
 
-	if (LOGF_PRIO_TRACE >= LOGF_LOG_MIN_PRIO) {
-		char *msg_text = protobuf_c_text_to_string((ProtobufCMessage *)msg, NULL);
-		TRACE("Handling RemoteToTpmd message:\n%s", msg_text ? msg_text : "NULL");
-		if (msg_text)
-			free(msg_text);
+	return true;
+}
+
+static void
+tpm2d_rcontrol_handle_batch(tpm2d_rcontrol_batch_t *batch)
+{
+	ASSERT(batch);
+	ASSERT(batch->jobs.head);
+
+	const RemoteToTpm2d *msg = ((tpm2d_rcontrol_job_t *)batch->jobs.head->data)->msg;
+	size_t n_jobs = list_length(batch->jobs.head);
+
+	for (list_t *l = batch->jobs.head; l; l = l->next) {
+		tpm2d_rcontrol_job_t *job = l->data;
+		TRACE("Handle message from client fd=%d", job->fd);
+
+		if (LOGF_PRIO_TRACE >= LOGF_LOG_MIN_PRIO) {
+			char *msg_text = protobuf_c_text_to_string((ProtobufCMessage *)job->msg,
+								   NULL);
+			TRACE("Handling RemoteToTpmd message:\n%s", msg_text ? msg_text : "NULL");
+			if (msg_text)
+				free(msg_text);
+		}
 	}
 
 	tss2_init();
@@ -98,9 +154,12 @@ tpm2d_rcontrol_handle_message(const RemoteToTpm2d *msg, int fd, tpm2d_rcontrol_t
 		tpm2d_quote_t *quote = NULL;
 		uint8_t *attestation_cert = NULL;
 		size_t att_cert_len = 0;
-		uint8_t pcr_bitmap[3];
+		uint8_t pcr_bitmap[3] = { 0 };
 		int pcr_regs = 0;
 		int index = 0;
+		merkle_tree_t *nonce_tree = NULL;
+		const uint8_t *qualifying_data = msg->qualifyingdata.data;
+		size_t qualifying_data_len = msg->qualifyingdata.len;
 
 		TPMI_DH_OBJECT att_key_handle = tpm2d_get_as_key_handle();
 		if (att_key_handle == TPM_RH_NULL)
@@ -157,9 +216,29 @@ tpm2d_rcontrol_handle_message(const RemoteToTpm2d *msg, int fd, tpm2d_rcontrol_t
 			}
 		}
 
+		// several pending requests share one quote over the merkle root of their nonces
+		if (n_jobs > 1) {
+			const uint8_t **nonces = mem_new(const uint8_t *, n_jobs);
+			size_t *nonce_lens = mem_new(size_t, n_jobs);
+			index = 0;
+			for (list_t *l = batch->jobs.head; l; l = l->next, index++) {
+				tpm2d_rcontrol_job_t *job = l->data;
+				nonces[index] = job->msg->qualifyingdata.data;
+				nonce_lens[index] = job->msg->qualifyingdata.len;
+			}
+			nonce_tree = merkle_tree_new(nonces, nonce_lens, n_jobs);
+			mem_free0(nonces);
+			mem_free0(nonce_lens);
+			IF_NULL_GOTO_ERROR(nonce_tree, err_att_req);
+
+			qualifying_data = merkle_tree_get_root(nonce_tree);
+			qualifying_data_len = MERKLE_HASH_LEN;
+			DEBUG("Batched %zu attestation requests into one quote", n_jobs);
+		}
+
 		quote = tpm2_quote_new(pcr_bitmap, sizeof(pcr_bitmap), att_key_handle,
-				       TPM2D_ATT_KEY_PW, msg->qualifyingdata.data,
-				       msg->qualifyingdata.len);
+				       TPM2D_ATT_KEY_PW, (uint8_t *)qualifying_data,
+				       qualifying_data_len);
 		IF_NULL_GOTO_ERROR(quote, err_att_req);
 
 		// add device certificate to quote
@@ -224,23 +303,78 @@ tpm2d_rcontrol_handle_message(const RemoteToTpm2d *msg, int fd, tpm2d_rcontrol_t
 		out.certificate.data = attestation_cert;
 		out.certificate.len = att_cert_len;
 
-		out.ml_ima_entry.data = ml_get_ima_list_new(&out.ml_ima_entry.len);
-		if (!out.ml_ima_entry.data) {
+		size_t ima_list_len = 0;
+		uint8_t *ima_list = ml_get_ima_list_new(&ima_list_len);
+		if (!ima_list) {
 			WARN("Failed to retrieve IMA measurement list");
 			goto err_att_req;
 		}
 
-		out.ml_container_entry = ml_get_container_list_new(&out.n_ml_container_entry);
-		if (!out.ml_container_entry) {
+		size_t n_container_list = 0;
+		MlContainerEntry **container_list = ml_get_container_list_new(&n_container_list);
+		if (!container_list) {
 			WARN("Failed to retrieve container measurement list");
+			mem_free0(ima_list);
 			goto err_att_req;
 		}
 
+		const char *boot_id = ml_get_boot_id();
+		out.boot_id = (char *)boot_id;
+
 		DEBUG("Received INTERNAL_ATTESTATION_RES, now sending reply");
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		index = 0;
+		for (list_t *l = batch->jobs.head; l; l = l->next, index++) {
+			tpm2d_rcontrol_job_t *job = l->data;
+			ProtobufCBinaryData *proof = NULL;
+
+			if (nonce_tree) {
+				out.has_nonce_index = true;
+				out.nonce_index = index;
+				out.has_nonce_count = true;
+				out.nonce_count = n_jobs;
+				out.n_nonce_proof = merkle_tree_get_proof_len(nonce_tree, index);
+				proof = mem_new0(ProtobufCBinaryData, MAX(out.n_nonce_proof, 1));
+				for (size_t k = 0; k < out.n_nonce_proof; k++) {
+					proof[k].data = (uint8_t *)merkle_tree_get_proof_hash(
+						nonce_tree, index, k);
+					proof[k].len = MERKLE_HASH_LEN;
+				}
+				out.nonce_proof = proof;
+			}
 
-		mem_free0(out.ml_ima_entry.data);
-		ml_container_list_free(out.ml_container_entry, out.n_ml_container_entry);
+			// only send the entries the verifier does not know yet
+			uint64_t ima_offset = 0;
+			uint32_t container_offset = 0;
+			if (boot_id && job->msg->boot_id && !strcmp(boot_id, job->msg->boot_id)) {
+				if (job->msg->has_ml_ima_offset &&
+				    job->msg->ml_ima_offset <= ima_list_len)
+					ima_offset = job->msg->ml_ima_offset;
+				if (job->msg->has_ml_container_offset &&
+				    job->msg->ml_container_offset <= n_container_list)
+					container_offset = job->msg->ml_container_offset;
+			}
+			out.has_ml_ima_offset = ima_offset > 0;
+			out.ml_ima_offset = ima_offset;
+			out.ml_ima_entry.data = ima_list + ima_offset;
+			out.ml_ima_entry.len = ima_list_len - ima_offset;
+			out.has_ml_container_offset = container_offset > 0;
+			out.ml_container_offset = container_offset;
+			out.ml_container_entry = container_list + container_offset;
+			out.n_ml_container_entry = n_container_list - container_offset;
+			TRACE("Sending measurement lists from IMA offset %" PRIu64
+			      ", container offset %u to fd=%d",
+			      ima_offset, container_offset, job->fd);
+
+			// the connection is only written from the event loop
+			job->reply_len =
+				protobuf_c_message_get_packed_size((ProtobufCMessage *)&out);
+			job->reply = mem_alloc(MAX(job->reply_len, 1));
+			protobuf_c_message_pack((ProtobufCMessage *)&out, job->reply);
+			mem_free0(proof);
+		}
+
+		mem_free0(ima_list);
+		ml_container_list_free(container_list, n_container_list);
 
 	err_att_req:
 		tpm2d_flush_as_key_handle();
@@ -260,6 +394,7 @@ tpm2d_rcontrol_handle_message(const RemoteToTpm2d *msg, int fd, tpm2d_rcontrol_t
 			tpm2_quote_free(quote);
 		if (attestation_cert)
 			mem_free0(attestation_cert);
+		merkle_tree_free(nonce_tree);
 	} break;
 	default:
 		WARN("RemoteToTpm2d command %d unknown or not implemented yet", msg->code);
@@ -268,10 +403,54 @@ tpm2d_rcontrol_handle_message(const RemoteToTpm2d *msg, int fd, tpm2d_rcontrol_t
 	tss2_destroy();
 }
 
+static void
+tpm2d_rcontrol_batch_work(void *data)
+{
+	tpm2d_rcontrol_batch_t *batch = data;
+
+	// no further requests may join once the quote is being taken
+	pthread_mutex_lock(&tpm2d_rcontrol_batch_lock);
+	if (batch->rcontrol->pending == batch)
+		batch->rcontrol->pending = NULL;
+	pthread_mutex_unlock(&tpm2d_rcontrol_batch_lock);
+
+	tpm2d_rcontrol_handle_batch(batch);
+}
+
+static void
+tpm2d_rcontrol_job_done(tpm2d_rcontrol_job_t *job)
+{
+	if (job->reply && protobuf_send_message_packed(job->fd, job->reply, job->reply_len) < 0)
+		WARN("Failed to send response on remote control connection %d", job->fd);
+	DEBUG("Handled remote control connection %d", job->fd);
+
+	// resume reading further requests of this client
+	event_add_io(job->io);
+
+	protobuf_free_message((ProtobufCMessage *)job->msg);
+	mem_free0(job->reply);
+	mem_free0(job);
+}
+
+static void
+tpm2d_rcontrol_batch_done(void *data)
+{
+	tpm2d_rcontrol_batch_t *batch = data;
+
+	for (list_t *l = batch->jobs.head; l; l = l->next)
+		tpm2d_rcontrol_job_done(l->data);
+
+	list_queue_delete(&batch->jobs);
+	mem_free0(batch);
+}
+
 /**
  * Event callback for incoming data that a ControllerToTpm message.
  *
- * The handle_message function will be called to handle the received message.
+ * The message is handled by the TPM worker thread with low priority, so that
+ * attestation requests do not delay local commands on the container start path.
+ * Attestation requests arriving meanwhile join the pending batch, see
+ * tpm2d_rcontrol_batch_t.
  *
  * @param fd	    file descriptor of the client connection
  *		    from which the incoming message is read
@@ -291,9 +470,35 @@ tpm2d_rcontrol_cb_recv_message(int fd, unsigned events, event_io_t *io, void *da
 		// close connection if client EOF, or protocol parse error
 		IF_NULL_GOTO_TRACE(msg, connection_err);
 
-		tpm2d_rcontrol_handle_message(msg, fd, rcontrol);
-		protobuf_free_message((ProtobufCMessage *)msg);
-		DEBUG("Handled remote control connection %d", fd);
+		tpm2d_rcontrol_job_t *job = mem_new0(tpm2d_rcontrol_job_t, 1);
+		job->msg = msg;
+		job->fd = fd;
+		job->io = io;
+		job->rcontrol = rcontrol;
+
+		// suspend reading until the response is sent, see tpm2d_rcontrol_job_done
+		event_remove_io(io);
+
+		pthread_mutex_lock(&tpm2d_rcontrol_batch_lock);
+		if (rcontrol->pending && tpm2d_rcontrol_batch_can_join(rcontrol->pending, msg)) {
+			list_queue_append(&rcontrol->pending->jobs, job);
+			pthread_mutex_unlock(&tpm2d_rcontrol_batch_lock);
+			TRACE("Joined pending attestation batch with connection %d", fd);
+			return;
+		}
+		tpm2d_rcontrol_batch_t *batch = mem_new0(tpm2d_rcontrol_batch_t, 1);
+		batch->rcontrol = rcontrol;
+		list_queue_append(&batch->jobs, job);
+		rcontrol->pending = batch;
+		pthread_mutex_unlock(&tpm2d_rcontrol_batch_lock);
+
+		if (tpm2d_worker_run(TPM2D_WORKER_PRIO_LOW, tpm2d_rcontrol_batch_work,
+				     tpm2d_rcontrol_batch_done, batch) < 0) {
+			// handle the message in place if there is no worker
+			tpm2d_rcontrol_batch_work(batch);
+			tpm2d_rcontrol_batch_done(batch);
+		}
+		return;
 	}
 	if (events & EVENT_IO_EXCEPT) {
 		INFO("Remote client closed connection; disconnecting rcontrol socket.");
@@ -26,6 +26,7 @@
 #include "common/mem.h"
 #include "common/macro.h"
 #include "common/file.h"
+#include "common/hex.h"
 
 #include <ibmtss/tss.h>
 #include <ibmtss/tssutils.h>
@@ -81,48 +82,6 @@ tss2_destroy(void)
 	tss_context = NULL;
 }
 
-char *
-convert_bin_to_hex_new(const uint8_t *bin, int length)
-{
-	size_t len = MUL_WITH_OVERFLOW_CHECK(length, (size_t)2);
-	len = MUL_WITH_OVERFLOW_CHECK(len, sizeof(char));
-	len = ADD_WITH_OVERFLOW_CHECK(len, 1);
-	char *hex = mem_alloc0(len);
-
-	for (int i = 0; i < length; ++i) {
-		// remember snprintf additionally writs a '0' byte
-		snprintf(hex + i * 2, 3, "%.2x", bin[i]);
-	}
-
-	return hex;
-}
-
-uint8_t *
-convert_hex_to_bin_new(const char *hex_str, int *out_length)
-{
-	int len = strlen(hex_str);
-	int i = 0, j = 0;
-	*out_length = (len + 1) / 2;
-
-	uint8_t *bin = mem_alloc0(*out_length);
-
-	if (len % 2 == 1) {
-		// odd length -> we need to pad
-		IF_FALSE_GOTO(sscanf(&(hex_str[0]), "%1hhx", &(bin[0])) == 1, err);
-		i = j = 1;
-	}
-
-	for (; i < len; i += 2, j++) {
-		IF_FALSE_GOTO(sscanf(&(hex_str[i]), "%2hhx", &(bin[j])) == 1, err);
-	}
-
-	return bin;
-err:
-	ERROR("Converstion of hex string to bin failed!");
-	mem_free0(bin);
-	return NULL;
-}
-
 #ifndef TPM2D_NVMCRYPT_ONLY
 static uint8_t *
 tpm2d_marshal_structure_new(void *structure, MarshalFunction_t marshal_function, size_t *size)
@@ -466,6 +425,222 @@ tpm2_flushcontext(TPMI_DH_CONTEXT handle)
 	return rc;
 }
 
+/*
+ * Cache of loaded sessions and objects. Starting a salted session and loading a key
+ * both cost an RSA private key operation inside the TPM, thus handles are kept loaded
+ * after use and handed out again for the same purpose. Entries are reference counted
+ * and only idle entries are evicted, least recently used first. The cache sizes are
+ * chosen to leave room in the TPM's transient slots (at least three of each kind) for
+ * the salt key and uncached handles, e.g., trial sessions.
+ */
+#define TPM2D_SESSION_CACHE_SIZE 2
+#define TPM2D_OBJECT_CACHE_SIZE 2
+
+typedef struct tpm2_cache_entry {
+	TPM_HANDLE handle; // 0 if the entry is unused
+	unsigned int refs;
+	unsigned long last_use;
+	TPM_SE session_type;
+	TPM_HANDLE parent;		  // bind handle of a session, parent of an object
+	uint8_t id[SHA256_DIGEST_LENGTH]; // hash of the auth value and key files
+} tpm2_cache_entry_t;
+
+static tpm2_cache_entry_t tpm2_session_cache[TPM2D_SESSION_CACHE_SIZE];
+static tpm2_cache_entry_t tpm2_object_cache[TPM2D_OBJECT_CACHE_SIZE];
+static unsigned long tpm2_cache_clock = 0;
+
+static void
+tpm2_cache_id(uint8_t *id, const char *auth, const char *file1, const char *file2)
+{
+	SHA256_CTX sha256;
+	const char *strs[] = { auth, file1, file2 };
+
+	SHA256_Init(&sha256);
+	for (size_t i = 0; i < sizeof(strs) / sizeof(strs[0]); ++i) {
+		// include the terminating '\0' to separate the strings, "\1" marks NULL
+		const char *s = strs[i] ? strs[i] : "\1";
+		SHA256_Update(&sha256, s, strlen(s) + 1);
+	}
+	SHA256_Final(id, &sha256);
+}
+
+static tpm2_cache_entry_t *
+tpm2_cache_find(tpm2_cache_entry_t *cache, size_t size, TPM_SE session_type, TPM_HANDLE parent,
+		const uint8_t *id, bool idle_only)
+{
+	for (size_t i = 0; i < size; ++i) {
+		if (cache[i].handle != 0 && (!idle_only || cache[i].refs == 0) &&
+		    cache[i].session_type == session_type && cache[i].parent == parent &&
+		    !memcmp(cache[i].id, id, SHA256_DIGEST_LENGTH))
+			return &cache[i];
+	}
+	return NULL;
+}
+
+static tpm2_cache_entry_t *
+tpm2_cache_find_handle(tpm2_cache_entry_t *cache, size_t size, TPM_HANDLE handle)
+{
+	for (size_t i = 0; i < size; ++i) {
+		if (cache[i].handle != 0 && cache[i].handle == handle)
+			return &cache[i];
+	}
+	return NULL;
+}
+
+static void
+tpm2_cache_evict(tpm2_cache_entry_t *entry)
+{
+	TRACE("Flushing cached handle %08x", entry->handle);
+	if (TPM_RC_SUCCESS != tpm2_flushcontext(entry->handle))
+		WARN("Failed to flush cached handle %08x", entry->handle);
+	memset(entry, 0, sizeof(tpm2_cache_entry_t));
+}
+
+/*
+ * Returns an unused entry for a new handle, evicting the least recently used idle
+ * entry if necessary. Returns NULL if all entries are in use.
+ */
+static tpm2_cache_entry_t *
+tpm2_cache_get_free(tpm2_cache_entry_t *cache, size_t size)
+{
+	tpm2_cache_entry_t *lru = NULL;
+
+	for (size_t i = 0; i < size; ++i) {
+		if (cache[i].handle == 0)
+			return &cache[i];
+		if (cache[i].refs == 0 && (!lru || cache[i].last_use < lru->last_use))
+			lru = &cache[i];
+	}
+	if (lru)
+		tpm2_cache_evict(lru);
+	return lru;
+}
+
+/*
+ * Evicts all idle entries of a cache to free TPM slots, e.g., if the TPM ran out of
+ * memory for a new handle.
+ */
+static bool
+tpm2_cache_evict_idle(tpm2_cache_entry_t *cache, size_t size)
+{
+	bool evicted = false;
+
+	for (size_t i = 0; i < size; ++i) {
+		if (cache[i].handle != 0 && cache[i].refs == 0) {
+			tpm2_cache_evict(&cache[i]);
+			evicted = true;
+		}
+	}
+	return evicted;
+}
+
+static bool
+tpm2_rc_is_out_of_memory(TPM_RC rc)
+{
+	return (rc & 0xfff) == TPM_RC_OBJECT_MEMORY || (rc & 0xfff) == TPM_RC_SESSION_MEMORY;
+}
+
+TPM_RC
+tpm2_session_get(TPM_SE session_type, TPMI_SH_AUTH_SESSION *out_session_handle,
+		 TPMI_DH_OBJECT bind_handle, const char *bind_pwd)
+{
+	TPM_RC rc;
+	uint8_t id[SHA256_DIGEST_LENGTH];
+	tpm2_cache_entry_t *entry = NULL;
+
+	/*
+	 * The name of an NV index changes when it is written or redefined, which would
+	 * silently turn a bound session into an unbound one. Thus, only sessions which are
+	 * unbound or bound to a hierarchy are cached.
+	 */
+	bool cacheable = (session_type == TPM_SE_HMAC || session_type == TPM_SE_POLICY) &&
+			 (bind_handle == TPM_RH_NULL || (bind_handle >> 24) == TPM_HT_PERMANENT);
+
+	if (cacheable) {
+		tpm2_cache_id(id, bind_handle == TPM_RH_NULL ? NULL : bind_pwd, NULL, NULL);
+		// sessions are not shared, since their state changes with each use
+		entry = tpm2_cache_find(tpm2_session_cache, TPM2D_SESSION_CACHE_SIZE, session_type,
+					bind_handle, id, true);
+	}
+	if (entry) {
+		// a policy session has to start with an empty policy digest
+		if (session_type != TPM_SE_POLICY ||
+		    TPM_RC_SUCCESS == tpm2_policyrestart(entry->handle)) {
+			entry->refs++;
+			entry->last_use = ++tpm2_cache_clock;
+			*out_session_handle = entry->handle;
+			TRACE("Reusing cached session %08x", entry->handle);
+			return TPM_RC_SUCCESS;
+		}
+		tpm2_cache_evict(entry);
+	}
+
+	rc = tpm2_startauthsession(session_type, out_session_handle, bind_handle, bind_pwd);
+	if (tpm2_rc_is_out_of_memory(rc) &&
+	    tpm2_cache_evict_idle(tpm2_session_cache, TPM2D_SESSION_CACHE_SIZE))
+		rc = tpm2_startauthsession(session_type, out_session_handle, bind_handle, bind_pwd);
+	if (TPM_RC_SUCCESS != rc || !cacheable)
+		return rc;
+
+	entry = tpm2_cache_get_free(tpm2_session_cache, TPM2D_SESSION_CACHE_SIZE);
+	if (entry) {
+		entry->handle = *out_session_handle;
+		entry->refs = 1;
+		entry->last_use = ++tpm2_cache_clock;
+		entry->session_type = session_type;
+		entry->parent = bind_handle;
+		memcpy(entry->id, id, SHA256_DIGEST_LENGTH);
+	}
+	return rc;
+}
+
+void
+tpm2_session_put(TPMI_SH_AUTH_SESSION session_handle, TPM_RC rc)
+{
+	tpm2_cache_entry_t *entry = tpm2_cache_find_handle(
+		tpm2_session_cache, TPM2D_SESSION_CACHE_SIZE, session_handle);
+
+	if (!entry) {
+		if (TPM_RC_SUCCESS != tpm2_flushcontext(session_handle))
+			WARN("Flush failed, maybe session handle was allready flushed.");
+		return;
+	}
+
+	ASSERT(entry->refs > 0);
+	entry->refs--;
+
+	// the state of a session is unknown after a failed command, do not reuse it
+	if (TPM_RC_SUCCESS != rc && entry->refs == 0)
+		tpm2_cache_evict(entry);
+}
+
+void
+tpm2_session_invalidate(TPMI_DH_OBJECT bind_handle)
+{
+	for (size_t i = 0; i < TPM2D_SESSION_CACHE_SIZE; ++i) {
+		tpm2_cache_entry_t *entry = &tpm2_session_cache[i];
+		if (entry->handle == 0 || entry->parent != bind_handle)
+			continue;
+		if (entry->refs == 0)
+			tpm2_cache_evict(entry);
+		else // flushed by tpm2_session_put()
+			entry->handle = 0;
+	}
+}
+
+void
+tpm2_handle_cache_flush(void)
+{
+	for (size_t i = 0; i < TPM2D_SESSION_CACHE_SIZE; ++i) {
+		if (tpm2_session_cache[i].handle != 0)
+			tpm2_cache_evict(&tpm2_session_cache[i]);
+	}
+	for (size_t i = 0; i < TPM2D_OBJECT_CACHE_SIZE; ++i) {
+		if (tpm2_object_cache[i].handle != 0)
+			tpm2_cache_evict(&tpm2_object_cache[i]);
+	}
+}
+
 static TPM_RC
 tpm2_fill_rsa_details(TPMT_PUBLIC *out_public_area, tpm2d_key_type_t key_type)
 {
@@ -809,27 +984,92 @@ tpm2_load(TPMI_DH_OBJECT parent_handle, const char *parent_pwd, const char *file
 }
 
 TPM_RC
-tpm2_pcrextend(TPMI_DH_PCR pcr_index, TPMI_ALG_HASH hash_alg, const uint8_t *data, size_t data_len)
+tpm2_load_cached(TPMI_DH_OBJECT parent_handle, const char *parent_pwd,
+		 const char *file_name_priv_key, const char *file_name_pub_key,
+		 uint32_t *out_handle)
+{
+	TPM_RC rc;
+	uint8_t id[SHA256_DIGEST_LENGTH];
+	tpm2_cache_entry_t *entry;
+
+	tpm2_cache_id(id, parent_pwd, file_name_priv_key, file_name_pub_key);
+	entry = tpm2_cache_find(tpm2_object_cache, TPM2D_OBJECT_CACHE_SIZE, 0, parent_handle, id,
+				false);
+	if (entry) {
+		// loaded objects are not altered by their use, thus they can be shared
+		entry->refs++;
+		entry->last_use = ++tpm2_cache_clock;
+		*out_handle = entry->handle;
+		TRACE("Reusing cached object %08x", entry->handle);
+		return TPM_RC_SUCCESS;
+	}
+
+	rc = tpm2_load(parent_handle, parent_pwd, file_name_priv_key, file_name_pub_key,
+		       out_handle);
+	if (tpm2_rc_is_out_of_memory(rc) &&
+	    tpm2_cache_evict_idle(tpm2_object_cache, TPM2D_OBJECT_CACHE_SIZE))
+		rc = tpm2_load(parent_handle, parent_pwd, file_name_priv_key, file_name_pub_key,
+			       out_handle);
+	IF_FALSE_RETVAL(TPM_RC_SUCCESS == rc, rc);
+
+	entry = tpm2_cache_get_free(tpm2_object_cache, TPM2D_OBJECT_CACHE_SIZE);
+	if (entry) {
+		entry->handle = *out_handle;
+		entry->refs = 1;
+		entry->last_use = ++tpm2_cache_clock;
+		entry->parent = parent_handle;
+		memcpy(entry->id, id, SHA256_DIGEST_LENGTH);
+	}
+	return rc;
+}
+
+void
+tpm2_object_put(TPMI_DH_OBJECT object_handle)
+{
+	tpm2_cache_entry_t *entry =
+		tpm2_cache_find_handle(tpm2_object_cache, TPM2D_OBJECT_CACHE_SIZE, object_handle);
+
+	if (!entry) {
+		if (TPM_RC_SUCCESS != tpm2_flushcontext(object_handle))
+			WARN("Failed to flush object %08x", object_handle);
+		return;
+	}
+
+	ASSERT(entry->refs > 0);
+	entry->refs--;
+}
+
+TPM_RC
+tpm2_pcrextend_banks(TPMI_DH_PCR pcr_index, size_t count, const TPMI_ALG_HASH *hash_algs,
+		     const uint8_t *const *data, const size_t *data_len)
 {
 	TPM_RC rc = TPM_RC_SUCCESS;
 	PCR_Extend_In in;
 
 	IF_NULL_RETVAL_ERROR(tss_context, TSS_RC_NULL_PARAMETER);
 
-	if (data_len > sizeof(TPMU_HA)) {
-		ERROR("Data length %zu exceeds hash size %zu!", data_len, sizeof(TPMU_HA));
+	if (count == 0 || count > HASH_COUNT) {
+		ERROR("Invalid number of banks %zu to extend!", count);
 		return EXIT_FAILURE;
 	}
 
 	in.pcrHandle = pcr_index;
 
-	// extend one bank
-	in.digests.count = 1;
+	// extend all given banks with a single command
+	in.digests.count = count;
+
+	for (size_t i = 0; i < count; i++) {
+		if (data_len[i] > sizeof(TPMU_HA)) {
+			ERROR("Data length %zu exceeds hash size %zu!", data_len[i],
+			      sizeof(TPMU_HA));
+			return EXIT_FAILURE;
+		}
 
-	// pad and set data
-	in.digests.digests[0].hashAlg = hash_alg;
-	memset((uint8_t *)&in.digests.digests[0].digest, 0, sizeof(TPMU_HA));
-	memcpy((uint8_t *)&in.digests.digests[0].digest, data, data_len);
+		// pad and set data
+		in.digests.digests[i].hashAlg = hash_algs[i];
+		memset((uint8_t *)&in.digests.digests[i].digest, 0, sizeof(TPMU_HA));
+		memcpy((uint8_t *)&in.digests.digests[i].digest, data[i], data_len[i]);
+	}
 
 	rc = TSS_Execute(tss_context, NULL, (COMMAND_PARAMETERS *)&in, NULL, TPM_CC_PCR_Extend,
 			 TPM_RS_PW, NULL, 0, TPM_RH_NULL, NULL, 0);
@@ -840,6 +1080,12 @@ tpm2_pcrextend(TPMI_DH_PCR pcr_index, TPMI_ALG_HASH hash_alg, const uint8_t *dat
 	return rc;
 }
 
+TPM_RC
+tpm2_pcrextend(TPMI_DH_PCR pcr_index, TPMI_ALG_HASH hash_alg, const uint8_t *data, size_t data_len)
+{
+	return tpm2_pcrextend_banks(pcr_index, 1, &hash_alg, &data, &data_len);
+}
+
 tpm2d_quote_t *
 tpm2_quote_new(uint8_t *pcr_bitmap, size_t size_pcr_bitmap, TPMI_DH_OBJECT sig_key_handle,
 	       const char *sig_key_pwd, uint8_t *qualifying_data, size_t qualifying_data_len)
@@ -1057,7 +1303,7 @@ tpm2_rsadecrypt(TPMI_DH_OBJECT key_handle, const char *key_pwd, uint8_t *in_buff
 TPM_RC
 tpm2_hierarchychangeauth(TPMI_RH_HIERARCHY hierarchy, const char *old_pwd, const char *new_pwd)
 {
-	TPM_RC rc, rc_flush = TPM_RC_SUCCESS;
+	TPM_RC rc;
 	TPMI_SH_AUTH_SESSION se_handle;
 	HierarchyChangeAuth_In in;
 
@@ -1072,7 +1318,7 @@ tpm2_hierarchychangeauth(TPMI_RH_HIERARCHY hierarchy, const char *old_pwd, const
 		return rc;
 
 	// since we use this to store symetric keys, start an encrypted transport */
-	rc = tpm2_startauthsession(TPM_SE_HMAC, &se_handle, hierarchy, old_pwd);
+	rc = tpm2_session_get(TPM_SE_HMAC, &se_handle, hierarchy, old_pwd);
 	if (TPM_RC_SUCCESS != rc)
 		goto err;
 
@@ -1083,13 +1329,13 @@ tpm2_hierarchychangeauth(TPMI_RH_HIERARCHY hierarchy, const char *old_pwd, const
 				 NULL, 0);
 	} while (TPM_RC_RETRY == rc);
 
-	rc_flush = tpm2_flushcontext(se_handle);
+	tpm2_session_put(se_handle, rc);
+	// sessions bound to the hierarchy were derived from the old auth value
+	if (TPM_RC_SUCCESS == rc)
+		tpm2_session_invalidate(hierarchy);
 err:
-	if (TPM_RC_SUCCESS != rc) {
+	if (TPM_RC_SUCCESS != rc)
 		TSS_TPM_CMD_ERROR(rc, "CC_HierarchyChangeAuth");
-	} else {
-		rc = rc_flush;
-	}
 	return rc;
 }
 
@@ -1104,7 +1350,7 @@ tpm2_getrandom_new(size_t rand_length)
 	IF_NULL_RETVAL_ERROR(tss_context, NULL);
 
 	// since we use this to generate symetric keys, start an encrypted transport */
-	rc = tpm2_startauthsession(TPM_SE_HMAC, &se_handle, TPM_RH_NULL, NULL);
+	rc = tpm2_session_get(TPM_SE_HMAC, &se_handle, TPM_RH_NULL, NULL);
 	if (TPM_RC_SUCCESS != rc)
 		return NULL;
 
@@ -1122,20 +1368,19 @@ tpm2_getrandom_new(size_t rand_length)
 		recv_bytes += out.randomBytes.t.size;
 	} while (recv_bytes < rand_length);
 
+	tpm2_session_put(se_handle, rc);
+
 	if (TPM_RC_SUCCESS != rc) {
 		TSS_TPM_CMD_ERROR(rc, "CC_GetRandom");
 		mem_free0(rand);
 		return NULL;
 	}
 
-	char *rand_hex = convert_bin_to_hex_new(rand, rand_length);
+	char *rand_hex = hex_encode_new(rand, rand_length);
 	INFO("Generated Rand: %s", rand_hex);
 
 	mem_free0(rand_hex);
 
-	if (TPM_RC_SUCCESS != tpm2_flushcontext(se_handle))
-		WARN("Flush failed, maybe session handle was allready flushed.");
-
 	return rand;
 }
 
@@ -1263,7 +1508,7 @@ TPM_RC
 tpm2_nv_definespace(TPMI_RH_HIERARCHY hierarchy, TPMI_RH_NV_INDEX nv_index_handle, size_t nv_size,
 		    const char *hierarchy_pwd, const char *nv_pwd, uint8_t *policy_digest)
 {
-	TPM_RC rc, rc_flush = TPM_RC_SUCCESS;
+	TPM_RC rc;
 	TPMI_SH_AUTH_SESSION se_handle;
 	NV_DefineSpace_In in;
 	TPMA_NV nv_attr;
@@ -1330,7 +1575,7 @@ tpm2_nv_definespace(TPMI_RH_HIERARCHY hierarchy, TPMI_RH_NV_INDEX nv_index_handl
 	in.publicInfo.nvPublic.attributes = nv_attr;
 
 	// since we use this to store symetric keys, start an encrypted transport */
-	rc = tpm2_startauthsession(TPM_SE_HMAC, &se_handle, hierarchy, hierarchy_pwd);
+	rc = tpm2_session_get(TPM_SE_HMAC, &se_handle, hierarchy, hierarchy_pwd);
 	if (TPM_RC_SUCCESS != rc)
 		goto err;
 
@@ -1342,13 +1587,10 @@ tpm2_nv_definespace(TPMI_RH_HIERARCHY hierarchy, TPMI_RH_NV_INDEX nv_index_handl
 				 TPM_RH_NULL, NULL, 0);
 	} while (TPM_RC_RETRY == rc);
 
-	rc_flush = tpm2_flushcontext(se_handle);
+	tpm2_session_put(se_handle, rc);
 err:
-	if (TPM_RC_SUCCESS != rc) {
+	if (TPM_RC_SUCCESS != rc)
 		TSS_TPM_CMD_ERROR(rc, "CC_NV_DefineSpace");
-	} else {
-		rc = rc_flush;
-	}
 
 	return rc;
 }
@@ -1357,7 +1599,7 @@ TPM_RC
 tpm2_nv_undefinespace(TPMI_RH_HIERARCHY hierarchy, TPMI_RH_NV_INDEX nv_index_handle,
 		      const char *hierarchy_pwd)
 {
-	TPM_RC rc, rc_flush = TPM_RC_SUCCESS;
+	TPM_RC rc;
 	TPMI_SH_AUTH_SESSION se_handle;
 	NV_UndefineSpace_In in;
 
@@ -1372,7 +1614,7 @@ tpm2_nv_undefinespace(TPMI_RH_HIERARCHY hierarchy, TPMI_RH_NV_INDEX nv_index_han
 	in.nvIndex = nv_index_handle;
 
 	// since we use this to store symetric keys, start an encrypted transport */
-	rc = tpm2_startauthsession(TPM_SE_HMAC, &se_handle, hierarchy, hierarchy_pwd);
+	rc = tpm2_session_get(TPM_SE_HMAC, &se_handle, hierarchy, hierarchy_pwd);
 	if (TPM_RC_SUCCESS != rc)
 		goto err;
 
@@ -1383,13 +1625,10 @@ tpm2_nv_undefinespace(TPMI_RH_HIERARCHY hierarchy, TPMI_RH_NV_INDEX nv_index_han
 				 se_handle, 0, TPMA_SESSION_CONTINUESESSION, TPM_RH_NULL, NULL, 0);
 	} while (TPM_RC_RETRY == rc);
 
-	rc_flush = tpm2_flushcontext(se_handle);
+	tpm2_session_put(se_handle, rc);
 err:
-	if (TPM_RC_SUCCESS != rc) {
+	if (TPM_RC_SUCCESS != rc)
 		TSS_TPM_CMD_ERROR(rc, "CC_NV_UndefineSpace");
-	} else {
-		rc = rc_flush;
-	}
 
 	return rc;
 }
@@ -1398,7 +1637,7 @@ TPM_RC
 tpm2_nv_write(TPMI_RH_NV_INDEX nv_index_handle, const char *nv_pwd, uint8_t *data,
 	      size_t data_length)
 {
-	TPM_RC rc, rc_flush = TPM_RC_SUCCESS;
+	TPM_RC rc;
 	TPMI_SH_AUTH_SESSION se_handle;
 	NV_Write_In in;
 
@@ -1422,7 +1661,7 @@ tpm2_nv_write(TPMI_RH_NV_INDEX nv_index_handle, const char *nv_pwd, uint8_t *dat
 	in.data.b.size = data_length;
 
 	// since we use this to read symetric keys, start an encrypted transport */
-	rc = tpm2_startauthsession(TPM_SE_HMAC, &se_handle, nv_index_handle, nv_pwd);
+	rc = tpm2_session_get(TPM_SE_HMAC, &se_handle, nv_index_handle, nv_pwd);
 	if (TPM_RC_SUCCESS != rc)
 		goto err;
 
@@ -1433,13 +1672,10 @@ tpm2_nv_write(TPMI_RH_NV_INDEX nv_index_handle, const char *nv_pwd, uint8_t *dat
 				 NULL, 0);
 	} while (TPM_RC_RETRY == rc);
 
-	rc_flush = tpm2_flushcontext(se_handle);
+	tpm2_session_put(se_handle, rc);
 err:
-	if (TPM_RC_SUCCESS != rc) {
+	if (TPM_RC_SUCCESS != rc)
 		TSS_TPM_CMD_ERROR(rc, "CC_NV_Write");
-	} else {
-		rc = rc_flush;
-	}
 	return rc;
 }
 
@@ -1447,7 +1683,7 @@ TPM_RC
 tpm2_nv_read(TPMI_SH_POLICY se_handle, TPMI_RH_NV_INDEX nv_index_handle, const char *nv_pwd,
 	     uint8_t *out_buffer, size_t *out_length)
 {
-	TPM_RC rc, rc_flush = TPM_RC_SUCCESS;
+	TPM_RC rc;
 	TPMI_SH_AUTH_SESSION auth_se_handle;
 
 	NV_Read_In in;
@@ -1475,7 +1711,7 @@ tpm2_nv_read(TPMI_SH_POLICY se_handle, TPMI_RH_NV_INDEX nv_index_handle, const c
 
 	// since we use this to read symetric keys, start an encrypted transport
 	if (se_handle == TPM_RH_NULL) {
-		rc = tpm2_startauthsession(TPM_SE_HMAC, &auth_se_handle, nv_index_handle, nv_pwd);
+		rc = tpm2_session_get(TPM_SE_HMAC, &auth_se_handle, nv_index_handle, nv_pwd);
 		if (TPM_RC_SUCCESS != rc)
 			goto err;
 	} else {
@@ -1510,21 +1746,18 @@ tpm2_nv_read(TPMI_SH_POLICY se_handle, TPMI_RH_NV_INDEX nv_index_handle, const c
 	TSS_PrintAll("nv_read data: ", out_buffer, *out_length);
 
 flush:
-	rc_flush = tpm2_flushcontext(auth_se_handle);
+	tpm2_session_put(auth_se_handle, rc);
 
 err:
-	if (TPM_RC_SUCCESS != rc) {
+	if (TPM_RC_SUCCESS != rc)
 		TSS_TPM_CMD_ERROR(rc, "CC_NV_Read");
-	} else {
-		rc = rc_flush;
-	}
 	return rc;
 }
 
 TPM_RC
 tpm2_nv_readlock(TPMI_RH_NV_INDEX nv_index_handle, const char *nv_pwd)
 {
-	TPM_RC rc, rc_flush = TPM_RC_SUCCESS;
+	TPM_RC rc;
 	TPMI_SH_AUTH_SESSION se_handle;
 	NV_ReadLock_In in;
 
@@ -1539,7 +1772,7 @@ tpm2_nv_readlock(TPMI_RH_NV_INDEX nv_index_handle, const char *nv_pwd)
 	in.nvIndex = nv_index_handle;
 
 	// since we use this to read symetric keys, start an encrypted transport
-	rc = tpm2_startauthsession(TPM_SE_HMAC, &se_handle, nv_index_handle, nv_pwd);
+	rc = tpm2_session_get(TPM_SE_HMAC, &se_handle, nv_index_handle, nv_pwd);
 	if (TPM_RC_SUCCESS != rc)
 		goto err;
 
@@ -1550,13 +1783,10 @@ tpm2_nv_readlock(TPMI_RH_NV_INDEX nv_index_handle, const char *nv_pwd)
 				 se_handle, 0, TPMA_SESSION_CONTINUESESSION, TPM_RH_NULL, NULL, 0);
 	} while (TPM_RC_RETRY == rc);
 
-	rc_flush = tpm2_flushcontext(se_handle);
+	tpm2_session_put(se_handle, rc);
 
 err:
-	if (TPM_RC_SUCCESS != rc) {
+	if (TPM_RC_SUCCESS != rc)
 		TSS_TPM_CMD_ERROR(rc, "CC_NV_ReadLock");
-	} else {
-		rc = rc_flush;
-	}
 	return rc;
 }
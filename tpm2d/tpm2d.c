@@ -66,13 +66,12 @@ static char *tpm2d_as_key_pwd_pt = TPM2D_PRIMARY_STORAGE_KEY_PW;
 #endif
 
 static void
-tpm2d_logfile_rename_cb(UNUSED event_timer_t *timer, UNUSED void *data)
+tpm2d_logfile_prio_cb(event_timer_t *timer, UNUSED void *data)
 {
-	INFO("Logfile must be closed and a new file opened");
-	logf_unregister(tpm2d_logfile_handler);
-	tpm2d_logfile_handler =
-		logf_register(&logf_file_write, logf_file_new(LOGFILE_DIR "/cml-tpm2d"));
+	// the log file is rotated by its stream, only the first day is logged verbosely
+	INFO("Restricting logfile to warnings");
 	logf_handler_set_prio(tpm2d_logfile_handler, LOGF_PRIO_WARN);
+	event_timer_free(timer);
 }
 
 static void
@@ -102,9 +101,9 @@ tpm2d_get_as_key_handle(void)
 		int ret;
 		// load attestation key
 		if (TPM_RC_SUCCESS !=
-		    (ret = tpm2_load(tpm2d_as_key_handle_pt_ps, tpm2d_as_key_pwd_pt,
-				     TPM2D_ATT_PRIV_FILE, TPM2D_ATT_PUB_FILE,
-				     &tpm2d_as_key_handle_tr))) {
+		    (ret = tpm2_load_cached(tpm2d_as_key_handle_pt_ps, tpm2d_as_key_pwd_pt,
+					    TPM2D_ATT_PRIV_FILE, TPM2D_ATT_PUB_FILE,
+					    &tpm2d_as_key_handle_tr))) {
 			ERROR("Failed to load attestation key with error code: %08x", ret);
 			return TPM_RH_NULL;
 		} else {
@@ -119,7 +118,8 @@ void
 tpm2d_flush_as_key_handle(void)
 {
 	if (tpm2d_as_key_handle_tr != TPM_RH_NULL) {
-		tpm2_flushcontext(tpm2d_as_key_handle_tr);
+		// stays loaded in the handle cache for the next attestation
+		tpm2_object_put(tpm2d_as_key_handle_tr);
 		tpm2d_as_key_handle_tr = TPM_RH_NULL;
 	}
 }
@@ -252,12 +252,13 @@ tpm2d_exit(void)
 	INFO("Cleaning up tss2 and exit");
 	// When called tss2 library context may not be
 	tss2_init();
-	if (tpm2d_salt_key_handle != TPM_RH_NULL)
-		tpm2_flushcontext(tpm2d_salt_key_handle);
 #ifndef TPM2D_NVMCRYPT_ONLY
-	if (tpm2d_as_key_handle_tr != TPM_RH_NULL)
-		tpm2_flushcontext(tpm2d_as_key_handle_tr);
+	tpm2d_flush_as_key_handle();
 #endif
+	// cached sessions are salted, flush them before the salt key
+	tpm2_handle_cache_flush();
+	if (tpm2d_salt_key_handle != TPM_RH_NULL)
+		tpm2_flushcontext(tpm2d_salt_key_handle);
 
 	tss2_destroy();
 	exit(0);
@@ -313,8 +314,10 @@ main(UNUSED int argc, char **argv)
 		}
 	}
 
-	tpm2d_logfile_handler =
-		logf_register(&logf_file_write, logf_file_new(LOGFILE_DIR "/cml-tpm2d"));
+	tpm2d_logfile_handler = logf_register(
+		&logf_file_write,
+		logf_file_rotating_new(LOGFILE_DIR "/cml-tpm2d", LOGF_FILE_ROTATE_SIZE,
+				       LOGF_FILE_ROTATE_AGE, LOGF_FILE_ROTATE_TOTAL));
 	logf_handler_set_prio(tpm2d_logfile_handler, LOGF_PRIO_TRACE);
 
 	INFO("Starting tpm2d ...");
@@ -327,8 +330,7 @@ main(UNUSED int argc, char **argv)
 	event_add_signal(sig_term);
 
 	event_timer_t *logfile_timer =
-		event_timer_new(HOURS_TO_MILLISECONDS(24), EVENT_TIMER_REPEAT_FOREVER,
-				tpm2d_logfile_rename_cb, NULL);
+		event_timer_new(HOURS_TO_MILLISECONDS(24), 1, tpm2d_logfile_prio_cb, NULL);
 	event_add_timer(logfile_timer);
 
 	tpm2d_init();
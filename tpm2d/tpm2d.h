@@ -84,31 +84,6 @@ tss2_init(void);
 void
 tss2_destroy(void);
 
-/**
- * Helper function to convert a binary buffer to an hex string
- *
- * This function allocates a new buffer containing the
- * resulting hex representation containing a terminating '\0'
- * of the binary buffer.
- *
- * @param bin binary buffer
- * @param length of the binary buffer
- */
-char *
-convert_bin_to_hex_new(const uint8_t *bin, int length);
-
-/**
- * Helper function to convert a hex string into binary
- *
- * This function allocates a new buffer containing the
- * resulting binary representation of the string.
- *
- * @param hex_str buffer containing the hex string representation
- * @param out_length in this pointer the size of result is returned
- */
-uint8_t *
-convert_hex_to_bin_new(const char *hex_str, int *out_length);
-
 /**
  * Function to powerup the simulator
  *
@@ -168,6 +143,44 @@ tpm2_createprimary_asym(TPMI_RH_HIERARCHY hierachy, tpm2d_key_type_t key_type,
 TPM_RC
 tpm2_flushcontext(TPMI_DH_CONTEXT handle);
 
+/**
+ * Returns a loaded auth session for the given purpose. Sessions which are unbound
+ * or bound to a hierarchy are taken from a cache of loaded sessions if possible,
+ * instead of starting a new one. A cached policy session is restarted, i.e., its
+ * policy digest is empty. The session must be returned with tpm2_session_put().
+ *
+ * @param session_type TPM_SE_HMAC or TPM_SE_POLICY; other types are not cached
+ * @param out_session_handle returns the handle of the session
+ * @param bind_handle the entity to bind the session to, or TPM_RH_NULL
+ * @param bind_pwd the auth value of the bind entity
+ * @return TPM_RC_SUCCESS on success, the error of TPM2_StartAuthSession otherwise
+ */
+TPM_RC
+tpm2_session_get(TPM_SE session_type, TPMI_SH_AUTH_SESSION *out_session_handle,
+		 TPMI_DH_OBJECT bind_handle, const char *bind_pwd);
+
+/**
+ * Returns a session obtained by tpm2_session_get(). The session is kept loaded
+ * for reuse if it is cached and the command using it succeeded, otherwise it is flushed.
+ *
+ * @param session_handle handle of the session
+ * @param rc result of the last command using the session
+ */
+void
+tpm2_session_put(TPMI_SH_AUTH_SESSION session_handle, TPM_RC rc);
+
+/**
+ * Drops all cached sessions bound to the given entity, e.g., after its auth value changed.
+ */
+void
+tpm2_session_invalidate(TPMI_DH_OBJECT bind_handle);
+
+/**
+ * Flushes all cached sessions and objects out of the TPM.
+ */
+void
+tpm2_handle_cache_flush(void);
+
 #ifndef TPM2D_NVMCRYPT_ONLY
 /**
  * Creates an asymmetric key as part of the hierarchy designated by the parent handle
@@ -184,6 +197,23 @@ TPM_RC
 tpm2_load(TPMI_DH_OBJECT parent_handle, const char *parent_pwd, const char *file_name_priv_key,
 	  const char *file_name_pub_key, uint32_t *out_handle);
 
+/**
+ * Like tpm2_load(), but returns the handle of an already loaded object for the same
+ * key files and parent if possible. Cached objects stay loaded until they are evicted
+ * in favor of other objects. The handle must be returned with tpm2_object_put().
+ */
+TPM_RC
+tpm2_load_cached(TPMI_DH_OBJECT parent_handle, const char *parent_pwd,
+		 const char *file_name_priv_key, const char *file_name_pub_key,
+		 uint32_t *out_handle);
+
+/**
+ * Returns an object handle obtained by tpm2_load_cached(). Objects which are not
+ * cached are flushed.
+ */
+void
+tpm2_object_put(TPMI_DH_OBJECT object_handle);
+
 TPMI_DH_OBJECT
 tpm2d_get_as_key_handle(void);
 
@@ -193,6 +223,14 @@ tpm2d_flush_as_key_handle(void);
 TPM_RC
 tpm2_pcrextend(TPMI_DH_PCR pcr_index, TPMI_ALG_HASH hash_alg, const uint8_t *data, size_t data_len);
 
+/**
+ * Extends count banks of pcr_index in a single TPM2_PCR_Extend command, bank i with
+ * hash_algs[i] by data[i] of length data_len[i].
+ */
+TPM_RC
+tpm2_pcrextend_banks(TPMI_DH_PCR pcr_index, size_t count, const TPMI_ALG_HASH *hash_algs,
+		     const uint8_t *const *data, const size_t *data_len);
+
 tpm2d_quote_t *
 tpm2_quote_new(uint8_t *pcr_bitmap, size_t size_pcr_bitmap, TPMI_DH_OBJECT sig_key_handle,
 	       const char *sig_key_pwd, uint8_t *qualifying_data, size_t qualifying_data_len);
@@ -239,6 +277,12 @@ TPM_RC
 tpm2_nv_write(TPMI_RH_NV_INDEX nv_index_handle, const char *nv_pwd, uint8_t *data,
 	      size_t data_length);
 
+/**
+ * Reads the data of an NV index using an encrypted transport.
+ *
+ * @param se_handle a policy session obtained by tpm2_session_get() which is
+ *        returned by this function, or TPM_RH_NULL to use an HMAC session
+ */
 TPM_RC
 tpm2_nv_read(TPMI_SH_POLICY se_handle, TPMI_RH_NV_INDEX nv_index_handle, const char *nv_pwd,
 	     uint8_t *out_buffer, size_t *out_length);
@@ -0,0 +1,172 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "worker.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/event.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+typedef struct tpm2d_worker_job {
+	void (*work)(void *data);
+	void (*done)(void *data);
+	void *data;
+	struct tpm2d_worker_job *next;
+} tpm2d_worker_job_t;
+
+static pthread_mutex_t tpm2d_worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tpm2d_worker_cond = PTHREAD_COND_INITIALIZER;
+// pending jobs per priority, protected by tpm2d_worker_lock
+static tpm2d_worker_job_t *tpm2d_worker_head[TPM2D_WORKER_PRIO_COUNT] = { NULL };
+static tpm2d_worker_job_t *tpm2d_worker_tail[TPM2D_WORKER_PRIO_COUNT] = { NULL };
+
+// finished jobs are passed back to the event loop as pointers written into this pipe
+static int tpm2d_worker_done_pipe[2] = { -1, -1 };
+static bool tpm2d_worker_started = false;
+
+/**
+ * Dequeues the first job of the highest non-empty priority. Must be called with
+ * tpm2d_worker_lock held.
+ */
+static tpm2d_worker_job_t *
+tpm2d_worker_dequeue(void)
+{
+	for (int prio = 0; prio < TPM2D_WORKER_PRIO_COUNT; prio++) {
+		tpm2d_worker_job_t *job = tpm2d_worker_head[prio];
+		if (!job)
+			continue;
+		tpm2d_worker_head[prio] = job->next;
+		if (!tpm2d_worker_head[prio])
+			tpm2d_worker_tail[prio] = NULL;
+		return job;
+	}
+	return NULL;
+}
+
+static void *
+tpm2d_worker_thread(UNUSED void *arg)
+{
+	for (;;) {
+		tpm2d_worker_job_t *job;
+
+		pthread_mutex_lock(&tpm2d_worker_lock);
+		while (!(job = tpm2d_worker_dequeue()))
+			pthread_cond_wait(&tpm2d_worker_cond, &tpm2d_worker_lock);
+		pthread_mutex_unlock(&tpm2d_worker_lock);
+
+		job->work(job->data);
+
+		// pointer sized writes to a pipe are atomic
+		ssize_t ret;
+		do {
+			ret = write(tpm2d_worker_done_pipe[1], &job, sizeof(job));
+		} while (ret < 0 && errno == EINTR);
+		if (ret != sizeof(job))
+			FATAL_ERRNO("Failed to hand back finished job to the event loop");
+	}
+	return NULL;
+}
+
+static void
+tpm2d_worker_cb_done(int fd, unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+{
+	IF_FALSE_RETURN(events & EVENT_IO_READ);
+
+	tpm2d_worker_job_t *job;
+	while (read(fd, &job, sizeof(job)) == sizeof(job)) {
+		job->done(job->data);
+		mem_free0(job);
+	}
+}
+
+static int
+tpm2d_worker_start(void)
+{
+	if (pipe2(tpm2d_worker_done_pipe, O_CLOEXEC) < 0) {
+		ERROR_ERRNO("Failed to create worker pipe");
+		return -1;
+	}
+	// only the reading end in the event loop must not block
+	if (fcntl(tpm2d_worker_done_pipe[0], F_SETFL, O_NONBLOCK) < 0)
+		WARN_ERRNO("Failed to make worker pipe non-blocking");
+
+	// signals are handled by the event loop thread only
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	pthread_t thread;
+	int ret = pthread_create(&thread, NULL, tpm2d_worker_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret) {
+		ERROR("Could not start TPM worker thread");
+		close(tpm2d_worker_done_pipe[0]);
+		close(tpm2d_worker_done_pipe[1]);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	event_io_t *event =
+		event_io_new(tpm2d_worker_done_pipe[0], EVENT_IO_READ, tpm2d_worker_cb_done, NULL);
+	event_add_io(event);
+
+	DEBUG("Started TPM worker thread");
+	tpm2d_worker_started = true;
+	return 0;
+}
+
+int
+tpm2d_worker_run(tpm2d_worker_prio_t prio, void (*work)(void *data), void (*done)(void *data),
+		 void *data)
+{
+	ASSERT(work);
+	ASSERT(done);
+	ASSERT(prio < TPM2D_WORKER_PRIO_COUNT);
+
+	if (!tpm2d_worker_started && tpm2d_worker_start() < 0)
+		return -1;
+
+	tpm2d_worker_job_t *job = mem_new0(tpm2d_worker_job_t, 1);
+	job->work = work;
+	job->done = done;
+	job->data = data;
+
+	pthread_mutex_lock(&tpm2d_worker_lock);
+	if (tpm2d_worker_tail[prio])
+		tpm2d_worker_tail[prio]->next = job;
+	else
+		tpm2d_worker_head[prio] = job;
+	tpm2d_worker_tail[prio] = job;
+	pthread_cond_signal(&tpm2d_worker_cond);
+	pthread_mutex_unlock(&tpm2d_worker_lock);
+
+	return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file worker.h
+ *
+ * A dedicated thread executing all TPM commands triggered by clients, so that a slow
+ * command (e.g., a quote) no longer blocks the event loop and thereby every other client.
+ * Queued jobs are executed one after another in order of their priority, so that latency
+ * critical commands on the container start path overtake attestation requests.
+ * The TSS context must only be used by jobs on this thread once the event loop runs.
+ * Results are handed back to the event loop thread by a done callback.
+ */
+
+#ifndef TPM2D_WORKER_H
+#define TPM2D_WORKER_H
+
+typedef enum {
+	TPM2D_WORKER_PRIO_HIGH = 0, //!< commands blocking a container start, e.g., unsealing keys
+	TPM2D_WORKER_PRIO_NORMAL,   //!< all other local commands
+	TPM2D_WORKER_PRIO_LOW,	    //!< remote attestation requests
+	TPM2D_WORKER_PRIO_COUNT
+} tpm2d_worker_prio_t;
+
+/**
+ * Runs work(data) on the TPM worker thread and afterwards done(data) in the
+ * event loop thread. The worker is started on first use.
+ *
+ * @param prio priority of the job, jobs of higher priority are executed first
+ * @param work function running on the worker thread
+ * @param done function running in the event loop after work returned
+ * @param data data parameter passed to both functions
+ * @return 0 if the job was queued, -1 otherwise (neither function is called then)
+ */
+int
+tpm2d_worker_run(tpm2d_worker_prio_t prio, void (*work)(void *data), void (*done)(void *data),
+		 void *data);
+
+#endif /* TPM2D_WORKER_H */